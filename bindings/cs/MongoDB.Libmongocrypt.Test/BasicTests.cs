@@ -20,6 +20,9 @@ using System.Collections.Generic;
 using System.IO;
 using System.Linq;
 using System.Reflection;
+#if NETCOREAPP3_0
+using System.Threading.Tasks;
+#endif
 using Xunit;
 using System.Text;
 using FluentAssertions;
@@ -190,6 +193,57 @@ namespace MongoDB.Libmongocrypt.Test
             }
         }
 
+#if NETCOREAPP3_0
+        [Fact]
+        public void DecryptQueryFromSpan()
+        {
+            var bytes = BsonUtil.ToBytes(ReadJsonTestFile("encrypted-command-reply.json"));
+            // Pass a slice so that the document does not start at the beginning of the array
+            var padded = new byte[bytes.Length + 8];
+            bytes.CopyTo(padded, 4);
+
+            using (var cryptClient = CryptClientFactory.Create(CreateOptions()))
+            using (var context = cryptClient.StartDecryptionContext(new ReadOnlySpan<byte>(padded, 4, bytes.Length)))
+            {
+                var (binary, bsonCommand) = ProcessContextToCompletion(context);
+                bsonCommand.Should().Equal(ReadJsonTestFile("command-reply.json"));
+                binary.AsSpan().ToArray().Should().Equal(binary.ToArray());
+            }
+        }
+
+        [Fact]
+        public async Task DecryptQueryWithAsyncKmsRequests()
+        {
+            using (var cryptClient = CryptClientFactory.Create(CreateOptions()))
+            using (var context = cryptClient.StartDecryptionContext(BsonUtil.ToBytes(ReadJsonTestFile("encrypted-command-reply.json"))))
+            {
+                var (state, _, _) = ProcessState(context);
+                state.Should().Be(CryptContext.StateCode.MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+                context.State.Should().Be(CryptContext.StateCode.MONGOCRYPT_CTX_NEED_KMS);
+
+                var reply = Encoding.UTF8.GetBytes(ReadHttpTestFile("kms-decrypt-reply.txt"));
+                var sent = 0;
+                await context.ProcessKmsRequestsAsync(async (request, cancellationToken) =>
+                {
+                    using (var message = request.RentMessage(out var length))
+                    {
+                        Encoding.UTF8.GetString(message.Memory.Span.Slice(0, length)).Should().Contain("Host:kms.us-east-1.amazonaws.com");
+                    }
+
+                    // Feed from another thread, as a socket completion would
+                    await Task.Run(() => request.Feed(reply), cancellationToken);
+                    request.BytesNeeded.Should().Be(0);
+                    sent++;
+                });
+                sent.Should().Be(1);
+
+                var (readyState, _, document) = ProcessState(context);
+                readyState.Should().Be(CryptContext.StateCode.MONGOCRYPT_CTX_READY);
+                document.Should().Equal(ReadJsonTestFile("command-reply.json"));
+            }
+        }
+
+#endif
         [Fact]
         public void DecryptQueryStepwise()
         {
@@ -72,6 +72,28 @@ namespace MongoDB.Libmongocrypt
             return arr;
         }
 
+#if NETSTANDARD2_1
+        /// <summary>
+        /// Gets a view of Data without copying it. The span is only valid until this binary, or the context that owns the data,
+        /// is disposed.
+        /// </summary>
+        public unsafe ReadOnlySpan<byte> AsSpan()
+        {
+            return new ReadOnlySpan<byte>((void*)Data, (int)Length);
+        }
+
+        /// <summary>
+        /// Copies Data into a caller supplied buffer, such as one rented from an ArrayPool.
+        /// </summary>
+        /// <returns>The number of bytes written.</returns>
+        public int CopyTo(Span<byte> destination)
+        {
+            ReadOnlySpan<byte> data = AsSpan();
+            data.CopyTo(destination);
+            return data.Length;
+        }
+
+#endif
         /// <summary>
         /// Write bytes into Data.
         /// </summary>
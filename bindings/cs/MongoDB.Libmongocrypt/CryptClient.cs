@@ -217,6 +217,90 @@ namespace MongoDB.Libmongocrypt
             return new CryptContext(handle);
         }
 
+#if NETSTANDARD2_1
+        /// <summary>
+        /// Starts the encryption context, without copying the command.
+        /// </summary>
+        /// <param name="db">The database of the collection.</param>
+        /// <param name="command">The command.</param>
+        /// <returns>A encryption context.</returns>
+        public CryptContext StartEncryptionContext(string db, ReadOnlySpan<byte> command)
+        {
+            ContextSafeHandle handle = Library.mongocrypt_ctx_new(_handle);
+
+            IntPtr stringPointer = (IntPtr)Marshal.StringToHGlobalAnsi(db);
+
+            try
+            {
+                unsafe
+                {
+                    fixed (byte* c = command)
+                    {
+                        var commandPtr = (IntPtr)c;
+                        using (var pinnedCommand = new PinnedBinary(commandPtr, (uint)command.Length))
+                        {
+                            // Let mongocrypt run strlen
+                            handle.Check(_status, Library.mongocrypt_ctx_encrypt_init(handle, stringPointer, -1, pinnedCommand.Handle));
+                        }
+                    }
+                }
+            }
+            finally
+            {
+                Marshal.FreeHGlobal(stringPointer);
+            }
+
+            return new CryptContext(handle);
+        }
+
+        /// <summary>
+        /// Starts the decryption context, without copying the document.
+        /// </summary>
+        /// <param name="buffer">The bson document to decrypt.</param>
+        /// <returns>A decryption context</returns>
+        public CryptContext StartDecryptionContext(ReadOnlySpan<byte> buffer)
+        {
+            ContextSafeHandle handle = Library.mongocrypt_ctx_new(_handle);
+
+            unsafe
+            {
+                fixed (byte* p = buffer)
+                {
+                    IntPtr ptr = (IntPtr)p;
+                    using (PinnedBinary pinned = new PinnedBinary(ptr, (uint)buffer.Length))
+                    {
+                        handle.Check(_status, Library.mongocrypt_ctx_decrypt_init(handle, pinned.Handle));
+                    }
+                }
+            }
+
+            return new CryptContext(handle);
+        }
+
+        /// <summary>
+        /// Starts an explicit decryption context, without copying the value.
+        /// </summary>
+        /// <param name="buffer">The buffer.</param>
+        /// <returns>A encryption context</returns>
+        public CryptContext StartExplicitDecryptionContext(ReadOnlySpan<byte> buffer)
+        {
+            ContextSafeHandle handle = Library.mongocrypt_ctx_new(_handle);
+
+            unsafe
+            {
+                fixed (byte* p = buffer)
+                {
+                    IntPtr ptr = (IntPtr)p;
+                    using (PinnedBinary pinned = new PinnedBinary(ptr, (uint)buffer.Length))
+                    {
+                        handle.Check(_status, Library.mongocrypt_ctx_explicit_decrypt_init(handle, pinned.Handle));
+                    }
+                }
+            }
+
+            return new CryptContext(handle);
+        }
+#endif
 
         void IStatus.Check(Status status)
         {
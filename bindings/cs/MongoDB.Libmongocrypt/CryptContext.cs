@@ -17,6 +17,10 @@
 using System;
 using System.Collections.Generic;
 using System.Runtime.InteropServices;
+#if NETSTANDARD2_1
+using System.Threading;
+using System.Threading.Tasks;
+#endif
 
 namespace MongoDB.Libmongocrypt
 {
@@ -132,6 +136,27 @@ namespace MongoDB.Libmongocrypt
             }
         }
 
+#if NETSTANDARD2_1
+        /// <summary>
+        /// Feeds the result from running a remote operation back to the libmongocrypt, without copying it.
+        /// </summary>
+        /// <param name="buffer">The buffer.</param>
+        public void Feed(ReadOnlySpan<byte> buffer)
+        {
+            unsafe
+            {
+                fixed (byte* p = buffer)
+                {
+                    IntPtr ptr = (IntPtr)p;
+                    using (PinnedBinary pinned = new PinnedBinary(ptr, (uint)buffer.Length))
+                    {
+                        Check(Library.mongocrypt_ctx_mongo_feed(_handle, pinned.Handle));
+                    }
+                }
+            }
+        }
+#endif
+
         /// <summary>
         /// Signal the feeding is done.
         /// </summary>
@@ -166,6 +191,37 @@ namespace MongoDB.Libmongocrypt
             return new KmsRequestCollection(requests, this);
         }
 
+#if NETSTANDARD2_1
+        /// <summary>
+        /// Starts all outstanding KMS requests at once, waits for all of them, and marks them done.
+        /// </summary>
+        /// <param name="sendRequestAsync">Sends one request and feeds it the response until BytesNeeded is 0. It is called for
+        /// every request before any is awaited, so the requests are fed concurrently, possibly on different threads.</param>
+        /// <param name="cancellationToken">The cancellation token passed to <paramref name="sendRequestAsync"/>.</param>
+        public async ValueTask ProcessKmsRequestsAsync(
+            Func<KmsRequest, CancellationToken, ValueTask> sendRequestAsync,
+            CancellationToken cancellationToken = default)
+        {
+            var requests = GetKmsMessageRequests();
+            var pending = new List<Task>();
+            foreach (var request in requests)
+            {
+                var sent = sendRequestAsync(request, cancellationToken);
+                if (!sent.IsCompletedSuccessfully)
+                {
+                    pending.Add(sent.AsTask());
+                }
+            }
+
+            if (pending.Count > 0)
+            {
+                await Task.WhenAll(pending).ConfigureAwait(false);
+            }
+
+            requests.MarkDone();
+        }
+#endif
+
         void IStatus.Check(Status status)
         {
             Library.mongocrypt_ctx_status(_handle, status.Handle);
@@ -15,12 +15,18 @@
  */
 
 using System;
+#if NETSTANDARD2_1
+using System.Buffers;
+#endif
 using System.Runtime.InteropServices;
 
 namespace MongoDB.Libmongocrypt
 {
     /// <summary>
     /// Contains a KMS request to make to a remote server.
+    ///
+    /// The requests of a context are independent, so different requests may be fed from different threads at the same time.
+    /// A single request must not be used from more than one thread at a time.
     /// </summary>
     /// <seealso cref="IStatus" />
     public class KmsRequest : IStatus
@@ -95,6 +101,45 @@ namespace MongoDB.Libmongocrypt
                 }
         }
 
+#if NETSTANDARD2_1
+        /// <summary>
+        /// Feeds the response back to the libmongocrypt, without copying it.
+        /// </summary>
+        /// <param name="buffer">The response.</param>
+        public void Feed(ReadOnlySpan<byte> buffer)
+        {
+            unsafe
+            {
+                fixed (byte* p = buffer)
+                {
+                    IntPtr ptr = (IntPtr)p;
+                    using (PinnedBinary pinned = new PinnedBinary(ptr, (uint)buffer.Length))
+                    {
+                        Check(Library.mongocrypt_kms_ctx_feed(_id, pinned.Handle));
+                    }
+                }
+            }
+        }
+#endif
+
+#if NETSTANDARD2_1
+        /// <summary>
+        /// Copies the message to send to KMS into a buffer rented from <see cref="MemoryPool{T}.Shared"/>. Unlike a span
+        /// over <see cref="Message"/>, the buffer may be held across awaits while it is written to a socket.
+        /// </summary>
+        /// <param name="length">The length of the message, which may be shorter than the rented buffer.</param>
+        /// <returns>The rented buffer. Dispose it to return it to the pool.</returns>
+        public IMemoryOwner<byte> RentMessage(out int length)
+        {
+            using (Binary binary = Message)
+            {
+                IMemoryOwner<byte> owner = MemoryPool<byte>.Shared.Rent((int)binary.Length);
+                length = binary.CopyTo(owner.Memory.Span);
+                return owner;
+            }
+        }
+
+#endif
         void IStatus.Check(Status status)
         {
             Library.mongocrypt_kms_ctx_status(_id, status.Handle);
@@ -19,17 +19,30 @@ package com.mongodb.crypt.capi;
 
 import com.mongodb.crypt.capi.CAPI.mongocrypt_binary_t;
 
+import java.nio.ByteBuffer;
+
 import static com.mongodb.crypt.capi.CAPI.mongocrypt_binary_destroy;
 
 // Wrap JNA memory and a mongocrypt_binary_t that references that memory, in order to ensure that the JNA Memory is not GC'd before the
-// mongocrypt_binary_t is destroyed
+// mongocrypt_binary_t is destroyed. The memory is either a block from DisposableMemoryPool, or a direct ByteBuffer owned by the caller.
 class BinaryHolder implements AutoCloseable {
 
     private final DisposableMemory memory;
+    private final int length;
+    private final ByteBuffer directBuffer;
     private final mongocrypt_binary_t binary;
 
-    BinaryHolder(final DisposableMemory memory, final mongocrypt_binary_t binary) {
+    BinaryHolder(final DisposableMemory memory, final int length, final mongocrypt_binary_t binary) {
         this.memory = memory;
+        this.length = length;
+        this.directBuffer = null;
+        this.binary = binary;
+    }
+
+    BinaryHolder(final ByteBuffer directBuffer, final mongocrypt_binary_t binary) {
+        this.memory = null;
+        this.length = 0;
+        this.directBuffer = directBuffer;
         this.binary = binary;
     }
 
@@ -40,6 +53,8 @@ class BinaryHolder implements AutoCloseable {
     @Override
     public void close() {
         mongocrypt_binary_destroy(binary);
-        memory.dispose();
+        if (memory != null) {
+            DisposableMemoryPool.release(memory, length);
+        }
     }
 }
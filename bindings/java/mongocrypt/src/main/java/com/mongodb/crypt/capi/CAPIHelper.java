@@ -18,6 +18,7 @@
 package com.mongodb.crypt.capi;
 
 import com.mongodb.crypt.capi.CAPI.mongocrypt_binary_t;
+import com.sun.jna.Native;
 import com.sun.jna.Pointer;
 import org.bson.BsonBinaryWriter;
 import org.bson.BsonDocument;
@@ -42,14 +43,18 @@ final class CAPIHelper {
 
     @SuppressWarnings("unchecked")
     static BinaryHolder toBinary(final BsonDocument document) {
+        if (document instanceof RawBsonDocument) {
+            // Already encoded: copy the bytes straight to native memory rather than re-encoding
+            return toBinary(((RawBsonDocument) document).getByteBuffer().asNIO());
+        }
         BasicOutputBuffer buffer = new BasicOutputBuffer();
         BsonBinaryWriter writer = new BsonBinaryWriter(buffer);
         ((Codec<BsonDocument>) CODEC_REGISTRY.get(document.getClass())).encode(writer, document, EncoderContext.builder().build());
 
-        DisposableMemory memory = new DisposableMemory(buffer.size());
-        memory.write(0, buffer.getInternalBuffer(), 0, buffer.size());
+        DisposableMemory memory = DisposableMemoryPool.acquire(buffer.getSize());
+        memory.write(0, buffer.getInternalBuffer(), 0, buffer.getSize());
 
-        return new BinaryHolder(memory, mongocrypt_binary_new_from_data(memory, buffer.getSize()));
+        return new BinaryHolder(memory, buffer.getSize(), mongocrypt_binary_new_from_data(memory, buffer.getSize()));
     }
 
     static RawBsonDocument toDocument(final mongocrypt_binary_t binary) {
@@ -59,14 +64,29 @@ final class CAPIHelper {
         return new RawBsonDocument(bytes);
     }
 
+    /**
+     * Wraps the remaining bytes of the buffer in a mongocrypt_binary_t. A direct buffer is referenced in place, without copying, so
+     * the caller must not modify it until the returned holder is closed. Any other buffer is copied to native memory.
+     */
     static BinaryHolder toBinary(final ByteBuffer buffer) {
-        byte[] message = new byte[buffer.remaining()];
-        buffer.get(message, 0, buffer.remaining());
+        int length = buffer.remaining();
+        if (buffer.isDirect()) {
+            Pointer pointer = Native.getDirectBufferPointer(buffer).share(buffer.position());
+            buffer.position(buffer.limit());
+            return new BinaryHolder(buffer, mongocrypt_binary_new_from_data(pointer, length));
+        }
 
-        DisposableMemory memory = new DisposableMemory(message.length);
-        memory.write(0, message, 0, message.length);
+        DisposableMemory memory = DisposableMemoryPool.acquire(length);
+        if (buffer.hasArray()) {
+            memory.write(0, buffer.array(), buffer.arrayOffset() + buffer.position(), length);
+            buffer.position(buffer.limit());
+        } else {
+            byte[] message = new byte[length];
+            buffer.get(message, 0, length);
+            memory.write(0, message, 0, length);
+        }
 
-        return new BinaryHolder(memory, mongocrypt_binary_new_from_data(memory, message.length));
+        return new BinaryHolder(memory, length, mongocrypt_binary_new_from_data(memory, length));
     }
 
     static ByteBuffer toByteBuffer(final mongocrypt_binary_t binary) {
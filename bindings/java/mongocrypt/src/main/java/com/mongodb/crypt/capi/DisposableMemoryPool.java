@@ -0,0 +1,89 @@
+/*
+ * Copyright 2008-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+package com.mongodb.crypt.capi;
+
+import java.util.concurrent.ConcurrentLinkedQueue;
+import java.util.concurrent.atomic.AtomicIntegerArray;
+
+// A pool of DisposableMemory blocks, so that passing documents to libmongocrypt does not allocate and free native memory every time.
+// Blocks are sized in powers of two. Only blocks up to MAX_POOLED_SIZE are kept, and at most MAX_BLOCKS_PER_SIZE of each size.
+final class DisposableMemoryPool {
+    private static final int MIN_SIZE_SHIFT = 10;
+    private static final int MAX_SIZE_SHIFT = 24;
+    private static final int MAX_POOLED_SIZE = 1 << MAX_SIZE_SHIFT;
+    private static final int MAX_BLOCKS_PER_SIZE = 8;
+
+    private static final ConcurrentLinkedQueue<DisposableMemory>[] POOLS = createPools();
+    private static final AtomicIntegerArray POOL_SIZES = new AtomicIntegerArray(MAX_SIZE_SHIFT - MIN_SIZE_SHIFT + 1);
+
+    /**
+     * Returns a block of at least size bytes. Give it back with {@link #release(DisposableMemory, int)}.
+     */
+    static DisposableMemory acquire(final int size) {
+        if (size > MAX_POOLED_SIZE) {
+            return new DisposableMemory(Math.max(size, 1));
+        }
+        int index = indexOf(size);
+        DisposableMemory memory = POOLS[index].poll();
+        if (memory != null) {
+            POOL_SIZES.decrementAndGet(index);
+            return memory;
+        }
+        return new DisposableMemory(1 << (index + MIN_SIZE_SHIFT));
+    }
+
+    /**
+     * Returns a block to the pool, or disposes of it if the pool is full or the block was not sized by the pool. The first used bytes
+     * are zeroed, since they may hold a plaintext document.
+     */
+    static void release(final DisposableMemory memory, final int used) {
+        long size = memory.size();
+        if (size > MAX_POOLED_SIZE || Long.bitCount(size) != 1 || size < (1 << MIN_SIZE_SHIFT)) {
+            memory.dispose();
+            return;
+        }
+        int index = indexOf((int) size);
+        if (POOL_SIZES.incrementAndGet(index) > MAX_BLOCKS_PER_SIZE) {
+            POOL_SIZES.decrementAndGet(index);
+            memory.dispose();
+            return;
+        }
+        memory.clear(used);
+        POOLS[index].offer(memory);
+    }
+
+    private static int indexOf(final int size) {
+        if (size <= (1 << MIN_SIZE_SHIFT)) {
+            return 0;
+        }
+        int shift = 32 - Integer.numberOfLeadingZeros(size - 1);
+        return shift - MIN_SIZE_SHIFT;
+    }
+
+    @SuppressWarnings("unchecked")
+    private static ConcurrentLinkedQueue<DisposableMemory>[] createPools() {
+        ConcurrentLinkedQueue<DisposableMemory>[] pools = new ConcurrentLinkedQueue[MAX_SIZE_SHIFT - MIN_SIZE_SHIFT + 1];
+        for (int i = 0; i < pools.length; i++) {
+            pools[i] = new ConcurrentLinkedQueue<DisposableMemory>();
+        }
+        return pools;
+    }
+
+    private DisposableMemoryPool() {
+    }
+}
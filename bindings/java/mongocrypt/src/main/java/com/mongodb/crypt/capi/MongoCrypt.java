@@ -21,6 +21,7 @@ package com.mongodb.crypt.capi;
 import org.bson.BsonDocument;
 
 import java.io.Closeable;
+import java.nio.ByteBuffer;
 
 /**
  * A context for encryption/decryption operations.
@@ -44,6 +45,14 @@ public interface MongoCrypt extends Closeable {
      */
     MongoCryptContext createDecryptionContext(BsonDocument document);
 
+    /**
+     * Create a context to use for decryption. A direct buffer is passed to libmongocrypt without copying.
+     *
+     * @param document a buffer whose remaining bytes are the BSON document to decrypt
+     * @return the context
+     */
+    MongoCryptContext createDecryptionContext(ByteBuffer document);
+
     /**
      * Create a context to use for creating a data key
      * @param kmsProvider the KMS provider
@@ -21,9 +21,16 @@ import org.bson.BsonDocument;
 import org.bson.RawBsonDocument;
 
 import java.io.Closeable;
+import java.nio.ByteBuffer;
+import java.util.List;
 
 /**
  * An interface representing the lifecycle of an encryption or decryption request.  It's modelled as a state machine.
+ *
+ * <p>
+ * A context is not thread safe: calls to it must not be concurrent, though they may come from different threads.  The key decryptors
+ * it returns are the exception, see {@link MongoKeyDecryptor}.
+ * </p>
  */
 public interface MongoCryptContext extends Closeable {
 
@@ -107,8 +114,24 @@ public interface MongoCryptContext extends Closeable {
      */
     MongoKeyDecryptor nextKeyDecryptor();
 
+    /**
+     * Gets all the remaining key decryptors at once, so that they can be serviced concurrently.
+     *
+     * <p>
+     * This is equivalent to calling {@link #nextKeyDecryptor()} until it returns null.
+     * </p>
+     *
+     * @return the key decryptors, which may be empty
+     */
+    List<MongoKeyDecryptor> getKeyDecryptors();
+
     /**
      * Indicate that all key decryptors have been completed
+     *
+     * <p>
+     * If the decryptors were fed from other threads, the feeding must happen-before this call, for example by joining the futures or
+     * threads that fed them.
+     * </p>
      */
     void completeKeyDecryptors();
 
@@ -118,6 +141,13 @@ public interface MongoCryptContext extends Closeable {
      */
     RawBsonDocument finish();
 
+    /**
+     * Finish the operation without copying the result out of native memory.
+     *
+     * @return a read-only direct buffer holding the encrypted or decrypted document, which is only valid until this context is closed
+     */
+    ByteBuffer finishAsByteBuffer();
+
     @Override
     void close();
 }
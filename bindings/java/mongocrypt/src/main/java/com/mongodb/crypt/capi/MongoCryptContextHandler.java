@@ -0,0 +1,57 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+package com.mongodb.crypt.capi;
+
+import com.mongodb.crypt.capi.MongoCryptContext.State;
+import org.bson.BsonDocument;
+import org.bson.RawBsonDocument;
+
+import java.util.List;
+import java.util.concurrent.CompletableFuture;
+
+/**
+ * The I/O that {@link MongoCryptContexts#runAsync(MongoCryptContext, MongoCryptContextHandler)} needs to drive a context.
+ *
+ * <p>
+ * The returned futures may be completed on any thread.
+ * </p>
+ */
+public interface MongoCryptContextHandler {
+
+    /**
+     * Runs an operation against the cluster, mongocryptd or the key vault.
+     *
+     * @param state the state of the context, which tells where to send the operation
+     * @param operation the operation
+     * @return a future for the resulting documents
+     */
+    CompletableFuture<List<BsonDocument>> executeMongoOperation(State state, RawBsonDocument operation);
+
+    /**
+     * Sends the message of the key decryptor to its key management service, and feeds it the response.
+     *
+     * <p>
+     * This is called for every key decryptor of the context before any of the returned futures must complete, so the decryptors may be
+     * serviced concurrently.
+     * </p>
+     *
+     * @param keyDecryptor the key decryptor
+     * @return a future that completes once {@link MongoKeyDecryptor#bytesNeeded()} is 0
+     */
+    CompletableFuture<Void> decryptKey(MongoKeyDecryptor keyDecryptor);
+}
@@ -23,6 +23,10 @@ import com.mongodb.crypt.capi.CAPI.mongocrypt_kms_ctx_t;
 import org.bson.BsonDocument;
 import org.bson.RawBsonDocument;
 
+import java.nio.ByteBuffer;
+import java.util.ArrayList;
+import java.util.List;
+
 import static com.mongodb.crypt.capi.CAPI.mongocrypt_binary_destroy;
 import static com.mongodb.crypt.capi.CAPI.mongocrypt_binary_new;
 import static com.mongodb.crypt.capi.CAPI.mongocrypt_ctx_destroy;
@@ -38,6 +42,7 @@ import static com.mongodb.crypt.capi.CAPI.mongocrypt_status_destroy;
 import static com.mongodb.crypt.capi.CAPI.mongocrypt_status_new;
 import static com.mongodb.crypt.capi.CAPI.mongocrypt_status_t;
 import static com.mongodb.crypt.capi.CAPIHelper.toBinary;
+import static com.mongodb.crypt.capi.CAPIHelper.toByteBuffer;
 import static com.mongodb.crypt.capi.CAPIHelper.toDocument;
 import static org.bson.assertions.Assertions.isTrue;
 import static org.bson.assertions.Assertions.notNull;
@@ -105,6 +110,16 @@ class MongoCryptContextImpl implements MongoCryptContext {
         return new MongoKeyDecryptorImpl(kmsContext);
     }
 
+    @Override
+    public List<MongoKeyDecryptor> getKeyDecryptors() {
+        List<MongoKeyDecryptor> keyDecryptors = new ArrayList<>();
+        MongoKeyDecryptor keyDecryptor;
+        while ((keyDecryptor = nextKeyDecryptor()) != null) {
+            keyDecryptors.add(keyDecryptor);
+        }
+        return keyDecryptors;
+    }
+
     @Override
     public void completeKeyDecryptors() {
         isTrue("open", !closed);
@@ -133,6 +148,24 @@ class MongoCryptContextImpl implements MongoCryptContext {
         }
     }
 
+    @Override
+    public ByteBuffer finishAsByteBuffer() {
+        isTrue("open", !closed);
+
+        mongocrypt_binary_t binary = mongocrypt_binary_new();
+
+        try {
+            boolean success = mongocrypt_ctx_finalize(wrapped, binary);
+            if (!success) {
+                throwExceptionFromStatus();
+            }
+            // The data is owned by the context, so only the binary wrapper is destroyed here
+            return toByteBuffer(binary).asReadOnlyBuffer();
+        } finally {
+            mongocrypt_binary_destroy(binary);
+        }
+    }
+
     @Override
     public void close() {
         mongocrypt_ctx_destroy(wrapped);
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+package com.mongodb.crypt.capi;
+
+import com.mongodb.crypt.capi.MongoCryptContext.State;
+import org.bson.BsonDocument;
+import org.bson.RawBsonDocument;
+
+import java.util.List;
+import java.util.concurrent.CompletableFuture;
+import java.util.concurrent.CompletionException;
+
+import static org.bson.assertions.Assertions.notNull;
+
+/**
+ * Helpers to drive a {@code MongoCryptContext} to completion.
+ */
+public final class MongoCryptContexts {
+
+    /**
+     * Runs the context until it is ready, and finishes it.
+     *
+     * <p>
+     * Each step waits for the futures of the one before, so the context is never used concurrently.  All key decryptors of a step are
+     * handed to the handler at once.  The context is not closed, whether the run succeeds or fails.
+     * </p>
+     *
+     * @param context the context
+     * @param handler the handler to do the I/O
+     * @return a future for the encrypted or decrypted document
+     */
+    public static CompletableFuture<RawBsonDocument> runAsync(final MongoCryptContext context, final MongoCryptContextHandler handler) {
+        notNull("context", context);
+        notNull("handler", handler);
+        CompletableFuture<RawBsonDocument> result = new CompletableFuture<>();
+        step(context, handler, result);
+        return result;
+    }
+
+    private static void step(final MongoCryptContext context, final MongoCryptContextHandler handler,
+                             final CompletableFuture<RawBsonDocument> result) {
+        CompletableFuture<Void> next;
+        try {
+            State state = context.getState();
+            switch (state) {
+                case NEED_MONGO_COLLINFO:
+                case NEED_MONGO_MARKINGS:
+                case NEED_MONGO_KEYS:
+                    next = handler.executeMongoOperation(state, context.getMongoOperation()).thenAccept(documents -> {
+                        for (BsonDocument document : documents) {
+                            context.addMongoOperationResult(document);
+                        }
+                        context.completeMongoOperation();
+                    });
+                    break;
+                case NEED_KMS:
+                    List<MongoKeyDecryptor> keyDecryptors = context.getKeyDecryptors();
+                    CompletableFuture<?>[] futures = new CompletableFuture<?>[keyDecryptors.size()];
+                    for (int i = 0; i < futures.length; i++) {
+                        futures[i] = handler.decryptKey(keyDecryptors.get(i));
+                    }
+                    next = CompletableFuture.allOf(futures).thenRun(context::completeKeyDecryptors);
+                    break;
+                case READY:
+                    result.complete(context.finish());
+                    return;
+                default:
+                    throw new MongoCryptException("Unexpected context state " + state);
+            }
+        } catch (RuntimeException e) {
+            result.completeExceptionally(e);
+            return;
+        }
+
+        next.whenComplete((ignored, t) -> {
+            if (t == null) {
+                step(context, handler, result);
+            } else {
+                result.completeExceptionally(t instanceof CompletionException && t.getCause() != null ? t.getCause() : t);
+            }
+        });
+    }
+
+    private MongoCryptContexts() {
+    }
+}
@@ -204,15 +204,28 @@ class MongoCryptImpl implements MongoCrypt {
     @Override
     public MongoCryptContext createDecryptionContext(final BsonDocument document) {
         isTrue("open", !closed.get());
+        try (BinaryHolder documentBinaryHolder = toBinary(document)){
+            return createDecryptionContext(documentBinaryHolder);
+        }
+    }
+
+    @Override
+    public MongoCryptContext createDecryptionContext(final ByteBuffer document) {
+        isTrue("open", !closed.get());
+        notNull("document", document);
+        try (BinaryHolder documentBinaryHolder = toBinary(document)){
+            return createDecryptionContext(documentBinaryHolder);
+        }
+    }
+
+    private MongoCryptContext createDecryptionContext(final BinaryHolder documentBinaryHolder) {
         mongocrypt_ctx_t context = mongocrypt_ctx_new(wrapped);
         if (context == null) {
             throwExceptionFromStatus();
         }
-        try (BinaryHolder documentBinaryHolder = toBinary(document)){
-            boolean success = mongocrypt_ctx_decrypt_init(context, documentBinaryHolder.getBinary());
-            if (!success) {
-                MongoCryptContextImpl.throwExceptionFromStatus(context);
-            }
+        boolean success = mongocrypt_ctx_decrypt_init(context, documentBinaryHolder.getBinary());
+        if (!success) {
+            MongoCryptContextImpl.throwExceptionFromStatus(context);
         }
         return new MongoCryptContextImpl(context);
     }
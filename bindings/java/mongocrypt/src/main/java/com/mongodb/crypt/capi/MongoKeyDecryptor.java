@@ -21,6 +21,12 @@ import java.nio.ByteBuffer;
 
 /**
  * An interface representing a key decryption operation using a key management service.
+ *
+ * <p>
+ * The key decryptors of a context are independent of each other and of the context, so different decryptors may be fed from different
+ * threads at the same time.  A single decryptor must not be used from more than one thread at a time.  All of them must be done before
+ * calling {@link MongoCryptContext#completeKeyDecryptors()}.
+ * </p>
  */
 public interface MongoKeyDecryptor {
 
@@ -39,11 +39,18 @@ import java.nio.ByteBuffer;
 import java.nio.charset.Charset;
 import java.util.Arrays;
 import java.util.Base64;
+import java.util.Collections;
 import java.util.List;
+import java.util.concurrent.CompletableFuture;
+import java.util.concurrent.CopyOnWriteArrayList;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
 
 import static org.junit.Assert.assertEquals;
 import static org.junit.Assert.assertNotNull;
 import static org.junit.Assert.assertNull;
+import static org.junit.Assert.assertTrue;
 
 @SuppressWarnings("SameParameterValue")
 public class MongoCryptTest {
@@ -106,6 +113,74 @@ public class MongoCryptTest {
         mongoCrypt.close();
     }
 
+    @Test
+    public void testDecryptDirectByteBuffer() throws IOException, URISyntaxException {
+        MongoCrypt mongoCrypt = createMongoCrypt();
+        assertNotNull(mongoCrypt);
+
+        ByteBuffer encrypted = new RawBsonDocument(getResourceAsDocument("encrypted-command-reply.json"),
+                new BsonDocumentCodec()).getByteBuffer().asNIO();
+        ByteBuffer document = ByteBuffer.allocateDirect(encrypted.remaining());
+        document.put(encrypted);
+        document.flip();
+
+        MongoCryptContext decryptor = mongoCrypt.createDecryptionContext(document);
+
+        assertEquals(State.NEED_MONGO_KEYS, decryptor.getState());
+
+        testKeyDecryptor(decryptor);
+
+        assertEquals(State.READY, decryptor.getState());
+
+        ByteBuffer decryptedBuffer = decryptor.finishAsByteBuffer();
+        assertEquals(State.DONE, decryptor.getState());
+        assertTrue(decryptedBuffer.isDirect());
+        byte[] decryptedBytes = new byte[decryptedBuffer.remaining()];
+        decryptedBuffer.get(decryptedBytes);
+        assertEquals(getResourceAsDocument("command-reply.json"), new RawBsonDocument(decryptedBytes));
+
+        decryptor.close();
+
+        mongoCrypt.close();
+    }
+
+    @Test
+    public void testDecryptAsync() throws IOException, URISyntaxException, ExecutionException, InterruptedException {
+        MongoCrypt mongoCrypt = createMongoCrypt();
+        assertNotNull(mongoCrypt);
+
+        MongoCryptContext decryptor = mongoCrypt.createDecryptionContext(getResourceAsDocument("encrypted-command-reply.json"));
+        BsonDocument keyDocument = getResourceAsDocument("key-document.json");
+        ByteBuffer kmsReply = getHttpResourceAsByteBuffer("kms-reply.txt");
+        List<String> hostNames = new CopyOnWriteArrayList<>();
+        ExecutorService executor = Executors.newSingleThreadExecutor();
+
+        try {
+            RawBsonDocument decryptedDocument = MongoCryptContexts.runAsync(decryptor, new MongoCryptContextHandler() {
+                @Override
+                public CompletableFuture<List<BsonDocument>> executeMongoOperation(final State state, final RawBsonDocument operation) {
+                    return CompletableFuture.supplyAsync(() -> Collections.singletonList(keyDocument), executor);
+                }
+
+                @Override
+                public CompletableFuture<Void> decryptKey(final MongoKeyDecryptor keyDecryptor) {
+                    hostNames.add(keyDecryptor.getHostName());
+                    return CompletableFuture.runAsync(() -> keyDecryptor.feed(kmsReply.duplicate()), executor);
+                }
+            }).get();
+
+            assertEquals(Collections.singletonList("kms.us-east-1.amazonaws.com"), hostNames);
+            assertEquals(State.DONE, decryptor.getState());
+            assertEquals(getResourceAsDocument("command-reply.json"), decryptedDocument);
+        } finally {
+            executor.shutdown();
+        }
+
+        decryptor.close();
+
+        mongoCrypt.close();
+    }
+
     @Test
     public void testMultipleCloseCalls() {
         MongoCrypt mongoCrypt = createMongoCrypt();
@@ -216,7 +291,9 @@ public class MongoCryptTest {
         context.completeMongoOperation();
         assertEquals(State.NEED_KMS, context.getState());
 
-        MongoKeyDecryptor keyDecryptor = context.nextKeyDecryptor();
+        List<MongoKeyDecryptor> keyDecryptors = context.getKeyDecryptors();
+        assertEquals(1, keyDecryptors.size());
+        MongoKeyDecryptor keyDecryptor = keyDecryptors.get(0);
         assertEquals("kms.us-east-1.amazonaws.com", keyDecryptor.getHostName());
 
         ByteBuffer keyDecryptorMessage = keyDecryptor.getMessage();
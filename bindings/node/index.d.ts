@@ -137,6 +137,19 @@ export interface ClientEncryptionOptions {
    * Options for specific KMS providers to use
    */
   kmsProviders?: KMSProviders;
+
+  /**
+   * If libmongocrypt was built with native crypto, use it instead of the
+   * Node.js crypto callbacks. Defaults to false.
+   */
+  preferNativeCrypto?: boolean;
+
+  /**
+   * Share one native encryption engine, and its key cache, with every instance
+   * created with the same id in this process, including in worker threads.
+   * They must be created with the same options.
+   */
+  sharedCryptId?: string;
 }
 
 /**
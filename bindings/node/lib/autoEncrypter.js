@@ -20,6 +20,8 @@ module.exports = function(modules) {
    * @property {object} [schemaMap] A map of namespaces to a local JSON schema for encryption
    * @property {boolean} [bypassAutoEncryption] Allows the user to bypass auto encryption, maintaining implicit decryption
    * @property {AutoEncrypter~logger} [options.logger] An optional hook to catch logging messages from the underlying encryption engine
+   * @property {boolean} [preferNativeCrypto=false] If libmongocrypt was built with native crypto, use it instead of the Node.js crypto callbacks. Decryption then runs on the libuv threadpool, unless a logger is set
+   * @property {string} [sharedCryptId] Share one native encryption engine, and its key cache, with every encrypter created with the same id in this process, including in worker threads. They must be created with the same `kmsProviders`, `schemaMap`, `preferNativeCrypto` and whether a `logger` is set
    * @property {AutoEncrypter~AutoEncryptionExtraOptions} [extraOptions] Extra options related to the mongocryptd process
    */
 
@@ -121,6 +123,14 @@ module.exports = function(modules) {
         mongoCryptOptions.logger = options.logger;
       }
 
+      if (typeof options.preferNativeCrypto === 'boolean') {
+        mongoCryptOptions.preferNativeCrypto = options.preferNativeCrypto;
+      }
+
+      if (typeof options.sharedCryptId === 'string') {
+        mongoCryptOptions.sharedCryptId = options.sharedCryptId;
+      }
+
       Object.assign(mongoCryptOptions, { cryptoCallbacks });
       this._mongocrypt = new mc.MongoCrypt(mongoCryptOptions);
       this._contextCounter = 0;
@@ -227,19 +237,18 @@ module.exports = function(modules) {
       const bson = this._bson;
       const buffer = Buffer.isBuffer(response) ? response : bson.serialize(response, options);
 
-      let context;
-      try {
-        context = this._mongocrypt.makeDecryptionContext(buffer);
-      } catch (err) {
-        callback(err, null);
-        return;
-      }
+      this._mongocrypt.makeDecryptionContextAsync(buffer, (err, context) => {
+        if (err) {
+          callback(err, null);
+          return;
+        }
 
-      // TODO: should this be an accessor from the addon?
-      context.id = this._contextCounter++;
+        // TODO: should this be an accessor from the addon?
+        context.id = this._contextCounter++;
 
-      const stateMachine = new StateMachine(Object.assign({ bson }, options));
-      stateMachine.execute(this, context, callback);
+        const stateMachine = new StateMachine(Object.assign({ bson }, options));
+        stateMachine.execute(this, context, callback);
+      });
     }
   }
 
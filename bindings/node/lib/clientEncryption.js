@@ -40,6 +40,8 @@ module.exports = function(modules) {
      * @param {string} options.keyVaultNamespace The namespace of the key vault, used to store encryption keys
      * @param {MongoClient} [options.keyVaultClient] A `MongoClient` used to fetch keys from a key vault. Defaults to `client`
      * @param {KMSProviders} [options.kmsProviders] options for specific KMS providers to use
+     * @param {boolean} [options.preferNativeCrypto=false] If libmongocrypt was built with native crypto, use it instead of the Node.js crypto callbacks
+     * @param {string} [options.sharedCryptId] Share one native encryption engine, and its key cache, with every instance created with the same id in this process, including in worker threads. They must be created with the same options
      *
      * @example
      * new ClientEncryption(mongoClient, {
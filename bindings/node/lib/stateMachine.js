@@ -185,16 +185,18 @@ module.exports = function(modules) {
 
         // terminal states
         case MONGOCRYPT_CTX_READY: {
-          const finalizedContext = context.finalize();
-          // TODO: Maybe rework the logic here so that instead of doing
-          // the callback here, finalize stores the result, and then
-          // we wait to MONGOCRYPT_CTX_DONE to do the callback
-          if (context.state === MONGOCRYPT_CTX_ERROR) {
-            const message = context.status.message || 'Finalization error';
-            callback(new MongoCryptError(message));
-            return;
-          }
-          callback(null, bson.deserialize(finalizedContext, this.options));
+          // Runs on the libuv threadpool when the context allows it.
+          context.finalizeAsync((err, finalizedContext) => {
+            // TODO: Maybe rework the logic here so that instead of doing
+            // the callback here, finalize stores the result, and then
+            // we wait to MONGOCRYPT_CTX_DONE to do the callback
+            if (err || context.state === MONGOCRYPT_CTX_ERROR) {
+              const message = context.status.message || 'Finalization error';
+              callback(new MongoCryptError(message));
+              return;
+            }
+            callback(null, bson.deserialize(finalizedContext, this.options));
+          });
           return;
         }
         case MONGOCRYPT_CTX_ERROR: {
@@ -50,6 +50,24 @@ v8::Local<v8::Object> BufferFromBinary(mongocrypt_binary_t* binary) {
     return scope.Escape(buffer);
 }
 
+// Wraps a binary filled by mongocrypt_ctx_finalize_steal in a Buffer without
+// copying. The Buffer takes ownership of binary, and destroys it when collected.
+v8::Local<v8::Object> BufferFromOwnedBinary(mongocrypt_binary_t* binary) {
+    Nan::EscapableHandleScope scope;
+    char* data = (char*)mongocrypt_binary_data(binary);
+    size_t len = mongocrypt_binary_len(binary);
+    if (len == 0) {
+        mongocrypt_binary_destroy(binary);
+        return scope.Escape(Nan::NewBuffer(0).ToLocalChecked());
+    }
+
+    auto destroy = [](char*, void* hint) {
+        mongocrypt_binary_destroy(static_cast<mongocrypt_binary_t*>(hint));
+    };
+    v8::Local<v8::Object> buffer = Nan::NewBuffer(data, len, destroy, binary).ToLocalChecked();
+    return scope.Escape(buffer);
+}
+
 v8::Local<v8::Object> BufferWithLengthOf(mongocrypt_binary_t* binary) {
     Nan::EscapableHandleScope scope;
     size_t len = mongocrypt_binary_len(binary);
@@ -129,6 +147,7 @@ NAN_MODULE_INIT(MongoCrypt::Init) {
     Nan::SetPrototypeMethod(tpl, "makeEncryptionContext", MakeEncryptionContext);
     Nan::SetPrototypeMethod(tpl, "makeExplicitEncryptionContext", MakeExplicitEncryptionContext);
     Nan::SetPrototypeMethod(tpl, "makeDecryptionContext", MakeDecryptionContext);
+    Nan::SetPrototypeMethod(tpl, "makeDecryptionContextAsync", MakeDecryptionContextAsync);
     Nan::SetPrototypeMethod(tpl, "makeExplicitDecryptionContext", MakeExplicitDecryptionContext);
     Nan::SetPrototypeMethod(tpl, "makeDataKeyContext", MakeDataKeyContext);
 
@@ -138,10 +157,27 @@ NAN_MODULE_INIT(MongoCrypt::Init) {
     Nan::SetAccessor(itpl, Nan::New("status").ToLocalChecked(), Status);
 
     constructor().Reset(Nan::GetFunction(tpl).ToLocalChecked());
+#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
+    // Release the constructor of a worker thread before its isolate is disposed.
+    node::AddEnvironmentCleanupHook(
+        v8::Isolate::GetCurrent(), [](void*) { constructor().Reset(); }, nullptr);
+#endif
     Nan::Set(
         target, Nan::New("MongoCrypt").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
 }
 
+// The log handler of a shared handle. Messages logged on a thread without a
+// MongoCrypt using the handle, such as a libuv threadpool thread, are dropped.
+void MongoCrypt::sharedLogHandler(mongocrypt_log_level_t level,
+                                  const char* message,
+                                  uint32_t message_len,
+                                  void* ctx) {
+    MongoCrypt* mongoCrypt = threadInstance(static_cast<SharedCrypt*>(ctx));
+    if (mongoCrypt && mongoCrypt->_logger) {
+        logHandler(level, message, message_len, mongoCrypt);
+    }
+}
+
 void MongoCrypt::logHandler(mongocrypt_log_level_t level,
                             const char* message,
                             uint32_t message_len,
@@ -163,6 +199,12 @@ void MongoCrypt::logHandler(mongocrypt_log_level_t level,
 }
 
 
+static bool NoCryptoHooksError(mongocrypt_status_t* status) {
+    const char* message = "no crypto hooks on this thread for the shared MongoCrypt";
+    mongocrypt_status_set(status, MONGOCRYPT_STATUS_ERROR_CLIENT, 1, message, -1);
+    return false;
+}
+
 static void MaybeSetCryptoHookErrorStatus(v8::Local<v8::Value> result, mongocrypt_status_t *status) {
     if (!result->IsObject()) {
         return;
@@ -185,14 +227,100 @@ static void MaybeSetCryptoHookErrorStatus(v8::Local<v8::Value> result, mongocryp
 }
 
 MongoCrypt::MongoCrypt(mongocrypt_t* mongo_crypt, Nan::Callback* logger, CryptoHooks* hooks)
-    : _mongo_crypt(mongo_crypt), _logger(logger), _cryptoHooks(hooks) {}
+    : _mongo_crypt(mongo_crypt), _logger(logger), _cryptoHooks(hooks), _canRunOffThread(false) {}
+
+// Guards the shared handles by `sharedCryptId`, kept in MongoCrypt::New.
+static std::mutex& SharedCryptsMutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+// The MongoCrypt instances of this thread that use a shared handle, by handle.
+static std::multimap<const void*, MongoCrypt*>& ThreadInstances() {
+    static thread_local std::multimap<const void*, MongoCrypt*> instances;
+    return instances;
+}
+
+MongoCrypt::~MongoCrypt() {
+    if (!_shared) {
+        return;
+    }
+
+    auto range = ThreadInstances().equal_range(_shared.get());
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == this) {
+            ThreadInstances().erase(it);
+            break;
+        }
+    }
+}
+
+MongoCrypt* MongoCrypt::threadInstance(const SharedCrypt* shared) {
+    auto it = ThreadInstances().find(shared);
+    return it == ThreadInstances().end() ? nullptr : it->second;
+}
+
+MongoCrypt::CryptoHooks* MongoCrypt::resolveHooks(void* ctx) {
+    CryptoHooks* cryptoHooks = static_cast<CryptoHooks*>(ctx);
+    if (!cryptoHooks->shared) {
+        return cryptoHooks;
+    }
+
+    MongoCrypt* mongoCrypt = threadInstance(cryptoHooks->shared);
+    return mongoCrypt ? mongoCrypt->_cryptoHooks.get() : nullptr;
+}
+
+// Sets the handlers that call into this instance, or into the instance of the
+// calling thread for a shared handle, and initializes the handle.
+bool MongoCrypt::configure(bool preferNativeCrypto) {
+    if (_logger) {
+        bool ok = _shared
+            ? mongocrypt_setopt_log_handler(crypt(), MongoCrypt::sharedLogHandler, _shared.get())
+            : mongocrypt_setopt_log_handler(crypt(), MongoCrypt::logHandler, this);
+        if (!ok) {
+            Nan::ThrowTypeError(errorStringFromStatus(crypt()));
+            return false;
+        }
+    }
+
+    if (_cryptoHooks) {
+        CryptoHooks* hooks = _shared ? &_shared->dispatch : _cryptoHooks.get();
+        if (!setupCryptoHooks(crypt(), hooks)) {
+            Nan::ThrowError("unable to configure crypto hooks");
+            return false;
+        }
+    }
+
+#ifdef MONGOCRYPT_ENABLE_CRYPTO
+    // Only the RSA signing hook is still called, when creating KMS requests. That never
+    // happens while initializing a decryption context or finalizing any context.
+    if (_cryptoHooks && preferNativeCrypto) {
+        if (!mongocrypt_setopt_crypto_hooks_policy(crypt(), MONGOCRYPT_CRYPTO_PRIMITIVE_ALL)) {
+            Nan::ThrowTypeError(errorStringFromStatus(crypt()));
+            return false;
+        }
+    }
+#endif
+
+    // initialize afer all options are set, but after `MongoCrypt` instance is created so we can
+    // optionally pass the instance to the logging function.
+    if (!mongocrypt_init(crypt())) {
+        Nan::ThrowTypeError(errorStringFromStatus(crypt()));
+        return false;
+    }
+
+    return true;
+}
 
 
 bool MongoCrypt::setupCryptoHooks(mongocrypt_t* mongoCrypt, CryptoHooks* cryptoHooks) {
     auto aes_256_cbc_encrypt =
         [](void *ctx, mongocrypt_binary_t *key, mongocrypt_binary_t *iv, mongocrypt_binary_t *in, mongocrypt_binary_t *out, uint32_t *bytes_written, mongocrypt_status_t *status) -> bool {
             Nan::HandleScope scope;
-            CryptoHooks* cryptoHooks = static_cast<CryptoHooks*>(ctx);
+            CryptoHooks* cryptoHooks = resolveHooks(ctx);
+            if (!cryptoHooks) {
+                return NoCryptoHooksError(status);
+            }
             Nan::Callback* hook = cryptoHooks->aes256CbcEncryptHook.get();
 
             v8::Local<v8::Object> keyBuffer = BufferFromBinary(key);
@@ -218,7 +346,10 @@ bool MongoCrypt::setupCryptoHooks(mongocrypt_t* mongoCrypt, CryptoHooks* cryptoH
     auto aes_256_cbc_decrypt =
         [](void *ctx, mongocrypt_binary_t *key, mongocrypt_binary_t *iv, mongocrypt_binary_t *in, mongocrypt_binary_t *out, uint32_t *bytes_written, mongocrypt_status_t *status) -> bool {
             Nan::HandleScope scope;
-            CryptoHooks* cryptoHooks = static_cast<CryptoHooks*>(ctx);
+            CryptoHooks* cryptoHooks = resolveHooks(ctx);
+            if (!cryptoHooks) {
+                return NoCryptoHooksError(status);
+            }
             Nan::Callback* hook = cryptoHooks->aes256CbcDecryptHook.get();
 
             v8::Local<v8::Object> keyBuffer = BufferFromBinary(key);
@@ -244,7 +375,10 @@ bool MongoCrypt::setupCryptoHooks(mongocrypt_t* mongoCrypt, CryptoHooks* cryptoH
     auto random =
         [](void *ctx, mongocrypt_binary_t *out, uint32_t count, mongocrypt_status_t *status) -> bool{
             Nan::HandleScope scope;
-            CryptoHooks* cryptoHooks = static_cast<CryptoHooks*>(ctx);
+            CryptoHooks* cryptoHooks = resolveHooks(ctx);
+            if (!cryptoHooks) {
+                return NoCryptoHooksError(status);
+            }
             Nan::Callback* hook = cryptoHooks->randomHook.get();
 
             v8::Local<v8::Object> outBuffer = BufferWithLengthOf(out);
@@ -264,7 +398,10 @@ bool MongoCrypt::setupCryptoHooks(mongocrypt_t* mongoCrypt, CryptoHooks* cryptoH
     auto hmac_sha_512 =
         [](void *ctx, mongocrypt_binary_t *key, mongocrypt_binary_t *in, mongocrypt_binary_t *out, mongocrypt_status_t *status) -> bool {
             Nan::HandleScope scope;
-            CryptoHooks* cryptoHooks = static_cast<CryptoHooks*>(ctx);
+            CryptoHooks* cryptoHooks = resolveHooks(ctx);
+            if (!cryptoHooks) {
+                return NoCryptoHooksError(status);
+            }
             Nan::Callback* hook = cryptoHooks->hmacSha512Hook.get();
 
             v8::Local<v8::Object> keyBuffer = BufferFromBinary(key);
@@ -285,7 +422,10 @@ bool MongoCrypt::setupCryptoHooks(mongocrypt_t* mongoCrypt, CryptoHooks* cryptoH
     auto hmac_sha_256 =
         [](void *ctx, mongocrypt_binary_t *key, mongocrypt_binary_t *in, mongocrypt_binary_t *out, mongocrypt_status_t *status) -> bool {
             Nan::HandleScope scope;
-            CryptoHooks* cryptoHooks = static_cast<CryptoHooks*>(ctx);
+            CryptoHooks* cryptoHooks = resolveHooks(ctx);
+            if (!cryptoHooks) {
+                return NoCryptoHooksError(status);
+            }
             Nan::Callback* hook = cryptoHooks->hmacSha256Hook.get();
 
             v8::Local<v8::Object> keyBuffer = BufferFromBinary(key);
@@ -306,7 +446,10 @@ bool MongoCrypt::setupCryptoHooks(mongocrypt_t* mongoCrypt, CryptoHooks* cryptoH
     auto sha_256 =
         [](void *ctx, mongocrypt_binary_t *in, mongocrypt_binary_t *out, mongocrypt_status_t *status) -> bool {
             Nan::HandleScope scope;
-            CryptoHooks* cryptoHooks = static_cast<CryptoHooks*>(ctx);
+            CryptoHooks* cryptoHooks = resolveHooks(ctx);
+            if (!cryptoHooks) {
+                return NoCryptoHooksError(status);
+            }
             Nan::Callback* hook = cryptoHooks->sha256Hook.get();
 
             v8::Local<v8::Object> inputBuffer = BufferFromBinary(in);
@@ -327,7 +470,10 @@ bool MongoCrypt::setupCryptoHooks(mongocrypt_t* mongoCrypt, CryptoHooks* cryptoH
     auto sign_rsa_sha256 =
         [](void *ctx, mongocrypt_binary_t *key, mongocrypt_binary_t *in, mongocrypt_binary_t *out, mongocrypt_status_t *status) -> bool {
             Nan::HandleScope scope;
-            CryptoHooks* cryptoHooks = static_cast<CryptoHooks*>(ctx);
+            CryptoHooks* cryptoHooks = resolveHooks(ctx);
+            if (!cryptoHooks) {
+                return NoCryptoHooksError(status);
+            }
             Nan::Callback* hook = cryptoHooks->signRsaSha256Hook.get();
 
             v8::Local<v8::Object> keyBuffer = BufferFromBinary(key);
@@ -372,6 +518,10 @@ NAN_METHOD(MongoCrypt::New) {
 
         Nan::Callback* logger = nullptr;
         CryptoHooks *cryptoHooks = nullptr;
+        bool preferNativeCrypto = false;
+        std::string sharedCryptId;
+        // The options a shared handle is created with, which later users must match.
+        std::string sharedOptions;
         std::unique_ptr<mongocrypt_t, MongoCryptDeleter> crypt(mongocrypt_new());
 
         if (info.Length() >= 1) {
@@ -380,6 +530,7 @@ NAN_METHOD(MongoCrypt::New) {
             v8::Local<v8::String> SCHEMA_MAP_KEY = Nan::New("schemaMap").ToLocalChecked();
             v8::Local<v8::String> LOGGER_KEY = Nan::New("logger").ToLocalChecked();
             v8::Local<v8::String> CRYPTO_CALLBACKS_KEY = Nan::New("cryptoCallbacks").ToLocalChecked();
+            v8::Local<v8::String> SHARED_CRYPT_ID_KEY = Nan::New("sharedCryptId").ToLocalChecked();
 
             v8::Local<v8::String> AES256_ENCRYPT_HOOK_KEY = Nan::New("aes256CbcEncryptHook").ToLocalChecked();
             v8::Local<v8::String> AES256_DECRYPT_HOOK_KEY = Nan::New("aes256CbcDecryptHook").ToLocalChecked();
@@ -401,6 +552,7 @@ NAN_METHOD(MongoCrypt::New) {
 
                 std::unique_ptr<mongocrypt_binary_t, MongoCryptBinaryDeleter> kmsProvidersBinary(
                     BufferToBinary(kmsProvidersOptions));
+                sharedOptions += "kmsProviders:" + StringFromBinary(kmsProvidersBinary.get());
                 if (!mongocrypt_setopt_kms_providers(crypt.get(), kmsProvidersBinary.get())) {
                     Nan::ThrowTypeError(errorStringFromStatus(crypt.get()));
                     return;
@@ -419,6 +571,7 @@ NAN_METHOD(MongoCrypt::New) {
 
                 std::unique_ptr<mongocrypt_binary_t, MongoCryptBinaryDeleter> schemaMapBinary(
                     BufferToBinary(schemaMapBuffer));
+                sharedOptions += ";schemaMap:" + StringFromBinary(schemaMapBinary.get());
                 if (!mongocrypt_setopt_schema_map(crypt.get(), schemaMapBinary.get())) {
                     Nan::ThrowTypeError(errorStringFromStatus(crypt.get()));
                     return;
@@ -431,6 +584,19 @@ NAN_METHOD(MongoCrypt::New) {
                         .ToLocalChecked());
             }
 
+            preferNativeCrypto = BooleanOptionValue(options, "preferNativeCrypto");
+
+            if (Nan::Has(options, SHARED_CRYPT_ID_KEY).FromMaybe(false)) {
+                v8::Local<v8::Value> sharedCryptIdValue =
+                    Nan::Get(options, SHARED_CRYPT_ID_KEY).ToLocalChecked();
+                if (!sharedCryptIdValue->IsString()) {
+                    Nan::ThrowTypeError("Option `sharedCryptId` must be a string");
+                    return;
+                }
+
+                sharedCryptId = *Nan::Utf8String(sharedCryptIdValue);
+            }
+
             if (Nan::Has(options, CRYPTO_CALLBACKS_KEY).FromMaybe(false)) {
                 v8::Local<v8::Object> cryptoCallbacks =
                     Nan::To<v8::Object>(Nan::Get(options, CRYPTO_CALLBACKS_KEY).ToLocalChecked())
@@ -468,27 +634,48 @@ NAN_METHOD(MongoCrypt::New) {
         }
 
         MongoCrypt* class_instance = new MongoCrypt(crypt.release(), logger, cryptoHooks);
-        if (logger) {
-            if (!mongocrypt_setopt_log_handler(
-                    class_instance->_mongo_crypt.get(), MongoCrypt::logHandler, class_instance)) {
-                Nan::ThrowTypeError(errorStringFromStatus(class_instance->_mongo_crypt.get()));
+        if (sharedCryptId.empty()) {
+            if (!class_instance->configure(preferNativeCrypto)) {
                 return;
             }
-        }
+        } else {
+            sharedOptions += logger ? ";logger" : "";
+            sharedOptions += cryptoHooks ? ";cryptoCallbacks" : "";
+            sharedOptions += preferNativeCrypto ? ";preferNativeCrypto" : "";
+
+            // Entries expire with the last MongoCrypt using the handle.
+            std::lock_guard<std::mutex> lock(SharedCryptsMutex());
+            static std::map<std::string, std::weak_ptr<SharedCrypt>> sharedCrypts;
+            std::shared_ptr<SharedCrypt> shared = sharedCrypts[sharedCryptId].lock();
+            if (shared) {
+                if (shared->options != sharedOptions) {
+                    Nan::ThrowTypeError("Option `sharedCryptId` is in use with different options");
+                    return;
+                }
 
-        if (cryptoHooks) {
-            if (!setupCryptoHooks(class_instance->_mongo_crypt.get(), cryptoHooks)) {
-                Nan::ThrowError("unable to configure crypto hooks");
-                return;
+                // The handle is already configured and initialized.
+                class_instance->_mongo_crypt.reset();
+                class_instance->_shared = shared;
+                ThreadInstances().emplace(shared.get(), class_instance);
+            } else {
+                shared = std::make_shared<SharedCrypt>();
+                shared->crypt = std::move(class_instance->_mongo_crypt);
+                shared->options = sharedOptions;
+                shared->dispatch.shared = shared.get();
+                class_instance->_shared = shared;
+                // Registered first, so hooks and logs during initialization reach it.
+                ThreadInstances().emplace(shared.get(), class_instance);
+                if (!class_instance->configure(preferNativeCrypto)) {
+                    return;
+                }
+
+                sharedCrypts[sharedCryptId] = shared;
             }
         }
 
-        // initialize afer all options are set, but after `MongoCrypt` instance is created so we can
-        // optionally pass the instance to the logging function.
-        if (!mongocrypt_init(class_instance->_mongo_crypt.get())) {
-            Nan::ThrowTypeError(errorStringFromStatus(class_instance->_mongo_crypt.get()));
-            return;
-        }
+#ifdef MONGOCRYPT_ENABLE_CRYPTO
+        class_instance->_canRunOffThread = !logger && (!cryptoHooks || preferNativeCrypto);
+#endif
 
         class_instance->Wrap(info.This());
         return info.GetReturnValue().Set(info.This());
@@ -504,7 +691,7 @@ NAN_GETTER(MongoCrypt::Status) {
     Nan::HandleScope scope;
     MongoCrypt* mc = Nan::ObjectWrap::Unwrap<MongoCrypt>(info.This());
     std::unique_ptr<mongocrypt_status_t, MongoCryptStatusDeleter> status(mongocrypt_status_new());
-    mongocrypt_status(mc->_mongo_crypt.get(), status.get());
+    mongocrypt_status(mc->crypt(), status.get());
     v8::Local<v8::Object> result = ExtractStatus(status.get());
     info.GetReturnValue().Set(result);
 }
@@ -514,7 +701,7 @@ NAN_METHOD(MongoCrypt::MakeEncryptionContext) {
     MongoCrypt* mc = Nan::ObjectWrap::Unwrap<MongoCrypt>(info.This());
     std::string ns(*Nan::Utf8String(Nan::To<v8::String>(info[0]).FromMaybe(v8::Local<v8::String>())));
     std::unique_ptr<mongocrypt_ctx_t, MongoCryptContextDeleter> context(
-        mongocrypt_ctx_new(mc->_mongo_crypt.get()));
+        mongocrypt_ctx_new(mc->crypt()));
 
     v8::Local<v8::Object> commandBuffer = Nan::To<v8::Object>(info[1]).ToLocalChecked();
     if (!node::Buffer::HasInstance(commandBuffer)) {
@@ -530,7 +717,8 @@ NAN_METHOD(MongoCrypt::MakeEncryptionContext) {
         return;
     }
 
-    v8::Local<v8::Object> result = MongoCryptContext::NewInstance(context.release());
+    v8::Local<v8::Object> result =
+        MongoCryptContext::NewInstance(context.release(), mc->_canRunOffThread);
     info.GetReturnValue().Set(result);
 }
 
@@ -538,7 +726,7 @@ NAN_METHOD(MongoCrypt::MakeExplicitEncryptionContext) {
     Nan::HandleScope scope;
     MongoCrypt* mc = Nan::ObjectWrap::Unwrap<MongoCrypt>(info.This());
     std::unique_ptr<mongocrypt_ctx_t, MongoCryptContextDeleter> context(
-        mongocrypt_ctx_new(mc->_mongo_crypt.get()));
+        mongocrypt_ctx_new(mc->crypt()));
 
     v8::Local<v8::Object> valueBuffer = Nan::To<v8::Object>(info[0]).ToLocalChecked();
     if (!node::Buffer::HasInstance(valueBuffer)) {
@@ -610,7 +798,8 @@ NAN_METHOD(MongoCrypt::MakeExplicitEncryptionContext) {
         return;
     }
 
-    v8::Local<v8::Object> result = MongoCryptContext::NewInstance(context.release());
+    v8::Local<v8::Object> result =
+        MongoCryptContext::NewInstance(context.release(), mc->_canRunOffThread);
     info.GetReturnValue().Set(result);
 }
 
@@ -624,17 +813,83 @@ NAN_METHOD(MongoCrypt::MakeDecryptionContext) {
     std::unique_ptr<mongocrypt_binary_t, MongoCryptBinaryDeleter> binary(
         BufferToBinary(Nan::To<v8::Object>(info[0]).ToLocalChecked()));
     std::unique_ptr<mongocrypt_ctx_t, MongoCryptContextDeleter> context(
-        mongocrypt_ctx_new(mc->_mongo_crypt.get()));
+        mongocrypt_ctx_new(mc->crypt()));
 
     if (!mongocrypt_ctx_decrypt_init(context.get(), binary.get())) {
         Nan::ThrowTypeError(errorStringFromStatus(context.get()));
         return;
     }
 
-    v8::Local<v8::Object> result = MongoCryptContext::NewInstance(context.release());
+    v8::Local<v8::Object> result =
+        MongoCryptContext::NewInstance(context.release(), mc->_canRunOffThread);
     info.GetReturnValue().Set(result);
 }
 
+class DecryptInitWorker : public Nan::AsyncWorker {
+   public:
+    DecryptInitWorker(Nan::Callback* callback, mongocrypt_ctx_t* context, mongocrypt_binary_t* binary)
+        : Nan::AsyncWorker(callback, "mongocrypt:decryptInit"), _context(context), _binary(binary) {}
+
+    void Execute() override {
+        if (!mongocrypt_ctx_decrypt_init(_context.get(), _binary.get())) {
+            SetErrorMessage(errorStringFromStatus(_context.get()).c_str());
+        }
+    }
+
+    void HandleOKCallback() override {
+        Nan::HandleScope scope;
+        v8::Local<v8::Value> argv[] = {Nan::Null(),
+                                       MongoCryptContext::NewInstance(_context.release(), true)};
+        callback->Call(2, argv, async_resource);
+    }
+
+   private:
+    std::unique_ptr<mongocrypt_ctx_t, MongoCryptContextDeleter> _context;
+    std::unique_ptr<mongocrypt_binary_t, MongoCryptBinaryDeleter> _binary;
+};
+
+NAN_METHOD(MongoCrypt::MakeDecryptionContextAsync) {
+    if (!node::Buffer::HasInstance(info[0])) {
+        Nan::ThrowTypeError("First parameter must be a Buffer");
+        return;
+    }
+
+    if (info.Length() < 2 || !info[1]->IsFunction()) {
+        Nan::ThrowTypeError("Second parameter must be a function");
+        return;
+    }
+
+    MongoCrypt* mc = Nan::ObjectWrap::Unwrap<MongoCrypt>(info.This());
+    v8::Local<v8::Object> buffer = Nan::To<v8::Object>(info[0]).ToLocalChecked();
+    Nan::Callback* callback = new Nan::Callback(info[1].As<v8::Function>());
+
+    if (!mc->_canRunOffThread) {
+        std::unique_ptr<Nan::Callback> syncCallback(callback);
+        std::unique_ptr<mongocrypt_binary_t, MongoCryptBinaryDeleter> binary(BufferToBinary(buffer));
+        std::unique_ptr<mongocrypt_ctx_t, MongoCryptContextDeleter> context(
+            mongocrypt_ctx_new(mc->crypt()));
+
+        if (!mongocrypt_ctx_decrypt_init(context.get(), binary.get())) {
+            v8::Local<v8::Value> argv[] = {
+                Nan::Error(errorStringFromStatus(context.get()).c_str())};
+            Nan::Call(*syncCallback, Nan::GetCurrentContext()->Global(), 1, argv);
+            return;
+        }
+
+        v8::Local<v8::Value> argv[] = {Nan::Null(),
+                                       MongoCryptContext::NewInstance(context.release())};
+        Nan::Call(*syncCallback, Nan::GetCurrentContext()->Global(), 2, argv);
+        return;
+    }
+
+    DecryptInitWorker* worker = new DecryptInitWorker(
+        callback, mongocrypt_ctx_new(mc->crypt()), BufferToBinary(buffer));
+    // Keep the input, and the `mongocrypt_t` the context refers to, alive until the work is done.
+    worker->SaveToPersistent("buffer", buffer);
+    worker->SaveToPersistent("mongocrypt", info.This());
+    Nan::AsyncQueueWorker(worker);
+}
+
 NAN_METHOD(MongoCrypt::MakeExplicitDecryptionContext) {
     if (!node::Buffer::HasInstance(info[0])) {
         Nan::ThrowTypeError("First parameter must be a Buffer");
@@ -645,14 +900,15 @@ NAN_METHOD(MongoCrypt::MakeExplicitDecryptionContext) {
     std::unique_ptr<mongocrypt_binary_t, MongoCryptBinaryDeleter> binary(
         BufferToBinary(Nan::To<v8::Object>(info[0]).ToLocalChecked()));
     std::unique_ptr<mongocrypt_ctx_t, MongoCryptContextDeleter> context(
-        mongocrypt_ctx_new(mc->_mongo_crypt.get()));
+        mongocrypt_ctx_new(mc->crypt()));
 
     if (!mongocrypt_ctx_explicit_decrypt_init(context.get(), binary.get())) {
         Nan::ThrowTypeError(errorStringFromStatus(context.get()));
         return;
     }
 
-    v8::Local<v8::Object> result = MongoCryptContext::NewInstance(context.release());
+    v8::Local<v8::Object> result =
+        MongoCryptContext::NewInstance(context.release(), mc->_canRunOffThread);
     info.GetReturnValue().Set(result);
 }
 
@@ -665,7 +921,7 @@ NAN_METHOD(MongoCrypt::MakeDataKeyContext) {
     }
 
     std::unique_ptr<mongocrypt_ctx_t, MongoCryptContextDeleter> context(
-        mongocrypt_ctx_new(mc->_mongo_crypt.get()));
+        mongocrypt_ctx_new(mc->crypt()));
     std::unique_ptr<mongocrypt_binary_t, MongoCryptBinaryDeleter> binary(
         BufferToBinary(optionsBuffer));
 
@@ -709,7 +965,8 @@ NAN_METHOD(MongoCrypt::MakeDataKeyContext) {
         return;
     }
 
-    v8::Local<v8::Object> result = MongoCryptContext::NewInstance(context.release());
+    v8::Local<v8::Object> result =
+        MongoCryptContext::NewInstance(context.release(), mc->_canRunOffThread);
     info.GetReturnValue().Set(result);
 }
 
@@ -722,6 +979,7 @@ NAN_MODULE_INIT(MongoCryptContext::Init) {
     Nan::SetPrototypeMethod(tpl, "nextKMSRequest", NextKMSRequest);
     Nan::SetPrototypeMethod(tpl, "finishKMSRequests", FinishKMSRequests);
     Nan::SetPrototypeMethod(tpl, "finalize", Finalize);
+    Nan::SetPrototypeMethod(tpl, "finalizeAsync", FinalizeAsync);
 
     v8::Local<v8::ObjectTemplate> itpl = tpl->InstanceTemplate();
     itpl->SetInternalFieldCount(1);
@@ -730,21 +988,28 @@ NAN_MODULE_INIT(MongoCryptContext::Init) {
     Nan::SetAccessor(itpl, Nan::New("state").ToLocalChecked(), State);
 
     constructor().Reset(Nan::GetFunction(tpl).ToLocalChecked());
+#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
+    // Release the constructor of a worker thread before its isolate is disposed.
+    node::AddEnvironmentCleanupHook(
+        v8::Isolate::GetCurrent(), [](void*) { constructor().Reset(); }, nullptr);
+#endif
     Nan::Set(target,
              Nan::New("MongoCryptContext").ToLocalChecked(),
              Nan::GetFunction(tpl).ToLocalChecked());
 }
 
-v8::Local<v8::Object> MongoCryptContext::NewInstance(mongocrypt_ctx_t* context) {
+v8::Local<v8::Object> MongoCryptContext::NewInstance(mongocrypt_ctx_t* context,
+                                                     bool canRunOffThread) {
     Nan::EscapableHandleScope scope;
     v8::Local<v8::Function> ctor = Nan::New<v8::Function>(constructor());
     v8::Local<v8::Object> object = Nan::NewInstance(ctor).ToLocalChecked();
-    MongoCryptContext* class_instance = new MongoCryptContext(context);
+    MongoCryptContext* class_instance = new MongoCryptContext(context, canRunOffThread);
     class_instance->Wrap(object);
     return scope.Escape(object);
 }
 
-MongoCryptContext::MongoCryptContext(mongocrypt_ctx_t* context) : _context(context) {}
+MongoCryptContext::MongoCryptContext(mongocrypt_ctx_t* context, bool canRunOffThread)
+    : _context(context), _canRunOffThread(canRunOffThread) {}
 
 NAN_GETTER(MongoCryptContext::Status) {
     Nan::HandleScope scope;
@@ -821,11 +1086,66 @@ NAN_METHOD(MongoCryptContext::Finalize) {
     MongoCryptContext* mcc = Nan::ObjectWrap::Unwrap<MongoCryptContext>(info.This());
 
     std::unique_ptr<mongocrypt_binary_t, MongoCryptBinaryDeleter> output(mongocrypt_binary_new());
-    mongocrypt_ctx_finalize(mcc->_context.get(), output.get());
-    v8::Local<v8::Object> buffer = BufferFromBinary(output.get());
+    mongocrypt_ctx_finalize_steal(mcc->_context.get(), output.get());
+    v8::Local<v8::Object> buffer = BufferFromOwnedBinary(output.release());
     info.GetReturnValue().Set(buffer);
 }
 
+class FinalizeWorker : public Nan::AsyncWorker {
+   public:
+    FinalizeWorker(Nan::Callback* callback, mongocrypt_ctx_t* context)
+        : Nan::AsyncWorker(callback, "mongocrypt:finalize"),
+          _context(context),
+          _output(mongocrypt_binary_new()) {}
+
+    void Execute() override {
+        if (!mongocrypt_ctx_finalize_steal(_context, _output.get())) {
+            SetErrorMessage(errorStringFromStatus(_context).c_str());
+        }
+    }
+
+    void HandleOKCallback() override {
+        Nan::HandleScope scope;
+        v8::Local<v8::Value> argv[] = {Nan::Null(), BufferFromOwnedBinary(_output.release())};
+        callback->Call(2, argv, async_resource);
+    }
+
+   private:
+    mongocrypt_ctx_t* _context;
+    std::unique_ptr<mongocrypt_binary_t, MongoCryptBinaryDeleter> _output;
+};
+
+NAN_METHOD(MongoCryptContext::FinalizeAsync) {
+    if (info.Length() < 1 || !info[0]->IsFunction()) {
+        Nan::ThrowTypeError("First parameter must be a function");
+        return;
+    }
+
+    MongoCryptContext* mcc = Nan::ObjectWrap::Unwrap<MongoCryptContext>(info.This());
+    Nan::Callback* callback = new Nan::Callback(info[0].As<v8::Function>());
+
+    if (!mcc->_canRunOffThread) {
+        std::unique_ptr<Nan::Callback> syncCallback(callback);
+        std::unique_ptr<mongocrypt_binary_t, MongoCryptBinaryDeleter> output(mongocrypt_binary_new());
+
+        if (!mongocrypt_ctx_finalize_steal(mcc->_context.get(), output.get())) {
+            v8::Local<v8::Value> argv[] = {
+                Nan::Error(errorStringFromStatus(mcc->_context.get()).c_str())};
+            Nan::Call(*syncCallback, Nan::GetCurrentContext()->Global(), 1, argv);
+            return;
+        }
+
+        v8::Local<v8::Value> argv[] = {Nan::Null(), BufferFromOwnedBinary(output.release())};
+        Nan::Call(*syncCallback, Nan::GetCurrentContext()->Global(), 2, argv);
+        return;
+    }
+
+    FinalizeWorker* worker = new FinalizeWorker(callback, mcc->_context.get());
+    // The context must outlive the work. It must not be used until the callback is called.
+    worker->SaveToPersistent("context", info.This());
+    Nan::AsyncQueueWorker(worker);
+}
+
 NAN_MODULE_INIT(MongoCryptKMSRequest::Init) {
     v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>();
     tpl->SetClassName(Nan::New("MongoCryptKMSRequest").ToLocalChecked());
@@ -840,6 +1160,11 @@ NAN_MODULE_INIT(MongoCryptKMSRequest::Init) {
     Nan::SetAccessor(itpl, Nan::New("message").ToLocalChecked(), Message);
 
     constructor().Reset(Nan::GetFunction(tpl).ToLocalChecked());
+#if NODE_MODULE_VERSION >= NODE_12_0_MODULE_VERSION
+    // Release the constructor of a worker thread before its isolate is disposed.
+    node::AddEnvironmentCleanupHook(
+        v8::Isolate::GetCurrent(), [](void*) { constructor().Reset(); }, nullptr);
+#endif
     Nan::Set(target,
              Nan::New("MongoCryptKMSRequest").ToLocalChecked(),
              Nan::GetFunction(tpl).ToLocalChecked());
@@ -915,4 +1240,4 @@ static NAN_MODULE_INIT(Init) {
     MongoCryptKMSRequest::Init(target);
 }
 
-NODE_MODULE(mongocrypt, Init)
+NAN_MODULE_WORKER_ENABLED(mongocrypt, Init)
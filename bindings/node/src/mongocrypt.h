@@ -2,10 +2,14 @@
 #define NODE_MONGOCRYPT_H
 
 #include <nan.h>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
 
 extern "C" {
 #include <mongocrypt/mongocrypt.h>
+#include <mongocrypt/mongocrypt-config.h>
 }
 
 struct MongoCryptBinaryDeleter {
@@ -31,8 +35,9 @@ class MongoCrypt : public Nan::ObjectWrap {
     static NAN_MODULE_INIT(Init);
 
    private:
+    // One per thread, since each worker thread has its own isolate.
     static inline Nan::Persistent<v8::Function> & constructor() {
-        static Nan::Persistent<v8::Function> ctor;
+        static thread_local Nan::Persistent<v8::Function> ctor;
         return ctor;
     }
 
@@ -40,12 +45,15 @@ class MongoCrypt : public Nan::ObjectWrap {
     static NAN_METHOD(MakeEncryptionContext);
     static NAN_METHOD(MakeExplicitEncryptionContext);
     static NAN_METHOD(MakeDecryptionContext);
+    static NAN_METHOD(MakeDecryptionContextAsync);
     static NAN_METHOD(MakeExplicitDecryptionContext);
     static NAN_METHOD(MakeDataKeyContext);
 
     static NAN_GETTER(Status);
 
    private:
+    struct SharedCrypt;
+
     struct CryptoHooks {
         std::unique_ptr<Nan::Callback> aes256CbcEncryptHook;
         std::unique_ptr<Nan::Callback> aes256CbcDecryptHook;
@@ -54,30 +62,62 @@ class MongoCrypt : public Nan::ObjectWrap {
         std::unique_ptr<Nan::Callback> hmacSha256Hook;
         std::unique_ptr<Nan::Callback> sha256Hook;
         std::unique_ptr<Nan::Callback> signRsaSha256Hook;
+        // If set, these hooks have no callbacks, and forward to the hooks of
+        // the MongoCrypt using the shared handle on the calling thread.
+        SharedCrypt* shared = nullptr;
+    };
+
+    // A mongocrypt_t shared by every MongoCrypt created with the same
+    // `sharedCryptId`, in any worker thread, so they share one key cache.
+    // Hooks and loggers are functions of one isolate, so the handle calls
+    // those of the MongoCrypt on the calling thread.
+    struct SharedCrypt {
+        std::unique_ptr<mongocrypt_t, MongoCryptDeleter> crypt;
+        // The options it was created with, which later users must match.
+        std::string options;
+        CryptoHooks dispatch;
     };
 
     friend class MongoCryptContext;
     explicit MongoCrypt(mongocrypt_t* mongo_crypt, Nan::Callback* logger, CryptoHooks* hooks);
+    ~MongoCrypt();
     static bool setupCryptoHooks(mongocrypt_t* mongoCrypt, CryptoHooks* cryptoHooks);
+    static CryptoHooks* resolveHooks(void* ctx);
+    static MongoCrypt* threadInstance(const SharedCrypt* shared);
+    bool configure(bool preferNativeCrypto);
+    mongocrypt_t* crypt() const {
+        return _shared ? _shared->crypt.get() : _mongo_crypt.get();
+    }
 
     static void logHandler(mongocrypt_log_level_t level,
                            const char* message,
                            uint32_t message_len,
                            void* ctx);
+    static void sharedLogHandler(mongocrypt_log_level_t level,
+                                 const char* message,
+                                 uint32_t message_len,
+                                 void* ctx);
 
     std::unique_ptr<mongocrypt_t, MongoCryptDeleter> _mongo_crypt;
+    // Set instead of _mongo_crypt if the handle is shared.
+    std::shared_ptr<SharedCrypt> _shared;
     std::unique_ptr<Nan::Callback> _logger;
     std::unique_ptr<CryptoHooks> _cryptoHooks;
+    // True if no callback into JavaScript can happen while initializing or
+    // finalizing a context, so that work may run on the libuv threadpool.
+    bool _canRunOffThread;
 };
 
 class MongoCryptContext : public Nan::ObjectWrap {
    public:
     static NAN_MODULE_INIT(Init);
-    static v8::Local<v8::Object> NewInstance(mongocrypt_ctx_t* context);
+    static v8::Local<v8::Object> NewInstance(mongocrypt_ctx_t* context,
+                                             bool canRunOffThread = false);
 
    private:
+    // One per thread, since each worker thread has its own isolate.
     static inline Nan::Persistent<v8::Function> & constructor() {
-        static Nan::Persistent<v8::Function> ctor;
+        static thread_local Nan::Persistent<v8::Function> ctor;
         return ctor;
     }
 
@@ -87,13 +127,15 @@ class MongoCryptContext : public Nan::ObjectWrap {
     static NAN_METHOD(NextKMSRequest);
     static NAN_METHOD(FinishKMSRequests);
     static NAN_METHOD(Finalize);
+    static NAN_METHOD(FinalizeAsync);
 
     static NAN_GETTER(Status);
     static NAN_GETTER(State);
 
    private:
-    explicit MongoCryptContext(mongocrypt_ctx_t* context);
+    explicit MongoCryptContext(mongocrypt_ctx_t* context, bool canRunOffThread);
     std::unique_ptr<mongocrypt_ctx_t, MongoCryptContextDeleter> _context;
+    bool _canRunOffThread;
 };
 
 class MongoCryptKMSRequest : public Nan::ObjectWrap {
@@ -102,8 +144,9 @@ class MongoCryptKMSRequest : public Nan::ObjectWrap {
     static v8::Local<v8::Object> NewInstance(mongocrypt_kms_ctx_t* kms_context);
 
    private:
+    // One per thread, since each worker thread has its own isolate.
     static inline Nan::Persistent<v8::Function> & constructor() {
-        static Nan::Persistent<v8::Function> ctor;
+        static thread_local Nan::Persistent<v8::Function> ctor;
         return ctor;
     }
 
@@ -126,6 +126,55 @@ describe('AutoEncrypter', function() {
       });
     });
 
+    it('should decrypt mock data off the main thread with `preferNativeCrypto`', function(done) {
+      const input = readExtendedJsonToBuffer(`${__dirname}/data/encrypted-document.json`);
+      const client = new MockClient();
+      const mc = new AutoEncrypter(client, {
+        keyVaultNamespace: 'admin.datakeys',
+        preferNativeCrypto: true,
+        kmsProviders: {
+          aws: { accessKeyId: 'example', secretAccessKey: 'example' },
+          local: { key: Buffer.alloc(96) }
+        }
+      });
+      mc.decrypt(input, (err, decrypted) => {
+        if (err) return done(err);
+        expect(decrypted).to.eql({ filter: { find: 'test', ssn: '457-55-5462' } });
+        done();
+      });
+    });
+
+    it('should share one engine between encrypters with the same `sharedCryptId`', function(done) {
+      const input = readExtendedJsonToBuffer(`${__dirname}/data/encrypted-document.json`);
+      const options = {
+        keyVaultNamespace: 'admin.datakeys',
+        sharedCryptId: 'autoEncrypter.test',
+        kmsProviders: {
+          aws: { accessKeyId: 'example', secretAccessKey: 'example' },
+          local: { key: Buffer.alloc(96) }
+        }
+      };
+      const first = new AutoEncrypter(new MockClient(), options);
+      const second = new AutoEncrypter(new MockClient(), options);
+      expect(
+        () =>
+          new AutoEncrypter(
+            new MockClient(),
+            Object.assign({}, options, { kmsProviders: { local: { key: Buffer.alloc(96) } } })
+          )
+      ).to.throw(/in use with different options/);
+
+      first.decrypt(input, (err, decrypted) => {
+        if (err) return done(err);
+        expect(decrypted).to.eql({ filter: { find: 'test', ssn: '457-55-5462' } });
+        second.decrypt(input, (err, decrypted) => {
+          if (err) return done(err);
+          expect(decrypted).to.eql({ filter: { find: 'test', ssn: '457-55-5462' } });
+          done();
+        });
+      });
+    });
+
     it('should encrypt mock data', function(done) {
       const client = new MockClient();
       const mc = new AutoEncrypter(client, {
@@ -0,0 +1,163 @@
+'use strict';
+
+// Measures automatic encryption and decryption throughput of typical documents with the
+// crypto hooks of this package, with native crypto preferred over the hooks, and with native
+// crypto only, to quantify the cost of calling into JavaScript for every primitive.
+//
+// Usage: node test/benchmarks/cryptoHooks.js [durationMs]
+//
+// No server or mongocryptd is needed: keys use the "local" KMS provider, and the benchmark
+// answers the key vault and mongocryptd requests itself. Documents are encrypted and decrypted
+// one per context, and in batches of BATCH_SIZE documents per context, as in a bulk insert or a
+// cursor batch. Prints one JSON result per line.
+
+const BSON = require('bson');
+const mc = require('bindings')('mongocrypt');
+const cryptoCallbacks = require('../../lib/cryptoCallbacks');
+
+const MONGOCRYPT_CTX_NEED_MONGO_MARKINGS = 2;
+const MONGOCRYPT_CTX_NEED_MONGO_KEYS = 3;
+const MONGOCRYPT_CTX_READY = 5;
+
+const BATCH_SIZE = 100;
+const NS = 'bench.coll';
+const RANDOM = 'AEAD_AES_256_CBC_HMAC_SHA_512-Random';
+const durationMs = Number(process.argv[2]) || 2000;
+const kmsProviders = BSON.serialize({ local: { key: Buffer.alloc(96) } });
+
+const modes = {
+  native: {},
+  hooks: { cryptoCallbacks },
+  preferNativeCrypto: { cryptoCallbacks, preferNativeCrypto: true }
+};
+
+function createKeyDocument() {
+  const crypt = new mc.MongoCrypt({ kmsProviders });
+  const context = crypt.makeDataKeyContext(BSON.serialize({ provider: 'local' }), {});
+  if (context.state !== MONGOCRYPT_CTX_READY) {
+    throw new Error(`unexpected data key state: ${context.state}`);
+  }
+
+  return context.finalize();
+}
+
+function makeDocument(i) {
+  return {
+    _id: i,
+    name: 'Jane Doe',
+    ssn: '457-55-5462',
+    salary: 120000 + i,
+    notes: 'n'.repeat(200),
+    address: { street: '1 Main St', city: 'New York', zip: '10001' }
+  };
+}
+
+// What mongocryptd would reply: the command, with the encrypted fields replaced by markings.
+function makeMarkingsReply(keyId, count) {
+  function mark(value) {
+    const marking = BSON.serialize({ a: 2, v: value, ki: keyId });
+    return new BSON.Binary(Buffer.concat([Buffer.from([0]), marking]), 6);
+  }
+
+  const documents = [];
+  for (let i = 0; i < count; i++) {
+    const doc = makeDocument(i);
+    doc.ssn = mark(doc.ssn);
+    doc.salary = mark(doc.salary);
+    doc.notes = mark(doc.notes);
+    documents.push(doc);
+  }
+
+  return BSON.serialize({
+    ok: 1,
+    result: { insert: 'coll', documents },
+    hasEncryptedPlaceholders: true,
+    schemaRequiresEncryption: true
+  });
+}
+
+function makeSchemaMap(keyId) {
+  const encrypted = bsonType => ({ encrypt: { bsonType, algorithm: RANDOM, keyId: [keyId] } });
+  return BSON.serialize({
+    [NS]: {
+      bsonType: 'object',
+      properties: { ssn: encrypted('string'), salary: encrypted('int'), notes: encrypted('string') }
+    }
+  });
+}
+
+// Drive a context to completion, answering requests from memory.
+function run(context, keyDocument, markingsReply) {
+  for (;;) {
+    switch (context.state) {
+      case MONGOCRYPT_CTX_NEED_MONGO_KEYS:
+        context.nextMongoOperation();
+        context.addMongoOperationResponse(keyDocument);
+        context.finishMongoOperation();
+        break;
+      case MONGOCRYPT_CTX_NEED_MONGO_MARKINGS:
+        context.nextMongoOperation();
+        context.addMongoOperationResponse(markingsReply);
+        context.finishMongoOperation();
+        break;
+      case MONGOCRYPT_CTX_READY:
+        return context.finalize();
+      default:
+        throw new Error(`unexpected state ${context.state}: ${context.status.message}`);
+    }
+  }
+}
+
+// Run op until durationMs passes, and return documents per second.
+function measure(op, docsPerOp) {
+  op(); // warm the key cache
+  let ops = 0;
+  const start = process.hrtime();
+  let elapsedMs = 0;
+  while (elapsedMs < durationMs) {
+    op();
+    ops++;
+    const elapsed = process.hrtime(start);
+    elapsedMs = elapsed[0] * 1e3 + elapsed[1] / 1e6;
+  }
+
+  return (ops * docsPerOp * 1000) / elapsedMs;
+}
+
+function main() {
+  const keyDocument = createKeyDocument();
+  const keyId = BSON.deserialize(keyDocument)._id;
+  const schemaMap = makeSchemaMap(keyId);
+
+  for (const mode of Object.keys(modes)) {
+    const crypt = new mc.MongoCrypt(Object.assign({ kmsProviders, schemaMap }, modes[mode]));
+
+    for (const batchSize of [1, BATCH_SIZE]) {
+      const markingsReply = makeMarkingsReply(keyId, batchSize);
+      const documents = [];
+      for (let i = 0; i < batchSize; i++) {
+        documents.push(makeDocument(i));
+      }
+      const command = BSON.serialize({ insert: 'coll', documents });
+
+      const encrypt = () =>
+        run(crypt.makeEncryptionContext(NS, command), keyDocument, markingsReply);
+      const encrypted = BSON.deserialize(encrypt());
+      const reply = BSON.serialize({
+        ok: 1,
+        cursor: { id: 0, ns: NS, firstBatch: encrypted.documents }
+      });
+      const decrypt = () => run(crypt.makeDecryptionContext(reply), keyDocument);
+
+      const results = {
+        encrypt: measure(encrypt, batchSize),
+        decrypt: measure(decrypt, batchSize)
+      };
+      for (const op of Object.keys(results)) {
+        console.log(JSON.stringify({ op, mode, batchSize, docsPerSec: Math.round(results[op]) }));
+      }
+    }
+  }
+}
+
+main();
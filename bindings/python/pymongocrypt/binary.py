@@ -76,19 +76,27 @@ class MongoCryptBinaryOut(_MongoCryptBinary):
 
 
 class MongoCryptBinaryIn(_MongoCryptBinary):
-    __slots__ = ("__copy",)
+    __slots__ = ("__view",)
 
     def __init__(self, data):
-        """Creates a mongocrypt_binary_t from binary data."""
-        # mongocrypt_binary_t does not own the data it is passed so we need to
-        # create a copy to keep the data alive.
-        self.__copy = ffi.new("uint8_t[]", data)
+        """Creates a mongocrypt_binary_t from binary data.
+
+        :Parameters:
+          - `data`: An object supporting the buffer protocol. For example
+            bytes, bytearray, or memoryview. It is not copied, and must not
+            be modified while this object is open.
+        """
+        # mongocrypt_binary_t does not own the data it is passed, and
+        # libmongocrypt never writes to it. Point it at the caller's buffer
+        # and keep a reference so the buffer stays alive.
+        self.__view = ffi.from_buffer(data)
         super(MongoCryptBinaryIn, self).__init__(
-            lib.mongocrypt_binary_new_from_data(self.__copy, len(data)))
+            lib.mongocrypt_binary_new_from_data(
+                ffi.cast("uint8_t *", self.__view), len(self.__view)))
 
     def _close(self):
         """Cleanup resources."""
         super(MongoCryptBinaryIn, self)._close()
-        if self.__copy is None:
-            ffi.release(self.__copy)
-            self.__copy = None
+        if self.__view is not None:
+            ffi.release(self.__view)
+            self.__view = None
@@ -1009,6 +1009,28 @@ mongocrypt_setopt_crypto_hook_sign_rsaes_pkcs1_v1_5 (
    mongocrypt_t *crypt,
    mongocrypt_hmac_fn sign_rsaes_pkcs1_v1_5,
    void *sign_ctx);
+
+bool
+mongocrypt_is_crypto_available (void);
+
+typedef enum {
+   MONGOCRYPT_CRYPTO_PRIMITIVE_AES_256_CBC = 1,
+   MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512 = 2,
+   MONGOCRYPT_CRYPTO_PRIMITIVE_SHA_256 = 4,
+   MONGOCRYPT_CRYPTO_PRIMITIVE_RANDOM = 8,
+   MONGOCRYPT_CRYPTO_PRIMITIVE_ALL = 15
+} mongocrypt_crypto_primitive_t;
+
+bool
+mongocrypt_setopt_crypto_hooks_policy (mongocrypt_t *crypt, uint32_t native);
+
+bool
+mongocrypt_ctx_explicit_encrypt_batch_init (mongocrypt_ctx_t *ctx,
+                                            mongocrypt_binary_t *msgs);
+
+bool
+mongocrypt_ctx_decrypt_batch_init (mongocrypt_ctx_t *ctx,
+                                   mongocrypt_binary_t *docs);
 """)
 
 
@@ -12,7 +12,7 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
-from pymongocrypt.mongocrypt import MongoCrypt
+from pymongocrypt.mongocrypt import MongoCrypt, _bson_array_documents
 from pymongocrypt.state_machine import run_state_machine
 
 
@@ -161,6 +161,37 @@ class ExplicitEncrypter(object):
         with self.mongocrypt.explicit_encryption_context(value, opts) as ctx:
             return run_state_machine(ctx, self.callback)
 
+    def encrypt_many(self, values, algorithm, key_id=None,
+                     key_alt_name=None):
+        """Encrypts a list of BSON values with one key.
+
+        Unlike calling :meth:`encrypt` for each value, this runs a single
+        state machine, so the key is fetched and decrypted at most once.
+
+        Note that exactly one of ``key_id`` or  ``key_alt_name`` must be
+        provided.
+
+        :Parameters:
+          - `values`: A list of BSON values to encrypt, each as for
+            :meth:`encrypt`.
+          - `algorithm` (string): The encryption algorithm to use. See
+            :class:`Algorithm` for some valid options.
+          - `key_id` (bytes): The bytes of the binary subtype 4 ``_id`` data
+            key. For example, ``uuid.bytes`` or ``bytes(bson_binary)``.
+          - `key_alt_name` (string): Identifies a key vault document by
+            'keyAltName'.
+
+        :Returns:
+          A list of the encrypted BSON values, in the order of `values`.
+        """
+        if not values:
+            return []
+        opts = ExplicitEncryptOpts(algorithm, key_id, key_alt_name)
+        with self.mongocrypt.explicit_encryption_batch_context(
+                values, opts) as ctx:
+            encrypted = run_state_machine(ctx, self.callback)
+        return _bson_array_documents(encrypted)
+
     def decrypt(self, value):
         """Decrypts a BSON value.
 
@@ -174,6 +205,26 @@ class ExplicitEncrypter(object):
         with self.mongocrypt.explicit_decryption_context(value) as ctx:
             return run_state_machine(ctx, self.callback)
 
+    def decrypt_many(self, values):
+        """Decrypts a list of BSON values.
+
+        Unlike calling :meth:`decrypt` for each value, this runs a single
+        state machine, so the keys of all values are fetched together and
+        each is decrypted at most once.
+
+        :Parameters:
+          - `values`: A list of encoded documents to decrypt, each as for
+            :meth:`decrypt`.
+
+        :Returns:
+          A list of the decrypted BSON values, in the order of `values`.
+        """
+        if not values:
+            return []
+        with self.mongocrypt.explicit_decryption_batch_context(values) as ctx:
+            decrypted = run_state_machine(ctx, self.callback)
+        return _bson_array_documents(decrypted)
+
     def close(self):
         """Cleanup resources."""
         self.mongocrypt.close()
@@ -14,6 +14,7 @@
 
 import base64
 import copy
+import struct
 
 from pymongocrypt.binary import (MongoCryptBinaryIn,
                                  MongoCryptBinaryOut)
@@ -32,6 +33,54 @@ from pymongocrypt.crypto import (aes_256_cbc_encrypt,
                                  sign_rsaes_pkcs1_v1_5)
 
 
+def _crypto_available():
+    """Returns True if libmongocrypt was built with native crypto."""
+    try:
+        return bool(lib.mongocrypt_is_crypto_available())
+    except AttributeError:
+        # Older libmongocrypt versions lack this function.
+        return False
+
+
+def _bson_document(elements):
+    """Returns the BSON document made of the encoded elements."""
+    return struct.pack('<i', len(elements) + 5) + elements + b'\x00'
+
+
+def _bson_elements(document):
+    """Returns the encoded elements of a BSON document."""
+    return memoryview(document)[4:-1].tobytes()
+
+
+def _bson_string_element(name, value):
+    value = str_to_bytes(value)
+    return (b'\x02' + str_to_bytes(name) + b'\x00' +
+            struct.pack('<i', len(value) + 1) + value + b'\x00')
+
+
+def _bson_array(documents):
+    """Returns a BSON array of the encoded documents."""
+    elements = []
+    for i, document in enumerate(documents):
+        elements.append(b'\x03' + str_to_bytes(str(i)) + b'\x00' +
+                        memoryview(document).tobytes())
+    return _bson_document(b''.join(elements))
+
+
+def _bson_array_documents(array):
+    """Returns the encoded documents of a BSON array of documents."""
+    documents = []
+    pos = 4
+    while array[pos:pos + 1] != b'\x00':
+        if array[pos:pos + 1] != b'\x03':
+            raise MongoCryptError('expected an array of documents')
+        pos = array.index(b'\x00', pos + 1) + 1
+        length = struct.unpack('<i', array[pos:pos + 4])[0]
+        documents.append(array[pos:pos + length])
+        pos += length
+    return documents
+
+
 class MongoCryptOptions(object):
     def __init__(self, kms_providers, schema_map=None):
         """Options for :class:`MongoCrypt`.
@@ -190,6 +239,15 @@ class MongoCrypt(object):
                 self.__crypt, sign_rsaes_pkcs1_v1_5, ffi.NULL):
             self.__raise_from_status()
 
+        # cffi releases the GIL while libmongocrypt runs, but every crypto
+        # callback takes it back. When libmongocrypt has its own crypto, use
+        # it so that encryption and decryption run without the GIL. Only RSA
+        # signing, used to create KMS requests, still calls into Python.
+        if _crypto_available():
+            if not lib.mongocrypt_setopt_crypto_hooks_policy(
+                    self.__crypt, lib.MONGOCRYPT_CRYPTO_PRIMITIVE_ALL):
+                self.__raise_from_status()
+
         if not lib.mongocrypt_init(self.__crypt):
             self.__raise_from_status()
 
@@ -255,6 +313,21 @@ class MongoCrypt(object):
         """
         return ExplicitEncryptionContext(self._create_context(), value, opts)
 
+    def explicit_encryption_batch_context(self, values, opts):
+        """Creates a context to use for explicit encryption of many values.
+
+        :Parameters:
+          - `values`: A list of encoded documents to encrypt, each in the
+            form { "v" : BSON value to encrypt }}.
+          - `opts`: A :class:`ExplicitEncryptOpts`. The key and algorithm are
+            used for every value.
+
+        :Returns:
+          A :class:`ExplicitEncryptionBatchContext`.
+        """
+        return ExplicitEncryptionBatchContext(
+            self._create_context(), values, opts)
+
     def explicit_decryption_context(self, value):
         """Creates a context to use for explicit decryption.
 
@@ -267,6 +340,18 @@ class MongoCrypt(object):
         """
         return ExplicitDecryptionContext(self._create_context(), value)
 
+    def explicit_decryption_batch_context(self, values):
+        """Creates a context to use for explicit decryption of many values.
+
+        :Parameters:
+          - `values`: A list of encoded documents to decrypt, each in the
+            form { "v" : encrypted BSON value }}.
+
+        :Returns:
+          A :class:`ExplicitDecryptionBatchContext`.
+        """
+        return ExplicitDecryptionBatchContext(self._create_context(), values)
+
     def data_key_context(self, kms_provider, opts=None):
         """Creates a context to use for key generation.
 
@@ -475,6 +560,74 @@ class ExplicitDecryptionContext(MongoCryptContext):
             raise
 
 
+class ExplicitEncryptionBatchContext(MongoCryptContext):
+    __slots__ = ()
+
+    def __init__(self, ctx, values, opts):
+        """Abstracts libmongocrypt's mongocrypt_ctx_t type.
+
+        The keys of all values are fetched and decrypted together. finish()
+        returns a BSON array of { "v" : encrypted BSON value } documents, in
+        the order of `values`.
+
+        :Parameters:
+          - `ctx`: A mongocrypt_ctx_t. This MongoCryptContext takes ownership
+            of the underlying mongocrypt_ctx_t.
+          - `values`: A list of encoded documents to encrypt, each in the
+            form { "v" : BSON value to encrypt }}.
+          - `opts`: A :class:`ExplicitEncryptOpts`. Its `key_alt_name` is the
+            name itself, not a document.
+        """
+        super(ExplicitEncryptionBatchContext, self).__init__(ctx)
+        try:
+            options = _bson_string_element('algorithm', opts.algorithm)
+            if opts.key_id is not None:
+                options += (b'\x05keyId\x00' +
+                            struct.pack('<iB', len(opts.key_id), 4) +
+                            bytes(opts.key_id))
+            if opts.key_alt_name is not None:
+                options += _bson_string_element('keyAltName',
+                                                opts.key_alt_name)
+            msgs = _bson_array([_bson_document(_bson_elements(value) + options)
+                                for value in values])
+
+            with MongoCryptBinaryIn(msgs) as binary:
+                if not lib.mongocrypt_ctx_explicit_encrypt_batch_init(
+                        ctx, binary.bin):
+                    self._raise_from_status()
+        except Exception:
+            # Destroy the context on error.
+            self._close()
+            raise
+
+
+class ExplicitDecryptionBatchContext(MongoCryptContext):
+    __slots__ = ()
+
+    def __init__(self, ctx, values):
+        """Abstracts libmongocrypt's mongocrypt_ctx_t type.
+
+        The keys of all values are fetched and decrypted together. finish()
+        returns a BSON array of { "v" : decrypted BSON value } documents, in
+        the order of `values`.
+
+        :Parameters:
+          - `ctx`: A mongocrypt_ctx_t. This MongoCryptContext takes ownership
+            of the underlying mongocrypt_ctx_t.
+          - `values`: A list of encoded documents to decrypt, each in the
+            form { "v" : encrypted BSON value }}.
+        """
+        super(ExplicitDecryptionBatchContext, self).__init__(ctx)
+        try:
+            with MongoCryptBinaryIn(_bson_array(values)) as binary:
+                if not lib.mongocrypt_ctx_decrypt_batch_init(ctx, binary.bin):
+                    self._raise_from_status()
+        except Exception:
+            # Destroy the context on error.
+            self._close()
+            raise
+
+
 class DataKeyContext(MongoCryptContext):
     __slots__ = ()
 
@@ -12,6 +12,9 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import sys
+import threading
+
 from abc import abstractmethod
 
 from pymongocrypt.binding import lib
@@ -22,6 +25,10 @@ from pymongocrypt.errors import MongoCryptError
 class MongoCryptCallback(ABC):
     """Callback ABC to perform I/O on behalf of libbmongocrypt."""
 
+    #: The most KMS requests run at once, each on its own thread. When greater
+    #: than 1, :meth:`kms_request` must be thread-safe.
+    max_kms_workers = 1
+
     @abstractmethod
     def kms_request(self, kms_context):
         """Complete a KMS request.
@@ -107,6 +114,49 @@ class MongoCryptCallback(ABC):
         pass
 
 
+def _run_kms_requests(kms_contexts, callback):
+    """Complete the KMS requests, up to callback.max_kms_workers at once.
+
+    libmongocrypt allows the KMS contexts of one context to be fed
+    concurrently. The first exception raised by a request is re-raised once
+    the requests already started finish.
+    """
+    max_workers = getattr(callback, 'max_kms_workers', 1) or 1
+    if max_workers <= 1 or len(kms_contexts) <= 1:
+        for kms_ctx in kms_contexts:
+            callback.kms_request(kms_ctx)
+        return
+
+    pending = list(reversed(kms_contexts))
+    errors = []
+    lock = threading.Lock()
+
+    def worker():
+        while True:
+            with lock:
+                if errors or not pending:
+                    return
+                kms_ctx = pending.pop()
+            try:
+                callback.kms_request(kms_ctx)
+            except BaseException:
+                with lock:
+                    errors.append(sys.exc_info()[1])
+                return
+
+    # The calling thread is one of the workers.
+    threads = [threading.Thread(target=worker)
+               for _ in range(min(max_workers, len(kms_contexts)) - 1)]
+    for thread in threads:
+        thread.daemon = True
+        thread.start()
+    worker()
+    for thread in threads:
+        thread.join()
+    if errors:
+        raise errors[0]
+
+
 def run_state_machine(ctx, callback):
     """Run the libmongocrypt state machine until completion.
 
@@ -145,9 +195,12 @@ def run_state_machine(ctx, callback):
                 ctx.add_mongo_operation_result(key)
             ctx.complete_mongo_operation()
         elif state == lib.MONGOCRYPT_CTX_NEED_KMS:
-            for kms_ctx in ctx.kms_contexts():
-                with kms_ctx:
-                    callback.kms_request(kms_ctx)
+            kms_contexts = list(ctx.kms_contexts())
+            try:
+                _run_kms_requests(kms_contexts, callback)
+            finally:
+                for kms_ctx in kms_contexts:
+                    kms_ctx._close()
             ctx.complete_kms()
         else:
             raise MongoCryptError('unknown state: %r' % (state,))
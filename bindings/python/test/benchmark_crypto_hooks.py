@@ -0,0 +1,192 @@
+# Copyright 2021-present MongoDB, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Benchmark encryption and decryption with the Python crypto hooks and
+with libmongocrypt's native crypto.
+
+Usage: python test/benchmark_crypto_hooks.py [duration_secs]
+
+MongoCrypt uses native crypto when libmongocrypt has it, and the hooks in
+pymongocrypt.crypto otherwise. This benchmark runs both ways, to quantify the
+cost of calling into Python, and taking the GIL, for every primitive.
+
+No server or mongocryptd is needed: keys use the "local" KMS provider, and
+the callback answers key vault and mongocryptd requests from memory.
+Documents are encrypted and decrypted one per context, and BATCH_SIZE per
+context, as in a bulk insert or a cursor batch. Prints one JSON result per
+line.
+"""
+
+from __future__ import print_function
+
+import json
+import sys
+import timeit
+
+from bson import BSON
+from bson.binary import Binary, STANDARD
+from bson.codec_options import CodecOptions
+
+import pymongocrypt.mongocrypt
+from pymongocrypt.auto_encrypter import AutoEncrypter
+from pymongocrypt.explicit_encrypter import ExplicitEncrypter
+from pymongocrypt.mongocrypt import MongoCryptOptions
+from pymongocrypt.state_machine import MongoCryptCallback
+
+BATCH_SIZE = 100
+NS = 'bench.coll'
+RANDOM = 'AEAD_AES_256_CBC_HMAC_SHA_512-Random'
+OPTS = CodecOptions(uuid_representation=STANDARD)
+KMS_PROVIDERS = {'local': {'key': b'\x00' * 96}}
+
+
+class BenchCallback(MongoCryptCallback):
+    """Answers requests from memory."""
+    def __init__(self):
+        self.key_doc = None
+        self.mongocryptd_reply = None
+
+    def kms_request(self, kms_context):
+        raise AssertionError('the local KMS provider makes no requests')
+
+    def collection_info(self, database, filter):
+        raise AssertionError('the schema map is used')
+
+    def mark_command(self, database, cmd):
+        return self.mongocryptd_reply
+
+    def fetch_keys(self, filter):
+        return [self.key_doc]
+
+    def insert_data_key(self, data_key):
+        self.key_doc = data_key
+        return BSON(data_key).decode(OPTS)['_id']
+
+    def bson_encode(self, doc):
+        return BSON.encode(doc, codec_options=OPTS)
+
+    def close(self):
+        pass
+
+
+def make_document(i):
+    return {
+        '_id': i,
+        'name': 'Jane Doe',
+        'ssn': '457-55-5462',
+        'salary': 120000 + i,
+        'notes': 'n' * 200,
+        'address': {'street': '1 Main St', 'city': 'New York', 'zip': '10001'},
+    }
+
+
+def make_mongocryptd_reply(key_id, count):
+    """The command, with the encrypted fields replaced by markings."""
+    def mark(value):
+        marking = BSON.encode(
+            {'a': 2, 'v': value, 'ki': Binary(key_id.bytes, 4)})
+        return Binary(b'\x00' + marking, 6)
+
+    documents = []
+    for i in range(count):
+        doc = make_document(i)
+        for field in ('ssn', 'salary', 'notes'):
+            doc[field] = mark(doc[field])
+        documents.append(doc)
+    return BSON.encode({
+        'ok': 1,
+        'result': {'insert': 'coll', 'documents': documents},
+        'hasEncryptedPlaceholders': True,
+        'schemaRequiresEncryption': True})
+
+
+def make_schema_map(key_id):
+    def encrypted(bson_type):
+        return {'encrypt': {'bsonType': bson_type, 'algorithm': RANDOM,
+                            'keyId': [Binary(key_id.bytes, 4)]}}
+    return BSON.encode({NS: {
+        'bsonType': 'object',
+        'properties': {'ssn': encrypted('string'), 'salary': encrypted('int'),
+                       'notes': encrypted('string')}}})
+
+
+def measure(op, docs_per_op, duration):
+    """Run op for duration seconds, and return documents per second."""
+    op()  # warm the key cache
+    ops = 0
+    start = timeit.default_timer()
+    elapsed = 0
+    while elapsed < duration:
+        op()
+        ops += 1
+        elapsed = timeit.default_timer() - start
+    return ops * docs_per_op / elapsed
+
+
+def bench_mode(mode, callback, key_id, duration):
+    encrypter = AutoEncrypter(callback, MongoCryptOptions(
+        KMS_PROVIDERS, schema_map=make_schema_map(key_id)))
+    try:
+        for batch_size in (1, BATCH_SIZE):
+            callback.mongocryptd_reply = make_mongocryptd_reply(
+                key_id, batch_size)
+            cmd = BSON.encode({
+                'insert': 'coll',
+                'documents': [make_document(i) for i in range(batch_size)]})
+            encrypted = BSON(encrypter.encrypt('bench', cmd)).decode()
+            reply = BSON.encode({'ok': 1, 'cursor': {
+                'id': 0, 'ns': NS, 'firstBatch': encrypted['documents']}})
+
+            results = [
+                ('encrypt',
+                 measure(lambda: encrypter.encrypt('bench', cmd),
+                         batch_size, duration)),
+                ('decrypt',
+                 measure(lambda: encrypter.decrypt(reply),
+                         batch_size, duration))]
+            for op, docs_per_sec in results:
+                print(json.dumps({'op': op, 'mode': mode,
+                                  'batchSize': batch_size,
+                                  'docsPerSec': round(docs_per_sec)}))
+    finally:
+        encrypter.close()
+
+
+def main():
+    duration = float(sys.argv[1]) if len(sys.argv) > 1 else 2.0
+    callback = BenchCallback()
+    key_creator = ExplicitEncrypter(callback, MongoCryptOptions(KMS_PROVIDERS))
+    try:
+        key_id = key_creator.create_data_key('local')
+    finally:
+        key_creator.close()
+
+    crypto_available = pymongocrypt.mongocrypt._crypto_available
+    modes = [('hooks', lambda: False)]
+    if crypto_available():
+        modes.append(('native', crypto_available))
+    else:
+        print('libmongocrypt was built without native crypto, '
+              'only benchmarking the hooks', file=sys.stderr)
+    for mode, available in modes:
+        # MongoCrypt uses native crypto when this returns True.
+        pymongocrypt.mongocrypt._crypto_available = available
+        try:
+            bench_mode(mode, callback, key_id, duration)
+        finally:
+            pymongocrypt.mongocrypt._crypto_available = crypto_available
+
+
+if __name__ == '__main__':
+    main()
@@ -65,6 +65,12 @@ class TestMongoCryptBinary(unittest.TestCase):
             self.assertEqual(binary.to_bytes(), b'')
         self.assertIsNone(binary.bin)
 
+    def test_mongocrypt_binary_in_buffer_protocol(self):
+        for data in (bytearray(b'1\x0023'), memoryview(b'1\x0023')):
+            with MongoCryptBinaryIn(data) as binary:
+                self.assertEqual(binary.to_bytes(), b'1\x0023')
+            self.assertIsNone(binary.bin)
+
     def test_mongocrypt_binary_out(self):
         with MongoCryptBinaryOut() as binary:
             self.assertIsNotNone(binary.bin)
@@ -350,6 +356,63 @@ class TestMongoCryptCallback(unittest.TestCase):
             BSON(decrypted).decode(), json_data('command-reply.json'))
         self.assertEqual(decrypted, bson_data('command-reply.json'))
 
+    def test_decrypt_concurrent_kms(self):
+        callback = MockCallback(
+            list_colls_result=bson_data('collection-info.json'),
+            mongocryptd_reply=bson_data('mongocryptd-reply.json'),
+            key_docs=[bson_data('key-document.json')],
+            kms_reply=http_data('kms-reply.txt'))
+        callback.max_kms_workers = 4
+        encrypter = AutoEncrypter(callback, self.mongo_crypt_opts())
+        self.addCleanup(encrypter.close)
+        decrypted = encrypter.decrypt(
+            bson_data('encrypted-command-reply.json'))
+        self.assertEqual(decrypted, bson_data('command-reply.json'))
+
+    @unittest.skipUnless(sys.version_info[:2] >= (3, 5), "requires asyncio")
+    def test_decrypt_async(self):
+        import asyncio
+        from pymongocrypt.async_state_machine import run_state_machine
+
+        callback = AsyncMockCallback(
+            key_docs=[bson_data('key-document.json')],
+            kms_reply=http_data('kms-reply.txt'))
+        mc = MongoCrypt(self.mongo_crypt_opts(), callback)
+        self.addCleanup(mc.close)
+        loop = asyncio.new_event_loop()
+        self.addCleanup(loop.close)
+        with mc.decryption_context(
+                bson_data('encrypted-command-reply.json')) as ctx:
+            decrypted = loop.run_until_complete(
+                run_state_machine(ctx, callback))
+        self.assertEqual(decrypted, bson_data('command-reply.json'))
+        self.assertEqual(callback.kms_endpoint, 'kms.us-east-1.amazonaws.com')
+
+
+class AsyncMockCallback(MockCallback):
+    """Returns awaitables, as an AsyncMongoCryptCallback does."""
+
+    def kms_request(self, kms_context):
+        import asyncio
+        super(AsyncMockCallback, self).kms_request(kms_context)
+        return asyncio.sleep(0)
+
+    def fetch_keys(self, filter):
+        import asyncio
+        return asyncio.sleep(0, self.key_docs)
+
+
+class CountingCallback(MockCallback):
+    """Counts key vault queries."""
+
+    def __init__(self, **kwargs):
+        super(CountingCallback, self).__init__(**kwargs)
+        self.fetch_keys_calls = 0
+
+    def fetch_keys(self, filter):
+        self.fetch_keys_calls += 1
+        return super(CountingCallback, self).fetch_keys(filter)
+
 
 class KeyVaultCallback(MockCallback):
     def __init__(self, kms_reply=None):
@@ -399,6 +462,29 @@ class TestExplicitEncryption(unittest.TestCase):
         key_alt_name = json_data('key-document.json')['keyAltNames'][0]
         self._test_encrypt_decrypt(key_alt_name=key_alt_name)
 
+    def test_encrypt_decrypt_many(self):
+        callback = CountingCallback(
+            key_docs=[bson_data('key-document.json')],
+            kms_reply=http_data('kms-reply.txt'))
+        encrypter = ExplicitEncrypter(callback, self.mongo_crypt_opts())
+        self.addCleanup(encrypter.close)
+
+        vals = [BSON.encode({'v': 'hello'}), BSON.encode({'v': 'world'}),
+                BSON.encode({'v': 'hello'})]
+        algo = "AEAD_AES_256_CBC_HMAC_SHA_512-Deterministic"
+        key_id = json_data('key-document.json')['_id']
+        encrypted = encrypter.encrypt_many(vals, algo, key_id=key_id.bytes)
+        self.assertEqual(len(encrypted), 3)
+        self.assertEqual(encrypted[0], bson_data('encrypted-value.json'))
+        self.assertEqual(encrypted[0], encrypted[2])
+        self.assertNotEqual(encrypted[0], encrypted[1])
+        self.assertEqual(callback.fetch_keys_calls, 1)
+
+        self.assertEqual(encrypter.decrypt_many(encrypted), vals)
+        self.assertEqual(encrypter.encrypt_many([], algo, key_id=key_id.bytes),
+                         [])
+        self.assertEqual(encrypter.decrypt_many([]), [])
+
     def test_data_key_creation(self):
         mock_key_vault = KeyVaultCallback(
             kms_reply=http_data('kms-encrypt-reply.txt'))
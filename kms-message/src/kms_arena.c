@@ -0,0 +1,135 @@
+/*
+ * Copyright 2018-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "kms_arena.h"
+#include "kms_message_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Enough for any type a request stores. */
+#define KMS_ARENA_ALIGN 16
+
+static size_t
+aligned (size_t size)
+{
+   return (size + KMS_ARENA_ALIGN - 1) & ~((size_t) KMS_ARENA_ALIGN - 1);
+}
+
+static kms_arena_block_t *
+block_new (size_t size)
+{
+   kms_arena_block_t *block;
+
+   /* The data follows the block header. */
+   block = malloc (aligned (sizeof (kms_arena_block_t)) + size);
+   KMS_ASSERT (block);
+   block->next = NULL;
+   block->size = size;
+   block->used = 0;
+   block->data =
+      (unsigned char *) block + aligned (sizeof (kms_arena_block_t));
+   return block;
+}
+
+kms_arena_t *
+kms_arena_new (size_t initial_size)
+{
+   kms_arena_t *arena = malloc (sizeof (kms_arena_t));
+   KMS_ASSERT (arena);
+
+   arena->blocks = block_new (aligned (initial_size ? initial_size : 1));
+   arena->last = NULL;
+   return arena;
+}
+
+void
+kms_arena_destroy (kms_arena_t *arena)
+{
+   kms_arena_block_t *block, *next;
+
+   if (!arena) {
+      return;
+   }
+
+   for (block = arena->blocks; block; block = next) {
+      next = block->next;
+      free (block);
+   }
+   free (arena);
+}
+
+void *
+kms_arena_alloc (kms_arena_t *arena, size_t size)
+{
+   kms_arena_block_t *block = arena->blocks;
+
+   size = aligned (size ? size : 1);
+   if (block->size - block->used < size) {
+      /* Double the block size each time, so a request needs few blocks. */
+      size_t block_size = 2 * block->size;
+
+      while (block_size < size) {
+         block_size *= 2;
+      }
+      block = block_new (block_size);
+      block->next = arena->blocks;
+      arena->blocks = block;
+   }
+
+   arena->last = block->data + block->used;
+   block->used += size;
+   return arena->last;
+}
+
+void *
+kms_arena_realloc (kms_arena_t *arena,
+                   void *ptr,
+                   size_t old_size,
+                   size_t new_size)
+{
+   kms_arena_block_t *block = arena->blocks;
+   void *grown;
+
+   if (!ptr) {
+      return kms_arena_alloc (arena, new_size);
+   }
+
+   if (ptr == arena->last) {
+      size_t offset = (size_t) ((unsigned char *) ptr - block->data);
+
+      if (block->size - offset >= new_size) {
+         block->used = offset + aligned (new_size);
+         return ptr;
+      }
+   }
+
+   grown = kms_arena_alloc (arena, new_size);
+   memcpy (grown, ptr, old_size < new_size ? old_size : new_size);
+   return grown;
+}
+
+size_t
+kms_arena_size (const kms_arena_t *arena)
+{
+   const kms_arena_block_t *block;
+   size_t size = 0;
+
+   for (block = arena->blocks; block; block = block->next) {
+      size += block->size;
+   }
+   return size;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2018-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KMS_ARENA_H
+#define KMS_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Memory for the strings and lists of one request. Allocations are carved
+ * from a chain of blocks, never freed one by one, and all released by
+ * kms_arena_destroy. */
+typedef struct _kms_arena_block_t {
+   struct _kms_arena_block_t *next;
+   size_t size;
+   size_t used;
+   unsigned char *data;
+} kms_arena_block_t;
+
+typedef struct {
+   /* The block allocations are carved from. Earlier blocks follow it. */
+   kms_arena_block_t *blocks;
+   /* The most recent allocation, which can grow in place. */
+   void *last;
+} kms_arena_t;
+
+kms_arena_t *
+kms_arena_new (size_t initial_size);
+void
+kms_arena_destroy (kms_arena_t *arena);
+void *
+kms_arena_alloc (kms_arena_t *arena, size_t size);
+/* Returns @ptr grown to @new_size bytes, or a copy of its first @old_size
+ * bytes if it cannot grow in place. */
+void *
+kms_arena_realloc (kms_arena_t *arena,
+                   void *ptr,
+                   size_t old_size,
+                   size_t new_size);
+/* The bytes reserved by the arena's blocks. */
+size_t
+kms_arena_size (const kms_arena_t *arena);
+
+#endif /* KMS_ARENA_H */
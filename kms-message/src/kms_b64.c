@@ -129,28 +129,24 @@ kms_message_b64_ntop (uint8_t const *src,
    uint8_t output[4];
    size_t i;
 
+   /* Check the output size once, so whole quanta are encoded without
+    * per-character bounds checks. The terminator needs one more byte. */
+   if ((srclength + 2) / 3 * 4 >= targsize) {
+      return -1;
+   }
+
    while (2 < srclength) {
-      input[0] = *src++;
-      input[1] = *src++;
-      input[2] = *src++;
-      srclength -= 3;
+      uint32_t quantum;
 
-      output[0] = input[0] >> 2;
-      output[1] = ((input[0] & 0x03) << 4) + (input[1] >> 4);
-      output[2] = ((input[1] & 0x0f) << 2) + (input[2] >> 6);
-      output[3] = input[2] & 0x3f;
-      Assert (output[0] < 64);
-      Assert (output[1] < 64);
-      Assert (output[2] < 64);
-      Assert (output[3] < 64);
+      quantum = ((uint32_t) src[0] << 16) | ((uint32_t) src[1] << 8) | src[2];
+      src += 3;
+      srclength -= 3;
 
-      if (datalength + 4 > targsize) {
-         return -1;
-      }
-      target[datalength++] = Base64[output[0]];
-      target[datalength++] = Base64[output[1]];
-      target[datalength++] = Base64[output[2]];
-      target[datalength++] = Base64[output[3]];
+      target[datalength] = Base64[quantum >> 18];
+      target[datalength + 1] = Base64[(quantum >> 12) & 0x3f];
+      target[datalength + 2] = Base64[(quantum >> 6) & 0x3f];
+      target[datalength + 3] = Base64[quantum & 0x3f];
+      datalength += 4;
    }
 
    /* Now we worry about padding. */
@@ -291,6 +287,26 @@ kms_message_b64_initialize_rmap (void)
       b64rmap[(uint8_t) Base64[i]] = i;
 }
 
+/* Read four base64 characters at @src into the low 24 bits of @quantum.
+ * Returns false if any is not a base64 character, which includes the NULL
+ * terminator, so this never reads past the end of @src. */
+static int
+b64_quantum (char const *src, uint32_t *quantum)
+{
+   uint8_t ofs;
+   int i;
+
+   *quantum = 0;
+   for (i = 0; i < 4; i++) {
+      ofs = b64rmap[(uint8_t) src[i]];
+      if (ofs >= b64rmap_special) {
+         return 0;
+      }
+      *quantum = (*quantum << 6) | ofs;
+   }
+   return 1;
+}
+
 static int
 b64_pton_do (char const *src, uint8_t *target, size_t targsize)
 {
@@ -301,6 +317,23 @@ b64_pton_do (char const *src, uint8_t *target, size_t targsize)
    tarindex = 0;
 
    while (1) {
+      if (state == 0) {
+         /* Decode whole quanta with one table lookup per character. The
+          * state machine below handles whitespace, padding, and the end. */
+         while ((size_t) tarindex + 3 <= targsize) {
+            uint32_t quantum;
+
+            if (!b64_quantum (src, &quantum)) {
+               break;
+            }
+            target[tarindex] = (uint8_t) (quantum >> 16);
+            target[tarindex + 1] = (uint8_t) (quantum >> 8);
+            target[tarindex + 2] = (uint8_t) quantum;
+            tarindex += 3;
+            src += 4;
+         }
+      }
+
       ch = *src++;
       ofs = b64rmap[ch];
 
@@ -417,6 +450,15 @@ b64_pton_len (char const *src)
    tarindex = 0;
 
    while (1) {
+      if (state == 0) {
+         uint32_t quantum;
+
+         while (b64_quantum (src, &quantum)) {
+            tarindex += 3;
+            src += 4;
+         }
+      }
+
       ch = *src++;
       ofs = b64rmap[ch];
 
@@ -25,6 +25,45 @@
 #define JWT_EXPIRATION_SECS 5 * 60
 #define SIGNATURE_LEN 256
 
+/* Add the headers and payload of an oauth request carrying @assertion. */
+static bool
+_oauth_request_init (kms_request_t *req,
+                     const char *host,
+                     const char *assertion)
+{
+   kms_request_str_t *str;
+   char *payload;
+   bool ret = false;
+
+   req->assertion = strdup (assertion);
+   str =
+      kms_request_str_new_from_chars ("grant_type=urn%3Aietf%3Aparams%3Aoauth%"
+                                      "3Agrant-type%3Ajwt-bearer&assertion=",
+                                      -1);
+   kms_request_str_append_chars (str, assertion, -1);
+   payload = kms_request_str_detach (str);
+
+   if (!kms_request_add_header_field (
+          req, "Content-Type", "application/x-www-form-urlencoded")) {
+      goto done;
+   }
+   if (!kms_request_add_header_field (req, "Host", host)) {
+      goto done;
+   }
+   if (!kms_request_add_header_field (req, "Accept", "application/json")) {
+      goto done;
+   }
+
+   if (!kms_request_append_payload (req, payload, strlen (payload))) {
+      goto done;
+   }
+
+   ret = true;
+done:
+   free (payload);
+   return ret;
+}
+
 kms_request_t *
 kms_gcp_request_oauth_new (const char *host,
                            const char *email,
@@ -44,7 +83,6 @@ kms_gcp_request_oauth_new (const char *host,
    uint8_t *jwt_signature = NULL;
    char *jwt_signature_b64url = NULL;
    char *jwt_assertion_b64url = NULL;
-   char *payload = NULL;
 
    req = kms_request_new ("POST", "/token", opt);
    if (opt->provider != KMS_REQUEST_PROVIDER_GCP) {
@@ -113,25 +151,7 @@ kms_gcp_request_oauth_new (const char *host,
                             jwt_signature_b64url);
    jwt_assertion_b64url = kms_request_str_detach (str);
 
-   str =
-      kms_request_str_new_from_chars ("grant_type=urn%3Aietf%3Aparams%3Aoauth%"
-                                      "3Agrant-type%3Ajwt-bearer&assertion=",
-                                      -1);
-   kms_request_str_append_chars (str, jwt_assertion_b64url, -1);
-   payload = kms_request_str_detach (str);
-
-   if (!kms_request_add_header_field (
-          req, "Content-Type", "application/x-www-form-urlencoded")) {
-      goto done;
-   }
-   if (!kms_request_add_header_field (req, "Host", host)) {
-      goto done;
-   }
-   if (!kms_request_add_header_field (req, "Accept", "application/json")) {
-      goto done;
-   }
-
-   if (!kms_request_append_payload (req, payload, strlen (payload))) {
+   if (!_oauth_request_init (req, host, jwt_assertion_b64url)) {
       goto done;
    }
 
@@ -141,10 +161,36 @@ done:
    free (jwt_claims_b64url);
    free (jwt_header_and_claims_b64url);
    free (jwt_assertion_b64url);
-   free (payload);
    return req;
 }
 
+kms_request_t *
+kms_gcp_request_oauth_new_from_assertion (const char *host,
+                                          const char *assertion,
+                                          const kms_request_opt_t *opt)
+{
+   kms_request_t *req;
+
+   req = kms_request_new ("POST", "/token", opt);
+   if (opt->provider != KMS_REQUEST_PROVIDER_GCP) {
+      KMS_ERROR (req, "Expected KMS request with provider type: GCP");
+      return req;
+   }
+
+   if (kms_request_get_error (req)) {
+      return req;
+   }
+
+   (void) _oauth_request_init (req, host, assertion);
+   return req;
+}
+
+const char *
+kms_gcp_request_oauth_get_assertion (kms_request_t *req)
+{
+   return req->assertion;
+}
+
 static kms_request_t *
 _encrypt_decrypt_common (const char *encrypt_decrypt,
                          const char *host,
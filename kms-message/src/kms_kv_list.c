@@ -23,10 +23,13 @@
 #include "sort.h"
 
 static void
-kv_init (kms_kv_t *kv, kms_request_str_t *key, kms_request_str_t *value)
+kv_init (kms_arena_t *arena,
+         kms_kv_t *kv,
+         kms_request_str_t *key,
+         kms_request_str_t *value)
 {
-   kv->key = kms_request_str_dup (key);
-   kv->value = kms_request_str_dup (value);
+   kv->key = kms_request_str_dup_in (arena, key);
+   kv->value = kms_request_str_dup_in (arena, value);
 }
 
 static void
@@ -36,21 +39,56 @@ kv_cleanup (kms_kv_t *kv)
    kms_request_str_destroy (kv->value);
 }
 
+static void *
+list_alloc (kms_arena_t *arena, size_t size)
+{
+   void *ptr = arena ? kms_arena_alloc (arena, size) : malloc (size);
+   KMS_ASSERT (ptr);
+   return ptr;
+}
+
+static void *
+list_realloc (kms_arena_t *arena, void *ptr, size_t old_size, size_t size)
+{
+   if (arena) {
+      ptr = kms_arena_realloc (arena, ptr, old_size, size);
+   } else {
+      ptr = realloc (ptr, size);
+   }
+   KMS_ASSERT (ptr);
+   return ptr;
+}
+
 kms_kv_list_t *
-kms_kv_list_new (void)
+kms_kv_list_new_in (kms_arena_t *arena)
 {
-   kms_kv_list_t *lst = malloc (sizeof (kms_kv_list_t));
-   KMS_ASSERT (lst);
+   kms_kv_list_t *lst = list_alloc (arena, sizeof (kms_kv_list_t));
 
+   lst->arena = arena;
    lst->size = 16;
-   lst->kvs = malloc (lst->size * sizeof (kms_kv_t));
-   KMS_ASSERT (lst->kvs);
+   lst->kvs = list_alloc (arena, lst->size * sizeof (kms_kv_t));
+   lst->sorted = NULL;
 
    lst->len = 0;
 
    return lst;
 }
 
+kms_kv_list_t *
+kms_kv_list_new_indexed_in (kms_arena_t *arena)
+{
+   kms_kv_list_t *lst = kms_kv_list_new_in (arena);
+
+   lst->sorted = list_alloc (arena, lst->size * sizeof (size_t));
+   return lst;
+}
+
+kms_kv_list_t *
+kms_kv_list_new (void)
+{
+   return kms_kv_list_new_in (NULL);
+}
+
 void
 kms_kv_list_destroy (kms_kv_list_t *lst)
 {
@@ -60,27 +98,127 @@ kms_kv_list_destroy (kms_kv_list_t *lst)
       return;
    }
 
+   /* Stolen strings may not be from the arena. */
    for (i = 0; i < lst->len; i++) {
       kv_cleanup (&lst->kvs[i]);
    }
 
+   if (lst->arena) {
+      return;
+   }
+
+   free (lst->sorted);
    free (lst->kvs);
    free (lst);
 }
 
+static const char *
+sorted_key (const kms_kv_list_t *lst, size_t i)
+{
+   return lst->kvs[lst->sorted[i]].key->str;
+}
+
+/* The first of the n first index entries whose key is not less than key,
+ * or n. With upper, the first whose key is greater. */
+static size_t
+index_search (const kms_kv_list_t *lst, size_t n, const char *key, bool upper)
+{
+   size_t lo = 0;
+   size_t hi = n;
+   size_t mid;
+   int cmp;
+
+   while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      cmp = kms_strcasecmp (sorted_key (lst, mid), key);
+      if (cmp < 0 || (upper && cmp == 0)) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+
+   return lo;
+}
+
+/* Adds the last pair to the index, after any pairs with an equal key. */
+static void
+index_add_last (kms_kv_list_t *lst)
+{
+   size_t n = lst->len - 1;
+   size_t pos;
+
+   if (!lst->sorted) {
+      return;
+   }
+
+   pos = index_search (lst, n, lst->kvs[n].key->str, true);
+   memmove (&lst->sorted[pos + 1],
+            &lst->sorted[pos],
+            sizeof (size_t) * (n - pos));
+   lst->sorted[pos] = n;
+}
+
+/* Removes the pair at kvs position "removed" from the index. Call before
+ * the pair is removed from kvs. */
+static void
+index_remove (kms_kv_list_t *lst, size_t removed)
+{
+   size_t i;
+   size_t j = 0;
+
+   if (!lst->sorted) {
+      return;
+   }
+
+   for (i = 0; i < lst->len; i++) {
+      if (lst->sorted[i] == removed) {
+         continue;
+      }
+
+      lst->sorted[j++] = lst->sorted[i] - (lst->sorted[i] > removed ? 1 : 0);
+   }
+}
+
+static kms_kv_t *
+kv_list_append (kms_kv_list_t *lst)
+{
+   if (lst->len == lst->size) {
+      lst->kvs = list_realloc (lst->arena,
+                               lst->kvs,
+                               lst->size * sizeof (kms_kv_t),
+                               2 * lst->size * sizeof (kms_kv_t));
+      if (lst->sorted) {
+         lst->sorted = list_realloc (lst->arena,
+                                     lst->sorted,
+                                     lst->size * sizeof (size_t),
+                                     2 * lst->size * sizeof (size_t));
+      }
+      lst->size *= 2;
+   }
+
+   return &lst->kvs[lst->len++];
+}
+
 void
 kms_kv_list_add (kms_kv_list_t *lst,
                  kms_request_str_t *key,
                  kms_request_str_t *value)
 {
-   if (lst->len == lst->size) {
-      lst->size *= 2;
-      lst->kvs = realloc (lst->kvs, lst->size * sizeof (kms_kv_t));
-      KMS_ASSERT (lst->kvs);
-   }
+   kv_init (lst->arena, kv_list_append (lst), key, value);
+   index_add_last (lst);
+}
+
+void
+kms_kv_list_add_stolen (kms_kv_list_t *lst,
+                        kms_request_str_t *key,
+                        kms_request_str_t *value)
+{
+   kms_kv_t *kv = kv_list_append (lst);
 
-   kv_init (&lst->kvs[lst->len], key, value);
-   ++lst->len;
+   kv->key = key;
+   kv->value = value;
+   index_add_last (lst);
 }
 
 const kms_kv_t *
@@ -88,6 +226,15 @@ kms_kv_list_find (const kms_kv_list_t *lst, const char *key)
 {
    size_t i;
 
+   if (lst->sorted) {
+      i = index_search (lst, lst->len, key, false);
+      if (i < lst->len && 0 == kms_strcasecmp (sorted_key (lst, i), key)) {
+         return &lst->kvs[lst->sorted[i]];
+      }
+
+      return NULL;
+   }
+
    for (i = 0; i < lst->len; i++) {
       if (0 == kms_strcasecmp (lst->kvs[i].key->str, key)) {
          return &lst->kvs[i];
@@ -105,6 +252,7 @@ kms_kv_list_del (kms_kv_list_t *lst, const char *key)
    for (i = 0; i < lst->len; i++) {
       if (0 == strcmp (lst->kvs[i].key->str, key)) {
          kv_cleanup (&lst->kvs[i]);
+         index_remove (lst, i);
          memmove (&lst->kvs[i],
                   &lst->kvs[i + 1],
                   sizeof (kms_kv_t) * (lst->len - i - 1));
@@ -120,28 +268,40 @@ kms_kv_list_dup (const kms_kv_list_t *lst)
    size_t i;
 
    if (lst->len == 0) {
-      return kms_kv_list_new ();
+      return lst->sorted ? kms_kv_list_new_indexed_in (lst->arena)
+                         : kms_kv_list_new_in (lst->arena);
    }
 
-   dup = malloc (sizeof (kms_kv_list_t));
-   KMS_ASSERT (dup);
+   dup = list_alloc (lst->arena, sizeof (kms_kv_list_t));
 
+   dup->arena = lst->arena;
    dup->size = dup->len = lst->len;
-   dup->kvs = malloc (lst->len * sizeof (kms_kv_t));
-   KMS_ASSERT (dup->kvs);
-
+   dup->kvs = list_alloc (lst->arena, lst->len * sizeof (kms_kv_t));
+   dup->sorted = NULL;
+   if (lst->sorted) {
+      dup->sorted = list_alloc (lst->arena, lst->len * sizeof (size_t));
+      memcpy (dup->sorted, lst->sorted, lst->len * sizeof (size_t));
+   }
 
    for (i = 0; i < lst->len; i++) {
-      kv_init (&dup->kvs[i], lst->kvs[i].key, lst->kvs[i].value);
+      kv_init (lst->arena, &dup->kvs[i], lst->kvs[i].key, lst->kvs[i].value);
    }
 
    return dup;
 }
 
+const kms_kv_t *
+kms_kv_list_sorted_at (const kms_kv_list_t *lst, size_t i)
+{
+   KMS_ASSERT (lst->sorted);
+   KMS_ASSERT (i < lst->len);
+   return &lst->kvs[lst->sorted[i]];
+}
 
 void
 kms_kv_list_sort (kms_kv_list_t *lst, int (*cmp) (const void *, const void *))
 {
+   KMS_ASSERT (!lst->sorted);
    /* A stable sort is required to sort headers when creating canonical
     * requests. qsort is not stable. */
    insertionsort (
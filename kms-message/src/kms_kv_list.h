@@ -34,22 +34,46 @@ typedef struct {
    kms_kv_t *kvs;
    size_t len;
    size_t size;
+   /* If set, the list and the strings it copies are allocated from arena. */
+   kms_arena_t *arena;
+   /* If not NULL, the positions of kvs ordered by key, compared without case.
+    * Equal keys keep the order they were added in. kvs itself stays in the
+    * order the pairs were added. */
+   size_t *sorted;
 } kms_kv_list_t;
 
 kms_kv_list_t *
 kms_kv_list_new (void);
+/* Like kms_kv_list_new, but allocates from @arena if it is not NULL. */
+kms_kv_list_t *
+kms_kv_list_new_in (kms_arena_t *arena);
+/* Like kms_kv_list_new_in, but keeps an index by key so that
+ * kms_kv_list_find is a binary search and kms_kv_list_sorted_at visits the
+ * pairs in key order without copying or sorting the list. */
+kms_kv_list_t *
+kms_kv_list_new_indexed_in (kms_arena_t *arena);
 void
 kms_kv_list_destroy (kms_kv_list_t *lst);
 void
 kms_kv_list_add (kms_kv_list_t *lst,
                  kms_request_str_t *key,
                  kms_request_str_t *value);
+/* Like kms_kv_list_add, but takes ownership of key and value. */
+void
+kms_kv_list_add_stolen (kms_kv_list_t *lst,
+                        kms_request_str_t *key,
+                        kms_request_str_t *value);
 const kms_kv_t *
 kms_kv_list_find (const kms_kv_list_t *lst, const char *key);
 void
 kms_kv_list_del (kms_kv_list_t *lst, const char *key);
+/* The i'th pair in key order. @lst must be indexed. */
+const kms_kv_t *
+kms_kv_list_sorted_at (const kms_kv_list_t *lst, size_t i);
+/* The copy is allocated from the same arena as @lst, if any. */
 kms_kv_list_t *
 kms_kv_list_dup (const kms_kv_list_t *lst);
+/* Sorts kvs in place. @lst must not be indexed. */
 void
 kms_kv_list_sort (kms_kv_list_t *lst, int (*cmp) (const void *, const void *));
 
@@ -55,6 +55,33 @@ kms_gcp_request_oauth_new (const char *host,
                            size_t private_key_len,
                            const kms_request_opt_t *opt);
 
+/* Constructs an oauth client credentials request for GCP with a JSON Web
+ * Token that was already signed. The JWT is valid for five minutes after
+ * it was signed, so a JWT taken from an earlier request with
+ * kms_gcp_request_oauth_get_assertion may be reused for that long without
+ * signing again.
+ *
+ * Parameters:
+ * - host: The host header, like "oauth2.googleapis.com".
+ * - assertion: The signed JWT, as returned by
+ *   kms_gcp_request_oauth_get_assertion.
+ * - opt: Request options. The provider must be set to KMS_REQUEST_PROVIDER_GCP
+ *   with kms_request_opt_set_provider.
+ *
+ * Returns: A new kms_request_t.
+ * Always returns a new kms_request_t, even on error.
+ * Caller must check if an error occurred by calling kms_request_get_error.
+ */
+KMS_MSG_EXPORT (kms_request_t *)
+kms_gcp_request_oauth_new_from_assertion (const char *host,
+                                          const char *assertion,
+                                          const kms_request_opt_t *opt);
+
+/* Returns the signed JWT of an oauth request, or NULL if @req is not a GCP
+ * oauth request. The returned string is owned by @req. */
+KMS_MSG_EXPORT (const char *)
+kms_gcp_request_oauth_get_assertion (kms_request_t *req);
+
 /* Constructs the encrypt request for GCP.
  * See
  * https://cloud.google.com/kms/docs/encrypt-decrypt#kms-encrypt-symmetric-api
@@ -79,6 +79,11 @@ KMS_MSG_EXPORT (char *)
 kms_request_get_string_to_sign (kms_request_t *request);
 KMS_MSG_EXPORT (bool)
 kms_request_get_signing_key (kms_request_t *request, unsigned char *key);
+/* Use a 32 byte signing key previously returned by
+ * kms_request_get_signing_key for a request with the same secret key, date,
+ * region, and service, instead of deriving it again. */
+KMS_MSG_EXPORT (bool)
+kms_request_set_signing_key (kms_request_t *request, const unsigned char *key);
 KMS_MSG_EXPORT (char *)
 kms_request_get_signature (kms_request_t *request);
 KMS_MSG_EXPORT (char *)
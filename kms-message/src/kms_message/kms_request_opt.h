@@ -48,6 +48,13 @@ KMS_MSG_EXPORT (void)
 kms_request_opt_set_connection_close (kms_request_opt_t *opt,
                                       bool connection_close);
 
+/* If true, a request allocates its headers, canonical forms and signature
+ * from one growing arena, freed by kms_request_destroy, instead of many
+ * small allocations. Strings returned to the caller are still freed with
+ * kms_request_free_string. Defaults to false. */
+KMS_MSG_EXPORT (void)
+kms_request_opt_set_arena (kms_request_opt_t *opt, bool use_arena);
+
 KMS_MSG_EXPORT (void)
 kms_request_opt_set_crypto_hooks (kms_request_opt_t *opt,
                                   bool (*sha256) (void *ctx,
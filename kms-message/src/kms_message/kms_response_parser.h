@@ -41,6 +41,18 @@ kms_response_parser_feed (kms_response_parser_t *parser,
                           uint8_t *buf,
                           uint32_t len);
 
+/* Returns space for @len bytes after the bytes fed so far, so a response can
+ * be read into the parser without copying it through another buffer. Call
+ * kms_response_parser_commit with the number of bytes written. The space is
+ * valid until the next call on @parser. */
+KMS_MSG_EXPORT (uint8_t *)
+kms_response_parser_reserve (kms_response_parser_t *parser, uint32_t len);
+
+/* Parses @len bytes written to the space from kms_response_parser_reserve,
+ * like kms_response_parser_feed. @len must not exceed what was reserved. */
+KMS_MSG_EXPORT (bool)
+kms_response_parser_commit (kms_response_parser_t *parser, uint32_t len);
+
 KMS_MSG_EXPORT (kms_response_t *)
 kms_response_parser_get_response (kms_response_parser_t *parser);
 
@@ -35,15 +35,25 @@ struct _kms_request_t {
    kms_request_str_t *secret_key;
    kms_request_str_t *datetime;
    kms_request_str_t *date;
+   /* Set by kms_request_set_signing_key, so it is not derived again. */
+   unsigned char signing_key[32];
+   bool has_signing_key;
    /* End: AWS specific */
+   /* Begin: GCP specific */
+   /* The signed JWT of an oauth request. */
+   char *assertion;
+   /* End: GCP specific */
    kms_request_str_t *method;
    kms_request_str_t *path;
    kms_request_str_t *query;
    kms_request_str_t *payload;
    kms_kv_list_t *query_params;
+   /* Indexed, so it is visited sorted by name for signing and serializing. */
    kms_kv_list_t *header_fields;
    /* turn off for tests only, not in public kms_request_opt_t API */
    bool auto_content_length;
+   /* If set, the strings and lists of the request are allocated from it. */
+   kms_arena_t *arena;
    _kms_crypto_t crypto;
    kms_request_provider_t provider;
 };
@@ -51,7 +61,12 @@ struct _kms_request_t {
 struct _kms_response_t {
    int status;
    kms_kv_list_t *headers;
+   /* Points to body_view, or NULL if no body was parsed. */
    kms_request_str_t *body;
+   /* A view of the body inside raw. Not separately allocated. */
+   kms_request_str_t body_view;
+   /* The bytes received, handed over from the parser. */
+   kms_request_str_t *raw;
 };
 
 typedef enum {
@@ -70,6 +85,11 @@ struct _kms_response_parser_t {
    kms_request_str_t *raw_response;
    int content_length;
    int start; /* start of the current thing getting parsed. */
+   /* The body is kept in raw_response at body_start. Chunks are moved down
+    * to follow one another as they are parsed. body_start is -1 until the
+    * body (or the first chunk) is parsed. */
+   int body_start;
+   int body_len;
 
    /* Support two types of HTTP 1.1 responses.
     * - "Content-Length: x" header is present, indicating the body length.
@@ -79,6 +99,9 @@ struct _kms_response_parser_t {
    bool transfer_encoding_chunked;
    int chunk_size;
    kms_response_parser_state_t state;
+   /* Bytes of raw_response after its end that the caller may write into, from
+    * kms_response_parser_reserve. 0 if nothing is reserved. */
+   uint32_t reserved;
 };
 
 #define CHECK_FAILED         \
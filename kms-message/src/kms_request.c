@@ -21,10 +21,13 @@
 #include "kms_request_opt_private.h"
 #include "kms_port.h"
 
+/* Enough for the headers and signature of a typical KMS request. */
+#define KMS_REQUEST_ARENA_SIZE 4096
+
 static kms_kv_list_t *
-parse_query_params (kms_request_str_t *q)
+parse_query_params (kms_arena_t *arena, kms_request_str_t *q)
 {
-   kms_kv_list_t *lst = kms_kv_list_new ();
+   kms_kv_list_t *lst = kms_kv_list_new_in (arena);
    char *p = q->str;
    char *end = q->str + q->len;
    char *amp, *equals;
@@ -41,8 +44,9 @@ parse_query_params (kms_request_str_t *q)
          amp = end;
       }
 
-      k = kms_request_str_new_from_chars (p, equals - p);
-      v = kms_request_str_new_from_chars (equals + 1, amp - equals - 1);
+      k = kms_request_str_new_from_chars_in (arena, p, equals - p);
+      v = kms_request_str_new_from_chars_in (
+         arena, equals + 1, amp - equals - 1);
       kms_kv_list_add (lst, k, v);
       kms_request_str_destroy (k);
       kms_request_str_destroy (v);
@@ -60,8 +64,13 @@ kms_request_new (const char *method,
 {
    kms_request_t *request = calloc (1, sizeof (kms_request_t));
    const char *question_mark;
+   kms_arena_t *arena = NULL;
 
    KMS_ASSERT (request);
+   if (opt && opt->use_arena) {
+      arena = kms_arena_new (KMS_REQUEST_ARENA_SIZE);
+   }
+   request->arena = arena;
    if (opt && opt->provider) {
       request->provider = opt->provider;
    } else {
@@ -71,31 +80,33 @@ kms_request_new (const char *method,
    request->failed = false;
 
    request->finalized = false;
-   request->region = kms_request_str_new ();
-   request->service = kms_request_str_new ();
-   request->access_key_id = kms_request_str_new ();
-   request->secret_key = kms_request_str_new ();
+   request->region = kms_request_str_new_in (arena);
+   request->service = kms_request_str_new_in (arena);
+   request->access_key_id = kms_request_str_new_in (arena);
+   request->secret_key = kms_request_str_new_in (arena);
 
    question_mark = strchr (path_and_query, '?');
    if (question_mark) {
-      request->path = kms_request_str_new_from_chars (
-         path_and_query, question_mark - path_and_query);
-      request->query = kms_request_str_new_from_chars (question_mark + 1, -1);
-      request->query_params = parse_query_params (request->query);
+      request->path = kms_request_str_new_from_chars_in (
+         arena, path_and_query, question_mark - path_and_query);
+      request->query =
+         kms_request_str_new_from_chars_in (arena, question_mark + 1, -1);
+      request->query_params = parse_query_params (arena, request->query);
       if (!request->query_params) {
          KMS_ERROR (request, "Cannot parse query: %s", request->query->str);
       }
    } else {
-      request->path = kms_request_str_new_from_chars (path_and_query, -1);
-      request->query = kms_request_str_new ();
-      request->query_params = kms_kv_list_new ();
+      request->path =
+         kms_request_str_new_from_chars_in (arena, path_and_query, -1);
+      request->query = kms_request_str_new_in (arena);
+      request->query_params = kms_kv_list_new_in (arena);
    }
 
-   request->payload = kms_request_str_new ();
-   request->date = kms_request_str_new ();
-   request->datetime = kms_request_str_new ();
-   request->method = kms_request_str_new_from_chars (method, -1);
-   request->header_fields = kms_kv_list_new ();
+   request->payload = kms_request_str_new_in (arena);
+   request->date = kms_request_str_new_in (arena);
+   request->datetime = kms_request_str_new_in (arena);
+   request->method = kms_request_str_new_from_chars_in (arena, method, -1);
+   request->header_fields = kms_kv_list_new_indexed_in (arena);
    request->auto_content_length = true;
 
    /* For AWS KMS requests, add a X-Amz-Date header. */
@@ -135,6 +146,8 @@ kms_request_destroy (kms_request_t *request)
    kms_request_str_destroy (request->date);
    kms_kv_list_destroy (request->query_params);
    kms_kv_list_destroy (request->header_fields);
+   kms_arena_destroy (request->arena);
+   free (request->assertion);
    free (request);
 }
 
@@ -222,8 +235,8 @@ kms_request_add_header_field (kms_request_t *request,
 
    CHECK_FAILED;
 
-   k = kms_request_str_new_from_chars (field_name, -1);
-   v = kms_request_str_new_from_chars (value, -1);
+   k = kms_request_str_new_from_chars_in (request->arena, field_name, -1);
+   v = kms_request_str_new_from_chars_in (request->arena, value, -1);
    kms_kv_list_add (request->header_fields, k, v);
    kms_request_str_destroy (k);
    kms_request_str_destroy (v);
@@ -309,12 +322,26 @@ append_canonical_query (kms_request_t *request, kms_request_str_t *str)
    kms_kv_list_destroy (lst);
 }
 
-/* "lst" is a sorted list of headers */
+/* docs.aws.amazon.com/general/latest/gr/sigv4-create-canonical-request.html
+ *
+ * "Build the canonical headers list by sorting the (lowercase) headers by
+ * character code... Do not sort the values in headers that have multiple
+ * values."
+ *
+ * header_fields is indexed, so it is visited in that order without sorting.
+ * The Connection header is not signed.
+ */
+static bool
+is_signed_header (const kms_kv_t *kv)
+{
+   return 0 != kms_strcasecmp (kv->key->str, "connection");
+}
+
 static void
-append_canonical_headers (kms_kv_list_t *lst, kms_request_str_t *str)
+append_canonical_headers (const kms_kv_list_t *lst, kms_request_str_t *str)
 {
    size_t i;
-   kms_kv_t *kv;
+   const kms_kv_t *kv;
    const kms_request_str_t *previous_key = NULL;
 
    /* aws docs: "To create the canonical headers list, convert all header names
@@ -322,7 +349,11 @@ append_canonical_headers (kms_kv_list_t *lst, kms_request_str_t *str)
     * sequential spaces in the header value to a single space." "Do not sort the
     * values in headers that have multiple values." */
    for (i = 0; i < lst->len; i++) {
-      kv = &lst->kvs[i];
+      kv = kms_kv_list_sorted_at (lst, i);
+      if (!is_signed_header (kv)) {
+         continue;
+      }
+
       if (previous_key &&
           0 == kms_strcasecmp (previous_key->str, kv->key->str)) {
          /* duplicate header */
@@ -331,7 +362,7 @@ append_canonical_headers (kms_kv_list_t *lst, kms_request_str_t *str)
          continue;
       }
 
-      if (i > 0) {
+      if (previous_key) {
          kms_request_str_append_newline (str);
       }
 
@@ -345,30 +376,30 @@ append_canonical_headers (kms_kv_list_t *lst, kms_request_str_t *str)
 }
 
 static void
-append_signed_headers (kms_kv_list_t *lst, kms_request_str_t *str)
+append_signed_headers (const kms_kv_list_t *lst, kms_request_str_t *str)
 {
    size_t i;
 
-   kms_kv_t *kv;
+   const kms_kv_t *kv;
    const kms_request_str_t *previous_key = NULL;
 
    for (i = 0; i < lst->len; i++) {
-      kv = &lst->kvs[i];
-      if (previous_key &&
-          0 == kms_strcasecmp (previous_key->str, kv->key->str)) {
-         /* duplicate header */
+      kv = kms_kv_list_sorted_at (lst, i);
+      if (!is_signed_header (kv)) {
          continue;
       }
 
-      if (0 == kms_strcasecmp (kv->key->str, "connection")) {
+      if (previous_key &&
+          0 == kms_strcasecmp (previous_key->str, kv->key->str)) {
+         /* duplicate header */
          continue;
       }
 
-      kms_request_str_append_lowercase (str, kv->key);
-      if (i < lst->len - 1) {
+      if (previous_key) {
          kms_request_str_append_char (str, ';');
       }
 
+      kms_request_str_append_lowercase (str, kv->key);
       previous_key = kv->key;
    }
 }
@@ -399,7 +430,7 @@ finalize (kms_request_t *request)
       }
       /* For AWS requests, derive a default Host header from region + service.
        * E.g. "kms.us-east-1.amazonaws.com" */
-      k = kms_request_str_new_from_chars ("Host", -1);
+      k = kms_request_str_new_from_chars_in (request->arena, "Host", -1);
       v = kms_request_str_dup (request->service);
       kms_request_str_append_char (v, '.');
       kms_request_str_append (v, request->region);
@@ -411,8 +442,9 @@ finalize (kms_request_t *request)
 
    if (!kms_kv_list_find (lst, "Content-Length") && request->payload->len &&
        request->auto_content_length) {
-      k = kms_request_str_new_from_chars ("Content-Length", -1);
-      v = kms_request_str_new ();
+      k = kms_request_str_new_from_chars_in (
+         request->arena, "Content-Length", -1);
+      v = kms_request_str_new_in (request->arena);
       kms_request_str_appendf (v, "%zu", request->payload->len);
       kms_kv_list_add (lst, k, v);
       kms_request_str_destroy (k);
@@ -422,31 +454,6 @@ finalize (kms_request_t *request)
    return true;
 }
 
-/* docs.aws.amazon.com/general/latest/gr/sigv4-create-canonical-request.html
- *
- * "Build the canonical headers list by sorting the (lowercase) headers by
- * character code... Do not sort the values in headers that have multiple
- * values."
- */
-static int
-cmp_header_field_names (const void *a, const void *b)
-{
-   return kms_strcasecmp (((kms_kv_t *) a)->key->str,
-                          ((kms_kv_t *) b)->key->str);
-}
-
-static kms_kv_list_t *
-canonical_headers (const kms_request_t *request)
-{
-   kms_kv_list_t *lst;
-
-   KMS_ASSERT (request->finalized);
-   lst = kms_kv_list_dup (request->header_fields);
-   kms_kv_list_sort (lst, cmp_header_field_names);
-   kms_kv_list_del (lst, "Connection");
-   return lst;
-}
-
 char *
 kms_request_get_canonical (kms_request_t *request)
 {
@@ -462,7 +469,7 @@ kms_request_get_canonical (kms_request_t *request)
       return NULL;
    }
 
-   canonical = kms_request_str_new ();
+   canonical = kms_request_str_new_in (request->arena);
    kms_request_str_append (canonical, request->method);
    kms_request_str_append_newline (canonical);
    normalized = kms_request_str_path_normalized (request->path);
@@ -471,11 +478,10 @@ kms_request_get_canonical (kms_request_t *request)
    kms_request_str_append_newline (canonical);
    append_canonical_query (request, canonical);
    kms_request_str_append_newline (canonical);
-   lst = canonical_headers (request);
+   lst = request->header_fields;
    append_canonical_headers (lst, canonical);
    kms_request_str_append_newline (canonical);
    append_signed_headers (lst, canonical);
-   kms_kv_list_destroy (lst);
    kms_request_str_append_newline (canonical);
    if (!kms_request_str_append_hashed (
           &request->crypto, canonical, request->payload)) {
@@ -523,7 +529,7 @@ kms_request_get_string_to_sign (kms_request_t *request)
       return NULL;
    }
 
-   sts = kms_request_str_new ();
+   sts = kms_request_str_new_in (request->arena);
    kms_request_str_append_chars (sts, "AWS4-HMAC-SHA256\n", -1);
    kms_request_str_append (sts, request->datetime);
    kms_request_str_append_newline (sts);
@@ -590,6 +596,11 @@ kms_request_get_signing_key (kms_request_t *request, unsigned char *key)
       return false;
    }
 
+   if (request->has_signing_key) {
+      memcpy (key, request->signing_key, sizeof (request->signing_key));
+      return true;
+   }
+
    /* docs.aws.amazon.com/general/latest/gr/sigv4-calculate-signature.html
     * Pseudocode for deriving a signing key
     *
@@ -599,10 +610,12 @@ kms_request_get_signing_key (kms_request_t *request, unsigned char *key)
     * kService = HMAC(kRegion, Service)
     * kSigning = HMAC(kService, "aws4_request")
     */
-   aws4_plus_secret = kms_request_str_new_from_chars ("AWS4", -1);
+   aws4_plus_secret =
+      kms_request_str_new_from_chars_in (request->arena, "AWS4", -1);
    kms_request_str_append (aws4_plus_secret, request->secret_key);
 
-   aws4_request = kms_request_str_new_from_chars ("aws4_request", -1);
+   aws4_request =
+      kms_request_str_new_from_chars_in (request->arena, "aws4_request", -1);
 
    if (!(kms_request_hmac (
             &request->crypto, k_date, aws4_plus_secret, request->date) &&
@@ -623,6 +636,18 @@ done:
    return success;
 }
 
+bool
+kms_request_set_signing_key (kms_request_t *request, const unsigned char *key)
+{
+   if (request->failed) {
+      return false;
+   }
+
+   memcpy (request->signing_key, key, sizeof (request->signing_key));
+   request->has_signing_key = true;
+   return true;
+}
+
 char *
 kms_request_get_signature (kms_request_t *request)
 {
@@ -642,7 +667,7 @@ kms_request_get_signature (kms_request_t *request)
       goto done;
    }
 
-   sig = kms_request_str_new ();
+   sig = kms_request_str_new_in (request->arena);
    kms_request_str_append_chars (sig, "AWS4-HMAC-SHA256 Credential=", -1);
    kms_request_str_append (sig, request->access_key_id);
    kms_request_str_append_char (sig, '/');
@@ -652,7 +677,7 @@ kms_request_get_signature (kms_request_t *request)
    kms_request_str_append_char (sig, '/');
    kms_request_str_append (sig, request->service);
    kms_request_str_append_chars (sig, "/aws4_request, SignedHeaders=", -1);
-   lst = canonical_headers (request);
+   lst = request->header_fields;
    append_signed_headers (lst, sig);
    kms_request_str_append_chars (sig, ", Signature=", -1);
    if (!(kms_request_get_signing_key (request, signing_key) &&
@@ -664,7 +689,6 @@ kms_request_get_signature (kms_request_t *request)
    kms_request_str_append_hex (sig, signature, sizeof (signature));
    success = true;
 done:
-   kms_kv_list_destroy (lst);
    kms_request_str_destroy (sts);
 
    if (!success) {
@@ -702,6 +726,7 @@ kms_request_get_signed (kms_request_t *request)
    kms_kv_list_t *lst = NULL;
    char *signature = NULL;
    kms_request_str_t *sreq = NULL;
+   const kms_kv_t *kv;
    size_t i;
 
    kms_request_validate (request);
@@ -713,7 +738,7 @@ kms_request_get_signed (kms_request_t *request)
       return NULL;
    }
 
-   sreq = kms_request_str_new ();
+   sreq = kms_request_str_new_in (request->arena);
    /* like "POST / HTTP/1.1" */
    kms_request_str_append (sreq, request->method);
    kms_request_str_append_char (sreq, ' ');
@@ -727,12 +752,12 @@ kms_request_get_signed (kms_request_t *request)
    kms_request_str_append_newline (sreq);
 
    /* headers */
-   lst = kms_kv_list_dup (request->header_fields);
-   kms_kv_list_sort (lst, cmp_header_field_names);
+   lst = request->header_fields;
    for (i = 0; i < lst->len; i++) {
-      kms_request_str_append (sreq, lst->kvs[i].key);
+      kv = kms_kv_list_sorted_at (lst, i);
+      kms_request_str_append (sreq, kv->key);
       kms_request_str_append_char (sreq, ':');
-      kms_request_str_append (sreq, lst->kvs[i].value);
+      kms_request_str_append (sreq, kv->value);
       kms_request_str_append_newline (sreq);
    }
 
@@ -756,7 +781,6 @@ kms_request_get_signed (kms_request_t *request)
    success = true;
 done:
    free (signature);
-   kms_kv_list_destroy (lst);
 
    if (!success) {
       kms_request_str_destroy (sreq);
@@ -771,13 +795,14 @@ kms_request_to_string (kms_request_t *request)
 {
    kms_kv_list_t *lst = NULL;
    kms_request_str_t *sreq = NULL;
+   const kms_kv_t *kv;
    size_t i;
 
    if (!finalize (request)) {
       return false;
    }
 
-   sreq = kms_request_str_new ();
+   sreq = kms_request_str_new_in (request->arena);
    /* like "POST / HTTP/1.1" */
    kms_request_str_append (sreq, request->method);
    kms_request_str_append_char (sreq, ' ');
@@ -791,12 +816,12 @@ kms_request_to_string (kms_request_t *request)
    kms_request_str_append_newline (sreq);
 
    /* headers */
-   lst = kms_kv_list_dup (request->header_fields);
-   kms_kv_list_sort (lst, cmp_header_field_names);
+   lst = request->header_fields;
    for (i = 0; i < lst->len; i++) {
-      kms_request_str_append (sreq, lst->kvs[i].key);
+      kv = kms_kv_list_sorted_at (lst, i);
+      kms_request_str_append (sreq, kv->key);
       kms_request_str_append_char (sreq, ':');
-      kms_request_str_append (sreq, lst->kvs[i].value);
+      kms_request_str_append (sreq, kv->value);
       kms_request_str_append_newline (sreq);
    }
 
@@ -807,7 +832,6 @@ kms_request_to_string (kms_request_t *request)
       kms_request_str_append (sreq, request->payload);
    }
 
-   kms_kv_list_destroy (lst);
    return kms_request_str_detach (sreq);
 }
 
@@ -38,6 +38,12 @@ kms_request_opt_set_connection_close (kms_request_opt_t *opt,
    opt->connection_close = connection_close;
 }
 
+void
+kms_request_opt_set_arena (kms_request_opt_t *opt, bool use_arena)
+{
+   opt->use_arena = use_arena;
+}
+
 
 void
 kms_request_opt_set_crypto_hooks (kms_request_opt_t *opt,
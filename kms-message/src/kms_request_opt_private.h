@@ -27,6 +27,7 @@ struct _kms_request_opt_t {
    bool connection_close;
    _kms_crypto_t crypto;
    kms_request_provider_t provider;
+   bool use_arena;
 };
 
 #endif /* KMS_REQUEST_OPT_PRIVATE_H */
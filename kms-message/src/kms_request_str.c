@@ -47,16 +47,23 @@ tables_init ()
 }
 
 
+static void *
+str_alloc (kms_arena_t *arena, size_t size)
+{
+   void *ptr = arena ? kms_arena_alloc (arena, size) : malloc (size);
+   KMS_ASSERT (ptr);
+   return ptr;
+}
+
 kms_request_str_t *
-kms_request_str_new (void)
+kms_request_str_new_in (kms_arena_t *arena)
 {
-   kms_request_str_t *s = malloc (sizeof (kms_request_str_t));
-   KMS_ASSERT (s);
+   kms_request_str_t *s = str_alloc (arena, sizeof (kms_request_str_t));
 
+   s->arena = arena;
    s->len = 0;
    s->size = 16;
-   s->str = malloc (s->size);
-   KMS_ASSERT (s->str);
+   s->str = str_alloc (arena, s->size);
 
    s->str[0] = '\0';
 
@@ -64,17 +71,24 @@ kms_request_str_new (void)
 }
 
 kms_request_str_t *
-kms_request_str_new_from_chars (const char *chars, ssize_t len)
+kms_request_str_new (void)
 {
-   kms_request_str_t *s = malloc (sizeof (kms_request_str_t));
-   KMS_ASSERT (s);
+   return kms_request_str_new_in (NULL);
+}
+
+kms_request_str_t *
+kms_request_str_new_from_chars_in (kms_arena_t *arena,
+                                   const char *chars,
+                                   ssize_t len)
+{
+   kms_request_str_t *s = str_alloc (arena, sizeof (kms_request_str_t));
 
    size_t actual_len;
 
    actual_len = len < 0 ? strlen (chars) : (size_t) len;
+   s->arena = arena;
    s->size = actual_len + 1;
-   s->str = malloc (s->size);
-   KMS_ASSERT (s->str);
+   s->str = str_alloc (arena, s->size);
 
    memcpy (s->str, chars, actual_len);
    s->str[actual_len] = '\0';
@@ -83,6 +97,12 @@ kms_request_str_new_from_chars (const char *chars, ssize_t len)
    return s;
 }
 
+kms_request_str_t *
+kms_request_str_new_from_chars (const char *chars, ssize_t len)
+{
+   return kms_request_str_new_from_chars_in (NULL, chars, len);
+}
+
 kms_request_str_t *
 kms_request_str_wrap (char *chars, ssize_t len)
 {
@@ -96,6 +116,7 @@ kms_request_str_wrap (char *chars, ssize_t len)
    KMS_ASSERT (s);
 
 
+   s->arena = NULL;
    s->str = chars;
    s->len = len < 0 ? strlen (chars) : (size_t) len;
    s->size = s->len;
@@ -106,7 +127,7 @@ kms_request_str_wrap (char *chars, ssize_t len)
 void
 kms_request_str_destroy (kms_request_str_t *str)
 {
-   if (!str) {
+   if (!str || str->arena) {
       return;
    }
 
@@ -120,6 +141,9 @@ kms_request_str_detach (kms_request_str_t *str)
    if (!str) {
       return NULL;
    }
+   if (str->arena) {
+      return kms_strndup (str->str, str->len);
+   }
    char *r = str->str;
    free (str);
    return r;
@@ -146,25 +170,28 @@ kms_request_str_reserve (kms_request_str_t *str, size_t size)
       next_size |= next_size >> 16U;
       ++next_size;
 
+      if (str->arena) {
+         str->str =
+            kms_arena_realloc (str->arena, str->str, str->size, next_size);
+      } else {
+         str->str = realloc (str->str, next_size);
+      }
       str->size = next_size;
-      str->str = realloc (str->str, next_size);
    }
 
    return str->str != NULL;
 }
 
 kms_request_str_t *
-kms_request_str_dup (kms_request_str_t *str)
+kms_request_str_dup_in (kms_arena_t *arena, kms_request_str_t *str)
 {
-   kms_request_str_t *dup = malloc (sizeof (kms_request_str_t));
-   KMS_ASSERT (dup);
-
-
-   dup->str = kms_strndup (str->str, str->len);
-   dup->len = str->len;
-   dup->size = str->len + 1;
+   return kms_request_str_new_from_chars_in (arena, str->str, str->len);
+}
 
-   return dup;
+kms_request_str_t *
+kms_request_str_dup (kms_request_str_t *str)
+{
+   return kms_request_str_dup_in (str->arena, str);
 }
 
 void
@@ -435,7 +462,7 @@ kms_request_str_t *
 kms_request_str_path_normalized (kms_request_str_t *str)
 {
    kms_request_str_t *slash = kms_request_str_new_from_chars ("/", 1);
-   kms_request_str_t *out = kms_request_str_new ();
+   kms_request_str_t *out = kms_request_str_new_in (str->arena);
    char *in = strdup (str->str);
    char *p = in;
    char *end = in + str->len;
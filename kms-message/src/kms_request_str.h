@@ -18,6 +18,7 @@
 #define KMS_MESSAGE_KMS_REQUEST_STR_H
 
 #include "kms_message/kms_message.h"
+#include "kms_arena.h"
 #include "kms_crypto.h"
 
 #include <stdarg.h>
@@ -29,6 +30,9 @@ typedef struct {
    char *str;
    size_t len;
    size_t size;
+   /* If set, str and the struct itself are allocated from arena, and are
+    * freed with it instead of by kms_request_str_destroy. */
+   kms_arena_t *arena;
 } kms_request_str_t;
 
 KMS_MSG_EXPORT (kms_request_str_t *)
@@ -37,8 +41,19 @@ KMS_MSG_EXPORT (kms_request_str_t *)
 kms_request_str_new_from_chars (const char *chars, ssize_t len);
 KMS_MSG_EXPORT (kms_request_str_t *)
 kms_request_str_wrap (char *chars, ssize_t len);
+/* Like kms_request_str_new, kms_request_str_new_from_chars and
+ * kms_request_str_dup, but allocate from @arena if it is not NULL. */
+kms_request_str_t *
+kms_request_str_new_in (kms_arena_t *arena);
+kms_request_str_t *
+kms_request_str_new_from_chars_in (kms_arena_t *arena,
+                                   const char *chars,
+                                   ssize_t len);
+kms_request_str_t *
+kms_request_str_dup_in (kms_arena_t *arena, kms_request_str_t *str);
 KMS_MSG_EXPORT (void)
 kms_request_str_destroy (kms_request_str_t *str);
+/* Returns the chars of @str, to be freed with free, and destroys @str. */
 KMS_MSG_EXPORT (char *)
 kms_request_str_detach (kms_request_str_t *str);
 KMS_MSG_EXPORT (bool)
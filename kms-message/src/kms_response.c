@@ -26,7 +26,8 @@ kms_response_destroy (kms_response_t *response)
       return;
    }
    kms_kv_list_destroy (response->headers);
-   kms_request_str_destroy (response->body);
+   /* The body is a view into raw. */
+   kms_request_str_destroy (response->raw);
    free (response);
 }
 
@@ -5,6 +5,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "hexlify.h"
 
@@ -30,9 +31,12 @@ _parser_init (kms_response_parser_t *parser)
    parser->response->headers = kms_kv_list_new ();
    parser->state = PARSING_STATUS_LINE;
    parser->start = 0;
+   parser->body_start = -1;
+   parser->body_len = 0;
    parser->failed = false;
    parser->chunk_size = 0;
    parser->transfer_encoding_chunked = false;
+   parser->reserved = 0;
 }
 
 kms_response_parser_t *
@@ -212,15 +216,14 @@ _parse_line (kms_response_parser_t *parser, int end)
          val = kms_request_str_new_from_chars (raw + i, j - i);
       }
 
-      kms_kv_list_add (response->headers, key, val);
+      /* The list owns key and val from here on. */
+      kms_kv_list_add_stolen (response->headers, key, val);
 
       /* if we have *not* read the Content-Length yet, check. */
       if (parser->content_length == -1 &&
           strcmp (key->str, "Content-Length") == 0) {
          if (!_parse_int (val->str, &parser->content_length)) {
             KMS_ERROR (parser, "Could not parse Content-Length header.");
-            kms_request_str_destroy (key);
-            kms_request_str_destroy (val);
             return PARSING_DONE;
          }
       }
@@ -230,13 +233,9 @@ _parse_line (kms_response_parser_t *parser, int end)
             parser->transfer_encoding_chunked = true;
          } else {
             KMS_ERROR (parser, "Unsupported Transfer-Encoding: %s", val->str);
-            kms_request_str_destroy (key);
-            kms_request_str_destroy (val);
             return PARSING_DONE;
          }
       }
-      kms_request_str_destroy (key);
-      kms_request_str_destroy (val);
       return PARSING_HEADER;
    } else if (parser->state == PARSING_CHUNK_LENGTH) {
       int result = 0;
@@ -251,24 +250,28 @@ _parse_line (kms_response_parser_t *parser, int end)
    return PARSING_DONE;
 }
 
-bool
-kms_response_parser_feed (kms_response_parser_t *parser,
-                          uint8_t *buf,
-                          uint32_t len)
+/* process the data appended to raw_response after curr. */
+static bool
+_parse (kms_response_parser_t *parser, int curr)
 {
    kms_request_str_t *raw = parser->raw_response;
-   int curr, body_read, chunk_read;
+   int body_read, chunk_read;
+   const char *lf;
 
-   curr = (int) raw->len;
-   kms_request_str_append_chars (raw, (char *) buf, len);
-   /* process the new data appended. */
    while (curr < (int) raw->len) {
       switch (parser->state) {
       case PARSING_STATUS_LINE:
       case PARSING_HEADER:
       case PARSING_CHUNK_LENGTH:
-         /* find the next \r\n. */
-         if (curr && strncmp (raw->str + (curr - 1), "\r\n", 2) == 0) {
+         /* find the next \r\n. A \r at the end of a previous feed is
+          * matched by the \n at the start of this one. */
+         lf = memchr (raw->str + curr, '\n', raw->len - (size_t) curr);
+         if (!lf) {
+            curr = (int) raw->len;
+            break;
+         }
+         curr = (int) (lf - raw->str);
+         if (curr && raw->str[curr - 1] == '\r') {
             parser->state = _parse_line (parser, curr - 1);
             parser->start = curr + 1;
          }
@@ -276,7 +279,8 @@ kms_response_parser_feed (kms_response_parser_t *parser,
 
          if (parser->state == PARSING_BODY && parser->content_length <= 0) {
             /* Ok, no Content-Length header, or explicitly 0, so empty body */
-            parser->response->body = kms_request_str_new ();
+            parser->body_start = parser->start;
+            parser->body_len = 0;
             parser->state = PARSING_DONE;
          }
          break;
@@ -289,10 +293,10 @@ kms_response_parser_feed (kms_response_parser_t *parser,
             return false;
          }
 
-         /* check if we have the entire body. */
+         /* check if we have the entire body. It is left in place. */
          if (body_read == parser->content_length) {
-            parser->response->body = kms_request_str_new_from_chars (
-               raw->str + parser->start, parser->content_length);
+            parser->body_start = parser->start;
+            parser->body_len = parser->content_length;
             parser->state = PARSING_DONE;
          }
 
@@ -302,12 +306,15 @@ kms_response_parser_feed (kms_response_parser_t *parser,
          chunk_read = (int) raw->len - parser->start;
          /* check if we've read the full chunk and the trailing \r\n */
          if (chunk_read >= parser->chunk_size + 2) {
-            if (!parser->response->body) {
-               parser->response->body = kms_request_str_new ();
+            if (parser->body_start == -1) {
+               parser->body_start = parser->start;
             }
-            kms_request_str_append_chars (parser->response->body,
-                                          raw->str + parser->start,
-                                          parser->chunk_size);
+            /* Move the chunk down to follow the previous one. The chunk
+             * length lines in between are already parsed. */
+            memmove (raw->str + parser->body_start + parser->body_len,
+                     raw->str + parser->start,
+                     (size_t) parser->chunk_size);
+            parser->body_len += parser->chunk_size;
             curr = parser->start + parser->chunk_size + 2;
             parser->start = curr;
             if (parser->chunk_size == 0) {
@@ -332,11 +339,75 @@ kms_response_parser_feed (kms_response_parser_t *parser,
    return true;
 }
 
+bool
+kms_response_parser_feed (kms_response_parser_t *parser,
+                          uint8_t *buf,
+                          uint32_t len)
+{
+   kms_request_str_t *raw = parser->raw_response;
+   int curr;
+
+   parser->reserved = 0;
+   curr = (int) raw->len;
+   kms_request_str_append_chars (raw, (char *) buf, len);
+   return _parse (parser, curr);
+}
+
+uint8_t *
+kms_response_parser_reserve (kms_response_parser_t *parser, uint32_t len)
+{
+   kms_request_str_t *raw = parser->raw_response;
+
+   kms_request_str_reserve (raw, len);
+   parser->reserved = len;
+   return (uint8_t *) raw->str + raw->len;
+}
+
+bool
+kms_response_parser_commit (kms_response_parser_t *parser, uint32_t len)
+{
+   kms_request_str_t *raw = parser->raw_response;
+   int curr;
+
+   if (len > parser->reserved) {
+      KMS_ERROR (parser,
+                 "Committed %u bytes, but only %u were reserved",
+                 (unsigned) len,
+                 (unsigned) parser->reserved);
+      return false;
+   }
+
+   parser->reserved = 0;
+   curr = (int) raw->len;
+   raw->len += len;
+   raw->str[raw->len] = '\0';
+   return _parse (parser, curr);
+}
+
 /* steals the response from the parser. */
 kms_response_t *
 kms_response_parser_get_response (kms_response_parser_t *parser)
 {
    kms_response_t *response = parser->response;
+   kms_request_str_t *raw = parser->raw_response;
+
+   /* Hand the received bytes to the response, the body is a view of them. */
+   response->raw = raw;
+   parser->raw_response = NULL;
+   if (parser->body_start != -1) {
+      if (parser->body_len == 0) {
+         /* Point at the terminating NUL. */
+         response->body_view.str = raw->str + raw->len;
+      } else {
+         response->body_view.str = raw->str + parser->body_start;
+         /* For chunked bodies, this overwrites parsed bytes. */
+         response->body_view.str[parser->body_len] = '\0';
+      }
+      response->body_view.len = (size_t) parser->body_len;
+      response->body_view.size = 0;
+      response->body_view.arena = NULL;
+      response->body = &response->body_view;
+   }
 
    parser->response = NULL;
    /* reset the parser. */
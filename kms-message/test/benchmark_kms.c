@@ -0,0 +1,403 @@
+/*
+ * Copyright 2021-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Micro-benchmarks of the KMS request and response paths.
+ *
+ * Usage: benchmark_kms [name-filter]
+ *
+ * Run from the kms-message directory, so the example responses in test/ are
+ * found. Prints a JSON document to stdout:
+ * { "results": [
+ *    { "name", "param", "iterations", "nsPerOp", "allocsPerOp" }, ...
+ * ] }
+ *
+ * Each benchmark doubles its iteration count until a run takes at least
+ * BENCH_MIN_NS. allocsPerOp counts calls to malloc, calloc and realloc,
+ * including those of the crypto library. It is only counted with glibc, and
+ * is -1 elsewhere. */
+
+/* Needed for clock_gettime */
+#define _GNU_SOURCE
+
+#include "src/kms_message/kms_message.h"
+#include "src/kms_message/kms_b64.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#define BENCH_MIN_NS (200 * 1000 * 1000)
+
+#define BENCH_ASSERT(_stmt)                                                  \
+   do {                                                                      \
+      if (!(_stmt)) {                                                        \
+         fprintf (stderr, "%s:%d failed: %s\n", __FILE__, __LINE__, #_stmt); \
+         abort ();                                                           \
+      }                                                                      \
+   } while (0)
+
+typedef void (*bench_op_t) (void *ctx);
+
+static const char *filter;
+static bool printed_result;
+
+#ifdef __GLIBC__
+/* Count allocations by interposing the allocator. glibc routes its own
+ * allocations, and those of other libraries, through these too. */
+extern void *
+__libc_malloc (size_t size);
+extern void *
+__libc_calloc (size_t nmemb, size_t size);
+extern void *
+__libc_realloc (void *ptr, size_t size);
+
+static int64_t num_allocs;
+
+void *
+malloc (size_t size)
+{
+   num_allocs++;
+   return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+   num_allocs++;
+   return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+   num_allocs++;
+   return __libc_realloc (ptr, size);
+}
+
+#define ALLOCS_COUNTED true
+#else
+static int64_t num_allocs;
+#define ALLOCS_COUNTED false
+#endif
+
+static int64_t
+now_ns (void)
+{
+#ifdef _WIN32
+   LARGE_INTEGER freq, count;
+
+   QueryPerformanceFrequency (&freq);
+   QueryPerformanceCounter (&count);
+   return (int64_t) ((double) count.QuadPart * 1e9 / (double) freq.QuadPart);
+#else
+   struct timespec ts;
+
+   BENCH_ASSERT (0 == clock_gettime (CLOCK_MONOTONIC, &ts));
+   return (int64_t) ts.tv_sec * 1000000000 + (int64_t) ts.tv_nsec;
+#endif
+}
+
+static bool
+selected (const char *name)
+{
+   return !filter || strstr (name, filter);
+}
+
+/* Run @op until a run of doubling iterations takes BENCH_MIN_NS. */
+static void
+bench (const char *name, const char *param, bench_op_t op, void *ctx)
+{
+   int64_t iterations = 1;
+   int64_t elapsed_ns;
+   int64_t allocs;
+   int64_t i;
+
+   if (!selected (name)) {
+      return;
+   }
+
+   for (;;) {
+      int64_t start_ns = now_ns ();
+      int64_t start_allocs = num_allocs;
+
+      for (i = 0; i < iterations; i++) {
+         op (ctx);
+      }
+      elapsed_ns = now_ns () - start_ns;
+      allocs = num_allocs - start_allocs;
+      if (elapsed_ns >= BENCH_MIN_NS) {
+         break;
+      }
+      iterations *= 2;
+   }
+
+   printf ("%s\n    { \"name\": \"%s\", \"param\": \"%s\", "
+           "\"iterations\": %lld, \"nsPerOp\": %.1f, "
+           "\"allocsPerOp\": %.1f }",
+           printed_result ? "," : "",
+           name,
+           param,
+           (long long) iterations,
+           (double) elapsed_ns / (double) iterations,
+           ALLOCS_COUNTED ? (double) allocs / (double) iterations : -1.0);
+   fflush (stdout);
+   printed_result = true;
+}
+
+/* The size of the ciphertext of a data key encrypted by AWS KMS. */
+#define CIPHERTEXT_BLOB_LEN 184
+
+typedef struct {
+   uint8_t blob[CIPHERTEXT_BLOB_LEN];
+   kms_request_opt_t *opt;
+   kms_request_t *request;
+} request_ctx_t;
+
+static void
+set_credentials (kms_request_t *request)
+{
+   BENCH_ASSERT (kms_request_set_region (request, "us-east-1"));
+   BENCH_ASSERT (kms_request_set_service (request, "kms"));
+   BENCH_ASSERT (kms_request_set_access_key_id (request, "AKIDEXAMPLE"));
+   BENCH_ASSERT (kms_request_set_secret_key (
+      request, "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY"));
+}
+
+static void
+op_decrypt_request_new (void *ctx_void)
+{
+   request_ctx_t *ctx = (request_ctx_t *) ctx_void;
+   kms_request_t *request;
+
+   request = kms_decrypt_request_new (ctx->blob, sizeof (ctx->blob), ctx->opt);
+   BENCH_ASSERT (request);
+   kms_request_destroy (request);
+}
+
+/* Create, sign, and destroy, as libmongocrypt does for each key. */
+static void
+op_decrypt_request_signed (void *ctx_void)
+{
+   request_ctx_t *ctx = (request_ctx_t *) ctx_void;
+   kms_request_t *request;
+   char *signed_request;
+
+   request = kms_decrypt_request_new (ctx->blob, sizeof (ctx->blob), ctx->opt);
+   set_credentials (request);
+   signed_request = kms_request_get_signed (request);
+   BENCH_ASSERT (signed_request);
+   kms_request_free_string (signed_request);
+   kms_request_destroy (request);
+}
+
+static void
+op_get_signed (void *ctx_void)
+{
+   request_ctx_t *ctx = (request_ctx_t *) ctx_void;
+   char *signed_request;
+
+   signed_request = kms_request_get_signed (ctx->request);
+   BENCH_ASSERT (signed_request);
+   kms_request_free_string (signed_request);
+}
+
+static void
+op_to_string (void *ctx_void)
+{
+   request_ctx_t *ctx = (request_ctx_t *) ctx_void;
+   char *str;
+
+   str = kms_request_to_string (ctx->request);
+   BENCH_ASSERT (str);
+   kms_request_free_string (str);
+}
+
+static void
+bench_requests (bool use_arena)
+{
+   request_ctx_t ctx;
+   const char *param = use_arena ? "arena" : "default";
+   size_t i;
+
+   for (i = 0; i < sizeof (ctx.blob); i++) {
+      ctx.blob[i] = (uint8_t) i;
+   }
+   ctx.opt = kms_request_opt_new ();
+   kms_request_opt_set_arena (ctx.opt, use_arena);
+
+   bench ("kms_decrypt_request_new", param, op_decrypt_request_new, &ctx);
+   bench ("decrypt_request_signed", param, op_decrypt_request_signed, &ctx);
+
+   ctx.request =
+      kms_decrypt_request_new (ctx.blob, sizeof (ctx.blob), ctx.opt);
+   set_credentials (ctx.request);
+   bench ("kms_request_get_signed", param, op_get_signed, &ctx);
+   bench ("kms_request_to_string", param, op_to_string, &ctx);
+   kms_request_destroy (ctx.request);
+   kms_request_opt_destroy (ctx.opt);
+}
+
+typedef struct {
+   uint8_t *data;
+   size_t len;
+   /* The most bytes fed at once. */
+   int32_t max_feed;
+} response_ctx_t;
+
+static void
+op_parse_response (void *ctx_void)
+{
+   response_ctx_t *ctx = (response_ctx_t *) ctx_void;
+   kms_response_parser_t *parser;
+   kms_response_t *response;
+   size_t pos = 0;
+   int wants;
+
+   parser = kms_response_parser_new ();
+   while ((wants = kms_response_parser_wants_bytes (parser, ctx->max_feed)) >
+          0) {
+      size_t n = (size_t) wants;
+
+      if (n > ctx->len - pos) {
+         n = ctx->len - pos;
+      }
+      BENCH_ASSERT (n > 0);
+      BENCH_ASSERT (
+         kms_response_parser_feed (parser, ctx->data + pos, (uint32_t) n));
+      pos += n;
+   }
+   response = kms_response_parser_get_response (parser);
+   BENCH_ASSERT (response);
+   BENCH_ASSERT (kms_response_get_status (response) == 200);
+   kms_response_destroy (response);
+   kms_response_parser_destroy (parser);
+}
+
+static void
+bench_response (const char *path)
+{
+   response_ctx_t ctx;
+   FILE *f;
+   long len;
+   char param[128];
+
+   f = fopen (path, "rb");
+   if (!f) {
+      perror (path);
+      abort ();
+   }
+   BENCH_ASSERT (0 == fseek (f, 0, SEEK_END));
+   len = ftell (f);
+   BENCH_ASSERT (len > 0);
+   BENCH_ASSERT (0 == fseek (f, 0, SEEK_SET));
+   ctx.len = (size_t) len;
+   ctx.data = malloc (ctx.len);
+   BENCH_ASSERT (ctx.data);
+   BENCH_ASSERT (ctx.len == fread (ctx.data, 1, ctx.len, f));
+   fclose (f);
+
+   /* Fed whole, as after one large read, and in small reads. */
+   ctx.max_feed = 4096;
+   snprintf (param, sizeof (param), "%s 4096", path);
+   bench ("kms_response_parser_feed", param, op_parse_response, &ctx);
+   ctx.max_feed = 64;
+   snprintf (param, sizeof (param), "%s 64", path);
+   bench ("kms_response_parser_feed", param, op_parse_response, &ctx);
+   free (ctx.data);
+}
+
+typedef struct {
+   uint8_t raw[512];
+   size_t raw_len;
+   char *b64;
+} b64_ctx_t;
+
+static void
+op_raw_to_b64 (void *ctx_void)
+{
+   b64_ctx_t *ctx = (b64_ctx_t *) ctx_void;
+   char *b64;
+
+   b64 = kms_message_raw_to_b64 (ctx->raw, ctx->raw_len);
+   BENCH_ASSERT (b64);
+   free (b64);
+}
+
+static void
+op_b64_to_raw (void *ctx_void)
+{
+   b64_ctx_t *ctx = (b64_ctx_t *) ctx_void;
+   uint8_t *raw;
+   size_t len;
+
+   raw = kms_message_b64_to_raw (ctx->b64, &len);
+   BENCH_ASSERT (raw && len == ctx->raw_len);
+   free (raw);
+}
+
+static void
+bench_b64 (size_t raw_len)
+{
+   b64_ctx_t ctx;
+   char param[32];
+   size_t i;
+
+   BENCH_ASSERT (raw_len <= sizeof (ctx.raw));
+   ctx.raw_len = raw_len;
+   for (i = 0; i < raw_len; i++) {
+      ctx.raw[i] = (uint8_t) (i * 7);
+   }
+   ctx.b64 = kms_message_raw_to_b64 (ctx.raw, ctx.raw_len);
+   BENCH_ASSERT (ctx.b64);
+
+   snprintf (param, sizeof (param), "%d bytes", (int) raw_len);
+   bench ("kms_message_raw_to_b64", param, op_raw_to_b64, &ctx);
+   bench ("kms_message_b64_to_raw", param, op_b64_to_raw, &ctx);
+   free (ctx.b64);
+}
+
+int
+main (int argc, char *argv[])
+{
+   if (argc > 2) {
+      fprintf (stderr, "Usage: benchmark_kms [name-filter]\n");
+      return 1;
+   }
+   if (argc == 2) {
+      filter = argv[1];
+   }
+
+   BENCH_ASSERT (0 == kms_message_init ());
+
+   printf ("{ \"results\": [");
+   bench_requests (false);
+   bench_requests (true);
+   bench_response ("./test/example-response.bin");
+   bench_response ("./test/example-chunked-response.bin");
+   bench_response ("./test/example-multi-chunked-response.bin");
+   /* A local or GCP key, a data key, and an AWS ciphertext. */
+   bench_b64 (32);
+   bench_b64 (96);
+   bench_b64 (CIPHERTEXT_BLOB_LEN);
+   printf ("\n] }\n");
+
+   kms_message_cleanup ();
+   return 0;
+}
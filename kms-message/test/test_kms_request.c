@@ -37,6 +37,7 @@
 #include <src/kms_request_str.h>
 #include <src/kms_kv_list.h>
 #include <src/kms_port.h>
+#include <src/kms_message/kms_gcp_request.h>
 
 #define ASSERT_CONTAINS(_a, _b)                                              \
    do {                                                                      \
@@ -595,6 +596,31 @@ content_length_test (void)
    kms_request_destroy (request);
 }
 
+/* Headers added after signing are included when signing again. */
+void
+header_added_after_signing_test (void)
+{
+   kms_request_t *request = make_test_request ();
+   char *canonical;
+   char *sreq;
+
+   sreq = kms_request_get_signed (request);
+   KMS_ASSERT (sreq);
+   KMS_ASSERT (!strstr (sreq, "X-Test"));
+   free (sreq);
+
+   KMS_ASSERT (kms_request_add_header_field (request, "X-Test", "a"));
+   KMS_ASSERT (kms_request_append_header_field_value (request, "b", 1));
+   canonical = kms_request_get_canonical (request);
+   KMS_ASSERT (strstr (canonical, "x-test:ab\n"));
+   free (canonical);
+   sreq = kms_request_get_signed (request);
+   KMS_ASSERT (strstr (sreq, "X-Test:ab\n"));
+   KMS_ASSERT (strstr (sreq, "SignedHeaders=host;x-amz-date;x-test,"));
+   free (sreq);
+   kms_request_destroy (request);
+}
+
 void
 bad_query_test (void)
 {
@@ -711,6 +737,47 @@ decrypt_request_test (void)
    kms_request_destroy (request);
 }
 
+void
+arena_request_test (void)
+{
+   kms_request_opt_t *opt;
+   kms_request_t *request;
+   kms_request_t *plain;
+   char *a;
+   char *b;
+
+   opt = kms_request_opt_new ();
+   kms_request_opt_set_arena (opt, true);
+   request = kms_decrypt_request_new (
+      (uint8_t *) ciphertext_blob, sizeof (ciphertext_blob) - 1, opt);
+
+   set_test_date (request);
+   kms_request_set_region (request, "us-east-1");
+   kms_request_set_service (request, "service");
+   kms_request_set_access_key_id (request, "AKIDEXAMPLE");
+   kms_request_set_secret_key (request,
+                               "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+
+   test_compare_creq (request, "test/decrypt");
+   test_compare_sreq (request, "test/decrypt");
+   kms_request_destroy (request);
+
+   /* query parameters and path normalization allocate from the arena too. */
+   request = kms_request_new ("GET", "/a/../b/./c?Param2=v2&Param1=v1", opt);
+   plain = kms_request_new ("GET", "/a/../b/./c?Param2=v2&Param1=v1", NULL);
+   set_test_date (request);
+   set_test_date (plain);
+   a = kms_request_get_canonical (request);
+   b = kms_request_get_canonical (plain);
+   ASSERT_CMPSTR (a, b);
+   kms_request_free_string (a);
+   kms_request_free_string (b);
+
+   kms_request_destroy (plain);
+   kms_request_destroy (request);
+   kms_request_opt_destroy (opt);
+}
+
 void
 encrypt_request_test (void)
 {
@@ -731,6 +798,110 @@ encrypt_request_test (void)
    kms_request_destroy (request);
 }
 
+void
+set_signing_key_test (void)
+{
+   unsigned char signing_key[32];
+   unsigned char reused_key[32];
+   kms_request_t *request;
+   kms_request_t *reuse;
+   char *expect;
+   char *actual;
+
+   /* A request signed with a key derived for an equivalent request is
+    * identical. */
+   request = kms_decrypt_request_new (
+      (uint8_t *) ciphertext_blob, sizeof (ciphertext_blob) - 1, NULL);
+   reuse = kms_decrypt_request_new (
+      (uint8_t *) ciphertext_blob, sizeof (ciphertext_blob) - 1, NULL);
+   set_test_date (request);
+   set_test_date (reuse);
+   kms_request_set_region (request, "us-east-1");
+   kms_request_set_region (reuse, "us-east-1");
+   kms_request_set_service (request, "service");
+   kms_request_set_service (reuse, "service");
+   kms_request_set_access_key_id (request, "AKIDEXAMPLE");
+   kms_request_set_access_key_id (reuse, "AKIDEXAMPLE");
+   kms_request_set_secret_key (request,
+                               "wJalrXUtnFEMI/K7MDENG+bPxRfiCYEXAMPLEKEY");
+   /* The secret key is not used once the signing key is set. */
+   kms_request_set_secret_key (reuse, "unused");
+
+   KMS_ASSERT (kms_request_get_signing_key (request, signing_key));
+   KMS_ASSERT (kms_request_set_signing_key (reuse, signing_key));
+   KMS_ASSERT (kms_request_get_signing_key (reuse, reused_key));
+   KMS_ASSERT (0 == memcmp (signing_key, reused_key, sizeof (signing_key)));
+
+   expect = kms_request_get_signed (request);
+   actual = kms_request_get_signed (reuse);
+   compare_strs (__FUNCTION__, expect, actual);
+
+   free (expect);
+   free (actual);
+   kms_request_destroy (request);
+   kms_request_destroy (reuse);
+}
+
+static bool
+count_sign (void *ctx,
+            const char *private_key,
+            size_t private_key_len,
+            const char *input,
+            size_t input_len,
+            unsigned char *signature_out)
+{
+   (*(int *) ctx)++;
+   memset (signature_out, 'x', 256);
+   return true;
+}
+
+static void
+gcp_oauth_from_assertion_test (void)
+{
+   kms_request_opt_t *opt;
+   kms_request_t *request;
+   kms_request_t *reuse;
+   char *expect;
+   char *actual;
+   int signed_count = 0;
+
+   opt = kms_request_opt_new ();
+   kms_request_opt_set_provider (opt, KMS_REQUEST_PROVIDER_GCP);
+   kms_request_opt_set_crypto_hook_sign_rsaes_pkcs1_v1_5 (
+      opt, count_sign, &signed_count);
+
+   request = kms_gcp_request_oauth_new ("oauth2.googleapis.com",
+                                        "test@example.com",
+                                        "https://oauth2.googleapis.com/token",
+                                        "https://www.googleapis.com/auth/kms",
+                                        "key",
+                                        3,
+                                        opt);
+   KMS_ASSERT (!kms_request_get_error (request));
+   KMS_ASSERT (signed_count == 1);
+   KMS_ASSERT (kms_gcp_request_oauth_get_assertion (request));
+
+   /* A request built from the assertion is identical and is not signed. */
+   reuse = kms_gcp_request_oauth_new_from_assertion (
+      "oauth2.googleapis.com",
+      kms_gcp_request_oauth_get_assertion (request),
+      opt);
+   KMS_ASSERT (!kms_request_get_error (reuse));
+   KMS_ASSERT (signed_count == 1);
+   ASSERT_CMPSTR (kms_gcp_request_oauth_get_assertion (request),
+                  kms_gcp_request_oauth_get_assertion (reuse));
+
+   expect = kms_request_to_string (request);
+   actual = kms_request_to_string (reuse);
+   compare_strs (__FUNCTION__, expect, actual);
+
+   free (expect);
+   free (actual);
+   kms_request_destroy (request);
+   kms_request_destroy (reuse);
+   kms_request_opt_destroy (opt);
+}
+
 void
 kv_list_del_test (void)
 {
@@ -758,6 +929,49 @@ kv_list_del_test (void)
    kms_kv_list_destroy (lst);
 }
 
+void
+kv_list_indexed_test (void)
+{
+   kms_kv_list_t *lst = kms_kv_list_new_indexed_in (NULL);
+   kms_kv_list_t *dup;
+   kms_request_str_t *k = kms_request_str_new_from_chars ("b", -1);
+   kms_request_str_t *v = kms_request_str_new_from_chars ("1", -1);
+   const char *keys[] = {"b", "C", "a", "B", "d"};
+   const char *sorted[] = {"a", "b", "B", "C", "d"};
+   size_t i;
+
+   for (i = 0; i < sizeof (keys) / sizeof (keys[0]); i++) {
+      kms_request_str_set_chars (k, keys[i], -1);
+      kms_request_str_set_chars (v, keys[i], -1);
+      kms_kv_list_add (lst, k, v);
+   }
+
+   /* kvs keeps the order of insertion, the index is sorted without case and
+    * keeps equal keys in the order of insertion. */
+   ASSERT_CMPSTR (lst->kvs[1].key->str, "C");
+   for (i = 0; i < lst->len; i++) {
+      ASSERT_CMPSTR (kms_kv_list_sorted_at (lst, i)->key->str, sorted[i]);
+   }
+
+   ASSERT_CMPSTR (kms_kv_list_find (lst, "B")->value->str, "b");
+   ASSERT_CMPSTR (kms_kv_list_find (lst, "c")->value->str, "C");
+   KMS_ASSERT (!kms_kv_list_find (lst, "e"));
+   KMS_ASSERT (!kms_kv_list_find (lst, "0"));
+
+   dup = kms_kv_list_dup (lst);
+   kms_kv_list_del (dup, "C");
+   KMS_ASSERT (dup->len == 4);
+   KMS_ASSERT (!kms_kv_list_find (dup, "c"));
+   ASSERT_CMPSTR (kms_kv_list_sorted_at (dup, 2)->key->str, "B");
+   ASSERT_CMPSTR (kms_kv_list_sorted_at (dup, 3)->key->str, "d");
+   KMS_ASSERT (lst->len == 5);
+
+   kms_request_str_destroy (k);
+   kms_request_str_destroy (v);
+   kms_kv_list_destroy (dup);
+   kms_kv_list_destroy (lst);
+}
+
 void
 b64_test (void)
 {
@@ -774,6 +988,40 @@ b64_test (void)
    KMS_ASSERT (0 == memcmp (expected, data, 4));
 }
 
+void
+b64_round_trip_test (void)
+{
+   uint8_t raw[64];
+   char encoded[128];
+   /* Decoding padded input needs one more byte. */
+   uint8_t decoded[65];
+   size_t len;
+   int r;
+
+   for (len = 0; len < sizeof (raw); len++) {
+      raw[len] = (uint8_t) (len * 37 + 11);
+   }
+   /* Cover every padding case over multiple whole quanta. */
+   for (len = 0; len <= sizeof (raw); len++) {
+      r = kms_message_b64_ntop (raw, len, encoded, sizeof (encoded));
+      KMS_ASSERT (r == (int) ((len + 2) / 3 * 4));
+      r = kms_message_b64_pton (encoded, NULL, 0);
+      KMS_ASSERT (r == (int) len);
+      r = kms_message_b64_pton (encoded, decoded, sizeof (decoded));
+      KMS_ASSERT (r == (int) len);
+      KMS_ASSERT (0 == memcmp (raw, decoded, len));
+   }
+
+   /* Whitespace may split a quantum. */
+   r = kms_message_b64_pton ("AQ ID\nBAUG", decoded, sizeof (decoded));
+   KMS_ASSERT (r == 6);
+   KMS_ASSERT (0 == memcmp ("\x01\x02\x03\x04\x05\x06", decoded, 6));
+   /* The output must fit. */
+   KMS_ASSERT (-1 == kms_message_b64_ntop (raw, 3, encoded, 4));
+   KMS_ASSERT (-1 == kms_message_b64_pton ("AQIDBAUG", decoded, 5));
+   KMS_ASSERT (-1 == kms_message_b64_pton ("AQI*BAUG", decoded, 6));
+}
+
 void
 b64_b64url_test (void)
 {
@@ -811,6 +1059,8 @@ kms_response_parser_test (void)
 {
    kms_response_parser_t *parser = kms_response_parser_new ();
    kms_response_t *response;
+   const char *chunked;
+   size_t len;
 
    /* the parser resets after returning a response. */
    ASSERT (
@@ -935,6 +1185,45 @@ kms_response_parser_test (void)
    ASSERT (strstr (kms_response_parser_error (parser),
                    "Unexpected: exceeded content length"));
    kms_response_parser_destroy (parser);
+
+   /* An empty body is returned as an empty string. */
+   parser = kms_response_parser_new ();
+   ASSERT (kms_response_parser_feed (
+      parser, (uint8_t *) "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n", 38));
+   ASSERT (0 == kms_response_parser_wants_bytes (parser, 123));
+   response = kms_response_parser_get_response (parser);
+   ASSERT_CMPSTR (kms_response_get_body (response, &len), "");
+   ASSERT (len == 0);
+   kms_response_destroy (response);
+   kms_response_parser_destroy (parser);
+
+   /* Chunks fed at once are joined, and headers are kept. */
+   parser = kms_response_parser_new ();
+   chunked = "HTTP/1.1 200 OK\r\n"
+             "Transfer-Encoding: chunked\r\n"
+             "X-Test: a\r\n"
+             "\r\n"
+             "4\r\nabcd\r\n"
+             "3\r\nefg\r\n"
+             "0\r\n\r\n";
+   ASSERT (kms_response_parser_feed (
+      parser, (uint8_t *) chunked, (uint32_t) strlen (chunked)));
+   ASSERT (0 == kms_response_parser_wants_bytes (parser, 123));
+   response = kms_response_parser_get_response (parser);
+   ASSERT_CMPSTR (kms_response_get_body (response, &len), "abcdefg");
+   ASSERT (len == 7);
+   ASSERT_CMPSTR (kms_kv_list_find (response->headers, "X-Test")->value->str,
+                  "a");
+   kms_response_destroy (response);
+   kms_response_parser_destroy (parser);
+
+   /* Committing more than was reserved is an error. */
+   parser = kms_response_parser_new ();
+   memcpy (kms_response_parser_reserve (parser, 4), "HTTP", 4);
+   ASSERT (!kms_response_parser_commit (parser, 5));
+   ASSERT_CONTAINS (kms_response_parser_error (parser),
+                    "Committed 5 bytes, but only 4 were reserved");
+   kms_response_parser_destroy (parser);
 }
 
 typedef struct {
@@ -942,6 +1231,8 @@ typedef struct {
    const char *expected_body;
    int max_to_read;
    int expected_status;
+   /* Read into kms_response_parser_reserve instead of feeding a buffer. */
+   bool reserve;
 } parser_testcase_t;
 
 /* File should have \r\n line endings (use /etc/rewrite.py) */
@@ -964,9 +1255,21 @@ parser_testcase_run (parser_testcase_t *testcase)
       if (bytes_to_read > testcase->max_to_read) {
          bytes_to_read = testcase->max_to_read;
       }
-      size_t ret = fread (buf, 1, (size_t) bytes_to_read, response_file);
+      uint8_t *dst = buf;
+      size_t ret;
+      bool ok;
+
+      if (testcase->reserve) {
+         dst = kms_response_parser_reserve (parser, (uint32_t) bytes_to_read);
+      }
+      ret = fread (dst, 1, (size_t) bytes_to_read, response_file);
+      if (testcase->reserve) {
+         ok = kms_response_parser_commit (parser, (uint32_t) ret);
+      } else {
+         ok = kms_response_parser_feed (parser, buf, (int) ret);
+      }
 
-      if (!kms_response_parser_feed (parser, buf, (int) ret)) {
+      if (!ok) {
          printf ("feed error: %s\n", parser->error);
          ASSERT (false);
       }
@@ -1005,7 +1308,19 @@ kms_response_parser_files (void)
       {"./test/example-chunked-response.bin", chunked_body, 512, 200},
       {"./test/example-chunked-response.bin", chunked_body, 1, 200},
       {"./test/example-multi-chunked-response.bin", chunked_body, 512, 200},
-      {"./test/example-multi-chunked-response.bin", chunked_body, 1, 200}};
+      {"./test/example-multi-chunked-response.bin", chunked_body, 1, 200},
+      {"./test/example-response.bin", body, 512, 200, true},
+      {"./test/example-response.bin", body, 1, 200, true},
+      {"./test/example-multi-chunked-response.bin",
+       chunked_body,
+       512,
+       200,
+       true},
+      {"./test/example-multi-chunked-response.bin",
+       chunked_body,
+       1,
+       200,
+       true}};
    size_t i;
 
    for (i = 0; i < sizeof (tests) / sizeof (tests[0]); i++) {
@@ -1196,6 +1511,7 @@ main (int argc, char *argv[])
    RUN_TEST (path_normalization_test);
    RUN_TEST (host_test);
    RUN_TEST (content_length_test);
+   RUN_TEST (header_added_after_signing_test);
    RUN_TEST (bad_query_test);
    RUN_TEST (append_header_field_value_test);
    RUN_TEST (set_date_test);
@@ -1203,8 +1519,13 @@ main (int argc, char *argv[])
    RUN_TEST (connection_close_test);
    RUN_TEST (decrypt_request_test);
    RUN_TEST (encrypt_request_test);
+   RUN_TEST (arena_request_test);
+   RUN_TEST (set_signing_key_test);
+   RUN_TEST (gcp_oauth_from_assertion_test);
    RUN_TEST (kv_list_del_test);
+   RUN_TEST (kv_list_indexed_test);
    RUN_TEST (b64_test);
+   RUN_TEST (b64_round_trip_test);
    RUN_TEST (b64_b64url_test);
 
    ran_tests |= all_aws_sig_v4_tests (aws_test_suite_dir, selector);
@@ -22,6 +22,10 @@
 #include <bcrypt.h>
 
 static BCRYPT_ALG_HANDLE _algo_sha512_hmac = 0;
+/* Creates HMAC objects that are reset by BCryptFinishHash and keep their key,
+ * for prepared keys. Not available before Windows 8, in which case prepared
+ * keys are not used. */
+static BCRYPT_ALG_HANDLE _algo_sha512_hmac_reusable = 0;
 static BCRYPT_ALG_HANDLE _algo_aes256 = 0;
 static DWORD _aes256_key_blob_length;
 
@@ -81,6 +85,15 @@ _native_crypto_init ()
       return;
    }
 
+   nt_status = BCryptOpenAlgorithmProvider (
+      &_algo_sha512_hmac_reusable,
+      BCRYPT_SHA512_ALGORITHM,
+      MS_PRIMITIVE_PROVIDER,
+      BCRYPT_ALG_HANDLE_HMAC_FLAG | BCRYPT_HASH_REUSABLE_FLAG);
+   if (nt_status != STATUS_SUCCESS) {
+      _algo_sha512_hmac_reusable = 0;
+   }
+
    _native_crypto_initialized = true;
 }
 
@@ -97,59 +110,72 @@ typedef struct {
 static void
 _crypto_state_destroy (cng_encrypt_state *state);
 
-static cng_encrypt_state *
-_crypto_state_init (const _mongocrypt_buffer_t *key,
-                    const _mongocrypt_buffer_t *iv,
-                    mongocrypt_status_t *status)
+/* Import a raw AES key. On success, the handle must be destroyed with
+ * BCryptDestroyKey before *key_object is freed. On failure, *key_handle is
+ * INVALID_HANDLE_VALUE and *key_object must still be freed. */
+static bool
+_import_aes_key (const uint8_t *key,
+                 uint32_t key_len,
+                 BCRYPT_KEY_HANDLE *key_handle,
+                 unsigned char **key_object)
 {
-   cng_encrypt_state *state;
    uint32_t keyBlobLength;
    unsigned char *keyBlob;
    BCRYPT_KEY_DATA_BLOB_HEADER blobHeader;
    NTSTATUS nt_status;
 
-   keyBlob = NULL;
-
-   state = bson_malloc0 (sizeof (*state));
-   BSON_ASSERT (state);
-
-   state->key_handle = INVALID_HANDLE_VALUE;
+   *key_handle = INVALID_HANDLE_VALUE;
 
    /* Initialize key storage buffer */
-   state->key_object = bson_malloc0 (_aes256_key_blob_length);
-   BSON_ASSERT (state->key_object);
-
-   state->key_object_length = _aes256_key_blob_length;
+   *key_object = bson_malloc0 (_aes256_key_blob_length);
+   BSON_ASSERT (*key_object);
 
    /* Allocate temporary buffer for key import */
-   keyBlobLength = sizeof (BCRYPT_KEY_DATA_BLOB_HEADER) + key->len;
+   keyBlobLength = sizeof (BCRYPT_KEY_DATA_BLOB_HEADER) + key_len;
    keyBlob = bson_malloc0 (keyBlobLength);
    BSON_ASSERT (keyBlob);
 
-
    blobHeader.dwMagic = BCRYPT_KEY_DATA_BLOB_MAGIC;
    blobHeader.dwVersion = BCRYPT_KEY_DATA_BLOB_VERSION1;
-   blobHeader.cbKeyData = key->len;
+   blobHeader.cbKeyData = key_len;
 
    memcpy (keyBlob, &blobHeader, sizeof (BCRYPT_KEY_DATA_BLOB_HEADER));
 
-   memcpy (keyBlob + sizeof (BCRYPT_KEY_DATA_BLOB_HEADER), key->data, key->len);
+   memcpy (keyBlob + sizeof (BCRYPT_KEY_DATA_BLOB_HEADER), key, key_len);
 
    nt_status = BCryptImportKey (_algo_aes256,
                                 NULL,
                                 BCRYPT_KEY_DATA_BLOB,
-                                &(state->key_handle),
-                                state->key_object,
-                                state->key_object_length,
+                                key_handle,
+                                *key_object,
+                                _aes256_key_blob_length,
                                 keyBlob,
                                 keyBlobLength,
                                 0);
+   bson_free (keyBlob);
    if (nt_status != STATUS_SUCCESS) {
-      CLIENT_ERR ("Import Key Failed: 0x%x", (int) nt_status);
-      goto fail;
+      *key_handle = INVALID_HANDLE_VALUE;
+      return false;
    }
+   return true;
+}
 
-   bson_free (keyBlob);
+static cng_encrypt_state *
+_crypto_state_init (const _mongocrypt_buffer_t *key,
+                    const _mongocrypt_buffer_t *iv,
+                    mongocrypt_status_t *status)
+{
+   cng_encrypt_state *state;
+
+   state = bson_malloc0 (sizeof (*state));
+   BSON_ASSERT (state);
+
+   if (!_import_aes_key (
+          key->data, key->len, &state->key_handle, &state->key_object)) {
+      CLIENT_ERR ("Import Key Failed");
+      goto fail;
+   }
+   state->key_object_length = _aes256_key_blob_length;
 
    state->iv = bson_malloc0 (iv->len);
    BSON_ASSERT (state->iv);
@@ -160,7 +186,6 @@ _crypto_state_init (const _mongocrypt_buffer_t *key,
    return state;
 fail:
    _crypto_state_destroy (state);
-   bson_free (keyBlob);
 
    return NULL;
 }
@@ -301,6 +326,93 @@ done:
 }
 
 
+struct __native_crypto_hmac_t {
+   BCRYPT_HASH_HANDLE hash;
+   /* True if owned by a prepared key, and not destroyed on destroy. */
+   bool borrowed;
+   /* True if data was hashed since the last BCryptFinishHash. */
+   bool in_progress;
+};
+
+
+_native_crypto_hmac_t *
+_native_crypto_hmac_sha_512_new (const _mongocrypt_buffer_t *key,
+                                 mongocrypt_status_t *status)
+{
+   _native_crypto_hmac_t *hmac;
+   NTSTATUS nt_status;
+
+   hmac = bson_malloc0 (sizeof (*hmac));
+   BSON_ASSERT (hmac);
+
+   nt_status = BCryptCreateHash (_algo_sha512_hmac,
+                                 &hmac->hash,
+                                 NULL,
+                                 0,
+                                 (PUCHAR) key->data,
+                                 (ULONG) key->len,
+                                 0);
+   if (nt_status != STATUS_SUCCESS) {
+      CLIENT_ERR ("error initializing hmac: 0x%x", (int) nt_status);
+      bson_free (hmac);
+      return NULL;
+   }
+   return hmac;
+}
+
+
+bool
+_native_crypto_hmac_update (_native_crypto_hmac_t *hmac,
+                            const _mongocrypt_buffer_t *in,
+                            mongocrypt_status_t *status)
+{
+   NTSTATUS nt_status;
+
+   hmac->in_progress = true;
+   nt_status =
+      BCryptHashData (hmac->hash, (PUCHAR) in->data, (ULONG) in->len, 0);
+   if (nt_status != STATUS_SUCCESS) {
+      CLIENT_ERR ("error hashing data: 0x%x", (int) nt_status);
+      return false;
+   }
+   return true;
+}
+
+
+bool
+_native_crypto_hmac_final (_native_crypto_hmac_t *hmac,
+                           _mongocrypt_buffer_t *out,
+                           mongocrypt_status_t *status)
+{
+   NTSTATUS nt_status;
+
+   if (out->len != MONGOCRYPT_HMAC_SHA512_LEN) {
+      CLIENT_ERR ("out does not contain %d bytes", MONGOCRYPT_HMAC_SHA512_LEN);
+      return false;
+   }
+
+   nt_status = BCryptFinishHash (hmac->hash, out->data, out->len, 0);
+   hmac->in_progress = false;
+   if (nt_status != STATUS_SUCCESS) {
+      CLIENT_ERR ("error finishing hmac: 0x%x", (int) nt_status);
+      return false;
+   }
+   return true;
+}
+
+
+void
+_native_crypto_hmac_destroy (_native_crypto_hmac_t *hmac)
+{
+   if (!hmac || hmac->borrowed) {
+      return;
+   }
+
+   (void) BCryptDestroyHash (hmac->hash);
+   bson_free (hmac);
+}
+
+
 bool
 _native_crypto_random (_mongocrypt_buffer_t *out,
                        uint32_t count,
@@ -315,4 +427,212 @@ _native_crypto_random (_mongocrypt_buffer_t *out,
    return true;
 }
 
+
+struct __native_crypto_key_t {
+   /* ENC_KEY, imported once. The IV is passed to each call. */
+   BCRYPT_KEY_HANDLE aes;
+   unsigned char *aes_object;
+   /* The chained IVs of the CBC encryption and decryption in progress.
+    * BCryptEncrypt and BCryptDecrypt update them after each call. */
+   uint8_t encrypt_iv[MONGOCRYPT_IV_LEN];
+   uint8_t decrypt_iv[MONGOCRYPT_IV_LEN];
+   /* Reusable HMAC objects keyed with MAC_KEY and IV_KEY. */
+   struct __native_crypto_hmac_t mac;
+   struct __native_crypto_hmac_t iv;
+};
+
+
+static bool
+_create_reusable_hmac (struct __native_crypto_hmac_t *hmac,
+                       const uint8_t *key,
+                       uint32_t key_len)
+{
+   NTSTATUS nt_status;
+
+   nt_status = BCryptCreateHash (_algo_sha512_hmac_reusable,
+                                 &hmac->hash,
+                                 NULL,
+                                 0,
+                                 (PUCHAR) key,
+                                 (ULONG) key_len,
+                                 BCRYPT_HASH_REUSABLE_FLAG);
+   if (nt_status != STATUS_SUCCESS) {
+      hmac->hash = NULL;
+      return false;
+   }
+   hmac->borrowed = true;
+   return true;
+}
+
+
+/* Reset a reusable HMAC abandoned by an earlier failure. */
+static bool
+_reset_reusable_hmac (struct __native_crypto_hmac_t *hmac,
+                      mongocrypt_status_t *status)
+{
+   uint8_t discard[MONGOCRYPT_HMAC_SHA512_LEN];
+   NTSTATUS nt_status;
+
+   if (!hmac->in_progress) {
+      return true;
+   }
+
+   nt_status = BCryptFinishHash (hmac->hash, discard, sizeof (discard), 0);
+   hmac->in_progress = false;
+   if (nt_status != STATUS_SUCCESS) {
+      CLIENT_ERR ("error resetting hmac: 0x%x", (int) nt_status);
+      return false;
+   }
+   return true;
+}
+
+
+_native_crypto_key_t *
+_native_crypto_key_new (const _mongocrypt_buffer_t *key)
+{
+   _native_crypto_key_t *native_key;
+   const uint8_t *mac_key, *enc_key, *iv_key;
+
+   if (key->len != MONGOCRYPT_KEY_LEN || !_algo_sha512_hmac_reusable) {
+      return NULL;
+   }
+
+   /* [MCGREW]: MAC_KEY is the initial 32 bytes, and ENC_KEY the next 32. The
+    * final 32 bytes are the key for deterministic IVs. */
+   mac_key = key->data;
+   enc_key = key->data + MONGOCRYPT_MAC_KEY_LEN;
+   iv_key = key->data + MONGOCRYPT_MAC_KEY_LEN + MONGOCRYPT_ENC_KEY_LEN;
+
+   native_key = bson_malloc0 (sizeof (*native_key));
+   BSON_ASSERT (native_key);
+
+   if (!_import_aes_key (enc_key,
+                         MONGOCRYPT_ENC_KEY_LEN,
+                         &native_key->aes,
+                         &native_key->aes_object) ||
+       !_create_reusable_hmac (
+          &native_key->mac, mac_key, MONGOCRYPT_MAC_KEY_LEN) ||
+       !_create_reusable_hmac (
+          &native_key->iv, iv_key, MONGOCRYPT_IV_KEY_LEN)) {
+      /* Fall back to importing the key on every call. */
+      _native_crypto_key_destroy (native_key);
+      return NULL;
+   }
+
+   return native_key;
+}
+
+
+void
+_native_crypto_key_destroy (_native_crypto_key_t *native_key)
+{
+   if (!native_key) {
+      return;
+   }
+
+   if (native_key->mac.hash) {
+      (void) BCryptDestroyHash (native_key->mac.hash);
+   }
+   if (native_key->iv.hash) {
+      (void) BCryptDestroyHash (native_key->iv.hash);
+   }
+   /* Free the key handle before the key object that contains it. */
+   if (native_key->aes != INVALID_HANDLE_VALUE) {
+      BCryptDestroyKey (native_key->aes);
+   }
+   bson_free (native_key->aes_object);
+   bson_free (native_key);
+}
+
+
+_native_crypto_hmac_t *
+_native_crypto_hmac_sha_512_new_with_key (_native_crypto_key_t *native_key,
+                                          bool iv_key,
+                                          mongocrypt_status_t *status)
+{
+   _native_crypto_hmac_t *hmac;
+
+   hmac = iv_key ? &native_key->iv : &native_key->mac;
+   if (!_reset_reusable_hmac (hmac, status)) {
+      return NULL;
+   }
+   return hmac;
+}
+
+
+bool
+_native_crypto_aes_256_cbc_init_with_key (_native_crypto_key_t *native_key,
+                                          bool encrypt,
+                                          const _mongocrypt_buffer_t *iv,
+                                          mongocrypt_status_t *status)
+{
+   BSON_ASSERT (iv->len == MONGOCRYPT_IV_LEN);
+   memcpy (encrypt ? native_key->encrypt_iv : native_key->decrypt_iv,
+           iv->data,
+           MONGOCRYPT_IV_LEN);
+   return true;
+}
+
+
+bool
+_native_crypto_aes_256_cbc_update_with_key (_native_crypto_key_t *native_key,
+                                            bool encrypt,
+                                            const _mongocrypt_buffer_t *in,
+                                            _mongocrypt_buffer_t *out,
+                                            mongocrypt_status_t *status)
+{
+   ULONG bytes_written;
+   NTSTATUS nt_status;
+
+   if (encrypt) {
+      nt_status = BCryptEncrypt (native_key->aes,
+                                 (PUCHAR) in->data,
+                                 in->len,
+                                 NULL,
+                                 native_key->encrypt_iv,
+                                 MONGOCRYPT_IV_LEN,
+                                 out->data,
+                                 in->len,
+                                 &bytes_written,
+                                 0);
+   } else {
+      nt_status = BCryptDecrypt (native_key->aes,
+                                 (PUCHAR) in->data,
+                                 in->len,
+                                 NULL,
+                                 native_key->decrypt_iv,
+                                 MONGOCRYPT_IV_LEN,
+                                 out->data,
+                                 in->len,
+                                 &bytes_written,
+                                 0);
+   }
+   if (nt_status != STATUS_SUCCESS || bytes_written != in->len) {
+      CLIENT_ERR ("error %s: 0x%x",
+                  encrypt ? "encrypting" : "decrypting",
+                  (int) nt_status);
+      return false;
+   }
+   return true;
+}
+
+
+/* Only the libcrypto implementation interleaves CBC encryptions. */
+bool
+_native_crypto_cbc_lanes_supported (void)
+{
+   return false;
+}
+
+
+bool
+_native_crypto_aes_256_cbc_encrypt_lanes (_native_crypto_key_t *native_key,
+                                          _native_crypto_cbc_lane_t *lanes,
+                                          uint32_t n_lanes,
+                                          mongocrypt_status_t *status)
+{
+   CLIENT_ERR ("interleaved CBC encryption not supported");
+   return false;
+}
+
 #endif /* MONGOCRYPT_ENABLE_CRYPTO_CNG */
\ No newline at end of file
@@ -168,6 +168,62 @@ _native_crypto_hmac_sha_512 (const _mongocrypt_buffer_t *key,
 }
 
 
+struct __native_crypto_hmac_t {
+   CCHmacContext ctx;
+   /* True if owned by a prepared key, and not freed on destroy. */
+   bool borrowed;
+};
+
+
+_native_crypto_hmac_t *
+_native_crypto_hmac_sha_512_new (const _mongocrypt_buffer_t *key,
+                                 mongocrypt_status_t *status)
+{
+   _native_crypto_hmac_t *hmac;
+
+   hmac = bson_malloc0 (sizeof (*hmac));
+   BSON_ASSERT (hmac);
+
+   CCHmacInit (&hmac->ctx, kCCHmacAlgSHA512, key->data, key->len);
+   return hmac;
+}
+
+
+bool
+_native_crypto_hmac_update (_native_crypto_hmac_t *hmac,
+                            const _mongocrypt_buffer_t *in,
+                            mongocrypt_status_t *status)
+{
+   CCHmacUpdate (&hmac->ctx, in->data, in->len);
+   return true;
+}
+
+
+bool
+_native_crypto_hmac_final (_native_crypto_hmac_t *hmac,
+                           _mongocrypt_buffer_t *out,
+                           mongocrypt_status_t *status)
+{
+   if (out->len != MONGOCRYPT_HMAC_SHA512_LEN) {
+      CLIENT_ERR ("out does not contain %d bytes", MONGOCRYPT_HMAC_SHA512_LEN);
+      return false;
+   }
+
+   CCHmacFinal (&hmac->ctx, out->data);
+   return true;
+}
+
+
+void
+_native_crypto_hmac_destroy (_native_crypto_hmac_t *hmac)
+{
+   if (!hmac || hmac->borrowed) {
+      return;
+   }
+   bson_free (hmac);
+}
+
+
 bool
 _native_crypto_random (_mongocrypt_buffer_t *out,
                        uint32_t count,
@@ -181,4 +237,178 @@ _native_crypto_random (_mongocrypt_buffer_t *out,
    return true;
 }
 
+
+struct __native_crypto_key_t {
+   /* Cryptors created once with ENC_KEY. CCCryptorReset sets the IV of each
+    * call, so the AES key schedule is not expanded again. */
+   CCCryptorRef encrypt;
+   CCCryptorRef decrypt;
+   /* CCHmacInit is cheap next to creating a cryptor, so the HMAC keys are
+    * kept and the contexts reinitialized per use. */
+   uint8_t mac_key[MONGOCRYPT_MAC_KEY_LEN];
+   uint8_t iv_key[MONGOCRYPT_IV_KEY_LEN];
+   struct __native_crypto_hmac_t mac;
+   struct __native_crypto_hmac_t iv;
+};
+
+
+static CCCryptorRef
+_cryptor_new (CCOperation op, const uint8_t *enc_key)
+{
+   CCCryptorRef cryptor = NULL;
+   CCCryptorStatus cc_status;
+
+   /* The IV is set by CCCryptorReset before each use. */
+   cc_status = CCCryptorCreate (op,
+                                kCCAlgorithmAES,
+                                0 /* defaults to CBC w/ no padding */,
+                                enc_key,
+                                kCCKeySizeAES256,
+                                NULL,
+                                &cryptor);
+   if (cc_status != kCCSuccess) {
+      return NULL;
+   }
+   return cryptor;
+}
+
+
+_native_crypto_key_t *
+_native_crypto_key_new (const _mongocrypt_buffer_t *key)
+{
+   _native_crypto_key_t *native_key;
+   const uint8_t *enc_key;
+
+   if (key->len != MONGOCRYPT_KEY_LEN) {
+      return NULL;
+   }
+
+   native_key = bson_malloc0 (sizeof (*native_key));
+   BSON_ASSERT (native_key);
+
+   /* [MCGREW]: MAC_KEY is the initial 32 bytes, and ENC_KEY the next 32. The
+    * final 32 bytes are the key for deterministic IVs. */
+   enc_key = key->data + MONGOCRYPT_MAC_KEY_LEN;
+   memcpy (native_key->mac_key, key->data, MONGOCRYPT_MAC_KEY_LEN);
+   memcpy (native_key->iv_key,
+           key->data + MONGOCRYPT_MAC_KEY_LEN + MONGOCRYPT_ENC_KEY_LEN,
+           MONGOCRYPT_IV_KEY_LEN);
+   native_key->mac.borrowed = true;
+   native_key->iv.borrowed = true;
+
+   native_key->encrypt = _cryptor_new (kCCEncrypt, enc_key);
+   native_key->decrypt = _cryptor_new (kCCDecrypt, enc_key);
+   if (!native_key->encrypt || !native_key->decrypt) {
+      /* Fall back to creating a cryptor on every call. */
+      _native_crypto_key_destroy (native_key);
+      return NULL;
+   }
+
+   return native_key;
+}
+
+
+void
+_native_crypto_key_destroy (_native_crypto_key_t *native_key)
+{
+   if (!native_key) {
+      return;
+   }
+
+   if (native_key->encrypt) {
+      CCCryptorRelease (native_key->encrypt);
+   }
+   if (native_key->decrypt) {
+      CCCryptorRelease (native_key->decrypt);
+   }
+   memset (native_key, 0, sizeof (*native_key));
+   bson_free (native_key);
+}
+
+
+_native_crypto_hmac_t *
+_native_crypto_hmac_sha_512_new_with_key (_native_crypto_key_t *native_key,
+                                          bool iv_key,
+                                          mongocrypt_status_t *status)
+{
+   if (iv_key) {
+      CCHmacInit (&native_key->iv.ctx,
+                  kCCHmacAlgSHA512,
+                  native_key->iv_key,
+                  sizeof (native_key->iv_key));
+      return &native_key->iv;
+   }
+   CCHmacInit (&native_key->mac.ctx,
+               kCCHmacAlgSHA512,
+               native_key->mac_key,
+               sizeof (native_key->mac_key));
+   return &native_key->mac;
+}
+
+
+bool
+_native_crypto_aes_256_cbc_init_with_key (_native_crypto_key_t *native_key,
+                                          bool encrypt,
+                                          const _mongocrypt_buffer_t *iv,
+                                          mongocrypt_status_t *status)
+{
+   CCCryptorStatus cc_status;
+
+   BSON_ASSERT (iv->len == MONGOCRYPT_IV_LEN);
+   cc_status = CCCryptorReset (
+      encrypt ? native_key->encrypt : native_key->decrypt, iv->data);
+   if (cc_status != kCCSuccess) {
+      CLIENT_ERR ("error initializing cipher: %d", (int) cc_status);
+      return false;
+   }
+   return true;
+}
+
+
+bool
+_native_crypto_aes_256_cbc_update_with_key (_native_crypto_key_t *native_key,
+                                            bool encrypt,
+                                            const _mongocrypt_buffer_t *in,
+                                            _mongocrypt_buffer_t *out,
+                                            mongocrypt_status_t *status)
+{
+   size_t bytes_written;
+   CCCryptorStatus cc_status;
+
+   /* The cryptors do not pad, so every block is written. */
+   cc_status = CCCryptorUpdate (
+      encrypt ? native_key->encrypt : native_key->decrypt,
+      in->data,
+      in->len,
+      out->data,
+      in->len,
+      &bytes_written);
+   if (cc_status != kCCSuccess || bytes_written != in->len) {
+      CLIENT_ERR ("error %s: %d",
+                  encrypt ? "encrypting" : "decrypting",
+                  (int) cc_status);
+      return false;
+   }
+   return true;
+}
+
+
+/* Only the libcrypto implementation interleaves CBC encryptions. */
+bool
+_native_crypto_cbc_lanes_supported (void)
+{
+   return false;
+}
+
+
+bool
+_native_crypto_aes_256_cbc_encrypt_lanes (_native_crypto_key_t *native_key,
+                                          _native_crypto_cbc_lane_t *lanes,
+                                          uint32_t n_lanes,
+                                          mongocrypt_status_t *status)
+{
+   CLIENT_ERR ("interleaved CBC encryption not supported");
+   return false;
+}
+
 #endif /* MONGOCRYPT_ENABLE_CRYPTO_COMMON_CRYPTO */
@@ -249,4 +249,311 @@ _native_crypto_random (_mongocrypt_buffer_t *out,
    return true;
 }
 
+struct __native_crypto_hmac_t {
+   HMAC_CTX *ctx;
+   /* True if owned by a prepared key, and not freed on destroy. */
+   bool borrowed;
+};
+
+struct __native_crypto_key_t {
+   /* Cipher contexts initialized with ENC_KEY and no IV. */
+   EVP_CIPHER_CTX *encrypt;
+   EVP_CIPHER_CTX *decrypt;
+   /* ECB with ENC_KEY, for _native_crypto_aes_256_cbc_encrypt_lanes. */
+   EVP_CIPHER_CTX *ecb_encrypt;
+   /* HMAC contexts initialized with MAC_KEY and IV_KEY. */
+   struct __native_crypto_hmac_t mac;
+   struct __native_crypto_hmac_t iv;
+};
+
+
+_native_crypto_key_t *
+_native_crypto_key_new (const _mongocrypt_buffer_t *key)
+{
+   _native_crypto_key_t *native_key;
+   const uint8_t *mac_key, *enc_key, *iv_key;
+
+   if (key->len != MONGOCRYPT_KEY_LEN) {
+      return NULL;
+   }
+
+   /* [MCGREW]: MAC_KEY is the initial 32 bytes, and ENC_KEY the next 32. The
+    * final 32 bytes are the key for deterministic IVs. */
+   mac_key = key->data;
+   enc_key = key->data + MONGOCRYPT_MAC_KEY_LEN;
+   iv_key = key->data + MONGOCRYPT_MAC_KEY_LEN + MONGOCRYPT_ENC_KEY_LEN;
+
+   native_key = bson_malloc0 (sizeof (*native_key));
+   BSON_ASSERT (native_key);
+   native_key->encrypt = EVP_CIPHER_CTX_new ();
+   native_key->decrypt = EVP_CIPHER_CTX_new ();
+   native_key->ecb_encrypt = EVP_CIPHER_CTX_new ();
+   native_key->mac.ctx = HMAC_CTX_new ();
+   native_key->mac.borrowed = true;
+   native_key->iv.ctx = HMAC_CTX_new ();
+   native_key->iv.borrowed = true;
+
+   if (!native_key->encrypt || !native_key->decrypt ||
+       !native_key->ecb_encrypt || !native_key->mac.ctx ||
+       !native_key->iv.ctx ||
+       !EVP_EncryptInit_ex (
+          native_key->encrypt, EVP_aes_256_cbc (), NULL, enc_key, NULL) ||
+       !EVP_DecryptInit_ex (
+          native_key->decrypt, EVP_aes_256_cbc (), NULL, enc_key, NULL) ||
+       !EVP_EncryptInit_ex (
+          native_key->ecb_encrypt, EVP_aes_256_ecb (), NULL, enc_key, NULL) ||
+       !HMAC_Init_ex (native_key->mac.ctx,
+                      mac_key,
+                      MONGOCRYPT_MAC_KEY_LEN,
+                      EVP_sha512 (),
+                      NULL) ||
+       !HMAC_Init_ex (native_key->iv.ctx,
+                      iv_key,
+                      MONGOCRYPT_IV_KEY_LEN,
+                      EVP_sha512 (),
+                      NULL)) {
+      /* Fall back to initializing on every call. */
+      _native_crypto_key_destroy (native_key);
+      return NULL;
+   }
+
+   EVP_CIPHER_CTX_set_padding (native_key->encrypt, 0);
+   EVP_CIPHER_CTX_set_padding (native_key->decrypt, 0);
+   EVP_CIPHER_CTX_set_padding (native_key->ecb_encrypt, 0);
+   return native_key;
+}
+
+
+void
+_native_crypto_key_destroy (_native_crypto_key_t *native_key)
+{
+   if (!native_key) {
+      return;
+   }
+
+   if (native_key->encrypt) {
+      EVP_CIPHER_CTX_free (native_key->encrypt);
+   }
+   if (native_key->decrypt) {
+      EVP_CIPHER_CTX_free (native_key->decrypt);
+   }
+   if (native_key->ecb_encrypt) {
+      EVP_CIPHER_CTX_free (native_key->ecb_encrypt);
+   }
+   if (native_key->mac.ctx) {
+      HMAC_CTX_free (native_key->mac.ctx);
+   }
+   if (native_key->iv.ctx) {
+      HMAC_CTX_free (native_key->iv.ctx);
+   }
+   bson_free (native_key);
+}
+
+
+_native_crypto_hmac_t *
+_native_crypto_hmac_sha_512_new (const _mongocrypt_buffer_t *key,
+                                 mongocrypt_status_t *status)
+{
+   _native_crypto_hmac_t *hmac;
+
+   hmac = bson_malloc0 (sizeof (*hmac));
+   BSON_ASSERT (hmac);
+   hmac->ctx = HMAC_CTX_new ();
+   if (!hmac->ctx) {
+      CLIENT_ERR ("error creating HMAC: %s",
+                  ERR_error_string (ERR_get_error (), NULL));
+      bson_free (hmac);
+      return NULL;
+   }
+
+   if (!HMAC_Init_ex (
+          hmac->ctx, key->data, key->len, EVP_sha512 (), NULL /* engine */)) {
+      CLIENT_ERR ("error initializing HMAC: %s",
+                  ERR_error_string (ERR_get_error (), NULL));
+      _native_crypto_hmac_destroy (hmac);
+      return NULL;
+   }
+   return hmac;
+}
+
+
+_native_crypto_hmac_t *
+_native_crypto_hmac_sha_512_new_with_key (_native_crypto_key_t *native_key,
+                                          bool iv_key,
+                                          mongocrypt_status_t *status)
+{
+   _native_crypto_hmac_t *hmac;
+
+   hmac = iv_key ? &native_key->iv : &native_key->mac;
+   /* With a NULL key and digest, HMAC_Init_ex restarts with the key pads
+    * computed at initialization. */
+   if (!HMAC_Init_ex (hmac->ctx, NULL, 0, NULL, NULL /* engine */)) {
+      CLIENT_ERR ("error initializing HMAC: %s",
+                  ERR_error_string (ERR_get_error (), NULL));
+      return NULL;
+   }
+   return hmac;
+}
+
+
+bool
+_native_crypto_hmac_update (_native_crypto_hmac_t *hmac,
+                            const _mongocrypt_buffer_t *in,
+                            mongocrypt_status_t *status)
+{
+   if (!HMAC_Update (hmac->ctx, in->data, in->len)) {
+      CLIENT_ERR ("error updating HMAC: %s",
+                  ERR_error_string (ERR_get_error (), NULL));
+      return false;
+   }
+   return true;
+}
+
+
+bool
+_native_crypto_hmac_final (_native_crypto_hmac_t *hmac,
+                           _mongocrypt_buffer_t *out,
+                           mongocrypt_status_t *status)
+{
+   if (out->len != MONGOCRYPT_HMAC_SHA512_LEN) {
+      CLIENT_ERR ("out does not contain %d bytes", MONGOCRYPT_HMAC_SHA512_LEN);
+      return false;
+   }
+
+   if (!HMAC_Final (hmac->ctx, out->data, NULL /* unused out len */)) {
+      CLIENT_ERR ("error finalizing: %s",
+                  ERR_error_string (ERR_get_error (), NULL));
+      return false;
+   }
+   return true;
+}
+
+
+void
+_native_crypto_hmac_destroy (_native_crypto_hmac_t *hmac)
+{
+   if (!hmac || hmac->borrowed) {
+      return;
+   }
+
+   HMAC_CTX_free (hmac->ctx);
+   bson_free (hmac);
+}
+
+
+bool
+_native_crypto_aes_256_cbc_init_with_key (_native_crypto_key_t *native_key,
+                                          bool encrypt,
+                                          const _mongocrypt_buffer_t *iv,
+                                          mongocrypt_status_t *status)
+{
+   EVP_CIPHER_CTX *ctx;
+
+   ctx = encrypt ? native_key->encrypt : native_key->decrypt;
+   BSON_ASSERT (EVP_CIPHER_CTX_iv_length (ctx) == iv->len);
+
+   /* Only set the IV. The key schedule is kept from initialization. */
+   if (!EVP_CipherInit_ex (ctx, NULL, NULL, NULL, iv->data, encrypt ? 1 : 0)) {
+      CLIENT_ERR ("error initializing cipher: %s",
+                  ERR_error_string (ERR_get_error (), NULL));
+      return false;
+   }
+   return true;
+}
+
+
+bool
+_native_crypto_aes_256_cbc_update_with_key (_native_crypto_key_t *native_key,
+                                            bool encrypt,
+                                            const _mongocrypt_buffer_t *in,
+                                            _mongocrypt_buffer_t *out,
+                                            mongocrypt_status_t *status)
+{
+   EVP_CIPHER_CTX *ctx;
+   int bytes_written;
+
+   ctx = encrypt ? native_key->encrypt : native_key->decrypt;
+   /* Padding is disabled, so every block is written immediately. */
+   if (!EVP_CipherUpdate (
+          ctx, out->data, &bytes_written, in->data, (int) in->len) ||
+       (uint32_t) bytes_written != in->len) {
+      CLIENT_ERR ("error %s: %s",
+                  encrypt ? "encrypting" : "decrypting",
+                  ERR_error_string (ERR_get_error (), NULL));
+      return false;
+   }
+   return true;
+}
+
+
+bool
+_native_crypto_cbc_lanes_supported (void)
+{
+   return true;
+}
+
+
+bool
+_native_crypto_aes_256_cbc_encrypt_lanes (_native_crypto_key_t *native_key,
+                                          _native_crypto_cbc_lane_t *lanes,
+                                          uint32_t n_lanes,
+                                          mongocrypt_status_t *status)
+{
+   uint8_t blocks[MONGOCRYPT_CBC_MAX_LANES * MONGOCRYPT_BLOCK_SIZE];
+   uint32_t active[MONGOCRYPT_CBC_MAX_LANES];
+   uint32_t offset;
+   uint32_t i, j, n;
+   int bytes_written;
+
+   BSON_ASSERT (n_lanes <= MONGOCRYPT_CBC_MAX_LANES);
+   for (i = 0; i < n_lanes; i++) {
+      if (lanes[i].len % MONGOCRYPT_BLOCK_SIZE != 0) {
+         CLIENT_ERR ("lane length is not a multiple of block size");
+         return false;
+      }
+   }
+
+   for (offset = 0;; offset += MONGOCRYPT_BLOCK_SIZE) {
+      /* C_i = E (P_i ^ C_i-1), with C_0 the IV, for each unfinished lane. */
+      n = 0;
+      for (i = 0; i < n_lanes; i++) {
+         const uint8_t *prev;
+         uint8_t *block;
+
+         if (offset >= lanes[i].len) {
+            continue;
+         }
+         prev = offset == 0 ? lanes[i].iv
+                            : lanes[i].data + offset - MONGOCRYPT_BLOCK_SIZE;
+         block = blocks + n * MONGOCRYPT_BLOCK_SIZE;
+         for (j = 0; j < MONGOCRYPT_BLOCK_SIZE; j++) {
+            block[j] = lanes[i].data[offset + j] ^ prev[j];
+         }
+         active[n++] = i;
+      }
+      if (n == 0) {
+         break;
+      }
+
+      if (!EVP_EncryptUpdate (native_key->ecb_encrypt,
+                              blocks,
+                              &bytes_written,
+                              blocks,
+                              (int) (n * MONGOCRYPT_BLOCK_SIZE)) ||
+          (uint32_t) bytes_written != n * MONGOCRYPT_BLOCK_SIZE) {
+         CLIENT_ERR ("error encrypting: %s",
+                     ERR_error_string (ERR_get_error (), NULL));
+         return false;
+      }
+
+      for (i = 0; i < n; i++) {
+         memcpy (lanes[active[i]].data + offset,
+                 blocks + i * MONGOCRYPT_BLOCK_SIZE,
+                 MONGOCRYPT_BLOCK_SIZE);
+      }
+   }
+   return true;
+}
+
+
 #endif /* MONGOCRYPT_ENABLE_CRYPTO_LIBCRYPTO */
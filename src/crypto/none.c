@@ -67,6 +67,41 @@ _native_crypto_hmac_sha_512 (const _mongocrypt_buffer_t *key,
 }
 
 
+_native_crypto_hmac_t *
+_native_crypto_hmac_sha_512_new (const _mongocrypt_buffer_t *key,
+                                 mongocrypt_status_t *status)
+{
+   CLIENT_ERR ("hook not set for hmac_sha_512");
+   return NULL;
+}
+
+
+bool
+_native_crypto_hmac_update (_native_crypto_hmac_t *hmac,
+                            const _mongocrypt_buffer_t *in,
+                            mongocrypt_status_t *status)
+{
+   CLIENT_ERR ("hook not set for hmac_sha_512");
+   return false;
+}
+
+
+bool
+_native_crypto_hmac_final (_native_crypto_hmac_t *hmac,
+                           _mongocrypt_buffer_t *out,
+                           mongocrypt_status_t *status)
+{
+   CLIENT_ERR ("hook not set for hmac_sha_512");
+   return false;
+}
+
+
+void
+_native_crypto_hmac_destroy (_native_crypto_hmac_t *hmac)
+{
+}
+
+
 bool
 _native_crypto_random (_mongocrypt_buffer_t *out,
                        uint32_t count,
@@ -76,4 +111,71 @@ _native_crypto_random (_mongocrypt_buffer_t *out,
    return false;
 }
 
+
+/* Prepared keys are not supported. Callers fall back to the functions
+ * above, so the functions taking a prepared key are never called. */
+_native_crypto_key_t *
+_native_crypto_key_new (const _mongocrypt_buffer_t *key)
+{
+   return NULL;
+}
+
+
+void
+_native_crypto_key_destroy (_native_crypto_key_t *native_key)
+{
+}
+
+
+_native_crypto_hmac_t *
+_native_crypto_hmac_sha_512_new_with_key (_native_crypto_key_t *native_key,
+                                          bool iv_key,
+                                          mongocrypt_status_t *status)
+{
+   CLIENT_ERR ("prepared keys not supported");
+   return NULL;
+}
+
+
+bool
+_native_crypto_aes_256_cbc_init_with_key (_native_crypto_key_t *native_key,
+                                          bool encrypt,
+                                          const _mongocrypt_buffer_t *iv,
+                                          mongocrypt_status_t *status)
+{
+   CLIENT_ERR ("prepared keys not supported");
+   return false;
+}
+
+
+bool
+_native_crypto_aes_256_cbc_update_with_key (_native_crypto_key_t *native_key,
+                                            bool encrypt,
+                                            const _mongocrypt_buffer_t *in,
+                                            _mongocrypt_buffer_t *out,
+                                            mongocrypt_status_t *status)
+{
+   CLIENT_ERR ("prepared keys not supported");
+   return false;
+}
+
+
+/* Prepared keys are not supported, so neither is this. */
+bool
+_native_crypto_cbc_lanes_supported (void)
+{
+   return false;
+}
+
+
+bool
+_native_crypto_aes_256_cbc_encrypt_lanes (_native_crypto_key_t *native_key,
+                                          _native_crypto_cbc_lane_t *lanes,
+                                          uint32_t n_lanes,
+                                          mongocrypt_status_t *status)
+{
+   CLIENT_ERR ("interleaved CBC encryption not supported");
+   return false;
+}
+
 #endif /* MONGOCRYPT_ENABLE_CRYPTO */
\ No newline at end of file
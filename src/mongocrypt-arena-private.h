@@ -0,0 +1,65 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_ARENA_PRIVATE_H
+#define MONGOCRYPT_ARENA_PRIVATE_H
+
+#include <bson/bson.h>
+
+#include "mongocrypt-buffer-private.h"
+
+/* A bump allocator for temporaries that live as long as a context.
+ * Allocations are never freed individually. They are all released at once by
+ * _mongocrypt_arena_reset or _mongocrypt_arena_cleanup. */
+typedef struct __mongocrypt_arena_chunk_t {
+   struct __mongocrypt_arena_chunk_t *next;
+   size_t len;
+   size_t used;
+   uint8_t data[];
+} _mongocrypt_arena_chunk_t;
+
+typedef struct {
+   /* The head is the newest and largest chunk. */
+   _mongocrypt_arena_chunk_t *chunks;
+   /* Optional. The bytes of allocated chunks are added to it, and subtracted
+    * when they are freed, with _mongocrypt_atomic_add_int64. */
+   int64_t *held;
+} _mongocrypt_arena_t;
+
+void
+_mongocrypt_arena_init (_mongocrypt_arena_t *arena);
+
+/* Returns @len bytes aligned for any type. Never returns NULL. */
+void *
+_mongocrypt_arena_alloc (_mongocrypt_arena_t *arena, size_t len);
+
+/* Release all allocations. The largest chunk is kept for reuse. */
+void
+_mongocrypt_arena_reset (_mongocrypt_arena_t *arena);
+
+void
+_mongocrypt_arena_cleanup (_mongocrypt_arena_t *arena);
+
+/* Initialize @buf with @len bytes of uninitialized data. The data comes from
+ * @arena and @buf does not own it. If @arena is NULL, the data is allocated
+ * and owned by @buf. Either way, @buf must be cleaned up with
+ * _mongocrypt_buffer_cleanup. */
+void
+_mongocrypt_arena_buffer (_mongocrypt_arena_t *arena,
+                          _mongocrypt_buffer_t *buf,
+                          uint32_t len);
+
+#endif /* MONGOCRYPT_ARENA_PRIVATE_H */
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-arena-private.h"
+#include "mongocrypt-mutex-private.h"
+
+/* Large enough for the temporaries of a few dozen small fields. */
+#define ARENA_MIN_CHUNK_LEN 4096
+#define ARENA_ALIGNMENT 16
+
+void
+_mongocrypt_arena_init (_mongocrypt_arena_t *arena)
+{
+   BSON_ASSERT (arena);
+
+   arena->chunks = NULL;
+   arena->held = NULL;
+}
+
+
+static void
+_chunk_free (_mongocrypt_arena_t *arena, _mongocrypt_arena_chunk_t *chunk)
+{
+   if (arena->held) {
+      _mongocrypt_atomic_add_int64 (
+         arena->held,
+         -(int64_t) (sizeof (_mongocrypt_arena_chunk_t) + chunk->len));
+   }
+   bson_free (chunk);
+}
+
+
+void *
+_mongocrypt_arena_alloc (_mongocrypt_arena_t *arena, size_t len)
+{
+   _mongocrypt_arena_chunk_t *chunk;
+   size_t aligned_len;
+   size_t chunk_len;
+   void *ret;
+
+   BSON_ASSERT (arena);
+
+   aligned_len = (len + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+   BSON_ASSERT (aligned_len >= len);
+
+   chunk = arena->chunks;
+   if (!chunk || chunk->len - chunk->used < aligned_len) {
+      /* Double the chunk size each time, so a context needs few chunks. */
+      chunk_len = chunk ? chunk->len * 2 : ARENA_MIN_CHUNK_LEN;
+      if (chunk_len < aligned_len) {
+         chunk_len = aligned_len;
+      }
+      chunk = bson_malloc (sizeof (_mongocrypt_arena_chunk_t) + chunk_len);
+      BSON_ASSERT (chunk);
+      chunk->len = chunk_len;
+      chunk->used = 0;
+      chunk->next = arena->chunks;
+      arena->chunks = chunk;
+      if (arena->held) {
+         _mongocrypt_atomic_add_int64 (
+            arena->held,
+            (int64_t) (sizeof (_mongocrypt_arena_chunk_t) + chunk_len));
+      }
+   }
+
+   ret = chunk->data + chunk->used;
+   chunk->used += aligned_len;
+   return ret;
+}
+
+
+void
+_mongocrypt_arena_reset (_mongocrypt_arena_t *arena)
+{
+   _mongocrypt_arena_chunk_t *chunk;
+
+   BSON_ASSERT (arena);
+
+   if (!arena->chunks) {
+      return;
+   }
+
+   chunk = arena->chunks->next;
+   while (chunk) {
+      _mongocrypt_arena_chunk_t *next = chunk->next;
+
+      _chunk_free (arena, chunk);
+      chunk = next;
+   }
+   arena->chunks->next = NULL;
+   arena->chunks->used = 0;
+}
+
+
+void
+_mongocrypt_arena_cleanup (_mongocrypt_arena_t *arena)
+{
+   if (!arena) {
+      return;
+   }
+
+   _mongocrypt_arena_reset (arena);
+   if (arena->chunks) {
+      _chunk_free (arena, arena->chunks);
+   }
+   arena->chunks = NULL;
+}
+
+
+void
+_mongocrypt_arena_buffer (_mongocrypt_arena_t *arena,
+                          _mongocrypt_buffer_t *buf,
+                          uint32_t len)
+{
+   BSON_ASSERT (buf);
+
+   _mongocrypt_buffer_init (buf);
+   if (!arena) {
+      _mongocrypt_buffer_resize (buf, len);
+      return;
+   }
+
+   buf->data = _mongocrypt_arena_alloc (arena, len);
+   buf->len = len;
+   buf->owned = false;
+}
@@ -24,6 +24,8 @@
 struct _mongocrypt_binary_t {
    uint8_t *data;
    uint32_t len;
+   /* Set by mongocrypt_ctx_finalize_steal. data is freed on destroy. */
+   bool owned;
 };
 
 bool
@@ -78,5 +78,8 @@ mongocrypt_binary_destroy (mongocrypt_binary_t *binary)
       return;
    }
 
+   if (binary->owned) {
+      bson_free (binary->data);
+   }
    bson_free (binary);
 }
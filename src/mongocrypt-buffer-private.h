@@ -76,6 +76,24 @@ void
 _mongocrypt_buffer_steal_from_bson (_mongocrypt_buffer_t *buf, bson_t *bson);
 
 
+/* The length of an element with a key of @key_len bytes and the value @value,
+ * for reserving the capacity of an output document with bson_sized_new.
+ * Types that are not measured count their largest fixed size, and appending
+ * grows the document if that falls short. */
+uint32_t
+_mongocrypt_bson_element_len (uint32_t key_len, const bson_value_t *value);
+
+/* Set @len to the length of the encoding of @value, without a type byte or
+ * key. Returns false for types that are left to libbson to encode. */
+bool
+_mongocrypt_bson_value_len (const bson_value_t *value, uint32_t *len);
+
+/* Write the encoding of @value to @dst, which must hold the length given by
+ * _mongocrypt_bson_value_len. */
+void
+_mongocrypt_bson_value_write (const bson_value_t *value, uint8_t *dst);
+
+
 void
 _mongocrypt_buffer_from_bson (_mongocrypt_buffer_t *buf, const bson_t *bson);
 
@@ -136,6 +154,21 @@ void
 _mongocrypt_buffer_from_iter (_mongocrypt_buffer_t *plaintext,
                               bson_iter_t *iter);
 
+/* Set @doc to the document { "v": <value> } for the raw value @raw: a BSON
+ * type byte followed by the encoding of a value, as in a document after the
+ * key. The document is built by copying, without appending to a bson_t.
+ * Returns false if @raw is not one well-formed value. */
+bool
+_mongocrypt_buffer_wrap_raw_value (_mongocrypt_buffer_t *doc,
+                                   const _mongocrypt_buffer_t *raw)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Set @buf to the raw value of @value: its type byte followed by its
+ * encoding. */
+void
+_mongocrypt_buffer_from_raw_value (_mongocrypt_buffer_t *buf,
+                                   const bson_value_t *value);
+
 
 bool
 _mongocrypt_buffer_from_uuid_iter (_mongocrypt_buffer_t *buf, bson_iter_t *iter)
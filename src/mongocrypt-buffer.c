@@ -59,8 +59,10 @@ _mongocrypt_buffer_resize (_mongocrypt_buffer_t *buf, uint32_t len)
       but a fancier implementation could copy over up to 'len'
       bytes from the old buffer to the new one. */
    if (buf->owned) {
-      buf->data = bson_realloc (buf->data, len);
-      buf->len = len;
+      if (buf->len != len) {
+         buf->data = bson_realloc (buf->data, len);
+         buf->len = len;
+      }
       return;
    }
 
@@ -150,6 +152,144 @@ _mongocrypt_buffer_steal_from_bson (_mongocrypt_buffer_t *buf, bson_t *bson)
 }
 
 
+uint32_t
+_mongocrypt_bson_element_len (uint32_t key_len, const bson_value_t *value)
+{
+   uint32_t len;
+
+   /* The type byte, the key, and its NULL terminator. */
+   len = 1u + key_len + 1u;
+   switch (value->value_type) {
+   case BSON_TYPE_BINARY:
+      return len + 4u + 1u + value->value.v_binary.data_len;
+   case BSON_TYPE_UTF8:
+      return len + 4u + value->value.v_utf8.len + 1u;
+   case BSON_TYPE_DOCUMENT:
+   case BSON_TYPE_ARRAY:
+      return len + value->value.v_doc.data_len;
+   default:
+      /* A decimal128 is the largest fixed size value. */
+      return len + 16u;
+   }
+}
+
+
+bool
+_mongocrypt_bson_value_len (const bson_value_t *value, uint32_t *len)
+{
+   switch (value->value_type) {
+   case BSON_TYPE_BOOL:
+      *len = 1u;
+      return true;
+   case BSON_TYPE_INT32:
+      *len = 4u;
+      return true;
+   case BSON_TYPE_INT64:
+   case BSON_TYPE_DATE_TIME:
+   case BSON_TYPE_DOUBLE:
+      *len = 8u;
+      return true;
+   case BSON_TYPE_OID:
+      *len = 12u;
+      return true;
+   case BSON_TYPE_DECIMAL128:
+      *len = 16u;
+      return true;
+   case BSON_TYPE_UTF8:
+      /* The length, the string, and its NULL terminator. */
+      if (value->value.v_utf8.len > INT32_MAX - 5u) {
+         return false;
+      }
+      *len = 4u + value->value.v_utf8.len + 1u;
+      return true;
+   case BSON_TYPE_DOCUMENT:
+   case BSON_TYPE_ARRAY:
+      *len = value->value.v_doc.data_len;
+      return true;
+   case BSON_TYPE_BINARY:
+      /* The deprecated subtype has a second length. */
+      if (value->value.v_binary.subtype == BSON_SUBTYPE_BINARY_DEPRECATED ||
+          value->value.v_binary.data_len > INT32_MAX - 5u) {
+         return false;
+      }
+      /* The length, the subtype, and the data. */
+      *len = 4u + 1u + value->value.v_binary.data_len;
+      return true;
+   default:
+      return false;
+   }
+}
+
+
+static void
+_write_uint32_le (uint8_t *dst, uint32_t value)
+{
+   value = BSON_UINT32_TO_LE (value);
+   memcpy (dst, &value, sizeof (value));
+}
+
+
+static void
+_write_uint64_le (uint8_t *dst, uint64_t value)
+{
+   value = BSON_UINT64_TO_LE (value);
+   memcpy (dst, &value, sizeof (value));
+}
+
+
+void
+_mongocrypt_bson_value_write (const bson_value_t *value, uint8_t *dst)
+{
+   uint64_t u64;
+
+   switch (value->value_type) {
+   case BSON_TYPE_BOOL:
+      *dst = value->value.v_bool ? 1 : 0;
+      break;
+   case BSON_TYPE_INT32:
+      _write_uint32_le (dst, (uint32_t) value->value.v_int32);
+      break;
+   case BSON_TYPE_INT64:
+      _write_uint64_le (dst, (uint64_t) value->value.v_int64);
+      break;
+   case BSON_TYPE_DATE_TIME:
+      _write_uint64_le (dst, (uint64_t) value->value.v_datetime);
+      break;
+   case BSON_TYPE_DOUBLE:
+      memcpy (&u64, &value->value.v_double, sizeof (u64));
+      _write_uint64_le (dst, u64);
+      break;
+   case BSON_TYPE_OID:
+      memcpy (dst, value->value.v_oid.bytes, 12);
+      break;
+   case BSON_TYPE_DECIMAL128:
+      _write_uint64_le (dst, value->value.v_decimal128.low);
+      _write_uint64_le (dst + 8, value->value.v_decimal128.high);
+      break;
+   case BSON_TYPE_UTF8:
+      _write_uint32_le (dst, value->value.v_utf8.len + 1u);
+      memcpy (dst + 4, value->value.v_utf8.str, value->value.v_utf8.len);
+      dst[4 + value->value.v_utf8.len] = NULL_BYTE_VAL;
+      break;
+   case BSON_TYPE_DOCUMENT:
+   case BSON_TYPE_ARRAY:
+      memcpy (dst, value->value.v_doc.data, value->value.v_doc.data_len);
+      break;
+   case BSON_TYPE_BINARY:
+      _write_uint32_le (dst, value->value.v_binary.data_len);
+      dst[4] = (uint8_t) value->value.v_binary.subtype;
+      if (value->value.v_binary.data_len) {
+         memcpy (dst + 5,
+                 value->value.v_binary.data,
+                 value->value.v_binary.data_len);
+      }
+      break;
+   default:
+      BSON_ASSERT (false && "type has no direct encoding");
+   }
+}
+
+
 void
 _mongocrypt_buffer_from_bson (_mongocrypt_buffer_t *buf, const bson_t *bson)
 {
@@ -224,6 +364,14 @@ _mongocrypt_buffer_copy_to (const _mongocrypt_buffer_t *src,
    BSON_ASSERT (src);
    BSON_ASSERT (dst);
 
+   /* Reuse the allocation when copying over a buffer of the same length,
+    * like a key id or IV copied into the same slot. */
+   if (dst->owned && dst->len == src->len && src->len > 0) {
+      memmove (dst->data, src->data, src->len);
+      dst->subtype = src->subtype;
+      return;
+   }
+
    _mongocrypt_buffer_cleanup (dst);
    if (src->len == 0) {
       return;
@@ -283,6 +431,161 @@ _mongocrypt_buffer_empty (const _mongocrypt_buffer_t *buf)
    return buf->data == NULL;
 }
 
+static uint64_t
+_read_uint64_le (const uint8_t *data)
+{
+   uint64_t value;
+
+   memcpy (&value, data, sizeof (value));
+   return BSON_UINT64_FROM_LE (value);
+}
+
+
+/* Decode fixed width types without wrapping them in a document. Returns false
+ * for other types, and for values the general path must validate. */
+static bool
+_fixed_width_to_bson_value (const _mongocrypt_buffer_t *plaintext,
+                            uint8_t type,
+                            bson_value_t *out)
+{
+   const uint8_t *data = plaintext->data;
+   uint32_t len = plaintext->len;
+   uint64_t u64;
+   uint32_t u32;
+
+   switch (type) {
+   case BSON_TYPE_INT32:
+      if (len != 4) {
+         return false;
+      }
+      memcpy (&u32, data, sizeof (u32));
+      out->value.v_int32 = (int32_t) BSON_UINT32_FROM_LE (u32);
+      break;
+   case BSON_TYPE_INT64:
+      if (len != 8) {
+         return false;
+      }
+      out->value.v_int64 = (int64_t) _read_uint64_le (data);
+      break;
+   case BSON_TYPE_DATE_TIME:
+      if (len != 8) {
+         return false;
+      }
+      out->value.v_datetime = (int64_t) _read_uint64_le (data);
+      break;
+   case BSON_TYPE_DOUBLE:
+      if (len != 8) {
+         return false;
+      }
+      u64 = _read_uint64_le (data);
+      memcpy (&out->value.v_double, &u64, sizeof (u64));
+      break;
+   case BSON_TYPE_BOOL:
+      if (len != 1 || data[0] > 1) {
+         return false;
+      }
+      out->value.v_bool = data[0] == 1;
+      break;
+   case BSON_TYPE_OID:
+      if (len != 12) {
+         return false;
+      }
+      memcpy (out->value.v_oid.bytes, data, 12);
+      break;
+   case BSON_TYPE_DECIMAL128:
+      if (len != 16) {
+         return false;
+      }
+      out->value.v_decimal128.low = _read_uint64_le (data);
+      out->value.v_decimal128.high = _read_uint64_le (data + 8);
+      break;
+   default:
+      return false;
+   }
+   out->value_type = (bson_type_t) type;
+   return true;
+}
+
+
+static uint32_t
+_read_uint32_le (const uint8_t *data)
+{
+   uint32_t value;
+
+   memcpy (&value, data, sizeof (value));
+   return BSON_UINT32_FROM_LE (value);
+}
+
+
+/* Decode strings, documents, arrays, and binaries without wrapping them in a
+ * document. Only the value is validated, and its bytes are copied once, into
+ * @out. Returns false for other types, and for values the general path must
+ * validate. */
+static bool
+_variable_width_to_bson_value (const _mongocrypt_buffer_t *plaintext,
+                               uint8_t type,
+                               bson_value_t *out)
+{
+   const uint8_t *data = plaintext->data;
+   uint32_t len = plaintext->len;
+   uint32_t value_len;
+   bson_t doc;
+
+   switch (type) {
+   case BSON_TYPE_UTF8:
+      /* The length, including the NULL terminator, then the string. */
+      if (len < INT32_LEN + NULL_BYTE_LEN) {
+         return false;
+      }
+      value_len = _read_uint32_le (data);
+      if (value_len != len - INT32_LEN || data[len - 1] != NULL_BYTE_VAL) {
+         return false;
+      }
+      out->value.v_utf8.str = bson_malloc (value_len);
+      BSON_ASSERT (out->value.v_utf8.str);
+      memcpy (out->value.v_utf8.str, data + INT32_LEN, value_len);
+      out->value.v_utf8.len = value_len - NULL_BYTE_LEN;
+      break;
+   case BSON_TYPE_DOCUMENT:
+   case BSON_TYPE_ARRAY:
+      if (!bson_init_static (&doc, data, len) ||
+          !bson_validate (&doc, BSON_VALIDATE_NONE, NULL)) {
+         return false;
+      }
+      out->value.v_doc.data = bson_malloc (len);
+      BSON_ASSERT (out->value.v_doc.data);
+      memcpy (out->value.v_doc.data, data, len);
+      out->value.v_doc.data_len = len;
+      break;
+   case BSON_TYPE_BINARY:
+      /* The length, the subtype, and the data. */
+      if (len < INT32_LEN + TYPE_LEN) {
+         return false;
+      }
+      value_len = _read_uint32_le (data);
+      if (value_len != len - INT32_LEN - TYPE_LEN ||
+          data[INT32_LEN] == BSON_SUBTYPE_BINARY_DEPRECATED) {
+         return false;
+      }
+      out->value.v_binary.subtype = (bson_subtype_t) data[INT32_LEN];
+      out->value.v_binary.data_len = value_len;
+      /* Give an empty payload a real address, as below. */
+      out->value.v_binary.data = bson_malloc (value_len ? value_len : 1u);
+      BSON_ASSERT (out->value.v_binary.data);
+      if (value_len) {
+         memcpy (out->value.v_binary.data,
+                 data + INT32_LEN + TYPE_LEN,
+                 value_len);
+      }
+      break;
+   default:
+      return false;
+   }
+   out->value_type = (bson_type_t) type;
+   return true;
+}
+
+
 bool
 _mongocrypt_buffer_to_bson_value (_mongocrypt_buffer_t *plaintext,
                                   uint8_t type,
@@ -296,6 +599,11 @@ _mongocrypt_buffer_to_bson_value (_mongocrypt_buffer_t *plaintext,
    uint8_t *data;
    uint8_t data_prefix;
 
+   if (_fixed_width_to_bson_value (plaintext, type, out) ||
+       _variable_width_to_bson_value (plaintext, type, out)) {
+      return true;
+   }
+
    data_prefix = INT32_LEN        /* adds document size */
                  + TYPE_LEN       /* element type */
                  + NULL_BYTE_LEN; /* and doc's null byte terminator */
@@ -349,6 +657,17 @@ _mongocrypt_buffer_from_iter (_mongocrypt_buffer_t *plaintext,
                     + NULL_BYTE_LEN; /* and the key's null byte terminator */
 
    uint8_t *wrapper_data;
+   const bson_value_t *value;
+   uint32_t len;
+
+   /* Serialize common types straight into the plaintext. */
+   value = bson_iter_value (iter);
+   if (_mongocrypt_bson_value_len (value, &len)) {
+      _mongocrypt_buffer_init (plaintext);
+      _mongocrypt_buffer_resize (plaintext, len);
+      _mongocrypt_bson_value_write (value, plaintext->data);
+      return;
+   }
 
    /* It is not straightforward to transform a bson_value_t to a string of
     * bytes. As a workaround, we wrap the value in a bson document with an empty
@@ -368,6 +687,72 @@ _mongocrypt_buffer_from_iter (_mongocrypt_buffer_t *plaintext,
 }
 
 
+bool
+_mongocrypt_buffer_wrap_raw_value (_mongocrypt_buffer_t *doc,
+                                   const _mongocrypt_buffer_t *raw)
+{
+   /* The document length, the type byte, the key "v" and its NULL
+    * terminator, the value, and the document's NULL terminator. */
+   const uint32_t overhead = INT32_LEN + TYPE_LEN + 2u + NULL_BYTE_LEN;
+   uint32_t le_len;
+   bson_t bson;
+   bson_iter_t iter;
+
+   _mongocrypt_buffer_init (doc);
+   if (raw->len < TYPE_LEN || raw->len > INT32_MAX - overhead) {
+      return false;
+   }
+
+   _mongocrypt_buffer_resize (doc, raw->len + overhead);
+   le_len = BSON_UINT32_TO_LE (doc->len);
+   memcpy (doc->data, &le_len, INT32_LEN);
+   doc->data[INT32_LEN] = raw->data[0];
+   doc->data[INT32_LEN + TYPE_LEN] = 'v';
+   doc->data[INT32_LEN + TYPE_LEN + 1] = NULL_BYTE_VAL;
+   memcpy (doc->data + INT32_LEN + TYPE_LEN + 2u,
+           raw->data + TYPE_LEN,
+           raw->len - TYPE_LEN);
+   doc->data[doc->len - 1] = NULL_BYTE_VAL;
+
+   /* The value must end exactly where the document does. */
+   if (!_mongocrypt_buffer_to_bson (doc, &bson) ||
+       !bson_iter_init (&iter, &bson) || !bson_iter_next (&iter) ||
+       bson_iter_next (&iter) || iter.err_off != 0) {
+      _mongocrypt_buffer_cleanup (doc);
+      return false;
+   }
+   return true;
+}
+
+
+void
+_mongocrypt_buffer_from_raw_value (_mongocrypt_buffer_t *buf,
+                                   const bson_value_t *value)
+{
+   bson_t wrapper = BSON_INITIALIZER;
+   uint32_t len;
+
+   _mongocrypt_buffer_init (buf);
+   if (_mongocrypt_bson_value_len (value, &len)) {
+      _mongocrypt_buffer_resize (buf, TYPE_LEN + len);
+      buf->data[0] = (uint8_t) value->value_type;
+      _mongocrypt_bson_value_write (value, buf->data + TYPE_LEN);
+      return;
+   }
+
+   /* As in _mongocrypt_buffer_from_iter, let libbson encode the other types
+    * under an empty key, and copy the type byte and the value. */
+   bson_append_value (&wrapper, "", 0, value);
+   _mongocrypt_buffer_resize (
+      buf, wrapper.len - INT32_LEN - NULL_BYTE_LEN - NULL_BYTE_LEN);
+   buf->data[0] = bson_get_data (&wrapper)[INT32_LEN];
+   memcpy (buf->data + TYPE_LEN,
+           bson_get_data (&wrapper) + INT32_LEN + TYPE_LEN + NULL_BYTE_LEN,
+           buf->len - TYPE_LEN);
+   bson_destroy (&wrapper);
+}
+
+
 bool
 _mongocrypt_buffer_from_uuid_iter (_mongocrypt_buffer_t *buf, bson_iter_t *iter)
 {
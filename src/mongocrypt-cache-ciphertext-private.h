@@ -0,0 +1,36 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_CACHE_CIPHERTEXT_PRIVATE_H
+#define MONGOCRYPT_CACHE_CIPHERTEXT_PRIVATE_H
+
+#include "mongocrypt-buffer-private.h"
+#include "mongocrypt-cache-private.h"
+
+/* Deterministic encryption of the same plaintext, with the same key and BSON
+ * type, always produces the same ciphertext. The attribute borrows its
+ * buffers when used for a lookup, and owns copies once added. */
+typedef struct {
+   _mongocrypt_buffer_t key_id;
+   uint8_t original_bson_type;
+   _mongocrypt_buffer_t plaintext;
+} _mongocrypt_cache_ciphertext_attr_t;
+
+/* The value is a _mongocrypt_buffer_t of the encrypted data. */
+void
+_mongocrypt_cache_ciphertext_init (_mongocrypt_cache_t *cache);
+
+#endif /* MONGOCRYPT_CACHE_CIPHERTEXT_PRIVATE_H */
@@ -0,0 +1,135 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-private.h"
+#include "mongocrypt-cache-ciphertext-private.h"
+
+/* The deterministic ciphertext cache.
+ *
+ * Attribute is a _mongocrypt_cache_ciphertext_attr_t.
+ * Value is a _mongocrypt_buffer_t of the encrypted data, without the
+ * ciphertext header. Pairs are only found by hash, and the whole plaintext
+ * is compared, so a hash collision never returns another value's ciphertext.
+ */
+
+
+static bool
+_cmp_attr (void *a_in, void *b_in, int *out)
+{
+   _mongocrypt_cache_ciphertext_attr_t *a, *b;
+
+   a = (_mongocrypt_cache_ciphertext_attr_t *) a_in;
+   b = (_mongocrypt_cache_ciphertext_attr_t *) b_in;
+   *out = (int) a->original_bson_type - (int) b->original_bson_type;
+   if (0 == *out) {
+      *out = _mongocrypt_buffer_cmp (&a->key_id, &b->key_id);
+   }
+   if (0 == *out) {
+      *out = _mongocrypt_buffer_cmp (&a->plaintext, &b->plaintext);
+   }
+   return true;
+}
+
+
+static bool
+_hash_attr (void *attr_in, cache_hash_visit_fn visit, void *ctx)
+{
+   _mongocrypt_cache_ciphertext_attr_t *attr;
+   uint32_t hash;
+
+   attr = (_mongocrypt_cache_ciphertext_attr_t *) attr_in;
+   hash = _mongocrypt_cache_hash_bytes (attr->key_id.data, attr->key_id.len);
+   hash = hash * 31u + attr->original_bson_type;
+   hash = hash * 31u + _mongocrypt_cache_hash_bytes (attr->plaintext.data,
+                                                     attr->plaintext.len);
+   return visit (hash, ctx);
+}
+
+
+static void *
+_copy_attr (void *attr_in)
+{
+   _mongocrypt_cache_ciphertext_attr_t *src, *dst;
+
+   src = (_mongocrypt_cache_ciphertext_attr_t *) attr_in;
+   dst = bson_malloc0 (sizeof (*dst));
+   BSON_ASSERT (dst);
+   _mongocrypt_buffer_copy_to (&src->key_id, &dst->key_id);
+   dst->original_bson_type = src->original_bson_type;
+   _mongocrypt_buffer_copy_to (&src->plaintext, &dst->plaintext);
+   return dst;
+}
+
+
+static void
+_destroy_attr (void *attr_in)
+{
+   _mongocrypt_cache_ciphertext_attr_t *attr;
+
+   attr = (_mongocrypt_cache_ciphertext_attr_t *) attr_in;
+   if (!attr) {
+      return;
+   }
+   _mongocrypt_buffer_cleanup (&attr->key_id);
+   _mongocrypt_buffer_cleanup (&attr->plaintext);
+   bson_free (attr);
+}
+
+
+static void *
+_copy_value (void *value)
+{
+   _mongocrypt_buffer_t *dst;
+
+   dst = bson_malloc0 (sizeof (*dst));
+   BSON_ASSERT (dst);
+   _mongocrypt_buffer_copy_to ((_mongocrypt_buffer_t *) value, dst);
+   return dst;
+}
+
+
+static void
+_destroy_value (void *value)
+{
+   _mongocrypt_buffer_cleanup ((_mongocrypt_buffer_t *) value);
+   bson_free (value);
+}
+
+
+static size_t
+_size_pair (void *attr_in, void *value)
+{
+   _mongocrypt_cache_ciphertext_attr_t *attr;
+
+   attr = (_mongocrypt_cache_ciphertext_attr_t *) attr_in;
+   return sizeof (*attr) + attr->key_id.len + attr->plaintext.len +
+          sizeof (_mongocrypt_buffer_t) + ((_mongocrypt_buffer_t *) value)->len;
+}
+
+
+void
+_mongocrypt_cache_ciphertext_init (_mongocrypt_cache_t *cache)
+{
+   cache->cmp_attr = _cmp_attr;
+   cache->copy_attr = _copy_attr;
+   cache->destroy_attr = _destroy_attr;
+   cache->copy_value = _copy_value;
+   cache->destroy_value = _destroy_value;
+   cache->dump_attr = NULL;
+   _mongocrypt_cache_init (cache);
+   cache->hash_attr = _hash_attr;
+   cache->size_pair = _size_pair;
+}
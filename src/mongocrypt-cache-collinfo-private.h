@@ -17,8 +17,44 @@
 #define MONGOCRYPT_CACHE_COLLINFO_PRIVATE_H
 
 #include "mongocrypt-cache-private.h"
+#include "mongocrypt-schema-paths-private.h"
 
 void
 _mongocrypt_cache_collinfo_init (_mongocrypt_cache_t *cache);
 
+/* A digest of a $jsonSchema, or 0 if @schema is empty. Digests are not
+ * collision free, so they may only narrow comparisons of schemas. */
+uint32_t
+_mongocrypt_cache_collinfo_schema_digest (const _mongocrypt_buffer_t *schema);
+
+/* Make a cache value for @collinfo, or for a collection that does not exist
+ * if @collinfo is NULL. The digest of its $jsonSchema is computed once. */
+bson_t *
+_mongocrypt_cache_collinfo_value_new (const bson_t *collinfo);
+
+/* Parse a cache value. @collinfo is initialized to the collection info doc,
+ * which is empty for a collection that does not exist, and must be destroyed.
+ * It points into @value. Returns false if @value is malformed. */
+bool
+_mongocrypt_cache_collinfo_value_parse (const bson_t *value,
+                                        bson_t *collinfo,
+                                        uint32_t *schema_digest);
+
+/* Initialize @paths to the encrypted paths of the schema of @value, which
+ * are compiled once by _mongocrypt_cache_collinfo_value_new. Returns false,
+ * leaving @paths empty, if there is no schema or it could not be compiled. */
+bool
+_mongocrypt_cache_collinfo_value_paths (const bson_t *value,
+                                        _mongocrypt_schema_paths_t *paths);
+
+/* Make a copy of the cache value @value, marked as having a schema that
+ * requires no encryption. */
+bson_t *
+_mongocrypt_cache_collinfo_value_no_encryption_new (const bson_t *value);
+
+/* Returns false if @value was marked by
+ * _mongocrypt_cache_collinfo_value_no_encryption_new. */
+bool
+_mongocrypt_cache_collinfo_value_requires_encryption (const bson_t *value);
+
 #endif /* MONGOCRYPT_CACHE_COLLINFO_PRIVATE_H */
\ No newline at end of file
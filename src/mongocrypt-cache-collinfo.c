@@ -15,10 +15,22 @@
  */
 
 #include "mongocrypt-cache-private.h"
+#include "mongocrypt-cache-collinfo-private.h"
 /* The collinfo cache.
  *
  * Attribute is a null terminated namespace.
- * Value is a collection info doc (response to listCollections).
+ * Value is made by _mongocrypt_cache_collinfo_value_new:
+ * {
+ *    collinfo: <the collection info doc (response to listCollections)>,
+ *    schemaDigest: <int64>,
+ *    encryptedPaths: [<dotted path>, ...]
+ * }
+ * 'collinfo' is absent if listCollections returned nothing, so namespaces
+ * without a collection are cached too. 'encryptedPaths' lists the paths of
+ * the 'encrypt' nodes of the $jsonSchema, and is absent if there are none or
+ * the schema cannot be reduced to a list of paths.
+ * 'schemaRequiresEncryption: false' is appended once mongocryptd reports that
+ * the schema encrypts nothing.
  */
 
 
@@ -30,6 +42,13 @@ _cmp_attr (void *a, void *b, int *out)
 }
 
 
+static bool
+_hash_attr (void *ns, cache_hash_visit_fn visit, void *ctx)
+{
+   return visit (_mongocrypt_cache_hash_bytes (ns, strlen ((char *) ns)), ctx);
+}
+
+
 static void *
 _copy_attr (void *ns)
 {
@@ -58,6 +77,13 @@ _destroy_value (void *bson)
 }
 
 
+static size_t
+_size_pair (void *ns, void *bson)
+{
+   return strlen ((char *) ns) + 1 + sizeof (bson_t) + ((bson_t *) bson)->len;
+}
+
+
 void
 _mongocrypt_cache_collinfo_init (_mongocrypt_cache_t *cache)
 {
@@ -66,7 +92,142 @@ _mongocrypt_cache_collinfo_init (_mongocrypt_cache_t *cache)
    cache->destroy_attr = _destroy_attr;
    cache->copy_value = _copy_value;
    cache->destroy_value = _destroy_value;
-   _mongocrypt_mutex_init (&cache->mutex);
-   cache->pair = NULL;
-   cache->expiration = CACHE_EXPIRATION_MS;
-}
\ No newline at end of file
+   cache->dump_attr = NULL;
+   _mongocrypt_cache_init (cache);
+   cache->hash_attr = _hash_attr;
+   cache->size_pair = _size_pair;
+}
+
+uint32_t
+_mongocrypt_cache_collinfo_schema_digest (const _mongocrypt_buffer_t *schema)
+{
+   if (!schema->len) {
+      return 0;
+   }
+   return _mongocrypt_cache_hash_bytes (schema->data, schema->len);
+}
+
+
+/* Append the encrypted paths of @schema to the cache value @value. */
+static void
+_append_paths (bson_t *value, const _mongocrypt_buffer_t *schema)
+{
+   _mongocrypt_schema_paths_t paths;
+   bson_t schema_bson, child;
+   char buf[16];
+   const char *key;
+   uint32_t i;
+
+   if (!schema->len || !_mongocrypt_buffer_to_bson (schema, &schema_bson) ||
+       !_mongocrypt_schema_paths_init (&paths, &schema_bson)) {
+      return;
+   }
+   if (paths.len > 0) {
+      BSON_APPEND_ARRAY_BEGIN (value, "encryptedPaths", &child);
+      for (i = 0; i < paths.len; i++) {
+         bson_uint32_to_string (i, &key, buf, sizeof (buf));
+         bson_append_utf8 (&child, key, -1, paths.paths[i], -1);
+      }
+      bson_append_array_end (value, &child);
+   }
+   _mongocrypt_schema_paths_cleanup (&paths);
+}
+
+
+bson_t *
+_mongocrypt_cache_collinfo_value_new (const bson_t *collinfo)
+{
+   bson_t *value;
+   bson_iter_t iter;
+   _mongocrypt_buffer_t schema;
+
+   _mongocrypt_buffer_init (&schema);
+   value = bson_new ();
+   if (collinfo) {
+      BSON_APPEND_DOCUMENT (value, "collinfo", collinfo);
+      if (bson_iter_init (&iter, collinfo) &&
+          bson_iter_find_descendant (
+             &iter, "options.validator.$jsonSchema", &iter)) {
+         /* A malformed schema is reported when the value is used. */
+         (void) _mongocrypt_buffer_copy_from_document_iter (&schema, &iter);
+      }
+   }
+   BSON_APPEND_INT64 (value,
+                      "schemaDigest",
+                      _mongocrypt_cache_collinfo_schema_digest (&schema));
+   _append_paths (value, &schema);
+   _mongocrypt_buffer_cleanup (&schema);
+   return value;
+}
+
+
+bool
+_mongocrypt_cache_collinfo_value_paths (const bson_t *value,
+                                        _mongocrypt_schema_paths_t *paths)
+{
+   bson_iter_t iter, child;
+
+   memset (paths, 0, sizeof (*paths));
+   if (!bson_iter_init_find (&iter, value, "encryptedPaths") ||
+       !BSON_ITER_HOLDS_ARRAY (&iter) || !bson_iter_recurse (&iter, &child)) {
+      return false;
+   }
+   while (bson_iter_next (&child)) {
+      if (!BSON_ITER_HOLDS_UTF8 (&child)) {
+         _mongocrypt_schema_paths_cleanup (paths);
+         return false;
+      }
+      _mongocrypt_schema_paths_append (paths, bson_iter_utf8 (&child, NULL));
+   }
+   return paths->len > 0;
+}
+
+
+bool
+_mongocrypt_cache_collinfo_value_parse (const bson_t *value,
+                                        bson_t *collinfo,
+                                        uint32_t *schema_digest)
+{
+   bson_iter_t iter;
+   const uint8_t *data;
+   uint32_t len;
+
+   if (!bson_iter_init_find (&iter, value, "schemaDigest") ||
+       !BSON_ITER_HOLDS_INT64 (&iter)) {
+      return false;
+   }
+   *schema_digest = (uint32_t) bson_iter_int64 (&iter);
+
+   if (!bson_iter_init_find (&iter, value, "collinfo")) {
+      bson_init (collinfo);
+      return true;
+   }
+   if (!BSON_ITER_HOLDS_DOCUMENT (&iter)) {
+      return false;
+   }
+   bson_iter_document (&iter, &len, &data);
+   return bson_init_static (collinfo, data, len);
+}
+
+
+bson_t *
+_mongocrypt_cache_collinfo_value_no_encryption_new (const bson_t *value)
+{
+   bson_t *copy;
+
+   copy = bson_copy (value);
+   BSON_APPEND_BOOL (copy, "schemaRequiresEncryption", false);
+   return copy;
+}
+
+
+bool
+_mongocrypt_cache_collinfo_value_requires_encryption (const bson_t *value)
+{
+   bson_iter_t iter;
+
+   if (bson_iter_init_find (&iter, value, "schemaRequiresEncryption")) {
+      return bson_iter_as_bool (&iter);
+   }
+   return true;
+}
@@ -19,14 +19,18 @@
 
 #include "mongocrypt-buffer-private.h"
 #include "mongocrypt-cache-private.h"
+#include "mongocrypt-crypto-private.h"
 #include "mongocrypt-key-private.h"
 #include "mongocrypt-mutex-private.h"
 #include "mongocrypt-opts-private.h"
 #include "mongocrypt-status-private.h"
 
+/* A value is immutable once created. Copies share it by taking a reference
+ * with _mongocrypt_cache_key_value_ref. */
 typedef struct {
    _mongocrypt_key_doc_t *key_doc;
    _mongocrypt_buffer_t decrypted_key_material;
+   int64_t refcount;
 } _mongocrypt_cache_key_value_t;
 
 typedef struct {
@@ -45,11 +49,235 @@ _mongocrypt_cache_key_value_t *
 _mongocrypt_cache_key_value_new (_mongocrypt_key_doc_t *key_doc,
                                  _mongocrypt_buffer_t *decrypted_key_material);
 
+/* Returns @value with one more reference. */
+_mongocrypt_cache_key_value_t *
+_mongocrypt_cache_key_value_ref (_mongocrypt_cache_key_value_t *value);
+
+/* Drop a reference, freeing @value with the last one. */
 void
 _mongocrypt_cache_key_value_destroy (void *value);
 
 void
 _mongocrypt_cache_key_attr_destroy (_mongocrypt_cache_key_attr_t *attr);
 
+/* Append "keyDocument", "keyMaterial", and the int64 @lifetime_field set to
+ * @lifetime to @out. keyMaterial is @decrypted_key_material encrypted with
+ * @kek. The key document and the lifetime are its associated data, so
+ * neither can be changed without failing _mongocrypt_cache_key_unwrap. Used
+ * to move decrypted keys out of a mongocrypt_t. */
+bool
+_mongocrypt_cache_key_wrap (_mongocrypt_crypto_t *crypto,
+                            const _mongocrypt_buffer_t *kek,
+                            _mongocrypt_key_doc_t *key_doc,
+                            const _mongocrypt_buffer_t *decrypted_key_material,
+                            const char *lifetime_field,
+                            int64_t lifetime,
+                            bson_t *out,
+                            mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Parse and decrypt the fields appended by _mongocrypt_cache_key_wrap with
+ * the same @lifetime_field, and authenticate them. @key_doc must be new, and
+ * @decrypted_key_material is always initialized. */
+bool
+_mongocrypt_cache_key_unwrap (_mongocrypt_crypto_t *crypto,
+                              const _mongocrypt_buffer_t *kek,
+                              const bson_t *entry,
+                              const char *lifetime_field,
+                              _mongocrypt_key_doc_t *key_doc,
+                              _mongocrypt_buffer_t *decrypted_key_material,
+                              int64_t *lifetime,
+                              mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* The size of the buffer a key cache backend get callback writes to. Larger
+ * entries are not shared. */
+#define MONGOCRYPT_KEY_CACHE_ENTRY_MAX_LEN 4096
+
+/* Look up the key matching @attr with the get callback set by
+ * mongocrypt_setopt_key_cache_backend, and add it to crypt->cache_key.
+ * *value is set to a copy of the key, or NULL if no backend is set or it has
+ * no unexpired match. */
+bool
+_mongocrypt_cache_key_backend_get (mongocrypt_t *crypt,
+                                   _mongocrypt_cache_key_attr_t *attr,
+                                   _mongocrypt_cache_key_value_t **value,
+                                   mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Share a key decrypted by this process through the put callback, under its
+ * _id and each of its keyAltNames. Does nothing if no backend is set. */
+bool
+_mongocrypt_cache_key_backend_put (
+   mongocrypt_t *crypt,
+   _mongocrypt_key_doc_t *key_doc,
+   const _mongocrypt_buffer_t *decrypted_key_material,
+   mongocrypt_status_t *status) MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Remove the keys matching @attr from crypt->cache_key, along with the
+ * values encrypted or decrypted with them in the ciphertext and plaintext
+ * caches, and their entries in the backend store if it has an evict
+ * callback. */
+bool
+_mongocrypt_cache_key_invalidate (mongocrypt_t *crypt,
+                                  _mongocrypt_cache_key_attr_t *attr,
+                                  mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Recently used keys copied out of crypt->cache_key for the threads of a
+ * process. A thread only uses the shard for its _mongocrypt_thread_index, so
+ * a hit writes nothing another thread reads, unless there are more threads
+ * than shards. Entries are valid while the generation of the key cache is
+ * unchanged, and until the key expires or enters the refresh window. Hits are
+ * not counted in the stats or last use of the key cache. */
+#define MONGOCRYPT_KEY_L1_SHARDS 16
+#define MONGOCRYPT_KEY_L1_ENTRIES 4
+
+typedef struct {
+   _mongocrypt_cache_key_attr_t *attr; /* NULL if unused. */
+   _mongocrypt_cache_key_value_t *value;
+   int64_t generation;
+   int64_t until_ms;
+} _mongocrypt_key_l1_entry_t;
+
+typedef struct {
+   mongocrypt_mutex_t mutex;
+   _mongocrypt_key_l1_entry_t entries[MONGOCRYPT_KEY_L1_ENTRIES];
+   /* The entry to replace when none is stale. */
+   uint32_t next;
+} _mongocrypt_key_l1_shard_t;
+
+typedef struct {
+   /* Allocated separately, so shards do not share cache lines. */
+   _mongocrypt_key_l1_shard_t *shards[MONGOCRYPT_KEY_L1_SHARDS];
+} _mongocrypt_key_l1_t;
+
+_mongocrypt_key_l1_t *
+_mongocrypt_key_l1_new (void);
+
+void
+_mongocrypt_key_l1_destroy (_mongocrypt_key_l1_t *l1);
+
+/* Called in the child of a fork. @l1 may be NULL. */
+void
+_mongocrypt_key_l1_after_fork (_mongocrypt_key_l1_t *l1);
+
+/* Destroy every copied key. @l1 may be NULL. */
+void
+_mongocrypt_key_l1_clear (_mongocrypt_key_l1_t *l1);
+
+/* Like _mongocrypt_cache_get on @cache, a key cache, but checks the calling
+ * thread's shard of @l1 first. @l1 may be NULL. */
+bool
+_mongocrypt_key_l1_get (_mongocrypt_key_l1_t *l1,
+                        _mongocrypt_cache_t *cache,
+                        _mongocrypt_cache_key_attr_t *attr,
+                        _mongocrypt_cache_key_value_t **value)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Key fetches in progress, shared by the contexts of a mongocrypt_t. When
+ * several contexts miss the key cache for the same key, the first claims the
+ * fetch, and the others wait for it to add the key to the cache instead of
+ * fetching and decrypting the key again. */
+typedef struct __mongocrypt_key_fetch_t {
+   _mongocrypt_cache_key_attr_t *attr;
+   const void *owner;
+   int64_t started_ms;
+   struct __mongocrypt_key_fetch_t *next;
+} _mongocrypt_key_fetch_t;
+
+typedef struct {
+   mongocrypt_mutex_t mutex;
+   mongocrypt_cond_t cond;
+   _mongocrypt_key_fetch_t *fetches;
+} _mongocrypt_key_fetches_t;
+
+void
+_mongocrypt_key_fetches_init (_mongocrypt_key_fetches_t *fetches);
+
+void
+_mongocrypt_key_fetches_cleanup (_mongocrypt_key_fetches_t *fetches);
+
+/* Called in the child of a fork. Drops the fetches claimed by contexts of
+ * the parent, which never finish in the child. */
+void
+_mongocrypt_key_fetches_after_fork (_mongocrypt_key_fetches_t *fetches);
+
+/* Returns true if @owner now owns the fetch of the key matching @attr.
+ * Returns false if another owner claimed it less than @wait_ms ago. A claim
+ * older than that is taken over, in case its owner stalled. */
+bool
+_mongocrypt_key_fetches_claim (_mongocrypt_key_fetches_t *fetches,
+                               const _mongocrypt_cache_key_attr_t *attr,
+                               const void *owner,
+                               uint64_t wait_ms);
+
+/* Block until no other owner is fetching the key matching @attr, or until
+ * @wait_ms after that fetch was claimed. */
+void
+_mongocrypt_key_fetches_wait (_mongocrypt_key_fetches_t *fetches,
+                              const _mongocrypt_cache_key_attr_t *attr,
+                              const void *owner,
+                              uint64_t wait_ms);
+
+/* Release the fetches claimed by @owner that match @attr, or all of them if
+ * @attr is NULL, and wake the waiters. */
+void
+_mongocrypt_key_fetches_release (_mongocrypt_key_fetches_t *fetches,
+                                 const void *owner,
+                                 const _mongocrypt_cache_key_attr_t *attr);
+
+/* Key fetches of different keys, merged into one key vault query. The first
+ * context to miss the cache opens a batch and leads it: it waits out the
+ * batching window, then fetches the keys that other contexts added to the
+ * batch along with its own. Those contexts wait for the leader's fetch as
+ * they would for a fetch in _mongocrypt_key_fetches_t. */
+typedef struct {
+   mongocrypt_mutex_t mutex;
+   mongocrypt_cond_t cond;
+   /* The key broker leading the open batch, or NULL if none is open. */
+   const void *leader;
+   _mongocrypt_buffer_t *ids;
+   uint32_t num_ids;
+   uint32_t ids_size;
+} _mongocrypt_key_batch_t;
+
+void
+_mongocrypt_key_batch_init (_mongocrypt_key_batch_t *batch);
+
+void
+_mongocrypt_key_batch_cleanup (_mongocrypt_key_batch_t *batch);
+
+/* Called in the child of a fork. Drops a batch led by a context of the
+ * parent. */
+void
+_mongocrypt_key_batch_after_fork (_mongocrypt_key_batch_t *batch);
+
+/* Merge the fetch of the @num_ids keys in @ids into a batch.
+ *
+ * If another owner leads an open batch, the keys are added to it, their
+ * fetches in @fetches are handed from @owner to the leader, and true is
+ * returned. The caller then waits for the leader with
+ * _mongocrypt_key_fetches_wait.
+ *
+ * Otherwise @owner opens a batch, blocks for @window_ms while other owners
+ * add keys, closes it, and returns false. @joined is set to the ids added,
+ * to be fetched by @owner, and @num_joined to their count. Free @joined
+ * with _mongocrypt_key_batch_ids_destroy. */
+bool
+_mongocrypt_key_batch_merge (_mongocrypt_key_batch_t *batch,
+                             _mongocrypt_key_fetches_t *fetches,
+                             const void *owner,
+                             const _mongocrypt_buffer_t *ids,
+                             uint32_t num_ids,
+                             uint64_t window_ms,
+                             uint64_t wait_ms,
+                             _mongocrypt_buffer_t **joined,
+                             uint32_t *num_joined);
+
+void
+_mongocrypt_key_batch_ids_destroy (_mongocrypt_buffer_t *ids,
+                                   uint32_t num_ids);
+
 
 #endif /* MONGOCRYPT_CACHE_KEY_PRIVATE_H */
@@ -14,7 +14,12 @@
  * limitations under the License.
  */
 
+#include "mongocrypt-private.h"
+#include "mongocrypt-cache-ciphertext-private.h"
 #include "mongocrypt-cache-key-private.h"
+#include "mongocrypt-cache-plaintext-private.h"
+#include "mongocrypt-key-slab-private.h"
+#include "mongocrypt-os-private.h"
 /* The key cache.
  *
  * Attribute is a UUID in the form of a _mongocrypt_buffer_t.
@@ -49,6 +54,60 @@ _cmp_attr (void *a, void *b, int *out)
 }
 
 
+/* A key can be found by its _id or any of its keyAltNames. */
+static bool
+_hash_attr (void *attr_in, cache_hash_visit_fn visit, void *ctx)
+{
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_key_alt_name_t *altname;
+
+   attr = (_mongocrypt_cache_key_attr_t *) attr_in;
+   if (!_mongocrypt_buffer_empty (&attr->id)) {
+      if (!visit (_mongocrypt_cache_hash_bytes (attr->id.data, attr->id.len),
+                  ctx)) {
+         return false;
+      }
+   }
+
+   for (altname = attr->alt_names; NULL != altname; altname = altname->next) {
+      const char *str = _mongocrypt_key_alt_name_get_string (altname);
+
+      if (!visit (_mongocrypt_cache_hash_bytes (str, strlen (str)), ctx)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/* A key belongs in the first partition whose tag prefixes one of its
+ * keyAltNames. */
+static uint32_t
+_partition_attr (void *attr_in,
+                 const _mongocrypt_cache_partition_t *partitions,
+                 uint32_t num_partitions)
+{
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_key_alt_name_t *altname;
+   uint32_t i;
+
+   attr = (_mongocrypt_cache_key_attr_t *) attr_in;
+   for (i = 0; i < num_partitions; i++) {
+      size_t tag_len = strlen (partitions[i].tag);
+
+      for (altname = attr->alt_names; NULL != altname;
+           altname = altname->next) {
+         const char *str = _mongocrypt_key_alt_name_get_string (altname);
+
+         if (0 == strncmp (str, partitions[i].tag, tag_len)) {
+            return i + 1;
+         }
+      }
+   }
+   return 0;
+}
+
+
 static void *
 _copy_attr (void *attr)
 {
@@ -70,13 +129,40 @@ _destroy_attr (void *attr)
 static void *
 _copy_contents (void *value)
 {
-   _mongocrypt_cache_key_value_t *key_value;
+   return _mongocrypt_cache_key_value_ref (
+      (_mongocrypt_cache_key_value_t *) value);
+}
 
-   key_value = (_mongocrypt_cache_key_value_t *) value;
-   return _mongocrypt_cache_key_value_new (key_value->key_doc,
-                                           &key_value->decrypted_key_material);
+static size_t
+_size_alt_names (_mongocrypt_key_alt_name_t *alt_names)
+{
+   size_t bytes = 0;
+
+   for (; alt_names; alt_names = alt_names->next) {
+      bytes += sizeof (*alt_names) +
+               strlen (_mongocrypt_key_alt_name_get_string (alt_names)) + 1;
+   }
+   return bytes;
 }
 
+
+static size_t
+_size_pair (void *attr_in, void *value_in)
+{
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_cache_key_value_t *value;
+   _mongocrypt_key_doc_t *key_doc;
+
+   attr = (_mongocrypt_cache_key_attr_t *) attr_in;
+   value = (_mongocrypt_cache_key_value_t *) value_in;
+   key_doc = value->key_doc;
+   return sizeof (*attr) + attr->id.len + _size_alt_names (attr->alt_names) +
+          sizeof (*value) + value->decrypted_key_material.len +
+          sizeof (*key_doc) + key_doc->bson.len + key_doc->id.len +
+          key_doc->key_material.len + _size_alt_names (key_doc->key_alt_names);
+}
+
+
 static void
 _dump_attr (void *attr_in)
 {
@@ -106,16 +192,37 @@ _mongocrypt_cache_key_value_new (_mongocrypt_key_doc_t *key_doc,
    key_value = bson_malloc0 (sizeof (*key_value));
    BSON_ASSERT (key_value);
 
-   _mongocrypt_buffer_copy_to (decrypted_key_material,
-                               &key_value->decrypted_key_material);
+   /* Cached keys live in the locked key slab. The buffer does not own the
+    * slot, which _mongocrypt_cache_key_value_destroy releases. */
+   if (decrypted_key_material->len == MONGOCRYPT_KEY_LEN) {
+      key_value->decrypted_key_material.data = _mongocrypt_key_slab_alloc ();
+      key_value->decrypted_key_material.len = MONGOCRYPT_KEY_LEN;
+      memcpy (key_value->decrypted_key_material.data,
+              decrypted_key_material->data,
+              MONGOCRYPT_KEY_LEN);
+   } else {
+      _mongocrypt_buffer_copy_to (decrypted_key_material,
+                                  &key_value->decrypted_key_material);
+   }
 
    key_value->key_doc = _mongocrypt_key_new ();
-   _mongocrypt_key_doc_copy_to (key_doc, key_value->key_doc);
+   _mongocrypt_key_doc_copy_minimal_to (key_doc, key_value->key_doc);
+   key_value->refcount = 1;
 
    return key_value;
 }
 
 
+_mongocrypt_cache_key_value_t *
+_mongocrypt_cache_key_value_ref (_mongocrypt_cache_key_value_t *value)
+{
+   BSON_ASSERT (value);
+
+   _mongocrypt_atomic_add_int64 (&value->refcount, 1);
+   return value;
+}
+
+
 void
 _mongocrypt_cache_key_value_destroy (void *value)
 {
@@ -125,8 +232,15 @@ _mongocrypt_cache_key_value_destroy (void *value)
       return;
    }
    key_value = (_mongocrypt_cache_key_value_t *) value;
+   if (_mongocrypt_atomic_release_int64 (&key_value->refcount) > 0) {
+      return;
+   }
    _mongocrypt_key_destroy (key_value->key_doc);
-   _mongocrypt_buffer_cleanup (&key_value->decrypted_key_material);
+   if (key_value->decrypted_key_material.owned) {
+      _mongocrypt_buffer_cleanup (&key_value->decrypted_key_material);
+   } else {
+      _mongocrypt_key_slab_free (key_value->decrypted_key_material.data);
+   }
    bson_free (key_value);
 }
 
@@ -139,9 +253,10 @@ _mongocrypt_cache_key_init (_mongocrypt_cache_t *cache)
    cache->copy_value = _copy_contents;
    cache->destroy_value = _mongocrypt_cache_key_value_destroy;
    cache->dump_attr = _dump_attr;
-   _mongocrypt_mutex_init (&cache->mutex);
-   cache->pair = NULL;
-   cache->expiration = CACHE_EXPIRATION_MS;
+   _mongocrypt_cache_init (cache);
+   cache->hash_attr = _hash_attr;
+   cache->size_pair = _size_pair;
+   cache->partition_attr = _partition_attr;
 }
 
 /* Since key cache may be looked up by either _id or keyAltName,
@@ -176,3 +291,983 @@ _mongocrypt_cache_key_attr_destroy (_mongocrypt_cache_key_attr_t *attr)
    _mongocrypt_key_alt_name_destroy_all (attr->alt_names);
    bson_free (attr);
 }
+
+
+/* The associated data of wrapped key material: the key document, then the
+ * NULL terminated @lifetime_field and @lifetime, little-endian. The key
+ * document holds the _id and keyAltNames a key is looked up by. */
+static void
+_wrap_associated_data (const bson_t *key_doc_bson,
+                       const char *lifetime_field,
+                       int64_t lifetime,
+                       _mongocrypt_buffer_t *out)
+{
+   uint64_t lifetime_le = BSON_UINT64_TO_LE ((uint64_t) lifetime);
+   uint32_t field_len = (uint32_t) strlen (lifetime_field) + 1;
+
+   _mongocrypt_buffer_init (out);
+   _mongocrypt_buffer_resize (
+      out, key_doc_bson->len + field_len + (uint32_t) sizeof (lifetime_le));
+   memcpy (out->data, bson_get_data (key_doc_bson), key_doc_bson->len);
+   memcpy (out->data + key_doc_bson->len, lifetime_field, field_len);
+   memcpy (out->data + key_doc_bson->len + field_len,
+           &lifetime_le,
+           sizeof (lifetime_le));
+}
+
+
+bool
+_mongocrypt_cache_key_wrap (_mongocrypt_crypto_t *crypto,
+                            const _mongocrypt_buffer_t *kek,
+                            _mongocrypt_key_doc_t *key_doc,
+                            const _mongocrypt_buffer_t *decrypted_key_material,
+                            const char *lifetime_field,
+                            int64_t lifetime,
+                            bson_t *out,
+                            mongocrypt_status_t *status)
+{
+   _mongocrypt_buffer_t iv, wrapped, associated_data;
+   uint32_t bytes_written;
+   bool ret = false;
+
+   _mongocrypt_buffer_init (&iv);
+   _mongocrypt_buffer_init (&wrapped);
+   _wrap_associated_data (
+      &key_doc->bson, lifetime_field, lifetime, &associated_data);
+   _mongocrypt_buffer_resize (&iv, MONGOCRYPT_IV_LEN);
+   _mongocrypt_buffer_resize (
+      &wrapped,
+      _mongocrypt_calculate_ciphertext_len (decrypted_key_material->len));
+   if (!_mongocrypt_random (crypto, &iv, MONGOCRYPT_IV_LEN, status) ||
+       !_mongocrypt_do_encryption (crypto,
+                                   &iv,
+                                   &associated_data,
+                                   kek,
+                                   NULL /* native key */,
+                                   decrypted_key_material,
+                                   &wrapped,
+                                   &bytes_written,
+                                   status)) {
+      goto done;
+   }
+
+   bson_append_document (
+      out, MONGOCRYPT_STR_AND_LEN ("keyDocument"), &key_doc->bson);
+   bson_append_binary (out,
+                       MONGOCRYPT_STR_AND_LEN ("keyMaterial"),
+                       BSON_SUBTYPE_BINARY,
+                       wrapped.data,
+                       wrapped.len);
+   bson_append_int64 (out, lifetime_field, -1, lifetime);
+   ret = true;
+
+done:
+   _mongocrypt_buffer_cleanup (&associated_data);
+   _mongocrypt_buffer_cleanup (&wrapped);
+   _mongocrypt_buffer_cleanup (&iv);
+   return ret;
+}
+
+
+bool
+_mongocrypt_cache_key_unwrap (_mongocrypt_crypto_t *crypto,
+                              const _mongocrypt_buffer_t *kek,
+                              const bson_t *entry,
+                              const char *lifetime_field,
+                              _mongocrypt_key_doc_t *key_doc,
+                              _mongocrypt_buffer_t *decrypted_key_material,
+                              int64_t *lifetime,
+                              mongocrypt_status_t *status)
+{
+   _mongocrypt_buffer_t wrapped, associated_data;
+   bson_iter_t iter;
+   bson_t doc;
+   const uint8_t *data;
+   uint32_t len, bytes_written, expected_len;
+   bool ret;
+
+   _mongocrypt_buffer_init (decrypted_key_material);
+
+   if (!bson_iter_init_find (&iter, entry, lifetime_field) ||
+       !BSON_ITER_HOLDS_INT64 (&iter)) {
+      CLIENT_ERR ("invalid key entry: expected int64 '%s'", lifetime_field);
+      return false;
+   }
+   *lifetime = bson_iter_int64 (&iter);
+
+   if (!bson_iter_init_find (&iter, entry, "keyDocument") ||
+       !BSON_ITER_HOLDS_DOCUMENT (&iter)) {
+      CLIENT_ERR ("invalid key entry: expected 'keyDocument'");
+      return false;
+   }
+   bson_iter_document (&iter, &len, &data);
+   if (!bson_init_static (&doc, data, len)) {
+      CLIENT_ERR ("invalid key entry: malformed 'keyDocument'");
+      return false;
+   }
+   if (!_mongocrypt_key_parse_owned (&doc, key_doc, status)) {
+      return false;
+   }
+
+   if (!bson_iter_init_find (&iter, entry, "keyMaterial") ||
+       !_mongocrypt_buffer_from_binary_iter (&wrapped, &iter)) {
+      CLIENT_ERR ("invalid key entry: expected binary 'keyMaterial'");
+      return false;
+   }
+   expected_len = _mongocrypt_calculate_ciphertext_len (MONGOCRYPT_KEY_LEN);
+   if (wrapped.len != expected_len) {
+      CLIENT_ERR ("invalid key entry: 'keyMaterial' is incorrect length");
+      return false;
+   }
+
+   _mongocrypt_buffer_resize (
+      decrypted_key_material,
+      _mongocrypt_calculate_plaintext_len (wrapped.len));
+   /* Authenticate the key document as stored, not as parsed. */
+   _wrap_associated_data (&doc, lifetime_field, *lifetime, &associated_data);
+   ret = _mongocrypt_do_decryption (crypto,
+                                    &associated_data,
+                                    kek,
+                                    NULL /* native key */,
+                                    &wrapped,
+                                    decrypted_key_material,
+                                    &bytes_written,
+                                    status);
+   _mongocrypt_buffer_cleanup (&associated_data);
+   if (!ret) {
+      return false;
+   }
+   decrypted_key_material->len = bytes_written;
+   if (decrypted_key_material->len != MONGOCRYPT_KEY_LEN) {
+      CLIENT_ERR ("invalid key entry: decrypted key is incorrect length");
+      return false;
+   }
+   return true;
+}
+
+
+/* Append the name of @attr to @name: {"_id": <UUID>} if it has an _id, and
+ * {"keyAltName": <string>} otherwise. */
+static void
+_backend_name (_mongocrypt_cache_key_attr_t *attr, bson_t *name)
+{
+   if (!_mongocrypt_buffer_empty (&attr->id)) {
+      BSON_ASSERT (_mongocrypt_buffer_append (
+         &attr->id, name, MONGOCRYPT_STR_AND_LEN ("_id")));
+   } else {
+      bson_append_value (
+         name, MONGOCRYPT_STR_AND_LEN ("keyAltName"), &attr->alt_names->value);
+   }
+}
+
+
+/* Call the get callback with @name. @entry is set to the result, which is
+ * empty on a miss. */
+static bool
+_backend_get_entry (mongocrypt_t *crypt,
+                    mongocrypt_binary_t *name,
+                    _mongocrypt_buffer_t *entry,
+                    mongocrypt_status_t *status)
+{
+   mongocrypt_binary_t out_bin;
+   uint32_t bytes_written = 0;
+   bool ret;
+
+   _mongocrypt_buffer_init (entry);
+   _mongocrypt_buffer_resize (entry, MONGOCRYPT_KEY_CACHE_ENTRY_MAX_LEN);
+   _mongocrypt_buffer_to_binary (entry, &out_bin);
+   ret = crypt->opts.key_cache_get (
+      crypt->opts.key_cache_ctx, name, &out_bin, &bytes_written, status);
+   if (!ret) {
+      if (mongocrypt_status_ok (status)) {
+         CLIENT_ERR ("key cache backend get failed");
+      }
+      return false;
+   }
+   if (bytes_written > MONGOCRYPT_KEY_CACHE_ENTRY_MAX_LEN) {
+      CLIENT_ERR ("key cache backend wrote too many bytes");
+      return false;
+   }
+   entry->len = bytes_written;
+   return true;
+}
+
+
+/* Decrypt a backend @entry. Returns true and leaves *value NULL if the entry
+ * expired, is not for @attr, or fails to authenticate, and sets *stale in
+ * that case. */
+static bool
+_backend_add_entry (mongocrypt_t *crypt,
+                    _mongocrypt_cache_key_attr_t *attr,
+                    const _mongocrypt_buffer_t *entry,
+                    _mongocrypt_cache_key_value_t **value,
+                    bool *stale,
+                    mongocrypt_status_t *status)
+{
+   _mongocrypt_key_doc_t *key_doc;
+   _mongocrypt_cache_key_attr_t *key_attr = NULL;
+   _mongocrypt_buffer_t key_material;
+   bson_t as_bson;
+   bson_iter_t iter;
+   int64_t ttl_ms, expiration_ms, expires_ms;
+   int cmp;
+   bool ret = false;
+
+   *stale = false;
+   if (!_mongocrypt_buffer_to_bson (entry, &as_bson) ||
+       !bson_iter_init_find (&iter, &as_bson, "expiresMs") ||
+       !BSON_ITER_HOLDS_INT64 (&iter)) {
+      CLIENT_ERR ("invalid key cache backend entry");
+      return false;
+   }
+   /* Skip decrypting expired entries. Lowering expiresMs only causes a
+    * miss, and the value used below is authenticated. */
+   if (bson_iter_int64 (&iter) <= bson_get_monotonic_time () / 1000) {
+      *stale = true;
+      return true;
+   }
+
+   key_doc = _mongocrypt_key_new ();
+   if (!_mongocrypt_cache_key_unwrap (crypt->crypto,
+                                      &crypt->opts.key_cache_secret,
+                                      &as_bson,
+                                      "expiresMs",
+                                      key_doc,
+                                      &key_material,
+                                      &expires_ms,
+                                      status)) {
+      /* The entry was changed in the store or written with another
+       * secret. Fetch the key rather than fail the context. */
+      _mongocrypt_status_reset (status);
+      *stale = true;
+      ret = true;
+      goto done;
+   }
+   ttl_ms = expires_ms - bson_get_monotonic_time () / 1000;
+   if (ttl_ms <= 0) {
+      *stale = true;
+      ret = true;
+      goto done;
+   }
+
+   key_attr =
+      _mongocrypt_cache_key_attr_new (&key_doc->id, key_doc->key_alt_names);
+   BSON_ASSERT (_cmp_attr (key_attr, attr, &cmp));
+   if (0 != cmp) {
+      /* The backend returned the entry of another key, e.g. the previous
+       * owner of a keyAltName. */
+      *stale = true;
+      ret = true;
+      goto done;
+   }
+
+   /* A cache with a shorter TTL keeps the key for at most its own TTL. */
+   expiration_ms = (int64_t) crypt->cache_key->expiration;
+   if (!_mongocrypt_cache_add_stolen_aged (
+          crypt->cache_key,
+          key_attr,
+          _mongocrypt_cache_key_value_new (key_doc, &key_material),
+          ttl_ms < expiration_ms ? expiration_ms - ttl_ms : 0,
+          status)) {
+      goto done;
+   }
+   *value = _mongocrypt_cache_key_value_new (key_doc, &key_material);
+   ret = true;
+
+done:
+   _mongocrypt_cache_key_attr_destroy (key_attr);
+   _mongocrypt_buffer_cleanup (&key_material);
+   _mongocrypt_key_destroy (key_doc);
+   return ret;
+}
+
+
+/* Call the evict callback with @name. */
+static bool
+_backend_evict_entry (mongocrypt_t *crypt,
+                      mongocrypt_binary_t *name,
+                      mongocrypt_status_t *status)
+{
+   bool ret;
+
+   ret = crypt->opts.key_cache_evict (crypt->opts.key_cache_ctx, name, status);
+   if (!ret && mongocrypt_status_ok (status)) {
+      CLIENT_ERR ("key cache backend evict failed");
+   }
+   _mongocrypt_atomic_add_int64 (&crypt->stats.key_backend.evictions, 1);
+   return ret;
+}
+
+
+bool
+_mongocrypt_cache_key_backend_get (mongocrypt_t *crypt,
+                                   _mongocrypt_cache_key_attr_t *attr,
+                                   _mongocrypt_cache_key_value_t **value,
+                                   mongocrypt_status_t *status)
+{
+   _mongocrypt_stats_key_backend_t *stats = &crypt->stats.key_backend;
+   _mongocrypt_buffer_t entry;
+   mongocrypt_binary_t name_bin;
+   bson_t name;
+   bool stale = false;
+   bool ret = true;
+
+   *value = NULL;
+   if (!crypt->opts.key_cache_get) {
+      return true;
+   }
+
+   bson_init (&name);
+   _backend_name (attr, &name);
+   name_bin.data = (uint8_t *) bson_get_data (&name);
+   name_bin.len = name.len;
+   if (!_backend_get_entry (crypt, &name_bin, &entry, status)) {
+      ret = false;
+   } else if (entry.len > 0) {
+      ret = _backend_add_entry (crypt, attr, &entry, value, &stale, status);
+   }
+   if (ret) {
+      _mongocrypt_atomic_add_int64 (*value ? &stats->hits : &stats->misses, 1);
+   }
+
+   if (ret && stale && crypt->opts.key_cache_evict) {
+      ret = _backend_evict_entry (crypt, &name_bin, status);
+   }
+   bson_destroy (&name);
+   _mongocrypt_buffer_cleanup (&entry);
+   return ret;
+}
+
+
+static bool
+_backend_put_entry (mongocrypt_t *crypt,
+                    bson_t *name,
+                    bson_t *entry,
+                    mongocrypt_status_t *status)
+{
+   mongocrypt_binary_t name_bin, entry_bin;
+   bool ret;
+
+   name_bin.data = (uint8_t *) bson_get_data (name);
+   name_bin.len = name->len;
+   entry_bin.data = (uint8_t *) bson_get_data (entry);
+   entry_bin.len = entry->len;
+   ret = crypt->opts.key_cache_put (
+      crypt->opts.key_cache_ctx, &name_bin, &entry_bin, status);
+   if (!ret && mongocrypt_status_ok (status)) {
+      CLIENT_ERR ("key cache backend put failed");
+   }
+   _mongocrypt_atomic_add_int64 (&crypt->stats.key_backend.puts, 1);
+   return ret;
+}
+
+
+bool
+_mongocrypt_cache_key_backend_put (
+   mongocrypt_t *crypt,
+   _mongocrypt_key_doc_t *key_doc,
+   const _mongocrypt_buffer_t *decrypted_key_material,
+   mongocrypt_status_t *status)
+{
+   _mongocrypt_key_alt_name_t *alt_name;
+   bson_t entry, name;
+   bool ret = false;
+
+   if (!crypt->opts.key_cache_put) {
+      return true;
+   }
+
+   bson_init (&entry);
+   if (!_mongocrypt_cache_key_wrap (crypt->crypto,
+                                    &crypt->opts.key_cache_secret,
+                                    key_doc,
+                                    decrypted_key_material,
+                                    "expiresMs",
+                                    bson_get_monotonic_time () / 1000 +
+                                       (int64_t) crypt->cache_key->expiration,
+                                    &entry,
+                                    status)) {
+      goto done;
+   }
+   if (entry.len > MONGOCRYPT_KEY_CACHE_ENTRY_MAX_LEN) {
+      /* Other processes could not read it back. */
+      ret = true;
+      goto done;
+   }
+
+   bson_init (&name);
+   BSON_ASSERT (_mongocrypt_buffer_append (
+      &key_doc->id, &name, MONGOCRYPT_STR_AND_LEN ("_id")));
+   ret = _backend_put_entry (crypt, &name, &entry, status);
+   bson_destroy (&name);
+
+   for (alt_name = key_doc->key_alt_names; ret && alt_name;
+        alt_name = alt_name->next) {
+      bson_init (&name);
+      bson_append_value (
+         &name, MONGOCRYPT_STR_AND_LEN ("keyAltName"), &alt_name->value);
+      ret = _backend_put_entry (crypt, &name, &entry, status);
+      bson_destroy (&name);
+   }
+
+done:
+   bson_destroy (&entry);
+   return ret;
+}
+
+
+/* Evict the entries for @attr from the backend store, under its _id and
+ * each of its keyAltNames. */
+static bool
+_backend_evict_attr (mongocrypt_t *crypt,
+                     _mongocrypt_cache_key_attr_t *attr,
+                     mongocrypt_status_t *status)
+{
+   _mongocrypt_key_alt_name_t *alt_name;
+   mongocrypt_binary_t name_bin;
+   bson_t name;
+   bool ret = true;
+
+   if (!_mongocrypt_buffer_empty (&attr->id)) {
+      bson_init (&name);
+      BSON_ASSERT (_mongocrypt_buffer_append (
+         &attr->id, &name, MONGOCRYPT_STR_AND_LEN ("_id")));
+      name_bin.data = (uint8_t *) bson_get_data (&name);
+      name_bin.len = name.len;
+      ret = _backend_evict_entry (crypt, &name_bin, status);
+      bson_destroy (&name);
+   }
+
+   for (alt_name = attr->alt_names; ret && alt_name;
+        alt_name = alt_name->next) {
+      bson_init (&name);
+      bson_append_value (
+         &name, MONGOCRYPT_STR_AND_LEN ("keyAltName"), &alt_name->value);
+      name_bin.data = (uint8_t *) bson_get_data (&name);
+      name_bin.len = name.len;
+      ret = _backend_evict_entry (crypt, &name_bin, status);
+      bson_destroy (&name);
+   }
+   return ret;
+}
+
+
+typedef struct {
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_cache_key_value_t **removed;
+   uint32_t n_removed;
+} _invalidate_ctx_t;
+
+
+static bool
+_invalidate_pred (void *attr, void *value, void *ctx)
+{
+   _invalidate_ctx_t *inv = (_invalidate_ctx_t *) ctx;
+   int res;
+
+   BSON_ASSERT (_cmp_attr (attr, inv->attr, &res));
+   if (res != 0) {
+      return false;
+   }
+   inv->removed = bson_realloc (inv->removed,
+                                (inv->n_removed + 1u) * sizeof (*inv->removed));
+   inv->removed[inv->n_removed++] =
+      _mongocrypt_cache_key_value_ref ((_mongocrypt_cache_key_value_t *) value);
+   return true;
+}
+
+
+static bool
+_ciphertext_uses_key (void *attr, void *value, void *ctx)
+{
+   _mongocrypt_cache_ciphertext_attr_t *ciphertext_attr;
+
+   ciphertext_attr = (_mongocrypt_cache_ciphertext_attr_t *) attr;
+   return 0 == _mongocrypt_buffer_cmp (&ciphertext_attr->key_id,
+                                       (_mongocrypt_buffer_t *) ctx);
+}
+
+
+bool
+_mongocrypt_cache_key_invalidate (mongocrypt_t *crypt,
+                                  _mongocrypt_cache_key_attr_t *attr,
+                                  mongocrypt_status_t *status)
+{
+   _invalidate_ctx_t inv;
+   uint32_t i;
+   bool ret = true;
+
+   memset (&inv, 0, sizeof (inv));
+   inv.attr = attr;
+   _mongocrypt_cache_remove_if (crypt->cache_key, _invalidate_pred, &inv);
+   _mongocrypt_atomic_add_int64 (&crypt->cache_key->invalidations, 1);
+
+   if (crypt->opts.key_cache_evict) {
+      ret = _backend_evict_attr (crypt, attr, status);
+   }
+   if (crypt->opts.use_ciphertext_cache &&
+       !_mongocrypt_buffer_empty (&attr->id)) {
+      _mongocrypt_cache_remove_if (
+         &crypt->cache_ciphertext, _ciphertext_uses_key, &attr->id);
+   }
+   for (i = 0; i < inv.n_removed; i++) {
+      _mongocrypt_key_doc_t *key_doc = inv.removed[i]->key_doc;
+
+      if (ret && crypt->opts.key_cache_evict) {
+         _mongocrypt_cache_key_attr_t *key_attr;
+
+         key_attr = _mongocrypt_cache_key_attr_new (&key_doc->id,
+                                                    key_doc->key_alt_names);
+         ret = _backend_evict_attr (crypt, key_attr, status);
+         _mongocrypt_cache_key_attr_destroy (key_attr);
+      }
+      if (crypt->opts.use_ciphertext_cache) {
+         _mongocrypt_cache_remove_if (
+            &crypt->cache_ciphertext, _ciphertext_uses_key, &key_doc->id);
+      }
+      _mongocrypt_cache_key_value_destroy (inv.removed[i]);
+   }
+   bson_free (inv.removed);
+
+   /* Plaintexts are cached only while their key is. */
+   if (crypt->opts.use_plaintext_cache) {
+      _mongocrypt_cache_plaintext_remove_uncached_keys (&crypt->cache_plaintext,
+                                                        crypt->cache_key);
+   }
+   return ret;
+}
+
+
+_mongocrypt_key_l1_t *
+_mongocrypt_key_l1_new (void)
+{
+   _mongocrypt_key_l1_t *l1;
+   uint32_t i;
+
+   l1 = bson_malloc0 (sizeof (*l1));
+   BSON_ASSERT (l1);
+   for (i = 0; i < MONGOCRYPT_KEY_L1_SHARDS; i++) {
+      l1->shards[i] = bson_malloc0 (sizeof (_mongocrypt_key_l1_shard_t));
+      BSON_ASSERT (l1->shards[i]);
+      _mongocrypt_mutex_init (&l1->shards[i]->mutex);
+   }
+   return l1;
+}
+
+
+static void
+_l1_entry_cleanup (_mongocrypt_key_l1_entry_t *entry)
+{
+   _mongocrypt_cache_key_attr_destroy (entry->attr);
+   _mongocrypt_cache_key_value_destroy (entry->value);
+   entry->attr = NULL;
+   entry->value = NULL;
+}
+
+
+void
+_mongocrypt_key_l1_destroy (_mongocrypt_key_l1_t *l1)
+{
+   uint32_t i, j;
+
+   if (!l1) {
+      return;
+   }
+   for (i = 0; i < MONGOCRYPT_KEY_L1_SHARDS; i++) {
+      for (j = 0; j < MONGOCRYPT_KEY_L1_ENTRIES; j++) {
+         _l1_entry_cleanup (&l1->shards[i]->entries[j]);
+      }
+      _mongocrypt_mutex_cleanup (&l1->shards[i]->mutex);
+      bson_free (l1->shards[i]);
+   }
+   bson_free (l1);
+}
+
+
+void
+_mongocrypt_key_l1_after_fork (_mongocrypt_key_l1_t *l1)
+{
+   uint32_t i;
+
+   if (!l1) {
+      return;
+   }
+   for (i = 0; i < MONGOCRYPT_KEY_L1_SHARDS; i++) {
+      _mongocrypt_mutex_init (&l1->shards[i]->mutex);
+   }
+}
+
+
+void
+_mongocrypt_key_l1_clear (_mongocrypt_key_l1_t *l1)
+{
+   uint32_t i, j;
+
+   if (!l1) {
+      return;
+   }
+   for (i = 0; i < MONGOCRYPT_KEY_L1_SHARDS; i++) {
+      _mongocrypt_mutex_lock (&l1->shards[i]->mutex);
+      for (j = 0; j < MONGOCRYPT_KEY_L1_ENTRIES; j++) {
+         _l1_entry_cleanup (&l1->shards[i]->entries[j]);
+      }
+      _mongocrypt_mutex_unlock (&l1->shards[i]->mutex);
+   }
+}
+
+
+static bool
+_l1_entry_valid (_mongocrypt_key_l1_entry_t *entry,
+                 int64_t generation,
+                 int64_t now)
+{
+   return entry->attr && entry->generation == generation &&
+          now < entry->until_ms;
+}
+
+
+bool
+_mongocrypt_key_l1_get (_mongocrypt_key_l1_t *l1,
+                        _mongocrypt_cache_t *cache,
+                        _mongocrypt_cache_key_attr_t *attr,
+                        _mongocrypt_cache_key_value_t **value)
+{
+   _mongocrypt_key_l1_shard_t *shard;
+   _mongocrypt_key_l1_entry_t *entry;
+   int64_t generation;
+   int64_t now;
+   int64_t until_ms;
+   uint32_t i;
+   int cmp;
+
+   if (!l1) {
+      return _mongocrypt_cache_get (cache, attr, (void **) value);
+   }
+
+   /* Read the generation before the key cache, so a change in between makes
+    * the copy stale instead of hiding the change. */
+   generation = _mongocrypt_atomic_load_int64 (&cache->generation);
+   now = bson_get_monotonic_time () / 1000;
+   shard = l1->shards[_mongocrypt_thread_index () % MONGOCRYPT_KEY_L1_SHARDS];
+
+   _mongocrypt_mutex_lock (&shard->mutex);
+   for (i = 0; i < MONGOCRYPT_KEY_L1_ENTRIES; i++) {
+      entry = &shard->entries[i];
+      if (_l1_entry_valid (entry, generation, now) &&
+          _cmp_attr (entry->attr, attr, &cmp) && 0 == cmp) {
+         *value = _copy_contents (entry->value);
+         _mongocrypt_mutex_unlock (&shard->mutex);
+         return true;
+      }
+   }
+   _mongocrypt_mutex_unlock (&shard->mutex);
+
+   if (!_mongocrypt_cache_get_until (
+          cache, attr, (void **) value, &until_ms)) {
+      return false;
+   }
+   if (!*value || until_ms <= now) {
+      return true;
+   }
+
+   _mongocrypt_mutex_lock (&shard->mutex);
+   entry = NULL;
+   for (i = 0; i < MONGOCRYPT_KEY_L1_ENTRIES; i++) {
+      if (!_l1_entry_valid (&shard->entries[i], generation, now)) {
+         entry = &shard->entries[i];
+         break;
+      }
+   }
+   if (!entry) {
+      entry = &shard->entries[shard->next];
+      shard->next = (shard->next + 1) % MONGOCRYPT_KEY_L1_ENTRIES;
+   }
+   _l1_entry_cleanup (entry);
+   /* Match the key by its _id or any keyAltName, like the key cache. */
+   entry->attr = _mongocrypt_cache_key_attr_new (
+      &(*value)->key_doc->id, (*value)->key_doc->key_alt_names);
+   entry->value = _copy_contents (*value);
+   entry->generation = generation;
+   entry->until_ms = until_ms;
+   _mongocrypt_mutex_unlock (&shard->mutex);
+   return true;
+}
+
+
+void
+_mongocrypt_key_fetches_init (_mongocrypt_key_fetches_t *fetches)
+{
+   _mongocrypt_mutex_init (&fetches->mutex);
+   _mongocrypt_cond_init (&fetches->cond);
+   fetches->fetches = NULL;
+}
+
+
+static void
+_key_fetch_destroy (_mongocrypt_key_fetch_t *fetch)
+{
+   _mongocrypt_cache_key_attr_destroy (fetch->attr);
+   bson_free (fetch);
+}
+
+
+void
+_mongocrypt_key_fetches_cleanup (_mongocrypt_key_fetches_t *fetches)
+{
+   _mongocrypt_key_fetch_t *fetch, *next;
+
+   for (fetch = fetches->fetches; fetch; fetch = next) {
+      next = fetch->next;
+      _key_fetch_destroy (fetch);
+   }
+   fetches->fetches = NULL;
+   _mongocrypt_cond_cleanup (&fetches->cond);
+   _mongocrypt_mutex_cleanup (&fetches->mutex);
+}
+
+
+void
+_mongocrypt_key_fetches_after_fork (_mongocrypt_key_fetches_t *fetches)
+{
+   _mongocrypt_key_fetch_t *fetch, *next;
+
+   for (fetch = fetches->fetches; fetch; fetch = next) {
+      next = fetch->next;
+      _key_fetch_destroy (fetch);
+   }
+   _mongocrypt_key_fetches_init (fetches);
+}
+
+
+static bool
+_attr_matches (const _mongocrypt_cache_key_attr_t *a,
+               const _mongocrypt_cache_key_attr_t *b)
+{
+   int cmp;
+
+   (void) _cmp_attr ((void *) a, (void *) b, &cmp);
+   return 0 == cmp;
+}
+
+
+/* Returns the fetch of @attr claimed by an owner other than @owner less than
+ * @wait_ms ago, if any. Must be called with the mutex held. */
+static _mongocrypt_key_fetch_t *
+_find_other_fetch (_mongocrypt_key_fetches_t *fetches,
+                   const _mongocrypt_cache_key_attr_t *attr,
+                   const void *owner,
+                   uint64_t wait_ms,
+                   int64_t now_ms)
+{
+   _mongocrypt_key_fetch_t *fetch;
+
+   for (fetch = fetches->fetches; fetch; fetch = fetch->next) {
+      if (fetch->owner != owner &&
+          now_ms - fetch->started_ms < (int64_t) wait_ms &&
+          _attr_matches (fetch->attr, attr)) {
+         return fetch;
+      }
+   }
+   return NULL;
+}
+
+
+bool
+_mongocrypt_key_fetches_claim (_mongocrypt_key_fetches_t *fetches,
+                               const _mongocrypt_cache_key_attr_t *attr,
+                               const void *owner,
+                               uint64_t wait_ms)
+{
+   _mongocrypt_key_fetch_t *fetch;
+   int64_t now_ms;
+
+   now_ms = bson_get_monotonic_time () / 1000;
+   _mongocrypt_mutex_lock (&fetches->mutex);
+   if (_find_other_fetch (fetches, attr, owner, wait_ms, now_ms)) {
+      _mongocrypt_mutex_unlock (&fetches->mutex);
+      return false;
+   }
+
+   fetch = bson_malloc0 (sizeof (*fetch));
+   BSON_ASSERT (fetch);
+   fetch->attr = _mongocrypt_cache_key_attr_new (
+      (_mongocrypt_buffer_t *) &attr->id, attr->alt_names);
+   fetch->owner = owner;
+   fetch->started_ms = now_ms;
+   fetch->next = fetches->fetches;
+   fetches->fetches = fetch;
+   _mongocrypt_mutex_unlock (&fetches->mutex);
+   return true;
+}
+
+
+void
+_mongocrypt_key_fetches_wait (_mongocrypt_key_fetches_t *fetches,
+                              const _mongocrypt_cache_key_attr_t *attr,
+                              const void *owner,
+                              uint64_t wait_ms)
+{
+   _mongocrypt_key_fetch_t *fetch;
+   int64_t now_ms;
+
+   _mongocrypt_mutex_lock (&fetches->mutex);
+   for (;;) {
+      now_ms = bson_get_monotonic_time () / 1000;
+      fetch = _find_other_fetch (fetches, attr, owner, wait_ms, now_ms);
+      if (!fetch) {
+         break;
+      }
+      _mongocrypt_cond_timedwait (&fetches->cond,
+                                  &fetches->mutex,
+                                  fetch->started_ms + (int64_t) wait_ms -
+                                     now_ms);
+   }
+   _mongocrypt_mutex_unlock (&fetches->mutex);
+}
+
+
+void
+_mongocrypt_key_fetches_release (_mongocrypt_key_fetches_t *fetches,
+                                 const void *owner,
+                                 const _mongocrypt_cache_key_attr_t *attr)
+{
+   _mongocrypt_key_fetch_t **link, *fetch;
+   bool released = false;
+
+   _mongocrypt_mutex_lock (&fetches->mutex);
+   link = &fetches->fetches;
+   while ((fetch = *link)) {
+      if (fetch->owner == owner &&
+          (!attr || _attr_matches (fetch->attr, attr))) {
+         *link = fetch->next;
+         _key_fetch_destroy (fetch);
+         released = true;
+      } else {
+         link = &fetch->next;
+      }
+   }
+   if (released) {
+      _mongocrypt_cond_broadcast (&fetches->cond);
+   }
+   _mongocrypt_mutex_unlock (&fetches->mutex);
+}
+
+
+void
+_mongocrypt_key_batch_init (_mongocrypt_key_batch_t *batch)
+{
+   _mongocrypt_mutex_init (&batch->mutex);
+   _mongocrypt_cond_init (&batch->cond);
+   batch->leader = NULL;
+   batch->ids = NULL;
+   batch->num_ids = 0;
+   batch->ids_size = 0;
+}
+
+
+void
+_mongocrypt_key_batch_ids_destroy (_mongocrypt_buffer_t *ids,
+                                   uint32_t num_ids)
+{
+   uint32_t i;
+
+   for (i = 0; i < num_ids; i++) {
+      _mongocrypt_buffer_cleanup (&ids[i]);
+   }
+   bson_free (ids);
+}
+
+
+void
+_mongocrypt_key_batch_cleanup (_mongocrypt_key_batch_t *batch)
+{
+   _mongocrypt_key_batch_ids_destroy (batch->ids, batch->num_ids);
+   batch->ids = NULL;
+   batch->num_ids = 0;
+   _mongocrypt_cond_cleanup (&batch->cond);
+   _mongocrypt_mutex_cleanup (&batch->mutex);
+}
+
+
+void
+_mongocrypt_key_batch_after_fork (_mongocrypt_key_batch_t *batch)
+{
+   _mongocrypt_key_batch_ids_destroy (batch->ids, batch->num_ids);
+   _mongocrypt_key_batch_init (batch);
+}
+
+
+/* Add the keys to the batch led by another owner. Called with the batch
+ * mutex held. */
+static void
+_key_batch_join (_mongocrypt_key_batch_t *batch,
+                 _mongocrypt_key_fetches_t *fetches,
+                 const void *owner,
+                 const _mongocrypt_buffer_t *ids,
+                 uint32_t num_ids,
+                 uint64_t wait_ms)
+{
+   uint32_t i;
+
+   for (i = 0; i < num_ids; i++) {
+      _mongocrypt_cache_key_attr_t *attr;
+
+      if (batch->num_ids == batch->ids_size) {
+         batch->ids_size = batch->ids_size ? batch->ids_size * 2 : 8;
+         batch->ids = bson_realloc (
+            batch->ids, batch->ids_size * sizeof (_mongocrypt_buffer_t));
+      }
+      _mongocrypt_buffer_copy_to (&ids[i], &batch->ids[batch->num_ids++]);
+
+      /* If a third owner claims the key in between, both wait for it. */
+      attr = _mongocrypt_cache_key_attr_new (
+         (_mongocrypt_buffer_t *) &ids[i], NULL);
+      _mongocrypt_key_fetches_release (fetches, owner, attr);
+      (void) _mongocrypt_key_fetches_claim (
+         fetches, attr, batch->leader, wait_ms);
+      _mongocrypt_cache_key_attr_destroy (attr);
+   }
+}
+
+
+bool
+_mongocrypt_key_batch_merge (_mongocrypt_key_batch_t *batch,
+                             _mongocrypt_key_fetches_t *fetches,
+                             const void *owner,
+                             const _mongocrypt_buffer_t *ids,
+                             uint32_t num_ids,
+                             uint64_t window_ms,
+                             uint64_t wait_ms,
+                             _mongocrypt_buffer_t **joined,
+                             uint32_t *num_joined)
+{
+   int64_t now_ms;
+   int64_t close_ms;
+
+   *joined = NULL;
+   *num_joined = 0;
+
+   _mongocrypt_mutex_lock (&batch->mutex);
+   if (batch->leader && batch->leader != owner) {
+      _key_batch_join (batch, fetches, owner, ids, num_ids, wait_ms);
+      _mongocrypt_mutex_unlock (&batch->mutex);
+      return true;
+   }
+
+   batch->leader = owner;
+   now_ms = bson_get_monotonic_time () / 1000;
+   close_ms = now_ms + (int64_t) window_ms;
+   while (now_ms < close_ms) {
+      _mongocrypt_cond_timedwait (
+         &batch->cond, &batch->mutex, close_ms - now_ms);
+      now_ms = bson_get_monotonic_time () / 1000;
+   }
+   batch->leader = NULL;
+   *joined = batch->ids;
+   *num_joined = batch->num_ids;
+   batch->ids = NULL;
+   batch->num_ids = 0;
+   batch->ids_size = 0;
+   _mongocrypt_mutex_unlock (&batch->mutex);
+   return false;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_CACHE_MARKINGS_PRIVATE_H
+#define MONGOCRYPT_CACHE_MARKINGS_PRIVATE_H
+
+#include "mongocrypt-buffer-private.h"
+#include "mongocrypt-cache-private.h"
+#include "mongocrypt-status-private.h"
+
+/* The shape of a command is the command with its literal values replaced by
+ * their types. Strings starting with '$' (field paths and operators) are
+ * kept. */
+typedef struct {
+   char *ns;
+   _mongocrypt_buffer_t schema;
+   /* The _mongocrypt_cache_collinfo_schema_digest of schema. */
+   uint32_t schema_digest;
+   bool remote_schema;
+   _mongocrypt_buffer_t shape;
+} _mongocrypt_cache_markings_attr_t;
+
+void
+_mongocrypt_cache_markings_init (_mongocrypt_cache_t *cache);
+
+/* Returns NULL if @cmd is malformed. @schema may be empty. */
+_mongocrypt_cache_markings_attr_t *
+_mongocrypt_cache_markings_attr_new (const char *ns,
+                                     const _mongocrypt_buffer_t *schema,
+                                     uint32_t schema_digest,
+                                     bool remote_schema,
+                                     const bson_t *cmd);
+
+void
+_mongocrypt_cache_markings_attr_destroy (
+   _mongocrypt_cache_markings_attr_t *attr);
+
+/* Make a template from the mongocryptd @reply to @cmd. Every literal of the
+ * reply's result, including the 'v' of each marking, is mapped back to the
+ * literal of @cmd it came from. Returns NULL if that mapping is ambiguous,
+ * in which case the reply cannot be cached. */
+bson_t *
+_mongocrypt_markings_template_new (const bson_t *cmd, const bson_t *reply);
+
+/* Fill in @template with the literals of @cmd, which must have the shape
+ * of the command the template was made from. @reply is initialized to the
+ * mongocryptd reply for @cmd. */
+bool
+_mongocrypt_markings_template_apply (const bson_t *template,
+                                     const bson_t *cmd,
+                                     bson_t *reply,
+                                     mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+#endif /* MONGOCRYPT_CACHE_MARKINGS_PRIVATE_H */
@@ -0,0 +1,643 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-private.h"
+#include "mongocrypt-cache-markings-private.h"
+
+/* The markings cache.
+ *
+ * Attribute is a _mongocrypt_cache_markings_attr_t.
+ * Value is a markings template:
+ * {
+ *    reply: <the mongocryptd reply without 'result'>,
+ *    result: <the 'result' of the mongocryptd reply, if present>,
+ *    refs: [<int32>, ...]
+ * }
+ * There is one ref for each literal of 'result', in document order. A ref is
+ * the index of the command literal that replaces the literal (or the 'v' of a
+ * marking), or -1 if the literal is kept as is.
+ */
+
+typedef struct {
+   bson_iter_t iter;
+   char *path; /* NULL unless collected with paths. */
+} _leaf_t;
+
+typedef struct {
+   _leaf_t *leaves;
+   uint32_t n_leaves;
+   uint32_t leaves_size;
+   bool with_paths;
+} _leaves_t;
+
+
+static bool
+_cmp_attr (void *a_in, void *b_in, int *out)
+{
+   _mongocrypt_cache_markings_attr_t *a, *b;
+
+   a = (_mongocrypt_cache_markings_attr_t *) a_in;
+   b = (_mongocrypt_cache_markings_attr_t *) b_in;
+   *out = strcmp (a->ns, b->ns);
+   if (0 == *out) {
+      *out = (int) a->remote_schema - (int) b->remote_schema;
+   }
+   if (0 == *out) {
+      *out = _mongocrypt_buffer_cmp (&a->shape, &b->shape);
+   }
+   /* Schemas with different digests differ, without comparing their bytes. */
+   if (0 == *out && a->schema_digest != b->schema_digest) {
+      *out = a->schema_digest < b->schema_digest ? -1 : 1;
+   }
+   if (0 == *out) {
+      *out = _mongocrypt_buffer_cmp (&a->schema, &b->schema);
+   }
+   return true;
+}
+
+
+static bool
+_hash_attr (void *attr_in, cache_hash_visit_fn visit, void *ctx)
+{
+   _mongocrypt_cache_markings_attr_t *attr;
+   uint32_t hash;
+
+   attr = (_mongocrypt_cache_markings_attr_t *) attr_in;
+   /* The schema is only hashed through its precomputed digest. */
+   hash = _mongocrypt_cache_hash_bytes (attr->ns, strlen (attr->ns));
+   hash = hash * 31u +
+          _mongocrypt_cache_hash_bytes (attr->shape.data, attr->shape.len);
+   hash = hash * 31u + attr->schema_digest;
+   return visit (hash, ctx);
+}
+
+
+static void *
+_copy_attr (void *attr_in)
+{
+   _mongocrypt_cache_markings_attr_t *src, *dst;
+
+   src = (_mongocrypt_cache_markings_attr_t *) attr_in;
+   dst = bson_malloc0 (sizeof (*dst));
+   BSON_ASSERT (dst);
+   dst->ns = bson_strdup (src->ns);
+   _mongocrypt_buffer_copy_to (&src->schema, &dst->schema);
+   dst->schema_digest = src->schema_digest;
+   dst->remote_schema = src->remote_schema;
+   _mongocrypt_buffer_copy_to (&src->shape, &dst->shape);
+   return dst;
+}
+
+
+static void
+_destroy_attr (void *attr)
+{
+   _mongocrypt_cache_markings_attr_destroy (
+      (_mongocrypt_cache_markings_attr_t *) attr);
+}
+
+
+static void *
+_copy_value (void *bson)
+{
+   return bson_copy (bson);
+}
+
+
+static void
+_destroy_value (void *bson)
+{
+   bson_destroy (bson);
+}
+
+
+static size_t
+_size_pair (void *attr_in, void *bson)
+{
+   _mongocrypt_cache_markings_attr_t *attr;
+
+   attr = (_mongocrypt_cache_markings_attr_t *) attr_in;
+   return sizeof (*attr) + strlen (attr->ns) + 1 + attr->schema.len +
+          attr->shape.len + sizeof (bson_t) + ((bson_t *) bson)->len;
+}
+
+
+void
+_mongocrypt_cache_markings_init (_mongocrypt_cache_t *cache)
+{
+   cache->cmp_attr = _cmp_attr;
+   cache->copy_attr = _copy_attr;
+   cache->destroy_attr = _destroy_attr;
+   cache->copy_value = _copy_value;
+   cache->destroy_value = _destroy_value;
+   cache->dump_attr = NULL;
+   _mongocrypt_cache_init (cache);
+   cache->hash_attr = _hash_attr;
+   cache->size_pair = _size_pair;
+}
+
+
+static bool
+_holds_container (const bson_iter_t *iter)
+{
+   return BSON_ITER_HOLDS_DOCUMENT (iter) || BSON_ITER_HOLDS_ARRAY (iter);
+}
+
+
+static bool
+_holds_marking (const bson_iter_t *iter)
+{
+   bson_subtype_t subtype;
+   uint32_t len;
+   const uint8_t *data;
+
+   if (!BSON_ITER_HOLDS_BINARY (iter)) {
+      return false;
+   }
+   bson_iter_binary (iter, &subtype, &len, &data);
+   return subtype == 6 && len > 0 && data[0] == 0;
+}
+
+
+static bool
+_append_shape (bson_iter_t *iter, bson_t *out)
+{
+   while (bson_iter_next (iter)) {
+      const char *key;
+
+      key = bson_iter_key (iter);
+      if (_holds_container (iter)) {
+         bson_iter_t child;
+         bson_t child_out;
+         bool ok;
+
+         if (!bson_iter_recurse (iter, &child)) {
+            return false;
+         }
+         if (BSON_ITER_HOLDS_ARRAY (iter)) {
+            bson_append_array_begin (out, key, -1, &child_out);
+            ok = _append_shape (&child, &child_out);
+            bson_append_array_end (out, &child_out);
+         } else {
+            bson_append_document_begin (out, key, -1, &child_out);
+            ok = _append_shape (&child, &child_out);
+            bson_append_document_end (out, &child_out);
+         }
+         if (!ok) {
+            return false;
+         }
+      } else if (BSON_ITER_HOLDS_UTF8 (iter) &&
+                 bson_iter_utf8 (iter, NULL)[0] == '$') {
+         bson_append_iter (out, key, -1, iter);
+      } else {
+         bson_append_int32 (out, key, -1, (int32_t) bson_iter_type (iter));
+      }
+   }
+   return true;
+}
+
+
+_mongocrypt_cache_markings_attr_t *
+_mongocrypt_cache_markings_attr_new (const char *ns,
+                                     const _mongocrypt_buffer_t *schema,
+                                     uint32_t schema_digest,
+                                     bool remote_schema,
+                                     const bson_t *cmd)
+{
+   _mongocrypt_cache_markings_attr_t *attr;
+   bson_iter_t iter;
+   bson_t shape;
+
+   if (!ns || !schema || !cmd) {
+      return NULL;
+   }
+
+   bson_init (&shape);
+   if (!bson_iter_init (&iter, cmd) || !_append_shape (&iter, &shape)) {
+      bson_destroy (&shape);
+      return NULL;
+   }
+
+   attr = bson_malloc0 (sizeof (*attr));
+   BSON_ASSERT (attr);
+   attr->ns = bson_strdup (ns);
+   _mongocrypt_buffer_copy_to (schema, &attr->schema);
+   attr->schema_digest = schema_digest;
+   attr->remote_schema = remote_schema;
+   _mongocrypt_buffer_steal_from_bson (&attr->shape, &shape);
+   return attr;
+}
+
+
+void
+_mongocrypt_cache_markings_attr_destroy (
+   _mongocrypt_cache_markings_attr_t *attr)
+{
+   if (!attr) {
+      return;
+   }
+   bson_free (attr->ns);
+   _mongocrypt_buffer_cleanup (&attr->schema);
+   _mongocrypt_buffer_cleanup (&attr->shape);
+   bson_free (attr);
+}
+
+
+static void
+_leaves_init (_leaves_t *leaves, bool with_paths)
+{
+   memset (leaves, 0, sizeof (*leaves));
+   leaves->with_paths = with_paths;
+}
+
+
+static void
+_leaves_cleanup (_leaves_t *leaves)
+{
+   uint32_t i;
+
+   for (i = 0; i < leaves->n_leaves; i++) {
+      bson_free (leaves->leaves[i].path);
+   }
+   bson_free (leaves->leaves);
+}
+
+
+/* Collect every literal under @iter in document order. */
+static bool
+_leaves_collect (_leaves_t *leaves, bson_iter_t *iter, const char *prefix)
+{
+   while (bson_iter_next (iter)) {
+      char *path = NULL;
+
+      if (leaves->with_paths) {
+         path = prefix ? bson_strdup_printf (
+                            "%s.%s", prefix, bson_iter_key (iter))
+                       : bson_strdup (bson_iter_key (iter));
+      }
+
+      if (_holds_container (iter)) {
+         bson_iter_t child;
+         bool ok;
+
+         ok = bson_iter_recurse (iter, &child) &&
+              _leaves_collect (leaves, &child, path);
+         bson_free (path);
+         if (!ok) {
+            return false;
+         }
+         continue;
+      }
+
+      if (leaves->n_leaves == leaves->leaves_size) {
+         leaves->leaves_size = leaves->leaves_size ? leaves->leaves_size * 2
+                                                   : 16;
+         leaves->leaves = bson_realloc (
+            leaves->leaves, leaves->leaves_size * sizeof (_leaf_t));
+      }
+      memcpy (&leaves->leaves[leaves->n_leaves].iter, iter, sizeof (*iter));
+      leaves->leaves[leaves->n_leaves].path = path;
+      leaves->n_leaves++;
+   }
+   return true;
+}
+
+
+static bool
+_value_eq (const bson_iter_t *a, const bson_iter_t *b)
+{
+   bson_t a_bson, b_bson;
+   bool eq;
+
+   if (bson_iter_type (a) != bson_iter_type (b)) {
+      return false;
+   }
+
+   bson_init (&a_bson);
+   bson_init (&b_bson);
+   bson_append_iter (&a_bson, "", 0, a);
+   bson_append_iter (&b_bson, "", 0, b);
+   eq = a_bson.len == b_bson.len &&
+        0 == memcmp (bson_get_data (&a_bson), bson_get_data (&b_bson),
+                     a_bson.len);
+   bson_destroy (&a_bson);
+   bson_destroy (&b_bson);
+   return eq;
+}
+
+
+/* Find the command literal that @leaf of the result came from. @hint is the
+ * first candidate tried, since the result usually keeps the literals in the
+ * order of the command. Sets *ref to -1 if no command literal has the value.
+ * Returns false if the literal cannot be mapped unambiguously. */
+static bool
+_find_ref (_leaves_t *cmd_leaves, _leaf_t *leaf, uint32_t hint, int32_t *ref)
+{
+   bson_iter_t v_iter;
+   const bson_iter_t *value;
+   uint32_t i, found = 0, count = 0;
+   bool is_marking;
+
+   value = &leaf->iter;
+   is_marking = _holds_marking (&leaf->iter);
+   if (is_marking) {
+      bson_subtype_t subtype;
+      uint32_t len;
+      const uint8_t *data;
+      bson_t marking;
+
+      bson_iter_binary (&leaf->iter, &subtype, &len, &data);
+      if (!bson_init_static (&marking, data + 1, len - 1) ||
+          !bson_iter_init_find (&v_iter, &marking, "v")) {
+         return false;
+      }
+      value = &v_iter;
+   }
+
+   /* A literal at the same path with the same value is the same literal. */
+   if (hint < cmd_leaves->n_leaves &&
+       0 == strcmp (cmd_leaves->leaves[hint].path, leaf->path) &&
+       _value_eq (&cmd_leaves->leaves[hint].iter, value)) {
+      *ref = (int32_t) hint;
+      return true;
+   }
+   for (i = 0; i < cmd_leaves->n_leaves; i++) {
+      if (0 == strcmp (cmd_leaves->leaves[i].path, leaf->path) &&
+          _value_eq (&cmd_leaves->leaves[i].iter, value)) {
+         *ref = (int32_t) i;
+         return true;
+      }
+   }
+
+   /* Otherwise the value must be unique. */
+   for (i = 0; i < cmd_leaves->n_leaves; i++) {
+      if (_value_eq (&cmd_leaves->leaves[i].iter, value)) {
+         found = i;
+         count++;
+      }
+   }
+
+   if (count == 0) {
+      /* The literal was added by mongocryptd. A marking's value must come
+       * from the command. */
+      *ref = -1;
+      return !is_marking;
+   }
+   if (count > 1) {
+      return false;
+   }
+   *ref = (int32_t) found;
+   return true;
+}
+
+
+bson_t *
+_mongocrypt_markings_template_new (const bson_t *cmd, const bson_t *reply)
+{
+   _leaves_t cmd_leaves, result_leaves;
+   bson_iter_t iter, result_iter;
+   bson_t *template;
+   bson_t child;
+   bool has_result = false;
+   bool ok = false;
+   uint32_t i, hint = 0;
+
+   _leaves_init (&cmd_leaves, true);
+   _leaves_init (&result_leaves, true);
+   template = bson_new ();
+
+   if (!bson_iter_init (&iter, cmd) ||
+       !_leaves_collect (&cmd_leaves, &iter, NULL)) {
+      goto done;
+   }
+
+   if (!bson_iter_init (&iter, reply)) {
+      goto done;
+   }
+   bson_append_document_begin (template, "reply", -1, &child);
+   while (bson_iter_next (&iter)) {
+      if (0 == strcmp (bson_iter_key (&iter), "result")) {
+         memcpy (&result_iter, &iter, sizeof (iter));
+         has_result = true;
+         continue;
+      }
+      bson_append_iter (&child, NULL, 0, &iter);
+   }
+   bson_append_document_end (template, &child);
+
+   if (!has_result) {
+      ok = true;
+      goto done;
+   }
+
+   if (!BSON_ITER_HOLDS_DOCUMENT (&result_iter) ||
+       !bson_iter_recurse (&result_iter, &iter) ||
+       !_leaves_collect (&result_leaves, &iter, NULL)) {
+      goto done;
+   }
+   bson_append_iter (template, "result", -1, &result_iter);
+
+   bson_append_array_begin (template, "refs", -1, &child);
+   for (i = 0; i < result_leaves.n_leaves; i++) {
+      char buf[16];
+      const char *key;
+      int32_t ref;
+
+      if (!_find_ref (&cmd_leaves, &result_leaves.leaves[i], hint, &ref)) {
+         bson_append_array_end (template, &child);
+         goto done;
+      }
+      if (ref >= 0) {
+         hint = (uint32_t) ref + 1;
+      }
+      bson_uint32_to_string (i, &key, buf, sizeof (buf));
+      bson_append_int32 (&child, key, -1, ref);
+   }
+   bson_append_array_end (template, &child);
+   ok = true;
+
+done:
+   _leaves_cleanup (&cmd_leaves);
+   _leaves_cleanup (&result_leaves);
+   if (!ok) {
+      bson_destroy (template);
+      return NULL;
+   }
+   return template;
+}
+
+
+/* Append a copy of @marking_iter with its 'v' replaced by @v_iter. */
+static bool
+_append_filled_marking (bson_t *out,
+                        const char *key,
+                        bson_iter_t *marking_iter,
+                        bson_iter_t *v_iter,
+                        mongocrypt_status_t *status)
+{
+   bson_subtype_t subtype;
+   uint32_t len;
+   const uint8_t *data;
+   bson_t marking, filled;
+   bson_iter_t iter;
+   _mongocrypt_buffer_t buf;
+   bool ret;
+
+   bson_iter_binary (marking_iter, &subtype, &len, &data);
+   if (!bson_init_static (&marking, data + 1, len - 1) ||
+       !bson_iter_init (&iter, &marking)) {
+      CLIENT_ERR ("invalid marking");
+      return false;
+   }
+
+   bson_init (&filled);
+   while (bson_iter_next (&iter)) {
+      if (0 == strcmp (bson_iter_key (&iter), "v")) {
+         continue;
+      }
+      bson_append_iter (&filled, NULL, 0, &iter);
+   }
+   bson_append_iter (&filled, "v", 1, v_iter);
+
+   _mongocrypt_buffer_init (&buf);
+   _mongocrypt_buffer_resize (&buf, filled.len + 1);
+   buf.data[0] = 0;
+   memcpy (buf.data + 1, bson_get_data (&filled), filled.len);
+   ret = bson_append_binary (
+      out, key, -1, (bson_subtype_t) 6, buf.data, buf.len);
+   _mongocrypt_buffer_cleanup (&buf);
+   bson_destroy (&filled);
+   if (!ret) {
+      CLIENT_ERR ("could not append marking");
+   }
+   return ret;
+}
+
+
+static bool
+_fill (bson_iter_t *iter,
+       bson_t *out,
+       _leaves_t *cmd_leaves,
+       bson_iter_t *refs,
+       mongocrypt_status_t *status)
+{
+   while (bson_iter_next (iter)) {
+      const char *key;
+      bson_iter_t *leaf;
+      int32_t ref;
+
+      key = bson_iter_key (iter);
+      if (_holds_container (iter)) {
+         bson_iter_t child;
+         bson_t child_out;
+         bool ok;
+
+         if (!bson_iter_recurse (iter, &child)) {
+            CLIENT_ERR ("malformed markings template");
+            return false;
+         }
+         if (BSON_ITER_HOLDS_ARRAY (iter)) {
+            bson_append_array_begin (out, key, -1, &child_out);
+            ok = _fill (&child, &child_out, cmd_leaves, refs, status);
+            bson_append_array_end (out, &child_out);
+         } else {
+            bson_append_document_begin (out, key, -1, &child_out);
+            ok = _fill (&child, &child_out, cmd_leaves, refs, status);
+            bson_append_document_end (out, &child_out);
+         }
+         if (!ok) {
+            return false;
+         }
+         continue;
+      }
+
+      if (!bson_iter_next (refs) || !BSON_ITER_HOLDS_INT32 (refs)) {
+         CLIENT_ERR ("malformed markings template");
+         return false;
+      }
+      ref = bson_iter_int32 (refs);
+      if (ref < 0) {
+         bson_append_iter (out, key, -1, iter);
+         continue;
+      }
+      if ((uint32_t) ref >= cmd_leaves->n_leaves) {
+         CLIENT_ERR ("markings template does not match command");
+         return false;
+      }
+
+      leaf = &cmd_leaves->leaves[ref].iter;
+      if (_holds_marking (iter)) {
+         if (!_append_filled_marking (out, key, iter, leaf, status)) {
+            return false;
+         }
+      } else {
+         bson_append_iter (out, key, -1, leaf);
+      }
+   }
+   return true;
+}
+
+
+bool
+_mongocrypt_markings_template_apply (const bson_t *template,
+                                     const bson_t *cmd,
+                                     bson_t *reply,
+                                     mongocrypt_status_t *status)
+{
+   _leaves_t cmd_leaves;
+   bson_iter_t iter, child, refs_iter, refs;
+   bson_t result;
+   bool ret = false;
+
+   bson_init (reply);
+   _leaves_init (&cmd_leaves, false);
+
+   if (!bson_iter_init_find (&iter, template, "reply") ||
+       !BSON_ITER_HOLDS_DOCUMENT (&iter) || !bson_iter_recurse (&iter, &child)) {
+      CLIENT_ERR ("malformed markings template");
+      goto done;
+   }
+   while (bson_iter_next (&child)) {
+      bson_append_iter (reply, NULL, 0, &child);
+   }
+
+   if (!bson_iter_init_find (&iter, template, "result")) {
+      ret = true;
+      goto done;
+   }
+
+   if (!BSON_ITER_HOLDS_DOCUMENT (&iter) || !bson_iter_recurse (&iter, &child) ||
+       !bson_iter_init_find (&refs_iter, template, "refs") ||
+       !BSON_ITER_HOLDS_ARRAY (&refs_iter) ||
+       !bson_iter_recurse (&refs_iter, &refs)) {
+      CLIENT_ERR ("malformed markings template");
+      goto done;
+   }
+
+   if (!bson_iter_init (&iter, cmd) ||
+       !_leaves_collect (&cmd_leaves, &iter, NULL)) {
+      CLIENT_ERR ("malformed command");
+      goto done;
+   }
+
+   bson_append_document_begin (reply, "result", -1, &result);
+   ret = _fill (&child, &result, &cmd_leaves, &refs, status);
+   bson_append_document_end (reply, &result);
+
+done:
+   _leaves_cleanup (&cmd_leaves);
+   return ret;
+}
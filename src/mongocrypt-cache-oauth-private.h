@@ -23,8 +23,23 @@
 typedef struct {
    bson_t *entry;
    char *access_token;
+   /* expiration_time_us and refresh_time_us are written under the write
+    * lock with _mongocrypt_atomic_store_int64, so they may be read without
+    * it. expiration_time_us is 0 if nothing is cached. */
    int64_t expiration_time_us;
-   mongocrypt_mutex_t mutex; /* global lock of cache. */
+   int64_t refresh_time_us;
+   /* Nonzero while a refresh context owns the refresh of this token. Claimed
+    * with _mongocrypt_atomic_cas_int64, without the lock. */
+   int64_t refreshing;
+   /* Guards entry and access_token. Gets take it shared. */
+   mongocrypt_rwlock_t rwlock;
+   /* The key broker fetching a token while none is cached, or NULL. Other
+    * key brokers wait for it instead of requesting a token of their own.
+    * Guarded by fetch_mutex. */
+   const void *fetch_owner;
+   int64_t fetch_started_ms;
+   mongocrypt_mutex_t fetch_mutex;
+   mongocrypt_cond_t fetch_cond;
 } _mongocrypt_cache_oauth_t;
 
 _mongocrypt_cache_oauth_t *
@@ -33,6 +48,11 @@ _mongocrypt_cache_oauth_new (void);
 void
 _mongocrypt_cache_oauth_destroy (_mongocrypt_cache_oauth_t *cache);
 
+/* Called in the child of a fork. Keeps the token, but drops a refresh
+ * claimed by the parent. */
+void
+_mongocrypt_cache_oauth_after_fork (_mongocrypt_cache_oauth_t *cache);
+
 bool
 _mongocrypt_cache_oauth_add (_mongocrypt_cache_oauth_t *cache,
                              bson_t *oauth_response,
@@ -43,4 +63,38 @@ _mongocrypt_cache_oauth_add (_mongocrypt_cache_oauth_t *cache,
 char *
 _mongocrypt_cache_oauth_get (_mongocrypt_cache_oauth_t *cache);
 
+/* Returns true if a token is cached and is within the refresh period before
+ * it expires, and no refresh is in progress. Does not take the lock. */
+bool
+_mongocrypt_cache_oauth_needs_refresh (_mongocrypt_cache_oauth_t *cache);
+
+/* Claim the refresh of the token. Returns false if another caller already
+ * claimed it. A successful claim must be released with
+ * _mongocrypt_cache_oauth_end_refresh. */
+bool
+_mongocrypt_cache_oauth_start_refresh (_mongocrypt_cache_oauth_t *cache);
+
+void
+_mongocrypt_cache_oauth_end_refresh (_mongocrypt_cache_oauth_t *cache);
+
+/* Returns true if @owner now owns the fetch of a token. Returns false if
+ * another owner claimed it less than @wait_ms ago. A claim older than that is
+ * taken over, in case its owner stalled. */
+bool
+_mongocrypt_cache_oauth_claim_fetch (_mongocrypt_cache_oauth_t *cache,
+                                     const void *owner,
+                                     uint64_t wait_ms);
+
+/* Block until no other owner is fetching a token, or until @wait_ms after
+ * that fetch was claimed. */
+void
+_mongocrypt_cache_oauth_wait_fetch (_mongocrypt_cache_oauth_t *cache,
+                                    const void *owner,
+                                    uint64_t wait_ms);
+
+/* Release the fetch if @owner claimed it, and wake the waiters. */
+void
+_mongocrypt_cache_oauth_release_fetch (_mongocrypt_cache_oauth_t *cache,
+                                       const void *owner);
+
 #endif /* MONGOCRYPT_CACHE_OAUTH_PRIVATE_H */
\ No newline at end of file
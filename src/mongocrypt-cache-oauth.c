@@ -24,25 +24,45 @@
  */
 #define MONGOCRYPT_OAUTH_CACHE_EVICTION_PERIOD_US 5000 * 1000
 
+/* How long before eviction a cached token is reported as needing a refresh.
+ * A background refresh in this period replaces the token before any user
+ * operation has to wait for authentication.
+ */
+#define MONGOCRYPT_OAUTH_CACHE_REFRESH_PERIOD_US 60 * 1000 * 1000
+
 _mongocrypt_cache_oauth_t *
 _mongocrypt_cache_oauth_new (void)
 {
    _mongocrypt_cache_oauth_t *cache;
 
    cache = bson_malloc0 (sizeof (_mongocrypt_cache_oauth_t));
-   _mongocrypt_mutex_init (&cache->mutex);
+   _mongocrypt_rwlock_init (&cache->rwlock);
+   _mongocrypt_mutex_init (&cache->fetch_mutex);
+   _mongocrypt_cond_init (&cache->fetch_cond);
    return cache;
 }
 
 void
 _mongocrypt_cache_oauth_destroy (_mongocrypt_cache_oauth_t *cache)
 {
-   _mongocrypt_mutex_cleanup (&cache->mutex);
+   _mongocrypt_rwlock_cleanup (&cache->rwlock);
+   _mongocrypt_mutex_cleanup (&cache->fetch_mutex);
+   _mongocrypt_cond_cleanup (&cache->fetch_cond);
    bson_destroy (cache->entry);
    bson_free (cache->access_token);
    bson_free (cache);
 }
 
+void
+_mongocrypt_cache_oauth_after_fork (_mongocrypt_cache_oauth_t *cache)
+{
+   _mongocrypt_rwlock_init (&cache->rwlock);
+   cache->refreshing = 0;
+   _mongocrypt_mutex_init (&cache->fetch_mutex);
+   _mongocrypt_cond_init (&cache->fetch_cond);
+   cache->fetch_owner = NULL;
+}
+
 bool
 _mongocrypt_cache_oauth_add (_mongocrypt_cache_oauth_t *cache,
                              bson_t *oauth_response,
@@ -50,6 +70,7 @@ _mongocrypt_cache_oauth_add (_mongocrypt_cache_oauth_t *cache,
 {
    bson_iter_t iter;
    int64_t expiration_time_us;
+   int64_t refresh_time_us;
    int64_t cache_time_us;
    const char *access_token;
 
@@ -62,6 +83,8 @@ _mongocrypt_cache_oauth_add (_mongocrypt_cache_oauth_t *cache,
    expiration_time_us = (bson_iter_as_int64 (&iter) * 1000 * 1000) +
                         cache_time_us -
                         MONGOCRYPT_OAUTH_CACHE_EVICTION_PERIOD_US;
+   refresh_time_us =
+      expiration_time_us - MONGOCRYPT_OAUTH_CACHE_REFRESH_PERIOD_US;
 
    if (!bson_iter_init_find (&iter, oauth_response, "access_token") ||
        !BSON_ITER_HOLDS_UTF8 (&iter)) {
@@ -70,15 +93,18 @@ _mongocrypt_cache_oauth_add (_mongocrypt_cache_oauth_t *cache,
    }
    access_token = bson_iter_utf8 (&iter, NULL);
 
-   _mongocrypt_mutex_lock (&cache->mutex);
+   _mongocrypt_rwlock_wrlock (&cache->rwlock);
    if (expiration_time_us > cache->expiration_time_us) {
       bson_destroy (cache->entry);
       cache->entry = bson_copy (oauth_response);
-      cache->expiration_time_us = expiration_time_us;
       bson_free (cache->access_token);
       cache->access_token = bson_strdup (access_token);
+      _mongocrypt_atomic_store_int64 (&cache->refresh_time_us,
+                                      refresh_time_us);
+      _mongocrypt_atomic_store_int64 (&cache->expiration_time_us,
+                                      expiration_time_us);
    }
-   _mongocrypt_mutex_unlock (&cache->mutex);
+   _mongocrypt_rwlock_wrunlock (&cache->rwlock);
    return true;
 }
 
@@ -88,23 +114,115 @@ char *
 _mongocrypt_cache_oauth_get (_mongocrypt_cache_oauth_t *cache)
 {
    char *access_token;
+   int64_t now;
 
-   _mongocrypt_mutex_lock (&cache->mutex);
-   if (!cache->entry) {
-      _mongocrypt_mutex_unlock (&cache->mutex);
+   /* Check for a missing or expired token without taking the lock. An expired
+    * token is left in place and replaced by the next add. */
+   now = bson_get_monotonic_time ();
+   if (now >= _mongocrypt_atomic_load_int64 (&cache->expiration_time_us)) {
       return NULL;
    }
 
-   if (bson_get_monotonic_time () >= cache->expiration_time_us) {
-      bson_destroy (cache->entry);
-      cache->entry = NULL;
-      cache->expiration_time_us = 0;
-      _mongocrypt_mutex_unlock (&cache->mutex);
+   /* Readers copy the token concurrently. */
+   _mongocrypt_rwlock_rdlock (&cache->rwlock);
+   if (!cache->entry || now >= cache->expiration_time_us) {
+      _mongocrypt_rwlock_rdunlock (&cache->rwlock);
       return NULL;
    }
 
    access_token = bson_strdup (cache->access_token);
-   _mongocrypt_mutex_unlock (&cache->mutex);
+   _mongocrypt_rwlock_rdunlock (&cache->rwlock);
 
    return access_token;
-}
\ No newline at end of file
+}
+
+bool
+_mongocrypt_cache_oauth_needs_refresh (_mongocrypt_cache_oauth_t *cache)
+{
+   if (0 == _mongocrypt_atomic_load_int64 (&cache->expiration_time_us)) {
+      return false;
+   }
+   if (_mongocrypt_atomic_load_int64 (&cache->refreshing)) {
+      return false;
+   }
+   return bson_get_monotonic_time () >=
+          _mongocrypt_atomic_load_int64 (&cache->refresh_time_us);
+}
+
+bool
+_mongocrypt_cache_oauth_start_refresh (_mongocrypt_cache_oauth_t *cache)
+{
+   return _mongocrypt_atomic_cas_int64 (&cache->refreshing, 0, 1);
+}
+
+void
+_mongocrypt_cache_oauth_end_refresh (_mongocrypt_cache_oauth_t *cache)
+{
+   _mongocrypt_atomic_store_release_int64 (&cache->refreshing, 0);
+}
+
+/* Returns true if an owner other than @owner claimed the fetch less than
+ * @wait_ms ago. Must be called with fetch_mutex held. */
+static bool
+_other_fetch_pending (_mongocrypt_cache_oauth_t *cache,
+                      const void *owner,
+                      uint64_t wait_ms,
+                      int64_t now_ms)
+{
+   return cache->fetch_owner && cache->fetch_owner != owner &&
+          now_ms - cache->fetch_started_ms < (int64_t) wait_ms;
+}
+
+bool
+_mongocrypt_cache_oauth_claim_fetch (_mongocrypt_cache_oauth_t *cache,
+                                     const void *owner,
+                                     uint64_t wait_ms)
+{
+   int64_t now_ms;
+   bool claimed = false;
+
+   now_ms = bson_get_monotonic_time () / 1000;
+   _mongocrypt_mutex_lock (&cache->fetch_mutex);
+   if (!_other_fetch_pending (cache, owner, wait_ms, now_ms)) {
+      if (cache->fetch_owner != owner) {
+         cache->fetch_owner = owner;
+         cache->fetch_started_ms = now_ms;
+      }
+      claimed = true;
+   }
+   _mongocrypt_mutex_unlock (&cache->fetch_mutex);
+   return claimed;
+}
+
+void
+_mongocrypt_cache_oauth_wait_fetch (_mongocrypt_cache_oauth_t *cache,
+                                    const void *owner,
+                                    uint64_t wait_ms)
+{
+   int64_t now_ms;
+
+   _mongocrypt_mutex_lock (&cache->fetch_mutex);
+   for (;;) {
+      now_ms = bson_get_monotonic_time () / 1000;
+      if (!_other_fetch_pending (cache, owner, wait_ms, now_ms)) {
+         break;
+      }
+      _mongocrypt_cond_timedwait (&cache->fetch_cond,
+                                  &cache->fetch_mutex,
+                                  cache->fetch_started_ms +
+                                     (int64_t) wait_ms - now_ms);
+   }
+   _mongocrypt_mutex_unlock (&cache->fetch_mutex);
+}
+
+void
+_mongocrypt_cache_oauth_release_fetch (_mongocrypt_cache_oauth_t *cache,
+                                       const void *owner)
+{
+   _mongocrypt_mutex_lock (&cache->fetch_mutex);
+   if (cache->fetch_owner == owner) {
+      cache->fetch_owner = NULL;
+      _mongocrypt_cond_broadcast (&cache->fetch_cond);
+   }
+   _mongocrypt_mutex_unlock (&cache->fetch_mutex);
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef MONGOCRYPT_CACHE_PLAINTEXT_PRIVATE_H
+#define MONGOCRYPT_CACHE_PLAINTEXT_PRIVATE_H
+
+#include "mongocrypt-buffer-private.h"
+#include "mongocrypt-cache-private.h"
+
+/* The attribute is a _mongocrypt_buffer_t of a serialized deterministic
+ * ciphertext, and the value a _mongocrypt_buffer_t of its plaintext. */
+void
+_mongocrypt_cache_plaintext_init (_mongocrypt_cache_t *cache);
+
+/* Remove the plaintexts whose key is no longer in @cache_key. */
+void
+_mongocrypt_cache_plaintext_remove_uncached_keys (
+   _mongocrypt_cache_t *cache, _mongocrypt_cache_t *cache_key);
+
+#endif /* MONGOCRYPT_CACHE_PLAINTEXT_PRIVATE_H */
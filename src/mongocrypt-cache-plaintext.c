@@ -0,0 +1,165 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "mongocrypt-private.h"
+#include "mongocrypt-cache-key-private.h"
+#include "mongocrypt-cache-plaintext-private.h"
+
+/* The decrypted value cache.
+ *
+ * Attribute is a _mongocrypt_buffer_t of a serialized ciphertext, which
+ * starts with the blob subtype, the key id, and the original BSON type.
+ * Value is a _mongocrypt_buffer_t of the plaintext. Pairs are found by a
+ * hash of the ciphertext, and the whole ciphertext is compared, so a hash
+ * collision never returns another value's plaintext.
+ */
+
+/* The key id follows the blob subtype. */
+#define KEY_ID_OFFSET 1
+#define KEY_ID_LEN 16
+
+
+static bool
+_cmp_attr (void *a_in, void *b_in, int *out)
+{
+   *out = _mongocrypt_buffer_cmp ((_mongocrypt_buffer_t *) a_in,
+                                  (_mongocrypt_buffer_t *) b_in);
+   return true;
+}
+
+
+static bool
+_hash_attr (void *attr_in, cache_hash_visit_fn visit, void *ctx)
+{
+   _mongocrypt_buffer_t *attr;
+
+   attr = (_mongocrypt_buffer_t *) attr_in;
+   return visit (_mongocrypt_cache_hash_bytes (attr->data, attr->len), ctx);
+}
+
+
+static void *
+_copy_buffer (void *in)
+{
+   _mongocrypt_buffer_t *dst;
+
+   dst = bson_malloc0 (sizeof (*dst));
+   BSON_ASSERT (dst);
+   _mongocrypt_buffer_copy_to ((_mongocrypt_buffer_t *) in, dst);
+   return dst;
+}
+
+
+static void
+_destroy_buffer (void *in)
+{
+   if (!in) {
+      return;
+   }
+   _mongocrypt_buffer_cleanup ((_mongocrypt_buffer_t *) in);
+   bson_free (in);
+}
+
+
+static size_t
+_size_pair (void *attr, void *value)
+{
+   return 2 * sizeof (_mongocrypt_buffer_t) +
+          ((_mongocrypt_buffer_t *) attr)->len +
+          ((_mongocrypt_buffer_t *) value)->len;
+}
+
+
+void
+_mongocrypt_cache_plaintext_init (_mongocrypt_cache_t *cache)
+{
+   cache->cmp_attr = _cmp_attr;
+   cache->copy_attr = _copy_buffer;
+   cache->destroy_attr = _destroy_buffer;
+   cache->copy_value = _copy_buffer;
+   cache->destroy_value = _destroy_buffer;
+   cache->dump_attr = NULL;
+   _mongocrypt_cache_init (cache);
+   cache->hash_attr = _hash_attr;
+   cache->size_pair = _size_pair;
+}
+
+
+typedef struct {
+   _mongocrypt_buffer_t *ids;
+   uint32_t n_ids;
+} _key_ids_t;
+
+
+static void
+_collect_key_id (_mongocrypt_cache_pair_t *pair, void *ctx)
+{
+   _mongocrypt_cache_key_value_t *value;
+   _key_ids_t *key_ids;
+
+   value = (_mongocrypt_cache_key_value_t *) pair->value;
+   key_ids = (_key_ids_t *) ctx;
+   key_ids->ids = bson_realloc (
+      key_ids->ids, (key_ids->n_ids + 1u) * sizeof (_mongocrypt_buffer_t));
+   _mongocrypt_buffer_copy_to (&value->key_doc->id,
+                               &key_ids->ids[key_ids->n_ids++]);
+}
+
+
+static bool
+_key_uncached (void *attr_in, void *value, void *ctx)
+{
+   _mongocrypt_buffer_t *attr;
+   _key_ids_t *key_ids;
+   uint32_t i;
+
+   attr = (_mongocrypt_buffer_t *) attr_in;
+   key_ids = (_key_ids_t *) ctx;
+   BSON_ASSERT (attr->len > KEY_ID_OFFSET + KEY_ID_LEN);
+   for (i = 0; i < key_ids->n_ids; i++) {
+      if (key_ids->ids[i].len == KEY_ID_LEN &&
+          0 == memcmp (key_ids->ids[i].data,
+                       attr->data + KEY_ID_OFFSET,
+                       KEY_ID_LEN)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+void
+_mongocrypt_cache_plaintext_remove_uncached_keys (
+   _mongocrypt_cache_t *cache, _mongocrypt_cache_t *cache_key)
+{
+   _key_ids_t key_ids;
+   uint32_t i;
+
+   if (0 == _mongocrypt_cache_num_entries (cache)) {
+      return;
+   }
+
+   /* Collect the key ids first, so the locks of both caches are never held
+    * together. */
+   memset (&key_ids, 0, sizeof (key_ids));
+   _mongocrypt_cache_foreach (cache_key, _collect_key_id, &key_ids);
+   _mongocrypt_cache_remove_if (cache, _key_uncached, &key_ids);
+   for (i = 0; i < key_ids.n_ids; i++) {
+      _mongocrypt_buffer_cleanup (&key_ids.ids[i]);
+   }
+   bson_free (key_ids.ids);
+}
@@ -19,9 +19,21 @@
 #include "mongocrypt-buffer-private.h"
 #include "mongocrypt-mutex-private.h"
 #include "mongocrypt-status-private.h"
+#include "mongocrypt-trace-private.h"
 
 #define CACHE_EXPIRATION_MS 60000
 
+/* Pairs not used for this long are trimmed by mongocrypt_trim. */
+#define CACHE_COLD_MS 10000
+
+/* The capacity an adaptive cache starts at, and never shrinks below. */
+#define CACHE_ADAPTIVE_MIN_ENTRIES 64
+/* The number of evicted attributes an adaptive cache remembers. */
+#define CACHE_ADAPTIVE_GHOSTS 4096
+/* The slots of the set of remembered attributes. A power of two, at least
+ * twice CACHE_ADAPTIVE_GHOSTS so probes stay short. */
+#define CACHE_ADAPTIVE_GHOST_SLOTS 8192
+
 /* A generic simple cache.
  * To avoid overusing the names "key" or "id", the cache contains
  * "attribute-value" pairs.
@@ -31,14 +43,102 @@ typedef bool (*cache_compare_fn) (void *thing_a, void *thing_b, int *out);
 typedef void (*cache_destroy_fn) (void *thing);
 typedef void *(*cache_copy_fn) (void *thing);
 typedef void (*cache_dump_fn) (void *thing);
+/* Called for each hash of an attribute. Return false to stop iterating. */
+typedef bool (*cache_hash_visit_fn) (uint32_t hash, void *ctx);
+/* Calls @visit once for every hash an attribute can be found by. Two
+ * attributes that compare equal with cmp_attr must share at least one hash.
+ * Returns false if @visit returned false. */
+typedef bool (*cache_hash_fn) (void *thing,
+                               cache_hash_visit_fn visit,
+                               void *ctx);
+typedef void (*cache_attr_visit_fn) (void *attr, void *ctx);
+/* Estimates the bytes held by an attribute and its value. */
+typedef size_t (*cache_size_fn) (void *attr, void *value);
+
+/* A list of pairs, from the most to the least recently placed at its head.
+ * Pairs are linked through used_next and used_prev in cold and hot lists,
+ * and through added_next and added_prev in added lists. */
+typedef struct {
+   struct __mongocrypt_cache_pair_t *head;
+   struct __mongocrypt_cache_pair_t *tail;
+} _mongocrypt_cache_list_t;
+
+/* A share of a cache with its own bounds, so the pairs of one partition
+ * cannot evict the pairs of others. Pairs are assigned a partition by
+ * partition_attr when added. */
+typedef struct {
+   char *tag;
+   /* If non-zero, adding to a full partition evicts its least recently used
+    * pair. */
+   uint32_t max_entries;
+   /* If non-zero, replaces the cache expiration for pairs in the
+    * partition. */
+   uint64_t expiration;
+   uint32_t num_pairs;
+   /* The pairs of the partition. See _mongocrypt_cache_t.added and
+    * _mongocrypt_cache_t.cold. */
+   _mongocrypt_cache_list_t added;
+   _mongocrypt_cache_list_t cold;
+   _mongocrypt_cache_list_t hot;
+} _mongocrypt_cache_partition_t;
+
+/* Returns the partition an attribute belongs in: an index into @partitions
+ * plus one, or 0 for none. */
+typedef uint32_t (*cache_partition_fn) (
+   void *attr,
+   const _mongocrypt_cache_partition_t *partitions,
+   uint32_t num_partitions);
+
+/* Values of _mongocrypt_cache_pair_t.refresh. */
+#define CACHE_REFRESH_NONE 0
+#define CACHE_REFRESH_REQUESTED 1
+#define CACHE_REFRESH_STARTED 2
 
 typedef struct __mongocrypt_cache_pair_t {
    void *attr;
    void *value;
    struct __mongocrypt_cache_pair_t *next;
+   struct __mongocrypt_cache_pair_t *prev;
+   /* Links in the added list of the pair's partition. */
+   struct __mongocrypt_cache_pair_t *added_next;
+   struct __mongocrypt_cache_pair_t *added_prev;
+   /* Links in the cold or hot list of the pair's partition. */
+   struct __mongocrypt_cache_pair_t *used_next;
+   struct __mongocrypt_cache_pair_t *used_prev;
+   bool hot;
+   /* hits when the pair was placed at the head of its list. */
+   int64_t placed_hits;
    int64_t last_updated;
+   /* Updated by readers with _mongocrypt_atomic_store_int64. */
+   int64_t last_used;
+   /* One of the CACHE_REFRESH_* values. Readers only move it from NONE to
+    * REQUESTED, with _mongocrypt_atomic_store_int64. */
+   int64_t refresh;
+   /* Lookups that returned this pair. Updated by readers with
+    * _mongocrypt_atomic_add_int64. */
+   int64_t hits;
+   /* The adaptation window in which the pair was last hit, set by readers
+    * with _mongocrypt_atomic_cas_int64. */
+   int64_t hit_window;
+   /* Counted in _mongocrypt_cache_t.bytes. */
+   size_t bytes;
+   /* An index into _mongocrypt_cache_t.partitions plus one, or 0. */
+   uint32_t partition;
 } _mongocrypt_cache_pair_t;
 
+/* Called by _mongocrypt_cache_foreach with the cache locked for reading.
+ * @pair must not be modified. */
+typedef void (*cache_pair_visit_fn) (_mongocrypt_cache_pair_t *pair,
+                                     void *ctx);
+
+/* An entry in a bucket of the hash index. A pair has one entry for each hash
+ * returned by hash_attr. */
+typedef struct __mongocrypt_cache_index_entry_t {
+   uint32_t hash;
+   _mongocrypt_cache_pair_t *pair;
+   struct __mongocrypt_cache_index_entry_t *next;
+} _mongocrypt_cache_index_entry_t;
+
 typedef struct {
    cache_dump_fn dump_attr;
    cache_compare_fn cmp_attr;
@@ -46,12 +146,108 @@ typedef struct {
    cache_destroy_fn destroy_attr;
    cache_copy_fn copy_value;
    cache_destroy_fn destroy_value;
+   /* Optional. If set, lookups go through a hash index instead of
+    * comparing against every pair. */
+   cache_hash_fn hash_attr;
+   /* Optional. Used to estimate bytes. */
+   cache_size_fn size_pair;
+   /* Optional. Used to assign pairs to partitions, if there are any. */
+   cache_partition_fn partition_attr;
+   _mongocrypt_cache_partition_t *partitions;
+   uint32_t num_partitions;
+   /* Estimated bytes held by the pairs, not counting the index. */
+   size_t bytes;
+   /* Every pair, from most to least recently added. */
    _mongocrypt_cache_pair_t *pair;
-   mongocrypt_mutex_t mutex; /* global lock of cache. */
+   _mongocrypt_cache_pair_t *tail;
+   uint32_t num_pairs;
+   /* Pairs in no partition ordered by last_updated, newest first. A pair's
+    * last_updated is only set when it is added, so this is the order they
+    * were added in, except for restored pairs, which are placed by age. A
+    * partition may have its own expiration, so each partition keeps its own
+    * list, and expired pairs are at the tail of one of them. */
+   _mongocrypt_cache_list_t added;
+   /* Pairs in no partition, roughly from most to least recently used:
+    * those never hit in cold, in the order they were added, and the others
+    * in hot. Lookups only hold a read lock, so they do not move pairs.
+    * Instead, a pair hit since it was placed moves to the head of hot when
+    * it reaches the tail of either list, as in CLOCK, so finding the least
+    * recently used pair does not visit every pair. */
+   _mongocrypt_cache_list_t cold;
+   _mongocrypt_cache_list_t hot;
+   _mongocrypt_cache_index_entry_t **buckets;
+   uint32_t num_buckets;
+   uint32_t num_index_entries;
+   /* Readers share the lock. Anything that modifies pairs or the index
+    * takes it exclusively. */
+   mongocrypt_rwlock_t lock;
    uint64_t expiration;
+   /* If non-zero, adding to a full cache evicts the least recently used
+    * pair. */
+   uint32_t max_entries;
+   /* If non-zero, the cache is sized adaptively, and holds at most max_bytes
+    * of pairs. See _mongocrypt_cache_set_adaptive. */
+   size_t max_bytes;
+   /* The current bound on pairs of an adaptive cache. */
+   uint32_t capacity;
+   /* A ring of the first hashes of attributes evicted to make room, each
+    * with CACHE_GHOST_VALID set. Zero entries are empty. The oldest is
+    * overwritten when the ring is full. */
+   uint64_t *ghosts;
+   uint32_t next_ghost;
+   /* An open-addressed set of the hashes in ghosts, so they are found
+    * without scanning the ring. Each slot is the entry in ghosts, with its
+    * index in the ring above bit 32. Zero slots are empty. */
+   uint64_t *ghost_set;
+   /* The lookups counted when the current adaptation window started, and
+    * how many evicted attributes were added again since. */
+   int64_t window_lookups;
+   uint32_t window_ghost_hits;
+   /* Identifies the current adaptation window. Pairs hit in it, counted in
+    * window_in_use by the lookup that first sets their hit_window. */
+   int64_t window;
+   int64_t window_in_use;
+   /* If non-zero, a lookup that hits a pair within refresh_window
+    * milliseconds of expiring requests that the pair be refreshed. */
+   uint64_t refresh_window;
+   /* Non-zero if any pair has CACHE_REFRESH_REQUESTED. */
+   int64_t refresh_requested;
+   /* Incremented with _mongocrypt_atomic_add_int64 whenever a pair is added
+    * or removed, so copies of values taken by lookups can be checked without
+    * the lock. */
+   int64_t generation;
+   /* Incremented with _mongocrypt_atomic_add_int64 when keys are invalidated,
+    * for copies that outlive additions to the cache, like the keys of a
+    * decrypt session. */
+   int64_t invalidations;
+   /* Counters for mongocrypt_get_stats. Updated with
+    * _mongocrypt_atomic_add_int64, since hits happen under a read lock. */
+   int64_t hits;
+   int64_t misses;
+   int64_t evictions;
+   /* Lock contention, only measured if built with ENABLE_LOCK_STATS. Hold
+    * time is only measured for exclusive holds, since readers overlap.
+    * locked_us is when the current writer took the lock. */
+   int64_t lock_acquisitions;
+   int64_t lock_wait_us;
+   int64_t lock_hold_us;
+   int64_t locked_us;
+   /* Optional. If set, lookups are reported as spans named by name. */
+   _mongocrypt_trace_t *trace;
+   const char *name;
 } _mongocrypt_cache_t;
 
 
+/* Initialize the fields shared by all cache types. Callers set the
+ * attribute/value functions. */
+void
+_mongocrypt_cache_init (_mongocrypt_cache_t *cache);
+
+/* A hash of @len bytes at @data suitable for cache_hash_fn implementations. */
+uint32_t
+_mongocrypt_cache_hash_bytes (const void *data, size_t len);
+
+
 /* Attempt to get an entry.
  * Returns boolean indicating success.
  */
@@ -60,6 +256,16 @@ _mongocrypt_cache_get (_mongocrypt_cache_t *cache,
                        void *attr,
                        void **value) MONGOCRYPT_WARN_UNUSED_RESULT;
 
+/* Like _mongocrypt_cache_get, but on a hit also sets *until_ms to the
+ * monotonic time in milliseconds when the value expires, or enters the
+ * refresh window. Until then, and while cache->generation is unchanged, the
+ * copy may stand in for another lookup. */
+bool
+_mongocrypt_cache_get_until (_mongocrypt_cache_t *cache,
+                             void *attr,
+                             void **value,
+                             int64_t *until_ms) MONGOCRYPT_WARN_UNUSED_RESULT;
+
 bool
 _mongocrypt_cache_add_copy (_mongocrypt_cache_t *cache,
                             void *attr,
@@ -77,20 +283,121 @@ _mongocrypt_cache_add_stolen (_mongocrypt_cache_t *cache,
                               mongocrypt_status_t *status)
    MONGOCRYPT_WARN_UNUSED_RESULT;
 
+/* Like _mongocrypt_cache_add_stolen, but the value was added @age_ms ago, so
+ * it expires that much sooner. Used to restore a cache. */
+bool
+_mongocrypt_cache_add_stolen_aged (_mongocrypt_cache_t *cache,
+                                   void *attr,
+                                   void *value,
+                                   int64_t age_ms,
+                                   mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
 
 void
 _mongocrypt_cache_cleanup (_mongocrypt_cache_t *cache);
 
+/* Called in the child of a fork, before any other thread is started. Makes
+ * the lock usable again, and lets pairs whose refresh a context of the parent
+ * started be refreshed again. Other pairs are not written, so their memory
+ * stays shared with the parent. */
+void
+_mongocrypt_cache_after_fork (_mongocrypt_cache_t *cache);
+
 /* A helper debug function to dump the state of the cache. */
 void
 _mongocrypt_cache_dump (_mongocrypt_cache_t *cache);
 
-/* Tests may override the default expiration */
+/* Remove expired entries. Lookups never modify the cache, so expired entries
+ * are only removed here and when adding. The pairs of each partition are kept
+ * in expiration order, so this only visits the pairs it removes, and the tail
+ * of each partition. */
+void
+_mongocrypt_cache_evict (_mongocrypt_cache_t *cache);
+
+/* Set the time in milliseconds before an entry expires. Defaults to
+ * CACHE_EXPIRATION_MS. */
 void
 _mongocrypt_cache_set_expiration (_mongocrypt_cache_t *cache, uint64_t milli);
 
+/* Set the window before expiration in which lookups request a refresh. 0
+ * disables refresh-ahead. */
+void
+_mongocrypt_cache_set_refresh_window (_mongocrypt_cache_t *cache,
+                                      uint64_t milli);
+
+/* Returns true if a lookup requested that a pair be refreshed and no refresh
+ * has started for it yet. */
+bool
+_mongocrypt_cache_needs_refresh (_mongocrypt_cache_t *cache);
+
+/* Calls @visit on the attribute of every unexpired pair with a requested
+ * refresh, and marks those pairs as started so they are only returned once.
+ * A pair is refreshed by adding a new value for its attribute. */
+void
+_mongocrypt_cache_start_refresh (_mongocrypt_cache_t *cache,
+                                 cache_attr_visit_fn visit,
+                                 void *ctx);
+
+/* Bound the number of entries. 0 means unbounded. */
+void
+_mongocrypt_cache_set_max_entries (_mongocrypt_cache_t *cache,
+                                   uint32_t max_entries);
+
+/* Size the cache adaptively, holding at most @max_bytes of pairs, and at
+ * most max_entries pairs if that is set. 0 disables adaptive sizing.
+ *
+ * The capacity starts at CACHE_ADAPTIVE_MIN_ENTRIES. It grows when an
+ * attribute evicted to make room is added again, since a larger cache would
+ * have kept it. It shrinks after a window of lookups in which that did not
+ * happen, but not below the number of pairs hit in the window. Pairs that
+ * were never hit are evicted first, so a scan of many attributes that are
+ * each used once does not flush the pairs in use. */
+void
+_mongocrypt_cache_set_adaptive (_mongocrypt_cache_t *cache, size_t max_bytes);
+
+/* The current capacity of an adaptive cache, or 0 if it is not adaptive. */
+uint32_t
+_mongocrypt_cache_capacity (_mongocrypt_cache_t *cache);
+
+/* Add a partition named @tag, which partition_attr matches attributes
+ * against. @max_entries and @expiration are as described in
+ * _mongocrypt_cache_partition_t. Pairs already in the cache are not moved
+ * into the partition. Returns false if @tag is already a partition. */
+bool
+_mongocrypt_cache_add_partition (_mongocrypt_cache_t *cache,
+                                 const char *tag,
+                                 uint32_t max_entries,
+                                 uint64_t expiration);
+
 uint32_t
 _mongocrypt_cache_num_entries (_mongocrypt_cache_t *cache);
 
+/* Estimate the bytes held by the cached pairs and the index. */
+size_t
+_mongocrypt_cache_bytes (_mongocrypt_cache_t *cache);
+
+/* Remove expired pairs and pairs not used in the last @idle_ms milliseconds,
+ * or every pair if @idle_ms is 0. The index of a cache left empty is
+ * released. Returns the estimated bytes freed. */
+size_t
+_mongocrypt_cache_trim (_mongocrypt_cache_t *cache, int64_t idle_ms);
+
+/* Calls @visit on every unexpired pair. @visit must not use the cache. */
+void
+_mongocrypt_cache_foreach (_mongocrypt_cache_t *cache,
+                           cache_pair_visit_fn visit,
+                           void *ctx);
+
+/* Returns true if the pair of @attr and @value should be removed. */
+typedef bool (*cache_pair_pred_fn) (void *attr, void *value, void *ctx);
+
+/* Remove every pair for which @pred returns true. @pred must not use the
+ * cache. */
+void
+_mongocrypt_cache_remove_if (_mongocrypt_cache_t *cache,
+                             cache_pair_pred_fn pred,
+                             void *ctx);
+
 
 #endif /* MONGOCRYPT_CACHE_PRIVATE */
\ No newline at end of file
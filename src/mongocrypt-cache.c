@@ -19,34 +19,429 @@
 #include "mongocrypt-private.h"
 
 
+#define CACHE_INITIAL_BUCKETS 64
+
+
+/* Wrappers for the cache lock. If built with ENABLE_LOCK_STATS they record
+ * how long callers wait for it and how long writers hold it. */
+#ifdef MONGOCRYPT_ENABLE_LOCK_STATS
+static void
+_cache_count_wait (_mongocrypt_cache_t *cache, int64_t start_us)
+{
+   _mongocrypt_atomic_add_int64 (&cache->lock_acquisitions, 1);
+   _mongocrypt_atomic_add_int64 (&cache->lock_wait_us,
+                                 bson_get_monotonic_time () - start_us);
+}
+#endif
+
+
+static void
+_cache_rdlock (_mongocrypt_cache_t *cache)
+{
+#ifdef MONGOCRYPT_ENABLE_LOCK_STATS
+   int64_t start_us = bson_get_monotonic_time ();
+
+   _mongocrypt_rwlock_rdlock (&cache->lock);
+   _cache_count_wait (cache, start_us);
+#else
+   _mongocrypt_rwlock_rdlock (&cache->lock);
+#endif
+}
+
+
+static void
+_cache_rdunlock (_mongocrypt_cache_t *cache)
+{
+   _mongocrypt_rwlock_rdunlock (&cache->lock);
+}
+
+
+static void
+_cache_wrlock (_mongocrypt_cache_t *cache)
+{
+#ifdef MONGOCRYPT_ENABLE_LOCK_STATS
+   int64_t start_us = bson_get_monotonic_time ();
+
+   _mongocrypt_rwlock_wrlock (&cache->lock);
+   _cache_count_wait (cache, start_us);
+   cache->locked_us = bson_get_monotonic_time ();
+#else
+   _mongocrypt_rwlock_wrlock (&cache->lock);
+#endif
+}
+
+
+static void
+_cache_wrunlock (_mongocrypt_cache_t *cache)
+{
+#ifdef MONGOCRYPT_ENABLE_LOCK_STATS
+   _mongocrypt_atomic_add_int64 (
+      &cache->lock_hold_us, bson_get_monotonic_time () - cache->locked_us);
+#endif
+   _mongocrypt_rwlock_wrunlock (&cache->lock);
+}
+
+
 /* Did the cache pair expire? Caller must hold lock. */
+static int64_t
+_pair_expiration (_mongocrypt_cache_t *cache, _mongocrypt_cache_pair_t *pair)
+{
+   if (pair->partition && cache->partitions[pair->partition - 1].expiration) {
+      return (int64_t) cache->partitions[pair->partition - 1].expiration;
+   }
+   return (int64_t) cache->expiration;
+}
+
+
 static bool
 _pair_expired (_mongocrypt_cache_t *cache, _mongocrypt_cache_pair_t *pair)
 {
    int64_t current;
 
    current = bson_get_monotonic_time () / 1000;
-   return (current - pair->last_updated) > (int64_t) cache->expiration;
+   return (current - pair->last_updated) > _pair_expiration (cache, pair);
+}
+
+
+uint32_t
+_mongocrypt_cache_hash_bytes (const void *data, size_t len)
+{
+   /* 32 bit FNV-1a. */
+   const uint8_t *bytes = (const uint8_t *) data;
+   uint32_t hash = 2166136261u;
+   size_t i;
+
+   for (i = 0; i < len; i++) {
+      hash ^= bytes[i];
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+
+void
+_mongocrypt_cache_init (_mongocrypt_cache_t *cache)
+{
+   cache->hash_attr = NULL;
+   cache->size_pair = NULL;
+   cache->partition_attr = NULL;
+   cache->partitions = NULL;
+   cache->num_partitions = 0;
+   cache->bytes = 0;
+   cache->pair = NULL;
+   cache->tail = NULL;
+   cache->num_pairs = 0;
+   cache->added.head = NULL;
+   cache->added.tail = NULL;
+   cache->cold.head = NULL;
+   cache->cold.tail = NULL;
+   cache->hot.head = NULL;
+   cache->hot.tail = NULL;
+   cache->buckets = NULL;
+   cache->num_buckets = 0;
+   cache->num_index_entries = 0;
+   _mongocrypt_rwlock_init (&cache->lock);
+   cache->expiration = CACHE_EXPIRATION_MS;
+   cache->max_entries = 0;
+   cache->max_bytes = 0;
+   cache->capacity = 0;
+   cache->ghosts = NULL;
+   cache->next_ghost = 0;
+   cache->ghost_set = NULL;
+   cache->window_lookups = 0;
+   cache->window_ghost_hits = 0;
+   cache->window = 1;
+   cache->window_in_use = 0;
+   cache->refresh_window = 0;
+   cache->refresh_requested = 0;
+   cache->generation = 0;
+   cache->invalidations = 0;
+   cache->hits = 0;
+   cache->misses = 0;
+   cache->evictions = 0;
+   cache->lock_acquisitions = 0;
+   cache->lock_wait_us = 0;
+   cache->lock_hold_us = 0;
+   cache->locked_us = 0;
+   cache->trace = NULL;
+   cache->name = NULL;
+}
+
+
+/* Double the number of buckets. Caller must hold lock. */
+static void
+_index_grow (_mongocrypt_cache_t *cache)
+{
+   _mongocrypt_cache_index_entry_t **buckets;
+   uint32_t num_buckets;
+   uint32_t i;
+
+   num_buckets = cache->num_buckets ? cache->num_buckets * 2
+                                    : CACHE_INITIAL_BUCKETS;
+   buckets = bson_malloc0 (sizeof (*buckets) * num_buckets);
+   BSON_ASSERT (buckets);
+
+   for (i = 0; i < cache->num_buckets; i++) {
+      _mongocrypt_cache_index_entry_t *entry, *next;
+
+      for (entry = cache->buckets[i]; entry; entry = next) {
+         uint32_t idx = entry->hash % num_buckets;
+
+         next = entry->next;
+         entry->next = buckets[idx];
+         buckets[idx] = entry;
+      }
+   }
+
+   bson_free (cache->buckets);
+   cache->buckets = buckets;
+   cache->num_buckets = num_buckets;
+}
+
+
+typedef struct {
+   _mongocrypt_cache_t *cache;
+   _mongocrypt_cache_pair_t *pair;
+} _index_visit_ctx_t;
+
+
+static bool
+_index_insert_visit (uint32_t hash, void *ctx)
+{
+   _index_visit_ctx_t *visit_ctx = (_index_visit_ctx_t *) ctx;
+   _mongocrypt_cache_t *cache = visit_ctx->cache;
+   _mongocrypt_cache_index_entry_t *entry;
+   uint32_t idx;
+
+   if (cache->num_index_entries >= cache->num_buckets) {
+      _index_grow (cache);
+   }
+
+   entry = bson_malloc0 (sizeof (*entry));
+   BSON_ASSERT (entry);
+   entry->hash = hash;
+   entry->pair = visit_ctx->pair;
+   idx = hash % cache->num_buckets;
+   entry->next = cache->buckets[idx];
+   cache->buckets[idx] = entry;
+   cache->num_index_entries++;
+   return true;
 }
 
 
-/* Return the pair after the one being destroyed. */
+static bool
+_index_remove_visit (uint32_t hash, void *ctx)
+{
+   _index_visit_ctx_t *visit_ctx = (_index_visit_ctx_t *) ctx;
+   _mongocrypt_cache_t *cache = visit_ctx->cache;
+   _mongocrypt_cache_index_entry_t **ptr;
+
+   ptr = &cache->buckets[hash % cache->num_buckets];
+   while (*ptr) {
+      _mongocrypt_cache_index_entry_t *entry = *ptr;
+
+      if (entry->pair == visit_ctx->pair) {
+         *ptr = entry->next;
+         bson_free (entry);
+         cache->num_index_entries--;
+         continue;
+      }
+      ptr = &entry->next;
+   }
+   return true;
+}
+
+
+/* The hot or cold list of the pairs in @partition. Caller must hold
+ * lock. */
+static _mongocrypt_cache_list_t *
+_used_list (_mongocrypt_cache_t *cache, uint32_t partition, bool hot)
+{
+   if (partition) {
+      return hot ? &cache->partitions[partition - 1].hot
+                 : &cache->partitions[partition - 1].cold;
+   }
+   return hot ? &cache->hot : &cache->cold;
+}
+
+
+/* Place @pair at the head of its list. Caller must hold write lock. */
+static void
+_used_push (_mongocrypt_cache_t *cache, _mongocrypt_cache_pair_t *pair)
+{
+   _mongocrypt_cache_list_t *list =
+      _used_list (cache, pair->partition, pair->hot);
+
+   pair->used_prev = NULL;
+   pair->used_next = list->head;
+   if (list->head) {
+      list->head->used_prev = pair;
+   } else {
+      list->tail = pair;
+   }
+   list->head = pair;
+   pair->placed_hits = _mongocrypt_atomic_load_int64 (&pair->hits);
+}
+
+
+/* Caller must hold write lock. */
+static void
+_used_unlink (_mongocrypt_cache_t *cache, _mongocrypt_cache_pair_t *pair)
+{
+   _mongocrypt_cache_list_t *list =
+      _used_list (cache, pair->partition, pair->hot);
+
+   if (pair->used_prev) {
+      pair->used_prev->used_next = pair->used_next;
+   } else {
+      list->head = pair->used_next;
+   }
+   if (pair->used_next) {
+      pair->used_next->used_prev = pair->used_prev;
+   } else {
+      list->tail = pair->used_prev;
+   }
+}
+
+
+/* The least recently used pair of the hot or cold list of @partition, or
+ * NULL if it is empty. Pairs hit since they were placed are moved to the
+ * head of hot first. Each move follows a hit, so this takes constant time
+ * amortized. Caller must hold write lock. */
 static _mongocrypt_cache_pair_t *
-_destroy_pair (_mongocrypt_cache_t *cache,
-               _mongocrypt_cache_pair_t *prev,
-               _mongocrypt_cache_pair_t *pair)
+_used_tail (_mongocrypt_cache_t *cache, uint32_t partition, bool hot)
+{
+   _mongocrypt_cache_list_t *list = _used_list (cache, partition, hot);
+   _mongocrypt_cache_pair_t *pair;
+
+   /* Lookups need the lock this holds, so hits cannot change meanwhile. */
+   while ((pair = list->tail) &&
+          _mongocrypt_atomic_load_int64 (&pair->hits) != pair->placed_hits) {
+      _used_unlink (cache, pair);
+      pair->hot = true;
+      _used_push (cache, pair);
+   }
+   return pair;
+}
+
+
+/* Sets *lru to whichever of *lru and @pair was used less recently. */
+static void
+_less_recently_used (_mongocrypt_cache_pair_t *pair,
+                     _mongocrypt_cache_pair_t **lru)
+{
+   if (!pair) {
+      return;
+   }
+   if (!*lru || _mongocrypt_atomic_load_int64 (&pair->last_used) <
+                   _mongocrypt_atomic_load_int64 (&(*lru)->last_used)) {
+      *lru = pair;
+   }
+}
+
+
+/* The added list of the pairs in @partition. Caller must hold lock. */
+static _mongocrypt_cache_list_t *
+_added_list (_mongocrypt_cache_t *cache, uint32_t partition)
+{
+   return partition ? &cache->partitions[partition - 1].added : &cache->added;
+}
+
+
+/* Place @pair at the head of its added list. Caller must hold write lock. */
+static void
+_added_push (_mongocrypt_cache_t *cache, _mongocrypt_cache_pair_t *pair)
+{
+   _mongocrypt_cache_list_t *list = _added_list (cache, pair->partition);
+
+   pair->added_prev = NULL;
+   pair->added_next = list->head;
+   if (list->head) {
+      list->head->added_prev = pair;
+   } else {
+      list->tail = pair;
+   }
+   list->head = pair;
+}
+
+
+/* Caller must hold write lock. */
+static void
+_added_unlink (_mongocrypt_cache_t *cache, _mongocrypt_cache_pair_t *pair)
+{
+   _mongocrypt_cache_list_t *list = _added_list (cache, pair->partition);
+
+   if (pair->added_prev) {
+      pair->added_prev->added_next = pair->added_next;
+   } else {
+      list->head = pair->added_next;
+   }
+   if (pair->added_next) {
+      pair->added_next->added_prev = pair->added_prev;
+   } else {
+      list->tail = pair->added_prev;
+   }
+}
+
+
+/* Returns true if the oldest pair of any partition expired. Caller must hold
+ * lock. */
+static bool
+_any_expired (_mongocrypt_cache_t *cache)
+{
+   uint32_t i;
+
+   for (i = 0; i <= cache->num_partitions; i++) {
+      _mongocrypt_cache_pair_t *tail = _added_list (cache, i)->tail;
+
+      if (tail && _pair_expired (cache, tail)) {
+         return true;
+      }
+   }
+   return false;
+}
+
+
+/* Return the pair after the one being destroyed. Caller must hold lock. */
+static _mongocrypt_cache_pair_t *
+_destroy_pair (_mongocrypt_cache_t *cache, _mongocrypt_cache_pair_t *pair)
 {
    _mongocrypt_cache_pair_t *tmp;
    tmp = pair->next;
 
+   /* Remove from the index. */
+   if (cache->hash_attr && cache->num_buckets) {
+      _index_visit_ctx_t visit_ctx;
+
+      visit_ctx.cache = cache;
+      visit_ctx.pair = pair;
+      cache->hash_attr (pair->attr, _index_remove_visit, &visit_ctx);
+   }
+
    /* Unlink */
-   if (!prev) {
-      cache->pair = cache->pair->next;
+   if (pair->prev) {
+      pair->prev->next = pair->next;
+   } else {
+      cache->pair = pair->next;
+   }
+   if (pair->next) {
+      pair->next->prev = pair->prev;
    } else {
-      prev->next = pair->next;
+      cache->tail = pair->prev;
    }
+   _added_unlink (cache, pair);
+   _used_unlink (cache, pair);
+   if (pair->hit_window == cache->window) {
+      _mongocrypt_atomic_add_int64 (&cache->window_in_use, -1);
+   }
+   cache->num_pairs--;
+   if (pair->partition) {
+      cache->partitions[pair->partition - 1].num_pairs--;
+   }
+   _mongocrypt_atomic_add_int64 (&cache->generation, 1);
 
    /* Destroy pair */
+   cache->bytes -= pair->bytes;
    cache->destroy_attr (pair->attr);
    cache->destroy_value (pair->value);
    bson_free (pair);
@@ -54,31 +449,99 @@ _destroy_pair (_mongocrypt_cache_t *cache,
    return tmp;
 }
 
-/* Caller must hold mutex. */
-void
-_mongocrypt_cache_evict (_mongocrypt_cache_t *cache)
+/* Caller must hold write lock. */
+static void
+_evict (_mongocrypt_cache_t *cache)
 {
-   _mongocrypt_cache_pair_t *pair, *prev;
+   int64_t now;
+   uint32_t i;
 
-   prev = NULL;
-   pair = cache->pair;
-   while (pair) {
-      if (_pair_expired (cache, pair)) {
-         pair = _destroy_pair (cache, prev, pair);
+   now = bson_get_monotonic_time () / 1000;
+   /* The pairs of a partition share an expiration and are ordered by when
+    * they were added, so its expired pairs are always at the tail of its
+    * added list, and each is visited once. */
+   for (i = 0; i <= cache->num_partitions; i++) {
+      _mongocrypt_cache_list_t *list = _added_list (cache, i);
+
+      while (list->tail && now - list->tail->last_updated >
+                              _pair_expiration (cache, list->tail)) {
+         _destroy_pair (cache, list->tail);
+         _mongocrypt_atomic_add_int64 (&cache->evictions, 1);
+      }
+   }
+}
+
+
+typedef struct {
+   _mongocrypt_cache_t *cache;
+   void *attr;
+   /* If true, destroy every match. Otherwise, stop at the first match. */
+   bool remove;
+   _mongocrypt_cache_pair_t *match;
+   bool error;
+} _index_match_ctx_t;
+
+
+static bool
+_index_match_visit (uint32_t hash, void *ctx)
+{
+   _index_match_ctx_t *match_ctx = (_index_match_ctx_t *) ctx;
+   _mongocrypt_cache_t *cache = match_ctx->cache;
+   _mongocrypt_cache_index_entry_t *entry;
+
+   if (!cache->num_buckets) {
+      return false;
+   }
+
+restart:
+   for (entry = cache->buckets[hash % cache->num_buckets]; entry;
+        entry = entry->next) {
+      int res;
+
+      if (entry->hash != hash) {
          continue;
       }
-      prev = pair;
-      pair = pair->next;
+
+      if (!cache->cmp_attr (entry->pair->attr, match_ctx->attr, &res)) {
+         match_ctx->error = true;
+         return false;
+      }
+
+      if (0 != res) {
+         continue;
+      }
+
+      if (!match_ctx->remove) {
+         match_ctx->match = entry->pair;
+         return false;
+      }
+
+      /* Destroying the pair removes its entries from this bucket. */
+      _destroy_pair (cache, entry->pair);
+      goto restart;
    }
+   return true;
 }
 
-/* Caller must hold mutex. */
+
+/* Caller must hold write lock. */
 static bool
 _mongocrypt_remove_matches (_mongocrypt_cache_t *cache, void *attr)
 {
-   _mongocrypt_cache_pair_t *pair, *prev;
+   _mongocrypt_cache_pair_t *pair;
+
+   if (cache->hash_attr) {
+      _index_match_ctx_t match_ctx;
+
+      match_ctx.cache = cache;
+      match_ctx.attr = attr;
+      match_ctx.remove = true;
+      match_ctx.match = NULL;
+      match_ctx.error = false;
+      cache->hash_attr (attr, _index_match_visit, &match_ctx);
+      return !match_ctx.error;
+   }
 
-   prev = NULL;
    pair = cache->pair;
    while (pair) {
       int res;
@@ -88,10 +551,9 @@ _mongocrypt_remove_matches (_mongocrypt_cache_t *cache, void *attr)
       }
 
       if (0 == res) {
-         pair = _destroy_pair (cache, prev, pair);
+         pair = _destroy_pair (cache, pair);
          continue;
       }
-      prev = pair;
       pair = pair->next;
    }
 
@@ -99,10 +561,426 @@ _mongocrypt_remove_matches (_mongocrypt_cache_t *cache, void *attr)
 }
 
 
+/* The least recently used pair in @partition, or of all pairs if
+ * @partition is 0. Caller must hold write lock. */
+static _mongocrypt_cache_pair_t *
+_lru_pair (_mongocrypt_cache_t *cache, uint32_t partition)
+{
+   _mongocrypt_cache_pair_t *lru = NULL;
+   uint32_t i;
+
+   if (partition) {
+      /* Cold first, so it wins ties. */
+      _less_recently_used (_used_tail (cache, partition, false), &lru);
+      _less_recently_used (_used_tail (cache, partition, true), &lru);
+      return lru;
+   }
+
+   /* Each partition has its own lists. There are few partitions. */
+   for (i = 0; i <= cache->num_partitions; i++) {
+      _less_recently_used (_used_tail (cache, i, false), &lru);
+      _less_recently_used (_used_tail (cache, i, true), &lru);
+   }
+   return lru;
+}
+
+
+/* Evict least recently used pairs until at most @limit remain. Caller must
+ * hold write lock. */
+static void
+_evict_lru (_mongocrypt_cache_t *cache, uint32_t limit)
+{
+   while (cache->num_pairs > limit) {
+      _destroy_pair (cache, _lru_pair (cache, 0));
+      _mongocrypt_atomic_add_int64 (&cache->evictions, 1);
+   }
+}
+
+
+/* Evict least recently used pairs of @partition until at most @limit
+ * remain in it. Caller must hold write lock. */
+static void
+_evict_partition_lru (_mongocrypt_cache_t *cache,
+                      uint32_t partition,
+                      uint32_t limit)
+{
+   while (cache->partitions[partition - 1].num_pairs > limit) {
+      _destroy_pair (cache, _lru_pair (cache, partition));
+      _mongocrypt_atomic_add_int64 (&cache->evictions, 1);
+   }
+}
+
+
+/* Set on entries of _mongocrypt_cache_t.ghosts, so a hash of 0 is not
+ * mistaken for an empty entry. */
+#define CACHE_GHOST_VALID (((uint64_t) 1) << 32)
+
+
+static bool
+_first_hash_visit (uint32_t hash, void *ctx)
+{
+   *(uint32_t *) ctx = hash;
+   return false;
+}
+
+
+#define CACHE_GHOST_SLOT_MASK (CACHE_ADAPTIVE_GHOST_SLOTS - 1)
+/* The ring index of a slot of _mongocrypt_cache_t.ghost_set. */
+#define CACHE_GHOST_RING_INDEX(slot) ((uint32_t) ((slot) >> 33))
+
+
+/* The slot of ghost_set holding @hash, or the empty slot where it would go.
+ * Caller must hold lock. */
+static uint32_t
+_ghost_find (_mongocrypt_cache_t *cache, uint32_t hash)
+{
+   uint32_t i = hash & CACHE_GHOST_SLOT_MASK;
+
+   /* The set is at most half full, so there is always an empty slot. */
+   while (cache->ghost_set[i] &&
+          (uint32_t) cache->ghost_set[i] != hash) {
+      i = (i + 1) & CACHE_GHOST_SLOT_MASK;
+   }
+   return i;
+}
+
+
+/* Empty slot @i of ghost_set, and move back the entries after it that would
+ * no longer be found. Caller must hold write lock. */
+static void
+_ghost_remove (_mongocrypt_cache_t *cache, uint32_t i)
+{
+   uint64_t *set = cache->ghost_set;
+   uint32_t j = i;
+
+   set[i] = 0;
+   for (;;) {
+      uint32_t home;
+
+      j = (j + 1) & CACHE_GHOST_SLOT_MASK;
+      if (!set[j]) {
+         return;
+      }
+      home = (uint32_t) set[j] & CACHE_GHOST_SLOT_MASK;
+      /* Move the entry at j to i unless its home is in (i, j]. */
+      if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+         set[i] = set[j];
+         set[j] = 0;
+         i = j;
+      }
+   }
+}
+
+
+/* Remember that @pair was evicted to make room. Caller must hold write
+ * lock. */
+static void
+_ghost_add (_mongocrypt_cache_t *cache, _mongocrypt_cache_pair_t *pair)
+{
+   uint32_t hash = 0, pos = cache->next_ghost, i;
+
+   if (!cache->hash_attr) {
+      return;
+   }
+   cache->hash_attr (pair->attr, _first_hash_visit, &hash);
+
+   /* Forget the oldest ghost if the ring is full. */
+   if (cache->ghosts[pos]) {
+      _ghost_remove (cache, _ghost_find (cache, (uint32_t) cache->ghosts[pos]));
+   }
+   /* A hash is remembered once, at its latest position. */
+   i = _ghost_find (cache, hash);
+   if (cache->ghost_set[i]) {
+      cache->ghosts[CACHE_GHOST_RING_INDEX (cache->ghost_set[i])] = 0;
+   }
+   cache->ghosts[pos] = CACHE_GHOST_VALID | hash;
+   cache->ghost_set[i] = cache->ghosts[pos] | ((uint64_t) pos << 33);
+   cache->next_ghost = (pos + 1) % CACHE_ADAPTIVE_GHOSTS;
+}
+
+
+typedef struct {
+   _mongocrypt_cache_t *cache;
+   bool found;
+} _ghost_take_ctx_t;
+
+
+/* Forget the evicted attribute with @hash, if there is one. */
+static bool
+_ghost_take_visit (uint32_t hash, void *ctx)
+{
+   _ghost_take_ctx_t *take_ctx = (_ghost_take_ctx_t *) ctx;
+   _mongocrypt_cache_t *cache = take_ctx->cache;
+   uint32_t i;
+
+   i = _ghost_find (cache, hash);
+   if (!cache->ghost_set[i]) {
+      return true;
+   }
+   cache->ghosts[CACHE_GHOST_RING_INDEX (cache->ghost_set[i])] = 0;
+   _ghost_remove (cache, i);
+   take_ctx->found = true;
+   return false;
+}
+
+
+/* The pair an adaptive cache evicts first: the least recently used of the
+ * pairs never hit, or of every pair if all were hit. @keep is never chosen.
+ * Caller must hold write lock. */
+static _mongocrypt_cache_pair_t *
+_adaptive_victim (_mongocrypt_cache_t *cache, _mongocrypt_cache_pair_t *keep)
+{
+   _mongocrypt_cache_pair_t *pair, *victim = NULL;
+   uint32_t i;
+
+   /* The tail of a cold list was never hit. @keep was just added, so it is
+    * only a tail if it is alone in its list, and never hot. */
+   for (i = 0; i <= cache->num_partitions; i++) {
+      pair = _used_tail (cache, i, false);
+      if (pair != keep) {
+         _less_recently_used (pair, &victim);
+      }
+   }
+   if (victim) {
+      return victim;
+   }
+   for (i = 0; i <= cache->num_partitions; i++) {
+      _less_recently_used (_used_tail (cache, i, true), &victim);
+   }
+   return victim;
+}
+
+
+/* Evict until an adaptive cache has room for @reserve more pairs, and its
+ * pairs fit in max_bytes. Caller must hold write lock. */
+static void
+_evict_adaptive (_mongocrypt_cache_t *cache,
+                 uint32_t reserve,
+                 _mongocrypt_cache_pair_t *keep)
+{
+   while (cache->num_pairs + reserve > cache->capacity ||
+          cache->bytes > cache->max_bytes) {
+      _mongocrypt_cache_pair_t *victim;
+
+      victim = _adaptive_victim (cache, keep);
+      if (!victim) {
+         /* Only @keep is left. */
+         return;
+      }
+      _ghost_add (cache, victim);
+      _destroy_pair (cache, victim);
+      _mongocrypt_atomic_add_int64 (&cache->evictions, 1);
+   }
+}
+
+
+/* Start a new adaptation window, in which no pair was hit yet. Caller must
+ * hold write lock. */
+static void
+_start_window (_mongocrypt_cache_t *cache)
+{
+   _mongocrypt_atomic_add_int64 (&cache->window, 1);
+   _mongocrypt_atomic_store_int64 (&cache->window_in_use, 0);
+}
+
+
+/* Adjust the capacity of an adaptive cache before @attr is added. Caller
+ * must hold write lock. */
+static void
+_adapt (_mongocrypt_cache_t *cache, void *attr)
+{
+   _ghost_take_ctx_t take_ctx;
+   int64_t lookups;
+
+   take_ctx.cache = cache;
+   take_ctx.found = false;
+   if (cache->hash_attr) {
+      cache->hash_attr (attr, _ghost_take_visit, &take_ctx);
+   }
+   if (take_ctx.found) {
+      /* A larger cache would have kept @attr. */
+      cache->window_ghost_hits++;
+      if (cache->bytes < cache->max_bytes) {
+         uint32_t step = cache->capacity / 8 + 1;
+
+         cache->capacity = UINT32_MAX - cache->capacity > step
+                              ? cache->capacity + step
+                              : UINT32_MAX;
+      }
+   }
+
+   lookups = _mongocrypt_atomic_load_int64 (&cache->hits) +
+             _mongocrypt_atomic_load_int64 (&cache->misses);
+   if (lookups - cache->window_lookups >= 2 * (int64_t) cache->capacity) {
+      if (cache->window_ghost_hits == 0 &&
+          cache->num_pairs >= cache->capacity) {
+         int64_t in_use = _mongocrypt_atomic_load_int64 (&cache->window_in_use);
+         uint32_t target;
+
+         /* Nothing evicted in the window was needed again. Shrink, but keep
+          * the pairs in use. */
+         target = cache->capacity - cache->capacity / 8;
+         if ((int64_t) target <= in_use) {
+            target = (uint32_t) in_use + 1;
+         }
+         if (target < CACHE_ADAPTIVE_MIN_ENTRIES) {
+            target = CACHE_ADAPTIVE_MIN_ENTRIES;
+         }
+         if (target < cache->capacity) {
+            cache->capacity = target;
+         }
+      }
+      cache->window_lookups = lookups;
+      cache->window_ghost_hits = 0;
+      _start_window (cache);
+   }
+
+   if (cache->max_entries && cache->capacity > cache->max_entries) {
+      cache->capacity = cache->max_entries;
+   }
+}
+
+
 void
 _mongocrypt_cache_set_expiration (_mongocrypt_cache_t *cache, uint64_t milli)
 {
+   /* Locked, since other mongocrypt_t may share the cache. */
+   _cache_wrlock (cache);
    cache->expiration = milli;
+   _cache_wrunlock (cache);
+}
+
+
+void
+_mongocrypt_cache_set_refresh_window (_mongocrypt_cache_t *cache,
+                                      uint64_t milli)
+{
+   _cache_wrlock (cache);
+   cache->refresh_window = milli;
+   _cache_wrunlock (cache);
+}
+
+
+bool
+_mongocrypt_cache_needs_refresh (_mongocrypt_cache_t *cache)
+{
+   return 0 != _mongocrypt_atomic_load_int64 (&cache->refresh_requested);
+}
+
+
+void
+_mongocrypt_cache_start_refresh (_mongocrypt_cache_t *cache,
+                                 cache_attr_visit_fn visit,
+                                 void *ctx)
+{
+   _mongocrypt_cache_pair_t *pair;
+
+   _cache_wrlock (cache);
+   _evict (cache);
+   _mongocrypt_atomic_store_int64 (&cache->refresh_requested, 0);
+   for (pair = cache->pair; pair; pair = pair->next) {
+      if (pair->refresh != CACHE_REFRESH_REQUESTED) {
+         continue;
+      }
+      pair->refresh = CACHE_REFRESH_STARTED;
+      visit (pair->attr, ctx);
+   }
+   _cache_wrunlock (cache);
+}
+
+
+void
+_mongocrypt_cache_set_max_entries (_mongocrypt_cache_t *cache,
+                                   uint32_t max_entries)
+{
+   _cache_wrlock (cache);
+   cache->max_entries = max_entries;
+   if (max_entries) {
+      _evict_lru (cache, max_entries);
+      if (cache->capacity > max_entries) {
+         cache->capacity = max_entries;
+      }
+   }
+   _cache_wrunlock (cache);
+}
+
+
+void
+_mongocrypt_cache_set_adaptive (_mongocrypt_cache_t *cache, size_t max_bytes)
+{
+   _cache_wrlock (cache);
+   bson_free (cache->ghosts);
+   cache->ghosts = NULL;
+   cache->next_ghost = 0;
+   bson_free (cache->ghost_set);
+   cache->ghost_set = NULL;
+   cache->max_bytes = max_bytes;
+   cache->capacity = 0;
+   if (max_bytes) {
+      cache->ghosts = bson_malloc0 (CACHE_ADAPTIVE_GHOSTS * sizeof (uint64_t));
+      BSON_ASSERT (cache->ghosts);
+      cache->ghost_set =
+         bson_malloc0 (CACHE_ADAPTIVE_GHOST_SLOTS * sizeof (uint64_t));
+      BSON_ASSERT (cache->ghost_set);
+      cache->capacity = CACHE_ADAPTIVE_MIN_ENTRIES;
+      if (cache->max_entries && cache->capacity > cache->max_entries) {
+         cache->capacity = cache->max_entries;
+      }
+      cache->window_lookups = _mongocrypt_atomic_load_int64 (&cache->hits) +
+                              _mongocrypt_atomic_load_int64 (&cache->misses);
+      cache->window_ghost_hits = 0;
+      _start_window (cache);
+      _evict_adaptive (cache, 0, NULL);
+   }
+   _cache_wrunlock (cache);
+}
+
+
+bool
+_mongocrypt_cache_add_partition (_mongocrypt_cache_t *cache,
+                                 const char *tag,
+                                 uint32_t max_entries,
+                                 uint64_t expiration)
+{
+   _mongocrypt_cache_partition_t *partition;
+   uint32_t i;
+
+   BSON_ASSERT (tag);
+   _cache_wrlock (cache);
+   for (i = 0; i < cache->num_partitions; i++) {
+      if (0 == strcmp (cache->partitions[i].tag, tag)) {
+         _cache_wrunlock (cache);
+         return false;
+      }
+   }
+   cache->partitions =
+      bson_realloc (cache->partitions,
+                    (cache->num_partitions + 1) * sizeof (*partition));
+   partition = &cache->partitions[cache->num_partitions++];
+   partition->tag = bson_strdup (tag);
+   partition->max_entries = max_entries;
+   partition->expiration = expiration;
+   partition->num_pairs = 0;
+   partition->added.head = NULL;
+   partition->added.tail = NULL;
+   partition->cold.head = NULL;
+   partition->cold.tail = NULL;
+   partition->hot.head = NULL;
+   partition->hot.tail = NULL;
+   _cache_wrunlock (cache);
+   return true;
+}
+
+
+uint32_t
+_mongocrypt_cache_capacity (_mongocrypt_cache_t *cache)
+{
+   uint32_t capacity;
+
+   _cache_rdlock (cache);
+   capacity = cache->capacity;
+   _cache_rdunlock (cache);
+   return capacity;
 }
 
 
@@ -116,11 +994,22 @@ _find_pair (_mongocrypt_cache_t *cache,
 
    *out = NULL;
 
+   if (cache->hash_attr) {
+      _index_match_ctx_t match_ctx;
+
+      match_ctx.cache = cache;
+      match_ctx.attr = attr;
+      match_ctx.remove = false;
+      match_ctx.match = NULL;
+      match_ctx.error = false;
+      cache->hash_attr (attr, _index_match_visit, &match_ctx);
+      *out = match_ctx.match;
+      return !match_ctx.error;
+   }
+
    pair = cache->pair;
    while (pair) {
       int res;
-      /* TODO: this is a naive O(n) lookup. Consider optimizing
-         with a hash map (possibly vendor one). */
       if (!cache->cmp_attr (pair->attr, attr, &res)) {
          return false;
       }
@@ -137,7 +1026,7 @@ _find_pair (_mongocrypt_cache_t *cache,
 
 /* Create a new pair on linked list. Caller must hold lock. */
 static _mongocrypt_cache_pair_t *
-_pair_new (_mongocrypt_cache_t *cache, void *attr)
+_pair_new (_mongocrypt_cache_t *cache, void *attr, uint32_t partition)
 {
    _mongocrypt_cache_pair_t *pair;
 
@@ -147,8 +1036,31 @@ _pair_new (_mongocrypt_cache_t *cache, void *attr)
    pair->attr = cache->copy_attr (attr);
    /* add rest of values. */
    pair->next = cache->pair;
+   pair->prev = NULL;
    pair->last_updated = bson_get_monotonic_time () / 1000;
+   pair->last_used = pair->last_updated;
+   pair->refresh = CACHE_REFRESH_NONE;
+   if (cache->pair) {
+      cache->pair->prev = pair;
+   } else {
+      cache->tail = pair;
+   }
    cache->pair = pair;
+   cache->num_pairs++;
+   pair->partition = partition;
+   if (partition) {
+      cache->partitions[partition - 1].num_pairs++;
+   }
+   _added_push (cache, pair);
+   _used_push (cache, pair);
+
+   if (cache->hash_attr) {
+      _index_visit_ctx_t visit_ctx;
+
+      visit_ctx.cache = cache;
+      visit_ctx.pair = pair;
+      cache->hash_attr (pair->attr, _index_insert_visit, &visit_ctx);
+   }
    return pair;
 }
 
@@ -163,57 +1075,223 @@ _cache_pair_destroy (_mongocrypt_cache_t *cache, _mongocrypt_cache_pair_t *pair)
 }
 
 
-bool
-_mongocrypt_cache_get (_mongocrypt_cache_t *cache,
-                       void *attr, /* attr of cache item */
-                       void **value /* copied to. */)
+static void
+_trace_lookup_end (_mongocrypt_cache_t *cache, uint64_t span_id, bool hit)
+{
+   bson_t attrs;
+
+   if (!span_id) {
+      return;
+   }
+
+   bson_init (&attrs);
+   bson_append_bool (&attrs, MONGOCRYPT_STR_AND_LEN ("hit"), hit);
+   _mongocrypt_trace_end (
+      cache->trace, MONGOCRYPT_TRACE_SPAN_CACHE_LOOKUP, span_id, &attrs);
+   bson_destroy (&attrs);
+}
+
+
+static bool
+_cache_get (_mongocrypt_cache_t *cache,
+            void *attr, /* attr of cache item */
+            void **value /* copied to. */,
+            int64_t *until_ms)
 {
    _mongocrypt_cache_pair_t *match;
+   uint64_t span_id = 0;
 
    *value = NULL;
 
-   _mongocrypt_mutex_lock (&cache->mutex);
-   /* TODO CDRIVER-3120: optimize the eviction algorithm to avoid unnecessary
-    * O(n) traversal */
-   _mongocrypt_cache_evict (cache);
+   if (MONGOCRYPT_TRACING (cache->trace)) {
+      bson_t attrs;
+
+      bson_init (&attrs);
+      bson_append_utf8 (
+         &attrs, MONGOCRYPT_STR_AND_LEN ("cache"), cache->name, -1);
+      span_id = _mongocrypt_trace_begin (
+         cache->trace, MONGOCRYPT_TRACE_SPAN_CACHE_LOOKUP, &attrs);
+      bson_destroy (&attrs);
+   }
+
+   /* Lookups only need a read lock, so concurrent hits do not serialize.
+    * Expired pairs are skipped here and removed by the next writer. */
+   _cache_rdlock (cache);
    if (!_find_pair (cache, attr, &match)) {
-      _mongocrypt_mutex_unlock (&cache->mutex);
+      _cache_rdunlock (cache);
+      _trace_lookup_end (cache, span_id, false);
       return false;
    }
 
-   if (match) {
+   if (match && !_pair_expired (cache, match)) {
+      int64_t now = bson_get_monotonic_time () / 1000;
+
+      /* Avoid writing to a shared cache line if the timestamp is current. */
+      if (_mongocrypt_atomic_load_int64 (&match->last_used) != now) {
+         _mongocrypt_atomic_store_int64 (&match->last_used, now);
+      }
+
+      if (cache->refresh_window &&
+          now - match->last_updated + (int64_t) cache->refresh_window >
+             _pair_expiration (cache, match) &&
+          _mongocrypt_atomic_load_int64 (&match->refresh) ==
+             CACHE_REFRESH_NONE) {
+         _mongocrypt_atomic_store_int64 (&match->refresh,
+                                         CACHE_REFRESH_REQUESTED);
+         _mongocrypt_atomic_store_int64 (&cache->refresh_requested, 1);
+      }
+      _mongocrypt_atomic_add_int64 (&match->hits, 1);
+      if (cache->max_bytes) {
+         int64_t window = _mongocrypt_atomic_load_int64 (&cache->window);
+         int64_t hit_window =
+            _mongocrypt_atomic_load_int64 (&match->hit_window);
+
+         /* Count the pair once per window, for _adapt. */
+         if (hit_window != window &&
+             _mongocrypt_atomic_cas_int64 (
+                &match->hit_window, hit_window, window)) {
+            _mongocrypt_atomic_add_int64 (&cache->window_in_use, 1);
+         }
+      }
       *value = cache->copy_value (match->value);
+      if (until_ms) {
+         *until_ms = match->last_updated + _pair_expiration (cache, match) -
+                     (int64_t) cache->refresh_window;
+      }
    }
-   _mongocrypt_mutex_unlock (&cache->mutex);
+   _cache_rdunlock (cache);
+   _mongocrypt_atomic_add_int64 (*value ? &cache->hits : &cache->misses, 1);
+   _trace_lookup_end (cache, span_id, *value != NULL);
    return true;
 }
 
 
+bool
+_mongocrypt_cache_get (_mongocrypt_cache_t *cache, void *attr, void **value)
+{
+   return _cache_get (cache, attr, value, NULL);
+}
+
+
+bool
+_mongocrypt_cache_get_until (_mongocrypt_cache_t *cache,
+                             void *attr,
+                             void **value,
+                             int64_t *until_ms)
+{
+   return _cache_get (cache, attr, value, until_ms);
+}
+
+
+void
+_mongocrypt_cache_evict (_mongocrypt_cache_t *cache)
+{
+   bool expired;
+
+   /* Only the oldest pair of each partition needs checking, and a read lock
+    * does not stall lookups when nothing has expired. */
+   _cache_rdlock (cache);
+   expired = _any_expired (cache);
+   _cache_rdunlock (cache);
+   if (!expired) {
+      return;
+   }
+
+   _cache_wrlock (cache);
+   _evict (cache);
+   _cache_wrunlock (cache);
+}
+
+
+/* Move @pair, just added at the head of its added list with an earlier
+ * last_updated, back to keep the list ordered by last_updated. Caller must
+ * hold write lock. */
+static void
+_pair_settle (_mongocrypt_cache_t *cache, _mongocrypt_cache_pair_t *pair)
+{
+   _mongocrypt_cache_list_t *list = _added_list (cache, pair->partition);
+   _mongocrypt_cache_pair_t *pos = NULL, *after;
+
+   for (after = pair->added_next;
+        after && after->last_updated > pair->last_updated;
+        after = after->added_next) {
+      pos = after;
+   }
+   if (!pos) {
+      return;
+   }
+
+   _added_unlink (cache, pair);
+   /* Insert after pos. */
+   pair->added_prev = pos;
+   pair->added_next = pos->added_next;
+   if (pos->added_next) {
+      pos->added_next->added_prev = pair;
+   } else {
+      list->tail = pair;
+   }
+   pos->added_next = pair;
+}
+
+
 static bool
 _cache_add (_mongocrypt_cache_t *cache,
             void *attr,
             void *value,
             mongocrypt_status_t *status,
-            bool steal_value)
+            bool steal_value,
+            int64_t age_ms)
 {
    _mongocrypt_cache_pair_t *pair;
+   uint32_t partition = 0;
 
-   _mongocrypt_mutex_lock (&cache->mutex);
-   _mongocrypt_cache_evict (cache);
+   _cache_wrlock (cache);
+   _evict (cache);
    if (!_mongocrypt_remove_matches (cache, attr)) {
       CLIENT_ERR ("error removing from cache");
-      _mongocrypt_mutex_unlock (&cache->mutex);
+      _cache_wrunlock (cache);
       return false;
    }
+   if (cache->num_partitions && cache->partition_attr) {
+      partition = cache->partition_attr (
+         attr, cache->partitions, cache->num_partitions);
+      BSON_ASSERT (partition <= cache->num_partitions);
+   }
+   if (partition && cache->partitions[partition - 1].max_entries) {
+      /* Make room in the partition, so it only displaces its own pairs. */
+      _evict_partition_lru (
+         cache, partition, cache->partitions[partition - 1].max_entries - 1);
+   }
+   if (cache->max_bytes) {
+      _adapt (cache, attr);
+      /* Make room for the new pair. */
+      _evict_adaptive (cache, 1, NULL);
+   } else if (cache->max_entries) {
+      /* Make room for the new pair. */
+      _evict_lru (cache, cache->max_entries - 1);
+   }
 
-   pair = _pair_new (cache, attr);
+   pair = _pair_new (cache, attr, partition);
+   if (age_ms > 0) {
+      pair->last_updated -= age_ms;
+      _pair_settle (cache, pair);
+   }
 
    if (steal_value) {
       pair->value = value;
    } else {
       pair->value = cache->copy_value (value);
    }
-   _mongocrypt_mutex_unlock (&cache->mutex);
+   pair->bytes = sizeof (*pair);
+   if (cache->size_pair) {
+      pair->bytes += cache->size_pair (pair->attr, pair->value);
+   }
+   cache->bytes += pair->bytes;
+   if (cache->max_bytes) {
+      _evict_adaptive (cache, 0, pair);
+   }
+   _mongocrypt_atomic_add_int64 (&cache->generation, 1);
+   _cache_wrunlock (cache);
    return true;
 }
 
@@ -224,7 +1302,7 @@ _mongocrypt_cache_add_copy (_mongocrypt_cache_t *cache,
                             void *value,
                             mongocrypt_status_t *status)
 {
-   return _cache_add (cache, attr, value, status, false);
+   return _cache_add (cache, attr, value, status, false, 0);
 }
 
 
@@ -234,13 +1312,25 @@ _mongocrypt_cache_add_stolen (_mongocrypt_cache_t *cache,
                               void *value,
                               mongocrypt_status_t *status)
 {
-   return _cache_add (cache, attr, value, status, true);
+   return _cache_add (cache, attr, value, status, true, 0);
+}
+
+
+bool
+_mongocrypt_cache_add_stolen_aged (_mongocrypt_cache_t *cache,
+                                   void *attr,
+                                   void *value,
+                                   int64_t age_ms,
+                                   mongocrypt_status_t *status)
+{
+   return _cache_add (cache, attr, value, status, true, age_ms);
 }
 
 void
 _mongocrypt_cache_cleanup (_mongocrypt_cache_t *cache)
 {
    _mongocrypt_cache_pair_t *pair, *tmp;
+   uint32_t i;
 
    pair = cache->pair;
    while (pair) {
@@ -248,6 +1338,42 @@ _mongocrypt_cache_cleanup (_mongocrypt_cache_t *cache)
       _cache_pair_destroy (cache, pair);
       pair = tmp;
    }
+
+   if (cache->buckets) {
+      for (i = 0; i < cache->num_buckets; i++) {
+         _mongocrypt_cache_index_entry_t *entry, *next;
+
+         for (entry = cache->buckets[i]; entry; entry = next) {
+            next = entry->next;
+            bson_free (entry);
+         }
+      }
+      bson_free (cache->buckets);
+   }
+
+   for (i = 0; i < cache->num_partitions; i++) {
+      bson_free (cache->partitions[i].tag);
+   }
+   bson_free (cache->partitions);
+   bson_free (cache->ghosts);
+   bson_free (cache->ghost_set);
+   _mongocrypt_rwlock_cleanup (&cache->lock);
+}
+
+void
+_mongocrypt_cache_after_fork (_mongocrypt_cache_t *cache)
+{
+   _mongocrypt_cache_pair_t *pair;
+
+   /* A thread of the parent may have held the lock when the process forked.
+    * That thread does not exist in the child, so initialize the lock again
+    * rather than wait for it. */
+   _mongocrypt_rwlock_init (&cache->lock);
+   for (pair = cache->pair; pair; pair = pair->next) {
+      if (pair->refresh == CACHE_REFRESH_STARTED) {
+         pair->refresh = CACHE_REFRESH_NONE;
+      }
+   }
 }
 
 /* Print the contents of the cache (for debugging purposes) */
@@ -257,7 +1383,7 @@ _mongocrypt_cache_dump (_mongocrypt_cache_t *cache)
    _mongocrypt_cache_pair_t *pair;
    int count;
 
-   _mongocrypt_mutex_lock (&cache->mutex);
+   _cache_rdlock (cache);
    count = 0;
    for (pair = cache->pair; pair != NULL; pair = pair->next) {
       printf ("entry:%d last_updated:%d\n", count, (int) pair->last_updated);
@@ -268,22 +1394,112 @@ _mongocrypt_cache_dump (_mongocrypt_cache_t *cache)
       count++;
    }
 
-   _mongocrypt_mutex_unlock (&cache->mutex);
+   _cache_rdunlock (cache);
 }
 
 
 uint32_t
 _mongocrypt_cache_num_entries (_mongocrypt_cache_t *cache)
 {
-   _mongocrypt_cache_pair_t *pair;
    uint32_t count;
 
-   _mongocrypt_mutex_lock (&cache->mutex);
-   count = 0;
-   for (pair = cache->pair; pair != NULL; pair = pair->next) {
-      count++;
+   /* Only count entries that have not expired. */
+   _cache_wrlock (cache);
+   _evict (cache);
+   count = cache->num_pairs;
+   _cache_wrunlock (cache);
+   return count;
+}
+
+
+void
+_mongocrypt_cache_foreach (_mongocrypt_cache_t *cache,
+                           cache_pair_visit_fn visit,
+                           void *ctx)
+{
+   _mongocrypt_cache_pair_t *pair;
+
+   _cache_rdlock (cache);
+   for (pair = cache->pair; pair; pair = pair->next) {
+      if (!_pair_expired (cache, pair)) {
+         visit (pair, ctx);
+      }
    }
+   _cache_rdunlock (cache);
+}
 
-   _mongocrypt_mutex_unlock (&cache->mutex);
-   return count;
-}
\ No newline at end of file
+
+void
+_mongocrypt_cache_remove_if (_mongocrypt_cache_t *cache,
+                             cache_pair_pred_fn pred,
+                             void *ctx)
+{
+   _mongocrypt_cache_pair_t *pair;
+
+   _cache_wrlock (cache);
+   pair = cache->pair;
+   while (pair) {
+      if (pred (pair->attr, pair->value, ctx)) {
+         pair = _destroy_pair (cache, pair);
+         _mongocrypt_atomic_add_int64 (&cache->evictions, 1);
+         continue;
+      }
+      pair = pair->next;
+   }
+   _cache_wrunlock (cache);
+}
+
+
+/* Caller must hold lock. */
+static size_t
+_cache_bytes (_mongocrypt_cache_t *cache)
+{
+   return cache->bytes +
+          cache->num_index_entries * sizeof (_mongocrypt_cache_index_entry_t) +
+          cache->num_buckets * sizeof (_mongocrypt_cache_index_entry_t *);
+}
+
+
+size_t
+_mongocrypt_cache_bytes (_mongocrypt_cache_t *cache)
+{
+   size_t bytes;
+
+   _cache_rdlock (cache);
+   bytes = _cache_bytes (cache);
+   _cache_rdunlock (cache);
+   return bytes;
+}
+
+
+size_t
+_mongocrypt_cache_trim (_mongocrypt_cache_t *cache, int64_t idle_ms)
+{
+   _mongocrypt_cache_pair_t *pair;
+   size_t before;
+   size_t freed;
+   int64_t now;
+
+   now = bson_get_monotonic_time () / 1000;
+   _cache_wrlock (cache);
+   before = _cache_bytes (cache);
+   _evict (cache);
+   pair = cache->pair;
+   while (pair) {
+      if (now - _mongocrypt_atomic_load_int64 (&pair->last_used) >= idle_ms) {
+         pair = _destroy_pair (cache, pair);
+         _mongocrypt_atomic_add_int64 (&cache->evictions, 1);
+         continue;
+      }
+      pair = pair->next;
+   }
+   if (!cache->num_pairs) {
+      /* _destroy_pair freed the entries. */
+      bson_free (cache->buckets);
+      cache->buckets = NULL;
+      cache->num_buckets = 0;
+   }
+   freed = before - _cache_bytes (cache);
+   _cache_wrunlock (cache);
+   return freed;
+}
@@ -47,10 +47,28 @@ _mongocrypt_serialize_ciphertext (_mongocrypt_ciphertext_t *ciphertext,
                                   _mongocrypt_buffer_t *out)
    MONGOCRYPT_WARN_UNUSED_RESULT;
 
+/* Allocate @out for @ciphertext serialized with @data_len bytes of data, and
+ * write its header. @ciphertext->data is set to the rest of @out, unowned, so
+ * encrypting into it completes @out without a copy. */
+bool
+_mongocrypt_ciphertext_reserve (_mongocrypt_ciphertext_t *ciphertext,
+                                uint32_t data_len,
+                                _mongocrypt_buffer_t *out)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
 bool
 _mongocrypt_ciphertext_serialize_associated_data (
    _mongocrypt_ciphertext_t *ciphertext,
    _mongocrypt_buffer_t *out) MONGOCRYPT_WARN_UNUSED_RESULT;
 
+/* Like _mongocrypt_ciphertext_serialize_associated_data, for @ciphertext
+ * parsed from @in with _mongocrypt_ciphertext_parse_unowned. @out borrows
+ * the associated data from @in. */
+bool
+_mongocrypt_ciphertext_associated_data_unowned (
+   _mongocrypt_ciphertext_t *ciphertext,
+   const _mongocrypt_buffer_t *in,
+   _mongocrypt_buffer_t *out) MONGOCRYPT_WARN_UNUSED_RESULT;
+
 
 #endif /* MONGOCRYPT_CIPHERTEXT_PRIVATE_H */
@@ -41,7 +41,7 @@ _mongocrypt_ciphertext_parse_unowned (_mongocrypt_buffer_t *in,
 
    /* From BSON Binary subtype 6 specification:
       struct fle_blob {
-      uint8  fle_blob_subtype = (1 or 2);
+      uint8  fle_blob_subtype = (1, 2, or 3);
       uint8  key_uuid[16];
       uint8  original_bson_type;
       uint8  ciphertext[ciphertext_length];
@@ -81,8 +81,9 @@ _mongocrypt_ciphertext_parse_unowned (_mongocrypt_buffer_t *in,
    offset += 1;
 
    /* TODO: merge new changes. */
-   if (ciphertext->blob_subtype != 1 && ciphertext->blob_subtype != 2) {
-      CLIENT_ERR ("malformed ciphertext, expected blob subtype of 1 or 2");
+   if (ciphertext->blob_subtype != 1 && ciphertext->blob_subtype != 2 &&
+       ciphertext->blob_subtype != 3) {
+      CLIENT_ERR ("malformed ciphertext, expected blob subtype of 1, 2, or 3");
       return false;
    }
 
@@ -102,15 +103,19 @@ _mongocrypt_ciphertext_parse_unowned (_mongocrypt_buffer_t *in,
    return true;
 }
 
-bool
-_mongocrypt_serialize_ciphertext (_mongocrypt_ciphertext_t *ciphertext,
-                                  _mongocrypt_buffer_t *out)
+/* Allocate @out for @ciphertext with @data_len bytes of data, and write
+ * everything before the data, which starts at @data_offset. */
+static bool
+_serialize_header (_mongocrypt_ciphertext_t *ciphertext,
+                   uint32_t data_len,
+                   _mongocrypt_buffer_t *out,
+                   uint32_t *data_offset)
 {
    uint32_t offset;
 
    /* From BSON Binary subtype 6 specification:
       struct fle_blob {
-      uint8  fle_blob_subtype = (1 or 2);
+      uint8  fle_blob_subtype = (1, 2, or 3);
       uint8  key_uuid[16];
       uint8  original_bson_type;
       uint8  ciphertext[ciphertext_length];
@@ -125,10 +130,14 @@ _mongocrypt_serialize_ciphertext (_mongocrypt_ciphertext_t *ciphertext,
       return false;
    }
 
+   if (data_len > UINT32_MAX - 18) {
+      return false;
+   }
+
    _mongocrypt_buffer_init (out);
    offset = 0;
-   out->len = 1 + ciphertext->key_id.len + 1 + ciphertext->data.len;
-   out->data = bson_malloc0 (out->len);
+   out->len = 1 + ciphertext->key_id.len + 1 + data_len;
+   out->data = bson_malloc (out->len);
    BSON_ASSERT (out->data);
 
    out->owned = true;
@@ -142,29 +151,55 @@ _mongocrypt_serialize_ciphertext (_mongocrypt_ciphertext_t *ciphertext,
    out->data[offset] = ciphertext->original_bson_type;
    offset += 1;
 
-   memcpy (out->data + offset, ciphertext->data.data, ciphertext->data.len);
-
+   *data_offset = offset;
    return true;
 }
 
+bool
+_mongocrypt_serialize_ciphertext (_mongocrypt_ciphertext_t *ciphertext,
+                                  _mongocrypt_buffer_t *out)
+{
+   uint32_t offset;
 
-/*
-From "FLE and AEAD" doc:
-A = Associated Data = fle_blob_subtype + key_uuid[16] + original_bson_type
-*/
+   if (!ciphertext ||
+       !_serialize_header (ciphertext, ciphertext->data.len, out, &offset)) {
+      return false;
+   }
+
+   if (ciphertext->data.len) {
+      memcpy (out->data + offset, ciphertext->data.data, ciphertext->data.len);
+   }
+
+   return true;
+}
 
 bool
-_mongocrypt_ciphertext_serialize_associated_data (
-   _mongocrypt_ciphertext_t *ciphertext, _mongocrypt_buffer_t *out)
+_mongocrypt_ciphertext_reserve (_mongocrypt_ciphertext_t *ciphertext,
+                                uint32_t data_len,
+                                _mongocrypt_buffer_t *out)
 {
-   int32_t bytes_written;
+   uint32_t offset;
 
-   if (!out) {
+   if (!_serialize_header (ciphertext, data_len, out, &offset)) {
       return false;
    }
 
-   _mongocrypt_buffer_init (out);
+   _mongocrypt_buffer_cleanup (&ciphertext->data);
+   _mongocrypt_buffer_init (&ciphertext->data);
+   ciphertext->data.data = out->data + offset;
+   ciphertext->data.len = data_len;
+   return true;
+}
+
+
+/*
+From "FLE and AEAD" doc:
+A = Associated Data = fle_blob_subtype + key_uuid[16] + original_bson_type
+*/
 
+static bool
+_associated_data_valid (_mongocrypt_ciphertext_t *ciphertext)
+{
    if (!ciphertext->original_bson_type) {
       return false;
    }
@@ -175,7 +210,27 @@ _mongocrypt_ciphertext_serialize_associated_data (
 
    if (ciphertext->blob_subtype !=
           MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC &&
-       ciphertext->blob_subtype != MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM) {
+       ciphertext->blob_subtype != MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM &&
+       ciphertext->blob_subtype !=
+          MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM_COMPRESSED) {
+      return false;
+   }
+   return true;
+}
+
+bool
+_mongocrypt_ciphertext_serialize_associated_data (
+   _mongocrypt_ciphertext_t *ciphertext, _mongocrypt_buffer_t *out)
+{
+   int32_t bytes_written;
+
+   if (!out) {
+      return false;
+   }
+
+   _mongocrypt_buffer_init (out);
+
+   if (!_associated_data_valid (ciphertext)) {
       return false;
    }
 
@@ -193,3 +248,25 @@ _mongocrypt_ciphertext_serialize_associated_data (
    memcpy (out->data + bytes_written, &ciphertext->original_bson_type, 1);
    return true;
 }
+
+bool
+_mongocrypt_ciphertext_associated_data_unowned (
+   _mongocrypt_ciphertext_t *ciphertext,
+   const _mongocrypt_buffer_t *in,
+   _mongocrypt_buffer_t *out)
+{
+   if (!out) {
+      return false;
+   }
+
+   _mongocrypt_buffer_init (out);
+
+   if (!_associated_data_valid (ciphertext) || in->len < 18) {
+      return false;
+   }
+
+   /* The associated data is the serialized ciphertext up to its data. */
+   out->data = in->data;
+   out->len = 1 + ciphertext->key_id.len + 1;
+   return true;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_COMPRESS_PRIVATE_H
+#define MONGOCRYPT_COMPRESS_PRIVATE_H
+
+#include "mongocrypt-buffer-private.h"
+#include "mongocrypt.h"
+
+/* A small LZ77 compressor for the plaintext of randomized ciphertexts with
+ * blob subtype MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM_COMPRESSED.
+ *
+ * The format is the uncompressed length as a little-endian uint32 followed
+ * by sequences of:
+ *    uint8  token = (literal length << 4) | (match length - 4);
+ *    uint8  literal length continued, if 15 in the token;
+ *    uint8  literals[literal length];
+ *    uint16 offset of the match, little-endian;
+ *    uint8  match length continued, if 15 in the token;
+ * The last sequence ends after its literals. A length of 15 in the token is
+ * continued with bytes that are added to it, up to and including the first
+ * byte that is not 255. */
+
+/* Compress @in into @out. Returns false, with @out empty, if the result would
+ * not be smaller than @in. @out must be cleaned up either way. */
+bool
+_mongocrypt_compress (const _mongocrypt_buffer_t *in,
+                      _mongocrypt_buffer_t *out);
+
+/* Decompress @in, which was produced by _mongocrypt_compress, into @out. */
+bool
+_mongocrypt_decompress (const _mongocrypt_buffer_t *in,
+                        _mongocrypt_buffer_t *out,
+                        mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+#endif /* MONGOCRYPT_COMPRESS_PRIVATE_H */
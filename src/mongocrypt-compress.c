@@ -0,0 +1,269 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-private.h"
+#include "mongocrypt-compress-private.h"
+
+#define HEADER_LEN 4
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+#define NIBBLE_MAX 15
+
+typedef struct {
+   uint8_t *data;
+   uint32_t len;
+   uint32_t cap;
+} _writer_t;
+
+
+static bool
+_put (_writer_t *w, const void *src, uint32_t len)
+{
+   if (w->cap - w->len < len) {
+      return false;
+   }
+   memcpy (w->data + w->len, src, len);
+   w->len += len;
+   return true;
+}
+
+
+static bool
+_put_byte (_writer_t *w, uint8_t byte)
+{
+   return _put (w, &byte, 1);
+}
+
+
+static bool
+_put_len (_writer_t *w, uint32_t len)
+{
+   if (len < NIBBLE_MAX) {
+      return true;
+   }
+   len -= NIBBLE_MAX;
+   while (len >= 255) {
+      if (!_put_byte (w, 255)) {
+         return false;
+      }
+      len -= 255;
+   }
+   return _put_byte (w, (uint8_t) len);
+}
+
+
+/* A @match_len of 0 writes the last sequence. */
+static bool
+_put_sequence (_writer_t *w,
+               const uint8_t *literals,
+               uint32_t n_literals,
+               uint32_t offset,
+               uint32_t match_len)
+{
+   uint32_t extra;
+   uint8_t token;
+
+   extra = match_len ? match_len - MIN_MATCH : 0;
+   token = (uint8_t) ((BSON_MIN (n_literals, NIBBLE_MAX) << 4) |
+                      BSON_MIN (extra, NIBBLE_MAX));
+   if (!_put_byte (w, token) || !_put_len (w, n_literals) ||
+       !_put (w, literals, n_literals)) {
+      return false;
+   }
+   if (match_len == 0) {
+      return true;
+   }
+   return _put_byte (w, (uint8_t) (offset & 0xff)) &&
+          _put_byte (w, (uint8_t) (offset >> 8)) && _put_len (w, extra);
+}
+
+
+static uint32_t
+_hash (const uint8_t *data)
+{
+   uint32_t seq;
+
+   memcpy (&seq, data, sizeof (seq));
+   return (seq * 2654435761u) >> (32 - HASH_BITS);
+}
+
+
+bool
+_mongocrypt_compress (const _mongocrypt_buffer_t *in, _mongocrypt_buffer_t *out)
+{
+   /* The last position + 1 of each hash, or 0. */
+   uint32_t table[1 << HASH_BITS] = {0};
+   _writer_t w;
+   uint32_t i, anchor, ref, match_len, le_len;
+
+   BSON_ASSERT (in);
+   BSON_ASSERT (out);
+
+   _mongocrypt_buffer_init (out);
+   if (in->len <= HEADER_LEN + 1) {
+      return false;
+   }
+
+   /* The result must be smaller than @in. */
+   w.data = bson_malloc (in->len);
+   BSON_ASSERT (w.data);
+   w.len = 0;
+   w.cap = in->len - 1;
+
+   le_len = BSON_UINT32_TO_LE (in->len);
+   BSON_ASSERT (_put (&w, &le_len, HEADER_LEN));
+
+   i = 0;
+   anchor = 0;
+   while (in->len - i >= MIN_MATCH) {
+      uint32_t h;
+
+      h = _hash (in->data + i);
+      ref = table[h];
+      table[h] = i + 1;
+      if (ref == 0 || i + 1 - ref > MAX_OFFSET ||
+          0 != memcmp (in->data + ref - 1, in->data + i, MIN_MATCH)) {
+         i++;
+         continue;
+      }
+      ref--;
+
+      match_len = MIN_MATCH;
+      while (i + match_len < in->len &&
+             in->data[ref + match_len] == in->data[i + match_len]) {
+         match_len++;
+      }
+      if (!_put_sequence (
+             &w, in->data + anchor, i - anchor, i - ref, match_len)) {
+         goto fail;
+      }
+      i += match_len;
+      anchor = i;
+   }
+
+   if (anchor < in->len &&
+       !_put_sequence (&w, in->data + anchor, in->len - anchor, 0, 0)) {
+      goto fail;
+   }
+
+   out->data = w.data;
+   out->len = w.len;
+   out->owned = true;
+   return true;
+
+fail:
+   bson_free (w.data);
+   return false;
+}
+
+
+static bool
+_get_len (const uint8_t **p, const uint8_t *end, uint32_t *len)
+{
+   uint8_t byte;
+
+   if (*len < NIBBLE_MAX) {
+      return true;
+   }
+   do {
+      if (*p == end) {
+         return false;
+      }
+      byte = *(*p)++;
+      if (UINT32_MAX - *len < byte) {
+         return false;
+      }
+      *len += byte;
+   } while (byte == 255);
+   return true;
+}
+
+
+bool
+_mongocrypt_decompress (const _mongocrypt_buffer_t *in,
+                        _mongocrypt_buffer_t *out,
+                        mongocrypt_status_t *status)
+{
+   const uint8_t *p, *end;
+   uint32_t out_len, written, n, offset, i;
+   uint8_t token;
+
+   BSON_ASSERT (in);
+   BSON_ASSERT (out);
+
+   _mongocrypt_buffer_init (out);
+   if (in->len <= HEADER_LEN) {
+      CLIENT_ERR ("malformed compressed value, too small");
+      return false;
+   }
+
+   memcpy (&out_len, in->data, HEADER_LEN);
+   out_len = BSON_UINT32_FROM_LE (out_len);
+   if (out_len == 0 || out_len > INT32_MAX) {
+      CLIENT_ERR ("malformed compressed value, invalid length");
+      return false;
+   }
+   _mongocrypt_buffer_resize (out, out_len);
+
+   p = in->data + HEADER_LEN;
+   end = in->data + in->len;
+   written = 0;
+   while (p < end) {
+      token = *p++;
+
+      n = token >> 4;
+      if (!_get_len (&p, end, &n) || (uint32_t) (end - p) < n ||
+          out_len - written < n) {
+         goto malformed;
+      }
+      memcpy (out->data + written, p, n);
+      p += n;
+      written += n;
+      if (p == end) {
+         break;
+      }
+
+      if (end - p < 2) {
+         goto malformed;
+      }
+      offset = (uint32_t) p[0] | ((uint32_t) p[1] << 8);
+      p += 2;
+      n = token & 0x0f;
+      if (!_get_len (&p, end, &n) || offset == 0 || offset > written ||
+          out_len - written < MIN_MATCH ||
+          n > out_len - written - MIN_MATCH) {
+         goto malformed;
+      }
+      n += MIN_MATCH;
+      /* The match may overlap the bytes it writes. */
+      for (i = 0; i < n; i++) {
+         out->data[written + i] = out->data[written - offset + i];
+      }
+      written += n;
+   }
+
+   if (written != out_len) {
+      goto malformed;
+   }
+   return true;
+
+malformed:
+   _mongocrypt_buffer_cleanup (out);
+   _mongocrypt_buffer_init (out);
+   CLIENT_ERR ("malformed compressed value");
+   return false;
+}
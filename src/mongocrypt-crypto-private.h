@@ -19,6 +19,7 @@
 
 #include "mongocrypt.h"
 #include "mongocrypt-buffer-private.h"
+#include "mongocrypt-mutex-private.h"
 
 #define MONGOCRYPT_KEY_LEN 96
 #define MONGOCRYPT_IV_KEY_LEN 32
@@ -29,6 +30,16 @@
 #define MONGOCRYPT_HMAC_LEN 32
 #define MONGOCRYPT_BLOCK_SIZE 16
 
+/* Native crypto state prepared for one 96 byte data key, so values encrypted
+ * or decrypted with the same key do not recompute the AES key schedule or
+ * the HMAC key pads. Defined by each native crypto implementation. Not thread
+ * safe. */
+typedef struct __native_crypto_key_t _native_crypto_key_t;
+
+/* An HMAC-SHA-512 in progress. Defined by each native crypto implementation.
+ */
+typedef struct __native_crypto_hmac_t _native_crypto_hmac_t;
+
 typedef struct {
    int hooks_enabled;
    mongocrypt_crypto_fn aes_256_cbc_encrypt;
@@ -37,20 +48,67 @@ typedef struct {
    mongocrypt_hmac_fn hmac_sha_512;
    mongocrypt_hmac_fn hmac_sha_256;
    mongocrypt_hash_fn sha_256;
+   /* Optional. If unset with hooks enabled, HMAC inputs are concatenated and
+    * passed to hmac_sha_512. */
+   mongocrypt_hmac_init_fn hmac_sha_512_init;
+   mongocrypt_hmac_update_fn hmac_sha_512_update;
+   mongocrypt_hmac_final_fn hmac_sha_512_final;
+   /* Optional. If set with hooks enabled, the values of a document are
+    * encrypted and decrypted together with the _batch functions. */
+   mongocrypt_crypto_batch_fn batch;
+   /* A mask of mongocrypt_crypto_primitive_t that use the native backend even
+    * though hooks are enabled. */
+   uint32_t native;
    void *ctx;
 } _mongocrypt_crypto_t;
 
+#ifdef MONGOCRYPT_ENABLE_CRYPTO_HOOKS
+/* Returns true if all of @primitives, a mask of
+ * mongocrypt_crypto_primitive_t, use the native backend. */
+bool
+_mongocrypt_crypto_is_native (const _mongocrypt_crypto_t *crypto,
+                              uint32_t primitives);
+
+/* Returns true if the values of a document go through the batch hook. */
+bool
+_mongocrypt_crypto_uses_batch (const _mongocrypt_crypto_t *crypto);
+
+/* Time AES-256-CBC, HMAC SHA-512, and random, with the hooks and with the
+ * native backend, on typical value lengths. Then set native so each uses the
+ * faster of the two. A hook that fails, or whose output differs from the
+ * native backend's, is replaced by it. SHA-256 is left as it was. Requires
+ * native crypto. */
+bool
+_mongocrypt_crypto_self_benchmark (_mongocrypt_crypto_t *crypto,
+                                   mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+#else
+/* Built without hooks, so every primitive is native. Constant, so the hook
+ * paths of the callers are compiled out. */
+#define _mongocrypt_crypto_is_native(crypto, primitives) \
+   ((void) (crypto), (void) (primitives), true)
+#define _mongocrypt_crypto_uses_batch(crypto) ((void) (crypto), false)
+#endif
+
+/* Returns true if _mongocrypt_do_encryption_batch can encrypt the values of a
+ * document together with the native backend, interleaving their blocks. */
+bool
+_mongocrypt_crypto_uses_multi_buffer (const _mongocrypt_crypto_t *crypto);
+
 uint32_t
 _mongocrypt_calculate_ciphertext_len (uint32_t plaintext_len);
 
 uint32_t
 _mongocrypt_calculate_plaintext_len (uint32_t ciphertext_len);
 
+/* @native_key may be NULL. If set, it must have been prepared from @key with
+ * _native_crypto_key_new. Likewise for the functions below. */
 bool
 _mongocrypt_do_encryption (_mongocrypt_crypto_t *crypto,
                            const _mongocrypt_buffer_t *iv,
                            const _mongocrypt_buffer_t *associated_data,
                            const _mongocrypt_buffer_t *key,
+                           _native_crypto_key_t *native_key,
                            const _mongocrypt_buffer_t *plaintext,
                            _mongocrypt_buffer_t *ciphertext,
                            uint32_t *bytes_written,
@@ -61,18 +119,170 @@ bool
 _mongocrypt_do_decryption (_mongocrypt_crypto_t *crypto,
                            const _mongocrypt_buffer_t *associated_data,
                            const _mongocrypt_buffer_t *key,
+                           _native_crypto_key_t *native_key,
                            const _mongocrypt_buffer_t *ciphertext,
                            _mongocrypt_buffer_t *plaintext,
                            uint32_t *bytes_written,
                            mongocrypt_status_t *status)
    MONGOCRYPT_WARN_UNUSED_RESULT;
 
+/* One value for _mongocrypt_do_encryption_batch. The buffers may be owned or
+ * borrowed. Clean up with _mongocrypt_encryption_job_cleanup. */
+typedef struct {
+   _mongocrypt_buffer_t key;
+   _native_crypto_key_t *native_key;
+   /* If true, iv is computed with _mongocrypt_calculate_deterministic_iv.
+    * Otherwise the caller sets it. Either way it must contain 16 bytes. */
+   bool deterministic;
+   _mongocrypt_buffer_t iv;
+   _mongocrypt_buffer_t associated_data;
+   _mongocrypt_buffer_t plaintext;
+   /* Pre-allocated with _mongocrypt_calculate_ciphertext_len bytes. */
+   _mongocrypt_buffer_t *ciphertext;
+} _mongocrypt_encryption_job_t;
+
+void
+_mongocrypt_encryption_job_init (_mongocrypt_encryption_job_t *job);
+
+void
+_mongocrypt_encryption_job_cleanup (_mongocrypt_encryption_job_t *job);
+
+/* Like _mongocrypt_do_encryption for each of @jobs, computing deterministic
+ * IVs first. Requires the batch crypto hook, which is called once per step
+ * for all values, or _mongocrypt_crypto_uses_multi_buffer. Fails if any value
+ * fails. */
+bool
+_mongocrypt_do_encryption_batch (_mongocrypt_crypto_t *crypto,
+                                 _mongocrypt_encryption_job_t *jobs,
+                                 uint32_t count,
+                                 mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* One value for _mongocrypt_do_decryption_batch. */
+typedef struct {
+   _mongocrypt_buffer_t key;
+   _mongocrypt_buffer_t associated_data;
+   _mongocrypt_buffer_t ciphertext;
+   /* Pre-allocated with _mongocrypt_calculate_plaintext_len bytes. */
+   _mongocrypt_buffer_t plaintext;
+   /* Set to the length of the plaintext, excluding padding. */
+   uint32_t bytes_written;
+} _mongocrypt_decryption_job_t;
+
+void
+_mongocrypt_decryption_job_init (_mongocrypt_decryption_job_t *job);
+
+void
+_mongocrypt_decryption_job_cleanup (_mongocrypt_decryption_job_t *job);
+
+/* Like _mongocrypt_do_decryption for each of @jobs. Requires the batch crypto
+ * hook, which is called once for all values. Fails if any value fails. */
+bool
+_mongocrypt_do_decryption_batch (_mongocrypt_crypto_t *crypto,
+                                 _mongocrypt_decryption_job_t *jobs,
+                                 uint32_t count,
+                                 mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* [MCGREW] encryption or decryption of a value passed in chunks, producing
+ * the same ciphertext as _mongocrypt_do_encryption with the same IV. The IV
+ * is not part of the input or output; the caller writes or reads it. Memory
+ * use does not depend on the length of the value. */
+typedef struct {
+   _mongocrypt_crypto_t *crypto;
+   bool encrypt;
+   uint8_t key[MONGOCRYPT_KEY_LEN];
+   /* The IV of the next chunk: the last ciphertext block so far. */
+   uint8_t iv[MONGOCRYPT_IV_LEN];
+   uint64_t associated_data_len;
+   /* Input not processed yet. Less than a block when encrypting. When
+    * decrypting, the last block and the tag are also held back for final. */
+   _mongocrypt_buffer_t pending;
+   /* The HMAC in progress, either native or from the hooks. */
+   bool hmac_started;
+   _native_crypto_hmac_t *hmac;
+   void *hmac_ctx;
+} _mongocrypt_stream_cipher_t;
+
+/* Start encrypting or decrypting with the 96 byte @key. @iv is the 16 byte IV,
+ * which is the first 16 bytes of the ciphertext. With crypto hooks, requires
+ * the incremental HMAC hooks. Clean up with _mongocrypt_stream_cipher_cleanup
+ * even on error. */
+bool
+_mongocrypt_stream_cipher_init (_mongocrypt_stream_cipher_t *stream,
+                                _mongocrypt_crypto_t *crypto,
+                                bool encrypt,
+                                const _mongocrypt_buffer_t *key,
+                                const _mongocrypt_buffer_t *iv,
+                                const _mongocrypt_buffer_t *associated_data,
+                                mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Process the next chunk of plaintext or ciphertext. @out is initialized and
+ * set to the output available so far, which may be empty. When decrypting,
+ * the output is not authenticated until _mongocrypt_stream_cipher_final
+ * succeeds. */
+bool
+_mongocrypt_stream_cipher_update (_mongocrypt_stream_cipher_t *stream,
+                                  const _mongocrypt_buffer_t *in,
+                                  _mongocrypt_buffer_t *out,
+                                  mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Finish the value. @out is initialized and set to the rest of the output:
+ * when encrypting, the last block and the tag; when decrypting, the rest of
+ * the plaintext without padding, after the tag is verified. */
+bool
+_mongocrypt_stream_cipher_final (_mongocrypt_stream_cipher_t *stream,
+                                 _mongocrypt_buffer_t *out,
+                                 mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+void
+_mongocrypt_stream_cipher_cleanup (_mongocrypt_stream_cipher_t *stream);
+
 bool
 _mongocrypt_random (_mongocrypt_crypto_t *crypto,
                     _mongocrypt_buffer_t *out,
                     uint32_t count,
                     mongocrypt_status_t *status) MONGOCRYPT_WARN_UNUSED_RESULT;
 
+#define MONGOCRYPT_RANDOM_POOL_LEN 4096
+
+/* Random bytes fetched in blocks, so each IV does not call the random hook or
+ * the native CSPRNG. Bytes are handed out once and zeroed. The pool is
+ * emptied if the process forked since it was filled, so a parent and child
+ * never hand out the same bytes. */
+typedef struct {
+   mongocrypt_mutex_t mutex;
+   uint8_t bytes[MONGOCRYPT_RANDOM_POOL_LEN];
+   /* The unused bytes are the last avail bytes of bytes. */
+   uint32_t avail;
+   int64_t pid;
+} _mongocrypt_random_pool_t;
+
+void
+_mongocrypt_random_pool_init (_mongocrypt_random_pool_t *pool);
+
+void
+_mongocrypt_random_pool_cleanup (_mongocrypt_random_pool_t *pool);
+
+/* Called in the child of a fork. Discards the bytes drawn by the parent, so
+ * the pool is refilled from the CSPRNG of the child. */
+void
+_mongocrypt_random_pool_after_fork (_mongocrypt_random_pool_t *pool);
+
+/* Like _mongocrypt_random, but takes the bytes from @pool, refilling it from
+ * @crypto when it runs out. Only use for values that are not secret, like
+ * IVs. Requests larger than the pool bypass it. */
+bool
+_mongocrypt_random_pool_take (_mongocrypt_random_pool_t *pool,
+                              _mongocrypt_crypto_t *crypto,
+                              _mongocrypt_buffer_t *out,
+                              uint32_t count,
+                              mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
 /* Returns 0 if equal, non-zero otherwise */
 int
 _mongocrypt_memequal (const void *const b1, const void *const b2, size_t len);
@@ -81,6 +291,7 @@ bool
 _mongocrypt_calculate_deterministic_iv (
    _mongocrypt_crypto_t *crypto,
    const _mongocrypt_buffer_t *key,
+   _native_crypto_key_t *native_key,
    const _mongocrypt_buffer_t *plaintext,
    const _mongocrypt_buffer_t *associated_data,
    _mongocrypt_buffer_t *out,
@@ -128,4 +339,91 @@ _native_crypto_random (_mongocrypt_buffer_t *out,
                        mongocrypt_status_t *status)
    MONGOCRYPT_WARN_UNUSED_RESULT;
 
+/* Prepare native state for a 96 byte data key. Returns NULL if the
+ * implementation does not support prepared keys, in which case callers use
+ * the functions above. */
+_native_crypto_key_t *
+_native_crypto_key_new (const _mongocrypt_buffer_t *key);
+
+void
+_native_crypto_key_destroy (_native_crypto_key_t *native_key);
+
+/* Start an incremental HMAC-SHA-512 keyed with @key. Returns NULL and sets
+ * @status on error. */
+_native_crypto_hmac_t *
+_native_crypto_hmac_sha_512_new (const _mongocrypt_buffer_t *key,
+                                 mongocrypt_status_t *status);
+
+/* Like _native_crypto_hmac_sha_512_new, using the prepared MAC_KEY, or IV_KEY
+ * if @iv_key is true. The result shares state with @native_key, so only one
+ * may be in progress per key at a time. */
+_native_crypto_hmac_t *
+_native_crypto_hmac_sha_512_new_with_key (_native_crypto_key_t *native_key,
+                                          bool iv_key,
+                                          mongocrypt_status_t *status);
+
+bool
+_native_crypto_hmac_update (_native_crypto_hmac_t *hmac,
+                            const _mongocrypt_buffer_t *in,
+                            mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Writes the 64 byte HMAC into @out. Call at most once, then destroy @hmac. */
+bool
+_native_crypto_hmac_final (_native_crypto_hmac_t *hmac,
+                           _mongocrypt_buffer_t *out,
+                           mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+void
+_native_crypto_hmac_destroy (_native_crypto_hmac_t *hmac);
+
+/* Start an AES-256-CBC encryption, or decryption if @encrypt is false, with
+ * the prepared ENC_KEY and @iv. Continue it with
+ * _native_crypto_aes_256_cbc_update_with_key. One encryption and one
+ * decryption may be in progress per key at a time. */
+bool
+_native_crypto_aes_256_cbc_init_with_key (_native_crypto_key_t *native_key,
+                                          bool encrypt,
+                                          const _mongocrypt_buffer_t *iv,
+                                          mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Encrypts or decrypts the block-aligned @in into @out without padding,
+ * chained from the previous call. @out must have room for @in. */
+bool
+_native_crypto_aes_256_cbc_update_with_key (_native_crypto_key_t *native_key,
+                                            bool encrypt,
+                                            const _mongocrypt_buffer_t *in,
+                                            _mongocrypt_buffer_t *out,
+                                            mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* The most buffers _native_crypto_aes_256_cbc_encrypt_lanes takes. */
+#define MONGOCRYPT_CBC_MAX_LANES 8
+
+/* One buffer of _native_crypto_aes_256_cbc_encrypt_lanes. */
+typedef struct {
+   const uint8_t *iv;
+   /* Padded to a multiple of the block size. Encrypted in place. */
+   uint8_t *data;
+   uint32_t len;
+} _native_crypto_cbc_lane_t;
+
+/* Returns true if the implementation supports
+ * _native_crypto_aes_256_cbc_encrypt_lanes. */
+bool
+_native_crypto_cbc_lanes_supported (void);
+
+/* Encrypts up to MONGOCRYPT_CBC_MAX_LANES independent buffers in place with
+ * AES-256-CBC and the prepared ENC_KEY. CBC is serial within a buffer, so the
+ * next block of every buffer is encrypted in one call, which keeps the AES
+ * pipeline full. */
+bool
+_native_crypto_aes_256_cbc_encrypt_lanes (_native_crypto_key_t *native_key,
+                                          _native_crypto_cbc_lane_t *lanes,
+                                          uint32_t n_lanes,
+                                          mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
 #endif /* MONGOCRYPT_CRYPTO_PRIVATE_H */
@@ -26,8 +26,41 @@
 #include "mongocrypt-crypto-private.h"
 #include "mongocrypt-log-private.h"
 #include "mongocrypt-private.h"
+#include "mongocrypt-probes-private.h"
 #include "mongocrypt-status-private.h"
 
+#ifdef MONGOCRYPT_ENABLE_CRYPTO_HOOKS
+bool
+_mongocrypt_crypto_is_native (const _mongocrypt_crypto_t *crypto,
+                              uint32_t primitives)
+{
+   return !crypto->hooks_enabled ||
+          (crypto->native & primitives) == primitives;
+}
+
+
+bool
+_mongocrypt_crypto_uses_batch (const _mongocrypt_crypto_t *crypto)
+{
+   return crypto->batch &&
+          0 == (crypto->native & (MONGOCRYPT_CRYPTO_PRIMITIVE_AES_256_CBC |
+                                  MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512));
+}
+#endif
+
+
+bool
+_mongocrypt_crypto_uses_multi_buffer (const _mongocrypt_crypto_t *crypto)
+{
+   return !_mongocrypt_crypto_uses_batch (crypto) &&
+          _mongocrypt_crypto_is_native (
+             crypto,
+             MONGOCRYPT_CRYPTO_PRIMITIVE_AES_256_CBC |
+                MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512) &&
+          _native_crypto_cbc_lanes_supported ();
+}
+
+
 /* Crypto primitives. These either call the native built in crypto primitives or
  * user supplied hooks. */
 static bool
@@ -49,7 +82,8 @@ _crypto_aes_256_cbc_encrypt (_mongocrypt_crypto_t *crypto,
       return false;
    }
 
-   if (crypto->hooks_enabled) {
+   if (!_mongocrypt_crypto_is_native (
+          crypto, MONGOCRYPT_CRYPTO_PRIMITIVE_AES_256_CBC)) {
       mongocrypt_binary_t enc_key_bin, iv_bin, out_bin, in_bin;
       bool ret;
 
@@ -86,7 +120,8 @@ _crypto_aes_256_cbc_decrypt (_mongocrypt_crypto_t *crypto,
       return false;
    }
 
-   if (crypto->hooks_enabled) {
+   if (!_mongocrypt_crypto_is_native (
+          crypto, MONGOCRYPT_CRYPTO_PRIMITIVE_AES_256_CBC)) {
       mongocrypt_binary_t enc_key_bin, iv_bin, out_bin, in_bin;
       bool ret;
 
@@ -126,7 +161,8 @@ _crypto_hmac_sha_512 (_mongocrypt_crypto_t *crypto,
       return false;
    }
 
-   if (crypto->hooks_enabled) {
+   if (!_mongocrypt_crypto_is_native (
+          crypto, MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512)) {
       mongocrypt_binary_t hmac_key_bin, out_bin, in_bin;
       bool ret;
 
@@ -142,6 +178,105 @@ _crypto_hmac_sha_512 (_mongocrypt_crypto_t *crypto,
 }
 
 
+/* Computes the HMAC-SHA-512 of @parts concatenated, without copying them when
+ * incremental HMAC is available. @native_key may be NULL. If set, its MAC_KEY,
+ * or IV_KEY if @iv_key is true, is used in place of @hmac_key. */
+static bool
+_crypto_hmac_sha_512_parts (_mongocrypt_crypto_t *crypto,
+                            const _mongocrypt_buffer_t *hmac_key,
+                            _native_crypto_key_t *native_key,
+                            bool iv_key,
+                            const _mongocrypt_buffer_t *parts,
+                            uint32_t num_parts,
+                            _mongocrypt_buffer_t *out,
+                            mongocrypt_status_t *status)
+{
+   _native_crypto_hmac_t *hmac;
+   uint32_t i;
+   bool ret = false;
+
+   if (hmac_key->len != MONGOCRYPT_MAC_KEY_LEN) {
+      CLIENT_ERR ("invalid hmac key length");
+      return false;
+   }
+
+   if (out->len != MONGOCRYPT_HMAC_SHA512_LEN) {
+      CLIENT_ERR ("out does not contain %d bytes", MONGOCRYPT_HMAC_SHA512_LEN);
+      return false;
+   }
+
+   if (!_mongocrypt_crypto_is_native (
+          crypto, MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512) &&
+       !crypto->hmac_sha_512_init) {
+      _mongocrypt_buffer_t to_hmac;
+
+      /* The hooks only take one input. */
+      _mongocrypt_buffer_init (&to_hmac);
+      if (!_mongocrypt_buffer_concat (&to_hmac, parts, num_parts)) {
+         CLIENT_ERR ("failed to allocate buffer");
+         return false;
+      }
+      ret = _crypto_hmac_sha_512 (crypto, hmac_key, &to_hmac, out, status);
+      _mongocrypt_buffer_cleanup (&to_hmac);
+      return ret;
+   }
+
+   if (!_mongocrypt_crypto_is_native (
+          crypto, MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512)) {
+      mongocrypt_binary_t hmac_key_bin, in_bin, out_bin;
+      mongocrypt_status_t *abandon_status;
+      void *hmac_ctx = NULL;
+
+      _mongocrypt_buffer_to_binary (hmac_key, &hmac_key_bin);
+      if (!crypto->hmac_sha_512_init (
+             crypto->ctx, &hmac_key_bin, &hmac_ctx, status)) {
+         return false;
+      }
+
+      for (i = 0; i < num_parts; i++) {
+         if (parts[i].len == 0) {
+            continue;
+         }
+         _mongocrypt_buffer_to_binary (&parts[i], &in_bin);
+         if (!crypto->hmac_sha_512_update (
+                crypto->ctx, hmac_ctx, &in_bin, status)) {
+            /* Let the hook release its state, keeping the update error. */
+            abandon_status = mongocrypt_status_new ();
+            (void) crypto->hmac_sha_512_final (
+               crypto->ctx, hmac_ctx, NULL, abandon_status);
+            mongocrypt_status_destroy (abandon_status);
+            return false;
+         }
+      }
+
+      _mongocrypt_buffer_to_binary (out, &out_bin);
+      return crypto->hmac_sha_512_final (
+         crypto->ctx, hmac_ctx, &out_bin, status);
+   }
+
+   if (native_key) {
+      hmac = _native_crypto_hmac_sha_512_new_with_key (
+         native_key, iv_key, status);
+   } else {
+      hmac = _native_crypto_hmac_sha_512_new (hmac_key, status);
+   }
+   if (!hmac) {
+      return false;
+   }
+
+   for (i = 0; i < num_parts; i++) {
+      if (!_native_crypto_hmac_update (hmac, &parts[i], status)) {
+         goto done;
+      }
+   }
+
+   ret = _native_crypto_hmac_final (hmac, out, status);
+done:
+   _native_crypto_hmac_destroy (hmac);
+   return ret;
+}
+
+
 static bool
 _crypto_random (_mongocrypt_crypto_t *crypto,
                 _mongocrypt_buffer_t *out,
@@ -153,7 +288,8 @@ _crypto_random (_mongocrypt_crypto_t *crypto,
       return false;
    }
 
-   if (crypto->hooks_enabled) {
+   if (!_mongocrypt_crypto_is_native (crypto,
+                                      MONGOCRYPT_CRYPTO_PRIMITIVE_RANDOM)) {
       mongocrypt_binary_t out_bin;
 
       _mongocrypt_buffer_to_binary (out, &out_bin);
@@ -163,6 +299,209 @@ _crypto_random (_mongocrypt_crypto_t *crypto,
 }
 
 
+#ifdef MONGOCRYPT_ENABLE_CRYPTO_HOOKS
+/* Calls of each primitive per input length, per backend. */
+#define SELF_BENCHMARK_ITERATIONS 64
+
+/* A short string, and a longer document, as typical field values. */
+static const uint32_t _self_benchmark_lens[] = {64, 1024};
+
+#define SELF_BENCHMARK_N_LENS \
+   (sizeof (_self_benchmark_lens) / sizeof (_self_benchmark_lens[0]))
+
+/* Runs a primitive on @in, a multiple of the block size, setting @out to the
+ * same length. */
+typedef bool (*_self_benchmark_fn) (_mongocrypt_crypto_t *crypto,
+                                    const _mongocrypt_buffer_t *in,
+                                    _mongocrypt_buffer_t *out,
+                                    mongocrypt_status_t *status);
+
+
+/* Encrypt and decrypt again. @out is the ciphertext. */
+static bool
+_self_benchmark_aes (_mongocrypt_crypto_t *crypto,
+                     const _mongocrypt_buffer_t *in,
+                     _mongocrypt_buffer_t *out,
+                     mongocrypt_status_t *status)
+{
+   _mongocrypt_buffer_t key, iv, plaintext;
+   uint32_t bytes_written;
+   bool ret;
+
+   /* The input is at least as long as the key. */
+   _mongocrypt_buffer_init (&key);
+   key.data = in->data;
+   key.len = MONGOCRYPT_ENC_KEY_LEN;
+   _mongocrypt_buffer_init (&iv);
+   iv.data = in->data;
+   iv.len = MONGOCRYPT_IV_LEN;
+   _mongocrypt_buffer_init (&plaintext);
+   _mongocrypt_buffer_resize (&plaintext, in->len);
+
+   bytes_written = 0;
+   ret = _crypto_aes_256_cbc_encrypt (
+      crypto, &key, &iv, in, out, &bytes_written, status);
+   bytes_written = 0;
+   ret = ret && _crypto_aes_256_cbc_decrypt (
+                   crypto, &iv, &key, out, &plaintext, &bytes_written, status);
+   if (ret && 0 != _mongocrypt_buffer_cmp (&plaintext, in)) {
+      CLIENT_ERR ("decryption does not reverse encryption");
+      ret = false;
+   }
+   _mongocrypt_buffer_cleanup (&plaintext);
+   return ret;
+}
+
+
+/* @out holds the HMAC in its first bytes. */
+static bool
+_self_benchmark_hmac (_mongocrypt_crypto_t *crypto,
+                      const _mongocrypt_buffer_t *in,
+                      _mongocrypt_buffer_t *out,
+                      mongocrypt_status_t *status)
+{
+   _mongocrypt_buffer_t key, hmac;
+
+   _mongocrypt_buffer_init (&key);
+   key.data = in->data;
+   key.len = MONGOCRYPT_MAC_KEY_LEN;
+   _mongocrypt_buffer_init (&hmac);
+   hmac.data = out->data;
+   hmac.len = MONGOCRYPT_HMAC_SHA512_LEN;
+   return _crypto_hmac_sha_512 (crypto, &key, in, &hmac, status);
+}
+
+
+/* Random output cannot be compared, only timed. */
+static bool
+_self_benchmark_random (_mongocrypt_crypto_t *crypto,
+                        const _mongocrypt_buffer_t *in,
+                        _mongocrypt_buffer_t *out,
+                        mongocrypt_status_t *status)
+{
+   return _crypto_random (crypto, out, out->len, status);
+}
+
+
+/* Time @fn with @primitive using the hooks, then the native backend. Returns
+ * true if the native backend is faster, or if the hooks fail or disagree with
+ * it. Returns false and sets @status if the native backend fails. */
+static bool
+_self_benchmark_primitive (_mongocrypt_crypto_t *crypto,
+                           uint32_t primitive,
+                           _self_benchmark_fn fn,
+                           bool compare,
+                           bool *use_native,
+                           mongocrypt_status_t *status)
+{
+   _mongocrypt_buffer_t in[SELF_BENCHMARK_N_LENS];
+   _mongocrypt_buffer_t out[2][SELF_BENCHMARK_N_LENS];
+   mongocrypt_status_t *hook_status;
+   int64_t elapsed_us[2];
+   uint32_t saved, i, j;
+   bool hooks_ok = true;
+   bool ret = false;
+   int native;
+
+   saved = crypto->native;
+   hook_status = mongocrypt_status_new ();
+   for (i = 0; i < SELF_BENCHMARK_N_LENS; i++) {
+      _mongocrypt_buffer_init (&in[i]);
+      _mongocrypt_buffer_resize (&in[i], _self_benchmark_lens[i]);
+      for (j = 0; j < in[i].len; j++) {
+         in[i].data[j] = (uint8_t) j;
+      }
+      for (native = 0; native < 2; native++) {
+         _mongocrypt_buffer_init (&out[native][i]);
+         _mongocrypt_buffer_resize (&out[native][i], in[i].len);
+         memset (out[native][i].data, 0, out[native][i].len);
+      }
+   }
+
+   for (native = 0; native < 2 && hooks_ok; native++) {
+      int64_t start_us;
+
+      crypto->native = native ? saved | primitive : saved & ~primitive;
+      start_us = bson_get_monotonic_time ();
+      for (i = 0; i < SELF_BENCHMARK_N_LENS && hooks_ok; i++) {
+         for (j = 0; j < SELF_BENCHMARK_ITERATIONS && hooks_ok; j++) {
+            if (native && !fn (crypto, &in[i], &out[native][i], status)) {
+               goto done;
+            }
+            if (!native &&
+                !fn (crypto, &in[i], &out[native][i], hook_status)) {
+               hooks_ok = false;
+            }
+         }
+      }
+      elapsed_us[native] = bson_get_monotonic_time () - start_us;
+   }
+
+   if (!hooks_ok) {
+      *use_native = true;
+   } else {
+      *use_native = elapsed_us[1] < elapsed_us[0];
+      for (i = 0; compare && i < SELF_BENCHMARK_N_LENS; i++) {
+         if (0 != _mongocrypt_buffer_cmp (&out[0][i], &out[1][i])) {
+            *use_native = true;
+         }
+      }
+   }
+   ret = true;
+
+done:
+   crypto->native = saved;
+   for (i = 0; i < SELF_BENCHMARK_N_LENS; i++) {
+      _mongocrypt_buffer_cleanup (&in[i]);
+      _mongocrypt_buffer_cleanup (&out[0][i]);
+      _mongocrypt_buffer_cleanup (&out[1][i]);
+   }
+   mongocrypt_status_destroy (hook_status);
+   return ret;
+}
+
+
+bool
+_mongocrypt_crypto_self_benchmark (_mongocrypt_crypto_t *crypto,
+                                   mongocrypt_status_t *status)
+{
+   const struct {
+      uint32_t primitive;
+      _self_benchmark_fn fn;
+      bool compare;
+   } benchmarks[] = {
+      {MONGOCRYPT_CRYPTO_PRIMITIVE_AES_256_CBC, _self_benchmark_aes, true},
+      {MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512, _self_benchmark_hmac, true},
+      {MONGOCRYPT_CRYPTO_PRIMITIVE_RANDOM, _self_benchmark_random, false}};
+   uint32_t native;
+   size_t i;
+
+   BSON_ASSERT (crypto->hooks_enabled);
+
+   native = crypto->native;
+   for (i = 0; i < sizeof (benchmarks) / sizeof (benchmarks[0]); i++) {
+      bool use_native;
+
+      if (!_self_benchmark_primitive (crypto,
+                                      benchmarks[i].primitive,
+                                      benchmarks[i].fn,
+                                      benchmarks[i].compare,
+                                      &use_native,
+                                      status)) {
+         return false;
+      }
+      if (use_native) {
+         native |= benchmarks[i].primitive;
+      } else {
+         native &= ~benchmarks[i].primitive;
+      }
+   }
+   crypto->native = native;
+   return true;
+}
+#endif
+
+
 /*
  * Secure memcmp copied from the C driver.
  */
@@ -230,6 +569,88 @@ _mongocrypt_calculate_plaintext_len (uint32_t ciphertext_len)
 }
 
 
+/* Copy @plaintext into @out with PKCS #7 padding. @out is initialized. */
+static bool
+_pad_plaintext (const _mongocrypt_buffer_t *plaintext,
+                _mongocrypt_buffer_t *out,
+                mongocrypt_status_t *status)
+{
+   uint32_t unaligned;
+   uint32_t padding_byte;
+   _mongocrypt_buffer_t intermediates[2];
+   uint8_t final_block_storage[MONGOCRYPT_BLOCK_SIZE];
+
+   _mongocrypt_buffer_init (out);
+
+   /* calculate how many extra bytes there are after a block boundary */
+   unaligned = plaintext->len % MONGOCRYPT_BLOCK_SIZE;
+
+   /* Some crypto providers disallow variable length inputs, and require
+    * the input to be a multiple of the block size. So add everything up
+    * to but excluding the last block if not block aligned, then add
+    * the last block with padding. */
+   _mongocrypt_buffer_init (&intermediates[0]);
+   _mongocrypt_buffer_init (&intermediates[1]);
+   intermediates[0].data = (uint8_t *) plaintext->data;
+   intermediates[0].len = plaintext->len - unaligned;
+   intermediates[1].data = final_block_storage;
+   intermediates[1].len = sizeof (final_block_storage);
+
+   /* [MCGREW]: "Prior to CBC encryption, the plaintext P is padded by appending
+    * a padding string PS to that data, to ensure that len(P || PS) is a
+    * multiple of 128". This is also known as PKCS #7 padding. */
+   if (unaligned) {
+      /* Copy the unaligned bytes. */
+      memcpy (intermediates[1].data,
+              plaintext->data + (plaintext->len - unaligned),
+              unaligned);
+      /* Fill the rest with the padding byte. */
+      padding_byte = MONGOCRYPT_BLOCK_SIZE - unaligned;
+      memset (intermediates[1].data + unaligned, padding_byte, padding_byte);
+   } else {
+      /* Fill the rest with the padding byte. */
+      padding_byte = MONGOCRYPT_BLOCK_SIZE;
+      memset (intermediates[1].data, padding_byte, padding_byte);
+   }
+
+   if (!_mongocrypt_buffer_concat (out, intermediates, 2)) {
+      CLIENT_ERR ("failed to allocate buffer");
+      return false;
+   }
+   return true;
+}
+
+
+/* The plaintexts of int32, int64, date, double, and decimal128 values pad
+ * to at most two blocks. */
+#define SMALL_PADDED_LEN (2 * MONGOCRYPT_BLOCK_SIZE)
+
+
+/* Like _pad_plaintext, for a plaintext shorter than SMALL_PADDED_LEN. @out is
+ * a view of @storage, so nothing is allocated. */
+static void
+_pad_small_plaintext (const _mongocrypt_buffer_t *plaintext,
+                      uint8_t storage[SMALL_PADDED_LEN],
+                      _mongocrypt_buffer_t *out)
+{
+   uint32_t padded_len;
+   uint32_t padding_byte;
+
+   BSON_ASSERT (plaintext->len < SMALL_PADDED_LEN);
+   padded_len =
+      (plaintext->len / MONGOCRYPT_BLOCK_SIZE + 1) * MONGOCRYPT_BLOCK_SIZE;
+   padding_byte = padded_len - plaintext->len;
+   if (plaintext->len > 0) {
+      memcpy (storage, plaintext->data, plaintext->len);
+   }
+   memset (storage + plaintext->len, (int) padding_byte, padding_byte);
+
+   _mongocrypt_buffer_init (out);
+   out->data = storage;
+   out->len = padded_len;
+}
+
+
 /* ----------------------------------------------------------------------------
  *
  * _aes256_cbc_encrypt --
@@ -267,11 +688,8 @@ _encrypt_step (_mongocrypt_crypto_t *crypto,
                uint32_t *bytes_written,
                mongocrypt_status_t *status)
 {
-   uint32_t unaligned;
-   uint32_t padding_byte;
-   _mongocrypt_buffer_t intermediates[2];
    _mongocrypt_buffer_t to_encrypt;
-   uint8_t final_block_storage[MONGOCRYPT_BLOCK_SIZE];
+   uint8_t small_storage[SMALL_PADDED_LEN];
    bool ret = false;
 
    _mongocrypt_buffer_init (&to_encrypt);
@@ -293,39 +711,9 @@ _encrypt_step (_mongocrypt_crypto_t *crypto,
       goto done;
    }
 
-   /* calculate how many extra bytes there are after a block boundary */
-   unaligned = plaintext->len % MONGOCRYPT_BLOCK_SIZE;
-
-   /* Some crypto providers disallow variable length inputs, and require
-    * the input to be a multiple of the block size. So add everything up
-    * to but excluding the last block if not block aligned, then add
-    * the last block with padding. */
-   _mongocrypt_buffer_init (&intermediates[0]);
-   _mongocrypt_buffer_init (&intermediates[1]);
-   intermediates[0].data = (uint8_t *) plaintext->data;
-   intermediates[0].len = plaintext->len - unaligned;
-   intermediates[1].data = final_block_storage;
-   intermediates[1].len = sizeof (final_block_storage);
-
-   /* [MCGREW]: "Prior to CBC encryption, the plaintext P is padded by appending
-    * a padding string PS to that data, to ensure that len(P || PS) is a
-    * multiple of 128". This is also known as PKCS #7 padding. */
-   if (unaligned) {
-      /* Copy the unaligned bytes. */
-      memcpy (intermediates[1].data,
-              plaintext->data + (plaintext->len - unaligned),
-              unaligned);
-      /* Fill the rest with the padding byte. */
-      padding_byte = MONGOCRYPT_BLOCK_SIZE - unaligned;
-      memset (intermediates[1].data + unaligned, padding_byte, padding_byte);
-   } else {
-      /* Fill the rest with the padding byte. */
-      padding_byte = MONGOCRYPT_BLOCK_SIZE;
-      memset (intermediates[1].data, padding_byte, padding_byte);
-   }
-
-   if (!_mongocrypt_buffer_concat (&to_encrypt, intermediates, 2)) {
-      CLIENT_ERR ("failed to allocate buffer");
+   if (plaintext->len < SMALL_PADDED_LEN) {
+      _pad_small_plaintext (plaintext, small_storage, &to_encrypt);
+   } else if (!_pad_plaintext (plaintext, &to_encrypt, status)) {
       goto done;
    }
 
@@ -388,22 +776,18 @@ _hmac_step (_mongocrypt_crypto_t *crypto,
             mongocrypt_status_t *status)
 {
    _mongocrypt_buffer_t intermediates[3];
-   _mongocrypt_buffer_t to_hmac;
    uint64_t associated_data_len_be;
    uint8_t tag_storage[64];
    _mongocrypt_buffer_t tag;
-   bool ret = false;
-
-   _mongocrypt_buffer_init (&to_hmac);
 
    if (MONGOCRYPT_MAC_KEY_LEN != mac_key->len) {
       CLIENT_ERR ("HMAC key wrong length: %d", mac_key->len);
-      goto done;
+      return false;
    }
 
    if (out->len != MONGOCRYPT_HMAC_LEN) {
       CLIENT_ERR ("out wrong length: %d", out->len);
-      goto done;
+      return false;
    }
 
    /* [MCGREW]:
@@ -436,30 +820,236 @@ _hmac_step (_mongocrypt_crypto_t *crypto,
    tag.len = sizeof (tag_storage);
 
 
-   if (!_mongocrypt_buffer_concat (&to_hmac, intermediates, 3)) {
-      CLIENT_ERR ("failed to allocate buffer");
+   if (!_crypto_hmac_sha_512_parts (crypto,
+                                    mac_key,
+                                    NULL /* native key */,
+                                    false,
+                                    intermediates,
+                                    3,
+                                    &tag,
+                                    status)) {
+      return false;
+   }
+
+   /* [MCGREW 2.7] "The HMAC-SHA-512 value is truncated to T_LEN=32 octets" */
+   memcpy (out->data, tag.data, MONGOCRYPT_HMAC_LEN);
+   return true;
+}
+
+/* Ciphertext is added to the HMAC in chunks of this size, right after each
+ * chunk is encrypted or before it is decrypted, while it is still in cache. A
+ * multiple of the block size. */
+#define AEAD_CHUNK_LEN 4096
+
+
+/* Starts the HMAC of the single pass functions below with the prepared
+ * MAC_KEY. */
+static _native_crypto_hmac_t *
+_aead_hmac_start (_native_crypto_key_t *native_key,
+                  const _mongocrypt_buffer_t *associated_data,
+                  const _mongocrypt_buffer_t *iv,
+                  mongocrypt_status_t *status)
+{
+   _native_crypto_hmac_t *hmac;
+
+   hmac = _native_crypto_hmac_sha_512_new_with_key (native_key, false, status);
+   if (!hmac) {
+      return NULL;
+   }
+
+   /* [MCGREW]: the HMAC covers A, then S, which begins with the IV. */
+   if (!_native_crypto_hmac_update (hmac, associated_data, status) ||
+       !_native_crypto_hmac_update (hmac, iv, status)) {
+      _native_crypto_hmac_destroy (hmac);
+      return NULL;
+   }
+   return hmac;
+}
+
+
+/* Adds AL and writes the untruncated 64 byte HMAC into @tag. */
+static bool
+_aead_hmac_finish (_native_crypto_hmac_t *hmac,
+                   const _mongocrypt_buffer_t *associated_data,
+                   _mongocrypt_buffer_t *tag,
+                   mongocrypt_status_t *status)
+{
+   _mongocrypt_buffer_t al;
+   uint64_t associated_data_len_be;
+
+   /* [MCGREW]: AL is the number of bits in A as a 64-bit big-endian integer. */
+   associated_data_len_be = 8 * (uint64_t) associated_data->len;
+   associated_data_len_be = BSON_UINT64_TO_BE (associated_data_len_be);
+   _mongocrypt_buffer_init (&al);
+   al.data = (uint8_t *) &associated_data_len_be;
+   al.len = sizeof (associated_data_len_be);
+   return _native_crypto_hmac_update (hmac, &al, status) &&
+          _native_crypto_hmac_final (hmac, tag, status);
+}
+
+
+/* [MCGREW] encryption in a single pass with the prepared ENC_KEY and MAC_KEY.
+ * Encrypts @in with PKCS #7 padding into @out, and computes the untruncated
+ * HMAC-SHA-512 of @associated_data || @iv || @out || AL into @tag. Each chunk
+ * of ciphertext is added to the HMAC right after it is written. @out must have
+ * room for the padded ciphertext, and @tag must contain 64 bytes. */
+static bool
+_aead_encrypt_with_key (_native_crypto_key_t *native_key,
+                        const _mongocrypt_buffer_t *associated_data,
+                        const _mongocrypt_buffer_t *iv,
+                        const _mongocrypt_buffer_t *in,
+                        _mongocrypt_buffer_t *out,
+                        _mongocrypt_buffer_t *tag,
+                        uint32_t *bytes_written,
+                        mongocrypt_status_t *status)
+{
+   _native_crypto_hmac_t *hmac;
+   _mongocrypt_buffer_t in_chunk, out_chunk;
+   uint8_t final_block[MONGOCRYPT_BLOCK_SIZE];
+   uint32_t aligned_len;
+   uint32_t unaligned;
+   uint32_t offset;
+   bool ret = false;
+
+   BSON_ASSERT (iv->len == MONGOCRYPT_IV_LEN);
+   *bytes_written = 0;
+
+   unaligned = in->len % MONGOCRYPT_BLOCK_SIZE;
+   aligned_len = in->len - unaligned;
+   if (out->len < aligned_len + MONGOCRYPT_BLOCK_SIZE) {
+      CLIENT_ERR ("out does not have room for the padded ciphertext");
+      return false;
+   }
+
+   if (!_native_crypto_aes_256_cbc_init_with_key (
+          native_key, true /* encrypt */, iv, status)) {
+      return false;
+   }
+   hmac = _aead_hmac_start (native_key, associated_data, iv, status);
+   if (!hmac) {
+      return false;
+   }
+
+   _mongocrypt_buffer_init (&in_chunk);
+   _mongocrypt_buffer_init (&out_chunk);
+
+   /* Encrypt the whole blocks directly from @in, so the plaintext is not
+    * copied. */
+   for (offset = 0; offset < aligned_len; offset += in_chunk.len) {
+      in_chunk.data = in->data + offset;
+      in_chunk.len = BSON_MIN (AEAD_CHUNK_LEN, aligned_len - offset);
+      out_chunk.data = out->data + offset;
+      out_chunk.len = in_chunk.len;
+      if (!_native_crypto_aes_256_cbc_update_with_key (
+             native_key, true /* encrypt */, &in_chunk, &out_chunk, status) ||
+          !_native_crypto_hmac_update (hmac, &out_chunk, status)) {
+         goto done;
+      }
+   }
+
+   /* [MCGREW]: PKCS #7 padding. Only the final block is assembled. */
+   memcpy (final_block, in->data + aligned_len, unaligned);
+   memset (final_block + unaligned,
+           MONGOCRYPT_BLOCK_SIZE - unaligned,
+           MONGOCRYPT_BLOCK_SIZE - unaligned);
+   in_chunk.data = final_block;
+   in_chunk.len = MONGOCRYPT_BLOCK_SIZE;
+   out_chunk.data = out->data + aligned_len;
+   out_chunk.len = MONGOCRYPT_BLOCK_SIZE;
+   if (!_native_crypto_aes_256_cbc_update_with_key (
+          native_key, true /* encrypt */, &in_chunk, &out_chunk, status) ||
+       !_native_crypto_hmac_update (hmac, &out_chunk, status)) {
       goto done;
    }
-   if (!_crypto_hmac_sha_512 (crypto, mac_key, &to_hmac, &tag, status)) {
+
+   if (!_aead_hmac_finish (hmac, associated_data, tag, status)) {
       goto done;
    }
 
-   /* [MCGREW 2.7] "The HMAC-SHA-512 value is truncated to T_LEN=32 octets" */
-   memcpy (out->data, tag.data, MONGOCRYPT_HMAC_LEN);
+   *bytes_written = aligned_len + MONGOCRYPT_BLOCK_SIZE;
    ret = true;
 done:
-   _mongocrypt_buffer_cleanup (&to_hmac);
+   _native_crypto_hmac_destroy (hmac);
    return ret;
 }
 
-/* ----------------------------------------------------------------------------
- *
- * _mongocrypt_do_encryption --
- *
- *    Defer encryption to whichever crypto library libmongocrypt is using.
- *
- * Parameters:
- *    @iv a 16 byte IV.
+
+/* [MCGREW] decryption in a single pass with the prepared ENC_KEY and MAC_KEY.
+ * Decrypts the block-aligned @in into @out without removing padding, and
+ * computes the untruncated HMAC-SHA-512 of @associated_data || @iv || @in || AL
+ * into @tag. The caller must verify @tag before using @out. */
+static bool
+_aead_decrypt_with_key (_native_crypto_key_t *native_key,
+                        const _mongocrypt_buffer_t *associated_data,
+                        const _mongocrypt_buffer_t *iv,
+                        const _mongocrypt_buffer_t *in,
+                        _mongocrypt_buffer_t *out,
+                        _mongocrypt_buffer_t *tag,
+                        uint32_t *bytes_written,
+                        mongocrypt_status_t *status)
+{
+   _native_crypto_hmac_t *hmac;
+   _mongocrypt_buffer_t in_chunk, out_chunk;
+   uint32_t offset;
+   bool ret = false;
+
+   BSON_ASSERT (iv->len == MONGOCRYPT_IV_LEN);
+   *bytes_written = 0;
+
+   if (in->len % MONGOCRYPT_BLOCK_SIZE != 0) {
+      CLIENT_ERR ("error, ciphertext length is not a multiple of block size");
+      return false;
+   }
+   if (out->len < in->len) {
+      CLIENT_ERR ("out does not have room for the plaintext");
+      return false;
+   }
+
+   if (!_native_crypto_aes_256_cbc_init_with_key (
+          native_key, false /* decrypt */, iv, status)) {
+      return false;
+   }
+   hmac = _aead_hmac_start (native_key, associated_data, iv, status);
+   if (!hmac) {
+      return false;
+   }
+
+   _mongocrypt_buffer_init (&in_chunk);
+   _mongocrypt_buffer_init (&out_chunk);
+
+   for (offset = 0; offset < in->len; offset += in_chunk.len) {
+      in_chunk.data = in->data + offset;
+      in_chunk.len = BSON_MIN (AEAD_CHUNK_LEN, in->len - offset);
+      out_chunk.data = out->data + offset;
+      out_chunk.len = in_chunk.len;
+      /* Padding is removed by the caller, so every block is written. */
+      if (!_native_crypto_hmac_update (hmac, &in_chunk, status) ||
+          !_native_crypto_aes_256_cbc_update_with_key (
+             native_key, false /* decrypt */, &in_chunk, &out_chunk, status)) {
+         goto done;
+      }
+   }
+
+   if (!_aead_hmac_finish (hmac, associated_data, tag, status)) {
+      goto done;
+   }
+
+   *bytes_written = in->len;
+   ret = true;
+done:
+   _native_crypto_hmac_destroy (hmac);
+   return ret;
+}
+
+
+/* ----------------------------------------------------------------------------
+ *
+ * _do_encryption --
+ *
+ *    Defer encryption to whichever crypto library libmongocrypt is using.
+ *
+ * Parameters:
+ *    @iv a 16 byte IV.
  *    @associated_data associated data for the HMAC. May be NULL.
  *    @key a 96 byte key.
  *    @plaintext the plaintext to encrypt.
@@ -480,15 +1070,16 @@ done:
  *
  * ----------------------------------------------------------------------------
  */
-bool
-_mongocrypt_do_encryption (_mongocrypt_crypto_t *crypto,
-                           const _mongocrypt_buffer_t *iv,
-                           const _mongocrypt_buffer_t *associated_data,
-                           const _mongocrypt_buffer_t *key,
-                           const _mongocrypt_buffer_t *plaintext,
-                           _mongocrypt_buffer_t *ciphertext,
-                           uint32_t *bytes_written,
-                           mongocrypt_status_t *status)
+static bool
+_do_encryption (_mongocrypt_crypto_t *crypto,
+                const _mongocrypt_buffer_t *iv,
+                const _mongocrypt_buffer_t *associated_data,
+                const _mongocrypt_buffer_t *key,
+                _native_crypto_key_t *native_key,
+                const _mongocrypt_buffer_t *plaintext,
+                _mongocrypt_buffer_t *ciphertext,
+                uint32_t *bytes_written,
+                mongocrypt_status_t *status)
 {
    _mongocrypt_buffer_t mac_key = {0}, enc_key = {0}, intermediate = {0},
                         intermediate_hmac = {0}, empty_buffer = {0};
@@ -539,6 +1130,38 @@ _mongocrypt_do_encryption (_mongocrypt_crypto_t *crypto,
    intermediate.len -= iv->len;
    *bytes_written += iv->len;
 
+   if (native_key &&
+       _mongocrypt_crypto_is_native (
+          crypto,
+          MONGOCRYPT_CRYPTO_PRIMITIVE_AES_256_CBC |
+             MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512)) {
+      uint8_t tag_storage[MONGOCRYPT_HMAC_SHA512_LEN];
+      _mongocrypt_buffer_t tag = {0};
+
+      tag.data = tag_storage;
+      tag.len = sizeof (tag_storage);
+
+      /* [MCGREW]: Steps 2 through 5 in a single pass over the data. */
+      if (!_aead_encrypt_with_key (native_key,
+                                   associated_data ? associated_data
+                                                   : &empty_buffer,
+                                   iv,
+                                   plaintext,
+                                   &intermediate,
+                                   &tag,
+                                   &intermediate_bytes_written,
+                                   status)) {
+         return false;
+      }
+      *bytes_written += intermediate_bytes_written;
+
+      /* [MCGREW 2.7] "The HMAC-SHA-512 value is truncated to T_LEN=32 octets"
+       */
+      memcpy (ciphertext->data + *bytes_written, tag.data, MONGOCRYPT_HMAC_LEN);
+      *bytes_written += MONGOCRYPT_HMAC_LEN;
+      return true;
+   }
+
    /* [MCGREW]: Steps 2 & 3. */
    if (!_encrypt_step (crypto,
                        iv,
@@ -574,6 +1197,54 @@ _mongocrypt_do_encryption (_mongocrypt_crypto_t *crypto,
 }
 
 
+/* Fires the encrypt probes around _do_encryption. */
+bool
+_mongocrypt_do_encryption (_mongocrypt_crypto_t *crypto,
+                           const _mongocrypt_buffer_t *iv,
+                           const _mongocrypt_buffer_t *associated_data,
+                           const _mongocrypt_buffer_t *key,
+                           _native_crypto_key_t *native_key,
+                           const _mongocrypt_buffer_t *plaintext,
+                           _mongocrypt_buffer_t *ciphertext,
+                           uint32_t *bytes_written,
+                           mongocrypt_status_t *status)
+{
+   bool ret;
+
+   MONGOCRYPT_PROBE1 (encrypt__start, plaintext->len);
+   ret = _do_encryption (crypto,
+                         iv,
+                         associated_data,
+                         key,
+                         native_key,
+                         plaintext,
+                         ciphertext,
+                         bytes_written,
+                         status);
+   MONGOCRYPT_PROBE2 (encrypt__done, ret, ret ? *bytes_written : 0);
+   return ret;
+}
+
+
+/* Remove the PKCS #7 padding from decrypted @plaintext by shortening
+ * @bytes_written. */
+static bool
+_remove_padding (const _mongocrypt_buffer_t *plaintext,
+                 uint32_t *bytes_written,
+                 mongocrypt_status_t *status)
+{
+   uint8_t padding_byte;
+
+   padding_byte = plaintext->data[*bytes_written - 1];
+   if (padding_byte > 16) {
+      CLIENT_ERR ("error, ciphertext malformed padding");
+      return false;
+   }
+   *bytes_written -= padding_byte;
+   return true;
+}
+
+
 /* ----------------------------------------------------------------------------
  *
  * _aes256_cbc_decrypt --
@@ -611,8 +1282,6 @@ _decrypt_step (_mongocrypt_crypto_t *crypto,
                uint32_t *bytes_written,
                mongocrypt_status_t *status)
 {
-   uint8_t padding_byte;
-
    BSON_ASSERT (bytes_written);
    *bytes_written = 0;
 
@@ -635,24 +1304,23 @@ _decrypt_step (_mongocrypt_crypto_t *crypto,
       return false;
    }
 
-   if (!_crypto_aes_256_cbc_decrypt (
-          crypto, iv, enc_key, ciphertext, plaintext, bytes_written, status)) {
+   if (!_crypto_aes_256_cbc_decrypt (crypto,
+                                     iv,
+                                     enc_key,
+                                     ciphertext,
+                                     plaintext,
+                                     bytes_written,
+                                     status)) {
       return false;
    }
 
-   padding_byte = plaintext->data[*bytes_written - 1];
-   if (padding_byte > 16) {
-      CLIENT_ERR ("error, ciphertext malformed padding");
-      return false;
-   }
-   *bytes_written -= padding_byte;
-   return true;
+   return _remove_padding (plaintext, bytes_written, status);
 }
 
 
 /* ----------------------------------------------------------------------------
  *
- * _mongocrypt_do_decryption --
+ * _do_decryption --
  *
  *    Defer decryption to whichever crypto library libmongocrypt is using.
  *
@@ -678,14 +1346,15 @@ _decrypt_step (_mongocrypt_crypto_t *crypto,
  *
  * ----------------------------------------------------------------------------
  */
-bool
-_mongocrypt_do_decryption (_mongocrypt_crypto_t *crypto,
-                           const _mongocrypt_buffer_t *associated_data,
-                           const _mongocrypt_buffer_t *key,
-                           const _mongocrypt_buffer_t *ciphertext,
-                           _mongocrypt_buffer_t *plaintext,
-                           uint32_t *bytes_written,
-                           mongocrypt_status_t *status)
+static bool
+_do_decryption (_mongocrypt_crypto_t *crypto,
+                const _mongocrypt_buffer_t *associated_data,
+                const _mongocrypt_buffer_t *key,
+                _native_crypto_key_t *native_key,
+                const _mongocrypt_buffer_t *ciphertext,
+                _mongocrypt_buffer_t *plaintext,
+                uint32_t *bytes_written,
+                mongocrypt_status_t *status)
 {
    bool ret = false;
    _mongocrypt_buffer_t mac_key = {0}, enc_key = {0}, intermediate = {0},
@@ -736,6 +1405,53 @@ _mongocrypt_do_decryption (_mongocrypt_crypto_t *crypto,
    hmac_tag.data = hmac_tag_storage;
    hmac_tag.len = MONGOCRYPT_HMAC_LEN;
 
+   if (native_key &&
+       _mongocrypt_crypto_is_native (
+          crypto,
+          MONGOCRYPT_CRYPTO_PRIMITIVE_AES_256_CBC |
+             MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512)) {
+      uint8_t tag_storage[MONGOCRYPT_HMAC_SHA512_LEN];
+      _mongocrypt_buffer_t tag = {0};
+
+      tag.data = tag_storage;
+      tag.len = sizeof (tag_storage);
+
+      /* Data excluding IV + HMAC. */
+      intermediate.data = (uint8_t *) ciphertext->data + MONGOCRYPT_IV_LEN;
+      intermediate.len =
+         ciphertext->len - (MONGOCRYPT_IV_LEN + MONGOCRYPT_HMAC_LEN);
+
+      /* [MCGREW 2.2]: Steps 3 and 4 in a single pass over the data. */
+      if (!_aead_decrypt_with_key (native_key,
+                                   associated_data ? associated_data
+                                                   : &empty_buffer,
+                                   &iv,
+                                   &intermediate,
+                                   plaintext,
+                                   &tag,
+                                   bytes_written,
+                                   status)) {
+         /* The backend may have decrypted part of the data before failing. */
+         memset (plaintext->data, 0, plaintext->len);
+         *bytes_written = 0;
+         goto done;
+      }
+
+      /* The plaintext is only released if the HMAC check passes. */
+      if (0 != _mongocrypt_memequal (tag.data,
+                                     ciphertext->data +
+                                        (ciphertext->len - MONGOCRYPT_HMAC_LEN),
+                                     MONGOCRYPT_HMAC_LEN)) {
+         memset (plaintext->data, 0, plaintext->len);
+         *bytes_written = 0;
+         CLIENT_ERR ("HMAC validation failure");
+         goto done;
+      }
+
+      ret = _remove_padding (plaintext, bytes_written, status);
+      goto done;
+   }
+
    /* [MCGREW 2.2]: Step 3: HMAC check. */
    if (!_hmac_step (crypto,
                     &mac_key,
@@ -776,6 +1492,1048 @@ done:
 }
 
 
+/* Fires the decrypt probes around _do_decryption. */
+bool
+_mongocrypt_do_decryption (_mongocrypt_crypto_t *crypto,
+                           const _mongocrypt_buffer_t *associated_data,
+                           const _mongocrypt_buffer_t *key,
+                           _native_crypto_key_t *native_key,
+                           const _mongocrypt_buffer_t *ciphertext,
+                           _mongocrypt_buffer_t *plaintext,
+                           uint32_t *bytes_written,
+                           mongocrypt_status_t *status)
+{
+   bool ret;
+
+   MONGOCRYPT_PROBE1 (decrypt__start, ciphertext->len);
+   ret = _do_decryption (crypto,
+                         associated_data,
+                         key,
+                         native_key,
+                         ciphertext,
+                         plaintext,
+                         bytes_written,
+                         status);
+   MONGOCRYPT_PROBE2 (decrypt__done, ret, ret ? *bytes_written : 0);
+   return ret;
+}
+
+
+struct _mongocrypt_crypto_job_t {
+   mongocrypt_crypto_job_type_t type;
+   mongocrypt_binary_t key;
+   mongocrypt_binary_t iv;
+   mongocrypt_binary_t in;
+   mongocrypt_binary_t out;
+   uint32_t bytes_written;
+};
+
+
+mongocrypt_crypto_job_type_t
+mongocrypt_crypto_job_type (const mongocrypt_crypto_job_t *job)
+{
+   BSON_ASSERT (job);
+   return job->type;
+}
+
+
+mongocrypt_binary_t *
+mongocrypt_crypto_job_key (mongocrypt_crypto_job_t *job)
+{
+   BSON_ASSERT (job);
+   return &job->key;
+}
+
+
+mongocrypt_binary_t *
+mongocrypt_crypto_job_iv (mongocrypt_crypto_job_t *job)
+{
+   BSON_ASSERT (job);
+   if (job->type == MONGOCRYPT_CRYPTO_JOB_HMAC_SHA_512) {
+      return NULL;
+   }
+   return &job->iv;
+}
+
+
+mongocrypt_binary_t *
+mongocrypt_crypto_job_in (mongocrypt_crypto_job_t *job)
+{
+   BSON_ASSERT (job);
+   return &job->in;
+}
+
+
+mongocrypt_binary_t *
+mongocrypt_crypto_job_out (mongocrypt_crypto_job_t *job)
+{
+   BSON_ASSERT (job);
+   return &job->out;
+}
+
+
+void
+mongocrypt_crypto_job_set_bytes_written (mongocrypt_crypto_job_t *job,
+                                         uint32_t bytes_written)
+{
+   BSON_ASSERT (job);
+   job->bytes_written = bytes_written;
+}
+
+
+/* A job of the batch hook, with storage for its input and HMAC output. */
+typedef struct {
+   mongocrypt_crypto_job_t job;
+   _mongocrypt_buffer_t in;
+   /* Holds a padded plaintext shorter than SMALL_PADDED_LEN. */
+   uint8_t small_in[SMALL_PADDED_LEN];
+   uint8_t tag[MONGOCRYPT_HMAC_SHA512_LEN];
+} _batch_job_t;
+
+
+static void
+_batch_reset (_batch_job_t *batch, uint32_t count)
+{
+   uint32_t i;
+
+   for (i = 0; i < count; i++) {
+      _mongocrypt_buffer_cleanup (&batch[i].in);
+   }
+   memset (batch, 0, count * sizeof (*batch));
+}
+
+
+/* Sets an HMAC-SHA-512 job of the concatenated @parts. */
+static bool
+_batch_set_hmac (_batch_job_t *bj,
+                 const uint8_t *hmac_key,
+                 const _mongocrypt_buffer_t *parts,
+                 uint32_t num_parts,
+                 mongocrypt_status_t *status)
+{
+   /* The hook only takes one input. */
+   _mongocrypt_buffer_init (&bj->in);
+   if (!_mongocrypt_buffer_concat (&bj->in, parts, num_parts)) {
+      CLIENT_ERR ("failed to allocate buffer");
+      return false;
+   }
+
+   bj->job.type = MONGOCRYPT_CRYPTO_JOB_HMAC_SHA_512;
+   bj->job.key.data = (uint8_t *) hmac_key;
+   bj->job.key.len = MONGOCRYPT_MAC_KEY_LEN;
+   _mongocrypt_buffer_to_binary (&bj->in, &bj->job.in);
+   bj->job.out.data = bj->tag;
+   bj->job.out.len = sizeof (bj->tag);
+   return true;
+}
+
+
+static void
+_batch_set_aes (_batch_job_t *bj,
+                mongocrypt_crypto_job_type_t type,
+                const uint8_t *enc_key,
+                const uint8_t *iv,
+                const _mongocrypt_buffer_t *in,
+                uint8_t *out,
+                uint32_t out_len)
+{
+   bj->job.type = type;
+   bj->job.key.data = (uint8_t *) enc_key;
+   bj->job.key.len = MONGOCRYPT_ENC_KEY_LEN;
+   bj->job.iv.data = (uint8_t *) iv;
+   bj->job.iv.len = MONGOCRYPT_IV_LEN;
+   _mongocrypt_buffer_to_binary (in, &bj->job.in);
+   bj->job.out.data = out;
+   bj->job.out.len = out_len;
+}
+
+
+static bool
+_batch_run (_mongocrypt_crypto_t *crypto,
+            _batch_job_t *batch,
+            uint32_t count,
+            mongocrypt_status_t *status)
+{
+   mongocrypt_crypto_job_t **jobs;
+   uint32_t i;
+   bool ret;
+
+   if (count == 0) {
+      return true;
+   }
+
+   jobs = bson_malloc (count * sizeof (*jobs));
+   BSON_ASSERT (jobs);
+   for (i = 0; i < count; i++) {
+      batch[i].job.bytes_written = 0;
+      jobs[i] = &batch[i].job;
+   }
+   ret = crypto->batch (crypto->ctx, jobs, count, status);
+   bson_free (jobs);
+   return ret;
+}
+
+
+void
+_mongocrypt_encryption_job_init (_mongocrypt_encryption_job_t *job)
+{
+   memset (job, 0, sizeof (*job));
+}
+
+
+void
+_mongocrypt_encryption_job_cleanup (_mongocrypt_encryption_job_t *job)
+{
+   if (!job) {
+      return;
+   }
+   _mongocrypt_buffer_cleanup (&job->key);
+   _mongocrypt_buffer_cleanup (&job->iv);
+   _mongocrypt_buffer_cleanup (&job->associated_data);
+   _mongocrypt_buffer_cleanup (&job->plaintext);
+}
+
+
+static bool
+_check_encryption_jobs (_mongocrypt_encryption_job_t *jobs,
+                        uint32_t count,
+                        mongocrypt_status_t *status)
+{
+   uint32_t i;
+
+   for (i = 0; i < count; i++) {
+      _mongocrypt_encryption_job_t *job = &jobs[i];
+
+      if (MONGOCRYPT_KEY_LEN != job->key.len) {
+         CLIENT_ERR ("key should have length %d, but has length %d",
+                     MONGOCRYPT_KEY_LEN,
+                     job->key.len);
+         return false;
+      }
+      if (MONGOCRYPT_IV_LEN != job->iv.len) {
+         CLIENT_ERR ("IV should have length %d, but has length %d",
+                     MONGOCRYPT_IV_LEN,
+                     job->iv.len);
+         return false;
+      }
+      if (job->ciphertext->len !=
+          _mongocrypt_calculate_ciphertext_len (job->plaintext.len)) {
+         CLIENT_ERR (
+            "output ciphertext should have been allocated with %d bytes",
+            _mongocrypt_calculate_ciphertext_len (job->plaintext.len));
+         return false;
+      }
+   }
+   return true;
+}
+
+
+static int
+_cmp_job_native_key (const void *a, const void *b)
+{
+   const _mongocrypt_encryption_job_t *job_a, *job_b;
+   uintptr_t key_a, key_b;
+
+   job_a = *(_mongocrypt_encryption_job_t *const *) a;
+   job_b = *(_mongocrypt_encryption_job_t *const *) b;
+   key_a = (uintptr_t) job_a->native_key;
+   key_b = (uintptr_t) job_b->native_key;
+   return key_a < key_b ? -1 : key_a > key_b ? 1 : 0;
+}
+
+
+/* Encrypt @jobs with the native backend. Values with the same prepared key
+ * are encrypted up to MONGOCRYPT_CBC_MAX_LANES at a time with
+ * _native_crypto_aes_256_cbc_encrypt_lanes. Each HMAC is then computed alone,
+ * since SHA-512 has no interleaved implementation to call. */
+static bool
+_encrypt_multi_buffer (_mongocrypt_crypto_t *crypto,
+                       _mongocrypt_encryption_job_t *jobs,
+                       uint32_t count,
+                       mongocrypt_status_t *status)
+{
+   _mongocrypt_encryption_job_t **sorted;
+   _native_crypto_cbc_lane_t lanes[MONGOCRYPT_CBC_MAX_LANES];
+   _mongocrypt_buffer_t parts[3];
+   uint64_t associated_data_len_be;
+   uint8_t tag_storage[MONGOCRYPT_HMAC_SHA512_LEN];
+   _mongocrypt_buffer_t tag;
+   uint32_t i, n;
+   bool ret = false;
+
+   BSON_ASSERT (_mongocrypt_crypto_uses_multi_buffer (crypto));
+
+   sorted = bson_malloc (count * sizeof (*sorted));
+   BSON_ASSERT (sorted);
+   for (i = 0; i < count; i++) {
+      sorted[i] = &jobs[i];
+   }
+   qsort (sorted, count, sizeof (*sorted), _cmp_job_native_key);
+
+   for (i = 0; i < 3; i++) {
+      _mongocrypt_buffer_init (&parts[i]);
+   }
+   _mongocrypt_buffer_init (&tag);
+   tag.data = tag_storage;
+   tag.len = sizeof (tag_storage);
+
+   /* [MCGREW]: Steps 2 & 3. The IV is prepended, and the padded plaintext is
+    * encrypted in place. */
+   for (i = 0, n = 0; i < count; i++) {
+      _mongocrypt_encryption_job_t *job = sorted[i];
+      _mongocrypt_buffer_t padded;
+      uint8_t *data;
+      uint32_t written;
+
+      if (job->deterministic &&
+          !_mongocrypt_calculate_deterministic_iv (crypto,
+                                                   &job->key,
+                                                   job->native_key,
+                                                   &job->plaintext,
+                                                   &job->associated_data,
+                                                   &job->iv,
+                                                   status)) {
+         goto done;
+      }
+
+      if (!job->native_key) {
+         /* The key could not be prepared. */
+         if (!_mongocrypt_do_encryption (crypto,
+                                         &job->iv,
+                                         &job->associated_data,
+                                         &job->key,
+                                         NULL /* native key */,
+                                         &job->plaintext,
+                                         job->ciphertext,
+                                         &written,
+                                         status)) {
+            goto done;
+         }
+         continue;
+      }
+
+      data = job->ciphertext->data;
+      memcpy (data, job->iv.data, MONGOCRYPT_IV_LEN);
+      _mongocrypt_buffer_init (&padded);
+      padded.data = data + MONGOCRYPT_IV_LEN;
+      padded.len = job->ciphertext->len -
+                   (MONGOCRYPT_IV_LEN + MONGOCRYPT_HMAC_LEN);
+      if (job->plaintext.len > 0) {
+         memcpy (padded.data, job->plaintext.data, job->plaintext.len);
+      }
+      /* [MCGREW]: PKCS #7 padding. */
+      memset (padded.data + job->plaintext.len,
+              (int) (padded.len - job->plaintext.len),
+              padded.len - job->plaintext.len);
+
+      lanes[n].iv = job->iv.data;
+      lanes[n].data = padded.data;
+      lanes[n].len = padded.len;
+      n++;
+      if (n == MONGOCRYPT_CBC_MAX_LANES || i + 1 == count ||
+          sorted[i + 1]->native_key != job->native_key) {
+         if (!_native_crypto_aes_256_cbc_encrypt_lanes (
+                job->native_key, lanes, n, status)) {
+            goto done;
+         }
+         n = 0;
+      }
+   }
+
+   /* [MCGREW]: Steps 4 & 5, as in _hmac_step. */
+   for (i = 0; i < count; i++) {
+      _mongocrypt_encryption_job_t *job = sorted[i];
+      _mongocrypt_buffer_t *ciphertext = job->ciphertext;
+      _mongocrypt_buffer_t mac_key;
+
+      if (!job->native_key) {
+         continue;
+      }
+      _mongocrypt_buffer_init (&mac_key);
+      mac_key.data = job->key.data;
+      mac_key.len = MONGOCRYPT_MAC_KEY_LEN;
+      associated_data_len_be = 8 * (uint64_t) job->associated_data.len;
+      associated_data_len_be = BSON_UINT64_TO_BE (associated_data_len_be);
+      parts[0].data = job->associated_data.data;
+      parts[0].len = job->associated_data.len;
+      parts[1].data = ciphertext->data;
+      parts[1].len = ciphertext->len - MONGOCRYPT_HMAC_LEN;
+      parts[2].data = (uint8_t *) &associated_data_len_be;
+      parts[2].len = sizeof (uint64_t);
+      if (!_crypto_hmac_sha_512_parts (crypto,
+                                       &mac_key,
+                                       job->native_key,
+                                       false,
+                                       parts,
+                                       3,
+                                       &tag,
+                                       status)) {
+         goto done;
+      }
+      /* [MCGREW 2.7] "The HMAC-SHA-512 value is truncated to T_LEN=32 octets"
+       */
+      memcpy (ciphertext->data + (ciphertext->len - MONGOCRYPT_HMAC_LEN),
+              tag.data,
+              MONGOCRYPT_HMAC_LEN);
+   }
+
+   ret = true;
+done:
+   bson_free (sorted);
+   return ret;
+}
+
+
+bool
+_mongocrypt_do_encryption_batch (_mongocrypt_crypto_t *crypto,
+                                 _mongocrypt_encryption_job_t *jobs,
+                                 uint32_t count,
+                                 mongocrypt_status_t *status)
+{
+   _batch_job_t *batch;
+   _mongocrypt_buffer_t parts[3];
+   uint64_t associated_data_len_be;
+   uint32_t i, n;
+   bool ret = false;
+
+   if (count == 0) {
+      return true;
+   }
+
+   if (!_check_encryption_jobs (jobs, count, status)) {
+      return false;
+   }
+
+   if (!_mongocrypt_crypto_uses_batch (crypto)) {
+      return _encrypt_multi_buffer (crypto, jobs, count, status);
+   }
+
+   batch = bson_malloc0 (count * sizeof (*batch));
+   BSON_ASSERT (batch);
+
+   for (i = 0; i < 3; i++) {
+      _mongocrypt_buffer_init (&parts[i]);
+   }
+
+   /* Deterministic IVs first, as in _mongocrypt_calculate_deterministic_iv.
+    * The ciphertext depends on them. */
+   for (i = 0, n = 0; i < count; i++) {
+      _mongocrypt_encryption_job_t *job = &jobs[i];
+
+      if (!job->deterministic) {
+         continue;
+      }
+      associated_data_len_be = 8 * (uint64_t) job->associated_data.len;
+      associated_data_len_be = BSON_UINT64_TO_BE (associated_data_len_be);
+      parts[0].data = job->associated_data.data;
+      parts[0].len = job->associated_data.len;
+      parts[1].data = (uint8_t *) &associated_data_len_be;
+      parts[1].len = sizeof (uint64_t);
+      parts[2].data = job->plaintext.data;
+      parts[2].len = job->plaintext.len;
+      if (!_batch_set_hmac (&batch[n++],
+                            job->key.data + MONGOCRYPT_MAC_KEY_LEN +
+                               MONGOCRYPT_ENC_KEY_LEN,
+                            parts,
+                            3,
+                            status)) {
+         goto done;
+      }
+   }
+   if (!_batch_run (crypto, batch, n, status)) {
+      goto done;
+   }
+   for (i = 0, n = 0; i < count; i++) {
+      if (jobs[i].deterministic) {
+         /* Truncate to IV length */
+         memcpy (jobs[i].iv.data, batch[n++].tag, MONGOCRYPT_IV_LEN);
+      }
+   }
+   _batch_reset (batch, count);
+
+   /* [MCGREW]: Steps 2 & 3. The IV is prepended. */
+   for (i = 0; i < count; i++) {
+      _mongocrypt_buffer_t *ciphertext = jobs[i].ciphertext;
+
+      memset (ciphertext->data, 0, ciphertext->len);
+      memcpy (ciphertext->data, jobs[i].iv.data, MONGOCRYPT_IV_LEN);
+      if (jobs[i].plaintext.len < SMALL_PADDED_LEN) {
+         _pad_small_plaintext (
+            &jobs[i].plaintext, batch[i].small_in, &batch[i].in);
+      } else if (!_pad_plaintext (&jobs[i].plaintext, &batch[i].in, status)) {
+         goto done;
+      }
+      _batch_set_aes (&batch[i],
+                      MONGOCRYPT_CRYPTO_JOB_AES_256_CBC_ENCRYPT,
+                      jobs[i].key.data + MONGOCRYPT_MAC_KEY_LEN,
+                      jobs[i].iv.data,
+                      &batch[i].in,
+                      ciphertext->data + MONGOCRYPT_IV_LEN,
+                      ciphertext->len -
+                         (MONGOCRYPT_IV_LEN + MONGOCRYPT_HMAC_LEN));
+   }
+   if (!_batch_run (crypto, batch, count, status)) {
+      goto done;
+   }
+   for (i = 0; i < count; i++) {
+      if (batch[i].job.bytes_written != batch[i].in.len) {
+         CLIENT_ERR ("encryption failure, wrote %d bytes, expected %d",
+                     batch[i].job.bytes_written,
+                     batch[i].in.len);
+         goto done;
+      }
+   }
+   _batch_reset (batch, count);
+
+   /* [MCGREW]: Steps 4 & 5, as in _hmac_step. */
+   for (i = 0; i < count; i++) {
+      _mongocrypt_buffer_t *ciphertext = jobs[i].ciphertext;
+
+      associated_data_len_be = 8 * (uint64_t) jobs[i].associated_data.len;
+      associated_data_len_be = BSON_UINT64_TO_BE (associated_data_len_be);
+      parts[0].data = jobs[i].associated_data.data;
+      parts[0].len = jobs[i].associated_data.len;
+      parts[1].data = ciphertext->data;
+      parts[1].len = ciphertext->len - MONGOCRYPT_HMAC_LEN;
+      parts[2].data = (uint8_t *) &associated_data_len_be;
+      parts[2].len = sizeof (uint64_t);
+      if (!_batch_set_hmac (
+             &batch[i], jobs[i].key.data, parts, 3, status)) {
+         goto done;
+      }
+   }
+   if (!_batch_run (crypto, batch, count, status)) {
+      goto done;
+   }
+   for (i = 0; i < count; i++) {
+      _mongocrypt_buffer_t *ciphertext = jobs[i].ciphertext;
+
+      /* [MCGREW 2.7] "The HMAC-SHA-512 value is truncated to T_LEN=32 octets"
+       */
+      memcpy (ciphertext->data + (ciphertext->len - MONGOCRYPT_HMAC_LEN),
+              batch[i].tag,
+              MONGOCRYPT_HMAC_LEN);
+   }
+
+   ret = true;
+done:
+   _batch_reset (batch, count);
+   bson_free (batch);
+   return ret;
+}
+
+
+void
+_mongocrypt_decryption_job_init (_mongocrypt_decryption_job_t *job)
+{
+   memset (job, 0, sizeof (*job));
+}
+
+
+void
+_mongocrypt_decryption_job_cleanup (_mongocrypt_decryption_job_t *job)
+{
+   if (!job) {
+      return;
+   }
+   _mongocrypt_buffer_cleanup (&job->key);
+   _mongocrypt_buffer_cleanup (&job->associated_data);
+   _mongocrypt_buffer_cleanup (&job->ciphertext);
+   _mongocrypt_buffer_cleanup (&job->plaintext);
+}
+
+
+bool
+_mongocrypt_do_decryption_batch (_mongocrypt_crypto_t *crypto,
+                                 _mongocrypt_decryption_job_t *jobs,
+                                 uint32_t count,
+                                 mongocrypt_status_t *status)
+{
+   _batch_job_t *batch;
+   _mongocrypt_buffer_t parts[3];
+   _mongocrypt_buffer_t to_decrypt;
+   uint64_t associated_data_len_be;
+   uint32_t i;
+   bool ret = false;
+
+   BSON_ASSERT (_mongocrypt_crypto_uses_batch (crypto));
+
+   if (count == 0) {
+      return true;
+   }
+
+   for (i = 0; i < count; i++) {
+      _mongocrypt_decryption_job_t *job = &jobs[i];
+
+      job->bytes_written = 0;
+      if (MONGOCRYPT_KEY_LEN != job->key.len) {
+         CLIENT_ERR ("key should have length %d, but has length %d",
+                     MONGOCRYPT_KEY_LEN,
+                     job->key.len);
+         return false;
+      }
+      if (job->ciphertext.len <
+          MONGOCRYPT_HMAC_LEN + MONGOCRYPT_IV_LEN + MONGOCRYPT_BLOCK_SIZE) {
+         CLIENT_ERR ("corrupt ciphertext - must be > %d bytes",
+                     MONGOCRYPT_HMAC_LEN + MONGOCRYPT_IV_LEN +
+                        MONGOCRYPT_BLOCK_SIZE);
+         return false;
+      }
+      if ((job->ciphertext.len - (MONGOCRYPT_IV_LEN + MONGOCRYPT_HMAC_LEN)) %
+             MONGOCRYPT_BLOCK_SIZE !=
+          0) {
+         CLIENT_ERR (
+            "error, ciphertext length is not a multiple of block size");
+         return false;
+      }
+      if (job->plaintext.len !=
+          _mongocrypt_calculate_plaintext_len (job->ciphertext.len)) {
+         CLIENT_ERR (
+            "output plaintext should have been allocated with %d bytes, "
+            "but has: %d",
+            _mongocrypt_calculate_plaintext_len (job->ciphertext.len),
+            job->plaintext.len);
+         return false;
+      }
+   }
+
+   batch = bson_malloc0 (2 * count * sizeof (*batch));
+   BSON_ASSERT (batch);
+
+   for (i = 0; i < 3; i++) {
+      _mongocrypt_buffer_init (&parts[i]);
+   }
+   _mongocrypt_buffer_init (&to_decrypt);
+
+   /* [MCGREW 2.2]: Steps 3 and 4 are independent, so the HMAC and the
+    * decryption of every value go in one batch. The plaintext is only
+    * released once its HMAC is checked. */
+   for (i = 0; i < count; i++) {
+      _mongocrypt_decryption_job_t *job = &jobs[i];
+
+      associated_data_len_be = 8 * (uint64_t) job->associated_data.len;
+      associated_data_len_be = BSON_UINT64_TO_BE (associated_data_len_be);
+      parts[0].data = job->associated_data.data;
+      parts[0].len = job->associated_data.len;
+      parts[1].data = job->ciphertext.data;
+      parts[1].len = job->ciphertext.len - MONGOCRYPT_HMAC_LEN;
+      parts[2].data = (uint8_t *) &associated_data_len_be;
+      parts[2].len = sizeof (uint64_t);
+      if (!_batch_set_hmac (
+             &batch[2 * i], job->key.data, parts, 3, status)) {
+         goto done;
+      }
+
+      /* Data excluding IV + HMAC. */
+      to_decrypt.data = job->ciphertext.data + MONGOCRYPT_IV_LEN;
+      to_decrypt.len =
+         job->ciphertext.len - (MONGOCRYPT_IV_LEN + MONGOCRYPT_HMAC_LEN);
+      _batch_set_aes (&batch[2 * i + 1],
+                      MONGOCRYPT_CRYPTO_JOB_AES_256_CBC_DECRYPT,
+                      job->key.data + MONGOCRYPT_MAC_KEY_LEN,
+                      job->ciphertext.data,
+                      &to_decrypt,
+                      job->plaintext.data,
+                      job->plaintext.len);
+   }
+   if (!_batch_run (crypto, batch, 2 * count, status)) {
+      goto done;
+   }
+
+   for (i = 0; i < count; i++) {
+      _mongocrypt_decryption_job_t *job = &jobs[i];
+
+      /* [MCGREW] "using a comparison routine that takes constant time". */
+      if (0 != _mongocrypt_memequal (batch[2 * i].tag,
+                                     job->ciphertext.data +
+                                        (job->ciphertext.len -
+                                         MONGOCRYPT_HMAC_LEN),
+                                     MONGOCRYPT_HMAC_LEN)) {
+         CLIENT_ERR ("HMAC validation failure");
+         goto done;
+      }
+
+      job->bytes_written = batch[2 * i + 1].job.bytes_written;
+      if (job->bytes_written == 0 || job->bytes_written > job->plaintext.len) {
+         CLIENT_ERR ("decryption failure, wrote %d bytes",
+                     job->bytes_written);
+         goto done;
+      }
+      if (!_remove_padding (&job->plaintext, &job->bytes_written, status)) {
+         goto done;
+      }
+   }
+
+   ret = true;
+done:
+   if (!ret) {
+      for (i = 0; i < count; i++) {
+         memset (jobs[i].plaintext.data, 0, jobs[i].plaintext.len);
+         jobs[i].bytes_written = 0;
+      }
+   }
+   _batch_reset (batch, 2 * count);
+   bson_free (batch);
+   return ret;
+}
+
+
+static bool
+_stream_hmac_update (_mongocrypt_stream_cipher_t *stream,
+                     const uint8_t *data,
+                     uint32_t len,
+                     mongocrypt_status_t *status)
+{
+   _mongocrypt_crypto_t *crypto = stream->crypto;
+   _mongocrypt_buffer_t in;
+   mongocrypt_binary_t in_bin;
+
+   if (len == 0) {
+      return true;
+   }
+   _mongocrypt_buffer_init (&in);
+   in.data = (uint8_t *) data;
+   in.len = len;
+   if (stream->hmac) {
+      return _native_crypto_hmac_update (stream->hmac, &in, status);
+   }
+   _mongocrypt_buffer_to_binary (&in, &in_bin);
+   return crypto->hmac_sha_512_update (
+      crypto->ctx, stream->hmac_ctx, &in_bin, status);
+}
+
+
+/* Adds AL and writes the truncated 32 byte tag into @tag. */
+static bool
+_stream_hmac_final (_mongocrypt_stream_cipher_t *stream,
+                    uint8_t *tag,
+                    mongocrypt_status_t *status)
+{
+   _mongocrypt_crypto_t *crypto = stream->crypto;
+   uint8_t full_storage[MONGOCRYPT_HMAC_SHA512_LEN];
+   _mongocrypt_buffer_t full;
+   mongocrypt_binary_t full_bin;
+   uint64_t associated_data_len_be;
+   bool ret;
+
+   associated_data_len_be = 8 * stream->associated_data_len;
+   associated_data_len_be = BSON_UINT64_TO_BE (associated_data_len_be);
+   if (!_stream_hmac_update (stream,
+                             (uint8_t *) &associated_data_len_be,
+                             sizeof (uint64_t),
+                             status)) {
+      return false;
+   }
+
+   _mongocrypt_buffer_init (&full);
+   full.data = full_storage;
+   full.len = sizeof (full_storage);
+   stream->hmac_started = false;
+   if (stream->hmac) {
+      ret = _native_crypto_hmac_final (stream->hmac, &full, status);
+      _native_crypto_hmac_destroy (stream->hmac);
+      stream->hmac = NULL;
+   } else {
+      _mongocrypt_buffer_to_binary (&full, &full_bin);
+      ret = crypto->hmac_sha_512_final (
+         crypto->ctx, stream->hmac_ctx, &full_bin, status);
+      stream->hmac_ctx = NULL;
+   }
+   if (ret) {
+      memcpy (tag, full_storage, MONGOCRYPT_HMAC_LEN);
+   }
+   return ret;
+}
+
+
+/* Encrypts or decrypts @len block-aligned bytes chained from the previous
+ * chunk, adding the ciphertext to the HMAC. */
+static bool
+_stream_cbc (_mongocrypt_stream_cipher_t *stream,
+             const uint8_t *in,
+             uint32_t len,
+             uint8_t *out,
+             mongocrypt_status_t *status)
+{
+   _mongocrypt_buffer_t enc_key, iv, in_buf, out_buf;
+   const uint8_t *ciphertext;
+   uint32_t bytes_written = 0;
+   bool ret;
+
+   BSON_ASSERT (len > 0 && len % MONGOCRYPT_BLOCK_SIZE == 0);
+   _mongocrypt_buffer_init (&enc_key);
+   enc_key.data = stream->key + MONGOCRYPT_MAC_KEY_LEN;
+   enc_key.len = MONGOCRYPT_ENC_KEY_LEN;
+   _mongocrypt_buffer_init (&iv);
+   iv.data = stream->iv;
+   iv.len = MONGOCRYPT_IV_LEN;
+   _mongocrypt_buffer_init (&in_buf);
+   in_buf.data = (uint8_t *) in;
+   in_buf.len = len;
+   _mongocrypt_buffer_init (&out_buf);
+   out_buf.data = out;
+   out_buf.len = len;
+
+   if (stream->encrypt) {
+      ret = _crypto_aes_256_cbc_encrypt (stream->crypto,
+                                         &enc_key,
+                                         &iv,
+                                         &in_buf,
+                                         &out_buf,
+                                         &bytes_written,
+                                         status);
+      ciphertext = out;
+   } else {
+      ret = _crypto_aes_256_cbc_decrypt (stream->crypto,
+                                         &iv,
+                                         &enc_key,
+                                         &in_buf,
+                                         &out_buf,
+                                         &bytes_written,
+                                         status);
+      ciphertext = in;
+   }
+   if (!ret) {
+      return false;
+   }
+   if (bytes_written != len) {
+      CLIENT_ERR ("AES-256-CBC wrote %d bytes, expected %d",
+                  (int) bytes_written,
+                  (int) len);
+      return false;
+   }
+
+   memcpy (stream->iv,
+           ciphertext + len - MONGOCRYPT_BLOCK_SIZE,
+           MONGOCRYPT_IV_LEN);
+   return _stream_hmac_update (stream, ciphertext, len, status);
+}
+
+
+bool
+_mongocrypt_stream_cipher_init (_mongocrypt_stream_cipher_t *stream,
+                                _mongocrypt_crypto_t *crypto,
+                                bool encrypt,
+                                const _mongocrypt_buffer_t *key,
+                                const _mongocrypt_buffer_t *iv,
+                                const _mongocrypt_buffer_t *associated_data,
+                                mongocrypt_status_t *status)
+{
+   _mongocrypt_buffer_t mac_key;
+   mongocrypt_binary_t mac_key_bin;
+
+   BSON_ASSERT (stream);
+   memset (stream, 0, sizeof (*stream));
+   _mongocrypt_buffer_init (&stream->pending);
+   stream->crypto = crypto;
+   stream->encrypt = encrypt;
+
+   if (key->len != MONGOCRYPT_KEY_LEN) {
+      CLIENT_ERR ("key should have length %d, but has length %d",
+                  MONGOCRYPT_KEY_LEN,
+                  key->len);
+      return false;
+   }
+   if (iv->len != MONGOCRYPT_IV_LEN) {
+      CLIENT_ERR ("IV should have length %d, but has length %d",
+                  MONGOCRYPT_IV_LEN,
+                  iv->len);
+      return false;
+   }
+   if (!_mongocrypt_crypto_is_native (
+          crypto, MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512) &&
+       !crypto->hmac_sha_512_init) {
+      CLIENT_ERR ("streaming requires the incremental HMAC-SHA-512 hooks");
+      return false;
+   }
+   if (!_mongocrypt_crypto_is_native (
+          crypto, MONGOCRYPT_CRYPTO_PRIMITIVE_AES_256_CBC) &&
+       !(encrypt ? crypto->aes_256_cbc_encrypt : crypto->aes_256_cbc_decrypt)) {
+      CLIENT_ERR ("streaming requires the AES-256-CBC hooks");
+      return false;
+   }
+
+   memcpy (stream->key, key->data, MONGOCRYPT_KEY_LEN);
+   memcpy (stream->iv, iv->data, MONGOCRYPT_IV_LEN);
+   stream->associated_data_len = associated_data->len;
+
+   _mongocrypt_buffer_init (&mac_key);
+   mac_key.data = stream->key;
+   mac_key.len = MONGOCRYPT_MAC_KEY_LEN;
+   if (_mongocrypt_crypto_is_native (
+          crypto, MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512)) {
+      stream->hmac = _native_crypto_hmac_sha_512_new (&mac_key, status);
+      if (!stream->hmac) {
+         return false;
+      }
+   } else {
+      _mongocrypt_buffer_to_binary (&mac_key, &mac_key_bin);
+      if (!crypto->hmac_sha_512_init (
+             crypto->ctx, &mac_key_bin, &stream->hmac_ctx, status)) {
+         return false;
+      }
+   }
+   stream->hmac_started = true;
+
+   /* [MCGREW]: the HMAC is over A || IV || C || AL. */
+   return _stream_hmac_update (
+             stream, associated_data->data, associated_data->len, status) &&
+          _stream_hmac_update (stream, stream->iv, MONGOCRYPT_IV_LEN, status);
+}
+
+
+bool
+_mongocrypt_stream_cipher_update (_mongocrypt_stream_cipher_t *stream,
+                                  const _mongocrypt_buffer_t *in,
+                                  _mongocrypt_buffer_t *out,
+                                  mongocrypt_status_t *status)
+{
+   _mongocrypt_buffer_t parts[2];
+   _mongocrypt_buffer_t work;
+   uint32_t held;
+   uint32_t process = 0;
+   bool ret = false;
+
+   _mongocrypt_buffer_init (out);
+   if (!stream->hmac_started) {
+      CLIENT_ERR ("stream is not in progress");
+      return false;
+   }
+   if (in->len == 0) {
+      return true;
+   }
+
+   parts[0] = stream->pending;
+   parts[1] = *in;
+   _mongocrypt_buffer_init (&work);
+   if (!_mongocrypt_buffer_concat (&work, parts, 2)) {
+      CLIENT_ERR ("stream chunk too large");
+      return false;
+   }
+
+   held = stream->encrypt ? 0 : MONGOCRYPT_BLOCK_SIZE + MONGOCRYPT_HMAC_LEN;
+   if (work.len > held) {
+      process = work.len - held;
+      process -= process % MONGOCRYPT_BLOCK_SIZE;
+   }
+   if (process > 0) {
+      _mongocrypt_buffer_resize (out, process);
+      if (!_stream_cbc (stream, work.data, process, out->data, status)) {
+         _mongocrypt_buffer_cleanup (out);
+         _mongocrypt_buffer_init (out);
+         goto done;
+      }
+   }
+
+   _mongocrypt_buffer_cleanup (&stream->pending);
+   _mongocrypt_buffer_init (&stream->pending);
+   if (work.len > process) {
+      _mongocrypt_buffer_resize (&stream->pending, work.len - process);
+      memcpy (stream->pending.data, work.data + process, work.len - process);
+   }
+   ret = true;
+done:
+   _mongocrypt_buffer_cleanup (&work);
+   return ret;
+}
+
+
+bool
+_mongocrypt_stream_cipher_final (_mongocrypt_stream_cipher_t *stream,
+                                 _mongocrypt_buffer_t *out,
+                                 mongocrypt_status_t *status)
+{
+   uint8_t block[MONGOCRYPT_BLOCK_SIZE];
+   uint8_t tag[MONGOCRYPT_HMAC_LEN];
+   uint8_t padding_byte;
+   uint32_t pending_len = stream->pending.len;
+
+   _mongocrypt_buffer_init (out);
+   if (!stream->hmac_started) {
+      CLIENT_ERR ("stream is not in progress");
+      return false;
+   }
+
+   if (stream->encrypt) {
+      /* [MCGREW 2.1]: PKCS #7 padding, always at least one byte. */
+      BSON_ASSERT (pending_len < MONGOCRYPT_BLOCK_SIZE);
+      padding_byte = (uint8_t) (MONGOCRYPT_BLOCK_SIZE - pending_len);
+      if (pending_len > 0) {
+         memcpy (block, stream->pending.data, pending_len);
+      }
+      memset (block + pending_len, padding_byte, padding_byte);
+
+      _mongocrypt_buffer_resize (out,
+                                 MONGOCRYPT_BLOCK_SIZE + MONGOCRYPT_HMAC_LEN);
+      if (!_stream_cbc (
+             stream, block, MONGOCRYPT_BLOCK_SIZE, out->data, status) ||
+          !_stream_hmac_final (
+             stream, out->data + MONGOCRYPT_BLOCK_SIZE, status)) {
+         _mongocrypt_buffer_cleanup (out);
+         _mongocrypt_buffer_init (out);
+         return false;
+      }
+      return true;
+   }
+
+   if (pending_len != MONGOCRYPT_BLOCK_SIZE + MONGOCRYPT_HMAC_LEN) {
+      CLIENT_ERR ("malformed ciphertext, too small");
+      return false;
+   }
+   if (!_stream_cbc (stream,
+                     stream->pending.data,
+                     MONGOCRYPT_BLOCK_SIZE,
+                     block,
+                     status) ||
+       !_stream_hmac_final (stream, tag, status)) {
+      return false;
+   }
+
+   /* [MCGREW] "using a comparison routine that takes constant time". */
+   if (0 != _mongocrypt_memequal (tag,
+                                  stream->pending.data + MONGOCRYPT_BLOCK_SIZE,
+                                  MONGOCRYPT_HMAC_LEN)) {
+      memset (block, 0, sizeof (block));
+      CLIENT_ERR ("HMAC validation failure");
+      return false;
+   }
+
+   padding_byte = block[MONGOCRYPT_BLOCK_SIZE - 1];
+   if (padding_byte == 0 || padding_byte > MONGOCRYPT_BLOCK_SIZE) {
+      CLIENT_ERR ("error, ciphertext malformed padding");
+      return false;
+   }
+   if (padding_byte < MONGOCRYPT_BLOCK_SIZE) {
+      _mongocrypt_buffer_resize (out, MONGOCRYPT_BLOCK_SIZE - padding_byte);
+      memcpy (out->data, block, out->len);
+   }
+   memset (block, 0, sizeof (block));
+   return true;
+}
+
+
+void
+_mongocrypt_stream_cipher_cleanup (_mongocrypt_stream_cipher_t *stream)
+{
+   mongocrypt_status_t *abandon_status;
+
+   if (!stream) {
+      return;
+   }
+   if (stream->hmac) {
+      _native_crypto_hmac_destroy (stream->hmac);
+   } else if (stream->hmac_started) {
+      /* Let the hook release its state. */
+      abandon_status = mongocrypt_status_new ();
+      (void) stream->crypto->hmac_sha_512_final (
+         stream->crypto->ctx, stream->hmac_ctx, NULL, abandon_status);
+      mongocrypt_status_destroy (abandon_status);
+   }
+   _mongocrypt_buffer_cleanup (&stream->pending);
+   memset (stream, 0, sizeof (*stream));
+}
+
+
 /* ----------------------------------------------------------------------------
  *
  * _mongocrypt_random --
@@ -813,6 +2571,87 @@ _mongocrypt_random (_mongocrypt_crypto_t *crypto,
 }
 
 
+void
+_mongocrypt_random_pool_init (_mongocrypt_random_pool_t *pool)
+{
+   _mongocrypt_mutex_init (&pool->mutex);
+   pool->avail = 0;
+   pool->pid = 0;
+}
+
+
+void
+_mongocrypt_random_pool_cleanup (_mongocrypt_random_pool_t *pool)
+{
+   memset (pool->bytes, 0, sizeof (pool->bytes));
+   _mongocrypt_mutex_cleanup (&pool->mutex);
+}
+
+
+void
+_mongocrypt_random_pool_after_fork (_mongocrypt_random_pool_t *pool)
+{
+   memset (pool->bytes, 0, sizeof (pool->bytes));
+   _mongocrypt_random_pool_init (pool);
+}
+
+
+bool
+_mongocrypt_random_pool_take (_mongocrypt_random_pool_t *pool,
+                              _mongocrypt_crypto_t *crypto,
+                              _mongocrypt_buffer_t *out,
+                              uint32_t count,
+                              mongocrypt_status_t *status)
+{
+   _mongocrypt_buffer_t block;
+   uint8_t *taken;
+   int64_t pid;
+   bool ret = false;
+
+   BSON_ASSERT (pool);
+   BSON_ASSERT (out);
+   BSON_ASSERT (status);
+   if (count != out->len) {
+      CLIENT_ERR (
+         "out should have length %d, but has length %d", count, out->len);
+      return false;
+   }
+
+   if (count > MONGOCRYPT_RANDOM_POOL_LEN) {
+      return _crypto_random (crypto, out, count, status);
+   }
+
+   pid = _mongocrypt_getpid ();
+   _mongocrypt_mutex_lock (&pool->mutex);
+   if (pool->pid != pid) {
+      /* Never filled, or filled by the parent of a fork. */
+      pool->avail = 0;
+      pool->pid = pid;
+   }
+
+   if (pool->avail < count) {
+      _mongocrypt_buffer_init (&block);
+      block.data = pool->bytes;
+      block.len = MONGOCRYPT_RANDOM_POOL_LEN;
+      if (!_crypto_random (
+             crypto, &block, MONGOCRYPT_RANDOM_POOL_LEN, status)) {
+         pool->avail = 0;
+         goto done;
+      }
+      pool->avail = MONGOCRYPT_RANDOM_POOL_LEN;
+   }
+
+   taken = pool->bytes + (MONGOCRYPT_RANDOM_POOL_LEN - pool->avail);
+   memcpy (out->data, taken, count);
+   memset (taken, 0, count);
+   pool->avail -= count;
+   ret = true;
+
+done:
+   _mongocrypt_mutex_unlock (&pool->mutex);
+   return ret;
+}
+
 /* ----------------------------------------------------------------------------
  *
  * _mongocrypt_calculate_deterministic_iv --
@@ -839,20 +2678,17 @@ bool
 _mongocrypt_calculate_deterministic_iv (
    _mongocrypt_crypto_t *crypto,
    const _mongocrypt_buffer_t *key,
+   _native_crypto_key_t *native_key,
    const _mongocrypt_buffer_t *plaintext,
    const _mongocrypt_buffer_t *associated_data,
    _mongocrypt_buffer_t *out,
    mongocrypt_status_t *status)
 {
    _mongocrypt_buffer_t intermediates[3];
-   _mongocrypt_buffer_t to_hmac;
    _mongocrypt_buffer_t iv_key;
    uint64_t associated_data_len_be;
    uint8_t tag_storage[64];
    _mongocrypt_buffer_t tag;
-   bool ret = false;
-
-   _mongocrypt_buffer_init (&to_hmac);
 
    BSON_ASSERT (key);
    BSON_ASSERT (plaintext);
@@ -864,13 +2700,13 @@ _mongocrypt_calculate_deterministic_iv (
       CLIENT_ERR ("key should have length %d, but has length %d\n",
                   MONGOCRYPT_KEY_LEN,
                   key->len);
-      goto done;
+      return false;
    }
    if (MONGOCRYPT_IV_LEN != out->len) {
       CLIENT_ERR ("out should have length %d, but has length %d\n",
                   MONGOCRYPT_IV_LEN,
                   out->len);
-      goto done;
+      return false;
    }
 
    _mongocrypt_buffer_init (&iv_key);
@@ -895,20 +2731,18 @@ _mongocrypt_calculate_deterministic_iv (
    tag.data = tag_storage;
    tag.len = sizeof (tag_storage);
 
-   if (!_mongocrypt_buffer_concat (&to_hmac, intermediates, 3)) {
-      CLIENT_ERR ("failed to allocate buffer");
-      goto done;
-   }
-
-   if (!_crypto_hmac_sha_512 (crypto, &iv_key, &to_hmac, &tag, status)) {
-      goto done;
+   if (!_crypto_hmac_sha_512_parts (crypto,
+                                    &iv_key,
+                                    native_key,
+                                    true,
+                                    intermediates,
+                                    3,
+                                    &tag,
+                                    status)) {
+      return false;
    }
 
    /* Truncate to IV length */
    memcpy (out->data, tag.data, MONGOCRYPT_IV_LEN);
-
-   ret = true;
-done:
-   _mongocrypt_buffer_cleanup (&to_hmac);
-   return ret;
+   return true;
 }
\ No newline at end of file
@@ -0,0 +1,777 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt.h"
+#include "mongocrypt-private.h"
+#include "mongocrypt-ciphertext-private.h"
+#include "mongocrypt-compress-private.h"
+#include "mongocrypt-crypto-private.h"
+#include "mongocrypt-ctx-private.h"
+
+/* Values are encrypted or decrypted this many at a time, so the jobs in
+ * flight take little memory however long the column is. */
+#define CHUNK_LEN 256
+
+/* The blob subtype, key id, and original BSON type before each ciphertext. */
+#define HEADER_LEN 18
+
+
+/* The length of a value of @bson_type, or 0 if its length varies. */
+static uint32_t
+_fixed_len (uint8_t bson_type)
+{
+   switch (bson_type) {
+   case BSON_TYPE_DOUBLE:
+   case BSON_TYPE_INT64:
+      return 8;
+   case BSON_TYPE_INT32:
+      return 4;
+   default:
+      return 0;
+   }
+}
+
+
+static void
+_cleanup (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_column_t *cctx;
+
+   cctx = (_mongocrypt_ctx_column_t *) ctx;
+   _mongocrypt_buffer_cleanup (&cctx->in);
+   _mongocrypt_buffer_cleanup (&cctx->out);
+   bson_free (cctx->in_offsets);
+   bson_free (cctx->out_offsets);
+}
+
+
+static _mongocrypt_buffer_t *
+_result (mongocrypt_ctx_t *ctx)
+{
+   return &((_mongocrypt_ctx_column_t *) ctx)->out;
+}
+
+
+/* View value @i of the input in @out. */
+static void
+_in_value (_mongocrypt_ctx_column_t *cctx,
+           uint32_t i,
+           _mongocrypt_buffer_t *out)
+{
+   _mongocrypt_buffer_init (out);
+   out->data = cctx->in.data + cctx->in_offsets[i];
+   out->len = cctx->in_offsets[i + 1] - cctx->in_offsets[i];
+}
+
+
+/* The length of value @i as a BSON value, which is what is encrypted. A
+ * string is prefixed by its length and ends with a NUL. */
+static uint32_t
+_plaintext_len (_mongocrypt_ctx_column_t *cctx, uint32_t i)
+{
+   uint32_t len;
+
+   len = cctx->in_offsets[i + 1] - cctx->in_offsets[i];
+   return cctx->bson_type == BSON_TYPE_UTF8 ? len + 5u : len;
+}
+
+
+/* Encrypt values [start, start + n), whose output is already laid out. */
+static bool
+_encrypt_chunk (mongocrypt_ctx_t *ctx,
+                const _mongocrypt_buffer_t *key,
+                _native_crypto_key_t *native_key,
+                const _mongocrypt_buffer_t *associated_data,
+                uint32_t start,
+                uint32_t n,
+                _mongocrypt_encryption_job_t *jobs,
+                _mongocrypt_buffer_t *ciphertexts,
+                _mongocrypt_buffer_t *scratch)
+{
+   _mongocrypt_ctx_column_t *cctx;
+   _mongocrypt_crypto_t *crypto;
+   _mongocrypt_buffer_t ivs;
+   uint32_t i, scratch_len = 0;
+   uint8_t *pos;
+   bool deterministic;
+
+   cctx = (_mongocrypt_ctx_column_t *) ctx;
+   crypto = ctx->crypt->crypto;
+   deterministic =
+      ctx->opts.algorithm == MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC;
+
+   /* Strings are encoded as BSON values in one scratch buffer. */
+   if (cctx->bson_type == BSON_TYPE_UTF8) {
+      for (i = 0; i < n; i++) {
+         scratch_len += _plaintext_len (cctx, start + i);
+      }
+   }
+
+   /* The IVs follow the strings. Deterministic IVs are computed later. */
+   if (scratch->len < scratch_len + n * MONGOCRYPT_IV_LEN) {
+      _mongocrypt_buffer_resize (scratch, scratch_len + n * MONGOCRYPT_IV_LEN);
+   }
+   _mongocrypt_buffer_init (&ivs);
+   ivs.data = scratch->data + scratch_len;
+   ivs.len = n * MONGOCRYPT_IV_LEN;
+   if (!deterministic &&
+       !_mongocrypt_random_pool_take (&ctx->crypt->random_pool,
+                                      crypto,
+                                      &ivs,
+                                      ivs.len,
+                                      ctx->status)) {
+      return false;
+   }
+
+   pos = scratch->data;
+   for (i = 0; i < n; i++) {
+      _mongocrypt_encryption_job_t *job = &jobs[i];
+      uint32_t offset;
+
+      _mongocrypt_encryption_job_init (job);
+      _mongocrypt_buffer_set_to (key, &job->key);
+      job->native_key = native_key;
+      job->deterministic = deterministic;
+      job->iv.data = ivs.data + i * MONGOCRYPT_IV_LEN;
+      job->iv.len = MONGOCRYPT_IV_LEN;
+      _mongocrypt_buffer_set_to (associated_data, &job->associated_data);
+      _in_value (cctx, start + i, &job->plaintext);
+      if (cctx->bson_type == BSON_TYPE_UTF8) {
+         uint32_t len_le;
+
+         len_le = BSON_UINT32_TO_LE (job->plaintext.len + 1u);
+         memcpy (pos, &len_le, 4);
+         if (job->plaintext.len) {
+            memcpy (pos + 4, job->plaintext.data, job->plaintext.len);
+         }
+         pos[4 + job->plaintext.len] = 0;
+         job->plaintext.data = pos;
+         job->plaintext.len += 5u;
+         pos += job->plaintext.len;
+      }
+
+      offset = cctx->out_offsets[start + i] + HEADER_LEN;
+      _mongocrypt_buffer_init (&ciphertexts[i]);
+      ciphertexts[i].data = cctx->out.data + offset;
+      ciphertexts[i].len = cctx->out_offsets[start + i + 1] - offset;
+      job->ciphertext = &ciphertexts[i];
+   }
+
+   if (_mongocrypt_crypto_uses_batch (crypto) ||
+       _mongocrypt_crypto_uses_multi_buffer (crypto)) {
+      return _mongocrypt_do_encryption_batch (crypto, jobs, n, ctx->status);
+   }
+
+   for (i = 0; i < n; i++) {
+      _mongocrypt_encryption_job_t *job = &jobs[i];
+      uint32_t bytes_written;
+
+      if (deterministic &&
+          !_mongocrypt_calculate_deterministic_iv (crypto,
+                                                   &job->key,
+                                                   job->native_key,
+                                                   &job->plaintext,
+                                                   &job->associated_data,
+                                                   &job->iv,
+                                                   ctx->status)) {
+         return false;
+      }
+      if (!_mongocrypt_do_encryption (crypto,
+                                      &job->iv,
+                                      &job->associated_data,
+                                      &job->key,
+                                      job->native_key,
+                                      &job->plaintext,
+                                      job->ciphertext,
+                                      &bytes_written,
+                                      ctx->status)) {
+         return false;
+      }
+      BSON_ASSERT (bytes_written == job->ciphertext->len);
+   }
+   return true;
+}
+
+
+static bool
+_finalize_encrypt (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_column_t *cctx;
+   _mongocrypt_ciphertext_t ciphertext;
+   _mongocrypt_buffer_t key, key_id, associated_data, scratch;
+   _mongocrypt_buffer_t *ciphertexts = NULL;
+   _mongocrypt_encryption_job_t *jobs = NULL;
+   _native_crypto_key_t *native_key = NULL;
+   uint8_t header[HEADER_LEN];
+   uint64_t total = 0;
+   uint32_t i;
+   bool ret = false;
+
+   cctx = (_mongocrypt_ctx_column_t *) ctx;
+   _mongocrypt_ciphertext_init (&ciphertext);
+   _mongocrypt_buffer_init (&key);
+   _mongocrypt_buffer_init (&key_id);
+   _mongocrypt_buffer_init (&associated_data);
+   _mongocrypt_buffer_init (&scratch);
+
+   /* Every value has the same key, so look it up once. */
+   if (ctx->opts.key_alt_names) {
+      if (!_mongocrypt_key_broker_decrypted_key_by_name (
+             &ctx->kb,
+             &ctx->opts.key_alt_names->value,
+             &key,
+             &key_id,
+             &native_key)) {
+         _mongocrypt_key_broker_status (&ctx->kb, ctx->status);
+         _mongocrypt_ctx_fail (ctx);
+         goto fail;
+      }
+   } else {
+      const _mongocrypt_buffer_t *borrowed;
+
+      if (!_mongocrypt_key_broker_borrow_decrypted_key (
+             &ctx->kb, &ctx->opts.key_id, &borrowed, &native_key)) {
+         _mongocrypt_key_broker_status (&ctx->kb, ctx->status);
+         _mongocrypt_ctx_fail (ctx);
+         goto fail;
+      }
+      _mongocrypt_buffer_set_to (borrowed, &key);
+      _mongocrypt_buffer_copy_to (&ctx->opts.key_id, &key_id);
+   }
+
+   /* So is the associated data, and the header of every ciphertext. */
+   ciphertext.blob_subtype = (uint8_t) ctx->opts.algorithm;
+   ciphertext.original_bson_type = cctx->bson_type;
+   _mongocrypt_buffer_copy_to (&key_id, &ciphertext.key_id);
+   if (key_id.len != 16 ||
+       !_mongocrypt_ciphertext_serialize_associated_data (&ciphertext,
+                                                         &associated_data)) {
+      _mongocrypt_ctx_fail_w_msg (ctx, "could not serialize associated data");
+      goto fail;
+   }
+   header[0] = ciphertext.blob_subtype;
+   memcpy (header + 1, key_id.data, 16);
+   header[17] = ciphertext.original_bson_type;
+
+   /* Lay out the output, so each value is encrypted in place. */
+   cctx->out_offsets =
+      bson_malloc (sizeof (uint32_t) * ((size_t) cctx->count + 1u));
+   BSON_ASSERT (cctx->out_offsets);
+   for (i = 0; i < cctx->count; i++) {
+      cctx->out_offsets[i] = (uint32_t) total;
+      total += HEADER_LEN + _mongocrypt_calculate_ciphertext_len (
+                               _plaintext_len (cctx, i));
+      if (total > UINT32_MAX) {
+         _mongocrypt_ctx_fail_w_msg (ctx, "encrypted column too large");
+         goto fail;
+      }
+   }
+   cctx->out_offsets[cctx->count] = (uint32_t) total;
+   _mongocrypt_buffer_resize (&cctx->out, (uint32_t) total);
+   for (i = 0; i < cctx->count; i++) {
+      memcpy (cctx->out.data + cctx->out_offsets[i], header, HEADER_LEN);
+   }
+
+   jobs = bson_malloc (sizeof (*jobs) * CHUNK_LEN);
+   BSON_ASSERT (jobs);
+   ciphertexts = bson_malloc (sizeof (*ciphertexts) * CHUNK_LEN);
+   BSON_ASSERT (ciphertexts);
+   for (i = 0; i < cctx->count; i += CHUNK_LEN) {
+      if (!_encrypt_chunk (ctx,
+                           &key,
+                           native_key,
+                           &associated_data,
+                           i,
+                           BSON_MIN (CHUNK_LEN, cctx->count - i),
+                           jobs,
+                           ciphertexts,
+                           &scratch)) {
+         _mongocrypt_ctx_fail (ctx);
+         goto fail;
+      }
+   }
+
+   _mongocrypt_atomic_add_int64 (&ctx->crypt->stats.fields_encrypted,
+                                 cctx->count);
+   ctx->timings.fields += cctx->count;
+   ret = true;
+
+fail:
+   bson_free (jobs);
+   bson_free (ciphertexts);
+   _mongocrypt_ciphertext_cleanup (&ciphertext);
+   _mongocrypt_buffer_cleanup (&key);
+   _mongocrypt_buffer_cleanup (&key_id);
+   _mongocrypt_buffer_cleanup (&associated_data);
+   _mongocrypt_buffer_cleanup (&scratch);
+   return ret;
+}
+
+
+/* Append @len bytes to the output of a string column. */
+static void
+_append (_mongocrypt_ctx_column_t *cctx,
+         uint32_t *used,
+         const uint8_t *data,
+         uint32_t len)
+{
+   if (cctx->out.len - *used < len) {
+      uint64_t capacity;
+
+      /* Resizing an owned buffer keeps its data. */
+      capacity = BSON_MAX ((uint64_t) cctx->out.len * 2u,
+                           (uint64_t) *used + len);
+      BSON_ASSERT (capacity <= UINT32_MAX);
+      _mongocrypt_buffer_resize (&cctx->out, (uint32_t) capacity);
+   }
+   if (len) {
+      memcpy (cctx->out.data + *used, data, len);
+   }
+   *used += len;
+}
+
+
+/* Write the decrypted BSON value @plaintext as value @i of the output. */
+static bool
+_write_plaintext (mongocrypt_ctx_t *ctx,
+                  uint32_t i,
+                  const _mongocrypt_buffer_t *plaintext,
+                  uint32_t *used)
+{
+   _mongocrypt_ctx_column_t *cctx;
+   uint32_t len;
+
+   cctx = (_mongocrypt_ctx_column_t *) ctx;
+   cctx->out_offsets[i] = *used;
+   if (cctx->bson_type != BSON_TYPE_UTF8) {
+      if (plaintext->len != _fixed_len (cctx->bson_type)) {
+         return _mongocrypt_ctx_fail_w_msg (ctx, "malformed encrypted bson");
+      }
+      _append (cctx, used, plaintext->data, plaintext->len);
+      return true;
+   }
+
+   if (plaintext->len < 5) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed encrypted bson");
+   }
+   memcpy (&len, plaintext->data, 4);
+   len = BSON_UINT32_FROM_LE (len);
+   if (len != plaintext->len - 4u || plaintext->data[plaintext->len - 1]) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed encrypted bson");
+   }
+   _append (cctx, used, plaintext->data + 4, len - 1u);
+   return true;
+}
+
+
+/* Decrypt values [start, start + n), and append them to the output. */
+static bool
+_decrypt_chunk (mongocrypt_ctx_t *ctx,
+                uint32_t start,
+                uint32_t n,
+                _mongocrypt_decryption_job_t *jobs,
+                _mongocrypt_ciphertext_t *ciphertexts,
+                _native_crypto_key_t **native_keys,
+                _mongocrypt_buffer_t *scratch,
+                uint32_t *used)
+{
+   _mongocrypt_ctx_column_t *cctx;
+   _mongocrypt_crypto_t *crypto;
+   uint64_t scratch_len = 0;
+   uint32_t i;
+   uint8_t *pos;
+
+   cctx = (_mongocrypt_ctx_column_t *) ctx;
+   crypto = ctx->crypt->crypto;
+
+   for (i = 0; i < n; i++) {
+      _mongocrypt_buffer_t in;
+      const _mongocrypt_buffer_t *key;
+
+      _mongocrypt_decryption_job_init (&jobs[i]);
+      _in_value (cctx, start + i, &in);
+      if (!_mongocrypt_ciphertext_parse_unowned (
+             &in, &ciphertexts[i], ctx->status)) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
+      if (!_mongocrypt_key_broker_borrow_decrypted_key (
+             &ctx->kb, &ciphertexts[i].key_id, &key, &native_keys[i])) {
+         return _mongocrypt_ctx_fail_w_msg (ctx, "key not found");
+      }
+      _mongocrypt_buffer_set_to (key, &jobs[i].key);
+      _mongocrypt_buffer_set_to (&ciphertexts[i].data, &jobs[i].ciphertext);
+      if (!_mongocrypt_ciphertext_associated_data_unowned (
+             &ciphertexts[i], &in, &jobs[i].associated_data)) {
+         return _mongocrypt_ctx_fail_w_msg (
+            ctx, "could not serialize associated data");
+      }
+      scratch_len +=
+         _mongocrypt_calculate_plaintext_len (ciphertexts[i].data.len);
+   }
+
+   /* Decrypt into one scratch buffer, since plaintexts are padded. */
+   if (scratch_len > UINT32_MAX) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "encrypted column too large");
+   }
+   if (scratch->len < scratch_len) {
+      _mongocrypt_buffer_resize (scratch, (uint32_t) scratch_len);
+   }
+   pos = scratch->data;
+   for (i = 0; i < n; i++) {
+      jobs[i].plaintext.data = pos;
+      jobs[i].plaintext.len =
+         _mongocrypt_calculate_plaintext_len (ciphertexts[i].data.len);
+      pos += jobs[i].plaintext.len;
+   }
+
+   if (_mongocrypt_crypto_uses_batch (crypto)) {
+      if (!_mongocrypt_do_decryption_batch (crypto, jobs, n, ctx->status)) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
+   } else {
+      for (i = 0; i < n; i++) {
+         if (!_mongocrypt_do_decryption (crypto,
+                                         &jobs[i].associated_data,
+                                         &jobs[i].key,
+                                         native_keys[i],
+                                         &jobs[i].ciphertext,
+                                         &jobs[i].plaintext,
+                                         &jobs[i].bytes_written,
+                                         ctx->status)) {
+            return _mongocrypt_ctx_fail (ctx);
+         }
+      }
+   }
+
+   for (i = 0; i < n; i++) {
+      _mongocrypt_buffer_t decompressed;
+      bool ok;
+
+      jobs[i].plaintext.len = jobs[i].bytes_written;
+      if (ciphertexts[i].blob_subtype !=
+          MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM_COMPRESSED) {
+         if (!_write_plaintext (ctx, start + i, &jobs[i].plaintext, used)) {
+            return false;
+         }
+         continue;
+      }
+      if (!_mongocrypt_decompress (
+             &jobs[i].plaintext, &decompressed, ctx->status)) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
+      ok = _write_plaintext (ctx, start + i, &decompressed, used);
+      _mongocrypt_buffer_cleanup (&decompressed);
+      if (!ok) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+static bool
+_finalize_decrypt (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_column_t *cctx;
+   _mongocrypt_decryption_job_t *jobs;
+   _mongocrypt_ciphertext_t *ciphertexts;
+   _native_crypto_key_t **native_keys;
+   _mongocrypt_buffer_t scratch;
+   uint32_t i, used = 0;
+   bool ret = true;
+
+   cctx = (_mongocrypt_ctx_column_t *) ctx;
+   cctx->out_offsets =
+      bson_malloc (sizeof (uint32_t) * ((size_t) cctx->count + 1u));
+   BSON_ASSERT (cctx->out_offsets);
+   /* Each plaintext is shorter than its ciphertext, unless compressed. */
+   if (cctx->bson_type == BSON_TYPE_UTF8) {
+      _mongocrypt_buffer_resize (&cctx->out, cctx->in.len);
+   } else {
+      _mongocrypt_buffer_resize (&cctx->out,
+                                 cctx->count * _fixed_len (cctx->bson_type));
+   }
+
+   jobs = bson_malloc (sizeof (*jobs) * CHUNK_LEN);
+   BSON_ASSERT (jobs);
+   ciphertexts = bson_malloc (sizeof (*ciphertexts) * CHUNK_LEN);
+   BSON_ASSERT (ciphertexts);
+   native_keys = bson_malloc (sizeof (*native_keys) * CHUNK_LEN);
+   BSON_ASSERT (native_keys);
+   _mongocrypt_buffer_init (&scratch);
+   for (i = 0; i < cctx->count && ret; i += CHUNK_LEN) {
+      ret = _decrypt_chunk (ctx,
+                            i,
+                            BSON_MIN (CHUNK_LEN, cctx->count - i),
+                            jobs,
+                            ciphertexts,
+                            native_keys,
+                            &scratch,
+                            &used);
+   }
+   bson_free (jobs);
+   bson_free (ciphertexts);
+   bson_free (native_keys);
+   _mongocrypt_buffer_cleanup (&scratch);
+   if (!ret) {
+      return false;
+   }
+
+   cctx->out_offsets[cctx->count] = used;
+   cctx->out.len = used;
+   _mongocrypt_atomic_add_int64 (&ctx->crypt->stats.fields_decrypted,
+                                 cctx->count);
+   ctx->timings.fields += cctx->count;
+   return true;
+}
+
+
+static bool
+_finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   _mongocrypt_ctx_column_t *cctx;
+
+   cctx = (_mongocrypt_ctx_column_t *) ctx;
+   if (cctx->encrypt ? !_finalize_encrypt (ctx) : !_finalize_decrypt (ctx)) {
+      return false;
+   }
+   _mongocrypt_buffer_to_binary (&cctx->out, out);
+   ctx->state = MONGOCRYPT_CTX_DONE;
+   return true;
+}
+
+
+/* Shared by encrypt_column_init and decrypt_column_init. Copies the values,
+ * and sets the offsets of each. */
+static bool
+_column_init (mongocrypt_ctx_t *ctx,
+              uint8_t bson_type,
+              mongocrypt_binary_t *values,
+              const uint32_t *offsets,
+              uint32_t count)
+{
+   _mongocrypt_ctx_column_t *cctx;
+   uint32_t i, fixed_len;
+
+   cctx = (_mongocrypt_ctx_column_t *) ctx;
+   ctx->type = _MONGOCRYPT_TYPE_COLUMN;
+   ctx->vtable.finalize = _finalize;
+   ctx->vtable.result = _result;
+   ctx->vtable.cleanup = _cleanup;
+   cctx->bson_type = bson_type;
+   cctx->count = count;
+
+   if (bson_type != BSON_TYPE_UTF8 && !_fixed_len (bson_type)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "unsupported column type");
+   }
+   if (!values || !values->data || count == 0) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid column");
+   }
+   if (count > (UINT32_MAX - 1u) / sizeof (uint32_t)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "column too large");
+   }
+
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
+      _mongocrypt_log (&ctx->crypt->log,
+                       MONGOCRYPT_LOG_LEVEL_TRACE,
+                       "%s (%s=%d, %s=%u, %s=%u)",
+                       BSON_FUNC,
+                       "bson_type",
+                       (int) bson_type,
+                       "len",
+                       values->len,
+                       "count",
+                       count);
+   }
+
+   _mongocrypt_buffer_copy_from_binary (&cctx->in, values);
+   cctx->in_offsets = bson_malloc (sizeof (uint32_t) * ((size_t) count + 1u));
+   BSON_ASSERT (cctx->in_offsets);
+
+   /* Encrypted values vary in length, since strings do. */
+   fixed_len = cctx->encrypt ? _fixed_len (bson_type) : 0;
+   if (fixed_len) {
+      if (offsets) {
+         return _mongocrypt_ctx_fail_w_msg (
+            ctx, "offsets must not be set for a fixed length type");
+      }
+      if ((uint64_t) count * fixed_len != values->len) {
+         return _mongocrypt_ctx_fail_w_msg (
+            ctx, "column length does not match count");
+      }
+      for (i = 0; i <= count; i++) {
+         cctx->in_offsets[i] = i * fixed_len;
+      }
+      return true;
+   }
+
+   if (!offsets) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "offsets required");
+   }
+   memcpy (
+      cctx->in_offsets, offsets, sizeof (uint32_t) * ((size_t) count + 1u));
+   for (i = 0; i < count; i++) {
+      if (cctx->in_offsets[i] > cctx->in_offsets[i + 1]) {
+         return _mongocrypt_ctx_fail_w_msg (ctx, "offsets must not decrease");
+      }
+   }
+   if (cctx->in_offsets[count] > values->len) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "offsets exceed column length");
+   }
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_explicit_encrypt_column_init (mongocrypt_ctx_t *ctx,
+                                             uint8_t bson_type,
+                                             mongocrypt_binary_t *values,
+                                             const uint32_t *offsets,
+                                             uint32_t count)
+{
+   _mongocrypt_ctx_column_t *cctx;
+   _mongocrypt_ctx_opts_spec_t opts_spec;
+   uint32_t i;
+
+   if (!ctx) {
+      return false;
+   }
+   memset (&opts_spec, 0, sizeof (opts_spec));
+   opts_spec.key_descriptor = OPT_REQUIRED;
+   opts_spec.algorithm = OPT_REQUIRED;
+   if (!_mongocrypt_ctx_init (ctx, &opts_spec)) {
+      return false;
+   }
+
+   cctx = (_mongocrypt_ctx_column_t *) ctx;
+   cctx->encrypt = true;
+   if (ctx->opts.algorithm ==
+       MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM_COMPRESSED) {
+      /* The layout of the output is computed before encrypting. */
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "compression is not supported for columns");
+   }
+   if (bson_type == BSON_TYPE_DOUBLE &&
+       ctx->opts.algorithm == MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC) {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "BSON type invalid for deterministic encryption");
+   }
+   if (!_column_init (ctx, bson_type, values, offsets, count)) {
+      return false;
+   }
+   if (bson_type == BSON_TYPE_UTF8) {
+      for (i = 0; i < count; i++) {
+         _mongocrypt_buffer_t value;
+
+         _in_value (cctx, i, &value);
+         if (value.len > INT32_MAX - 5 ||
+             !bson_utf8_validate (
+                (const char *) value.data, value.len, false)) {
+            return _mongocrypt_ctx_fail_w_msg (ctx, "invalid UTF-8 string");
+         }
+      }
+   }
+
+   if (ctx->opts.key_alt_names) {
+      if (!_mongocrypt_key_broker_request_name (
+             &ctx->kb, &ctx->opts.key_alt_names->value)) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
+   } else if (!_mongocrypt_key_broker_request_id (&ctx->kb,
+                                                  &ctx->opts.key_id)) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
+
+   (void) _mongocrypt_key_broker_requests_done (&ctx->kb);
+   return _mongocrypt_ctx_state_from_key_broker (ctx);
+}
+
+
+bool
+mongocrypt_ctx_explicit_decrypt_column_init (mongocrypt_ctx_t *ctx,
+                                             uint8_t bson_type,
+                                             mongocrypt_binary_t *ciphertexts,
+                                             const uint32_t *offsets,
+                                             uint32_t count)
+{
+   _mongocrypt_ctx_column_t *cctx;
+   _mongocrypt_ctx_opts_spec_t opts_spec;
+   _mongocrypt_buffer_t last_key_id;
+   uint32_t i;
+
+   if (!ctx) {
+      return false;
+   }
+   memset (&opts_spec, 0, sizeof (opts_spec));
+   if (!_mongocrypt_ctx_init (ctx, &opts_spec)) {
+      return false;
+   }
+
+   cctx = (_mongocrypt_ctx_column_t *) ctx;
+   if (!_column_init (ctx, bson_type, ciphertexts, offsets, count)) {
+      return false;
+   }
+
+   /* Columns usually have one key, so only request a key id that differs
+    * from the one before. */
+   _mongocrypt_buffer_init (&last_key_id);
+   for (i = 0; i < count; i++) {
+      _mongocrypt_ciphertext_t ciphertext;
+      _mongocrypt_buffer_t in;
+
+      _in_value (cctx, i, &in);
+      if (!_mongocrypt_ciphertext_parse_unowned (
+             &in, &ciphertext, ctx->status)) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
+      if (ciphertext.original_bson_type != bson_type) {
+         return _mongocrypt_ctx_fail_w_msg (
+            ctx, "encrypted value does not have the column type");
+      }
+      if (0 == _mongocrypt_buffer_cmp (&ciphertext.key_id, &last_key_id)) {
+         continue;
+      }
+      if (!_mongocrypt_key_broker_request_id (&ctx->kb, &ciphertext.key_id)) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
+      _mongocrypt_buffer_set_to (&ciphertext.key_id, &last_key_id);
+   }
+
+   (void) _mongocrypt_key_broker_requests_done (&ctx->kb);
+   return _mongocrypt_ctx_state_from_key_broker (ctx);
+}
+
+
+bool
+mongocrypt_ctx_column_offsets (mongocrypt_ctx_t *ctx, const uint32_t **offsets)
+{
+   _mongocrypt_ctx_column_t *cctx;
+
+   if (!ctx) {
+      return false;
+   }
+   if (!offsets) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL input");
+   }
+   cctx = (_mongocrypt_ctx_column_t *) ctx;
+   if (ctx->type != _MONGOCRYPT_TYPE_COLUMN ||
+       ctx->state != MONGOCRYPT_CTX_DONE || !cctx->out_offsets) {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "column context must be finalized first");
+   }
+   *offsets = cctx->out_offsets;
+   return true;
+}
@@ -19,160 +19,222 @@
 #include "mongocrypt-ctx-private.h"
 #include "mongocrypt-crypto-private.h"
 
-static void
-_cleanup (mongocrypt_ctx_t *ctx)
+static _mongocrypt_buffer_t *
+_result (mongocrypt_ctx_t *ctx)
 {
    _mongocrypt_ctx_datakey_t *dkctx;
 
+   dkctx = (_mongocrypt_ctx_datakey_t *) ctx;
+   return &dkctx->key_doc;
+}
+
+
+void
+_mongocrypt_ctx_datakey_cleanup (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_datakey_t *dkctx;
+   uint32_t i;
+
    dkctx = (_mongocrypt_ctx_datakey_t *) ctx;
    _mongocrypt_buffer_cleanup (&dkctx->key_doc);
-   _mongocrypt_kms_ctx_cleanup (&dkctx->kms);
-   _mongocrypt_buffer_cleanup (&dkctx->encrypted_key_material);
-   _mongocrypt_buffer_cleanup (&dkctx->plaintext_key_material);
+   for (i = 0; i < dkctx->n_keys; i++) {
+      _mongocrypt_ctx_datakey_key_t *key = &dkctx->keys[i];
+
+      _mongocrypt_kms_ctx_cleanup (&key->kms);
+      _mongocrypt_buffer_cleanup (&key->encrypted_key_material);
+      _mongocrypt_buffer_cleanup (&key->plaintext_key_material);
+   }
+   bson_free (dkctx->keys);
 }
 
 
-static mongocrypt_kms_ctx_t *
-_next_kms_ctx (mongocrypt_ctx_t *ctx)
+mongocrypt_kms_ctx_t *
+_mongocrypt_ctx_datakey_next_kms_ctx (mongocrypt_ctx_t *ctx)
 {
    _mongocrypt_ctx_datakey_t *dkctx;
 
    dkctx = (_mongocrypt_ctx_datakey_t *) ctx;
-   if (dkctx->kms_returned) {
+   if (dkctx->next_kms >= dkctx->n_kms) {
       return NULL;
    }
-   dkctx->kms_returned = true;
-   return &dkctx->kms;
+   return &dkctx->keys[dkctx->next_kms++].kms;
+}
+
+
+/* Encrypt the key material of @key with the local master key. */
+static bool
+_encrypt_local (mongocrypt_ctx_t *ctx, _mongocrypt_ctx_datakey_key_t *key)
+{
+   bool crypt_ret;
+   uint32_t bytes_written;
+   _mongocrypt_buffer_t iv;
+
+   key->encrypted_key_material.len =
+      _mongocrypt_calculate_ciphertext_len (key->plaintext_key_material.len);
+   key->encrypted_key_material.data =
+      bson_malloc (key->encrypted_key_material.len);
+   key->encrypted_key_material.owned = true;
+   BSON_ASSERT (key->encrypted_key_material.data);
+
+   /* use a random IV. */
+   _mongocrypt_buffer_init (&iv);
+   iv.data = bson_malloc0 (MONGOCRYPT_IV_LEN);
+   BSON_ASSERT (iv.data);
+
+   iv.len = MONGOCRYPT_IV_LEN;
+   iv.owned = true;
+   if (!_mongocrypt_random_pool_take (&ctx->crypt->random_pool,
+                                      ctx->crypt->crypto,
+                                      &iv,
+                                      MONGOCRYPT_IV_LEN,
+                                      ctx->status)) {
+      _mongocrypt_buffer_cleanup (&iv);
+      return _mongocrypt_ctx_fail (ctx);
+   }
+
+   crypt_ret =
+      _mongocrypt_do_encryption (ctx->crypt->crypto,
+                                 &iv,
+                                 NULL /* associated data. */,
+                                 &ctx->crypt->opts.kms_provider_local.key,
+                                 NULL /* native key */,
+                                 &key->plaintext_key_material,
+                                 &key->encrypted_key_material,
+                                 &bytes_written,
+                                 ctx->status);
+   _mongocrypt_buffer_cleanup (&iv);
+   if (!crypt_ret) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
+   return true;
+}
+
+
+/* Create the KMS request to encrypt the key material of @key. For Azure and
+ * GCP, @access_token is the current bearer token. */
+static bool
+_init_kms_encrypt (mongocrypt_ctx_t *ctx,
+                   _mongocrypt_ctx_datakey_key_t *key,
+                   const char *access_token)
+{
+   bool ret;
+
+   if (ctx->opts.kek.kms_provider == MONGOCRYPT_KMS_PROVIDER_AWS) {
+      ret = _mongocrypt_kms_ctx_init_aws_encrypt (
+         &key->kms,
+         &ctx->crypt->opts,
+         &ctx->opts,
+         &key->plaintext_key_material,
+         &ctx->crypt->log,
+         ctx->crypt->crypto,
+         &ctx->crypt->aws_signing_keys);
+   } else if (ctx->opts.kek.kms_provider == MONGOCRYPT_KMS_PROVIDER_AZURE) {
+      ret = _mongocrypt_kms_ctx_init_azure_wrapkey (
+         &key->kms,
+         &ctx->crypt->log,
+         &ctx->crypt->opts,
+         &ctx->opts,
+         access_token,
+         &key->plaintext_key_material);
+   } else {
+      ret = _mongocrypt_kms_ctx_init_gcp_encrypt (
+         &key->kms,
+         &ctx->crypt->log,
+         &ctx->crypt->opts,
+         &ctx->opts,
+         access_token,
+         &key->plaintext_key_material);
+   }
+   if (!ret) {
+      mongocrypt_kms_ctx_status (&key->kms, ctx->status);
+      return _mongocrypt_ctx_fail (ctx);
+   }
+   return true;
 }
 
 /* For local, immediately encrypt.
- * For AWS, create the KMS request to encrypt.
+ * For AWS, create the KMS requests to encrypt.
  * For Azure/GCP, auth first if needed, otherwise encrypt.
+ * Every key is encrypted in the same state, so a batch needs at most one
+ * oauth request and one round of KMS requests.
  */
-static bool
-_kms_start (mongocrypt_ctx_t *ctx)
+bool
+_mongocrypt_ctx_datakey_kms_start (mongocrypt_ctx_t *ctx)
 {
    bool ret = false;
    _mongocrypt_ctx_datakey_t *dkctx;
    char *access_token = NULL;
+   uint32_t i;
 
    dkctx = (_mongocrypt_ctx_datakey_t *) ctx;
 
-   /* Clear out any pre-existing initialized KMS context, and zero it (so it is
-    * safe to call cleanup again). */
-   _mongocrypt_kms_ctx_cleanup (&dkctx->kms);
-   memset (&dkctx->kms, 0, sizeof (dkctx->kms));
-   dkctx->kms_returned = false;
+   /* Clear out any pre-existing initialized KMS contexts, and zero them (so
+    * it is safe to call cleanup again). */
+   for (i = 0; i < dkctx->n_keys; i++) {
+      _mongocrypt_kms_ctx_cleanup (&dkctx->keys[i].kms);
+      memset (&dkctx->keys[i].kms, 0, sizeof (dkctx->keys[i].kms));
+   }
+   dkctx->n_kms = 0;
+   dkctx->next_kms = 0;
    if (ctx->opts.kek.kms_provider == MONGOCRYPT_KMS_PROVIDER_LOCAL) {
-      bool crypt_ret;
-      uint32_t bytes_written;
-      _mongocrypt_buffer_t iv;
-
       /* For a local KMS provider, the customer master key is supplied by the
        * user in mongocrypt_setopt_kms_provider_local. We use it to
        * encrypt/decrypt data keys directly. */
-      dkctx->encrypted_key_material.len = _mongocrypt_calculate_ciphertext_len (
-         dkctx->plaintext_key_material.len);
-      dkctx->encrypted_key_material.data =
-         bson_malloc (dkctx->encrypted_key_material.len);
-      dkctx->encrypted_key_material.owned = true;
-      BSON_ASSERT (dkctx->encrypted_key_material.data);
-
-      /* use a random IV. */
-      _mongocrypt_buffer_init (&iv);
-      iv.data = bson_malloc0 (MONGOCRYPT_IV_LEN);
-      BSON_ASSERT (iv.data);
-
-      iv.len = MONGOCRYPT_IV_LEN;
-      iv.owned = true;
-      if (!_mongocrypt_random (
-             ctx->crypt->crypto, &iv, MONGOCRYPT_IV_LEN, ctx->status)) {
-         _mongocrypt_buffer_cleanup (&iv);
-         _mongocrypt_ctx_fail (ctx);
-         goto done;
-      }
-
-      crypt_ret = _mongocrypt_do_encryption (ctx->crypt->crypto,
-                                             &iv,
-                                             NULL /* associated data. */,
-                                             &ctx->crypt->opts.kms_provider_local.key,
-                                             &dkctx->plaintext_key_material,
-                                             &dkctx->encrypted_key_material,
-                                             &bytes_written,
-                                             ctx->status);
-      _mongocrypt_buffer_cleanup (&iv);
-      if (!crypt_ret) {
-         _mongocrypt_ctx_fail (ctx);
-         goto done;
+      for (i = 0; i < dkctx->n_keys; i++) {
+         if (!_encrypt_local (ctx, &dkctx->keys[i])) {
+            goto done;
+         }
       }
       ctx->state = MONGOCRYPT_CTX_READY;
    } else if (ctx->opts.kek.kms_provider == MONGOCRYPT_KMS_PROVIDER_AWS) {
       /* For AWS provider, AWS credentials are supplied in
        * mongocrypt_setopt_kms_provider_aws. Data keys are encrypted with an
        * "encrypt" HTTP message to KMS. */
-      if (!_mongocrypt_kms_ctx_init_aws_encrypt (&dkctx->kms,
-                                                 &ctx->crypt->opts,
-                                                 &ctx->opts,
-                                                 &dkctx->plaintext_key_material,
-                                                 &ctx->crypt->log,
-                                                 ctx->crypt->crypto)) {
-         mongocrypt_kms_ctx_status (&dkctx->kms, ctx->status);
-         _mongocrypt_ctx_fail (ctx);
-         goto done;
-      }
-
-      ctx->state = MONGOCRYPT_CTX_NEED_KMS;
-   } else if (ctx->opts.kek.kms_provider == MONGOCRYPT_KMS_PROVIDER_AZURE) {
-      access_token =
-         _mongocrypt_cache_oauth_get (ctx->crypt->cache_oauth_azure);
-      if (access_token) {
-         if (!_mongocrypt_kms_ctx_init_azure_wrapkey (
-                &dkctx->kms,
-                &ctx->crypt->log,
-                &ctx->crypt->opts,
-                &ctx->opts,
-                access_token,
-                &dkctx->plaintext_key_material)) {
-            mongocrypt_kms_ctx_status (&dkctx->kms, ctx->status);
-            _mongocrypt_ctx_fail (ctx);
-            goto done;
-         }
-      } else {
-         if (!_mongocrypt_kms_ctx_init_azure_auth (
-                &dkctx->kms,
-                &ctx->crypt->log,
-                &ctx->crypt->opts,
-                ctx->opts.kek.provider.azure.key_vault_endpoint)) {
-            mongocrypt_kms_ctx_status (&dkctx->kms, ctx->status);
-            _mongocrypt_ctx_fail (ctx);
+      for (i = 0; i < dkctx->n_keys; i++) {
+         if (!_init_kms_encrypt (ctx, &dkctx->keys[i], NULL)) {
             goto done;
          }
       }
+      dkctx->n_kms = dkctx->n_keys;
       ctx->state = MONGOCRYPT_CTX_NEED_KMS;
-   } else if (ctx->opts.kek.kms_provider == MONGOCRYPT_KMS_PROVIDER_GCP) {
-      access_token = _mongocrypt_cache_oauth_get (ctx->crypt->cache_oauth_gcp);
+   } else if (ctx->opts.kek.kms_provider == MONGOCRYPT_KMS_PROVIDER_AZURE ||
+              ctx->opts.kek.kms_provider == MONGOCRYPT_KMS_PROVIDER_GCP) {
+      bool azure;
+
+      azure = ctx->opts.kek.kms_provider == MONGOCRYPT_KMS_PROVIDER_AZURE;
+      access_token = _mongocrypt_cache_oauth_get (
+         azure ? ctx->crypt->cache_oauth_azure : ctx->crypt->cache_oauth_gcp);
       if (access_token) {
-         if (!_mongocrypt_kms_ctx_init_gcp_encrypt (
-                &dkctx->kms,
-                &ctx->crypt->log,
-                &ctx->crypt->opts,
-                &ctx->opts,
-                access_token,
-                &dkctx->plaintext_key_material)) {
-            mongocrypt_kms_ctx_status (&dkctx->kms, ctx->status);
-            _mongocrypt_ctx_fail (ctx);
-            goto done;
+         for (i = 0; i < dkctx->n_keys; i++) {
+            if (!_init_kms_encrypt (ctx, &dkctx->keys[i], access_token)) {
+               goto done;
+            }
          }
+         dkctx->n_kms = dkctx->n_keys;
       } else {
-         if (!_mongocrypt_kms_ctx_init_gcp_auth (
-                &dkctx->kms,
-                &ctx->crypt->log,
-                &ctx->crypt->opts,
-                ctx->opts.kek.provider.gcp.endpoint)) {
-            mongocrypt_kms_ctx_status (&dkctx->kms, ctx->status);
+         mongocrypt_kms_ctx_t *kms = &dkctx->keys[0].kms;
+         bool auth_ret;
+
+         if (azure) {
+            auth_ret = _mongocrypt_kms_ctx_init_azure_auth (
+               kms,
+               &ctx->crypt->log,
+               &ctx->crypt->opts,
+               ctx->opts.kek.provider.azure.key_vault_endpoint);
+         } else {
+            auth_ret = _mongocrypt_kms_ctx_init_gcp_auth (
+               kms,
+               &ctx->crypt->log,
+               &ctx->crypt->opts,
+               ctx->opts.kek.provider.gcp.endpoint,
+               &ctx->crypt->gcp_assertions);
+         }
+         if (!auth_ret) {
+            mongocrypt_kms_ctx_status (kms, ctx->status);
             _mongocrypt_ctx_fail (ctx);
             goto done;
          }
+         dkctx->n_kms = 1;
       }
       ctx->state = MONGOCRYPT_CTX_NEED_KMS;
    } else {
@@ -186,57 +248,64 @@ done:
    return ret;
 }
 
-static bool
-_kms_done (mongocrypt_ctx_t *ctx)
+
+bool
+_mongocrypt_ctx_datakey_kms_done (mongocrypt_ctx_t *ctx)
 {
    _mongocrypt_ctx_datakey_t *dkctx;
    mongocrypt_status_t *status;
+   uint32_t i;
 
    dkctx = (_mongocrypt_ctx_datakey_t *) ctx;
    status = ctx->status;
-   if (!mongocrypt_kms_ctx_status (&dkctx->kms, ctx->status)) {
-      return _mongocrypt_ctx_fail (ctx);
-   }
+   for (i = 0; i < dkctx->n_kms; i++) {
+      _mongocrypt_ctx_datakey_key_t *key = &dkctx->keys[i];
 
-   if (mongocrypt_kms_ctx_bytes_needed (&dkctx->kms) != 0) {
-      return _mongocrypt_ctx_fail_w_msg (ctx, "KMS response unfinished");
-   }
+      if (!mongocrypt_kms_ctx_status (&key->kms, ctx->status)) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
+
+      if (mongocrypt_kms_ctx_bytes_needed (&key->kms) != 0) {
+         return _mongocrypt_ctx_fail_w_msg (ctx, "KMS response unfinished");
+      }
 
-   /* If this was an oauth request, store the response and proceed to encrypt.
-    */
-   if (dkctx->kms.req_type == MONGOCRYPT_KMS_AZURE_OAUTH) {
-      bson_t oauth_response;
+      /* If this was an oauth request, store the response and proceed to
+       * encrypt. */
+      if (key->kms.req_type == MONGOCRYPT_KMS_AZURE_OAUTH) {
+         bson_t oauth_response;
 
-      BSON_ASSERT (
-         _mongocrypt_buffer_to_bson (&dkctx->kms.result, &oauth_response));
-      if (!_mongocrypt_cache_oauth_add (
-             ctx->crypt->cache_oauth_azure, &oauth_response, status)) {
-         return _mongocrypt_ctx_fail (ctx);
+         BSON_ASSERT (
+            _mongocrypt_buffer_to_bson (&key->kms.result, &oauth_response));
+         if (!_mongocrypt_cache_oauth_add (
+                ctx->crypt->cache_oauth_azure, &oauth_response, status)) {
+            return _mongocrypt_ctx_fail (ctx);
+         }
+         return _mongocrypt_ctx_datakey_kms_start (ctx);
+      } else if (key->kms.req_type == MONGOCRYPT_KMS_GCP_OAUTH) {
+         bson_t oauth_response;
+
+         BSON_ASSERT (
+            _mongocrypt_buffer_to_bson (&key->kms.result, &oauth_response));
+         if (!_mongocrypt_cache_oauth_add (
+                ctx->crypt->cache_oauth_gcp, &oauth_response, status)) {
+            return _mongocrypt_ctx_fail (ctx);
+         }
+         return _mongocrypt_ctx_datakey_kms_start (ctx);
       }
-      return _kms_start (ctx);
-   } else if (dkctx->kms.req_type == MONGOCRYPT_KMS_GCP_OAUTH) {
-      bson_t oauth_response;
-
-      BSON_ASSERT (
-         _mongocrypt_buffer_to_bson (&dkctx->kms.result, &oauth_response));
-      if (!_mongocrypt_cache_oauth_add (
-             ctx->crypt->cache_oauth_gcp, &oauth_response, status)) {
+
+      /* Store the result. */
+      if (!_mongocrypt_kms_ctx_result (&key->kms,
+                                       &key->encrypted_key_material)) {
+         BSON_ASSERT (!mongocrypt_kms_ctx_status (&key->kms, ctx->status));
          return _mongocrypt_ctx_fail (ctx);
       }
-      return _kms_start (ctx);
-   }
-
-   /* Store the result. */
-   if (!_mongocrypt_kms_ctx_result (&dkctx->kms,
-                                    &dkctx->encrypted_key_material)) {
-      BSON_ASSERT (!mongocrypt_kms_ctx_status (&dkctx->kms, ctx->status));
-      return _mongocrypt_ctx_fail (ctx);
-   }
 
-   /* The encrypted key material must be at least as large as the plaintext. */
-   if (dkctx->encrypted_key_material.len < MONGOCRYPT_KEY_LEN) {
-      return _mongocrypt_ctx_fail_w_msg (ctx,
-                                         "key material not expected length");
+      /* The encrypted key material must be at least as large as the
+       * plaintext. */
+      if (key->encrypted_key_material.len < MONGOCRYPT_KEY_LEN) {
+         return _mongocrypt_ctx_fail_w_msg (
+            ctx, "key material not expected length");
+      }
    }
 
    ctx->state = MONGOCRYPT_CTX_READY;
@@ -277,23 +346,25 @@ _append_id (mongocrypt_t *crypt, bson_t *bson, mongocrypt_status_t *status)
 }
 
 
+/* Build the document of @datakey into @key_doc. On success the caller must
+ * destroy @key_doc. */
 static bool
-_finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+_build_key_doc (mongocrypt_ctx_t *ctx,
+                _mongocrypt_ctx_datakey_key_t *datakey,
+                bson_t *key_doc)
 {
-   _mongocrypt_ctx_datakey_t *dkctx;
-   bson_t key_doc, child;
+   bson_t child;
    struct timeval tp;
 
 #define BSON_CHECK(_stmt)                                                      \
    if (!(_stmt)) {                                                             \
-      bson_destroy (&key_doc);                                                 \
+      bson_destroy (key_doc);                                                  \
       return _mongocrypt_ctx_fail_w_msg (ctx, "unable to construct BSON doc"); \
    }
 
-   dkctx = (_mongocrypt_ctx_datakey_t *) ctx;
-
-   bson_init (&key_doc);
-   if (!_append_id (ctx->crypt, &key_doc, ctx->status)) {
+   bson_init (key_doc);
+   if (!_append_id (ctx->crypt, key_doc, ctx->status)) {
+      bson_destroy (key_doc);
       return _mongocrypt_ctx_fail (ctx);
    }
 
@@ -301,56 +372,91 @@ _finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
       _mongocrypt_key_alt_name_t *alt_name = ctx->opts.key_alt_names;
       int i;
 
-      bson_append_array_begin (&key_doc, "keyAltNames", -1, &child);
+      bson_append_array_begin (key_doc, "keyAltNames", -1, &child);
       for (i = 0; alt_name; i++) {
          char *key = bson_strdup_printf ("%d", i);
          bson_append_value (&child, key, -1, &alt_name->value);
          bson_free (key);
          alt_name = alt_name->next;
       }
-      bson_append_array_end (&key_doc, &child);
+      bson_append_array_end (key_doc, &child);
    }
-   if (!_mongocrypt_buffer_append (&dkctx->encrypted_key_material,
-                                   &key_doc,
+   if (!_mongocrypt_buffer_append (&datakey->encrypted_key_material,
+                                   key_doc,
                                    MONGOCRYPT_STR_AND_LEN ("keyMaterial"))) {
-      bson_destroy (&key_doc);
+      bson_destroy (key_doc);
       return _mongocrypt_ctx_fail_w_msg (ctx, "could not append keyMaterial");
    }
    bson_gettimeofday (&tp);
    BSON_CHECK (bson_append_timeval (
-      &key_doc, MONGOCRYPT_STR_AND_LEN ("creationDate"), &tp));
+      key_doc, MONGOCRYPT_STR_AND_LEN ("creationDate"), &tp));
    BSON_CHECK (bson_append_timeval (
-      &key_doc, MONGOCRYPT_STR_AND_LEN ("updateDate"), &tp));
+      key_doc, MONGOCRYPT_STR_AND_LEN ("updateDate"), &tp));
    BSON_CHECK (bson_append_int32 (
-      &key_doc, MONGOCRYPT_STR_AND_LEN ("status"), 0)); /* 0 = enabled. */
+      key_doc, MONGOCRYPT_STR_AND_LEN ("status"), 0)); /* 0 = enabled. */
    BSON_CHECK (bson_append_document_begin (
-      &key_doc, MONGOCRYPT_STR_AND_LEN ("masterKey"), &child));
+      key_doc, MONGOCRYPT_STR_AND_LEN ("masterKey"), &child));
    if (!_mongocrypt_kek_append (&ctx->opts.kek, &child, ctx->status)) {
-      bson_destroy (&key_doc);
+      bson_destroy (key_doc);
       return _mongocrypt_ctx_fail (ctx);
    }
-   BSON_CHECK (bson_append_document_end (&key_doc, &child));
-   _mongocrypt_buffer_steal_from_bson (&dkctx->key_doc, &key_doc);
+   BSON_CHECK (bson_append_document_end (key_doc, &child));
+#undef BSON_CHECK
+   return true;
+}
+
+
+static bool
+_finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   _mongocrypt_ctx_datakey_t *dkctx;
+   bson_t result, key_doc, keys;
+   uint32_t i;
+
+   dkctx = (_mongocrypt_ctx_datakey_t *) ctx;
+
+   if (!dkctx->batch) {
+      if (!_build_key_doc (ctx, &dkctx->keys[0], &result)) {
+         return false;
+      }
+   } else {
+      /* { "v": [ <key document>, ... ] } */
+      bson_init (&result);
+      bson_append_array_begin (&result, MONGOCRYPT_STR_AND_LEN ("v"), &keys);
+      for (i = 0; i < dkctx->n_keys; i++) {
+         char storage[16];
+         const char *key;
+
+         if (!_build_key_doc (ctx, &dkctx->keys[i], &key_doc)) {
+            bson_append_array_end (&result, &keys);
+            bson_destroy (&result);
+            return false;
+         }
+         bson_uint32_to_string (i, &key, storage, sizeof (storage));
+         bson_append_document (&keys, key, -1, &key_doc);
+         bson_destroy (&key_doc);
+      }
+      bson_append_array_end (&result, &keys);
+   }
+   _mongocrypt_buffer_steal_from_bson (&dkctx->key_doc, &result);
    _mongocrypt_buffer_to_binary (&dkctx->key_doc, out);
    ctx->state = MONGOCRYPT_CTX_DONE;
    return true;
 }
 
 
-bool
-mongocrypt_ctx_datakey_init (mongocrypt_ctx_t *ctx)
+/* Initialize a datakey context for @n_keys keys. */
+static bool
+_datakey_init (mongocrypt_ctx_t *ctx, uint32_t n_keys, bool batch)
 {
    _mongocrypt_ctx_datakey_t *dkctx;
    _mongocrypt_ctx_opts_spec_t opts_spec;
-   bool ret;
+   uint32_t i;
 
-   if (!ctx) {
-      return false;
-   }
-   ret = false;
    memset (&opts_spec, 0, sizeof (opts_spec));
    opts_spec.kek = OPT_REQUIRED;
-   opts_spec.key_alt_names = OPT_OPTIONAL;
+   /* keyAltNames must be unique in the key vault. */
+   opts_spec.key_alt_names = batch ? OPT_PROHIBITED : OPT_OPTIONAL;
 
    if (!_mongocrypt_ctx_init (ctx, &opts_spec)) {
       return false;
@@ -361,30 +467,58 @@ mongocrypt_ctx_datakey_init (mongocrypt_ctx_t *ctx)
    ctx->vtable.mongo_op_keys = NULL;
    ctx->vtable.mongo_feed_keys = NULL;
    ctx->vtable.mongo_done_keys = NULL;
-   ctx->vtable.next_kms_ctx = _next_kms_ctx;
-   ctx->vtable.kms_done = _kms_done;
+   ctx->vtable.next_kms_ctx = _mongocrypt_ctx_datakey_next_kms_ctx;
+   ctx->vtable.kms_done = _mongocrypt_ctx_datakey_kms_done;
    ctx->vtable.finalize = _finalize;
-   ctx->vtable.cleanup = _cleanup;
-
-   _mongocrypt_buffer_init (&dkctx->plaintext_key_material);
-   dkctx->plaintext_key_material.data = bson_malloc (MONGOCRYPT_KEY_LEN);
-   BSON_ASSERT (dkctx->plaintext_key_material.data);
-
-   dkctx->plaintext_key_material.len = MONGOCRYPT_KEY_LEN;
-   dkctx->plaintext_key_material.owned = true;
-   if (!_mongocrypt_random (ctx->crypt->crypto,
-                            &dkctx->plaintext_key_material,
-                            MONGOCRYPT_KEY_LEN,
-                            ctx->status)) {
-      _mongocrypt_ctx_fail (ctx);
-      goto done;
+   ctx->vtable.result = _result;
+   ctx->vtable.cleanup = _mongocrypt_ctx_datakey_cleanup;
+
+   if (n_keys == 0) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "key count must be positive");
+   }
+   if (n_keys > UINT32_MAX / sizeof (_mongocrypt_ctx_datakey_key_t)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "key count too large");
    }
 
-   if (!_kms_start (ctx)) {
-      goto done;
+   dkctx->batch = batch;
+   dkctx->keys = bson_malloc0 (sizeof (_mongocrypt_ctx_datakey_key_t) * n_keys);
+   BSON_ASSERT (dkctx->keys);
+   dkctx->n_keys = n_keys;
+
+   for (i = 0; i < n_keys; i++) {
+      _mongocrypt_buffer_t *material;
+
+      material = &dkctx->keys[i].plaintext_key_material;
+      material->data = bson_malloc (MONGOCRYPT_KEY_LEN);
+      BSON_ASSERT (material->data);
+
+      material->len = MONGOCRYPT_KEY_LEN;
+      material->owned = true;
+      if (!_mongocrypt_random (
+             ctx->crypt->crypto, material, MONGOCRYPT_KEY_LEN, ctx->status)) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
    }
 
-   ret = true;
-done:
-   return ret;
+   return _mongocrypt_ctx_datakey_kms_start (ctx);
+}
+
+
+bool
+mongocrypt_ctx_datakey_init (mongocrypt_ctx_t *ctx)
+{
+   if (!ctx) {
+      return false;
+   }
+   return _datakey_init (ctx, 1, false);
+}
+
+
+bool
+mongocrypt_ctx_datakey_batch_init (mongocrypt_ctx_t *ctx, uint32_t count)
+{
+   if (!ctx) {
+      return false;
+   }
+   return _datakey_init (ctx, count, true);
 }
@@ -15,88 +15,293 @@
  */
 
 #include "mongocrypt-ciphertext-private.h"
+#include "mongocrypt-compress-private.h"
 #include "mongocrypt-crypto-private.h"
 #include "mongocrypt-ctx-private.h"
 #include "mongocrypt-traverse-util-private.h"
 
+/* Parse the ciphertext @in, look up its key, and set @job up to decrypt it.
+ * If @parsed is set, it is @in already parsed. Always clean up @job with
+ * _mongocrypt_decryption_job_cleanup. */
 static bool
-_replace_ciphertext_with_plaintext (void *ctx,
-                                    _mongocrypt_buffer_t *in,
-                                    bson_value_t *out,
-                                    mongocrypt_status_t *status)
+_prepare_decryption (_mongocrypt_key_broker_t *kb,
+                     _mongocrypt_buffer_t *in,
+                     const _mongocrypt_ciphertext_t *parsed,
+                     _mongocrypt_ciphertext_t *ciphertext,
+                     _mongocrypt_decryption_job_t *job,
+                     _native_crypto_key_t **native_key,
+                     mongocrypt_status_t *status)
 {
-   _mongocrypt_key_broker_t *kb;
-   _mongocrypt_ciphertext_t ciphertext;
-   _mongocrypt_buffer_t plaintext;
-   _mongocrypt_buffer_t key_material;
-   _mongocrypt_buffer_t associated_data;
-   uint32_t bytes_written;
-   bool ret = false;
-
-   BSON_ASSERT (ctx);
-   BSON_ASSERT (in);
-   BSON_ASSERT (out);
+   const _mongocrypt_buffer_t *key_material;
 
-   _mongocrypt_buffer_init (&plaintext);
-   _mongocrypt_buffer_init (&associated_data);
-   _mongocrypt_buffer_init (&key_material);
-   kb = (_mongocrypt_key_broker_t *) ctx;
+   _mongocrypt_decryption_job_init (job);
 
-   if (!_mongocrypt_ciphertext_parse_unowned (in, &ciphertext, status)) {
-      goto fail;
+   if (parsed) {
+      memcpy (ciphertext, parsed, sizeof (*ciphertext));
+   } else if (!_mongocrypt_ciphertext_parse_unowned (
+                 in, ciphertext, status)) {
+      return false;
    }
 
    /* look up the key */
-   if (!_mongocrypt_key_broker_decrypted_key_by_id (
-          kb, &ciphertext.key_id, &key_material)) {
+   if (!_mongocrypt_key_broker_borrow_decrypted_key (
+          kb, &ciphertext->key_id, &key_material, native_key)) {
       CLIENT_ERR ("key not found");
-      goto fail;
+      return false;
    }
+   _mongocrypt_buffer_set_to (key_material, &job->key);
+   _mongocrypt_buffer_set_to (&ciphertext->data, &job->ciphertext);
 
-   plaintext.len = _mongocrypt_calculate_plaintext_len (ciphertext.data.len);
-   plaintext.data = bson_malloc0 (plaintext.len);
-   BSON_ASSERT (plaintext.data);
+   _mongocrypt_arena_buffer (
+      kb->arena,
+      &job->plaintext,
+      _mongocrypt_calculate_plaintext_len (ciphertext->data.len));
 
-   plaintext.owned = true;
-
-   if (!_mongocrypt_ciphertext_serialize_associated_data (&ciphertext,
-                                                          &associated_data)) {
+   if (!_mongocrypt_ciphertext_associated_data_unowned (
+          ciphertext, in, &job->associated_data)) {
       CLIENT_ERR ("could not serialize associated data");
+      return false;
+   }
+   return true;
+}
+
+
+static bool
+_plaintext_to_bson_value (_mongocrypt_ciphertext_t *ciphertext,
+                          _mongocrypt_decryption_job_t *job,
+                          bson_value_t *out,
+                          mongocrypt_status_t *status)
+{
+   _mongocrypt_buffer_t decompressed;
+   bool ret;
+
+   job->plaintext.len = job->bytes_written;
+
+   if (ciphertext->blob_subtype !=
+       MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM_COMPRESSED) {
+      if (!_mongocrypt_buffer_to_bson_value (
+             &job->plaintext, ciphertext->original_bson_type, out)) {
+         CLIENT_ERR ("malformed encrypted bson");
+         return false;
+      }
+      return true;
+   }
+
+   if (!_mongocrypt_decompress (&job->plaintext, &decompressed, status)) {
+      return false;
+   }
+   ret = _mongocrypt_buffer_to_bson_value (
+      &decompressed, ciphertext->original_bson_type, out);
+   _mongocrypt_buffer_cleanup (&decompressed);
+   if (!ret) {
+      CLIENT_ERR ("malformed encrypted bson");
+   }
+   return ret;
+}
+
+
+/* Decrypt the ciphertext @in into @out. @parsed is as for
+ * _prepare_decryption. */
+static bool
+_decrypt_value (_mongocrypt_key_broker_t *kb,
+                _mongocrypt_buffer_t *in,
+                const _mongocrypt_ciphertext_t *parsed,
+                bson_value_t *out,
+                mongocrypt_status_t *status)
+{
+   _mongocrypt_ciphertext_t ciphertext;
+   _mongocrypt_decryption_job_t job;
+   _native_crypto_key_t *native_key = NULL;
+   _mongocrypt_buffer_t *cached = NULL;
+   bool use_cache;
+   bool ret = false;
+
+   BSON_ASSERT (kb);
+   BSON_ASSERT (in);
+   BSON_ASSERT (out);
+
+   /* Still look up the key on a cache hit, so a value is only returned if
+    * its key can be fetched and decrypted. */
+   if (!_prepare_decryption (
+          kb, in, parsed, &ciphertext, &job, &native_key, status)) {
+      goto fail;
+   }
+
+   /* Only deterministic ciphertexts repeat. */
+   use_cache = kb->crypt->opts.use_plaintext_cache &&
+               ciphertext.blob_subtype ==
+                  MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC;
+   if (use_cache && _mongocrypt_cache_get (&kb->crypt->cache_plaintext,
+                                           in,
+                                           (void **) &cached)) {
+      ret = _mongocrypt_buffer_to_bson_value (
+         cached, ciphertext.original_bson_type, out);
+      if (!ret) {
+         CLIENT_ERR ("malformed encrypted bson");
+      }
+      _mongocrypt_buffer_cleanup (cached);
+      bson_free (cached);
       goto fail;
    }
 
    if (!_mongocrypt_do_decryption (kb->crypt->crypto,
-                                   &associated_data,
-                                   &key_material,
-                                   &ciphertext.data,
-                                   &plaintext,
-                                   &bytes_written,
+                                   &job.associated_data,
+                                   &job.key,
+                                   native_key,
+                                   &job.ciphertext,
+                                   &job.plaintext,
+                                   &job.bytes_written,
                                    status)) {
       goto fail;
    }
 
-   plaintext.len = bytes_written;
+   ret = _plaintext_to_bson_value (&ciphertext, &job, out, status);
+   if (ret && use_cache &&
+       !_mongocrypt_cache_add_copy (
+          &kb->crypt->cache_plaintext, in, &job.plaintext, status)) {
+      ret = false;
+   }
 
-   if (!_mongocrypt_buffer_to_bson_value (
-          &plaintext, ciphertext.original_bson_type, out)) {
-      CLIENT_ERR ("malformed encrypted bson");
+fail:
+   _mongocrypt_decryption_job_cleanup (&job);
+   return ret;
+}
+
+
+static bool
+_replace_ciphertext_with_plaintext (void *ctx,
+                                    _mongocrypt_splice_item_t *item,
+                                    mongocrypt_status_t *status)
+{
+   BSON_ASSERT (ctx);
+   BSON_ASSERT (item);
+
+   return _decrypt_value ((_mongocrypt_key_broker_t *) ctx,
+                          &item->in,
+                          item->header,
+                          &item->out,
+                          status);
+}
+
+
+/* Decrypt every ciphertext of a document at once, with the batch crypto hook.
+ */
+static bool
+_replace_ciphertexts_with_plaintexts (void *ctx,
+                                      _mongocrypt_splice_item_t *items,
+                                      uint32_t n_items,
+                                      mongocrypt_status_t *status)
+{
+   _mongocrypt_key_broker_t *kb;
+   _mongocrypt_ciphertext_t *ciphertexts;
+   _mongocrypt_decryption_job_t *jobs;
+   _native_crypto_key_t *native_key;
+   uint32_t i;
+   bool ret = false;
+
+   BSON_ASSERT (ctx);
+   BSON_ASSERT (items);
+
+   kb = (_mongocrypt_key_broker_t *) ctx;
+   ciphertexts = bson_malloc0 (n_items * sizeof (*ciphertexts));
+   BSON_ASSERT (ciphertexts);
+   jobs = bson_malloc0 (n_items * sizeof (*jobs));
+   BSON_ASSERT (jobs);
+
+   for (i = 0; i < n_items; i++) {
+      if (!_prepare_decryption (kb,
+                                &items[i].in,
+                                items[i].header,
+                                &ciphertexts[i],
+                                &jobs[i],
+                                &native_key,
+                                status)) {
+         goto fail;
+      }
+   }
+
+   if (!_mongocrypt_do_decryption_batch (
+          kb->crypt->crypto, jobs, n_items, status)) {
       goto fail;
    }
+
+   for (i = 0; i < n_items; i++) {
+      if (!_plaintext_to_bson_value (
+             &ciphertexts[i], &jobs[i], &items[i].out, status)) {
+         goto fail;
+      }
+   }
+
    ret = true;
 
 fail:
-   _mongocrypt_buffer_cleanup (&plaintext);
-   _mongocrypt_buffer_cleanup (&associated_data);
-   _mongocrypt_buffer_cleanup (&key_material);
+   for (i = 0; i < n_items; i++) {
+      _mongocrypt_decryption_job_cleanup (&jobs[i]);
+   }
+   bson_free (jobs);
+   bson_free (ciphertexts);
    return ret;
 }
 
 
+/* Return the next document of a chunked context, decrypted. */
+static bool
+_finalize_chunk (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   static const uint8_t empty_doc[] = {5, 0, 0, 0, 0};
+   _mongocrypt_ctx_decrypt_t *dctx;
+   _mongocrypt_buffer_t *chunk;
+   bson_t as_bson;
+
+   dctx = (_mongocrypt_ctx_decrypt_t *) ctx;
+   _mongocrypt_buffer_cleanup (&dctx->decrypted_doc);
+   _mongocrypt_buffer_init (&dctx->decrypted_doc);
+   if (dctx->next_chunk > 0) {
+      /* The previous result may have viewed its chunk. */
+      _mongocrypt_buffer_cleanup (&dctx->chunks[dctx->next_chunk - 1]);
+      _mongocrypt_buffer_init (&dctx->chunks[dctx->next_chunk - 1]);
+   }
+
+   if (dctx->n_chunks == 0) {
+      out->data = (uint8_t *) empty_doc;
+      out->len = sizeof (empty_doc);
+      ctx->state = MONGOCRYPT_CTX_DONE;
+      return true;
+   }
+
+   chunk = &dctx->chunks[dctx->next_chunk++];
+   if (ctx->nothing_to_do) {
+      _mongocrypt_buffer_to_binary (chunk, out);
+   } else {
+      /* Validated when fed. */
+      BSON_ASSERT (_mongocrypt_buffer_to_bson (chunk, &as_bson));
+      if (!_mongocrypt_ctx_transform_binary_in_bson (
+             ctx,
+             _replace_ciphertext_with_plaintext,
+             _replace_ciphertexts_with_plaintexts,
+             TRAVERSE_MATCH_CIPHERTEXT,
+             &as_bson,
+             &dctx->filter,
+             &dctx->decrypted_doc)) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
+      _mongocrypt_buffer_cleanup (chunk);
+      _mongocrypt_buffer_init (chunk);
+      out->data = dctx->decrypted_doc.data;
+      out->len = dctx->decrypted_doc.len;
+   }
+
+   if (dctx->next_chunk == dctx->n_chunks) {
+      ctx->state = MONGOCRYPT_CTX_DONE;
+   }
+   return true;
+}
+
+
 static bool
 _finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
 {
-   bson_t as_bson, final_bson;
-   bson_iter_t iter;
+   bson_t *final_bson;
    _mongocrypt_ctx_decrypt_t *dctx;
    bool res;
 
@@ -110,26 +315,26 @@ _finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
 
    dctx = (_mongocrypt_ctx_decrypt_t *) ctx;
 
+   if (dctx->chunked) {
+      return _finalize_chunk (ctx, out);
+   }
+
    if (!dctx->explicit) {
-      if (ctx->nothing_to_do) {
+      /* Without recorded ciphertexts, none were found. */
+      if (ctx->nothing_to_do || !dctx->collected.in_data) {
          _mongocrypt_buffer_to_binary (&dctx->original_doc, out);
          ctx->state = MONGOCRYPT_CTX_DONE;
          return true;
       }
 
-      if (!_mongocrypt_buffer_to_bson (&dctx->original_doc, &as_bson)) {
-         return _mongocrypt_ctx_fail_w_msg (ctx, "malformed bson");
-      }
-
-      bson_iter_init (&iter, &as_bson);
-      bson_init (&final_bson);
-      res = _mongocrypt_transform_binary_in_bson (
+      /* The ciphertexts were found and parsed when their keys were
+       * requested. */
+      res = _mongocrypt_ctx_transform_splice (
+         ctx,
          _replace_ciphertext_with_plaintext,
-         &ctx->kb,
-         TRAVERSE_MATCH_CIPHERTEXT,
-         &iter,
-         &final_bson,
-         ctx->status);
+         _replace_ciphertexts_with_plaintexts,
+         &dctx->collected,
+         &dctx->decrypted_doc);
       if (!res) {
          return _mongocrypt_ctx_fail (ctx);
       }
@@ -137,17 +342,25 @@ _finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
       /* For explicit decryption, we just have a single value */
       bson_value_t value;
 
-      if (!_replace_ciphertext_with_plaintext (
-             &ctx->kb, &dctx->unwrapped_doc, &value, ctx->status)) {
+      if (!_decrypt_value (
+             &ctx->kb, &dctx->unwrapped_doc, NULL, &value, ctx->status)) {
          return _mongocrypt_ctx_fail (ctx);
       }
 
-      bson_init (&final_bson);
-      bson_append_value (&final_bson, MONGOCRYPT_STR_AND_LEN ("v"), &value);
+      if (dctx->raw) {
+         _mongocrypt_buffer_from_raw_value (&dctx->decrypted_doc, &value);
+      } else {
+         /* The document length, the element, and the terminator. */
+         final_bson = bson_sized_new (
+            4u + _mongocrypt_bson_element_len (1u, &value) + 1u);
+         bson_append_value (final_bson, MONGOCRYPT_STR_AND_LEN ("v"), &value);
+         _mongocrypt_buffer_steal_from_bson (&dctx->decrypted_doc, final_bson);
+      }
       bson_value_destroy (&value);
+      _mongocrypt_atomic_add_int64 (&ctx->crypt->stats.fields_decrypted, 1);
+      ctx->timings.fields++;
    }
 
-   _mongocrypt_buffer_steal_from_bson (&dctx->decrypted_doc, &final_bson);
    out->data = dctx->decrypted_doc.data;
    out->len = dctx->decrypted_doc.len;
    ctx->state = MONGOCRYPT_CTX_DONE;
@@ -180,20 +393,69 @@ _collect_key_from_ciphertext (void *ctx,
 }
 
 
+/* Like _collect_key_from_ciphertext, but for an item of the recorded splice,
+ * whose header is set to the parsed ciphertext. */
+static bool
+_record_ciphertext (void *ctx,
+                    _mongocrypt_splice_item_t *item,
+                    mongocrypt_status_t *status)
+{
+   _mongocrypt_ciphertext_t *ciphertext;
+   _mongocrypt_key_broker_t *kb;
+
+   BSON_ASSERT (ctx);
+   BSON_ASSERT (item);
+
+   kb = (_mongocrypt_key_broker_t *) ctx;
+   ciphertext = bson_malloc (sizeof (*ciphertext));
+   BSON_ASSERT (ciphertext);
+   /* Freed with the splice. */
+   item->header = ciphertext;
+   if (!_mongocrypt_ciphertext_parse_unowned (&item->in, ciphertext, status)) {
+      return false;
+   }
+
+   if (!_mongocrypt_key_broker_request_id (kb, &ciphertext->key_id)) {
+      return _mongocrypt_key_broker_status (kb, status);
+   }
+
+   return true;
+}
+
+
+static _mongocrypt_buffer_t *
+_result (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_decrypt_t *dctx;
+
+   dctx = (_mongocrypt_ctx_decrypt_t *) ctx;
+   return &dctx->decrypted_doc;
+}
+
+
 static void
 _cleanup (mongocrypt_ctx_t *ctx)
 {
    _mongocrypt_ctx_decrypt_t *dctx;
+   uint32_t i;
 
    dctx = (_mongocrypt_ctx_decrypt_t *) ctx;
    _mongocrypt_buffer_cleanup (&dctx->original_doc);
    _mongocrypt_buffer_cleanup (&dctx->decrypted_doc);
+   _mongocrypt_ctx_splice_release (ctx, &dctx->collected);
+   for (i = 0; i < dctx->n_chunks; i++) {
+      _mongocrypt_buffer_cleanup (&dctx->chunks[i]);
+   }
+   bson_free (dctx->chunks);
 }
 
 
-bool
-mongocrypt_ctx_explicit_decrypt_init (mongocrypt_ctx_t *ctx,
-                                      mongocrypt_binary_t *msg)
+/* Shared by explicit_decrypt_init and explicit_decrypt_value_init. If @raw,
+ * @msg is a raw value instead of a { "v": <ciphertext> } document. */
+static bool
+_explicit_decrypt_init (mongocrypt_ctx_t *ctx,
+                        mongocrypt_binary_t *msg,
+                        bool raw)
 {
    _mongocrypt_ctx_decrypt_t *dctx;
    bson_iter_t iter;
@@ -212,9 +474,40 @@ mongocrypt_ctx_explicit_decrypt_init (mongocrypt_ctx_t *ctx,
       return _mongocrypt_ctx_fail_w_msg (ctx, "invalid msg");
    }
 
-   if (ctx->crypt->log.trace_enabled) {
+   dctx = (_mongocrypt_ctx_decrypt_t *) ctx;
+   dctx->explicit = true;
+   ctx->type = _MONGOCRYPT_TYPE_DECRYPT;
+   ctx->vtable.finalize = _finalize;
+   ctx->vtable.result = _result;
+   ctx->vtable.cleanup = _cleanup;
+
+
+   /* We expect these to be round-tripped from explicit encrypt,
+      so they must be wrapped like { "v" : "encrypted thing" }. A raw value
+      is wrapped here. */
+   if (raw) {
+      _mongocrypt_buffer_t raw_value;
+
+      dctx->raw = true;
+      _mongocrypt_buffer_from_binary (&raw_value, msg);
+      if (!_mongocrypt_buffer_wrap_raw_value (&dctx->original_doc,
+                                              &raw_value)) {
+         return _mongocrypt_ctx_fail_w_msg (ctx, "malformed raw value");
+      }
+   } else {
+      _mongocrypt_ctx_slot_copy (ctx,
+                                 _MONGOCRYPT_CTX_SLOT_INPUT,
+                                 msg->data,
+                                 msg->len,
+                                 &dctx->original_doc);
+   }
+
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
+      mongocrypt_binary_t wrapped;
       char *msg_val;
-      msg_val = _mongocrypt_new_json_string_from_binary (msg);
+
+      _mongocrypt_buffer_to_binary (&dctx->original_doc, &wrapped);
+      msg_val = _mongocrypt_new_json_string_from_binary (&wrapped);
       _mongocrypt_log (&ctx->crypt->log,
                        MONGOCRYPT_LOG_LEVEL_TRACE,
                        "%s (%s=\"%s\")",
@@ -225,16 +518,6 @@ mongocrypt_ctx_explicit_decrypt_init (mongocrypt_ctx_t *ctx,
       bson_free (msg_val);
    }
 
-   dctx = (_mongocrypt_ctx_decrypt_t *) ctx;
-   dctx->explicit = true;
-   ctx->type = _MONGOCRYPT_TYPE_DECRYPT;
-   ctx->vtable.finalize = _finalize;
-   ctx->vtable.cleanup = _cleanup;
-
-
-   /* We expect these to be round-tripped from explicit encrypt,
-      so they must be wrapped like { "v" : "encrypted thing" } */
-   _mongocrypt_buffer_copy_from_binary (&dctx->original_doc, msg);
    if (!_mongocrypt_buffer_to_bson (&dctx->original_doc, &as_bson)) {
       return _mongocrypt_ctx_fail_w_msg (ctx, "malformed bson");
    }
@@ -260,7 +543,32 @@ mongocrypt_ctx_explicit_decrypt_init (mongocrypt_ctx_t *ctx,
 
 
 bool
-mongocrypt_ctx_decrypt_init (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *doc)
+mongocrypt_ctx_explicit_decrypt_init (mongocrypt_ctx_t *ctx,
+                                      mongocrypt_binary_t *msg)
+{
+   return _explicit_decrypt_init (ctx, msg, false);
+}
+
+
+bool
+mongocrypt_ctx_explicit_decrypt_value_init (mongocrypt_ctx_t *ctx,
+                                            mongocrypt_binary_t *value)
+{
+   return _explicit_decrypt_init (ctx, value, true);
+}
+
+
+/* Shared by decrypt_init, decrypt_in_place_init, and decrypt_batch_init.
+ * Every element of a batch is a document, so decrypting the outer document
+ * decrypts each of them, with the key requests for all of them gathered into
+ * the one key broker. If @in_place, @doc is viewed and finalize overwrites
+ * it. */
+static bool
+_decrypt_init (mongocrypt_ctx_t *ctx,
+               mongocrypt_binary_t *doc,
+               bool batch,
+               bool in_place,
+               const char *func)
 {
    _mongocrypt_ctx_decrypt_t *dctx;
    bson_t as_bson;
@@ -268,6 +576,8 @@ mongocrypt_ctx_decrypt_init (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *doc)
    _mongocrypt_ctx_opts_spec_t opts_spec;
 
    memset (&opts_spec, 0, sizeof (opts_spec));
+   opts_spec.decrypt_paths = OPT_OPTIONAL;
+   opts_spec.decrypt_session = OPT_OPTIONAL;
    if (!ctx) {
       return false;
    }
@@ -277,40 +587,458 @@ mongocrypt_ctx_decrypt_init (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *doc)
    }
 
    if (!doc || !doc->data) {
-      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid doc");
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, batch ? "invalid docs" : "invalid doc");
    }
 
-   if (ctx->crypt->log.trace_enabled) {
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
       char *doc_val;
       doc_val = _mongocrypt_new_json_string_from_binary (doc);
       _mongocrypt_log (&ctx->crypt->log,
                        MONGOCRYPT_LOG_LEVEL_TRACE,
                        "%s (%s=\"%s\")",
-                       BSON_FUNC,
-                       "doc",
+                       func,
+                       batch ? "docs" : "doc",
                        doc_val);
       bson_free (doc_val);
    }
    dctx = (_mongocrypt_ctx_decrypt_t *) ctx;
    ctx->type = _MONGOCRYPT_TYPE_DECRYPT;
    ctx->vtable.finalize = _finalize;
+   ctx->vtable.result = _result;
    ctx->vtable.cleanup = _cleanup;
+   dctx->filter.paths = ctx->opts.decrypt_paths.paths;
+   dctx->filter.len = ctx->opts.decrypt_paths.len;
+   dctx->filter.skip_root = batch;
 
-   _mongocrypt_buffer_copy_from_binary (&dctx->original_doc, doc);
+   if (in_place) {
+      _mongocrypt_buffer_from_binary (&dctx->original_doc, doc);
+      ctx->finalize_in_place = true;
+   } else {
+      _mongocrypt_ctx_slot_copy (ctx,
+                                 _MONGOCRYPT_CTX_SLOT_INPUT,
+                                 doc->data,
+                                 doc->len,
+                                 &dctx->original_doc);
+   }
    /* get keys. */
    if (!_mongocrypt_buffer_to_bson (&dctx->original_doc, &as_bson)) {
       return _mongocrypt_ctx_fail_w_msg (ctx, "malformed bson");
    }
 
-   bson_iter_init (&iter, &as_bson);
-   if (!_mongocrypt_traverse_binary_in_bson (_collect_key_from_ciphertext,
-                                             &ctx->kb,
-                                             TRAVERSE_MATCH_CIPHERTEXT,
-                                             &iter,
-                                             ctx->status)) {
+   if (batch) {
+      bson_iter_init (&iter, &as_bson);
+      while (bson_iter_next (&iter)) {
+         if (!BSON_ITER_HOLDS_DOCUMENT (&iter)) {
+            return _mongocrypt_ctx_fail_w_msg (
+               ctx, "invalid docs, each element must be a document");
+         }
+      }
+   }
+
+   /* Most replies have no ciphertext. With no keys requested, the context
+    * has nothing to do. Otherwise the ciphertexts are recorded, so finalize
+    * does not look for them or parse them again. */
+   _mongocrypt_ctx_splice_init (
+      ctx, &dctx->collected, TRAVERSE_MATCH_CIPHERTEXT);
+   dctx->collected.filter = &dctx->filter;
+   dctx->collected.header_destroy = bson_free;
+   if (_mongocrypt_traverse_may_match (&as_bson, TRAVERSE_MATCH_CIPHERTEXT) &&
+       !_mongocrypt_ctx_collect_binary_in_bson (
+          ctx, _record_ciphertext, &as_bson, &dctx->collected)) {
       return _mongocrypt_ctx_fail (ctx);
    }
 
    (void) _mongocrypt_key_broker_requests_done (&ctx->kb);
    return _mongocrypt_ctx_state_from_key_broker (ctx);
 }
+
+
+bool
+mongocrypt_ctx_decrypt_init (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *doc)
+{
+   return _decrypt_init (ctx, doc, false, false, BSON_FUNC);
+}
+
+
+bool
+mongocrypt_ctx_decrypt_in_place_init (mongocrypt_ctx_t *ctx,
+                                      mongocrypt_binary_t *doc)
+{
+   return _decrypt_init (ctx, doc, false, true, BSON_FUNC);
+}
+
+
+bool
+mongocrypt_try_decrypt_cached (mongocrypt_t *crypt,
+                               mongocrypt_binary_t *doc,
+                               mongocrypt_binary_t *out,
+                               mongocrypt_status_t *status)
+{
+   mongocrypt_ctx_t *ctx;
+   bool ret = false;
+
+   if (!crypt || !status) {
+      return false;
+   }
+
+   if (!out) {
+      CLIENT_ERR ("invalid NULL input");
+      return false;
+   }
+
+   ctx = mongocrypt_ctx_new (crypt);
+   if (!ctx) {
+      _mongocrypt_status_copy_to (crypt->status, status);
+      return false;
+   }
+
+   if (!mongocrypt_ctx_decrypt_init (ctx, doc)) {
+      goto done;
+   }
+
+   if (ctx->state != MONGOCRYPT_CTX_READY) {
+      /* A key must be fetched or decrypted first. */
+      if (out->owned) {
+         bson_free (out->data);
+      }
+      out->data = NULL;
+      out->len = 0;
+      out->owned = false;
+      ret = true;
+      goto done;
+   }
+
+   ret = mongocrypt_ctx_finalize_steal (ctx, out);
+
+done:
+   if (!ret) {
+      _mongocrypt_status_copy_to (ctx->status, status);
+   }
+   mongocrypt_ctx_destroy (ctx);
+   return ret;
+}
+
+
+bool
+mongocrypt_ctx_decrypt_batch_init (mongocrypt_ctx_t *ctx,
+                                   mongocrypt_binary_t *docs)
+{
+   return _decrypt_init (ctx, docs, true, false, BSON_FUNC);
+}
+
+
+bool
+mongocrypt_ctx_decrypt_chunked_init (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_decrypt_t *dctx;
+   _mongocrypt_ctx_opts_spec_t opts_spec;
+
+   memset (&opts_spec, 0, sizeof (opts_spec));
+   opts_spec.decrypt_paths = OPT_OPTIONAL;
+   opts_spec.decrypt_session = OPT_OPTIONAL;
+   if (!ctx) {
+      return false;
+   }
+
+   if (!_mongocrypt_ctx_init (ctx, &opts_spec)) {
+      return false;
+   }
+
+   dctx = (_mongocrypt_ctx_decrypt_t *) ctx;
+   dctx->chunked = true;
+   dctx->filter.paths = ctx->opts.decrypt_paths.paths;
+   dctx->filter.len = ctx->opts.decrypt_paths.len;
+   ctx->type = _MONGOCRYPT_TYPE_DECRYPT;
+   ctx->vtable.finalize = _finalize;
+   ctx->vtable.result = _result;
+   ctx->vtable.cleanup = _cleanup;
+   return true;
+}
+
+
+/* Check that @ctx is a chunked decryption context still accepting chunks. */
+static bool
+_check_chunks_open (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_decrypt_t *dctx;
+
+   if (!ctx->initialized) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "ctx NULL or uninitialized");
+   }
+   dctx = (_mongocrypt_ctx_decrypt_t *) ctx;
+   if (ctx->type != _MONGOCRYPT_TYPE_DECRYPT || !dctx->chunked) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "not applicable to context");
+   }
+   if (ctx->state == MONGOCRYPT_CTX_ERROR) {
+      return false;
+   }
+   if (dctx->chunks_done) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "chunks already done");
+   }
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_decrypt_feed_chunk (mongocrypt_ctx_t *ctx,
+                                   mongocrypt_binary_t *doc)
+{
+   _mongocrypt_ctx_decrypt_t *dctx;
+   _mongocrypt_buffer_t *chunk;
+   bson_t as_bson;
+
+   if (!ctx) {
+      return false;
+   }
+   if (!_check_chunks_open (ctx)) {
+      return false;
+   }
+   if (!doc || !doc->data) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid doc");
+   }
+
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
+      char *doc_val;
+      doc_val = _mongocrypt_new_json_string_from_binary (doc);
+      _mongocrypt_log (&ctx->crypt->log,
+                       MONGOCRYPT_LOG_LEVEL_TRACE,
+                       "%s (%s=\"%s\")",
+                       BSON_FUNC,
+                       "doc",
+                       doc_val);
+      bson_free (doc_val);
+   }
+
+   dctx = (_mongocrypt_ctx_decrypt_t *) ctx;
+   if (dctx->n_chunks == dctx->chunks_alloc) {
+      dctx->chunks_alloc = dctx->chunks_alloc ? 2 * dctx->chunks_alloc : 8;
+      dctx->chunks = bson_realloc (
+         dctx->chunks, dctx->chunks_alloc * sizeof (_mongocrypt_buffer_t));
+   }
+   chunk = &dctx->chunks[dctx->n_chunks++];
+   _mongocrypt_buffer_init (chunk);
+   _mongocrypt_buffer_copy_from_binary (chunk, doc);
+   if (!_mongocrypt_buffer_to_bson (chunk, &as_bson)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed bson");
+   }
+
+   /* Request the keys now, so the chunk is not scanned again until it is
+    * decrypted. */
+   if (_mongocrypt_traverse_may_match (&as_bson, TRAVERSE_MATCH_CIPHERTEXT) &&
+       !_mongocrypt_scan_binary_in_bson (_collect_key_from_ciphertext,
+                                         &ctx->kb,
+                                         TRAVERSE_MATCH_CIPHERTEXT,
+                                         &as_bson,
+                                         &dctx->filter,
+                                         ctx->status)) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_decrypt_chunks_done (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_decrypt_t *dctx;
+
+   if (!ctx) {
+      return false;
+   }
+   if (!_check_chunks_open (ctx)) {
+      return false;
+   }
+
+   dctx = (_mongocrypt_ctx_decrypt_t *) ctx;
+   dctx->chunks_done = true;
+   (void) _mongocrypt_key_broker_requests_done (&ctx->kb);
+   return _mongocrypt_ctx_state_from_key_broker (ctx);
+}
+
+
+/* A field read from a view. value is the field decrypted, as {v: <value>},
+ * or an empty document if the field is missing. */
+typedef struct {
+   char *path;
+   _mongocrypt_buffer_t value;
+} _mongocrypt_doc_view_field_t;
+
+
+struct _mongocrypt_doc_view_t {
+   /* The decryption context, whose key broker holds the keys. */
+   mongocrypt_ctx_t *ctx;
+   /* The document, still encrypted. */
+   _mongocrypt_buffer_t doc;
+   _mongocrypt_doc_view_field_t *fields;
+   uint32_t n_fields;
+   mongocrypt_status_t *status;
+};
+
+
+mongocrypt_doc_view_t *
+mongocrypt_ctx_finalize_view (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_decrypt_t *dctx;
+   mongocrypt_doc_view_t *view;
+
+   if (!ctx) {
+      return NULL;
+   }
+   if (!ctx->initialized) {
+      _mongocrypt_ctx_fail_w_msg (ctx, "ctx NULL or uninitialized");
+      return NULL;
+   }
+   dctx = (_mongocrypt_ctx_decrypt_t *) ctx;
+   if (ctx->type != _MONGOCRYPT_TYPE_DECRYPT || dctx->explicit ||
+       dctx->chunked) {
+      _mongocrypt_ctx_fail_w_msg (ctx, "not applicable to context");
+      return NULL;
+   }
+   if (dctx->filter.len > 0) {
+      _mongocrypt_ctx_fail_w_msg (ctx, "cannot view with decrypt paths");
+      return NULL;
+   }
+   if (ctx->state == MONGOCRYPT_CTX_ERROR) {
+      return NULL;
+   }
+   if (ctx->state != MONGOCRYPT_CTX_READY) {
+      _mongocrypt_ctx_fail_w_msg (ctx, "wrong state");
+      return NULL;
+   }
+
+   view = bson_malloc0 (sizeof (*view));
+   BSON_ASSERT (view);
+   view->ctx = ctx;
+   view->status = mongocrypt_status_new ();
+   /* The context has no further use for the document. */
+   _mongocrypt_buffer_steal (&view->doc, &dctx->original_doc);
+   ctx->state = MONGOCRYPT_CTX_DONE;
+   return view;
+}
+
+
+/* Decrypt the field at @path into @value. */
+static bool
+_doc_view_read (mongocrypt_doc_view_t *view,
+                const char *path,
+                _mongocrypt_buffer_t *value)
+{
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_status_t *status;
+   bson_t doc, wrapped;
+   bson_iter_t iter, field;
+   bool ret;
+
+   ctx = view->ctx;
+   status = view->status;
+   BSON_ASSERT (_mongocrypt_buffer_to_bson (&view->doc, &doc));
+   bson_init (&wrapped);
+   if (bson_iter_init (&iter, &doc) &&
+       bson_iter_find_descendant (&iter, path, &field) &&
+       !bson_append_iter (&wrapped, "v", 1, &field)) {
+      bson_destroy (&wrapped);
+      CLIENT_ERR ("field too large");
+      return false;
+   }
+
+   if (!_mongocrypt_traverse_may_match (&wrapped, TRAVERSE_MATCH_CIPHERTEXT)) {
+      _mongocrypt_buffer_steal_from_bson (value, &wrapped);
+      return true;
+   }
+
+   ret = _mongocrypt_ctx_transform_binary_in_bson (
+      ctx,
+      _replace_ciphertext_with_plaintext,
+      _replace_ciphertexts_with_plaintexts,
+      TRAVERSE_MATCH_CIPHERTEXT,
+      &wrapped,
+      NULL,
+      value);
+   if (!ret) {
+      /* The context is done. Report the error on the view instead. */
+      _mongocrypt_status_copy_to (ctx->status, status);
+      _mongocrypt_status_reset (ctx->status);
+   }
+   bson_destroy (&wrapped);
+   return ret;
+}
+
+
+bool
+mongocrypt_doc_view_get (mongocrypt_doc_view_t *view,
+                         const char *path,
+                         mongocrypt_binary_t *out)
+{
+   _mongocrypt_doc_view_field_t *field;
+   uint32_t i;
+
+   if (!view) {
+      return false;
+   }
+   if (!path || !out) {
+      _mongocrypt_set_error (view->status,
+                             MONGOCRYPT_STATUS_ERROR_CLIENT,
+                             MONGOCRYPT_GENERIC_ERROR_CODE,
+                             "%s",
+                             "invalid NULL input");
+      return false;
+   }
+
+   for (i = 0; i < view->n_fields; i++) {
+      if (0 == strcmp (view->fields[i].path, path)) {
+         _mongocrypt_buffer_to_binary (&view->fields[i].value, out);
+         return true;
+      }
+   }
+
+   view->fields = bson_realloc (
+      view->fields, (view->n_fields + 1u) * sizeof (*view->fields));
+   field = &view->fields[view->n_fields];
+   _mongocrypt_buffer_init (&field->value);
+   if (!_doc_view_read (view, path, &field->value)) {
+      _mongocrypt_buffer_cleanup (&field->value);
+      return false;
+   }
+   field->path = bson_strdup (path);
+   view->n_fields++;
+   _mongocrypt_buffer_to_binary (&field->value, out);
+   return true;
+}
+
+
+bool
+mongocrypt_doc_view_status (mongocrypt_doc_view_t *view,
+                            mongocrypt_status_t *status_out)
+{
+   if (!view) {
+      return false;
+   }
+
+   if (!status_out) {
+      mongocrypt_status_t *status = view->status;
+      CLIENT_ERR ("argument 'status' is required");
+      return false;
+   }
+   _mongocrypt_status_copy_to (view->status, status_out);
+   return mongocrypt_status_ok (status_out);
+}
+
+
+void
+mongocrypt_doc_view_destroy (mongocrypt_doc_view_t *view)
+{
+   uint32_t i;
+
+   if (!view) {
+      return;
+   }
+   for (i = 0; i < view->n_fields; i++) {
+      bson_free (view->fields[i].path);
+      _mongocrypt_buffer_cleanup (&view->fields[i].value);
+   }
+   bson_free (view->fields);
+   _mongocrypt_buffer_cleanup (&view->doc);
+   mongocrypt_status_destroy (view->status);
+   bson_free (view);
+}
@@ -14,11 +14,14 @@
  * limitations under the License.
  */
 
+#include "mongocrypt-cache-collinfo-private.h"
+#include "mongocrypt-cache-markings-private.h"
 #include "mongocrypt-ciphertext-private.h"
 #include "mongocrypt-crypto-private.h"
 #include "mongocrypt-ctx-private.h"
 #include "mongocrypt-key-broker-private.h"
 #include "mongocrypt-marking-private.h"
+#include "mongocrypt-schema-paths-private.h"
 #include "mongocrypt-traverse-util-private.h"
 
 /* Construct the list collections command to send. */
@@ -88,6 +91,24 @@ _set_schema_from_collinfo (mongocrypt_ctx_t *ctx, bson_t *collinfo)
    return true;
 }
 
+/* Add @collinfo to the collinfo cache, or a negative entry if @collinfo is
+ * NULL. */
+static bool
+_cache_collinfo (mongocrypt_ctx_t *ctx, const bson_t *collinfo)
+{
+   _mongocrypt_ctx_encrypt_t *ectx;
+   bson_t *value;
+
+   ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
+   value = _mongocrypt_cache_collinfo_value_new (collinfo);
+   if (!_mongocrypt_cache_add_stolen (
+          ctx->crypt->cache_collinfo, ectx->ns, value, ctx->status)) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
+   return true;
+}
+
+
 static bool
 _mongo_feed_collinfo (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *in)
 {
@@ -99,11 +120,11 @@ _mongo_feed_collinfo (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *in)
    if (!bson_init_static (&as_bson, in->data, in->len)) {
       return _mongocrypt_ctx_fail_w_msg (ctx, "BSON malformed");
    }
+   ectx->fed_collinfo = true;
 
    /* Cache the received collinfo. */
-   if (!_mongocrypt_cache_add_copy (
-          &ctx->crypt->cache_collinfo, ectx->ns, &as_bson, ctx->status)) {
-      return _mongocrypt_ctx_fail (ctx);
+   if (!_cache_collinfo (ctx, &as_bson)) {
+      return false;
    }
 
    if (!_set_schema_from_collinfo (ctx, &as_bson)) {
@@ -114,14 +135,44 @@ _mongo_feed_collinfo (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *in)
 }
 
 
+static bool
+_need_markings (mongocrypt_ctx_t *ctx);
+
+
+/* Compile the plan from the schema, as _mongocrypt_cache_collinfo_value_new
+ * did for the entry just cached. */
+static void
+_set_plan_from_schema (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_encrypt_t *ectx;
+   bson_t schema;
+
+   ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
+   _mongocrypt_schema_paths_cleanup (&ectx->plan);
+   if (!_mongocrypt_buffer_empty (&ectx->schema) &&
+       _mongocrypt_buffer_to_bson (&ectx->schema, &schema)) {
+      (void) _mongocrypt_schema_paths_init (&ectx->plan, &schema);
+   }
+}
+
+
 static bool
 _mongo_done_collinfo (mongocrypt_ctx_t *ctx)
 {
    _mongocrypt_ctx_encrypt_t *ectx;
 
    ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
+   /* Remember that the collection does not exist, so later contexts do not
+    * repeat listCollections until the entry expires. */
+   if (!ectx->fed_collinfo && !_cache_collinfo (ctx, NULL)) {
+      return false;
+   }
+   ectx->fetched_collinfo = true;
+   ectx->schema_digest =
+      _mongocrypt_cache_collinfo_schema_digest (&ectx->schema);
+   _set_plan_from_schema (ctx);
    ectx->parent.state = MONGOCRYPT_CTX_NEED_MONGO_MARKINGS;
-   return true;
+   return _need_markings (ctx);
 }
 
 
@@ -162,56 +213,229 @@ _mongo_op_markings (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
 }
 
 
+#define JSON_SCHEMA_KEY "\x03jsonSchema"
+#define IS_REMOTE_SCHEMA_KEY "\x08isRemoteSchema"
+
+/* The same command as _mongo_op_markings, without copying the original
+ * command or the schema:
+ * 1. the length of the command,
+ * 2. the elements of the original command,
+ * 3. the jsonSchema element header,
+ * 4. the schema,
+ * 5. the isRemoteSchema element and the terminating null byte.
+ */
 static bool
-_collect_key_from_marking (void *ctx,
-                           _mongocrypt_buffer_t *in,
-                           mongocrypt_status_t *status)
+_mongo_op_markings_iov (mongocrypt_ctx_t *ctx,
+                        mongocrypt_binary_t **iov,
+                        uint32_t *iov_count)
 {
-   _mongocrypt_marking_t marking;
+   static const uint8_t empty_doc[] = {5, 0, 0, 0, 0};
+   _mongocrypt_ctx_encrypt_t *ectx;
+   _mongocrypt_buffer_t *parts;
+   const uint8_t *schema;
+   uint32_t schema_len, cmd_len;
+   uint64_t total;
+   uint8_t *p;
+
+   ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
+   if (ectx->original_cmd.len < 5) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid BSON cmd");
+   }
+
+   if (_mongocrypt_buffer_empty (&ectx->schema)) {
+      schema = empty_doc;
+      schema_len = sizeof (empty_doc);
+   } else {
+      schema = ectx->schema.data;
+      schema_len = ectx->schema.len;
+   }
+
+   /* Elements are between the length and the terminating null byte. */
+   cmd_len = ectx->original_cmd.len - 5;
+   parts = &ectx->mongocryptd_cmd_parts;
+   if (_mongocrypt_buffer_empty (parts)) {
+      total = 4 + (uint64_t) cmd_len + sizeof (JSON_SCHEMA_KEY) + schema_len +
+              sizeof (IS_REMOTE_SCHEMA_KEY) + 1 + 1;
+      if (total > INT32_MAX) {
+         return _mongocrypt_ctx_fail_w_msg (ctx, "mongocryptd command too big");
+      }
+
+      _mongocrypt_buffer_resize (parts,
+                                 4 + sizeof (JSON_SCHEMA_KEY) +
+                                    sizeof (IS_REMOTE_SCHEMA_KEY) + 2);
+      p = parts->data;
+      p[0] = (uint8_t) (total & 0xff);
+      p[1] = (uint8_t) ((total >> 8) & 0xff);
+      p[2] = (uint8_t) ((total >> 16) & 0xff);
+      p[3] = (uint8_t) ((total >> 24) & 0xff);
+      p += 4;
+      memcpy (p, JSON_SCHEMA_KEY, sizeof (JSON_SCHEMA_KEY));
+      p += sizeof (JSON_SCHEMA_KEY);
+      memcpy (p, IS_REMOTE_SCHEMA_KEY, sizeof (IS_REMOTE_SCHEMA_KEY));
+      p += sizeof (IS_REMOTE_SCHEMA_KEY);
+      /* if a local schema was not set, set isRemoteSchema=true */
+      p[0] = ectx->used_local_schema ? 0 : 1;
+      p[1] = 0;
+   }
+
+   p = parts->data;
+   iov[0]->data = p;
+   iov[0]->len = 4;
+   iov[1]->data = ectx->original_cmd.data + 4;
+   iov[1]->len = cmd_len;
+   iov[2]->data = p + 4;
+   iov[2]->len = sizeof (JSON_SCHEMA_KEY);
+   iov[3]->data = (uint8_t *) schema;
+   iov[3]->len = schema_len;
+   iov[4]->data = p + 4 + sizeof (JSON_SCHEMA_KEY);
+   iov[4]->len = sizeof (IS_REMOTE_SCHEMA_KEY) + 2;
+   *iov_count = 5;
+   return true;
+}
+
+
+static void
+_marking_destroy (void *marking)
+{
+   _mongocrypt_marking_cleanup ((_mongocrypt_marking_t *) marking);
+   bson_free (marking);
+}
+
+
+/* Parse the marking of @item into its header, and request its key. */
+static bool
+_record_marking (void *ctx,
+                 _mongocrypt_splice_item_t *item,
+                 mongocrypt_status_t *status)
+{
+   _mongocrypt_marking_t *marking;
    _mongocrypt_key_broker_t *kb;
    bool res;
 
    kb = (_mongocrypt_key_broker_t *) ctx;
+   marking = bson_malloc (sizeof (*marking));
+   BSON_ASSERT (marking);
+   _mongocrypt_marking_init (marking);
+   /* Freed with the splice. */
+   item->header = marking;
 
-   if (!_mongocrypt_marking_parse_unowned (in, &marking, status)) {
-      _mongocrypt_marking_cleanup (&marking);
+   if (!_mongocrypt_marking_parse_unowned (&item->in, marking, status)) {
       return false;
    }
 
-   if (marking.has_alt_name) {
-      res = _mongocrypt_key_broker_request_name (kb, &marking.key_alt_name);
+   if (marking->has_alt_name) {
+      res = _mongocrypt_key_broker_request_name (kb, &marking->key_alt_name);
    } else {
-      res = _mongocrypt_key_broker_request_id (kb, &marking.key_id);
+      res = _mongocrypt_key_broker_request_id (kb, &marking->key_id);
    }
 
    if (!res) {
-      _mongocrypt_key_broker_status (kb, status);
-      _mongocrypt_marking_cleanup (&marking);
-      return false;
+      return _mongocrypt_key_broker_status (kb, status);
    }
 
-   _mongocrypt_marking_cleanup (&marking);
+   return true;
+}
+
 
+/* Mark the collinfo cache entry this context added as needing no encryption,
+ * so later contexts for the namespace skip mongocryptd. The entry is left
+ * alone if it has since been replaced by one with a different schema. */
+static bool
+_cache_no_encryption (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_encrypt_t *ectx;
+   bson_t *value = NULL;
+   bson_t *marked;
+   bson_t collinfo;
+   uint32_t digest;
+
+   ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
+   if (!_mongocrypt_cache_get (
+          ctx->crypt->cache_collinfo, ectx->ns, (void **) &value)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "failed to retrieve from cache");
+   }
+
+   if (!value) {
+      return true;
+   }
+
+   if (!_mongocrypt_cache_collinfo_value_parse (value, &collinfo, &digest)) {
+      bson_destroy (value);
+      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed cached collinfo");
+   }
+   bson_destroy (&collinfo);
+   if (digest != ectx->schema_digest ||
+       !_mongocrypt_cache_collinfo_value_requires_encryption (value)) {
+      bson_destroy (value);
+      return true;
+   }
+
+   marked = _mongocrypt_cache_collinfo_value_no_encryption_new (value);
+   bson_destroy (value);
+   if (!_mongocrypt_cache_add_stolen (
+          ctx->crypt->cache_collinfo, ectx->ns, marked, ctx->status)) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
    return true;
 }
 
 
+/* Restrict the markings collected from the marked command @cmd to the
+ * encrypted paths of the plan. Only an insert is restricted, since
+ * mongocryptd marks its documents exactly at the paths of the schema. Array
+ * indexes are not path components, so "documents.<path>" selects the path in
+ * every document. @paths backs @filter, and must be cleaned up either way. */
 static bool
-_mongo_feed_markings (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *in)
+_plan_filter (_mongocrypt_ctx_encrypt_t *ectx,
+              const bson_t *cmd,
+              _mongocrypt_schema_paths_t *paths,
+              _mongocrypt_path_filter_t *filter)
+{
+   bson_iter_t iter;
+   uint32_t i;
+
+   memset (paths, 0, sizeof (*paths));
+   memset (filter, 0, sizeof (*filter));
+   if (ectx->plan.len == 0 || !bson_iter_init (&iter, cmd) ||
+       !bson_iter_next (&iter) ||
+       0 != strcmp (bson_iter_key (&iter), "insert")) {
+      return false;
+   }
+   for (i = 0; i < ectx->plan.len; i++) {
+      char *path;
+
+      path = bson_strdup_printf ("documents.%s", ectx->plan.paths[i]);
+      _mongocrypt_schema_paths_append (paths, path);
+      bson_free (path);
+   }
+   filter->paths = paths->paths;
+   filter->len = paths->len;
+   return true;
+}
+
+
+/* Process a mongocryptd reply, received or from the markings cache. If
+ * @borrow, 'result' is viewed instead of copied, so @reply must outlive the
+ * context. */
+static bool
+_feed_markings_reply (mongocrypt_ctx_t *ctx, const bson_t *reply, bool borrow)
 {
    /* Find keys. */
    bson_t as_bson;
    bson_iter_t iter;
    _mongocrypt_ctx_encrypt_t *ectx;
+   _mongocrypt_schema_paths_t plan_paths;
+   _mongocrypt_path_filter_t filter;
+   bool ok;
 
    ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
-   if (!_mongocrypt_binary_to_bson (in, &as_bson)) {
-      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed BSON");
-   }
-
-   if (bson_iter_init_find (&iter, &as_bson, "schemaRequiresEncryption") &&
+   if (bson_iter_init_find (&iter, reply, "schemaRequiresEncryption") &&
        !bson_iter_as_bool (&iter)) {
-      /* TODO: update cache: this schema does not require encryption. */
+      /* Remember this for the remote schema, so later contexts go straight
+       * to nothing_to_do. */
+      if (ectx->fetched_collinfo && !_cache_no_encryption (ctx)) {
+         return false;
+      }
 
       /* If using a local schema, warn if there are no encrypted fields. */
       if (ectx->used_local_schema) {
@@ -232,29 +456,47 @@ _mongo_feed_markings (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *in)
       }
    }
 
-   if (bson_iter_init_find (&iter, &as_bson, "hasEncryptedPlaceholders") &&
+   if (bson_iter_init_find (&iter, reply, "hasEncryptedPlaceholders") &&
        !bson_iter_as_bool (&iter)) {
       return true;
    }
 
-   if (!bson_iter_init_find (&iter, &as_bson, "result")) {
+   if (!bson_iter_init_find (&iter, reply, "result")) {
       return _mongocrypt_ctx_fail_w_msg (ctx, "malformed marking, no 'result'");
    }
 
-   if (!_mongocrypt_buffer_copy_from_document_iter (&ectx->marked_cmd, &iter)) {
+   _mongocrypt_buffer_cleanup (&ectx->marked_cmd);
+   ok = _mongocrypt_buffer_from_document_iter (&ectx->marked_cmd, &iter);
+   if (ok && !borrow) {
+      _mongocrypt_ctx_slot_copy (ctx,
+                                 _MONGOCRYPT_CTX_SLOT_MARKED,
+                                 ectx->marked_cmd.data,
+                                 ectx->marked_cmd.len,
+                                 &ectx->marked_cmd);
+   }
+   if (!ok) {
       return _mongocrypt_ctx_fail_w_msg (
          ctx, "malformed marking, 'result' must be a document");
    }
 
-   if (!bson_iter_recurse (&iter, &iter)) {
+   if (!_mongocrypt_buffer_to_bson (&ectx->marked_cmd, &as_bson)) {
       return _mongocrypt_ctx_fail_w_msg (
          ctx, "malformed marking, could not recurse into 'result'");
    }
-   if (!_mongocrypt_traverse_binary_in_bson (_collect_key_from_marking,
-                                             (void *) &ctx->kb,
-                                             TRAVERSE_MATCH_MARKING,
-                                             &iter,
-                                             ctx->status)) {
+
+   /* Record the markings, so finalize does not look for them or parse them
+    * again. */
+   _mongocrypt_ctx_splice_release (ctx, &ectx->collected);
+   _mongocrypt_ctx_splice_init (ctx, &ectx->collected, TRAVERSE_MATCH_MARKING);
+   ectx->collected.header_destroy = _marking_destroy;
+   if (_plan_filter (ectx, &as_bson, &plan_paths, &filter)) {
+      ectx->collected.filter = &filter;
+   }
+   ok = _mongocrypt_ctx_collect_binary_in_bson (
+      ctx, _record_marking, &as_bson, &ectx->collected);
+   ectx->collected.filter = NULL;
+   _mongocrypt_schema_paths_cleanup (&plan_paths);
+   if (!ok) {
       return _mongocrypt_ctx_fail (ctx);
    }
 
@@ -262,6 +504,64 @@ _mongo_feed_markings (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *in)
 }
 
 
+/* Returns NULL if the command is malformed. Initializes @cmd from the
+ * original command. */
+static _mongocrypt_cache_markings_attr_t *
+_markings_attr_new (mongocrypt_ctx_t *ctx, bson_t *cmd)
+{
+   _mongocrypt_ctx_encrypt_t *ectx;
+
+   ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
+   if (!_mongocrypt_buffer_to_bson (&ectx->original_cmd, cmd)) {
+      return NULL;
+   }
+   return _mongocrypt_cache_markings_attr_new (ectx->ns,
+                                               &ectx->schema,
+                                               ectx->schema_digest,
+                                               !ectx->used_local_schema,
+                                               cmd);
+}
+
+
+static bool
+_mongo_feed_markings (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *in)
+{
+   _mongocrypt_cache_markings_attr_t *attr;
+   bson_t as_bson, cmd;
+   bson_t *template;
+
+   if (!_mongocrypt_binary_to_bson (in, &as_bson)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed BSON");
+   }
+
+   if (!_feed_markings_reply (ctx, &as_bson, ctx->feed_unowned)) {
+      return false;
+   }
+
+   if (!ctx->crypt->opts.use_markings_cache) {
+      return true;
+   }
+
+   attr = _markings_attr_new (ctx, &cmd);
+   if (!attr) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid BSON cmd");
+   }
+
+   /* Replies that cannot be made into a template are not cached. */
+   template = _mongocrypt_markings_template_new (&cmd, &as_bson);
+   if (template && !_mongocrypt_cache_add_stolen (&ctx->crypt->cache_markings,
+                                                  attr,
+                                                  template,
+                                                  ctx->status)) {
+      bson_destroy (template);
+      _mongocrypt_cache_markings_attr_destroy (attr);
+      return _mongocrypt_ctx_fail (ctx);
+   }
+   _mongocrypt_cache_markings_attr_destroy (attr);
+   return true;
+}
+
+
 static bool
 _mongo_done_markings (mongocrypt_ctx_t *ctx)
 {
@@ -270,71 +570,483 @@ _mongo_done_markings (mongocrypt_ctx_t *ctx)
 }
 
 
+/* Called when the context needs markings. If the markings cache has a
+ * template for the command, fill it in instead of asking mongocryptd. */
+static bool
+_try_markings_from_cache (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_cache_markings_attr_t *attr;
+   bson_t cmd, reply;
+   bson_t *template = NULL;
+   bool ret;
+
+   if (!ctx->crypt->opts.use_markings_cache) {
+      return true;
+   }
+
+   attr = _markings_attr_new (ctx, &cmd);
+   if (!attr) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid BSON cmd");
+   }
+
+   ret = _mongocrypt_cache_get (
+      &ctx->crypt->cache_markings, attr, (void **) &template);
+   _mongocrypt_cache_markings_attr_destroy (attr);
+   if (!ret) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "failed to retrieve from cache");
+   }
+
+   if (!template) {
+      return true;
+   }
+
+   ret = _mongocrypt_markings_template_apply (
+      template, &cmd, &reply, ctx->status);
+   bson_destroy (template);
+   if (!ret) {
+      bson_destroy (&reply);
+      return _mongocrypt_ctx_fail (ctx);
+   }
+
+   ret = _feed_markings_reply (ctx, &reply, false);
+   bson_destroy (&reply);
+   if (!ret) {
+      return false;
+   }
+   return _mongo_done_markings (ctx);
+}
+
+
+/* Called when the context needs markings. If local marking is enabled for
+ * the namespace and supports the command, mark it without mongocryptd. */
+static bool
+_try_local_markings (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_encrypt_t *ectx;
+   bson_t namespaces, cmd, schema, reply;
+   bson_iter_t iter;
+   bool ret;
+
+   ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
+   if (_mongocrypt_buffer_empty (&ctx->crypt->opts.local_marking_ns) ||
+       !_mongocrypt_buffer_to_bson (&ctx->crypt->opts.local_marking_ns,
+                                    &namespaces) ||
+       !bson_iter_init_find (&iter, &namespaces, ectx->ns)) {
+      return true;
+   }
+
+   if (!_mongocrypt_buffer_to_bson (&ectx->original_cmd, &cmd)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid BSON cmd");
+   }
+
+   if (_mongocrypt_buffer_empty (&ectx->schema)) {
+      bson_init (&schema);
+   } else if (!_mongocrypt_buffer_to_bson (&ectx->schema, &schema)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid BSON schema");
+   }
+
+   if (!_mongocrypt_marking_mark_locally (&schema, &cmd, &reply)) {
+      /* Unsupported. mongocryptd marks the command. */
+      bson_destroy (&reply);
+      bson_destroy (&schema);
+      return true;
+   }
+   bson_destroy (&schema);
+
+   ret = _feed_markings_reply (ctx, &reply, false);
+   bson_destroy (&reply);
+   if (!ret) {
+      return false;
+   }
+   return _mongo_done_markings (ctx);
+}
+
+
+/* Called when the context needs markings. If the command provably
+ * references no encrypted path of the schema, skip markings entirely. */
+static bool
+_try_skip_markings (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_encrypt_t *ectx;
+   _mongocrypt_schema_paths_t paths;
+   bson_t cmd, schema;
+   bool disjoint;
+
+   ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
+   /* mongocryptd reports an error for a schema with siblings that requires
+    * encryption. */
+   if (!ctx->crypt->opts.skip_unencrypted_cmds ||
+       ectx->collinfo_has_siblings) {
+      return true;
+   }
+
+   if (!_mongocrypt_buffer_to_bson (&ectx->original_cmd, &cmd)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid BSON cmd");
+   }
+
+   if (_mongocrypt_buffer_empty (&ectx->schema)) {
+      bson_init (&schema);
+   } else if (!_mongocrypt_buffer_to_bson (&ectx->schema, &schema)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid BSON schema");
+   }
+
+   if (!_mongocrypt_schema_paths_init (&paths, &schema)) {
+      bson_destroy (&schema);
+      return true;
+   }
+   bson_destroy (&schema);
+
+   disjoint = _mongocrypt_schema_paths_cmd_is_disjoint (&paths, &cmd);
+   _mongocrypt_schema_paths_cleanup (&paths);
+   if (disjoint) {
+      ctx->nothing_to_do = true;
+      ctx->state = MONGOCRYPT_CTX_READY;
+   }
+   return true;
+}
+
+
+static bool
+_need_markings (mongocrypt_ctx_t *ctx)
+{
+   if (!_try_skip_markings (ctx)) {
+      return false;
+   }
+   if (ctx->state != MONGOCRYPT_CTX_NEED_MONGO_MARKINGS) {
+      return true;
+   }
+   if (!_try_local_markings (ctx)) {
+      return false;
+   }
+   if (ctx->state != MONGOCRYPT_CTX_NEED_MONGO_MARKINGS) {
+      return true;
+   }
+   return _try_markings_from_cache (ctx);
+}
+
+
+/* Transfer ownership of the serialized ciphertext @serialized to @out. */
+static void
+_serialized_to_bson_value (_mongocrypt_buffer_t *serialized, bson_value_t *out)
+{
+   BSON_ASSERT (serialized->owned);
+
+   out->value_type = BSON_TYPE_BINARY;
+   out->value.v_binary.data = serialized->data;
+   out->value.v_binary.data_len = serialized->len;
+   out->value.v_binary.subtype = (bson_subtype_t) 6;
+   _mongocrypt_buffer_init (serialized);
+}
+
+
 static bool
 _marking_to_bson_value (void *ctx,
                         _mongocrypt_marking_t *marking,
                         bson_value_t *out,
                         mongocrypt_status_t *status)
 {
-   _mongocrypt_ciphertext_t ciphertext;
-   _mongocrypt_buffer_t serialized_ciphertext = {0};
+   _mongocrypt_buffer_t serialized;
+
+   BSON_ASSERT (out);
+
+   /* The ciphertext is encrypted in place, in the buffer given to @out. */
+   if (!_mongocrypt_marking_to_serialized_ciphertext (
+          ctx, marking, &serialized, status)) {
+      return false;
+   }
+
+   _serialized_to_bson_value (&serialized, out);
+   return true;
+}
+
+
+static bool
+_replace_marking_with_ciphertext (void *ctx,
+                                  _mongocrypt_splice_item_t *item,
+                                  mongocrypt_status_t *status)
+{
+   _mongocrypt_marking_t marking;
+   bool ret;
+
+   BSON_ASSERT (item);
+
+   if (item->header) {
+      return _marking_to_bson_value (
+         ctx, (_mongocrypt_marking_t *) item->header, &item->out, status);
+   }
+
+   memset (&marking, 0, sizeof (marking));
+
+   if (!_mongocrypt_marking_parse_unowned (&item->in, &marking, status)) {
+      _mongocrypt_marking_cleanup (&marking);
+      return false;
+   }
+
+   ret = _marking_to_bson_value (ctx, &marking, &item->out, status);
+   _mongocrypt_marking_cleanup (&marking);
+   return ret;
+}
+
+/* Deterministic markings with the same bytes have the same key, algorithm,
+ * and value, so they encrypt to the same ciphertext. */
+static bool
+_is_deterministic_marking (const _mongocrypt_splice_item_t *item)
+{
+   const _mongocrypt_marking_t *marking;
+
+   marking = (const _mongocrypt_marking_t *) item->header;
+   return marking &&
+          marking->algorithm == MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC;
+}
+
+/* Encrypt every marking of a document at once, with the batch crypto hook. */
+static bool
+_replace_markings_with_ciphertexts (void *ctx,
+                                    _mongocrypt_splice_item_t *items,
+                                    uint32_t n_items,
+                                    mongocrypt_status_t *status)
+{
+   _mongocrypt_key_broker_t *kb;
+   _mongocrypt_ciphertext_t *ciphertexts;
+   _mongocrypt_buffer_t *serialized;
+   _mongocrypt_encryption_job_t *jobs;
+   uint32_t i;
    bool ret = false;
 
-   BSON_ASSERT (out);
+   BSON_ASSERT (ctx);
+   BSON_ASSERT (items);
+
+   kb = (_mongocrypt_key_broker_t *) ctx;
+   ciphertexts = bson_malloc0 (n_items * sizeof (*ciphertexts));
+   BSON_ASSERT (ciphertexts);
+   serialized = bson_malloc0 (n_items * sizeof (*serialized));
+   BSON_ASSERT (serialized);
+   jobs = bson_malloc0 (n_items * sizeof (*jobs));
+   BSON_ASSERT (jobs);
+
+   for (i = 0; i < n_items; i++) {
+      _mongocrypt_marking_t marking, *parsed;
+      bool ok;
+
+      memset (&marking, 0, sizeof (marking));
+      _mongocrypt_ciphertext_init (&ciphertexts[i]);
+      parsed = (_mongocrypt_marking_t *) items[i].header;
+      ok = true;
+      if (!parsed) {
+         ok = _mongocrypt_marking_parse_unowned (
+            &items[i].in, &marking, status);
+         parsed = &marking;
+      }
+      ok = ok && _mongocrypt_marking_prepare_encryption (kb,
+                                                         parsed,
+                                                         &ciphertexts[i],
+                                                         &serialized[i],
+                                                         &jobs[i],
+                                                         status);
+      _mongocrypt_marking_cleanup (&marking);
+      if (!ok) {
+         goto fail;
+      }
+   }
+
+   if (!_mongocrypt_do_encryption_batch (
+          kb->crypt->crypto, jobs, n_items, status)) {
+      goto fail;
+   }
+
+   for (i = 0; i < n_items; i++) {
+      _serialized_to_bson_value (&serialized[i], &items[i].out);
+   }
+
+   ret = true;
+
+fail:
+   for (i = 0; i < n_items; i++) {
+      _mongocrypt_encryption_job_cleanup (&jobs[i]);
+      _mongocrypt_ciphertext_cleanup (&ciphertexts[i]);
+      _mongocrypt_buffer_cleanup (&serialized[i]);
+   }
+   bson_free (jobs);
+   bson_free (serialized);
+   bson_free (ciphertexts);
+   return ret;
+}
+
+/* Parse one message of an explicit batch:
+ * {v: <value>, algorithm: <string>, keyId: <UUID> | keyAltName: <string>}
+ * into a fake marking. */
+static bool
+_parse_batch_msg (bson_iter_t *msg_iter,
+                  _mongocrypt_marking_t *out,
+                  mongocrypt_status_t *status)
+{
+   bson_iter_t iter;
+   bool has_v = false, has_key_id = false;
+
+   _mongocrypt_marking_init (out);
+
+   if (!BSON_ITER_HOLDS_DOCUMENT (msg_iter) ||
+       !bson_iter_recurse (msg_iter, &iter)) {
+      CLIENT_ERR ("invalid msgs, each element must be a document");
+      return false;
+   }
+
+   while (bson_iter_next (&iter)) {
+      const char *field;
+
+      field = bson_iter_key (&iter);
+      BSON_ASSERT (field);
+      if (0 == strcmp ("v", field)) {
+         has_v = true;
+         memcpy (&out->v_iter, &iter, sizeof (bson_iter_t));
+         continue;
+      }
+
+      if (0 == strcmp ("keyId", field)) {
+         _mongocrypt_buffer_cleanup (&out->key_id);
+         if (!_mongocrypt_buffer_from_uuid_iter (&out->key_id, &iter)) {
+            CLIENT_ERR ("keyId must be a UUID");
+            return false;
+         }
+         has_key_id = true;
+         continue;
+      }
+
+      if (0 == strcmp ("keyAltName", field)) {
+         if (!BSON_ITER_HOLDS_UTF8 (&iter)) {
+            CLIENT_ERR ("keyAltName must be a UTF8");
+            return false;
+         }
+         if (out->has_alt_name) {
+            bson_value_destroy (&out->key_alt_name);
+         }
+         bson_value_copy (bson_iter_value (&iter), &out->key_alt_name);
+         out->has_alt_name = true;
+         continue;
+      }
+
+      if (0 == strcmp ("algorithm", field)) {
+         const char *algorithm;
+         uint32_t len;
+
+         if (!BSON_ITER_HOLDS_UTF8 (&iter)) {
+            CLIENT_ERR ("algorithm must be a UTF8");
+            return false;
+         }
+         algorithm = bson_iter_utf8 (&iter, &len);
+         if (len == ALGORITHM_DETERMINISTIC_LEN &&
+             0 == strcmp (algorithm, ALGORITHM_DETERMINISTIC)) {
+            out->algorithm = MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC;
+         } else if (len == ALGORITHM_RANDOM_LEN &&
+                    0 == strcmp (algorithm, ALGORITHM_RANDOM)) {
+            out->algorithm = MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM;
+         } else if (len == ALGORITHM_RANDOM_COMPRESSED_LEN &&
+                    0 == strcmp (algorithm, ALGORITHM_RANDOM_COMPRESSED)) {
+            out->algorithm =
+               MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM_COMPRESSED;
+         } else {
+            CLIENT_ERR ("unsupported algorithm");
+            return false;
+         }
+         continue;
+      }
+
+      CLIENT_ERR ("unrecognized field '%s'", field);
+      return false;
+   }
+
+   if (!has_v) {
+      CLIENT_ERR ("invalid msg, must contain 'v'");
+      return false;
+   }
 
-   _mongocrypt_ciphertext_init (&ciphertext);
+   if (out->algorithm == MONGOCRYPT_ENCRYPTION_ALGORITHM_NONE) {
+      CLIENT_ERR ("invalid msg, must contain 'algorithm'");
+      return false;
+   }
 
-   if (!_mongocrypt_marking_to_ciphertext (ctx, marking, &ciphertext, status)) {
-      goto fail;
+   if (has_key_id == out->has_alt_name) {
+      CLIENT_ERR ("invalid msg, must contain one of 'keyId' or 'keyAltName'");
+      return false;
    }
 
-   if (!_mongocrypt_serialize_ciphertext (&ciphertext,
-                                          &serialized_ciphertext)) {
-      CLIENT_ERR ("malformed ciphertext");
-      goto fail;
-   };
+   return true;
+}
 
-   /* ownership of serialized_ciphertext is transferred to caller. */
-   out->value_type = BSON_TYPE_BINARY;
-   out->value.v_binary.data = serialized_ciphertext.data;
-   out->value.v_binary.data_len = serialized_ciphertext.len;
-   out->value.v_binary.subtype = (bson_subtype_t) 6;
 
-   ret = true;
+/* An upper bound of the length of the output of an explicit batch, so it is
+ * built in one allocation. Each message is at least as long as its value. */
+static uint32_t
+_explicit_batch_capacity (const bson_t *msgs)
+{
+   bson_iter_t iter;
+   uint64_t len = 5;
 
-fail:
-   _mongocrypt_ciphertext_cleanup (&ciphertext);
-   return ret;
+   if (!bson_iter_init (&iter, msgs)) {
+      return 0;
+   }
+   while (bson_iter_next (&iter)) {
+      const uint8_t *data;
+      uint32_t msg_len = 0;
+
+      if (BSON_ITER_HOLDS_DOCUMENT (&iter)) {
+         bson_iter_document (&iter, &msg_len, &data);
+      }
+      /* {<key>: {v: <binary subtype 6>}}. The ciphertext is prefixed by its
+       * type byte, key id, and original type. */
+      len += 1u + bson_iter_key_len (&iter) + 1u + 4u + 3u + 4u + 1u + 1u +
+             16u + 1u + _mongocrypt_calculate_ciphertext_len (msg_len) + 1u;
+   }
+   return (uint32_t) BSON_MIN (len, (uint64_t) INT32_MAX);
 }
 
 
+/* Encrypt every message of an explicit batch. Each output element has the key
+ * of its message, and is the {v: <ciphertext>} doc. */
 static bool
-_replace_marking_with_ciphertext (void *ctx,
-                                  _mongocrypt_buffer_t *in,
-                                  bson_value_t *out,
-                                  mongocrypt_status_t *status)
+_finalize_explicit_batch (mongocrypt_ctx_t *ctx,
+                          bson_t *msgs,
+                          bson_t *converted)
 {
-   _mongocrypt_marking_t marking;
-   bool ret;
+   bson_iter_t iter;
 
-   BSON_ASSERT (in);
+   bson_iter_init (&iter, msgs);
+   while (bson_iter_next (&iter)) {
+      _mongocrypt_marking_t marking;
+      bson_value_t value;
+      bson_t child;
+      bool res;
 
-   memset (&marking, 0, sizeof (marking));
+      memset (&value, 0, sizeof (value));
+      res = _parse_batch_msg (&iter, &marking, ctx->status) &&
+            _marking_to_bson_value (&ctx->kb, &marking, &value, ctx->status);
+      if (res) {
+         bson_append_document_begin (converted,
+                                     bson_iter_key (&iter),
+                                     (int) bson_iter_key_len (&iter),
+                                     &child);
+         bson_append_value (&child, MONGOCRYPT_STR_AND_LEN ("v"), &value);
+         bson_append_document_end (converted, &child);
+         _mongocrypt_atomic_add_int64 (&ctx->crypt->stats.fields_encrypted, 1);
+         ctx->timings.fields++;
+      }
 
-   if (!_mongocrypt_marking_parse_unowned (in, &marking, status)) {
+      bson_value_destroy (&value);
       _mongocrypt_marking_cleanup (&marking);
-      return false;
+
+      if (!res) {
+         return false;
+      }
    }
 
-   ret = _marking_to_bson_value (ctx, &marking, out, status);
-   _mongocrypt_marking_cleanup (&marking);
-   return ret;
+   return true;
 }
 
+
 static bool
 _finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
 {
-   bson_t as_bson, converted;
+   bson_t as_bson, *converted;
    bson_iter_t iter;
    _mongocrypt_ctx_encrypt_t *ectx;
    bool res;
@@ -347,25 +1059,39 @@ _finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
          ctx->state = MONGOCRYPT_CTX_DONE;
          return true;
       }
-      if (!_mongocrypt_buffer_to_bson (&ectx->marked_cmd, &as_bson)) {
+      /* collected is set once a marked command is fed. */
+      if (!ectx->collected.in_data) {
+         return _mongocrypt_ctx_fail_w_msg (ctx, "malformed bson");
+      }
+
+      /* Transform the markings recorded when their keys were requested.
+       * Repeated deterministic markings are encrypted once. */
+      _mongocrypt_splice_dedupe (&ectx->collected, _is_deterministic_marking);
+      res = _mongocrypt_ctx_transform_splice (
+         ctx,
+         _replace_marking_with_ciphertext,
+         _replace_markings_with_ciphertexts,
+         &ectx->collected,
+         &ectx->encrypted_cmd);
+      if (!res) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
+   } else if (ectx->explicit_batch) {
+      if (!_mongocrypt_buffer_to_bson (&ectx->original_cmd, &as_bson)) {
          return _mongocrypt_ctx_fail_w_msg (ctx, "malformed bson");
       }
 
-      bson_iter_init (&iter, &as_bson);
-      bson_init (&converted);
-      if (!_mongocrypt_transform_binary_in_bson (
-             _replace_marking_with_ciphertext,
-             &ctx->kb,
-             TRAVERSE_MATCH_MARKING,
-             &iter,
-             &converted,
-             ctx->status)) {
+      converted = bson_sized_new (_explicit_batch_capacity (&as_bson));
+      if (!_finalize_explicit_batch (ctx, &as_bson, converted)) {
+         bson_destroy (converted);
          return _mongocrypt_ctx_fail (ctx);
       }
+      _mongocrypt_buffer_steal_from_bson (&ectx->encrypted_cmd, converted);
    } else {
       /* For explicit encryption, we have no marking, but we can fake one */
       _mongocrypt_marking_t marking;
       bson_value_t value;
+      uint32_t len;
 
       memset (&value, 0, sizeof (value));
 
@@ -390,22 +1116,27 @@ _finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
          marking.has_alt_name = true;
       }
 
-      bson_init (&converted);
       res = _marking_to_bson_value (&ctx->kb, &marking, &value, ctx->status);
-      if (res) {
-         bson_append_value (&converted, MONGOCRYPT_STR_AND_LEN ("v"), &value);
+      if (res && ectx->raw) {
+         _mongocrypt_buffer_from_raw_value (&ectx->encrypted_cmd, &value);
+      } else if (res) {
+         /* The document length, the element, and the terminator. */
+         len = 4u + _mongocrypt_bson_element_len (1u, &value) + 1u;
+         converted = bson_sized_new (len);
+         bson_append_value (converted, MONGOCRYPT_STR_AND_LEN ("v"), &value);
+         _mongocrypt_buffer_steal_from_bson (&ectx->encrypted_cmd, converted);
       }
 
       bson_value_destroy (&value);
       _mongocrypt_marking_cleanup (&marking);
 
       if (!res) {
-         bson_destroy (&converted);
          return _mongocrypt_ctx_fail (ctx);
       }
+      _mongocrypt_atomic_add_int64 (&ctx->crypt->stats.fields_encrypted, 1);
+      ctx->timings.fields++;
    }
 
-   _mongocrypt_buffer_steal_from_bson (&ectx->encrypted_cmd, &converted);
    _mongocrypt_buffer_to_binary (&ectx->encrypted_cmd, out);
    ctx->state = MONGOCRYPT_CTX_DONE;
 
@@ -413,6 +1144,16 @@ _finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
 }
 
 
+static _mongocrypt_buffer_t *
+_result (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_encrypt_t *ectx;
+
+   ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
+   return &ectx->encrypted_cmd;
+}
+
+
 static void
 _cleanup (mongocrypt_ctx_t *ctx)
 {
@@ -424,37 +1165,30 @@ _cleanup (mongocrypt_ctx_t *ctx)
    bson_free (ectx->coll_name);
    _mongocrypt_buffer_cleanup (&ectx->list_collections_filter);
    _mongocrypt_buffer_cleanup (&ectx->schema);
+   _mongocrypt_schema_paths_cleanup (&ectx->plan);
    _mongocrypt_buffer_cleanup (&ectx->original_cmd);
    _mongocrypt_buffer_cleanup (&ectx->mongocryptd_cmd);
+   _mongocrypt_buffer_cleanup (&ectx->mongocryptd_cmd_parts);
    _mongocrypt_buffer_cleanup (&ectx->marked_cmd);
+   _mongocrypt_ctx_splice_release (ctx, &ectx->collected);
    _mongocrypt_buffer_cleanup (&ectx->encrypted_cmd);
+   _mongocrypt_buffer_cleanup (&ectx->prefetch_filter);
 }
 
 
 static bool
 _try_schema_from_schema_map (mongocrypt_ctx_t *ctx)
 {
-   mongocrypt_t *crypt;
    _mongocrypt_ctx_encrypt_t *ectx;
-   bson_t schema_map;
-   bson_iter_t iter;
 
-   crypt = ctx->crypt;
    ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
 
-   if (_mongocrypt_buffer_empty (&crypt->opts.schema_map)) {
-      /* No schema map set. */
-      return true;
-   }
-
-   if (!_mongocrypt_buffer_to_bson (&crypt->opts.schema_map, &schema_map)) {
-      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed schema map");
-   }
-
-   if (bson_iter_init_find (&iter, &schema_map, ectx->ns)) {
-      if (!_mongocrypt_buffer_copy_from_document_iter (&ectx->schema, &iter)) {
-         return _mongocrypt_ctx_fail_w_msg (ctx, "malformed schema map");
-      }
+   /* The schema map outlives the context, so the schema is not copied. */
+   if (_mongocrypt_schema_map_find (&ctx->crypt->schema_map,
+                                    ectx->ns,
+                                    &ectx->schema,
+                                    &ectx->schema_digest,
+                                    &ectx->plan)) {
       ectx->used_local_schema = true;
       ctx->state = MONGOCRYPT_CTX_NEED_MONGO_MARKINGS;
    }
@@ -468,29 +1202,52 @@ static bool
 _try_schema_from_cache (mongocrypt_ctx_t *ctx)
 {
    _mongocrypt_ctx_encrypt_t *ectx;
-   bson_t *collinfo = NULL;
+   bson_t *value = NULL;
+   bson_t collinfo;
+   bool ret;
 
    ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
 
    /* Otherwise, we need a remote schema. Check if we have a response to
     * listCollections cached. */
-   if (!_mongocrypt_cache_get (&ctx->crypt->cache_collinfo,
+   if (!_mongocrypt_cache_get (ctx->crypt->cache_collinfo,
                                ectx->ns /* null terminated */,
-                               (void **) &collinfo)) {
+                               (void **) &value)) {
       return _mongocrypt_ctx_fail_w_msg (ctx, "failed to retrieve from cache");
    }
 
-   if (collinfo) {
-      if (!_set_schema_from_collinfo (ctx, collinfo)) {
-         return _mongocrypt_ctx_fail (ctx);
-      }
-      ctx->state = MONGOCRYPT_CTX_NEED_MONGO_MARKINGS;
-   } else {
+   if (!value) {
       /* we need to get it. */
+      _mongocrypt_atomic_add_int64 (&ctx->ns_stats->collinfo_misses, 1);
       ctx->state = MONGOCRYPT_CTX_NEED_MONGO_COLLINFO;
+      return true;
+   }
+
+   /* A collection without a schema, or without a collection, is cached too,
+    * and also goes straight to markings. */
+   if (!_mongocrypt_cache_collinfo_value_parse (
+          value, &collinfo, &ectx->schema_digest)) {
+      bson_destroy (value);
+      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed cached collinfo");
+   }
+   ret = _set_schema_from_collinfo (ctx, &collinfo);
+   bson_destroy (&collinfo);
+   if (!ret) {
+      bson_destroy (value);
+      return _mongocrypt_ctx_fail (ctx);
    }
 
-   bson_destroy (collinfo);
+   (void) _mongocrypt_cache_collinfo_value_paths (value, &ectx->plan);
+
+   /* mongocryptd already reported that this schema encrypts nothing. */
+   if (!_mongocrypt_cache_collinfo_value_requires_encryption (value)) {
+      bson_destroy (value);
+      ctx->nothing_to_do = true;
+      ctx->state = MONGOCRYPT_CTX_READY;
+      return true;
+   }
+   bson_destroy (value);
+   ctx->state = MONGOCRYPT_CTX_NEED_MONGO_MARKINGS;
    return true;
 }
 
@@ -556,9 +1313,12 @@ fail:
    return ret;
 }
 
-bool
-mongocrypt_ctx_explicit_encrypt_init (mongocrypt_ctx_t *ctx,
-                                      mongocrypt_binary_t *msg)
+/* Shared by explicit_encrypt_init and explicit_encrypt_value_init. If @raw,
+ * @msg is a raw value instead of a { "v": <value> } document. */
+static bool
+_explicit_encrypt_init (mongocrypt_ctx_t *ctx,
+                        mongocrypt_binary_t *msg,
+                        bool raw)
 {
    _mongocrypt_ctx_encrypt_t *ectx;
    bson_t as_bson;
@@ -580,6 +1340,7 @@ mongocrypt_ctx_explicit_encrypt_init (mongocrypt_ctx_t *ctx,
    ctx->type = _MONGOCRYPT_TYPE_ENCRYPT;
    ectx->explicit = true;
    ctx->vtable.finalize = _finalize;
+   ctx->vtable.result = _result;
    ctx->vtable.cleanup = _cleanup;
 
    if (!msg || !msg->data) {
@@ -600,14 +1361,33 @@ mongocrypt_ctx_explicit_encrypt_init (mongocrypt_ctx_t *ctx,
 
    _mongocrypt_buffer_init (&ectx->original_cmd);
 
-   _mongocrypt_buffer_copy_from_binary (&ectx->original_cmd, msg);
+   if (raw) {
+      _mongocrypt_buffer_t raw_value;
+
+      ectx->raw = true;
+      _mongocrypt_buffer_from_binary (&raw_value, msg);
+      if (!_mongocrypt_buffer_wrap_raw_value (&ectx->original_cmd,
+                                              &raw_value)) {
+         return _mongocrypt_ctx_fail_w_msg (ctx, "malformed raw value");
+      }
+   } else {
+      _mongocrypt_ctx_slot_copy (ctx,
+                                 _MONGOCRYPT_CTX_SLOT_INPUT,
+                                 msg->data,
+                                 msg->len,
+                                 &ectx->original_cmd);
+   }
    if (!_mongocrypt_buffer_to_bson (&ectx->original_cmd, &as_bson)) {
       return _mongocrypt_ctx_fail_w_msg (ctx, "msg must be bson");
    }
 
-   if (ctx->crypt->log.trace_enabled) {
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
+      mongocrypt_binary_t wrapped;
       char *cmd_val;
-      cmd_val = _mongocrypt_new_json_string_from_binary (msg);
+
+      /* Log a raw value as the document it was wrapped in. */
+      _mongocrypt_buffer_to_binary (&ectx->original_cmd, &wrapped);
+      cmd_val = _mongocrypt_new_json_string_from_binary (&wrapped);
       _mongocrypt_log (&ctx->crypt->log,
                        MONGOCRYPT_LOG_LEVEL_TRACE,
                        "%s (%s=\"%s\")",
@@ -629,6 +1409,163 @@ mongocrypt_ctx_explicit_encrypt_init (mongocrypt_ctx_t *ctx,
    return _mongocrypt_ctx_state_from_key_broker (ctx);
 }
 
+bool
+mongocrypt_ctx_explicit_encrypt_init (mongocrypt_ctx_t *ctx,
+                                      mongocrypt_binary_t *msg)
+{
+   return _explicit_encrypt_init (ctx, msg, false);
+}
+
+bool
+mongocrypt_ctx_explicit_encrypt_value_init (mongocrypt_ctx_t *ctx,
+                                            mongocrypt_binary_t *value)
+{
+   return _explicit_encrypt_init (ctx, value, true);
+}
+
+bool
+mongocrypt_explicit_encrypt_cached (mongocrypt_t *crypt,
+                                    mongocrypt_binary_t *key_id,
+                                    const char *algorithm,
+                                    mongocrypt_binary_t *value,
+                                    mongocrypt_binary_t *out,
+                                    mongocrypt_status_t *status)
+{
+   mongocrypt_ctx_t *ctx;
+   bool ret = false;
+
+   if (!crypt || !status) {
+      return false;
+   }
+
+   if (!out) {
+      CLIENT_ERR ("invalid NULL input");
+      return false;
+   }
+
+   ctx = mongocrypt_ctx_new (crypt);
+   if (!ctx) {
+      _mongocrypt_status_copy_to (crypt->status, status);
+      return false;
+   }
+
+   if (!mongocrypt_ctx_setopt_key_id (ctx, key_id) ||
+       !mongocrypt_ctx_setopt_algorithm (ctx, algorithm, -1) ||
+       !mongocrypt_ctx_explicit_encrypt_init (ctx, value)) {
+      goto done;
+   }
+
+   if (ctx->state != MONGOCRYPT_CTX_READY) {
+      /* The key must be fetched or decrypted first. */
+      if (out->owned) {
+         bson_free (out->data);
+      }
+      out->data = NULL;
+      out->len = 0;
+      out->owned = false;
+      ret = true;
+      goto done;
+   }
+
+   ret = mongocrypt_ctx_finalize_steal (ctx, out);
+
+done:
+   if (!ret) {
+      _mongocrypt_status_copy_to (ctx->status, status);
+   }
+   mongocrypt_ctx_destroy (ctx);
+   return ret;
+}
+
+
+bool
+mongocrypt_ctx_explicit_encrypt_batch_init (mongocrypt_ctx_t *ctx,
+                                            mongocrypt_binary_t *msgs)
+{
+   _mongocrypt_ctx_encrypt_t *ectx;
+   bson_t as_bson;
+   bson_iter_t iter;
+   _mongocrypt_ctx_opts_spec_t opts_spec;
+
+   if (!ctx) {
+      return false;
+   }
+   /* Each message carries its own key and algorithm. */
+   memset (&opts_spec, 0, sizeof (opts_spec));
+
+   if (!_mongocrypt_ctx_init (ctx, &opts_spec)) {
+      return false;
+   }
+
+   ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
+   ctx->type = _MONGOCRYPT_TYPE_ENCRYPT;
+   ectx->explicit = true;
+   ectx->explicit_batch = true;
+   ctx->vtable.finalize = _finalize;
+   ctx->vtable.result = _result;
+   ctx->vtable.cleanup = _cleanup;
+
+   if (!msgs || !msgs->data) {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "msgs required for explicit encryption");
+   }
+
+   _mongocrypt_buffer_init (&ectx->original_cmd);
+
+   _mongocrypt_ctx_slot_copy (ctx,
+                              _MONGOCRYPT_CTX_SLOT_INPUT,
+                              msgs->data,
+                              msgs->len,
+                              &ectx->original_cmd);
+   if (!_mongocrypt_buffer_to_bson (&ectx->original_cmd, &as_bson)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "msgs must be bson");
+   }
+
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
+      char *cmd_val;
+      cmd_val = _mongocrypt_new_json_string_from_binary (msgs);
+      _mongocrypt_log (&ctx->crypt->log,
+                       MONGOCRYPT_LOG_LEVEL_TRACE,
+                       "%s (%s=\"%s\")",
+                       BSON_FUNC,
+                       "msgs",
+                       cmd_val);
+      bson_free (cmd_val);
+   }
+
+   /* Request the keys of every message up front, so the whole batch is
+    * resolved with one pass through the key broker. */
+   bson_iter_init (&iter, &as_bson);
+   while (bson_iter_next (&iter)) {
+      _mongocrypt_marking_t marking;
+      bool res;
+
+      res = _parse_batch_msg (&iter, &marking, ctx->status) &&
+            _permitted_for_encryption (
+               &marking.v_iter, marking.algorithm, ctx->status);
+      if (res) {
+         if (marking.has_alt_name) {
+            res = _mongocrypt_key_broker_request_name (&ctx->kb,
+                                                       &marking.key_alt_name);
+         } else {
+            res = _mongocrypt_key_broker_request_id (&ctx->kb,
+                                                     &marking.key_id);
+         }
+         if (!res) {
+            _mongocrypt_key_broker_status (&ctx->kb, ctx->status);
+         }
+      }
+      _mongocrypt_marking_cleanup (&marking);
+
+      if (!res) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
+   }
+
+   (void) _mongocrypt_key_broker_requests_done (&ctx->kb);
+   return _mongocrypt_ctx_state_from_key_broker (ctx);
+}
+
 static bool
 _check_cmd_for_auto_encrypt (mongocrypt_binary_t *cmd,
                              bool *bypass,
@@ -780,6 +1717,49 @@ _check_cmd_for_auto_encrypt (mongocrypt_binary_t *cmd,
    return false;
 }
 
+/* Start a context that prefetches the keys named in the schema, once the
+ * schema is known. */
+static bool
+_start_concurrent (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_encrypt_t *ectx;
+   mongocrypt_binary_t *filter;
+   mongocrypt_ctx_t *prefetch_ctx;
+
+   ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
+   if (ectx->started_concurrent ||
+       ctx->state == MONGOCRYPT_CTX_NEED_MONGO_COLLINFO) {
+      return true;
+   }
+   ectx->started_concurrent = true;
+   if (ctx->state != MONGOCRYPT_CTX_NEED_MONGO_MARKINGS) {
+      /* Keys are already requested, or not needed. */
+      return true;
+   }
+
+   filter = mongocrypt_binary_new ();
+   if (!mongocrypt_ctx_encrypt_prefetch_filter (ctx, filter)) {
+      mongocrypt_binary_destroy (filter);
+      return false;
+   }
+   if (ectx->prefetch_filter_count == 0) {
+      mongocrypt_binary_destroy (filter);
+      return true;
+   }
+
+   prefetch_ctx = mongocrypt_ctx_new (ctx->crypt);
+   if (!prefetch_ctx ||
+       !mongocrypt_ctx_prefetch_keys_init (prefetch_ctx, filter)) {
+      /* Not an error. ctx fetches the keys itself. */
+      mongocrypt_ctx_destroy (prefetch_ctx);
+      prefetch_ctx = NULL;
+   }
+   mongocrypt_binary_destroy (filter);
+   ctx->concurrent = prefetch_ctx;
+   return true;
+}
+
+
 bool
 mongocrypt_ctx_encrypt_init (mongocrypt_ctx_t *ctx,
                              const char *db,
@@ -807,9 +1787,12 @@ mongocrypt_ctx_encrypt_init (mongocrypt_ctx_t *ctx,
    ctx->vtable.mongo_done_collinfo = _mongo_done_collinfo;
    ctx->vtable.mongo_op_collinfo = _mongo_op_collinfo;
    ctx->vtable.mongo_op_markings = _mongo_op_markings;
+   ctx->vtable.mongo_op_markings_iov = _mongo_op_markings_iov;
    ctx->vtable.mongo_feed_markings = _mongo_feed_markings;
    ctx->vtable.mongo_done_markings = _mongo_done_markings;
    ctx->vtable.finalize = _finalize;
+   ctx->vtable.result = _result;
+   ctx->vtable.start_concurrent = _start_concurrent;
    ctx->vtable.cleanup = _cleanup;
    ctx->vtable.mongo_op_collinfo = _mongo_op_collinfo;
    ctx->vtable.mongo_feed_collinfo = _mongo_feed_collinfo;
@@ -820,7 +1803,11 @@ mongocrypt_ctx_encrypt_init (mongocrypt_ctx_t *ctx,
       return _mongocrypt_ctx_fail_w_msg (ctx, "invalid command");
    }
 
-   _mongocrypt_buffer_copy_from_binary (&ectx->original_cmd, cmd);
+   _mongocrypt_ctx_slot_copy (ctx,
+                              _MONGOCRYPT_CTX_SLOT_INPUT,
+                              cmd->data,
+                              cmd->len,
+                              &ectx->original_cmd);
 
    if (!_check_cmd_for_auto_encrypt (
           cmd, &bypass, &ectx->coll_name, ctx->status)) {
@@ -847,6 +1834,10 @@ mongocrypt_ctx_encrypt_init (mongocrypt_ctx_t *ctx,
    }
 
    ectx->ns = bson_strdup_printf ("%s.%s", ectx->db_name, ectx->coll_name);
+   if (!ctx->ns_stats) {
+      ctx->ns_stats = _mongocrypt_stats_namespaces_get (
+         &ctx->crypt->stats.namespaces, ectx->ns);
+   }
 
    if (ctx->opts.kek.provider.aws.region || ctx->opts.kek.provider.aws.cmk) {
       return _mongocrypt_ctx_fail_w_msg (
@@ -863,7 +1854,7 @@ mongocrypt_ctx_encrypt_init (mongocrypt_ctx_t *ctx,
          ctx, "algorithm must not be set for auto encryption");
    }
 
-   if (ctx->crypt->log.trace_enabled) {
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
       char *cmd_val;
       cmd_val = _mongocrypt_new_json_string_from_binary (cmd);
       _mongocrypt_log (&ctx->crypt->log,
@@ -884,16 +1875,149 @@ mongocrypt_ctx_encrypt_init (mongocrypt_ctx_t *ctx,
       return false;
    }
 
-   /* If we didn't have a local schema, try the cache. */
-   if (_mongocrypt_buffer_empty (&ectx->schema)) {
+   /* If we didn't have a local schema, try the cache. Otherwise, we need
+    * the driver to fetch the schema. */
+   if (!ectx->used_local_schema) {
       if (!_try_schema_from_cache (ctx)) {
          return false;
       }
    }
 
-   /* Otherwise, we need the the driver to fetch the schema. */
-   if (_mongocrypt_buffer_empty (&ectx->schema)) {
-      ctx->state = MONGOCRYPT_CTX_NEED_MONGO_COLLINFO;
+   if (ctx->state == MONGOCRYPT_CTX_NEED_MONGO_MARKINGS) {
+      return _need_markings (ctx);
+   }
+   return true;
+}
+
+
+/* Returns true if @id is already in the array @ids. */
+static bool
+_key_id_listed (const bson_t *ids, _mongocrypt_buffer_t *id)
+{
+   bson_iter_t iter;
+   _mongocrypt_buffer_t listed;
+
+   BSON_ASSERT (bson_iter_init (&iter, ids));
+   while (bson_iter_next (&iter)) {
+      if (_mongocrypt_buffer_from_uuid_iter (&listed, &iter) &&
+          0 == _mongocrypt_buffer_cmp (&listed, id)) {
+         return true;
+      }
+   }
+   return false;
+}
+
+
+static bool
+_key_id_cached (mongocrypt_ctx_t *ctx, _mongocrypt_buffer_t *id)
+{
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_cache_key_value_t *value = NULL;
+   bool found;
+
+   attr = _mongocrypt_cache_key_attr_new (id, NULL);
+   found =
+      _mongocrypt_cache_get (ctx->crypt->cache_key, attr, (void **) &value) &&
+      value;
+   _mongocrypt_cache_key_value_destroy (value);
+   _mongocrypt_cache_key_attr_destroy (attr);
+   return found;
+}
+
+
+/* Append the UUIDs of each 'keyId' in 'encrypt' and 'encryptMetadata' under
+ * the schema node at @iter to the array @ids, unless cached or repeated.
+ * Key alt name pointers are resolved by mongocryptd, so they are skipped. */
+static void
+_collect_schema_key_ids (mongocrypt_ctx_t *ctx,
+                         bson_iter_t *iter,
+                         bson_t *ids,
+                         uint32_t *count)
+{
+   bson_iter_t child, opts, key_ids;
+   _mongocrypt_buffer_t id;
+
+   if (!bson_iter_recurse (iter, &child)) {
+      return;
+   }
+   while (bson_iter_next (&child)) {
+      const char *key;
+
+      key = bson_iter_key (&child);
+      if ((0 == strcmp (key, "encrypt") ||
+           0 == strcmp (key, "encryptMetadata")) &&
+          BSON_ITER_HOLDS_DOCUMENT (&child) &&
+          bson_iter_recurse (&child, &opts) &&
+          bson_iter_find (&opts, "keyId") && BSON_ITER_HOLDS_ARRAY (&opts) &&
+          bson_iter_recurse (&opts, &key_ids)) {
+         while (bson_iter_next (&key_ids)) {
+            char buf[16];
+            const char *index;
+
+            if (!_mongocrypt_buffer_from_uuid_iter (&id, &key_ids) ||
+                _key_id_listed (ids, &id) || _key_id_cached (ctx, &id)) {
+               continue;
+            }
+            bson_uint32_to_string ((*count)++, &index, buf, sizeof (buf));
+            BSON_ASSERT (_mongocrypt_buffer_append (
+               &id, ids, index, (uint32_t) strlen (index)));
+         }
+      } else if (BSON_ITER_HOLDS_DOCUMENT (&child) ||
+                 BSON_ITER_HOLDS_ARRAY (&child)) {
+         _collect_schema_key_ids (ctx, &child, ids, count);
+      }
+   }
+}
+
+
+bool
+mongocrypt_ctx_encrypt_prefetch_filter (mongocrypt_ctx_t *ctx,
+                                        mongocrypt_binary_t *filter)
+{
+   _mongocrypt_ctx_encrypt_t *ectx;
+   bson_t schema_doc, schema, as_bson, in, ids;
+   bson_iter_t iter;
+
+   if (!ctx) {
+      return false;
+   }
+
+   if (!filter) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL filter");
+   }
+
+   ectx = (_mongocrypt_ctx_encrypt_t *) ctx;
+   if (ctx->type != _MONGOCRYPT_TYPE_ENCRYPT || ectx->explicit ||
+       ctx->state != MONGOCRYPT_CTX_NEED_MONGO_MARKINGS) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "wrong state");
+   }
+
+   if (_mongocrypt_buffer_empty (&ectx->prefetch_filter)) {
+      if (_mongocrypt_buffer_empty (&ectx->schema)) {
+         bson_init (&schema);
+      } else if (!_mongocrypt_buffer_to_bson (&ectx->schema, &schema)) {
+         return _mongocrypt_ctx_fail_w_msg (ctx, "invalid BSON schema");
+      }
+
+      /* Wrap the schema so it can be walked as a node. */
+      bson_init (&schema_doc);
+      BSON_APPEND_DOCUMENT (&schema_doc, "schema", &schema);
+      bson_init (&ids);
+      BSON_ASSERT (bson_iter_init_find (&iter, &schema_doc, "schema"));
+      _collect_schema_key_ids (
+         ctx, &iter, &ids, &ectx->prefetch_filter_count);
+      bson_destroy (&schema_doc);
+      bson_destroy (&schema);
+
+      /* An empty $in matches nothing, unlike an empty filter. */
+      bson_init (&as_bson);
+      BSON_APPEND_DOCUMENT_BEGIN (&as_bson, "_id", &in);
+      BSON_APPEND_ARRAY (&in, "$in", &ids);
+      bson_append_document_end (&as_bson, &in);
+      bson_destroy (&ids);
+      _mongocrypt_buffer_steal_from_bson (&ectx->prefetch_filter, &as_bson);
    }
+
+   _mongocrypt_buffer_to_binary (&ectx->prefetch_filter, filter);
    return true;
 }
@@ -0,0 +1,263 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt.h"
+#include "mongocrypt-private.h"
+#include "mongocrypt-ctx-private.h"
+
+static void
+_cleanup (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_prefetch_collinfo_t *pctx;
+   uint32_t i;
+
+   pctx = (_mongocrypt_ctx_prefetch_collinfo_t *) ctx;
+   for (i = 0; i < pctx->n_names; i++) {
+      bson_free (pctx->names[i]);
+   }
+   bson_free (pctx->names);
+   bson_free (pctx->fed);
+   bson_free (pctx->db_name);
+   _mongocrypt_buffer_cleanup (&pctx->list_collections_filter);
+}
+
+
+/* Construct the list collections filter. Without names, it matches every
+ * collection of the database. */
+static bool
+_mongo_op_collinfo (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   _mongocrypt_ctx_prefetch_collinfo_t *pctx;
+
+   pctx = (_mongocrypt_ctx_prefetch_collinfo_t *) ctx;
+   if (_mongocrypt_buffer_empty (&pctx->list_collections_filter)) {
+      bson_t *filter, name, in;
+      uint32_t i;
+
+      filter = bson_new ();
+      if (pctx->names) {
+         BSON_APPEND_DOCUMENT_BEGIN (filter, "name", &name);
+         BSON_APPEND_ARRAY_BEGIN (&name, "$in", &in);
+         for (i = 0; i < pctx->n_names; i++) {
+            const char *key;
+            char buf[16];
+
+            bson_uint32_to_string (i, &key, buf, sizeof (buf));
+            bson_append_utf8 (&in, key, -1, pctx->names[i], -1);
+         }
+         bson_append_array_end (&name, &in);
+         bson_append_document_end (filter, &name);
+      }
+      CRYPT_TRACEF (&ctx->crypt->log, "constructed: %s\n", tmp_json (filter));
+      _mongocrypt_buffer_steal_from_bson (&pctx->list_collections_filter,
+                                          filter);
+   }
+   out->data = pctx->list_collections_filter.data;
+   out->len = pctx->list_collections_filter.len;
+   return true;
+}
+
+
+static bool
+_cache_collinfo (mongocrypt_ctx_t *ctx,
+                 const char *name,
+                 const bson_t *collinfo)
+{
+   _mongocrypt_ctx_prefetch_collinfo_t *pctx;
+   bson_t *value;
+   char *ns;
+   bool ret;
+
+   pctx = (_mongocrypt_ctx_prefetch_collinfo_t *) ctx;
+   ns = bson_strdup_printf ("%s.%s", pctx->db_name, name);
+   value = _mongocrypt_cache_collinfo_value_new (collinfo);
+   ret = _mongocrypt_cache_add_stolen (
+      ctx->crypt->cache_collinfo, ns, value, ctx->status);
+   bson_free (ns);
+   if (!ret) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
+   return true;
+}
+
+
+static bool
+_mongo_feed_collinfo (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *in)
+{
+   _mongocrypt_ctx_prefetch_collinfo_t *pctx;
+   bson_t as_bson;
+   bson_iter_t iter;
+   const char *name;
+   uint32_t i;
+
+   pctx = (_mongocrypt_ctx_prefetch_collinfo_t *) ctx;
+   if (!bson_init_static (&as_bson, in->data, in->len)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "BSON malformed");
+   }
+   if (!bson_iter_init_find (&iter, &as_bson, "name") ||
+       !BSON_ITER_HOLDS_UTF8 (&iter)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx,
+                                         "collection info has no \"name\"");
+   }
+   name = bson_iter_utf8 (&iter, NULL);
+   if (0 == strlen (name)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid collection name");
+   }
+
+   for (i = 0; i < pctx->n_names; i++) {
+      if (0 == strcmp (pctx->names[i], name)) {
+         pctx->fed[i] = true;
+      }
+   }
+
+   return _cache_collinfo (ctx, name, &as_bson);
+}
+
+
+static bool
+_mongo_done_collinfo (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_prefetch_collinfo_t *pctx;
+   uint32_t i;
+
+   pctx = (_mongocrypt_ctx_prefetch_collinfo_t *) ctx;
+   /* Remember the requested collections that do not exist. */
+   for (i = 0; i < pctx->n_names; i++) {
+      if (!pctx->fed[i] && !_cache_collinfo (ctx, pctx->names[i], NULL)) {
+         return false;
+      }
+   }
+   ctx->state = MONGOCRYPT_CTX_READY;
+   return true;
+}
+
+
+static bool
+_finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   /* There is no result. Collection info was added to the collinfo cache. */
+   static const uint8_t empty_doc[] = {5, 0, 0, 0, 0};
+
+   out->data = (uint8_t *) empty_doc;
+   out->len = sizeof (empty_doc);
+   ctx->state = MONGOCRYPT_CTX_DONE;
+   return true;
+}
+
+
+/* Parse {"names": [<string>, ...]}. */
+static bool
+_parse_names (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *names)
+{
+   _mongocrypt_ctx_prefetch_collinfo_t *pctx;
+   _mongocrypt_buffer_t names_buf;
+   bson_t as_bson;
+   bson_iter_t iter, child;
+   uint32_t n = 0;
+
+   pctx = (_mongocrypt_ctx_prefetch_collinfo_t *) ctx;
+   _mongocrypt_buffer_from_binary (&names_buf, names);
+   if (!_mongocrypt_buffer_to_bson (&names_buf, &as_bson) ||
+       !bson_validate (&as_bson, BSON_VALIDATE_NONE, NULL)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed bson");
+   }
+   if (!bson_iter_init_find (&iter, &as_bson, "names") ||
+       !BSON_ITER_HOLDS_ARRAY (&iter) || !bson_iter_recurse (&iter, &child)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "expected \"names\" array");
+   }
+   while (bson_iter_next (&child)) {
+      n++;
+   }
+   if (n == 0) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "\"names\" must not be empty");
+   }
+
+   pctx->names = bson_malloc0 (sizeof (char *) * n);
+   pctx->fed = bson_malloc0 (sizeof (bool) * n);
+   BSON_ASSERT (pctx->names && pctx->fed);
+   BSON_ASSERT (bson_iter_recurse (&iter, &child));
+   while (bson_iter_next (&child)) {
+      uint32_t len;
+      const char *name;
+
+      if (!BSON_ITER_HOLDS_UTF8 (&child)) {
+         return _mongocrypt_ctx_fail_w_msg (ctx,
+                                            "expected collection name string");
+      }
+      name = bson_iter_utf8 (&child, &len);
+      if (len == 0 || strlen (name) != len) {
+         return _mongocrypt_ctx_fail_w_msg (ctx, "invalid collection name");
+      }
+      pctx->names[pctx->n_names++] = bson_strdup (name);
+   }
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_prefetch_collinfo_init (mongocrypt_ctx_t *ctx,
+                                       const char *db,
+                                       int32_t db_len,
+                                       mongocrypt_binary_t *names)
+{
+   _mongocrypt_ctx_prefetch_collinfo_t *pctx;
+   _mongocrypt_ctx_opts_spec_t opts_spec;
+
+   if (!ctx) {
+      return false;
+   }
+   memset (&opts_spec, 0, sizeof (opts_spec));
+   if (!_mongocrypt_ctx_init (ctx, &opts_spec)) {
+      return false;
+   }
+
+   pctx = (_mongocrypt_ctx_prefetch_collinfo_t *) ctx;
+   ctx->type = _MONGOCRYPT_TYPE_PREFETCH_COLLINFO;
+   ctx->vtable.mongo_op_collinfo = _mongo_op_collinfo;
+   ctx->vtable.mongo_feed_collinfo = _mongo_feed_collinfo;
+   ctx->vtable.mongo_done_collinfo = _mongo_done_collinfo;
+   ctx->vtable.finalize = _finalize;
+   ctx->vtable.cleanup = _cleanup;
+
+   if (!_mongocrypt_validate_and_copy_string (db, db_len, &pctx->db_name) ||
+       0 == strlen (pctx->db_name)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid db");
+   }
+
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
+      char *names_val;
+      names_val = names ? _mongocrypt_new_json_string_from_binary (names)
+                        : bson_strdup ("(null)");
+      _mongocrypt_log (&ctx->crypt->log,
+                       MONGOCRYPT_LOG_LEVEL_TRACE,
+                       "%s (%s=\"%s\", %s=%d, %s=\"%s\")",
+                       BSON_FUNC,
+                       "db",
+                       pctx->db_name,
+                       "db_len",
+                       db_len,
+                       "names",
+                       names_val);
+      bson_free (names_val);
+   }
+
+   if (names && !_parse_names (ctx, names)) {
+      return false;
+   }
+
+   ctx->state = MONGOCRYPT_CTX_NEED_MONGO_COLLINFO;
+   return true;
+}
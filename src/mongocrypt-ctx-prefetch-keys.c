@@ -0,0 +1,82 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt.h"
+#include "mongocrypt-private.h"
+#include "mongocrypt-ctx-private.h"
+
+static bool
+_finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   /* There is no result. Keys were added to the key cache. */
+   static const uint8_t empty_doc[] = {5, 0, 0, 0, 0};
+
+   out->data = (uint8_t *) empty_doc;
+   out->len = sizeof (empty_doc);
+   ctx->state = MONGOCRYPT_CTX_DONE;
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_prefetch_keys_init (mongocrypt_ctx_t *ctx,
+                                   mongocrypt_binary_t *filter)
+{
+   _mongocrypt_ctx_opts_spec_t opts_spec;
+   _mongocrypt_buffer_t filter_buf;
+   bson_t as_bson;
+
+   if (!ctx) {
+      return false;
+   }
+   memset (&opts_spec, 0, sizeof (opts_spec));
+   if (!_mongocrypt_ctx_init (ctx, &opts_spec)) {
+      return false;
+   }
+
+   if (!filter || !filter->data) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid filter");
+   }
+
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
+      char *filter_val;
+      filter_val = _mongocrypt_new_json_string_from_binary (filter);
+      _mongocrypt_log (&ctx->crypt->log,
+                       MONGOCRYPT_LOG_LEVEL_TRACE,
+                       "%s (%s=\"%s\")",
+                       BSON_FUNC,
+                       "filter",
+                       filter_val);
+      bson_free (filter_val);
+   }
+
+   ctx->type = _MONGOCRYPT_TYPE_PREFETCH_KEYS;
+   ctx->vtable.finalize = _finalize;
+
+   _mongocrypt_buffer_from_binary (&filter_buf, filter);
+   if (!_mongocrypt_buffer_to_bson (&filter_buf, &as_bson) ||
+       !bson_validate (&as_bson, BSON_VALIDATE_NONE, NULL)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed bson");
+   }
+
+   if (!_mongocrypt_key_broker_request_all (&ctx->kb, &filter_buf)) {
+      _mongocrypt_key_broker_status (&ctx->kb, ctx->status);
+      return _mongocrypt_ctx_fail (ctx);
+   }
+
+   (void) _mongocrypt_key_broker_requests_done (&ctx->kb);
+   return _mongocrypt_ctx_state_from_key_broker (ctx);
+}
@@ -23,12 +23,31 @@
 #include "mongocrypt-key-broker-private.h"
 #include "mongocrypt-key-private.h"
 #include "mongocrypt-endpoint-private.h"
+#include "mongocrypt-arena-private.h"
+#include "mongocrypt-traverse-util-private.h"
+#include "mongocrypt-schema-paths-private.h"
+
+#define ALGORITHM_DETERMINISTIC "AEAD_AES_256_CBC_HMAC_SHA_512-Deterministic"
+#define ALGORITHM_DETERMINISTIC_LEN 43
+#define ALGORITHM_RANDOM "AEAD_AES_256_CBC_HMAC_SHA_512-Random"
+#define ALGORITHM_RANDOM_LEN 36
+#define ALGORITHM_RANDOM_COMPRESSED \
+   "AEAD_AES_256_CBC_HMAC_SHA_512-Random-Compressed"
+#define ALGORITHM_RANDOM_COMPRESSED_LEN 47
 
 typedef enum {
    _MONGOCRYPT_TYPE_NONE,
    _MONGOCRYPT_TYPE_ENCRYPT,
    _MONGOCRYPT_TYPE_DECRYPT,
    _MONGOCRYPT_TYPE_CREATE_DATA_KEY,
+   _MONGOCRYPT_TYPE_REFRESH_KEYS,
+   _MONGOCRYPT_TYPE_PREFETCH_KEYS,
+   _MONGOCRYPT_TYPE_PREFETCH_COLLINFO,
+   _MONGOCRYPT_TYPE_REFRESH_OAUTH,
+   _MONGOCRYPT_TYPE_STREAM,
+   _MONGOCRYPT_TYPE_COLUMN,
+   _MONGOCRYPT_TYPE_REWRAP_MANY_DATAKEY,
+   _MONGOCRYPT_TYPE_REENCRYPT,
 } _mongocrypt_ctx_type_t;
 
 /* Option values are validated when set.
@@ -40,6 +59,9 @@ typedef struct __mongocrypt_ctx_opts_t {
    _mongocrypt_key_alt_name_t *key_alt_names;
    mongocrypt_encryption_algorithm_t algorithm;
    _mongocrypt_kek_t kek;
+   _mongocrypt_schema_paths_t decrypt_paths;
+   /* Not owned. */
+   mongocrypt_decrypt_session_t *decrypt_session;
 } _mongocrypt_ctx_opts_t;
 
 
@@ -49,6 +71,10 @@ typedef struct {
    bool (*mongo_feed_collinfo) (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *in);
    bool (*mongo_done_collinfo) (mongocrypt_ctx_t *ctx);
    bool (*mongo_op_markings) (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out);
+   /* Optional. Like mongo_op_markings, but in pieces that are not copied. */
+   bool (*mongo_op_markings_iov) (mongocrypt_ctx_t *ctx,
+                                  mongocrypt_binary_t **iov,
+                                  uint32_t *iov_count);
    bool (*mongo_feed_markings) (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *in);
    bool (*mongo_done_markings) (mongocrypt_ctx_t *ctx);
    bool (*mongo_op_keys) (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out);
@@ -57,21 +83,127 @@ typedef struct {
    mongocrypt_kms_ctx_t *(*next_kms_ctx) (mongocrypt_ctx_t *ctx);
    bool (*kms_done) (mongocrypt_ctx_t *ctx);
    bool (*finalize) (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out);
+   /* Optional. Returns the buffer finalize may point its output at, so that
+    * mongocrypt_ctx_finalize_steal can take it instead of copying. */
+   _mongocrypt_buffer_t *(*result) (mongocrypt_ctx_t *ctx);
+   /* Optional. Called by mongocrypt_ctx_pending_ops until it sets
+    * ctx->concurrent, which it may never do. Returns false if ctx failed. */
+   bool (*start_concurrent) (mongocrypt_ctx_t *ctx);
    void (*cleanup) (mongocrypt_ctx_t *ctx);
 } _mongocrypt_vtable_t;
 
 
+/* Time spent by a context in each state, in microseconds. A transition is
+ * observed by the next public call on the context, so time between a state
+ * change and that call is attributed to the old state. */
+typedef struct {
+   mongocrypt_ctx_state_t state;
+   /* Set by mongocrypt_ctx_new, for mongocrypt_setopt_slow_ctx_threshold_ms.
+    * started_us is set on initialization. */
+   int64_t created_us;
+   int64_t entered_us;
+   int64_t started_us;
+   int64_t done_us;
+   int64_t state_us[MONGOCRYPT_CTX_DONE + 1];
+   int64_t finalize_us;
+   int64_t fields;
+   int64_t kms_requests;
+} _mongocrypt_ctx_timings_t;
+
+/* Slow contexts are logged at most this often. */
+#define MONGOCRYPT_SLOW_CTX_LOG_INTERVAL_US (1000 * 1000)
+
+
+void
+_mongocrypt_ctx_timings_update (mongocrypt_ctx_t *ctx);
+
+
+/* The byte storage of a context. Each slot is reused by the next operation
+ * after mongocrypt_ctx_reset, growing as needed. */
+typedef enum {
+   /* The copy of the command or document given at initialization. */
+   _MONGOCRYPT_CTX_SLOT_INPUT,
+   /* The copy of the command marked by mongocryptd. */
+   _MONGOCRYPT_CTX_SLOT_MARKED,
+   /* The result built by finalize. */
+   _MONGOCRYPT_CTX_SLOT_RESULT,
+   _MONGOCRYPT_CTX_SLOTS
+} _mongocrypt_ctx_slot_t;
+
+typedef struct {
+   uint8_t *data;
+   uint32_t size;
+} _mongocrypt_ctx_bytes_t;
+
+
+/* State of mongocrypt_ctx_run. Every operation of a run points at the context
+ * that was run, which holds the callbacks. */
+typedef struct {
+   mongocrypt_ctx_t *root;
+   /* The callbacks of the host operations this context is waiting for. */
+   uint32_t pending;
+   /* The rest is only used in root. */
+   mongocrypt_ctx_mongo_fn mongo;
+   mongocrypt_ctx_kms_fn kms;
+   mongocrypt_ctx_done_fn done;
+   void *user_ctx;
+   /* The callbacks not yet continued, over every operation. */
+   uint32_t in_flight;
+   /* Set while operations are started. A continue from a callback then only
+    * sets again, so callbacks may complete before they return. */
+   bool stepping;
+   bool again;
+   bool finished;
+} _mongocrypt_ctx_run_t;
+
+
 struct _mongocrypt_ctx_t {
    mongocrypt_t *crypt;
    mongocrypt_ctx_state_t state;
    _mongocrypt_ctx_type_t type;
    mongocrypt_status_t *status;
    _mongocrypt_key_broker_t kb;
+   /* Per-field temporaries. Released when the context is reset or
+    * destroyed. */
+   _mongocrypt_arena_t arena;
    _mongocrypt_vtable_t vtable;
    _mongocrypt_ctx_opts_t opts;
    bool initialized;
    bool
       nothing_to_do; /* set to true if no encryption/decryption is required. */
+   /* Set while mongocrypt_ctx_finalize_len runs. The transformed document is
+    * then measured and kept in finalize_splice rather than built, so
+    * mongocrypt_ctx_finalize_into can lay it out in the caller's buffer. */
+   bool finalize_deferred;
+   _mongocrypt_splice_t finalize_splice;
+   bool finalize_spliced; /* Set while finalize_splice holds the splice. */
+   /* Set by mongocrypt_ctx_decrypt_in_place_init. The transformed document
+    * is then written over the input, which is viewed rather than copied. */
+   bool finalize_in_place;
+   /* Set by mongocrypt_ctx_finalize_len. Any output built by finalize is
+    * viewed by finalize_out. */
+   bool finalize_measured;
+   mongocrypt_binary_t finalize_out;
+   uint32_t finalize_len;
+   /* Set while mongocrypt_ctx_mongo_feed_unowned runs. The fed document may
+    * be viewed instead of copied. */
+   bool feed_unowned;
+   /* Owned. A context doing work for this one, listed by
+    * mongocrypt_ctx_pending_ops while it is pending. */
+   mongocrypt_ctx_t *concurrent;
+   _mongocrypt_ctx_timings_t timings;
+   _mongocrypt_ctx_run_t run;
+   /* crypt->forks when the context was created. The context fails if the
+    * process forked since. */
+   int64_t forks;
+   /* The counters of the namespace the work is attributed to, in
+    * crypt->stats.namespaces. NULL if there is none. */
+   _mongocrypt_stats_ns_t *ns_stats;
+   /* Kept across mongocrypt_ctx_reset, like arena and the storage of kb, so
+    * a reused context does not allocate them again. spare_splice is empty,
+    * but holds the arrays of the last splice released. */
+   _mongocrypt_splice_t spare_splice;
+   _mongocrypt_ctx_bytes_t slots[_MONGOCRYPT_CTX_SLOTS];
 };
 
 
@@ -88,18 +220,37 @@ _mongocrypt_ctx_fail_w_msg (mongocrypt_ctx_t *ctx, const char *msg);
 typedef struct {
    mongocrypt_ctx_t parent;
    bool explicit;
+   /* explicit_batch is set by mongocrypt_ctx_explicit_encrypt_batch_init. */
+   bool explicit_batch;
+   /* raw is set by mongocrypt_ctx_explicit_encrypt_value_init. original_cmd
+    * is still { "v": <value> }, but encrypted_cmd is the raw ciphertext. */
+   bool raw;
    char *coll_name;
    char *db_name;
    char *ns;
    _mongocrypt_buffer_t list_collections_filter;
    _mongocrypt_buffer_t schema;
+   /* The _mongocrypt_cache_collinfo_schema_digest of schema. */
+   uint32_t schema_digest;
+   /* The encrypted paths of schema, compiled once with its collinfo cache
+    * entry or schema map entry. Markings are only collected under them.
+    * Empty if there are none, or they could not be listed. */
+   _mongocrypt_schema_paths_t plan;
+   /* fed_collinfo is true if the driver fed a listCollections result. */
+   bool fed_collinfo;
+   /* fetched_collinfo is true if this context added the collinfo cache entry
+    * for ns, rather than reading it from the cache. */
+   bool fetched_collinfo;
    /* TODO CDRIVER-3150: audit + rename these buffers.
-    * original_cmd for explicit is {v: <BSON value>}, for auto is the command to
-    * be encrypted.
+    * original_cmd for explicit is {v: <BSON value>}, for an explicit batch is
+    * the array of messages, for auto is the command to be encrypted.
     *
     * mongocryptd_cmd is only applicable for auto encryption. It is the original
     * command with JSONSchema appended.
     *
+    * mongocryptd_cmd_parts holds the bytes of mongocryptd_cmd that are not in
+    * original_cmd or schema, for mongocrypt_ctx_mongo_op_iov.
+    *
     * marked_cmd is the value of the 'result' field in mongocryptd response
     *
     * encrypted_cmd is the final output, the original command encrypted, or for
@@ -107,9 +258,19 @@ typedef struct {
     */
    _mongocrypt_buffer_t original_cmd;
    _mongocrypt_buffer_t mongocryptd_cmd;
+   _mongocrypt_buffer_t mongocryptd_cmd_parts;
    _mongocrypt_buffer_t marked_cmd;
+   /* The markings of marked_cmd, with their parsed headers, recorded when
+    * their keys were requested. */
+   _mongocrypt_splice_t collected;
    _mongocrypt_buffer_t encrypted_cmd;
    _mongocrypt_buffer_t key_id;
+   /* Set by mongocrypt_ctx_encrypt_prefetch_filter. */
+   _mongocrypt_buffer_t prefetch_filter;
+   /* prefetch_filter_count is the number of key ids in prefetch_filter. */
+   uint32_t prefetch_filter_count;
+   /* started_concurrent is set once a prefetch context was considered. */
+   bool started_concurrent;
    bool used_local_schema;
    /* collinfo_has_siblings is true if the schema came from a remote JSON
     * schema, and there were siblings. */
@@ -126,20 +287,143 @@ typedef struct {
     * */
    _mongocrypt_buffer_t original_doc;
    _mongocrypt_buffer_t unwrapped_doc; /* explicit only */
+   /* raw is set by mongocrypt_ctx_explicit_decrypt_value_init. decrypted_doc
+    * is then the raw plaintext. */
+   bool raw;
    _mongocrypt_buffer_t decrypted_doc;
+   /* chunked is set by mongocrypt_ctx_decrypt_chunked_init. chunks holds the
+    * fed documents, which are accepted until chunks_done. Each finalize
+    * returns the next one decrypted, and frees the one before it. */
+   bool chunked;
+   bool chunks_done;
+   _mongocrypt_buffer_t *chunks;
+   uint32_t n_chunks;
+   uint32_t chunks_alloc;
+   uint32_t next_chunk;
+   /* Views parent.opts.decrypt_paths. Empty if no paths were set. */
+   _mongocrypt_path_filter_t filter;
+   /* The ciphertexts of original_doc, with their parsed headers, recorded
+    * when their keys were requested. */
+   _mongocrypt_splice_t collected;
 } _mongocrypt_ctx_decrypt_t;
 
 
+/* One data key being created. */
 typedef struct {
-   mongocrypt_ctx_t parent;
    mongocrypt_kms_ctx_t kms;
-   bool kms_returned;
-   _mongocrypt_buffer_t key_doc;
    _mongocrypt_buffer_t plaintext_key_material;
    _mongocrypt_buffer_t encrypted_key_material;
+} _mongocrypt_ctx_datakey_key_t;
+
+
+typedef struct {
+   mongocrypt_ctx_t parent;
+   _mongocrypt_ctx_datakey_key_t *keys;
+   uint32_t n_keys;
+   /* batch is true for mongocrypt_ctx_datakey_batch_init. */
+   bool batch;
+   /* The KMS contexts in use are those of keys [0, n_kms). An oauth request
+    * uses only the first. */
+   uint32_t n_kms;
+   uint32_t next_kms;
+   _mongocrypt_buffer_t key_doc;
 } _mongocrypt_ctx_datakey_t;
 
 
+typedef struct {
+   /* Key material is encrypted under the new master key like that of new data
+    * keys, so this starts with a datakey context to share its functions. */
+   _mongocrypt_ctx_datakey_t datakey;
+   /* True once every key was decrypted, and is being encrypted again. */
+   bool rewrapping;
+   /* The _id of each key in datakey.keys. */
+   _mongocrypt_buffer_t *key_ids;
+   _mongocrypt_buffer_t updates;
+} _mongocrypt_ctx_rewrap_t;
+
+
+typedef struct {
+   mongocrypt_ctx_t parent;
+   mongocrypt_kms_ctx_t kms;
+   bool kms_returned;
+   /* The cache of the KMS provider being authenticated. */
+   _mongocrypt_cache_oauth_t *cache;
+   /* claimed is true if this context owns the refresh of the cache. */
+   bool claimed;
+} _mongocrypt_ctx_refresh_oauth_t;
+
+
+typedef struct {
+   mongocrypt_ctx_t parent;
+   char *db_name;
+   /* The requested collection names, or NULL for the whole database. fed[i]
+    * is true once the collection info of names[i] is fed. */
+   char **names;
+   bool *fed;
+   uint32_t n_names;
+   _mongocrypt_buffer_t list_collections_filter;
+} _mongocrypt_ctx_prefetch_collinfo_t;
+
+
+typedef struct {
+   mongocrypt_ctx_t parent;
+   bool encrypt;
+   /* started is true once the key is fetched and the cipher initialized. */
+   bool started;
+   uint8_t original_bson_type;
+   uint8_t blob_subtype;
+   _mongocrypt_buffer_t key_id;
+   /* The first MONGOCRYPT_STREAM_HEADER_LEN bytes of the document. */
+   uint8_t header[MONGOCRYPT_STREAM_HEADER_LEN];
+   _mongocrypt_stream_cipher_t cipher;
+   /* Encrypt: the declared length of the payload, and the bytes passed so
+    * far. Decrypt: the payload bytes returned so far. */
+   uint32_t len;
+   uint32_t passed;
+   /* The BSON framing of the value in the plaintext: the int32 length, and
+    * for a binary the subtype. Decrypt strips it as it arrives. */
+   uint8_t framing[5];
+   uint32_t framing_len;
+   uint32_t framing_have;
+   /* Decrypt: the IV collected so far, the ciphertext bytes after it still
+    * expected, then the document terminator. */
+   uint8_t iv[MONGOCRYPT_IV_LEN];
+   uint32_t iv_have;
+   uint32_t remaining;
+   /* Decrypt of a string: the last plaintext byte, held back since the
+    * trailing NUL is not returned. */
+   bool has_held;
+   uint8_t held;
+   /* The output of the last update or final. */
+   _mongocrypt_buffer_t out;
+} _mongocrypt_ctx_stream_t;
+
+
+typedef struct {
+   mongocrypt_ctx_t parent;
+   bool encrypt;
+   uint8_t bson_type;
+   uint32_t count;
+   /* Value i of the input is [in_offsets[i], in_offsets[i + 1]) of in. */
+   _mongocrypt_buffer_t in;
+   uint32_t *in_offsets;
+   /* Likewise for the output, once finalized. */
+   _mongocrypt_buffer_t out;
+   uint32_t *out_offsets;
+} _mongocrypt_ctx_column_t;
+
+
+typedef struct {
+   mongocrypt_ctx_t parent;
+   _mongocrypt_buffer_t original_doc;
+   _mongocrypt_buffer_t reencrypted_doc;
+   /* The key to re-encrypt with, looked up when finalizing. */
+   _mongocrypt_buffer_t key_id;
+   _mongocrypt_buffer_t key_material;
+   _native_crypto_key_t *native_key;
+} _mongocrypt_ctx_reencrypt_t;
+
+
 /* Used for option validation. True means required. False means prohibited. */
 typedef enum {
    OPT_PROHIBITED = 0,
@@ -152,6 +436,8 @@ typedef struct {
    _mongocrypt_ctx_opt_spec_t key_descriptor; /* a key_id or key_alt_name */
    _mongocrypt_ctx_opt_spec_t key_alt_names;
    _mongocrypt_ctx_opt_spec_t algorithm;
+   _mongocrypt_ctx_opt_spec_t decrypt_paths;
+   _mongocrypt_ctx_opt_spec_t decrypt_session;
 } _mongocrypt_ctx_opts_spec_t;
 
 /* Common initialization. */
@@ -165,4 +451,86 @@ bool
 _mongocrypt_ctx_state_from_key_broker (mongocrypt_ctx_t *ctx)
    MONGOCRYPT_WARN_UNUSED_RESULT;
 
+/* Transform the matching binaries of a document with cb, passing the key
+ * broker as the callback context, and splice the results into @out. If
+ * @filter is set, only the matches under its paths are transformed. The
+ * fields are transformed in parallel if mongocrypt_setopt_parallel_for was
+ * used and there are enough of them. If the batch crypto hook is set, they
+ * are instead all passed to batch_cb at once. */
+bool
+_mongocrypt_ctx_transform_binary_in_bson (
+   mongocrypt_ctx_t *ctx,
+   _mongocrypt_splice_callback_t cb,
+   _mongocrypt_splice_batch_callback_t batch_cb,
+   traversal_match_t match,
+   const bson_t *in,
+   const _mongocrypt_path_filter_t *filter,
+   _mongocrypt_buffer_t *out) MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Record the matching binaries of @in in the initialized @splice, and call
+ * @cb for each with the key broker as its context, to request its key and
+ * set its header. Finalize then transforms the splice with
+ * _mongocrypt_ctx_transform_splice, without looking for them again. */
+bool
+_mongocrypt_ctx_collect_binary_in_bson (mongocrypt_ctx_t *ctx,
+                                        _mongocrypt_splice_callback_t cb,
+                                        const bson_t *in,
+                                        _mongocrypt_splice_t *splice)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Like _mongocrypt_ctx_transform_binary_in_bson, for the matches already
+ * recorded in @collected. Takes the splice, and leaves @collected empty. */
+bool
+_mongocrypt_ctx_transform_splice (mongocrypt_ctx_t *ctx,
+                                  _mongocrypt_splice_callback_t cb,
+                                  _mongocrypt_splice_batch_callback_t batch_cb,
+                                  _mongocrypt_splice_t *collected,
+                                  _mongocrypt_buffer_t *out)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Initialize @splice with the arrays of ctx->spare_splice, if any. */
+void
+_mongocrypt_ctx_splice_init (mongocrypt_ctx_t *ctx,
+                             _mongocrypt_splice_t *splice,
+                             traversal_match_t match);
+
+/* Release the items of @splice and leave it empty. Its arrays are kept in
+ * ctx->spare_splice, unless that holds larger ones. */
+void
+_mongocrypt_ctx_splice_release (mongocrypt_ctx_t *ctx,
+                                _mongocrypt_splice_t *splice);
+
+/* Set @buf to view @len bytes of the storage @slot of @ctx. @buf is valid
+ * until the slot is used again, or @ctx is reset or destroyed. */
+void
+_mongocrypt_ctx_slot_buffer (mongocrypt_ctx_t *ctx,
+                             _mongocrypt_ctx_slot_t slot,
+                             uint32_t len,
+                             _mongocrypt_buffer_t *buf);
+
+/* Like _mongocrypt_ctx_slot_buffer, and copy @len bytes of @data to it. */
+void
+_mongocrypt_ctx_slot_copy (mongocrypt_ctx_t *ctx,
+                           _mongocrypt_ctx_slot_t slot,
+                           const uint8_t *data,
+                           uint32_t len,
+                           _mongocrypt_buffer_t *buf);
+
+/* Functions of a datakey context, also used by a rewrap context. */
+void
+_mongocrypt_ctx_datakey_cleanup (mongocrypt_ctx_t *ctx);
+
+mongocrypt_kms_ctx_t *
+_mongocrypt_ctx_datakey_next_kms_ctx (mongocrypt_ctx_t *ctx);
+
+/* Encrypt the plaintext key material of every key with ctx->opts.kek. Moves
+ * to MONGOCRYPT_CTX_NEED_KMS, or to MONGOCRYPT_CTX_READY for a local KEK. */
+bool
+_mongocrypt_ctx_datakey_kms_start (mongocrypt_ctx_t *ctx)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+bool
+_mongocrypt_ctx_datakey_kms_done (mongocrypt_ctx_t *ctx)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
 #endif /* MONGOCRYPT_CTX_PRIVATE_H */
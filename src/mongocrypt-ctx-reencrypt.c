@@ -0,0 +1,353 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt.h"
+#include "mongocrypt-private.h"
+#include "mongocrypt-ciphertext-private.h"
+#include "mongocrypt-crypto-private.h"
+#include "mongocrypt-ctx-private.h"
+#include "mongocrypt-traverse-util-private.h"
+
+static _mongocrypt_buffer_t *
+_result (mongocrypt_ctx_t *ctx)
+{
+   return &((_mongocrypt_ctx_reencrypt_t *) ctx)->reencrypted_doc;
+}
+
+
+static void
+_cleanup (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_reencrypt_t *rctx;
+
+   rctx = (_mongocrypt_ctx_reencrypt_t *) ctx;
+   _mongocrypt_buffer_cleanup (&rctx->original_doc);
+   _mongocrypt_buffer_cleanup (&rctx->reencrypted_doc);
+   _mongocrypt_buffer_cleanup (&rctx->key_id);
+   _mongocrypt_buffer_cleanup (&rctx->key_material);
+}
+
+
+static bool
+_collect_key_from_ciphertext (void *ctx,
+                              _mongocrypt_buffer_t *in,
+                              mongocrypt_status_t *status)
+{
+   _mongocrypt_ciphertext_t ciphertext;
+   _mongocrypt_key_broker_t *kb;
+
+   BSON_ASSERT (ctx);
+   BSON_ASSERT (in);
+
+   kb = (_mongocrypt_key_broker_t *) ctx;
+
+   if (!_mongocrypt_ciphertext_parse_unowned (in, &ciphertext, status)) {
+      return false;
+   }
+
+   if (!_mongocrypt_key_broker_request_id (kb, &ciphertext.key_id)) {
+      return _mongocrypt_key_broker_status (kb, status);
+   }
+
+   return true;
+}
+
+
+/* Decrypt the ciphertext of @item with its key, and encrypt the plaintext
+ * again with the new key, into a ciphertext of the same algorithm and BSON
+ * type. A compressed plaintext is encrypted as is. @ctx is the re-encryption
+ * context. */
+static bool
+_reencrypt_ciphertext (void *ctx,
+                       _mongocrypt_splice_item_t *item,
+                       mongocrypt_status_t *status)
+{
+   _mongocrypt_ctx_reencrypt_t *rctx;
+   _mongocrypt_key_broker_t *kb;
+   _mongocrypt_ciphertext_t old_ciphertext, new_ciphertext;
+   _mongocrypt_decryption_job_t job;
+   _mongocrypt_buffer_t associated_data, serialized, iv;
+   _mongocrypt_buffer_t *in;
+   bson_value_t *out;
+   const _mongocrypt_buffer_t *old_key;
+   _native_crypto_key_t *old_native_key = NULL;
+   uint8_t iv_data[MONGOCRYPT_IV_LEN];
+   uint32_t bytes_written;
+   bool ret = false;
+
+   BSON_ASSERT (ctx);
+   BSON_ASSERT (item);
+
+   in = &item->in;
+   out = &item->out;
+   rctx = (_mongocrypt_ctx_reencrypt_t *) ctx;
+   kb = &rctx->parent.kb;
+   _mongocrypt_decryption_job_init (&job);
+   _mongocrypt_ciphertext_init (&new_ciphertext);
+   _mongocrypt_buffer_init (&associated_data);
+   _mongocrypt_buffer_init (&serialized);
+
+   if (!_mongocrypt_ciphertext_parse_unowned (in, &old_ciphertext, status)) {
+      goto done;
+   }
+
+   if (!_mongocrypt_key_broker_borrow_decrypted_key (
+          kb, &old_ciphertext.key_id, &old_key, &old_native_key)) {
+      CLIENT_ERR ("key not found");
+      goto done;
+   }
+   _mongocrypt_buffer_set_to (old_key, &job.key);
+   _mongocrypt_buffer_set_to (&old_ciphertext.data, &job.ciphertext);
+   if (!_mongocrypt_ciphertext_associated_data_unowned (
+          &old_ciphertext, in, &job.associated_data)) {
+      CLIENT_ERR ("could not serialize associated data");
+      goto done;
+   }
+   _mongocrypt_buffer_resize (
+      &job.plaintext,
+      _mongocrypt_calculate_plaintext_len (old_ciphertext.data.len));
+   if (!_mongocrypt_do_decryption (kb->crypt->crypto,
+                                   &job.associated_data,
+                                   &job.key,
+                                   old_native_key,
+                                   &job.ciphertext,
+                                   &job.plaintext,
+                                   &job.bytes_written,
+                                   status)) {
+      goto done;
+   }
+   job.plaintext.len = job.bytes_written;
+
+   /* The blob subtype is the algorithm. */
+   new_ciphertext.blob_subtype = old_ciphertext.blob_subtype;
+   new_ciphertext.original_bson_type = old_ciphertext.original_bson_type;
+   _mongocrypt_buffer_copy_to (&rctx->key_id, &new_ciphertext.key_id);
+   if (!_mongocrypt_ciphertext_serialize_associated_data (&new_ciphertext,
+                                                          &associated_data)) {
+      CLIENT_ERR ("could not serialize associated data");
+      goto done;
+   }
+   if (!_mongocrypt_ciphertext_reserve (
+          &new_ciphertext,
+          _mongocrypt_calculate_ciphertext_len (job.plaintext.len),
+          &serialized)) {
+      CLIENT_ERR ("could not serialize ciphertext");
+      goto done;
+   }
+
+   _mongocrypt_buffer_init (&iv);
+   iv.data = iv_data;
+   iv.len = MONGOCRYPT_IV_LEN;
+   if (new_ciphertext.blob_subtype ==
+       MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC) {
+      if (!_mongocrypt_calculate_deterministic_iv (kb->crypt->crypto,
+                                                   &rctx->key_material,
+                                                   rctx->native_key,
+                                                   &job.plaintext,
+                                                   &associated_data,
+                                                   &iv,
+                                                   status)) {
+         goto done;
+      }
+   } else if (!_mongocrypt_random_pool_take (&kb->crypt->random_pool,
+                                             kb->crypt->crypto,
+                                             &iv,
+                                             MONGOCRYPT_IV_LEN,
+                                             status)) {
+      goto done;
+   }
+
+   if (!_mongocrypt_do_encryption (kb->crypt->crypto,
+                                   &iv,
+                                   &associated_data,
+                                   &rctx->key_material,
+                                   rctx->native_key,
+                                   &job.plaintext,
+                                   &new_ciphertext.data,
+                                   &bytes_written,
+                                   status)) {
+      goto done;
+   }
+   BSON_ASSERT (bytes_written == new_ciphertext.data.len);
+
+   /* @out takes the serialized ciphertext. */
+   out->value_type = BSON_TYPE_BINARY;
+   out->value.v_binary.data = serialized.data;
+   out->value.v_binary.data_len = serialized.len;
+   out->value.v_binary.subtype = (bson_subtype_t) 6;
+   _mongocrypt_buffer_init (&serialized);
+   ret = true;
+
+done:
+   _mongocrypt_buffer_cleanup (&serialized);
+   _mongocrypt_buffer_cleanup (&associated_data);
+   _mongocrypt_ciphertext_cleanup (&new_ciphertext);
+   _mongocrypt_decryption_job_cleanup (&job);
+   return ret;
+}
+
+
+/* Look up the key to re-encrypt with. */
+static bool
+_borrow_new_key (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_reencrypt_t *rctx;
+   const _mongocrypt_buffer_t *borrowed;
+
+   rctx = (_mongocrypt_ctx_reencrypt_t *) ctx;
+   if (ctx->opts.key_alt_names) {
+      if (!_mongocrypt_key_broker_decrypted_key_by_name (
+             &ctx->kb,
+             &ctx->opts.key_alt_names->value,
+             &rctx->key_material,
+             &rctx->key_id,
+             &rctx->native_key)) {
+         _mongocrypt_key_broker_status (&ctx->kb, ctx->status);
+         return _mongocrypt_ctx_fail (ctx);
+      }
+      return true;
+   }
+
+   if (!_mongocrypt_key_broker_borrow_decrypted_key (
+          &ctx->kb, &ctx->opts.key_id, &borrowed, &rctx->native_key)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "key not found");
+   }
+   _mongocrypt_buffer_copy_to (borrowed, &rctx->key_material);
+   _mongocrypt_buffer_copy_to (&ctx->opts.key_id, &rctx->key_id);
+   return true;
+}
+
+
+static bool
+_finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   _mongocrypt_ctx_reencrypt_t *rctx;
+   _mongocrypt_splice_t splice;
+   bson_t as_bson;
+   uint32_t len;
+   bool ret;
+
+   rctx = (_mongocrypt_ctx_reencrypt_t *) ctx;
+   if (!_borrow_new_key (ctx)) {
+      return false;
+   }
+
+   /* Validated in init. */
+   BSON_ASSERT (_mongocrypt_buffer_to_bson (&rctx->original_doc, &as_bson));
+
+   /* One pass over the document: each ciphertext is decrypted and encrypted
+    * again in the same callback, and spliced into the output. */
+   _mongocrypt_ctx_splice_init (ctx, &splice, TRAVERSE_MATCH_CIPHERTEXT);
+   ret = _mongocrypt_splice_collect (&splice, &as_bson, ctx->status) &&
+         _mongocrypt_splice_transform (&splice,
+                                       _reencrypt_ciphertext,
+                                       rctx,
+                                       NULL,
+                                       NULL,
+                                       ctx->status) &&
+         _mongocrypt_splice_measure (&splice, &len, ctx->status);
+   if (ret) {
+      _mongocrypt_ctx_slot_buffer (
+         ctx, _MONGOCRYPT_CTX_SLOT_RESULT, len, &rctx->reencrypted_doc);
+      _mongocrypt_splice_write (&splice, rctx->reencrypted_doc.data);
+      _mongocrypt_atomic_add_int64 (&ctx->crypt->stats.fields_decrypted,
+                                    splice.n_items);
+      _mongocrypt_atomic_add_int64 (&ctx->crypt->stats.fields_encrypted,
+                                    splice.n_items);
+      ctx->timings.fields += splice.n_items;
+   }
+   _mongocrypt_ctx_splice_release (ctx, &splice);
+   if (!ret) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
+
+   _mongocrypt_buffer_to_binary (&rctx->reencrypted_doc, out);
+   ctx->state = MONGOCRYPT_CTX_DONE;
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_reencrypt_init (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *doc)
+{
+   _mongocrypt_ctx_reencrypt_t *rctx;
+   _mongocrypt_ctx_opts_spec_t opts_spec;
+   bson_t as_bson;
+
+   if (!ctx) {
+      return false;
+   }
+   memset (&opts_spec, 0, sizeof (opts_spec));
+   opts_spec.key_descriptor = OPT_REQUIRED;
+   if (!_mongocrypt_ctx_init (ctx, &opts_spec)) {
+      return false;
+   }
+
+   rctx = (_mongocrypt_ctx_reencrypt_t *) ctx;
+   ctx->type = _MONGOCRYPT_TYPE_REENCRYPT;
+   ctx->vtable.finalize = _finalize;
+   ctx->vtable.result = _result;
+   ctx->vtable.cleanup = _cleanup;
+
+   if (!doc || !doc->data) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid doc");
+   }
+
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
+      char *doc_val;
+      doc_val = _mongocrypt_new_json_string_from_binary (doc);
+      _mongocrypt_log (&ctx->crypt->log,
+                       MONGOCRYPT_LOG_LEVEL_TRACE,
+                       "%s (%s=\"%s\")",
+                       BSON_FUNC,
+                       "doc",
+                       doc_val);
+      bson_free (doc_val);
+   }
+
+   _mongocrypt_ctx_slot_copy (ctx,
+                              _MONGOCRYPT_CTX_SLOT_INPUT,
+                              doc->data,
+                              doc->len,
+                              &rctx->original_doc);
+   if (!_mongocrypt_buffer_to_bson (&rctx->original_doc, &as_bson)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed bson");
+   }
+
+   /* Request the new key, and the key of every ciphertext. */
+   if (ctx->opts.key_alt_names) {
+      if (!_mongocrypt_key_broker_request_name (
+             &ctx->kb, &ctx->opts.key_alt_names->value)) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
+   } else {
+      if (!_mongocrypt_key_broker_request_id (&ctx->kb, &ctx->opts.key_id)) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
+   }
+
+   if (!_mongocrypt_scan_binary_in_bson (_collect_key_from_ciphertext,
+                                         &ctx->kb,
+                                         TRAVERSE_MATCH_CIPHERTEXT,
+                                         &as_bson,
+                                         NULL,
+                                         ctx->status)) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
+
+   (void) _mongocrypt_key_broker_requests_done (&ctx->kb);
+   return _mongocrypt_ctx_state_from_key_broker (ctx);
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt.h"
+#include "mongocrypt-private.h"
+#include "mongocrypt-ctx-private.h"
+#include "mongocrypt-cache-key-private.h"
+
+typedef struct {
+   bson_t *ids;
+   bool ok;
+} _collect_ids_t;
+
+
+/* Called with the key cache locked. Must not use the cache. */
+static void
+_collect_id (void *attr_in, void *ctx)
+{
+   _mongocrypt_cache_key_attr_t *attr;
+   _collect_ids_t *collect;
+
+   attr = (_mongocrypt_cache_key_attr_t *) attr_in;
+   collect = (_collect_ids_t *) ctx;
+   if (_mongocrypt_buffer_empty (&attr->id)) {
+      return;
+   }
+   if (!_mongocrypt_buffer_append (&attr->id, collect->ids, "", 0)) {
+      collect->ok = false;
+   }
+}
+
+
+static bool
+_finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   /* There is no result. Keys were refreshed in the key cache. */
+   static const uint8_t empty_doc[] = {5, 0, 0, 0, 0};
+
+   out->data = (uint8_t *) empty_doc;
+   out->len = sizeof (empty_doc);
+   ctx->state = MONGOCRYPT_CTX_DONE;
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_refresh_keys_init (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_opts_spec_t opts_spec;
+   _collect_ids_t collect;
+   bson_t ids;
+   bson_iter_t iter;
+   bool ret = false;
+
+   if (!ctx) {
+      return false;
+   }
+   memset (&opts_spec, 0, sizeof (opts_spec));
+   if (!_mongocrypt_ctx_init (ctx, &opts_spec)) {
+      return false;
+   }
+
+   ctx->type = _MONGOCRYPT_TYPE_REFRESH_KEYS;
+   ctx->vtable.finalize = _finalize;
+   /* Always fetch the keys, so the fetched keys replace the cached ones. */
+   ctx->kb.bypass_cache = true;
+
+   bson_init (&ids);
+   collect.ids = &ids;
+   collect.ok = true;
+   _mongocrypt_cache_start_refresh (
+      ctx->crypt->cache_key, _collect_id, &collect);
+   if (!collect.ok) {
+      _mongocrypt_ctx_fail_w_msg (ctx, "could not collect key ids");
+      goto done;
+   }
+
+   bson_iter_init (&iter, &ids);
+   while (bson_iter_next (&iter)) {
+      _mongocrypt_buffer_t key_id;
+
+      if (!_mongocrypt_buffer_from_uuid_iter (&key_id, &iter)) {
+         _mongocrypt_ctx_fail_w_msg (ctx, "cached key id is not a UUID");
+         goto done;
+      }
+      if (!_mongocrypt_key_broker_request_id (&ctx->kb, &key_id)) {
+         _mongocrypt_key_broker_status (&ctx->kb, ctx->status);
+         _mongocrypt_ctx_fail (ctx);
+         goto done;
+      }
+   }
+
+   (void) _mongocrypt_key_broker_requests_done (&ctx->kb);
+   ret = _mongocrypt_ctx_state_from_key_broker (ctx);
+
+done:
+   bson_destroy (&ids);
+   return ret;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt.h"
+#include "mongocrypt-private.h"
+#include "mongocrypt-ctx-private.h"
+
+
+static void
+_cleanup (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_refresh_oauth_t *roctx;
+
+   roctx = (_mongocrypt_ctx_refresh_oauth_t *) ctx;
+   if (roctx->claimed) {
+      _mongocrypt_cache_oauth_end_refresh (roctx->cache);
+      roctx->claimed = false;
+   }
+   _mongocrypt_kms_ctx_cleanup (&roctx->kms);
+}
+
+
+static mongocrypt_kms_ctx_t *
+_next_kms_ctx (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_refresh_oauth_t *roctx;
+
+   roctx = (_mongocrypt_ctx_refresh_oauth_t *) ctx;
+   if (roctx->kms_returned) {
+      return NULL;
+   }
+   roctx->kms_returned = true;
+   return &roctx->kms;
+}
+
+
+static bool
+_kms_done (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_refresh_oauth_t *roctx;
+   _mongocrypt_buffer_t oauth_response_buf;
+   bson_t oauth_response;
+
+   roctx = (_mongocrypt_ctx_refresh_oauth_t *) ctx;
+   if (!mongocrypt_kms_ctx_status (&roctx->kms, ctx->status)) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
+
+   if (mongocrypt_kms_ctx_bytes_needed (&roctx->kms) != 0) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "KMS response unfinished");
+   }
+
+   if (!_mongocrypt_kms_ctx_result (&roctx->kms, &oauth_response_buf)) {
+      BSON_ASSERT (!mongocrypt_kms_ctx_status (&roctx->kms, ctx->status));
+      return _mongocrypt_ctx_fail (ctx);
+   }
+
+   BSON_ASSERT (_mongocrypt_buffer_to_bson (&oauth_response_buf,
+                                            &oauth_response));
+   if (!_mongocrypt_cache_oauth_add (
+          roctx->cache, &oauth_response, ctx->status)) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
+
+   /* The new token is cached. Let the next refresh start. */
+   _mongocrypt_cache_oauth_end_refresh (roctx->cache);
+   roctx->claimed = false;
+   ctx->state = MONGOCRYPT_CTX_READY;
+   return true;
+}
+
+
+static bool
+_finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   /* There is no result. The token was stored in the oauth cache. */
+   static const uint8_t empty_doc[] = {5, 0, 0, 0, 0};
+
+   out->data = (uint8_t *) empty_doc;
+   out->len = sizeof (empty_doc);
+   ctx->state = MONGOCRYPT_CTX_DONE;
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_refresh_oauth_init (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_refresh_oauth_t *roctx;
+   _mongocrypt_ctx_opts_spec_t opts_spec;
+   bool ok;
+
+   if (!ctx) {
+      return false;
+   }
+   memset (&opts_spec, 0, sizeof (opts_spec));
+   opts_spec.kek = OPT_REQUIRED;
+   if (!_mongocrypt_ctx_init (ctx, &opts_spec)) {
+      return false;
+   }
+
+   roctx = (_mongocrypt_ctx_refresh_oauth_t *) ctx;
+   ctx->type = _MONGOCRYPT_TYPE_REFRESH_OAUTH;
+   ctx->vtable.mongo_op_keys = NULL;
+   ctx->vtable.mongo_feed_keys = NULL;
+   ctx->vtable.mongo_done_keys = NULL;
+   ctx->vtable.next_kms_ctx = _next_kms_ctx;
+   ctx->vtable.kms_done = _kms_done;
+   ctx->vtable.finalize = _finalize;
+   ctx->vtable.cleanup = _cleanup;
+
+   if (ctx->opts.kek.kms_provider == MONGOCRYPT_KMS_PROVIDER_AZURE) {
+      roctx->cache = ctx->crypt->cache_oauth_azure;
+   } else if (ctx->opts.kek.kms_provider == MONGOCRYPT_KMS_PROVIDER_GCP) {
+      roctx->cache = ctx->crypt->cache_oauth_gcp;
+   } else {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "OAuth is only used by the Azure and GCP KMS providers");
+   }
+
+   if (!_mongocrypt_cache_oauth_start_refresh (roctx->cache)) {
+      /* Another context is refreshing the token. */
+      ctx->state = MONGOCRYPT_CTX_READY;
+      return true;
+   }
+   roctx->claimed = true;
+
+   if (ctx->opts.kek.kms_provider == MONGOCRYPT_KMS_PROVIDER_AZURE) {
+      ok = _mongocrypt_kms_ctx_init_azure_auth (
+         &roctx->kms,
+         &ctx->crypt->log,
+         &ctx->crypt->opts,
+         ctx->opts.kek.provider.azure.key_vault_endpoint);
+   } else {
+      ok = _mongocrypt_kms_ctx_init_gcp_auth (
+         &roctx->kms,
+         &ctx->crypt->log,
+         &ctx->crypt->opts,
+         ctx->opts.kek.provider.gcp.endpoint,
+         &ctx->crypt->gcp_assertions);
+   }
+   if (!ok) {
+      mongocrypt_kms_ctx_status (&roctx->kms, ctx->status);
+      return _mongocrypt_ctx_fail (ctx);
+   }
+
+   ctx->state = MONGOCRYPT_CTX_NEED_KMS;
+   return true;
+}
@@ -0,0 +1,270 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt.h"
+#include "mongocrypt-private.h"
+#include "mongocrypt-ctx-private.h"
+
+static _mongocrypt_buffer_t *
+_result (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_rewrap_t *rctx;
+
+   rctx = (_mongocrypt_ctx_rewrap_t *) ctx;
+   return &rctx->updates;
+}
+
+
+static void
+_cleanup (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_rewrap_t *rctx;
+   uint32_t i;
+
+   rctx = (_mongocrypt_ctx_rewrap_t *) ctx;
+   for (i = 0; i < rctx->datakey.n_keys; i++) {
+      _mongocrypt_buffer_cleanup (&rctx->key_ids[i]);
+   }
+   bson_free (rctx->key_ids);
+   _mongocrypt_buffer_cleanup (&rctx->updates);
+   _mongocrypt_ctx_datakey_cleanup (ctx);
+}
+
+
+/* Every key was decrypted. Encrypt the key material again with the new master
+ * key. */
+static bool
+_start_rewrap (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_rewrap_t *rctx;
+   key_returned_t *key;
+   uint32_t n_keys = 0, i = 0;
+
+   rctx = (_mongocrypt_ctx_rewrap_t *) ctx;
+   for (key = ctx->kb.keys_returned; key; key = key->next) {
+      n_keys++;
+   }
+   if (n_keys == 0) {
+      /* No key matched the filter, so there are no updates. */
+      return true;
+   }
+   if (n_keys > UINT32_MAX / sizeof (_mongocrypt_ctx_datakey_key_t)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "too many keys");
+   }
+
+   rctx->datakey.keys =
+      bson_malloc0 (sizeof (_mongocrypt_ctx_datakey_key_t) * n_keys);
+   BSON_ASSERT (rctx->datakey.keys);
+   rctx->key_ids = bson_malloc0 (sizeof (_mongocrypt_buffer_t) * n_keys);
+   BSON_ASSERT (rctx->key_ids);
+   rctx->datakey.n_keys = n_keys;
+   rctx->datakey.batch = true;
+
+   for (key = ctx->kb.keys_returned; key; key = key->next, i++) {
+      if (!key->decrypted) {
+         return _mongocrypt_ctx_fail_w_msg (ctx, "key was not decrypted");
+      }
+      _mongocrypt_buffer_copy_to (&key->doc->id, &rctx->key_ids[i]);
+      _mongocrypt_buffer_copy_to (
+         &key->decrypted_key_material,
+         &rctx->datakey.keys[i].plaintext_key_material);
+   }
+
+   rctx->rewrapping = true;
+   return _mongocrypt_ctx_datakey_kms_start (ctx);
+}
+
+
+static bool
+_mongo_done_keys (mongocrypt_ctx_t *ctx)
+{
+   (void) _mongocrypt_key_broker_docs_done (&ctx->kb);
+   if (!_mongocrypt_ctx_state_from_key_broker (ctx)) {
+      return false;
+   }
+   if (ctx->state == MONGOCRYPT_CTX_READY) {
+      return _start_rewrap (ctx);
+   }
+   return true;
+}
+
+
+static mongocrypt_kms_ctx_t *
+_next_kms_ctx (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_rewrap_t *rctx;
+
+   rctx = (_mongocrypt_ctx_rewrap_t *) ctx;
+   if (rctx->rewrapping) {
+      return _mongocrypt_ctx_datakey_next_kms_ctx (ctx);
+   }
+   return _mongocrypt_key_broker_next_kms (&ctx->kb);
+}
+
+
+static bool
+_kms_done (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_rewrap_t *rctx;
+
+   rctx = (_mongocrypt_ctx_rewrap_t *) ctx;
+   if (rctx->rewrapping) {
+      return _mongocrypt_ctx_datakey_kms_done (ctx);
+   }
+
+   if (!_mongocrypt_key_broker_kms_done (&ctx->kb)) {
+      BSON_ASSERT (!_mongocrypt_key_broker_status (&ctx->kb, ctx->status));
+      return _mongocrypt_ctx_fail (ctx);
+   }
+   if (!_mongocrypt_ctx_state_from_key_broker (ctx)) {
+      return false;
+   }
+   if (ctx->state == MONGOCRYPT_CTX_READY) {
+      return _start_rewrap (ctx);
+   }
+   return true;
+}
+
+
+/* Append the update statement of key @i:
+ * { "q": { "_id": <id> },
+ *   "u": { "$set": { "keyMaterial": <binary>, "masterKey": <document> },
+ *          "$currentDate": { "updateDate": true } } } */
+static bool
+_append_update (mongocrypt_ctx_t *ctx, uint32_t i, bson_t *update)
+{
+   _mongocrypt_ctx_rewrap_t *rctx;
+   bson_t q, u, set, master_key, current_date;
+
+   rctx = (_mongocrypt_ctx_rewrap_t *) ctx;
+   BSON_APPEND_DOCUMENT_BEGIN (update, "q", &q);
+   if (!_mongocrypt_buffer_append (
+          &rctx->key_ids[i], &q, MONGOCRYPT_STR_AND_LEN ("_id"))) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "could not append _id");
+   }
+   bson_append_document_end (update, &q);
+
+   BSON_APPEND_DOCUMENT_BEGIN (update, "u", &u);
+   BSON_APPEND_DOCUMENT_BEGIN (&u, "$set", &set);
+   if (!_mongocrypt_buffer_append (
+          &rctx->datakey.keys[i].encrypted_key_material,
+          &set,
+          MONGOCRYPT_STR_AND_LEN ("keyMaterial"))) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "could not append keyMaterial");
+   }
+   BSON_APPEND_DOCUMENT_BEGIN (&set, "masterKey", &master_key);
+   if (!_mongocrypt_kek_append (&ctx->opts.kek, &master_key, ctx->status)) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
+   bson_append_document_end (&set, &master_key);
+   bson_append_document_end (&u, &set);
+   BSON_APPEND_DOCUMENT_BEGIN (&u, "$currentDate", &current_date);
+   BSON_APPEND_BOOL (&current_date, "updateDate", true);
+   bson_append_document_end (&u, &current_date);
+   bson_append_document_end (update, &u);
+   return true;
+}
+
+
+static bool
+_finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   _mongocrypt_ctx_rewrap_t *rctx;
+   bson_t result, updates;
+   uint32_t i;
+
+   rctx = (_mongocrypt_ctx_rewrap_t *) ctx;
+   /* { "v": [ <update statement>, ... ] } */
+   bson_init (&result);
+   BSON_APPEND_ARRAY_BEGIN (&result, "v", &updates);
+   for (i = 0; i < rctx->datakey.n_keys; i++) {
+      char storage[16];
+      const char *key;
+      bson_t update;
+
+      bson_uint32_to_string (i, &key, storage, sizeof (storage));
+      bson_append_document_begin (&updates, key, -1, &update);
+      if (!_append_update (ctx, i, &update)) {
+         bson_destroy (&result);
+         return false;
+      }
+      bson_append_document_end (&updates, &update);
+   }
+   bson_append_array_end (&result, &updates);
+   _mongocrypt_buffer_steal_from_bson (&rctx->updates, &result);
+   _mongocrypt_buffer_to_binary (&rctx->updates, out);
+   ctx->state = MONGOCRYPT_CTX_DONE;
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_rewrap_many_datakey_init (mongocrypt_ctx_t *ctx,
+                                         mongocrypt_binary_t *filter)
+{
+   _mongocrypt_ctx_opts_spec_t opts_spec;
+   _mongocrypt_buffer_t filter_buf;
+   bson_t as_bson;
+
+   if (!ctx) {
+      return false;
+   }
+   memset (&opts_spec, 0, sizeof (opts_spec));
+   opts_spec.kek = OPT_REQUIRED;
+   if (!_mongocrypt_ctx_init (ctx, &opts_spec)) {
+      return false;
+   }
+
+   ctx->type = _MONGOCRYPT_TYPE_REWRAP_MANY_DATAKEY;
+   ctx->vtable.mongo_done_keys = _mongo_done_keys;
+   ctx->vtable.next_kms_ctx = _next_kms_ctx;
+   ctx->vtable.kms_done = _kms_done;
+   ctx->vtable.finalize = _finalize;
+   ctx->vtable.result = _result;
+   ctx->vtable.cleanup = _cleanup;
+
+   if (!filter || !filter->data) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid filter");
+   }
+
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
+      char *filter_val;
+      filter_val = _mongocrypt_new_json_string_from_binary (filter);
+      _mongocrypt_log (&ctx->crypt->log,
+                       MONGOCRYPT_LOG_LEVEL_TRACE,
+                       "%s (%s=\"%s\")",
+                       BSON_FUNC,
+                       "filter",
+                       filter_val);
+      bson_free (filter_val);
+   }
+
+   _mongocrypt_buffer_from_binary (&filter_buf, filter);
+   if (!_mongocrypt_buffer_to_bson (&filter_buf, &as_bson) ||
+       !bson_validate (&as_bson, BSON_VALIDATE_NONE, NULL)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed bson");
+   }
+
+   /* Fetch the matching key documents, and decrypt them through the key
+    * broker. */
+   if (!_mongocrypt_key_broker_request_all (&ctx->kb, &filter_buf)) {
+      _mongocrypt_key_broker_status (&ctx->kb, ctx->status);
+      return _mongocrypt_ctx_fail (ctx);
+   }
+
+   (void) _mongocrypt_key_broker_requests_done (&ctx->kb);
+   return _mongocrypt_ctx_state_from_key_broker (ctx);
+}
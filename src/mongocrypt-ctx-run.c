@@ -0,0 +1,219 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt.h"
+#include "mongocrypt-private.h"
+#include "mongocrypt-ctx-private.h"
+#include "mongocrypt-status-private.h"
+
+/* mongocrypt_ctx_run drives the same public state machine a driver would,
+ * but starts every operation that may run at once before waiting for any.
+ * The root is the context that was run. Its operations are itself and the
+ * concurrent context listed by mongocrypt_ctx_pending_ops. */
+
+
+static bool
+_is_terminal (mongocrypt_ctx_state_t state)
+{
+   return state == MONGOCRYPT_CTX_READY || state == MONGOCRYPT_CTX_DONE ||
+          state == MONGOCRYPT_CTX_ERROR;
+}
+
+
+static void
+_start_mongo (_mongocrypt_ctx_run_t *run, mongocrypt_ctx_t *op)
+{
+   mongocrypt_binary_t *op_bson;
+   mongocrypt_ctx_state_t state;
+
+   state = op->state;
+   op_bson = mongocrypt_binary_new ();
+   if (!mongocrypt_ctx_mongo_op (op, op_bson)) {
+      /* op failed. It is no longer listed, or ends the run. */
+      mongocrypt_binary_destroy (op_bson);
+      run->again = true;
+      return;
+   }
+   op->run.pending = 1;
+   run->in_flight++;
+   run->mongo (run->user_ctx, op, state, op_bson);
+   mongocrypt_binary_destroy (op_bson);
+}
+
+
+static void
+_complete (_mongocrypt_ctx_run_t *run, mongocrypt_ctx_t *op);
+
+
+static void
+_start_kms (_mongocrypt_ctx_run_t *run, mongocrypt_ctx_t *op)
+{
+   mongocrypt_kms_ctx_t *kms;
+
+   /* Hold one count until every request is started, so a request completed
+    * from its callback cannot call mongocrypt_ctx_kms_done early. */
+   op->run.pending = 1;
+   run->in_flight++;
+   while ((kms = mongocrypt_ctx_next_kms_ctx (op))) {
+      op->run.pending++;
+      run->in_flight++;
+      run->kms (run->user_ctx, op, kms);
+   }
+   _complete (run, op);
+}
+
+
+/* Start the operations that are not waiting for the host, until none can
+ * make progress. Calls done at the end. run may be freed on return. */
+static void
+_step (_mongocrypt_ctx_run_t *run)
+{
+   mongocrypt_ctx_t *ops[MONGOCRYPT_CTX_PENDING_OPS_MAX];
+   mongocrypt_ctx_t *root;
+   uint32_t n_ops, i;
+
+   if (run->stepping) {
+      run->again = true;
+      return;
+   }
+   run->stepping = true;
+   root = run->root;
+   do {
+      run->again = false;
+      n_ops =
+         mongocrypt_ctx_pending_ops (root, ops, MONGOCRYPT_CTX_PENDING_OPS_MAX);
+      for (i = 0; i < n_ops; i++) {
+         mongocrypt_ctx_t *op = ops[i];
+
+         if (op->run.pending > 0) {
+            continue;
+         }
+         op->run.root = root;
+         switch (op->state) {
+         case MONGOCRYPT_CTX_NEED_MONGO_COLLINFO:
+         case MONGOCRYPT_CTX_NEED_MONGO_MARKINGS:
+         case MONGOCRYPT_CTX_NEED_MONGO_KEYS:
+            _start_mongo (run, op);
+            break;
+         case MONGOCRYPT_CTX_NEED_KMS:
+            _start_kms (run, op);
+            break;
+         default:
+            /* Nothing to start. */
+            break;
+         }
+      }
+   } while (run->again);
+   run->stepping = false;
+
+   /* Wait for operations in flight even if root is done, since the host may
+    * destroy root, and every operation with it, from done. */
+   if (run->finished || run->in_flight > 0 || !_is_terminal (root->state)) {
+      return;
+   }
+   run->finished = true;
+   run->done (run->user_ctx, root, root->state != MONGOCRYPT_CTX_ERROR);
+}
+
+
+/* One callback of op completed. */
+static void
+_complete (_mongocrypt_ctx_run_t *run, mongocrypt_ctx_t *op)
+{
+   BSON_ASSERT (op->run.pending > 0);
+   BSON_ASSERT (run->in_flight > 0);
+   op->run.pending--;
+   run->in_flight--;
+   if (op->run.pending == 0) {
+      switch (op->state) {
+      case MONGOCRYPT_CTX_NEED_MONGO_COLLINFO:
+      case MONGOCRYPT_CTX_NEED_MONGO_MARKINGS:
+      case MONGOCRYPT_CTX_NEED_MONGO_KEYS:
+         (void) mongocrypt_ctx_mongo_done (op);
+         break;
+      case MONGOCRYPT_CTX_NEED_KMS:
+         (void) mongocrypt_ctx_kms_done (op);
+         break;
+      default:
+         /* op failed, possibly through mongocrypt_ctx_run_fail. */
+         break;
+      }
+   }
+   _step (run);
+}
+
+
+bool
+mongocrypt_ctx_run (mongocrypt_ctx_t *ctx,
+                    mongocrypt_ctx_mongo_fn mongo,
+                    mongocrypt_ctx_kms_fn kms,
+                    mongocrypt_ctx_done_fn done,
+                    void *user_ctx)
+{
+   _mongocrypt_ctx_run_t *run;
+
+   if (!ctx) {
+      return false;
+   }
+   if (!ctx->initialized) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "ctx NULL or uninitialized");
+   }
+   if (!mongo || !kms || !done) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL callback");
+   }
+   if (ctx->run.root) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "ctx already run");
+   }
+
+   run = &ctx->run;
+   run->root = ctx;
+   run->mongo = mongo;
+   run->kms = kms;
+   run->done = done;
+   run->user_ctx = user_ctx;
+   _step (run);
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_run_continue (mongocrypt_ctx_t *op)
+{
+   if (!op || !op->run.root || op->run.pending == 0) {
+      return false;
+   }
+   _complete (&op->run.root->run, op);
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_run_fail (mongocrypt_ctx_t *op, mongocrypt_status_t *status)
+{
+   if (!op || !op->run.root || op->run.pending == 0) {
+      return false;
+   }
+   if (op->state != MONGOCRYPT_CTX_ERROR) {
+      if (status && !mongocrypt_status_ok (status)) {
+         _mongocrypt_status_copy_to (status, op->status);
+         (void) _mongocrypt_ctx_fail (op);
+      } else {
+         (void) _mongocrypt_ctx_fail_w_msg (op, "operation failed");
+      }
+   }
+   _complete (&op->run.root->run, op);
+   return true;
+}
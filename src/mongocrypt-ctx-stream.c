@@ -0,0 +1,602 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt.h"
+#include "mongocrypt-private.h"
+#include "mongocrypt-ctx-private.h"
+
+/* The {v: <ciphertext>} document is laid out as:
+ *   int32 document length, 0x05, "v\0", int32 binary length, subtype 6,
+ *   blob subtype, key UUID (16 bytes), original BSON type,
+ *   IV, ciphertext, tag, 0x00.
+ * The 18 bytes from the blob subtype are the associated data. */
+#define DOC_OVERHEAD 13
+#define BLOB_OVERHEAD 18
+#define ASSOCIATED_DATA_OFFSET 12
+
+
+static uint32_t
+_read_int32_le (const uint8_t *data)
+{
+   uint32_t value;
+
+   memcpy (&value, data, sizeof (value));
+   return BSON_UINT32_FROM_LE (value);
+}
+
+
+static void
+_write_int32_le (uint8_t *data, uint32_t value)
+{
+   value = BSON_UINT32_TO_LE (value);
+   memcpy (data, &value, sizeof (value));
+}
+
+
+static void
+_out_append (_mongocrypt_ctx_stream_t *sctx, const uint8_t *data, uint32_t len)
+{
+   uint32_t offset = sctx->out.len;
+
+   if (len == 0) {
+      return;
+   }
+   BSON_ASSERT (len <= UINT32_MAX - offset);
+   sctx->out.data = bson_realloc (sctx->out.data, offset + len);
+   sctx->out.owned = true;
+   sctx->out.len = offset + len;
+   memcpy (sctx->out.data + offset, data, len);
+}
+
+
+static bool
+_start (_mongocrypt_ctx_stream_t *sctx)
+{
+   mongocrypt_ctx_t *ctx = &sctx->parent;
+   _mongocrypt_buffer_t key, iv, associated_data;
+   uint32_t binary_len;
+   bool found;
+   bool ret = false;
+
+   _mongocrypt_buffer_init (&key);
+   _mongocrypt_buffer_init (&iv);
+   _mongocrypt_buffer_init (&associated_data);
+
+   if (sctx->encrypt && ctx->opts.key_alt_names) {
+      _mongocrypt_buffer_cleanup (&sctx->key_id);
+      found = _mongocrypt_key_broker_decrypted_key_by_name (
+         &ctx->kb, &ctx->opts.key_alt_names->value, &key, &sctx->key_id, NULL);
+   } else {
+      found = _mongocrypt_key_broker_decrypted_key_by_id (
+         &ctx->kb, &sctx->key_id, &key, NULL);
+   }
+   if (!found) {
+      _mongocrypt_status_copy_to (ctx->kb.status, ctx->status);
+      _mongocrypt_ctx_fail (ctx);
+      goto done;
+   }
+
+   if (sctx->encrypt) {
+      _mongocrypt_buffer_resize (&iv, MONGOCRYPT_IV_LEN);
+      if (!_mongocrypt_random_pool_take (&ctx->crypt->random_pool,
+                                         ctx->crypt->crypto,
+                                         &iv,
+                                         MONGOCRYPT_IV_LEN,
+                                         ctx->status)) {
+         _mongocrypt_ctx_fail (ctx);
+         goto done;
+      }
+
+      /* The length of the plaintext, including its framing, was checked when
+       * the context was initialized. */
+      binary_len = BLOB_OVERHEAD + _mongocrypt_calculate_ciphertext_len (
+                                      sctx->framing_len + sctx->len +
+                                      (sctx->original_bson_type ==
+                                       BSON_TYPE_UTF8));
+      _write_int32_le (sctx->header, binary_len + DOC_OVERHEAD);
+      sctx->header[4] = BSON_TYPE_BINARY;
+      sctx->header[5] = 'v';
+      sctx->header[6] = '\0';
+      _write_int32_le (sctx->header + 7, binary_len);
+      sctx->header[11] = BSON_SUBTYPE_ENCRYPTED;
+      sctx->header[12] = sctx->blob_subtype;
+      memcpy (sctx->header + 13, sctx->key_id.data, 16);
+      sctx->header[29] = sctx->original_bson_type;
+   } else {
+      iv.data = sctx->iv;
+      iv.len = MONGOCRYPT_IV_LEN;
+   }
+
+   associated_data.data = sctx->header + ASSOCIATED_DATA_OFFSET;
+   associated_data.len = BLOB_OVERHEAD;
+   if (!_mongocrypt_stream_cipher_init (&sctx->cipher,
+                                        ctx->crypt->crypto,
+                                        sctx->encrypt,
+                                        &key,
+                                        &iv,
+                                        &associated_data,
+                                        ctx->status)) {
+      _mongocrypt_ctx_fail (ctx);
+      goto done;
+   }
+   sctx->started = true;
+
+   if (sctx->encrypt) {
+      _out_append (sctx, sctx->header, MONGOCRYPT_STREAM_HEADER_LEN);
+      _out_append (sctx, iv.data, iv.len);
+   }
+   ret = true;
+done:
+   _mongocrypt_buffer_cleanup (&key);
+   _mongocrypt_buffer_cleanup (&iv);
+   return ret;
+}
+
+
+/* Appends decrypted bytes to the output, without the framing or the trailing
+ * NUL of a string. */
+static void
+_emit_plaintext (_mongocrypt_ctx_stream_t *sctx,
+                 const uint8_t *data,
+                 uint32_t len)
+{
+   while (len > 0 && sctx->framing_have < sctx->framing_len) {
+      sctx->framing[sctx->framing_have++] = *data;
+      data++;
+      len--;
+   }
+   if (len == 0) {
+      return;
+   }
+
+   if (sctx->original_bson_type == BSON_TYPE_UTF8) {
+      if (sctx->has_held) {
+         _out_append (sctx, &sctx->held, 1);
+         sctx->passed++;
+      }
+      sctx->held = data[len - 1];
+      sctx->has_held = true;
+      len--;
+   }
+   _out_append (sctx, data, len);
+   sctx->passed += len;
+}
+
+
+static bool
+_cipher_update (_mongocrypt_ctx_stream_t *sctx,
+                const uint8_t *data,
+                uint32_t len)
+{
+   mongocrypt_ctx_t *ctx = &sctx->parent;
+   _mongocrypt_buffer_t in, out;
+
+   if (len == 0) {
+      return true;
+   }
+   _mongocrypt_buffer_init (&in);
+   in.data = (uint8_t *) data;
+   in.len = len;
+   if (!_mongocrypt_stream_cipher_update (
+          &sctx->cipher, &in, &out, ctx->status)) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
+   if (sctx->encrypt) {
+      _out_append (sctx, out.data, out.len);
+   } else {
+      _emit_plaintext (sctx, out.data, out.len);
+   }
+   _mongocrypt_buffer_cleanup (&out);
+   return true;
+}
+
+
+static bool
+_encrypt_update (_mongocrypt_ctx_stream_t *sctx,
+                 const uint8_t *data,
+                 uint32_t len)
+{
+   mongocrypt_ctx_t *ctx = &sctx->parent;
+
+   if (!sctx->started) {
+      if (!_start (sctx)) {
+         return false;
+      }
+      if (!_cipher_update (sctx, sctx->framing, sctx->framing_len)) {
+         return false;
+      }
+   }
+
+   if (len > sctx->len - sctx->passed) {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "stream input exceeds the declared length");
+   }
+   sctx->passed += len;
+   return _cipher_update (sctx, data, len);
+}
+
+
+static bool
+_decrypt_update (_mongocrypt_ctx_stream_t *sctx,
+                 const uint8_t *data,
+                 uint32_t len)
+{
+   mongocrypt_ctx_t *ctx = &sctx->parent;
+   uint32_t n;
+
+   if (len > sctx->remaining) {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "stream input exceeds the length of the ciphertext");
+   }
+   sctx->remaining -= len;
+
+   n = BSON_MIN (MONGOCRYPT_IV_LEN - sctx->iv_have, len);
+   memcpy (sctx->iv + sctx->iv_have, data, n);
+   sctx->iv_have += n;
+   data += n;
+   len -= n;
+   if (!sctx->started && sctx->iv_have == MONGOCRYPT_IV_LEN) {
+      if (!_start (sctx)) {
+         return false;
+      }
+   }
+
+   /* The last byte of the input terminates the document. */
+   if (sctx->remaining == 0 && len > 0) {
+      if (data[len - 1] != 0) {
+         return _mongocrypt_ctx_fail_w_msg (
+            ctx, "malformed ciphertext document");
+      }
+      len--;
+   }
+   return _cipher_update (sctx, data, len);
+}
+
+
+static bool
+_encrypt_final (_mongocrypt_ctx_stream_t *sctx)
+{
+   mongocrypt_ctx_t *ctx = &sctx->parent;
+   _mongocrypt_buffer_t out;
+   static const uint8_t nul = 0;
+
+   if (sctx->passed != sctx->len) {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "stream input is shorter than the declared length");
+   }
+   if (sctx->original_bson_type == BSON_TYPE_UTF8 &&
+       !_cipher_update (sctx, &nul, 1)) {
+      return false;
+   }
+   if (!_mongocrypt_stream_cipher_final (&sctx->cipher, &out, ctx->status)) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
+   _out_append (sctx, out.data, out.len);
+   _mongocrypt_buffer_cleanup (&out);
+   _out_append (sctx, &nul, 1);
+   return true;
+}
+
+
+static bool
+_decrypt_final (_mongocrypt_ctx_stream_t *sctx)
+{
+   mongocrypt_ctx_t *ctx = &sctx->parent;
+   _mongocrypt_buffer_t out;
+   uint32_t expected;
+   bool valid;
+
+   if (!sctx->started || sctx->remaining != 0) {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "stream input is shorter than the ciphertext");
+   }
+   if (!_mongocrypt_stream_cipher_final (&sctx->cipher, &out, ctx->status)) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
+   _emit_plaintext (sctx, out.data, out.len);
+   _mongocrypt_buffer_cleanup (&out);
+
+   /* The value is authenticated. Check its framing matches its length. */
+   valid = sctx->framing_have == sctx->framing_len;
+   if (valid) {
+      expected = _read_int32_le (sctx->framing);
+      if (sctx->original_bson_type == BSON_TYPE_UTF8) {
+         valid = sctx->has_held && sctx->held == 0 &&
+                 expected == sctx->passed + 1;
+      } else {
+         valid = expected == sctx->passed;
+      }
+   }
+   if (!valid) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed decrypted value");
+   }
+   return true;
+}
+
+
+/* Common checks for mongocrypt_ctx_stream_update and _final. */
+static bool
+_check_stream (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   if (!ctx->initialized) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "ctx NULL or uninitialized");
+   }
+   if (!out) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL output");
+   }
+   if (ctx->type != _MONGOCRYPT_TYPE_STREAM) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "not applicable to context");
+   }
+   if (ctx->state == MONGOCRYPT_CTX_ERROR) {
+      return false;
+   }
+   if (ctx->state != MONGOCRYPT_CTX_READY) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "wrong state");
+   }
+   return true;
+}
+
+
+static bool
+_finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   return _mongocrypt_ctx_fail_w_msg (
+      ctx, "use mongocrypt_ctx_stream_update and mongocrypt_ctx_stream_final");
+}
+
+
+static void
+_cleanup (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_stream_t *sctx;
+
+   sctx = (_mongocrypt_ctx_stream_t *) ctx;
+   _mongocrypt_stream_cipher_cleanup (&sctx->cipher);
+   _mongocrypt_buffer_cleanup (&sctx->key_id);
+   _mongocrypt_buffer_cleanup (&sctx->out);
+}
+
+
+static bool
+_stream_init (mongocrypt_ctx_t *ctx, _mongocrypt_ctx_opts_spec_t *opts_spec)
+{
+   _mongocrypt_ctx_stream_t *sctx;
+
+   if (!_mongocrypt_ctx_init (ctx, opts_spec)) {
+      return false;
+   }
+
+   sctx = (_mongocrypt_ctx_stream_t *) ctx;
+   ctx->type = _MONGOCRYPT_TYPE_STREAM;
+   ctx->vtable.finalize = _finalize;
+   ctx->vtable.cleanup = _cleanup;
+   _mongocrypt_buffer_init (&sctx->key_id);
+   _mongocrypt_buffer_init (&sctx->out);
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_explicit_encrypt_stream_init (mongocrypt_ctx_t *ctx,
+                                             uint8_t bson_type,
+                                             uint8_t binary_subtype,
+                                             uint32_t len)
+{
+   _mongocrypt_ctx_stream_t *sctx;
+   _mongocrypt_ctx_opts_spec_t opts_spec;
+   uint64_t plaintext_len;
+
+   if (!ctx) {
+      return false;
+   }
+   memset (&opts_spec, 0, sizeof (opts_spec));
+   opts_spec.key_descriptor = OPT_REQUIRED;
+   opts_spec.algorithm = OPT_REQUIRED;
+   if (!_stream_init (ctx, &opts_spec)) {
+      return false;
+   }
+
+   sctx = (_mongocrypt_ctx_stream_t *) ctx;
+   sctx->encrypt = true;
+
+   /* A deterministic IV is derived from the whole plaintext. */
+   if (ctx->opts.algorithm != MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM) {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "streaming requires the random algorithm");
+   }
+
+   if (bson_type == BSON_TYPE_BINARY) {
+      _write_int32_le (sctx->framing, len);
+      sctx->framing[4] = binary_subtype;
+      sctx->framing_len = 5;
+      plaintext_len = (uint64_t) len + 5;
+   } else if (bson_type == BSON_TYPE_UTF8) {
+      /* Includes the trailing NUL. */
+      _write_int32_le (sctx->framing, len + 1);
+      sctx->framing_len = 4;
+      plaintext_len = (uint64_t) len + 5;
+   } else {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "streaming is only supported for binary and string values");
+   }
+
+   /* The whole document must fit in a BSON document. */
+   if (plaintext_len + MONGOCRYPT_IV_LEN + 2 * MONGOCRYPT_BLOCK_SIZE +
+          MONGOCRYPT_HMAC_LEN + BLOB_OVERHEAD + DOC_OVERHEAD >
+       (uint64_t) INT32_MAX) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "stream length too large");
+   }
+
+   sctx->original_bson_type = bson_type;
+   sctx->blob_subtype = MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM;
+   sctx->len = len;
+
+   if (ctx->opts.key_alt_names) {
+      if (!_mongocrypt_key_broker_request_name (
+             &ctx->kb, &ctx->opts.key_alt_names->value)) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
+   } else {
+      _mongocrypt_buffer_copy_to (&ctx->opts.key_id, &sctx->key_id);
+      if (!_mongocrypt_key_broker_request_id (&ctx->kb, &ctx->opts.key_id)) {
+         return _mongocrypt_ctx_fail (ctx);
+      }
+   }
+
+   (void) _mongocrypt_key_broker_requests_done (&ctx->kb);
+   return _mongocrypt_ctx_state_from_key_broker (ctx);
+}
+
+
+bool
+mongocrypt_ctx_explicit_decrypt_stream_init (mongocrypt_ctx_t *ctx,
+                                             mongocrypt_binary_t *header)
+{
+   _mongocrypt_ctx_stream_t *sctx;
+   _mongocrypt_ctx_opts_spec_t opts_spec;
+   uint32_t binary_len;
+   uint32_t ciphertext_len;
+
+   if (!ctx) {
+      return false;
+   }
+   memset (&opts_spec, 0, sizeof (opts_spec));
+   if (!_stream_init (ctx, &opts_spec)) {
+      return false;
+   }
+
+   sctx = (_mongocrypt_ctx_stream_t *) ctx;
+   sctx->encrypt = false;
+
+   if (!header || !header->data) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL header");
+   }
+   if (header->len != MONGOCRYPT_STREAM_HEADER_LEN) {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "header must be MONGOCRYPT_STREAM_HEADER_LEN bytes");
+   }
+   memcpy (sctx->header, header->data, MONGOCRYPT_STREAM_HEADER_LEN);
+
+   binary_len = _read_int32_le (sctx->header + 7);
+   if (binary_len < BLOB_OVERHEAD ||
+       _read_int32_le (sctx->header) != binary_len + DOC_OVERHEAD ||
+       sctx->header[4] != BSON_TYPE_BINARY || sctx->header[5] != 'v' ||
+       sctx->header[6] != '\0' ||
+       sctx->header[11] != BSON_SUBTYPE_ENCRYPTED) {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "header must start a {v: <ciphertext>} document");
+   }
+   sctx->blob_subtype = sctx->header[12];
+   sctx->original_bson_type = sctx->header[29];
+   if (sctx->blob_subtype != MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC &&
+       sctx->blob_subtype != MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "unsupported ciphertext");
+   }
+   if (sctx->original_bson_type == BSON_TYPE_BINARY) {
+      sctx->framing_len = 5;
+   } else if (sctx->original_bson_type == BSON_TYPE_UTF8) {
+      sctx->framing_len = 4;
+   } else {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "streaming is only supported for binary and string values");
+   }
+
+   /* IV, at least one block, and the tag. */
+   ciphertext_len = binary_len - BLOB_OVERHEAD;
+   if (ciphertext_len < MONGOCRYPT_IV_LEN + MONGOCRYPT_BLOCK_SIZE +
+                           MONGOCRYPT_HMAC_LEN ||
+       (ciphertext_len - MONGOCRYPT_IV_LEN - MONGOCRYPT_HMAC_LEN) %
+             MONGOCRYPT_BLOCK_SIZE !=
+          0) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed ciphertext");
+   }
+   sctx->remaining = ciphertext_len + 1;
+
+   _mongocrypt_buffer_resize (&sctx->key_id, 16);
+   memcpy (sctx->key_id.data, sctx->header + 13, 16);
+   sctx->key_id.subtype = BSON_SUBTYPE_UUID;
+   if (!_mongocrypt_key_broker_request_id (&ctx->kb, &sctx->key_id)) {
+      return _mongocrypt_ctx_fail (ctx);
+   }
+
+   (void) _mongocrypt_key_broker_requests_done (&ctx->kb);
+   return _mongocrypt_ctx_state_from_key_broker (ctx);
+}
+
+
+bool
+mongocrypt_ctx_stream_update (mongocrypt_ctx_t *ctx,
+                              mongocrypt_binary_t *in,
+                              mongocrypt_binary_t *out)
+{
+   _mongocrypt_ctx_stream_t *sctx;
+   bool ret;
+
+   if (!ctx) {
+      return false;
+   }
+   if (!_check_stream (ctx, out)) {
+      return false;
+   }
+   if (!in || (!in->data && in->len > 0)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL input");
+   }
+
+   sctx = (_mongocrypt_ctx_stream_t *) ctx;
+   _mongocrypt_buffer_cleanup (&sctx->out);
+   _mongocrypt_buffer_init (&sctx->out);
+   if (sctx->encrypt) {
+      ret = _encrypt_update (sctx, in->data, in->len);
+   } else {
+      ret = _decrypt_update (sctx, in->data, in->len);
+   }
+   if (!ret) {
+      return false;
+   }
+   _mongocrypt_buffer_to_binary (&sctx->out, out);
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_stream_final (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   _mongocrypt_ctx_stream_t *sctx;
+   bool ret;
+
+   if (!ctx) {
+      return false;
+   }
+   if (!_check_stream (ctx, out)) {
+      return false;
+   }
+
+   sctx = (_mongocrypt_ctx_stream_t *) ctx;
+   _mongocrypt_buffer_cleanup (&sctx->out);
+   _mongocrypt_buffer_init (&sctx->out);
+   if (sctx->encrypt) {
+      ret = (sctx->started || _encrypt_update (sctx, NULL, 0)) &&
+            _encrypt_final (sctx);
+   } else {
+      ret = _decrypt_final (sctx);
+   }
+   if (!ret) {
+      return false;
+   }
+   _mongocrypt_buffer_to_binary (&sctx->out, out);
+   ctx->state = MONGOCRYPT_CTX_DONE;
+   return true;
+}
@@ -18,11 +18,7 @@
 
 #include "mongocrypt-ctx-private.h"
 #include "mongocrypt-key-broker-private.h"
-
-#define ALGORITHM_DETERMINISTIC "AEAD_AES_256_CBC_HMAC_SHA_512-Deterministic"
-#define ALGORITHM_DETERMINISTIC_LEN 43
-#define ALGORITHM_RANDOM "AEAD_AES_256_CBC_HMAC_SHA_512-Random"
-#define ALGORITHM_RANDOM_LEN 36
+#include "mongocrypt-probes-private.h"
 
 bool
 _mongocrypt_ctx_fail_w_msg (mongocrypt_ctx_t *ctx, const char *msg)
@@ -91,7 +87,8 @@ mongocrypt_ctx_setopt_key_id (mongocrypt_ctx_t *ctx,
       return false;
    }
 
-   if (ctx->crypt->log.trace_enabled && key_id && key_id->data) {
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log) && key_id &&
+       key_id->data) {
       char *key_id_val;
       key_id_val =
          _mongocrypt_new_string_from_bytes (key_id->data, key_id->len);
@@ -204,7 +201,7 @@ mongocrypt_ctx_setopt_algorithm (mongocrypt_ctx_t *ctx,
    }
 
    calculated_len = len == -1 ? strlen (algorithm) : (size_t) len;
-   if (ctx->crypt->log.trace_enabled) {
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
       _mongocrypt_log (&ctx->crypt->log,
                        MONGOCRYPT_LOG_LEVEL_TRACE,
                        "%s (%s=\"%.*s\")",
@@ -228,15 +225,208 @@ mongocrypt_ctx_setopt_algorithm (mongocrypt_ctx_t *ctx,
       return true;
    }
 
+   if (calculated_len == ALGORITHM_RANDOM_COMPRESSED_LEN &&
+       strncmp (algorithm,
+                ALGORITHM_RANDOM_COMPRESSED,
+                ALGORITHM_RANDOM_COMPRESSED_LEN) == 0) {
+      ctx->opts.algorithm = MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM_COMPRESSED;
+      return true;
+   }
+
    return _mongocrypt_ctx_fail_w_msg (ctx, "unsupported algorithm");
 }
 
 
+bool
+mongocrypt_ctx_setopt_decrypt_paths (mongocrypt_ctx_t *ctx,
+                                     mongocrypt_binary_t *paths)
+{
+   bson_t as_bson;
+   bson_iter_t iter, path_iter;
+
+   if (!ctx) {
+      return false;
+   }
+
+   if (ctx->initialized) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "cannot set options after init");
+   }
+
+   if (ctx->state == MONGOCRYPT_CTX_ERROR) {
+      return false;
+   }
+
+   if (!paths || !paths->data) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "option must be non-NULL");
+   }
+
+   if (ctx->opts.decrypt_paths.len > 0) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "already set decrypt paths");
+   }
+
+   if (!_mongocrypt_binary_to_bson (paths, &as_bson)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid paths bson object");
+   }
+
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
+      char *paths_val;
+      paths_val = _mongocrypt_new_json_string_from_binary (paths);
+      _mongocrypt_log (&ctx->crypt->log,
+                       MONGOCRYPT_LOG_LEVEL_TRACE,
+                       "%s (%s=\"%s\")",
+                       BSON_FUNC,
+                       "paths",
+                       paths_val);
+      bson_free (paths_val);
+   }
+
+   if (!bson_iter_init (&iter, &as_bson) || !bson_iter_next (&iter) ||
+       0 != strcmp (bson_iter_key (&iter), "paths")) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "paths must have field 'paths'");
+   }
+
+   if (!BSON_ITER_HOLDS_ARRAY (&iter) ||
+       !bson_iter_recurse (&iter, &path_iter)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "paths expected to be an array");
+   }
+
+   while (bson_iter_next (&path_iter)) {
+      const char *path;
+      uint32_t len;
+
+      if (!BSON_ITER_HOLDS_UTF8 (&path_iter)) {
+         return _mongocrypt_ctx_fail_w_msg (ctx, "path expected to be UTF8");
+      }
+      path = bson_iter_utf8 (&path_iter, &len);
+      if (len == 0 || strlen (path) != len || path[0] == '.' ||
+          path[len - 1] == '.' || strstr (path, "..")) {
+         return _mongocrypt_ctx_fail_w_msg (ctx, "invalid path");
+      }
+      _mongocrypt_schema_paths_append (&ctx->opts.decrypt_paths, path);
+   }
+
+   if (ctx->opts.decrypt_paths.len == 0) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "paths must not be empty");
+   }
+
+   if (bson_iter_next (&iter)) {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "unrecognized field, only paths expected");
+   }
+
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_setopt_stats_namespace (mongocrypt_ctx_t *ctx,
+                                       const char *ns,
+                                       int32_t ns_len)
+{
+   char *temp = NULL;
+
+   if (!ctx) {
+      return false;
+   }
+
+   if (ctx->initialized) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "cannot set options after init");
+   }
+
+   if (ctx->state == MONGOCRYPT_CTX_ERROR) {
+      return false;
+   }
+
+   if (ctx->ns_stats) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "already set stats namespace");
+   }
+
+   if (!_mongocrypt_validate_and_copy_string (ns, ns_len, &temp) ||
+       0 == strlen (temp)) {
+      bson_free (temp);
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid stats namespace");
+   }
+   ctx->ns_stats =
+      _mongocrypt_stats_namespaces_get (&ctx->crypt->stats.namespaces, temp);
+   bson_free (temp);
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_setopt_decrypt_session (mongocrypt_ctx_t *ctx,
+                                       mongocrypt_decrypt_session_t *session)
+{
+   if (!ctx) {
+      return false;
+   }
+
+   if (ctx->initialized) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "cannot set options after init");
+   }
+
+   if (ctx->state == MONGOCRYPT_CTX_ERROR) {
+      return false;
+   }
+
+   if (!session) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "option must be non-NULL");
+   }
+
+   if (ctx->opts.decrypt_session) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "already set decrypt session");
+   }
+
+   if (session->crypt != ctx->crypt) {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "decrypt session belongs to another crypt");
+   }
+
+   ctx->opts.decrypt_session = session;
+   return true;
+}
+
+
+/* The size of the largest derived context. Any context may be initialized as
+ * any type. */
+static size_t
+_ctx_size (void)
+{
+   size_t ctx_size;
+
+   ctx_size = sizeof (_mongocrypt_ctx_encrypt_t);
+   if (sizeof (_mongocrypt_ctx_decrypt_t) > ctx_size) {
+      ctx_size = sizeof (_mongocrypt_ctx_decrypt_t);
+   }
+   if (sizeof (_mongocrypt_ctx_datakey_t) > ctx_size) {
+      ctx_size = sizeof (_mongocrypt_ctx_datakey_t);
+   }
+   if (sizeof (_mongocrypt_ctx_refresh_oauth_t) > ctx_size) {
+      ctx_size = sizeof (_mongocrypt_ctx_refresh_oauth_t);
+   }
+   if (sizeof (_mongocrypt_ctx_stream_t) > ctx_size) {
+      ctx_size = sizeof (_mongocrypt_ctx_stream_t);
+   }
+   if (sizeof (_mongocrypt_ctx_prefetch_collinfo_t) > ctx_size) {
+      ctx_size = sizeof (_mongocrypt_ctx_prefetch_collinfo_t);
+   }
+   if (sizeof (_mongocrypt_ctx_column_t) > ctx_size) {
+      ctx_size = sizeof (_mongocrypt_ctx_column_t);
+   }
+   if (sizeof (_mongocrypt_ctx_rewrap_t) > ctx_size) {
+      ctx_size = sizeof (_mongocrypt_ctx_rewrap_t);
+   }
+   if (sizeof (_mongocrypt_ctx_reencrypt_t) > ctx_size) {
+      ctx_size = sizeof (_mongocrypt_ctx_reencrypt_t);
+   }
+   return ctx_size;
+}
+
+
 mongocrypt_ctx_t *
 mongocrypt_ctx_new (mongocrypt_t *crypt)
 {
    mongocrypt_ctx_t *ctx;
-   size_t ctx_size;
 
    if (!crypt) {
       return NULL;
@@ -248,23 +438,173 @@ mongocrypt_ctx_new (mongocrypt_t *crypt)
       CLIENT_ERR ("cannot create context from uninitialized crypt");
       return NULL;
    }
-   ctx_size = sizeof (_mongocrypt_ctx_encrypt_t);
-   if (sizeof (_mongocrypt_ctx_decrypt_t) > ctx_size) {
-      ctx_size = sizeof (_mongocrypt_ctx_decrypt_t);
-   }
-   if (sizeof (_mongocrypt_ctx_datakey_t) > ctx_size) {
-      ctx_size = sizeof (_mongocrypt_ctx_datakey_t);
-   }
-   ctx = bson_malloc0 (ctx_size);
+   ctx = bson_malloc0 (_ctx_size ());
    BSON_ASSERT (ctx);
 
    ctx->crypt = crypt;
    ctx->status = mongocrypt_status_new ();
+   _mongocrypt_arena_init (&ctx->arena);
+   ctx->arena.held = &crypt->stats.memory.contexts;
+   _mongocrypt_atomic_add_int64 (&crypt->stats.memory.contexts,
+                                 (int64_t) _ctx_size ());
    ctx->opts.algorithm = MONGOCRYPT_ENCRYPTION_ALGORITHM_NONE;
    ctx->state = MONGOCRYPT_CTX_DONE;
+   ctx->forks = _mongocrypt_atomic_load_int64 (&crypt->forks);
+   ctx->timings.created_us = bson_get_monotonic_time ();
    return ctx;
 }
 
+
+/* Free everything owned by the context except the context itself, its
+ * status, and the storage kept across mongocrypt_ctx_reset. */
+static void
+_ctx_cleanup (mongocrypt_ctx_t *ctx)
+{
+   if (ctx->vtable.cleanup) {
+      ctx->vtable.cleanup (ctx);
+   }
+
+   _mongocrypt_kek_cleanup (&ctx->opts.kek);
+   _mongocrypt_key_broker_reset (&ctx->kb);
+   _mongocrypt_key_alt_name_destroy_all (ctx->opts.key_alt_names);
+   _mongocrypt_buffer_cleanup (&ctx->opts.key_id);
+   _mongocrypt_schema_paths_cleanup (&ctx->opts.decrypt_paths);
+   _mongocrypt_arena_reset (&ctx->arena);
+   if (ctx->finalize_spliced) {
+      _mongocrypt_ctx_splice_release (ctx, &ctx->finalize_splice);
+      ctx->finalize_spliced = false;
+   }
+   mongocrypt_ctx_destroy (ctx->concurrent);
+   ctx->concurrent = NULL;
+}
+
+
+void
+_mongocrypt_ctx_splice_init (mongocrypt_ctx_t *ctx,
+                             _mongocrypt_splice_t *splice,
+                             traversal_match_t match)
+{
+   memcpy (splice, &ctx->spare_splice, sizeof (*splice));
+   _mongocrypt_splice_clear (splice, match);
+   _mongocrypt_splice_init (&ctx->spare_splice, match);
+}
+
+
+void
+_mongocrypt_ctx_splice_release (mongocrypt_ctx_t *ctx,
+                                _mongocrypt_splice_t *splice)
+{
+   _mongocrypt_splice_t tmp;
+   traversal_match_t match;
+
+   match = splice->match;
+   _mongocrypt_splice_clear (splice, match);
+   if (splice->items_size + splice->containers_size >
+       ctx->spare_splice.items_size + ctx->spare_splice.containers_size) {
+      memcpy (&tmp, &ctx->spare_splice, sizeof (tmp));
+      memcpy (&ctx->spare_splice, splice, sizeof (tmp));
+      memcpy (splice, &tmp, sizeof (tmp));
+   }
+   /* Free the smaller arrays. */
+   _mongocrypt_splice_cleanup (splice);
+   _mongocrypt_splice_init (splice, match);
+}
+
+
+void
+_mongocrypt_ctx_slot_buffer (mongocrypt_ctx_t *ctx,
+                             _mongocrypt_ctx_slot_t slot,
+                             uint32_t len,
+                             _mongocrypt_buffer_t *buf)
+{
+   _mongocrypt_ctx_bytes_t *bytes;
+
+   BSON_ASSERT (slot < _MONGOCRYPT_CTX_SLOTS);
+   bytes = &ctx->slots[slot];
+   if (len > bytes->size) {
+      /* Nothing in the slot is kept, so free rather than realloc. */
+      bson_free (bytes->data);
+      bytes->data = bson_malloc (len);
+      BSON_ASSERT (bytes->data);
+      bytes->size = len;
+   }
+   _mongocrypt_buffer_init (buf);
+   buf->data = bytes->data;
+   buf->len = len;
+   buf->owned = false;
+}
+
+
+void
+_mongocrypt_ctx_slot_copy (mongocrypt_ctx_t *ctx,
+                           _mongocrypt_ctx_slot_t slot,
+                           const uint8_t *data,
+                           uint32_t len,
+                           _mongocrypt_buffer_t *buf)
+{
+   _mongocrypt_ctx_slot_buffer (ctx, slot, len, buf);
+   if (len > 0) {
+      memcpy (buf->data, data, len);
+   }
+}
+
+
+bool
+mongocrypt_ctx_reset (mongocrypt_ctx_t *ctx)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_status_t *status;
+   _mongocrypt_arena_t arena;
+   _mongocrypt_key_broker_t kb;
+   _mongocrypt_splice_t spare_splice;
+   _mongocrypt_ctx_bytes_t slots[_MONGOCRYPT_CTX_SLOTS];
+
+   if (!ctx) {
+      return false;
+   }
+
+   _ctx_cleanup (ctx);
+
+   /* Keep the allocations of the context, status, arena, key broker, spare
+    * splice, and slots. A reset context is indistinguishable from one
+    * returned by mongocrypt_ctx_new. */
+   crypt = ctx->crypt;
+   status = ctx->status;
+   arena = ctx->arena;
+   memcpy (&kb, &ctx->kb, sizeof (kb));
+   memcpy (&spare_splice, &ctx->spare_splice, sizeof (spare_splice));
+   memcpy (slots, ctx->slots, sizeof (slots));
+   memset (ctx, 0, _ctx_size ());
+   _mongocrypt_status_reset (status);
+
+   ctx->crypt = crypt;
+   ctx->status = status;
+   ctx->arena = arena;
+   memcpy (&ctx->kb, &kb, sizeof (kb));
+   memcpy (&ctx->spare_splice, &spare_splice, sizeof (spare_splice));
+   memcpy (ctx->slots, slots, sizeof (slots));
+   ctx->opts.algorithm = MONGOCRYPT_ENCRYPTION_ALGORITHM_NONE;
+   ctx->state = MONGOCRYPT_CTX_DONE;
+   ctx->forks = _mongocrypt_atomic_load_int64 (&crypt->forks);
+   ctx->timings.created_us = bson_get_monotonic_time ();
+   return true;
+}
+
+/* Fail a context created before mongocrypt_after_fork_child was called. Its
+ * requests may have been sent by the parent, and its keys fetched there. */
+static bool
+_ctx_forked (mongocrypt_ctx_t *ctx)
+{
+   if (ctx->forks == _mongocrypt_atomic_load_int64 (&ctx->crypt->forks)) {
+      return false;
+   }
+   if (ctx->state != MONGOCRYPT_CTX_ERROR) {
+      _mongocrypt_ctx_fail_w_msg (
+         ctx, "context was created before the process forked");
+   }
+   return true;
+}
+
 #define CHECK_AND_CALL(fn, ...)                                                \
    do {                                                                        \
       if (!ctx->vtable.fn) {                                                   \
@@ -325,8 +665,247 @@ _kms_done (mongocrypt_ctx_t *ctx)
 }
 
 
+static const char *
+_ctx_type_name (_mongocrypt_ctx_type_t type)
+{
+   switch (type) {
+   case _MONGOCRYPT_TYPE_ENCRYPT:
+      return "encrypt";
+   case _MONGOCRYPT_TYPE_DECRYPT:
+      return "decrypt";
+   case _MONGOCRYPT_TYPE_CREATE_DATA_KEY:
+      return "createDataKey";
+   case _MONGOCRYPT_TYPE_REFRESH_KEYS:
+      return "refreshKeys";
+   case _MONGOCRYPT_TYPE_PREFETCH_KEYS:
+      return "prefetchKeys";
+   case _MONGOCRYPT_TYPE_PREFETCH_COLLINFO:
+      return "prefetchCollinfo";
+   case _MONGOCRYPT_TYPE_REFRESH_OAUTH:
+      return "refreshOAuth";
+   case _MONGOCRYPT_TYPE_STREAM:
+      return "stream";
+   case _MONGOCRYPT_TYPE_COLUMN:
+      return "column";
+   case _MONGOCRYPT_TYPE_REWRAP_MANY_DATAKEY:
+      return "rewrapManyDataKey";
+   case _MONGOCRYPT_TYPE_REENCRYPT:
+      return "reencrypt";
+   case _MONGOCRYPT_TYPE_NONE:
+   default:
+      return "none";
+   }
+}
+
+
+/* Append the times of mongocrypt_ctx_timings, as of @now. */
+static void
+_append_timings (mongocrypt_ctx_t *ctx, bson_t *bson, int64_t now)
+{
+   static const struct {
+      const char *name;
+      mongocrypt_ctx_state_t state;
+   } states[] = {{"needMongoCollinfo", MONGOCRYPT_CTX_NEED_MONGO_COLLINFO},
+                 {"needMongoMarkings", MONGOCRYPT_CTX_NEED_MONGO_MARKINGS},
+                 {"needMongoKeys", MONGOCRYPT_CTX_NEED_MONGO_KEYS},
+                 {"needKms", MONGOCRYPT_CTX_NEED_KMS},
+                 {"ready", MONGOCRYPT_CTX_READY}};
+   _mongocrypt_ctx_timings_t *timings = &ctx->timings;
+   size_t i;
+
+   for (i = 0; i < sizeof (states) / sizeof (states[0]); i++) {
+      int64_t us = timings->state_us[states[i].state];
+
+      /* Include the time spent so far in the current state. */
+      if (timings->state == states[i].state) {
+         us += now - timings->entered_us;
+      }
+      bson_append_int64 (bson, states[i].name, -1, us);
+   }
+   bson_append_int64 (
+      bson, MONGOCRYPT_STR_AND_LEN ("finalize"), timings->finalize_us);
+   bson_append_int64 (bson,
+                      MONGOCRYPT_STR_AND_LEN ("total"),
+                      (timings->done_us ? timings->done_us : now) -
+                         timings->started_us);
+   bson_append_int64 (bson, MONGOCRYPT_STR_AND_LEN ("fields"), timings->fields);
+}
+
+
+/* Log @ctx, which is done as of @now, if it took longer than
+ * mongocrypt_setopt_slow_ctx_threshold_ms and no slow context was logged
+ * within MONGOCRYPT_SLOW_CTX_LOG_INTERVAL_US. */
+static void
+_log_if_slow (mongocrypt_ctx_t *ctx, int64_t now)
+{
+   mongocrypt_t *crypt = ctx->crypt;
+   _mongocrypt_stats_namespaces_t *namespaces = &crypt->stats.namespaces;
+   uint64_t threshold_ms = crypt->opts.slow_ctx_threshold_ms;
+   int64_t lifetime_us = now - ctx->timings.created_us;
+   int64_t next_us;
+   int64_t suppressed;
+   key_request_t *req;
+   key_returned_t *key;
+   int32_t keys = 0;
+   int32_t cache_hits = 0;
+   bson_t bson;
+   bson_t child;
+   char *json;
+
+   if (!threshold_ms || lifetime_us <= 0 ||
+       (uint64_t) lifetime_us <= threshold_ms * 1000 ||
+       !MONGOCRYPT_LOG_ENABLED (&crypt->log, MONGOCRYPT_LOG_LEVEL_WARNING)) {
+      return;
+   }
+
+   next_us = _mongocrypt_atomic_load_int64 (&crypt->slow_ctx_next_us);
+   if (now < next_us ||
+       !_mongocrypt_atomic_cas_int64 (&crypt->slow_ctx_next_us,
+                                      next_us,
+                                      now +
+                                         MONGOCRYPT_SLOW_CTX_LOG_INTERVAL_US)) {
+      _mongocrypt_atomic_add_int64 (&crypt->slow_ctx_suppressed, 1);
+      return;
+   }
+   /* Only this thread takes the count until the interval passes, so counts
+    * added meanwhile are left for the next message. */
+   suppressed = _mongocrypt_atomic_load_int64 (&crypt->slow_ctx_suppressed);
+   _mongocrypt_atomic_add_int64 (&crypt->slow_ctx_suppressed, -suppressed);
+
+   for (req = ctx->kb.key_requests; req; req = req->next) {
+      if (!req->borrowed) {
+         keys++;
+      }
+   }
+   for (key = ctx->kb.keys_cached; key; key = key->next) {
+      cache_hits++;
+   }
+
+   bson_init (&bson);
+   bson_append_utf8 (&bson, MONGOCRYPT_STR_AND_LEN ("msg"), "slow context", -1);
+   bson_append_utf8 (
+      &bson, MONGOCRYPT_STR_AND_LEN ("type"), _ctx_type_name (ctx->type), -1);
+   if (ctx->ns_stats && ctx->ns_stats != &namespaces->overflow) {
+      bson_append_utf8 (&bson,
+                        MONGOCRYPT_STR_AND_LEN ("ns"),
+                        namespaces->names[ctx->ns_stats - namespaces->counters],
+                        -1);
+   }
+   bson_append_int64 (&bson, MONGOCRYPT_STR_AND_LEN ("lifetime"), lifetime_us);
+   bson_append_document_begin (
+      &bson, MONGOCRYPT_STR_AND_LEN ("timings"), &child);
+   _append_timings (ctx, &child, now);
+   bson_append_document_end (&bson, &child);
+   bson_append_int32 (&bson, MONGOCRYPT_STR_AND_LEN ("keys"), keys);
+   bson_append_int32 (&bson, MONGOCRYPT_STR_AND_LEN ("cacheHits"), cache_hits);
+   bson_append_int64 (
+      &bson, MONGOCRYPT_STR_AND_LEN ("kmsRequests"), ctx->timings.kms_requests);
+   bson_append_int64 (&bson, MONGOCRYPT_STR_AND_LEN ("suppressed"), suppressed);
+
+   json = bson_as_relaxed_extended_json (&bson, NULL);
+   _mongocrypt_log (&crypt->log, MONGOCRYPT_LOG_LEVEL_WARNING, "%s", json);
+   bson_free (json);
+   bson_destroy (&bson);
+}
+
+
+void
+_mongocrypt_ctx_timings_update (mongocrypt_ctx_t *ctx)
+{
+   _mongocrypt_ctx_timings_t *timings = &ctx->timings;
+   int64_t now;
+
+   if (timings->state == ctx->state) {
+      return;
+   }
+
+   MONGOCRYPT_PROBE3 (ctx__state, ctx, timings->state, ctx->state);
+   now = bson_get_monotonic_time ();
+   timings->state_us[timings->state] += now - timings->entered_us;
+   timings->state = ctx->state;
+   timings->entered_us = now;
+   if (ctx->state == MONGOCRYPT_CTX_DONE) {
+      timings->done_us = now;
+      _log_if_slow (ctx, now);
+   }
+}
+
+
 bool
 mongocrypt_ctx_mongo_op (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   if (!ctx) {
+      return false;
+   }
+   if (!ctx->initialized) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "ctx NULL or uninitialized");
+   }
+   if (_ctx_forked (ctx)) {
+      return false;
+   }
+   _mongocrypt_ctx_timings_update (ctx);
+
+   if (!out) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL input");
+   }
+
+   switch (ctx->state) {
+   case MONGOCRYPT_CTX_NEED_MONGO_COLLINFO:
+      CHECK_AND_CALL (mongo_op_collinfo, ctx, out);
+   case MONGOCRYPT_CTX_NEED_MONGO_MARKINGS:
+      CHECK_AND_CALL (mongo_op_markings, ctx, out);
+   case MONGOCRYPT_CTX_NEED_MONGO_KEYS:
+      CHECK_AND_CALL (mongo_op_keys, ctx, out);
+   case MONGOCRYPT_CTX_ERROR:
+      return false;
+   default:
+      return _mongocrypt_ctx_fail_w_msg (ctx, "wrong state");
+   }
+}
+
+
+bool
+mongocrypt_ctx_mongo_op_iov (mongocrypt_ctx_t *ctx,
+                             mongocrypt_binary_t **iov,
+                             uint32_t *iov_count)
+{
+   uint32_t i;
+
+   if (!ctx) {
+      return false;
+   }
+   if (!ctx->initialized) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "ctx NULL or uninitialized");
+   }
+
+   if (!iov || !iov_count) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL input");
+   }
+   for (i = 0; i < MONGOCRYPT_MONGO_OP_IOV_MAX; i++) {
+      if (!iov[i]) {
+         return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL input");
+      }
+   }
+
+   if (ctx->state == MONGOCRYPT_CTX_NEED_MONGO_MARKINGS &&
+       ctx->vtable.mongo_op_markings_iov) {
+      _mongocrypt_ctx_timings_update (ctx);
+      return ctx->vtable.mongo_op_markings_iov (ctx, iov, iov_count);
+   }
+
+   /* Other operations are small, and returned in one piece. */
+   *iov_count = 0;
+   if (!mongocrypt_ctx_mongo_op (ctx, iov[0])) {
+      return false;
+   }
+   *iov_count = 1;
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_mongo_projection (mongocrypt_ctx_t *ctx,
+                                 mongocrypt_binary_t *out)
 {
    if (!ctx) {
       return false;
@@ -339,18 +918,20 @@ mongocrypt_ctx_mongo_op (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
       return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL input");
    }
 
-   switch (ctx->state) {
-   case MONGOCRYPT_CTX_NEED_MONGO_COLLINFO:
-      CHECK_AND_CALL (mongo_op_collinfo, ctx, out);
-   case MONGOCRYPT_CTX_NEED_MONGO_MARKINGS:
-      CHECK_AND_CALL (mongo_op_markings, ctx, out);
-   case MONGOCRYPT_CTX_NEED_MONGO_KEYS:
-      CHECK_AND_CALL (mongo_op_keys, ctx, out);
-   case MONGOCRYPT_CTX_ERROR:
-      return false;
-   default:
+   if (ctx->state == MONGOCRYPT_CTX_ERROR) {
+      return false;
+   }
+
+   if (ctx->state != MONGOCRYPT_CTX_NEED_MONGO_KEYS ||
+       !ctx->vtable.mongo_op_keys) {
       return _mongocrypt_ctx_fail_w_msg (ctx, "wrong state");
    }
+
+   if (!_mongocrypt_key_broker_projection (&ctx->kb, out)) {
+      BSON_ASSERT (!_mongocrypt_key_broker_status (&ctx->kb, ctx->status));
+      return _mongocrypt_ctx_fail (ctx);
+   }
+   return true;
 }
 
 
@@ -363,12 +944,16 @@ mongocrypt_ctx_mongo_feed (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *in)
    if (!ctx->initialized) {
       return _mongocrypt_ctx_fail_w_msg (ctx, "ctx NULL or uninitialized");
    }
+   if (_ctx_forked (ctx)) {
+      return false;
+   }
+   _mongocrypt_ctx_timings_update (ctx);
 
    if (!in) {
       return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL input");
    }
 
-   if (ctx->crypt->log.trace_enabled) {
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
       char *in_val;
 
       in_val = _mongocrypt_new_json_string_from_binary (in);
@@ -396,6 +981,103 @@ mongocrypt_ctx_mongo_feed (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *in)
 }
 
 
+bool
+mongocrypt_ctx_mongo_feed_unowned (mongocrypt_ctx_t *ctx,
+                                   mongocrypt_binary_t *in)
+{
+   bool ret;
+
+   if (!ctx) {
+      return false;
+   }
+
+   ctx->feed_unowned = true;
+   ret = mongocrypt_ctx_mongo_feed (ctx, in);
+   ctx->feed_unowned = false;
+   return ret;
+}
+
+
+bool
+mongocrypt_ctx_mongo_feed_cursor (mongocrypt_ctx_t *ctx,
+                                  mongocrypt_binary_t *reply)
+{
+   bool (*feed) (mongocrypt_ctx_t *, mongocrypt_binary_t *);
+   bson_t as_bson;
+   bson_iter_t iter, cursor, batch;
+   bool found = false;
+
+   if (!ctx) {
+      return false;
+   }
+   if (!ctx->initialized) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "ctx NULL or uninitialized");
+   }
+   if (_ctx_forked (ctx)) {
+      return false;
+   }
+   _mongocrypt_ctx_timings_update (ctx);
+
+   if (!reply) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL input");
+   }
+
+   switch (ctx->state) {
+   case MONGOCRYPT_CTX_NEED_MONGO_COLLINFO:
+      feed = ctx->vtable.mongo_feed_collinfo;
+      break;
+   case MONGOCRYPT_CTX_NEED_MONGO_KEYS:
+      feed = ctx->vtable.mongo_feed_keys;
+      break;
+   case MONGOCRYPT_CTX_ERROR:
+      return false;
+   default:
+      return _mongocrypt_ctx_fail_w_msg (ctx, "wrong state");
+   }
+   if (!feed) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "not applicable to context");
+   }
+
+   if (!_mongocrypt_binary_to_bson (reply, &as_bson)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "malformed cursor reply");
+   }
+   if (bson_iter_init_find (&iter, &as_bson, "ok") &&
+       !bson_iter_as_bool (&iter)) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "cursor reply is an error");
+   }
+   if (bson_iter_init_find (&iter, &as_bson, "cursor") &&
+       BSON_ITER_HOLDS_DOCUMENT (&iter) && bson_iter_recurse (&iter, &cursor)) {
+      while (!found && bson_iter_next (&cursor)) {
+         found = 0 == strcmp (bson_iter_key (&cursor), "firstBatch") ||
+                 0 == strcmp (bson_iter_key (&cursor), "nextBatch");
+      }
+   }
+   if (!found || !BSON_ITER_HOLDS_ARRAY (&cursor) ||
+       !bson_iter_recurse (&cursor, &batch)) {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx,
+         "invalid cursor reply: expected array 'cursor.firstBatch' or "
+         "'cursor.nextBatch'");
+   }
+
+   /* Feed each document where it lies in the reply. */
+   while (bson_iter_next (&batch)) {
+      _mongocrypt_buffer_t doc;
+      mongocrypt_binary_t doc_bin;
+
+      if (!_mongocrypt_buffer_from_document_iter (&doc, &batch)) {
+         return _mongocrypt_ctx_fail_w_msg (
+            ctx, "invalid cursor reply: expected documents in batch");
+      }
+      _mongocrypt_buffer_to_binary (&doc, &doc_bin);
+      if (!feed (ctx, &doc_bin)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
 bool
 mongocrypt_ctx_mongo_done (mongocrypt_ctx_t *ctx)
 {
@@ -405,11 +1087,21 @@ mongocrypt_ctx_mongo_done (mongocrypt_ctx_t *ctx)
    if (!ctx->initialized) {
       return _mongocrypt_ctx_fail_w_msg (ctx, "ctx NULL or uninitialized");
    }
+   if (_ctx_forked (ctx)) {
+      return false;
+   }
+   _mongocrypt_ctx_timings_update (ctx);
 
    switch (ctx->state) {
    case MONGOCRYPT_CTX_NEED_MONGO_COLLINFO:
       CHECK_AND_CALL (mongo_done_collinfo, ctx);
    case MONGOCRYPT_CTX_NEED_MONGO_MARKINGS:
+      _mongocrypt_atomic_add_int64 (&ctx->crypt->stats.mongocryptd_round_trips,
+                                    1);
+      if (ctx->ns_stats) {
+         _mongocrypt_atomic_add_int64 (
+            &ctx->ns_stats->mongocryptd_round_trips, 1);
+      }
       CHECK_AND_CALL (mongo_done_markings, ctx);
    case MONGOCRYPT_CTX_NEED_MONGO_KEYS:
       CHECK_AND_CALL (mongo_done_keys, ctx);
@@ -431,11 +1123,59 @@ mongocrypt_ctx_state (mongocrypt_ctx_t *ctx)
       _mongocrypt_ctx_fail_w_msg (ctx, "ctx NULL or uninitialized");
       return MONGOCRYPT_CTX_ERROR;
    }
+   if (_ctx_forked (ctx)) {
+      return MONGOCRYPT_CTX_ERROR;
+   }
+   _mongocrypt_ctx_timings_update (ctx);
 
    return ctx->state;
 }
 
 
+uint32_t
+mongocrypt_ctx_pending_ops (mongocrypt_ctx_t *ctx,
+                            mongocrypt_ctx_t **ops,
+                            uint32_t max_ops)
+{
+   mongocrypt_ctx_t *concurrent;
+   uint32_t count = 0;
+
+   if (!ctx || !ops || max_ops == 0) {
+      return 0;
+   }
+   ops[count++] = ctx;
+   if (!ctx->initialized) {
+      return count;
+   }
+
+   if (!ctx->concurrent && ctx->vtable.start_concurrent &&
+       ctx->state != MONGOCRYPT_CTX_ERROR &&
+       !ctx->vtable.start_concurrent (ctx)) {
+      return count;
+   }
+
+   concurrent = ctx->concurrent;
+   if (!concurrent) {
+      return count;
+   }
+   if (concurrent->state == MONGOCRYPT_CTX_READY) {
+      /* The work is done once a concurrent context is ready. Its output is
+       * not used. */
+      mongocrypt_binary_t *out;
+
+      out = mongocrypt_binary_new ();
+      (void) mongocrypt_ctx_finalize (concurrent, out);
+      mongocrypt_binary_destroy (out);
+   }
+   /* A failed concurrent context is dropped. ctx does the work itself. */
+   if (count < max_ops && concurrent->state != MONGOCRYPT_CTX_DONE &&
+       concurrent->state != MONGOCRYPT_CTX_ERROR) {
+      ops[count++] = concurrent;
+   }
+   return count;
+}
+
+
 mongocrypt_kms_ctx_t *
 mongocrypt_ctx_next_kms_ctx (mongocrypt_ctx_t *ctx)
 {
@@ -446,6 +1186,10 @@ mongocrypt_ctx_next_kms_ctx (mongocrypt_ctx_t *ctx)
       _mongocrypt_ctx_fail_w_msg (ctx, "ctx NULL or uninitialized");
       return NULL;
    }
+   if (_ctx_forked (ctx)) {
+      return NULL;
+   }
+   _mongocrypt_ctx_timings_update (ctx);
 
    if (!ctx->vtable.next_kms_ctx) {
       _mongocrypt_ctx_fail_w_msg (ctx, "not applicable to context");
@@ -453,8 +1197,17 @@ mongocrypt_ctx_next_kms_ctx (mongocrypt_ctx_t *ctx)
    }
 
    switch (ctx->state) {
-   case MONGOCRYPT_CTX_NEED_KMS:
-      return ctx->vtable.next_kms_ctx (ctx);
+   case MONGOCRYPT_CTX_NEED_KMS: {
+      mongocrypt_kms_ctx_t *kms = ctx->vtable.next_kms_ctx (ctx);
+
+      if (kms) {
+         ctx->timings.kms_requests++;
+      }
+      _mongocrypt_kms_ctx_set_stats (kms, &ctx->crypt->stats);
+      _mongocrypt_kms_ctx_set_trace (kms, &ctx->crypt->trace);
+      _mongocrypt_kms_ctx_set_limiter (kms, &ctx->crypt->kms_limiter);
+      return kms;
+   }
    case MONGOCRYPT_CTX_ERROR:
       return NULL;
    default:
@@ -467,12 +1220,18 @@ mongocrypt_ctx_next_kms_ctx (mongocrypt_ctx_t *ctx)
 bool
 mongocrypt_ctx_kms_done (mongocrypt_ctx_t *ctx)
 {
+   bool ret;
+
    if (!ctx) {
       return false;
    }
    if (!ctx->initialized) {
       return _mongocrypt_ctx_fail_w_msg (ctx, "ctx NULL or uninitialized");
    }
+   if (_ctx_forked (ctx)) {
+      return false;
+   }
+   _mongocrypt_ctx_timings_update (ctx);
 
    if (!ctx->vtable.kms_done) {
       return _mongocrypt_ctx_fail_w_msg (ctx, "not applicable to context");
@@ -480,7 +1239,9 @@ mongocrypt_ctx_kms_done (mongocrypt_ctx_t *ctx)
 
    switch (ctx->state) {
    case MONGOCRYPT_CTX_NEED_KMS:
-      return ctx->vtable.kms_done (ctx);
+      ret = ctx->vtable.kms_done (ctx);
+      _mongocrypt_ctx_timings_update (ctx);
+      return ret;
    case MONGOCRYPT_CTX_ERROR:
       return false;
    default:
@@ -489,15 +1250,61 @@ mongocrypt_ctx_kms_done (mongocrypt_ctx_t *ctx)
 }
 
 
+static void
+_trace_finalize_end (mongocrypt_ctx_t *ctx, uint64_t span_id, bool ok)
+{
+   bson_t attrs;
+
+   bson_init (&attrs);
+   bson_append_bool (&attrs, MONGOCRYPT_STR_AND_LEN ("ok"), ok);
+   bson_append_int64 (
+      &attrs, MONGOCRYPT_STR_AND_LEN ("fields"), ctx->timings.fields);
+   _mongocrypt_trace_end (
+      &ctx->crypt->trace, MONGOCRYPT_TRACE_SPAN_FINALIZE, span_id, &attrs);
+   bson_destroy (&attrs);
+}
+
+
+/* Count a finalized encryption or decryption, which output @len bytes, in
+ * the stats of its namespace. */
+static void
+_record_ns_stats (mongocrypt_ctx_t *ctx, uint32_t len)
+{
+   _mongocrypt_stats_ns_t *ns_stats = ctx->ns_stats;
+
+   if (!ns_stats) {
+      return;
+   }
+   if (ctx->type == _MONGOCRYPT_TYPE_ENCRYPT) {
+      _mongocrypt_atomic_add_int64 (&ns_stats->encrypt_ops, 1);
+      _mongocrypt_atomic_add_int64 (&ns_stats->fields_encrypted,
+                                    ctx->timings.fields);
+      _mongocrypt_atomic_add_int64 (&ns_stats->ciphertext_bytes, len);
+   } else if (ctx->type == _MONGOCRYPT_TYPE_DECRYPT) {
+      _mongocrypt_atomic_add_int64 (&ns_stats->decrypt_ops, 1);
+      _mongocrypt_atomic_add_int64 (&ns_stats->fields_decrypted,
+                                    ctx->timings.fields);
+      _mongocrypt_atomic_add_int64 (&ns_stats->plaintext_bytes, len);
+   }
+}
+
+
 bool
 mongocrypt_ctx_finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
 {
+   int64_t start_us;
+   uint64_t span_id;
+   bool ret;
+
    if (!ctx) {
       return false;
    }
    if (!ctx->initialized) {
       return _mongocrypt_ctx_fail_w_msg (ctx, "ctx NULL or uninitialized");
    }
+   if (_ctx_forked (ctx)) {
+      return false;
+   }
 
    if (!out) {
       return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL input");
@@ -509,7 +1316,30 @@ mongocrypt_ctx_finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
 
    switch (ctx->state) {
    case MONGOCRYPT_CTX_READY:
-      return ctx->vtable.finalize (ctx, out);
+      /* Close out the time spent waiting in READY, so finalize is timed on
+       * its own. */
+      _mongocrypt_ctx_timings_update (ctx);
+      start_us = bson_get_monotonic_time ();
+      ctx->timings.state_us[MONGOCRYPT_CTX_READY] +=
+         start_us - ctx->timings.entered_us;
+      ctx->timings.entered_us = start_us;
+      span_id = 0;
+      if (MONGOCRYPT_TRACING (&ctx->crypt->trace)) {
+         span_id = _mongocrypt_trace_begin (
+            &ctx->crypt->trace, MONGOCRYPT_TRACE_SPAN_FINALIZE, NULL);
+      }
+      ret = ctx->vtable.finalize (ctx, out);
+      ctx->timings.finalize_us += bson_get_monotonic_time () - start_us;
+      if (span_id) {
+         _trace_finalize_end (ctx, span_id, ret);
+      }
+      ctx->timings.entered_us = bson_get_monotonic_time ();
+      _mongocrypt_ctx_timings_update (ctx);
+      /* The length of deferred output is known after finalize_len. */
+      if (ret && !ctx->finalize_deferred) {
+         _record_ns_stats (ctx, out->len);
+      }
+      return ret;
    case MONGOCRYPT_CTX_ERROR:
       return false;
    default:
@@ -517,6 +1347,147 @@ mongocrypt_ctx_finalize (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
    }
 }
 
+bool
+mongocrypt_ctx_finalize_steal (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   mongocrypt_binary_t result;
+   _mongocrypt_buffer_t *buf = NULL;
+   _mongocrypt_buffer_t stolen;
+
+   if (!ctx) {
+      return false;
+   }
+
+   if (!out) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL input");
+   }
+
+   memset (&result, 0, sizeof (result));
+   if (!mongocrypt_ctx_finalize (ctx, &result)) {
+      return false;
+   }
+
+   if (ctx->vtable.result) {
+      buf = ctx->vtable.result (ctx);
+   }
+
+   _mongocrypt_buffer_init (&stolen);
+   if (buf && buf->data == result.data && buf->len == result.len) {
+      /* Copies if buf does not own its data. */
+      _mongocrypt_buffer_steal (&stolen, buf);
+   } else {
+      _mongocrypt_buffer_copy_from_binary (&stolen, &result);
+   }
+
+   if (out->owned) {
+      bson_free (out->data);
+   }
+   out->data = stolen.data;
+   out->len = stolen.len;
+   out->owned = true;
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_finalize_len (mongocrypt_ctx_t *ctx, uint32_t *len)
+{
+   bool ret;
+
+   if (!ctx) {
+      return false;
+   }
+
+   if (!len) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL input");
+   }
+
+   if (ctx->finalize_measured) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "already finalized");
+   }
+
+   memset (&ctx->finalize_out, 0, sizeof (ctx->finalize_out));
+   ctx->finalize_deferred = true;
+   ret = mongocrypt_ctx_finalize (ctx, &ctx->finalize_out);
+   ctx->finalize_deferred = false;
+   if (!ret) {
+      return false;
+   }
+
+   if (!ctx->finalize_spliced) {
+      /* Finalize built the output itself. */
+      ctx->finalize_len = ctx->finalize_out.len;
+   }
+   ctx->finalize_measured = true;
+   _record_ns_stats (ctx, ctx->finalize_len);
+   *len = ctx->finalize_len;
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_finalize_into (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   if (!ctx) {
+      return false;
+   }
+
+   if (!out || !out->data) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL input");
+   }
+
+   if (!ctx->finalize_measured) {
+      return _mongocrypt_ctx_fail_w_msg (
+         ctx, "mongocrypt_ctx_finalize_len must be called first");
+   }
+
+   if (out->len < ctx->finalize_len) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "output buffer too small");
+   }
+
+   if (ctx->finalize_spliced) {
+      _mongocrypt_splice_write (&ctx->finalize_splice, out->data);
+      _mongocrypt_ctx_splice_release (ctx, &ctx->finalize_splice);
+      ctx->finalize_spliced = false;
+   } else {
+      memcpy (out->data, ctx->finalize_out.data, ctx->finalize_len);
+   }
+   ctx->finalize_measured = false;
+   return true;
+}
+
+
+bool
+mongocrypt_ctx_timings (mongocrypt_ctx_t *ctx, mongocrypt_binary_t *out)
+{
+   bson_t bson;
+   uint32_t len;
+
+   if (!ctx) {
+      return false;
+   }
+   if (!ctx->initialized) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "ctx NULL or uninitialized");
+   }
+
+   if (!out) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "invalid NULL input");
+   }
+
+   _mongocrypt_ctx_timings_update (ctx);
+   bson_init (&bson);
+   _append_timings (ctx, &bson, bson_get_monotonic_time ());
+
+   if (out->owned) {
+      bson_free (out->data);
+   }
+   out->data = bson_destroy_with_steal (&bson, true, &len);
+   out->len = len;
+   out->owned = true;
+   return true;
+}
+
+
 bool
 mongocrypt_ctx_status (mongocrypt_ctx_t *ctx, mongocrypt_status_t *out)
 {
@@ -536,19 +1507,22 @@ mongocrypt_ctx_status (mongocrypt_ctx_t *ctx, mongocrypt_status_t *out)
 void
 mongocrypt_ctx_destroy (mongocrypt_ctx_t *ctx)
 {
+   int i;
+
    if (!ctx) {
       return;
    }
 
-   if (ctx->vtable.cleanup) {
-      ctx->vtable.cleanup (ctx);
+   _ctx_cleanup (ctx);
+   _mongocrypt_key_broker_cleanup (&ctx->kb);
+   _mongocrypt_splice_cleanup (&ctx->spare_splice);
+   for (i = 0; i < _MONGOCRYPT_CTX_SLOTS; i++) {
+      bson_free (ctx->slots[i].data);
    }
-
-   _mongocrypt_kek_cleanup (&ctx->opts.kek);
+   _mongocrypt_arena_cleanup (&ctx->arena);
+   _mongocrypt_atomic_add_int64 (&ctx->crypt->stats.memory.contexts,
+                                 -(int64_t) _ctx_size ());
    mongocrypt_status_destroy (ctx->status);
-   _mongocrypt_key_broker_cleanup (&ctx->kb);
-   _mongocrypt_key_alt_name_destroy_all (ctx->opts.key_alt_names);
-   _mongocrypt_buffer_cleanup (&ctx->opts.key_id);
    bson_free (ctx);
    return;
 }
@@ -616,7 +1590,7 @@ mongocrypt_ctx_setopt_masterkey_aws (mongocrypt_ctx_t *ctx,
    mongocrypt_binary_destroy (bin);
    bson_destroy (&as_bson);
 
-   if (ctx->crypt->log.trace_enabled) {
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
       _mongocrypt_log (&ctx->crypt->log,
                        MONGOCRYPT_LOG_LEVEL_TRACE,
                        "%s (%s=\"%s\", %s=%d, %s=\"%s\", %s=%d)",
@@ -668,6 +1642,9 @@ _mongocrypt_ctx_init (mongocrypt_ctx_t *ctx,
       return _mongocrypt_ctx_fail_w_msg (ctx, "cannot double initialize");
    }
    ctx->initialized = true;
+   ctx->timings.state = ctx->state;
+   ctx->timings.started_us = bson_get_monotonic_time ();
+   ctx->timings.entered_us = ctx->timings.started_us;
 
    if (ctx->state == MONGOCRYPT_CTX_ERROR) {
       return false;
@@ -743,7 +1720,24 @@ _mongocrypt_ctx_init (mongocrypt_ctx_t *ctx,
       return _mongocrypt_ctx_fail_w_msg (ctx, "algorithm prohibited");
    }
 
-   _mongocrypt_key_broker_init (&ctx->kb, ctx->crypt);
+   if (opts_spec->decrypt_paths == OPT_PROHIBITED &&
+       ctx->opts.decrypt_paths.len > 0) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "decrypt paths prohibited");
+   }
+
+   if (opts_spec->decrypt_session == OPT_PROHIBITED &&
+       ctx->opts.decrypt_session) {
+      return _mongocrypt_ctx_fail_w_msg (ctx, "decrypt session prohibited");
+   }
+
+   /* The key broker of a reset context is ready, and keeps its storage. */
+   if (!ctx->kb.crypt) {
+      _mongocrypt_key_broker_init (&ctx->kb, ctx->crypt);
+   }
+   ctx->kb.arena = &ctx->arena;
+   if (ctx->opts.decrypt_session) {
+      _mongocrypt_key_broker_set_session (&ctx->kb, ctx->opts.decrypt_session);
+   }
    return true;
 }
 
@@ -872,7 +1866,7 @@ mongocrypt_ctx_setopt_key_encryption_key (mongocrypt_ctx_t *ctx,
       return _mongocrypt_ctx_fail (ctx);
    }
 
-   if (ctx->crypt->log.trace_enabled) {
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&ctx->crypt->log)) {
       char *bin_str = bson_as_canonical_extended_json (&as_bson, NULL);
       _mongocrypt_log (&ctx->crypt->log,
                        MONGOCRYPT_LOG_LEVEL_TRACE,
@@ -885,3 +1879,146 @@ mongocrypt_ctx_setopt_key_encryption_key (mongocrypt_ctx_t *ctx,
 
    return true;
 }
+
+
+bool
+_mongocrypt_ctx_collect_binary_in_bson (mongocrypt_ctx_t *ctx,
+                                        _mongocrypt_splice_callback_t cb,
+                                        const bson_t *in,
+                                        _mongocrypt_splice_t *splice)
+{
+   uint32_t i;
+
+   if (!_mongocrypt_splice_collect (splice, in, ctx->status)) {
+      return false;
+   }
+   for (i = 0; i < splice->n_items; i++) {
+      if (!cb (&ctx->kb, &splice->items[i], ctx->status)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+bool
+_mongocrypt_ctx_transform_splice (mongocrypt_ctx_t *ctx,
+                                  _mongocrypt_splice_callback_t cb,
+                                  _mongocrypt_splice_batch_callback_t batch_cb,
+                                  _mongocrypt_splice_t *collected,
+                                  _mongocrypt_buffer_t *out)
+{
+   _mongocrypt_opts_t *opts;
+   _mongocrypt_splice_t splice;
+   traversal_match_t match;
+   bool ret = false;
+
+   opts = &ctx->crypt->opts;
+   /* Take the splice, leaving @collected empty. */
+   memcpy (&splice, collected, sizeof (splice));
+   match = splice.match;
+   _mongocrypt_splice_init (collected, match);
+
+   if (batch_cb && ctx->crypt->crypto &&
+       _mongocrypt_crypto_uses_batch (ctx->crypt->crypto)) {
+      ret = _mongocrypt_splice_transform_batch (
+         &splice, batch_cb, &ctx->kb, ctx->status);
+   } else if (opts->parallel_for &&
+              splice.n_items >= opts->parallel_min_fields) {
+      _mongocrypt_arena_t *arena;
+
+      /* The arena and prepared native keys are not thread safe. */
+      arena = ctx->kb.arena;
+      ctx->kb.arena = NULL;
+      ctx->kb.concurrent = true;
+      ret = _mongocrypt_splice_transform (&splice,
+                                          cb,
+                                          &ctx->kb,
+                                          opts->parallel_for,
+                                          opts->parallel_for_ctx,
+                                          ctx->status);
+      ctx->kb.arena = arena;
+      ctx->kb.concurrent = false;
+   } else if (batch_cb && match == TRAVERSE_MATCH_MARKING &&
+              splice.n_items > 1 && !opts->use_ciphertext_cache &&
+              ctx->crypt->crypto &&
+              _mongocrypt_crypto_uses_multi_buffer (ctx->crypt->crypto)) {
+      /* Encrypt the markings together, interleaving their AES blocks. The
+       * batch path does not use the ciphertext cache. */
+      ret = _mongocrypt_splice_transform_batch (
+         &splice, batch_cb, &ctx->kb, ctx->status);
+   } else {
+      ret = _mongocrypt_splice_transform (
+         &splice, cb, &ctx->kb, NULL, NULL, ctx->status);
+   }
+
+   if (ret) {
+      _mongocrypt_atomic_add_int64 (match == TRAVERSE_MATCH_MARKING
+                                       ? &ctx->crypt->stats.fields_encrypted
+                                       : &ctx->crypt->stats.fields_decrypted,
+                                    splice.n_items);
+      ctx->timings.fields += splice.n_items;
+   }
+
+   if (ret && ctx->finalize_in_place) {
+      /* Nothing is left to lay out, even for mongocrypt_ctx_finalize_into. */
+      ret = _mongocrypt_splice_finish_in_place (&splice, out, ctx->status);
+      goto done;
+   }
+
+   if (ret && ctx->finalize_deferred) {
+      /* Leave out empty. mongocrypt_ctx_finalize_into builds it. */
+      _mongocrypt_buffer_init (out);
+      ret = _mongocrypt_splice_measure (
+         &splice, &ctx->finalize_len, ctx->status);
+      if (ret) {
+         BSON_ASSERT (!ctx->finalize_spliced);
+         memcpy (&ctx->finalize_splice, &splice, sizeof (splice));
+         ctx->finalize_spliced = true;
+         return true;
+      }
+      goto done;
+   }
+
+   if (ret && ctx->vtable.result && out == ctx->vtable.result (ctx)) {
+      uint32_t len;
+
+      /* The result is laid out in a slot, which a reset context reuses.
+       * Other outputs, like the fields of a document view, must outlive the
+       * next transform, and are allocated. */
+      ret = _mongocrypt_splice_measure (&splice, &len, ctx->status);
+      if (ret) {
+         _mongocrypt_ctx_slot_buffer (
+            ctx, _MONGOCRYPT_CTX_SLOT_RESULT, len, out);
+         _mongocrypt_splice_write (&splice, out->data);
+      }
+      goto done;
+   }
+
+   ret = ret && _mongocrypt_splice_finish (&splice, out, ctx->status);
+done:
+   _mongocrypt_ctx_splice_release (ctx, &splice);
+   return ret;
+}
+
+
+bool
+_mongocrypt_ctx_transform_binary_in_bson (
+   mongocrypt_ctx_t *ctx,
+   _mongocrypt_splice_callback_t cb,
+   _mongocrypt_splice_batch_callback_t batch_cb,
+   traversal_match_t match,
+   const bson_t *in,
+   const _mongocrypt_path_filter_t *filter,
+   _mongocrypt_buffer_t *out)
+{
+   _mongocrypt_splice_t splice;
+
+   _mongocrypt_ctx_splice_init (ctx, &splice, match);
+   splice.filter = filter;
+   if (!_mongocrypt_splice_collect (&splice, in, ctx->status)) {
+      _mongocrypt_ctx_splice_release (ctx, &splice);
+      return false;
+   }
+   return _mongocrypt_ctx_transform_splice (ctx, cb, batch_cb, &splice, out);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_DECRYPT_SESSION_PRIVATE_H
+#define MONGOCRYPT_DECRYPT_SESSION_PRIVATE_H
+
+#include "mongocrypt.h"
+#include "mongocrypt-cache-key-private.h"
+#include "mongocrypt-crypto-private.h"
+
+/* A key carried by a decrypt session from one context to the next. */
+typedef struct __mongocrypt_decrypt_session_key_t {
+   /* A reference. */
+   _mongocrypt_cache_key_value_t *value;
+   /* Prepared from value by a context. A context using the key takes it, and
+    * gives it back when cleaned up, so it is never shared. May be NULL. */
+   _native_crypto_key_t *native_key;
+   bool native_key_prepared;
+   /* Valid until keys are invalidated, which changes the invalidations count
+    * of the key cache, or the key cache expiration after the key was
+    * resolved. */
+   int64_t invalidations;
+   int64_t until_ms;
+   struct __mongocrypt_decrypt_session_key_t *next;
+} _mongocrypt_decrypt_session_key_t;
+
+/* Created with mongocrypt_decrypt_session_new. Not thread safe. Key brokers
+ * look keys up in it before the key cache, and add the keys they resolved
+ * when they are cleaned up. Contexts point to the session, never to its
+ * keys. */
+struct _mongocrypt_decrypt_session_t {
+   mongocrypt_t *crypt;
+   _mongocrypt_decrypt_session_key_t *keys;
+};
+
+/* Returns the valid key matching @id, if set, or any of @alt_names, or NULL.
+ * Removes expired keys. */
+_mongocrypt_decrypt_session_key_t *
+_mongocrypt_decrypt_session_find (mongocrypt_decrypt_session_t *session,
+                                  const _mongocrypt_buffer_t *id,
+                                  _mongocrypt_key_alt_name_t *alt_names);
+
+/* Add a key a context resolved when the key cache invalidations count was
+ * @invalidations. Steals the reference of @value and @native_key. If the key
+ * is present, only its missing prepared key is filled in. If keys were
+ * invalidated since, nothing is added. */
+void
+_mongocrypt_decrypt_session_add (mongocrypt_decrypt_session_t *session,
+                                 _mongocrypt_cache_key_value_t *value,
+                                 _native_crypto_key_t *native_key,
+                                 bool native_key_prepared,
+                                 int64_t invalidations);
+
+#endif /* MONGOCRYPT_DECRYPT_SESSION_PRIVATE_H */
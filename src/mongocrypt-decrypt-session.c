@@ -0,0 +1,154 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-private.h"
+#include "mongocrypt-decrypt-session-private.h"
+
+
+mongocrypt_decrypt_session_t *
+mongocrypt_decrypt_session_new (mongocrypt_t *crypt)
+{
+   mongocrypt_decrypt_session_t *session;
+
+   if (!crypt) {
+      return NULL;
+   }
+   if (!crypt->initialized) {
+      mongocrypt_status_t *status;
+
+      status = crypt->status;
+      CLIENT_ERR ("cannot create decrypt session from uninitialized crypt");
+      return NULL;
+   }
+
+   session = bson_malloc0 (sizeof (*session));
+   BSON_ASSERT (session);
+   session->crypt = crypt;
+   return session;
+}
+
+
+static void
+_key_destroy (_mongocrypt_decrypt_session_key_t *key)
+{
+   _mongocrypt_cache_key_value_destroy (key->value);
+   _native_crypto_key_destroy (key->native_key);
+   bson_free (key);
+}
+
+
+void
+mongocrypt_decrypt_session_destroy (mongocrypt_decrypt_session_t *session)
+{
+   _mongocrypt_decrypt_session_key_t *key, *next;
+
+   if (!session) {
+      return;
+   }
+
+   for (key = session->keys; key; key = next) {
+      next = key->next;
+      _key_destroy (key);
+   }
+   bson_free (session);
+}
+
+
+static bool
+_key_matches (_mongocrypt_decrypt_session_key_t *key,
+              const _mongocrypt_buffer_t *id,
+              _mongocrypt_key_alt_name_t *alt_names)
+{
+   _mongocrypt_key_doc_t *key_doc = key->value->key_doc;
+
+   if (id && !_mongocrypt_buffer_empty (id)) {
+      return 0 == _mongocrypt_buffer_cmp (&key_doc->id, id);
+   }
+   return _mongocrypt_key_alt_name_intersects (key_doc->key_alt_names,
+                                               alt_names);
+}
+
+
+_mongocrypt_decrypt_session_key_t *
+_mongocrypt_decrypt_session_find (mongocrypt_decrypt_session_t *session,
+                                  const _mongocrypt_buffer_t *id,
+                                  _mongocrypt_key_alt_name_t *alt_names)
+{
+   _mongocrypt_decrypt_session_key_t **link, *key;
+   int64_t invalidations;
+   int64_t now;
+
+   invalidations = _mongocrypt_atomic_load_int64 (
+      &session->crypt->cache_key->invalidations);
+   now = bson_get_monotonic_time () / 1000;
+   link = &session->keys;
+   while ((key = *link)) {
+      if (key->invalidations != invalidations || now >= key->until_ms) {
+         *link = key->next;
+         _key_destroy (key);
+         continue;
+      }
+      if (_key_matches (key, id, alt_names)) {
+         return key;
+      }
+      link = &key->next;
+   }
+   return NULL;
+}
+
+
+void
+_mongocrypt_decrypt_session_add (mongocrypt_decrypt_session_t *session,
+                                 _mongocrypt_cache_key_value_t *value,
+                                 _native_crypto_key_t *native_key,
+                                 bool native_key_prepared,
+                                 int64_t invalidations)
+{
+   _mongocrypt_decrypt_session_key_t *key;
+   _mongocrypt_cache_t *cache = session->crypt->cache_key;
+
+   if (invalidations !=
+       _mongocrypt_atomic_load_int64 (&cache->invalidations)) {
+      _mongocrypt_cache_key_value_destroy (value);
+      _native_crypto_key_destroy (native_key);
+      return;
+   }
+
+   key = _mongocrypt_decrypt_session_find (
+      session, &value->key_doc->id, value->key_doc->key_alt_names);
+   if (key) {
+      /* Keep one prepared key, for the next context to take. */
+      if (!key->native_key_prepared) {
+         key->native_key = native_key;
+         key->native_key_prepared = native_key_prepared;
+         native_key = NULL;
+      }
+      _mongocrypt_cache_key_value_destroy (value);
+      _native_crypto_key_destroy (native_key);
+      return;
+   }
+
+   key = bson_malloc0 (sizeof (*key));
+   BSON_ASSERT (key);
+   key->value = value;
+   key->native_key = native_key;
+   key->native_key_prepared = native_key_prepared;
+   key->invalidations = invalidations;
+   key->until_ms =
+      bson_get_monotonic_time () / 1000 + (int64_t) cache->expiration;
+   key->next = session->keys;
+   session->keys = key;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_EXECUTOR_PRIVATE_H
+#define MONGOCRYPT_EXECUTOR_PRIVATE_H
+
+#include "mongocrypt.h"
+
+/* The fewest fields a document must have to be transformed through an
+ * executor. */
+#define MONGOCRYPT_EXECUTOR_MIN_FIELDS 4
+
+/* The most tasks submitted for one parallel_for. Each task runs calls until
+ * there are none left, so this bounds the submissions, not the work. */
+#define MONGOCRYPT_EXECUTOR_MAX_TASKS 32
+
+/* Set by mongocrypt_setopt_executor. */
+typedef struct {
+   mongocrypt_submit_fn submit;
+   void *ctx;
+} _mongocrypt_executor_t;
+
+/* A mongocrypt_parallel_for_fn that runs the calls on the thread pool of a
+ * _mongocrypt_executor_t, passed as @ctx. The calling thread runs calls too,
+ * and only waits for the calls already started, so a busy or failing
+ * executor slows the work down but never blocks it. Tasks submitted for
+ * calls the calling thread ran find nothing to do. */
+bool
+_mongocrypt_executor_parallel_for (void *ctx,
+                                   uint32_t count,
+                                   mongocrypt_task_fn task,
+                                   void *task_ctx);
+
+#endif /* MONGOCRYPT_EXECUTOR_PRIVATE_H */
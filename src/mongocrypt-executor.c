@@ -0,0 +1,133 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-private.h"
+#include "mongocrypt-executor-private.h"
+#include "mongocrypt-mutex-private.h"
+
+/* The state of one parallel_for, shared by the calling thread and the tasks
+ * it submitted. Freed by whichever drops the last reference, since a task
+ * may run after the parallel_for returned. */
+typedef struct {
+   mongocrypt_mutex_t mutex;
+   mongocrypt_cond_t cond;
+   mongocrypt_task_fn task;
+   void *task_ctx;
+   uint32_t count;
+   uint32_t next;    /* The next call to claim. */
+   uint32_t running; /* Calls claimed but not returned. */
+   uint32_t refs;    /* The calling thread, and each task not yet run. */
+} _executor_run_t;
+
+
+static void
+_run_release (_executor_run_t *run)
+{
+   bool last;
+
+   _mongocrypt_mutex_lock (&run->mutex);
+   last = --run->refs == 0;
+   _mongocrypt_mutex_unlock (&run->mutex);
+   if (last) {
+      _mongocrypt_cond_cleanup (&run->cond);
+      _mongocrypt_mutex_cleanup (&run->mutex);
+      bson_free (run);
+   }
+}
+
+
+/* Claim and make calls until none are left. */
+static void
+_run_calls (_executor_run_t *run)
+{
+   uint32_t index;
+
+   _mongocrypt_mutex_lock (&run->mutex);
+   while (run->next < run->count) {
+      index = run->next++;
+      run->running++;
+      _mongocrypt_mutex_unlock (&run->mutex);
+
+      run->task (run->task_ctx, index);
+
+      _mongocrypt_mutex_lock (&run->mutex);
+      if (--run->running == 0 && run->next == run->count) {
+         _mongocrypt_cond_broadcast (&run->cond);
+      }
+   }
+   _mongocrypt_mutex_unlock (&run->mutex);
+}
+
+
+static void
+_run_task (void *task_ctx, uint32_t index)
+{
+   _executor_run_t *run;
+
+   (void) index;
+   run = (_executor_run_t *) task_ctx;
+   _run_calls (run);
+   _run_release (run);
+}
+
+
+bool
+_mongocrypt_executor_parallel_for (void *ctx,
+                                   uint32_t count,
+                                   mongocrypt_task_fn task,
+                                   void *task_ctx)
+{
+   _mongocrypt_executor_t *executor;
+   _executor_run_t *run;
+   uint32_t i, n_tasks;
+
+   executor = (_mongocrypt_executor_t *) ctx;
+   run = bson_malloc0 (sizeof (*run));
+   BSON_ASSERT (run);
+   _mongocrypt_mutex_init (&run->mutex);
+   _mongocrypt_cond_init (&run->cond);
+   run->task = task;
+   run->task_ctx = task_ctx;
+   run->count = count;
+   run->refs = 1;
+
+   /* The calling thread makes calls too. */
+   n_tasks = count > 0 ? count - 1 : 0;
+   n_tasks = BSON_MIN (n_tasks, MONGOCRYPT_EXECUTOR_MAX_TASKS);
+   for (i = 0; i < n_tasks; i++) {
+      bool submitted;
+
+      _mongocrypt_mutex_lock (&run->mutex);
+      run->refs++;
+      _mongocrypt_mutex_unlock (&run->mutex);
+      submitted = executor->submit (executor->ctx, _run_task, run, i);
+      if (!submitted) {
+         /* The calling thread makes the remaining calls. */
+         _run_release (run);
+         break;
+      }
+   }
+
+   _run_calls (run);
+
+   _mongocrypt_mutex_lock (&run->mutex);
+   while (run->running > 0) {
+      _mongocrypt_cond_timedwait (&run->cond, &run->mutex, 1000);
+   }
+   _mongocrypt_mutex_unlock (&run->mutex);
+   _run_release (run);
+   return true;
+}
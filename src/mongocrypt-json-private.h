@@ -0,0 +1,52 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_JSON_PRIVATE_H
+#define MONGOCRYPT_JSON_PRIVATE_H
+
+#include "mongocrypt-buffer-private.h"
+
+/* Read single fields of a KMS response body without converting it to BSON.
+ * These only handle the common case. They return false for anything else,
+ * including malformed JSON, so the caller can fall back to
+ * bson_init_from_json, which reports errors. */
+
+/* Find the top level string @field of the JSON object @json. @*value points
+ * into @json at the contents of the string. Returns false if the string has
+ * escape sequences. */
+bool
+_mongocrypt_json_find_string (const char *json,
+                              size_t json_len,
+                              const char *field,
+                              const char **value,
+                              size_t *value_len);
+
+/* Find the top level integer @field of the JSON object @json. */
+bool
+_mongocrypt_json_find_int64 (const char *json,
+                             size_t json_len,
+                             const char *field,
+                             int64_t *value);
+
+/* Decode @len characters of base64, or base64url if @url, into @out.
+ * Padding is optional. */
+bool
+_mongocrypt_json_b64_decode (const char *b64,
+                             size_t len,
+                             bool url,
+                             _mongocrypt_buffer_t *out);
+
+#endif /* MONGOCRYPT_JSON_PRIVATE_H */
@@ -0,0 +1,337 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-private.h"
+#include "mongocrypt-json-private.h"
+
+/* Nesting deeper than this is left to the full parser. */
+#define MAX_DEPTH 32
+
+
+static void
+_skip_ws (const char **p, const char *end)
+{
+   while (*p < end &&
+          (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r')) {
+      (*p)++;
+   }
+}
+
+
+/* Skip the string starting at *p, which is '"'. */
+static bool
+_skip_string (const char **p, const char *end)
+{
+   (*p)++;
+   while (*p < end) {
+      if (**p == '\\') {
+         if (end - *p < 2) {
+            return false;
+         }
+         *p += 2;
+      } else if (**p == '"') {
+         (*p)++;
+         return true;
+      } else if ((unsigned char) **p < 0x20) {
+         return false;
+      } else {
+         (*p)++;
+      }
+   }
+   return false;
+}
+
+
+static bool
+_skip_value (const char **p, const char *end, int depth);
+
+
+/* Skip the object or array starting at *p. */
+static bool
+_skip_container (const char **p, const char *end, int depth)
+{
+   bool is_object;
+   char close;
+
+   if (depth >= MAX_DEPTH) {
+      return false;
+   }
+   is_object = **p == '{';
+   close = is_object ? '}' : ']';
+   (*p)++;
+   _skip_ws (p, end);
+   if (*p < end && **p == close) {
+      (*p)++;
+      return true;
+   }
+   for (;;) {
+      if (is_object) {
+         if (*p >= end || **p != '"' || !_skip_string (p, end)) {
+            return false;
+         }
+         _skip_ws (p, end);
+         if (*p >= end || **p != ':') {
+            return false;
+         }
+         (*p)++;
+         _skip_ws (p, end);
+      }
+      if (!_skip_value (p, end, depth + 1)) {
+         return false;
+      }
+      _skip_ws (p, end);
+      if (*p >= end) {
+         return false;
+      }
+      if (**p == close) {
+         (*p)++;
+         return true;
+      }
+      if (**p != ',') {
+         return false;
+      }
+      (*p)++;
+      _skip_ws (p, end);
+   }
+}
+
+
+static bool
+_skip_value (const char **p, const char *end, int depth)
+{
+   const char *start;
+
+   if (*p >= end) {
+      return false;
+   }
+   if (**p == '"') {
+      return _skip_string (p, end);
+   }
+   if (**p == '{' || **p == '[') {
+      return _skip_container (p, end, depth);
+   }
+   /* A number, true, false, or null. */
+   start = *p;
+   while (*p < end &&
+          ((**p >= '0' && **p <= '9') || (**p >= 'a' && **p <= 'z') ||
+           **p == '-' || **p == '+' || **p == '.' || **p == 'E')) {
+      (*p)++;
+   }
+   return *p > start;
+}
+
+
+/* Find the first top level @field of the object @json. @*value spans the
+ * JSON text of its value. The whole object is scanned, so trailing garbage
+ * is rejected like bson_init_from_json does. */
+static bool
+_find (const char *json,
+       size_t json_len,
+       const char *field,
+       const char **value,
+       size_t *value_len)
+{
+   const char *p, *end;
+   size_t field_len;
+   bool found = false;
+
+   p = json;
+   end = json + json_len;
+   field_len = strlen (field);
+   _skip_ws (&p, end);
+   if (p >= end || *p != '{') {
+      return false;
+   }
+   p++;
+   _skip_ws (&p, end);
+   if (p < end && *p == '}') {
+      return false;
+   }
+   for (;;) {
+      const char *key, *start;
+      size_t key_len;
+
+      if (p >= end || *p != '"') {
+         return false;
+      }
+      key = p + 1;
+      if (!_skip_string (&p, end)) {
+         return false;
+      }
+      key_len = (size_t) (p - 1 - key);
+      _skip_ws (&p, end);
+      if (p >= end || *p != ':') {
+         return false;
+      }
+      p++;
+      _skip_ws (&p, end);
+      start = p;
+      if (!_skip_value (&p, end, 1)) {
+         return false;
+      }
+      if (!found && key_len == field_len &&
+          0 == memcmp (key, field, field_len)) {
+         *value = start;
+         *value_len = (size_t) (p - start);
+         found = true;
+      }
+      _skip_ws (&p, end);
+      if (p >= end) {
+         return false;
+      }
+      if (*p == '}') {
+         p++;
+         break;
+      }
+      if (*p != ',') {
+         return false;
+      }
+      p++;
+      _skip_ws (&p, end);
+   }
+   _skip_ws (&p, end);
+   /* The body may be NULL terminated. */
+   if (p < end && *p == '\0') {
+      p++;
+   }
+   return found && p == end;
+}
+
+
+bool
+_mongocrypt_json_find_string (const char *json,
+                              size_t json_len,
+                              const char *field,
+                              const char **value,
+                              size_t *value_len)
+{
+   const char *raw;
+   size_t raw_len;
+
+   if (!_find (json, json_len, field, &raw, &raw_len) || raw[0] != '"' ||
+       memchr (raw, '\\', raw_len)) {
+      return false;
+   }
+   *value = raw + 1;
+   *value_len = raw_len - 2;
+   return true;
+}
+
+
+bool
+_mongocrypt_json_find_int64 (const char *json,
+                             size_t json_len,
+                             const char *field,
+                             int64_t *value)
+{
+   const char *raw;
+   size_t raw_len, i = 0;
+   bool negative = false;
+   uint64_t n = 0;
+
+   if (!_find (json, json_len, field, &raw, &raw_len)) {
+      return false;
+   }
+   if (raw[0] == '-') {
+      negative = true;
+      i++;
+   }
+   if (i == raw_len) {
+      return false;
+   }
+   for (; i < raw_len; i++) {
+      if (raw[i] < '0' || raw[i] > '9' || n > (uint64_t) INT64_MAX / 10) {
+         return false;
+      }
+      n = n * 10 + (uint64_t) (raw[i] - '0');
+      if (n > (uint64_t) INT64_MAX) {
+         return false;
+      }
+   }
+   *value = negative ? -(int64_t) n : (int64_t) n;
+   return true;
+}
+
+
+static int
+_b64_value (char c, bool url)
+{
+   if (c >= 'A' && c <= 'Z') {
+      return c - 'A';
+   }
+   if (c >= 'a' && c <= 'z') {
+      return c - 'a' + 26;
+   }
+   if (c >= '0' && c <= '9') {
+      return c - '0' + 52;
+   }
+   if (c == '+' || (url && c == '-')) {
+      return 62;
+   }
+   if (c == '/' || (url && c == '_')) {
+      return 63;
+   }
+   return -1;
+}
+
+
+bool
+_mongocrypt_json_b64_decode (const char *b64,
+                             size_t len,
+                             bool url,
+                             _mongocrypt_buffer_t *out)
+{
+   uint8_t *data;
+   uint32_t acc = 0, n = 0;
+   int bits = 0;
+   size_t i;
+
+   if (len > 0 && b64[len - 1] == '=') {
+      len--;
+      if (len > 0 && b64[len - 1] == '=') {
+         len--;
+      }
+   }
+   if (len % 4 == 1 || len / 4 * 3 + 2 > UINT32_MAX) {
+      return false;
+   }
+
+   /* One more byte, so an empty result is not a NULL allocation. */
+   data = bson_malloc (len / 4 * 3 + 3);
+   BSON_ASSERT (data);
+   for (i = 0; i < len; i++) {
+      int v;
+
+      v = _b64_value (b64[i], url);
+      if (v < 0) {
+         bson_free (data);
+         return false;
+      }
+      acc = (acc << 6) | (uint32_t) v;
+      bits += 6;
+      if (bits >= 8) {
+         bits -= 8;
+         data[n++] = (uint8_t) (acc >> bits);
+         acc &= (1u << bits) - 1u;
+      }
+   }
+
+   _mongocrypt_buffer_cleanup (out);
+   out->data = data;
+   out->len = n;
+   out->owned = true;
+   return true;
+}
@@ -27,6 +27,9 @@
 #include "mongocrypt-binary-private.h"
 #include "mongocrypt-opts-private.h"
 #include "mongocrypt-cache-private.h"
+#include "mongocrypt-arena-private.h"
+#include "mongocrypt-crypto-private.h"
+#include "mongocrypt-decrypt-session-private.h"
 
 /* The key broker acts as a middle-man between an encrypt/decrypt request and
  * the key cache.
@@ -70,6 +73,13 @@ typedef struct _key_request_t {
    _mongocrypt_buffer_t id;
    _mongocrypt_key_alt_name_t *alt_name;
    bool satisfied; /* true if satisfied by a cache entry or a key returned. */
+   /* true if another context is fetching the key. Waiting requests are not
+    * in the filter unless the wait in requests_done times out. */
+   bool waiting;
+   /* true if another context added the key to this context's batch (see
+    * _mongocrypt_key_batch_t). Borrowed requests are fetched, but need not
+    * be satisfied. */
+   bool borrowed;
    struct _key_request_t *next;
 } key_request_t;
 
@@ -77,21 +87,52 @@ typedef struct _key_request_t {
 typedef struct _key_returned_t {
    _mongocrypt_key_doc_t *doc;
    _mongocrypt_buffer_t decrypted_key_material;
+   /* If set, the key came from the cache, and doc and decrypted_key_material
+    * are borrowed from this reference. */
+   _mongocrypt_cache_key_value_t *cached;
 
    mongocrypt_kms_ctx_t kms;
    bool decrypted;
 
    bool needs_auth;
 
+   /* Native crypto state prepared from decrypted_key_material on first use.
+    * NULL if the crypto backend does not support prepared keys. */
+   _native_crypto_key_t *native_key;
+   bool native_key_prepared;
+
    struct _key_returned_t *next;
 } key_returned_t;
 
+/* An entry in a key_index_t. Exactly one of id or name is set. Both point
+ * into the indexed item, which must outlive the index. */
+typedef struct _key_index_entry_t {
+   uint32_t hash;
+   const _mongocrypt_buffer_t *id;
+   const char *name;
+   void *item;
+   struct _key_index_entry_t *next;
+} key_index_entry_t;
+
+/* A hash index of key_request_t or key_returned_t by UUID and by
+ * keyAltName, so lookups do not walk the linked lists. */
+typedef struct {
+   key_index_entry_t **buckets;
+   uint32_t num_buckets;
+   uint32_t num_entries;
+   /* Entries of a cleared index, reused before allocating. */
+   key_index_entry_t *spare;
+} key_index_t;
+
 typedef struct _auth_request_t {
    mongocrypt_kms_ctx_t kms;
    bool returned;
    bool initialized;
 } auth_request_t;
 
+/* The number of slots in _mongocrypt_key_broker_t.recent_keys. */
+#define KB_RECENT_KEYS 4
+
 typedef struct {
    key_broker_state_t state;
    mongocrypt_status_t *status;
@@ -105,16 +146,75 @@ typedef struct {
    key_returned_t *keys_returned;
    key_returned_t *keys_cached;
    _mongocrypt_buffer_t filter;
+   _mongocrypt_buffer_t projection;
+   /* The documents the filter is built in, or NULL. Reinitialized rather
+    * than allocated again. */
+   bson_t *filter_doc;
+   bson_t *filter_ids;
+   bson_t *filter_names;
    mongocrypt_t *crypt;
 
    key_returned_t *decryptor_iter;
    auth_request_t auth_request_azure;
    auth_request_t auth_request_gcp;
+   /* If true, requests are not satisfied from the cache. Keys are always
+    * fetched, and the fetched keys replace any cached entries. */
+   bool bypass_cache;
+   /* If true, the filter was supplied by the caller and every key document
+    * returned is accepted, even if it matches no request. */
+   bool request_all;
+   /* Temporaries used while encrypting or decrypting with the keys. Owned by
+    * the context. May be NULL, in which case temporaries are allocated. */
+   _mongocrypt_arena_t *arena;
+   /* If true, decrypted keys may be looked up from several threads at once.
+    * Prepared native keys are not thread safe, and are not returned. */
+   bool concurrent;
+   /* The local master key prepared for native crypto on first use, so each
+    * later key document wrapped with it skips the cipher and MAC setup. May
+    * be NULL. */
+   _native_crypto_key_t *local_kek;
+   bool local_kek_prepared;
+   /* True if this key broker claimed a fetch in crypt->key_fetches. */
+   bool owns_fetches;
+   /* True if this key broker claimed the fetch of an OAuth token. */
+   bool owns_oauth_fetch;
+   /* Set by _mongocrypt_key_broker_set_session. May be NULL. */
+   mongocrypt_decrypt_session_t *session;
+   /* The invalidations count of the key cache when session was set. */
+   int64_t session_invalidations;
+   /* Indexes of key_requests, keys_returned, and keys_cached. */
+   key_index_t key_requests_index;
+   key_index_t keys_returned_index;
+   key_index_t keys_cached_index;
+   /* Keys recently returned by _mongocrypt_key_broker_borrow_decrypted_key,
+    * direct-mapped by key id. Entries point into keys_returned or
+    * keys_cached. */
+   key_returned_t *recent_keys[KB_RECENT_KEYS];
+   /* The span for the current state, or 0. Only the states that wait on the
+    * driver are traced. */
+   uint64_t trace_id;
+   /* Requests and keys released by _mongocrypt_key_broker_reset, reused
+    * before allocating. */
+   key_request_t *spare_requests;
+   key_returned_t *spare_keys;
 } _mongocrypt_key_broker_t;
 
 void
 _mongocrypt_key_broker_init (_mongocrypt_key_broker_t *kb, mongocrypt_t *crypt);
 
+/* Satisfy requests from @session before the key cache, and add the keys
+ * resolved to @session on cleanup. @session must outlive @kb. */
+void
+_mongocrypt_key_broker_set_session (_mongocrypt_key_broker_t *kb,
+                                    mongocrypt_decrypt_session_t *session);
+
+/* Request every key matching a find filter supplied by the caller, instead of
+ * individual keys. Keys returned are decrypted and added to the cache. */
+bool
+_mongocrypt_key_broker_request_all (_mongocrypt_key_broker_t *kb,
+                                    const _mongocrypt_buffer_t *filter)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
 /* Add a request for a key by UUID. */
 bool
 _mongocrypt_key_broker_request_id (_mongocrypt_key_broker_t *kb,
@@ -138,6 +238,13 @@ _mongocrypt_key_broker_filter (_mongocrypt_key_broker_t *kb,
                                mongocrypt_binary_t *out)
    MONGOCRYPT_WARN_UNUSED_RESULT;
 
+/* Get the find command projection, the fields of key documents that are
+ * parsed. */
+bool
+_mongocrypt_key_broker_projection (_mongocrypt_key_broker_t *kb,
+                                   mongocrypt_binary_t *out)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
 
 /* Add a key document. */
 bool
@@ -160,22 +267,38 @@ _mongocrypt_key_broker_kms_done (_mongocrypt_key_broker_t *kb);
 
 
 /* Get the final decrypted key material from a key by looking up with a key_id.
- * @out is always initialized, even on error. */
+ * @out is always initialized, even on error.
+ * @native_key_out may be NULL. If not NULL, it is set to the key's prepared
+ * native crypto state (owned by the key broker), or NULL if unavailable. */
 bool
-_mongocrypt_key_broker_decrypted_key_by_id (_mongocrypt_key_broker_t *kb,
-                                            const _mongocrypt_buffer_t *key_id,
-                                            _mongocrypt_buffer_t *out)
-   MONGOCRYPT_WARN_UNUSED_RESULT;
+_mongocrypt_key_broker_decrypted_key_by_id (
+   _mongocrypt_key_broker_t *kb,
+   const _mongocrypt_buffer_t *key_id,
+   _mongocrypt_buffer_t *out,
+   _native_crypto_key_t **native_key_out) MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Like _mongocrypt_key_broker_decrypted_key_by_id, but sets @out to the key
+ * material owned by the key broker instead of copying it. @out is valid until
+ * the key broker is cleaned up. Repeated lookups of the same few keys are
+ * answered without searching the key broker. */
+bool
+_mongocrypt_key_broker_borrow_decrypted_key (
+   _mongocrypt_key_broker_t *kb,
+   const _mongocrypt_buffer_t *key_id,
+   const _mongocrypt_buffer_t **out,
+   _native_crypto_key_t **native_key_out) MONGOCRYPT_WARN_UNUSED_RESULT;
 
 /* Get the final decrypted key material from a key, and optionally its key_id.
  * @key_id_out may be NULL. @out and @key_id_out (if not NULL) are always
- * initialized, even on error. */
+ * initialized, even on error. @native_key_out is as in
+ * _mongocrypt_key_broker_decrypted_key_by_id. */
 bool
-_mongocrypt_key_broker_decrypted_key_by_name (_mongocrypt_key_broker_t *kb,
-                                              const bson_value_t *key_alt_name,
-                                              _mongocrypt_buffer_t *out,
-                                              _mongocrypt_buffer_t *key_id_out)
-   MONGOCRYPT_WARN_UNUSED_RESULT;
+_mongocrypt_key_broker_decrypted_key_by_name (
+   _mongocrypt_key_broker_t *kb,
+   const bson_value_t *key_alt_name,
+   _mongocrypt_buffer_t *out,
+   _mongocrypt_buffer_t *key_id_out,
+   _native_crypto_key_t **native_key_out) MONGOCRYPT_WARN_UNUSED_RESULT;
 
 
 bool
@@ -183,6 +306,13 @@ _mongocrypt_key_broker_status (_mongocrypt_key_broker_t *kb,
                                mongocrypt_status_t *out);
 
 
+/* Release the requests and keys of @kb, and return it to the state after
+ * _mongocrypt_key_broker_init. Its status, projection, indexes, and the
+ * storage of its requests, keys, and filter are kept for reuse. */
+void
+_mongocrypt_key_broker_reset (_mongocrypt_key_broker_t *kb);
+
+
 void
 _mongocrypt_key_broker_cleanup (_mongocrypt_key_broker_t *kb);
 
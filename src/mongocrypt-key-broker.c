@@ -16,6 +16,7 @@
 
 #include "mongocrypt-key-broker-private.h"
 #include "mongocrypt-private.h"
+#include "mongocrypt-probes-private.h"
 
 void
 _mongocrypt_key_broker_init (_mongocrypt_key_broker_t *kb, mongocrypt_t *crypt)
@@ -26,61 +27,327 @@ _mongocrypt_key_broker_init (_mongocrypt_key_broker_t *kb, mongocrypt_t *crypt)
    kb->status = mongocrypt_status_new ();
 }
 
+
+void
+_mongocrypt_key_broker_set_session (_mongocrypt_key_broker_t *kb,
+                                    mongocrypt_decrypt_session_t *session)
+{
+   kb->session = session;
+   /* Read before any lookup, so a key invalidated while this key broker
+    * holds it is not added to the session. */
+   kb->session_invalidations = _mongocrypt_atomic_load_int64 (
+      &kb->crypt->cache_key->invalidations);
+}
+
+
+static bool
+_trace_span_for_state (key_broker_state_t state, mongocrypt_trace_span_t *span)
+{
+   switch (state) {
+   case KB_ADDING_DOCS:
+      *span = MONGOCRYPT_TRACE_SPAN_KEY_VAULT;
+      return true;
+   case KB_AUTHENTICATING:
+      *span = MONGOCRYPT_TRACE_SPAN_KMS_AUTH;
+      return true;
+   case KB_DECRYPTING_KEY_MATERIAL:
+      *span = MONGOCRYPT_TRACE_SPAN_KMS_DECRYPT;
+      return true;
+   default:
+      return false;
+   }
+}
+
+
+/* Move to @state, ending the span of the old state and beginning one for the
+ * new state. */
+static void
+_key_broker_set_state (_mongocrypt_key_broker_t *kb, key_broker_state_t state)
+{
+   _mongocrypt_trace_t *trace = kb->crypt ? &kb->crypt->trace : NULL;
+   mongocrypt_trace_span_t span;
+
+   if (MONGOCRYPT_TRACING (trace) && state != kb->state) {
+      if (_trace_span_for_state (kb->state, &span)) {
+         _mongocrypt_trace_end (trace, span, kb->trace_id, NULL);
+         kb->trace_id = 0;
+      }
+      if (_trace_span_for_state (state, &span)) {
+         kb->trace_id = _mongocrypt_trace_begin (trace, span, NULL);
+      }
+   }
+   kb->state = state;
+}
+
+#define KEY_INDEX_MIN_BUCKETS 16
+
+static uint32_t
+_key_index_hash_id (const _mongocrypt_buffer_t *id)
+{
+   return _mongocrypt_cache_hash_bytes (id->data, id->len);
+}
+
+static uint32_t
+_key_index_hash_name (const char *name)
+{
+   return _mongocrypt_cache_hash_bytes (name, strlen (name));
+}
+
+static void
+_key_index_grow (key_index_t *index)
+{
+   key_index_entry_t **buckets;
+   key_index_entry_t *entry;
+   key_index_entry_t *tmp;
+   uint32_t num_buckets;
+   uint32_t i;
+
+   num_buckets = index->num_buckets ? index->num_buckets * 2
+                                    : KEY_INDEX_MIN_BUCKETS;
+   buckets = bson_malloc0 (num_buckets * sizeof (*buckets));
+   BSON_ASSERT (buckets);
+
+   for (i = 0; i < index->num_buckets; i++) {
+      for (entry = index->buckets[i]; NULL != entry; entry = tmp) {
+         tmp = entry->next;
+         entry->next = buckets[entry->hash % num_buckets];
+         buckets[entry->hash % num_buckets] = entry;
+      }
+   }
+   bson_free (index->buckets);
+   index->buckets = buckets;
+   index->num_buckets = num_buckets;
+}
+
+/* Add an entry for either @id or @name (not both) pointing to @item. */
+static void
+_key_index_add (key_index_t *index,
+                const _mongocrypt_buffer_t *id,
+                const char *name,
+                void *item)
+{
+   key_index_entry_t *entry;
+   uint32_t bucket;
+
+   if (index->num_entries >= index->num_buckets) {
+      _key_index_grow (index);
+   }
+
+   if (index->spare) {
+      entry = index->spare;
+      index->spare = entry->next;
+   } else {
+      entry = bson_malloc (sizeof (*entry));
+      BSON_ASSERT (entry);
+   }
+   entry->id = id;
+   entry->name = name;
+   entry->hash = id ? _key_index_hash_id (id) : _key_index_hash_name (name);
+   entry->item = item;
+
+   /* Prepend, so the most recently added item is found first. */
+   bucket = entry->hash % index->num_buckets;
+   entry->next = index->buckets[bucket];
+   index->buckets[bucket] = entry;
+   index->num_entries++;
+}
+
+/* Add entries for a key's id (if not empty) and each of its key alt names. */
+static void
+_key_index_add_all (key_index_t *index,
+                    const _mongocrypt_buffer_t *id,
+                    _mongocrypt_key_alt_name_t *key_alt_names,
+                    void *item)
+{
+   if (!_mongocrypt_buffer_empty (id)) {
+      _key_index_add (index, id, NULL, item);
+   }
+   for (; NULL != key_alt_names; key_alt_names = key_alt_names->next) {
+      _key_index_add (index,
+                      NULL,
+                      _mongocrypt_key_alt_name_get_string (key_alt_names),
+                      item);
+   }
+}
+
+static void *
+_key_index_find_id (key_index_t *index, const _mongocrypt_buffer_t *id)
+{
+   key_index_entry_t *entry;
+   uint32_t hash;
+
+   if (!index->num_buckets) {
+      return NULL;
+   }
+   hash = _key_index_hash_id (id);
+   for (entry = index->buckets[hash % index->num_buckets]; NULL != entry;
+        entry = entry->next) {
+      if (entry->hash == hash && entry->id &&
+          0 == _mongocrypt_buffer_cmp (entry->id, id)) {
+         return entry->item;
+      }
+   }
+   return NULL;
+}
+
+static void *
+_key_index_find_name (key_index_t *index, const char *name)
+{
+   key_index_entry_t *entry;
+   uint32_t hash;
+
+   if (!index->num_buckets) {
+      return NULL;
+   }
+   hash = _key_index_hash_name (name);
+   for (entry = index->buckets[hash % index->num_buckets]; NULL != entry;
+        entry = entry->next) {
+      if (entry->hash == hash && entry->name &&
+          0 == strcmp (entry->name, name)) {
+         return entry->item;
+      }
+   }
+   return NULL;
+}
+
+/* Find the first (if any) item matching either a key_id or a list of
+ * key_alt_names (both are NULLable) */
+static void *
+_key_index_find_one (key_index_t *index,
+                     const _mongocrypt_buffer_t *key_id,
+                     _mongocrypt_key_alt_name_t *key_alt_names)
+{
+   void *item;
+
+   if (key_id) {
+      item = _key_index_find_id (index, key_id);
+      if (item) {
+         return item;
+      }
+   }
+   for (; NULL != key_alt_names; key_alt_names = key_alt_names->next) {
+      item = _key_index_find_name (
+         index, _mongocrypt_key_alt_name_get_string (key_alt_names));
+      if (item) {
+         return item;
+      }
+   }
+   return NULL;
+}
+
+/* Remove every entry, keeping them and the buckets for reuse. */
+static void
+_key_index_clear (key_index_t *index)
+{
+   key_index_entry_t *entry;
+   key_index_entry_t *tmp;
+   uint32_t i;
+
+   for (i = 0; i < index->num_buckets; i++) {
+      for (entry = index->buckets[i]; NULL != entry; entry = tmp) {
+         tmp = entry->next;
+         entry->next = index->spare;
+         index->spare = entry;
+      }
+      index->buckets[i] = NULL;
+   }
+   index->num_entries = 0;
+}
+
+static void
+_key_index_cleanup (key_index_t *index)
+{
+   key_index_entry_t *entry;
+   key_index_entry_t *tmp;
+
+   _key_index_clear (index);
+   for (entry = index->spare; NULL != entry; entry = tmp) {
+      tmp = entry->next;
+      bson_free (entry);
+   }
+   bson_free (index->buckets);
+}
+
+/* Prepend @key_returned to @list and add it to @index. */
+static void
+_key_returned_link (_mongocrypt_key_broker_t *kb,
+                    key_returned_t **list,
+                    key_index_t *index,
+                    key_returned_t *key_returned)
+{
+   key_returned->next = *list;
+   *list = key_returned;
+   _key_index_add_all (index,
+                       &key_returned->doc->id,
+                       key_returned->doc->key_alt_names,
+                       key_returned);
+
+   /* Update the head of the decrypting iter. */
+   kb->decryptor_iter = kb->keys_returned;
+}
+
+/* Returns a zeroed key_returned_t, reusing a spare if there is one. */
+static key_returned_t *
+_key_returned_new (_mongocrypt_key_broker_t *kb)
+{
+   key_returned_t *key_returned;
+
+   if (kb->spare_keys) {
+      key_returned = kb->spare_keys;
+      kb->spare_keys = key_returned->next;
+      memset (key_returned, 0, sizeof (*key_returned));
+      return key_returned;
+   }
+   key_returned = bson_malloc0 (sizeof (*key_returned));
+   BSON_ASSERT (key_returned);
+   return key_returned;
+}
+
 /*
  * Creates a new key_returned_t and prepends it to a list.
  *
  * Side effects:
  * - updates *list to point to a new head.
+ * - adds the new key_returned_t to @index.
  */
 static key_returned_t *
 _key_returned_prepend (_mongocrypt_key_broker_t *kb,
                        key_returned_t **list,
+                       key_index_t *index,
                        _mongocrypt_key_doc_t *key_doc)
 {
    key_returned_t *key_returned;
 
    BSON_ASSERT (key_doc);
 
-   key_returned = bson_malloc0 (sizeof (*key_returned));
-   BSON_ASSERT (key_returned);
+   key_returned = _key_returned_new (kb);
 
    key_returned->doc = _mongocrypt_key_new ();
    _mongocrypt_key_doc_copy_to (key_doc, key_returned->doc);
-
-   /* Prepend and update the head of the list. */
-   key_returned->next = *list;
-   *list = key_returned;
-
-   /* Update the head of the decrypting iter. */
-   kb->decryptor_iter = kb->keys_returned;
+   _key_returned_link (kb, list, index, key_returned);
    return key_returned;
 }
 
-/* Find the first (if any) key_returned_t matching either a key_id or a list of
- * key_alt_names (both are NULLable) */
+/* Prepend a key borrowed from the cache, stealing the reference @cached. */
 static key_returned_t *
-_key_returned_find_one (key_returned_t *list,
-                        _mongocrypt_buffer_t *key_id,
-                        _mongocrypt_key_alt_name_t *key_alt_names)
+_key_returned_prepend_cached (_mongocrypt_key_broker_t *kb,
+                              key_returned_t **list,
+                              key_index_t *index,
+                              _mongocrypt_cache_key_value_t *cached)
 {
    key_returned_t *key_returned;
 
-   for (key_returned = list; NULL != key_returned;
-        key_returned = key_returned->next) {
-      if (key_id) {
-         if (0 == _mongocrypt_buffer_cmp (key_id, &key_returned->doc->id)) {
-            return key_returned;
-         }
-      }
-      if (key_alt_names) {
-         if (_mongocrypt_key_alt_name_intersects (
-                key_alt_names, key_returned->doc->key_alt_names)) {
-            return key_returned;
-         }
-      }
-   }
+   BSON_ASSERT (cached);
 
-   return NULL;
+   key_returned = _key_returned_new (kb);
+
+   key_returned->cached = cached;
+   key_returned->doc = cached->key_doc;
+   _mongocrypt_buffer_set_to (&cached->decrypted_key_material,
+                              &key_returned->decrypted_key_material);
+   key_returned->decrypted = true;
+   _key_returned_link (kb, list, index, key_returned);
+   return key_returned;
 }
 
 /* Find the first (if any) key_request_t in the key broker matching either a
@@ -90,24 +357,34 @@ _key_request_find_one (_mongocrypt_key_broker_t *kb,
                        const _mongocrypt_buffer_t *key_id,
                        _mongocrypt_key_alt_name_t *key_alt_names)
 {
-   key_request_t *key_request;
+   return _key_index_find_one (
+      &kb->key_requests_index, key_id, key_alt_names);
+}
 
-   for (key_request = kb->key_requests; NULL != key_request;
-        key_request = key_request->next) {
-      if (key_id) {
-         if (0 == _mongocrypt_buffer_cmp (key_id, &key_request->id)) {
-            return key_request;
-         }
-      }
-      if (key_alt_names) {
-         if (_mongocrypt_key_alt_name_intersects (key_alt_names,
-                                                  key_request->alt_name)) {
-            return key_request;
-         }
-      }
+/* Returns a zeroed key_request_t, reusing a spare if there is one. */
+static key_request_t *
+_key_request_new (_mongocrypt_key_broker_t *kb)
+{
+   key_request_t *req;
+
+   if (kb->spare_requests) {
+      req = kb->spare_requests;
+      kb->spare_requests = req->next;
+      memset (req, 0, sizeof (*req));
+      return req;
    }
+   req = bson_malloc0 (sizeof (*req));
+   BSON_ASSERT (req);
+   return req;
+}
 
-   return NULL;
+/* Prepend @req to the key requests. */
+static void
+_key_request_prepend (_mongocrypt_key_broker_t *kb, key_request_t *req)
+{
+   req->next = kb->key_requests;
+   kb->key_requests = req;
+   _key_index_add_all (&kb->key_requests_index, &req->id, req->alt_name, req);
 }
 
 static bool
@@ -117,7 +394,7 @@ _all_key_requests_satisfied (_mongocrypt_key_broker_t *kb)
 
    for (key_request = kb->key_requests; NULL != key_request;
         key_request = key_request->next) {
-      if (!key_request->satisfied) {
+      if (!key_request->satisfied && !key_request->borrowed) {
          return false;
       }
    }
@@ -129,7 +406,7 @@ _key_broker_fail_w_msg (_mongocrypt_key_broker_t *kb, const char *msg)
 {
    mongocrypt_status_t *status;
 
-   kb->state = KB_ERROR;
+   _key_broker_set_state (kb, KB_ERROR);
    status = kb->status;
    CLIENT_ERR (msg);
    return false;
@@ -142,12 +419,44 @@ _key_broker_fail (_mongocrypt_key_broker_t *kb)
       return _key_broker_fail_w_msg (
          kb, "unexpected, failing but no error status set");
    }
-   kb->state = KB_ERROR;
+   _key_broker_set_state (kb, KB_ERROR);
    return false;
 }
 
+/* Returns true if @req was satisfied from the decrypt session. */
+static bool
+_try_satisfying_from_session (_mongocrypt_key_broker_t *kb,
+                              key_request_t *req)
+{
+   _mongocrypt_decrypt_session_key_t *key;
+   key_returned_t *key_returned;
+
+   key =
+      _mongocrypt_decrypt_session_find (kb->session, &req->id, req->alt_name);
+   if (!key) {
+      return false;
+   }
+
+   req->satisfied = true;
+   key_returned = _key_returned_prepend_cached (
+      kb,
+      &kb->keys_cached,
+      &kb->keys_cached_index,
+      _mongocrypt_cache_key_value_ref (key->value));
+   /* Take the prepared key. It is given back on cleanup. */
+   key_returned->native_key = key->native_key;
+   key_returned->native_key_prepared = key->native_key_prepared;
+   key->native_key = NULL;
+   key->native_key_prepared = false;
+   return true;
+}
+
+/* If @may_wait is true and another context is fetching the key that @req
+ * would fetch, @req waits for that context instead. */
 static bool
-_try_satisfying_from_cache (_mongocrypt_key_broker_t *kb, key_request_t *req)
+_try_satisfying_from_cache (_mongocrypt_key_broker_t *kb,
+                            key_request_t *req,
+                            bool may_wait)
 {
    _mongocrypt_cache_key_attr_t *attr = NULL;
    _mongocrypt_cache_key_value_t *value = NULL;
@@ -159,15 +468,25 @@ _try_satisfying_from_cache (_mongocrypt_key_broker_t *kb, key_request_t *req)
       goto cleanup;
    }
 
+   if (kb->session && _try_satisfying_from_session (kb, req)) {
+      ret = true;
+      goto cleanup;
+   }
+
    attr = _mongocrypt_cache_key_attr_new (&req->id, req->alt_name);
-   if (!_mongocrypt_cache_get (&kb->crypt->cache_key, attr, (void **) &value)) {
+   if (!_mongocrypt_key_l1_get (
+          kb->crypt->key_l1, kb->crypt->cache_key, attr, &value)) {
       _key_broker_fail_w_msg (kb, "failed to retrieve from cache");
       goto cleanup;
    }
+   if (!value && !_mongocrypt_cache_key_backend_get (
+                    kb->crypt, attr, &value, kb->status)) {
+      _key_broker_fail (kb);
+      goto cleanup;
+   }
 
    if (value) {
-      key_returned_t *key_returned;
-
+      MONGOCRYPT_PROBE1 (key__cache__hit, kb);
       req->satisfied = true;
       if (_mongocrypt_buffer_empty (&value->decrypted_key_material)) {
          _key_broker_fail_w_msg (
@@ -175,17 +494,29 @@ _try_satisfying_from_cache (_mongocrypt_key_broker_t *kb, key_request_t *req)
          goto cleanup;
       }
 
-      /* Add the cached key to our locally copied list.
+      /* Add the cached key to our list. It shares the cache entry.
        * Note, we deduplicate requests, but *not* keys from the cache,
        * because the state of the cache may change between each call to
        * _mongocrypt_cache_get.
        */
-      key_returned =
-         _key_returned_prepend (kb, &kb->keys_cached, value->key_doc);
-      _mongocrypt_buffer_init (&key_returned->decrypted_key_material);
-      _mongocrypt_buffer_copy_to (&value->decrypted_key_material,
-                                  &key_returned->decrypted_key_material);
-      key_returned->decrypted = true;
+      _key_returned_prepend_cached (
+         kb, &kb->keys_cached, &kb->keys_cached_index, value);
+      value = NULL;
+   } else {
+      MONGOCRYPT_PROBE1 (key__cache__miss, kb);
+      /* A context that misses right after the owner adds the key claims it
+       * again, and fetches it a second time. */
+      if (kb->crypt->opts.key_fetch_wait_ms) {
+         if (_mongocrypt_key_fetches_claim (
+                &kb->crypt->key_fetches,
+                attr,
+                kb,
+                kb->crypt->opts.key_fetch_wait_ms)) {
+            kb->owns_fetches = true;
+         } else {
+            req->waiting = may_wait;
+         }
+      }
    }
 
    ret = true;
@@ -215,7 +546,17 @@ _store_to_cache (_mongocrypt_key_broker_t *kb, key_returned_t *key_returned)
    value = _mongocrypt_cache_key_value_new (
       key_returned->doc, &key_returned->decrypted_key_material);
    ret = _mongocrypt_cache_add_stolen (
-      &kb->crypt->cache_key, attr, value, kb->status);
+      kb->crypt->cache_key, attr, value, kb->status);
+   if (ret) {
+      ret = _mongocrypt_cache_key_backend_put (
+         kb->crypt,
+         key_returned->doc,
+         &key_returned->decrypted_key_material,
+         kb->status);
+   }
+   if (kb->owns_fetches) {
+      _mongocrypt_key_fetches_release (&kb->crypt->key_fetches, kb, attr);
+   }
    _mongocrypt_cache_key_attr_destroy (attr);
    if (!ret) {
       return _key_broker_fail (kb);
@@ -242,13 +583,14 @@ _mongocrypt_key_broker_request_id (_mongocrypt_key_broker_t *kb,
       return true;
    }
 
-   req = bson_malloc0 (sizeof *req);
-   BSON_ASSERT (req);
+   req = _key_request_new (kb);
 
    _mongocrypt_buffer_copy_to (key_id, &req->id);
-   req->next = kb->key_requests;
-   kb->key_requests = req;
-   if (!_try_satisfying_from_cache (kb, req)) {
+   _key_request_prepend (kb, req);
+   if (kb->bypass_cache) {
+      return true;
+   }
+   if (!_try_satisfying_from_cache (kb, req, true)) {
       return false;
    }
    return true;
@@ -275,18 +617,182 @@ _mongocrypt_key_broker_request_name (_mongocrypt_key_broker_t *kb,
       return true;
    }
 
-   req = bson_malloc0 (sizeof *req);
-   BSON_ASSERT (req);
+   req = _key_request_new (kb);
 
    req->alt_name = key_alt_name /* takes ownership */;
-   req->next = kb->key_requests;
-   kb->key_requests = req;
-   if (!_try_satisfying_from_cache (kb, req)) {
+   _key_request_prepend (kb, req);
+   if (kb->bypass_cache) {
+      return true;
+   }
+   if (!_try_satisfying_from_cache (kb, req, true)) {
       return false;
    }
    return true;
 }
 
+bool
+_mongocrypt_key_broker_request_all (_mongocrypt_key_broker_t *kb,
+                                    const _mongocrypt_buffer_t *filter)
+{
+   if (kb->state != KB_REQUESTING) {
+      return _key_broker_fail_w_msg (
+         kb, "attempting to request all keys, but in wrong state");
+   }
+
+   if (kb->key_requests || kb->request_all) {
+      return _key_broker_fail_w_msg (
+         kb, "attempting to request all keys, but keys already requested");
+   }
+
+   kb->request_all = true;
+   _mongocrypt_buffer_copy_to (filter, &kb->filter);
+   return true;
+}
+
+/* Wait for the contexts fetching keys that requests are waiting on, and take
+ * the keys they add to the cache. Keys that are still not cached are fetched
+ * by this context. A context that claimed fetches of its own does not wait,
+ * so two contexts never wait on each other. */
+static bool
+_wait_for_key_fetches (_mongocrypt_key_broker_t *kb)
+{
+   key_request_t *req;
+
+   for (req = kb->key_requests; NULL != req; req = req->next) {
+      _mongocrypt_cache_key_attr_t *attr;
+
+      if (!req->waiting) {
+         continue;
+      }
+      req->waiting = false;
+      if (!kb->owns_fetches) {
+         attr = _mongocrypt_cache_key_attr_new (&req->id, req->alt_name);
+         _mongocrypt_key_fetches_wait (&kb->crypt->key_fetches,
+                                       attr,
+                                       kb,
+                                       kb->crypt->opts.key_fetch_wait_ms);
+         _mongocrypt_cache_key_attr_destroy (attr);
+      }
+      if (!_try_satisfying_from_cache (kb, req, false)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+/* Merge the fetch of the keys this context claimed into a batch, if
+ * opts.key_fetch_batch_ms is set. A context that joins another's batch waits
+ * for it in _wait_for_key_fetches. A context that leads a batch adds the
+ * keys that joined to its own requests. */
+static void
+_batch_key_fetches (_mongocrypt_key_broker_t *kb)
+{
+   key_request_t *req;
+   _mongocrypt_buffer_t *ids;
+   _mongocrypt_buffer_t *joined;
+   uint32_t num_ids = 0;
+   uint32_t num_joined;
+   uint32_t i;
+   bool follows;
+
+   if (!kb->crypt->opts.key_fetch_batch_ms || !kb->owns_fetches ||
+       kb->bypass_cache || kb->request_all ||
+       kb->crypt->key_vault_snapshot.num_keys > 0) {
+      return;
+   }
+
+   for (req = kb->key_requests; NULL != req; req = req->next) {
+      if (req->satisfied || req->waiting) {
+         continue;
+      }
+      /* The batch filter only has ids. */
+      if (req->alt_name) {
+         return;
+      }
+      num_ids++;
+   }
+   if (num_ids == 0) {
+      return;
+   }
+
+   /* Shallow copies. The requests own the ids. */
+   ids = bson_malloc (num_ids * sizeof (_mongocrypt_buffer_t));
+   BSON_ASSERT (ids);
+   i = 0;
+   for (req = kb->key_requests; NULL != req; req = req->next) {
+      if (!req->satisfied && !req->waiting) {
+         ids[i++] = req->id;
+      }
+   }
+
+   follows = _mongocrypt_key_batch_merge (&kb->crypt->key_batch,
+                                          &kb->crypt->key_fetches,
+                                          kb,
+                                          ids,
+                                          num_ids,
+                                          kb->crypt->opts.key_fetch_batch_ms,
+                                          kb->crypt->opts.key_fetch_wait_ms,
+                                          &joined,
+                                          &num_joined);
+   bson_free (ids);
+   if (follows) {
+      for (req = kb->key_requests; NULL != req; req = req->next) {
+         if (!req->satisfied) {
+            req->waiting = true;
+         }
+      }
+      kb->owns_fetches = false;
+      return;
+   }
+
+   for (i = 0; i < num_joined; i++) {
+      if (_key_request_find_one (kb, &joined[i], NULL)) {
+         continue;
+      }
+      req = _key_request_new (kb);
+      _mongocrypt_buffer_copy_to (&joined[i], &req->id);
+      req->borrowed = true;
+      _key_request_prepend (kb, req);
+   }
+   _mongocrypt_key_batch_ids_destroy (joined, num_joined);
+}
+
+/* Satisfy the remaining requests from the key vault snapshot, so the
+ * driver is not asked for key documents. */
+static bool
+_add_docs_from_snapshot (_mongocrypt_key_broker_t *kb)
+{
+   const _mongocrypt_key_vault_snapshot_t *snap;
+   key_request_t *req;
+
+   snap = &kb->crypt->key_vault_snapshot;
+   for (req = kb->key_requests; NULL != req; req = req->next) {
+      const _mongocrypt_buffer_t *doc = NULL;
+      _mongocrypt_key_alt_name_t *alt_name;
+
+      /* Adding a key may satisfy later requests too. */
+      if (req->satisfied) {
+         continue;
+      }
+      if (!_mongocrypt_buffer_empty (&req->id)) {
+         doc = _mongocrypt_key_vault_snapshot_find_id (snap, &req->id);
+      }
+      for (alt_name = req->alt_name; !doc && alt_name;
+           alt_name = alt_name->next) {
+         doc = _mongocrypt_key_vault_snapshot_find_name (
+            snap, _mongocrypt_key_alt_name_get_string (alt_name));
+      }
+      if (!doc) {
+         return _key_broker_fail_w_msg (
+            kb, "requested key not found in key vault snapshot");
+      }
+      if (!_mongocrypt_key_broker_add_doc (kb, doc)) {
+         return false;
+      }
+   }
+   return _mongocrypt_key_broker_docs_done (kb);
+}
+
 bool
 _mongocrypt_key_broker_requests_done (_mongocrypt_key_broker_t *kb)
 {
@@ -295,30 +801,53 @@ _mongocrypt_key_broker_requests_done (_mongocrypt_key_broker_t *kb)
          kb, "attempting to finish adding requests, but in wrong state");
    }
 
-   if (kb->key_requests) {
+   _batch_key_fetches (kb);
+   if (!_wait_for_key_fetches (kb)) {
+      return false;
+   }
+
+   if (kb->request_all) {
+      _key_broker_set_state (kb, KB_ADDING_DOCS);
+   } else if (kb->key_requests) {
       /* If all were satisfied from the cache, then we're done since those all
        * have decrypted material */
       if (_all_key_requests_satisfied (kb)) {
-         kb->state = KB_DONE;
+         _key_broker_set_state (kb, KB_DONE);
       } else {
-         kb->state = KB_ADDING_DOCS;
+         _key_broker_set_state (kb, KB_ADDING_DOCS);
+         if (kb->crypt->key_vault_snapshot.num_keys > 0) {
+            return _add_docs_from_snapshot (kb);
+         }
       }
    } else {
-      kb->state = KB_DONE;
+      _key_broker_set_state (kb, KB_DONE);
    }
    return true;
 }
 
+/* Empty the document at @doc, keeping its storage, or create it. */
+static bson_t *
+_reuse_bson (bson_t **doc)
+{
+   if (*doc) {
+      bson_reinit (*doc);
+   } else {
+      *doc = bson_new ();
+   }
+   return *doc;
+}
+
 bool
 _mongocrypt_key_broker_filter (_mongocrypt_key_broker_t *kb,
                                mongocrypt_binary_t *out)
 {
    key_request_t *req;
    _mongocrypt_key_alt_name_t *key_alt_name;
-   int name_index = 0;
-   int id_index = 0;
-   bson_t ids, names;
-   bson_t *filter;
+   uint32_t name_index = 0;
+   uint32_t id_index = 0;
+   bson_t *ids, *names, *filter;
+   const char *key_str;
+   char buf[16];
 
    BSON_ASSERT (kb);
 
@@ -332,8 +861,10 @@ _mongocrypt_key_broker_filter (_mongocrypt_key_broker_t *kb,
       return true;
    }
 
-   bson_init (&names);
-   bson_init (&ids);
+   /* The documents are reused after _mongocrypt_key_broker_reset. */
+   ids = _reuse_bson (&kb->filter_ids);
+   names = _reuse_bson (&kb->filter_names);
+   filter = _reuse_bson (&kb->filter_doc);
 
    for (req = kb->key_requests; NULL != req; req = req->next) {
       if (req->satisfied) {
@@ -342,40 +873,24 @@ _mongocrypt_key_broker_filter (_mongocrypt_key_broker_t *kb,
 
       if (!_mongocrypt_buffer_empty (&req->id)) {
          /* Collect key_ids in "ids" */
-         char *key_str;
-
-         key_str = bson_strdup_printf ("%d", id_index++);
-         if (!key_str ||
-             !_mongocrypt_buffer_append (
-                &req->id, &ids, key_str, (uint32_t) strlen (key_str))) {
-            bson_destroy (&ids);
-            bson_destroy (&names);
-            bson_free (key_str);
+         bson_uint32_to_string (id_index++, &key_str, buf, sizeof (buf));
+         if (!_mongocrypt_buffer_append (
+                &req->id, ids, key_str, (uint32_t) strlen (key_str))) {
             return _key_broker_fail_w_msg (kb, "could not construct id list");
          }
-
-         bson_free (key_str);
       }
 
       /* Collect key alt names in "names" */
       for (key_alt_name = req->alt_name; NULL != key_alt_name;
            key_alt_name = key_alt_name->next) {
-         char *key_str;
-
-         key_str = bson_strdup_printf ("%d", name_index++);
-         BSON_ASSERT (key_str);
-         if (!bson_append_value (&names,
+         bson_uint32_to_string (name_index++, &key_str, buf, sizeof (buf));
+         if (!bson_append_value (names,
                                  key_str,
-                                 (uint32_t) strlen (key_str),
+                                 (int) strlen (key_str),
                                  &key_alt_name->value)) {
-            bson_destroy (&ids);
-            bson_destroy (&names);
-            bson_free (key_str);
             return _key_broker_fail_w_msg (
                kb, "could not construct keyAltName list");
          }
-
-         bson_free (key_str);
       }
    }
 
@@ -384,32 +899,68 @@ _mongocrypt_key_broker_filter (_mongocrypt_key_broker_t *kb,
     * { $or: [ { _id: { $in : [ids] }},
     *          { keyAltName : { $in : [names] }} ] }
     */
-   filter = BCON_NEW ("$or",
-                      "[",
-                      "{",
-                      "_id",
-                      "{",
-                      "$in",
-                      BCON_ARRAY (&ids),
-                      "}",
-                      "}",
-                      "{",
-                      "keyAltNames",
-                      "{",
-                      "$in",
-                      BCON_ARRAY (&names),
-                      "}",
-                      "}",
-                      "]");
-
-   _mongocrypt_buffer_steal_from_bson (&kb->filter, filter);
+   BCON_APPEND (filter,
+                "$or",
+                "[",
+                "{",
+                "_id",
+                "{",
+                "$in",
+                BCON_ARRAY (ids),
+                "}",
+                "}",
+                "{",
+                "keyAltNames",
+                "{",
+                "$in",
+                BCON_ARRAY (names),
+                "}",
+                "}",
+                "]");
+
+   _mongocrypt_buffer_from_bson (&kb->filter, filter);
    _mongocrypt_buffer_to_binary (&kb->filter, out);
-   bson_destroy (&ids);
-   bson_destroy (&names);
 
    return true;
 }
 
+bool
+_mongocrypt_key_broker_projection (_mongocrypt_key_broker_t *kb,
+                                   mongocrypt_binary_t *out)
+{
+   bson_t *projection;
+
+   BSON_ASSERT (kb);
+
+   if (kb->state != KB_ADDING_DOCS) {
+      return _key_broker_fail_w_msg (
+         kb, "attempting to retrieve projection, but in wrong state");
+   }
+
+   if (_mongocrypt_buffer_empty (&kb->projection)) {
+      /* Every field _mongocrypt_key_parse_owned recognizes. */
+      projection = BCON_NEW ("_id",
+                             BCON_INT32 (1),
+                             "keyAltNames",
+                             BCON_INT32 (1),
+                             "keyMaterial",
+                             BCON_INT32 (1),
+                             "masterKey",
+                             BCON_INT32 (1),
+                             "version",
+                             BCON_INT32 (1),
+                             "status",
+                             BCON_INT32 (1),
+                             "creationDate",
+                             BCON_INT32 (1),
+                             "updateDate",
+                             BCON_INT32 (1));
+      _mongocrypt_buffer_steal_from_bson (&kb->projection, projection);
+   }
+   _mongocrypt_buffer_to_binary (&kb->projection, out);
+   return true;
+}
+
 static bool
 _decrypt_with_local_kms (_mongocrypt_key_broker_t *kb,
                          _mongocrypt_buffer_t *key_material,
@@ -426,10 +977,22 @@ _decrypt_with_local_kms (_mongocrypt_key_broker_t *kb,
 
    decrypted_key_material->owned = true;
 
+   if (!kb->local_kek_prepared) {
+      if (_mongocrypt_crypto_is_native (
+             kb->crypt->crypto,
+             MONGOCRYPT_CRYPTO_PRIMITIVE_AES_256_CBC |
+                MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512)) {
+         kb->local_kek =
+            _native_crypto_key_new (&kb->crypt->opts.kms_provider_local.key);
+      }
+      kb->local_kek_prepared = true;
+   }
+
    crypt_ret =
       _mongocrypt_do_decryption (kb->crypt->crypto,
                                  NULL /* associated data. */,
                                  &kb->crypt->opts.kms_provider_local.key,
+                                 kb->local_kek,
                                  key_material,
                                  decrypted_key_material,
                                  &bytes_written,
@@ -446,6 +1009,41 @@ _decrypt_with_local_kms (_mongocrypt_key_broker_t *kb,
    return true;
 }
 
+/* If another context is fetching a token of the OAuth @cache, wait for it
+ * instead of requesting another, so an expired token is requested once rather
+ * than by every context at the same time. Returns the token it cached, or
+ * NULL if this context must request one. A context that claimed a token fetch
+ * of its own does not wait, so two contexts never wait on each other. */
+static char *
+_wait_for_oauth_fetch (_mongocrypt_key_broker_t *kb,
+                       _mongocrypt_cache_oauth_t *cache)
+{
+   uint64_t wait_ms;
+   char *access_token;
+
+   wait_ms = kb->crypt->opts.key_fetch_wait_ms;
+   if (!wait_ms) {
+      return NULL;
+   }
+
+   if (_mongocrypt_cache_oauth_claim_fetch (cache, kb, wait_ms)) {
+      kb->owns_oauth_fetch = true;
+      return NULL;
+   }
+
+   if (kb->owns_oauth_fetch) {
+      return NULL;
+   }
+
+   _mongocrypt_cache_oauth_wait_fetch (cache, kb, wait_ms);
+   access_token = _mongocrypt_cache_oauth_get (cache);
+   if (!access_token &&
+       _mongocrypt_cache_oauth_claim_fetch (cache, kb, wait_ms)) {
+      kb->owns_oauth_fetch = true;
+   }
+   return access_token;
+}
+
 bool
 _mongocrypt_key_broker_add_doc (_mongocrypt_key_broker_t *kb,
                                 const _mongocrypt_buffer_t *doc)
@@ -454,6 +1052,7 @@ _mongocrypt_key_broker_add_doc (_mongocrypt_key_broker_t *kb,
    bson_t doc_bson;
    _mongocrypt_key_doc_t *key_doc = NULL;
    key_request_t *key_request;
+   _mongocrypt_key_alt_name_t *key_alt_name;
    key_returned_t *key_returned;
    _mongocrypt_kms_provider_t kek_provider;
    char* access_token = NULL;
@@ -481,7 +1080,8 @@ _mongocrypt_key_broker_add_doc (_mongocrypt_key_broker_t *kb,
    }
 
    /* Ensure that this document matches at least one request. */
-   if (!_key_request_find_one (kb, &key_doc->id, key_doc->key_alt_names)) {
+   if (!kb->request_all &&
+       !_key_request_find_one (kb, &key_doc->id, key_doc->key_alt_names)) {
       _key_broker_fail_w_msg (
          kb, "unexpected key returned, does not match any requests");
       goto done;
@@ -489,14 +1089,16 @@ _mongocrypt_key_broker_add_doc (_mongocrypt_key_broker_t *kb,
 
    /* Check if there are other keys_returned with intersecting altnames or
     * equal id. This is an error. Do *not* check cached keys. */
-   if (_key_returned_find_one (
-          kb->keys_returned, &key_doc->id, key_doc->key_alt_names)) {
+   if (_key_index_find_one (&kb->keys_returned_index,
+                            &key_doc->id,
+                            key_doc->key_alt_names)) {
       _key_broker_fail_w_msg (
          kb, "keys returned have duplicate keyAltNames or _id");
       goto done;
    }
 
-   key_returned = _key_returned_prepend (kb, &kb->keys_returned, key_doc);
+   key_returned = _key_returned_prepend (
+      kb, &kb->keys_returned, &kb->keys_returned_index, key_doc);
 
    /* Check that the returned key doc's provider matches. */
    kek_provider = key_doc->kek.kms_provider;
@@ -519,11 +1121,13 @@ _mongocrypt_key_broker_add_doc (_mongocrypt_key_broker_t *kb,
          goto done;
       }
    } else if (kek_provider == MONGOCRYPT_KMS_PROVIDER_AWS) {
-      if (!_mongocrypt_kms_ctx_init_aws_decrypt (&key_returned->kms,
-                                                 &kb->crypt->opts,
-                                                 key_doc,
-                                                 &kb->crypt->log,
-                                                 kb->crypt->crypto)) {
+      if (!_mongocrypt_kms_ctx_init_aws_decrypt (
+             &key_returned->kms,
+             &kb->crypt->opts,
+             key_doc,
+             &kb->crypt->log,
+             kb->crypt->crypto,
+             &kb->crypt->aws_signing_keys)) {
          mongocrypt_kms_ctx_status (&key_returned->kms, kb->status);
          _key_broker_fail (kb);
          goto done;
@@ -531,6 +1135,10 @@ _mongocrypt_key_broker_add_doc (_mongocrypt_key_broker_t *kb,
    } else if (kek_provider == MONGOCRYPT_KMS_PROVIDER_AZURE) {
 
       access_token = _mongocrypt_cache_oauth_get (kb->crypt->cache_oauth_azure);
+      if (!access_token) {
+         access_token =
+            _wait_for_oauth_fetch (kb, kb->crypt->cache_oauth_azure);
+      }
       if (!access_token) {
          key_returned->needs_auth = true;
          /* Create an oauth request if one does not exist. */
@@ -562,6 +1170,10 @@ _mongocrypt_key_broker_add_doc (_mongocrypt_key_broker_t *kb,
    } else if (kek_provider == MONGOCRYPT_KMS_PROVIDER_GCP) {
 
       access_token = _mongocrypt_cache_oauth_get (kb->crypt->cache_oauth_gcp);
+      if (!access_token) {
+         access_token =
+            _wait_for_oauth_fetch (kb, kb->crypt->cache_oauth_gcp);
+      }
       if (!access_token) {
          key_returned->needs_auth = true;
          /* Create an oauth request if one does not exist. */
@@ -570,7 +1182,8 @@ _mongocrypt_key_broker_add_doc (_mongocrypt_key_broker_t *kb,
                    &kb->auth_request_gcp.kms,
                    &kb->crypt->log,
                    &kb->crypt->opts,
-                   key_doc->kek.provider.gcp.endpoint)) {
+                   key_doc->kek.provider.gcp.endpoint,
+                   &kb->crypt->gcp_assertions)) {
                mongocrypt_kms_ctx_status (&kb->auth_request_gcp.kms,
                                           kb->status);
                _key_broker_fail (kb);
@@ -594,14 +1207,18 @@ _mongocrypt_key_broker_add_doc (_mongocrypt_key_broker_t *kb,
       goto done;
    }
 
-   /* Mark all matching key requests as satisfied. */
-   for (key_request = kb->key_requests; NULL != key_request;
-        key_request = key_request->next) {
-      if (0 == _mongocrypt_buffer_cmp (&key_doc->id, &key_request->id)) {
-         key_request->satisfied = true;
-      }
-      if (_mongocrypt_key_alt_name_intersects (key_doc->key_alt_names,
-                                               key_request->alt_name)) {
+   /* Mark all matching key requests as satisfied. Requests are deduplicated,
+    * so at most one request matches the id and each key alt name. */
+   key_request = _key_index_find_id (&kb->key_requests_index, &key_doc->id);
+   if (key_request) {
+      key_request->satisfied = true;
+   }
+   for (key_alt_name = key_doc->key_alt_names; NULL != key_alt_name;
+        key_alt_name = key_alt_name->next) {
+      key_request = _key_index_find_name (
+         &kb->key_requests_index,
+         _mongocrypt_key_alt_name_get_string (key_alt_name));
+      if (key_request) {
          key_request->satisfied = true;
       }
    }
@@ -631,6 +1248,23 @@ _mongocrypt_key_broker_docs_done (_mongocrypt_key_broker_t *kb)
                                      "not all keys requested were satisfied");
    }
 
+   /* Wake the contexts waiting on borrowed keys not in the key vault, so
+    * they fail on their own. */
+   if (kb->owns_fetches) {
+      key_request_t *req;
+
+      for (req = kb->key_requests; NULL != req; req = req->next) {
+         _mongocrypt_cache_key_attr_t *attr;
+
+         if (!req->borrowed || req->satisfied) {
+            continue;
+         }
+         attr = _mongocrypt_cache_key_attr_new (&req->id, NULL);
+         _mongocrypt_key_fetches_release (&kb->crypt->key_fetches, kb, attr);
+         _mongocrypt_cache_key_attr_destroy (attr);
+      }
+   }
+
    /* Transition to the next state.
     *  - If there are any Azure or GCP backed keys, and no oauth token is
     * cached, transition to KB_AUTHENTICATING.
@@ -653,11 +1287,11 @@ _mongocrypt_key_broker_docs_done (_mongocrypt_key_broker_t *kb)
    }
 
    if (needs_auth) {
-      kb->state = KB_AUTHENTICATING;
+      _key_broker_set_state (kb, KB_AUTHENTICATING);
    } else if (needs_decryption) {
-      kb->state = KB_DECRYPTING_KEY_MATERIAL;
+      _key_broker_set_state (kb, KB_DECRYPTING_KEY_MATERIAL);
    } else {
-      kb->state = KB_DONE;
+      _key_broker_set_state (kb, KB_DONE);
    }
    return true;
 }
@@ -712,6 +1346,47 @@ _mongocrypt_key_broker_next_kms (_mongocrypt_key_broker_t *kb)
    return NULL;
 }
 
+/* Cache the tokens returned by the OAuth requests. */
+static bool
+_cache_oauth_tokens (_mongocrypt_key_broker_t *kb)
+{
+   bson_t oauth_response;
+   _mongocrypt_buffer_t oauth_response_buf;
+
+   if (kb->auth_request_azure.initialized) {
+      if (!_mongocrypt_kms_ctx_result (&kb->auth_request_azure.kms,
+                                       &oauth_response_buf)) {
+         mongocrypt_kms_ctx_status (&kb->auth_request_azure.kms, kb->status);
+         return _key_broker_fail (kb);
+      }
+
+      /* Cache returned tokens. */
+      BSON_ASSERT (
+         _mongocrypt_buffer_to_bson (&oauth_response_buf, &oauth_response));
+      if (!_mongocrypt_cache_oauth_add (
+             kb->crypt->cache_oauth_azure, &oauth_response, kb->status)) {
+         return false;
+      }
+   }
+
+   if (kb->auth_request_gcp.initialized) {
+      if (!_mongocrypt_kms_ctx_result (&kb->auth_request_gcp.kms,
+                                       &oauth_response_buf)) {
+         mongocrypt_kms_ctx_status (&kb->auth_request_gcp.kms, kb->status);
+         return _key_broker_fail (kb);
+      }
+
+      /* Cache returned tokens. */
+      BSON_ASSERT (
+         _mongocrypt_buffer_to_bson (&oauth_response_buf, &oauth_response));
+      if (!_mongocrypt_cache_oauth_add (
+             kb->crypt->cache_oauth_gcp, &oauth_response, kb->status)) {
+         return false;
+      }
+   }
+   return true;
+}
+
 bool
 _mongocrypt_key_broker_kms_done (_mongocrypt_key_broker_t *kb)
 {
@@ -724,39 +1399,20 @@ _mongocrypt_key_broker_kms_done (_mongocrypt_key_broker_t *kb)
    }
 
    if (kb->state == KB_AUTHENTICATING) {
-      bson_t oauth_response;
-      _mongocrypt_buffer_t oauth_response_buf;
-
-      if (kb->auth_request_azure.initialized) {
-         if (!_mongocrypt_kms_ctx_result (&kb->auth_request_azure.kms,
-                                          &oauth_response_buf)) {
-            mongocrypt_kms_ctx_status (&kb->auth_request_azure.kms, kb->status);
-            return _key_broker_fail (kb);
-         }
-
-         /* Cache returned tokens. */
-         BSON_ASSERT (
-            _mongocrypt_buffer_to_bson (&oauth_response_buf, &oauth_response));
-         if (!_mongocrypt_cache_oauth_add (
-                kb->crypt->cache_oauth_azure, &oauth_response, kb->status)) {
-            return false;
-         }
+      bool cached;
+
+      cached = _cache_oauth_tokens (kb);
+      /* Wake the contexts waiting for the tokens, even if none was cached.
+       * They then request their own. */
+      if (kb->owns_oauth_fetch) {
+         _mongocrypt_cache_oauth_release_fetch (kb->crypt->cache_oauth_azure,
+                                                kb);
+         _mongocrypt_cache_oauth_release_fetch (kb->crypt->cache_oauth_gcp,
+                                                kb);
+         kb->owns_oauth_fetch = false;
       }
-
-      if (kb->auth_request_gcp.initialized) {
-         if (!_mongocrypt_kms_ctx_result (&kb->auth_request_gcp.kms,
-                                          &oauth_response_buf)) {
-            mongocrypt_kms_ctx_status (&kb->auth_request_gcp.kms, kb->status);
-            return _key_broker_fail (kb);
-         }
-
-         /* Cache returned tokens. */
-         BSON_ASSERT (
-            _mongocrypt_buffer_to_bson (&oauth_response_buf, &oauth_response));
-         if (!_mongocrypt_cache_oauth_add (
-                kb->crypt->cache_oauth_gcp, &oauth_response, kb->status)) {
-            return false;
-         }
+      if (!cached) {
+         return false;
       }
 
       /* Auth should be finished, create any remaining KMS requests. */
@@ -820,7 +1476,7 @@ _mongocrypt_key_broker_kms_done (_mongocrypt_key_broker_t *kb)
          }
       }
 
-      kb->state = KB_DECRYPTING_KEY_MATERIAL;
+      _key_broker_set_state (kb, KB_DECRYPTING_KEY_MATERIAL);
       return true;
    }
 
@@ -862,63 +1518,153 @@ _mongocrypt_key_broker_kms_done (_mongocrypt_key_broker_t *kb)
       }
    }
 
-   kb->state = KB_DONE;
+   _key_broker_set_state (kb, KB_DONE);
    return true;
 }
 
 
-bool
-_get_decrypted_key_material (_mongocrypt_key_broker_t *kb,
-                             _mongocrypt_buffer_t *key_id,
-                             _mongocrypt_key_alt_name_t *key_alt_name,
-                             _mongocrypt_buffer_t *out,
-                             _mongocrypt_buffer_t *key_id_out)
+/* Find a decrypted key by id or name. Returns NULL and fails the key broker
+ * if there is none. */
+static key_returned_t *
+_find_decrypted_key (_mongocrypt_key_broker_t *kb,
+                     const _mongocrypt_buffer_t *key_id,
+                     _mongocrypt_key_alt_name_t *key_alt_name)
 {
    key_returned_t *key_returned;
 
-   _mongocrypt_buffer_init (out);
-   if (key_id_out) {
-      _mongocrypt_buffer_init (key_id_out);
+   if (kb->state != KB_DONE) {
+      _key_broker_fail_w_msg (
+         kb, "attempting retrieve decrypted key material, but in wrong state");
+      return NULL;
    }
-   /* Search both keys_returned and keys_cached. */
 
+   /* Search both keys_returned and keys_cached. */
    key_returned =
-      _key_returned_find_one (kb->keys_returned, key_id, key_alt_name);
+      _key_index_find_one (&kb->keys_returned_index, key_id, key_alt_name);
    if (!key_returned) {
       /* Try the keys retrieved from the cache. */
       key_returned =
-         _key_returned_find_one (kb->keys_cached, key_id, key_alt_name);
+         _key_index_find_one (&kb->keys_cached_index, key_id, key_alt_name);
    }
 
    if (!key_returned) {
-      return _key_broker_fail_w_msg (kb, "could not find key");
+      _key_broker_fail_w_msg (kb, "could not find key");
+      return NULL;
    }
 
    if (!key_returned->decrypted) {
-      return _key_broker_fail_w_msg (kb, "unexpected, key not decrypted");
+      _key_broker_fail_w_msg (kb, "unexpected, key not decrypted");
+      return NULL;
+   }
+   return key_returned;
+}
+
+static _native_crypto_key_t *
+_native_key (_mongocrypt_key_broker_t *kb, key_returned_t *key_returned)
+{
+   if (!_mongocrypt_crypto_is_native (
+          kb->crypt->crypto,
+          MONGOCRYPT_CRYPTO_PRIMITIVE_AES_256_CBC |
+             MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512) ||
+       kb->concurrent) {
+      return NULL;
+   }
+   /* Prepare once, so repeated use of a key skips the cipher and MAC
+    * setup. */
+   if (!key_returned->native_key_prepared) {
+      key_returned->native_key =
+         _native_crypto_key_new (&key_returned->decrypted_key_material);
+      key_returned->native_key_prepared = true;
+   }
+   return key_returned->native_key;
+}
+
+static bool
+_get_decrypted_key_material (_mongocrypt_key_broker_t *kb,
+                             const _mongocrypt_buffer_t *key_id,
+                             _mongocrypt_key_alt_name_t *key_alt_name,
+                             _mongocrypt_buffer_t *out,
+                             _mongocrypt_buffer_t *key_id_out,
+                             _native_crypto_key_t **native_key_out)
+{
+   key_returned_t *key_returned;
+
+   _mongocrypt_buffer_init (out);
+   if (key_id_out) {
+      _mongocrypt_buffer_init (key_id_out);
+   }
+   if (native_key_out) {
+      *native_key_out = NULL;
+   }
+
+   key_returned = _find_decrypted_key (kb, key_id, key_alt_name);
+   if (!key_returned) {
+      return false;
    }
 
    _mongocrypt_buffer_copy_to (&key_returned->decrypted_key_material, out);
    if (key_id_out) {
       _mongocrypt_buffer_copy_to (&key_returned->doc->id, key_id_out);
    }
+   if (native_key_out) {
+      *native_key_out = _native_key (kb, key_returned);
+   }
    return true;
 }
 
 bool
-_mongocrypt_key_broker_decrypted_key_by_id (_mongocrypt_key_broker_t *kb,
-                                            const _mongocrypt_buffer_t *key_id,
-                                            _mongocrypt_buffer_t *out)
+_mongocrypt_key_broker_decrypted_key_by_id (
+   _mongocrypt_key_broker_t *kb,
+   const _mongocrypt_buffer_t *key_id,
+   _mongocrypt_buffer_t *out,
+   _native_crypto_key_t **native_key_out)
 {
-   if (kb->state != KB_DONE) {
-      return _key_broker_fail_w_msg (
-         kb, "attempting retrieve decrypted key material, but in wrong state");
+   return _get_decrypted_key_material (
+      kb, key_id, NULL /* key alt name */, out, NULL, native_key_out);
+}
+
+bool
+_mongocrypt_key_broker_borrow_decrypted_key (
+   _mongocrypt_key_broker_t *kb,
+   const _mongocrypt_buffer_t *key_id,
+   const _mongocrypt_buffer_t **out,
+   _native_crypto_key_t **native_key_out)
+{
+   key_returned_t *key_returned = NULL;
+   key_returned_t **recent = NULL;
+
+   *out = NULL;
+   if (native_key_out) {
+      *native_key_out = NULL;
+   }
+
+   /* The recent keys are not locked, so they are bypassed when lookups may
+    * be concurrent. Key ids are random UUIDs, so the last byte picks a slot
+    * as well as a hash would. */
+   if (!kb->concurrent && kb->state == KB_DONE && key_id->len > 0) {
+      recent = &kb->recent_keys[key_id->data[key_id->len - 1] %
+                                KB_RECENT_KEYS];
+      if (*recent &&
+          0 == _mongocrypt_buffer_cmp (&(*recent)->doc->id, key_id)) {
+         key_returned = *recent;
+      }
+   }
+
+   if (!key_returned) {
+      key_returned = _find_decrypted_key (kb, key_id, NULL);
+      if (!key_returned) {
+         return false;
+      }
+      if (recent) {
+         *recent = key_returned;
+      }
    }
-   return _get_decrypted_key_material (kb,
-                                       (_mongocrypt_buffer_t *) key_id,
-                                       NULL /* key alt name */,
-                                       out,
-                                       NULL /* key id out */);
+
+   *out = &key_returned->decrypted_key_material;
+   if (native_key_out) {
+      *native_key_out = _native_key (kb, key_returned);
+   }
+   return true;
 }
 
 bool
@@ -926,18 +1672,15 @@ _mongocrypt_key_broker_decrypted_key_by_name (
    _mongocrypt_key_broker_t *kb,
    const bson_value_t *key_alt_name_value,
    _mongocrypt_buffer_t *out,
-   _mongocrypt_buffer_t *key_id_out)
+   _mongocrypt_buffer_t *key_id_out,
+   _native_crypto_key_t **native_key_out)
 {
    bool ret;
    _mongocrypt_key_alt_name_t *key_alt_name;
 
-   if (kb->state != KB_DONE) {
-      return _key_broker_fail_w_msg (
-         kb, "attempting retrieve decrypted key material, but in wrong state");
-   }
-
    key_alt_name = _mongocrypt_key_alt_name_new (key_alt_name_value);
-   ret = _get_decrypted_key_material (kb, NULL, key_alt_name, out, key_id_out);
+   ret = _get_decrypted_key_material (
+      kb, NULL, key_alt_name, out, key_id_out, native_key_out);
    _mongocrypt_key_alt_name_destroy_all (key_alt_name);
    return ret;
 }
@@ -957,8 +1700,9 @@ _mongocrypt_key_broker_status (_mongocrypt_key_broker_t *kb,
 }
 
 
+/* Clean up the requests of @head, and keep them as spares. */
 static void
-_destroy_key_requests (key_request_t *head)
+_release_key_requests (_mongocrypt_key_broker_t *kb, key_request_t *head)
 {
    key_request_t *tmp;
 
@@ -968,41 +1712,144 @@ _destroy_key_requests (key_request_t *head)
       _mongocrypt_buffer_cleanup (&head->id);
       _mongocrypt_key_alt_name_destroy_all (head->alt_name);
 
-      bson_free (head);
+      head->next = kb->spare_requests;
+      kb->spare_requests = head;
       head = tmp;
    }
 }
 
+/* Clean up the keys of @head, and keep them as spares. */
 static void
-_destroy_keys_returned (key_returned_t *head)
+_release_keys_returned (_mongocrypt_key_broker_t *kb, key_returned_t *head)
 {
    key_returned_t *tmp;
 
    while (head) {
       tmp = head->next;
 
-      _mongocrypt_key_destroy (head->doc);
-      _mongocrypt_buffer_cleanup (&head->decrypted_key_material);
+      if (head->cached) {
+         _mongocrypt_cache_key_value_destroy (head->cached);
+      } else {
+         _mongocrypt_key_destroy (head->doc);
+         _mongocrypt_buffer_cleanup (&head->decrypted_key_material);
+      }
+      _native_crypto_key_destroy (head->native_key);
       _mongocrypt_kms_ctx_cleanup (&head->kms);
 
-      bson_free (head);
+      head->next = kb->spare_keys;
+      kb->spare_keys = head;
       head = tmp;
    }
 }
 
-void
-_mongocrypt_key_broker_cleanup (_mongocrypt_key_broker_t *kb)
+/* Add the decrypted keys of @head, and their prepared native keys, to the
+ * decrypt session. */
+static void
+_add_keys_to_session (_mongocrypt_key_broker_t *kb, key_returned_t *head)
 {
-   mongocrypt_status_destroy (kb->status);
+   _mongocrypt_cache_key_value_t *value;
+
+   for (; head; head = head->next) {
+      if (!head->decrypted) {
+         continue;
+      }
+      if (head->cached) {
+         value = _mongocrypt_cache_key_value_ref (head->cached);
+      } else {
+         value = _mongocrypt_cache_key_value_new (
+            head->doc, &head->decrypted_key_material);
+      }
+      _mongocrypt_decrypt_session_add (kb->session,
+                                       value,
+                                       head->native_key,
+                                       head->native_key_prepared,
+                                       kb->session_invalidations);
+      head->native_key = NULL;
+   }
+}
+
+/* Release everything but the storage kept by _mongocrypt_key_broker_reset.
+ */
+static void
+_key_broker_release (_mongocrypt_key_broker_t *kb)
+{
+   /* End the span of a state that was never left. */
+   _key_broker_set_state (kb, KB_DONE);
+   /* Wake contexts waiting on fetches this one did not finish. */
+   if (kb->owns_fetches) {
+      _mongocrypt_key_fetches_release (&kb->crypt->key_fetches, kb, NULL);
+   }
+   if (kb->owns_oauth_fetch) {
+      _mongocrypt_cache_oauth_release_fetch (kb->crypt->cache_oauth_azure, kb);
+      _mongocrypt_cache_oauth_release_fetch (kb->crypt->cache_oauth_gcp, kb);
+   }
    _mongocrypt_buffer_cleanup (&kb->filter);
-   /* Delete all linked lists */
-   _destroy_keys_returned (kb->keys_returned);
-   _destroy_keys_returned (kb->keys_cached);
-   _destroy_key_requests (kb->key_requests);
+   if (kb->session) {
+      _add_keys_to_session (kb, kb->keys_returned);
+      _add_keys_to_session (kb, kb->keys_cached);
+   }
+   _release_keys_returned (kb, kb->keys_returned);
+   _release_keys_returned (kb, kb->keys_cached);
+   _native_crypto_key_destroy (kb->local_kek);
+   _release_key_requests (kb, kb->key_requests);
+   _key_index_clear (&kb->keys_returned_index);
+   _key_index_clear (&kb->keys_cached_index);
+   _key_index_clear (&kb->key_requests_index);
    _mongocrypt_kms_ctx_cleanup (&kb->auth_request_azure.kms);
    _mongocrypt_kms_ctx_cleanup (&kb->auth_request_gcp.kms);
 }
 
+void
+_mongocrypt_key_broker_reset (_mongocrypt_key_broker_t *kb)
+{
+   _mongocrypt_key_broker_t kept;
+
+   _key_broker_release (kb);
+
+   memset (&kept, 0, sizeof (kept));
+   kept.crypt = kb->crypt;
+   kept.state = KB_REQUESTING;
+   kept.status = kb->status;
+   kept.projection = kb->projection;
+   kept.filter_doc = kb->filter_doc;
+   kept.filter_ids = kb->filter_ids;
+   kept.filter_names = kb->filter_names;
+   kept.key_requests_index = kb->key_requests_index;
+   kept.keys_returned_index = kb->keys_returned_index;
+   kept.keys_cached_index = kb->keys_cached_index;
+   kept.spare_requests = kb->spare_requests;
+   kept.spare_keys = kb->spare_keys;
+   memcpy (kb, &kept, sizeof (kept));
+   if (kb->status) {
+      _mongocrypt_status_reset (kb->status);
+   }
+}
+
+void
+_mongocrypt_key_broker_cleanup (_mongocrypt_key_broker_t *kb)
+{
+   key_request_t *req;
+   key_returned_t *key_returned;
+
+   _key_broker_release (kb);
+   mongocrypt_status_destroy (kb->status);
+   _mongocrypt_buffer_cleanup (&kb->projection);
+   bson_destroy (kb->filter_doc);
+   bson_destroy (kb->filter_ids);
+   bson_destroy (kb->filter_names);
+   while ((req = kb->spare_requests)) {
+      kb->spare_requests = req->next;
+      bson_free (req);
+   }
+   while ((key_returned = kb->spare_keys)) {
+      kb->spare_keys = key_returned->next;
+      bson_free (key_returned);
+   }
+   _key_index_cleanup (&kb->keys_returned_index);
+   _key_index_cleanup (&kb->keys_cached_index);
+   _key_index_cleanup (&kb->key_requests_index);
+}
+
 void
 _mongocrypt_key_broker_add_test_key (_mongocrypt_key_broker_t *kb,
                                      const _mongocrypt_buffer_t *key_id)
@@ -1014,7 +1861,8 @@ _mongocrypt_key_broker_add_test_key (_mongocrypt_key_broker_t *kb,
    key_doc = _mongocrypt_key_new ();
    _mongocrypt_buffer_copy_to (key_id, &key_doc->id);
 
-   key_returned = _key_returned_prepend (kb, &kb->keys_returned, key_doc);
+   key_returned = _key_returned_prepend (
+      kb, &kb->keys_returned, &kb->keys_returned_index, key_doc);
    key_returned->decrypted = true;
    _mongocrypt_buffer_init (&key_returned->decrypted_key_material);
    _mongocrypt_buffer_resize (&key_returned->decrypted_key_material,
@@ -1022,5 +1870,5 @@ _mongocrypt_key_broker_add_test_key (_mongocrypt_key_broker_t *kb,
    memset (key_returned->decrypted_key_material.data, 0, MONGOCRYPT_KEY_LEN);
    _mongocrypt_key_destroy (key_doc);
    /* Hijack state and move directly to DONE. */
-   kb->state = KB_DONE;
+   _key_broker_set_state (kb, KB_DONE);
 }
\ No newline at end of file
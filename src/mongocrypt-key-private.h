@@ -25,6 +25,8 @@
 typedef struct __mongocrypt_key_alt_name_t {
    struct __mongocrypt_key_alt_name_t *next;
    bson_value_t value;
+   /* Hash of the string, set by the constructors. Compared before it. */
+   uint32_t hash;
 } _mongocrypt_key_alt_name_t;
 
 typedef struct {
@@ -70,6 +72,13 @@ void
 _mongocrypt_key_doc_copy_to (_mongocrypt_key_doc_t *src,
                              _mongocrypt_key_doc_t *dst);
 
+/* Like _mongocrypt_key_doc_copy_to, but for a key cache entry, which already
+ * has the decrypted key material. Only the _id, keyAltNames, and original
+ * BSON are copied. The encrypted key material and the masterKey are not. */
+void
+_mongocrypt_key_doc_copy_minimal_to (_mongocrypt_key_doc_t *src,
+                                     _mongocrypt_key_doc_t *dst);
+
 void
 _mongocrypt_key_destroy (_mongocrypt_key_doc_t *key);
 
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef MONGOCRYPT_KEY_SLAB_PRIVATE_H
+#define MONGOCRYPT_KEY_SLAB_PRIVATE_H
+
+#include <bson/bson.h>
+
+/* A process-wide allocator for decrypted key material. Slots of
+ * MONGOCRYPT_KEY_LEN bytes are packed into pages that are locked into RAM
+ * when the OS allows it, so keys are never written to swap. A slot is zeroed
+ * before it is reused or its page is unmapped. Thread safe. */
+
+/* Returns a zeroed slot of MONGOCRYPT_KEY_LEN bytes. Aborts if no memory can
+ * be mapped. */
+uint8_t *
+_mongocrypt_key_slab_alloc (void);
+
+/* Zero and release a slot from _mongocrypt_key_slab_alloc. NULL is ignored.
+ */
+void
+_mongocrypt_key_slab_free (uint8_t *slot);
+
+/* Counts for tests. */
+typedef struct {
+   int64_t slots;
+   int64_t pages;
+   int64_t locked_pages;
+} _mongocrypt_key_slab_stats_t;
+
+void
+_mongocrypt_key_slab_stats (_mongocrypt_key_slab_stats_t *out);
+
+/* Called once from _mongocrypt_do_init. */
+void
+_mongocrypt_key_slab_init (void);
+
+/* Called in the child of a fork, before any other thread is started. Makes
+ * the slab usable again and locks its pages into RAM again. Only the first
+ * call in a process does anything. */
+void
+_mongocrypt_key_slab_after_fork (void);
+
+#endif /* MONGOCRYPT_KEY_SLAB_PRIVATE_H */
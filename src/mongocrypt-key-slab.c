@@ -0,0 +1,246 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "mongocrypt-crypto-private.h"
+#include "mongocrypt-key-slab-private.h"
+#include "mongocrypt-mutex-private.h"
+#include "mongocrypt-os-private.h"
+#include "mongocrypt-private.h"
+
+#define SLAB_PAGE_LEN 4096
+/* The page header takes the first cache line, and the slots the rest. */
+#define SLAB_HEADER_LEN 64
+#define SLAB_SLOTS ((SLAB_PAGE_LEN - SLAB_HEADER_LEN) / MONGOCRYPT_KEY_LEN)
+#define SLAB_ALL_FREE ((UINT64_C (1) << SLAB_SLOTS) - 1)
+
+typedef struct _slab_page_t {
+   /* Links in the list of pages with a free slot. */
+   struct _slab_page_t *prev;
+   struct _slab_page_t *next;
+   /* Links in the list of all pages. */
+   struct _slab_page_t *all_prev;
+   struct _slab_page_t *all_next;
+   /* Bit i is set if slot i is free. */
+   uint64_t free_mask;
+   bool locked;
+} slab_page_t;
+
+BSON_STATIC_ASSERT (sizeof (slab_page_t) <= SLAB_HEADER_LEN);
+BSON_STATIC_ASSERT (SLAB_SLOTS < 64);
+
+static struct {
+   mongocrypt_mutex_t mutex;
+   /* Pages with a free slot. */
+   slab_page_t *partial;
+   slab_page_t *all;
+   _mongocrypt_key_slab_stats_t stats;
+   /* The process the pages were locked in. */
+   int64_t pid;
+} _slab;
+
+
+void
+_mongocrypt_key_slab_init (void)
+{
+   _mongocrypt_mutex_init (&_slab.mutex);
+   _slab.pid = _mongocrypt_getpid ();
+}
+
+
+void
+_mongocrypt_key_slab_after_fork (void)
+{
+   slab_page_t *page;
+
+   BSON_ASSERT (0 == _mongocrypt_once (_mongocrypt_do_init));
+
+   /* Every mongocrypt_t of the child calls this. Only the first does the
+    * work. */
+   if (_slab.pid == _mongocrypt_getpid ()) {
+      return;
+   }
+   _slab.pid = _mongocrypt_getpid ();
+   _mongocrypt_mutex_init (&_slab.mutex);
+   for (page = _slab.all; page; page = page->all_next) {
+      if (page->locked && !_mongocrypt_os_relock (page, SLAB_PAGE_LEN)) {
+         page->locked = false;
+         _slab.stats.locked_pages--;
+      }
+   }
+}
+
+
+static uint32_t
+_lowest_bit (uint64_t mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+   return (uint32_t) __builtin_ctzll (mask);
+#else
+   uint32_t i = 0;
+
+   while (!(mask & 1)) {
+      mask >>= 1;
+      i++;
+   }
+   return i;
+#endif
+}
+
+
+/* Zero through a volatile pointer so the stores are not optimized away. */
+static void
+_secure_zero (uint8_t *ptr, size_t len)
+{
+   volatile uint8_t *p = ptr;
+
+   while (len--) {
+      *p++ = 0;
+   }
+}
+
+
+static void
+_link (slab_page_t *page)
+{
+   page->prev = NULL;
+   page->next = _slab.partial;
+   if (_slab.partial) {
+      _slab.partial->prev = page;
+   }
+   _slab.partial = page;
+}
+
+
+static void
+_unlink (slab_page_t *page)
+{
+   if (page->prev) {
+      page->prev->next = page->next;
+   } else {
+      _slab.partial = page->next;
+   }
+   if (page->next) {
+      page->next->prev = page->prev;
+   }
+   page->prev = NULL;
+   page->next = NULL;
+}
+
+
+uint8_t *
+_mongocrypt_key_slab_alloc (void)
+{
+   slab_page_t *page;
+   uint32_t i;
+
+   /* Key values may be created before any mongocrypt_t. */
+   BSON_ASSERT (0 == _mongocrypt_once (_mongocrypt_do_init));
+
+   _mongocrypt_mutex_lock (&_slab.mutex);
+   page = _slab.partial;
+   if (!page) {
+      bool locked;
+
+      page = _mongocrypt_os_map_locked (SLAB_PAGE_LEN, &locked);
+      BSON_ASSERT (page);
+      BSON_ASSERT (0 == ((uintptr_t) page & (SLAB_PAGE_LEN - 1)));
+      page->free_mask = SLAB_ALL_FREE;
+      page->locked = locked;
+      _link (page);
+      page->all_next = _slab.all;
+      if (_slab.all) {
+         _slab.all->all_prev = page;
+      }
+      _slab.all = page;
+      _slab.stats.pages++;
+      if (locked) {
+         _slab.stats.locked_pages++;
+      }
+   }
+   i = _lowest_bit (page->free_mask);
+   page->free_mask &= ~(UINT64_C (1) << i);
+   if (!page->free_mask) {
+      _unlink (page);
+   }
+   _slab.stats.slots++;
+   _mongocrypt_mutex_unlock (&_slab.mutex);
+
+   return (uint8_t *) page + SLAB_HEADER_LEN + i * MONGOCRYPT_KEY_LEN;
+}
+
+
+void
+_mongocrypt_key_slab_free (uint8_t *slot)
+{
+   slab_page_t *page;
+   uint64_t bit;
+   size_t offset;
+   bool unmap = false;
+
+   if (!slot) {
+      return;
+   }
+
+   page = (slab_page_t *) ((uintptr_t) slot & ~(uintptr_t) (SLAB_PAGE_LEN - 1));
+   offset = (size_t) (slot - (uint8_t *) page);
+   BSON_ASSERT (offset >= SLAB_HEADER_LEN);
+   BSON_ASSERT ((offset - SLAB_HEADER_LEN) % MONGOCRYPT_KEY_LEN == 0);
+   bit = UINT64_C (1) << ((offset - SLAB_HEADER_LEN) / MONGOCRYPT_KEY_LEN);
+   _secure_zero (slot, MONGOCRYPT_KEY_LEN);
+
+   _mongocrypt_mutex_lock (&_slab.mutex);
+   BSON_ASSERT (!(page->free_mask & bit));
+   if (!page->free_mask) {
+      _link (page);
+   }
+   page->free_mask |= bit;
+   _slab.stats.slots--;
+   /* Keep the last page with free slots even if it is empty, so a key that is
+    * cached and evicted in turn does not map and lock a page each time. */
+   if (page->free_mask == SLAB_ALL_FREE && (page->prev || page->next)) {
+      _unlink (page);
+      if (page->all_prev) {
+         page->all_prev->all_next = page->all_next;
+      } else {
+         _slab.all = page->all_next;
+      }
+      if (page->all_next) {
+         page->all_next->all_prev = page->all_prev;
+      }
+      _slab.stats.pages--;
+      if (page->locked) {
+         _slab.stats.locked_pages--;
+      }
+      unmap = true;
+   }
+   _mongocrypt_mutex_unlock (&_slab.mutex);
+
+   if (unmap) {
+      _mongocrypt_os_unmap_locked (page, SLAB_PAGE_LEN, page->locked);
+   }
+}
+
+
+void
+_mongocrypt_key_slab_stats (_mongocrypt_key_slab_stats_t *out)
+{
+   BSON_ASSERT (0 == _mongocrypt_once (_mongocrypt_do_init));
+
+   _mongocrypt_mutex_lock (&_slab.mutex);
+   *out = _slab.stats;
+   _mongocrypt_mutex_unlock (&_slab.mutex);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_KEY_VAULT_SNAPSHOT_PRIVATE_H
+#define MONGOCRYPT_KEY_VAULT_SNAPSHOT_PRIVATE_H
+
+#include "mongocrypt-buffer-private.h"
+#include "mongocrypt-status-private.h"
+
+/* The key vault snapshot set with mongocrypt_setopt_key_vault_snapshot: key
+ * documents laid end to end, as in a mongodump of the key vault collection.
+ * mongocrypt_init indexes it into a hash table from _id and keyAltName to
+ * key document. Entries point into the snapshot, which must outlive the
+ * table. */
+typedef struct __mongocrypt_key_vault_snapshot_entry_t {
+   uint32_t hash;
+   /* Exactly one of id or name is set. */
+   _mongocrypt_buffer_t id;
+   const char *name;
+   /* Not owned. */
+   _mongocrypt_buffer_t doc;
+   struct __mongocrypt_key_vault_snapshot_entry_t *next;
+} _mongocrypt_key_vault_snapshot_entry_t;
+
+typedef struct {
+   _mongocrypt_key_vault_snapshot_entry_t *entries;
+   uint32_t num_entries;
+   _mongocrypt_key_vault_snapshot_entry_t **buckets;
+   uint32_t num_buckets;
+   /* The number of key documents. */
+   uint32_t num_keys;
+} _mongocrypt_key_vault_snapshot_t;
+
+void
+_mongocrypt_key_vault_snapshot_init (_mongocrypt_key_vault_snapshot_t *snap);
+
+/* Index the key documents of @snapshot. Each must have a UUID _id. If an _id
+ * or keyAltName is repeated, the first key document is used. Key documents
+ * are otherwise validated when they are used. */
+bool
+_mongocrypt_key_vault_snapshot_load (_mongocrypt_key_vault_snapshot_t *snap,
+                                     const _mongocrypt_buffer_t *snapshot,
+                                     mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Returns the key document with _id @id, or NULL. */
+const _mongocrypt_buffer_t *
+_mongocrypt_key_vault_snapshot_find_id (
+   const _mongocrypt_key_vault_snapshot_t *snap,
+   const _mongocrypt_buffer_t *id);
+
+/* Returns the key document with the keyAltName @name, or NULL. */
+const _mongocrypt_buffer_t *
+_mongocrypt_key_vault_snapshot_find_name (
+   const _mongocrypt_key_vault_snapshot_t *snap, const char *name);
+
+void
+_mongocrypt_key_vault_snapshot_cleanup (_mongocrypt_key_vault_snapshot_t *snap);
+
+#endif /* MONGOCRYPT_KEY_VAULT_SNAPSHOT_PRIVATE_H */
@@ -0,0 +1,224 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-private.h"
+#include "mongocrypt-cache-private.h"
+#include "mongocrypt-key-vault-snapshot-private.h"
+
+
+void
+_mongocrypt_key_vault_snapshot_init (_mongocrypt_key_vault_snapshot_t *snap)
+{
+   memset (snap, 0, sizeof (*snap));
+}
+
+
+static uint32_t
+_hash_id (const _mongocrypt_buffer_t *id)
+{
+   return _mongocrypt_cache_hash_bytes (id->data, id->len);
+}
+
+
+static uint32_t
+_hash_name (const char *name)
+{
+   return _mongocrypt_cache_hash_bytes (name, strlen (name));
+}
+
+
+static const _mongocrypt_key_vault_snapshot_entry_t *
+_lookup (const _mongocrypt_key_vault_snapshot_t *snap,
+         const _mongocrypt_buffer_t *id,
+         const char *name)
+{
+   const _mongocrypt_key_vault_snapshot_entry_t *entry;
+   uint32_t hash;
+
+   if (!snap->num_buckets) {
+      return NULL;
+   }
+
+   hash = id ? _hash_id (id) : _hash_name (name);
+   for (entry = snap->buckets[hash & (snap->num_buckets - 1)]; entry;
+        entry = entry->next) {
+      if (entry->hash != hash) {
+         continue;
+      }
+      if (id ? (entry->name == NULL &&
+                0 == _mongocrypt_buffer_cmp (&entry->id, id))
+             : (entry->name != NULL && 0 == strcmp (entry->name, name))) {
+         return entry;
+      }
+   }
+   return NULL;
+}
+
+
+/* Add an entry for @id or @name unless one exists. */
+static void
+_insert (_mongocrypt_key_vault_snapshot_t *snap,
+         const _mongocrypt_buffer_t *id,
+         const char *name,
+         const bson_t *doc)
+{
+   _mongocrypt_key_vault_snapshot_entry_t *entry, **bucket;
+
+   if (_lookup (snap, id, name)) {
+      return;
+   }
+
+   entry = &snap->entries[snap->num_entries++];
+   if (id) {
+      entry->id = *id;
+      entry->hash = _hash_id (id);
+   } else {
+      entry->name = name;
+      entry->hash = _hash_name (name);
+   }
+   _mongocrypt_buffer_from_bson (&entry->doc, doc);
+   bucket = &snap->buckets[entry->hash & (snap->num_buckets - 1)];
+   entry->next = *bucket;
+   *bucket = entry;
+}
+
+
+/* Parse the key document at @offset, and advance @offset past it. Sets @id
+ * to view its _id. */
+static bool
+_next_key (const _mongocrypt_buffer_t *snapshot,
+           uint32_t *offset,
+           bson_t *doc,
+           _mongocrypt_buffer_t *id,
+           mongocrypt_status_t *status)
+{
+   bson_iter_t iter;
+   uint32_t len;
+
+   if (snapshot->len - *offset < 5u) {
+      CLIENT_ERR ("truncated key vault snapshot");
+      return false;
+   }
+   memcpy (&len, snapshot->data + *offset, sizeof (len));
+   len = BSON_UINT32_FROM_LE (len);
+   if (len < 5u || len > snapshot->len - *offset) {
+      CLIENT_ERR ("truncated key vault snapshot");
+      return false;
+   }
+   if (!bson_init_static (doc, snapshot->data + *offset, len)) {
+      CLIENT_ERR ("malformed key document in key vault snapshot");
+      return false;
+   }
+   *offset += len;
+
+   if (!bson_iter_init_find (&iter, doc, "_id") ||
+       !_mongocrypt_buffer_from_uuid_iter (id, &iter)) {
+      CLIENT_ERR ("key document in key vault snapshot has no UUID _id");
+      return false;
+   }
+   return true;
+}
+
+
+bool
+_mongocrypt_key_vault_snapshot_load (_mongocrypt_key_vault_snapshot_t *snap,
+                                     const _mongocrypt_buffer_t *snapshot,
+                                     mongocrypt_status_t *status)
+{
+   bson_t doc;
+   bson_iter_t iter, names;
+   _mongocrypt_buffer_t id;
+   uint32_t offset, count = 0;
+
+   _mongocrypt_key_vault_snapshot_cleanup (snap);
+   if (_mongocrypt_buffer_empty (snapshot)) {
+      return true;
+   }
+
+   /* Count the entries first, so entries is never reallocated. */
+   for (offset = 0; offset < snapshot->len;) {
+      if (!_next_key (snapshot, &offset, &doc, &id, status)) {
+         return false;
+      }
+      snap->num_keys++;
+      count++;
+      if (bson_iter_init_find (&iter, &doc, "keyAltNames") &&
+          BSON_ITER_HOLDS_ARRAY (&iter) && bson_iter_recurse (&iter, &names)) {
+         while (bson_iter_next (&names)) {
+            count++;
+         }
+      }
+   }
+
+   /* Use a power of two number of buckets, at least one per entry. */
+   snap->num_buckets = 1;
+   while (snap->num_buckets < count) {
+      snap->num_buckets *= 2;
+   }
+   snap->buckets = bson_malloc0 (snap->num_buckets * sizeof (*snap->buckets));
+   BSON_ASSERT (snap->buckets);
+   snap->entries = bson_malloc0 (count * sizeof (*snap->entries));
+   BSON_ASSERT (snap->entries);
+
+   for (offset = 0; offset < snapshot->len;) {
+      BSON_ASSERT (_next_key (snapshot, &offset, &doc, &id, status));
+      _insert (snap, &id, NULL, &doc);
+      if (!bson_iter_init_find (&iter, &doc, "keyAltNames") ||
+          !BSON_ITER_HOLDS_ARRAY (&iter) ||
+          !bson_iter_recurse (&iter, &names)) {
+         continue;
+      }
+      while (bson_iter_next (&names)) {
+         /* Other types are rejected when the key document is parsed. */
+         if (BSON_ITER_HOLDS_UTF8 (&names)) {
+            _insert (snap, NULL, bson_iter_utf8 (&names, NULL), &doc);
+         }
+      }
+   }
+   return true;
+}
+
+
+const _mongocrypt_buffer_t *
+_mongocrypt_key_vault_snapshot_find_id (
+   const _mongocrypt_key_vault_snapshot_t *snap,
+   const _mongocrypt_buffer_t *id)
+{
+   const _mongocrypt_key_vault_snapshot_entry_t *entry;
+
+   entry = _lookup (snap, id, NULL);
+   return entry ? &entry->doc : NULL;
+}
+
+
+const _mongocrypt_buffer_t *
+_mongocrypt_key_vault_snapshot_find_name (
+   const _mongocrypt_key_vault_snapshot_t *snap, const char *name)
+{
+   const _mongocrypt_key_vault_snapshot_entry_t *entry;
+
+   entry = _lookup (snap, NULL, name);
+   return entry ? &entry->doc : NULL;
+}
+
+
+void
+_mongocrypt_key_vault_snapshot_cleanup (_mongocrypt_key_vault_snapshot_t *snap)
+{
+   bson_free (snap->entries);
+   bson_free (snap->buckets);
+   _mongocrypt_key_vault_snapshot_init (snap);
+}
@@ -18,6 +18,22 @@
 #include "mongocrypt-key-private.h"
 
 
+/* Lists longer than this are compared by sorting them by hash. */
+#define MAX_LINEAR_LEN 8
+
+
+static void
+_set_hash (_mongocrypt_key_alt_name_t *key_alt_name)
+{
+   const char *str;
+
+   if (key_alt_name->value.value_type != BSON_TYPE_UTF8) {
+      return;
+   }
+   str = _mongocrypt_key_alt_name_get_string (key_alt_name);
+   key_alt_name->hash = _mongocrypt_cache_hash_bytes (str, strlen (str));
+}
+
 /* Check if two single entries are equal (i.e. ignore the 'next' pointer). */
 static bool
 _one_key_alt_name_equal (_mongocrypt_key_alt_name_t *ptr_a,
@@ -25,10 +41,42 @@ _one_key_alt_name_equal (_mongocrypt_key_alt_name_t *ptr_a,
 {
    BSON_ASSERT (ptr_a->value.value_type == BSON_TYPE_UTF8);
    BSON_ASSERT (ptr_b->value.value_type == BSON_TYPE_UTF8);
-   return 0 == strcmp (_mongocrypt_key_alt_name_get_string (ptr_a),
+   return ptr_a->hash == ptr_b->hash &&
+          0 == strcmp (_mongocrypt_key_alt_name_get_string (ptr_a),
                        _mongocrypt_key_alt_name_get_string (ptr_b));
 }
 
+/* Order by hash, then by string. */
+static int
+_cmp_sorted (const void *a, const void *b)
+{
+   _mongocrypt_key_alt_name_t *ptr_a, *ptr_b;
+
+   ptr_a = *(_mongocrypt_key_alt_name_t *const *) a;
+   ptr_b = *(_mongocrypt_key_alt_name_t *const *) b;
+   if (ptr_a->hash != ptr_b->hash) {
+      return ptr_a->hash < ptr_b->hash ? -1 : 1;
+   }
+   return strcmp (_mongocrypt_key_alt_name_get_string (ptr_a),
+                  _mongocrypt_key_alt_name_get_string (ptr_b));
+}
+
+/* Returns the @len entries of @list, sorted with _cmp_sorted. */
+static _mongocrypt_key_alt_name_t **
+_sorted (_mongocrypt_key_alt_name_t *list, uint32_t len)
+{
+   _mongocrypt_key_alt_name_t **sorted;
+   uint32_t i;
+
+   sorted = bson_malloc (len * sizeof (*sorted));
+   BSON_ASSERT (sorted);
+   for (i = 0; i < len; i++, list = list->next) {
+      sorted[i] = list;
+   }
+   qsort (sorted, len, sizeof (*sorted), _cmp_sorted);
+   return sorted;
+}
+
 static bool
 _find (_mongocrypt_key_alt_name_t *list, _mongocrypt_key_alt_name_t *entry)
 {
@@ -55,13 +103,31 @@ _list_len (_mongocrypt_key_alt_name_t *list)
 static bool
 _check_unique (_mongocrypt_key_alt_name_t *list)
 {
-   for (; NULL != list; list = list->next) {
-      /* Check if we can find the current entry in the remaining. */
-      if (_find (list->next, list)) {
-         return false;
+   _mongocrypt_key_alt_name_t **sorted;
+   uint32_t len, i;
+   bool ret = true;
+
+   len = _list_len (list);
+   if (len <= MAX_LINEAR_LEN) {
+      for (; NULL != list; list = list->next) {
+         /* Check if we can find the current entry in the remaining. */
+         if (_find (list->next, list)) {
+            return false;
+         }
       }
+      return true;
    }
-   return true;
+
+   /* Duplicates are adjacent once sorted. */
+   sorted = _sorted (list, len);
+   for (i = 1; i < len; i++) {
+      if (0 == _cmp_sorted (&sorted[i - 1], &sorted[i])) {
+         ret = false;
+         break;
+      }
+   }
+   bson_free (sorted);
+   return ret;
 }
 
 static bool
@@ -335,6 +401,21 @@ _mongocrypt_key_doc_copy_to (_mongocrypt_key_doc_t *src,
    _mongocrypt_kek_copy_to (&src->kek, &dst->kek);
 }
 
+
+void
+_mongocrypt_key_doc_copy_minimal_to (_mongocrypt_key_doc_t *src,
+                                     _mongocrypt_key_doc_t *dst)
+{
+   BSON_ASSERT (src);
+   BSON_ASSERT (dst);
+
+   _mongocrypt_buffer_copy_to (&src->id, &dst->id);
+   dst->key_alt_names = _mongocrypt_key_alt_name_copy_all (src->key_alt_names);
+   /* Kept to wrap the entry for a cache backend or export. */
+   bson_destroy (&dst->bson);
+   bson_copy_to (&src->bson, &dst->bson);
+}
+
 _mongocrypt_key_alt_name_t *
 _mongocrypt_key_alt_name_copy_all (_mongocrypt_key_alt_name_t *ptr)
 {
@@ -346,6 +427,7 @@ _mongocrypt_key_alt_name_copy_all (_mongocrypt_key_alt_name_t *ptr)
       BSON_ASSERT (copied);
 
       bson_value_copy (&ptr->value, &copied->value);
+      copied->hash = ptr->hash;
 
       if (!ptr_copy) {
          ptr_copy = copied;
@@ -371,16 +453,62 @@ _mongocrypt_key_alt_name_destroy_all (_mongocrypt_key_alt_name_t *ptr)
    }
 }
 
+/* Merge the sorted entries of two lists, looking for a common one. */
+static bool
+_sorted_intersect (_mongocrypt_key_alt_name_t *list_a,
+                   uint32_t len_a,
+                   _mongocrypt_key_alt_name_t *list_b,
+                   uint32_t len_b)
+{
+   _mongocrypt_key_alt_name_t **sorted_a, **sorted_b;
+   uint32_t i = 0, j = 0;
+   bool ret = false;
+
+   sorted_a = _sorted (list_a, len_a);
+   sorted_b = _sorted (list_b, len_b);
+   while (i < len_a && j < len_b) {
+      int cmp = _cmp_sorted (&sorted_a[i], &sorted_b[j]);
+
+      if (cmp == 0) {
+         ret = true;
+         break;
+      }
+      if (cmp < 0) {
+         i++;
+      } else {
+         j++;
+      }
+   }
+   bson_free (sorted_a);
+   bson_free (sorted_b);
+   return ret;
+}
+
 bool
 _mongocrypt_key_alt_name_intersects (_mongocrypt_key_alt_name_t *ptr_a,
                                      _mongocrypt_key_alt_name_t *ptr_b)
 {
    _mongocrypt_key_alt_name_t *orig_ptr_b = ptr_b;
+   uint32_t len_a, len_b;
+
+   if (!ptr_a || !ptr_b) {
+      return false;
+   }
+   len_a = _list_len (ptr_a);
+   len_b = _list_len (ptr_b);
+   /* Probes usually have a single name. */
+   if (len_a > MAX_LINEAR_LEN && len_b > MAX_LINEAR_LEN) {
+      return _sorted_intersect (ptr_a, len_a, ptr_b, len_b);
+   }
+   if (len_a > len_b) {
+      _mongocrypt_key_alt_name_t *tmp = ptr_a;
+
+      ptr_a = ptr_b;
+      ptr_b = orig_ptr_b = tmp;
+   }
    for (; ptr_a; ptr_a = ptr_a->next) {
-      for (ptr_b = orig_ptr_b; ptr_b; ptr_b = ptr_b->next) {
-         if (_one_key_alt_name_equal (ptr_a, ptr_b)) {
-            return true;
-         }
+      if (_find (orig_ptr_b, ptr_a)) {
+         return true;
       }
    }
    return false;
@@ -407,6 +535,7 @@ _mongocrypt_key_alt_name_create (const char *name, ...)
       curr->value.value_type = BSON_TYPE_UTF8;
       curr->value.value.v_utf8.str = bson_strdup (arg_ptr);
       curr->value.value.v_utf8.len = (uint32_t) strlen (arg_ptr);
+      _set_hash (curr);
       if (!prev) {
          head = curr;
       } else {
@@ -428,6 +557,7 @@ _mongocrypt_key_alt_name_new (const bson_value_t *value)
    BSON_ASSERT (name);
 
    bson_value_copy (value, &name->value);
+   _set_hash (name);
    return name;
 }
 
@@ -436,18 +566,37 @@ _mongocrypt_key_alt_name_unique_list_equal (_mongocrypt_key_alt_name_t *list_a,
                                             _mongocrypt_key_alt_name_t *list_b)
 {
    _mongocrypt_key_alt_name_t *ptr;
+   _mongocrypt_key_alt_name_t **sorted_a, **sorted_b;
+   uint32_t len, i;
+   bool ret = true;
 
    BSON_ASSERT (_check_unique (list_a));
    BSON_ASSERT (_check_unique (list_b));
-   if (_list_len (list_a) != _list_len (list_b)) {
+   len = _list_len (list_a);
+   if (len != _list_len (list_b)) {
       return false;
    }
-   for (ptr = list_a; NULL != ptr; ptr = ptr->next) {
-      if (!_find (list_b, ptr)) {
-         return false;
+   if (len <= MAX_LINEAR_LEN) {
+      for (ptr = list_a; NULL != ptr; ptr = ptr->next) {
+         if (!_find (list_b, ptr)) {
+            return false;
+         }
       }
+      return true;
    }
-   return true;
+
+   /* Unique lists are equal if they are equal once sorted. */
+   sorted_a = _sorted (list_a, len);
+   sorted_b = _sorted (list_b, len);
+   for (i = 0; i < len; i++) {
+      if (0 != _cmp_sorted (&sorted_a[i], &sorted_b[i])) {
+         ret = false;
+         break;
+      }
+   }
+   bson_free (sorted_a);
+   bson_free (sorted_b);
+   return ret;
 }
 
 const char *
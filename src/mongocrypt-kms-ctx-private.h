@@ -25,9 +25,93 @@
 #include "mongocrypt-opts-private.h"
 #include "kms_message/kms_message.h"
 #include "mongocrypt-crypto-private.h"
+#include "mongocrypt-kms-limiter-private.h"
+#include "mongocrypt-mutex-private.h"
+#include "mongocrypt-stats-private.h"
+#include "mongocrypt-trace-private.h"
 
 struct __mongocrypt_ctx_opts_t;
 
+/* An AWS SigV4 signing key derived for one access key, UTC date, and
+ * region. */
+typedef struct __mongocrypt_aws_signing_key_t {
+   char *access_key_id;
+   char date[sizeof "YYYYmmDD"];
+   char *region;
+   unsigned char key[32];
+   struct __mongocrypt_aws_signing_key_t *next;
+} _mongocrypt_aws_signing_key_t;
+
+/* Signing keys shared by the AWS KMS requests of a mongocrypt_t. A signing
+ * key is derived from the secret key, date, region, and service. The service
+ * is fixed, and an access key id names one secret key, so keys are found by
+ * access key id, date, and region. Keys for other access keys or dates are
+ * dropped when a new key is added. */
+typedef struct {
+   mongocrypt_mutex_t mutex;
+   _mongocrypt_aws_signing_key_t *keys;
+} _mongocrypt_aws_signing_keys_t;
+
+void
+_mongocrypt_aws_signing_keys_init (_mongocrypt_aws_signing_keys_t *keys);
+
+void
+_mongocrypt_aws_signing_keys_cleanup (_mongocrypt_aws_signing_keys_t *keys);
+
+/* A signed GCP OAuth JSON Web Token for one scope. */
+typedef struct __mongocrypt_gcp_assertion_t {
+   char *scope;
+   char *assertion;
+   /* Monotonic time after which the assertion is no longer reused. */
+   int64_t reuse_until_us;
+   struct __mongocrypt_gcp_assertion_t *next;
+} _mongocrypt_gcp_assertion_t;
+
+/* Assertions shared by the GCP OAuth requests of a mongocrypt_t. An assertion
+ * is signed with the service account private key, so assertions are found by
+ * scope and cleared when the credentials are updated. Expired assertions are
+ * dropped when a new assertion is added. */
+typedef struct {
+   mongocrypt_mutex_t mutex;
+   _mongocrypt_gcp_assertion_t *assertions;
+   /* Incremented by each clear, so an assertion signed with replaced
+    * credentials is not added. */
+   uint32_t generation;
+} _mongocrypt_gcp_assertions_t;
+
+void
+_mongocrypt_gcp_assertions_init (_mongocrypt_gcp_assertions_t *assertions);
+
+/* Drop every assertion. Call with the credentials_mutex of the crypt options
+ * held, after replacing the GCP credentials. */
+void
+_mongocrypt_gcp_assertions_clear (_mongocrypt_gcp_assertions_t *assertions);
+
+void
+_mongocrypt_gcp_assertions_cleanup (_mongocrypt_gcp_assertions_t *assertions);
+
+/* KMS request settings derived from the crypt options once, by
+ * mongocrypt_init, so creating a KMS context only fills in the per-request
+ * fields. */
+struct __mongocrypt_kms_config_t {
+   /* Shared by the requests that set no crypto hooks. kms_request_*_new only
+    * reads and copies options, so these are never modified. */
+   kms_request_opt_t *azure_opt;
+   kms_request_opt_t *gcp_opt;
+   /* The configured or default OAuth endpoints. */
+   const char *azure_auth_host;
+   const char *azure_auth_host_and_port;
+   const char *gcp_auth_host;
+   const char *gcp_auth_host_and_port;
+   char *gcp_audience;
+};
+
+_mongocrypt_kms_config_t *
+_mongocrypt_kms_config_new (const _mongocrypt_opts_t *crypt_opts);
+
+void
+_mongocrypt_kms_config_destroy (_mongocrypt_kms_config_t *config);
+
 typedef enum {
    MONGOCRYPT_KMS_AWS_ENCRYPT,
    MONGOCRYPT_KMS_AWS_DECRYPT,
@@ -48,6 +132,27 @@ struct _mongocrypt_kms_ctx_t {
    _mongocrypt_buffer_t result;
    char *endpoint;
    _mongocrypt_log_t *log;
+   /* Set by mongocrypt_ctx_next_kms_ctx when the request is handed out. */
+   _mongocrypt_stats_t *stats;
+   /* Set by mongocrypt_ctx_next_kms_ctx. trace_id is the open request span,
+    * or 0. */
+   _mongocrypt_trace_t *trace;
+   uint64_t trace_id;
+   /* Set by mongocrypt_ctx_next_kms_ctx if a rate limit is set. send_us is
+    * the monotonic time at which the message may be sent. */
+   _mongocrypt_kms_limiter_t *limiter;
+   int64_t send_us;
+   uint32_t bytes_received;
+   /* The space from mongocrypt_kms_ctx_reserve_read, inside the parser, and
+    * its length. read_len is 0 if nothing is reserved. */
+   uint8_t *read_buf;
+   uint32_t read_len;
+   /* The class of an error status, set when it is set. */
+   mongocrypt_kms_failure_t failure;
+   /* A duplicate from mongocrypt_kms_ctx_hedge, or NULL. Owned. */
+   struct _mongocrypt_kms_ctx_t *hedge;
+   /* Set on a hedge, the request it duplicates. */
+   struct _mongocrypt_kms_ctx_t *hedged;
 };
 
 
@@ -56,7 +161,8 @@ _mongocrypt_kms_ctx_init_aws_decrypt (mongocrypt_kms_ctx_t *kms,
                                       _mongocrypt_opts_t *crypt_opts,
                                       _mongocrypt_key_doc_t *key,
                                       _mongocrypt_log_t *log,
-                                      _mongocrypt_crypto_t *crypto)
+                                      _mongocrypt_crypto_t *crypto,
+                                      _mongocrypt_aws_signing_keys_t *keys)
    MONGOCRYPT_WARN_UNUSED_RESULT;
 
 
@@ -67,7 +173,8 @@ _mongocrypt_kms_ctx_init_aws_encrypt (
    struct __mongocrypt_ctx_opts_t *ctx_opts,
    _mongocrypt_buffer_t *decrypted_key_material,
    _mongocrypt_log_t *log,
-   _mongocrypt_crypto_t *crypto) MONGOCRYPT_WARN_UNUSED_RESULT;
+   _mongocrypt_crypto_t *crypto,
+   _mongocrypt_aws_signing_keys_t *keys) MONGOCRYPT_WARN_UNUSED_RESULT;
 
 bool
 _mongocrypt_kms_ctx_result (mongocrypt_kms_ctx_t *kms,
@@ -105,7 +212,8 @@ bool
 _mongocrypt_kms_ctx_init_gcp_auth (mongocrypt_kms_ctx_t *kms,
                                    _mongocrypt_log_t *log,
                                    _mongocrypt_opts_t *crypt_opts,
-                                   _mongocrypt_endpoint_t *kms_endpoint)
+                                   _mongocrypt_endpoint_t *kms_endpoint,
+                                   _mongocrypt_gcp_assertions_t *assertions)
    MONGOCRYPT_WARN_UNUSED_RESULT;
 
 bool
@@ -125,4 +233,22 @@ _mongocrypt_kms_ctx_init_gcp_decrypt (mongocrypt_kms_ctx_t *kms,
                                       _mongocrypt_log_t *log)
    MONGOCRYPT_WARN_UNUSED_RESULT;
 
+/* Count the request in @stats, once, and count the response bytes as they
+ * are fed. */
+void
+_mongocrypt_kms_ctx_set_stats (mongocrypt_kms_ctx_t *kms,
+                               _mongocrypt_stats_t *stats);
+
+/* Begin the request span, once. It ends when the response is complete or
+ * the context is cleaned up. */
+void
+_mongocrypt_kms_ctx_set_trace (mongocrypt_kms_ctx_t *kms,
+                               _mongocrypt_trace_t *trace);
+
+/* Take a token for the request from @limiter, once. Retries and hedges take
+ * their own. */
+void
+_mongocrypt_kms_ctx_set_limiter (mongocrypt_kms_ctx_t *kms,
+                                 _mongocrypt_kms_limiter_t *limiter);
+
 #endif /* MONGOCRYPT_KMX_CTX_PRIVATE_H */
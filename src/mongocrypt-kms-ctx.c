@@ -19,8 +19,10 @@
 #include "mongocrypt-binary-private.h"
 #include "mongocrypt-buffer-private.h"
 #include "mongocrypt-ctx-private.h"
+#include "mongocrypt-json-private.h"
 #include "mongocrypt-kms-ctx-private.h"
 #include "mongocrypt-opts-private.h"
+#include "mongocrypt-probes-private.h"
 #include "mongocrypt-status-private.h"
 #include <kms_message/kms_b64.h>
 #include <kms_message/kms_azure_request.h>
@@ -99,7 +101,8 @@ _set_kms_crypto_hooks (_mongocrypt_crypto_t *crypto,
                        ctx_with_status_t *ctx_with_status,
                        kms_request_opt_t *opts)
 {
-   if (crypto->hooks_enabled) {
+   if (!_mongocrypt_crypto_is_native (crypto,
+                                      MONGOCRYPT_CRYPTO_PRIMITIVE_SHA_256)) {
       kms_request_opt_set_crypto_hooks (
          opts, _sha256, _sha256_hmac, ctx_with_status);
    }
@@ -114,7 +117,355 @@ _init_common (mongocrypt_kms_ctx_t *kms,
    kms->log = log;
    kms->status = mongocrypt_status_new ();
    kms->req_type = kms_type;
+   kms->stats = NULL;
+   kms->trace = NULL;
+   kms->trace_id = 0;
+   kms->limiter = NULL;
+   kms->send_us = 0;
+   kms->bytes_received = 0;
+   kms->read_buf = NULL;
+   kms->read_len = 0;
+   kms->failure = MONGOCRYPT_KMS_FAILURE_NONE;
+   kms->hedge = NULL;
+   kms->hedged = NULL;
    _mongocrypt_buffer_init (&kms->result);
+   MONGOCRYPT_PROBE2 (kms__start, kms, (int) kms_type);
+}
+
+void
+_mongocrypt_aws_signing_keys_init (_mongocrypt_aws_signing_keys_t *keys)
+{
+   _mongocrypt_mutex_init (&keys->mutex);
+   keys->keys = NULL;
+}
+
+static void
+_aws_signing_key_destroy (_mongocrypt_aws_signing_key_t *key)
+{
+   bson_free (key->access_key_id);
+   bson_free (key->region);
+   bson_free (key);
+}
+
+void
+_mongocrypt_aws_signing_keys_cleanup (_mongocrypt_aws_signing_keys_t *keys)
+{
+   _mongocrypt_aws_signing_key_t *tmp;
+
+   while (keys->keys) {
+      tmp = keys->keys->next;
+      _aws_signing_key_destroy (keys->keys);
+      keys->keys = tmp;
+   }
+   _mongocrypt_mutex_cleanup (&keys->mutex);
+}
+
+/* kms-message signs GCP OAuth JWTs that expire five minutes after they are
+ * issued. Stop reusing them a minute early to allow for request latency and
+ * clock skew. */
+#define MONGOCRYPT_GCP_ASSERTION_REUSE_US (4 * 60 * 1000 * 1000)
+
+void
+_mongocrypt_gcp_assertions_init (_mongocrypt_gcp_assertions_t *assertions)
+{
+   _mongocrypt_mutex_init (&assertions->mutex);
+   assertions->assertions = NULL;
+   assertions->generation = 0;
+}
+
+static void
+_gcp_assertion_destroy (_mongocrypt_gcp_assertion_t *assertion)
+{
+   bson_free (assertion->scope);
+   bson_free (assertion->assertion);
+   bson_free (assertion);
+}
+
+static void
+_gcp_assertions_destroy_all (_mongocrypt_gcp_assertions_t *assertions)
+{
+   _mongocrypt_gcp_assertion_t *tmp;
+
+   while (assertions->assertions) {
+      tmp = assertions->assertions->next;
+      _gcp_assertion_destroy (assertions->assertions);
+      assertions->assertions = tmp;
+   }
+}
+
+void
+_mongocrypt_gcp_assertions_clear (_mongocrypt_gcp_assertions_t *assertions)
+{
+   _mongocrypt_mutex_lock (&assertions->mutex);
+   _gcp_assertions_destroy_all (assertions);
+   assertions->generation++;
+   _mongocrypt_mutex_unlock (&assertions->mutex);
+}
+
+void
+_mongocrypt_gcp_assertions_cleanup (_mongocrypt_gcp_assertions_t *assertions)
+{
+   _gcp_assertions_destroy_all (assertions);
+   _mongocrypt_mutex_cleanup (&assertions->mutex);
+}
+
+#define AZURE_AUTH_HOST_DEFAULT "login.microsoftonline.com"
+#define GCP_AUTH_HOST_DEFAULT "oauth2.googleapis.com"
+
+static kms_request_opt_t *
+_request_opt_new (const _mongocrypt_opts_t *crypt_opts,
+                  kms_request_provider_t provider)
+{
+   kms_request_opt_t *opt;
+
+   opt = kms_request_opt_new ();
+   BSON_ASSERT (opt);
+   kms_request_opt_set_arena (opt, true);
+   kms_request_opt_set_connection_close (opt, !crypt_opts->kms_keep_alive);
+   kms_request_opt_set_provider (opt, provider);
+   return opt;
+}
+
+_mongocrypt_kms_config_t *
+_mongocrypt_kms_config_new (const _mongocrypt_opts_t *crypt_opts)
+{
+   _mongocrypt_kms_config_t *config;
+   _mongocrypt_endpoint_t *endpoint;
+
+   config = bson_malloc0 (sizeof (*config));
+   BSON_ASSERT (config);
+   config->azure_opt =
+      _request_opt_new (crypt_opts, KMS_REQUEST_PROVIDER_AZURE);
+   config->gcp_opt = _request_opt_new (crypt_opts, KMS_REQUEST_PROVIDER_GCP);
+
+   endpoint = crypt_opts->kms_provider_azure.identity_platform_endpoint;
+   if (endpoint) {
+      config->azure_auth_host = endpoint->host;
+      config->azure_auth_host_and_port = endpoint->host_and_port;
+   } else {
+      config->azure_auth_host = AZURE_AUTH_HOST_DEFAULT;
+      config->azure_auth_host_and_port = AZURE_AUTH_HOST_DEFAULT;
+   }
+
+   endpoint = crypt_opts->kms_provider_gcp.endpoint;
+   if (endpoint) {
+      config->gcp_auth_host = endpoint->host;
+      config->gcp_auth_host_and_port = endpoint->host_and_port;
+   } else {
+      config->gcp_auth_host = GCP_AUTH_HOST_DEFAULT;
+      config->gcp_auth_host_and_port = GCP_AUTH_HOST_DEFAULT;
+   }
+   config->gcp_audience =
+      bson_strdup_printf ("https://%s/token", config->gcp_auth_host);
+   return config;
+}
+
+void
+_mongocrypt_kms_config_destroy (_mongocrypt_kms_config_t *config)
+{
+   if (!config) {
+      return;
+   }
+   kms_request_opt_destroy (config->azure_opt);
+   kms_request_opt_destroy (config->gcp_opt);
+   bson_free (config->gcp_audience);
+   bson_free (config);
+}
+
+/* Returns the shared request options for @provider, or new ones if
+ * mongocrypt_init has not run. Release with _request_opt_release. */
+static kms_request_opt_t *
+_request_opt_get (const _mongocrypt_opts_t *crypt_opts,
+                  kms_request_provider_t provider)
+{
+   if (crypt_opts->kms_config) {
+      return provider == KMS_REQUEST_PROVIDER_AZURE
+                ? crypt_opts->kms_config->azure_opt
+                : crypt_opts->kms_config->gcp_opt;
+   }
+   return _request_opt_new (crypt_opts, provider);
+}
+
+static void
+_request_opt_release (const _mongocrypt_opts_t *crypt_opts,
+                      kms_request_opt_t *opt)
+{
+   if (!crypt_opts->kms_config) {
+      kms_request_opt_destroy (opt);
+   }
+}
+
+/* Returns a copy of an unexpired assertion for @scope, or NULL. */
+static char *
+_find_gcp_assertion (_mongocrypt_gcp_assertions_t *assertions,
+                     const char *scope)
+{
+   _mongocrypt_gcp_assertion_t *entry;
+   char *found = NULL;
+   int64_t now;
+
+   if (!assertions) {
+      return NULL;
+   }
+
+   now = bson_get_monotonic_time ();
+   _mongocrypt_mutex_lock (&assertions->mutex);
+   for (entry = assertions->assertions; NULL != entry; entry = entry->next) {
+      if (now < entry->reuse_until_us && 0 == strcmp (entry->scope, scope)) {
+         found = bson_strdup (entry->assertion);
+         break;
+      }
+   }
+   _mongocrypt_mutex_unlock (&assertions->mutex);
+   return found;
+}
+
+/* Add the assertion signed for @req, dropping expired assertions. Nothing is
+ * added if the assertions were cleared since @generation was read. */
+static void
+_add_gcp_assertion (_mongocrypt_gcp_assertions_t *assertions,
+                    uint32_t generation,
+                    const char *scope,
+                    kms_request_t *req)
+{
+   _mongocrypt_gcp_assertion_t *entry;
+   _mongocrypt_gcp_assertion_t **link;
+   const char *assertion;
+   int64_t now;
+
+   assertion = kms_gcp_request_oauth_get_assertion (req);
+   if (!assertions || !assertion) {
+      return;
+   }
+
+   now = bson_get_monotonic_time ();
+   entry = bson_malloc0 (sizeof (*entry));
+   BSON_ASSERT (entry);
+   entry->scope = bson_strdup (scope);
+   entry->assertion = bson_strdup (assertion);
+   entry->reuse_until_us = now + MONGOCRYPT_GCP_ASSERTION_REUSE_US;
+
+   _mongocrypt_mutex_lock (&assertions->mutex);
+   if (generation != assertions->generation) {
+      _mongocrypt_mutex_unlock (&assertions->mutex);
+      _gcp_assertion_destroy (entry);
+      return;
+   }
+   link = &assertions->assertions;
+   while (*link) {
+      if (now >= (*link)->reuse_until_us) {
+         _mongocrypt_gcp_assertion_t *stale = *link;
+
+         *link = stale->next;
+         _gcp_assertion_destroy (stale);
+      } else {
+         link = &(*link)->next;
+      }
+   }
+   entry->next = assertions->assertions;
+   assertions->assertions = entry;
+   _mongocrypt_mutex_unlock (&assertions->mutex);
+}
+
+/* Set the signing key of @req from @keys, deriving and adding it if there is
+ * none for @access_key_id, the request's date, and @region. @keys may be
+ * NULL, in which case the signing key is derived when the request is
+ * signed. */
+static bool
+_set_signing_key (_mongocrypt_aws_signing_keys_t *keys,
+                  kms_request_t *req,
+                  const char *access_key_id,
+                  const char *region)
+{
+   _mongocrypt_aws_signing_key_t *entry;
+   _mongocrypt_aws_signing_key_t **link;
+   const char *datetime;
+   char date[sizeof "YYYYmmDD"];
+   unsigned char signing_key[32];
+   bool found = false;
+
+   if (!keys) {
+      return true;
+   }
+
+   /* X-Amz-Date is YYYYmmDDTHHMMSSZ. */
+   datetime = kms_request_get_canonical_header (req, "X-Amz-Date");
+   if (!datetime || strlen (datetime) < sizeof (date) - 1) {
+      return false;
+   }
+   memcpy (date, datetime, sizeof (date) - 1);
+   date[sizeof (date) - 1] = '\0';
+
+   _mongocrypt_mutex_lock (&keys->mutex);
+   for (entry = keys->keys; NULL != entry; entry = entry->next) {
+      if (0 == strcmp (entry->access_key_id, access_key_id) &&
+          0 == strcmp (entry->date, date) &&
+          0 == strcmp (entry->region, region)) {
+         memcpy (signing_key, entry->key, sizeof (signing_key));
+         found = true;
+         break;
+      }
+   }
+   _mongocrypt_mutex_unlock (&keys->mutex);
+
+   if (found) {
+      return kms_request_set_signing_key (req, signing_key);
+   }
+
+   /* Derive outside the lock. Two requests may derive the same key, in which
+    * case both are added and the newer is found first. */
+   if (!kms_request_get_signing_key (req, signing_key)) {
+      return false;
+   }
+
+   entry = bson_malloc0 (sizeof (*entry));
+   BSON_ASSERT (entry);
+   entry->access_key_id = bson_strdup (access_key_id);
+   memcpy (entry->date, date, sizeof (date));
+   entry->region = bson_strdup (region);
+   memcpy (entry->key, signing_key, sizeof (signing_key));
+
+   _mongocrypt_mutex_lock (&keys->mutex);
+   link = &keys->keys;
+   while (*link) {
+      if (0 != strcmp ((*link)->access_key_id, access_key_id) ||
+          0 != strcmp ((*link)->date, date)) {
+         _mongocrypt_aws_signing_key_t *stale = *link;
+
+         *link = stale->next;
+         _aws_signing_key_destroy (stale);
+      } else {
+         link = &(*link)->next;
+      }
+   }
+   entry->next = keys->keys;
+   keys->keys = entry;
+   _mongocrypt_mutex_unlock (&keys->mutex);
+   return true;
+}
+
+/* Copy the AWS credentials, which mongocrypt_update_kms_credentials may
+ * replace while a request is created. */
+static void
+_copy_aws_credentials (_mongocrypt_opts_t *crypt_opts,
+                       _mongocrypt_opts_kms_provider_aws_t *out)
+{
+   _mongocrypt_opts_kms_provider_aws_t *aws;
+
+   _mongocrypt_mutex_lock (&crypt_opts->credentials_mutex);
+   aws = &crypt_opts->kms_provider_aws;
+   out->access_key_id = bson_strdup (aws->access_key_id);
+   out->secret_access_key = bson_strdup (aws->secret_access_key);
+   out->session_token = bson_strdup (aws->session_token);
+   _mongocrypt_mutex_unlock (&crypt_opts->credentials_mutex);
+}
+
+static void
+_aws_credentials_cleanup (_mongocrypt_opts_kms_provider_aws_t *aws)
+{
+   bson_free (aws->access_key_id);
+   bson_free (aws->secret_access_key);
+   bson_free (aws->session_token);
 }
 
 bool
@@ -122,11 +473,13 @@ _mongocrypt_kms_ctx_init_aws_decrypt (mongocrypt_kms_ctx_t *kms,
                                       _mongocrypt_opts_t *crypt_opts,
                                       _mongocrypt_key_doc_t *key,
                                       _mongocrypt_log_t *log,
-                                      _mongocrypt_crypto_t *crypto)
+                                      _mongocrypt_crypto_t *crypto,
+                                      _mongocrypt_aws_signing_keys_t *keys)
 {
    kms_request_opt_t *opt;
    mongocrypt_status_t *status;
    ctx_with_status_t ctx_with_status;
+   _mongocrypt_opts_kms_provider_aws_t aws = {0};
    bool ret = false;
 
    _init_common (kms, log, MONGOCRYPT_KMS_AWS_DECRYPT);
@@ -154,12 +507,13 @@ _mongocrypt_kms_ctx_init_aws_decrypt (mongocrypt_kms_ctx_t *kms,
       goto done;
    }
 
-   if (!crypt_opts->kms_provider_aws.access_key_id) {
+   _copy_aws_credentials (crypt_opts, &aws);
+   if (!aws.access_key_id) {
       CLIENT_ERR ("aws access key id not provided");
       goto done;
    }
 
-   if (!crypt_opts->kms_provider_aws.secret_access_key) {
+   if (!aws.secret_access_key) {
       CLIENT_ERR ("aws secret access key not provided");
       goto done;
    }
@@ -167,9 +521,10 @@ _mongocrypt_kms_ctx_init_aws_decrypt (mongocrypt_kms_ctx_t *kms,
    /* create the KMS request. */
    opt = kms_request_opt_new ();
    BSON_ASSERT (opt);
+   kms_request_opt_set_arena (opt, true);
 
    _set_kms_crypto_hooks (crypto, &ctx_with_status, opt);
-   kms_request_opt_set_connection_close (opt, true);
+   kms_request_opt_set_connection_close (opt, !crypt_opts->kms_keep_alive);
 
    kms->req = kms_decrypt_request_new (
       key->key_material.data, key->key_material.len, opt);
@@ -177,10 +532,9 @@ _mongocrypt_kms_ctx_init_aws_decrypt (mongocrypt_kms_ctx_t *kms,
    kms_request_opt_destroy (opt);
    kms_request_set_service (kms->req, "kms");
 
-   if (crypt_opts->kms_provider_aws.session_token) {
-      kms_request_add_header_field (kms->req,
-                                    "X-Amz-Security-Token",
-                                    crypt_opts->kms_provider_aws.session_token);
+   if (aws.session_token) {
+      kms_request_add_header_field (
+         kms->req, "X-Amz-Security-Token", aws.session_token);
    }
 
    if (kms_request_get_error (kms->req)) {
@@ -207,19 +561,26 @@ _mongocrypt_kms_ctx_init_aws_decrypt (mongocrypt_kms_ctx_t *kms,
       goto done;
    }
 
-   if (!kms_request_set_access_key_id (
-          kms->req, crypt_opts->kms_provider_aws.access_key_id)) {
+   if (!kms_request_set_access_key_id (kms->req, aws.access_key_id)) {
       CLIENT_ERR ("failed to set aws access key id");
       _mongocrypt_status_append (status, ctx_with_status.status);
       goto done;
    }
-   if (!kms_request_set_secret_key (
-          kms->req, crypt_opts->kms_provider_aws.secret_access_key)) {
+   if (!kms_request_set_secret_key (kms->req, aws.secret_access_key)) {
       CLIENT_ERR ("failed to set aws secret access key");
       _mongocrypt_status_append (status, ctx_with_status.status);
       goto done;
    }
 
+   if (!_set_signing_key (keys,
+                          kms->req,
+                          aws.access_key_id,
+                          key->kek.provider.aws.region)) {
+      CLIENT_ERR ("failed to create KMS message");
+      _mongocrypt_status_append (status, ctx_with_status.status);
+      goto done;
+   }
+
    _mongocrypt_buffer_init (&kms->msg);
    kms->msg.data = (uint8_t *) kms_request_get_signed (kms->req);
    if (!kms->msg.data) {
@@ -241,6 +602,7 @@ _mongocrypt_kms_ctx_init_aws_decrypt (mongocrypt_kms_ctx_t *kms,
 
    ret = true;
 done:
+   _aws_credentials_cleanup (&aws);
    mongocrypt_status_destroy (ctx_with_status.status);
 
    return ret;
@@ -254,11 +616,13 @@ _mongocrypt_kms_ctx_init_aws_encrypt (
    _mongocrypt_ctx_opts_t *ctx_opts,
    _mongocrypt_buffer_t *plaintext_key_material,
    _mongocrypt_log_t *log,
-   _mongocrypt_crypto_t *crypto)
+   _mongocrypt_crypto_t *crypto,
+   _mongocrypt_aws_signing_keys_t *keys)
 {
    kms_request_opt_t *opt;
    mongocrypt_status_t *status;
    ctx_with_status_t ctx_with_status;
+   _mongocrypt_opts_kms_provider_aws_t aws = {0};
    bool ret = false;
 
    _init_common (kms, log, MONGOCRYPT_KMS_AWS_ENCRYPT);
@@ -286,12 +650,13 @@ _mongocrypt_kms_ctx_init_aws_encrypt (
       goto done;
    }
 
-   if (!crypt_opts->kms_provider_aws.access_key_id) {
+   _copy_aws_credentials (crypt_opts, &aws);
+   if (!aws.access_key_id) {
       CLIENT_ERR ("aws access key id not provided");
       goto done;
    }
 
-   if (!crypt_opts->kms_provider_aws.secret_access_key) {
+   if (!aws.secret_access_key) {
       CLIENT_ERR ("aws secret access key not provided");
       goto done;
    }
@@ -299,10 +664,10 @@ _mongocrypt_kms_ctx_init_aws_encrypt (
    /* create the KMS request. */
    opt = kms_request_opt_new ();
    BSON_ASSERT (opt);
-
+   kms_request_opt_set_arena (opt, true);
 
    _set_kms_crypto_hooks (crypto, &ctx_with_status, opt);
-   kms_request_opt_set_connection_close (opt, true);
+   kms_request_opt_set_connection_close (opt, !crypt_opts->kms_keep_alive);
 
    kms->req = kms_encrypt_request_new (plaintext_key_material->data,
                                        plaintext_key_material->len,
@@ -312,10 +677,9 @@ _mongocrypt_kms_ctx_init_aws_encrypt (
    kms_request_opt_destroy (opt);
    kms_request_set_service (kms->req, "kms");
 
-   if (crypt_opts->kms_provider_aws.session_token) {
-      kms_request_add_header_field (kms->req,
-                                    "X-Amz-Security-Token",
-                                    crypt_opts->kms_provider_aws.session_token);
+   if (aws.session_token) {
+      kms_request_add_header_field (
+         kms->req, "X-Amz-Security-Token", aws.session_token);
    }
 
    if (kms_request_get_error (kms->req)) {
@@ -342,19 +706,26 @@ _mongocrypt_kms_ctx_init_aws_encrypt (
       goto done;
    }
 
-   if (!kms_request_set_access_key_id (
-          kms->req, crypt_opts->kms_provider_aws.access_key_id)) {
+   if (!kms_request_set_access_key_id (kms->req, aws.access_key_id)) {
       CLIENT_ERR ("failed to set aws access key id");
       _mongocrypt_status_append (status, ctx_with_status.status);
       goto done;
    }
-   if (!kms_request_set_secret_key (
-          kms->req, crypt_opts->kms_provider_aws.secret_access_key)) {
+   if (!kms_request_set_secret_key (kms->req, aws.secret_access_key)) {
       CLIENT_ERR ("failed to set aws secret access key");
       _mongocrypt_status_append (status, ctx_with_status.status);
       goto done;
    }
 
+   if (!_set_signing_key (keys,
+                          kms->req,
+                          aws.access_key_id,
+                          ctx_opts->kek.provider.aws.region)) {
+      CLIENT_ERR ("failed to create KMS message");
+      _mongocrypt_status_append (status, ctx_with_status.status);
+      goto done;
+   }
+
    _mongocrypt_buffer_init (&kms->msg);
    kms->msg.data = (uint8_t *) kms_request_get_signed (kms->req);
    if (!kms->msg.data) {
@@ -376,17 +747,44 @@ _mongocrypt_kms_ctx_init_aws_encrypt (
 
    ret = true;
 done:
+   _aws_credentials_cleanup (&aws);
    mongocrypt_status_destroy (ctx_with_status.status);
    return ret;
 }
 
 
+/* Returns true if @kms has a complete response, with a result or an error
+ * from KMS. A response that failed to parse as HTTP does not count, so a
+ * hedge may still complete. */
+static bool
+_settled (mongocrypt_kms_ctx_t *kms)
+{
+   if (!mongocrypt_status_ok (kms->status)) {
+      return kms->failure != MONGOCRYPT_KMS_FAILURE_NETWORK;
+   }
+   return !_mongocrypt_buffer_empty (&kms->result);
+}
+
+
+/* Returns true if the hedge of @kms, or the request @kms hedges, settled
+ * first, so responses to @kms are no longer needed. */
+static bool
+_hedge_partner_settled (mongocrypt_kms_ctx_t *kms)
+{
+   return (kms->hedge && _settled (kms->hedge)) ||
+          (kms->hedged && _settled (kms->hedged));
+}
+
+
 uint32_t
 mongocrypt_kms_ctx_bytes_needed (mongocrypt_kms_ctx_t *kms)
 {
    if (!kms) {
       return 0;
    }
+   if (_hedge_partner_settled (kms)) {
+      return 0;
+   }
    /* TODO: an oddity of kms-message. After retrieving the JSON result, it
     * resets the parser. */
    if (!mongocrypt_status_ok (kms->status) ||
@@ -397,6 +795,24 @@ mongocrypt_kms_ctx_bytes_needed (mongocrypt_kms_ctx_t *kms)
                                            DEFAULT_MAX_KMS_BYTE_REQUEST);
 }
 
+/* Decode the base64 string @json_field of a successful response body into
+ * kms->result, without converting the body to BSON. Returns false if the
+ * body must be parsed in full, which also reports any error. */
+static bool
+_result_from_json_b64 (mongocrypt_kms_ctx_t *kms,
+                       const char *body,
+                       size_t body_len,
+                       const char *json_field,
+                       bool url)
+{
+   const char *b64;
+   size_t b64_len;
+
+   return _mongocrypt_json_find_string (
+             body, body_len, json_field, &b64, &b64_len) &&
+          _mongocrypt_json_b64_decode (b64, b64_len, url, &kms->result);
+}
+
 /* An AWS KMS context has received full response. Parse out the result or error.
  */
 static bool
@@ -440,13 +856,22 @@ _ctx_done_aws (mongocrypt_kms_ctx_t *kms, const char *json_field)
       bson_destroy (&body_bson);
       if (!bson_init_from_json (&body_bson, body, body_len, &bson_error)) {
          bson_init (&body_bson);
-      } else if (bson_iter_init_find (&iter, &body_bson, "message") &&
-                 BSON_ITER_HOLDS_UTF8 (&iter)) {
-         CLIENT_ERR ("Error in KMS response '%s'. "
-                     "HTTP status=%d",
-                     bson_iter_utf8 (&iter, NULL),
-                     http_status);
-         goto fail;
+      } else {
+         /* AWS reports throttling as HTTP 400, like { "__type":
+          * "ThrottlingException" } */
+         if (bson_iter_init_find (&iter, &body_bson, "__type") &&
+             BSON_ITER_HOLDS_UTF8 (&iter) &&
+             strstr (bson_iter_utf8 (&iter, NULL), "ThrottlingException")) {
+            kms->failure = MONGOCRYPT_KMS_FAILURE_THROTTLED;
+         }
+         if (bson_iter_init_find (&iter, &body_bson, "message") &&
+             BSON_ITER_HOLDS_UTF8 (&iter)) {
+            CLIENT_ERR ("Error in KMS response '%s'. "
+                        "HTTP status=%d",
+                        bson_iter_utf8 (&iter, NULL),
+                        http_status);
+            goto fail;
+         }
       }
 
       /* If we couldn't parse JSON, return the body unchanged as an error. */
@@ -456,6 +881,11 @@ _ctx_done_aws (mongocrypt_kms_ctx_t *kms, const char *json_field)
       goto fail;
    }
 
+   if (_result_from_json_b64 (kms, body, body_len, json_field, false)) {
+      ret = true;
+      goto fail;
+   }
+
    /* If HTTP response succeeded (status 200) then body should contain JSON.
     */
    bson_destroy (&body_bson);
@@ -492,6 +922,33 @@ fail:
    return ret;
 }
 
+/* Store the fields of a successful oauth response body that the oauth cache
+ * reads, without converting the rest of the body to BSON. Returns false if
+ * the body must be parsed in full. */
+static bool
+_oauth_result_from_json (mongocrypt_kms_ctx_t *kms,
+                         const char *body,
+                         size_t body_len)
+{
+   const char *token;
+   size_t token_len;
+   int64_t expires_in;
+   bson_t result;
+
+   if (!_mongocrypt_json_find_string (
+          body, body_len, "access_token", &token, &token_len) ||
+       token_len > INT32_MAX ||
+       !_mongocrypt_json_find_int64 (
+          body, body_len, "expires_in", &expires_in)) {
+      return false;
+   }
+   bson_init (&result);
+   bson_append_utf8 (&result, "access_token", -1, token, (int) token_len);
+   BSON_APPEND_INT64 (&result, "expires_in", expires_in);
+   _mongocrypt_buffer_steal_from_bson (&kms->result, &result);
+   return true;
+}
+
 /* A Azure/GCP oauth KMS context has received full response. Parse out the
  * bearer token or error. */
 static bool
@@ -519,6 +976,11 @@ _ctx_done_oauth (mongocrypt_kms_ctx_t *kms)
       goto fail;
    }
 
+   if (http_status == 200 && _oauth_result_from_json (kms, body, body_len)) {
+      ret = true;
+      goto fail;
+   }
+
    bson_body =
       bson_new_from_json ((const uint8_t *) body, body_len, &bson_error);
    if (!bson_body) {
@@ -601,6 +1063,12 @@ _ctx_done_azure_wrapkey_unwrapkey (mongocrypt_kms_ctx_t *kms)
       goto fail;
    }
 
+   if (http_status == 200 &&
+       _result_from_json_b64 (kms, body, body_len, "value", true)) {
+      ret = true;
+      goto fail;
+   }
+
    bson_body =
       bson_new_from_json ((const uint8_t *) body, body_len, &bson_error);
    if (!bson_body) {
@@ -723,6 +1191,11 @@ _ctx_done_gcp (mongocrypt_kms_ctx_t *kms, const char *json_field)
       goto fail;
    }
 
+   if (_result_from_json_b64 (kms, body, body_len, json_field, false)) {
+      ret = true;
+      goto fail;
+   }
+
    /* If HTTP response succeeded (status 200) then body should contain JSON.
     */
    bson_destroy (&body_bson);
@@ -757,6 +1230,253 @@ fail:
    return ret;
 }
 
+static const char *
+_kms_provider_name (mongocrypt_kms_ctx_t *kms)
+{
+   switch (kms->req_type) {
+   case MONGOCRYPT_KMS_AZURE_OAUTH:
+   case MONGOCRYPT_KMS_AZURE_WRAPKEY:
+   case MONGOCRYPT_KMS_AZURE_UNWRAPKEY:
+      return "azure";
+   case MONGOCRYPT_KMS_GCP_OAUTH:
+   case MONGOCRYPT_KMS_GCP_ENCRYPT:
+   case MONGOCRYPT_KMS_GCP_DECRYPT:
+      return "gcp";
+   default:
+      return "aws";
+   }
+}
+
+
+static void
+_kms_trace_end (mongocrypt_kms_ctx_t *kms)
+{
+   bson_t attrs;
+
+   if (!kms->trace_id) {
+      return;
+   }
+
+   bson_init (&attrs);
+   bson_append_int64 (&attrs,
+                      MONGOCRYPT_STR_AND_LEN ("bytesReceived"),
+                      (int64_t) kms->bytes_received);
+   _mongocrypt_trace_end (
+      kms->trace, MONGOCRYPT_TRACE_SPAN_KMS_REQUEST, kms->trace_id, &attrs);
+   bson_destroy (&attrs);
+   kms->trace_id = 0;
+}
+
+
+static _mongocrypt_stats_kms_t *
+_kms_stats (mongocrypt_kms_ctx_t *kms)
+{
+   switch (kms->req_type) {
+   case MONGOCRYPT_KMS_AZURE_OAUTH:
+   case MONGOCRYPT_KMS_AZURE_WRAPKEY:
+   case MONGOCRYPT_KMS_AZURE_UNWRAPKEY:
+      return &kms->stats->kms[MONGOCRYPT_STATS_KMS_AZURE];
+   case MONGOCRYPT_KMS_GCP_OAUTH:
+   case MONGOCRYPT_KMS_GCP_ENCRYPT:
+   case MONGOCRYPT_KMS_GCP_DECRYPT:
+      return &kms->stats->kms[MONGOCRYPT_STATS_KMS_GCP];
+   default:
+      return &kms->stats->kms[MONGOCRYPT_STATS_KMS_AWS];
+   }
+}
+
+
+void
+_mongocrypt_kms_ctx_set_stats (mongocrypt_kms_ctx_t *kms,
+                               _mongocrypt_stats_t *stats)
+{
+   _mongocrypt_stats_kms_t *kms_stats;
+
+   if (!kms || kms->stats) {
+      /* Already counted. */
+      return;
+   }
+
+   kms->stats = stats;
+   kms_stats = _kms_stats (kms);
+   _mongocrypt_atomic_add_int64 (&kms_stats->requests, 1);
+   _mongocrypt_atomic_add_int64 (&kms_stats->bytes_sent, kms->msg.len);
+   _mongocrypt_atomic_add_int64 (&stats->memory.kms, kms->msg.len);
+   if (kms->req_type == MONGOCRYPT_KMS_AZURE_OAUTH ||
+       kms->req_type == MONGOCRYPT_KMS_GCP_OAUTH) {
+      _mongocrypt_atomic_add_int64 (&kms_stats->oauth_refreshes, 1);
+   }
+}
+
+
+void
+_mongocrypt_kms_ctx_set_trace (mongocrypt_kms_ctx_t *kms,
+                               _mongocrypt_trace_t *trace)
+{
+   bson_t attrs;
+
+   if (!kms || kms->trace || !MONGOCRYPT_TRACING (trace)) {
+      return;
+   }
+
+   kms->trace = trace;
+   bson_init (&attrs);
+   bson_append_utf8 (&attrs,
+                     MONGOCRYPT_STR_AND_LEN ("provider"),
+                     _kms_provider_name (kms),
+                     -1);
+   bson_append_utf8 (&attrs,
+                     MONGOCRYPT_STR_AND_LEN ("endpoint"),
+                     kms->endpoint ? kms->endpoint : "",
+                     -1);
+   bson_append_int64 (
+      &attrs, MONGOCRYPT_STR_AND_LEN ("bytesSent"), (int64_t) kms->msg.len);
+   kms->trace_id = _mongocrypt_trace_begin (
+      trace, MONGOCRYPT_TRACE_SPAN_KMS_REQUEST, &attrs);
+   bson_destroy (&attrs);
+}
+
+
+void
+_mongocrypt_kms_ctx_set_limiter (mongocrypt_kms_ctx_t *kms,
+                                 _mongocrypt_kms_limiter_t *limiter)
+{
+   if (!kms || kms->limiter || 0 == limiter->rate) {
+      return;
+   }
+
+   kms->limiter = limiter;
+   kms->send_us = _mongocrypt_kms_limiter_reserve (
+      limiter, kms->endpoint, bson_get_monotonic_time ());
+}
+
+
+int64_t
+mongocrypt_kms_ctx_usleep (mongocrypt_kms_ctx_t *kms)
+{
+   int64_t now;
+
+   if (!kms || !kms->limiter) {
+      return 0;
+   }
+   now = bson_get_monotonic_time ();
+   return kms->send_us > now ? kms->send_us - now : 0;
+}
+
+
+/* Parse the completed response of @kms. */
+static bool
+_ctx_done (mongocrypt_kms_ctx_t *kms)
+{
+   mongocrypt_status_t *status;
+
+   status = kms->status;
+   if (kms->req_type == MONGOCRYPT_KMS_AWS_ENCRYPT) {
+      return _ctx_done_aws (kms, "CiphertextBlob");
+   } else if (kms->req_type == MONGOCRYPT_KMS_AWS_DECRYPT) {
+      return _ctx_done_aws (kms, "Plaintext");
+   } else if (kms->req_type == MONGOCRYPT_KMS_AZURE_OAUTH) {
+      return _ctx_done_oauth (kms);
+   } else if (kms->req_type == MONGOCRYPT_KMS_AZURE_WRAPKEY) {
+      return _ctx_done_azure_wrapkey_unwrapkey (kms);
+   } else if (kms->req_type == MONGOCRYPT_KMS_AZURE_UNWRAPKEY) {
+      return _ctx_done_azure_wrapkey_unwrapkey (kms);
+   } else if (kms->req_type == MONGOCRYPT_KMS_GCP_OAUTH) {
+      return _ctx_done_oauth (kms);
+   } else if (kms->req_type == MONGOCRYPT_KMS_GCP_ENCRYPT) {
+      return _ctx_done_gcp (kms, "ciphertext");
+   } else if (kms->req_type == MONGOCRYPT_KMS_GCP_DECRYPT) {
+      return _ctx_done_gcp (kms, "plaintext");
+   } else {
+      CLIENT_ERR ("Unknown request type");
+      return false;
+   }
+}
+
+
+/* If @kms is a hedge that settled first, hand its result or error to the
+ * request it duplicates, which the parent context reads. */
+static void
+_settle_hedged (mongocrypt_kms_ctx_t *kms)
+{
+   mongocrypt_kms_ctx_t *hedged = kms->hedged;
+
+   if (!hedged || !_settled (kms) || _settled (hedged)) {
+      return;
+   }
+   _mongocrypt_status_copy_to (kms->status, hedged->status);
+   _mongocrypt_buffer_copy_to (&kms->result, &hedged->result);
+   hedged->failure = kms->failure;
+   _kms_trace_end (hedged);
+}
+
+
+/* Logs and counts bytes of the response before they are parsed. */
+static void
+_received (mongocrypt_kms_ctx_t *kms,
+           const char *func,
+           const uint8_t *data,
+           uint32_t len)
+{
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (kms->log)) {
+      _mongocrypt_log (kms->log,
+                       MONGOCRYPT_LOG_LEVEL_TRACE,
+                       "%s (%s=\"%.*s\")",
+                       func,
+                       "bytes",
+                       (int) len,
+                       data);
+   }
+
+   if (kms->stats) {
+      _mongocrypt_stats_kms_t *kms_stats = _kms_stats (kms);
+
+      _mongocrypt_atomic_add_int64 (&kms_stats->bytes_received, len);
+      _mongocrypt_atomic_add_int64 (&kms->stats->memory.kms, len);
+   }
+   kms->bytes_received += len;
+}
+
+
+/* Finishes a feed or commit. parsed is the result from the parser. */
+static bool
+_parsed (mongocrypt_kms_ctx_t *kms, bool parsed)
+{
+   mongocrypt_status_t *status = kms->status;
+
+   if (!parsed) {
+      CLIENT_ERR ("KMS response parser error with status %d, error: '%s'",
+                  kms_response_parser_status (kms->parser),
+                  kms_response_parser_error (kms->parser));
+      kms->failure = MONGOCRYPT_KMS_FAILURE_NETWORK;
+      return false;
+   }
+
+   if (0 == mongocrypt_kms_ctx_bytes_needed (kms)) {
+      int http_status;
+      bool ret;
+
+      http_status = kms_response_parser_status (kms->parser);
+      _kms_trace_end (kms);
+      ret = _ctx_done (kms);
+      MONGOCRYPT_PROBE4 (
+         kms__done, kms, ret, http_status, kms->bytes_received);
+      if (!ret && kms->failure == MONGOCRYPT_KMS_FAILURE_NONE) {
+         if (http_status == 429) {
+            kms->failure = MONGOCRYPT_KMS_FAILURE_THROTTLED;
+         } else if (http_status >= 500 && http_status < 600) {
+            kms->failure = MONGOCRYPT_KMS_FAILURE_SERVER;
+         } else {
+            kms->failure = MONGOCRYPT_KMS_FAILURE_PERMANENT;
+         }
+      }
+      _settle_hedged (kms);
+      return ret;
+   }
+   return true;
+}
+
+
 bool
 mongocrypt_kms_ctx_feed (mongocrypt_kms_ctx_t *kms, mongocrypt_binary_t *bytes)
 {
@@ -766,6 +1486,15 @@ mongocrypt_kms_ctx_feed (mongocrypt_kms_ctx_t *kms, mongocrypt_binary_t *bytes)
       return false;
    }
 
+   /* Feeding may move the parser's buffer. */
+   kms->read_buf = NULL;
+   kms->read_len = 0;
+
+   if (_hedge_partner_settled (kms)) {
+      /* The other response settled first. */
+      return true;
+   }
+
    status = kms->status;
    if (!mongocrypt_status_ok (status)) {
       return false;
@@ -781,49 +1510,85 @@ mongocrypt_kms_ctx_feed (mongocrypt_kms_ctx_t *kms, mongocrypt_binary_t *bytes)
       return false;
    }
 
-   if (kms->log->trace_enabled) {
-      _mongocrypt_log (kms->log,
-                       MONGOCRYPT_LOG_LEVEL_TRACE,
-                       "%s (%s=\"%.*s\")",
-                       BSON_FUNC,
-                       "bytes",
-                       mongocrypt_binary_len (bytes),
-                       mongocrypt_binary_data (bytes));
+   _received (kms, BSON_FUNC, bytes->data, bytes->len);
+   return _parsed (
+      kms, kms_response_parser_feed (kms->parser, bytes->data, bytes->len));
+}
+
+
+bool
+mongocrypt_kms_ctx_reserve_read (mongocrypt_kms_ctx_t *kms,
+                                 uint8_t **buf,
+                                 uint32_t *len)
+{
+   mongocrypt_status_t *status;
+   uint32_t needed;
+
+   if (!kms) {
+      return false;
    }
 
-   if (!kms_response_parser_feed (kms->parser, bytes->data, bytes->len)) {
-      CLIENT_ERR ("KMS response parser error with status %d, error: '%s'",
-                  kms_response_parser_status (kms->parser),
-                  kms_response_parser_error (kms->parser));
+   status = kms->status;
+   if (!buf || !len) {
+      CLIENT_ERR ("arguments 'buf' and 'len' are required");
       return false;
    }
 
-   if (0 == mongocrypt_kms_ctx_bytes_needed (kms)) {
-      if (kms->req_type == MONGOCRYPT_KMS_AWS_ENCRYPT) {
-         return _ctx_done_aws (kms, "CiphertextBlob");
-      } else if (kms->req_type == MONGOCRYPT_KMS_AWS_DECRYPT) {
-         return _ctx_done_aws (kms, "Plaintext");
-      } else if (kms->req_type == MONGOCRYPT_KMS_AZURE_OAUTH) {
-         return _ctx_done_oauth (kms);
-      } else if (kms->req_type == MONGOCRYPT_KMS_AZURE_WRAPKEY) {
-         return _ctx_done_azure_wrapkey_unwrapkey (kms);
-      } else if (kms->req_type == MONGOCRYPT_KMS_AZURE_UNWRAPKEY) {
-         return _ctx_done_azure_wrapkey_unwrapkey (kms);
-      } else if (kms->req_type == MONGOCRYPT_KMS_GCP_OAUTH) {
-         return _ctx_done_oauth (kms);
-      } else if (kms->req_type == MONGOCRYPT_KMS_GCP_ENCRYPT) {
-         return _ctx_done_gcp (kms, "ciphertext");
-      } else if (kms->req_type == MONGOCRYPT_KMS_GCP_DECRYPT) {
-         return _ctx_done_gcp (kms, "plaintext");
-      } else {
-         CLIENT_ERR ("Unknown request type");
-         return false;
-      }
+   *buf = NULL;
+   *len = 0;
+   kms->read_buf = NULL;
+   kms->read_len = 0;
+   if (!mongocrypt_status_ok (status)) {
+      return false;
    }
+
+   needed = mongocrypt_kms_ctx_bytes_needed (kms);
+   if (needed == 0) {
+      return true;
+   }
+
+   kms->read_buf = kms_response_parser_reserve (kms->parser, needed);
+   kms->read_len = needed;
+   *buf = kms->read_buf;
+   *len = needed;
    return true;
 }
 
 
+bool
+mongocrypt_kms_ctx_commit_read (mongocrypt_kms_ctx_t *kms, uint32_t len)
+{
+   mongocrypt_status_t *status;
+   uint8_t *data;
+
+   if (!kms) {
+      return false;
+   }
+
+   status = kms->status;
+   if (!mongocrypt_status_ok (status)) {
+      return false;
+   }
+
+   if (len > kms->read_len) {
+      CLIENT_ERR ("KMS response committed more than was reserved");
+      return false;
+   }
+
+   data = kms->read_buf;
+   kms->read_buf = NULL;
+   kms->read_len = 0;
+   if (_hedge_partner_settled (kms)) {
+      /* The other response settled first. */
+      return true;
+   }
+
+   _received (kms, BSON_FUNC, data, len);
+   return _parsed (kms, kms_response_parser_commit (kms->parser, len));
+}
+
+
+
 bool
 _mongocrypt_kms_ctx_result (mongocrypt_kms_ctx_t *kms,
                             _mongocrypt_buffer_t *out)
@@ -871,12 +1636,121 @@ mongocrypt_kms_ctx_status (mongocrypt_kms_ctx_t *kms,
 }
 
 
+static void
+_hedge_destroy (mongocrypt_kms_ctx_t *kms)
+{
+   if (!kms->hedge) {
+      return;
+   }
+   _mongocrypt_kms_ctx_cleanup (kms->hedge);
+   bson_free (kms->hedge);
+   kms->hedge = NULL;
+}
+
+
+mongocrypt_kms_failure_t
+mongocrypt_kms_ctx_failure (mongocrypt_kms_ctx_t *kms)
+{
+   if (!kms || mongocrypt_status_ok (kms->status)) {
+      return MONGOCRYPT_KMS_FAILURE_NONE;
+   }
+   if (kms->failure == MONGOCRYPT_KMS_FAILURE_NONE) {
+      /* Like a misuse of the API. */
+      return MONGOCRYPT_KMS_FAILURE_PERMANENT;
+   }
+   return kms->failure;
+}
+
+
+bool
+mongocrypt_kms_ctx_retry (mongocrypt_kms_ctx_t *kms)
+{
+   mongocrypt_kms_failure_t failure;
+
+   if (!kms || kms->hedged) {
+      return false;
+   }
+   failure = mongocrypt_kms_ctx_failure (kms);
+   if (failure != MONGOCRYPT_KMS_FAILURE_THROTTLED &&
+       failure != MONGOCRYPT_KMS_FAILURE_SERVER &&
+       failure != MONGOCRYPT_KMS_FAILURE_NETWORK) {
+      return false;
+   }
+
+   _hedge_destroy (kms);
+   kms_response_parser_destroy (kms->parser);
+   kms->parser = kms_response_parser_new ();
+   _mongocrypt_status_reset (kms->status);
+   _mongocrypt_buffer_cleanup (&kms->result);
+   kms->failure = MONGOCRYPT_KMS_FAILURE_NONE;
+   if (kms->stats) {
+      _mongocrypt_stats_kms_t *kms_stats = _kms_stats (kms);
+
+      /* The message is sent again. Received bytes are dropped. */
+      _mongocrypt_atomic_add_int64 (&kms_stats->requests, 1);
+      _mongocrypt_atomic_add_int64 (&kms_stats->bytes_sent, kms->msg.len);
+      _mongocrypt_atomic_add_int64 (&kms->stats->memory.kms,
+                                    -(int64_t) kms->bytes_received);
+   }
+   kms->bytes_received = 0;
+   kms->read_buf = NULL;
+   kms->read_len = 0;
+   if (kms->limiter) {
+      kms->send_us = _mongocrypt_kms_limiter_reserve (
+         kms->limiter, kms->endpoint, bson_get_monotonic_time ());
+   }
+   return true;
+}
+
+
+mongocrypt_kms_ctx_t *
+mongocrypt_kms_ctx_hedge (mongocrypt_kms_ctx_t *kms)
+{
+   mongocrypt_kms_ctx_t *hedge;
+
+   if (!kms || kms->hedged || !kms->status) {
+      return NULL;
+   }
+   if (kms->hedge) {
+      return kms->hedge;
+   }
+   if (!mongocrypt_status_ok (kms->status) ||
+       !_mongocrypt_buffer_empty (&kms->result)) {
+      return NULL;
+   }
+
+   hedge = bson_malloc0 (sizeof (*hedge));
+   BSON_ASSERT (hedge);
+   _init_common (hedge, kms->log, kms->req_type);
+   _mongocrypt_buffer_copy_to (&kms->msg, &hedge->msg);
+   hedge->endpoint = bson_strdup (kms->endpoint);
+   hedge->hedged = kms;
+   if (kms->stats) {
+      _mongocrypt_kms_ctx_set_stats (hedge, kms->stats);
+   }
+   if (kms->limiter) {
+      _mongocrypt_kms_ctx_set_limiter (hedge, kms->limiter);
+   }
+   kms->hedge = hedge;
+   return hedge;
+}
+
+
 void
 _mongocrypt_kms_ctx_cleanup (mongocrypt_kms_ctx_t *kms)
 {
    if (!kms) {
       return;
    }
+   _hedge_destroy (kms);
+   /* The response was never completed. */
+   _kms_trace_end (kms);
+   if (kms->stats) {
+      /* Release what was counted since _mongocrypt_kms_ctx_set_stats. */
+      _mongocrypt_atomic_add_int64 (
+         &kms->stats->memory.kms,
+         -((int64_t) kms->msg.len + (int64_t) kms->bytes_received));
+   }
    if (kms->req) {
       kms_request_destroy (kms->req);
    }
@@ -935,6 +1809,9 @@ _mongocrypt_kms_ctx_init_azure_auth (mongocrypt_kms_ctx_t *kms,
    char *scope = NULL;
    const char *host;
    char *request_string;
+   char *tenant_id;
+   char *client_id;
+   char *client_secret;
    bool ret = false;
 
    _init_common (kms, log, MONGOCRYPT_KMS_AZURE_OAUTH);
@@ -942,11 +1819,15 @@ _mongocrypt_kms_ctx_init_azure_auth (mongocrypt_kms_ctx_t *kms,
    identity_platform_endpoint =
       crypt_opts->kms_provider_azure.identity_platform_endpoint;
 
-   if (identity_platform_endpoint) {
+   if (crypt_opts->kms_config) {
+      kms->endpoint =
+         bson_strdup (crypt_opts->kms_config->azure_auth_host_and_port);
+      host = crypt_opts->kms_config->azure_auth_host;
+   } else if (identity_platform_endpoint) {
       kms->endpoint = bson_strdup (identity_platform_endpoint->host_and_port);
       host = identity_platform_endpoint->host;
    } else {
-      kms->endpoint = bson_strdup ("login.microsoftonline.com");
+      kms->endpoint = bson_strdup (AZURE_AUTH_HOST_DEFAULT);
       host = kms->endpoint;
    }
 
@@ -960,17 +1841,20 @@ _mongocrypt_kms_ctx_init_azure_auth (mongocrypt_kms_ctx_t *kms,
       scope = bson_strdup ("https%3A%2F%2Fvault.azure.net%2F.default");
    }
 
-   opt = kms_request_opt_new ();
-   BSON_ASSERT (opt);
-   kms_request_opt_set_connection_close (opt, true);
-   kms_request_opt_set_provider (opt, KMS_REQUEST_PROVIDER_AZURE);
-   kms->req =
-      kms_azure_request_oauth_new (host,
-                                   scope,
-                                   crypt_opts->kms_provider_azure.tenant_id,
-                                   crypt_opts->kms_provider_azure.client_id,
-                                   crypt_opts->kms_provider_azure.client_secret,
-                                   opt);
+   /* Copy the credentials, which mongocrypt_update_kms_credentials may
+    * replace. */
+   _mongocrypt_mutex_lock (&crypt_opts->credentials_mutex);
+   tenant_id = bson_strdup (crypt_opts->kms_provider_azure.tenant_id);
+   client_id = bson_strdup (crypt_opts->kms_provider_azure.client_id);
+   client_secret = bson_strdup (crypt_opts->kms_provider_azure.client_secret);
+   _mongocrypt_mutex_unlock (&crypt_opts->credentials_mutex);
+
+   opt = _request_opt_get (crypt_opts, KMS_REQUEST_PROVIDER_AZURE);
+   kms->req = kms_azure_request_oauth_new (
+      host, scope, tenant_id, client_id, client_secret, opt);
+   bson_free (tenant_id);
+   bson_free (client_id);
+   bson_free (client_secret);
    if (kms_request_get_error (kms->req)) {
       CLIENT_ERR ("error constructing KMS message: %s",
                   kms_request_get_error (kms->req));
@@ -991,7 +1875,7 @@ _mongocrypt_kms_ctx_init_azure_auth (mongocrypt_kms_ctx_t *kms,
    ret = true;
 fail:
    bson_free (scope);
-   kms_request_opt_destroy (opt);
+   _request_opt_release (crypt_opts, opt);
    return ret;
 }
 
@@ -1020,10 +1904,7 @@ _mongocrypt_kms_ctx_init_azure_wrapkey (
       ctx_opts->kek.provider.azure.key_vault_endpoint->host_and_port);
    host = ctx_opts->kek.provider.azure.key_vault_endpoint->host;
 
-   opt = kms_request_opt_new ();
-   BSON_ASSERT (opt);
-   kms_request_opt_set_connection_close (opt, true);
-   kms_request_opt_set_provider (opt, KMS_REQUEST_PROVIDER_AZURE);
+   opt = _request_opt_get (crypt_opts, KMS_REQUEST_PROVIDER_AZURE);
    kms->req =
       kms_azure_request_wrapkey_new (host,
                                      access_token,
@@ -1052,7 +1933,7 @@ _mongocrypt_kms_ctx_init_azure_wrapkey (
 
    ret = true;
 fail:
-   kms_request_opt_destroy (opt);
+   _request_opt_release (crypt_opts, opt);
    bson_free (path_and_query);
    bson_free (payload);
    bson_free (bearer_token_value);
@@ -1082,10 +1963,7 @@ _mongocrypt_kms_ctx_init_azure_unwrapkey (mongocrypt_kms_ctx_t *kms,
       bson_strdup (key->kek.provider.azure.key_vault_endpoint->host_and_port);
    host = key->kek.provider.azure.key_vault_endpoint->host;
 
-   opt = kms_request_opt_new ();
-   BSON_ASSERT (opt);
-   kms_request_opt_set_connection_close (opt, true);
-   kms_request_opt_set_provider (opt, KMS_REQUEST_PROVIDER_AZURE);
+   opt = _request_opt_get (crypt_opts, KMS_REQUEST_PROVIDER_AZURE);
    kms->req =
       kms_azure_request_unwrapkey_new (host,
                                        access_token,
@@ -1114,7 +1992,7 @@ _mongocrypt_kms_ctx_init_azure_unwrapkey (mongocrypt_kms_ctx_t *kms,
 
    ret = true;
 fail:
-   kms_request_opt_destroy (opt);
+   _request_opt_release (crypt_opts, opt);
    bson_free (path_and_query);
    bson_free (payload);
    bson_free (bearer_token_value);
@@ -1160,32 +2038,43 @@ bool
 _mongocrypt_kms_ctx_init_gcp_auth (mongocrypt_kms_ctx_t *kms,
                                    _mongocrypt_log_t *log,
                                    _mongocrypt_opts_t *crypt_opts,
-                                   _mongocrypt_endpoint_t *kms_endpoint)
+                                   _mongocrypt_endpoint_t *kms_endpoint,
+                                   _mongocrypt_gcp_assertions_t *assertions)
 {
    kms_request_opt_t *opt = NULL;
    mongocrypt_status_t *status;
    _mongocrypt_endpoint_t *auth_endpoint;
    char *scope = NULL;
    char *audience = NULL;
+   char *assertion = NULL;
    const char *host;
    char *request_string;
    bool ret = false;
    ctx_with_status_t ctx_with_status;
+   char *email = NULL;
+   _mongocrypt_buffer_t private_key;
+   uint32_t generation = 0;
 
    _init_common (kms, log, MONGOCRYPT_KMS_GCP_OAUTH);
+   _mongocrypt_buffer_init (&private_key);
    status = kms->status;
    auth_endpoint = crypt_opts->kms_provider_gcp.endpoint;
    ctx_with_status.ctx = crypt_opts;
    ctx_with_status.status = mongocrypt_status_new ();
 
-   if (auth_endpoint) {
+   if (crypt_opts->kms_config) {
+      kms->endpoint =
+         bson_strdup (crypt_opts->kms_config->gcp_auth_host_and_port);
+      host = crypt_opts->kms_config->gcp_auth_host;
+      audience = bson_strdup (crypt_opts->kms_config->gcp_audience);
+   } else if (auth_endpoint) {
       kms->endpoint = bson_strdup (auth_endpoint->host_and_port);
       host = auth_endpoint->host;
       audience = bson_strdup_printf ("https://%s/token", auth_endpoint->host);
    } else {
-      kms->endpoint = bson_strdup ("oauth2.googleapis.com");
+      kms->endpoint = bson_strdup (GCP_AUTH_HOST_DEFAULT);
       host = kms->endpoint;
-      audience = bson_strdup_printf ("https://oauth2.googleapis.com/token");
+      audience = bson_strdup_printf ("https://%s/token", GCP_AUTH_HOST_DEFAULT);
    }
 
    if (kms_endpoint) {
@@ -1198,26 +2087,49 @@ _mongocrypt_kms_ctx_init_gcp_auth (mongocrypt_kms_ctx_t *kms,
 
    opt = kms_request_opt_new ();
    BSON_ASSERT (opt);
-   kms_request_opt_set_connection_close (opt, true);
+   kms_request_opt_set_arena (opt, true);
+   kms_request_opt_set_connection_close (opt, !crypt_opts->kms_keep_alive);
    kms_request_opt_set_provider (opt, KMS_REQUEST_PROVIDER_GCP);
    if (crypt_opts->sign_rsaes_pkcs1_v1_5) {
       kms_request_opt_set_crypto_hook_sign_rsaes_pkcs1_v1_5 (
          opt, _sign_rsaes_pkcs1_v1_5_trampoline, &ctx_with_status);
    }
-   kms->req = kms_gcp_request_oauth_new (
-      host,
-      crypt_opts->kms_provider_gcp.email,
-      audience,
-      scope,
-      (const char *) crypt_opts->kms_provider_gcp.private_key.data,
-      crypt_opts->kms_provider_gcp.private_key.len,
-      opt);
+   /* Reuse a recently signed assertion for the scope to skip RSA signing. */
+   assertion = _find_gcp_assertion (assertions, scope);
+   if (assertion) {
+      kms->req =
+         kms_gcp_request_oauth_new_from_assertion (host, assertion, opt);
+   } else {
+      /* Copy the credentials, which mongocrypt_update_kms_credentials may
+       * replace, with the generation of assertions they sign. */
+      _mongocrypt_mutex_lock (&crypt_opts->credentials_mutex);
+      email = bson_strdup (crypt_opts->kms_provider_gcp.email);
+      _mongocrypt_buffer_copy_to (&crypt_opts->kms_provider_gcp.private_key,
+                                  &private_key);
+      if (assertions) {
+         _mongocrypt_mutex_lock (&assertions->mutex);
+         generation = assertions->generation;
+         _mongocrypt_mutex_unlock (&assertions->mutex);
+      }
+      _mongocrypt_mutex_unlock (&crypt_opts->credentials_mutex);
+
+      kms->req = kms_gcp_request_oauth_new (host,
+                                            email,
+                                            audience,
+                                            scope,
+                                            (const char *) private_key.data,
+                                            private_key.len,
+                                            opt);
+   }
    if (kms_request_get_error (kms->req)) {
       CLIENT_ERR ("error constructing KMS message: %s",
                   kms_request_get_error (kms->req));
       _mongocrypt_status_append (status, ctx_with_status.status);
       goto fail;
    }
+   if (!assertion) {
+      _add_gcp_assertion (assertions, generation, scope, kms->req);
+   }
 
    request_string = kms_request_to_string (kms->req);
    if (!request_string) {
@@ -1235,6 +2147,9 @@ _mongocrypt_kms_ctx_init_gcp_auth (mongocrypt_kms_ctx_t *kms,
 fail:
    bson_free (scope);
    bson_free (audience);
+   bson_free (assertion);
+   bson_free (email);
+   _mongocrypt_buffer_cleanup (&private_key);
    kms_request_opt_destroy (opt);
    mongocrypt_status_destroy (ctx_with_status.status);
    return ret;
@@ -1270,10 +2185,7 @@ _mongocrypt_kms_ctx_init_gcp_encrypt (
       host = kms->endpoint;
    }
 
-   opt = kms_request_opt_new ();
-   BSON_ASSERT (opt);
-   kms_request_opt_set_connection_close (opt, true);
-   kms_request_opt_set_provider (opt, KMS_REQUEST_PROVIDER_GCP);
+   opt = _request_opt_get (crypt_opts, KMS_REQUEST_PROVIDER_GCP);
    kms->req =
       kms_gcp_request_encrypt_new (host,
                                    access_token,
@@ -1305,7 +2217,7 @@ _mongocrypt_kms_ctx_init_gcp_encrypt (
 
    ret = true;
 fail:
-   kms_request_opt_destroy (opt);
+   _request_opt_release (crypt_opts, opt);
    bson_free (path_and_query);
    bson_free (payload);
    bson_free (bearer_token_value);
@@ -1340,10 +2252,7 @@ _mongocrypt_kms_ctx_init_gcp_decrypt (mongocrypt_kms_ctx_t *kms,
       host = kms->endpoint;
    }
 
-   opt = kms_request_opt_new ();
-   BSON_ASSERT (opt);
-   kms_request_opt_set_connection_close (opt, true);
-   kms_request_opt_set_provider (opt, KMS_REQUEST_PROVIDER_GCP);
+   opt = _request_opt_get (crypt_opts, KMS_REQUEST_PROVIDER_GCP);
    kms->req = kms_gcp_request_decrypt_new (host,
                                            access_token,
                                            key->kek.provider.gcp.project_id,
@@ -1373,7 +2282,7 @@ _mongocrypt_kms_ctx_init_gcp_decrypt (mongocrypt_kms_ctx_t *kms,
 
    ret = true;
 fail:
-   kms_request_opt_destroy (opt);
+   _request_opt_release (crypt_opts, opt);
    bson_free (path_and_query);
    bson_free (payload);
    bson_free (bearer_token_value);
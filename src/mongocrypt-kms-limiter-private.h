@@ -0,0 +1,59 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_KMS_LIMITER_PRIVATE_H
+#define MONGOCRYPT_KMS_LIMITER_PRIVATE_H
+
+#include <bson/bson.h>
+
+#include "mongocrypt-mutex-private.h"
+
+/* The token bucket of one KMS endpoint. The endpoint names the provider and
+ * region, like kms.us-east-1.amazonaws.com. */
+typedef struct __mongocrypt_kms_bucket_t {
+   char *endpoint;
+   /* Monotonic time at which the bucket has a token for the next request.
+    * Requests reserved ahead of time move it into the future. */
+   int64_t next_us;
+   struct __mongocrypt_kms_bucket_t *next;
+} _mongocrypt_kms_bucket_t;
+
+/* Limits the rate of KMS requests of a mongocrypt_t per endpoint. Each
+ * bucket holds up to burst tokens and gains rate tokens per second. A
+ * request takes a token when it is handed out, waiting for one if the bucket
+ * is empty. */
+typedef struct {
+   mongocrypt_mutex_t mutex;
+   /* Requests per second. Zero disables the limiter. */
+   uint32_t rate;
+   uint32_t burst;
+   _mongocrypt_kms_bucket_t *buckets;
+} _mongocrypt_kms_limiter_t;
+
+void
+_mongocrypt_kms_limiter_init (_mongocrypt_kms_limiter_t *limiter);
+
+void
+_mongocrypt_kms_limiter_cleanup (_mongocrypt_kms_limiter_t *limiter);
+
+/* Take a token of the bucket of @endpoint. Returns the monotonic time, at or
+ * after @now_us, at which the request may be sent. */
+int64_t
+_mongocrypt_kms_limiter_reserve (_mongocrypt_kms_limiter_t *limiter,
+                                 const char *endpoint,
+                                 int64_t now_us);
+
+#endif /* MONGOCRYPT_KMS_LIMITER_PRIVATE_H */
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-kms-limiter-private.h"
+
+void
+_mongocrypt_kms_limiter_init (_mongocrypt_kms_limiter_t *limiter)
+{
+   _mongocrypt_mutex_init (&limiter->mutex);
+   limiter->rate = 0;
+   limiter->burst = 0;
+   limiter->buckets = NULL;
+}
+
+
+void
+_mongocrypt_kms_limiter_cleanup (_mongocrypt_kms_limiter_t *limiter)
+{
+   _mongocrypt_kms_bucket_t *tmp;
+
+   while (limiter->buckets) {
+      tmp = limiter->buckets->next;
+      bson_free (limiter->buckets->endpoint);
+      bson_free (limiter->buckets);
+      limiter->buckets = tmp;
+   }
+   _mongocrypt_mutex_cleanup (&limiter->mutex);
+}
+
+
+int64_t
+_mongocrypt_kms_limiter_reserve (_mongocrypt_kms_limiter_t *limiter,
+                                 const char *endpoint,
+                                 int64_t now_us)
+{
+   _mongocrypt_kms_bucket_t *bucket;
+   int64_t interval_us;
+   int64_t send_us;
+
+   if (limiter->rate == 0 || !endpoint) {
+      return now_us;
+   }
+
+   /* A full bucket has burst tokens, so a request may be sent up to burst - 1
+    * intervals before the bucket has its token. */
+   interval_us = 1000 * 1000 / (int64_t) limiter->rate;
+
+   _mongocrypt_mutex_lock (&limiter->mutex);
+   for (bucket = limiter->buckets; NULL != bucket; bucket = bucket->next) {
+      if (0 == strcmp (bucket->endpoint, endpoint)) {
+         break;
+      }
+   }
+   if (!bucket) {
+      bucket = bson_malloc0 (sizeof (*bucket));
+      BSON_ASSERT (bucket);
+      bucket->endpoint = bson_strdup (endpoint);
+      bucket->next_us = now_us;
+      bucket->next = limiter->buckets;
+      limiter->buckets = bucket;
+   }
+
+   if (bucket->next_us < now_us) {
+      /* The bucket refilled. Unused time does not add tokens past burst. */
+      bucket->next_us = now_us;
+   }
+   send_us = bucket->next_us - (int64_t) (limiter->burst - 1) * interval_us;
+   if (send_us < now_us) {
+      send_us = now_us;
+   }
+   bucket->next_us += interval_us;
+   _mongocrypt_mutex_unlock (&limiter->mutex);
+   return send_us;
+}
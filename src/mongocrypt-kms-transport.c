@@ -0,0 +1,777 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Only uses the public API of libmongocrypt, so it links to the shared
+ * library and does not depend on libbson. */
+
+#include "mongocrypt-kms-transport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#define DEFAULT_MAX_CONNECTIONS 8
+#define DEFAULT_TIMEOUT_MS 10000
+#define DEFAULT_PORT "443"
+/* A request is sent at most this many times. */
+#define MAX_ATTEMPTS 3
+/* Retries of throttled requests wait this long, doubled for each attempt. */
+#define BACKOFF_MS 100
+
+typedef struct {
+   mongocrypt_kms_ctx_t *kms;
+   char *host;
+   char *port;
+   const uint8_t *msg;
+   uint32_t msg_len;
+   uint32_t sent;
+   /* Whether the message allows the connection to be reused. */
+   bool keep_alive;
+   uint32_t attempts;
+   uint64_t not_before_ms;
+   bool assigned;
+   bool done;
+} _request_t;
+
+typedef enum {
+   CONN_CONNECTING,
+   CONN_HANDSHAKE,
+   CONN_SEND,
+   CONN_RECV,
+   CONN_IDLE
+} _conn_state_t;
+
+typedef struct _conn_t {
+   char *host;
+   char *port;
+   int fd;
+   SSL *ssl;
+   /* Addresses of the host, and the one being connected to. */
+   struct addrinfo *addrs;
+   struct addrinfo *addr;
+   _conn_state_t state;
+   short events;
+   /* Whether the connection sent a request before this one. */
+   bool reused;
+   /* Whether any bytes of the reply to this request arrived. */
+   bool received;
+   _request_t *req;
+   struct _conn_t *next;
+} _conn_t;
+
+struct _mongocrypt_kms_transport_t {
+   SSL_CTX *ssl_ctx;
+   uint32_t max_connections;
+   uint32_t timeout_ms;
+   /* Open connections. Idle ones are kept for later runs. */
+   _conn_t *conns;
+};
+
+typedef enum { STEP_WAIT, STEP_DONE, STEP_NETWORK, STEP_FEED } _step_t;
+
+
+static void
+_set_error (mongocrypt_status_t *status, const char *msg)
+{
+   mongocrypt_status_set (status, MONGOCRYPT_STATUS_ERROR_CLIENT, 1, msg, -1);
+}
+
+
+static uint64_t
+_now_ms (void)
+{
+   struct timespec ts;
+
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000u + (uint64_t) ts.tv_nsec / 1000000u;
+}
+
+
+static char *
+_strndup (const char *str, size_t len)
+{
+   char *out;
+
+   out = malloc (len + 1u);
+   if (out) {
+      memcpy (out, str, len);
+      out[len] = '\0';
+   }
+   return out;
+}
+
+
+/* Split "host", "host:port", or "[ipv6]:port". */
+static bool
+_parse_endpoint (const char *endpoint, char **host, char **port)
+{
+   const char *host_end, *colon;
+
+   *host = NULL;
+   *port = NULL;
+   if (endpoint[0] == '[') {
+      endpoint++;
+      host_end = strchr (endpoint, ']');
+      if (!host_end || (host_end[1] != '\0' && host_end[1] != ':')) {
+         return false;
+      }
+      colon = host_end[1] == ':' ? host_end + 1 : NULL;
+   } else {
+      colon = strrchr (endpoint, ':');
+      host_end = colon ? colon : endpoint + strlen (endpoint);
+   }
+   if (host_end == endpoint || (colon && colon[1] == '\0')) {
+      return false;
+   }
+   *host = _strndup (endpoint, (size_t) (host_end - endpoint));
+   *port = colon ? _strndup (colon + 1, strlen (colon + 1))
+                 : _strndup (DEFAULT_PORT, strlen (DEFAULT_PORT));
+   return *host && *port;
+}
+
+
+/* Whether the HTTP message has the header "Connection: close". */
+static bool
+_closes_connection (const uint8_t *msg, uint32_t len)
+{
+   static const char header[] = "\r\nconnection:";
+   uint32_t i, j;
+
+   for (i = 0; i + sizeof (header) - 1u <= len; i++) {
+      if (0 != strncasecmp (
+                  (const char *) msg + i, header, sizeof (header) - 1u)) {
+         continue;
+      }
+      j = i + (uint32_t) sizeof (header) - 1u;
+      while (j < len && msg[j] == ' ') {
+         j++;
+      }
+      return j + 5u <= len &&
+             0 == strncasecmp ((const char *) msg + j, "close", 5);
+   }
+   return false;
+}
+
+
+static void
+_conn_destroy (_conn_t *conn)
+{
+   if (!conn) {
+      return;
+   }
+   if (conn->ssl) {
+      SSL_free (conn->ssl);
+   }
+   if (conn->fd >= 0) {
+      close (conn->fd);
+   }
+   if (conn->addrs) {
+      freeaddrinfo (conn->addrs);
+   }
+   free (conn->host);
+   free (conn->port);
+   free (conn);
+}
+
+
+/* Remove @conn from the transport, and destroy it. */
+static void
+_conn_close (mongocrypt_kms_transport_t *transport, _conn_t *conn)
+{
+   _conn_t **link;
+
+   for (link = &transport->conns; *link; link = &(*link)->next) {
+      if (*link == conn) {
+         *link = conn->next;
+         break;
+      }
+   }
+   _conn_destroy (conn);
+}
+
+
+/* Start a non-blocking connect to the next address of @conn. */
+static bool
+_conn_connect_next (_conn_t *conn)
+{
+   if (conn->fd >= 0) {
+      close (conn->fd);
+      conn->fd = -1;
+      conn->addr = conn->addr->ai_next;
+   }
+
+   for (; conn->addr; conn->addr = conn->addr->ai_next) {
+      int flags;
+
+      conn->fd = socket (conn->addr->ai_family,
+                         conn->addr->ai_socktype,
+                         conn->addr->ai_protocol);
+      if (conn->fd < 0) {
+         continue;
+      }
+      flags = fcntl (conn->fd, F_GETFL, 0);
+      if (flags >= 0 && fcntl (conn->fd, F_SETFL, flags | O_NONBLOCK) == 0 &&
+          (0 == connect (
+                   conn->fd, conn->addr->ai_addr, conn->addr->ai_addrlen) ||
+           errno == EINPROGRESS)) {
+         conn->state = CONN_CONNECTING;
+         conn->events = POLLOUT;
+         return true;
+      }
+      close (conn->fd);
+      conn->fd = -1;
+   }
+   return false;
+}
+
+
+static _conn_t *
+_conn_new (mongocrypt_kms_transport_t *transport, _request_t *req)
+{
+   struct addrinfo hints;
+   _conn_t *conn;
+
+   conn = calloc (1, sizeof (*conn));
+   if (!conn) {
+      return NULL;
+   }
+   conn->fd = -1;
+   conn->host = _strndup (req->host, strlen (req->host));
+   conn->port = _strndup (req->port, strlen (req->port));
+   memset (&hints, 0, sizeof (hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   if (!conn->host || !conn->port ||
+       0 != getaddrinfo (conn->host, conn->port, &hints, &conn->addrs)) {
+      _conn_destroy (conn);
+      return NULL;
+   }
+   conn->addr = conn->addrs;
+   if (!_conn_connect_next (conn)) {
+      _conn_destroy (conn);
+      return NULL;
+   }
+   conn->next = transport->conns;
+   transport->conns = conn;
+   return conn;
+}
+
+
+static bool
+_conn_start_tls (mongocrypt_kms_transport_t *transport, _conn_t *conn)
+{
+   conn->ssl = SSL_new (transport->ssl_ctx);
+   if (!conn->ssl || 1 != SSL_set_fd (conn->ssl, conn->fd)) {
+      return false;
+   }
+   /* Send SNI, and check the certificate is for the host. */
+   if (1 != SSL_set_tlsext_host_name (conn->ssl, conn->host)) {
+      return false;
+   }
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+   if (1 != X509_VERIFY_PARAM_set1_host (
+               SSL_get0_param (conn->ssl), conn->host, 0)) {
+      return false;
+   }
+#else
+   if (1 != SSL_set1_host (conn->ssl, conn->host)) {
+      return false;
+   }
+#endif
+   conn->state = CONN_HANDSHAKE;
+   return true;
+}
+
+
+/* Map the result of an SSL call that did not complete to a step. */
+static _step_t
+_ssl_wait (_conn_t *conn, int ret)
+{
+   switch (SSL_get_error (conn->ssl, ret)) {
+   case SSL_ERROR_WANT_READ:
+      conn->events = POLLIN;
+      return STEP_WAIT;
+   case SSL_ERROR_WANT_WRITE:
+      conn->events = POLLOUT;
+      return STEP_WAIT;
+   default:
+      ERR_clear_error ();
+      return STEP_NETWORK;
+   }
+}
+
+
+/* Advance @conn as far as it goes without blocking. */
+static _step_t
+_conn_step (mongocrypt_kms_transport_t *transport, _conn_t *conn)
+{
+   _request_t *req = conn->req;
+   int ret;
+
+   if (conn->state == CONN_CONNECTING) {
+      int err = 0;
+      socklen_t err_len = sizeof (err);
+
+      if (0 != getsockopt (conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) ||
+          err != 0) {
+         return _conn_connect_next (conn) ? STEP_WAIT : STEP_NETWORK;
+      }
+      if (!_conn_start_tls (transport, conn)) {
+         return STEP_NETWORK;
+      }
+   }
+
+   if (conn->state == CONN_HANDSHAKE) {
+      ret = SSL_connect (conn->ssl);
+      if (ret != 1) {
+         return _ssl_wait (conn, ret);
+      }
+      conn->state = CONN_SEND;
+   }
+
+   if (conn->state == CONN_SEND) {
+      while (req->sent < req->msg_len) {
+         ret = SSL_write (
+            conn->ssl, req->msg + req->sent, (int) (req->msg_len - req->sent));
+         if (ret <= 0) {
+            return _ssl_wait (conn, ret);
+         }
+         req->sent += (uint32_t) ret;
+      }
+      conn->state = CONN_RECV;
+      conn->events = POLLIN;
+   }
+
+   while (mongocrypt_kms_ctx_bytes_needed (req->kms) > 0) {
+      uint8_t buf[4096];
+      uint32_t needed;
+      mongocrypt_binary_t *bin;
+      bool ok;
+
+      needed = mongocrypt_kms_ctx_bytes_needed (req->kms);
+      ret = SSL_read (
+         conn->ssl, buf, (int) (needed < sizeof (buf) ? needed : sizeof (buf)));
+      if (ret <= 0) {
+         return _ssl_wait (conn, ret);
+      }
+      conn->received = true;
+      bin = mongocrypt_binary_new_from_data (buf, (uint32_t) ret);
+      ok = mongocrypt_kms_ctx_feed (req->kms, bin);
+      mongocrypt_binary_destroy (bin);
+      if (!ok) {
+         return STEP_FEED;
+      }
+   }
+   return STEP_DONE;
+}
+
+
+/* Find a connection for each request that needs one. */
+static void
+_assign (mongocrypt_kms_transport_t *transport,
+         _request_t *reqs,
+         uint32_t n_reqs,
+         uint64_t now)
+{
+   uint32_t i;
+
+   for (i = 0; i < n_reqs; i++) {
+      _request_t *req = &reqs[i];
+      _conn_t *conn, *idle = NULL;
+      uint32_t open = 0;
+
+      if (req->done || req->assigned || req->not_before_ms > now) {
+         continue;
+      }
+      for (conn = transport->conns; conn; conn = conn->next) {
+         if (0 != strcmp (conn->host, req->host) ||
+             0 != strcmp (conn->port, req->port)) {
+            continue;
+         }
+         open++;
+         if (conn->state == CONN_IDLE && !idle) {
+            idle = conn;
+         }
+      }
+
+      if (idle) {
+         idle->reused = true;
+         idle->state = CONN_SEND;
+         idle->events = POLLOUT;
+         conn = idle;
+      } else if (open < transport->max_connections) {
+         conn = _conn_new (transport, req);
+         if (!conn) {
+            /* Count it as a failed attempt, and try again later. */
+            req->attempts++;
+            req->not_before_ms = now + BACKOFF_MS;
+            continue;
+         }
+      } else {
+         continue;
+      }
+      conn->received = false;
+      conn->req = req;
+      req->assigned = true;
+      req->sent = 0;
+   }
+}
+
+
+/* Handle a request whose connection failed. Returns false on a permanent
+ * failure, with @status set. */
+static bool
+_fail_request (_request_t *req,
+               bool reused,
+               bool received,
+               bool fed,
+               uint64_t now,
+               mongocrypt_status_t *status)
+{
+   req->assigned = false;
+   req->sent = 0;
+   if (fed) {
+      mongocrypt_kms_failure_t failure;
+
+      failure = mongocrypt_kms_ctx_failure (req->kms);
+      if (req->attempts + 1u >= MAX_ATTEMPTS ||
+          !mongocrypt_kms_ctx_retry (req->kms)) {
+         mongocrypt_kms_ctx_status (req->kms, status);
+         return false;
+      }
+      req->attempts++;
+      if (failure == MONGOCRYPT_KMS_FAILURE_THROTTLED) {
+         req->not_before_ms = now + ((uint64_t) BACKOFF_MS << req->attempts);
+      }
+      return true;
+   }
+
+   if (received) {
+      _set_error (status, "connection to KMS closed during the reply");
+      return false;
+   }
+   /* A kept-alive connection may have been closed by the server while idle.
+    * Nothing was fed, so send the request on a new connection. */
+   if (!reused) {
+      req->attempts++;
+   }
+   if (req->attempts >= MAX_ATTEMPTS) {
+      _set_error (status, "failed to send request to KMS");
+      return false;
+   }
+   return true;
+}
+
+
+static bool
+_collect (mongocrypt_ctx_t *ctx,
+          _request_t **reqs_out,
+          uint32_t *n_out,
+          mongocrypt_status_t *status)
+{
+   _request_t *reqs = NULL;
+   uint32_t n = 0, cap = 0;
+   mongocrypt_kms_ctx_t *kms;
+
+   while ((kms = mongocrypt_ctx_next_kms_ctx (ctx))) {
+      mongocrypt_binary_t *msg;
+      const char *endpoint;
+      _request_t *req;
+
+      if (n == cap) {
+         _request_t *grown;
+
+         cap = cap ? cap * 2u : 4u;
+         grown = realloc (reqs, sizeof (*reqs) * cap);
+         if (!grown) {
+            _set_error (status, "out of memory");
+            goto fail;
+         }
+         reqs = grown;
+      }
+      req = &reqs[n++];
+      memset (req, 0, sizeof (*req));
+      req->kms = kms;
+
+      msg = mongocrypt_binary_new ();
+      if (!mongocrypt_kms_ctx_message (kms, msg) ||
+          !mongocrypt_kms_ctx_endpoint (kms, &endpoint)) {
+         mongocrypt_binary_destroy (msg);
+         mongocrypt_kms_ctx_status (kms, status);
+         goto fail;
+      }
+      /* The message is owned by @kms. */
+      req->msg = mongocrypt_binary_data (msg);
+      req->msg_len = mongocrypt_binary_len (msg);
+      mongocrypt_binary_destroy (msg);
+      req->keep_alive = !_closes_connection (req->msg, req->msg_len);
+      if (!_parse_endpoint (endpoint, &req->host, &req->port)) {
+         _set_error (status, "invalid KMS endpoint");
+         goto fail;
+      }
+   }
+
+   *reqs_out = reqs;
+   *n_out = n;
+   return true;
+
+fail:
+   while (n > 0) {
+      n--;
+      free (reqs[n].host);
+      free (reqs[n].port);
+   }
+   free (reqs);
+   return false;
+}
+
+
+mongocrypt_kms_transport_t *
+mongocrypt_kms_transport_new (void)
+{
+   mongocrypt_kms_transport_t *transport;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+   SSL_library_init ();
+   SSL_load_error_strings ();
+   transport = calloc (1, sizeof (*transport));
+   if (transport) {
+      transport->ssl_ctx = SSL_CTX_new (SSLv23_client_method ());
+   }
+#else
+   transport = calloc (1, sizeof (*transport));
+   if (transport) {
+      transport->ssl_ctx = SSL_CTX_new (TLS_client_method ());
+   }
+#endif
+   if (!transport || !transport->ssl_ctx) {
+      mongocrypt_kms_transport_destroy (transport);
+      return NULL;
+   }
+   SSL_CTX_set_options (transport->ssl_ctx,
+                        SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1);
+   SSL_CTX_set_verify (transport->ssl_ctx, SSL_VERIFY_PEER, NULL);
+   if (1 != SSL_CTX_set_default_verify_paths (transport->ssl_ctx)) {
+      mongocrypt_kms_transport_destroy (transport);
+      return NULL;
+   }
+   transport->max_connections = DEFAULT_MAX_CONNECTIONS;
+   transport->timeout_ms = DEFAULT_TIMEOUT_MS;
+   return transport;
+}
+
+
+bool
+mongocrypt_kms_transport_setopt_max_connections (
+   mongocrypt_kms_transport_t *transport, uint32_t max_connections)
+{
+   if (!transport || max_connections == 0) {
+      return false;
+   }
+   transport->max_connections = max_connections;
+   return true;
+}
+
+
+bool
+mongocrypt_kms_transport_setopt_timeout_ms (
+   mongocrypt_kms_transport_t *transport, uint32_t timeout_ms)
+{
+   if (!transport) {
+      return false;
+   }
+   transport->timeout_ms = timeout_ms;
+   return true;
+}
+
+
+bool
+mongocrypt_kms_transport_setopt_ca_file (mongocrypt_kms_transport_t *transport,
+                                         const char *ca_file)
+{
+   if (!transport || !ca_file) {
+      return false;
+   }
+   return 1 ==
+          SSL_CTX_load_verify_locations (transport->ssl_ctx, ca_file, NULL);
+}
+
+
+bool
+mongocrypt_kms_transport_run (mongocrypt_kms_transport_t *transport,
+                              mongocrypt_ctx_t *ctx,
+                              mongocrypt_status_t *status)
+{
+   _request_t *reqs = NULL;
+   struct pollfd *fds = NULL;
+   _conn_t **polled = NULL;
+   uint32_t n_reqs = 0, n_done = 0, i;
+   uint64_t deadline = 0;
+   bool ret = false;
+
+   if (!transport || !ctx || !status) {
+      return false;
+   }
+   if (mongocrypt_ctx_state (ctx) != MONGOCRYPT_CTX_NEED_KMS) {
+      _set_error (status, "context does not need KMS");
+      return false;
+   }
+   if (transport->timeout_ms) {
+      deadline = _now_ms () + transport->timeout_ms;
+   }
+   if (!_collect (ctx, &reqs, &n_reqs, status)) {
+      return false;
+   }
+   if (n_reqs > 0) {
+      fds = calloc (n_reqs, sizeof (*fds));
+      polled = calloc (n_reqs, sizeof (*polled));
+      if (!fds || !polled) {
+         _set_error (status, "out of memory");
+         goto done;
+      }
+   }
+
+   while (n_done < n_reqs) {
+      _conn_t *conn;
+      uint64_t now = _now_ms (), wake = deadline;
+      uint32_t n_fds = 0;
+      int timeout = -1, n_ready;
+
+      if (deadline && now >= deadline) {
+         _set_error (status, "timed out waiting for KMS");
+         goto done;
+      }
+      _assign (transport, reqs, n_reqs, now);
+      for (i = 0; i < n_reqs; i++) {
+         if (reqs[i].attempts >= MAX_ATTEMPTS) {
+            _set_error (status, "failed to connect to KMS");
+            goto done;
+         }
+         /* Wake up for requests waiting out a backoff. */
+         if (!reqs[i].done && !reqs[i].assigned &&
+             reqs[i].not_before_ms > now &&
+             (!wake || reqs[i].not_before_ms < wake)) {
+            wake = reqs[i].not_before_ms;
+         }
+      }
+      for (conn = transport->conns; conn; conn = conn->next) {
+         if (conn->req) {
+            fds[n_fds].fd = conn->fd;
+            fds[n_fds].events = conn->events;
+            fds[n_fds].revents = 0;
+            polled[n_fds++] = conn;
+         }
+      }
+      if (wake) {
+         timeout = wake > now ? (int) (wake - now) : 0;
+      }
+
+      n_ready = poll (fds, n_fds, timeout);
+      if (n_ready < 0 && errno != EINTR) {
+         _set_error (status, "poll failed");
+         goto done;
+      }
+
+      for (i = 0; n_ready > 0 && i < n_fds; i++) {
+         _request_t *req;
+         bool reused, received;
+         _step_t step;
+
+         if (!fds[i].revents) {
+            continue;
+         }
+         conn = polled[i];
+         req = conn->req;
+         step = _conn_step (transport, conn);
+         if (step == STEP_WAIT) {
+            continue;
+         }
+         if (step == STEP_DONE) {
+            req->done = true;
+            n_done++;
+            if (req->keep_alive) {
+               conn->req = NULL;
+               conn->state = CONN_IDLE;
+               conn->events = 0;
+            } else {
+               _conn_close (transport, conn);
+            }
+            continue;
+         }
+
+         reused = conn->reused;
+         received = conn->received;
+         _conn_close (transport, conn);
+         if (!_fail_request (
+                req, reused, received, step == STEP_FEED, now, status)) {
+            goto done;
+         }
+      }
+   }
+
+   if (!mongocrypt_ctx_kms_done (ctx)) {
+      mongocrypt_ctx_status (ctx, status);
+      goto done;
+   }
+   ret = true;
+
+done:
+   /* Connections still in use are in the middle of a request. */
+   for (i = 0; i < n_reqs; i++) {
+      _conn_t *conn, *next;
+
+      for (conn = transport->conns; conn; conn = next) {
+         next = conn->next;
+         if (conn->req == &reqs[i]) {
+            _conn_close (transport, conn);
+         }
+      }
+      free (reqs[i].host);
+      free (reqs[i].port);
+   }
+   free (reqs);
+   free (fds);
+   free (polled);
+   return ret;
+}
+
+
+void
+mongocrypt_kms_transport_destroy (mongocrypt_kms_transport_t *transport)
+{
+   if (!transport) {
+      return;
+   }
+   while (transport->conns) {
+      _conn_close (transport, transport->conns);
+   }
+   if (transport->ssl_ctx) {
+      SSL_CTX_free (transport->ssl_ctx);
+   }
+   free (transport);
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_KMS_TRANSPORT_H
+#define MONGOCRYPT_KMS_TRANSPORT_H
+
+/** @file mongocrypt-kms-transport.h The optional KMS transport.
+ *
+ * libmongocrypt does no I/O. This companion library, built with
+ * ENABLE_KMS_TRANSPORT, performs the KMS step of the state machine for
+ * drivers that do not want to implement it. It is available on POSIX
+ * platforms with OpenSSL.
+ */
+
+#include "mongocrypt.h"
+#include "mongocrypt-kms-transport-export.h"
+
+
+/**
+ * Sends KMS requests over TLS, keeping connections open between requests.
+ *
+ * A transport is not thread-safe. Use one transport per thread, or guard
+ * calls with a mutex.
+ */
+typedef struct _mongocrypt_kms_transport_t mongocrypt_kms_transport_t;
+
+
+/**
+ * Create a new KMS transport.
+ *
+ * @returns A new @ref mongocrypt_kms_transport_t, or NULL if TLS could not
+ * be initialized.
+ */
+MONGOCRYPT_KMS_TRANSPORT_EXPORT
+mongocrypt_kms_transport_t *
+mongocrypt_kms_transport_new (void);
+
+
+/**
+ * Set the most connections open to one KMS endpoint.
+ *
+ * Requests to the same endpoint beyond this limit wait for a connection to
+ * finish its request.
+ *
+ * @param[in] transport The @ref mongocrypt_kms_transport_t object.
+ * @param[in] max_connections The limit, at least 1. Defaults to 8.
+ * @returns A boolean indicating success.
+ */
+MONGOCRYPT_KMS_TRANSPORT_EXPORT
+bool
+mongocrypt_kms_transport_setopt_max_connections (
+   mongocrypt_kms_transport_t *transport, uint32_t max_connections);
+
+
+/**
+ * Set how long @ref mongocrypt_kms_transport_run may take.
+ *
+ * @param[in] transport The @ref mongocrypt_kms_transport_t object.
+ * @param[in] timeout_ms The timeout in milliseconds, or 0 for no timeout.
+ * Defaults to 10000.
+ * @returns A boolean indicating success.
+ */
+MONGOCRYPT_KMS_TRANSPORT_EXPORT
+bool
+mongocrypt_kms_transport_setopt_timeout_ms (
+   mongocrypt_kms_transport_t *transport, uint32_t timeout_ms);
+
+
+/**
+ * Set a file of PEM certificates to verify KMS servers with.
+ *
+ * @param[in] transport The @ref mongocrypt_kms_transport_t object.
+ * @param[in] ca_file The path. Defaults to the system certificate store.
+ * @returns A boolean indicating success.
+ */
+MONGOCRYPT_KMS_TRANSPORT_EXPORT
+bool
+mongocrypt_kms_transport_setopt_ca_file (mongocrypt_kms_transport_t *transport,
+                                         const char *ca_file);
+
+
+/**
+ * Perform all KMS requests of a context in the state
+ * MONGOCRYPT_CTX_NEED_KMS.
+ *
+ * The requests are sent concurrently with non-blocking sockets. Requests
+ * to the same endpoint share a connection if @ref
+ * mongocrypt_setopt_kms_keep_alive was enabled, and those connections stay
+ * open for later calls. A request that fails with a retryable failure (see
+ * @ref mongocrypt_kms_ctx_failure) is sent again on a new connection, up to
+ * two times.
+ *
+ * On success, @ref mongocrypt_ctx_kms_done has been called on @p ctx.
+ *
+ * @param[in] transport The @ref mongocrypt_kms_transport_t object.
+ * @param[in] ctx The @ref mongocrypt_ctx_t object.
+ * @param[out] status Set on failure.
+ * @returns A boolean indicating success.
+ */
+MONGOCRYPT_KMS_TRANSPORT_EXPORT
+bool
+mongocrypt_kms_transport_run (mongocrypt_kms_transport_t *transport,
+                              mongocrypt_ctx_t *ctx,
+                              mongocrypt_status_t *status);
+
+
+/**
+ * Close all connections and destroy the transport.
+ *
+ * @param[in] transport The @ref mongocrypt_kms_transport_t object.
+ */
+MONGOCRYPT_KMS_TRANSPORT_EXPORT
+void
+mongocrypt_kms_transport_destroy (mongocrypt_kms_transport_t *transport);
+
+#endif /* MONGOCRYPT_KMS_TRANSPORT_H */
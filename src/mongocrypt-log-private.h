@@ -20,13 +20,42 @@
 #include "mongocrypt.h"
 #include "mongocrypt-mutex-private.h"
 
+/* A slot of the log buffer. seq is the position the slot may next be written
+ * at, or that position + 1 once written. */
+typedef struct {
+   int64_t seq;
+   mongocrypt_log_level_t level;
+   char *message;
+} _mongocrypt_log_slot_t;
+
 typedef struct {
    mongocrypt_mutex_t mutex; /* protects fn and ctx. */
    mongocrypt_log_fn_t fn;
    void *ctx;
    bool trace_enabled;
+   /* The most verbose level passed to fn. */
+   mongocrypt_log_level_t level;
+   /* If set by _mongocrypt_log_set_buffer, messages are queued here without
+    * locking, and passed to fn by _mongocrypt_log_drain. num_slots is a power
+    * of two. head and tail are the next positions to write and read. */
+   _mongocrypt_log_slot_t *slots;
+   int64_t num_slots;
+   int64_t head;
+   int64_t tail;
+   /* Messages dropped because the buffer was full. */
+   int64_t dropped;
 } _mongocrypt_log_t;
 
+/* Check this before formatting a message, so a disabled level costs no more
+ * than the check. Trace messages also require MONGOCRYPT_TRACE. fn is read
+ * without the mutex since it is only set by mongocrypt_init. */
+#define MONGOCRYPT_LOG_ENABLED(log, lvl)  \
+   ((log)->fn && (lvl) <= (log)->level && \
+    ((lvl) != MONGOCRYPT_LOG_LEVEL_TRACE || (log)->trace_enabled))
+
+#define MONGOCRYPT_LOG_TRACE_ENABLED(log) \
+   MONGOCRYPT_LOG_ENABLED (log, MONGOCRYPT_LOG_LEVEL_TRACE)
+
 void
 _mongocrypt_stdout_log_fn (mongocrypt_log_level_t level,
                            const char *message,
@@ -50,16 +79,30 @@ _mongocrypt_log_set_fn (_mongocrypt_log_t *log,
                         mongocrypt_log_fn_t fn,
                         void *ctx);
 
+/* Queue messages in a buffer of at least @capacity messages instead of
+ * calling fn. Call before logging starts. */
+void
+_mongocrypt_log_set_buffer (_mongocrypt_log_t *log, uint32_t capacity);
+
+/* Pass up to @max queued messages to fn. Returns the number passed. */
+uint32_t
+_mongocrypt_log_drain (_mongocrypt_log_t *log, uint32_t max);
+
 
 #ifdef MONGOCRYPT_ENABLE_TRACE
 
-#define CRYPT_TRACEF(log, fmt, ...)             \
-   _mongocrypt_log (log,                        \
-                    MONGOCRYPT_LOG_LEVEL_TRACE, \
-                    "(%s:%d) " fmt,             \
-                    BSON_FUNC,                  \
-                    __LINE__,                   \
-                    __VA_ARGS__)
+/* The arguments are only evaluated if trace logging is enabled. */
+#define CRYPT_TRACEF(log, fmt, ...)                   \
+   do {                                               \
+      if (MONGOCRYPT_LOG_TRACE_ENABLED (log)) {       \
+         _mongocrypt_log (log,                        \
+                          MONGOCRYPT_LOG_LEVEL_TRACE, \
+                          "(%s:%d) " fmt,             \
+                          BSON_FUNC,                  \
+                          __LINE__,                   \
+                          __VA_ARGS__);               \
+      }                                               \
+   } while (0)
 
 #define CRYPT_TRACE(log, msg) CRYPT_TRACEF (crypt, "%s", msg)
 
@@ -26,6 +26,7 @@ _mongocrypt_log_init (_mongocrypt_log_t *log)
    _mongocrypt_mutex_init (&log->mutex);
    /* Initially, no log function is set. */
    _mongocrypt_log_set_fn (log, NULL, NULL);
+   log->level = MONGOCRYPT_LOG_LEVEL_TRACE;
 #ifdef MONGOCRYPT_ENABLE_TRACE
    log->trace_enabled = (getenv ("MONGOCRYPT_TRACE") != NULL);
 #endif
@@ -35,6 +36,13 @@ _mongocrypt_log_init (_mongocrypt_log_t *log)
 void
 _mongocrypt_log_cleanup (_mongocrypt_log_t *log)
 {
+   int64_t i;
+
+   /* Undelivered messages are dropped. */
+   for (i = 0; i < log->num_slots; i++) {
+      bson_free (log->slots[i].message);
+   }
+   bson_free (log->slots);
    _mongocrypt_mutex_cleanup (&log->mutex);
    memset (log, 0, sizeof (*log));
 }
@@ -78,6 +86,109 @@ _mongocrypt_log_set_fn (_mongocrypt_log_t *log,
 }
 
 
+void
+_mongocrypt_log_set_buffer (_mongocrypt_log_t *log, uint32_t capacity)
+{
+   int64_t i;
+
+   BSON_ASSERT (!log->slots);
+   BSON_ASSERT (capacity > 0);
+
+   log->num_slots = 1;
+   while (log->num_slots < (int64_t) capacity) {
+      log->num_slots *= 2;
+   }
+   log->slots = bson_malloc0 (sizeof (*log->slots) * (size_t) log->num_slots);
+   BSON_ASSERT (log->slots);
+   for (i = 0; i < log->num_slots; i++) {
+      log->slots[i].seq = i;
+   }
+}
+
+
+/* Queue @message, taking it. Returns false if the buffer is full. Several
+ * threads may push at once: each claims a position by advancing head, then
+ * publishes its slot by advancing the slot's seq. */
+static bool
+_push (_mongocrypt_log_t *log, mongocrypt_log_level_t level, char *message)
+{
+   _mongocrypt_log_slot_t *slot;
+   int64_t pos, seq;
+
+   pos = _mongocrypt_atomic_load_int64 (&log->head);
+   for (;;) {
+      slot = &log->slots[pos & (log->num_slots - 1)];
+      seq = _mongocrypt_atomic_load_acquire_int64 (&slot->seq);
+      if (seq == pos) {
+         if (_mongocrypt_atomic_cas_int64 (&log->head, pos, pos + 1)) {
+            break;
+         }
+      } else if (seq < pos) {
+         /* The slot still holds a message from the previous lap. */
+         return false;
+      }
+      pos = _mongocrypt_atomic_load_int64 (&log->head);
+   }
+   slot->level = level;
+   slot->message = message;
+   _mongocrypt_atomic_store_release_int64 (&slot->seq, pos + 1);
+   return true;
+}
+
+
+/* Take the oldest queued message. Returns false if there is none. */
+static bool
+_pop (_mongocrypt_log_t *log, mongocrypt_log_level_t *level, char **message)
+{
+   _mongocrypt_log_slot_t *slot;
+   int64_t pos, seq;
+
+   pos = _mongocrypt_atomic_load_int64 (&log->tail);
+   for (;;) {
+      slot = &log->slots[pos & (log->num_slots - 1)];
+      seq = _mongocrypt_atomic_load_acquire_int64 (&slot->seq);
+      if (seq == pos + 1) {
+         if (_mongocrypt_atomic_cas_int64 (&log->tail, pos, pos + 1)) {
+            break;
+         }
+      } else if (seq < pos + 1) {
+         return false;
+      }
+      pos = _mongocrypt_atomic_load_int64 (&log->tail);
+   }
+   *level = slot->level;
+   *message = slot->message;
+   slot->message = NULL;
+   /* Free the slot for the next lap. */
+   _mongocrypt_atomic_store_release_int64 (&slot->seq, pos + log->num_slots);
+   return true;
+}
+
+
+uint32_t
+_mongocrypt_log_drain (_mongocrypt_log_t *log, uint32_t max)
+{
+   mongocrypt_log_level_t level;
+   char *message;
+   uint32_t n = 0;
+
+   if (!log->slots) {
+      return 0;
+   }
+
+   while (n < max && _pop (log, &level, &message)) {
+      _mongocrypt_mutex_lock (&log->mutex);
+      if (log->fn) {
+         log->fn (level, message, (uint32_t) strlen (message), log->ctx);
+      }
+      _mongocrypt_mutex_unlock (&log->mutex);
+      bson_free (message);
+      n++;
+   }
+   return n;
+}
+
+
 void
 _mongocrypt_log (_mongocrypt_log_t *log,
                  mongocrypt_log_level_t level,
@@ -87,7 +198,7 @@ _mongocrypt_log (_mongocrypt_log_t *log,
    va_list args;
    char *message;
 
-   if (level == MONGOCRYPT_LOG_LEVEL_TRACE && !log->trace_enabled) {
+   if (!MONGOCRYPT_LOG_ENABLED (log, level)) {
       return;
    }
 
@@ -99,6 +210,14 @@ _mongocrypt_log (_mongocrypt_log_t *log,
 
    BSON_ASSERT (message);
 
+   if (log->slots) {
+      if (!_push (log, level, message)) {
+         _mongocrypt_atomic_add_int64 (&log->dropped, 1);
+         bson_free (message);
+      }
+      return;
+   }
+
    _mongocrypt_mutex_lock (&log->mutex);
    if (log->fn) {
       log->fn (level, message, (uint32_t) strlen (message), log->ctx);
@@ -0,0 +1,645 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-private.h"
+#include "mongocrypt-ctx-private.h"
+#include "mongocrypt-marking-private.h"
+
+/* Marks commands from the JSON schema without mongocryptd.
+ *
+ * Only a subset of JSON schema is supported: nested 'properties',
+ * 'encryptMetadata', and 'encrypt' with a keyId of one UUID. Any other
+ * keyword that could affect encryption, and any command shape other than
+ * insert or a find with a filter of equalities, is reported as unsupported
+ * so the caller can fall back to mongocryptd, which reports errors. */
+
+#define UUID_LEN 16
+
+typedef struct {
+   int32_t algorithm;     /* 0 if unset. */
+   const uint8_t *key_id; /* UUID_LEN bytes, or NULL if unset. */
+   const char *bson_type; /* NULL if unset. */
+} _encrypt_opts_t;
+
+typedef struct {
+   /* The options of 'encrypt', or the inherited 'encryptMetadata'. */
+   _encrypt_opts_t opts;
+   bool encrypt;
+   bool has_properties;
+   bson_iter_t properties;
+} _node_t;
+
+static const struct {
+   const char *name;
+   bson_type_t type;
+} _bson_type_names[] = {{"double", BSON_TYPE_DOUBLE},
+                        {"string", BSON_TYPE_UTF8},
+                        {"object", BSON_TYPE_DOCUMENT},
+                        {"array", BSON_TYPE_ARRAY},
+                        {"binData", BSON_TYPE_BINARY},
+                        {"objectId", BSON_TYPE_OID},
+                        {"bool", BSON_TYPE_BOOL},
+                        {"date", BSON_TYPE_DATE_TIME},
+                        {"regex", BSON_TYPE_REGEX},
+                        {"dbPointer", BSON_TYPE_DBPOINTER},
+                        {"javascript", BSON_TYPE_CODE},
+                        {"symbol", BSON_TYPE_SYMBOL},
+                        {"javascriptWithScope", BSON_TYPE_CODEWSCOPE},
+                        {"int", BSON_TYPE_INT32},
+                        {"timestamp", BSON_TYPE_TIMESTAMP},
+                        {"long", BSON_TYPE_INT64},
+                        {"decimal", BSON_TYPE_DECIMAL128}};
+
+/* Command fields that do not affect marking. */
+static const char *_generic_fields[] = {"$db",
+                                        "lsid",
+                                        "txnNumber",
+                                        "autocommit",
+                                        "startTransaction",
+                                        "readConcern",
+                                        "writeConcern",
+                                        "$readPreference",
+                                        "$clusterTime",
+                                        "maxTimeMS",
+                                        "comment"};
+static const char *_insert_fields[] = {"ordered", "bypassDocumentValidation"};
+static const char *_find_fields[] = {"limit", "skip", "batchSize", "singleBatch"};
+
+
+static bool
+_in_list (const char *key, const char **list, size_t len)
+{
+   size_t i;
+
+   for (i = 0; i < len; i++) {
+      if (0 == strcmp (key, list[i])) {
+         return true;
+      }
+   }
+   return false;
+}
+
+
+/* Parse an 'encrypt' or 'encryptMetadata' document into @opts. Fields it
+ * does not set keep their value. */
+static bool
+_parse_encrypt_opts (bson_iter_t *iter, bool is_encrypt, _encrypt_opts_t *opts)
+{
+   bson_iter_t child;
+
+   if (!BSON_ITER_HOLDS_DOCUMENT (iter) || !bson_iter_recurse (iter, &child)) {
+      return false;
+   }
+
+   while (bson_iter_next (&child)) {
+      const char *key;
+
+      key = bson_iter_key (&child);
+      if (0 == strcmp (key, "keyId")) {
+         bson_iter_t key_ids;
+         bson_subtype_t subtype;
+         uint32_t len;
+         const uint8_t *data;
+
+         /* A JSON pointer to a key alt name is not supported. */
+         if (!BSON_ITER_HOLDS_ARRAY (&child) ||
+             !bson_iter_recurse (&child, &key_ids) ||
+             !bson_iter_next (&key_ids) || !BSON_ITER_HOLDS_BINARY (&key_ids)) {
+            return false;
+         }
+         bson_iter_binary (&key_ids, &subtype, &len, &data);
+         if (subtype != BSON_SUBTYPE_UUID || len != UUID_LEN ||
+             bson_iter_next (&key_ids)) {
+            return false;
+         }
+         opts->key_id = data;
+      } else if (0 == strcmp (key, "algorithm")) {
+         const char *algorithm;
+
+         if (!BSON_ITER_HOLDS_UTF8 (&child)) {
+            return false;
+         }
+         algorithm = bson_iter_utf8 (&child, NULL);
+         if (0 == strcmp (algorithm, ALGORITHM_DETERMINISTIC)) {
+            opts->algorithm = MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC;
+         } else if (0 == strcmp (algorithm, ALGORITHM_RANDOM)) {
+            opts->algorithm = MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM;
+         } else if (0 == strcmp (algorithm, ALGORITHM_RANDOM_COMPRESSED)) {
+            opts->algorithm = MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM_COMPRESSED;
+         } else {
+            return false;
+         }
+      } else if (is_encrypt && 0 == strcmp (key, "bsonType")) {
+         if (!BSON_ITER_HOLDS_UTF8 (&child)) {
+            return false;
+         }
+         opts->bson_type = bson_iter_utf8 (&child, NULL);
+      } else {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/* Parse the schema at @iter, inheriting @inherited. */
+static bool
+_node_parse (bson_iter_t *iter,
+             const _encrypt_opts_t *inherited,
+             _node_t *node)
+{
+   bson_iter_t child, metadata, encrypt;
+   bool has_metadata = false, has_validation = false;
+
+   memset (node, 0, sizeof (*node));
+   node->opts = *inherited;
+   node->opts.bson_type = NULL;
+
+   if (!BSON_ITER_HOLDS_DOCUMENT (iter) || !bson_iter_recurse (iter, &child)) {
+      return false;
+   }
+
+   while (bson_iter_next (&child)) {
+      const char *key;
+
+      key = bson_iter_key (&child);
+      if (0 == strcmp (key, "encrypt")) {
+         memcpy (&encrypt, &child, sizeof (child));
+         node->encrypt = true;
+      } else if (0 == strcmp (key, "encryptMetadata")) {
+         memcpy (&metadata, &child, sizeof (child));
+         has_metadata = true;
+      } else if (0 == strcmp (key, "properties")) {
+         if (!BSON_ITER_HOLDS_DOCUMENT (&child)) {
+            return false;
+         }
+         memcpy (&node->properties, &child, sizeof (child));
+         node->has_properties = true;
+      } else if (0 == strcmp (key, "additionalProperties")) {
+         /* A schema for additional properties may encrypt them. */
+         if (!BSON_ITER_HOLDS_BOOL (&child)) {
+            return false;
+         }
+         has_validation = true;
+      } else if (0 == strcmp (key, "bsonType") || 0 == strcmp (key, "type") ||
+                 0 == strcmp (key, "required")) {
+         has_validation = true;
+      } else if (0 != strcmp (key, "title") &&
+                 0 != strcmp (key, "description")) {
+         return false;
+      }
+   }
+
+   if (has_metadata && !_parse_encrypt_opts (&metadata, false, &node->opts)) {
+      return false;
+   }
+
+   if (node->encrypt) {
+      if (node->has_properties || has_metadata || has_validation ||
+          !_parse_encrypt_opts (&encrypt, true, &node->opts) ||
+          !node->opts.algorithm || !node->opts.key_id) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/* Check that every node of the schema is supported, and whether any field
+ * is encrypted. */
+static bool
+_check_schema (bson_iter_t *iter,
+               const _encrypt_opts_t *inherited,
+               bool *requires_encryption)
+{
+   _node_t node;
+   bson_iter_t child;
+
+   if (!_node_parse (iter, inherited, &node)) {
+      return false;
+   }
+
+   if (node.encrypt) {
+      *requires_encryption = true;
+      return true;
+   }
+
+   if (!node.has_properties) {
+      return true;
+   }
+
+   if (!bson_iter_recurse (&node.properties, &child)) {
+      return false;
+   }
+   while (bson_iter_next (&child)) {
+      if (!_check_schema (&child, &node.opts, requires_encryption)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+static bool
+_find_property (const _node_t *node, const char *key, bson_iter_t *out)
+{
+   if (!node->has_properties) {
+      return false;
+   }
+   return bson_iter_recurse (&node->properties, out) &&
+          bson_iter_find (out, key);
+}
+
+
+/* Returns false for values mongocryptd would refuse to mark. */
+static bool
+_permitted (const _encrypt_opts_t *opts, bson_iter_t *value)
+{
+   bson_type_t type;
+   size_t i;
+
+   type = bson_iter_type (value);
+   if (opts->bson_type) {
+      for (i = 0; i < sizeof (_bson_type_names) / sizeof (_bson_type_names[0]);
+           i++) {
+         if (0 == strcmp (opts->bson_type, _bson_type_names[i].name)) {
+            break;
+         }
+      }
+      if (i == sizeof (_bson_type_names) / sizeof (_bson_type_names[0]) ||
+          _bson_type_names[i].type != type) {
+         return false;
+      }
+   }
+
+   switch (type) {
+   case BSON_TYPE_EOD:
+   case BSON_TYPE_NULL:
+   case BSON_TYPE_MINKEY:
+   case BSON_TYPE_MAXKEY:
+   case BSON_TYPE_UNDEFINED:
+      return false;
+   case BSON_TYPE_BINARY: {
+      bson_subtype_t subtype;
+      uint32_t len;
+      const uint8_t *data;
+
+      bson_iter_binary (value, &subtype, &len, &data);
+      return subtype != 6;
+   }
+   case BSON_TYPE_DOUBLE:
+   case BSON_TYPE_DOCUMENT:
+   case BSON_TYPE_ARRAY:
+   case BSON_TYPE_CODEWSCOPE:
+   case BSON_TYPE_BOOL:
+   case BSON_TYPE_DECIMAL128:
+      return opts->algorithm != MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC;
+   default:
+      return true;
+   }
+}
+
+
+/* Append a marking of @value in the format read by
+ * _mongocrypt_marking_parse_unowned. */
+static bool
+_append_marking (bson_t *out,
+                 const char *key,
+                 const _encrypt_opts_t *opts,
+                 bson_iter_t *value)
+{
+   bson_t marking;
+   _mongocrypt_buffer_t buf;
+   bool ret;
+
+   if (!_permitted (opts, value)) {
+      return false;
+   }
+
+   bson_init (&marking);
+   BSON_APPEND_INT32 (&marking, "a", opts->algorithm);
+   BSON_APPEND_BINARY (&marking, "ki", BSON_SUBTYPE_UUID, opts->key_id, UUID_LEN);
+   bson_append_iter (&marking, "v", 1, value);
+
+   _mongocrypt_buffer_init (&buf);
+   _mongocrypt_buffer_resize (&buf, marking.len + 1);
+   buf.data[0] = 0;
+   memcpy (buf.data + 1, bson_get_data (&marking), marking.len);
+   ret = bson_append_binary (
+      out, key, -1, (bson_subtype_t) 6, buf.data, buf.len);
+   _mongocrypt_buffer_cleanup (&buf);
+   bson_destroy (&marking);
+   return ret;
+}
+
+
+/* Append the fields of a document to @out, replacing each field that the
+ * object schema @node encrypts with a marking. */
+static bool
+_mark_doc (bson_iter_t *iter, const _node_t *node, bson_t *out, bool *marked)
+{
+   while (bson_iter_next (iter)) {
+      const char *key;
+      bson_iter_t prop, child;
+      _node_t child_node;
+      bson_t child_out;
+      bool ok;
+
+      key = bson_iter_key (iter);
+      if (!_find_property (node, key, &prop)) {
+         bson_append_iter (out, NULL, 0, iter);
+         continue;
+      }
+      if (!_node_parse (&prop, &node->opts, &child_node)) {
+         return false;
+      }
+
+      if (child_node.encrypt) {
+         if (!_append_marking (out, key, &child_node.opts, iter)) {
+            return false;
+         }
+         *marked = true;
+         continue;
+      }
+
+      if (!child_node.has_properties) {
+         bson_append_iter (out, NULL, 0, iter);
+         continue;
+      }
+
+      if (BSON_ITER_HOLDS_ARRAY (iter)) {
+         /* mongocryptd decides whether the properties apply. */
+         return false;
+      }
+
+      if (!BSON_ITER_HOLDS_DOCUMENT (iter)) {
+         bson_append_iter (out, NULL, 0, iter);
+         continue;
+      }
+
+      if (!bson_iter_recurse (iter, &child)) {
+         return false;
+      }
+      bson_append_document_begin (out, key, -1, &child_out);
+      ok = _mark_doc (&child, &child_node, &child_out, marked);
+      bson_append_document_end (out, &child_out);
+      if (!ok) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+static bool
+_mark_insert_documents (bson_iter_t *iter,
+                        const _node_t *root,
+                        bson_t *out,
+                        bool *marked)
+{
+   bson_iter_t docs;
+   bson_t docs_out;
+   bool ok = true;
+
+   if (!BSON_ITER_HOLDS_ARRAY (iter) || !bson_iter_recurse (iter, &docs)) {
+      return false;
+   }
+
+   bson_append_array_begin (out, bson_iter_key (iter), -1, &docs_out);
+   while (ok && bson_iter_next (&docs)) {
+      bson_iter_t doc;
+      bson_t doc_out;
+
+      if (!BSON_ITER_HOLDS_DOCUMENT (&docs) ||
+          !bson_iter_recurse (&docs, &doc)) {
+         ok = false;
+         break;
+      }
+      bson_append_document_begin (
+         &docs_out, bson_iter_key (&docs), -1, &doc_out);
+      ok = _mark_doc (&doc, root, &doc_out, marked);
+      bson_append_document_end (&docs_out, &doc_out);
+   }
+   bson_append_array_end (out, &docs_out);
+   return ok;
+}
+
+
+/* Resolve a dotted path of a filter. Sets *encrypted, and @node if it is
+ * set. Returns false if the path is not supported. */
+static bool
+_resolve_path (const _node_t *root,
+               const char *path,
+               _node_t *node,
+               bool *encrypted)
+{
+   _node_t current;
+   char *copy, *part, *next;
+   bool ret = true;
+
+   *encrypted = false;
+   copy = bson_strdup (path);
+   memcpy (&current, root, sizeof (current));
+   for (part = copy; part; part = next) {
+      bson_iter_t prop;
+      _node_t child;
+
+      next = strchr (part, '.');
+      if (next) {
+         *next++ = '\0';
+      }
+
+      if (!_find_property (&current, part, &prop)) {
+         /* Nothing below an unknown field is encrypted. */
+         break;
+      }
+      if (!_node_parse (&prop, &current.opts, &child)) {
+         ret = false;
+         break;
+      }
+      memcpy (&current, &child, sizeof (child));
+      if (current.encrypt) {
+         /* A path through an encrypted field cannot be queried. */
+         if (next) {
+            ret = false;
+         } else {
+            memcpy (node, &current, sizeof (current));
+            *encrypted = true;
+         }
+         break;
+      }
+   }
+   bson_free (copy);
+   return ret;
+}
+
+
+/* Mark a filter of the form {<path>: <value> | {$eq: <value>}, ...}. */
+static bool
+_mark_filter (bson_iter_t *iter,
+              const _node_t *root,
+              bson_t *out,
+              bool *marked)
+{
+   bson_iter_t filter;
+   bson_t filter_out;
+   bool ok = true;
+
+   if (!BSON_ITER_HOLDS_DOCUMENT (iter) || !bson_iter_recurse (iter, &filter)) {
+      return false;
+   }
+
+   bson_append_document_begin (out, bson_iter_key (iter), -1, &filter_out);
+   while (ok && bson_iter_next (&filter)) {
+      const char *path;
+      bson_iter_t value;
+      bool is_eq = false, encrypted;
+      _node_t node;
+
+      path = bson_iter_key (&filter);
+      memcpy (&value, &filter, sizeof (value));
+      if (path[0] == '$') {
+         ok = false;
+         break;
+      }
+
+      if (BSON_ITER_HOLDS_DOCUMENT (&filter)) {
+         bson_iter_t rest;
+
+         /* Only {$eq: <value>} is supported. */
+         if (!bson_iter_recurse (&filter, &value) ||
+             !bson_iter_next (&value) ||
+             0 != strcmp (bson_iter_key (&value), "$eq")) {
+            ok = false;
+            break;
+         }
+         memcpy (&rest, &value, sizeof (value));
+         if (bson_iter_next (&rest)) {
+            ok = false;
+            break;
+         }
+         is_eq = true;
+      }
+      if (BSON_ITER_HOLDS_DOCUMENT (&value) || BSON_ITER_HOLDS_ARRAY (&value)) {
+         ok = false;
+         break;
+      }
+
+      if (!_resolve_path (root, path, &node, &encrypted)) {
+         ok = false;
+         break;
+      }
+
+      if (!encrypted) {
+         bson_append_iter (&filter_out, NULL, 0, &filter);
+         continue;
+      }
+
+      /* Random encryption does not support queries. */
+      if (node.opts.algorithm != MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC) {
+         ok = false;
+         break;
+      }
+
+      if (is_eq) {
+         bson_t eq;
+
+         bson_append_document_begin (&filter_out, path, -1, &eq);
+         ok = _append_marking (&eq, "$eq", &node.opts, &value);
+         bson_append_document_end (&filter_out, &eq);
+      } else {
+         ok = _append_marking (&filter_out, path, &node.opts, &value);
+      }
+      *marked = true;
+   }
+   bson_append_document_end (out, &filter_out);
+   return ok;
+}
+
+
+bool
+_mongocrypt_marking_mark_locally (const bson_t *schema,
+                                  const bson_t *cmd,
+                                  bson_t *reply)
+{
+   _encrypt_opts_t no_opts = {0};
+   _node_t root;
+   bson_t schema_doc, result;
+   bson_iter_t iter;
+   const char *cmd_name;
+   bool requires_encryption = false, marked = false, ok = true;
+
+   bson_init (reply);
+
+   /* Wrap the schema so it can be parsed as a node. */
+   bson_init (&schema_doc);
+   BSON_APPEND_DOCUMENT (&schema_doc, "schema", schema);
+   if (!bson_iter_init_find (&iter, &schema_doc, "schema") ||
+       !_check_schema (&iter, &no_opts, &requires_encryption) ||
+       !_node_parse (&iter, &no_opts, &root) || root.encrypt) {
+      bson_destroy (&schema_doc);
+      return false;
+   }
+
+   if (!bson_iter_init (&iter, cmd) || !bson_iter_next (&iter)) {
+      bson_destroy (&schema_doc);
+      return false;
+   }
+   cmd_name = bson_iter_key (&iter);
+   if (0 != strcmp (cmd_name, "insert") && 0 != strcmp (cmd_name, "find")) {
+      bson_destroy (&schema_doc);
+      return false;
+   }
+
+   bson_init (&result);
+   bson_append_iter (&result, NULL, 0, &iter);
+   while (ok && bson_iter_next (&iter)) {
+      const char *key;
+
+      key = bson_iter_key (&iter);
+      if (_in_list (key,
+                    _generic_fields,
+                    sizeof (_generic_fields) / sizeof (_generic_fields[0]))) {
+         bson_append_iter (&result, NULL, 0, &iter);
+      } else if (cmd_name[0] == 'i' && 0 == strcmp (key, "documents")) {
+         ok = _mark_insert_documents (&iter, &root, &result, &marked);
+      } else if (cmd_name[0] == 'i' &&
+                 _in_list (key,
+                           _insert_fields,
+                           sizeof (_insert_fields) /
+                              sizeof (_insert_fields[0]))) {
+         bson_append_iter (&result, NULL, 0, &iter);
+      } else if (cmd_name[0] == 'f' && 0 == strcmp (key, "filter")) {
+         ok = _mark_filter (&iter, &root, &result, &marked);
+      } else if (cmd_name[0] == 'f' &&
+                 _in_list (key,
+                           _find_fields,
+                           sizeof (_find_fields) / sizeof (_find_fields[0]))) {
+         bson_append_iter (&result, NULL, 0, &iter);
+      } else {
+         ok = false;
+      }
+   }
+
+   if (ok) {
+      BSON_APPEND_BOOL (reply, "hasEncryptedPlaceholders", marked);
+      BSON_APPEND_BOOL (reply, "schemaRequiresEncryption", requires_encryption);
+      BSON_APPEND_DOCUMENT (reply, "result", &result);
+   }
+   bson_destroy (&result);
+   bson_destroy (&schema_doc);
+   return ok;
+}
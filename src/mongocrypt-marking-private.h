@@ -42,6 +42,29 @@ _mongocrypt_marking_parse_unowned (const _mongocrypt_buffer_t *in,
                                    mongocrypt_status_t *status)
    MONGOCRYPT_WARN_UNUSED_RESULT;
 
+/* Mark @cmd with @schema without mongocryptd. Only insert, and find with a
+ * filter of equalities, are supported. @reply is initialized to the
+ * equivalent of a mongocryptd reply. Returns false if the command or schema
+ * is not supported, in which case mongocryptd must mark @cmd. */
+bool
+_mongocrypt_marking_mark_locally (const bson_t *schema,
+                                  const bson_t *cmd,
+                                  bson_t *reply);
+
+/* Look up the key of @marking, and set @job and @ciphertext up to encrypt
+ * it. Random IVs are generated. @ctx is the key broker. @ciphertext->data is
+ * filled in by encrypting @job. If @serialized is set, it is allocated for the
+ * serialized ciphertext, and @ciphertext->data points into it. Always clean up
+ * @job with _mongocrypt_encryption_job_cleanup. */
+bool
+_mongocrypt_marking_prepare_encryption (void *ctx,
+                                        _mongocrypt_marking_t *marking,
+                                        _mongocrypt_ciphertext_t *ciphertext,
+                                        _mongocrypt_buffer_t *serialized,
+                                        _mongocrypt_encryption_job_t *job,
+                                        mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
 bool
 _mongocrypt_marking_to_ciphertext (void *ctx,
                                    _mongocrypt_marking_t *marking,
@@ -49,5 +72,14 @@ _mongocrypt_marking_to_ciphertext (void *ctx,
                                    mongocrypt_status_t *status)
    MONGOCRYPT_WARN_UNUSED_RESULT;
 
+/* Like _mongocrypt_marking_to_ciphertext, but encrypts straight into the
+ * serialized ciphertext @out. */
+bool
+_mongocrypt_marking_to_serialized_ciphertext (void *ctx,
+                                              _mongocrypt_marking_t *marking,
+                                              _mongocrypt_buffer_t *out,
+                                              mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
 
 #endif /* MONGOCRYPT_MARKING_PRIVATE_H */
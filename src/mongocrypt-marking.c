@@ -16,7 +16,9 @@
 
 #include "mongocrypt.h"
 #include "mongocrypt-buffer-private.h"
+#include "mongocrypt-cache-ciphertext-private.h"
 #include "mongocrypt-ciphertext-private.h"
+#include "mongocrypt-compress-private.h"
 #include "mongocrypt-crypto-private.h"
 #include "mongocrypt-key-broker-private.h"
 #include "mongocrypt-marking-private.h"
@@ -102,7 +104,8 @@ _mongocrypt_marking_parse_unowned (const _mongocrypt_buffer_t *in,
          }
          algorithm = bson_iter_int32 (&iter);
          if (algorithm != MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC &&
-             algorithm != MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM) {
+             algorithm != MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM &&
+             algorithm != MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM_COMPRESSED) {
             CLIENT_ERR ("invalid algorithm value: %d", algorithm);
             return false;
          }
@@ -154,41 +157,43 @@ _mongocrypt_marking_cleanup (_mongocrypt_marking_t *marking)
 
 
 bool
-_mongocrypt_marking_to_ciphertext (void *ctx,
-                                   _mongocrypt_marking_t *marking,
-                                   _mongocrypt_ciphertext_t *ciphertext,
-                                   mongocrypt_status_t *status)
+_mongocrypt_marking_prepare_encryption (void *ctx,
+                                        _mongocrypt_marking_t *marking,
+                                        _mongocrypt_ciphertext_t *ciphertext,
+                                        _mongocrypt_buffer_t *serialized,
+                                        _mongocrypt_encryption_job_t *job,
+                                        mongocrypt_status_t *status)
 {
-   _mongocrypt_buffer_t plaintext;
-   _mongocrypt_buffer_t iv;
    _mongocrypt_key_broker_t *kb;
-   _mongocrypt_buffer_t associated_data;
-   _mongocrypt_buffer_t key_material;
    _mongocrypt_buffer_t key_id;
+   uint32_t ciphertext_len;
    bool ret = false;
    bool key_found;
-   uint32_t bytes_written;
 
    BSON_ASSERT (marking);
    BSON_ASSERT (ciphertext);
+   BSON_ASSERT (job);
    BSON_ASSERT (status);
    BSON_ASSERT (ctx);
 
-   _mongocrypt_buffer_init (&plaintext);
-   _mongocrypt_buffer_init (&associated_data);
-   _mongocrypt_buffer_init (&iv);
+   _mongocrypt_encryption_job_init (job);
    _mongocrypt_buffer_init (&key_id);
-   _mongocrypt_buffer_init (&key_material);
 
    kb = (_mongocrypt_key_broker_t *) ctx;
 
    /* Get the decrypted key for this marking. */
    if (marking->has_alt_name) {
       key_found = _mongocrypt_key_broker_decrypted_key_by_name (
-         kb, &marking->key_alt_name, &key_material, &key_id);
+         kb, &marking->key_alt_name, &job->key, &key_id, &job->native_key);
    } else if (!_mongocrypt_buffer_empty (&marking->key_id)) {
-      key_found = _mongocrypt_key_broker_decrypted_key_by_id (
-         kb, &marking->key_id, &key_material);
+      const _mongocrypt_buffer_t *borrowed;
+
+      /* Borrow the key material, markings often share a key. */
+      key_found = _mongocrypt_key_broker_borrow_decrypted_key (
+         kb, &marking->key_id, &borrowed, &job->native_key);
+      if (key_found) {
+         _mongocrypt_buffer_set_to (borrowed, &job->key);
+      }
       _mongocrypt_buffer_copy_to (&marking->key_id, &key_id);
    } else {
       CLIENT_ERR ("marking must have either key_id or key_alt_name");
@@ -200,62 +205,61 @@ _mongocrypt_marking_to_ciphertext (void *ctx,
       goto fail;
    }
 
+   _mongocrypt_buffer_from_iter (&job->plaintext, &marking->v_iter);
+
    _mongocrypt_ciphertext_init (ciphertext);
    ciphertext->original_bson_type = (uint8_t) bson_iter_type (&marking->v_iter);
    ciphertext->blob_subtype = marking->algorithm;
+   if (marking->algorithm ==
+       MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM_COMPRESSED) {
+      _mongocrypt_buffer_t compressed;
+
+      /* The blob subtype tells decryption whether to decompress. */
+      if (_mongocrypt_compress (&job->plaintext, &compressed)) {
+         _mongocrypt_buffer_cleanup (&job->plaintext);
+         _mongocrypt_buffer_steal (&job->plaintext, &compressed);
+      } else {
+         ciphertext->blob_subtype = MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM;
+      }
+      _mongocrypt_buffer_cleanup (&compressed);
+   }
    _mongocrypt_buffer_copy_to (&key_id, &ciphertext->key_id);
-   if (!_mongocrypt_ciphertext_serialize_associated_data (ciphertext,
-                                                          &associated_data)) {
+   if (!_mongocrypt_ciphertext_serialize_associated_data (
+          ciphertext, &job->associated_data)) {
       CLIENT_ERR ("could not serialize associated data");
       goto fail;
    }
 
-   _mongocrypt_buffer_from_iter (&plaintext, &marking->v_iter);
-   ciphertext->data.len = _mongocrypt_calculate_ciphertext_len (plaintext.len);
-   ciphertext->data.data = bson_malloc (ciphertext->data.len);
-   BSON_ASSERT (ciphertext->data.data);
-
-   ciphertext->data.owned = true;
-
-   switch (marking->algorithm) {
-   case MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC:
-      /* Use deterministic encryption. */
-      _mongocrypt_buffer_resize (&iv, MONGOCRYPT_IV_LEN);
-      ret = _mongocrypt_calculate_deterministic_iv (kb->crypt->crypto,
-                                                    &key_material,
-                                                    &plaintext,
-                                                    &associated_data,
-                                                    &iv,
-                                                    status);
-      if (!ret) {
+   ciphertext_len = _mongocrypt_calculate_ciphertext_len (job->plaintext.len);
+   if (serialized) {
+      if (!_mongocrypt_ciphertext_reserve (
+             ciphertext, ciphertext_len, serialized)) {
+         CLIENT_ERR ("could not serialize ciphertext");
          goto fail;
       }
+   } else {
+      _mongocrypt_arena_buffer (kb->arena, &ciphertext->data, ciphertext_len);
+   }
+   job->ciphertext = &ciphertext->data;
 
-      ret = _mongocrypt_do_encryption (kb->crypt->crypto,
-                                       &iv,
-                                       &associated_data,
-                                       &key_material,
-                                       &plaintext,
-                                       &ciphertext->data,
-                                       &bytes_written,
-                                       status);
+   _mongocrypt_arena_buffer (kb->arena, &job->iv, MONGOCRYPT_IV_LEN);
+   switch (marking->algorithm) {
+   case MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC:
+      /* Use deterministic encryption. The IV is computed from the plaintext
+       * when encrypting. */
+      job->deterministic = true;
       break;
    case MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM:
+   case MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM_COMPRESSED:
       /* Use randomized encryption.
        * In this case, we must generate a new, random iv. */
-      _mongocrypt_buffer_resize (&iv, MONGOCRYPT_IV_LEN);
-      if (!_mongocrypt_random (
-             kb->crypt->crypto, &iv, MONGOCRYPT_IV_LEN, status)) {
+      if (!_mongocrypt_random_pool_take (&kb->crypt->random_pool,
+                                         kb->crypt->crypto,
+                                         &job->iv,
+                                         MONGOCRYPT_IV_LEN,
+                                         status)) {
          goto fail;
       }
-      ret = _mongocrypt_do_encryption (kb->crypt->crypto,
-                                       &iv,
-                                       &associated_data,
-                                       &key_material,
-                                       &plaintext,
-                                       &ciphertext->data,
-                                       &bytes_written,
-                                       status);
       break;
    default:
       /* Error. */
@@ -263,19 +267,127 @@ _mongocrypt_marking_to_ciphertext (void *ctx,
       goto fail;
    }
 
-   if (!ret) {
-      goto fail;
+   ret = true;
+
+fail:
+   _mongocrypt_buffer_cleanup (&key_id);
+   return ret;
+}
+
+
+static bool
+_to_ciphertext (void *ctx,
+                _mongocrypt_marking_t *marking,
+                _mongocrypt_ciphertext_t *ciphertext,
+                _mongocrypt_buffer_t *serialized,
+                mongocrypt_status_t *status)
+{
+   _mongocrypt_encryption_job_t job;
+   _mongocrypt_key_broker_t *kb;
+   _mongocrypt_cache_ciphertext_attr_t attr;
+   bool use_cache;
+   bool ret = false;
+   uint32_t bytes_written;
+
+   kb = (_mongocrypt_key_broker_t *) ctx;
+
+   if (!_mongocrypt_marking_prepare_encryption (
+          ctx, marking, ciphertext, serialized, &job, status)) {
+      goto done;
+   }
+
+   use_cache = job.deterministic && kb->crypt->opts.use_ciphertext_cache;
+   if (use_cache) {
+      _mongocrypt_buffer_t *cached = NULL;
+
+      /* The attribute borrows the key id and plaintext. */
+      _mongocrypt_buffer_set_to (&ciphertext->key_id, &attr.key_id);
+      attr.original_bson_type = ciphertext->original_bson_type;
+      _mongocrypt_buffer_set_to (&job.plaintext, &attr.plaintext);
+      if (!_mongocrypt_cache_get (
+             &kb->crypt->cache_ciphertext, &attr, (void **) &cached)) {
+         CLIENT_ERR ("failed to lookup ciphertext cache");
+         goto done;
+      }
+      if (cached) {
+         ret = cached->len == ciphertext->data.len;
+         if (ret) {
+            memcpy (ciphertext->data.data, cached->data, cached->len);
+         }
+         _mongocrypt_buffer_cleanup (cached);
+         bson_free (cached);
+         if (ret) {
+            goto done;
+         }
+      }
+   }
+
+   if (job.deterministic &&
+       !_mongocrypt_calculate_deterministic_iv (kb->crypt->crypto,
+                                                &job.key,
+                                                job.native_key,
+                                                &job.plaintext,
+                                                &job.associated_data,
+                                                &job.iv,
+                                                status)) {
+      goto done;
+   }
+
+   if (!_mongocrypt_do_encryption (kb->crypt->crypto,
+                                   &job.iv,
+                                   &job.associated_data,
+                                   &job.key,
+                                   job.native_key,
+                                   &job.plaintext,
+                                   &ciphertext->data,
+                                   &bytes_written,
+                                   status)) {
+      goto done;
    }
 
    BSON_ASSERT (bytes_written == ciphertext->data.len);
 
+   if (use_cache && !_mongocrypt_cache_add_copy (&kb->crypt->cache_ciphertext,
+                                                 &attr,
+                                                 &ciphertext->data,
+                                                 status)) {
+      goto done;
+   }
+
    ret = true;
 
-fail:
-   _mongocrypt_buffer_cleanup (&iv);
-   _mongocrypt_buffer_cleanup (&key_id);
-   _mongocrypt_buffer_cleanup (&plaintext);
-   _mongocrypt_buffer_cleanup (&associated_data);
-   _mongocrypt_buffer_cleanup (&key_material);
+done:
+   _mongocrypt_encryption_job_cleanup (&job);
+   return ret;
+}
+
+
+bool
+_mongocrypt_marking_to_ciphertext (void *ctx,
+                                   _mongocrypt_marking_t *marking,
+                                   _mongocrypt_ciphertext_t *ciphertext,
+                                   mongocrypt_status_t *status)
+{
+   return _to_ciphertext (ctx, marking, ciphertext, NULL, status);
+}
+
+
+bool
+_mongocrypt_marking_to_serialized_ciphertext (void *ctx,
+                                              _mongocrypt_marking_t *marking,
+                                              _mongocrypt_buffer_t *out,
+                                              mongocrypt_status_t *status)
+{
+   _mongocrypt_ciphertext_t ciphertext;
+   bool ret;
+
+   _mongocrypt_buffer_init (out);
+   _mongocrypt_ciphertext_init (&ciphertext);
+   ret = _to_ciphertext (ctx, marking, &ciphertext, out, status);
+   _mongocrypt_ciphertext_cleanup (&ciphertext);
+   if (!ret) {
+      _mongocrypt_buffer_cleanup (out);
+      _mongocrypt_buffer_init (out);
+   }
    return ret;
 }
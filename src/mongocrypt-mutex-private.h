@@ -22,8 +22,12 @@
 #if defined(BSON_OS_UNIX)
 #include <pthread.h>
 #define mongocrypt_mutex_t pthread_mutex_t
+#define mongocrypt_rwlock_t pthread_rwlock_t
+#define mongocrypt_cond_t pthread_cond_t
 #else
 #define mongocrypt_mutex_t CRITICAL_SECTION
+#define mongocrypt_rwlock_t SRWLOCK
+#define mongocrypt_cond_t CONDITION_VARIABLE
 #endif
 
 void
@@ -38,4 +42,139 @@ _mongocrypt_mutex_lock (mongocrypt_mutex_t *mutex);
 void
 _mongocrypt_mutex_unlock (mongocrypt_mutex_t *mutex);
 
+/* A reader/writer lock. Any number of readers may hold the lock at once. A
+ * writer holds it exclusively. A thread must not take the same lock
+ * recursively. */
+void
+_mongocrypt_rwlock_init (mongocrypt_rwlock_t *rwlock);
+
+void
+_mongocrypt_rwlock_cleanup (mongocrypt_rwlock_t *rwlock);
+
+void
+_mongocrypt_rwlock_rdlock (mongocrypt_rwlock_t *rwlock);
+
+void
+_mongocrypt_rwlock_rdunlock (mongocrypt_rwlock_t *rwlock);
+
+void
+_mongocrypt_rwlock_wrlock (mongocrypt_rwlock_t *rwlock);
+
+void
+_mongocrypt_rwlock_wrunlock (mongocrypt_rwlock_t *rwlock);
+
+/* A condition variable, used with a mongocrypt_mutex_t. */
+void
+_mongocrypt_cond_init (mongocrypt_cond_t *cond);
+
+void
+_mongocrypt_cond_cleanup (mongocrypt_cond_t *cond);
+
+/* Wait until @cond is signaled or @timeout_ms passes. @mutex must be locked,
+ * and is locked again on return. Wakeups may be spurious, so callers check
+ * their condition in a loop. */
+void
+_mongocrypt_cond_timedwait (mongocrypt_cond_t *cond,
+                            mongocrypt_mutex_t *mutex,
+                            int64_t timeout_ms);
+
+void
+_mongocrypt_cond_broadcast (mongocrypt_cond_t *cond);
+
+/* Relaxed atomic access to a 64 bit integer. Only use for values where a
+ * stale read is acceptable (e.g. access timestamps). */
+int64_t
+_mongocrypt_atomic_load_int64 (int64_t *ptr);
+
+void
+_mongocrypt_atomic_store_int64 (int64_t *ptr, int64_t value);
+
+/* Relaxed atomic increment. Only use for counters that order nothing.
+ * Returns the incremented value. */
+int64_t
+_mongocrypt_atomic_add_int64 (int64_t *ptr, int64_t value);
+
+/* Decrement a reference count with acquire-release ordering, so the thread
+ * that drops the last reference sees every write made before the others were
+ * dropped. Returns the decremented value. */
+int64_t
+_mongocrypt_atomic_release_int64 (int64_t *ptr);
+
+/* Acquire load and release store, to publish data written before the store
+ * to the thread that loads the stored value. */
+int64_t
+_mongocrypt_atomic_load_acquire_int64 (int64_t *ptr);
+
+void
+_mongocrypt_atomic_store_release_int64 (int64_t *ptr, int64_t value);
+
+/* Set *ptr to @desired if it is @expected, with acquire-release ordering.
+ * Returns true if it was set. */
+bool
+_mongocrypt_atomic_cas_int64 (int64_t *ptr, int64_t expected, int64_t desired);
+
+/* Atomic access to a pointer. Loads acquire and stores release, so the data
+ * a pointer refers to may be published by storing the pointer. Exchange and
+ * compare-and-swap have acquire-release ordering. */
+void *
+_mongocrypt_atomic_load_acquire_ptr (void **ptr);
+
+void
+_mongocrypt_atomic_store_release_ptr (void **ptr, void *value);
+
+/* Set *ptr to @value. Returns the previous value. */
+void *
+_mongocrypt_atomic_exchange_ptr (void **ptr, void *value);
+
+/* Set *ptr to @desired if it is @expected. Returns true if it was set. */
+bool
+_mongocrypt_atomic_cas_ptr (void **ptr, void *expected, void *desired);
+
+/* A sequence lock, for small data that is read far more often than written.
+ * Readers never block writers or each other, and take no lock: they read
+ * the data and retry if a write overlapped.
+ *
+ * Writers must be serialized by the caller, e.g. with a mutex:
+ *
+ *    _mongocrypt_seqlock_write_begin (&s);
+ *    ... write the data ...
+ *    _mongocrypt_seqlock_write_end (&s);
+ *
+ * Readers copy the data, and use the copy only if no write overlapped:
+ *
+ *    do {
+ *       seq = _mongocrypt_seqlock_read_begin (&s);
+ *       ... copy the data ...
+ *    } while (_mongocrypt_seqlock_read_retry (&s, seq));
+ *
+ * A reader may see a torn copy before retrying, so the data must not include
+ * pointers to memory a writer frees. Access the data with the relaxed
+ * int64_t atomics above. */
+typedef struct {
+   int64_t seq;
+} _mongocrypt_seqlock_t;
+
+void
+_mongocrypt_seqlock_init (_mongocrypt_seqlock_t *seqlock);
+
+void
+_mongocrypt_seqlock_write_begin (_mongocrypt_seqlock_t *seqlock);
+
+void
+_mongocrypt_seqlock_write_end (_mongocrypt_seqlock_t *seqlock);
+
+/* Waits until no write is in progress. Returns the sequence to pass to
+ * _mongocrypt_seqlock_read_retry. */
+int64_t
+_mongocrypt_seqlock_read_begin (_mongocrypt_seqlock_t *seqlock);
+
+/* Returns true if a write started since _mongocrypt_seqlock_read_begin
+ * returned @seq, so the data read must be discarded. */
+bool
+_mongocrypt_seqlock_read_retry (_mongocrypt_seqlock_t *seqlock, int64_t seq);
+
+/* The id of the current process. Used to detect that the process forked. */
+int64_t
+_mongocrypt_getpid (void);
+
 #endif /* MONGOCRYPT_MUTEX_PRIVATE_H */
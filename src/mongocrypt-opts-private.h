@@ -24,6 +24,7 @@
 #include "mongocrypt-log-private.h"
 #include "mongocrypt-endpoint-private.h"
 #include "mongocrypt-kek-private.h"
+#include "mongocrypt-executor-private.h"
 
 typedef struct {
    char *tenant_id;
@@ -48,18 +49,69 @@ typedef struct {
    _mongocrypt_buffer_t key;
 } _mongocrypt_opts_kms_provider_local_t;
 
+/* Defined in mongocrypt-kms-ctx-private.h. */
+typedef struct __mongocrypt_kms_config_t _mongocrypt_kms_config_t;
+
 typedef struct {
    mongocrypt_log_fn_t log_fn;
    void *log_ctx;
+   mongocrypt_log_level_t log_level;
+   /* If non-zero, set by mongocrypt_setopt_log_buffer. */
+   uint32_t log_buffer_capacity;
+   mongocrypt_trace_fn_t trace_fn;
+   void *trace_ctx;
    _mongocrypt_buffer_t schema_map;
+   /* Not owned. Set by mongocrypt_setopt_schema_map_image. */
+   _mongocrypt_buffer_t schema_map_image;
+   /* Not owned. Set by mongocrypt_setopt_key_vault_snapshot. */
+   _mongocrypt_buffer_t key_vault_snapshot;
 
    int kms_providers; /* A bit set of _mongocrypt_kms_provider_t */
    _mongocrypt_opts_kms_provider_local_t kms_provider_local;
    _mongocrypt_opts_kms_provider_aws_t kms_provider_aws;
    _mongocrypt_opts_kms_provider_azure_t kms_provider_azure;
    _mongocrypt_opts_kms_provider_gcp_t kms_provider_gcp;
+   /* Protects the AWS, Azure, and GCP credentials, which
+    * mongocrypt_update_kms_credentials may replace after mongocrypt_init. */
+   mongocrypt_mutex_t credentials_mutex;
    mongocrypt_hmac_fn sign_rsaes_pkcs1_v1_5;
    void *sign_ctx;
+   mongocrypt_parallel_for_fn parallel_for;
+   void *parallel_for_ctx;
+   uint32_t parallel_min_fields;
+   /* If executor.submit is set, parallel_for runs on it. */
+   _mongocrypt_executor_t executor;
+   bool use_markings_cache;
+   bool use_ciphertext_cache;
+   bool use_plaintext_cache;
+   /* If non-zero, contexts that miss the key cache wait up to this long for
+    * another context fetching the same key. */
+   uint64_t key_fetch_wait_ms;
+   /* If non-zero, contexts that miss the key cache within this long of each
+    * other fetch their keys with one key vault query. */
+   uint64_t key_fetch_batch_ms;
+   /* If non-zero, contexts taking longer than this are logged. */
+   uint64_t slow_ctx_threshold_ms;
+   /* If true, KMS messages do not set "Connection: close". */
+   bool kms_keep_alive;
+   /* If true, mongocrypt_init creates crypt->key_l1. */
+   bool key_cache_per_thread;
+   /* A document with a field for each namespace marked locally. */
+   _mongocrypt_buffer_t local_marking_ns;
+   /* Set by mongocrypt_setopt_skip_unencrypted_commands. */
+   bool skip_unencrypted_cmds;
+   /* Set by mongocrypt_setopt_crypto_self_benchmark. */
+   bool crypto_self_benchmark;
+   /* Set by mongocrypt_setopt_key_cache_backend. */
+   mongocrypt_key_cache_get_fn key_cache_get;
+   mongocrypt_key_cache_put_fn key_cache_put;
+   /* Optional. Set by mongocrypt_setopt_key_cache_backend_evict. */
+   mongocrypt_key_cache_evict_fn key_cache_evict;
+   void *key_cache_ctx;
+   _mongocrypt_buffer_t key_cache_secret;
+   /* Set by mongocrypt_init. NULL before, in which case KMS contexts derive
+    * their settings per request. */
+   _mongocrypt_kms_config_t *kms_config;
 } _mongocrypt_opts_t;
 
 
@@ -26,6 +26,8 @@ void
 _mongocrypt_opts_init (_mongocrypt_opts_t *opts)
 {
    memset (opts, 0, sizeof (*opts));
+   opts->log_level = MONGOCRYPT_LOG_LEVEL_TRACE;
+   _mongocrypt_mutex_init (&opts->credentials_mutex);
 }
 
 static void
@@ -56,8 +58,11 @@ _mongocrypt_opts_cleanup (_mongocrypt_opts_t *opts)
    bson_free (opts->kms_provider_aws.session_token);
    _mongocrypt_buffer_cleanup (&opts->kms_provider_local.key);
    _mongocrypt_buffer_cleanup (&opts->schema_map);
+   _mongocrypt_buffer_cleanup (&opts->local_marking_ns);
+   _mongocrypt_buffer_cleanup (&opts->key_cache_secret);
    _mongocrypt_opts_kms_provider_azure_cleanup (&opts->kms_provider_azure);
    _mongocrypt_opts_kms_provider_gcp_cleanup (&opts->kms_provider_gcp);
+   _mongocrypt_mutex_cleanup (&opts->credentials_mutex);
 }
 
 
@@ -85,6 +90,12 @@ _mongocrypt_opts_validate (_mongocrypt_opts_t *opts,
       }
    }
 
+   /* Contexts that join a batch wait for its leader's fetch. */
+   if (opts->key_fetch_batch_ms && !opts->key_fetch_wait_ms) {
+      CLIENT_ERR ("key fetch batching requires a key fetch wait");
+      return false;
+   }
+
    return true;
 }
 
@@ -17,8 +17,33 @@
 #ifndef MONGOCRYPT_OS_PRIVATE_H
 #define MONGOCRYPT_OS_PRIVATE_H
 
+#include <bson/bson.h>
+#include <stdint.h>
+
 int
 _mongocrypt_once(void (*init_routine)(void));
 
+/* A number for the calling thread, assigned on its first call. Threads get
+ * consecutive numbers, and numbers of exited threads are not reused. */
+uint32_t
+_mongocrypt_thread_index (void);
+
+/* Map @len bytes of zeroed memory, aligned to at least 4096 bytes, and try to
+ * lock them into RAM so they are never written to swap. @locked is set to
+ * whether locking succeeded, which may fail due to resource limits. Returns
+ * NULL if the memory cannot be mapped. */
+void *
+_mongocrypt_os_map_locked (size_t len, bool *locked);
+
+/* Unmap memory from _mongocrypt_os_map_locked. */
+void
+_mongocrypt_os_unmap_locked (void *ptr, size_t len, bool locked);
+
+/* Lock memory from _mongocrypt_os_map_locked into RAM again, for the child of
+ * a fork, which does not inherit the locks of its parent. Returns whether
+ * locking succeeded. */
+bool
+_mongocrypt_os_relock (void *ptr, size_t len);
+
 
 #endif /* MONGOCRYPT_OS_PRIVATE_H */
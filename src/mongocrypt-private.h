@@ -29,6 +29,11 @@
 #include "mongocrypt-opts-private.h"
 #include "mongocrypt-crypto-private.h"
 #include "mongocrypt-cache-oauth-private.h"
+#include "mongocrypt-key-vault-snapshot-private.h"
+#include "mongocrypt-kms-ctx-private.h"
+#include "mongocrypt-schema-map-private.h"
+#include "mongocrypt-shared-cache-private.h"
+#include "mongocrypt-trace-private.h"
 
 
 #define MONGOCRYPT_GENERIC_ERROR_CODE 1
@@ -74,9 +79,29 @@ struct _mongocrypt_t {
    bool initialized;
    _mongocrypt_opts_t opts;
    mongocrypt_mutex_t mutex;
-   /* The collinfo and key cache are protected with an internal mutex. */
-   _mongocrypt_cache_t cache_collinfo;
-   _mongocrypt_cache_t cache_key;
+   /* Owns a reference. The collinfo, key and oauth caches point into it,
+    * and may be used by other mongocrypt_t. They are protected with internal
+    * locks. */
+   mongocrypt_shared_cache_t *shared_cache;
+   _mongocrypt_cache_t *cache_collinfo;
+   _mongocrypt_cache_t *cache_key;
+   /* Per-thread copies of keys in cache_key. NULL unless
+    * opts.key_cache_per_thread is set. */
+   _mongocrypt_key_l1_t *key_l1;
+   /* Key fetches in progress. Only used if opts.key_fetch_wait_ms is set. */
+   _mongocrypt_key_fetches_t key_fetches;
+   /* Only used if opts.key_fetch_batch_ms is set. */
+   _mongocrypt_key_batch_t key_batch;
+   /* Only used if opts.use_markings_cache is set. */
+   _mongocrypt_cache_t cache_markings;
+   /* Only used if opts.use_ciphertext_cache is set. */
+   _mongocrypt_cache_t cache_ciphertext;
+   /* Only used if opts.use_plaintext_cache is set. */
+   _mongocrypt_cache_t cache_plaintext;
+   /* opts.schema_map, compiled by mongocrypt_init. */
+   _mongocrypt_schema_map_t schema_map;
+   /* opts.key_vault_snapshot, indexed by mongocrypt_init. */
+   _mongocrypt_key_vault_snapshot_t key_vault_snapshot;
    _mongocrypt_log_t log;
    mongocrypt_status_t *status;
    _mongocrypt_crypto_t *crypto;
@@ -84,12 +109,34 @@ struct _mongocrypt_t {
    uint32_t ctx_counter;
    _mongocrypt_cache_oauth_t *cache_oauth_azure;
    _mongocrypt_cache_oauth_t *cache_oauth_gcp;
+   /* Derived AWS signing keys, protected by an internal mutex. */
+   _mongocrypt_aws_signing_keys_t aws_signing_keys;
+   _mongocrypt_gcp_assertions_t gcp_assertions;
+   /* Set by mongocrypt_setopt_kms_rate_limit. */
+   _mongocrypt_kms_limiter_t kms_limiter;
+   /* IVs for randomized encryption. */
+   _mongocrypt_random_pool_t random_pool;
+   /* Reported by mongocrypt_get_stats. */
+   _mongocrypt_stats_t stats;
+   /* Set from opts by mongocrypt_init. */
+   _mongocrypt_trace_t trace;
+   /* Incremented by mongocrypt_after_fork_child, to fail the contexts
+    * created before. */
+   int64_t forks;
+   /* The earliest time the next slow context may be logged, and the slow
+    * contexts not logged since the last one was. */
+   int64_t slow_ctx_next_us;
+   int64_t slow_ctx_suppressed;
 };
 
 typedef enum {
    MONGOCRYPT_ENCRYPTION_ALGORITHM_NONE = 0,
    MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC = 1,
-   MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM = 2
+   MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM = 2,
+   /* Randomized, with the plaintext compressed before encryption. Values
+    * that do not compress are encrypted as
+    * MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM. */
+   MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM_COMPRESSED = 3
 } mongocrypt_encryption_algorithm_t;
 
 
@@ -104,4 +151,8 @@ _mongocrypt_new_string_from_bytes (const void *in, int len);
 char *
 _mongocrypt_new_json_string_from_binary (mongocrypt_binary_t *binary);
 
+/* Process-wide initialization. Run with _mongocrypt_once. */
+void
+_mongocrypt_do_init (void);
+
 #endif /* MONGOCRYPT_PRIVATE_H */
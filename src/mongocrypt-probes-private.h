@@ -0,0 +1,55 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_PROBES_PRIVATE_H
+#define MONGOCRYPT_PROBES_PRIVATE_H
+
+#include "mongocrypt-config.h"
+
+/* Static tracepoints, compiled in with ENABLE_USDT. Each is a no-op
+ * instruction until a tracer (bpftrace, perf, SystemTap) attaches to it, so
+ * they may stay in production builds. The provider is "libmongocrypt":
+ *
+ * ctx__state (ctx, old_state, new_state)
+ *    A context changed state. States are mongocrypt_ctx_state_t values.
+ * key__cache__hit (kb), key__cache__miss (kb)
+ *    A key request was or was not satisfied from the key cache.
+ * kms__start (kms, request_type)
+ *    A KMS request was created.
+ * kms__done (kms, ok, http_status, bytes_received)
+ *    The whole KMS response was fed.
+ * encrypt__start (plaintext_len), encrypt__done (ok, bytes_written)
+ * decrypt__start (ciphertext_len), decrypt__done (ok, bytes_written)
+ *    Around _mongocrypt_do_encryption and _mongocrypt_do_decryption.
+ */
+#ifdef MONGOCRYPT_ENABLE_USDT
+#include <sys/sdt.h>
+
+#define MONGOCRYPT_PROBE1(name, a) DTRACE_PROBE1 (libmongocrypt, name, a)
+#define MONGOCRYPT_PROBE2(name, a, b) \
+   DTRACE_PROBE2 (libmongocrypt, name, a, b)
+#define MONGOCRYPT_PROBE3(name, a, b, c) \
+   DTRACE_PROBE3 (libmongocrypt, name, a, b, c)
+#define MONGOCRYPT_PROBE4(name, a, b, c, d) \
+   DTRACE_PROBE4 (libmongocrypt, name, a, b, c, d)
+#else
+#define MONGOCRYPT_PROBE1(name, a) ((void) 0)
+#define MONGOCRYPT_PROBE2(name, a, b) ((void) 0)
+#define MONGOCRYPT_PROBE3(name, a, b, c) ((void) 0)
+#define MONGOCRYPT_PROBE4(name, a, b, c, d) ((void) 0)
+#endif
+
+#endif /* MONGOCRYPT_PROBES_PRIVATE_H */
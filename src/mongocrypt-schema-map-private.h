@@ -0,0 +1,92 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_SCHEMA_MAP_PRIVATE_H
+#define MONGOCRYPT_SCHEMA_MAP_PRIVATE_H
+
+#include "mongocrypt-buffer-private.h"
+#include "mongocrypt-schema-paths-private.h"
+#include "mongocrypt-status-private.h"
+
+/* The schema map set with mongocrypt_setopt_schema_map, compiled by
+ * mongocrypt_init into a hash table from namespace to schema. Entries point
+ * into the schema map buffer, which must outlive the table. */
+typedef struct __mongocrypt_schema_map_entry_t {
+   const char *ns;
+   uint32_t hash;
+   /* Not owned. */
+   _mongocrypt_buffer_t schema;
+   /* The _mongocrypt_cache_collinfo_schema_digest of schema. */
+   uint32_t schema_digest;
+   /* The encrypted paths of schema. Empty if it has none or could not be
+    * compiled. */
+   _mongocrypt_schema_paths_t paths;
+   struct __mongocrypt_schema_map_entry_t *next;
+} _mongocrypt_schema_map_entry_t;
+
+typedef struct {
+   _mongocrypt_schema_map_entry_t *entries;
+   uint32_t num_entries;
+   _mongocrypt_schema_map_entry_t **buckets;
+   uint32_t num_buckets;
+   /* Not owned. Set instead of the table by
+    * _mongocrypt_schema_map_load_image. */
+   _mongocrypt_buffer_t image;
+} _mongocrypt_schema_map_t;
+
+void
+_mongocrypt_schema_map_init (_mongocrypt_schema_map_t *map);
+
+/* Build @map from @schema_map. Every schema must be a document. If a
+ * namespace is repeated, the first schema is used. */
+bool
+_mongocrypt_schema_map_compile (_mongocrypt_schema_map_t *map,
+                                const _mongocrypt_buffer_t *schema_map,
+                                mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Serialize @schema_map, like _mongocrypt_schema_map_compile, into an image
+ * with the hash table, schemas, and encrypted paths laid out in one buffer.
+ * The format is private to this version of libmongocrypt. */
+bool
+_mongocrypt_schema_map_build_image (const _mongocrypt_buffer_t *schema_map,
+                                    _mongocrypt_buffer_t *image,
+                                    mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Use @image, built by _mongocrypt_schema_map_build_image, without copying
+ * it. Only the header and index are checked, so this does not read the
+ * schemas. @image must outlive @map. */
+bool
+_mongocrypt_schema_map_load_image (_mongocrypt_schema_map_t *map,
+                                   const _mongocrypt_buffer_t *image,
+                                   mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Returns false if @ns is not in @map. Otherwise sets @schema to view the
+ * schema of @ns, which lives as long as @map, and appends its encrypted
+ * paths to @paths. */
+bool
+_mongocrypt_schema_map_find (const _mongocrypt_schema_map_t *map,
+                             const char *ns,
+                             _mongocrypt_buffer_t *schema,
+                             uint32_t *schema_digest,
+                             _mongocrypt_schema_paths_t *paths);
+
+void
+_mongocrypt_schema_map_cleanup (_mongocrypt_schema_map_t *map);
+
+#endif /* MONGOCRYPT_SCHEMA_MAP_PRIVATE_H */
@@ -0,0 +1,471 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-private.h"
+#include "mongocrypt-cache-collinfo-private.h"
+#include "mongocrypt-schema-map-private.h"
+
+/* A schema map image is little-endian uint32 words, then strings and
+ * schemas:
+ *
+ * header:  magic, version, length of the image, num_buckets, num_entries
+ * buckets: num_buckets words, each 0 or 1 + the index of the first entry
+ * entries: num_entries of ENTRY_WORDS words, laid out as _image_entry_t
+ * data:    the namespaces, each followed by a NUL byte, the schemas, and
+ *          the encrypted paths of each schema, each followed by a NUL byte
+ *
+ * Every offset is from the start of the image. */
+#define IMAGE_MAGIC 0x4d53434du /* "MCSM" */
+#define IMAGE_VERSION 1u
+#define HEADER_WORDS 5u
+#define ENTRY_WORDS 9u
+
+typedef struct {
+   uint32_t hash;
+   /* 0 or 1 + the index of the next entry in the bucket. */
+   uint32_t next;
+   uint32_t ns_offset;
+   uint32_t ns_len;
+   uint32_t schema_offset;
+   uint32_t schema_len;
+   uint32_t schema_digest;
+   uint32_t paths_offset;
+   uint32_t paths_len;
+} _image_entry_t;
+
+
+void
+_mongocrypt_schema_map_init (_mongocrypt_schema_map_t *map)
+{
+   memset (map, 0, sizeof (*map));
+}
+
+
+static uint32_t
+_hash_ns (const char *ns)
+{
+   return _mongocrypt_cache_hash_bytes (ns, strlen (ns));
+}
+
+
+static const _mongocrypt_schema_map_entry_t *
+_lookup (const _mongocrypt_schema_map_t *map, const char *ns)
+{
+   const _mongocrypt_schema_map_entry_t *entry;
+   uint32_t hash;
+
+   if (!map->num_buckets) {
+      return NULL;
+   }
+
+   hash = _hash_ns (ns);
+   for (entry = map->buckets[hash & (map->num_buckets - 1)]; entry;
+        entry = entry->next) {
+      if (entry->hash == hash && 0 == strcmp (entry->ns, ns)) {
+         return entry;
+      }
+   }
+   return NULL;
+}
+
+
+bool
+_mongocrypt_schema_map_compile (_mongocrypt_schema_map_t *map,
+                                const _mongocrypt_buffer_t *schema_map,
+                                mongocrypt_status_t *status)
+{
+   bson_t as_bson, schema;
+   bson_iter_t iter;
+   uint32_t count;
+
+   _mongocrypt_schema_map_cleanup (map);
+   if (_mongocrypt_buffer_empty (schema_map)) {
+      return true;
+   }
+
+   if (!_mongocrypt_buffer_to_bson (schema_map, &as_bson)) {
+      CLIENT_ERR ("malformed schema map");
+      return false;
+   }
+
+   count = bson_count_keys (&as_bson);
+   if (0 == count) {
+      return true;
+   }
+
+   /* Use a power of two number of buckets, at least one per entry. */
+   map->num_buckets = 1;
+   while (map->num_buckets < count) {
+      map->num_buckets *= 2;
+   }
+   map->buckets = bson_malloc0 (map->num_buckets * sizeof (*map->buckets));
+   BSON_ASSERT (map->buckets);
+   map->entries = bson_malloc0 (count * sizeof (*map->entries));
+   BSON_ASSERT (map->entries);
+
+   if (!bson_iter_init (&iter, &as_bson)) {
+      CLIENT_ERR ("malformed schema map");
+      return false;
+   }
+   while (bson_iter_next (&iter)) {
+      _mongocrypt_schema_map_entry_t *entry, **bucket;
+      const char *ns;
+
+      ns = bson_iter_key (&iter);
+      if (_lookup (map, ns)) {
+         continue;
+      }
+
+      BSON_ASSERT (map->num_entries < count);
+      entry = &map->entries[map->num_entries];
+      if (!_mongocrypt_buffer_from_document_iter (&entry->schema, &iter)) {
+         CLIENT_ERR ("malformed schema map");
+         return false;
+      }
+      entry->ns = ns;
+      entry->hash = _hash_ns (ns);
+      entry->schema_digest =
+         _mongocrypt_cache_collinfo_schema_digest (&entry->schema);
+      /* Left empty if the schema cannot be compiled to paths. */
+      if (_mongocrypt_buffer_to_bson (&entry->schema, &schema)) {
+         (void) _mongocrypt_schema_paths_init (&entry->paths, &schema);
+      }
+      bucket = &map->buckets[entry->hash & (map->num_buckets - 1)];
+      entry->next = *bucket;
+      *bucket = entry;
+      map->num_entries++;
+   }
+   return true;
+}
+
+
+void
+_mongocrypt_schema_map_cleanup (_mongocrypt_schema_map_t *map)
+{
+   uint32_t i;
+
+   /* An image has no entries to free. */
+   for (i = 0; map->entries && i < map->num_entries; i++) {
+      _mongocrypt_schema_paths_cleanup (&map->entries[i].paths);
+   }
+   bson_free (map->entries);
+   bson_free (map->buckets);
+   _mongocrypt_schema_map_init (map);
+}
+
+
+static uint32_t
+_read_word (const _mongocrypt_buffer_t *image, uint32_t index)
+{
+   uint32_t le;
+
+   memcpy (&le, image->data + (size_t) index * 4u, sizeof (le));
+   return BSON_UINT32_FROM_LE (le);
+}
+
+
+static void
+_write_word (_mongocrypt_buffer_t *image, uint32_t index, uint32_t value)
+{
+   uint32_t le = BSON_UINT32_TO_LE (value);
+
+   memcpy (image->data + (size_t) index * 4u, &le, sizeof (le));
+}
+
+
+static void
+_read_entry (const _mongocrypt_buffer_t *image,
+             uint32_t num_buckets,
+             uint32_t index,
+             _image_entry_t *entry)
+{
+   uint32_t words[ENTRY_WORDS];
+   uint32_t first, i;
+
+   first = HEADER_WORDS + num_buckets + index * ENTRY_WORDS;
+   for (i = 0; i < ENTRY_WORDS; i++) {
+      words[i] = _read_word (image, first + i);
+   }
+   entry->hash = words[0];
+   entry->next = words[1];
+   entry->ns_offset = words[2];
+   entry->ns_len = words[3];
+   entry->schema_offset = words[4];
+   entry->schema_len = words[5];
+   entry->schema_digest = words[6];
+   entry->paths_offset = words[7];
+   entry->paths_len = words[8];
+}
+
+
+static void
+_write_entry (_mongocrypt_buffer_t *image,
+              uint32_t num_buckets,
+              uint32_t index,
+              const _image_entry_t *entry)
+{
+   uint32_t first;
+
+   first = HEADER_WORDS + num_buckets + index * ENTRY_WORDS;
+   _write_word (image, first + 0, entry->hash);
+   _write_word (image, first + 1, entry->next);
+   _write_word (image, first + 2, entry->ns_offset);
+   _write_word (image, first + 3, entry->ns_len);
+   _write_word (image, first + 4, entry->schema_offset);
+   _write_word (image, first + 5, entry->schema_len);
+   _write_word (image, first + 6, entry->schema_digest);
+   _write_word (image, first + 7, entry->paths_offset);
+   _write_word (image, first + 8, entry->paths_len);
+}
+
+
+static uint32_t
+_entry_index (const _mongocrypt_schema_map_t *map,
+              const _mongocrypt_schema_map_entry_t *entry)
+{
+   return entry ? (uint32_t) (entry - map->entries) + 1u : 0u;
+}
+
+
+bool
+_mongocrypt_schema_map_build_image (const _mongocrypt_buffer_t *schema_map,
+                                    _mongocrypt_buffer_t *image,
+                                    mongocrypt_status_t *status)
+{
+   _mongocrypt_schema_map_t map;
+   uint64_t len;
+   uint32_t i, j, offset;
+   bool ret = false;
+
+   _mongocrypt_buffer_init (image);
+   _mongocrypt_schema_map_init (&map);
+   if (!_mongocrypt_schema_map_compile (&map, schema_map, status)) {
+      goto done;
+   }
+
+   len = 4u * ((uint64_t) HEADER_WORDS + map.num_buckets +
+               (uint64_t) map.num_entries * ENTRY_WORDS);
+   for (i = 0; i < map.num_entries; i++) {
+      _mongocrypt_schema_map_entry_t *entry = &map.entries[i];
+
+      len += strlen (entry->ns) + 1u + entry->schema.len;
+      for (j = 0; j < entry->paths.len; j++) {
+         len += strlen (entry->paths.paths[j]) + 1u;
+      }
+   }
+   if (len > UINT32_MAX) {
+      CLIENT_ERR ("schema map too large for an image");
+      goto done;
+   }
+
+   _mongocrypt_buffer_resize (image, (uint32_t) len);
+   memset (image->data, 0, image->len);
+   _write_word (image, 0, IMAGE_MAGIC);
+   _write_word (image, 1, IMAGE_VERSION);
+   _write_word (image, 2, image->len);
+   _write_word (image, 3, map.num_buckets);
+   _write_word (image, 4, map.num_entries);
+   for (i = 0; i < map.num_buckets; i++) {
+      _write_word (
+         image, HEADER_WORDS + i, _entry_index (&map, map.buckets[i]));
+   }
+
+   offset = 4u * (HEADER_WORDS + map.num_buckets +
+                  map.num_entries * ENTRY_WORDS);
+   for (i = 0; i < map.num_entries; i++) {
+      _mongocrypt_schema_map_entry_t *entry = &map.entries[i];
+      _image_entry_t out;
+
+      out.hash = entry->hash;
+      out.next = _entry_index (&map, entry->next);
+      out.schema_digest = entry->schema_digest;
+
+      out.ns_offset = offset;
+      out.ns_len = (uint32_t) strlen (entry->ns);
+      memcpy (image->data + offset, entry->ns, out.ns_len + 1u);
+      offset += out.ns_len + 1u;
+
+      out.schema_offset = offset;
+      out.schema_len = entry->schema.len;
+      memcpy (image->data + offset, entry->schema.data, entry->schema.len);
+      offset += entry->schema.len;
+
+      out.paths_offset = offset;
+      for (j = 0; j < entry->paths.len; j++) {
+         size_t path_len = strlen (entry->paths.paths[j]) + 1u;
+
+         memcpy (image->data + offset, entry->paths.paths[j], path_len);
+         offset += (uint32_t) path_len;
+      }
+      out.paths_len = offset - out.paths_offset;
+      _write_entry (image, map.num_buckets, i, &out);
+   }
+   BSON_ASSERT (offset == image->len);
+   ret = true;
+
+done:
+   if (!ret) {
+      _mongocrypt_buffer_cleanup (image);
+   }
+   _mongocrypt_schema_map_cleanup (&map);
+   return ret;
+}
+
+
+static bool
+_in_image (const _mongocrypt_buffer_t *image, uint32_t offset, uint32_t len)
+{
+   return offset <= image->len && len <= image->len - offset;
+}
+
+
+bool
+_mongocrypt_schema_map_load_image (_mongocrypt_schema_map_t *map,
+                                   const _mongocrypt_buffer_t *image,
+                                   mongocrypt_status_t *status)
+{
+   uint32_t num_buckets, num_entries, i;
+   uint64_t index_len;
+
+   _mongocrypt_schema_map_cleanup (map);
+   if (image->len < 4u * HEADER_WORDS || _read_word (image, 0) != IMAGE_MAGIC) {
+      CLIENT_ERR ("not a schema map image");
+      return false;
+   }
+   if (_read_word (image, 1) != IMAGE_VERSION) {
+      CLIENT_ERR ("schema map image of another version");
+      return false;
+   }
+   if (_read_word (image, 2) != image->len) {
+      CLIENT_ERR ("truncated schema map image");
+      return false;
+   }
+
+   num_buckets = _read_word (image, 3);
+   num_entries = _read_word (image, 4);
+   index_len = 4u * ((uint64_t) HEADER_WORDS + num_buckets +
+                     (uint64_t) num_entries * ENTRY_WORDS);
+   if (index_len > image->len || (num_buckets & (num_buckets - 1u)) != 0 ||
+       (num_buckets == 0) != (num_entries == 0)) {
+      CLIENT_ERR ("malformed schema map image");
+      return false;
+   }
+   for (i = 0; i < num_buckets; i++) {
+      if (_read_word (image, HEADER_WORDS + i) > num_entries) {
+         CLIENT_ERR ("malformed schema map image");
+         return false;
+      }
+   }
+
+   _mongocrypt_buffer_set_to (image, &map->image);
+   map->num_buckets = num_buckets;
+   map->num_entries = num_entries;
+   return true;
+}
+
+
+/* Returns false if @entry does not fit in the image. Checked on each lookup,
+ * so loading an image need not read every entry. */
+static bool
+_image_entry_valid (const _mongocrypt_schema_map_t *map,
+                    const _image_entry_t *entry)
+{
+   const _mongocrypt_buffer_t *image = &map->image;
+
+   return entry->next <= map->num_entries &&
+          entry->ns_len < UINT32_MAX &&
+          _in_image (image, entry->ns_offset, entry->ns_len + 1u) &&
+          image->data[entry->ns_offset + entry->ns_len] == '\0' &&
+          _in_image (image, entry->schema_offset, entry->schema_len) &&
+          _in_image (image, entry->paths_offset, entry->paths_len) &&
+          (entry->paths_len == 0 ||
+           image->data[entry->paths_offset + entry->paths_len - 1u] == '\0');
+}
+
+
+static bool
+_find_in_image (const _mongocrypt_schema_map_t *map,
+                const char *ns,
+                _mongocrypt_buffer_t *schema,
+                uint32_t *schema_digest,
+                _mongocrypt_schema_paths_t *paths)
+{
+   const _mongocrypt_buffer_t *image = &map->image;
+   _image_entry_t entry;
+   uint32_t hash, index, steps;
+   size_t ns_len;
+
+   hash = _hash_ns (ns);
+   ns_len = strlen (ns);
+   index = _read_word (image, HEADER_WORDS + (hash & (map->num_buckets - 1u)));
+   /* Bound the walk, in case the chain of a malformed image loops. */
+   for (steps = 0; index != 0 && steps < map->num_entries; steps++) {
+      const uint8_t *path, *end;
+
+      _read_entry (image, map->num_buckets, index - 1u, &entry);
+      if (!_image_entry_valid (map, &entry)) {
+         return false;
+      }
+      index = entry.next;
+      if (entry.hash != hash || entry.ns_len != ns_len ||
+          0 != memcmp (image->data + entry.ns_offset, ns, ns_len)) {
+         continue;
+      }
+
+      _mongocrypt_buffer_init (schema);
+      schema->data = image->data + entry.schema_offset;
+      schema->len = entry.schema_len;
+      *schema_digest = entry.schema_digest;
+      path = image->data + entry.paths_offset;
+      end = path + entry.paths_len;
+      while (path < end) {
+         _mongocrypt_schema_paths_append (paths, (const char *) path);
+         path += strlen ((const char *) path) + 1u;
+      }
+      return true;
+   }
+   return false;
+}
+
+
+bool
+_mongocrypt_schema_map_find (const _mongocrypt_schema_map_t *map,
+                             const char *ns,
+                             _mongocrypt_buffer_t *schema,
+                             uint32_t *schema_digest,
+                             _mongocrypt_schema_paths_t *paths)
+{
+   const _mongocrypt_schema_map_entry_t *entry;
+   uint32_t i;
+
+   if (!map->num_buckets) {
+      return false;
+   }
+   if (map->image.len) {
+      return _find_in_image (map, ns, schema, schema_digest, paths);
+   }
+
+   entry = _lookup (map, ns);
+   if (!entry) {
+      return false;
+   }
+   _mongocrypt_buffer_set_to (&entry->schema, schema);
+   *schema_digest = entry->schema_digest;
+   for (i = 0; i < entry->paths.len; i++) {
+      _mongocrypt_schema_paths_append (paths, entry->paths.paths[i]);
+   }
+   return true;
+}
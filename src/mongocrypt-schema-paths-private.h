@@ -0,0 +1,53 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_SCHEMA_PATHS_PRIVATE_H
+#define MONGOCRYPT_SCHEMA_PATHS_PRIVATE_H
+
+#include <bson/bson.h>
+
+/* A list of dotted paths. Holds the paths of the 'encrypt' nodes of a JSON
+ * schema, used to prove that a command does not reference an encrypted
+ * field, and the paths set by mongocrypt_ctx_setopt_decrypt_paths. */
+typedef struct {
+   char **paths;
+   uint32_t len;
+} _mongocrypt_schema_paths_t;
+
+/* Index the encrypted paths of @schema, which may be empty. Returns false,
+ * with @paths empty, if an 'encrypt' node is reachable other than through
+ * nested 'properties', so the paths cannot be listed. */
+bool
+_mongocrypt_schema_paths_init (_mongocrypt_schema_paths_t *paths,
+                               const bson_t *schema);
+
+/* Returns true if @cmd provably references none of @paths. Only insert,
+ * find, count, distinct, and delete are supported, with filters whose top
+ * level keys are paths, $and, $or, $nor, or $comment. Returns false for
+ * anything else, in which case mongocryptd must mark @cmd. */
+bool
+_mongocrypt_schema_paths_cmd_is_disjoint (
+   const _mongocrypt_schema_paths_t *paths, const bson_t *cmd);
+
+/* Append a copy of @path. */
+void
+_mongocrypt_schema_paths_append (_mongocrypt_schema_paths_t *paths,
+                                 const char *path);
+
+void
+_mongocrypt_schema_paths_cleanup (_mongocrypt_schema_paths_t *paths);
+
+#endif /* MONGOCRYPT_SCHEMA_PATHS_PRIVATE_H */
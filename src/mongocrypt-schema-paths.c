@@ -0,0 +1,413 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-private.h"
+#include "mongocrypt-schema-paths-private.h"
+
+/* A command field path is disjoint from an encrypted path if neither is a
+ * prefix of the other. Everything a filter operator, a projection, or a
+ * sort does with a field is scoped under its path, so only the paths of
+ * commands are compared, never their values. Paths with array indexes or
+ * '$' components are not compared, since they may refer to another path. */
+
+/* Command fields that reference no document paths. */
+static const char *_generic_fields[] = {"$db",
+                                        "lsid",
+                                        "txnNumber",
+                                        "autocommit",
+                                        "startTransaction",
+                                        "readConcern",
+                                        "writeConcern",
+                                        "$readPreference",
+                                        "$clusterTime",
+                                        "maxTimeMS",
+                                        "comment"};
+
+
+static bool
+_in_list (const char *key, const char **list, size_t len)
+{
+   size_t i;
+
+   for (i = 0; i < len; i++) {
+      if (0 == strcmp (key, list[i])) {
+         return true;
+      }
+   }
+   return false;
+}
+
+
+static bool
+_is_doc_or_array (const bson_iter_t *iter)
+{
+   return BSON_ITER_HOLDS_DOCUMENT (iter) || BSON_ITER_HOLDS_ARRAY (iter);
+}
+
+
+/* Returns true if the document or array at @iter has an 'encrypt' key at any
+ * depth. */
+static bool
+_contains_encrypt (const bson_iter_t *iter)
+{
+   bson_iter_t child;
+
+   if (!bson_iter_recurse (iter, &child)) {
+      return true;
+   }
+   while (bson_iter_next (&child)) {
+      if (0 == strcmp (bson_iter_key (&child), "encrypt")) {
+         return true;
+      }
+      if (_is_doc_or_array (&child) && _contains_encrypt (&child)) {
+         return true;
+      }
+   }
+   return false;
+}
+
+
+void
+_mongocrypt_schema_paths_append (_mongocrypt_schema_paths_t *paths,
+                                 const char *path)
+{
+   paths->paths =
+      bson_realloc (paths->paths, sizeof (char *) * (paths->len + 1u));
+   paths->paths[paths->len++] = bson_strdup (path);
+}
+
+
+/* Collect the encrypted paths of the schema node at @iter, which is at
+ * @prefix, or "" for the root. */
+static bool
+_collect (_mongocrypt_schema_paths_t *paths,
+          const bson_iter_t *iter,
+          const char *prefix)
+{
+   bson_iter_t child, property;
+
+   if (!BSON_ITER_HOLDS_DOCUMENT (iter) || !bson_iter_recurse (iter, &child)) {
+      return false;
+   }
+   while (bson_iter_next (&child)) {
+      const char *key;
+
+      key = bson_iter_key (&child);
+      if (0 == strcmp (key, "encrypt")) {
+         if (!*prefix) {
+            /* The whole document is encrypted. */
+            return false;
+         }
+         _mongocrypt_schema_paths_append (paths, prefix);
+      } else if (0 == strcmp (key, "properties")) {
+         if (!BSON_ITER_HOLDS_DOCUMENT (&child) ||
+             !bson_iter_recurse (&child, &property)) {
+            return false;
+         }
+         while (bson_iter_next (&property)) {
+            const char *name;
+            char *path;
+            bool ok;
+
+            name = bson_iter_key (&property);
+            if (!*name || name[0] == '$' || strchr (name, '.')) {
+               return false;
+            }
+            path = *prefix ? bson_strdup_printf ("%s.%s", prefix, name)
+                           : bson_strdup (name);
+            ok = _collect (paths, &property, path);
+            bson_free (path);
+            if (!ok) {
+               return false;
+            }
+         }
+      } else if (0 == strcmp (key, "encryptMetadata")) {
+         /* Only options of nested 'encrypt' nodes. */
+      } else if (_is_doc_or_array (&child) && _contains_encrypt (&child)) {
+         /* Like 'items', 'patternProperties', or 'anyOf'. */
+         return false;
+      }
+   }
+   return true;
+}
+
+
+bool
+_mongocrypt_schema_paths_init (_mongocrypt_schema_paths_t *paths,
+                               const bson_t *schema)
+{
+   bson_t schema_doc;
+   bson_iter_t iter;
+   bool ret;
+
+   memset (paths, 0, sizeof (*paths));
+
+   /* Wrap the schema so it can be parsed as a node. */
+   bson_init (&schema_doc);
+   BSON_APPEND_DOCUMENT (&schema_doc, "schema", schema);
+   ret = bson_iter_init_find (&iter, &schema_doc, "schema") &&
+         _collect (paths, &iter, "");
+   bson_destroy (&schema_doc);
+   if (!ret) {
+      _mongocrypt_schema_paths_cleanup (paths);
+   }
+   return ret;
+}
+
+
+static bool
+_path_is_disjoint (const _mongocrypt_schema_paths_t *paths, const char *path)
+{
+   const char *start, *c;
+   uint32_t i;
+
+   start = path;
+   for (c = path;; c++) {
+      if (*c == '.' || *c == '\0') {
+         const char *digit;
+
+         if (c == start || *start == '$') {
+            return false;
+         }
+         digit = start;
+         while (digit < c && *digit >= '0' && *digit <= '9') {
+            digit++;
+         }
+         if (digit == c) {
+            /* An array index. */
+            return false;
+         }
+         if (*c == '\0') {
+            break;
+         }
+         start = c + 1;
+      }
+   }
+
+   for (i = 0; i < paths->len; i++) {
+      const char *encrypted;
+      size_t len;
+
+      encrypted = paths->paths[i];
+      len = 0;
+      while (encrypted[len] && encrypted[len] == path[len]) {
+         len++;
+      }
+      if ((encrypted[len] == '\0' || encrypted[len] == '.') &&
+          (path[len] == '\0' || path[len] == '.')) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/* Every key of the document at @iter is a disjoint path. For projections,
+ * sorts, and inserted documents. */
+static bool
+_keys_are_disjoint (const _mongocrypt_schema_paths_t *paths,
+                    const bson_iter_t *iter)
+{
+   bson_iter_t child;
+
+   if (!BSON_ITER_HOLDS_DOCUMENT (iter) || !bson_iter_recurse (iter, &child)) {
+      return false;
+   }
+   while (bson_iter_next (&child)) {
+      if (!_path_is_disjoint (paths, bson_iter_key (&child))) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+static bool
+_filter_is_disjoint (const _mongocrypt_schema_paths_t *paths,
+                     const bson_iter_t *iter)
+{
+   bson_iter_t child, clause;
+
+   if (!BSON_ITER_HOLDS_DOCUMENT (iter) || !bson_iter_recurse (iter, &child)) {
+      return false;
+   }
+   while (bson_iter_next (&child)) {
+      const char *key;
+
+      key = bson_iter_key (&child);
+      if (0 == strcmp (key, "$and") || 0 == strcmp (key, "$or") ||
+          0 == strcmp (key, "$nor")) {
+         if (!BSON_ITER_HOLDS_ARRAY (&child) ||
+             !bson_iter_recurse (&child, &clause)) {
+            return false;
+         }
+         while (bson_iter_next (&clause)) {
+            if (!_filter_is_disjoint (paths, &clause)) {
+               return false;
+            }
+         }
+      } else if (0 != strcmp (key, "$comment") &&
+                 !_path_is_disjoint (paths, key)) {
+         /* Other top level operators, like $expr, are not paths. */
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/* Apply @fn to each document of the array at @iter. */
+static bool
+_each_is_disjoint (const _mongocrypt_schema_paths_t *paths,
+                   const bson_iter_t *iter,
+                   bool (*fn) (const _mongocrypt_schema_paths_t *paths,
+                               const bson_iter_t *iter))
+{
+   bson_iter_t child;
+
+   if (!BSON_ITER_HOLDS_ARRAY (iter) || !bson_iter_recurse (iter, &child)) {
+      return false;
+   }
+   while (bson_iter_next (&child)) {
+      if (!fn (paths, &child)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/* A delete statement, {q: <filter>, limit: <n>}. */
+static bool
+_delete_is_disjoint (const _mongocrypt_schema_paths_t *paths,
+                     const bson_iter_t *iter)
+{
+   bson_iter_t child;
+
+   if (!BSON_ITER_HOLDS_DOCUMENT (iter) || !bson_iter_recurse (iter, &child)) {
+      return false;
+   }
+   while (bson_iter_next (&child)) {
+      const char *key;
+
+      key = bson_iter_key (&child);
+      if (0 == strcmp (key, "q")) {
+         if (!_filter_is_disjoint (paths, &child)) {
+            return false;
+         }
+      } else if (0 != strcmp (key, "limit")) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+static bool
+_field_is_disjoint (const _mongocrypt_schema_paths_t *paths,
+                    const char *cmd_name,
+                    const bson_iter_t *iter)
+{
+   const char *key;
+
+   key = bson_iter_key (iter);
+   if (0 == strcmp (cmd_name, "find")) {
+      if (0 == strcmp (key, "filter")) {
+         return _filter_is_disjoint (paths, iter);
+      }
+      if (0 == strcmp (key, "projection") || 0 == strcmp (key, "sort")) {
+         return _keys_are_disjoint (paths, iter);
+      }
+      return 0 == strcmp (key, "limit") || 0 == strcmp (key, "skip") ||
+             0 == strcmp (key, "batchSize") ||
+             0 == strcmp (key, "singleBatch");
+   }
+   if (0 == strcmp (cmd_name, "count")) {
+      if (0 == strcmp (key, "query")) {
+         return _filter_is_disjoint (paths, iter);
+      }
+      return 0 == strcmp (key, "limit") || 0 == strcmp (key, "skip");
+   }
+   if (0 == strcmp (cmd_name, "distinct")) {
+      if (0 == strcmp (key, "query")) {
+         return _filter_is_disjoint (paths, iter);
+      }
+      return 0 == strcmp (key, "key") && BSON_ITER_HOLDS_UTF8 (iter) &&
+             _path_is_disjoint (paths, bson_iter_utf8 (iter, NULL));
+   }
+   if (0 == strcmp (cmd_name, "insert")) {
+      if (0 == strcmp (key, "documents")) {
+         return _each_is_disjoint (paths, iter, _keys_are_disjoint);
+      }
+      return 0 == strcmp (key, "ordered") ||
+             0 == strcmp (key, "bypassDocumentValidation");
+   }
+   if (0 == strcmp (cmd_name, "delete")) {
+      if (0 == strcmp (key, "deletes")) {
+         return _each_is_disjoint (paths, iter, _delete_is_disjoint);
+      }
+      return 0 == strcmp (key, "ordered");
+   }
+   return false;
+}
+
+
+bool
+_mongocrypt_schema_paths_cmd_is_disjoint (
+   const _mongocrypt_schema_paths_t *paths, const bson_t *cmd)
+{
+   bson_iter_t iter;
+   const char *cmd_name;
+
+   if (!bson_iter_init (&iter, cmd) || !bson_iter_next (&iter)) {
+      return false;
+   }
+   cmd_name = bson_iter_key (&iter);
+   if (0 != strcmp (cmd_name, "find") && 0 != strcmp (cmd_name, "count") &&
+       0 != strcmp (cmd_name, "distinct") &&
+       0 != strcmp (cmd_name, "insert") && 0 != strcmp (cmd_name, "delete")) {
+      return false;
+   }
+
+   while (bson_iter_next (&iter)) {
+      if (_in_list (bson_iter_key (&iter),
+                    _generic_fields,
+                    sizeof (_generic_fields) / sizeof (_generic_fields[0]))) {
+         continue;
+      }
+      if (!_field_is_disjoint (paths, cmd_name, &iter)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+void
+_mongocrypt_schema_paths_cleanup (_mongocrypt_schema_paths_t *paths)
+{
+   uint32_t i;
+
+   if (!paths) {
+      return;
+   }
+   for (i = 0; i < paths->len; i++) {
+      bson_free (paths->paths[i]);
+   }
+   bson_free (paths->paths);
+   paths->paths = NULL;
+   paths->len = 0;
+}
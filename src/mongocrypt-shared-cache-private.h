@@ -0,0 +1,41 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_SHARED_CACHE_PRIVATE_H
+#define MONGOCRYPT_SHARED_CACHE_PRIVATE_H
+
+#include "mongocrypt.h"
+#include "mongocrypt-cache-private.h"
+#include "mongocrypt-cache-oauth-private.h"
+
+/* The caches that only depend on the key vault and KMS providers. Every
+ * mongocrypt_t uses one, created by mongocrypt_new unless another is set
+ * with mongocrypt_setopt_shared_cache. */
+struct _mongocrypt_shared_cache_t {
+   /* The creator and each mongocrypt_t using the caches. Updated with
+    * _mongocrypt_atomic_add_int64. */
+   int64_t refs;
+   _mongocrypt_cache_t cache_collinfo;
+   _mongocrypt_cache_t cache_key;
+   _mongocrypt_cache_oauth_t *cache_oauth_azure;
+   _mongocrypt_cache_oauth_t *cache_oauth_gcp;
+};
+
+/* Take another reference. Released with mongocrypt_shared_cache_destroy. */
+mongocrypt_shared_cache_t *
+_mongocrypt_shared_cache_retain (mongocrypt_shared_cache_t *shared);
+
+#endif /* MONGOCRYPT_SHARED_CACHE_PRIVATE_H */
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-cache-collinfo-private.h"
+#include "mongocrypt-cache-key-private.h"
+#include "mongocrypt-mutex-private.h"
+#include "mongocrypt-shared-cache-private.h"
+
+
+mongocrypt_shared_cache_t *
+mongocrypt_shared_cache_new (void)
+{
+   mongocrypt_shared_cache_t *shared;
+
+   shared = bson_malloc0 (sizeof (*shared));
+   BSON_ASSERT (shared);
+
+   shared->refs = 1;
+   _mongocrypt_cache_collinfo_init (&shared->cache_collinfo);
+   _mongocrypt_cache_key_init (&shared->cache_key);
+   shared->cache_collinfo.name = "collinfo";
+   shared->cache_key.name = "key";
+   shared->cache_oauth_azure = _mongocrypt_cache_oauth_new ();
+   shared->cache_oauth_gcp = _mongocrypt_cache_oauth_new ();
+   return shared;
+}
+
+
+mongocrypt_shared_cache_t *
+_mongocrypt_shared_cache_retain (mongocrypt_shared_cache_t *shared)
+{
+   _mongocrypt_atomic_add_int64 (&shared->refs, 1);
+   return shared;
+}
+
+
+void
+mongocrypt_shared_cache_destroy (mongocrypt_shared_cache_t *shared)
+{
+   if (!shared) {
+      return;
+   }
+   if (_mongocrypt_atomic_add_int64 (&shared->refs, -1) > 0) {
+      return;
+   }
+   _mongocrypt_cache_cleanup (&shared->cache_collinfo);
+   _mongocrypt_cache_cleanup (&shared->cache_key);
+   _mongocrypt_cache_oauth_destroy (shared->cache_oauth_azure);
+   _mongocrypt_cache_oauth_destroy (shared->cache_oauth_gcp);
+   bson_free (shared);
+}
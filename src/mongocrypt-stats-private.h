@@ -0,0 +1,113 @@
+/*
+ * Copyright 2020-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_STATS_PRIVATE_H
+#define MONGOCRYPT_STATS_PRIVATE_H
+
+#include <stdint.h>
+
+#include "mongocrypt-mutex-private.h"
+
+typedef enum {
+   MONGOCRYPT_STATS_KMS_AWS,
+   MONGOCRYPT_STATS_KMS_AZURE,
+   MONGOCRYPT_STATS_KMS_GCP,
+   MONGOCRYPT_STATS_KMS_NUM
+} _mongocrypt_stats_kms_provider_t;
+
+typedef struct {
+   int64_t requests;
+   int64_t bytes_sent;
+   int64_t bytes_received;
+   /* OAuth token requests. A subset of requests. */
+   int64_t oauth_refreshes;
+} _mongocrypt_stats_kms_t;
+
+/* Calls to the callbacks set by mongocrypt_setopt_key_cache_backend. */
+typedef struct {
+   int64_t hits;
+   int64_t misses;
+   int64_t puts;
+   int64_t evictions;
+} _mongocrypt_stats_key_backend_t;
+
+/* Bytes currently held, reported by mongocrypt_get_memory_usage. Unlike the
+ * counters below these go down as memory is freed, but they are updated and
+ * read the same way. */
+typedef struct {
+   /* Contexts and their arenas. */
+   int64_t contexts;
+   /* KMS requests and the responses fed so far. */
+   int64_t kms;
+} _mongocrypt_memory_t;
+
+/* The most namespaces counted separately. Work on other namespaces is
+ * counted in _mongocrypt_stats_namespaces_t.overflow. */
+#define MONGOCRYPT_STATS_MAX_NAMESPACES 64
+
+/* The work of the encryption and decryption contexts of one namespace,
+ * counted when they are finalized, except for mongocryptd round trips and
+ * collinfo misses, which are counted as they happen. */
+typedef struct {
+   int64_t encrypt_ops;
+   int64_t decrypt_ops;
+   int64_t fields_encrypted;
+   int64_t fields_decrypted;
+   /* Bytes of the documents output by decryption. */
+   int64_t plaintext_bytes;
+   /* Bytes of the documents output by encryption. */
+   int64_t ciphertext_bytes;
+   int64_t mongocryptd_round_trips;
+   int64_t collinfo_misses;
+} _mongocrypt_stats_ns_t;
+
+/* Counters by namespace. Slots are claimed under mutex and never released,
+ * so lookups read names[i] for i < num_names without the lock. */
+typedef struct {
+   mongocrypt_mutex_t mutex;
+   char *names[MONGOCRYPT_STATS_MAX_NAMESPACES];
+   _mongocrypt_stats_ns_t counters[MONGOCRYPT_STATS_MAX_NAMESPACES];
+   int64_t num_names;
+   _mongocrypt_stats_ns_t overflow;
+} _mongocrypt_stats_namespaces_t;
+
+/* Monotonic counters reported by mongocrypt_get_stats. Every counter is
+ * only updated with _mongocrypt_atomic_add_int64 and read with
+ * _mongocrypt_atomic_load_int64, so they may be polled from any thread. */
+typedef struct {
+   _mongocrypt_stats_kms_t kms[MONGOCRYPT_STATS_KMS_NUM];
+   int64_t mongocryptd_round_trips;
+   int64_t fields_encrypted;
+   int64_t fields_decrypted;
+   _mongocrypt_stats_key_backend_t key_backend;
+   _mongocrypt_memory_t memory;
+   _mongocrypt_stats_namespaces_t namespaces;
+} _mongocrypt_stats_t;
+
+void
+_mongocrypt_stats_namespaces_init (_mongocrypt_stats_namespaces_t *namespaces);
+
+void
+_mongocrypt_stats_namespaces_cleanup (
+   _mongocrypt_stats_namespaces_t *namespaces);
+
+/* Returns the counters of @ns, claiming a slot for it if there is one left,
+ * or the overflow counters. */
+_mongocrypt_stats_ns_t *
+_mongocrypt_stats_namespaces_get (_mongocrypt_stats_namespaces_t *namespaces,
+                                  const char *ns);
+
+#endif /* MONGOCRYPT_STATS_PRIVATE_H */
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2020-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MONGOCRYPT_TRACE_PRIVATE_H
+#define MONGOCRYPT_TRACE_PRIVATE_H
+
+#include <bson/bson.h>
+
+#include "mongocrypt.h"
+
+typedef struct {
+   mongocrypt_trace_fn_t fn;
+   void *ctx;
+   /* Source of span ids. Updated with _mongocrypt_atomic_add_int64. */
+   int64_t last_id;
+} _mongocrypt_trace_t;
+
+/* Check this before building span attributes, so tracing costs a single
+ * branch when no handler is set. @trace may be NULL. */
+#define MONGOCRYPT_TRACING(trace) ((trace) && (trace)->fn)
+
+/* Call the handler for the start of a span. Returns the span id to pass to
+ * _mongocrypt_trace_end. @attrs may be NULL. */
+uint64_t
+_mongocrypt_trace_begin (_mongocrypt_trace_t *trace,
+                         mongocrypt_trace_span_t span,
+                         const bson_t *attrs);
+
+void
+_mongocrypt_trace_end (_mongocrypt_trace_t *trace,
+                       mongocrypt_trace_span_t span,
+                       uint64_t id,
+                       const bson_t *attrs);
+
+#endif /* MONGOCRYPT_TRACE_PRIVATE_H */
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2020-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-binary-private.h"
+#include "mongocrypt-mutex-private.h"
+#include "mongocrypt-trace-private.h"
+
+
+static void
+_call (_mongocrypt_trace_t *trace,
+       mongocrypt_trace_span_t span,
+       bool begin,
+       uint64_t id,
+       const bson_t *attrs)
+{
+   static const uint8_t empty_doc[] = {5, 0, 0, 0, 0};
+   mongocrypt_binary_t bin;
+
+   memset (&bin, 0, sizeof (bin));
+   if (attrs) {
+      bin.data = (uint8_t *) bson_get_data (attrs);
+      bin.len = attrs->len;
+   } else {
+      bin.data = (uint8_t *) empty_doc;
+      bin.len = sizeof (empty_doc);
+   }
+   trace->fn (span, begin, id, &bin, trace->ctx);
+}
+
+
+uint64_t
+_mongocrypt_trace_begin (_mongocrypt_trace_t *trace,
+                         mongocrypt_trace_span_t span,
+                         const bson_t *attrs)
+{
+   uint64_t id;
+
+   if (!MONGOCRYPT_TRACING (trace)) {
+      return 0;
+   }
+
+   id = (uint64_t) _mongocrypt_atomic_add_int64 (&trace->last_id, 1);
+   _call (trace, span, true, id, attrs);
+   return id;
+}
+
+
+void
+_mongocrypt_trace_end (_mongocrypt_trace_t *trace,
+                       mongocrypt_trace_span_t span,
+                       uint64_t id,
+                       const bson_t *attrs)
+{
+   if (!MONGOCRYPT_TRACING (trace) || !id) {
+      return;
+   }
+
+   _call (trace, span, false, id, attrs);
+}
@@ -55,4 +55,184 @@ _mongocrypt_transform_binary_in_bson (_mongocrypt_transform_callback_t cb,
    MONGOCRYPT_WARN_UNUSED_RESULT;
 
 
+/* Restricts a scan to the values at or under one of @paths, which are
+ * dotted field paths. Array indexes are not path components, so "a.b"
+ * matches the field "b" of every document of an array "a". Documents that
+ * cannot hold a matching path are skipped without being walked. */
+typedef struct {
+   char **paths;
+   uint32_t len;
+   /* If true, the keys of the root document are not path components either,
+    * as for the documents of a decrypt batch. */
+   bool skip_root;
+} _mongocrypt_path_filter_t;
+
+
+/* Like _mongocrypt_traverse_binary_in_bson, but walks the raw bytes of @bson
+ * directly. Fails on malformed BSON. @filter may be NULL. */
+bool
+_mongocrypt_scan_binary_in_bson (_mongocrypt_traverse_callback_t cb,
+                                 void *ctx,
+                                 traversal_match_t match,
+                                 const bson_t *bson,
+                                 const _mongocrypt_path_filter_t *filter,
+                                 mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+
+/* Returns false if @bson certainly contains no binary subtype 06 value where
+ * the first byte corresponds to 'match'. Cheaper than a traversal. */
+bool
+_mongocrypt_traverse_may_match (const bson_t *bson, traversal_match_t match);
+
+
+/* A splice transforms the matching binaries of a document without rebuilding
+ * it. The matches are located first, then transformed, then the output is
+ * copied from the input with only the transformed values and the lengths of
+ * their enclosing documents and arrays rewritten. */
+typedef struct {
+   const uint8_t *len_prefix; /* Points into the input. */
+   int32_t parent;            /* Index of the enclosing container, or -1. */
+   int64_t delta;             /* Change in length. */
+   bool is_array;
+} _mongocrypt_splice_container_t;
+
+typedef struct {
+   /* The element's type byte and value bytes. Point into the input. */
+   const uint8_t *type;
+   const uint8_t *start;
+   const uint8_t *end;
+   int32_t parent; /* Index of the enclosing container. */
+   _mongocrypt_buffer_t in;
+   bson_value_t out;
+   /* out encoded as the only element of a document with an empty key. Not
+    * set for common types, which are written straight from out. */
+   uint8_t *encoded;
+   uint32_t encoded_len;
+   /* The length of out written straight, if encoded is not set. */
+   uint32_t value_len;
+   /* Parsed from in by the owner of the splice when it was collected, or
+    * NULL. Freed with the header_destroy of the splice. */
+   void *header;
+   /* Only set if transformed through parallel_for. */
+   mongocrypt_status_t *status;
+   bool ok;
+   /* Set by _mongocrypt_splice_dedupe. The item is not transformed, and its
+    * out is copied from the earlier item at copy_of instead. */
+   bool is_copy;
+   uint32_t copy_of;
+} _mongocrypt_splice_item_t;
+
+/* Transforms the in of one item into its out, or, while collecting, records
+ * its header. */
+typedef bool (*_mongocrypt_splice_callback_t) (void *ctx,
+                                               _mongocrypt_splice_item_t *item,
+                                               mongocrypt_status_t *status);
+
+typedef struct {
+   traversal_match_t match;
+   _mongocrypt_splice_container_t *containers;
+   uint32_t n_containers;
+   uint32_t containers_size;
+   _mongocrypt_splice_item_t *items;
+   uint32_t n_items;
+   uint32_t items_size;
+   _mongocrypt_splice_callback_t cb;
+   void *ctx;
+   /* If set before _mongocrypt_splice_collect, only matches it selects are
+    * collected. */
+   const _mongocrypt_path_filter_t *filter;
+   /* Frees the header of an item, if set. */
+   void (*header_destroy) (void *header);
+   /* Set by _mongocrypt_splice_collect. The input data, which must stay
+    * valid until _mongocrypt_splice_write. */
+   const uint8_t *in_data;
+   uint32_t in_len;
+   /* Set by _mongocrypt_splice_measure. */
+   uint32_t out_len;
+} _mongocrypt_splice_t;
+
+
+void
+_mongocrypt_splice_init (_mongocrypt_splice_t *splice,
+                         traversal_match_t match);
+
+bool
+_mongocrypt_splice_collect (_mongocrypt_splice_t *splice,
+                            const bson_t *in,
+                            mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Mark every item for which @eligible returns true and whose in is identical
+ * to that of an earlier eligible item as a copy of the earlier item. Only use
+ * it when equal inputs must give equal outputs, as with deterministic
+ * encryption. Returns the number of items marked. */
+uint32_t
+_mongocrypt_splice_dedupe (
+   _mongocrypt_splice_t *splice,
+   bool (*eligible) (const _mongocrypt_splice_item_t *item));
+
+bool
+_mongocrypt_splice_transform (_mongocrypt_splice_t *splice,
+                              _mongocrypt_splice_callback_t cb,
+                              void *ctx,
+                              mongocrypt_parallel_for_fn parallel_for,
+                              void *parallel_for_ctx,
+                              mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Transforms every item of a splice in one call. Sets the out of each item
+ * only on success. */
+typedef bool (*_mongocrypt_splice_batch_callback_t) (
+   void *ctx,
+   _mongocrypt_splice_item_t *items,
+   uint32_t n_items,
+   mongocrypt_status_t *status);
+
+/* Like _mongocrypt_splice_transform, but passes all collected values to @cb
+ * at once. */
+bool
+_mongocrypt_splice_transform_batch (_mongocrypt_splice_t *splice,
+                                    _mongocrypt_splice_batch_callback_t cb,
+                                    void *ctx,
+                                    mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Sets @len to the length of the output document. */
+bool
+_mongocrypt_splice_measure (_mongocrypt_splice_t *splice,
+                            uint32_t *len,
+                            mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Writes exactly the length set by _mongocrypt_splice_measure to @dst. */
+void
+_mongocrypt_splice_write (_mongocrypt_splice_t *splice, uint8_t *dst);
+
+/* @out is initialized and owns the output document. */
+bool
+_mongocrypt_splice_finish (_mongocrypt_splice_t *splice,
+                           _mongocrypt_buffer_t *out,
+                           mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Like _mongocrypt_splice_finish, but overwrites the input, which must be
+ * writable. @out views it. Fails if a transformed value is longer than the
+ * value it replaces. */
+bool
+_mongocrypt_splice_finish_in_place (_mongocrypt_splice_t *splice,
+                                    _mongocrypt_buffer_t *out,
+                                    mongocrypt_status_t *status)
+   MONGOCRYPT_WARN_UNUSED_RESULT;
+
+/* Release the items of @splice and leave it empty, like
+ * _mongocrypt_splice_init, but keep its arrays for the next collect. */
+void
+_mongocrypt_splice_clear (_mongocrypt_splice_t *splice,
+                          traversal_match_t match);
+
+void
+_mongocrypt_splice_cleanup (_mongocrypt_splice_t *splice);
+
+
 #endif /* MONGOCRYPT_TRAVERSE_UTIL_H */
@@ -24,15 +24,28 @@
 
 typedef struct {
    void *ctx;
-   bson_iter_t iter;
    bson_t *copy; /* implies transform */
-   char *path;   /* only enabled during tracing. */
    _mongocrypt_traverse_callback_t traverse_cb;
    _mongocrypt_transform_callback_t transform_cb;
    mongocrypt_status_t *status;
    traversal_match_t match;
-   bson_t child;
-} _recurse_state_t;
+} _traverse_state_t;
+
+/* One level of a traversal. Frames are allocated once per traversal and
+ * never move, since a child bson_t being appended refers to its parent. */
+typedef struct {
+   bson_iter_t iter;
+   bson_t child; /* The copy of this level, except for the root. */
+   bool is_array;
+} _traverse_frame_t;
+
+/* The explicit stack of a traversal, so nesting costs a pointer on the C
+ * stack instead of a frame per level. */
+typedef struct {
+   _traverse_frame_t **frames;
+   uint32_t depth; /* Frames in use. */
+   uint32_t len;   /* Frames allocated. */
+} _traverse_stack_t;
 
 static bool
 _check_first_byte (uint8_t byte, traversal_match_t match)
@@ -40,41 +53,136 @@ _check_first_byte (uint8_t byte, traversal_match_t match)
 #define FIRST_BYTE_MARKING 0
 #define FIRST_BYTE_DETERMINISTIC 1
 #define FIRST_BYTE_RANDOMIZED 2
+#define FIRST_BYTE_RANDOMIZED_COMPRESSED 3
 
    switch (match) {
    case TRAVERSE_MATCH_MARKING:
       return byte == FIRST_BYTE_MARKING;
    case TRAVERSE_MATCH_CIPHERTEXT:
-      return byte == FIRST_BYTE_DETERMINISTIC || byte == FIRST_BYTE_RANDOMIZED;
+      return byte == FIRST_BYTE_DETERMINISTIC ||
+             byte == FIRST_BYTE_RANDOMIZED ||
+             byte == FIRST_BYTE_RANDOMIZED_COMPRESSED;
    }
    return false;
 }
 
+bool
+_mongocrypt_traverse_may_match (const bson_t *bson, traversal_match_t match)
+{
+   const uint8_t *data, *end, *found;
+
+   /* Every match is stored as the subtype byte 06 followed by the first byte
+    * of the data. Look for that pair with memchr, which libc vectorizes,
+    * instead of iterating every element. */
+   data = bson_get_data (bson);
+   end = data + bson->len;
+   while ((found = memchr (data, 6, (size_t) (end - data))) != NULL) {
+      if (found + 1 < end && _check_first_byte (found[1], match)) {
+         return true;
+      }
+      data = found + 1;
+   }
+   return false;
+}
+
+
+/* The document being appended to at level @i, or NULL if not transforming. */
+static bson_t *
+_traverse_copy (_traverse_state_t *state, _traverse_stack_t *stack, uint32_t i)
+{
+   if (!state->copy) {
+      return NULL;
+   }
+   return i == 0 ? state->copy : &stack->frames[i]->child;
+}
+
+
+static _traverse_frame_t *
+_traverse_push (_traverse_stack_t *stack)
+{
+   if (stack->depth == stack->len) {
+      uint32_t i, len;
+
+      len = stack->len ? stack->len * 2u : 8u;
+      stack->frames =
+         bson_realloc (stack->frames, sizeof (_traverse_frame_t *) * len);
+      for (i = stack->len; i < len; i++) {
+         stack->frames[i] = NULL;
+      }
+      stack->len = len;
+   }
+   if (!stack->frames[stack->depth]) {
+      stack->frames[stack->depth] = bson_malloc (sizeof (_traverse_frame_t));
+      BSON_ASSERT (stack->frames[stack->depth]);
+   }
+   return stack->frames[stack->depth++];
+}
+
+
+/* Pop the top frame and finish its copy in the parent. */
 static bool
-_recurse (_recurse_state_t *state)
+_traverse_pop (_traverse_state_t *state, _traverse_stack_t *stack)
 {
+   _traverse_frame_t *frame;
+   bson_t *parent;
+
+   frame = stack->frames[--stack->depth];
+   if (stack->depth == 0 || !state->copy) {
+      return true;
+   }
+   parent = _traverse_copy (state, stack, stack->depth - 1u);
+   if (frame->is_array) {
+      return bson_append_array_end (parent, &frame->child);
+   }
+   return bson_append_document_end (parent, &frame->child);
+}
+
+
+static bool
+_traverse (_traverse_state_t *state, const bson_iter_t *iter)
+{
+   _traverse_stack_t stack = {0};
+   _traverse_frame_t *frame;
    mongocrypt_status_t *status;
+   uint32_t i;
+   bool ret = true;
 
    status = state->status;
-   while (bson_iter_next (&state->iter)) {
-      if (BSON_ITER_HOLDS_BINARY (&state->iter)) {
+   frame = _traverse_push (&stack);
+   memcpy (&frame->iter, iter, sizeof (bson_iter_t));
+   frame->is_array = false;
+
+   while (stack.depth > 0) {
+      bson_t *copy;
+
+      frame = stack.frames[stack.depth - 1u];
+      copy = _traverse_copy (state, &stack, stack.depth - 1u);
+      if (!bson_iter_next (&frame->iter)) {
+         if (!_traverse_pop (state, &stack)) {
+            CLIENT_ERR ("error appending document");
+            ret = false;
+            break;
+         }
+         continue;
+      }
+
+      if (BSON_ITER_HOLDS_BINARY (&frame->iter)) {
          _mongocrypt_buffer_t value;
 
          BSON_ASSERT (
-            _mongocrypt_buffer_from_binary_iter (&value, &state->iter));
+            _mongocrypt_buffer_from_binary_iter (&value, &frame->iter));
 
          if (value.subtype == 6 && value.len > 0 &&
              _check_first_byte (value.data[0], state->match)) {
-            bool ret;
             /* call the right callback. */
-            if (state->copy) {
+            if (copy) {
                bson_value_t value_out;
                ret =
                   state->transform_cb (state->ctx, &value, &value_out, status);
                if (ret) {
-                  bson_append_value (state->copy,
-                                     bson_iter_key (&state->iter),
-                                     bson_iter_key_len (&state->iter),
+                  bson_append_value (copy,
+                                     bson_iter_key (&frame->iter),
+                                     bson_iter_key_len (&frame->iter),
                                      &value_out);
                   bson_value_destroy (&value_out);
                }
@@ -83,82 +191,65 @@ _recurse (_recurse_state_t *state)
             }
 
             if (!ret) {
-               return false;
+               break;
             }
             continue;
          }
          /* fall through and copy */
       }
 
-      if (BSON_ITER_HOLDS_ARRAY (&state->iter)) {
-         _recurse_state_t child_state;
-         bool ret;
+      if (BSON_ITER_HOLDS_ARRAY (&frame->iter) ||
+          BSON_ITER_HOLDS_DOCUMENT (&frame->iter)) {
+         _traverse_frame_t *child;
+         bool is_array;
 
-         memcpy (&child_state, state, sizeof (_recurse_state_t));
-         if (!bson_iter_recurse (&state->iter, &child_state.iter)) {
-            CLIENT_ERR ("error recursing into array");
-            return false;
-         }
-
-         if (state->copy) {
-            bson_append_array_begin (state->copy,
-                                     bson_iter_key (&state->iter),
-                                     bson_iter_key_len (&state->iter),
-                                     &state->child);
-            child_state.copy = &state->child;
-         }
-         ret = _recurse (&child_state);
-
-         if (state->copy) {
-            bson_append_array_end (state->copy, &state->child);
-         }
-         if (!ret) {
-            return false;
-         }
-         continue;
-      }
-
-      if (BSON_ITER_HOLDS_DOCUMENT (&state->iter)) {
-         _recurse_state_t child_state;
-         bool ret;
-
-         memcpy (&child_state, state, sizeof (_recurse_state_t));
-         if (!bson_iter_recurse (&state->iter, &child_state.iter)) {
-            CLIENT_ERR ("error recursing into document");
-            return false;
-         }
-         /* TODO: check for errors everywhere. */
-         if (state->copy) {
-            bson_append_document_begin (state->copy,
-                                        bson_iter_key (&state->iter),
-                                        bson_iter_key_len (&state->iter),
-                                        &state->child);
-            child_state.copy = &state->child;
-         }
-
-         ret = _recurse (&child_state);
-
-         if (state->copy) {
-            if (!bson_append_document_end (state->copy, &state->child)) {
-               CLIENT_ERR ("error appending document");
-               return false;
+         is_array = BSON_ITER_HOLDS_ARRAY (&frame->iter);
+         child = _traverse_push (&stack);
+         child->is_array = is_array;
+         if (!bson_iter_recurse (&frame->iter, &child->iter)) {
+            stack.depth--;
+            if (is_array) {
+               CLIENT_ERR ("error recursing into array");
+            } else {
+               CLIENT_ERR ("error recursing into document");
             }
+            ret = false;
+            break;
          }
-
-         if (!ret) {
-            return false;
+         if (copy) {
+            if (is_array) {
+               bson_append_array_begin (copy,
+                                        bson_iter_key (&frame->iter),
+                                        bson_iter_key_len (&frame->iter),
+                                        &child->child);
+            } else {
+               bson_append_document_begin (copy,
+                                           bson_iter_key (&frame->iter),
+                                           bson_iter_key_len (&frame->iter),
+                                           &child->child);
+            }
          }
          continue;
       }
 
-      if (state->copy) {
-         bson_append_value (state->copy,
-                            bson_iter_key (&state->iter),
-                            bson_iter_key_len (&state->iter),
-                            bson_iter_value (&state->iter));
+      if (copy) {
+         bson_append_value (copy,
+                            bson_iter_key (&frame->iter),
+                            bson_iter_key_len (&frame->iter),
+                            bson_iter_value (&frame->iter));
       }
    }
-   return true;
+
+   /* On failure, finish the copies still open so the output can be
+    * destroyed. */
+   while (stack.depth > 0) {
+      _traverse_pop (state, &stack);
+   }
+   for (i = 0; i < stack.len; i++) {
+      bson_free (stack.frames[i]);
+   }
+   bson_free (stack.frames);
+   return ret;
 }
 
 bool
@@ -169,17 +260,14 @@ _mongocrypt_transform_binary_in_bson (_mongocrypt_transform_callback_t cb,
                                       bson_t *out,
                                       mongocrypt_status_t *status)
 {
-   _recurse_state_t starting_state = {ctx,
-                                      *iter,
-                                      out /* copy */,
-                                      NULL /* path */,
-                                      NULL /* traverse callback */,
-                                      cb,
-                                      status,
-                                      match,
-                                      {0}};
+   _traverse_state_t state = {ctx,
+                              out /* copy */,
+                              NULL /* traverse callback */,
+                              cb,
+                              status,
+                              match};
 
-   return _recurse (&starting_state);
+   return _traverse (&state, iter);
 }
 
 
@@ -202,15 +290,1134 @@ _mongocrypt_traverse_binary_in_bson (_mongocrypt_traverse_callback_t cb,
                                      bson_iter_t *iter,
                                      mongocrypt_status_t *status)
 {
-   _recurse_state_t starting_state = {ctx,
-                                      *iter,
-                                      NULL /* copy */,
-                                      NULL /* path */,
-                                      cb,
-                                      NULL /* transform callback */,
-                                      status,
-                                      match,
-                                      {0}};
-
-   return _recurse (&starting_state);
+   _traverse_state_t state = {ctx,
+                              NULL /* copy */,
+                              cb,
+                              NULL /* transform callback */,
+                              status,
+                              match};
+
+   return _traverse (&state, iter);
+}
+
+
+
+void
+_mongocrypt_splice_init (_mongocrypt_splice_t *splice, traversal_match_t match)
+{
+   memset (splice, 0, sizeof (*splice));
+   splice->match = match;
+}
+
+
+static int32_t
+_splice_push_container (_mongocrypt_splice_t *splice,
+                        const uint8_t *len_prefix,
+                        int32_t parent,
+                        bool is_array)
+{
+   _mongocrypt_splice_container_t *container;
+
+   if (splice->n_containers == splice->containers_size) {
+      splice->containers_size =
+         splice->containers_size ? splice->containers_size * 2 : 8;
+      splice->containers =
+         bson_realloc (splice->containers,
+                       splice->containers_size *
+                          sizeof (_mongocrypt_splice_container_t));
+   }
+   container = &splice->containers[splice->n_containers];
+   container->len_prefix = len_prefix;
+   container->parent = parent;
+   container->delta = 0;
+   container->is_array = is_array;
+   return (int32_t) splice->n_containers++;
+}
+
+
+static void
+_splice_push_item (_mongocrypt_splice_t *splice,
+                   const uint8_t *type,
+                   const uint8_t *start,
+                   _mongocrypt_buffer_t *value,
+                   int32_t parent)
+{
+   _mongocrypt_splice_item_t *item;
+
+   if (splice->n_items == splice->items_size) {
+      splice->items_size = splice->items_size ? splice->items_size * 2 : 16;
+      splice->items =
+         bson_realloc (splice->items,
+                       splice->items_size * sizeof (_mongocrypt_splice_item_t));
+   }
+   item = &splice->items[splice->n_items++];
+   memset (item, 0, sizeof (*item));
+   item->type = type;
+   item->start = start;
+   item->end = value->data + value->len;
+   item->parent = parent;
+   memcpy (&item->in, value, sizeof (_mongocrypt_buffer_t));
+   item->out.value_type = BSON_TYPE_EOD;
+}
+
+
+/* One level of a raw scan. */
+typedef struct {
+   const uint8_t *p;   /* The next element. */
+   const uint8_t *end; /* The trailing 0 of the document. */
+   int32_t container;  /* The splice container of the document, or -1. */
+   bool keys_are_paths;
+   bool selected;
+   size_t path_len;  /* The path of the parent, restored when popped. */
+   uint32_t n_items; /* Splice items recorded before the document. */
+} _scan_frame_t;
+
+
+typedef struct {
+   traversal_match_t match;
+   /* If splice is set, matches and their containers are recorded in it.
+    * Otherwise traverse_cb is called for every match. */
+   _mongocrypt_splice_t *splice;
+   _mongocrypt_traverse_callback_t traverse_cb;
+   void *ctx;
+   mongocrypt_status_t *status;
+   /* If filter is set, path holds the dotted path of the current document,
+    * which is not NULL terminated. */
+   const _mongocrypt_path_filter_t *filter;
+   char *path;
+   size_t path_len;
+   size_t path_size;
+   /* The documents and arrays being walked, innermost last. */
+   _scan_frame_t *frames;
+   uint32_t depth;
+   uint32_t frames_size;
+} _scan_state_t;
+
+
+typedef enum {
+   PATH_UNSELECTED,
+   PATH_PARTIAL, /* A strict prefix of a selected path. */
+   PATH_SELECTED
+} _path_match_t;
+
+
+static _path_match_t
+_path_match (const _mongocrypt_path_filter_t *filter,
+             const char *path,
+             size_t len)
+{
+   _path_match_t ret = PATH_UNSELECTED;
+   uint32_t i;
+
+   for (i = 0; i < filter->len; i++) {
+      const char *selected;
+      size_t selected_len;
+
+      selected = filter->paths[i];
+      selected_len = strlen (selected);
+      if (selected_len <= len && 0 == memcmp (path, selected, selected_len) &&
+          (selected_len == len || path[selected_len] == '.')) {
+         return PATH_SELECTED;
+      }
+      if (selected_len > len && 0 == memcmp (path, selected, len) &&
+          selected[len] == '.') {
+         ret = PATH_PARTIAL;
+      }
+   }
+   return ret;
+}
+
+
+/* Append the key @key of @key_len bytes to the path of @state. */
+static void
+_scan_push_key (_scan_state_t *state, const uint8_t *key, size_t key_len)
+{
+   size_t needed;
+
+   needed = state->path_len + 1 + key_len;
+   if (needed > state->path_size) {
+      state->path_size = BSON_MAX (needed, 2 * state->path_size);
+      state->path = bson_realloc (state->path, state->path_size);
+   }
+   if (state->path_len > 0) {
+      state->path[state->path_len++] = '.';
+   }
+   memcpy (state->path + state->path_len, key, key_len);
+   state->path_len += key_len;
+}
+
+
+static uint32_t
+_scan_int32 (const uint8_t *data)
+{
+   uint32_t value;
+
+   memcpy (&value, data, sizeof (value));
+   return BSON_UINT32_FROM_LE (value);
+}
+
+
+/* Get the length of a BSON string value: an int32 length, then that many
+ * bytes, the last of which is 0. */
+static bool
+_scan_string_len (const uint8_t *value, size_t avail, size_t *value_len)
+{
+   uint32_t len;
+
+   if (avail < 4) {
+      return false;
+   }
+   len = _scan_int32 (value);
+   if (len < 1 || len > avail - 4 || value[4 + len - 1] != 0) {
+      return false;
+   }
+   *value_len = 4 + (size_t) len;
+   return true;
+}
+
+
+/* Push a frame for the elements of a document of @len bytes, which the
+ * caller checked is at least 5 bytes and ends with 0. */
+static void
+_scan_push (_scan_state_t *state,
+            const uint8_t *doc,
+            uint32_t len,
+            int32_t container,
+            bool keys_are_paths,
+            bool selected,
+            size_t path_len)
+{
+   _scan_frame_t *frame;
+
+   if (state->depth == state->frames_size) {
+      state->frames_size = state->frames_size ? state->frames_size * 2u : 8u;
+      state->frames = bson_realloc (
+         state->frames, state->frames_size * sizeof (_scan_frame_t));
+   }
+   frame = &state->frames[state->depth++];
+   frame->p = doc + 4;
+   frame->end = doc + len - 1; /* The trailing 0. */
+   frame->container = container;
+   frame->keys_are_paths = keys_are_paths;
+   frame->selected = selected;
+   frame->path_len = path_len;
+   frame->n_items = state->splice ? state->splice->n_items : 0;
+}
+
+
+/* Pop the top frame and restore the path of its parent. */
+static void
+_scan_pop (_scan_state_t *state)
+{
+   _scan_frame_t *frame;
+
+   frame = &state->frames[--state->depth];
+   if (state->depth > 0 && state->splice &&
+       state->splice->n_items == frame->n_items) {
+      /* Nothing to replace. The container is copied as is. */
+      state->splice->n_containers--;
+   }
+   state->path_len = frame->path_len;
+}
+
+
+/* Walk the elements of a document of @len bytes, which the caller checked
+ * is at least 5 bytes and ends with 0. Every element is bounds checked.
+ * Keys are skipped with memchr, and values by their length, without building
+ * a bson_iter_t for every element. Nested documents and arrays are pushed on
+ * the frame stack of @state instead of recursing, so nesting costs no C
+ * stack. With a filter, @selected is true if the document is at or under a
+ * selected path, and @keys_are_paths is false for arrays. */
+static bool
+_scan_document (_scan_state_t *state,
+                const uint8_t *doc,
+                uint32_t len,
+                int32_t parent,
+                bool keys_are_paths,
+                bool selected)
+{
+   mongocrypt_status_t *status;
+
+   status = state->status;
+   state->depth = 0;
+   _scan_push (
+      state, doc, len, parent, keys_are_paths, selected, state->path_len);
+   while (state->depth > 0) {
+      _scan_frame_t *frame;
+      const uint8_t *type, *key_end, *value, *end;
+      size_t avail, value_len, path_len;
+      uint32_t sub_len;
+      _path_match_t path_match;
+
+      frame = &state->frames[state->depth - 1u];
+      end = frame->end;
+      if (frame->p >= end) {
+         _scan_pop (state);
+         continue;
+      }
+
+      type = frame->p;
+      key_end = memchr (type + 1, 0, (size_t) (end - (type + 1)));
+      if (!key_end) {
+         goto malformed;
+      }
+      value = key_end + 1;
+      avail = (size_t) (end - value);
+
+      path_len = state->path_len;
+      if (frame->selected) {
+         path_match = PATH_SELECTED;
+      } else if (frame->keys_are_paths) {
+         _scan_push_key (state, type + 1, (size_t) (key_end - (type + 1)));
+         path_match = _path_match (state->filter, state->path, state->path_len);
+      } else {
+         /* An array element, at the path of its array. */
+         path_match = PATH_PARTIAL;
+      }
+
+      switch ((bson_type_t) *type) {
+      case BSON_TYPE_UNDEFINED:
+      case BSON_TYPE_NULL:
+      case BSON_TYPE_MINKEY:
+      case BSON_TYPE_MAXKEY:
+         value_len = 0;
+         break;
+      case BSON_TYPE_BOOL:
+         value_len = 1;
+         break;
+      case BSON_TYPE_INT32:
+         value_len = 4;
+         break;
+      case BSON_TYPE_DOUBLE:
+      case BSON_TYPE_DATE_TIME:
+      case BSON_TYPE_TIMESTAMP:
+      case BSON_TYPE_INT64:
+         value_len = 8;
+         break;
+      case BSON_TYPE_OID:
+         value_len = 12;
+         break;
+      case BSON_TYPE_DECIMAL128:
+         value_len = 16;
+         break;
+      case BSON_TYPE_UTF8:
+      case BSON_TYPE_CODE:
+      case BSON_TYPE_SYMBOL:
+         if (!_scan_string_len (value, avail, &value_len)) {
+            goto malformed;
+         }
+         break;
+      case BSON_TYPE_DBPOINTER:
+         if (!_scan_string_len (value, avail, &value_len)) {
+            goto malformed;
+         }
+         value_len += 12;
+         break;
+      case BSON_TYPE_REGEX: {
+         const uint8_t *pattern_end, *options_end;
+
+         pattern_end = memchr (value, 0, avail);
+         if (!pattern_end) {
+            goto malformed;
+         }
+         options_end =
+            memchr (pattern_end + 1, 0, (size_t) (end - (pattern_end + 1)));
+         if (!options_end) {
+            goto malformed;
+         }
+         value_len = (size_t) (options_end + 1 - value);
+         break;
+      }
+      case BSON_TYPE_CODEWSCOPE:
+         if (avail < 4) {
+            goto malformed;
+         }
+         value_len = _scan_int32 (value);
+         if (value_len < 14) {
+            goto malformed;
+         }
+         break;
+      case BSON_TYPE_DOCUMENT:
+      case BSON_TYPE_ARRAY: {
+         int32_t container = -1;
+
+         if (avail < 4) {
+            goto malformed;
+         }
+         sub_len = _scan_int32 (value);
+         if (sub_len < 5 || sub_len > avail || value[sub_len - 1] != 0) {
+            goto malformed;
+         }
+         value_len = sub_len;
+         if (path_match == PATH_UNSELECTED) {
+            break;
+         }
+         if (state->splice) {
+            container = _splice_push_container (state->splice,
+                                                value,
+                                                frame->container,
+                                                *type == BSON_TYPE_ARRAY);
+         }
+         /* Resume after the child once it is popped, which restores the
+          * path. Pushing may move the frames. */
+         frame->p = value + value_len;
+         _scan_push (state,
+                     value,
+                     sub_len,
+                     container,
+                     *type == BSON_TYPE_DOCUMENT,
+                     path_match == PATH_SELECTED,
+                     path_len);
+         continue;
+      }
+      case BSON_TYPE_BINARY:
+         if (avail < 5) {
+            goto malformed;
+         }
+         sub_len = _scan_int32 (value);
+         if (sub_len > avail - 5) {
+            goto malformed;
+         }
+         value_len = 5 + (size_t) sub_len;
+         /* The int32 length is followed by the subtype, then the data. */
+         if (path_match == PATH_SELECTED && value[4] == 6 && sub_len > 0 &&
+             _check_first_byte (value[5], state->match)) {
+            _mongocrypt_buffer_t match;
+
+            _mongocrypt_buffer_init (&match);
+            match.data = (uint8_t *) value + 5;
+            match.len = sub_len;
+            match.subtype = (bson_subtype_t) 6;
+            if (state->splice) {
+               _splice_push_item (
+                  state->splice, type, value, &match, frame->container);
+            } else if (!state->traverse_cb (state->ctx, &match, status)) {
+               return false;
+            }
+         }
+         break;
+      case BSON_TYPE_EOD:
+      default:
+         goto malformed;
+      }
+
+      if (value_len > avail) {
+         goto malformed;
+      }
+      frame->p = value + value_len;
+      state->path_len = path_len;
+   }
+   return true;
+
+malformed:
+   CLIENT_ERR ("malformed BSON");
+   return false;
+}
+
+
+static bool
+_scan (_scan_state_t *state, const bson_t *bson, int32_t root)
+{
+   mongocrypt_status_t *status;
+   const uint8_t *data;
+   bool ret;
+
+   status = state->status;
+   data = bson_get_data (bson);
+   if (bson->len < 5 || _scan_int32 (data) != bson->len ||
+       data[bson->len - 1] != 0) {
+      CLIENT_ERR ("malformed BSON");
+      return false;
+   }
+   if (state->filter && state->filter->len == 0) {
+      state->filter = NULL;
+   }
+   ret = _scan_document (state,
+                         data,
+                         bson->len,
+                         root,
+                         !state->filter || !state->filter->skip_root,
+                         !state->filter);
+   bson_free (state->path);
+   state->path = NULL;
+   bson_free (state->frames);
+   state->frames = NULL;
+   return ret;
+}
+
+
+/*-----------------------------------------------------------------------------
+ *
+ * _mongocrypt_scan_binary_in_bson
+ *
+ *    Like _mongocrypt_traverse_binary_in_bson, but walks the raw bytes of
+ *    bson instead of iterating it with bson_iter_t. If filter is set, only
+ *    matches under its paths are passed to cb.
+ *
+ * Return:
+ *    True on success. Returns false on failure or malformed BSON, and sets
+ *    error.
+ *
+ *-----------------------------------------------------------------------------
+ */
+bool
+_mongocrypt_scan_binary_in_bson (_mongocrypt_traverse_callback_t cb,
+                                 void *ctx,
+                                 traversal_match_t match,
+                                 const bson_t *bson,
+                                 const _mongocrypt_path_filter_t *filter,
+                                 mongocrypt_status_t *status)
+{
+   _scan_state_t state;
+
+   memset (&state, 0, sizeof (state));
+   state.match = match;
+   state.traverse_cb = cb;
+   state.ctx = ctx;
+   state.status = status;
+   state.filter = filter;
+   return _scan (&state, bson, -1);
+}
+
+
+/*-----------------------------------------------------------------------------
+ *
+ * _mongocrypt_splice_collect
+ *
+ *    Record the location of every binary subtype 06 value in 'in' where the
+ *    first byte corresponds to the match, and of the documents and arrays
+ *    enclosing them. The data of 'in' must outlive the splice, though 'in'
+ *    itself need not. If the splice has a filter, only matches under its
+ *    paths are recorded.
+ *
+ * Return:
+ *    True on success. Returns false on failure and sets error.
+ *
+ *-----------------------------------------------------------------------------
+ */
+bool
+_mongocrypt_splice_collect (_mongocrypt_splice_t *splice,
+                            const bson_t *in,
+                            mongocrypt_status_t *status)
+{
+   _scan_state_t state;
+   int32_t root;
+
+   BSON_ASSERT (!splice->in_data);
+   splice->in_data = bson_get_data (in);
+   splice->in_len = in->len;
+
+   memset (&state, 0, sizeof (state));
+   state.match = splice->match;
+   state.splice = splice;
+   state.status = status;
+   state.filter = splice->filter;
+   root = _splice_push_container (splice, bson_get_data (in), -1, false);
+   if (!_scan (&state, in, root)) {
+      return false;
+   }
+   if (splice->n_items == 0) {
+      splice->n_containers = 0;
+   }
+   return true;
+}
+
+
+typedef struct {
+   const _mongocrypt_buffer_t *in;
+   uint32_t index;
+} _splice_dedupe_entry_t;
+
+
+/* Order by input, then by index, so the first of equal inputs sorts first. */
+static int
+_splice_dedupe_cmp (const void *a, const void *b)
+{
+   const _splice_dedupe_entry_t *ea = a, *eb = b;
+   int cmp;
+
+   if (ea->in->len != eb->in->len) {
+      return ea->in->len < eb->in->len ? -1 : 1;
+   }
+   cmp = memcmp (ea->in->data, eb->in->data, ea->in->len);
+   if (cmp != 0) {
+      return cmp;
+   }
+   return ea->index < eb->index ? -1 : (ea->index > eb->index ? 1 : 0);
+}
+
+
+/*-----------------------------------------------------------------------------
+ *
+ * _mongocrypt_splice_dedupe
+ *
+ *    Find the eligible items with identical inputs, so each distinct input
+ *    is transformed once, like the repeated values of a large $in. The
+ *    transforms then copy the output of the first of them to the rest.
+ *
+ * Return:
+ *    The number of items marked as copies.
+ *
+ *-----------------------------------------------------------------------------
+ */
+uint32_t
+_mongocrypt_splice_dedupe (
+   _mongocrypt_splice_t *splice,
+   bool (*eligible) (const _mongocrypt_splice_item_t *item))
+{
+   _splice_dedupe_entry_t *entries;
+   uint32_t i, n_entries = 0, n_copies = 0;
+
+   if (splice->n_items < 2) {
+      return 0;
+   }
+
+   entries = bson_malloc (splice->n_items * sizeof (*entries));
+   BSON_ASSERT (entries);
+   for (i = 0; i < splice->n_items; i++) {
+      _mongocrypt_splice_item_t *item = &splice->items[i];
+
+      item->is_copy = false;
+      if (eligible (item)) {
+         entries[n_entries].in = &item->in;
+         entries[n_entries].index = i;
+         n_entries++;
+      }
+   }
+
+   qsort (entries, n_entries, sizeof (*entries), _splice_dedupe_cmp);
+   for (i = 1; i < n_entries; i++) {
+      const _splice_dedupe_entry_t *first = &entries[i - 1];
+      _mongocrypt_splice_item_t *item;
+
+      if (first->in->len != entries[i].in->len ||
+          0 != memcmp (first->in->data, entries[i].in->data, first->in->len)) {
+         continue;
+      }
+      item = &splice->items[entries[i].index];
+      /* Point at the first of the run, which is not a copy itself. */
+      item->copy_of = splice->items[first->index].is_copy
+                         ? splice->items[first->index].copy_of
+                         : first->index;
+      item->is_copy = true;
+      n_copies++;
+   }
+
+   bson_free (entries);
+   return n_copies;
+}
+
+
+/* Give the copies the output of the items they copy. A copy of an item that
+ * failed fails too. */
+static void
+_splice_fill_copies (_mongocrypt_splice_t *splice)
+{
+   uint32_t i;
+
+   for (i = 0; i < splice->n_items; i++) {
+      _mongocrypt_splice_item_t *item = &splice->items[i];
+      const _mongocrypt_splice_item_t *orig;
+
+      if (!item->is_copy) {
+         continue;
+      }
+      orig = &splice->items[item->copy_of];
+      item->ok = orig->ok;
+      if (orig->ok) {
+         bson_value_copy (&orig->out, &item->out);
+      }
+   }
+}
+
+
+static void
+_splice_run (void *task_ctx, uint32_t index)
+{
+   _mongocrypt_splice_t *splice;
+   _mongocrypt_splice_item_t *item;
+
+   splice = (_mongocrypt_splice_t *) task_ctx;
+   BSON_ASSERT (index < splice->n_items);
+   item = &splice->items[index];
+   if (item->is_copy) {
+      /* Filled in once every task is done. */
+      item->ok = true;
+      return;
+   }
+   item->ok = splice->cb (splice->ctx, item, item->status);
+   if (!item->ok) {
+      /* out is only set on success. */
+      item->out.value_type = BSON_TYPE_EOD;
+   }
+}
+
+
+/* The items of a splice, in runs transformed by one parallel_for task. */
+typedef struct {
+   _mongocrypt_splice_t *splice;
+   uint32_t *starts; /* n_tasks + 1 entries. */
+   uint32_t n_tasks;
+} _splice_tasks_t;
+
+
+/* Transform a run of items in order, stopping at the first failure. */
+static void
+_splice_run_task (void *task_ctx, uint32_t index)
+{
+   _splice_tasks_t *tasks;
+   uint32_t i;
+
+   tasks = (_splice_tasks_t *) task_ctx;
+   BSON_ASSERT (index < tasks->n_tasks);
+   for (i = tasks->starts[index]; i < tasks->starts[index + 1]; i++) {
+      _splice_run (tasks->splice, i);
+      if (!tasks->splice->items[i].ok) {
+         return;
+      }
+   }
+}
+
+
+/* The index of the container of @item that is an element of a top level
+ * array, like a document of the 'documents' of an insert. Returns -1 if
+ * there is none. */
+static int32_t
+_splice_item_document (const _mongocrypt_splice_t *splice,
+                       const _mongocrypt_splice_item_t *item)
+{
+   const _mongocrypt_splice_container_t *containers;
+   int32_t c;
+
+   containers = splice->containers;
+   for (c = item->parent; c >= 0; c = containers[c].parent) {
+      int32_t array = containers[c].parent;
+
+      if (array >= 0 && containers[array].is_array &&
+          containers[array].parent >= 0 &&
+          containers[containers[array].parent].parent == -1) {
+         return c;
+      }
+   }
+   return -1;
+}
+
+
+/* Group the items of a bulk write by document, so each parallel_for task
+ * transforms a whole document instead of a single value. Returns false, with
+ * @tasks empty, if the items are not spread over several documents. */
+static bool
+_splice_group_by_document (_mongocrypt_splice_t *splice,
+                           _splice_tasks_t *tasks)
+{
+   int32_t prev = -1;
+   uint32_t i;
+
+   memset (tasks, 0, sizeof (*tasks));
+   tasks->splice = splice;
+   tasks->starts = bson_malloc ((splice->n_items + 1u) * sizeof (uint32_t));
+   BSON_ASSERT (tasks->starts);
+   for (i = 0; i < splice->n_items; i++) {
+      int32_t doc;
+
+      doc = _splice_item_document (splice, &splice->items[i]);
+      if (i == 0 || doc == -1 || doc != prev) {
+         tasks->starts[tasks->n_tasks++] = i;
+      }
+      prev = doc;
+   }
+   tasks->starts[tasks->n_tasks] = splice->n_items;
+
+   if (tasks->n_tasks < 2 || tasks->n_tasks == splice->n_items) {
+      /* One task per value is no different. */
+      bson_free (tasks->starts);
+      tasks->starts = NULL;
+      tasks->n_tasks = 0;
+      return false;
+   }
+   return true;
+}
+
+
+/*-----------------------------------------------------------------------------
+ *
+ * _mongocrypt_splice_transform
+ *
+ *    Call cb for every collected value that is not a copy, and copy the
+ *    output of the copies. If parallel_for is set, the calls are
+ *    made through it, possibly concurrently, and cb must be thread safe. The
+ *    values of each document of a bulk write are then transformed by one
+ *    task, so many small documents are not split into a task per value.
+ *
+ * Return:
+ *    True on success. Returns false on failure and sets error. If several
+ *    values fail, the error is that of the first.
+ *
+ *-----------------------------------------------------------------------------
+ */
+bool
+_mongocrypt_splice_transform (_mongocrypt_splice_t *splice,
+                              _mongocrypt_splice_callback_t cb,
+                              void *ctx,
+                              mongocrypt_parallel_for_fn parallel_for,
+                              void *parallel_for_ctx,
+                              mongocrypt_status_t *status)
+{
+   _splice_tasks_t tasks;
+   uint32_t i;
+   bool ok;
+
+   splice->cb = cb;
+   splice->ctx = ctx;
+
+   if (!parallel_for) {
+      for (i = 0; i < splice->n_items; i++) {
+         _mongocrypt_splice_item_t *item = &splice->items[i];
+
+         if (item->is_copy) {
+            continue;
+         }
+         item->ok = cb (ctx, item, status);
+         if (!item->ok) {
+            item->out.value_type = BSON_TYPE_EOD;
+            return false;
+         }
+      }
+      _splice_fill_copies (splice);
+      return true;
+   }
+
+   for (i = 0; i < splice->n_items; i++) {
+      splice->items[i].status = mongocrypt_status_new ();
+   }
+
+   if (_splice_group_by_document (splice, &tasks)) {
+      ok = parallel_for (
+         parallel_for_ctx, tasks.n_tasks, _splice_run_task, &tasks);
+      bson_free (tasks.starts);
+   } else {
+      ok = splice->n_items == 0 ||
+           parallel_for (
+              parallel_for_ctx, splice->n_items, _splice_run, splice);
+   }
+   if (!ok) {
+      CLIENT_ERR ("parallel_for failed");
+      return false;
+   }
+   _splice_fill_copies (splice);
+
+   /* Items after a failure in the same task are not run. The failure comes
+    * first. */
+   for (i = 0; i < splice->n_items; i++) {
+      if (!splice->items[i].ok) {
+         _mongocrypt_status_copy_to (splice->items[i].status, status);
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/*-----------------------------------------------------------------------------
+ *
+ * _mongocrypt_splice_transform_batch
+ *
+ *    Call cb once with every collected value that is not a copy, so the
+ *    values can be transformed together.
+ *
+ * Return:
+ *    True on success. Returns false on failure and sets error.
+ *
+ *-----------------------------------------------------------------------------
+ */
+bool
+_mongocrypt_splice_transform_batch (_mongocrypt_splice_t *splice,
+                                    _mongocrypt_splice_batch_callback_t cb,
+                                    void *ctx,
+                                    mongocrypt_status_t *status)
+{
+   _mongocrypt_splice_item_t *distinct;
+   uint32_t i, n_distinct;
+   bool ok;
+
+   if (splice->n_items == 0) {
+      return true;
+   }
+
+   n_distinct = 0;
+   for (i = 0; i < splice->n_items; i++) {
+      if (!splice->items[i].is_copy) {
+         n_distinct++;
+      }
+   }
+   if (n_distinct == splice->n_items) {
+      ok = cb (ctx, splice->items, splice->n_items, status);
+      for (i = 0; i < splice->n_items; i++) {
+         splice->items[i].ok = ok;
+      }
+      return ok;
+   }
+
+   /* Pass only the items that are not copies, then move their outputs
+    * back. */
+   distinct = bson_malloc (n_distinct * sizeof (*distinct));
+   BSON_ASSERT (distinct);
+   n_distinct = 0;
+   for (i = 0; i < splice->n_items; i++) {
+      if (!splice->items[i].is_copy) {
+         distinct[n_distinct++] = splice->items[i];
+      }
+   }
+   ok = cb (ctx, distinct, n_distinct, status);
+   n_distinct = 0;
+   for (i = 0; i < splice->n_items; i++) {
+      _mongocrypt_splice_item_t *item = &splice->items[i];
+
+      if (item->is_copy) {
+         continue;
+      }
+      item->ok = ok;
+      if (ok) {
+         memcpy (&item->out, &distinct[n_distinct].out, sizeof (item->out));
+      }
+      n_distinct++;
+   }
+   bson_free (distinct);
+   if (ok) {
+      _splice_fill_copies (splice);
+   }
+   return ok;
+}
+
+
+/*-----------------------------------------------------------------------------
+ *
+ * _mongocrypt_splice_measure
+ *
+ *    Encode the transformed values and compute the exact length of the output
+ *    document.
+ *
+ * Return:
+ *    True on success. Returns false on failure and sets error.
+ *
+ *-----------------------------------------------------------------------------
+ */
+bool
+_mongocrypt_splice_measure (_mongocrypt_splice_t *splice,
+                            uint32_t *len,
+                            mongocrypt_status_t *status)
+{
+   uint32_t i;
+   int64_t out_len;
+
+   BSON_ASSERT (splice->in_data);
+   BSON_ASSERT (len);
+
+   /* Encode the outputs, and add the change in length of each to its
+    * enclosing containers. */
+   for (i = 0; i < splice->n_items; i++) {
+      _mongocrypt_splice_item_t *item = &splice->items[i];
+      int64_t delta;
+      int32_t parent;
+      bson_t tmp;
+
+      BSON_ASSERT (item->ok);
+      if (_mongocrypt_bson_value_len (&item->out, &item->value_len)) {
+         /* Ciphertexts and common plaintexts are written without encoding
+          * them first. */
+         delta = (int64_t) item->value_len - (item->end - item->start);
+      } else {
+         bson_init (&tmp);
+         if (!bson_append_value (&tmp, "", 0, &item->out)) {
+            bson_destroy (&tmp);
+            CLIENT_ERR ("could not encode transformed value");
+            return false;
+         }
+         item->encoded =
+            bson_destroy_with_steal (&tmp, true, &item->encoded_len);
+         /* The value follows the length, type byte, and empty key, and
+          * precedes the trailing byte. */
+         delta =
+            (int64_t) (item->encoded_len - 7) - (item->end - item->start);
+      }
+      for (parent = item->parent; parent != -1;
+           parent = splice->containers[parent].parent) {
+         splice->containers[parent].delta += delta;
+      }
+   }
+
+   out_len = (int64_t) splice->in_len;
+   if (splice->n_containers > 0) {
+      out_len += splice->containers[0].delta;
+   }
+   if (out_len > INT32_MAX) {
+      CLIENT_ERR ("transformed document too large");
+      return false;
+   }
+   splice->out_len = (uint32_t) out_len;
+   *len = splice->out_len;
+   return true;
+}
+
+
+/*-----------------------------------------------------------------------------
+ *
+ * _mongocrypt_splice_write
+ *
+ *    Build the output document into @dst, which must hold the length given by
+ *    _mongocrypt_splice_measure. Untouched bytes are copied with memmove. Only
+ *    the transformed values, their type bytes, and the lengths of the
+ *    documents and arrays enclosing them are rewritten.
+ *
+ *    @dst may be the input itself if no value grows. Then every byte is
+ *    written at or before where it was read from, and after it was read.
+ *
+ *-----------------------------------------------------------------------------
+ */
+void
+_mongocrypt_splice_write (_mongocrypt_splice_t *splice, uint8_t *dst)
+{
+   const uint8_t *src, *src_end;
+   uint8_t *dst_start = dst;
+   uint32_t ci, ii;
+
+   BSON_ASSERT (splice->in_data);
+   src = splice->in_data;
+   src_end = src + splice->in_len;
+   ci = 0;
+   ii = 0;
+   /* Containers and items are each in document order. Merge them. */
+   while (ci < splice->n_containers || ii < splice->n_items) {
+      if (ci < splice->n_containers &&
+          (ii == splice->n_items ||
+           splice->containers[ci].len_prefix < splice->items[ii].type)) {
+         _mongocrypt_splice_container_t *container = &splice->containers[ci++];
+         uint32_t len;
+         int64_t new_len;
+
+         memmove (dst, src, (size_t) (container->len_prefix - src));
+         dst += container->len_prefix - src;
+         memcpy (&len, container->len_prefix, sizeof (len));
+         new_len = (int64_t) BSON_UINT32_FROM_LE (len) + container->delta;
+         len = BSON_UINT32_TO_LE ((uint32_t) new_len);
+         memcpy (dst, &len, sizeof (len));
+         dst += sizeof (len);
+         src = container->len_prefix + sizeof (len);
+      } else {
+         _mongocrypt_splice_item_t *item = &splice->items[ii++];
+
+         memmove (dst, src, (size_t) (item->type - src));
+         dst += item->type - src;
+         *dst++ =
+            item->encoded ? item->encoded[4] : (uint8_t) item->out.value_type;
+         /* Copy the key. */
+         memmove (dst, item->type + 1, (size_t) (item->start - item->type - 1));
+         dst += item->start - item->type - 1;
+         if (item->encoded) {
+            memcpy (dst, item->encoded + 6, item->encoded_len - 7);
+            dst += item->encoded_len - 7;
+         } else {
+            _mongocrypt_bson_value_write (&item->out, dst);
+            dst += item->value_len;
+         }
+         src = item->end;
+      }
+   }
+   memmove (dst, src, (size_t) (src_end - src));
+   BSON_ASSERT (dst + (src_end - src) == dst_start + splice->out_len);
+}
+
+
+/* Build the output document into a new buffer. */
+bool
+_mongocrypt_splice_finish (_mongocrypt_splice_t *splice,
+                           _mongocrypt_buffer_t *out,
+                           mongocrypt_status_t *status)
+{
+   uint32_t len;
+
+   _mongocrypt_buffer_init (out);
+   if (!_mongocrypt_splice_measure (splice, &len, status)) {
+      return false;
+   }
+   _mongocrypt_buffer_resize (out, len);
+   _mongocrypt_splice_write (splice, out->data);
+   return true;
+}
+
+
+/* Build the output document over the input, which must be writable. @out
+ * views it. */
+bool
+_mongocrypt_splice_finish_in_place (_mongocrypt_splice_t *splice,
+                                    _mongocrypt_buffer_t *out,
+                                    mongocrypt_status_t *status)
+{
+   uint32_t len;
+   uint32_t i;
+
+   _mongocrypt_buffer_init (out);
+   if (!_mongocrypt_splice_measure (splice, &len, status)) {
+      return false;
+   }
+   for (i = 0; i < splice->n_items; i++) {
+      _mongocrypt_splice_item_t *item = &splice->items[i];
+      uint32_t value_len;
+
+      value_len = item->encoded ? item->encoded_len - 7 : item->value_len;
+      if (value_len > (uint32_t) (item->end - item->start)) {
+         CLIENT_ERR ("transformed value does not fit in place");
+         return false;
+      }
+   }
+   _mongocrypt_splice_write (splice, (uint8_t *) splice->in_data);
+   out->data = (uint8_t *) splice->in_data;
+   out->len = len;
+   return true;
+}
+
+
+static void
+_splice_destroy_items (_mongocrypt_splice_t *splice)
+{
+   uint32_t i;
+
+   for (i = 0; i < splice->n_items; i++) {
+      bson_value_destroy (&splice->items[i].out);
+      mongocrypt_status_destroy (splice->items[i].status);
+      bson_free (splice->items[i].encoded);
+      if (splice->items[i].header) {
+         splice->header_destroy (splice->items[i].header);
+      }
+   }
+}
+
+
+void
+_mongocrypt_splice_clear (_mongocrypt_splice_t *splice,
+                          traversal_match_t match)
+{
+   _mongocrypt_splice_item_t *items;
+   _mongocrypt_splice_container_t *containers;
+   uint32_t items_size, containers_size;
+
+   _splice_destroy_items (splice);
+   items = splice->items;
+   items_size = splice->items_size;
+   containers = splice->containers;
+   containers_size = splice->containers_size;
+   _mongocrypt_splice_init (splice, match);
+   splice->items = items;
+   splice->items_size = items_size;
+   splice->containers = containers;
+   splice->containers_size = containers_size;
+}
+
+
+void
+_mongocrypt_splice_cleanup (_mongocrypt_splice_t *splice)
+{
+   _splice_destroy_items (splice);
+   bson_free (splice->items);
+   bson_free (splice->containers);
 }
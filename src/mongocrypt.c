@@ -19,10 +19,14 @@
 
 #include "mongocrypt-private.h"
 #include "mongocrypt-binary-private.h"
+#include "mongocrypt-cache-ciphertext-private.h"
+#include "mongocrypt-cache-plaintext-private.h"
 #include "mongocrypt-cache-collinfo-private.h"
 #include "mongocrypt-cache-key-private.h"
+#include "mongocrypt-cache-markings-private.h"
 #include "mongocrypt-config.h"
 #include "mongocrypt-crypto-private.h"
+#include "mongocrypt-key-slab-private.h"
 #include "mongocrypt-log-private.h"
 #include "mongocrypt-opts-private.h"
 #include "mongocrypt-os-private.h"
@@ -42,6 +46,17 @@ mongocrypt_version (uint32_t *len)
 }
 
 
+bool
+mongocrypt_is_crypto_available (void)
+{
+#ifdef MONGOCRYPT_ENABLE_CRYPTO
+   return true;
+#else
+   return false;
+#endif
+}
+
+
 void
 _mongocrypt_set_error (mongocrypt_status_t *status,
                        mongocrypt_status_type_t type,
@@ -105,6 +120,19 @@ _mongocrypt_do_init (void)
 {
    (void) kms_message_init ();
    _native_crypto_init ();
+   _mongocrypt_key_slab_init ();
+}
+
+
+/* Point the caches of @crypt into @shared, taking over the reference. */
+static void
+_use_shared_cache (mongocrypt_t *crypt, mongocrypt_shared_cache_t *shared)
+{
+   crypt->shared_cache = shared;
+   crypt->cache_collinfo = &shared->cache_collinfo;
+   crypt->cache_key = &shared->cache_key;
+   crypt->cache_oauth_azure = shared->cache_oauth_azure;
+   crypt->cache_oauth_gcp = shared->cache_oauth_gcp;
 }
 
 
@@ -117,14 +145,33 @@ mongocrypt_new (void)
    BSON_ASSERT (crypt);
 
    _mongocrypt_mutex_init (&crypt->mutex);
-   _mongocrypt_cache_collinfo_init (&crypt->cache_collinfo);
-   _mongocrypt_cache_key_init (&crypt->cache_key);
+   _use_shared_cache (crypt, mongocrypt_shared_cache_new ());
+   _mongocrypt_key_fetches_init (&crypt->key_fetches);
+   _mongocrypt_key_batch_init (&crypt->key_batch);
+   _mongocrypt_stats_namespaces_init (&crypt->stats.namespaces);
+   _mongocrypt_cache_markings_init (&crypt->cache_markings);
+   _mongocrypt_cache_ciphertext_init (&crypt->cache_ciphertext);
+   _mongocrypt_cache_plaintext_init (&crypt->cache_plaintext);
+   /* Only traced while not shared, since crypt->trace goes away with
+    * crypt. */
+   crypt->cache_collinfo->trace = &crypt->trace;
+   crypt->cache_key->trace = &crypt->trace;
+   crypt->cache_markings.trace = &crypt->trace;
+   crypt->cache_markings.name = "markings";
+   crypt->cache_ciphertext.trace = &crypt->trace;
+   crypt->cache_ciphertext.name = "ciphertext";
+   crypt->cache_plaintext.trace = &crypt->trace;
+   crypt->cache_plaintext.name = "plaintext";
+   _mongocrypt_schema_map_init (&crypt->schema_map);
+   _mongocrypt_key_vault_snapshot_init (&crypt->key_vault_snapshot);
    crypt->status = mongocrypt_status_new ();
    _mongocrypt_opts_init (&crypt->opts);
    _mongocrypt_log_init (&crypt->log);
    crypt->ctx_counter = 1;
-   crypt->cache_oauth_azure = _mongocrypt_cache_oauth_new ();
-   crypt->cache_oauth_gcp = _mongocrypt_cache_oauth_new ();
+   _mongocrypt_aws_signing_keys_init (&crypt->aws_signing_keys);
+   _mongocrypt_gcp_assertions_init (&crypt->gcp_assertions);
+   _mongocrypt_kms_limiter_init (&crypt->kms_limiter);
+   _mongocrypt_random_pool_init (&crypt->random_pool);
 
    if (0 != _mongocrypt_once (_mongocrypt_do_init) ||
        !(_native_crypto_initialized)) {
@@ -158,6 +205,108 @@ mongocrypt_setopt_log_handler (mongocrypt_t *crypt,
    return true;
 }
 
+bool
+mongocrypt_setopt_log_level (mongocrypt_t *crypt, mongocrypt_log_level_t level)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+   if ((int) level < (int) MONGOCRYPT_LOG_LEVEL_FATAL ||
+       (int) level > (int) MONGOCRYPT_LOG_LEVEL_TRACE) {
+      CLIENT_ERR ("invalid log level: %d", (int) level);
+      return false;
+   }
+   crypt->opts.log_level = level;
+   return true;
+}
+
+bool
+mongocrypt_setopt_log_buffer (mongocrypt_t *crypt, uint32_t capacity)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+   if (capacity == 0 || capacity > MONGOCRYPT_LOG_BUFFER_MAX) {
+      CLIENT_ERR ("invalid log buffer capacity: %u", capacity);
+      return false;
+   }
+   crypt->opts.log_buffer_capacity = capacity;
+   return true;
+}
+
+uint32_t
+mongocrypt_log_drain (mongocrypt_t *crypt, uint32_t max)
+{
+   if (!crypt) {
+      return 0;
+   }
+   return _mongocrypt_log_drain (&crypt->log, max);
+}
+
+uint64_t
+mongocrypt_log_dropped (mongocrypt_t *crypt)
+{
+   if (!crypt) {
+      return 0;
+   }
+   return (uint64_t) _mongocrypt_atomic_load_int64 (&crypt->log.dropped);
+}
+
+bool
+mongocrypt_setopt_slow_ctx_threshold_ms (mongocrypt_t *crypt,
+                                         uint64_t threshold_ms)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   crypt->opts.slow_ctx_threshold_ms = threshold_ms;
+   return true;
+}
+
+bool
+mongocrypt_setopt_trace_handler (mongocrypt_t *crypt,
+                                 mongocrypt_trace_fn_t trace_fn,
+                                 void *trace_ctx)
+{
+   if (!crypt) {
+      return false;
+   }
+
+   if (crypt->initialized) {
+      mongocrypt_status_t *status = crypt->status;
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+   crypt->opts.trace_fn = trace_fn;
+   crypt->opts.trace_ctx = trace_ctx;
+   return true;
+}
+
 bool
 mongocrypt_setopt_kms_provider_aws (mongocrypt_t *crypt,
                                     const char *aws_access_key_id,
@@ -198,7 +347,7 @@ mongocrypt_setopt_kms_provider_aws (mongocrypt_t *crypt,
       return false;
    }
 
-   if (crypt->log.trace_enabled) {
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&crypt->log)) {
       _mongocrypt_log (&crypt->log,
                        MONGOCRYPT_LOG_LEVEL_TRACE,
                        "%s (%s=\"%s\", %s=%d, %s=\"%s\", %s=%d)",
@@ -282,7 +431,8 @@ mongocrypt_setopt_schema_map (mongocrypt_t *crypt,
       return false;
    }
 
-   if (!_mongocrypt_buffer_empty (&crypt->opts.schema_map)) {
+   if (!_mongocrypt_buffer_empty (&crypt->opts.schema_map) ||
+       !_mongocrypt_buffer_empty (&crypt->opts.schema_map_image)) {
       CLIENT_ERR ("already set schema map");
       return false;
    }
@@ -304,6 +454,109 @@ mongocrypt_setopt_schema_map (mongocrypt_t *crypt,
 }
 
 
+bool
+mongocrypt_setopt_schema_map_image (mongocrypt_t *crypt,
+                                    mongocrypt_binary_t *image)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   if (!image || !mongocrypt_binary_data (image)) {
+      CLIENT_ERR ("passed null schema map image");
+      return false;
+   }
+
+   if (!_mongocrypt_buffer_empty (&crypt->opts.schema_map) ||
+       !_mongocrypt_buffer_empty (&crypt->opts.schema_map_image)) {
+      CLIENT_ERR ("already set schema map");
+      return false;
+   }
+
+   /* Viewed, not copied, so a mapped file stays shared. */
+   _mongocrypt_buffer_from_binary (&crypt->opts.schema_map_image, image);
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_key_vault_snapshot (mongocrypt_t *crypt,
+                                      mongocrypt_binary_t *snapshot)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   if (!snapshot || !mongocrypt_binary_data (snapshot) ||
+       0 == mongocrypt_binary_len (snapshot)) {
+      CLIENT_ERR ("passed null key vault snapshot");
+      return false;
+   }
+
+   if (!_mongocrypt_buffer_empty (&crypt->opts.key_vault_snapshot)) {
+      CLIENT_ERR ("already set key vault snapshot");
+      return false;
+   }
+
+   /* Viewed, not copied, like a schema map image. */
+   _mongocrypt_buffer_from_binary (&crypt->opts.key_vault_snapshot, snapshot);
+   return true;
+}
+
+
+bool
+mongocrypt_build_schema_map_image (mongocrypt_t *crypt,
+                                   mongocrypt_binary_t *schema_map,
+                                   mongocrypt_binary_t *out)
+{
+   _mongocrypt_buffer_t schema_map_buf, image;
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+
+   if (!schema_map || !mongocrypt_binary_data (schema_map)) {
+      CLIENT_ERR ("passed null schema map");
+      return false;
+   }
+   if (!out) {
+      CLIENT_ERR ("invalid NULL output");
+      return false;
+   }
+
+   _mongocrypt_buffer_from_binary (&schema_map_buf, schema_map);
+   if (!_mongocrypt_schema_map_build_image (&schema_map_buf, &image, status)) {
+      return false;
+   }
+
+   if (out->owned) {
+      bson_free (out->data);
+   }
+   out->data = image.data;
+   out->len = image.len;
+   out->owned = true;
+   return true;
+}
+
+
 bool
 mongocrypt_setopt_kms_provider_local (mongocrypt_t *crypt,
                                       mongocrypt_binary_t *key)
@@ -335,7 +588,7 @@ mongocrypt_setopt_kms_provider_local (mongocrypt_t *crypt,
       return false;
    }
 
-   if (crypt->log.trace_enabled) {
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&crypt->log)) {
       char *key_val;
       key_val = _mongocrypt_new_string_from_bytes (key->data, key->len);
 
@@ -355,141 +608,1868 @@ mongocrypt_setopt_kms_provider_local (mongocrypt_t *crypt,
 }
 
 
-bool
-mongocrypt_init (mongocrypt_t *crypt)
+static bool
+_setopt_cache_ttl (mongocrypt_t *crypt,
+                   _mongocrypt_cache_t *cache,
+                   uint64_t ttl_ms)
 {
-   mongocrypt_status_t *status;
+   mongocrypt_status_t *status = crypt->status;
 
-   if (!crypt) {
-      return false;
-   }
-   status = crypt->status;
    if (crypt->initialized) {
-      CLIENT_ERR ("already initialized");
+      CLIENT_ERR ("options cannot be set after initialization");
       return false;
    }
 
-   crypt->initialized = true;
-
-   if (!mongocrypt_status_ok (crypt->status)) {
+   if (0 == ttl_ms) {
+      CLIENT_ERR ("cache TTL must be greater than zero");
       return false;
    }
 
-   if (!_mongocrypt_opts_validate (&crypt->opts, status)) {
-      return false;
-   }
+   _mongocrypt_cache_set_expiration (cache, ttl_ms);
+   return true;
+}
 
-   if (crypt->opts.log_fn) {
-      _mongocrypt_log_set_fn (
-         &crypt->log, crypt->opts.log_fn, crypt->opts.log_ctx);
-   }
 
-   if (!crypt->crypto) {
-#ifndef MONGOCRYPT_ENABLE_CRYPTO
-      CLIENT_ERR ("libmongocrypt built with native crypto disabled. crypto "
-                  "hooks required");
-      return false;
-#else
-      /* set default hooks. */
-      crypt->crypto = bson_malloc0 (sizeof (*crypt->crypto));
-      BSON_ASSERT (crypt->crypto);
+static bool
+_setopt_cache_max_entries (mongocrypt_t *crypt,
+                           _mongocrypt_cache_t *cache,
+                           uint32_t max_entries)
+{
+   mongocrypt_status_t *status = crypt->status;
 
-#endif
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
    }
+
+   _mongocrypt_cache_set_max_entries (cache, max_entries);
    return true;
 }
 
 
 bool
-mongocrypt_status (mongocrypt_t *crypt, mongocrypt_status_t *out)
+mongocrypt_setopt_key_cache_ttl (mongocrypt_t *crypt, uint64_t ttl_ms)
 {
    if (!crypt) {
       return false;
    }
-
-   if (!out) {
-      mongocrypt_status_t *status = crypt->status;
-      CLIENT_ERR ("argument 'out' is required");
-      return false;
-   }
-
-   if (!mongocrypt_status_ok (crypt->status)) {
-      _mongocrypt_status_copy_to (crypt->status, out);
-      return false;
-   }
-   _mongocrypt_status_reset (out);
-   return true;
+   return _setopt_cache_ttl (crypt, crypt->cache_key, ttl_ms);
 }
 
 
-void
-mongocrypt_destroy (mongocrypt_t *crypt)
+bool
+mongocrypt_setopt_key_cache_max_entries (mongocrypt_t *crypt,
+                                         uint32_t max_entries)
 {
    if (!crypt) {
-      return;
+      return false;
    }
-   _mongocrypt_opts_cleanup (&crypt->opts);
-   _mongocrypt_cache_cleanup (&crypt->cache_collinfo);
-   _mongocrypt_cache_cleanup (&crypt->cache_key);
-   _mongocrypt_mutex_cleanup (&crypt->mutex);
-   _mongocrypt_log_cleanup (&crypt->log);
-   mongocrypt_status_destroy (crypt->status);
-   bson_free (crypt->crypto);
-   _mongocrypt_cache_oauth_destroy (crypt->cache_oauth_azure);
-   _mongocrypt_cache_oauth_destroy (crypt->cache_oauth_gcp);
-   bson_free (crypt);
+   return _setopt_cache_max_entries (crypt, crypt->cache_key, max_entries);
 }
 
 
 bool
-_mongocrypt_validate_and_copy_string (const char *in,
-                                      int32_t in_len,
-                                      char **out)
+mongocrypt_setopt_key_cache_adaptive (mongocrypt_t *crypt, uint64_t max_bytes)
 {
-   if (!in) {
-      return false;
-   }
+   mongocrypt_status_t *status;
 
-   if (in_len < -1) {
+   if (!crypt) {
       return false;
    }
-
-   if (in_len == -1) {
-      in_len = (uint32_t) strlen (in);
+   status = crypt->status;
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
    }
-
-   if (!bson_utf8_validate (in, in_len, false)) {
+   if (max_bytes == 0) {
+      CLIENT_ERR ("max_bytes must be positive");
       return false;
    }
-   *out = bson_strndup (in, in_len);
+   if (max_bytes > SIZE_MAX) {
+      max_bytes = SIZE_MAX;
+   }
+   _mongocrypt_cache_set_adaptive (crypt->cache_key, (size_t) max_bytes);
    return true;
 }
 
 
 bool
-mongocrypt_setopt_crypto_hooks (mongocrypt_t *crypt,
-                                mongocrypt_crypto_fn aes_256_cbc_encrypt,
-                                mongocrypt_crypto_fn aes_256_cbc_decrypt,
-                                mongocrypt_random_fn random,
-                                mongocrypt_hmac_fn hmac_sha_512,
-                                mongocrypt_hmac_fn hmac_sha_256,
-                                mongocrypt_hash_fn sha_256,
-                                void *ctx)
+mongocrypt_setopt_key_cache_partition (mongocrypt_t *crypt,
+                                       const char *alt_name_prefix,
+                                       int32_t alt_name_prefix_len,
+                                       uint32_t max_entries,
+                                       uint64_t ttl_ms)
 {
    mongocrypt_status_t *status;
+   char *prefix;
 
    if (!crypt) {
       return false;
    }
-
    status = crypt->status;
-
    if (crypt->initialized) {
       CLIENT_ERR ("options cannot be set after initialization");
       return false;
    }
-
-   if (crypt->crypto) {
+   if (!_mongocrypt_validate_and_copy_string (
+          alt_name_prefix, alt_name_prefix_len, &prefix)) {
+      CLIENT_ERR ("invalid keyAltName prefix");
+      return false;
+   }
+   if (!_mongocrypt_cache_add_partition (
+          crypt->cache_key, prefix, max_entries, ttl_ms)) {
+      CLIENT_ERR ("key cache partition already set for prefix: %s", prefix);
+      bson_free (prefix);
+      return false;
+   }
+   bson_free (prefix);
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_key_cache_refresh_window (mongocrypt_t *crypt,
+                                            uint64_t window_ms)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   _mongocrypt_cache_set_refresh_window (crypt->cache_key, window_ms);
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_key_fetch_wait (mongocrypt_t *crypt, uint64_t wait_ms)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   crypt->opts.key_fetch_wait_ms = wait_ms;
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_key_fetch_batch (mongocrypt_t *crypt, uint64_t window_ms)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   crypt->opts.key_fetch_batch_ms = window_ms;
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_kms_keep_alive (mongocrypt_t *crypt, bool enable)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   crypt->opts.kms_keep_alive = enable;
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_kms_rate_limit (mongocrypt_t *crypt,
+                                  uint32_t requests_per_sec,
+                                  uint32_t burst)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   if (requests_per_sec == 0 || requests_per_sec > 1000 * 1000) {
+      CLIENT_ERR ("requests_per_sec must be between 1 and 1000000");
+      return false;
+   }
+
+   if (burst == 0) {
+      CLIENT_ERR ("burst must be positive");
+      return false;
+   }
+
+   crypt->kms_limiter.rate = requests_per_sec;
+   crypt->kms_limiter.burst = burst;
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_shared_cache (mongocrypt_t *crypt,
+                                mongocrypt_shared_cache_t *shared)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+   if (!shared) {
+      CLIENT_ERR ("invalid NULL shared cache");
+      return false;
+   }
+
+   _mongocrypt_shared_cache_retain (shared);
+   mongocrypt_shared_cache_destroy (crypt->shared_cache);
+   _use_shared_cache (crypt, shared);
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_key_cache_per_thread (mongocrypt_t *crypt, bool enable)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   crypt->opts.key_cache_per_thread = enable;
+   return true;
+}
+
+
+bool
+mongocrypt_needs_key_refresh (mongocrypt_t *crypt)
+{
+   if (!crypt) {
+      return false;
+   }
+   return _mongocrypt_cache_needs_refresh (crypt->cache_key);
+}
+
+
+static void
+_append_cache_stats (bson_t *bson, const char *name, _mongocrypt_cache_t *cache)
+{
+   bson_t child;
+   uint32_t entries, capacity;
+
+   _mongocrypt_rwlock_rdlock (&cache->lock);
+   entries = cache->num_pairs;
+   capacity = cache->capacity;
+   _mongocrypt_rwlock_rdunlock (&cache->lock);
+
+   bson_append_document_begin (bson, name, -1, &child);
+   bson_append_int64 (&child,
+                      MONGOCRYPT_STR_AND_LEN ("hits"),
+                      _mongocrypt_atomic_load_int64 (&cache->hits));
+   bson_append_int64 (&child,
+                      MONGOCRYPT_STR_AND_LEN ("misses"),
+                      _mongocrypt_atomic_load_int64 (&cache->misses));
+   bson_append_int64 (&child,
+                      MONGOCRYPT_STR_AND_LEN ("evictions"),
+                      _mongocrypt_atomic_load_int64 (&cache->evictions));
+   bson_append_int64 (&child, MONGOCRYPT_STR_AND_LEN ("entries"), entries);
+   if (capacity) {
+      bson_append_int64 (
+         &child, MONGOCRYPT_STR_AND_LEN ("capacity"), capacity);
+   }
+   _mongocrypt_rwlock_rdlock (&cache->lock);
+   if (cache->num_partitions) {
+      bson_t partitions;
+      uint32_t i;
+
+      bson_append_document_begin (
+         &child, MONGOCRYPT_STR_AND_LEN ("partitions"), &partitions);
+      for (i = 0; i < cache->num_partitions; i++) {
+         bson_append_int64 (&partitions,
+                            cache->partitions[i].tag,
+                            -1,
+                            cache->partitions[i].num_pairs);
+      }
+      bson_append_document_end (&child, &partitions);
+   }
+   _mongocrypt_rwlock_rdunlock (&cache->lock);
+#ifdef MONGOCRYPT_ENABLE_LOCK_STATS
+   bson_append_int64 (
+      &child,
+      MONGOCRYPT_STR_AND_LEN ("lockAcquisitions"),
+      _mongocrypt_atomic_load_int64 (&cache->lock_acquisitions));
+   bson_append_int64 (&child,
+                      MONGOCRYPT_STR_AND_LEN ("lockWaitUs"),
+                      _mongocrypt_atomic_load_int64 (&cache->lock_wait_us));
+   bson_append_int64 (&child,
+                      MONGOCRYPT_STR_AND_LEN ("lockHoldUs"),
+                      _mongocrypt_atomic_load_int64 (&cache->lock_hold_us));
+#endif
+   bson_append_document_end (bson, &child);
+}
+
+
+static void
+_append_kms_stats (bson_t *bson,
+                   const char *name,
+                   _mongocrypt_stats_kms_t *kms_stats)
+{
+   bson_t child;
+
+   bson_append_document_begin (bson, name, -1, &child);
+   bson_append_int64 (&child,
+                      MONGOCRYPT_STR_AND_LEN ("requests"),
+                      _mongocrypt_atomic_load_int64 (&kms_stats->requests));
+   bson_append_int64 (&child,
+                      MONGOCRYPT_STR_AND_LEN ("bytesSent"),
+                      _mongocrypt_atomic_load_int64 (&kms_stats->bytes_sent));
+   bson_append_int64 (
+      &child,
+      MONGOCRYPT_STR_AND_LEN ("bytesReceived"),
+      _mongocrypt_atomic_load_int64 (&kms_stats->bytes_received));
+   bson_append_int64 (
+      &child,
+      MONGOCRYPT_STR_AND_LEN ("oauthRefreshes"),
+      _mongocrypt_atomic_load_int64 (&kms_stats->oauth_refreshes));
+   bson_append_document_end (bson, &child);
+}
+
+
+void
+_mongocrypt_stats_namespaces_init (_mongocrypt_stats_namespaces_t *namespaces)
+{
+   memset (namespaces, 0, sizeof (*namespaces));
+   _mongocrypt_mutex_init (&namespaces->mutex);
+}
+
+
+void
+_mongocrypt_stats_namespaces_cleanup (
+   _mongocrypt_stats_namespaces_t *namespaces)
+{
+   int64_t i;
+
+   for (i = 0; i < namespaces->num_names; i++) {
+      bson_free (namespaces->names[i]);
+   }
+   _mongocrypt_mutex_cleanup (&namespaces->mutex);
+}
+
+
+/* Returns the index of @ns among the first @num names, or -1. */
+static int64_t
+_find_namespace (_mongocrypt_stats_namespaces_t *namespaces,
+                 const char *ns,
+                 int64_t from,
+                 int64_t num)
+{
+   int64_t i;
+
+   for (i = from; i < num; i++) {
+      if (0 == strcmp (namespaces->names[i], ns)) {
+         return i;
+      }
+   }
+   return -1;
+}
+
+
+_mongocrypt_stats_ns_t *
+_mongocrypt_stats_namespaces_get (_mongocrypt_stats_namespaces_t *namespaces,
+                                  const char *ns)
+{
+   int64_t num, found;
+
+   BSON_ASSERT (ns);
+   num = _mongocrypt_atomic_load_acquire_int64 (&namespaces->num_names);
+   found = _find_namespace (namespaces, ns, 0, num);
+   if (found >= 0) {
+      return &namespaces->counters[found];
+   }
+
+   _mongocrypt_mutex_lock (&namespaces->mutex);
+   /* Only look at the names claimed since. */
+   found = _find_namespace (namespaces, ns, num, namespaces->num_names);
+   if (found < 0 && namespaces->num_names < MONGOCRYPT_STATS_MAX_NAMESPACES) {
+      found = namespaces->num_names;
+      namespaces->names[found] = bson_strdup (ns);
+      _mongocrypt_atomic_store_release_int64 (&namespaces->num_names,
+                                              found + 1);
+   }
+   _mongocrypt_mutex_unlock (&namespaces->mutex);
+   if (found < 0) {
+      return &namespaces->overflow;
+   }
+   return &namespaces->counters[found];
+}
+
+
+static void
+_append_ns_stats (bson_t *bson, _mongocrypt_stats_ns_t *ns_stats)
+{
+   bson_append_int64 (bson,
+                      MONGOCRYPT_STR_AND_LEN ("encryptOps"),
+                      _mongocrypt_atomic_load_int64 (&ns_stats->encrypt_ops));
+   bson_append_int64 (bson,
+                      MONGOCRYPT_STR_AND_LEN ("decryptOps"),
+                      _mongocrypt_atomic_load_int64 (&ns_stats->decrypt_ops));
+   bson_append_int64 (
+      bson,
+      MONGOCRYPT_STR_AND_LEN ("fieldsEncrypted"),
+      _mongocrypt_atomic_load_int64 (&ns_stats->fields_encrypted));
+   bson_append_int64 (
+      bson,
+      MONGOCRYPT_STR_AND_LEN ("fieldsDecrypted"),
+      _mongocrypt_atomic_load_int64 (&ns_stats->fields_decrypted));
+   bson_append_int64 (
+      bson,
+      MONGOCRYPT_STR_AND_LEN ("plaintextBytes"),
+      _mongocrypt_atomic_load_int64 (&ns_stats->plaintext_bytes));
+   bson_append_int64 (
+      bson,
+      MONGOCRYPT_STR_AND_LEN ("ciphertextBytes"),
+      _mongocrypt_atomic_load_int64 (&ns_stats->ciphertext_bytes));
+   bson_append_int64 (
+      bson,
+      MONGOCRYPT_STR_AND_LEN ("mongocryptdRoundTrips"),
+      _mongocrypt_atomic_load_int64 (&ns_stats->mongocryptd_round_trips));
+   bson_append_int64 (
+      bson,
+      MONGOCRYPT_STR_AND_LEN ("collinfoMisses"),
+      _mongocrypt_atomic_load_int64 (&ns_stats->collinfo_misses));
+}
+
+
+static void
+_append_namespaces_stats (bson_t *bson,
+                          _mongocrypt_stats_namespaces_t *namespaces)
+{
+   bson_t array, child;
+   int64_t i, num;
+
+   num = _mongocrypt_atomic_load_acquire_int64 (&namespaces->num_names);
+   bson_append_array_begin (
+      bson, MONGOCRYPT_STR_AND_LEN ("namespaces"), &array);
+   for (i = 0; i < num; i++) {
+      const char *key;
+      char buf[16];
+
+      bson_uint32_to_string ((uint32_t) i, &key, buf, sizeof (buf));
+      bson_append_document_begin (&array, key, -1, &child);
+      bson_append_utf8 (
+         &child, MONGOCRYPT_STR_AND_LEN ("ns"), namespaces->names[i], -1);
+      _append_ns_stats (&child, &namespaces->counters[i]);
+      bson_append_document_end (&array, &child);
+   }
+   bson_append_array_end (bson, &array);
+
+   bson_append_document_begin (
+      bson, MONGOCRYPT_STR_AND_LEN ("otherNamespaces"), &child);
+   _append_ns_stats (&child, &namespaces->overflow);
+   bson_append_document_end (bson, &child);
+}
+
+
+/* Append "native" or "hooks" for @primitive. */
+static void
+_append_crypto_backend (bson_t *bson,
+                        const char *name,
+                        mongocrypt_t *crypt,
+                        uint32_t primitive)
+{
+   bool native;
+
+   /* crypto is only NULL before mongocrypt_init, if no hooks were set. */
+   native = !crypt->crypto ||
+            _mongocrypt_crypto_is_native (crypt->crypto, primitive);
+   bson_append_utf8 (bson, name, -1, native ? "native" : "hooks", -1);
+}
+
+
+bool
+mongocrypt_get_stats (mongocrypt_t *crypt, mongocrypt_binary_t *out)
+{
+   _mongocrypt_stats_t *stats;
+   mongocrypt_status_t *status;
+   bson_t bson, child;
+   uint32_t len;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+   if (!out) {
+      CLIENT_ERR ("invalid NULL input");
+      return false;
+   }
+
+   stats = &crypt->stats;
+   bson_init (&bson);
+   bson_append_document_begin (&bson, MONGOCRYPT_STR_AND_LEN ("cache"), &child);
+   _append_cache_stats (&child, "collinfo", crypt->cache_collinfo);
+   _append_cache_stats (&child, "key", crypt->cache_key);
+   _append_cache_stats (&child, "markings", &crypt->cache_markings);
+   _append_cache_stats (&child, "ciphertext", &crypt->cache_ciphertext);
+   _append_cache_stats (&child, "plaintext", &crypt->cache_plaintext);
+   bson_append_document_end (&bson, &child);
+
+   bson_append_document_begin (&bson, MONGOCRYPT_STR_AND_LEN ("kms"), &child);
+   _append_kms_stats (&child, "aws", &stats->kms[MONGOCRYPT_STATS_KMS_AWS]);
+   _append_kms_stats (&child, "azure", &stats->kms[MONGOCRYPT_STATS_KMS_AZURE]);
+   _append_kms_stats (&child, "gcp", &stats->kms[MONGOCRYPT_STATS_KMS_GCP]);
+   bson_append_document_end (&bson, &child);
+
+   bson_append_int64 (
+      &bson,
+      MONGOCRYPT_STR_AND_LEN ("mongocryptdRoundTrips"),
+      _mongocrypt_atomic_load_int64 (&stats->mongocryptd_round_trips));
+   bson_append_int64 (&bson,
+                      MONGOCRYPT_STR_AND_LEN ("fieldsEncrypted"),
+                      _mongocrypt_atomic_load_int64 (&stats->fields_encrypted));
+   bson_append_int64 (&bson,
+                      MONGOCRYPT_STR_AND_LEN ("fieldsDecrypted"),
+                      _mongocrypt_atomic_load_int64 (&stats->fields_decrypted));
+
+   bson_append_document_begin (
+      &bson, MONGOCRYPT_STR_AND_LEN ("keyCacheBackend"), &child);
+   bson_append_int64 (&child,
+                      MONGOCRYPT_STR_AND_LEN ("hits"),
+                      _mongocrypt_atomic_load_int64 (&stats->key_backend.hits));
+   bson_append_int64 (
+      &child,
+      MONGOCRYPT_STR_AND_LEN ("misses"),
+      _mongocrypt_atomic_load_int64 (&stats->key_backend.misses));
+   bson_append_int64 (&child,
+                      MONGOCRYPT_STR_AND_LEN ("puts"),
+                      _mongocrypt_atomic_load_int64 (&stats->key_backend.puts));
+   bson_append_int64 (
+      &child,
+      MONGOCRYPT_STR_AND_LEN ("evictions"),
+      _mongocrypt_atomic_load_int64 (&stats->key_backend.evictions));
+   bson_append_document_end (&bson, &child);
+
+   bson_append_document_begin (
+      &bson, MONGOCRYPT_STR_AND_LEN ("crypto"), &child);
+   _append_crypto_backend (
+      &child, "aes256Cbc", crypt, MONGOCRYPT_CRYPTO_PRIMITIVE_AES_256_CBC);
+   _append_crypto_backend (
+      &child, "hmacSha512", crypt, MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512);
+   _append_crypto_backend (
+      &child, "sha256", crypt, MONGOCRYPT_CRYPTO_PRIMITIVE_SHA_256);
+   _append_crypto_backend (
+      &child, "random", crypt, MONGOCRYPT_CRYPTO_PRIMITIVE_RANDOM);
+   bson_append_document_end (&bson, &child);
+
+   _append_namespaces_stats (&bson, &stats->namespaces);
+
+   if (out->owned) {
+      bson_free (out->data);
+   }
+   out->data = bson_destroy_with_steal (&bson, true, &len);
+   out->len = len;
+   out->owned = true;
+   return true;
+}
+
+
+bool
+mongocrypt_get_memory_usage (mongocrypt_t *crypt, mongocrypt_binary_t *out)
+{
+   _mongocrypt_memory_t *memory;
+   mongocrypt_status_t *status;
+   bson_t bson;
+   uint32_t len;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+   if (!out) {
+      CLIENT_ERR ("invalid NULL input");
+      return false;
+   }
+
+   memory = &crypt->stats.memory;
+   bson_init (&bson);
+   bson_append_int64 (&bson,
+                      MONGOCRYPT_STR_AND_LEN ("keyCache"),
+                      (int64_t) _mongocrypt_cache_bytes (crypt->cache_key));
+   bson_append_int64 (
+      &bson,
+      MONGOCRYPT_STR_AND_LEN ("collinfoCache"),
+      (int64_t) _mongocrypt_cache_bytes (crypt->cache_collinfo));
+   bson_append_int64 (
+      &bson,
+      MONGOCRYPT_STR_AND_LEN ("markingsCache"),
+      (int64_t) _mongocrypt_cache_bytes (&crypt->cache_markings));
+   bson_append_int64 (
+      &bson,
+      MONGOCRYPT_STR_AND_LEN ("ciphertextCache"),
+      (int64_t) _mongocrypt_cache_bytes (&crypt->cache_ciphertext));
+   bson_append_int64 (
+      &bson,
+      MONGOCRYPT_STR_AND_LEN ("plaintextCache"),
+      (int64_t) _mongocrypt_cache_bytes (&crypt->cache_plaintext));
+   bson_append_int64 (&bson,
+                      MONGOCRYPT_STR_AND_LEN ("contexts"),
+                      _mongocrypt_atomic_load_int64 (&memory->contexts));
+   bson_append_int64 (&bson,
+                      MONGOCRYPT_STR_AND_LEN ("kms"),
+                      _mongocrypt_atomic_load_int64 (&memory->kms));
+
+   if (out->owned) {
+      bson_free (out->data);
+   }
+   out->data = bson_destroy_with_steal (&bson, true, &len);
+   out->len = len;
+   out->owned = true;
+   return true;
+}
+
+
+typedef struct {
+   bson_t keys;
+   uint32_t num_keys;
+   int64_t now_ms;
+} _key_cache_foreach_ctx_t;
+
+
+/* Copy what describes a cached key, so callbacks run without the lock. */
+static void
+_append_key_info (_mongocrypt_cache_pair_t *pair, void *ctx)
+{
+   _key_cache_foreach_ctx_t *foreach_ctx = (_key_cache_foreach_ctx_t *) ctx;
+   _mongocrypt_cache_key_value_t *value;
+   _mongocrypt_key_alt_name_t *alt_name;
+   bson_t key_info, alt_names;
+   char buf[16];
+   const char *key;
+   uint32_t i = 0;
+
+   value = (_mongocrypt_cache_key_value_t *) pair->value;
+   bson_uint32_to_string (foreach_ctx->num_keys++, &key, buf, sizeof (buf));
+   bson_append_document_begin (&foreach_ctx->keys, key, -1, &key_info);
+   BSON_ASSERT (_mongocrypt_buffer_append (
+      &value->key_doc->id, &key_info, MONGOCRYPT_STR_AND_LEN ("_id")));
+   bson_append_array_begin (
+      &key_info, MONGOCRYPT_STR_AND_LEN ("keyAltNames"), &alt_names);
+   for (alt_name = value->key_doc->key_alt_names; alt_name;
+        alt_name = alt_name->next) {
+      bson_uint32_to_string (i++, &key, buf, sizeof (buf));
+      bson_append_value (&alt_names, key, -1, &alt_name->value);
+   }
+   bson_append_array_end (&key_info, &alt_names);
+   bson_append_int64 (&key_info,
+                      MONGOCRYPT_STR_AND_LEN ("hits"),
+                      _mongocrypt_atomic_load_int64 (&pair->hits));
+   bson_append_int64 (&key_info,
+                      MONGOCRYPT_STR_AND_LEN ("ageMs"),
+                      foreach_ctx->now_ms - pair->last_updated);
+   bson_append_int64 (
+      &key_info,
+      MONGOCRYPT_STR_AND_LEN ("idleMs"),
+      foreach_ctx->now_ms - _mongocrypt_atomic_load_int64 (&pair->last_used));
+   bson_append_document_end (&foreach_ctx->keys, &key_info);
+}
+
+
+bool
+mongocrypt_key_cache_foreach (mongocrypt_t *crypt,
+                              mongocrypt_key_cache_fn_t fn,
+                              void *ctx)
+{
+   _key_cache_foreach_ctx_t foreach_ctx;
+   mongocrypt_status_t *status;
+   bson_iter_t iter;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+   if (!fn) {
+      CLIENT_ERR ("invalid NULL callback");
+      return false;
+   }
+
+   bson_init (&foreach_ctx.keys);
+   foreach_ctx.num_keys = 0;
+   foreach_ctx.now_ms = bson_get_monotonic_time () / 1000;
+   _mongocrypt_cache_foreach (
+      crypt->cache_key, _append_key_info, &foreach_ctx);
+
+   bson_iter_init (&iter, &foreach_ctx.keys);
+   while (bson_iter_next (&iter)) {
+      const uint8_t *data;
+      uint32_t len;
+      mongocrypt_binary_t *key_info;
+      bool cont;
+
+      bson_iter_document (&iter, &len, &data);
+      key_info = mongocrypt_binary_new_from_data ((uint8_t *) data, len);
+      cont = fn (key_info, ctx);
+      mongocrypt_binary_destroy (key_info);
+      if (!cont) {
+         break;
+      }
+   }
+   bson_destroy (&foreach_ctx.keys);
+   return true;
+}
+
+
+typedef struct {
+   _mongocrypt_key_doc_t *key_doc;
+   _mongocrypt_buffer_t key_material;
+   int64_t ttl_ms;
+} _exported_key_t;
+
+typedef struct {
+   _exported_key_t *keys;
+   uint32_t num_keys;
+   uint32_t keys_size;
+   int64_t now_ms;
+   int64_t expiration_ms;
+} _key_cache_export_ctx_t;
+
+
+/* Copy the key and its remaining time, so it is wrapped without the lock. */
+static void
+_collect_exported_key (_mongocrypt_cache_pair_t *pair, void *ctx)
+{
+   _key_cache_export_ctx_t *export_ctx = (_key_cache_export_ctx_t *) ctx;
+   _mongocrypt_cache_key_value_t *value;
+   _exported_key_t *key;
+
+   if (export_ctx->num_keys == export_ctx->keys_size) {
+      export_ctx->keys_size =
+         export_ctx->keys_size ? export_ctx->keys_size * 2 : 16;
+      export_ctx->keys = bson_realloc (
+         export_ctx->keys, export_ctx->keys_size * sizeof (_exported_key_t));
+   }
+
+   value = (_mongocrypt_cache_key_value_t *) pair->value;
+   key = &export_ctx->keys[export_ctx->num_keys++];
+   key->key_doc = _mongocrypt_key_new ();
+   _mongocrypt_key_doc_copy_to (value->key_doc, key->key_doc);
+   _mongocrypt_buffer_init (&key->key_material);
+   _mongocrypt_buffer_copy_to (&value->decrypted_key_material,
+                               &key->key_material);
+   key->ttl_ms = export_ctx->expiration_ms -
+                 (export_ctx->now_ms - pair->last_updated);
+}
+
+
+static bool
+_check_kek (mongocrypt_t *crypt, mongocrypt_binary_t *kek)
+{
+   mongocrypt_status_t *status = crypt->status;
+
+   if (!crypt->initialized) {
+      CLIENT_ERR ("mongocrypt_init must be called first");
+      return false;
+   }
+   if (!kek) {
+      CLIENT_ERR ("invalid NULL kek");
+      return false;
+   }
+   if (mongocrypt_binary_len (kek) != MONGOCRYPT_KEY_LEN) {
+      CLIENT_ERR ("kek must be %d bytes", MONGOCRYPT_KEY_LEN);
+      return false;
+   }
+   return true;
+}
+
+
+bool
+mongocrypt_key_cache_export (mongocrypt_t *crypt,
+                             mongocrypt_binary_t *kek,
+                             mongocrypt_binary_t *out)
+{
+   _key_cache_export_ctx_t export_ctx;
+   _mongocrypt_buffer_t kek_buf;
+   mongocrypt_status_t *status;
+   bson_t bson, keys;
+   uint32_t i, len;
+   bool ret = false;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+   if (!_check_kek (crypt, kek)) {
+      return false;
+   }
+   if (!out) {
+      CLIENT_ERR ("invalid NULL output");
+      return false;
+   }
+
+   memset (&export_ctx, 0, sizeof (export_ctx));
+   export_ctx.now_ms = bson_get_monotonic_time () / 1000;
+   export_ctx.expiration_ms = (int64_t) crypt->cache_key->expiration;
+   _mongocrypt_cache_foreach (
+      crypt->cache_key, _collect_exported_key, &export_ctx);
+
+   _mongocrypt_buffer_from_binary (&kek_buf, kek);
+   bson_init (&bson);
+   bson_append_int32 (&bson, MONGOCRYPT_STR_AND_LEN ("v"), 2);
+   bson_append_array_begin (&bson, MONGOCRYPT_STR_AND_LEN ("keys"), &keys);
+   for (i = 0; i < export_ctx.num_keys; i++) {
+      _exported_key_t *key = &export_ctx.keys[i];
+      bson_t child;
+      char buf[16];
+      const char *idx;
+      bool ok;
+
+      bson_uint32_to_string (i, &idx, buf, sizeof (buf));
+      bson_append_document_begin (&keys, idx, -1, &child);
+      ok = _mongocrypt_cache_key_wrap (crypt->crypto,
+                                       &kek_buf,
+                                       key->key_doc,
+                                       &key->key_material,
+                                       "ttlMs",
+                                       key->ttl_ms,
+                                       &child,
+                                       status);
+      bson_append_document_end (&keys, &child);
+      if (!ok) {
+         bson_append_array_end (&bson, &keys);
+         bson_destroy (&bson);
+         goto done;
+      }
+   }
+   bson_append_array_end (&bson, &keys);
+
+   if (out->owned) {
+      bson_free (out->data);
+   }
+   out->data = bson_destroy_with_steal (&bson, true, &len);
+   out->len = len;
+   out->owned = true;
+   ret = true;
+
+done:
+   for (i = 0; i < export_ctx.num_keys; i++) {
+      _mongocrypt_key_destroy (export_ctx.keys[i].key_doc);
+      _mongocrypt_buffer_cleanup (&export_ctx.keys[i].key_material);
+   }
+   bson_free (export_ctx.keys);
+   return ret;
+}
+
+
+bool
+mongocrypt_setopt_key_cache_backend (mongocrypt_t *crypt,
+                                     mongocrypt_key_cache_get_fn get,
+                                     mongocrypt_key_cache_put_fn put,
+                                     mongocrypt_binary_t *secret,
+                                     void *ctx)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+   if (!get || !put) {
+      CLIENT_ERR ("invalid NULL key cache callback");
+      return false;
+   }
+   if (!secret || mongocrypt_binary_len (secret) != MONGOCRYPT_KEY_LEN) {
+      CLIENT_ERR ("secret must be %d bytes", MONGOCRYPT_KEY_LEN);
+      return false;
+   }
+
+   crypt->opts.key_cache_get = get;
+   crypt->opts.key_cache_put = put;
+   crypt->opts.key_cache_ctx = ctx;
+   _mongocrypt_buffer_cleanup (&crypt->opts.key_cache_secret);
+   _mongocrypt_buffer_copy_from_binary (&crypt->opts.key_cache_secret, secret);
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_key_cache_backend_evict (mongocrypt_t *crypt,
+                                           mongocrypt_key_cache_evict_fn evict)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+   if (!evict) {
+      CLIENT_ERR ("invalid NULL key cache callback");
+      return false;
+   }
+   if (!crypt->opts.key_cache_get) {
+      CLIENT_ERR ("mongocrypt_setopt_key_cache_backend must be called first");
+      return false;
+   }
+
+   crypt->opts.key_cache_evict = evict;
+   return true;
+}
+
+
+/* Decrypt and cache one element of the "keys" array of an export. */
+static bool
+_import_key (mongocrypt_t *crypt,
+             const _mongocrypt_buffer_t *kek,
+             bson_iter_t *iter)
+{
+   mongocrypt_status_t *status = crypt->status;
+   _mongocrypt_key_doc_t *key_doc;
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_cache_key_value_t *value;
+   _mongocrypt_buffer_t key_material;
+   bson_t entry;
+   const uint8_t *data;
+   uint32_t len;
+   int64_t ttl_ms, expiration_ms;
+   bool ret = false;
+
+   if (!BSON_ITER_HOLDS_DOCUMENT (iter)) {
+      CLIENT_ERR ("invalid exported key: expected document");
+      return false;
+   }
+   bson_iter_document (iter, &len, &data);
+   if (!bson_init_static (&entry, data, len)) {
+      CLIENT_ERR ("invalid exported key: malformed document");
+      return false;
+   }
+
+   key_doc = _mongocrypt_key_new ();
+   if (!_mongocrypt_cache_key_unwrap (crypt->crypto,
+                                      kek,
+                                      &entry,
+                                      "ttlMs",
+                                      key_doc,
+                                      &key_material,
+                                      &ttl_ms,
+                                      status)) {
+      goto done;
+   }
+   if (ttl_ms <= 0) {
+      /* The key expired before it was exported. */
+      ret = true;
+      goto done;
+   }
+
+   attr = _mongocrypt_cache_key_attr_new (&key_doc->id,
+                                          key_doc->key_alt_names);
+   value = _mongocrypt_cache_key_value_new (key_doc, &key_material);
+   /* A cache with another TTL keeps the key for at most its own TTL. */
+   expiration_ms = (int64_t) crypt->cache_key->expiration;
+   ret = _mongocrypt_cache_add_stolen_aged (
+      crypt->cache_key,
+      attr,
+      value,
+      ttl_ms < expiration_ms ? expiration_ms - ttl_ms : 0,
+      status);
+   _mongocrypt_cache_key_attr_destroy (attr);
+
+done:
+   _mongocrypt_buffer_cleanup (&key_material);
+   _mongocrypt_key_destroy (key_doc);
+   return ret;
+}
+
+
+bool
+mongocrypt_key_cache_import (mongocrypt_t *crypt,
+                             mongocrypt_binary_t *kek,
+                             mongocrypt_binary_t *in)
+{
+   _mongocrypt_buffer_t kek_buf;
+   mongocrypt_status_t *status;
+   bson_t as_bson;
+   bson_iter_t iter, keys;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+   if (!_check_kek (crypt, kek)) {
+      return false;
+   }
+   if (!in || !_mongocrypt_binary_to_bson (in, &as_bson)) {
+      CLIENT_ERR ("invalid BSON input");
+      return false;
+   }
+
+   if (!bson_iter_init_find (&iter, &as_bson, "v") ||
+       !BSON_ITER_HOLDS_INT32 (&iter) || bson_iter_int32 (&iter) != 2) {
+      CLIENT_ERR ("unsupported key cache export version");
+      return false;
+   }
+   if (!bson_iter_init_find (&iter, &as_bson, "keys") ||
+       !BSON_ITER_HOLDS_ARRAY (&iter) || !bson_iter_recurse (&iter, &keys)) {
+      CLIENT_ERR ("invalid key cache export: expected array 'keys'");
+      return false;
+   }
+
+   _mongocrypt_buffer_from_binary (&kek_buf, kek);
+   while (bson_iter_next (&keys)) {
+      if (!_import_key (crypt, &kek_buf, &keys)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+typedef struct {
+   char *ns;
+   bson_t *value;
+   int64_t ttl_ms;
+} _exported_collinfo_t;
+
+typedef struct {
+   _exported_collinfo_t *entries;
+   uint32_t num_entries;
+   uint32_t entries_size;
+   int64_t now_ms;
+   int64_t expiration_ms;
+} _collinfo_cache_export_ctx_t;
+
+
+/* Copy the entry and its remaining time, so it is appended without the
+ * lock. */
+static void
+_collect_exported_collinfo (_mongocrypt_cache_pair_t *pair, void *ctx)
+{
+   _collinfo_cache_export_ctx_t *export_ctx =
+      (_collinfo_cache_export_ctx_t *) ctx;
+   _exported_collinfo_t *entry;
+
+   if (export_ctx->num_entries == export_ctx->entries_size) {
+      export_ctx->entries_size =
+         export_ctx->entries_size ? export_ctx->entries_size * 2 : 16;
+      export_ctx->entries =
+         bson_realloc (export_ctx->entries,
+                       export_ctx->entries_size * sizeof (*entry));
+   }
+
+   entry = &export_ctx->entries[export_ctx->num_entries++];
+   entry->ns = bson_strdup ((const char *) pair->attr);
+   entry->value = bson_copy ((const bson_t *) pair->value);
+   entry->ttl_ms = export_ctx->expiration_ms -
+                   (export_ctx->now_ms - pair->last_updated);
+}
+
+
+bool
+mongocrypt_collinfo_cache_export (mongocrypt_t *crypt,
+                                  mongocrypt_binary_t *out)
+{
+   _collinfo_cache_export_ctx_t export_ctx;
+   mongocrypt_status_t *status;
+   bson_t bson, collections;
+   uint32_t i, len;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+   if (!crypt->initialized) {
+      CLIENT_ERR ("mongocrypt_init must be called first");
+      return false;
+   }
+   if (!out) {
+      CLIENT_ERR ("invalid NULL output");
+      return false;
+   }
+
+   memset (&export_ctx, 0, sizeof (export_ctx));
+   export_ctx.now_ms = bson_get_monotonic_time () / 1000;
+   export_ctx.expiration_ms = (int64_t) crypt->cache_collinfo->expiration;
+   _mongocrypt_cache_foreach (
+      crypt->cache_collinfo, _collect_exported_collinfo, &export_ctx);
+
+   bson_init (&bson);
+   bson_append_int32 (&bson, MONGOCRYPT_STR_AND_LEN ("v"), 1);
+   bson_append_array_begin (
+      &bson, MONGOCRYPT_STR_AND_LEN ("collections"), &collections);
+   for (i = 0; i < export_ctx.num_entries; i++) {
+      _exported_collinfo_t *entry = &export_ctx.entries[i];
+      bson_t child, collinfo;
+      uint32_t schema_digest;
+      char buf[16];
+      const char *idx;
+
+      if (!_mongocrypt_cache_collinfo_value_parse (
+             entry->value, &collinfo, &schema_digest)) {
+         /* Values are made by _mongocrypt_cache_collinfo_value_new. */
+         continue;
+      }
+      bson_uint32_to_string (i, &idx, buf, sizeof (buf));
+      bson_append_document_begin (&collections, idx, -1, &child);
+      bson_append_utf8 (&child, MONGOCRYPT_STR_AND_LEN ("ns"), entry->ns, -1);
+      if (!bson_empty (&collinfo)) {
+         bson_append_document (
+            &child, MONGOCRYPT_STR_AND_LEN ("collinfo"), &collinfo);
+      }
+      if (!_mongocrypt_cache_collinfo_value_requires_encryption (
+             entry->value)) {
+         bson_append_bool (&child,
+                           MONGOCRYPT_STR_AND_LEN ("schemaRequiresEncryption"),
+                           false);
+      }
+      bson_append_int64 (
+         &child, MONGOCRYPT_STR_AND_LEN ("ttlMs"), entry->ttl_ms);
+      bson_append_document_end (&collections, &child);
+      bson_destroy (&collinfo);
+   }
+   bson_append_array_end (&bson, &collections);
+
+   if (out->owned) {
+      bson_free (out->data);
+   }
+   out->data = bson_destroy_with_steal (&bson, true, &len);
+   out->len = len;
+   out->owned = true;
+
+   for (i = 0; i < export_ctx.num_entries; i++) {
+      bson_free (export_ctx.entries[i].ns);
+      bson_destroy (export_ctx.entries[i].value);
+   }
+   bson_free (export_ctx.entries);
+   return true;
+}
+
+
+/* Cache one element of the "collections" array of an export. */
+static bool
+_import_collinfo (mongocrypt_t *crypt, bson_iter_t *iter)
+{
+   mongocrypt_status_t *status = crypt->status;
+   bson_iter_t child;
+   bson_t entry, collinfo;
+   bson_t *value;
+   const uint8_t *data;
+   const char *ns;
+   uint32_t len;
+   int64_t ttl_ms, expiration_ms;
+   bool has_collinfo = false;
+
+   if (!BSON_ITER_HOLDS_DOCUMENT (iter)) {
+      CLIENT_ERR ("invalid exported collinfo: expected document");
+      return false;
+   }
+   bson_iter_document (iter, &len, &data);
+   if (!bson_init_static (&entry, data, len)) {
+      CLIENT_ERR ("invalid exported collinfo: malformed document");
+      return false;
+   }
+
+   if (!bson_iter_init_find (&child, &entry, "ns") ||
+       !BSON_ITER_HOLDS_UTF8 (&child)) {
+      CLIENT_ERR ("invalid exported collinfo: expected string 'ns'");
+      return false;
+   }
+   ns = bson_iter_utf8 (&child, NULL);
+
+   if (bson_iter_init_find (&child, &entry, "collinfo")) {
+      if (!BSON_ITER_HOLDS_DOCUMENT (&child)) {
+         CLIENT_ERR ("invalid exported collinfo: expected document "
+                     "'collinfo'");
+         return false;
+      }
+      bson_iter_document (&child, &len, &data);
+      if (!bson_init_static (&collinfo, data, len)) {
+         CLIENT_ERR ("invalid exported collinfo: malformed 'collinfo'");
+         return false;
+      }
+      has_collinfo = true;
+   }
+
+   if (!bson_iter_init_find (&child, &entry, "ttlMs") ||
+       !BSON_ITER_HOLDS_INT64 (&child)) {
+      CLIENT_ERR ("invalid exported collinfo: expected int64 'ttlMs'");
+      return false;
+   }
+   ttl_ms = bson_iter_int64 (&child);
+   if (ttl_ms <= 0) {
+      /* The entry expired before it was exported. */
+      return true;
+   }
+
+   /* The digest and encrypted paths are computed again, in case the
+    * exporting version of libmongocrypt computed them differently. */
+   value = _mongocrypt_cache_collinfo_value_new (
+      has_collinfo ? &collinfo : NULL);
+   if (bson_iter_init_find (&child, &entry, "schemaRequiresEncryption") &&
+       !bson_iter_as_bool (&child)) {
+      bson_t *no_encryption;
+
+      no_encryption =
+         _mongocrypt_cache_collinfo_value_no_encryption_new (value);
+      bson_destroy (value);
+      value = no_encryption;
+   }
+
+   /* A cache with another TTL keeps the entry for at most its own TTL. */
+   expiration_ms = (int64_t) crypt->cache_collinfo->expiration;
+   return _mongocrypt_cache_add_stolen_aged (
+      crypt->cache_collinfo,
+      (void *) ns,
+      value,
+      ttl_ms < expiration_ms ? expiration_ms - ttl_ms : 0,
+      status);
+}
+
+
+bool
+mongocrypt_collinfo_cache_import (mongocrypt_t *crypt, mongocrypt_binary_t *in)
+{
+   mongocrypt_status_t *status;
+   bson_t as_bson;
+   bson_iter_t iter, collections;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+   if (!crypt->initialized) {
+      CLIENT_ERR ("mongocrypt_init must be called first");
+      return false;
+   }
+   if (!in || !_mongocrypt_binary_to_bson (in, &as_bson)) {
+      CLIENT_ERR ("invalid BSON input");
+      return false;
+   }
+
+   if (!bson_iter_init_find (&iter, &as_bson, "v") ||
+       !BSON_ITER_HOLDS_INT32 (&iter) || bson_iter_int32 (&iter) != 1) {
+      CLIENT_ERR ("unsupported collinfo cache export version");
+      return false;
+   }
+   if (!bson_iter_init_find (&iter, &as_bson, "collections") ||
+       !BSON_ITER_HOLDS_ARRAY (&iter) ||
+       !bson_iter_recurse (&iter, &collections)) {
+      CLIENT_ERR ("invalid collinfo cache export: expected array "
+                  "'collections'");
+      return false;
+   }
+
+   while (bson_iter_next (&collections)) {
+      if (!_import_collinfo (crypt, &collections)) {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+bool
+mongocrypt_key_cache_invalidate (mongocrypt_t *crypt,
+                                 mongocrypt_binary_t *key_id)
+{
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_buffer_t id;
+   mongocrypt_status_t *status;
+   bool ret;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+   if (!crypt->initialized) {
+      CLIENT_ERR ("mongocrypt_init must be called first");
+      return false;
+   }
+   if (!key_id || !key_id->data || key_id->len != 16) {
+      CLIENT_ERR ("invalid key_id: expected 16 byte UUID");
+      return false;
+   }
+
+   _mongocrypt_buffer_from_binary (&id, key_id);
+   id.subtype = BSON_SUBTYPE_UUID;
+   attr = _mongocrypt_cache_key_attr_new (&id, NULL);
+   ret = _mongocrypt_cache_key_invalidate (crypt, attr, status);
+   _mongocrypt_cache_key_attr_destroy (attr);
+   return ret;
+}
+
+
+bool
+mongocrypt_key_cache_invalidate_alt_name (mongocrypt_t *crypt,
+                                          mongocrypt_binary_t *key_alt_name)
+{
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_key_alt_name_t *alt_name;
+   mongocrypt_status_t *status;
+   bson_t as_bson;
+   bson_iter_t iter;
+   bool ret;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+   if (!crypt->initialized) {
+      CLIENT_ERR ("mongocrypt_init must be called first");
+      return false;
+   }
+   if (!key_alt_name || !key_alt_name->data ||
+       !_mongocrypt_binary_to_bson (key_alt_name, &as_bson)) {
+      CLIENT_ERR ("invalid keyAltName bson object");
+      return false;
+   }
+   if (!bson_iter_init_find (&iter, &as_bson, "keyAltName") ||
+       !BSON_ITER_HOLDS_UTF8 (&iter)) {
+      CLIENT_ERR ("keyAltName must have UTF8 field 'keyAltName'");
+      return false;
+   }
+
+   alt_name = _mongocrypt_key_alt_name_new (bson_iter_value (&iter));
+   attr = _mongocrypt_cache_key_attr_new (NULL, alt_name);
+   ret = _mongocrypt_cache_key_invalidate (crypt, attr, status);
+   _mongocrypt_cache_key_attr_destroy (attr);
+   _mongocrypt_key_alt_name_destroy_all (alt_name);
+   return ret;
+}
+
+
+bool
+mongocrypt_needs_oauth_refresh (mongocrypt_t *crypt, const char *kms_provider)
+{
+   if (!crypt || !kms_provider) {
+      return false;
+   }
+   if (0 == strcmp (kms_provider, "azure")) {
+      return _mongocrypt_cache_oauth_needs_refresh (crypt->cache_oauth_azure);
+   }
+   if (0 == strcmp (kms_provider, "gcp")) {
+      return _mongocrypt_cache_oauth_needs_refresh (crypt->cache_oauth_gcp);
+   }
+   return false;
+}
+
+
+bool
+mongocrypt_cache_maintain (mongocrypt_t *crypt)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+   if (!crypt->initialized) {
+      CLIENT_ERR ("mongocrypt_init must be called first");
+      return false;
+   }
+
+   _mongocrypt_cache_evict (crypt->cache_collinfo);
+   _mongocrypt_cache_evict (crypt->cache_key);
+   if (crypt->opts.use_markings_cache) {
+      _mongocrypt_cache_evict (&crypt->cache_markings);
+   }
+   if (crypt->opts.use_ciphertext_cache) {
+      _mongocrypt_cache_evict (&crypt->cache_ciphertext);
+   }
+   if (crypt->opts.use_plaintext_cache) {
+      _mongocrypt_cache_evict (&crypt->cache_plaintext);
+      _mongocrypt_cache_plaintext_remove_uncached_keys (
+         &crypt->cache_plaintext, crypt->cache_key);
+   }
+   return true;
+}
+
+
+bool
+mongocrypt_trim (mongocrypt_t *crypt,
+                 mongocrypt_trim_level_t level,
+                 uint64_t *bytes_freed)
+{
+   mongocrypt_status_t *status;
+   int64_t idle_ms;
+   size_t freed = 0;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+   if (!crypt->initialized) {
+      CLIENT_ERR ("mongocrypt_init must be called first");
+      return false;
+   }
+
+   if (level == MONGOCRYPT_TRIM_COLD) {
+      idle_ms = CACHE_COLD_MS;
+   } else if (level == MONGOCRYPT_TRIM_ALL) {
+      idle_ms = 0;
+   } else {
+      CLIENT_ERR ("invalid trim level: %d", (int) level);
+      return false;
+   }
+
+   /* Values derived from keys and schemas are cheap to compute again. */
+   freed += _mongocrypt_cache_trim (&crypt->cache_markings, 0);
+   freed += _mongocrypt_cache_trim (&crypt->cache_ciphertext, 0);
+   freed += _mongocrypt_cache_trim (&crypt->cache_plaintext, 0);
+   freed += _mongocrypt_cache_trim (crypt->cache_collinfo, idle_ms);
+   freed += _mongocrypt_cache_trim (crypt->cache_key, idle_ms);
+   _mongocrypt_key_l1_clear (crypt->key_l1);
+
+   if (bytes_freed) {
+      *bytes_freed = (uint64_t) freed;
+   }
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_collinfo_cache_ttl (mongocrypt_t *crypt, uint64_t ttl_ms)
+{
+   if (!crypt) {
+      return false;
+   }
+   return _setopt_cache_ttl (crypt, crypt->cache_collinfo, ttl_ms);
+}
+
+
+bool
+mongocrypt_setopt_collinfo_cache_max_entries (mongocrypt_t *crypt,
+                                              uint32_t max_entries)
+{
+   if (!crypt) {
+      return false;
+   }
+   return _setopt_cache_max_entries (
+      crypt, crypt->cache_collinfo, max_entries);
+}
+
+
+bool
+mongocrypt_setopt_use_markings_cache (mongocrypt_t *crypt,
+                                      uint32_t max_entries)
+{
+   if (!crypt) {
+      return false;
+   }
+   if (!_setopt_cache_max_entries (
+          crypt, &crypt->cache_markings, max_entries)) {
+      return false;
+   }
+   crypt->opts.use_markings_cache = true;
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_use_ciphertext_cache (mongocrypt_t *crypt,
+                                        uint32_t max_entries)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+   if (max_entries == 0) {
+      CLIENT_ERR ("ciphertext cache max_entries must be positive");
+      return false;
+   }
+   if (!_setopt_cache_max_entries (
+          crypt, &crypt->cache_ciphertext, max_entries)) {
+      return false;
+   }
+   crypt->opts.use_ciphertext_cache = true;
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_use_plaintext_cache (mongocrypt_t *crypt,
+                                       uint32_t max_entries)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+   if (max_entries == 0) {
+      CLIENT_ERR ("plaintext cache max_entries must be positive");
+      return false;
+   }
+   if (!_setopt_cache_max_entries (
+          crypt, &crypt->cache_plaintext, max_entries)) {
+      return false;
+   }
+   crypt->opts.use_plaintext_cache = true;
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_local_marking (mongocrypt_t *crypt,
+                                 const char *ns,
+                                 int32_t ns_len)
+{
+   mongocrypt_status_t *status;
+   char *ns_copy = NULL;
+   bson_t namespaces;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   if (!_mongocrypt_validate_and_copy_string (ns, ns_len, &ns_copy) ||
+       !strchr (ns_copy, '.')) {
+      bson_free (ns_copy);
+      CLIENT_ERR ("invalid namespace");
+      return false;
+   }
+
+   if (_mongocrypt_buffer_empty (&crypt->opts.local_marking_ns)) {
+      bson_init (&namespaces);
+   } else {
+      bson_t existing;
+
+      BSON_ASSERT (
+         _mongocrypt_buffer_to_bson (&crypt->opts.local_marking_ns, &existing));
+      bson_copy_to (&existing, &namespaces);
+      _mongocrypt_buffer_cleanup (&crypt->opts.local_marking_ns);
+   }
+   BSON_APPEND_BOOL (&namespaces, ns_copy, true);
+   _mongocrypt_buffer_steal_from_bson (&crypt->opts.local_marking_ns,
+                                       &namespaces);
+   bson_free (ns_copy);
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_skip_unencrypted_commands (mongocrypt_t *crypt, bool enable)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   crypt->opts.skip_unencrypted_cmds = enable;
+   return true;
+}
+
+
+bool
+mongocrypt_init (mongocrypt_t *crypt)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+   if (crypt->initialized) {
+      CLIENT_ERR ("already initialized");
+      return false;
+   }
+
+   crypt->initialized = true;
+
+   if (!mongocrypt_status_ok (crypt->status)) {
+      return false;
+   }
+
+   if (!_mongocrypt_opts_validate (&crypt->opts, status)) {
+      return false;
+   }
+
+   if (!_mongocrypt_buffer_empty (&crypt->opts.schema_map_image)) {
+      if (!_mongocrypt_schema_map_load_image (
+             &crypt->schema_map, &crypt->opts.schema_map_image, status)) {
+         return false;
+      }
+   } else if (!_mongocrypt_schema_map_compile (&crypt->schema_map,
+                                               &crypt->opts.schema_map,
+                                               status)) {
+      return false;
+   }
+
+   if (!_mongocrypt_key_vault_snapshot_load (&crypt->key_vault_snapshot,
+                                             &crypt->opts.key_vault_snapshot,
+                                             status)) {
+      return false;
+   }
+
+   if (crypt->opts.log_fn) {
+      _mongocrypt_log_set_fn (
+         &crypt->log, crypt->opts.log_fn, crypt->opts.log_ctx);
+   }
+   crypt->log.level = crypt->opts.log_level;
+   if (crypt->opts.log_buffer_capacity > 0) {
+      _mongocrypt_log_set_buffer (&crypt->log,
+                                  crypt->opts.log_buffer_capacity);
+   }
+   crypt->trace.fn = crypt->opts.trace_fn;
+   crypt->trace.ctx = crypt->opts.trace_ctx;
+   if (crypt->opts.key_cache_per_thread) {
+      crypt->key_l1 = _mongocrypt_key_l1_new ();
+   }
+   /* A plaintext lives no longer than its key would. */
+   _mongocrypt_cache_set_expiration (&crypt->cache_plaintext,
+                                     crypt->cache_key->expiration);
+   crypt->opts.kms_config = _mongocrypt_kms_config_new (&crypt->opts);
+
+   if (!crypt->crypto) {
+#ifndef MONGOCRYPT_ENABLE_CRYPTO
+      CLIENT_ERR ("libmongocrypt built with native crypto disabled. crypto "
+                  "hooks required");
+      return false;
+#else
+      /* set default hooks. */
+      crypt->crypto = bson_malloc0 (sizeof (*crypt->crypto));
+      BSON_ASSERT (crypt->crypto);
+
+#endif
+   }
+
+#ifdef MONGOCRYPT_ENABLE_CRYPTO_HOOKS
+   if (crypt->opts.crypto_self_benchmark &&
+       !_mongocrypt_crypto_self_benchmark (crypt->crypto, status)) {
+      return false;
+   }
+#endif
+   return true;
+}
+
+
+bool
+mongocrypt_status (mongocrypt_t *crypt, mongocrypt_status_t *out)
+{
+   if (!crypt) {
+      return false;
+   }
+
+   if (!out) {
+      mongocrypt_status_t *status = crypt->status;
+      CLIENT_ERR ("argument 'out' is required");
+      return false;
+   }
+
+   if (!mongocrypt_status_ok (crypt->status)) {
+      _mongocrypt_status_copy_to (crypt->status, out);
+      return false;
+   }
+   _mongocrypt_status_reset (out);
+   return true;
+}
+
+
+bool
+mongocrypt_after_fork_child (mongocrypt_t *crypt)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+   if (!crypt->initialized) {
+      CLIENT_ERR ("mongocrypt_init must be called first");
+      return false;
+   }
+
+   /* Threads of the parent may have held any of the locks when the process
+    * forked. Only the forking thread exists in the child, so initialize the
+    * locks again. */
+   _mongocrypt_key_slab_after_fork ();
+   _mongocrypt_mutex_init (&crypt->mutex);
+   _mongocrypt_mutex_init (&crypt->opts.credentials_mutex);
+   _mongocrypt_mutex_init (&crypt->log.mutex);
+   _mongocrypt_cache_after_fork (crypt->cache_collinfo);
+   _mongocrypt_cache_after_fork (crypt->cache_key);
+   _mongocrypt_cache_after_fork (&crypt->cache_markings);
+   _mongocrypt_cache_after_fork (&crypt->cache_ciphertext);
+   _mongocrypt_cache_after_fork (&crypt->cache_plaintext);
+   if (crypt->cache_oauth_azure) {
+      _mongocrypt_cache_oauth_after_fork (crypt->cache_oauth_azure);
+   }
+   if (crypt->cache_oauth_gcp) {
+      _mongocrypt_cache_oauth_after_fork (crypt->cache_oauth_gcp);
+   }
+   _mongocrypt_key_l1_after_fork (crypt->key_l1);
+   _mongocrypt_key_fetches_after_fork (&crypt->key_fetches);
+   _mongocrypt_key_batch_after_fork (&crypt->key_batch);
+   _mongocrypt_mutex_init (&crypt->aws_signing_keys.mutex);
+   _mongocrypt_mutex_init (&crypt->stats.namespaces.mutex);
+   _mongocrypt_mutex_init (&crypt->gcp_assertions.mutex);
+   _mongocrypt_mutex_init (&crypt->kms_limiter.mutex);
+   /* The parent and child must never use the same IVs. */
+   _mongocrypt_random_pool_after_fork (&crypt->random_pool);
+
+   _mongocrypt_atomic_add_int64 (&crypt->forks, 1);
+   return true;
+}
+
+
+void
+mongocrypt_destroy (mongocrypt_t *crypt)
+{
+   if (!crypt) {
+      return;
+   }
+   _mongocrypt_kms_config_destroy (crypt->opts.kms_config);
+   _mongocrypt_opts_cleanup (&crypt->opts);
+   _mongocrypt_key_l1_destroy (crypt->key_l1);
+   _mongocrypt_key_fetches_cleanup (&crypt->key_fetches);
+   _mongocrypt_key_batch_cleanup (&crypt->key_batch);
+   _mongocrypt_cache_cleanup (&crypt->cache_markings);
+   _mongocrypt_cache_cleanup (&crypt->cache_ciphertext);
+   _mongocrypt_cache_cleanup (&crypt->cache_plaintext);
+   _mongocrypt_schema_map_cleanup (&crypt->schema_map);
+   _mongocrypt_key_vault_snapshot_cleanup (&crypt->key_vault_snapshot);
+   _mongocrypt_stats_namespaces_cleanup (&crypt->stats.namespaces);
+   _mongocrypt_mutex_cleanup (&crypt->mutex);
+   _mongocrypt_log_cleanup (&crypt->log);
+   mongocrypt_status_destroy (crypt->status);
+   bson_free (crypt->crypto);
+   mongocrypt_shared_cache_destroy (crypt->shared_cache);
+   _mongocrypt_aws_signing_keys_cleanup (&crypt->aws_signing_keys);
+   _mongocrypt_gcp_assertions_cleanup (&crypt->gcp_assertions);
+   _mongocrypt_kms_limiter_cleanup (&crypt->kms_limiter);
+   _mongocrypt_random_pool_cleanup (&crypt->random_pool);
+   bson_free (crypt);
+}
+
+
+bool
+_mongocrypt_validate_and_copy_string (const char *in,
+                                      int32_t in_len,
+                                      char **out)
+{
+   if (!in) {
+      return false;
+   }
+
+   if (in_len < -1) {
+      return false;
+   }
+
+   if (in_len == -1) {
+      in_len = (uint32_t) strlen (in);
+   }
+
+   if (!bson_utf8_validate (in, in_len, false)) {
+      return false;
+   }
+   *out = bson_strndup (in, in_len);
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_crypto_hooks (mongocrypt_t *crypt,
+                                mongocrypt_crypto_fn aes_256_cbc_encrypt,
+                                mongocrypt_crypto_fn aes_256_cbc_decrypt,
+                                mongocrypt_random_fn random,
+                                mongocrypt_hmac_fn hmac_sha_512,
+                                mongocrypt_hmac_fn hmac_sha_256,
+                                mongocrypt_hash_fn sha_256,
+                                void *ctx)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+#ifndef MONGOCRYPT_ENABLE_CRYPTO_HOOKS
+   CLIENT_ERR ("libmongocrypt built with crypto hooks disabled");
+   return false;
+#endif
+
+   if (crypt->crypto) {
       CLIENT_ERR ("crypto_hooks already set");
       return false;
    }
@@ -539,6 +2519,155 @@ mongocrypt_setopt_crypto_hooks (mongocrypt_t *crypt,
    return true;
 }
 
+bool
+mongocrypt_setopt_crypto_hook_hmac_sha_512_incremental (
+   mongocrypt_t *crypt,
+   mongocrypt_hmac_init_fn hmac_sha_512_init,
+   mongocrypt_hmac_update_fn hmac_sha_512_update,
+   mongocrypt_hmac_final_fn hmac_sha_512_final)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   if (!crypt->crypto || !crypt->crypto->hooks_enabled) {
+      CLIENT_ERR ("crypto_hooks must be set first");
+      return false;
+   }
+
+   if (crypt->crypto->hmac_sha_512_init) {
+      CLIENT_ERR ("incremental hmac_sha_512 hooks already set");
+      return false;
+   }
+
+   if (!hmac_sha_512_init || !hmac_sha_512_update || !hmac_sha_512_final) {
+      CLIENT_ERR ("incremental hmac_sha_512 hooks must all be set");
+      return false;
+   }
+
+   crypt->crypto->hmac_sha_512_init = hmac_sha_512_init;
+   crypt->crypto->hmac_sha_512_update = hmac_sha_512_update;
+   crypt->crypto->hmac_sha_512_final = hmac_sha_512_final;
+   return true;
+}
+
+bool
+mongocrypt_setopt_crypto_hook_batch (mongocrypt_t *crypt,
+                                     mongocrypt_crypto_batch_fn batch)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   if (!crypt->crypto || !crypt->crypto->hooks_enabled) {
+      CLIENT_ERR ("crypto_hooks must be set first");
+      return false;
+   }
+
+   if (crypt->crypto->batch) {
+      CLIENT_ERR ("batch crypto hook already set");
+      return false;
+   }
+
+   if (!batch) {
+      CLIENT_ERR ("batch crypto hook must be set");
+      return false;
+   }
+
+   crypt->crypto->batch = batch;
+   return true;
+}
+
+bool
+mongocrypt_setopt_crypto_hooks_policy (mongocrypt_t *crypt, uint32_t native)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   if (!crypt->crypto || !crypt->crypto->hooks_enabled) {
+      CLIENT_ERR ("crypto_hooks must be set first");
+      return false;
+   }
+
+   if (native & ~(uint32_t) MONGOCRYPT_CRYPTO_PRIMITIVE_ALL) {
+      CLIENT_ERR ("unrecognized crypto primitives: %u", native);
+      return false;
+   }
+
+#ifndef MONGOCRYPT_ENABLE_CRYPTO
+   if (native) {
+      CLIENT_ERR ("libmongocrypt built with native crypto disabled. crypto "
+                  "hooks required");
+      return false;
+   }
+#endif
+
+   crypt->crypto->native = native;
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_crypto_self_benchmark (mongocrypt_t *crypt, bool enable)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   if (!crypt->crypto || !crypt->crypto->hooks_enabled) {
+      CLIENT_ERR ("crypto_hooks must be set first");
+      return false;
+   }
+
+#ifndef MONGOCRYPT_ENABLE_CRYPTO
+   if (enable) {
+      CLIENT_ERR ("libmongocrypt built with native crypto disabled. crypto "
+                  "hooks required");
+      return false;
+   }
+#endif
+
+   crypt->opts.crypto_self_benchmark = enable;
+   return true;
+}
+
 bool
 mongocrypt_setopt_crypto_hook_sign_rsaes_pkcs1_v1_5 (
    mongocrypt_t *crypt,
@@ -568,6 +2697,89 @@ mongocrypt_setopt_crypto_hook_sign_rsaes_pkcs1_v1_5 (
    return true;
 }
 
+bool
+mongocrypt_setopt_parallel_for (mongocrypt_t *crypt,
+                                mongocrypt_parallel_for_fn parallel_for,
+                                uint32_t min_fields,
+                                void *ctx)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   if (crypt->opts.executor.submit) {
+      CLIENT_ERR ("cannot set both an executor and parallel_for");
+      return false;
+   }
+
+   if (crypt->opts.parallel_for) {
+      CLIENT_ERR ("parallel_for already set");
+      return false;
+   }
+
+   if (!parallel_for) {
+      CLIENT_ERR ("parallel_for must be set");
+      return false;
+   }
+
+   crypt->opts.parallel_for = parallel_for;
+   crypt->opts.parallel_for_ctx = ctx;
+   /* A single field is never worth dispatching. */
+   crypt->opts.parallel_min_fields = BSON_MAX (min_fields, 2);
+   return true;
+}
+
+
+bool
+mongocrypt_setopt_executor (mongocrypt_t *crypt,
+                            mongocrypt_submit_fn submit,
+                            void *ctx)
+{
+   mongocrypt_status_t *status;
+
+   if (!crypt) {
+      return false;
+   }
+
+   status = crypt->status;
+
+   if (crypt->initialized) {
+      CLIENT_ERR ("options cannot be set after initialization");
+      return false;
+   }
+
+   if (crypt->opts.executor.submit) {
+      CLIENT_ERR ("executor already set");
+      return false;
+   }
+
+   if (crypt->opts.parallel_for) {
+      CLIENT_ERR ("cannot set both an executor and parallel_for");
+      return false;
+   }
+
+   if (!submit) {
+      CLIENT_ERR ("submit must be set");
+      return false;
+   }
+
+   crypt->opts.executor.submit = submit;
+   crypt->opts.executor.ctx = ctx;
+   crypt->opts.parallel_for = _mongocrypt_executor_parallel_for;
+   crypt->opts.parallel_for_ctx = &crypt->opts.executor;
+   crypt->opts.parallel_min_fields = MONGOCRYPT_EXECUTOR_MIN_FIELDS;
+   return true;
+}
+
 bool
 mongocrypt_setopt_kms_providers (mongocrypt_t *crypt,
                                  mongocrypt_binary_t *kms_providers)
@@ -742,7 +2954,7 @@ mongocrypt_setopt_kms_providers (mongocrypt_t *crypt,
       }
    }
 
-   if (crypt->log.trace_enabled) {
+   if (MONGOCRYPT_LOG_TRACE_ENABLED (&crypt->log)) {
       char *as_str = bson_as_json (&as_bson, NULL);
       _mongocrypt_log (&crypt->log,
                        MONGOCRYPT_LOG_LEVEL_TRACE,
@@ -755,3 +2967,205 @@ mongocrypt_setopt_kms_providers (mongocrypt_t *crypt,
 
    return true;
 }
+
+
+/* Credentials parsed by mongocrypt_update_kms_credentials. After the swap,
+ * they hold the replaced credentials. */
+typedef struct {
+   int kms_providers;
+   _mongocrypt_opts_kms_provider_aws_t aws;
+   _mongocrypt_opts_kms_provider_azure_t azure;
+   _mongocrypt_opts_kms_provider_gcp_t gcp;
+} _kms_credentials_t;
+
+
+static void
+_kms_credentials_cleanup (_kms_credentials_t *creds)
+{
+   bson_free (creds->aws.access_key_id);
+   bson_free (creds->aws.secret_access_key);
+   bson_free (creds->aws.session_token);
+   bson_free (creds->azure.tenant_id);
+   bson_free (creds->azure.client_id);
+   bson_free (creds->azure.client_secret);
+   bson_free (creds->gcp.email);
+   _mongocrypt_buffer_cleanup (&creds->gcp.private_key);
+}
+
+
+static bool
+_parse_kms_credentials (mongocrypt_t *crypt,
+                        bson_t *as_bson,
+                        _kms_credentials_t *creds)
+{
+   mongocrypt_status_t *status = crypt->status;
+   bson_iter_t iter;
+   int provider;
+
+   if (!bson_iter_init (&iter, as_bson)) {
+      CLIENT_ERR ("invalid BSON");
+      return false;
+   }
+
+   while (bson_iter_next (&iter)) {
+      const char *field_name;
+
+      field_name = bson_iter_key (&iter);
+      if (0 == strcmp (field_name, "aws")) {
+         provider = MONGOCRYPT_KMS_PROVIDER_AWS;
+      } else if (0 == strcmp (field_name, "azure")) {
+         provider = MONGOCRYPT_KMS_PROVIDER_AZURE;
+      } else if (0 == strcmp (field_name, "gcp")) {
+         provider = MONGOCRYPT_KMS_PROVIDER_GCP;
+      } else if (0 == strcmp (field_name, "local")) {
+         CLIENT_ERR ("local KMS provider cannot be updated");
+         return false;
+      } else {
+         CLIENT_ERR ("unsupported KMS provider: %s", field_name);
+         return false;
+      }
+
+      if (0 == (crypt->opts.kms_providers & provider)) {
+         CLIENT_ERR ("%s KMS provider not configured", field_name);
+         return false;
+      }
+      if (0 != (creds->kms_providers & provider)) {
+         CLIENT_ERR ("%s KMS provider already set", field_name);
+         return false;
+      }
+      creds->kms_providers |= provider;
+
+      if (provider == MONGOCRYPT_KMS_PROVIDER_AWS) {
+         if (!_mongocrypt_parse_required_utf8 (as_bson,
+                                               "aws.accessKeyId",
+                                               &creds->aws.access_key_id,
+                                               status) ||
+             !_mongocrypt_parse_required_utf8 (as_bson,
+                                               "aws.secretAccessKey",
+                                               &creds->aws.secret_access_key,
+                                               status) ||
+             !_mongocrypt_parse_optional_utf8 (as_bson,
+                                               "aws.sessionToken",
+                                               &creds->aws.session_token,
+                                               status) ||
+             !_mongocrypt_check_allowed_fields (as_bson,
+                                                "aws",
+                                                status,
+                                                "accessKeyId",
+                                                "secretAccessKey",
+                                                "sessionToken")) {
+            return false;
+         }
+      } else if (provider == MONGOCRYPT_KMS_PROVIDER_AZURE) {
+         if (!_mongocrypt_parse_required_utf8 (as_bson,
+                                               "azure.tenantId",
+                                               &creds->azure.tenant_id,
+                                               status) ||
+             !_mongocrypt_parse_required_utf8 (as_bson,
+                                               "azure.clientId",
+                                               &creds->azure.client_id,
+                                               status) ||
+             !_mongocrypt_parse_required_utf8 (as_bson,
+                                               "azure.clientSecret",
+                                               &creds->azure.client_secret,
+                                               status) ||
+             !_mongocrypt_check_allowed_fields (as_bson,
+                                                "azure",
+                                                status,
+                                                "tenantId",
+                                                "clientId",
+                                                "clientSecret")) {
+            return false;
+         }
+      } else {
+         if (!_mongocrypt_parse_required_utf8 (
+                as_bson, "gcp.email", &creds->gcp.email, status) ||
+             !_mongocrypt_parse_required_binary (as_bson,
+                                                 "gcp.privateKey",
+                                                 &creds->gcp.private_key,
+                                                 status) ||
+             !_mongocrypt_check_allowed_fields (
+                as_bson, "gcp", status, "email", "privateKey")) {
+            return false;
+         }
+      }
+   }
+   return true;
+}
+
+
+static void
+_swap_str (char **a, char **b)
+{
+   char *tmp = *a;
+
+   *a = *b;
+   *b = tmp;
+}
+
+
+bool
+mongocrypt_update_kms_credentials (mongocrypt_t *crypt,
+                                   mongocrypt_binary_t *kms_providers)
+{
+   mongocrypt_status_t *status;
+   _kms_credentials_t creds;
+   _mongocrypt_opts_t *opts;
+   bson_t as_bson;
+   bool ret = false;
+
+   if (!crypt) {
+      return false;
+   }
+   status = crypt->status;
+
+   if (!crypt->initialized) {
+      CLIENT_ERR ("mongocrypt_init must be called first");
+      return false;
+   }
+
+   if (!_mongocrypt_binary_to_bson (kms_providers, &as_bson)) {
+      CLIENT_ERR ("invalid BSON");
+      return false;
+   }
+
+   memset (&creds, 0, sizeof (creds));
+   if (!_parse_kms_credentials (crypt, &as_bson, &creds)) {
+      goto done;
+   }
+
+   /* Swap every provider at once, so no request mixes old and new
+    * credentials. AWS signing keys are found by access key id, so they need
+    * no invalidation. GCP assertions are signed with the private key. */
+   opts = &crypt->opts;
+   _mongocrypt_mutex_lock (&opts->credentials_mutex);
+   if (creds.kms_providers & MONGOCRYPT_KMS_PROVIDER_AWS) {
+      _swap_str (&opts->kms_provider_aws.access_key_id,
+                 &creds.aws.access_key_id);
+      _swap_str (&opts->kms_provider_aws.secret_access_key,
+                 &creds.aws.secret_access_key);
+      _swap_str (&opts->kms_provider_aws.session_token,
+                 &creds.aws.session_token);
+   }
+   if (creds.kms_providers & MONGOCRYPT_KMS_PROVIDER_AZURE) {
+      _swap_str (&opts->kms_provider_azure.tenant_id, &creds.azure.tenant_id);
+      _swap_str (&opts->kms_provider_azure.client_id, &creds.azure.client_id);
+      _swap_str (&opts->kms_provider_azure.client_secret,
+                 &creds.azure.client_secret);
+   }
+   if (creds.kms_providers & MONGOCRYPT_KMS_PROVIDER_GCP) {
+      _mongocrypt_buffer_t tmp;
+
+      _swap_str (&opts->kms_provider_gcp.email, &creds.gcp.email);
+      tmp = opts->kms_provider_gcp.private_key;
+      opts->kms_provider_gcp.private_key = creds.gcp.private_key;
+      creds.gcp.private_key = tmp;
+      _mongocrypt_gcp_assertions_clear (&crypt->gcp_assertions);
+   }
+   _mongocrypt_mutex_unlock (&opts->credentials_mutex);
+   ret = true;
+
+done:
+   _kms_credentials_cleanup (&creds);
+   return ret;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "../mongocrypt-os-private.h"
+
+#ifndef _WIN32
+
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+void *
+_mongocrypt_os_map_locked (size_t len, bool *locked)
+{
+   void *ptr;
+
+   ptr = mmap (
+      NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (ptr == MAP_FAILED) {
+      *locked = false;
+      return NULL;
+   }
+   *locked = 0 == mlock (ptr, len);
+#ifdef MADV_DONTDUMP
+   /* Keep the contents out of core dumps too. */
+   (void) madvise (ptr, len, MADV_DONTDUMP);
+#endif
+   return ptr;
+}
+
+void
+_mongocrypt_os_unmap_locked (void *ptr, size_t len, bool locked)
+{
+   if (locked) {
+      (void) munlock (ptr, len);
+   }
+   (void) munmap (ptr, len);
+}
+
+bool
+_mongocrypt_os_relock (void *ptr, size_t len)
+{
+   return 0 == mlock (ptr, len);
+}
+
+#endif /* _WIN32 */
@@ -18,6 +18,11 @@
 
 #ifndef _WIN32
 
+#include <errno.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <unistd.h>
+
 void
 _mongocrypt_mutex_init (mongocrypt_mutex_t *mutex)
 {
@@ -54,4 +59,224 @@ _mongocrypt_mutex_unlock (mongocrypt_mutex_t *mutex)
    }
 }
 
+void
+_mongocrypt_rwlock_init (mongocrypt_rwlock_t *rwlock)
+{
+   int ret = pthread_rwlock_init (rwlock, NULL);
+   if (ret) {
+      abort ();
+   }
+}
+
+void
+_mongocrypt_rwlock_cleanup (mongocrypt_rwlock_t *rwlock)
+{
+   int ret = pthread_rwlock_destroy (rwlock);
+   if (ret) {
+      abort ();
+   }
+}
+
+void
+_mongocrypt_rwlock_rdlock (mongocrypt_rwlock_t *rwlock)
+{
+   int ret = pthread_rwlock_rdlock (rwlock);
+   if (ret) {
+      abort ();
+   }
+}
+
+void
+_mongocrypt_rwlock_rdunlock (mongocrypt_rwlock_t *rwlock)
+{
+   int ret = pthread_rwlock_unlock (rwlock);
+   if (ret) {
+      abort ();
+   }
+}
+
+void
+_mongocrypt_rwlock_wrlock (mongocrypt_rwlock_t *rwlock)
+{
+   int ret = pthread_rwlock_wrlock (rwlock);
+   if (ret) {
+      abort ();
+   }
+}
+
+void
+_mongocrypt_rwlock_wrunlock (mongocrypt_rwlock_t *rwlock)
+{
+   int ret = pthread_rwlock_unlock (rwlock);
+   if (ret) {
+      abort ();
+   }
+}
+
+void
+_mongocrypt_cond_init (mongocrypt_cond_t *cond)
+{
+   int ret = pthread_cond_init (cond, NULL);
+   if (ret) {
+      abort ();
+   }
+}
+
+void
+_mongocrypt_cond_cleanup (mongocrypt_cond_t *cond)
+{
+   int ret = pthread_cond_destroy (cond);
+   if (ret) {
+      abort ();
+   }
+}
+
+void
+_mongocrypt_cond_timedwait (mongocrypt_cond_t *cond,
+                            mongocrypt_mutex_t *mutex,
+                            int64_t timeout_ms)
+{
+   struct timeval now;
+   struct timespec deadline;
+   int64_t nsec;
+   int ret;
+
+   if (timeout_ms < 0) {
+      timeout_ms = 0;
+   }
+   /* pthread_cond_timedwait takes an absolute CLOCK_REALTIME deadline. */
+   gettimeofday (&now, NULL);
+   nsec = (int64_t) now.tv_usec * 1000 + (timeout_ms % 1000) * 1000000;
+   deadline.tv_sec = now.tv_sec + (time_t) (timeout_ms / 1000) +
+                     (time_t) (nsec / 1000000000);
+   deadline.tv_nsec = (long) (nsec % 1000000000);
+   ret = pthread_cond_timedwait (cond, mutex, &deadline);
+   if (ret && ret != ETIMEDOUT) {
+      abort ();
+   }
+}
+
+void
+_mongocrypt_cond_broadcast (mongocrypt_cond_t *cond)
+{
+   int ret = pthread_cond_broadcast (cond);
+   if (ret) {
+      abort ();
+   }
+}
+
+int64_t
+_mongocrypt_atomic_load_int64 (int64_t *ptr)
+{
+   return __atomic_load_n (ptr, __ATOMIC_RELAXED);
+}
+
+void
+_mongocrypt_atomic_store_int64 (int64_t *ptr, int64_t value)
+{
+   __atomic_store_n (ptr, value, __ATOMIC_RELAXED);
+}
+
+int64_t
+_mongocrypt_atomic_add_int64 (int64_t *ptr, int64_t value)
+{
+   return __atomic_add_fetch (ptr, value, __ATOMIC_RELAXED);
+}
+
+int64_t
+_mongocrypt_atomic_release_int64 (int64_t *ptr)
+{
+   return __atomic_sub_fetch (ptr, 1, __ATOMIC_ACQ_REL);
+}
+
+int64_t
+_mongocrypt_atomic_load_acquire_int64 (int64_t *ptr)
+{
+   return __atomic_load_n (ptr, __ATOMIC_ACQUIRE);
+}
+
+void
+_mongocrypt_atomic_store_release_int64 (int64_t *ptr, int64_t value)
+{
+   __atomic_store_n (ptr, value, __ATOMIC_RELEASE);
+}
+
+bool
+_mongocrypt_atomic_cas_int64 (int64_t *ptr, int64_t expected, int64_t desired)
+{
+   return __atomic_compare_exchange_n (
+      ptr, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+void *
+_mongocrypt_atomic_load_acquire_ptr (void **ptr)
+{
+   return __atomic_load_n (ptr, __ATOMIC_ACQUIRE);
+}
+
+void
+_mongocrypt_atomic_store_release_ptr (void **ptr, void *value)
+{
+   __atomic_store_n (ptr, value, __ATOMIC_RELEASE);
+}
+
+void *
+_mongocrypt_atomic_exchange_ptr (void **ptr, void *value)
+{
+   return __atomic_exchange_n (ptr, value, __ATOMIC_ACQ_REL);
+}
+
+bool
+_mongocrypt_atomic_cas_ptr (void **ptr, void *expected, void *desired)
+{
+   return __atomic_compare_exchange_n (
+      ptr, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+void
+_mongocrypt_seqlock_init (_mongocrypt_seqlock_t *seqlock)
+{
+   __atomic_store_n (&seqlock->seq, 0, __ATOMIC_RELAXED);
+}
+
+void
+_mongocrypt_seqlock_write_begin (_mongocrypt_seqlock_t *seqlock)
+{
+   /* An odd sequence marks a write in progress. The fence keeps the writes
+    * to the data after the increment. */
+   __atomic_add_fetch (&seqlock->seq, 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+void
+_mongocrypt_seqlock_write_end (_mongocrypt_seqlock_t *seqlock)
+{
+   __atomic_add_fetch (&seqlock->seq, 1, __ATOMIC_RELEASE);
+}
+
+int64_t
+_mongocrypt_seqlock_read_begin (_mongocrypt_seqlock_t *seqlock)
+{
+   int64_t seq;
+
+   while ((seq = __atomic_load_n (&seqlock->seq, __ATOMIC_ACQUIRE)) & 1) {
+      sched_yield ();
+   }
+   return seq;
+}
+
+bool
+_mongocrypt_seqlock_read_retry (_mongocrypt_seqlock_t *seqlock, int64_t seq)
+{
+   /* Keep the reads of the data before the second read of the sequence. */
+   __atomic_thread_fence (__ATOMIC_ACQUIRE);
+   return __atomic_load_n (&seqlock->seq, __ATOMIC_RELAXED) != seq;
+}
+
+int64_t
+_mongocrypt_getpid (void)
+{
+   return (int64_t) getpid ();
+}
+
 #endif /* _WIN32 */
\ No newline at end of file
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../mongocrypt-mutex-private.h"
+#include "../mongocrypt-os-private.h"
+
+#ifndef _WIN32
+
+#include <pthread.h>
+
+static pthread_once_t thread_index_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_index_key;
+static int64_t thread_index_counter;
+
+static void
+_thread_index_init (void)
+{
+   BSON_ASSERT (0 == pthread_key_create (&thread_index_key, NULL));
+}
+
+uint32_t
+_mongocrypt_thread_index (void)
+{
+   uintptr_t stored;
+   uint32_t index;
+
+   BSON_ASSERT (0 == pthread_once (&thread_index_once, _thread_index_init));
+   /* Stored plus one, since an unset value reads as NULL. */
+   stored = (uintptr_t) pthread_getspecific (thread_index_key);
+   if (stored) {
+      return (uint32_t) (stored - 1);
+   }
+   index = (uint32_t) (
+      _mongocrypt_atomic_add_int64 (&thread_index_counter, 1) - 1);
+   BSON_ASSERT (0 == pthread_setspecific (thread_index_key,
+                                          (void *) ((uintptr_t) index + 1)));
+   return index;
+}
+
+#endif /* _WIN32 */
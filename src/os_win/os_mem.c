@@ -0,0 +1,53 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <bson/bson.h>
+
+#include "../mongocrypt-os-private.h"
+
+#ifdef _WIN32
+
+void *
+_mongocrypt_os_map_locked (size_t len, bool *locked)
+{
+   void *ptr;
+
+   ptr = VirtualAlloc (NULL, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+   if (!ptr) {
+      *locked = false;
+      return NULL;
+   }
+   *locked = VirtualLock (ptr, len) != 0;
+   return ptr;
+}
+
+void
+_mongocrypt_os_unmap_locked (void *ptr, size_t len, bool locked)
+{
+   if (locked) {
+      (void) VirtualUnlock (ptr, len);
+   }
+   (void) VirtualFree (ptr, 0, MEM_RELEASE);
+}
+
+bool
+_mongocrypt_os_relock (void *ptr, size_t len)
+{
+   return VirtualLock (ptr, len) != 0;
+}
+
+#endif /* _WIN32 */
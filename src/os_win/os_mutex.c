@@ -42,4 +42,184 @@ _mongocrypt_mutex_unlock (mongocrypt_mutex_t *mutex)
    LeaveCriticalSection (mutex);
 }
 
+void
+_mongocrypt_rwlock_init (mongocrypt_rwlock_t *rwlock)
+{
+   InitializeSRWLock (rwlock);
+}
+
+void
+_mongocrypt_rwlock_cleanup (mongocrypt_rwlock_t *rwlock)
+{
+   /* SRW locks do not need to be destroyed. */
+   (void) rwlock;
+}
+
+void
+_mongocrypt_rwlock_rdlock (mongocrypt_rwlock_t *rwlock)
+{
+   AcquireSRWLockShared (rwlock);
+}
+
+void
+_mongocrypt_rwlock_rdunlock (mongocrypt_rwlock_t *rwlock)
+{
+   ReleaseSRWLockShared (rwlock);
+}
+
+void
+_mongocrypt_rwlock_wrlock (mongocrypt_rwlock_t *rwlock)
+{
+   AcquireSRWLockExclusive (rwlock);
+}
+
+void
+_mongocrypt_rwlock_wrunlock (mongocrypt_rwlock_t *rwlock)
+{
+   ReleaseSRWLockExclusive (rwlock);
+}
+
+void
+_mongocrypt_cond_init (mongocrypt_cond_t *cond)
+{
+   InitializeConditionVariable (cond);
+}
+
+void
+_mongocrypt_cond_cleanup (mongocrypt_cond_t *cond)
+{
+   /* Condition variables do not need to be destroyed. */
+   (void) cond;
+}
+
+void
+_mongocrypt_cond_timedwait (mongocrypt_cond_t *cond,
+                            mongocrypt_mutex_t *mutex,
+                            int64_t timeout_ms)
+{
+   if (timeout_ms < 0) {
+      timeout_ms = 0;
+   }
+   /* A timeout is reported as failure, which callers handle by checking
+    * their condition. */
+   (void) SleepConditionVariableCS (cond, mutex, (DWORD) timeout_ms);
+}
+
+void
+_mongocrypt_cond_broadcast (mongocrypt_cond_t *cond)
+{
+   WakeAllConditionVariable (cond);
+}
+
+int64_t
+_mongocrypt_atomic_load_int64 (int64_t *ptr)
+{
+   return InterlockedCompareExchange64 (ptr, 0, 0);
+}
+
+void
+_mongocrypt_atomic_store_int64 (int64_t *ptr, int64_t value)
+{
+   InterlockedExchange64 (ptr, value);
+}
+
+int64_t
+_mongocrypt_atomic_add_int64 (int64_t *ptr, int64_t value)
+{
+   return InterlockedExchangeAdd64 (ptr, value) + value;
+}
+
+int64_t
+_mongocrypt_atomic_release_int64 (int64_t *ptr)
+{
+   return InterlockedDecrement64 (ptr);
+}
+
+int64_t
+_mongocrypt_atomic_load_acquire_int64 (int64_t *ptr)
+{
+   return InterlockedCompareExchange64 (ptr, 0, 0);
+}
+
+void
+_mongocrypt_atomic_store_release_int64 (int64_t *ptr, int64_t value)
+{
+   InterlockedExchange64 (ptr, value);
+}
+
+bool
+_mongocrypt_atomic_cas_int64 (int64_t *ptr, int64_t expected, int64_t desired)
+{
+   return InterlockedCompareExchange64 (ptr, desired, expected) == expected;
+}
+
+void *
+_mongocrypt_atomic_load_acquire_ptr (void **ptr)
+{
+   return InterlockedCompareExchangePointer (ptr, NULL, NULL);
+}
+
+void
+_mongocrypt_atomic_store_release_ptr (void **ptr, void *value)
+{
+   InterlockedExchangePointer (ptr, value);
+}
+
+void *
+_mongocrypt_atomic_exchange_ptr (void **ptr, void *value)
+{
+   return InterlockedExchangePointer (ptr, value);
+}
+
+bool
+_mongocrypt_atomic_cas_ptr (void **ptr, void *expected, void *desired)
+{
+   return InterlockedCompareExchangePointer (ptr, desired, expected) ==
+          expected;
+}
+
+/* Interlocked functions are full barriers, so no fences are needed beyond
+ * the one before the second read of the sequence. */
+void
+_mongocrypt_seqlock_init (_mongocrypt_seqlock_t *seqlock)
+{
+   InterlockedExchange64 (&seqlock->seq, 0);
+}
+
+void
+_mongocrypt_seqlock_write_begin (_mongocrypt_seqlock_t *seqlock)
+{
+   InterlockedIncrement64 (&seqlock->seq);
+}
+
+void
+_mongocrypt_seqlock_write_end (_mongocrypt_seqlock_t *seqlock)
+{
+   InterlockedIncrement64 (&seqlock->seq);
+}
+
+int64_t
+_mongocrypt_seqlock_read_begin (_mongocrypt_seqlock_t *seqlock)
+{
+   int64_t seq;
+
+   while ((seq = InterlockedCompareExchange64 (&seqlock->seq, 0, 0)) & 1) {
+      SwitchToThread ();
+   }
+   return seq;
+}
+
+bool
+_mongocrypt_seqlock_read_retry (_mongocrypt_seqlock_t *seqlock, int64_t seq)
+{
+   MemoryBarrier ();
+   return InterlockedCompareExchange64 (&seqlock->seq, 0, 0) != seq;
+}
+
+int64_t
+_mongocrypt_getpid (void)
+{
+   return (int64_t) GetCurrentProcessId ();
+}
+
 #endif /* _WIN32 */
\ No newline at end of file
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <bson/bson.h>
+
+#include "../mongocrypt-mutex-private.h"
+#include "../mongocrypt-os-private.h"
+
+#ifdef _WIN32
+
+static INIT_ONCE thread_index_once = INIT_ONCE_STATIC_INIT;
+static DWORD thread_index_key;
+static int64_t thread_index_counter;
+
+static BOOL WINAPI
+_thread_index_init (_Inout_ PINIT_ONCE InitOnce,
+                    _Inout_opt_ PVOID Parameter,
+                    _Out_opt_ PVOID *Context)
+{
+   thread_index_key = TlsAlloc ();
+   BSON_ASSERT (thread_index_key != TLS_OUT_OF_INDEXES);
+   return (TRUE);
+}
+
+uint32_t
+_mongocrypt_thread_index (void)
+{
+   uintptr_t stored;
+   uint32_t index;
+
+   BSON_ASSERT (InitOnceExecuteOnce (
+      &thread_index_once, &_thread_index_init, NULL, NULL));
+   /* Stored plus one, since an unset value reads as NULL. */
+   stored = (uintptr_t) TlsGetValue (thread_index_key);
+   if (stored) {
+      return (uint32_t) (stored - 1);
+   }
+   index = (uint32_t) (
+      _mongocrypt_atomic_add_int64 (&thread_index_counter, 1) - 1);
+   BSON_ASSERT (
+      TlsSetValue (thread_index_key, (LPVOID) ((uintptr_t) index + 1)));
+   return index;
+}
+
+#endif /* _WIN32 */
@@ -0,0 +1,1403 @@
+/*
+ * Copyright 2020-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Micro-benchmarks of libmongocrypt hot paths.
+ *
+ * Usage: benchmark-mongocrypt [name-filter]
+ *
+ * Prints a JSON document to stdout:
+ * { "version": <libmongocrypt version>, "results": [
+ *    { "name", "param", "value", "iterations", "nsPerOp", "opsPerSec" }, ...
+ * ] }
+ *
+ * Each benchmark doubles its iteration count until a run takes at least
+ * BENCH_MIN_US, so results are comparable across machines and versions.
+ *
+ * The KMS benchmarks decrypt values whose keys are not cached, so each
+ * operation sends KMS requests to an in-process mock of AWS, Azure, and GCP
+ * (see mock-kms.h) with simulated latency, a latency tail, and throttling.
+ * Their results also have KMS requests, throttled responses, retries, and
+ * hedges per operation.
+ *
+ * The threaded benchmarks share one mongocrypt_t between a growing number of
+ * threads. Their results also have "p50Us" and "p99Us" latencies of single
+ * operations, and "lockWaitUs" and "lockHoldUs" if libmongocrypt was built
+ * with ENABLE_LOCK_STATS. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <kms_message/kms_message.h>
+
+#ifdef BSON_OS_UNIX
+#include <pthread.h>
+#endif
+
+#include "mock-kms.h"
+#include "mongocrypt-cache-key-private.h"
+#include "mongocrypt-crypto-private.h"
+#include "mongocrypt-key-private.h"
+#include "mongocrypt-private.h"
+#include "mongocrypt-traverse-util-private.h"
+
+#define BENCH_MIN_US (200 * 1000)
+
+#define BENCH_ASSERT(_stmt)                                                  \
+   do {                                                                      \
+      if (!(_stmt)) {                                                        \
+         fprintf (stderr, "%s:%d failed: %s\n", __FILE__, __LINE__, #_stmt); \
+         abort ();                                                           \
+      }                                                                      \
+   } while (0)
+
+typedef void (*_bench_op_t) (void *ctx);
+
+static const char *_filter;
+static bool _printed_result;
+
+
+/* @extra, if set, is appended to the fields of the result. */
+static void
+_print_result (const char *name,
+               const char *param,
+               int64_t value,
+               int64_t iterations,
+               int64_t elapsed_us,
+               const char *extra)
+{
+   double ns_per_op = (double) elapsed_us * 1000.0 / (double) iterations;
+
+   printf ("%s\n    { \"name\": \"%s\", \"param\": \"%s\", "
+           "\"value\": %" PRId64 ", \"iterations\": %" PRId64 ", "
+           "\"nsPerOp\": %.1f, \"opsPerSec\": %.1f%s }",
+           _printed_result ? "," : "",
+           name,
+           param,
+           value,
+           iterations,
+           ns_per_op,
+           ns_per_op > 0 ? 1e9 / ns_per_op : 0.0,
+           extra ? extra : "");
+   fflush (stdout);
+   _printed_result = true;
+}
+
+
+static bool
+_selected (const char *name)
+{
+   return !_filter || strstr (name, _filter);
+}
+
+
+/* Run @op until a run of doubling iterations takes BENCH_MIN_US. Sets the
+ * iterations and duration of that run. */
+static void
+_bench_run (_bench_op_t op,
+            void *ctx,
+            int64_t *iterations_out,
+            int64_t *elapsed_us_out)
+{
+   int64_t iterations = 1;
+   int64_t elapsed_us;
+   int64_t i;
+
+   for (;;) {
+      int64_t start_us = bson_get_monotonic_time ();
+
+      for (i = 0; i < iterations; i++) {
+         op (ctx);
+      }
+      elapsed_us = bson_get_monotonic_time () - start_us;
+      if (elapsed_us >= BENCH_MIN_US) {
+         break;
+      }
+      iterations *= 2;
+   }
+   *iterations_out = iterations;
+   *elapsed_us_out = elapsed_us;
+}
+
+
+static void
+_bench (const char *name,
+        const char *param,
+        int64_t value,
+        _bench_op_t op,
+        void *ctx)
+{
+   int64_t iterations;
+   int64_t elapsed_us;
+
+   _bench_run (op, ctx, &iterations, &elapsed_us);
+   _print_result (name, param, value, iterations, elapsed_us, NULL);
+}
+
+
+static void
+_fill_buffer (_mongocrypt_buffer_t *buf, uint32_t len, uint8_t seed)
+{
+   uint32_t i;
+
+   _mongocrypt_buffer_init (buf);
+   _mongocrypt_buffer_resize (buf, len);
+   for (i = 0; i < len; i++) {
+      buf->data[i] = (uint8_t) (seed + i);
+   }
+}
+
+
+typedef struct {
+   _mongocrypt_crypto_t *crypto;
+   _native_crypto_key_t *native_key;
+   _mongocrypt_buffer_t key;
+   _mongocrypt_buffer_t iv;
+   _mongocrypt_buffer_t associated_data;
+   _mongocrypt_buffer_t plaintext;
+   _mongocrypt_buffer_t ciphertext;
+   _mongocrypt_buffer_t decrypted;
+   mongocrypt_status_t *status;
+} _crypto_bench_t;
+
+
+static void
+_op_encrypt (void *ctx)
+{
+   _crypto_bench_t *b = (_crypto_bench_t *) ctx;
+   uint32_t written;
+
+   BENCH_ASSERT (_mongocrypt_do_encryption (b->crypto,
+                                            &b->iv,
+                                            &b->associated_data,
+                                            &b->key,
+                                            b->native_key,
+                                            &b->plaintext,
+                                            &b->ciphertext,
+                                            &written,
+                                            b->status));
+}
+
+
+static void
+_op_decrypt (void *ctx)
+{
+   _crypto_bench_t *b = (_crypto_bench_t *) ctx;
+   uint32_t written;
+
+   BENCH_ASSERT (_mongocrypt_do_decryption (b->crypto,
+                                            &b->associated_data,
+                                            &b->key,
+                                            b->native_key,
+                                            &b->ciphertext,
+                                            &b->decrypted,
+                                            &written,
+                                            b->status));
+}
+
+
+static void
+_op_deterministic_iv (void *ctx)
+{
+   _crypto_bench_t *b = (_crypto_bench_t *) ctx;
+
+   BENCH_ASSERT (_mongocrypt_calculate_deterministic_iv (b->crypto,
+                                                         &b->key,
+                                                         b->native_key,
+                                                         &b->plaintext,
+                                                         &b->associated_data,
+                                                         &b->iv,
+                                                         b->status));
+}
+
+
+static void
+_bench_crypto (mongocrypt_t *crypt)
+{
+   static const uint32_t sizes[] = {16, 256, 4096, 65536};
+   _crypto_bench_t b;
+   size_t i;
+
+   memset (&b, 0, sizeof (b));
+   b.crypto = crypt->crypto;
+   b.status = mongocrypt_status_new ();
+   _fill_buffer (&b.key, MONGOCRYPT_KEY_LEN, 'k');
+   _fill_buffer (&b.iv, MONGOCRYPT_IV_LEN, 'i');
+   _fill_buffer (&b.associated_data, 18, 'a');
+   if (_mongocrypt_crypto_is_native (
+          crypt->crypto,
+          MONGOCRYPT_CRYPTO_PRIMITIVE_AES_256_CBC |
+             MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512)) {
+      /* Use a prepared key, as the key broker does. */
+      b.native_key = _native_crypto_key_new (&b.key);
+   }
+
+   for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++) {
+      _fill_buffer (&b.plaintext, sizes[i], 'p');
+      _fill_buffer (
+         &b.ciphertext, _mongocrypt_calculate_ciphertext_len (sizes[i]), 0);
+      _fill_buffer (&b.decrypted,
+                    _mongocrypt_calculate_plaintext_len (b.ciphertext.len),
+                    0);
+
+      if (_selected ("encrypt")) {
+         _bench ("encrypt", "bytes", sizes[i], _op_encrypt, &b);
+      }
+      if (_selected ("decrypt")) {
+         /* Decrypt what was encrypted. */
+         _op_encrypt (&b);
+         _bench ("decrypt", "bytes", sizes[i], _op_decrypt, &b);
+      }
+      if (_selected ("deterministicIV")) {
+         _bench (
+            "deterministicIV", "bytes", sizes[i], _op_deterministic_iv, &b);
+      }
+
+      _mongocrypt_buffer_cleanup (&b.plaintext);
+      _mongocrypt_buffer_cleanup (&b.ciphertext);
+      _mongocrypt_buffer_cleanup (&b.decrypted);
+   }
+
+   if (b.native_key) {
+      _native_crypto_key_destroy (b.native_key);
+   }
+   _mongocrypt_buffer_cleanup (&b.key);
+   _mongocrypt_buffer_cleanup (&b.iv);
+   _mongocrypt_buffer_cleanup (&b.associated_data);
+   mongocrypt_status_destroy (b.status);
+}
+
+
+typedef struct {
+   bson_t doc;
+   mongocrypt_status_t *status;
+} _transform_bench_t;
+
+
+static bool
+_replace_with_int (void *ctx,
+                   _mongocrypt_buffer_t *in,
+                   bson_value_t *out,
+                   mongocrypt_status_t *status)
+{
+   out->value_type = BSON_TYPE_INT32;
+   out->value.v_int32 = (int32_t) in->len;
+   return true;
+}
+
+
+static void
+_op_transform (void *ctx)
+{
+   _transform_bench_t *b = (_transform_bench_t *) ctx;
+   bson_iter_t iter;
+   bson_t out;
+
+   BENCH_ASSERT (bson_iter_init (&iter, &b->doc));
+   bson_init (&out);
+   BENCH_ASSERT (_mongocrypt_transform_binary_in_bson (
+      _replace_with_int, NULL, TRAVERSE_MATCH_CIPHERTEXT, &iter, &out, b->status));
+   bson_destroy (&out);
+}
+
+
+static void
+_bench_transform (void)
+{
+   static const uint32_t counts[] = {1, 16, 256};
+   _transform_bench_t b;
+   uint8_t ciphertext[64];
+   size_t i;
+   uint32_t j;
+
+   if (!_selected ("transform")) {
+      return;
+   }
+
+   b.status = mongocrypt_status_new ();
+   memset (ciphertext, 0, sizeof (ciphertext));
+   /* The first byte marks a deterministic ciphertext. */
+   ciphertext[0] = 1;
+
+   for (i = 0; i < sizeof (counts) / sizeof (counts[0]); i++) {
+      bson_init (&b.doc);
+      for (j = 0; j < counts[i]; j++) {
+         char key[16];
+
+         bson_snprintf (key, sizeof (key), "f%u", j);
+         /* Interleave unencrypted fields, as a real document would. */
+         BENCH_ASSERT (bson_append_utf8 (&b.doc, "plain", -1, "value", -1));
+         BENCH_ASSERT (bson_append_binary (&b.doc,
+                                           key,
+                                           -1,
+                                           BSON_SUBTYPE_ENCRYPTED,
+                                           ciphertext,
+                                           sizeof (ciphertext)));
+      }
+      _bench ("transform", "fields", counts[i], _op_transform, &b);
+      bson_destroy (&b.doc);
+   }
+   mongocrypt_status_destroy (b.status);
+}
+
+
+typedef struct {
+   _mongocrypt_cache_t cache;
+   _mongocrypt_cache_key_value_t *value;
+   _mongocrypt_buffer_t id;
+   uint32_t count;
+   uint32_t next;
+   mongocrypt_status_t *status;
+} _cache_bench_t;
+
+
+static void
+_set_id (_cache_bench_t *b, uint32_t n)
+{
+   memset (b->id.data, 0, b->id.len);
+   memcpy (b->id.data, &n, sizeof (n));
+}
+
+
+static void
+_fill_cache (_cache_bench_t *b)
+{
+   _mongocrypt_cache_key_attr_t *attr;
+   uint32_t n;
+
+   for (n = 0; n < b->count; n++) {
+      _set_id (b, n);
+      attr = _mongocrypt_cache_key_attr_new (&b->id, NULL);
+      BENCH_ASSERT (
+         _mongocrypt_cache_add_copy (&b->cache, attr, b->value, b->status));
+      _mongocrypt_cache_key_attr_destroy (attr);
+   }
+}
+
+
+static void
+_op_cache_get (void *ctx)
+{
+   _cache_bench_t *b = (_cache_bench_t *) ctx;
+   _mongocrypt_cache_key_attr_t *attr;
+   void *value;
+
+   _set_id (b, b->next++ % b->count);
+   attr = _mongocrypt_cache_key_attr_new (&b->id, NULL);
+   BENCH_ASSERT (_mongocrypt_cache_get (&b->cache, attr, &value));
+   BENCH_ASSERT (value);
+   _mongocrypt_cache_key_value_destroy (value);
+   _mongocrypt_cache_key_attr_destroy (attr);
+}
+
+
+static _mongocrypt_key_doc_t *
+_new_key_doc (void)
+{
+   _mongocrypt_key_doc_t *key_doc;
+   mongocrypt_status_t *status;
+   uint8_t bytes[MONGOCRYPT_KEY_LEN] = {0};
+   bson_t doc, master_key;
+
+   bson_init (&doc);
+   bson_append_binary (&doc, "_id", -1, BSON_SUBTYPE_UUID, bytes, 16);
+   bson_append_binary (
+      &doc, "keyMaterial", -1, BSON_SUBTYPE_BINARY, bytes, sizeof (bytes));
+   bson_append_date_time (&doc, "creationDate", -1, 0);
+   bson_append_date_time (&doc, "updateDate", -1, 0);
+   bson_append_int32 (&doc, "status", -1, 0);
+   bson_append_document_begin (&doc, "masterKey", -1, &master_key);
+   bson_append_utf8 (&master_key, "provider", -1, "local", -1);
+   bson_append_document_end (&doc, &master_key);
+
+   key_doc = _mongocrypt_key_new ();
+   status = mongocrypt_status_new ();
+   BENCH_ASSERT (_mongocrypt_key_parse_owned (&doc, key_doc, status));
+   mongocrypt_status_destroy (status);
+   bson_destroy (&doc);
+   return key_doc;
+}
+
+
+static void
+_bench_key_cache (void)
+{
+   static const uint32_t counts[] = {16, 256, 4096};
+   _cache_bench_t b;
+   _mongocrypt_key_doc_t *key_doc;
+   _mongocrypt_buffer_t material;
+   size_t i;
+
+   if (!_selected ("keyCacheAdd") && !_selected ("keyCacheGet")) {
+      return;
+   }
+
+   memset (&b, 0, sizeof (b));
+   b.status = mongocrypt_status_new ();
+   _fill_buffer (&b.id, 16, 0);
+   key_doc = _new_key_doc ();
+   _fill_buffer (&material, MONGOCRYPT_KEY_LEN, 'm');
+   b.value = _mongocrypt_cache_key_value_new (key_doc, &material);
+
+   for (i = 0; i < sizeof (counts) / sizeof (counts[0]); i++) {
+      int64_t iterations = 0;
+      int64_t elapsed_us = 0;
+
+      b.count = counts[i];
+
+      /* Adds are timed by filling an empty cache until enough time passes,
+       * since every add needs a new attribute. */
+      if (_selected ("keyCacheAdd")) {
+         while (elapsed_us < BENCH_MIN_US) {
+            int64_t start_us;
+
+            _mongocrypt_cache_key_init (&b.cache);
+            start_us = bson_get_monotonic_time ();
+            _fill_cache (&b);
+            elapsed_us += bson_get_monotonic_time () - start_us;
+            iterations += b.count;
+            _mongocrypt_cache_cleanup (&b.cache);
+         }
+         _print_result (
+            "keyCacheAdd", "entries", b.count, iterations, elapsed_us, NULL);
+      }
+
+      if (_selected ("keyCacheGet")) {
+         _mongocrypt_cache_key_init (&b.cache);
+         _fill_cache (&b);
+         b.next = 0;
+         _bench ("keyCacheGet", "entries", b.count, _op_cache_get, &b);
+         _mongocrypt_cache_cleanup (&b.cache);
+      }
+   }
+
+   _mongocrypt_cache_key_value_destroy (b.value);
+   _mongocrypt_buffer_cleanup (&material);
+   _mongocrypt_key_destroy (key_doc);
+   _mongocrypt_buffer_cleanup (&b.id);
+   mongocrypt_status_destroy (b.status);
+}
+
+
+static const char _kms_reply[] =
+   "HTTP/1.1 200 OK\r\n"
+   "x-amzn-RequestId: deeb35e5-4ecb-4bf1-9af5-84a54ff0af0e\r\n"
+   "Content-Type: application/x-amz-json-1.1\r\n"
+   "Content-Length: 233\r\n"
+   "\r\n"
+   "{\"KeyId\": \"arn:aws:kms:us-east-1:579766882180:key/"
+   "89fcc2c4-08b0-4bd9-9f25-e30687b580d0\", \"Plaintext\": "
+   "\"TqhXy3tKckECjy4/ZNykMWG8amBF46isVPzeOgeusKrwheBmYaU8TMG5AHR/"
+   "NeUDKukqo8hBGgogiQOVpLPkqBQHD8YkLsNbDmHoGOill5QAHnniF/"
+   "Lz405bGucB5TfR\"}";
+
+
+static void
+_op_kms_parse (void *ctx)
+{
+   kms_response_parser_t *parser;
+   kms_response_t *response;
+
+   parser = kms_response_parser_new ();
+   BENCH_ASSERT (kms_response_parser_feed (
+      parser, (uint8_t *) _kms_reply, (uint32_t) strlen (_kms_reply)));
+   BENCH_ASSERT (0 == kms_response_parser_wants_bytes (parser, 1024));
+   response = kms_response_parser_get_response (parser);
+   BENCH_ASSERT (response);
+   kms_response_destroy (response);
+   kms_response_parser_destroy (parser);
+}
+
+
+static void
+_bench_kms_parser (void)
+{
+   if (!_selected ("kmsResponseParse")) {
+      return;
+   }
+
+   _bench ("kmsResponseParse",
+           "bytes",
+           (int64_t) strlen (_kms_reply),
+           _op_kms_parse,
+           NULL);
+}
+
+
+/* A mongocrypt_t using the local KMS provider, so no network is needed. */
+static mongocrypt_t *
+_new_crypt (void)
+{
+   mongocrypt_t *crypt;
+   char localkey_data[MONGOCRYPT_KEY_LEN] = {0};
+   mongocrypt_binary_t *localkey;
+
+   crypt = mongocrypt_new ();
+   localkey = mongocrypt_binary_new_from_data ((uint8_t *) localkey_data,
+                                               sizeof localkey_data);
+   BENCH_ASSERT (mongocrypt_setopt_kms_provider_local (crypt, localkey));
+   mongocrypt_binary_destroy (localkey);
+   BENCH_ASSERT (mongocrypt_init (crypt));
+   return crypt;
+}
+
+
+#define DETERMINISTIC "AEAD_AES_256_CBC_HMAC_SHA_512-Deterministic"
+
+/* Canned driver replies for the end-to-end benchmarks. */
+typedef struct {
+   uint32_t fields;
+   bool cold;
+   /* Reused by warm runs, so its caches stay populated. */
+   mongocrypt_t *crypt;
+   bson_t key_doc;
+   _mongocrypt_buffer_t key_id;
+   bson_t cmd;
+   bson_t collinfo;
+   bson_t markings;
+   bson_t encrypted;
+   bson_t explicit_value;
+   bson_t explicit_ciphertext;
+} _e2e_bench_t;
+
+
+static mongocrypt_binary_t *
+_bson_as_binary (const bson_t *bson)
+{
+   return mongocrypt_binary_new_from_data ((uint8_t *) bson_get_data (bson),
+                                           bson->len);
+}
+
+
+static void
+_feed (mongocrypt_ctx_t *ctx, const bson_t *reply)
+{
+   mongocrypt_binary_t *bin = _bson_as_binary (reply);
+
+   BENCH_ASSERT (mongocrypt_ctx_mongo_feed (ctx, bin));
+   mongocrypt_binary_destroy (bin);
+   BENCH_ASSERT (mongocrypt_ctx_mongo_done (ctx));
+}
+
+
+/* Answer every request of @ctx from the canned replies. If @result is set,
+ * it is initialized with a copy of the output. */
+static void
+_run_ctx (_e2e_bench_t *b, mongocrypt_ctx_t *ctx, bson_t *result)
+{
+   mongocrypt_binary_t *out;
+   mongocrypt_status_t *status;
+   bson_t out_bson;
+
+   for (;;) {
+      switch (mongocrypt_ctx_state (ctx)) {
+      case MONGOCRYPT_CTX_NEED_MONGO_COLLINFO:
+         _feed (ctx, &b->collinfo);
+         break;
+      case MONGOCRYPT_CTX_NEED_MONGO_MARKINGS:
+         _feed (ctx, &b->markings);
+         break;
+      case MONGOCRYPT_CTX_NEED_MONGO_KEYS:
+         _feed (ctx, &b->key_doc);
+         break;
+      case MONGOCRYPT_CTX_READY:
+         out = mongocrypt_binary_new ();
+         BENCH_ASSERT (mongocrypt_ctx_finalize (ctx, out));
+         if (result) {
+            BENCH_ASSERT (_mongocrypt_binary_to_bson (out, &out_bson));
+            bson_copy_to (&out_bson, result);
+         }
+         mongocrypt_binary_destroy (out);
+         break;
+      case MONGOCRYPT_CTX_DONE:
+         return;
+      case MONGOCRYPT_CTX_NEED_KMS:
+         /* Local keys are decrypted without KMS. */
+      case MONGOCRYPT_CTX_ERROR:
+      default:
+         status = mongocrypt_status_new ();
+         mongocrypt_ctx_status (ctx, status);
+         fprintf (stderr,
+                  "unexpected state %d: %s\n",
+                  (int) mongocrypt_ctx_state (ctx),
+                  mongocrypt_status_message (status, NULL));
+         abort ();
+      }
+   }
+}
+
+
+static void
+_auto_encrypt (_e2e_bench_t *b, mongocrypt_t *crypt, bson_t *result)
+{
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+
+   ctx = mongocrypt_ctx_new (crypt);
+   bin = _bson_as_binary (&b->cmd);
+   BENCH_ASSERT (mongocrypt_ctx_encrypt_init (ctx, "db", -1, bin));
+   mongocrypt_binary_destroy (bin);
+   _run_ctx (b, ctx, result);
+   mongocrypt_ctx_destroy (ctx);
+}
+
+
+static void
+_auto_decrypt (_e2e_bench_t *b, mongocrypt_t *crypt)
+{
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+
+   ctx = mongocrypt_ctx_new (crypt);
+   bin = _bson_as_binary (&b->encrypted);
+   BENCH_ASSERT (mongocrypt_ctx_decrypt_init (ctx, bin));
+   mongocrypt_binary_destroy (bin);
+   _run_ctx (b, ctx, NULL);
+   mongocrypt_ctx_destroy (ctx);
+}
+
+
+static void
+_explicit_encrypt (_e2e_bench_t *b, mongocrypt_t *crypt, bson_t *result)
+{
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+
+   ctx = mongocrypt_ctx_new (crypt);
+   bin = mongocrypt_binary_new_from_data (b->key_id.data, b->key_id.len);
+   BENCH_ASSERT (mongocrypt_ctx_setopt_key_id (ctx, bin));
+   mongocrypt_binary_destroy (bin);
+   BENCH_ASSERT (mongocrypt_ctx_setopt_algorithm (ctx, DETERMINISTIC, -1));
+   bin = _bson_as_binary (&b->explicit_value);
+   BENCH_ASSERT (mongocrypt_ctx_explicit_encrypt_init (ctx, bin));
+   mongocrypt_binary_destroy (bin);
+   _run_ctx (b, ctx, result);
+   mongocrypt_ctx_destroy (ctx);
+}
+
+
+static void
+_explicit_decrypt (_e2e_bench_t *b, mongocrypt_t *crypt)
+{
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+
+   ctx = mongocrypt_ctx_new (crypt);
+   bin = _bson_as_binary (&b->explicit_ciphertext);
+   BENCH_ASSERT (mongocrypt_ctx_explicit_decrypt_init (ctx, bin));
+   mongocrypt_binary_destroy (bin);
+   _run_ctx (b, ctx, NULL);
+   mongocrypt_ctx_destroy (ctx);
+}
+
+
+/* A cold run uses a new mongocrypt_t, so every cache starts empty. */
+#define E2E_OP(_name, _body)                                     \
+   static void _name (void *ctx)                                 \
+   {                                                             \
+      _e2e_bench_t *b = (_e2e_bench_t *) ctx;                    \
+      mongocrypt_t *crypt = b->cold ? _new_crypt () : b->crypt;  \
+      uint32_t i;                                                \
+                                                                 \
+      (void) i;                                                  \
+      _body;                                                     \
+      if (b->cold) {                                             \
+         mongocrypt_destroy (crypt);                             \
+      }                                                          \
+   }
+
+E2E_OP (_op_auto_encrypt, _auto_encrypt (b, crypt, NULL))
+E2E_OP (_op_auto_decrypt, _auto_decrypt (b, crypt))
+/* Explicit mode takes one context per value. */
+E2E_OP (_op_explicit_encrypt,
+        for (i = 0; i < b->fields; i++) _explicit_encrypt (b, crypt, NULL))
+E2E_OP (_op_explicit_decrypt,
+        for (i = 0; i < b->fields; i++) _explicit_decrypt (b, crypt))
+
+
+static void
+_e2e_init_key (_e2e_bench_t *b)
+{
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *out;
+   bson_t out_bson;
+   bson_iter_t iter;
+
+   ctx = mongocrypt_ctx_new (b->crypt);
+   BENCH_ASSERT (mongocrypt_ctx_setopt_masterkey_local (ctx));
+   BENCH_ASSERT (mongocrypt_ctx_datakey_init (ctx));
+   BENCH_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   out = mongocrypt_binary_new ();
+   BENCH_ASSERT (mongocrypt_ctx_finalize (ctx, out));
+   BENCH_ASSERT (_mongocrypt_binary_to_bson (out, &out_bson));
+   bson_copy_to (&out_bson, &b->key_doc);
+   mongocrypt_binary_destroy (out);
+   mongocrypt_ctx_destroy (ctx);
+
+   BENCH_ASSERT (bson_iter_init_find (&iter, &b->key_doc, "_id"));
+   BENCH_ASSERT (_mongocrypt_buffer_copy_from_uuid_iter (&b->key_id, &iter));
+}
+
+
+static void
+_append_marking (bson_t *doc, const char *field, _e2e_bench_t *b)
+{
+   bson_t marking;
+   _mongocrypt_buffer_t buf;
+
+   bson_init (&marking);
+   BSON_APPEND_INT32 (&marking, "a", 1);
+   BENCH_ASSERT (_mongocrypt_buffer_append (&b->key_id, &marking, "ki", 2));
+   BSON_APPEND_UTF8 (&marking, "v", "benchmark value");
+
+   /* A marking is a 0 byte followed by the BSON document. */
+   _mongocrypt_buffer_init (&buf);
+   _mongocrypt_buffer_resize (&buf, marking.len + 1);
+   buf.data[0] = 0;
+   memcpy (buf.data + 1, bson_get_data (&marking), marking.len);
+   BENCH_ASSERT (bson_append_binary (
+      doc, field, -1, BSON_SUBTYPE_ENCRYPTED, buf.data, buf.len));
+   _mongocrypt_buffer_cleanup (&buf);
+   bson_destroy (&marking);
+}
+
+
+/* Build the command, the collinfo with its schema, and the mongocryptd
+ * reply for a document with b->fields encrypted fields. */
+static void
+_e2e_init_replies (_e2e_bench_t *b)
+{
+   bson_t docs, doc, marked_docs, marked_doc, schema, props, prop, encrypt;
+   bson_t key_ids, options, validator, result;
+   uint32_t i;
+
+   bson_init (&b->cmd);
+   BSON_APPEND_UTF8 (&b->cmd, "insert", "coll");
+   BSON_APPEND_ARRAY_BEGIN (&b->cmd, "documents", &docs);
+   BSON_APPEND_DOCUMENT_BEGIN (&docs, "0", &doc);
+
+   bson_init (&b->markings);
+   BSON_APPEND_BOOL (&b->markings, "schemaRequiresEncryption", true);
+   BSON_APPEND_BOOL (&b->markings, "hasEncryptedPlaceholders", true);
+   BSON_APPEND_INT32 (&b->markings, "ok", 1);
+   BSON_APPEND_DOCUMENT_BEGIN (&b->markings, "result", &result);
+   BSON_APPEND_UTF8 (&result, "insert", "coll");
+   BSON_APPEND_ARRAY_BEGIN (&result, "documents", &marked_docs);
+   BSON_APPEND_DOCUMENT_BEGIN (&marked_docs, "0", &marked_doc);
+
+   bson_init (&schema);
+   BSON_APPEND_UTF8 (&schema, "bsonType", "object");
+   BSON_APPEND_DOCUMENT_BEGIN (&schema, "properties", &props);
+
+   for (i = 0; i < b->fields; i++) {
+      char field[16];
+
+      bson_snprintf (field, sizeof (field), "f%u", i);
+      BSON_APPEND_UTF8 (&doc, field, "benchmark value");
+      _append_marking (&marked_doc, field, b);
+
+      BSON_APPEND_DOCUMENT_BEGIN (&props, field, &prop);
+      BSON_APPEND_DOCUMENT_BEGIN (&prop, "encrypt", &encrypt);
+      BSON_APPEND_ARRAY_BEGIN (&encrypt, "keyId", &key_ids);
+      BENCH_ASSERT (
+         _mongocrypt_buffer_append (&b->key_id, &key_ids, "0", 1));
+      bson_append_array_end (&encrypt, &key_ids);
+      BSON_APPEND_UTF8 (&encrypt, "bsonType", "string");
+      BSON_APPEND_UTF8 (&encrypt, "algorithm", DETERMINISTIC);
+      bson_append_document_end (&prop, &encrypt);
+      bson_append_document_end (&props, &prop);
+   }
+
+   bson_append_document_end (&docs, &doc);
+   bson_append_array_end (&b->cmd, &docs);
+   bson_append_document_end (&marked_docs, &marked_doc);
+   bson_append_array_end (&result, &marked_docs);
+   bson_append_document_end (&b->markings, &result);
+   bson_append_document_end (&schema, &props);
+
+   bson_init (&b->collinfo);
+   BSON_APPEND_UTF8 (&b->collinfo, "name", "coll");
+   BSON_APPEND_UTF8 (&b->collinfo, "type", "collection");
+   BSON_APPEND_DOCUMENT_BEGIN (&b->collinfo, "options", &options);
+   BSON_APPEND_DOCUMENT_BEGIN (&options, "validator", &validator);
+   BSON_APPEND_DOCUMENT (&validator, "$jsonSchema", &schema);
+   bson_append_document_end (&options, &validator);
+   bson_append_document_end (&b->collinfo, &options);
+   bson_destroy (&schema);
+
+   bson_init (&b->explicit_value);
+   BSON_APPEND_UTF8 (&b->explicit_value, "v", "benchmark value");
+}
+
+
+static void
+_e2e_setup (_e2e_bench_t *b, uint32_t fields)
+{
+   memset (b, 0, sizeof (*b));
+   b->fields = fields;
+   b->crypt = _new_crypt ();
+   _e2e_init_key (b);
+   _e2e_init_replies (b);
+   /* Produce the inputs for decryption. This also warms the caches. */
+   _auto_encrypt (b, b->crypt, &b->encrypted);
+   _explicit_encrypt (b, b->crypt, &b->explicit_ciphertext);
+}
+
+
+static void
+_e2e_cleanup (_e2e_bench_t *b)
+{
+   bson_destroy (&b->key_doc);
+   _mongocrypt_buffer_cleanup (&b->key_id);
+   bson_destroy (&b->cmd);
+   bson_destroy (&b->collinfo);
+   bson_destroy (&b->markings);
+   bson_destroy (&b->encrypted);
+   bson_destroy (&b->explicit_value);
+   bson_destroy (&b->explicit_ciphertext);
+   mongocrypt_destroy (b->crypt);
+}
+
+
+static void
+_bench_e2e (void)
+{
+   static const uint32_t counts[] = {1, 10, 100, 1000};
+   static const struct {
+      const char *name;
+      _bench_op_t op;
+   } ops[] = {{"autoEncrypt", _op_auto_encrypt},
+              {"autoDecrypt", _op_auto_decrypt},
+              {"explicitEncrypt", _op_explicit_encrypt},
+              {"explicitDecrypt", _op_explicit_decrypt}};
+   _e2e_bench_t b;
+   size_t i, j;
+   int cold;
+
+   for (i = 0; i < sizeof (counts) / sizeof (counts[0]); i++) {
+      _e2e_setup (&b, counts[i]);
+      for (j = 0; j < sizeof (ops) / sizeof (ops[0]); j++) {
+         for (cold = 0; cold <= 1; cold++) {
+            char name[64];
+
+            bson_snprintf (name,
+                           sizeof (name),
+                           "%s%s",
+                           ops[j].name,
+                           cold ? "Cold" : "Warm");
+            if (!_selected (name)) {
+               continue;
+            }
+            b.cold = cold;
+            _bench (name, "fields", b.fields, ops[j].op, &b);
+         }
+      }
+      _e2e_cleanup (&b);
+   }
+}
+
+
+#define BENCH_KMS_MAX_KEYS 10
+
+/* Decryption of values whose keys were evicted from the key cache, so every
+ * operation waits for the mock KMS. */
+typedef struct {
+   const char *provider;
+   uint32_t keys;
+   mock_kms_t *mock;
+   mongocrypt_t *crypt;
+   bson_t key_docs[BENCH_KMS_MAX_KEYS];
+   _mongocrypt_buffer_t key_ids[BENCH_KMS_MAX_KEYS];
+   bson_t encrypted;
+} _kms_bench_t;
+
+
+static mongocrypt_t *
+_new_mock_kms_crypt (uint32_t requests_per_sec)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_binary_t *bin;
+   bson_t kms_providers = BSON_INITIALIZER;
+
+   crypt = mongocrypt_new ();
+   mock_kms_append_providers (&kms_providers);
+   bin = _bson_as_binary (&kms_providers);
+   BENCH_ASSERT (mongocrypt_setopt_kms_providers (crypt, bin));
+   mongocrypt_binary_destroy (bin);
+   bson_destroy (&kms_providers);
+   if (requests_per_sec) {
+      BENCH_ASSERT (mongocrypt_setopt_kms_rate_limit (
+         crypt, requests_per_sec, requests_per_sec / 10));
+   }
+   BENCH_ASSERT (mongocrypt_init (crypt));
+   return crypt;
+}
+
+
+/* Run @ctx, answering key requests with keys [first, first + count) and KMS
+ * requests with the mock. If @result is set, it is initialized with a copy
+ * of the output. */
+static void
+_kms_run_ctx (_kms_bench_t *b,
+              mongocrypt_ctx_t *ctx,
+              uint32_t first,
+              uint32_t count,
+              bson_t *result)
+{
+   mongocrypt_binary_t *out;
+   mongocrypt_binary_t *bin;
+   mongocrypt_status_t *status;
+   bson_t out_bson;
+   uint32_t i;
+
+   status = mongocrypt_status_new ();
+   for (;;) {
+      switch (mongocrypt_ctx_state (ctx)) {
+      case MONGOCRYPT_CTX_NEED_MONGO_KEYS:
+         for (i = first; i < first + count; i++) {
+            bin = _bson_as_binary (&b->key_docs[i]);
+            BENCH_ASSERT (mongocrypt_ctx_mongo_feed (ctx, bin));
+            mongocrypt_binary_destroy (bin);
+         }
+         BENCH_ASSERT (mongocrypt_ctx_mongo_done (ctx));
+         break;
+      case MONGOCRYPT_CTX_NEED_KMS:
+         if (!mock_kms_run (b->mock, ctx, status)) {
+            fprintf (stderr,
+                     "mock KMS failed: %s\n",
+                     mongocrypt_status_message (status, NULL));
+            abort ();
+         }
+         break;
+      case MONGOCRYPT_CTX_READY:
+         out = mongocrypt_binary_new ();
+         BENCH_ASSERT (mongocrypt_ctx_finalize (ctx, out));
+         if (result) {
+            BENCH_ASSERT (_mongocrypt_binary_to_bson (out, &out_bson));
+            bson_copy_to (&out_bson, result);
+         }
+         mongocrypt_binary_destroy (out);
+         break;
+      case MONGOCRYPT_CTX_DONE:
+         mongocrypt_status_destroy (status);
+         return;
+      case MONGOCRYPT_CTX_ERROR:
+      default:
+         mongocrypt_ctx_status (ctx, status);
+         fprintf (stderr,
+                  "unexpected state %d: %s\n",
+                  (int) mongocrypt_ctx_state (ctx),
+                  mongocrypt_status_message (status, NULL));
+         abort ();
+      }
+   }
+}
+
+
+/* Create b->keys data keys through the mock, and a document with one value
+ * encrypted with each. */
+static void
+_kms_setup (_kms_bench_t *b,
+            const char *provider,
+            uint32_t keys,
+            const mock_kms_opts_t *opts,
+            uint32_t requests_per_sec)
+{
+   mock_kms_opts_t setup_opts = {0};
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+   bson_t kek = BSON_INITIALIZER;
+   bson_t value = BSON_INITIALIZER;
+   bson_t ciphertext;
+   bson_iter_t iter;
+   uint32_t i;
+
+   BENCH_ASSERT (keys <= BENCH_KMS_MAX_KEYS);
+   memset (b, 0, sizeof (*b));
+   b->provider = provider;
+   b->keys = keys;
+   b->crypt = _new_mock_kms_crypt (requests_per_sec);
+   /* Set up without delays. */
+   b->mock = mock_kms_new (&setup_opts);
+   mock_kms_append_kek (provider, &kek);
+   BSON_APPEND_UTF8 (&value, "v", "benchmark value");
+   bson_init (&b->encrypted);
+
+   for (i = 0; i < keys; i++) {
+      char field[16];
+
+      ctx = mongocrypt_ctx_new (b->crypt);
+      bin = _bson_as_binary (&kek);
+      BENCH_ASSERT (mongocrypt_ctx_setopt_key_encryption_key (ctx, bin));
+      mongocrypt_binary_destroy (bin);
+      BENCH_ASSERT (mongocrypt_ctx_datakey_init (ctx));
+      _kms_run_ctx (b, ctx, 0, 0, &b->key_docs[i]);
+      mongocrypt_ctx_destroy (ctx);
+      BENCH_ASSERT (bson_iter_init_find (&iter, &b->key_docs[i], "_id"));
+      BENCH_ASSERT (
+         _mongocrypt_buffer_copy_from_uuid_iter (&b->key_ids[i], &iter));
+
+      ctx = mongocrypt_ctx_new (b->crypt);
+      bin = mongocrypt_binary_new_from_data (b->key_ids[i].data,
+                                             b->key_ids[i].len);
+      BENCH_ASSERT (mongocrypt_ctx_setopt_key_id (ctx, bin));
+      mongocrypt_binary_destroy (bin);
+      BENCH_ASSERT (mongocrypt_ctx_setopt_algorithm (ctx, DETERMINISTIC, -1));
+      bin = _bson_as_binary (&value);
+      BENCH_ASSERT (mongocrypt_ctx_explicit_encrypt_init (ctx, bin));
+      mongocrypt_binary_destroy (bin);
+      _kms_run_ctx (b, ctx, i, 1, &ciphertext);
+      mongocrypt_ctx_destroy (ctx);
+
+      bson_snprintf (field, sizeof (field), "f%u", i);
+      BENCH_ASSERT (bson_iter_init_find (&iter, &ciphertext, "v"));
+      BENCH_ASSERT (bson_append_iter (&b->encrypted, field, -1, &iter));
+      bson_destroy (&ciphertext);
+   }
+
+   mock_kms_destroy (b->mock);
+   b->mock = mock_kms_new (opts);
+   bson_destroy (&kek);
+   bson_destroy (&value);
+}
+
+
+static void
+_kms_cleanup (_kms_bench_t *b)
+{
+   uint32_t i;
+
+   for (i = 0; i < b->keys; i++) {
+      bson_destroy (&b->key_docs[i]);
+      _mongocrypt_buffer_cleanup (&b->key_ids[i]);
+   }
+   bson_destroy (&b->encrypted);
+   mock_kms_destroy (b->mock);
+   mongocrypt_destroy (b->crypt);
+}
+
+
+static void
+_op_kms_decrypt (void *ctx)
+{
+   _kms_bench_t *b = (_kms_bench_t *) ctx;
+   mongocrypt_ctx_t *dctx;
+   mongocrypt_binary_t *bin;
+   uint32_t i;
+
+   /* Evict the keys, as when their cache TTL expires. OAuth tokens stay
+    * cached. */
+   for (i = 0; i < b->keys; i++) {
+      bin = mongocrypt_binary_new_from_data (b->key_ids[i].data,
+                                             b->key_ids[i].len);
+      BENCH_ASSERT (mongocrypt_key_cache_invalidate (b->crypt, bin));
+      mongocrypt_binary_destroy (bin);
+   }
+
+   dctx = mongocrypt_ctx_new (b->crypt);
+   bin = _bson_as_binary (&b->encrypted);
+   BENCH_ASSERT (mongocrypt_ctx_decrypt_init (dctx, bin));
+   mongocrypt_binary_destroy (bin);
+   _kms_run_ctx (b, dctx, 0, b->keys, NULL);
+   mongocrypt_ctx_destroy (dctx);
+}
+
+
+/* Decrypt with every key evicted, against a mock KMS with 10ms of latency.
+ * Each result also has the mean number of KMS requests, throttled responses,
+ * retries, and hedges per operation. */
+static void
+_bench_kms (void)
+{
+   static const char *providers[] = {"aws", "azure", "gcp"};
+   static const uint32_t key_counts[] = {1, BENCH_KMS_MAX_KEYS};
+   /* latency, jitter, slow percent, slow, server requests per second,
+    * backoff, hedge after. */
+   static const struct {
+      const char *name;
+      mock_kms_opts_t opts;
+      /* The client side rate limit, or 0. */
+      uint32_t requests_per_sec;
+   } scenarios[] = {
+      {"kmsDecrypt", {10000, 2000, 0, 0, 0, 0, 0}, 0},
+      /* One response in ten takes 100ms longer. */
+      {"kmsDecryptSlowTail", {10000, 2000, 10, 100000, 0, 0, 0}, 0},
+      {"kmsDecryptHedged", {10000, 2000, 10, 100000, 0, 0, 20000}, 0},
+      /* The server allows fewer requests than are sent. */
+      {"kmsDecryptThrottled", {10000, 2000, 0, 0, 200, 5000, 0}, 0},
+      {"kmsDecryptRateLimited", {10000, 2000, 0, 0, 200, 5000, 0}, 200}};
+   _kms_bench_t b;
+   size_t i, j, k;
+
+   for (i = 0; i < sizeof (scenarios) / sizeof (scenarios[0]); i++) {
+      for (j = 0; j < sizeof (providers) / sizeof (providers[0]); j++) {
+         for (k = 0; k < sizeof (key_counts) / sizeof (key_counts[0]); k++) {
+            mock_kms_stats_t before, after;
+            int64_t iterations, elapsed_us;
+            char name[64];
+            char extra[256];
+            double n;
+
+            bson_snprintf (name,
+                           sizeof (name),
+                           "%s%c%s",
+                           scenarios[i].name,
+                           providers[j][0] - 'a' + 'A',
+                           providers[j] + 1);
+            if (!_selected (name)) {
+               continue;
+            }
+
+            _kms_setup (&b,
+                        providers[j],
+                        key_counts[k],
+                        &scenarios[i].opts,
+                        scenarios[i].requests_per_sec);
+            mock_kms_stats (b.mock, &before);
+            _bench_run (_op_kms_decrypt, &b, &iterations, &elapsed_us);
+            mock_kms_stats (b.mock, &after);
+            /* The stats include the runs before the measured one. */
+            n = (double) (iterations * 2 - 1);
+            bson_snprintf (
+               extra,
+               sizeof (extra),
+               ", \"kmsRequestsPerOp\": %.2f, \"throttledPerOp\": %.2f, "
+               "\"retriesPerOp\": %.2f, \"hedgesPerOp\": %.2f",
+               (double) (after.requests - before.requests) / n,
+               (double) (after.throttled - before.throttled) / n,
+               (double) (after.retries - before.retries) / n,
+               (double) (after.hedges - before.hedges) / n);
+            _print_result (
+               name, "keys", b.keys, iterations, elapsed_us, extra);
+            _kms_cleanup (&b);
+         }
+      }
+   }
+}
+
+
+#ifdef BSON_OS_UNIX
+#define BENCH_THREADED_US (1000 * 1000)
+#define BENCH_THREADED_FIELDS 10
+
+/* One thread of a threaded benchmark. */
+typedef struct {
+   _e2e_bench_t *b;
+   _bench_op_t op;
+   int64_t deadline_us;
+   int64_t *latencies_us;
+   size_t count;
+   size_t capacity;
+   pthread_t thread;
+} _thread_bench_t;
+
+
+static void *
+_thread_bench_run (void *arg)
+{
+   _thread_bench_t *t = (_thread_bench_t *) arg;
+   int64_t now = bson_get_monotonic_time ();
+
+   while (now < t->deadline_us) {
+      int64_t start_us = now;
+
+      t->op (t->b);
+      now = bson_get_monotonic_time ();
+      if (t->count == t->capacity) {
+         t->capacity = t->capacity ? t->capacity * 2 : 1024;
+         t->latencies_us = bson_realloc (
+            t->latencies_us, t->capacity * sizeof (*t->latencies_us));
+      }
+      t->latencies_us[t->count++] = now - start_us;
+   }
+   return NULL;
+}
+
+
+static int
+_cmp_int64 (const void *a, const void *b)
+{
+   int64_t x = *(const int64_t *) a;
+   int64_t y = *(const int64_t *) b;
+
+   return x < y ? -1 : x > y;
+}
+
+
+/* Sum a lock counter over every cache. Returns false unless libmongocrypt
+ * was built with ENABLE_LOCK_STATS. */
+static bool
+_lock_stat (mongocrypt_t *crypt, const char *counter, int64_t *out)
+{
+   static const char *caches[] = {"collinfo", "key", "markings"};
+   mongocrypt_binary_t *bin;
+   bson_t stats;
+   bson_iter_t iter;
+   size_t i;
+   bool found = false;
+
+   *out = 0;
+   bin = mongocrypt_binary_new ();
+   BENCH_ASSERT (mongocrypt_get_stats (crypt, bin));
+   BENCH_ASSERT (_mongocrypt_binary_to_bson (bin, &stats));
+   for (i = 0; i < sizeof (caches) / sizeof (caches[0]); i++) {
+      char path[64];
+
+      bson_snprintf (path, sizeof (path), "cache.%s.%s", caches[i], counter);
+      if (bson_iter_init (&iter, &stats) &&
+          bson_iter_find_descendant (&iter, path, &iter)) {
+         *out += bson_iter_as_int64 (&iter);
+         found = true;
+      }
+   }
+   mongocrypt_binary_destroy (bin);
+   return found;
+}
+
+
+/* Run @op on @num_threads threads sharing b->crypt, and print the aggregate
+ * throughput and the latency percentiles of single operations. */
+static void
+_bench_threaded_one (const char *name,
+                     _e2e_bench_t *b,
+                     _bench_op_t op,
+                     uint32_t num_threads)
+{
+   _thread_bench_t *threads;
+   int64_t *latencies_us;
+   int64_t start_us, elapsed_us;
+   int64_t wait_before = 0, wait_after = 0, hold_before = 0, hold_after = 0;
+   bool lock_stats;
+   size_t total = 0, n;
+   uint32_t i;
+   double ns_per_op;
+
+   lock_stats = _lock_stat (b->crypt, "lockWaitUs", &wait_before) &&
+                _lock_stat (b->crypt, "lockHoldUs", &hold_before);
+   threads = bson_malloc0 (num_threads * sizeof (*threads));
+   start_us = bson_get_monotonic_time ();
+   for (i = 0; i < num_threads; i++) {
+      threads[i].b = b;
+      threads[i].op = op;
+      threads[i].deadline_us = start_us + BENCH_THREADED_US;
+      BENCH_ASSERT (0 == pthread_create (&threads[i].thread,
+                                         NULL,
+                                         _thread_bench_run,
+                                         &threads[i]));
+   }
+   for (i = 0; i < num_threads; i++) {
+      BENCH_ASSERT (0 == pthread_join (threads[i].thread, NULL));
+      total += threads[i].count;
+   }
+   elapsed_us = bson_get_monotonic_time () - start_us;
+   if (lock_stats) {
+      _lock_stat (b->crypt, "lockWaitUs", &wait_after);
+      _lock_stat (b->crypt, "lockHoldUs", &hold_after);
+   }
+
+   BENCH_ASSERT (total > 0);
+   latencies_us = bson_malloc (total * sizeof (*latencies_us));
+   n = 0;
+   for (i = 0; i < num_threads; i++) {
+      memcpy (latencies_us + n,
+              threads[i].latencies_us,
+              threads[i].count * sizeof (*latencies_us));
+      n += threads[i].count;
+      bson_free (threads[i].latencies_us);
+   }
+   bson_free (threads);
+   qsort (latencies_us, total, sizeof (*latencies_us), _cmp_int64);
+
+   ns_per_op = (double) elapsed_us * 1000.0 / (double) total;
+   printf ("%s\n    { \"name\": \"%s\", \"param\": \"threads\", "
+           "\"value\": %u, \"iterations\": %" PRIu64 ", "
+           "\"nsPerOp\": %.1f, \"opsPerSec\": %.1f, "
+           "\"p50Us\": %" PRId64 ", \"p99Us\": %" PRId64,
+           _printed_result ? "," : "",
+           name,
+           num_threads,
+           (uint64_t) total,
+           ns_per_op,
+           1e9 / ns_per_op,
+           latencies_us[total / 2],
+           latencies_us[total * 99 / 100]);
+   if (lock_stats) {
+      printf (", \"lockWaitUs\": %" PRId64 ", \"lockHoldUs\": %" PRId64,
+              wait_after - wait_before,
+              hold_after - hold_before);
+   }
+   printf (" }");
+   fflush (stdout);
+   _printed_result = true;
+   bson_free (latencies_us);
+}
+
+
+static void
+_bench_threaded (void)
+{
+   static const uint32_t thread_counts[] = {1, 2, 4, 8, 16};
+   _e2e_bench_t b;
+   size_t i;
+
+   if (!_selected ("threadedEncrypt") && !_selected ("threadedDecrypt")) {
+      return;
+   }
+
+   /* Warm contexts on a shared handle, so threads contend on the caches. */
+   _e2e_setup (&b, BENCH_THREADED_FIELDS);
+   for (i = 0; i < sizeof (thread_counts) / sizeof (thread_counts[0]); i++) {
+      if (_selected ("threadedEncrypt")) {
+         _bench_threaded_one (
+            "threadedEncrypt", &b, _op_auto_encrypt, thread_counts[i]);
+      }
+      if (_selected ("threadedDecrypt")) {
+         _bench_threaded_one (
+            "threadedDecrypt", &b, _op_auto_decrypt, thread_counts[i]);
+      }
+   }
+   _e2e_cleanup (&b);
+}
+#endif /* BSON_OS_UNIX */
+
+
+int
+main (int argc, char **argv)
+{
+   mongocrypt_t *crypt;
+
+   if (argc > 1) {
+      _filter = argv[1];
+   }
+
+   /* Initialize a handle for its crypto hooks. */
+   crypt = _new_crypt ();
+
+   printf ("{\n  \"version\": \"%s\",\n  \"results\": [",
+           mongocrypt_version (NULL));
+   _bench_crypto (crypt);
+   _bench_transform ();
+   _bench_key_cache ();
+   _bench_kms_parser ();
+   _bench_e2e ();
+   _bench_kms ();
+#ifdef BSON_OS_UNIX
+   _bench_threaded ();
+#endif
+   printf ("\n  ]\n}\n");
+
+   mongocrypt_destroy (crypt);
+   return 0;
+}
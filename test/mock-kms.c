@@ -0,0 +1,637 @@
+/*
+ * Copyright 2020-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mock-kms.h"
+
+#include <kms_message/kms_b64.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "mongocrypt-buffer-private.h"
+#include "mongocrypt-json-private.h"
+
+#define MOCK_KMS_MAX_ENDPOINTS 16
+#define MOCK_KMS_MAX_RETRIES 5
+
+/* Not a secret. It is only used to sign GCP OAuth requests to the mock. */
+#define MOCK_KMS_GCP_PRIVATE_KEY                                               \
+   "MIIEvgIBADANBgkqhkiG9w0BAQEFAASCBKgwggSkAgEAAoIBAQC4JOyv5z05cL18ztpknRC7C" \
+   "FY2gYol4DAKerdVUoDJxCTmFMf39dVUEqD0WDiw/qcRtSO1/"                          \
+   "FRut08PlSPmvbyKetsLoxlpS8lukSzEFpFK7+L+R4miFOl6HvECyg7lbC1H/"              \
+   "WGAhIz9yZRlXhRo9qmO/"                                                      \
+   "fB6PV9IeYtU+"                                                              \
+   "1xYuXicjCDPp36uuxBAnCz7JfvxJ3mdVc0vpSkbSb141nWuKNYR1mgyvvL6KzxO6mYsCo4hRA" \
+   "dhuizD9C4jDHk0V2gDCFBk0h8SLEdzStX8L0jG90/Og4y7J1b/cPo/"                    \
+   "kbYokkYisxe8cPlsvGBf+rZex7XPxc1yWaP080qeABJb+S88O//"                       \
+   "LAgMBAAECggEBAKVxP1m3FzHBUe2NZ3fYCc0Qa2zjK7xl1KPFp2u4CU+"                  \
+   "9sy0oZJUqQHUdm5CMprqWwIHPTftWboFenmCwrSXFOFzujljBO7Z3yc1WD3NJl1ZNepLcsRJ3" \
+   "WWFH5V+NLJ8Bdxlj1DMEZCwr7PC5+vpnCuYWzvT0qOPTl9RNVaW9VVjHouJ9Fg+"           \
+   "s2DrShXDegFabl1iZEDdI4xScHoYBob06A5lw0WOCTayzw0Naf37lM8Y4psRAmI46XLiF/"    \
+   "Vbuorna4hcChxDePlNLEfMipICcuxTcei1RBSlBa2t1tcnvoTy6cuYDqqImRYjp1KnMKlKQBn" \
+   "Q1NjS2TsRGm+F0FbreVCECgYEA4IDJlm8q/hVyNcPe4OzIcL1rsdYN3bNm2Y2O/"           \
+   "YtRPIkQ446ItyxD06d9VuXsQpFp9jNACAPfCMSyHpPApqlxdc8z/"                      \
+   "xATlgHkcGezEOd1r4E7NdTpGg8y6Rj9b8kVlED6v4grbRhKcU6moyKUQT3+"               \
+   "1B6ENZTOKyxuyDEgTwZHtFECgYEA0fqdv9h9s77d6eWmIioP7FSymq93pC4umxf6TVicpjpME" \
+   "rdD2ZfJGulN37dq8FOsOFnSmFYJdICj/PbJm6p1i8O21lsFCltEqVoVabJ7/"              \
+   "0alPfdG2U76OeBqI8ZubL4BMnWXAB/"                                            \
+   "VVEYbyWCNpQSDTjHQYs54qa2I0dJB7OgJt1sCgYEArctFQ02/"                         \
+   "7H5Rscl1yo3DBXO94SeiCFSPdC8f2Kt3MfOxvVdkAtkjkMACSbkoUsgbTVqTYSEOEc2jTgR3i" \
+   "Q13JgpHaFbbsq64V0QP3TAxbLIQUjYGVgQaF1UfLOBv8hrzgj45z/ST/"                  \
+   "G80lOl595+0nCUbmBcgG1AEWrmdF0/"                                            \
+   "3RmECgYAKvIzKXXB3+19vcT2ga5Qq2l3TiPtOGsppRb2XrNs9qKdxIYvHmXo/"             \
+   "9QP1V3SRW0XoD7ez8FpFabp42cmPOxUNk3FK3paQZABLxH5pzCWI9PzIAVfPDrm+"          \
+   "sdnbgG7vAnwfL2IMMJSA3aDYGCbF9EgefG+"                                       \
+   "STcpfqq7fQ6f5TBgLFwKBgCd7gn1xYL696SaKVSm7VngpXlczHVEpz3kStWR5gfzriPBxXgMV" \
+   "cWmcbajRser7ARpCEfbxM1UJyv6oAYZWVSNErNzNVb4POqLYcCNySuC6xKhs9FrEQnyKjyk8w" \
+   "I4VnrEMGrQ8e+qYSwYk9Gh6dKGoRMAPYVXQAO0fIsHF/T0a"
+
+#define MOCK_KMS_AWS_KEY                                \
+   "arn:aws:kms:us-east-1:579766882180:key/89fcc2c4-" \
+   "08b0-4bd9-9f25-e30687b580d0"
+
+/* A token bucket of the requests to one endpoint. */
+typedef struct {
+   char *endpoint;
+   double tokens;
+   int64_t last_us;
+} _mock_bucket_t;
+
+struct _mock_kms_t {
+   mock_kms_opts_t opts;
+   uint64_t rand;
+   _mock_bucket_t buckets[MOCK_KMS_MAX_ENDPOINTS];
+   size_t num_buckets;
+   mock_kms_stats_t stats;
+};
+
+/* A request sent by mock_kms_run. */
+typedef struct {
+   mongocrypt_kms_ctx_t *kms;
+   /* The index of the request a hedge duplicates, or -1. */
+   int64_t primary;
+   /* The index of the hedge of a request, or -1. */
+   int64_t hedge;
+   int64_t arrival_us;
+   char *response;
+   uint32_t response_len;
+   uint32_t retries;
+   bool pending;
+} _mock_request_t;
+
+
+mock_kms_t *
+mock_kms_new (const mock_kms_opts_t *opts)
+{
+   mock_kms_t *mock;
+
+   mock = bson_malloc0 (sizeof (*mock));
+   mock->opts = *opts;
+   /* A fixed seed, so runs are comparable. */
+   mock->rand = 0x9E3779B97F4A7C15ULL;
+   return mock;
+}
+
+
+void
+mock_kms_destroy (mock_kms_t *mock)
+{
+   size_t i;
+
+   if (!mock) {
+      return;
+   }
+   for (i = 0; i < mock->num_buckets; i++) {
+      bson_free (mock->buckets[i].endpoint);
+   }
+   bson_free (mock);
+}
+
+
+void
+mock_kms_append_providers (bson_t *kms_providers)
+{
+   bson_t child;
+
+   BSON_APPEND_DOCUMENT_BEGIN (kms_providers, "aws", &child);
+   BSON_APPEND_UTF8 (&child, "accessKeyId", "mock");
+   BSON_APPEND_UTF8 (&child, "secretAccessKey", "mock");
+   bson_append_document_end (kms_providers, &child);
+
+   BSON_APPEND_DOCUMENT_BEGIN (kms_providers, "azure", &child);
+   BSON_APPEND_UTF8 (&child, "tenantId", "mock");
+   BSON_APPEND_UTF8 (&child, "clientId", "mock");
+   BSON_APPEND_UTF8 (&child, "clientSecret", "mock");
+   bson_append_document_end (kms_providers, &child);
+
+   BSON_APPEND_DOCUMENT_BEGIN (kms_providers, "gcp", &child);
+   BSON_APPEND_UTF8 (&child, "email", "mock@example.com");
+   BSON_APPEND_UTF8 (&child, "privateKey", MOCK_KMS_GCP_PRIVATE_KEY);
+   bson_append_document_end (kms_providers, &child);
+}
+
+
+void
+mock_kms_append_kek (const char *provider, bson_t *kek)
+{
+   BSON_APPEND_UTF8 (kek, "provider", provider);
+   if (0 == strcmp (provider, "aws")) {
+      BSON_APPEND_UTF8 (kek, "region", "us-east-1");
+      BSON_APPEND_UTF8 (kek, "key", MOCK_KMS_AWS_KEY);
+   } else if (0 == strcmp (provider, "azure")) {
+      BSON_APPEND_UTF8 (kek, "keyVaultEndpoint", "mock.vault.azure.net");
+      BSON_APPEND_UTF8 (kek, "keyName", "mock");
+   } else {
+      BSON_ASSERT (0 == strcmp (provider, "gcp"));
+      BSON_APPEND_UTF8 (kek, "projectId", "mock");
+      BSON_APPEND_UTF8 (kek, "location", "global");
+      BSON_APPEND_UTF8 (kek, "keyRing", "mock");
+      BSON_APPEND_UTF8 (kek, "keyName", "mock");
+   }
+}
+
+
+/* xorshift64 */
+static uint64_t
+_rand (mock_kms_t *mock)
+{
+   mock->rand ^= mock->rand << 13;
+   mock->rand ^= mock->rand >> 7;
+   mock->rand ^= mock->rand << 17;
+   return mock->rand;
+}
+
+
+static int64_t
+_delay_us (mock_kms_t *mock)
+{
+   int64_t delay_us = mock->opts.latency_us;
+
+   if (mock->opts.jitter_us > 0) {
+      delay_us += (int64_t) (_rand (mock) %
+                             (uint64_t) (mock->opts.jitter_us + 1));
+   }
+   if (mock->opts.slow_percent > 0 &&
+       _rand (mock) % 100 < mock->opts.slow_percent) {
+      delay_us += mock->opts.slow_us;
+   }
+   return delay_us;
+}
+
+
+/* Returns true if a request to @endpoint at @sent_us exceeds the rate. */
+static bool
+_throttled (mock_kms_t *mock, const char *endpoint, int64_t sent_us)
+{
+   double rate = (double) mock->opts.requests_per_sec;
+   double burst = rate / 10 > 1 ? rate / 10 : 1;
+   _mock_bucket_t *bucket = NULL;
+   size_t i;
+
+   if (!mock->opts.requests_per_sec) {
+      return false;
+   }
+
+   for (i = 0; i < mock->num_buckets; i++) {
+      if (0 == strcmp (mock->buckets[i].endpoint, endpoint)) {
+         bucket = &mock->buckets[i];
+         break;
+      }
+   }
+   if (!bucket) {
+      BSON_ASSERT (mock->num_buckets < MOCK_KMS_MAX_ENDPOINTS);
+      bucket = &mock->buckets[mock->num_buckets++];
+      bucket->endpoint = bson_strdup (endpoint);
+      bucket->tokens = burst;
+      bucket->last_us = sent_us;
+   }
+
+   /* Hedges are sent ahead of earlier requests on the clock, so time may
+    * appear to go back. */
+   if (sent_us > bucket->last_us) {
+      bucket->tokens += rate * (double) (sent_us - bucket->last_us) / 1e6;
+      if (bucket->tokens > burst) {
+         bucket->tokens = burst;
+      }
+      bucket->last_us = sent_us;
+   }
+   if (bucket->tokens < 1) {
+      return true;
+   }
+   bucket->tokens -= 1;
+   return false;
+}
+
+
+static void
+_http_response (const char *status_line,
+                const char *body,
+                char **response,
+                uint32_t *response_len)
+{
+   *response = bson_strdup_printf ("HTTP/1.1 %s\r\n"
+                                   "Content-Type: application/json\r\n"
+                                   "Content-Length: %d\r\n"
+                                   "\r\n"
+                                   "%s",
+                                   status_line,
+                                   (int) strlen (body),
+                                   body);
+   *response_len = (uint32_t) strlen (*response);
+}
+
+
+/* Decode the base64 string @in_field of @body, invert every byte, and
+ * return it as base64. Returns NULL if the field is missing. */
+static char *
+_transform (const char *body, const char *in_field, bool url)
+{
+   _mongocrypt_buffer_t value;
+   const char *b64;
+   size_t b64_len;
+   char *encoded;
+   char *out;
+   uint32_t i;
+
+   _mongocrypt_buffer_init (&value);
+   if (!_mongocrypt_json_find_string (
+          body, strlen (body), in_field, &b64, &b64_len) ||
+       !_mongocrypt_json_b64_decode (b64, b64_len, url, &value)) {
+      _mongocrypt_buffer_cleanup (&value);
+      return NULL;
+   }
+   for (i = 0; i < value.len; i++) {
+      value.data[i] = (uint8_t) ~value.data[i];
+   }
+   encoded = url ? kms_message_raw_to_b64url (value.data, value.len)
+                 : kms_message_raw_to_b64 (value.data, value.len);
+   _mongocrypt_buffer_cleanup (&value);
+   BSON_ASSERT (encoded);
+   /* kms-message allocates with malloc. */
+   out = bson_strdup (encoded);
+   free (encoded);
+   return out;
+}
+
+
+bool
+mock_kms_respond (mock_kms_t *mock,
+                  const char *endpoint,
+                  const uint8_t *msg,
+                  uint32_t len,
+                  int64_t sent_us,
+                  char **response,
+                  uint32_t *response_len,
+                  int64_t *arrival_us)
+{
+   char *request;
+   char *path;
+   char *end;
+   const char *body;
+   const char *in_field;
+   const char *out_field;
+   const char *extra = "";
+   char *value = NULL;
+   char *json;
+   bool aws;
+   bool url = false;
+   bool ret = false;
+
+   request = bson_strndup ((const char *) msg, len);
+   /* The request line is "POST <path> HTTP/1.1". */
+   path = strchr (request, ' ');
+   body = strstr (request, "\r\n\r\n");
+   if (!path || !body || !(end = strchr (path + 1, ' '))) {
+      goto done;
+   }
+   path++;
+   *end = '\0';
+   body += 4;
+   aws = NULL != strstr (end + 1, "\r\nX-Amz-Target:TrentService.");
+
+   mock->stats.requests++;
+   *arrival_us = sent_us + _delay_us (mock);
+   if (_throttled (mock, endpoint, sent_us)) {
+      mock->stats.throttled++;
+      /* AWS reports throttling with HTTP 400, the others with 429. */
+      if (aws) {
+         _http_response ("400 Bad Request",
+                         "{\"__type\": \"ThrottlingException\", "
+                         "\"message\": \"Rate exceeded\"}",
+                         response,
+                         response_len);
+      } else {
+         _http_response ("429 Too Many Requests",
+                         "{\"error\": {\"code\": 429, "
+                         "\"message\": \"Too many requests\"}}",
+                         response,
+                         response_len);
+      }
+      ret = true;
+      goto done;
+   }
+
+   if (0 == strcmp (path, "/token") || strstr (path, "/oauth2/v2.0/token")) {
+      mock->stats.oauth_requests++;
+      _http_response ("200 OK",
+                      "{\"token_type\": \"Bearer\", \"expires_in\": 3600, "
+                      "\"access_token\": \"mock\"}",
+                      response,
+                      response_len);
+      ret = true;
+      goto done;
+   }
+
+   if (aws && strstr (end + 1, "TrentService.Encrypt")) {
+      in_field = "Plaintext";
+      out_field = "CiphertextBlob";
+      extra = ", \"KeyId\": \"" MOCK_KMS_AWS_KEY "\"";
+   } else if (aws) {
+      in_field = "CiphertextBlob";
+      out_field = "Plaintext";
+   } else if (strstr (path, "/wrapkey") || strstr (path, "/unwrapkey")) {
+      in_field = "value";
+      out_field = "value";
+      extra = ", \"kid\": \"https://mock.vault.azure.net/keys/mock\"";
+      url = true;
+   } else if (strstr (path, ":encrypt")) {
+      in_field = "plaintext";
+      out_field = "ciphertext";
+   } else if (strstr (path, ":decrypt")) {
+      in_field = "ciphertext";
+      out_field = "plaintext";
+   } else {
+      goto done;
+   }
+
+   value = _transform (body, in_field, url);
+   if (!value) {
+      goto done;
+   }
+   json = bson_strdup_printf ("{\"%s\": \"%s\"%s}", out_field, value, extra);
+   _http_response ("200 OK", json, response, response_len);
+   bson_free (json);
+   ret = true;
+
+done:
+   bson_free (value);
+   bson_free (request);
+   return ret;
+}
+
+
+static void
+_sleep_us (int64_t usec)
+{
+#ifdef _WIN32
+   Sleep ((DWORD) (usec / 1000));
+#else
+   usleep ((useconds_t) usec);
+#endif
+}
+
+
+/* Send request @i of @reqs at @sent_us. */
+static bool
+_send (mock_kms_t *mock,
+       _mock_request_t *reqs,
+       size_t i,
+       int64_t sent_us,
+       mongocrypt_status_t *status)
+{
+   mongocrypt_binary_t *msg;
+   const char *endpoint;
+   bool ret;
+
+   msg = mongocrypt_binary_new ();
+   bson_free (reqs[i].response);
+   reqs[i].response = NULL;
+   ret = mongocrypt_kms_ctx_message (reqs[i].kms, msg) &&
+         mongocrypt_kms_ctx_endpoint (reqs[i].kms, &endpoint) &&
+         mock_kms_respond (mock,
+                           endpoint,
+                           mongocrypt_binary_data (msg),
+                           mongocrypt_binary_len (msg),
+                           sent_us,
+                           &reqs[i].response,
+                           &reqs[i].response_len,
+                           &reqs[i].arrival_us);
+   mongocrypt_binary_destroy (msg);
+   if (!ret) {
+      mongocrypt_status_set (status,
+                             MONGOCRYPT_STATUS_ERROR_CLIENT,
+                             1,
+                             "mock KMS cannot answer the request",
+                             -1);
+      return false;
+   }
+   reqs[i].pending = true;
+   return true;
+}
+
+
+/* Send request @p of @reqs at @sent_us, and if its response will take
+ * longer than hedge_after_us, a hedge of it too. */
+static bool
+_send_hedged (mock_kms_t *mock,
+              _mock_request_t *reqs,
+              size_t *num_reqs,
+              size_t p,
+              int64_t sent_us,
+              mongocrypt_status_t *status)
+{
+   mongocrypt_kms_ctx_t *hedge;
+   size_t h;
+
+   if (!_send (mock, reqs, p, sent_us, status)) {
+      return false;
+   }
+   /* A driver would start a timer instead. The outcome is the same. */
+   if (mock->opts.hedge_after_us <= 0 ||
+       reqs[p].arrival_us <= sent_us + mock->opts.hedge_after_us ||
+       !(hedge = mongocrypt_kms_ctx_hedge (reqs[p].kms))) {
+      return true;
+   }
+
+   /* A retried request reuses the slot of its destroyed hedge. */
+   if (reqs[p].hedge >= 0) {
+      h = (size_t) reqs[p].hedge;
+   } else {
+      h = (*num_reqs)++;
+      memset (&reqs[h], 0, sizeof (reqs[h]));
+      reqs[p].hedge = (int64_t) h;
+   }
+   reqs[h].kms = hedge;
+   reqs[h].primary = (int64_t) p;
+   reqs[h].hedge = -1;
+   mock->stats.hedges++;
+   return _send (mock,
+                 reqs,
+                 h,
+                 sent_us + mock->opts.hedge_after_us +
+                    mongocrypt_kms_ctx_usleep (hedge),
+                 status);
+}
+
+
+/* Feed the response of @r, as much as the parser asks for at a time. */
+static void
+_feed (_mock_request_t *r)
+{
+   uint32_t offset = 0;
+   uint32_t needed;
+
+   while (offset < r->response_len &&
+          (needed = mongocrypt_kms_ctx_bytes_needed (r->kms)) > 0) {
+      mongocrypt_binary_t *bin;
+
+      if (needed > r->response_len - offset) {
+         needed = r->response_len - offset;
+      }
+      bin = mongocrypt_binary_new_from_data (
+         (uint8_t *) r->response + offset, needed);
+      /* A failure is read from the request with mongocrypt_kms_ctx_failure.
+       */
+      if (!mongocrypt_kms_ctx_feed (r->kms, bin)) {
+         mongocrypt_binary_destroy (bin);
+         return;
+      }
+      mongocrypt_binary_destroy (bin);
+      offset += needed;
+   }
+}
+
+
+bool
+mock_kms_run (mock_kms_t *mock,
+              mongocrypt_ctx_t *ctx,
+              mongocrypt_status_t *status)
+{
+   _mock_request_t *reqs = NULL;
+   mongocrypt_kms_ctx_t *kms;
+   size_t num_primaries = 0;
+   size_t num_reqs;
+   size_t capacity = 0;
+   size_t i;
+   int64_t now;
+   bool ret = false;
+
+   /* Take every request up front, as a driver sending them concurrently
+    * would. Each may get a hedge, so reserve twice the room. */
+   while ((kms = mongocrypt_ctx_next_kms_ctx (ctx))) {
+      if (2 * (num_primaries + 1) > capacity) {
+         capacity = capacity ? capacity * 2 : 16;
+         reqs = bson_realloc (reqs, capacity * sizeof (*reqs));
+      }
+      memset (&reqs[num_primaries], 0, sizeof (*reqs));
+      reqs[num_primaries].kms = kms;
+      reqs[num_primaries].primary = -1;
+      reqs[num_primaries].hedge = -1;
+      num_primaries++;
+   }
+   num_reqs = num_primaries;
+
+   now = bson_get_monotonic_time ();
+   for (i = 0; i < num_primaries; i++) {
+      if (!_send_hedged (mock,
+                         reqs,
+                         &num_reqs,
+                         i,
+                         now + mongocrypt_kms_ctx_usleep (reqs[i].kms),
+                         status)) {
+         goto done;
+      }
+   }
+
+   /* Receive responses in the order they arrive. */
+   for (;;) {
+      _mock_request_t *r = NULL;
+      _mock_request_t *primary;
+      mongocrypt_kms_failure_t failure;
+
+      for (i = 0; i < num_reqs; i++) {
+         if (reqs[i].pending &&
+             (!r || reqs[i].arrival_us < r->arrival_us)) {
+            r = &reqs[i];
+         }
+      }
+      if (!r) {
+         break;
+      }
+
+      now = bson_get_monotonic_time ();
+      if (r->arrival_us > now) {
+         _sleep_us (r->arrival_us - now);
+      }
+      r->pending = false;
+      _feed (r);
+
+      primary = r->primary >= 0 ? &reqs[r->primary] : r;
+      if (mongocrypt_kms_ctx_bytes_needed (primary->kms) > 0) {
+         continue;
+      }
+      /* The first response settles the request and its hedge. */
+      primary->pending = false;
+      if (primary->hedge >= 0) {
+         reqs[primary->hedge].pending = false;
+      }
+
+      failure = mongocrypt_kms_ctx_failure (primary->kms);
+      if (failure == MONGOCRYPT_KMS_FAILURE_NONE) {
+         continue;
+      }
+      if ((failure != MONGOCRYPT_KMS_FAILURE_THROTTLED &&
+           failure != MONGOCRYPT_KMS_FAILURE_SERVER) ||
+          primary->retries >= MOCK_KMS_MAX_RETRIES ||
+          !mongocrypt_kms_ctx_retry (primary->kms)) {
+         mongocrypt_kms_ctx_status (primary->kms, status);
+         goto done;
+      }
+      mock->stats.retries++;
+      now = bson_get_monotonic_time ();
+      if (!_send_hedged (mock,
+                         reqs,
+                         &num_reqs,
+                         (size_t) (primary - reqs),
+                         now + (mock->opts.backoff_us << primary->retries) +
+                            mongocrypt_kms_ctx_usleep (primary->kms),
+                         status)) {
+         goto done;
+      }
+      primary->retries++;
+   }
+
+   if (!mongocrypt_ctx_kms_done (ctx)) {
+      mongocrypt_ctx_status (ctx, status);
+      goto done;
+   }
+   ret = true;
+
+done:
+   for (i = 0; i < num_reqs; i++) {
+      bson_free (reqs[i].response);
+   }
+   bson_free (reqs);
+   return ret;
+}
+
+
+void
+mock_kms_stats (mock_kms_t *mock, mock_kms_stats_t *stats)
+{
+   *stats = mock->stats;
+}
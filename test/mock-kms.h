@@ -0,0 +1,111 @@
+/*
+ * Copyright 2020-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MOCK_KMS_H
+#define MOCK_KMS_H
+
+#include <bson/bson.h>
+
+#include "mongocrypt.h"
+
+/* An in-process mock of AWS KMS, Azure Key Vault, Google Cloud KMS, and
+ * their OAuth endpoints. It answers the messages of
+ * mongocrypt_kms_ctx_message with the HTTP responses the real services
+ * send, after a simulated network delay, so benchmarks can run the full
+ * state machine, including the KMS step, without cloud credentials.
+ *
+ * The mock "encrypts" by inverting every byte, so data keys created through
+ * it can be decrypted through it again. Key encryption keys and credentials
+ * are not checked. */
+typedef struct _mock_kms_t mock_kms_t;
+
+typedef struct {
+   /* Time from sending a request to receiving its response. */
+   int64_t latency_us;
+   /* A uniformly random delay, up to jitter_us, added to latency_us. */
+   int64_t jitter_us;
+   /* The percentage of responses delayed another slow_us, for a latency
+    * tail. */
+   uint32_t slow_percent;
+   int64_t slow_us;
+   /* Requests to one endpoint beyond this rate are throttled, as the
+    * providers do when a quota is exceeded. 0 for no limit. Up to a tenth of
+    * a second of requests may be sent at once. */
+   uint32_t requests_per_sec;
+
+   /* How mock_kms_run, acting as the driver, handles responses. */
+
+   /* Retry throttled requests after this backoff, doubled on each retry. */
+   int64_t backoff_us;
+   /* Send a hedge of a request still pending after this long. 0 to never
+    * hedge. */
+   int64_t hedge_after_us;
+} mock_kms_opts_t;
+
+typedef struct {
+   /* Every request sent, including OAuth requests, retries, and hedges. */
+   int64_t requests;
+   int64_t oauth_requests;
+   int64_t throttled;
+   int64_t retries;
+   int64_t hedges;
+} mock_kms_stats_t;
+
+mock_kms_t *
+mock_kms_new (const mock_kms_opts_t *opts);
+
+void
+mock_kms_destroy (mock_kms_t *mock);
+
+/* Append the credentials of the "aws", "azure", and "gcp" providers, for
+ * mongocrypt_setopt_kms_providers. */
+void
+mock_kms_append_providers (bson_t *kms_providers);
+
+/* Append the key encryption key of @provider, "aws", "azure", or "gcp",
+ * for mongocrypt_ctx_setopt_key_encryption_key. */
+void
+mock_kms_append_kek (const char *provider, bson_t *kek);
+
+/* Answer a request sent to @endpoint at @sent_us, on the
+ * bson_get_monotonic_time clock. Sets @response to the HTTP response, to be
+ * freed with bson_free, and @arrival_us to when it is received. Returns
+ * false if @msg is not a request of a known provider. */
+bool
+mock_kms_respond (mock_kms_t *mock,
+                  const char *endpoint,
+                  const uint8_t *msg,
+                  uint32_t len,
+                  int64_t sent_us,
+                  char **response,
+                  uint32_t *response_len,
+                  int64_t *arrival_us);
+
+/* Act as a driver in the MONGOCRYPT_CTX_NEED_KMS state of @ctx: send every
+ * KMS request at once, honoring mongocrypt_kms_ctx_usleep, sleep until each
+ * response arrives and feed it, retry throttled requests, hedge slow ones,
+ * and call mongocrypt_ctx_kms_done. Returns false and sets @status if a
+ * request fails for good. */
+bool
+mock_kms_run (mock_kms_t *mock,
+              mongocrypt_ctx_t *ctx,
+              mongocrypt_status_t *status);
+
+/* Counts of everything sent since mock_kms_new. */
+void
+mock_kms_stats (mock_kms_t *mock, mock_kms_stats_t *stats);
+
+#endif /* MOCK_KMS_H */
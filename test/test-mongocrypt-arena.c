@@ -0,0 +1,79 @@
+/*
+ * Copyright 2019-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mongocrypt-arena-private.h"
+
+#include "test-mongocrypt.h"
+
+static void
+_test_arena (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_arena_t arena;
+   _mongocrypt_arena_chunk_t *kept;
+   _mongocrypt_buffer_t buf;
+   uint8_t *a, *b, *big;
+   int i;
+
+   _mongocrypt_arena_init (&arena);
+
+   /* Allocations are distinct and aligned. */
+   a = _mongocrypt_arena_alloc (&arena, 1);
+   b = _mongocrypt_arena_alloc (&arena, 3);
+   BSON_ASSERT (a != b);
+   BSON_ASSERT (((uintptr_t) a) % 16 == 0);
+   BSON_ASSERT (((uintptr_t) b) % 16 == 0);
+   memset (a, 0xAA, 1);
+   memset (b, 0xBB, 3);
+   BSON_ASSERT (a[0] == 0xAA);
+
+   /* Fill past the first chunk, and allocate one larger than a chunk. */
+   for (i = 0; i < 1000; i++) {
+      memset (_mongocrypt_arena_alloc (&arena, 32), i, 32);
+   }
+   big = _mongocrypt_arena_alloc (&arena, 100 * 1024);
+   memset (big, 0, 100 * 1024);
+   BSON_ASSERT (arena.chunks->next);
+
+   /* Reset keeps one chunk. */
+   kept = arena.chunks;
+   _mongocrypt_arena_reset (&arena);
+   BSON_ASSERT (arena.chunks == kept);
+   BSON_ASSERT (!arena.chunks->next);
+   BSON_ASSERT (arena.chunks->used == 0);
+   BSON_ASSERT (_mongocrypt_arena_alloc (&arena, 8) == kept->data);
+
+   /* Arena buffers are not owned, so cleaning them up is a no-op. */
+   _mongocrypt_arena_buffer (&arena, &buf, 16);
+   BSON_ASSERT (buf.len == 16);
+   BSON_ASSERT (!buf.owned);
+   _mongocrypt_buffer_cleanup (&buf);
+
+   /* Without an arena, the buffer owns its data. */
+   _mongocrypt_arena_buffer (NULL, &buf, 16);
+   BSON_ASSERT (buf.len == 16);
+   BSON_ASSERT (buf.owned);
+   _mongocrypt_buffer_cleanup (&buf);
+
+   _mongocrypt_arena_cleanup (&arena);
+   BSON_ASSERT (!arena.chunks);
+}
+
+
+void
+_mongocrypt_tester_install_arena (_mongocrypt_tester_t *tester)
+{
+   INSTALL_TEST (_test_arena);
+}
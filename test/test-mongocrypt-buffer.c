@@ -161,8 +161,170 @@ _test_mongocrypt_buffer_from_iter (_mongocrypt_tester_t *tester)
    bson_destroy (&wrapper);
 }
 
+static void
+_test_mongocrypt_buffer_copy_to_reuse (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_buffer_t a, b, c;
+   uint8_t *data;
+
+   _mongocrypt_buffer_init (&a);
+   _mongocrypt_buffer_init (&b);
+   _mongocrypt_buffer_init (&c);
+   _mongocrypt_buffer_copy_from_hex (&a, "00112233445566778899aabbccddeeff");
+   _mongocrypt_buffer_copy_from_hex (&b, "ffeeddccbbaa99887766554433221100");
+   _mongocrypt_buffer_copy_from_hex (&c, "0011");
+   a.subtype = BSON_SUBTYPE_UUID;
+
+   /* The same length reuses the destination's allocation. */
+   data = b.data;
+   _mongocrypt_buffer_copy_to (&a, &b);
+   BSON_ASSERT (b.data == data);
+   BSON_ASSERT (b.subtype == BSON_SUBTYPE_UUID);
+   BSON_ASSERT (0 == _mongocrypt_buffer_cmp (&a, &b));
+
+   /* A different length does not. */
+   _mongocrypt_buffer_copy_to (&c, &b);
+   BSON_ASSERT (0 == _mongocrypt_buffer_cmp (&c, &b));
+
+   /* Resizing to the same length keeps the data. */
+   data = a.data;
+   _mongocrypt_buffer_resize (&a, 16);
+   BSON_ASSERT (a.data == data);
+   BSON_ASSERT (0 == _mongocrypt_buffer_cmp_hex (
+                        &a, "00112233445566778899aabbccddeeff"));
+
+   _mongocrypt_buffer_cleanup (&a);
+   _mongocrypt_buffer_cleanup (&b);
+   _mongocrypt_buffer_cleanup (&c);
+}
+
+/* Each value of @doc is the same after encoding it as a plaintext and
+ * decoding it. */
+static void
+_assert_values_round_trip (const bson_t *doc)
+{
+   bson_iter_t iter;
+
+   BSON_ASSERT (bson_iter_init (&iter, doc));
+   while (bson_iter_next (&iter)) {
+      _mongocrypt_buffer_t plaintext;
+      bson_value_t out;
+      bson_t expected = BSON_INITIALIZER, actual = BSON_INITIALIZER;
+
+      _mongocrypt_buffer_from_iter (&plaintext, &iter);
+      BSON_ASSERT (_mongocrypt_buffer_to_bson_value (
+         &plaintext, (uint8_t) bson_iter_type (&iter), &out));
+      BSON_ASSERT (out.value_type == bson_iter_type (&iter));
+      BSON_ASSERT (bson_append_iter (&expected, "v", 1, &iter));
+      BSON_ASSERT (bson_append_value (&actual, "v", 1, &out));
+      BSON_ASSERT (bson_equal (&expected, &actual));
+      bson_destroy (&expected);
+      bson_destroy (&actual);
+      bson_value_destroy (&out);
+      _mongocrypt_buffer_cleanup (&plaintext);
+   }
+}
+
+/* Fixed width types are decoded without a wrapping document. */
+static void
+_test_mongocrypt_buffer_fixed_width_to_bson_value (
+   _mongocrypt_tester_t *tester)
+{
+   bson_t *doc;
+   bson_decimal128_t dec;
+   bson_oid_t oid;
+
+   BSON_ASSERT (bson_decimal128_from_string ("1.5", &dec));
+   bson_oid_init_from_string (&oid, "0123456789abcdef01234567");
+   doc = BCON_NEW ("int32",
+                   BCON_INT32 (-2),
+                   "int64",
+                   BCON_INT64 (INT64_MIN),
+                   "double",
+                   BCON_DOUBLE (-0.25),
+                   "date",
+                   BCON_DATE_TIME (1234567890123),
+                   "true",
+                   BCON_BOOL (true),
+                   "false",
+                   BCON_BOOL (false),
+                   "oid",
+                   BCON_OID (&oid),
+                   "decimal128",
+                   BCON_DECIMAL128 (&dec));
+
+   _assert_values_round_trip (doc);
+   bson_destroy (doc);
+}
+
+
+/* Strings, documents, arrays, and binaries are also encoded and decoded
+ * without a wrapping document. Other types take the general path. */
+static void
+_test_mongocrypt_buffer_variable_width_to_bson_value (
+   _mongocrypt_tester_t *tester)
+{
+   _mongocrypt_buffer_t plaintext;
+   bson_value_t out;
+
+   _assert_values_round_trip (
+      TMP_BSON ("{'str': 'abc', 'empty_str': '', 'doc': {'a': [1, {}]}, "
+                "'arr': [], 'bin': {'$binary': {'base64': 'AAECAw==', "
+                "'subType': '06'}}, 'empty_bin': {'$binary': {'base64': '', "
+                "'subType': '00'}}, 'old_bin': {'$binary': {'base64': "
+                "'AAECAw==', 'subType': '02'}}, 'regex': "
+                "{'$regularExpression': {'pattern': 'a', 'options': 'i'}}, "
+                "'null': null}"));
+
+   /* Lengths that overrun the plaintext are rejected. */
+   _mongocrypt_buffer_copy_from_hex (&plaintext, "0500000061626300");
+   BSON_ASSERT (
+      !_mongocrypt_buffer_to_bson_value (&plaintext, BSON_TYPE_UTF8, &out));
+   _mongocrypt_buffer_cleanup (&plaintext);
+   _mongocrypt_buffer_copy_from_hex (&plaintext, "0900000000");
+   BSON_ASSERT (!_mongocrypt_buffer_to_bson_value (
+      &plaintext, BSON_TYPE_DOCUMENT, &out));
+   _mongocrypt_buffer_cleanup (&plaintext);
+   _mongocrypt_buffer_copy_from_hex (&plaintext, "0300000000aabb");
+   BSON_ASSERT (
+      !_mongocrypt_buffer_to_bson_value (&plaintext, BSON_TYPE_BINARY, &out));
+   _mongocrypt_buffer_cleanup (&plaintext);
+}
+
+
+/* Measured types are exact, and the rest are bounded. */
+static void
+_test_mongocrypt_bson_element_len (_mongocrypt_tester_t *tester)
+{
+   bson_t *doc;
+   bson_iter_t iter;
+
+   doc = TMP_BSON ("{'bin': {'$binary': {'base64': 'AAECAw==', 'subType': "
+                   "'06'}}, 'str': 'abc', 'doc': {'a': [1, 2]}, 'arr': [], "
+                   "'int': 1, 'dec': {'$numberDecimal': '1.5'}}");
+   BSON_ASSERT (bson_iter_init (&iter, doc));
+   while (bson_iter_next (&iter)) {
+      bson_t actual = BSON_INITIALIZER;
+      uint32_t len;
+
+      len = _mongocrypt_bson_element_len (bson_iter_key_len (&iter),
+                                          bson_iter_value (&iter));
+      BSON_ASSERT (bson_append_iter (&actual, NULL, 0, &iter));
+      if (BSON_ITER_HOLDS_INT32 (&iter)) {
+         BSON_ASSERT (len > actual.len - 5u);
+      } else {
+         BSON_ASSERT (len == actual.len - 5u);
+      }
+      bson_destroy (&actual);
+   }
+}
+
 void
 _mongocrypt_tester_install_buffer (_mongocrypt_tester_t *tester)
 {
    INSTALL_TEST (_test_mongocrypt_buffer_from_iter);
+   INSTALL_TEST (_test_mongocrypt_buffer_copy_to_reuse);
+   INSTALL_TEST (_test_mongocrypt_buffer_fixed_width_to_bson_value);
+   INSTALL_TEST (_test_mongocrypt_buffer_variable_width_to_bson_value);
+   INSTALL_TEST (_test_mongocrypt_bson_element_len);
 }
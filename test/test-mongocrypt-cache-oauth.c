@@ -30,7 +30,7 @@ static void _test_cache_oauth_expiration (_mongocrypt_tester_t *tester) {
    status = mongocrypt_status_new ();
    ret = _mongocrypt_cache_oauth_add (cache, TMP_BSON ("{'expires_in': 0, 'access_token': 'foo'}"), status);
    ASSERT_OR_PRINT (ret, status);
-   /* Attempting to get the token will purge the new token from the cache. */
+   /* An expired token is not returned. */
    token = _mongocrypt_cache_oauth_get (cache);
    BSON_ASSERT (!token);
 
@@ -50,8 +50,180 @@ static void _test_cache_oauth_expiration (_mongocrypt_tester_t *tester) {
    mongocrypt_status_destroy (status);
 }
 
+static void
+_test_cache_oauth_refresh (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_cache_oauth_t *cache;
+   mongocrypt_status_t *status;
+   char *token;
+
+   cache = _mongocrypt_cache_oauth_new ();
+   status = mongocrypt_status_new ();
+
+   /* Nothing cached, nothing to refresh. */
+   BSON_ASSERT (!_mongocrypt_cache_oauth_needs_refresh (cache));
+
+   ASSERT_OR_PRINT (
+      _mongocrypt_cache_oauth_add (
+         cache,
+         TMP_BSON ("{'expires_in': 1000, 'access_token': 'foo'}"),
+         status),
+      status);
+   BSON_ASSERT (!_mongocrypt_cache_oauth_needs_refresh (cache));
+
+   /* A token close to expiring needs a refresh but is still usable. */
+   _mongocrypt_cache_oauth_destroy (cache);
+   cache = _mongocrypt_cache_oauth_new ();
+   ASSERT_OR_PRINT (
+      _mongocrypt_cache_oauth_add (
+         cache, TMP_BSON ("{'expires_in': 30, 'access_token': 'foo'}"), status),
+      status);
+   BSON_ASSERT (_mongocrypt_cache_oauth_needs_refresh (cache));
+   token = _mongocrypt_cache_oauth_get (cache);
+   ASSERT_STREQUAL (token, "foo");
+   bson_free (token);
+
+   /* Only one caller may claim the refresh. */
+   BSON_ASSERT (_mongocrypt_cache_oauth_start_refresh (cache));
+   BSON_ASSERT (!_mongocrypt_cache_oauth_needs_refresh (cache));
+   BSON_ASSERT (!_mongocrypt_cache_oauth_start_refresh (cache));
+
+   /* Replacing the token ends the refresh period. */
+   ASSERT_OR_PRINT (
+      _mongocrypt_cache_oauth_add (
+         cache,
+         TMP_BSON ("{'expires_in': 1000, 'access_token': 'bar'}"),
+         status),
+      status);
+   _mongocrypt_cache_oauth_end_refresh (cache);
+   BSON_ASSERT (!_mongocrypt_cache_oauth_needs_refresh (cache));
+   token = _mongocrypt_cache_oauth_get (cache);
+   ASSERT_STREQUAL (token, "bar");
+   bson_free (token);
+
+   _mongocrypt_cache_oauth_destroy (cache);
+   mongocrypt_status_destroy (status);
+}
+
+static void
+_test_cache_oauth_fetch (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_cache_oauth_t *cache;
+   int owner_a, owner_b;
+
+   cache = _mongocrypt_cache_oauth_new ();
+
+   /* Only one owner fetches a token. Claiming again is a no-op. */
+   BSON_ASSERT (_mongocrypt_cache_oauth_claim_fetch (cache, &owner_a, 1000));
+   BSON_ASSERT (!_mongocrypt_cache_oauth_claim_fetch (cache, &owner_b, 1000));
+   BSON_ASSERT (_mongocrypt_cache_oauth_claim_fetch (cache, &owner_a, 1000));
+
+   /* Releasing a fetch claimed by another owner does nothing. */
+   _mongocrypt_cache_oauth_release_fetch (cache, &owner_b);
+   BSON_ASSERT (!_mongocrypt_cache_oauth_claim_fetch (cache, &owner_b, 1000));
+
+   /* A waiter gives up wait_ms after the claim, then may take it over. */
+   _mongocrypt_cache_oauth_wait_fetch (cache, &owner_b, 10);
+   BSON_ASSERT (_mongocrypt_cache_oauth_claim_fetch (cache, &owner_b, 10));
+   BSON_ASSERT (!_mongocrypt_cache_oauth_claim_fetch (cache, &owner_a, 1000));
+
+   /* Released fetches may be claimed, and are not waited on. */
+   _mongocrypt_cache_oauth_release_fetch (cache, &owner_b);
+   _mongocrypt_cache_oauth_wait_fetch (cache, &owner_a, 1000 * 1000);
+   BSON_ASSERT (_mongocrypt_cache_oauth_claim_fetch (cache, &owner_a, 1000));
+
+   _mongocrypt_cache_oauth_destroy (cache);
+}
+
+#define AZURE_KEK                                                  \
+   TEST_BSON ("{'provider': 'azure', 'keyVaultEndpoint': "         \
+              "'example.vault.azure.net', 'keyName': 'test'}")
+
+static void
+_test_cache_oauth_refresh_ctx (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_ctx_t *other;
+   mongocrypt_kms_ctx_t *kms;
+   mongocrypt_binary_t *bin;
+   mongocrypt_binary_t out;
+   mongocrypt_status_t *status;
+   const char *body = "{\"access_token\":\"new\",\"expires_in\":3600}";
+   char *reply;
+   char *token;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   status = mongocrypt_status_new ();
+   BSON_ASSERT (!mongocrypt_needs_oauth_refresh (crypt, "azure"));
+   ASSERT_OR_PRINT (
+      _mongocrypt_cache_oauth_add (
+         crypt->cache_oauth_azure,
+         TMP_BSON ("{'expires_in': 30, 'access_token': 'old'}"),
+         status),
+      status);
+   BSON_ASSERT (mongocrypt_needs_oauth_refresh (crypt, "azure"));
+   BSON_ASSERT (!mongocrypt_needs_oauth_refresh (crypt, "gcp"));
+   BSON_ASSERT (!mongocrypt_needs_oauth_refresh (crypt, "aws"));
+
+   /* Only Azure and GCP authenticate with OAuth. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_masterkey_local (ctx), ctx);
+   ASSERT_FAILS (mongocrypt_ctx_refresh_oauth_init (ctx), ctx, "only used by");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_encryption_key (ctx, AZURE_KEK), ctx);
+   ASSERT_OK (mongocrypt_ctx_refresh_oauth_init (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_KMS);
+   BSON_ASSERT (!mongocrypt_needs_oauth_refresh (crypt, "azure"));
+
+   /* A second refresh context has nothing to do. */
+   other = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_encryption_key (other, AZURE_KEK),
+              other);
+   ASSERT_OK (mongocrypt_ctx_refresh_oauth_init (other), other);
+   BSON_ASSERT (mongocrypt_ctx_state (other) == MONGOCRYPT_CTX_READY);
+   ASSERT_OK (mongocrypt_ctx_finalize (other, &out), other);
+   mongocrypt_ctx_destroy (other);
+
+   /* The current token stays usable while the refresh runs. */
+   token = _mongocrypt_cache_oauth_get (crypt->cache_oauth_azure);
+   ASSERT_STREQUAL (token, "old");
+   bson_free (token);
+
+   kms = mongocrypt_ctx_next_kms_ctx (ctx);
+   BSON_ASSERT (kms);
+   reply = bson_strdup_printf (
+      "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s",
+      (int) strlen (body),
+      body);
+   bin = mongocrypt_binary_new_from_data ((uint8_t *) reply,
+                                          (uint32_t) strlen (reply));
+   ASSERT_OK (mongocrypt_kms_ctx_feed (kms, bin), kms);
+   BSON_ASSERT (!mongocrypt_ctx_next_kms_ctx (ctx));
+   ASSERT_OK (mongocrypt_ctx_kms_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, &out), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+
+   token = _mongocrypt_cache_oauth_get (crypt->cache_oauth_azure);
+   ASSERT_STREQUAL (token, "new");
+   bson_free (token);
+   BSON_ASSERT (!mongocrypt_needs_oauth_refresh (crypt, "azure"));
+
+   mongocrypt_binary_destroy (bin);
+   bson_free (reply);
+   mongocrypt_status_destroy (status);
+   mongocrypt_destroy (crypt);
+}
+
 void
 _mongocrypt_tester_install_cache_oauth (_mongocrypt_tester_t *tester)
 {
    INSTALL_TEST (_test_cache_oauth_expiration);
+   INSTALL_TEST (_test_cache_oauth_refresh);
+   INSTALL_TEST (_test_cache_oauth_fetch);
+   INSTALL_TEST (_test_cache_oauth_refresh_ctx);
 }
\ No newline at end of file
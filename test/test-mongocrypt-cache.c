@@ -17,6 +17,7 @@
 #include "test-mongocrypt.h"
 #include "mongocrypt-crypto-private.h"
 #include "mongocrypt-cache-collinfo-private.h"
+#include "mongocrypt-key-slab-private.h"
 
 void
 _test_cache (_mongocrypt_tester_t *tester)
@@ -123,6 +124,299 @@ _test_cache_expiration (_mongocrypt_tester_t *tester)
    BSON_ASSERT (_mongocrypt_cache_get (&cache, "1", (void **) &tmp));
    BSON_ASSERT (!tmp);
 
+   /* Lookups do not remove expired entries. Eviction does. */
+   BSON_ASSERT (cache.num_pairs == 1);
+   _mongocrypt_cache_evict (&cache);
+   BSON_ASSERT (cache.num_pairs == 0);
+
+   _mongocrypt_cache_cleanup (&cache);
+   mongocrypt_status_destroy (status);
+   bson_destroy (entry);
+}
+
+
+static void
+_test_cache_maintain (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_status_t *status;
+   bson_t *entry = BCON_NEW ("a", "b");
+
+   status = mongocrypt_status_new ();
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_collinfo_cache_ttl (crypt, 1), crypt);
+   ASSERT_FAILS (mongocrypt_cache_maintain (crypt),
+                 crypt,
+                 "mongocrypt_init must be called first");
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+
+   ASSERT_OR_PRINT (
+      _mongocrypt_cache_add_copy (crypt->cache_collinfo, "1", entry, status),
+      status);
+   /* Nothing has expired yet. */
+   ASSERT_OK (mongocrypt_cache_maintain (crypt), crypt);
+   BSON_ASSERT (crypt->cache_collinfo->num_pairs == 1);
+
+   _usleep (1000 * 100);
+   ASSERT_OK (mongocrypt_cache_maintain (crypt), crypt);
+   BSON_ASSERT (crypt->cache_collinfo->num_pairs == 0);
+   BSON_ASSERT (crypt->cache_collinfo->evictions == 1);
+
+   mongocrypt_destroy (crypt);
+   mongocrypt_status_destroy (status);
+   bson_destroy (entry);
+}
+
+
+static void
+_test_cache_trim (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_status_t *status;
+   bson_t *entry = BCON_NEW ("a", "b");
+   uint64_t freed;
+
+   status = mongocrypt_status_new ();
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_FAILS (mongocrypt_trim (crypt, MONGOCRYPT_TRIM_ALL, NULL),
+                 crypt,
+                 "mongocrypt_init must be called first");
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   ASSERT_FAILS (mongocrypt_trim (crypt, (mongocrypt_trim_level_t) 0, NULL),
+                 crypt,
+                 "invalid trim level");
+   _mongocrypt_status_reset (crypt->status);
+
+   ASSERT_OR_PRINT (
+      _mongocrypt_cache_add_copy (crypt->cache_collinfo, "1", entry, status),
+      status);
+   ASSERT_OR_PRINT (
+      _mongocrypt_cache_add_copy (crypt->cache_collinfo, "2", entry, status),
+      status);
+   /* Make the pair of "1", at the tail, cold. */
+   crypt->cache_collinfo->tail->last_used -= CACHE_COLD_MS;
+
+   ASSERT_OK (mongocrypt_trim (crypt, MONGOCRYPT_TRIM_COLD, &freed), crypt);
+   BSON_ASSERT (freed > 0);
+   BSON_ASSERT (crypt->cache_collinfo->num_pairs == 1);
+   BSON_ASSERT (crypt->cache_collinfo->evictions == 1);
+
+   /* Trimming everything also releases the index. */
+   ASSERT_OK (mongocrypt_trim (crypt, MONGOCRYPT_TRIM_ALL, &freed), crypt);
+   BSON_ASSERT (freed > 0);
+   BSON_ASSERT (crypt->cache_collinfo->num_pairs == 0);
+   BSON_ASSERT (_mongocrypt_cache_bytes (crypt->cache_collinfo) == 0);
+   ASSERT_OK (mongocrypt_trim (crypt, MONGOCRYPT_TRIM_ALL, &freed), crypt);
+   BSON_ASSERT (freed == 0);
+
+   mongocrypt_destroy (crypt);
+   mongocrypt_status_destroy (status);
+   bson_destroy (entry);
+}
+
+
+static void
+_test_cache_max_entries (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_cache_t cache;
+   mongocrypt_status_t *status;
+   bson_t *entry = BCON_NEW ("a", "b");
+   bson_t *tmp = NULL;
+
+   status = mongocrypt_status_new ();
+
+   _mongocrypt_cache_collinfo_init (&cache);
+   _mongocrypt_cache_set_max_entries (&cache, 2);
+
+   ASSERT_OR_PRINT (_mongocrypt_cache_add_copy (&cache, "1", entry, status),
+                    status);
+   _usleep (1000 * 5);
+   ASSERT_OR_PRINT (_mongocrypt_cache_add_copy (&cache, "2", entry, status),
+                    status);
+   _usleep (1000 * 5);
+
+   /* Use "1" so "2" is the least recently used. */
+   BSON_ASSERT (_mongocrypt_cache_get (&cache, "1", (void **) &tmp));
+   BSON_ASSERT (tmp);
+   bson_destroy (tmp);
+
+   /* Adding to a full cache evicts "2". */
+   ASSERT_OR_PRINT (_mongocrypt_cache_add_copy (&cache, "3", entry, status),
+                    status);
+   BSON_ASSERT (_mongocrypt_cache_num_entries (&cache) == 2);
+   BSON_ASSERT (_mongocrypt_cache_get (&cache, "2", (void **) &tmp));
+   BSON_ASSERT (!tmp);
+   BSON_ASSERT (_mongocrypt_cache_get (&cache, "1", (void **) &tmp));
+   BSON_ASSERT (tmp);
+   bson_destroy (tmp);
+   BSON_ASSERT (_mongocrypt_cache_get (&cache, "3", (void **) &tmp));
+   BSON_ASSERT (tmp);
+   bson_destroy (tmp);
+
+   /* Replacing an existing entry does not evict another. */
+   ASSERT_OR_PRINT (_mongocrypt_cache_add_copy (&cache, "3", entry, status),
+                    status);
+   BSON_ASSERT (_mongocrypt_cache_num_entries (&cache) == 2);
+
+   /* Lowering the limit evicts immediately. */
+   _mongocrypt_cache_set_max_entries (&cache, 1);
+   BSON_ASSERT (_mongocrypt_cache_num_entries (&cache) == 1);
+
+   _mongocrypt_cache_cleanup (&cache);
+   mongocrypt_status_destroy (status);
+   bson_destroy (entry);
+}
+
+
+static void
+_test_cache_adaptive (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_cache_t cache;
+   mongocrypt_status_t *status;
+   bson_t *entry = BCON_NEW ("a", "b");
+   bson_t *tmp = NULL;
+   char name[32];
+   size_t pair_bytes;
+   uint32_t i;
+
+   status = mongocrypt_status_new ();
+
+   _mongocrypt_cache_collinfo_init (&cache);
+   BSON_ASSERT (_mongocrypt_cache_capacity (&cache) == 0);
+   _mongocrypt_cache_set_adaptive (&cache, 1024 * 1024);
+   BSON_ASSERT (_mongocrypt_cache_capacity (&cache) ==
+                CACHE_ADAPTIVE_MIN_ENTRIES);
+
+   /* Add and use a few hot entries. */
+   for (i = 0; i < 8; i++) {
+      bson_snprintf (name, sizeof (name), "hot%d", (int) i);
+      ASSERT_OR_PRINT (_mongocrypt_cache_add_copy (&cache, name, entry, status),
+                       status);
+      BSON_ASSERT (_mongocrypt_cache_get (&cache, name, (void **) &tmp));
+      BSON_ASSERT (tmp);
+      bson_destroy (tmp);
+   }
+
+   /* A scan of entries used once does not evict the hot entries. */
+   for (i = 0; i < 4 * CACHE_ADAPTIVE_MIN_ENTRIES; i++) {
+      bson_snprintf (name, sizeof (name), "cold%d", (int) i);
+      ASSERT_OR_PRINT (_mongocrypt_cache_add_copy (&cache, name, entry, status),
+                       status);
+   }
+   BSON_ASSERT (_mongocrypt_cache_num_entries (&cache) ==
+                CACHE_ADAPTIVE_MIN_ENTRIES);
+   for (i = 0; i < 8; i++) {
+      bson_snprintf (name, sizeof (name), "hot%d", (int) i);
+      BSON_ASSERT (_mongocrypt_cache_get (&cache, name, (void **) &tmp));
+      BSON_ASSERT (tmp);
+      bson_destroy (tmp);
+   }
+   BSON_ASSERT (_mongocrypt_cache_get (&cache, "cold0", (void **) &tmp));
+   BSON_ASSERT (!tmp);
+
+   /* Adding an evicted entry again grows the cache. */
+   ASSERT_OR_PRINT (_mongocrypt_cache_add_copy (&cache, "cold0", entry, status),
+                    status);
+   BSON_ASSERT (_mongocrypt_cache_capacity (&cache) >
+                CACHE_ADAPTIVE_MIN_ENTRIES);
+   BSON_ASSERT (_mongocrypt_cache_num_entries (&cache) ==
+                CACHE_ADAPTIVE_MIN_ENTRIES + 1);
+
+   /* The memory budget bounds the cache below its capacity. */
+   pair_bytes = cache.bytes / cache.num_pairs;
+   _mongocrypt_cache_set_adaptive (&cache, 4 * pair_bytes);
+   BSON_ASSERT (_mongocrypt_cache_num_entries (&cache) <= 4);
+   BSON_ASSERT (cache.bytes <= 4 * pair_bytes);
+   for (i = 0; i < 16; i++) {
+      bson_snprintf (name, sizeof (name), "more%d", (int) i);
+      ASSERT_OR_PRINT (_mongocrypt_cache_add_copy (&cache, name, entry, status),
+                       status);
+      BSON_ASSERT (cache.bytes <= 4 * pair_bytes);
+   }
+
+   /* max_entries still applies. */
+   _mongocrypt_cache_set_adaptive (&cache, 1024 * 1024);
+   _mongocrypt_cache_set_max_entries (&cache, 2);
+   BSON_ASSERT (_mongocrypt_cache_capacity (&cache) == 2);
+   ASSERT_OR_PRINT (_mongocrypt_cache_add_copy (&cache, "last", entry, status),
+                    status);
+   BSON_ASSERT (_mongocrypt_cache_num_entries (&cache) == 2);
+
+   _mongocrypt_cache_cleanup (&cache);
+   mongocrypt_status_destroy (status);
+   bson_destroy (entry);
+}
+
+
+static void
+_count_visit (void *attr, void *ctx)
+{
+   BSON_ASSERT (0 == strcmp ((char *) attr, "1"));
+   (*(int *) ctx)++;
+}
+
+
+static void
+_test_cache_refresh_window (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_cache_t cache;
+   mongocrypt_status_t *status;
+   bson_t *entry = BCON_NEW ("a", "b");
+   bson_t *tmp = NULL;
+   int visited = 0;
+
+   status = mongocrypt_status_new ();
+
+   _mongocrypt_cache_collinfo_init (&cache);
+   _mongocrypt_cache_set_expiration (&cache, 100);
+   _mongocrypt_cache_set_refresh_window (&cache, 50);
+
+   ASSERT_OR_PRINT (_mongocrypt_cache_add_copy (&cache, "1", entry, status),
+                    status);
+   ASSERT_OR_PRINT (_mongocrypt_cache_add_copy (&cache, "2", entry, status),
+                    status);
+
+   /* Outside the refresh window, lookups do not request a refresh. */
+   BSON_ASSERT (_mongocrypt_cache_get (&cache, "1", (void **) &tmp));
+   BSON_ASSERT (tmp);
+   bson_destroy (tmp);
+   BSON_ASSERT (!_mongocrypt_cache_needs_refresh (&cache));
+
+   _usleep (1000 * 60);
+   BSON_ASSERT (_mongocrypt_cache_get (&cache, "1", (void **) &tmp));
+   BSON_ASSERT (tmp);
+   bson_destroy (tmp);
+   BSON_ASSERT (_mongocrypt_cache_needs_refresh (&cache));
+
+   /* Only "1" was used, so only "1" is refreshed, and only once. */
+   _mongocrypt_cache_start_refresh (&cache, _count_visit, &visited);
+   BSON_ASSERT (visited == 1);
+   BSON_ASSERT (!_mongocrypt_cache_needs_refresh (&cache));
+   BSON_ASSERT (_mongocrypt_cache_get (&cache, "1", (void **) &tmp));
+   BSON_ASSERT (tmp);
+   bson_destroy (tmp);
+   BSON_ASSERT (!_mongocrypt_cache_needs_refresh (&cache));
+   _mongocrypt_cache_start_refresh (&cache, _count_visit, &visited);
+   BSON_ASSERT (visited == 1);
+
+   /* Adding a new value completes the refresh. */
+   ASSERT_OR_PRINT (_mongocrypt_cache_add_copy (&cache, "1", entry, status),
+                    status);
+   _usleep (1000 * 60);
+   BSON_ASSERT (_mongocrypt_cache_get (&cache, "1", (void **) &tmp));
+   BSON_ASSERT (tmp);
+   bson_destroy (tmp);
+   BSON_ASSERT (_mongocrypt_cache_get (&cache, "2", (void **) &tmp));
+   BSON_ASSERT (!tmp);
+   _mongocrypt_cache_start_refresh (&cache, _count_visit, &visited);
+   BSON_ASSERT (visited == 2);
+
    _mongocrypt_cache_cleanup (&cache);
    mongocrypt_status_destroy (status);
    bson_destroy (entry);
@@ -255,10 +549,375 @@ _test_cache_duplicates (_mongocrypt_tester_t *tester)
    mongocrypt_status_destroy (status);
    _mongocrypt_cache_cleanup (&cache);
 }
+
+
+/* Add enough keys for the hash index to grow, then look each up by _id and by
+ * keyAltName. */
+static void
+_test_cache_many_entries (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_cache_t cache;
+   mongocrypt_status_t *status;
+   _mongocrypt_key_doc_t *placeholder_keydoc;
+   _mongocrypt_cache_key_value_t *tmp;
+   uint32_t i;
+   const uint32_t count = 1000;
+
+   status = mongocrypt_status_new ();
+   placeholder_keydoc = _mongocrypt_key_new ();
+   _mongocrypt_cache_key_init (&cache);
+
+   for (i = 0; i < count; i++) {
+      _mongocrypt_buffer_t id;
+      _mongocrypt_buffer_t key_material;
+      _mongocrypt_key_alt_name_t *alt_names;
+      _mongocrypt_cache_key_attr_t *attr;
+      _mongocrypt_cache_key_value_t *value;
+      char name[32];
+
+      _mongocrypt_buffer_init (&id);
+      _mongocrypt_buffer_resize (&id, 16);
+      memset (id.data, 0, id.len);
+      memcpy (id.data, &i, sizeof (i));
+      _mongocrypt_buffer_init (&key_material);
+      _mongocrypt_buffer_resize (&key_material, MONGOCRYPT_KEY_LEN);
+      memset (key_material.data, 0, key_material.len);
+      memcpy (key_material.data, &i, sizeof (i));
+      bson_snprintf (name, sizeof (name), "name%d", (int) i);
+      alt_names = _MONGOCRYPT_KEY_ALT_NAME_CREATE (name);
+
+      attr = _mongocrypt_cache_key_attr_new (&id, alt_names);
+      value = _mongocrypt_cache_key_value_new (placeholder_keydoc,
+                                               &key_material);
+      ASSERT_OR_PRINT (
+         _mongocrypt_cache_add_stolen (&cache, attr, value, status), status);
+
+      _mongocrypt_cache_key_attr_destroy (attr);
+      _mongocrypt_key_alt_name_destroy_all (alt_names);
+      _mongocrypt_buffer_cleanup (&key_material);
+      _mongocrypt_buffer_cleanup (&id);
+   }
+
+   BSON_ASSERT (_mongocrypt_cache_num_entries (&cache) == count);
+
+   for (i = 0; i < count; i++) {
+      _mongocrypt_buffer_t id;
+      _mongocrypt_key_alt_name_t *alt_names;
+      _mongocrypt_cache_key_attr_t *attr;
+      char name[32];
+
+      /* Look up by _id. */
+      _mongocrypt_buffer_init (&id);
+      _mongocrypt_buffer_resize (&id, 16);
+      memset (id.data, 0, id.len);
+      memcpy (id.data, &i, sizeof (i));
+      attr = _mongocrypt_cache_key_attr_new (&id, NULL);
+      BSON_ASSERT (_mongocrypt_cache_get (&cache, attr, (void **) &tmp));
+      BSON_ASSERT (tmp);
+      BSON_ASSERT (
+         0 == memcmp (tmp->decrypted_key_material.data, &i, sizeof (i)));
+      _mongocrypt_cache_key_value_destroy (tmp);
+      _mongocrypt_cache_key_attr_destroy (attr);
+      _mongocrypt_buffer_cleanup (&id);
+
+      /* Look up by keyAltName. */
+      bson_snprintf (name, sizeof (name), "name%d", (int) i);
+      alt_names = _MONGOCRYPT_KEY_ALT_NAME_CREATE (name);
+      attr = _mongocrypt_cache_key_attr_new (NULL, alt_names);
+      BSON_ASSERT (_mongocrypt_cache_get (&cache, attr, (void **) &tmp));
+      BSON_ASSERT (tmp);
+      BSON_ASSERT (
+         0 == memcmp (tmp->decrypted_key_material.data, &i, sizeof (i)));
+      _mongocrypt_cache_key_value_destroy (tmp);
+      _mongocrypt_cache_key_attr_destroy (attr);
+      _mongocrypt_key_alt_name_destroy_all (alt_names);
+   }
+
+   /* A name that was never added is not found. */
+   {
+      _mongocrypt_key_alt_name_t *alt_names;
+      _mongocrypt_cache_key_attr_t *attr;
+
+      alt_names = _MONGOCRYPT_KEY_ALT_NAME_CREATE ("missing");
+      attr = _mongocrypt_cache_key_attr_new (NULL, alt_names);
+      BSON_ASSERT (_mongocrypt_cache_get (&cache, attr, (void **) &tmp));
+      BSON_ASSERT (!tmp);
+      _mongocrypt_cache_key_attr_destroy (attr);
+      _mongocrypt_key_alt_name_destroy_all (alt_names);
+   }
+
+   _mongocrypt_cache_cleanup (&cache);
+   _mongocrypt_key_destroy (placeholder_keydoc);
+   mongocrypt_status_destroy (status);
+}
+
+
+static void
+_add_named_key (_mongocrypt_cache_t *cache,
+                _mongocrypt_key_doc_t *keydoc,
+                const char *name)
+{
+   mongocrypt_status_t *status;
+   _mongocrypt_key_alt_name_t *alt_names;
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_cache_key_value_t *value;
+   _mongocrypt_buffer_t key_material;
+
+   status = mongocrypt_status_new ();
+   _mongocrypt_buffer_init (&key_material);
+   _mongocrypt_buffer_resize (&key_material, MONGOCRYPT_KEY_LEN);
+   memset (key_material.data, 0, key_material.len);
+   alt_names = _MONGOCRYPT_KEY_ALT_NAME_CREATE (name);
+   attr = _mongocrypt_cache_key_attr_new (NULL, alt_names);
+   value = _mongocrypt_cache_key_value_new (keydoc, &key_material);
+   ASSERT_OR_PRINT (_mongocrypt_cache_add_stolen (cache, attr, value, status),
+                    status);
+   _mongocrypt_cache_key_attr_destroy (attr);
+   _mongocrypt_key_alt_name_destroy_all (alt_names);
+   _mongocrypt_buffer_cleanup (&key_material);
+   mongocrypt_status_destroy (status);
+}
+
+
+static bool
+_has_named_key (_mongocrypt_cache_t *cache, const char *name)
+{
+   _mongocrypt_key_alt_name_t *alt_names;
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_cache_key_value_t *tmp;
+
+   alt_names = _MONGOCRYPT_KEY_ALT_NAME_CREATE (name);
+   attr = _mongocrypt_cache_key_attr_new (NULL, alt_names);
+   BSON_ASSERT (_mongocrypt_cache_get (cache, attr, (void **) &tmp));
+   _mongocrypt_cache_key_attr_destroy (attr);
+   _mongocrypt_key_alt_name_destroy_all (alt_names);
+   if (!tmp) {
+      return false;
+   }
+   _mongocrypt_cache_key_value_destroy (tmp);
+   return true;
+}
+
+
+static void
+_test_cache_key_partitions (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_cache_t cache;
+   _mongocrypt_key_doc_t *placeholder_keydoc;
+   mongocrypt_t *crypt;
+   char name[32];
+   uint32_t i;
+
+   placeholder_keydoc = _mongocrypt_key_new ();
+   _mongocrypt_cache_key_init (&cache);
+   _mongocrypt_cache_set_max_entries (&cache, 8);
+   BSON_ASSERT (_mongocrypt_cache_add_partition (&cache, "big/", 2, 0));
+   BSON_ASSERT (!_mongocrypt_cache_add_partition (&cache, "big/", 4, 0));
+   BSON_ASSERT (_mongocrypt_cache_add_partition (&cache, "short/", 0, 1));
+
+   for (i = 0; i < 4; i++) {
+      bson_snprintf (name, sizeof (name), "small%d", (int) i);
+      _add_named_key (&cache, placeholder_keydoc, name);
+   }
+
+   /* A full partition evicts its own keys, not the others. */
+   for (i = 0; i < 10; i++) {
+      bson_snprintf (name, sizeof (name), "big/%d", (int) i);
+      _add_named_key (&cache, placeholder_keydoc, name);
+   }
+   BSON_ASSERT (_mongocrypt_cache_num_entries (&cache) == 6);
+   BSON_ASSERT (cache.partitions[0].num_pairs == 2);
+   for (i = 0; i < 4; i++) {
+      bson_snprintf (name, sizeof (name), "small%d", (int) i);
+      BSON_ASSERT (_has_named_key (&cache, name));
+   }
+   BSON_ASSERT (_has_named_key (&cache, "big/9"));
+   BSON_ASSERT (!_has_named_key (&cache, "big/0"));
+
+   /* A partition may expire its keys sooner. */
+   _add_named_key (&cache, placeholder_keydoc, "short/0");
+   BSON_ASSERT (cache.partitions[1].num_pairs == 1);
+   _usleep (1000 * 100);
+   BSON_ASSERT (!_has_named_key (&cache, "short/0"));
+   BSON_ASSERT (_has_named_key (&cache, "small0"));
+   _mongocrypt_cache_evict (&cache);
+   BSON_ASSERT (cache.partitions[1].num_pairs == 0);
+   BSON_ASSERT (_mongocrypt_cache_num_entries (&cache) == 6);
+
+   _mongocrypt_cache_cleanup (&cache);
+   _mongocrypt_key_destroy (placeholder_keydoc);
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (mongocrypt_setopt_key_cache_partition (crypt, "a/", -1, 2, 0),
+              crypt);
+   ASSERT_FAILS (mongocrypt_setopt_key_cache_partition (crypt, "a/", -1, 4, 0),
+                 crypt,
+                 "key cache partition already set");
+   mongocrypt_destroy (crypt);
+}
+
+
+/* Evicting checks the oldest pair of every partition, not only the oldest
+ * pair. */
+static void
+_test_cache_key_partitions_evict (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_cache_t cache;
+   _mongocrypt_key_doc_t *placeholder_keydoc;
+
+   placeholder_keydoc = _mongocrypt_key_new ();
+   _mongocrypt_cache_key_init (&cache);
+   _mongocrypt_cache_set_expiration (&cache, 1);
+   BSON_ASSERT (_mongocrypt_cache_add_partition (&cache, "long/", 0, 60000));
+   BSON_ASSERT (_mongocrypt_cache_add_partition (&cache, "short/", 0, 1));
+
+   /* The pair of the long partition is the oldest, and does not expire. */
+   _add_named_key (&cache, placeholder_keydoc, "long/0");
+   _add_named_key (&cache, placeholder_keydoc, "short/0");
+   _add_named_key (&cache, placeholder_keydoc, "none");
+   _usleep (1000 * 100);
+   _mongocrypt_cache_evict (&cache);
+   BSON_ASSERT (cache.partitions[0].num_pairs == 1);
+   BSON_ASSERT (cache.partitions[1].num_pairs == 0);
+   BSON_ASSERT (cache.num_pairs == 1);
+   BSON_ASSERT (cache.evictions == 2);
+   BSON_ASSERT (_has_named_key (&cache, "long/0"));
+
+   /* Nothing left has expired. */
+   _mongocrypt_cache_evict (&cache);
+   BSON_ASSERT (cache.evictions == 2);
+
+   _mongocrypt_cache_cleanup (&cache);
+   _mongocrypt_key_destroy (placeholder_keydoc);
+}
+
+
+/* A cache hit shares the cached key instead of copying it. */
+static void
+_test_cache_key_shared (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_cache_t cache;
+   mongocrypt_status_t *status;
+   _mongocrypt_key_doc_t *placeholder_keydoc;
+   _mongocrypt_cache_key_value_t *value, *hit1, *hit2;
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_key_alt_name_t *alt_names;
+   _mongocrypt_buffer_t buf;
+
+   status = mongocrypt_status_new ();
+   _mongocrypt_buffer_init (&buf);
+   _mongocrypt_buffer_resize (&buf, MONGOCRYPT_KEY_LEN);
+   memset (buf.data, 7, buf.len);
+   placeholder_keydoc = _mongocrypt_key_new ();
+   value = _mongocrypt_cache_key_value_new (placeholder_keydoc, &buf);
+   alt_names = _MONGOCRYPT_KEY_ALT_NAME_CREATE ("a");
+   attr = _mongocrypt_cache_key_attr_new (NULL /* id */, alt_names);
+
+   _mongocrypt_cache_key_init (&cache);
+   ASSERT_OR_PRINT (_mongocrypt_cache_add_copy (&cache, attr, value, status),
+                    status);
+   /* The cache holds its own reference. */
+   _mongocrypt_cache_key_value_destroy (value);
+
+   BSON_ASSERT (_mongocrypt_cache_get (&cache, attr, (void **) &hit1));
+   BSON_ASSERT (_mongocrypt_cache_get (&cache, attr, (void **) &hit2));
+   BSON_ASSERT (hit1 && hit1 == hit2);
+   BSON_ASSERT (hit1->decrypted_key_material.data[0] == 7);
+   _mongocrypt_cache_key_value_destroy (hit1);
+
+   /* A reference outlives the cache. */
+   _mongocrypt_cache_cleanup (&cache);
+   BSON_ASSERT (hit2->decrypted_key_material.data[0] == 7);
+   _mongocrypt_cache_key_value_destroy (hit2);
+
+   _mongocrypt_cache_key_attr_destroy (attr);
+   _mongocrypt_key_alt_name_destroy_all (alt_names);
+   _mongocrypt_buffer_cleanup (&buf);
+   _mongocrypt_key_destroy (placeholder_keydoc);
+   mongocrypt_status_destroy (status);
+}
+
+
+#define SLAB_TEST_SLOTS 100
+
+static void
+_test_cache_key_slab (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_key_slab_stats_t before, after;
+   _mongocrypt_key_doc_t *placeholder_keydoc;
+   _mongocrypt_cache_key_value_t *value;
+   _mongocrypt_buffer_t buf;
+   uint8_t *slots[SLAB_TEST_SLOTS];
+   uint8_t zeros[MONGOCRYPT_KEY_LEN] = {0};
+   int i, j;
+
+   _mongocrypt_key_slab_stats (&before);
+
+   /* Cached key material is copied into a slot. */
+   _mongocrypt_buffer_init (&buf);
+   _mongocrypt_buffer_resize (&buf, MONGOCRYPT_KEY_LEN);
+   memset (buf.data, 7, MONGOCRYPT_KEY_LEN);
+   placeholder_keydoc = _mongocrypt_key_new ();
+   value = _mongocrypt_cache_key_value_new (placeholder_keydoc, &buf);
+   BSON_ASSERT (!value->decrypted_key_material.owned);
+   BSON_ASSERT (value->decrypted_key_material.len == MONGOCRYPT_KEY_LEN);
+   BSON_ASSERT (0 == memcmp (value->decrypted_key_material.data,
+                             buf.data,
+                             MONGOCRYPT_KEY_LEN));
+   _mongocrypt_key_slab_stats (&after);
+   BSON_ASSERT (after.slots == before.slots + 1);
+   _mongocrypt_cache_key_value_destroy (value);
+   _mongocrypt_key_slab_stats (&after);
+   BSON_ASSERT (after.slots == before.slots);
+
+   /* Slots span pages, do not overlap, and are zeroed when reused. */
+   for (i = 0; i < SLAB_TEST_SLOTS; i++) {
+      slots[i] = _mongocrypt_key_slab_alloc ();
+      BSON_ASSERT (0 == memcmp (slots[i], zeros, MONGOCRYPT_KEY_LEN));
+      memset (slots[i], i + 1, MONGOCRYPT_KEY_LEN);
+   }
+   _mongocrypt_key_slab_stats (&after);
+   BSON_ASSERT (after.slots == before.slots + SLAB_TEST_SLOTS);
+   BSON_ASSERT (after.pages > before.pages);
+   BSON_ASSERT (after.locked_pages <= after.pages);
+   for (i = 0; i < SLAB_TEST_SLOTS; i++) {
+      for (j = 0; j < MONGOCRYPT_KEY_LEN; j++) {
+         BSON_ASSERT (slots[i][j] == (uint8_t) (i + 1));
+      }
+   }
+   for (i = 0; i < SLAB_TEST_SLOTS; i++) {
+      _mongocrypt_key_slab_free (slots[i]);
+   }
+   _mongocrypt_key_slab_free (NULL);
+
+   /* At most one empty page is kept. */
+   _mongocrypt_key_slab_stats (&after);
+   BSON_ASSERT (after.slots == before.slots);
+   BSON_ASSERT (after.pages <= before.pages + 1);
+
+   slots[0] = _mongocrypt_key_slab_alloc ();
+   BSON_ASSERT (0 == memcmp (slots[0], zeros, MONGOCRYPT_KEY_LEN));
+   _mongocrypt_key_slab_free (slots[0]);
+
+   _mongocrypt_key_destroy (placeholder_keydoc);
+   _mongocrypt_buffer_cleanup (&buf);
+}
+
+
 void
 _mongocrypt_tester_install_cache (_mongocrypt_tester_t *tester)
 {
    INSTALL_TEST (_test_cache);
    INSTALL_TEST (_test_cache_expiration);
+   INSTALL_TEST (_test_cache_maintain);
+   INSTALL_TEST (_test_cache_trim);
    INSTALL_TEST (_test_cache_duplicates);
-}
\ No newline at end of file
+   INSTALL_TEST (_test_cache_key_shared);
+   INSTALL_TEST (_test_cache_key_partitions);
+   INSTALL_TEST (_test_cache_key_partitions_evict);
+   INSTALL_TEST (_test_cache_many_entries);
+   INSTALL_TEST (_test_cache_max_entries);
+   INSTALL_TEST (_test_cache_adaptive);
+   INSTALL_TEST (_test_cache_refresh_window);
+   INSTALL_TEST (_test_cache_key_slab);
+}
@@ -16,6 +16,7 @@
 
 #include "mongocrypt-private.h"
 #include "mongocrypt-ciphertext-private.h"
+#include "mongocrypt-compress-private.h"
 #include "mongocrypt-crypto-private.h"
 #include "mongocrypt-marking-private.h"
 
@@ -68,6 +69,36 @@ _test_ciphertext_serialization (_mongocrypt_tester_t *tester)
 }
 
 
+/* Writing the data into reserved space matches serializing it. */
+static void
+_test_ciphertext_reserve (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_ciphertext_t ciphertext;
+   _mongocrypt_buffer_t serialized;
+   char *expected = "\x01\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0A\x0B\x0C"
+                    "\x0D\x0E\x0F\x02\x00\x01";
+
+   _mongocrypt_ciphertext_init (&ciphertext);
+   _mongocrypt_buffer_init (&serialized);
+
+   ciphertext.blob_subtype = 1;
+   ciphertext.original_bson_type = 2;
+   _mongocrypt_tester_fill_buffer (&ciphertext.key_id, 16);
+
+   BSON_ASSERT (_mongocrypt_ciphertext_reserve (&ciphertext, 2, &serialized));
+   BSON_ASSERT (serialized.len == 20);
+   BSON_ASSERT (ciphertext.data.len == 2);
+   BSON_ASSERT (!ciphertext.data.owned);
+   BSON_ASSERT (ciphertext.data.data == serialized.data + 18);
+   ciphertext.data.data[0] = 0;
+   ciphertext.data.data[1] = 1;
+   BSON_ASSERT (0 == memcmp (expected, serialized.data, serialized.len));
+
+   _mongocrypt_ciphertext_cleanup (&ciphertext);
+   _mongocrypt_buffer_cleanup (&serialized);
+}
+
+
 static void
 _test_malformed_ciphertext (_mongocrypt_tester_t *tester)
 {
@@ -249,11 +280,52 @@ _test_ciphertext_serialize_associated_data (_mongocrypt_tester_t *tester)
 }
 
 
+static void
+_test_compress (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_buffer_t in, compressed, out;
+   mongocrypt_status_t *status;
+   uint32_t i;
+
+   status = mongocrypt_status_new ();
+
+   /* Repetitive data, with matches that overlap themselves. */
+   _mongocrypt_buffer_init (&in);
+   _mongocrypt_buffer_resize (&in, 1000);
+   for (i = 0; i < in.len; i++) {
+      in.data[i] = (uint8_t) ("abcabcx"[i % 7] + (i % 91 == 0));
+   }
+   BSON_ASSERT (_mongocrypt_compress (&in, &compressed));
+   BSON_ASSERT (compressed.len < in.len / 4);
+   ASSERT_OR_PRINT (_mongocrypt_decompress (&compressed, &out, status),
+                    status);
+   BSON_ASSERT (0 == _mongocrypt_buffer_cmp (&in, &out));
+   _mongocrypt_buffer_cleanup (&out);
+
+   /* A truncated value is rejected. */
+   compressed.len--;
+   BSON_ASSERT (!_mongocrypt_decompress (&compressed, &out, status));
+   ASSERT_STATUS_CONTAINS (status, "malformed compressed value");
+   _mongocrypt_buffer_cleanup (&compressed);
+   _mongocrypt_buffer_cleanup (&in);
+
+   /* Data that does not get smaller is not compressed. */
+   _mongocrypt_tester_fill_buffer (&in, 64);
+   BSON_ASSERT (!_mongocrypt_compress (&in, &compressed));
+   BSON_ASSERT (_mongocrypt_buffer_empty (&compressed));
+   _mongocrypt_buffer_cleanup (&in);
+
+   mongocrypt_status_destroy (status);
+}
+
+
 void
 _mongocrypt_tester_install_ciphertext (_mongocrypt_tester_t *tester)
 {
    INSTALL_TEST (_test_malformed_ciphertext);
    INSTALL_TEST (_test_ciphertext_serialization);
+   INSTALL_TEST (_test_ciphertext_reserve);
    INSTALL_TEST (_test_ciphertext_algorithm);
    INSTALL_TEST (_test_ciphertext_serialize_associated_data);
+   INSTALL_TEST (_test_compress);
 }
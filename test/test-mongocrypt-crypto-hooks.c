@@ -245,6 +245,56 @@ _sign_rsaes_pkcs1_v1_5 (void *ctx,
    return true;
 }
 
+static bool
+_hmac_sha_512_init (void *ctx,
+                    mongocrypt_binary_t *key,
+                    void **hmac_ctx,
+                    mongocrypt_status_t *status)
+{
+   BSON_ASSERT (0 == strncmp ("error_on:", (char *) ctx, strlen ("error_on:")));
+   bson_string_append_printf (call_history, "call:%s\n", BSON_FUNC);
+   _append_bin ("key", key);
+   *hmac_ctx = bson_strdup ("hmac_ctx");
+   return true;
+}
+
+static bool
+_hmac_sha_512_update (void *ctx,
+                      void *hmac_ctx,
+                      mongocrypt_binary_t *in,
+                      mongocrypt_status_t *status)
+{
+   BSON_ASSERT (0 == strcmp ("hmac_ctx", (char *) hmac_ctx));
+   _append_bin ("in", in);
+   if (0 == strcmp ((char *) ctx, "error_on:hmac_sha512_update")) {
+      mongocrypt_status_set (
+         status, MONGOCRYPT_STATUS_ERROR_CLIENT, 1, (char *) ctx, -1);
+      return false;
+   }
+   return true;
+}
+
+static bool
+_hmac_sha_512_final (void *ctx,
+                     void *hmac_ctx,
+                     mongocrypt_binary_t *out,
+                     mongocrypt_status_t *status)
+{
+   _mongocrypt_buffer_t tmp;
+
+   BSON_ASSERT (0 == strcmp ("hmac_ctx", (char *) hmac_ctx));
+   bson_free (hmac_ctx);
+   if (!out) {
+      bson_string_append_printf (call_history, "abandon:%s\n", BSON_FUNC);
+      return true;
+   }
+   bson_string_append_printf (call_history, "ret:%s\n", BSON_FUNC);
+   _mongocrypt_buffer_copy_from_hex (&tmp, HMAC_HEX);
+   memcpy (out->data, tmp.data, tmp.len);
+   _mongocrypt_buffer_cleanup (&tmp);
+   return true;
+}
+
 static mongocrypt_t *
 _create_mongocrypt (_mongocrypt_tester_t *tester, const char *error_on)
 {
@@ -314,6 +364,7 @@ _test_crypto_hooks_encryption_helper (_mongocrypt_tester_t *tester,
                                     &iv,
                                     &associated_data,
                                     &key,
+                                    NULL /* native key */,
                                     &plaintext,
                                     &ciphertext,
                                     &bytes_written,
@@ -398,6 +449,7 @@ _test_crypto_hooks_decryption_helper (_mongocrypt_tester_t *tester,
    ret = _mongocrypt_do_decryption (crypt->crypto,
                                     &associated_data,
                                     &key,
+                                    NULL /* native key */,
                                     &ciphertext,
                                     &plaintext,
                                     &bytes_written,
@@ -461,7 +513,13 @@ _test_crypto_hooks_iv_gen_helper (_mongocrypt_tester_t *tester, char *error_on)
    call_history = bson_string_new (NULL);
 
    ret = _mongocrypt_calculate_deterministic_iv (
-      crypt->crypto, &key, &plaintext, &associated_data, &iv, status);
+      crypt->crypto,
+      &key,
+      NULL /* native key */,
+      &plaintext,
+      &associated_data,
+      &iv,
+      status);
 
    if (0 == strcmp (error_on, "error_on:none")) {
       ASSERT_OK_STATUS (ret, status);
@@ -493,6 +551,111 @@ _test_crypto_hooks_iv_gen (_mongocrypt_tester_t *tester)
 }
 
 
+static void
+_test_crypto_hooks_iv_gen_incremental_helper (_mongocrypt_tester_t *tester,
+                                              const char *error_on)
+{
+   mongocrypt_t *crypt;
+   bool ret;
+   mongocrypt_status_t *status;
+   _mongocrypt_buffer_t associated_data, key, plaintext, iv;
+   char *expected_iv = bson_strndup (HMAC_HEX_TAG, 16 * 2);
+   /* Each input is passed separately, instead of concatenated. */
+   const char *expected_call_history = "call:_hmac_sha_512_init\n"
+                                       "key:" IV_KEY_HEX "\n"
+                                       "in:AAAA\n"
+                                       "in:0000000000000010\n"
+                                       "in:BBBB\n"
+                                       "ret:_hmac_sha_512_final\n";
+
+   status = mongocrypt_status_new ();
+   crypt = mongocrypt_new ();
+   ASSERT_OK (mongocrypt_setopt_crypto_hooks (crypt,
+                                              _aes_256_cbc_encrypt,
+                                              _aes_256_cbc_decrypt,
+                                              _random,
+                                              _hmac_sha_512,
+                                              _hmac_sha_256,
+                                              _sha_256,
+                                              (void *) error_on),
+              crypt);
+   ASSERT_OK (mongocrypt_setopt_crypto_hook_hmac_sha_512_incremental (
+                 crypt,
+                 _hmac_sha_512_init,
+                 _hmac_sha_512_update,
+                 _hmac_sha_512_final),
+              crypt);
+   ASSERT_FAILS (mongocrypt_setopt_crypto_hook_hmac_sha_512_incremental (
+                    crypt,
+                    _hmac_sha_512_init,
+                    _hmac_sha_512_update,
+                    _hmac_sha_512_final),
+                 crypt,
+                 "already set");
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+
+   _mongocrypt_buffer_copy_from_hex (&associated_data, "AAAA");
+   _mongocrypt_buffer_copy_from_hex (&key, KEY_HEX);
+   _mongocrypt_buffer_copy_from_hex (&plaintext, "BBBB");
+
+   _mongocrypt_buffer_init (&iv);
+   _mongocrypt_buffer_resize (&iv, MONGOCRYPT_IV_LEN);
+
+   call_history = bson_string_new (NULL);
+
+   ret = _mongocrypt_calculate_deterministic_iv (crypt->crypto,
+                                                 &key,
+                                                 NULL /* native key */,
+                                                 &plaintext,
+                                                 &associated_data,
+                                                 &iv,
+                                                 status);
+
+   if (0 == strcmp (error_on, "error_on:none")) {
+      ASSERT_OK_STATUS (ret, status);
+      ASSERT_STREQUAL (call_history->str, expected_call_history);
+      BSON_ASSERT (0 == _mongocrypt_buffer_cmp_hex (&iv, expected_iv));
+   } else {
+      ASSERT_FAILS_STATUS (ret, status, error_on);
+      /* The final hook is still called to release the HMAC state. */
+      BSON_ASSERT (strstr (call_history->str, "abandon:_hmac_sha_512_final"));
+   }
+
+   bson_free (expected_iv);
+   _mongocrypt_buffer_cleanup (&key);
+   _mongocrypt_buffer_cleanup (&associated_data);
+   _mongocrypt_buffer_cleanup (&plaintext);
+   _mongocrypt_buffer_cleanup (&iv);
+   mongocrypt_status_destroy (status);
+   mongocrypt_destroy (crypt);
+   bson_string_free (call_history, true);
+}
+
+static void
+_test_crypto_hooks_iv_gen_incremental (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+
+   _test_crypto_hooks_iv_gen_incremental_helper (tester, "error_on:none");
+   _test_crypto_hooks_iv_gen_incremental_helper (
+      tester, "error_on:hmac_sha512_update");
+
+   /* The incremental hooks extend the crypto hooks. */
+   crypt = mongocrypt_new ();
+   ASSERT_FAILS (mongocrypt_setopt_crypto_hook_hmac_sha_512_incremental (
+                    crypt,
+                    _hmac_sha_512_init,
+                    _hmac_sha_512_update,
+                    _hmac_sha_512_final),
+                 crypt,
+                 "crypto_hooks must be set first");
+   mongocrypt_destroy (crypt);
+}
+
+
 static void
 _test_crypto_hooks_random_helper (_mongocrypt_tester_t *tester,
                                   const char *error_on)
@@ -720,12 +883,535 @@ _test_crypto_hook_sign_rsaes_pkcs1_v1_5 (_mongocrypt_tester_t *tester)
    bson_string_free (call_history, true);
 }
 
+static bool
+_crypto_batch (void *ctx,
+               mongocrypt_crypto_job_t **jobs,
+               uint32_t count,
+               mongocrypt_status_t *status)
+{
+   _mongocrypt_buffer_t tmp;
+   uint32_t i;
+
+   BSON_ASSERT (0 == strncmp ("error_on:", (char *) ctx, strlen ("error_on:")));
+   bson_string_append_printf (call_history, "call:%s:%d\n", BSON_FUNC, count);
+   for (i = 0; i < count; i++) {
+      mongocrypt_crypto_job_t *job = jobs[i];
+      mongocrypt_binary_t *in = mongocrypt_crypto_job_in (job);
+      mongocrypt_binary_t *out = mongocrypt_crypto_job_out (job);
+
+      bson_string_append_printf (
+         call_history, "type:%d\n", (int) mongocrypt_crypto_job_type (job));
+      _append_bin ("key", mongocrypt_crypto_job_key (job));
+      if (mongocrypt_crypto_job_type (job) ==
+          MONGOCRYPT_CRYPTO_JOB_HMAC_SHA_512) {
+         BSON_ASSERT (!mongocrypt_crypto_job_iv (job));
+         _append_bin ("in", in);
+         _mongocrypt_buffer_copy_from_hex (&tmp, HMAC_HEX);
+         BSON_ASSERT (out->len == tmp.len);
+         memcpy (out->data, tmp.data, tmp.len);
+         _mongocrypt_buffer_cleanup (&tmp);
+      } else {
+         _append_bin ("iv", mongocrypt_crypto_job_iv (job));
+         _append_bin ("in", in);
+         /* copy it directly, don't encrypt or decrypt. */
+         BSON_ASSERT (out->len >= in->len);
+         memcpy (out->data, in->data, in->len);
+         mongocrypt_crypto_job_set_bytes_written (job, in->len);
+      }
+   }
+   bson_string_append_printf (call_history, "ret:%s\n", BSON_FUNC);
+   if (0 == strcmp ((char *) ctx, "error_on:crypto_batch")) {
+      mongocrypt_status_set (
+         status, MONGOCRYPT_STATUS_ERROR_CLIENT, 1, (char *) ctx, -1);
+      return false;
+   }
+   return true;
+}
+
+
+static void
+_test_crypto_hooks_batch_encryption_helper (_mongocrypt_tester_t *tester,
+                                            const char *error_on)
+{
+   mongocrypt_t *crypt;
+   bool ret;
+   mongocrypt_status_t *status;
+   _mongocrypt_encryption_job_t jobs[2];
+   _mongocrypt_buffer_t ciphertexts[2];
+   int i;
+   /* The deterministic IV is the truncated HMAC. */
+   const char *expected_call_history =
+      "call:_crypto_batch:1\n"
+      "type:3\n"
+      "key:" IV_KEY_HEX "\n"
+      "in:AAAA0000000000000010BBBB\n"
+      "ret:_crypto_batch\n"
+      "call:_crypto_batch:2\n"
+      "type:1\n"
+      "key:" ENCRYPTION_KEY_HEX "\n"
+      "iv:60676DE9FD305FD2C0815763C4226872\n"
+      "in:BBBB0E0E0E0E0E0E0E0E0E0E0E0E0E0E\n"
+      "type:1\n"
+      "key:" ENCRYPTION_KEY_HEX "\n"
+      "iv:" IV_HEX "\n"
+      "in:CCCC0E0E0E0E0E0E0E0E0E0E0E0E0E0E\n"
+      "ret:_crypto_batch\n"
+      "call:_crypto_batch:2\n"
+      "type:3\n"
+      "key:" HMAC_KEY_HEX "\n"
+      "in:AAAA60676DE9FD305FD2C0815763C4226872"
+      "BBBB0E0E0E0E0E0E0E0E0E0E0E0E0E0E0000000000000010\n"
+      "type:3\n"
+      "key:" HMAC_KEY_HEX "\n"
+      "in:AAAA" IV_HEX "CCCC0E0E0E0E0E0E0E0E0E0E0E0E0E0E0000000000000010\n"
+      "ret:_crypto_batch\n";
+
+   status = mongocrypt_status_new ();
+   crypt = _create_mongocrypt (tester, error_on);
+   ASSERT_FAILS (mongocrypt_setopt_crypto_hook_batch (crypt, _crypto_batch),
+                 crypt,
+                 "options cannot be set after initialization");
+   /* Set it directly, as mongocrypt_init was called. */
+   crypt->crypto->batch = _crypto_batch;
+
+   for (i = 0; i < 2; i++) {
+      _mongocrypt_encryption_job_init (&jobs[i]);
+      _mongocrypt_buffer_copy_from_hex (&jobs[i].key, KEY_HEX);
+      _mongocrypt_buffer_copy_from_hex (&jobs[i].associated_data, "AAAA");
+      _mongocrypt_buffer_init (&ciphertexts[i]);
+      jobs[i].ciphertext = &ciphertexts[i];
+   }
+   jobs[0].deterministic = true;
+   _mongocrypt_buffer_resize (&jobs[0].iv, MONGOCRYPT_IV_LEN);
+   _mongocrypt_buffer_copy_from_hex (&jobs[0].plaintext, "BBBB");
+   _mongocrypt_buffer_copy_from_hex (&jobs[1].iv, IV_HEX);
+   _mongocrypt_buffer_copy_from_hex (&jobs[1].plaintext, "CCCC");
+   for (i = 0; i < 2; i++) {
+      _mongocrypt_buffer_resize (
+         &ciphertexts[i],
+         _mongocrypt_calculate_ciphertext_len (jobs[i].plaintext.len));
+   }
+
+   call_history = bson_string_new (NULL);
+
+   ret = _mongocrypt_do_encryption_batch (crypt->crypto, jobs, 2, status);
+
+   if (0 == strcmp (error_on, "error_on:none")) {
+      ASSERT_OK_STATUS (ret, status);
+
+      /* Check the full trace. The per-operation hooks are not called. */
+      ASSERT_STREQUAL (call_history->str, expected_call_history);
+
+      BSON_ASSERT (0 == _mongocrypt_buffer_cmp_hex (
+                           &ciphertexts[0],
+                           "60676DE9FD305FD2C0815763C4226872"
+                           "BBBB0E0E0E0E0E0E0E0E0E0E0E0E0E0E" HMAC_HEX_TAG));
+      BSON_ASSERT (0 == _mongocrypt_buffer_cmp_hex (
+                           &ciphertexts[1],
+                           IV_HEX "CCCC0E0E0E0E0E0E0E0E0E0E0E0E0E0E"
+                                  HMAC_HEX_TAG));
+   } else {
+      ASSERT_FAILS_STATUS (ret, status, error_on);
+   }
+
+   for (i = 0; i < 2; i++) {
+      _mongocrypt_encryption_job_cleanup (&jobs[i]);
+      _mongocrypt_buffer_cleanup (&ciphertexts[i]);
+   }
+   mongocrypt_status_destroy (status);
+   mongocrypt_destroy (crypt);
+   bson_string_free (call_history, true);
+}
+
+
+static void
+_test_crypto_hooks_batch_encryption (_mongocrypt_tester_t *tester)
+{
+   _test_crypto_hooks_batch_encryption_helper (tester, "error_on:none");
+   _test_crypto_hooks_batch_encryption_helper (tester,
+                                               "error_on:crypto_batch");
+}
+
+
+static void
+_test_crypto_hooks_batch_decryption_helper (_mongocrypt_tester_t *tester,
+                                            const char *error_on,
+                                            const char *ciphertext_hex,
+                                            const char *expected_error)
+{
+   mongocrypt_t *crypt;
+   bool ret;
+   mongocrypt_status_t *status;
+   _mongocrypt_decryption_job_t jobs[2];
+   int i;
+   /* The HMAC and decryption of both values in one call. */
+   const char *expected_call_history =
+      "call:_crypto_batch:4\n"
+      "type:3\n"
+      "key:" HMAC_KEY_HEX "\n"
+      "in:AAAA" IV_HEX "BBBB0E0E0E0E0E0E0E0E0E0E0E0E0E0E0000000000000010\n"
+      "type:2\n"
+      "key:" ENCRYPTION_KEY_HEX "\n"
+      "iv:" IV_HEX "\n"
+      "in:BBBB0E0E0E0E0E0E0E0E0E0E0E0E0E0E\n"
+      "type:3\n"
+      "key:" HMAC_KEY_HEX "\n"
+      "in:AAAA" IV_HEX "BBBB0E0E0E0E0E0E0E0E0E0E0E0E0E0E0000000000000010\n"
+      "type:2\n"
+      "key:" ENCRYPTION_KEY_HEX "\n"
+      "iv:" IV_HEX "\n"
+      "in:BBBB0E0E0E0E0E0E0E0E0E0E0E0E0E0E\n"
+      "ret:_crypto_batch\n";
+
+   status = mongocrypt_status_new ();
+   crypt = _create_mongocrypt (tester, error_on);
+   crypt->crypto->batch = _crypto_batch;
+
+   for (i = 0; i < 2; i++) {
+      _mongocrypt_decryption_job_init (&jobs[i]);
+      _mongocrypt_buffer_copy_from_hex (&jobs[i].key, KEY_HEX);
+      _mongocrypt_buffer_copy_from_hex (&jobs[i].associated_data, "AAAA");
+      _mongocrypt_buffer_copy_from_hex (
+         &jobs[i].ciphertext,
+         IV_HEX "BBBB0E0E0E0E0E0E0E0E0E0E0E0E0E0E" HMAC_HEX_TAG);
+      _mongocrypt_buffer_resize (
+         &jobs[i].plaintext,
+         _mongocrypt_calculate_plaintext_len (jobs[i].ciphertext.len));
+   }
+   /* The second value may have a bad tag. */
+   _mongocrypt_buffer_cleanup (&jobs[1].ciphertext);
+   _mongocrypt_buffer_copy_from_hex (&jobs[1].ciphertext, ciphertext_hex);
+
+   call_history = bson_string_new (NULL);
+
+   ret = _mongocrypt_do_decryption_batch (crypt->crypto, jobs, 2, status);
+
+   if (!expected_error) {
+      ASSERT_OK_STATUS (ret, status);
+      ASSERT_STREQUAL (call_history->str, expected_call_history);
+      for (i = 0; i < 2; i++) {
+         jobs[i].plaintext.len = jobs[i].bytes_written;
+         BSON_ASSERT (
+            0 == _mongocrypt_buffer_cmp_hex (&jobs[i].plaintext, "BBBB"));
+      }
+   } else {
+      ASSERT_FAILS_STATUS (ret, status, expected_error);
+      /* No plaintext is released. */
+      for (i = 0; i < 2; i++) {
+         BSON_ASSERT (jobs[i].bytes_written == 0);
+         BSON_ASSERT (jobs[i].plaintext.data[0] == 0);
+      }
+   }
+
+   for (i = 0; i < 2; i++) {
+      _mongocrypt_decryption_job_cleanup (&jobs[i]);
+   }
+   mongocrypt_status_destroy (status);
+   mongocrypt_destroy (crypt);
+   bson_string_free (call_history, true);
+}
+
+
+static void
+_test_crypto_hooks_batch_decryption (_mongocrypt_tester_t *tester)
+{
+   const char *valid =
+      IV_HEX "BBBB0E0E0E0E0E0E0E0E0E0E0E0E0E0E" HMAC_HEX_TAG;
+   const char *bad_tag =
+      IV_HEX "BBBB0E0E0E0E0E0E0E0E0E0E0E0E0E0E"
+             "00000000000000000000000000000000"
+             "00000000000000000000000000000000";
+
+   _test_crypto_hooks_batch_decryption_helper (
+      tester, "error_on:none", valid, NULL);
+   _test_crypto_hooks_batch_decryption_helper (
+      tester, "error_on:crypto_batch", valid, "error_on:crypto_batch");
+   _test_crypto_hooks_batch_decryption_helper (
+      tester, "error_on:none", bad_tag, "HMAC validation failure");
+}
+
+
+static void
+_test_crypto_hooks_batch_setopt (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+
+   crypt = mongocrypt_new ();
+   ASSERT_FAILS (mongocrypt_setopt_crypto_hook_batch (crypt, _crypto_batch),
+                 crypt,
+                 "crypto_hooks must be set first");
+   mongocrypt_destroy (crypt);
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (mongocrypt_setopt_crypto_hooks (crypt,
+                                              _aes_256_cbc_encrypt,
+                                              _aes_256_cbc_decrypt,
+                                              _random,
+                                              _hmac_sha_512,
+                                              _hmac_sha_256,
+                                              _sha_256,
+                                              (void *) "error_on:none"),
+              crypt);
+   ASSERT_FAILS (mongocrypt_setopt_crypto_hook_batch (crypt, NULL),
+                 crypt,
+                 "batch crypto hook must be set");
+   ASSERT_OK (mongocrypt_setopt_crypto_hook_batch (crypt, _crypto_batch),
+              crypt);
+   ASSERT_FAILS (mongocrypt_setopt_crypto_hook_batch (crypt, _crypto_batch),
+                 crypt,
+                 "batch crypto hook already set");
+   mongocrypt_destroy (crypt);
+}
+
+
+static mongocrypt_t *
+_create_mongocrypt_with_policy (uint32_t native)
+{
+   mongocrypt_t *crypt;
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_crypto_hooks (crypt,
+                                              _aes_256_cbc_encrypt,
+                                              _aes_256_cbc_decrypt,
+                                              _random,
+                                              _hmac_sha_512,
+                                              _hmac_sha_256,
+                                              _sha_256,
+                                              (void *) "error_on:none"),
+              crypt);
+   ASSERT_OK (mongocrypt_setopt_crypto_hooks_policy (crypt, native), crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   return crypt;
+}
+
+
+static void
+_test_crypto_hooks_policy (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_status_t *status;
+   _mongocrypt_buffer_t iv, associated_data, key, plaintext, ciphertext;
+   _mongocrypt_buffer_t decrypted;
+   uint32_t bytes_written;
+
+   status = mongocrypt_status_new ();
+   _mongocrypt_buffer_copy_from_hex (&iv, IV_HEX);
+   _mongocrypt_buffer_copy_from_hex (&associated_data, "AAAA");
+   _mongocrypt_buffer_copy_from_hex (&key, KEY_HEX);
+   _mongocrypt_buffer_copy_from_hex (&plaintext, "BBBB");
+   _mongocrypt_buffer_init (&ciphertext);
+   _mongocrypt_buffer_resize (
+      &ciphertext, _mongocrypt_calculate_ciphertext_len (plaintext.len));
+
+   /* Only HMAC SHA-512 is native. AES still goes through the hook. */
+   crypt =
+      _create_mongocrypt_with_policy (MONGOCRYPT_CRYPTO_PRIMITIVE_HMAC_SHA_512);
+   call_history = bson_string_new (NULL);
+   ASSERT_OK_STATUS (_mongocrypt_do_encryption (crypt->crypto,
+                                                &iv,
+                                                &associated_data,
+                                                &key,
+                                                NULL /* native key */,
+                                                &plaintext,
+                                                &ciphertext,
+                                                &bytes_written,
+                                                status),
+                     status);
+   ASSERT_STREQUAL (call_history->str,
+                    "call:_aes_256_cbc_encrypt\n"
+                    "key:" ENCRYPTION_KEY_HEX "\n"
+                    "iv:" IV_HEX "\n"
+                    "in:BBBB0E0E0E0E0E0E0E0E0E0E0E0E0E0E\n"
+                    "ret:_aes_256_cbc_encrypt\n");
+   /* The tag is a real HMAC, not the one returned by the hook. */
+   BSON_ASSERT (0 != _mongocrypt_buffer_cmp_hex (
+                        &ciphertext,
+                        IV_HEX "BBBB0E0E0E0E0E0E0E0E0E0E0E0E0E0E"
+                               HMAC_HEX_TAG));
+   bson_string_free (call_history, true);
+   mongocrypt_destroy (crypt);
+
+   /* Everything is native. The hooks are never called. */
+   crypt = _create_mongocrypt_with_policy (MONGOCRYPT_CRYPTO_PRIMITIVE_ALL);
+   call_history = bson_string_new (NULL);
+   ASSERT_OK_STATUS (_mongocrypt_do_encryption (crypt->crypto,
+                                                &iv,
+                                                &associated_data,
+                                                &key,
+                                                NULL /* native key */,
+                                                &plaintext,
+                                                &ciphertext,
+                                                &bytes_written,
+                                                status),
+                     status);
+   _mongocrypt_buffer_init (&decrypted);
+   _mongocrypt_buffer_resize (
+      &decrypted, _mongocrypt_calculate_plaintext_len (ciphertext.len));
+   ASSERT_OK_STATUS (_mongocrypt_do_decryption (crypt->crypto,
+                                                &associated_data,
+                                                &key,
+                                                NULL /* native key */,
+                                                &ciphertext,
+                                                &decrypted,
+                                                &bytes_written,
+                                                status),
+                     status);
+   decrypted.len = bytes_written;
+   BSON_ASSERT (0 == _mongocrypt_buffer_cmp (&decrypted, &plaintext));
+   ASSERT_STREQUAL (call_history->str, "");
+   bson_string_free (call_history, true);
+   mongocrypt_destroy (crypt);
+
+   _mongocrypt_buffer_cleanup (&decrypted);
+   _mongocrypt_buffer_cleanup (&key);
+   _mongocrypt_buffer_cleanup (&iv);
+   _mongocrypt_buffer_cleanup (&associated_data);
+   _mongocrypt_buffer_cleanup (&plaintext);
+   _mongocrypt_buffer_cleanup (&ciphertext);
+   mongocrypt_status_destroy (status);
+}
+
+
+static void
+_test_crypto_hooks_policy_setopt (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+
+#ifdef MONGOCRYPT_ENABLE_CRYPTO
+   BSON_ASSERT (mongocrypt_is_crypto_available ());
+#else
+   BSON_ASSERT (!mongocrypt_is_crypto_available ());
+#endif
+
+   crypt = mongocrypt_new ();
+   ASSERT_FAILS (mongocrypt_setopt_crypto_hooks_policy (
+                    crypt, MONGOCRYPT_CRYPTO_PRIMITIVE_ALL),
+                 crypt,
+                 "crypto_hooks must be set first");
+   mongocrypt_destroy (crypt);
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (mongocrypt_setopt_crypto_hooks (crypt,
+                                              _aes_256_cbc_encrypt,
+                                              _aes_256_cbc_decrypt,
+                                              _random,
+                                              _hmac_sha_512,
+                                              _hmac_sha_256,
+                                              _sha_256,
+                                              (void *) "error_on:none"),
+              crypt);
+   ASSERT_FAILS (mongocrypt_setopt_crypto_hooks_policy (crypt, 1 << 10),
+                 crypt,
+                 "unrecognized crypto primitives");
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_assert_crypto_backend (mongocrypt_t *crypt,
+                        const char *primitive,
+                        const char *expected)
+{
+   mongocrypt_binary_t *stats;
+   bson_t as_bson;
+   bson_iter_t iter;
+   char *path;
+
+   stats = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_get_stats (crypt, stats), crypt);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (stats, &as_bson));
+   path = bson_strdup_printf ("crypto.%s", primitive);
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, path, &iter));
+   ASSERT_STREQUAL (bson_iter_utf8 (&iter, NULL), expected);
+   bson_free (path);
+   mongocrypt_binary_destroy (stats);
+}
+
+
+static void
+_test_crypto_self_benchmark (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+
+   crypt = mongocrypt_new ();
+   ASSERT_FAILS (mongocrypt_setopt_crypto_self_benchmark (crypt, true),
+                 crypt,
+                 "crypto_hooks must be set first");
+   mongocrypt_destroy (crypt);
+
+   /* Without the benchmark, the policy applies. */
+   crypt = _create_mongocrypt_with_policy (0);
+   _assert_crypto_backend (crypt, "aes256Cbc", "hooks");
+   _assert_crypto_backend (crypt, "hmacSha512", "hooks");
+   mongocrypt_destroy (crypt);
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_crypto_hooks (crypt,
+                                              _aes_256_cbc_encrypt,
+                                              _aes_256_cbc_decrypt,
+                                              _random,
+                                              _hmac_sha_512,
+                                              _hmac_sha_256,
+                                              _sha_256,
+                                              (void *) "error_on:none"),
+              crypt);
+   ASSERT_OK (mongocrypt_setopt_crypto_self_benchmark (crypt, true), crypt);
+   call_history = bson_string_new (NULL);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   BSON_ASSERT (strstr (call_history->str, "call:_aes_256_cbc_encrypt"));
+   BSON_ASSERT (strstr (call_history->str, "call:_hmac_sha_512"));
+   bson_string_free (call_history, true);
+
+   /* The test hooks do not encrypt, and return a fixed HMAC. Whatever their
+    * speed, the native backend replaces them. SHA-256 is not benchmarked. */
+   _assert_crypto_backend (crypt, "aes256Cbc", "native");
+   _assert_crypto_backend (crypt, "hmacSha512", "native");
+   _assert_crypto_backend (crypt, "sha256", "hooks");
+   mongocrypt_destroy (crypt);
+}
+
+
+#ifndef MONGOCRYPT_ENABLE_CRYPTO_HOOKS
+static void
+_test_crypto_hooks_disabled (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+
+   crypt = mongocrypt_new ();
+   ASSERT_FAILS (mongocrypt_setopt_crypto_hooks (crypt,
+                                                 _aes_256_cbc_encrypt,
+                                                 _aes_256_cbc_decrypt,
+                                                 _random,
+                                                 _hmac_sha_512,
+                                                 _hmac_sha_256,
+                                                 _sha_256,
+                                                 NULL),
+                 crypt,
+                 "crypto hooks disabled");
+   mongocrypt_destroy (crypt);
+}
+#endif
+
+
 void
 _mongocrypt_tester_install_crypto_hooks (_mongocrypt_tester_t *tester)
 {
+#ifndef MONGOCRYPT_ENABLE_CRYPTO_HOOKS
+   printf ("Skipping crypto hook tests – built without crypto hooks\n");
+   INSTALL_TEST (_test_crypto_hooks_disabled);
+   return;
+#endif
    INSTALL_TEST_CRYPTO (_test_crypto_hooks_encryption, CRYPTO_OPTIONAL);
    INSTALL_TEST_CRYPTO (_test_crypto_hooks_decryption, CRYPTO_OPTIONAL);
    INSTALL_TEST_CRYPTO (_test_crypto_hooks_iv_gen, CRYPTO_OPTIONAL);
+   INSTALL_TEST_CRYPTO (_test_crypto_hooks_iv_gen_incremental, CRYPTO_OPTIONAL);
    INSTALL_TEST_CRYPTO (_test_crypto_hooks_random, CRYPTO_OPTIONAL);
    INSTALL_TEST_CRYPTO (_test_kms_request, CRYPTO_OPTIONAL);
    INSTALL_TEST_CRYPTO (_test_crypto_hooks_unset, CRYPTO_PROHIBITED);
@@ -734,4 +1420,10 @@ _mongocrypt_tester_install_crypto_hooks (_mongocrypt_tester_t *tester)
                         CRYPTO_OPTIONAL);
    INSTALL_TEST_CRYPTO (_test_crypto_hook_sign_rsaes_pkcs1_v1_5,
                         CRYPTO_OPTIONAL);
+   INSTALL_TEST_CRYPTO (_test_crypto_hooks_batch_encryption, CRYPTO_OPTIONAL);
+   INSTALL_TEST_CRYPTO (_test_crypto_hooks_batch_decryption, CRYPTO_OPTIONAL);
+   INSTALL_TEST_CRYPTO (_test_crypto_hooks_batch_setopt, CRYPTO_OPTIONAL);
+   INSTALL_TEST_CRYPTO (_test_crypto_hooks_policy, CRYPTO_REQUIRED);
+   INSTALL_TEST_CRYPTO (_test_crypto_hooks_policy_setopt, CRYPTO_OPTIONAL);
+   INSTALL_TEST_CRYPTO (_test_crypto_self_benchmark, CRYPTO_REQUIRED);
 }
@@ -58,6 +58,7 @@ _test_roundtrip (_mongocrypt_tester_t *tester)
                                     &iv,
                                     &associated_data,
                                     &key,
+                                    NULL /* native key */,
                                     &plaintext,
                                     &ciphertext,
                                     &bytes_written,
@@ -69,6 +70,7 @@ _test_roundtrip (_mongocrypt_tester_t *tester)
    ret = _mongocrypt_do_decryption (crypt->crypto,
                                     &associated_data,
                                     &key,
+                                    NULL /* native key */,
                                     &ciphertext,
                                     &decrypted,
                                     &bytes_written,
@@ -93,6 +95,7 @@ _test_roundtrip (_mongocrypt_tester_t *tester)
    ret = _mongocrypt_do_decryption (crypt->crypto,
                                     &associated_data,
                                     &key,
+                                    NULL /* native key */,
                                     &ciphertext,
                                     &decrypted,
                                     &bytes_written,
@@ -107,6 +110,7 @@ _test_roundtrip (_mongocrypt_tester_t *tester)
    ret = _mongocrypt_do_decryption (crypt->crypto,
                                     &associated_data,
                                     &key,
+                                    NULL /* native key */,
                                     &ciphertext,
                                     &decrypted,
                                     &bytes_written,
@@ -118,6 +122,7 @@ _test_roundtrip (_mongocrypt_tester_t *tester)
    ret = _mongocrypt_do_decryption (crypt->crypto,
                                     &associated_data,
                                     &key,
+                                    NULL /* native key */,
                                     &ciphertext,
                                     &decrypted,
                                     &bytes_written,
@@ -134,6 +139,7 @@ _test_roundtrip (_mongocrypt_tester_t *tester)
    ret = _mongocrypt_do_decryption (crypt->crypto,
                                     &associated_data,
                                     &key,
+                                    NULL /* native key */,
                                     &ciphertext,
                                     &decrypted,
                                     &bytes_written,
@@ -151,6 +157,165 @@ _test_roundtrip (_mongocrypt_tester_t *tester)
 }
 
 
+/* Plaintexts shorter than two blocks are padded on the stack. Check lengths
+ * on both sides of that and of each block boundary. */
+static void
+_test_roundtrip_lengths (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_status_t *status;
+   _mongocrypt_buffer_t key = {0}, iv = {0}, plaintext = {0};
+   uint8_t plaintext_storage[48];
+   uint32_t len, i;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   status = mongocrypt_status_new ();
+   key.data = (uint8_t *) _mongocrypt_repeat_char ('k', MONGOCRYPT_KEY_LEN);
+   key.len = MONGOCRYPT_KEY_LEN;
+   key.owned = true;
+   iv.data = (uint8_t *) _mongocrypt_repeat_char ('i', MONGOCRYPT_IV_LEN);
+   iv.len = MONGOCRYPT_IV_LEN;
+   iv.owned = true;
+   for (i = 0; i < sizeof (plaintext_storage); i++) {
+      plaintext_storage[i] = (uint8_t) i;
+   }
+
+   for (len = 0; len <= sizeof (plaintext_storage); len++) {
+      _mongocrypt_buffer_t ciphertext = {0}, decrypted = {0};
+      uint32_t bytes_written;
+
+      plaintext.data = plaintext_storage;
+      plaintext.len = len;
+      _mongocrypt_buffer_resize (&ciphertext,
+                                 _mongocrypt_calculate_ciphertext_len (len));
+      ASSERT_OR_PRINT (_mongocrypt_do_encryption (crypt->crypto,
+                                                  &iv,
+                                                  NULL /* associated data */,
+                                                  &key,
+                                                  NULL /* native key */,
+                                                  &plaintext,
+                                                  &ciphertext,
+                                                  &bytes_written,
+                                                  status),
+                       status);
+      BSON_ASSERT (bytes_written == ciphertext.len);
+
+      _mongocrypt_buffer_resize (
+         &decrypted, _mongocrypt_calculate_plaintext_len (ciphertext.len));
+      ASSERT_OR_PRINT (_mongocrypt_do_decryption (crypt->crypto,
+                                                  NULL /* associated data */,
+                                                  &key,
+                                                  NULL /* native key */,
+                                                  &ciphertext,
+                                                  &decrypted,
+                                                  &bytes_written,
+                                                  status),
+                       status);
+      BSON_ASSERT (bytes_written == len);
+      BSON_ASSERT (0 == memcmp (decrypted.data, plaintext_storage, len));
+
+      _mongocrypt_buffer_cleanup (&decrypted);
+      _mongocrypt_buffer_cleanup (&ciphertext);
+   }
+
+   mongocrypt_status_destroy (status);
+   _mongocrypt_buffer_cleanup (&key);
+   _mongocrypt_buffer_cleanup (&iv);
+   mongocrypt_destroy (crypt);
+}
+
+
+/* Values encrypted together, with their AES blocks interleaved, must match
+ * values encrypted one at a time. */
+static void
+_test_encryption_multi_buffer (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_status_t *status;
+   _mongocrypt_buffer_t keys[2];
+   _native_crypto_key_t *native_keys[2];
+   _mongocrypt_encryption_job_t jobs[19];
+   _mongocrypt_buffer_t ciphertexts[19];
+   uint8_t plaintext_storage[70];
+   uint32_t i, n_jobs;
+
+   n_jobs = (uint32_t) (sizeof (jobs) / sizeof (jobs[0]));
+   crypt = _mongocrypt_tester_mongocrypt ();
+   if (!_mongocrypt_crypto_uses_multi_buffer (crypt->crypto)) {
+      mongocrypt_destroy (crypt);
+      return;
+   }
+   status = mongocrypt_status_new ();
+   for (i = 0; i < 2; i++) {
+      _mongocrypt_buffer_init (&keys[i]);
+      keys[i].data =
+         (uint8_t *) _mongocrypt_repeat_char ((char) ('a' + i),
+                                              MONGOCRYPT_KEY_LEN);
+      keys[i].len = MONGOCRYPT_KEY_LEN;
+      keys[i].owned = true;
+      native_keys[i] = _native_crypto_key_new (&keys[i]);
+      BSON_ASSERT (native_keys[i]);
+   }
+   for (i = 0; i < sizeof (plaintext_storage); i++) {
+      plaintext_storage[i] = (uint8_t) i;
+   }
+
+   for (i = 0; i < n_jobs; i++) {
+      _mongocrypt_encryption_job_t *job = &jobs[i];
+
+      _mongocrypt_encryption_job_init (job);
+      _mongocrypt_buffer_set_to (&keys[i % 2], &job->key);
+      job->native_key = native_keys[i % 2];
+      job->deterministic = i % 3 == 0;
+      _mongocrypt_buffer_resize (&job->iv, MONGOCRYPT_IV_LEN);
+      memset (job->iv.data, (int) i, MONGOCRYPT_IV_LEN);
+      job->associated_data.data = plaintext_storage;
+      job->associated_data.len = 18;
+      job->plaintext.data = plaintext_storage;
+      job->plaintext.len = (i * 7) % sizeof (plaintext_storage);
+      _mongocrypt_buffer_init (&ciphertexts[i]);
+      _mongocrypt_buffer_resize (
+         &ciphertexts[i],
+         _mongocrypt_calculate_ciphertext_len (job->plaintext.len));
+      job->ciphertext = &ciphertexts[i];
+   }
+
+   ASSERT_OK_STATUS (
+      _mongocrypt_do_encryption_batch (crypt->crypto, jobs, n_jobs, status),
+      status);
+
+   for (i = 0; i < n_jobs; i++) {
+      _mongocrypt_buffer_t expected;
+      uint32_t bytes_written;
+
+      _mongocrypt_buffer_init (&expected);
+      _mongocrypt_buffer_resize (&expected, ciphertexts[i].len);
+      /* The batch set deterministic IVs, so reuse the IV of each job. */
+      ASSERT_OK_STATUS (_mongocrypt_do_encryption (crypt->crypto,
+                                                   &jobs[i].iv,
+                                                   &jobs[i].associated_data,
+                                                   &jobs[i].key,
+                                                   NULL /* native key */,
+                                                   &jobs[i].plaintext,
+                                                   &expected,
+                                                   &bytes_written,
+                                                   status),
+                        status);
+      BSON_ASSERT (0 == _mongocrypt_buffer_cmp (&expected, &ciphertexts[i]));
+      _mongocrypt_buffer_cleanup (&expected);
+      _mongocrypt_buffer_cleanup (&ciphertexts[i]);
+      _mongocrypt_encryption_job_cleanup (&jobs[i]);
+   }
+
+   for (i = 0; i < 2; i++) {
+      _native_crypto_key_destroy (native_keys[i]);
+      _mongocrypt_buffer_cleanup (&keys[i]);
+   }
+   mongocrypt_status_destroy (status);
+   mongocrypt_destroy (crypt);
+}
+
+
 /* From [MCGREW], see comment at the top of this file. */
 static void
 _test_mcgrew (_mongocrypt_tester_t *tester)
@@ -158,7 +323,8 @@ _test_mcgrew (_mongocrypt_tester_t *tester)
    mongocrypt_t *crypt;
    mongocrypt_status_t *status;
    _mongocrypt_buffer_t key, iv, associated_data, plaintext,
-      ciphertext_expected, ciphertext_actual;
+      ciphertext_expected, ciphertext_actual, decrypted;
+   _native_crypto_key_t *native_key;
    uint32_t bytes_written;
    bool ret;
 
@@ -205,6 +371,7 @@ _test_mcgrew (_mongocrypt_tester_t *tester)
                                     &iv,
                                     &associated_data,
                                     &key,
+                                    NULL /* native key */,
                                     &plaintext,
                                     &ciphertext_actual,
                                     &bytes_written,
@@ -215,6 +382,62 @@ _test_mcgrew (_mongocrypt_tester_t *tester)
                              ciphertext_expected.data,
                              ciphertext_actual.len));
 
+   /* A prepared key must produce the same ciphertext, including when reused.
+    */
+   native_key = _native_crypto_key_new (&key);
+   if (native_key) {
+      int i;
+
+      for (i = 0; i < 2; i++) {
+         memset (ciphertext_actual.data, 0, ciphertext_actual.len);
+         ret = _mongocrypt_do_encryption (crypt->crypto,
+                                          &iv,
+                                          &associated_data,
+                                          &key,
+                                          native_key,
+                                          &plaintext,
+                                          &ciphertext_actual,
+                                          &bytes_written,
+                                          status);
+         ASSERT_OK_STATUS (ret, status);
+         BSON_ASSERT (0 == memcmp (ciphertext_actual.data,
+                                   ciphertext_expected.data,
+                                   ciphertext_actual.len));
+      }
+
+      _mongocrypt_buffer_init (&decrypted);
+      _mongocrypt_buffer_resize (
+         &decrypted,
+         _mongocrypt_calculate_plaintext_len (ciphertext_actual.len));
+      ret = _mongocrypt_do_decryption (crypt->crypto,
+                                       &associated_data,
+                                       &key,
+                                       native_key,
+                                       &ciphertext_actual,
+                                       &decrypted,
+                                       &bytes_written,
+                                       status);
+      ASSERT_OK_STATUS (ret, status);
+      BSON_ASSERT (bytes_written == plaintext.len);
+      BSON_ASSERT (0 == memcmp (decrypted.data, plaintext.data, plaintext.len));
+
+      /* The single pass decryption must still reject a modified ciphertext. */
+      ciphertext_actual.data[MONGOCRYPT_IV_LEN] ^= 1;
+      ret = _mongocrypt_do_decryption (crypt->crypto,
+                                       &associated_data,
+                                       &key,
+                                       native_key,
+                                       &ciphertext_actual,
+                                       &decrypted,
+                                       &bytes_written,
+                                       status);
+      BSON_ASSERT (!ret);
+      BSON_ASSERT (0 == strcmp (mongocrypt_status_message (status, NULL),
+                                "HMAC validation failure"));
+      _mongocrypt_buffer_cleanup (&decrypted);
+      _native_crypto_key_destroy (native_key);
+   }
+
    _mongocrypt_buffer_cleanup (&key);
    _mongocrypt_buffer_cleanup (&iv);
    _mongocrypt_buffer_cleanup (&plaintext);
@@ -225,9 +448,111 @@ _test_mcgrew (_mongocrypt_tester_t *tester)
    mongocrypt_destroy (crypt);
 }
 
+typedef struct {
+   int calls;
+   uint8_t next;
+} _counting_random_t;
+
+/* Fills @out with consecutive byte values, so every byte handed out by a
+ * pool can be traced to the call that produced it. */
+static bool
+_counting_random (void *ctx,
+                  mongocrypt_binary_t *out,
+                  uint32_t count,
+                  mongocrypt_status_t *status)
+{
+   _counting_random_t *counter = (_counting_random_t *) ctx;
+   uint32_t i;
+
+   counter->calls++;
+   for (i = 0; i < count; i++) {
+      out->data[i] = counter->next++;
+   }
+   return true;
+}
+
+static void
+_test_random_pool (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_random_pool_t pool;
+   _mongocrypt_crypto_t crypto = {0};
+   _counting_random_t counter = {0};
+   mongocrypt_status_t *status;
+   _mongocrypt_buffer_t iv;
+   _mongocrypt_buffer_t big;
+   uint8_t expected[MONGOCRYPT_IV_LEN];
+   uint32_t i;
+   uint32_t j;
+
+#ifndef MONGOCRYPT_ENABLE_CRYPTO_HOOKS
+   printf ("Skipping test: the random pool is filled natively without hooks\n");
+   return;
+#endif
+
+   crypto.hooks_enabled = 1;
+   crypto.random = _counting_random;
+   crypto.ctx = &counter;
+   status = mongocrypt_status_new ();
+   _mongocrypt_random_pool_init (&pool);
+   _mongocrypt_buffer_init (&iv);
+   _mongocrypt_buffer_resize (&iv, MONGOCRYPT_IV_LEN);
+
+   /* One call fills the pool for many IVs, and no bytes are handed out
+    * twice. */
+   for (i = 0; i < MONGOCRYPT_RANDOM_POOL_LEN / MONGOCRYPT_IV_LEN; i++) {
+      ASSERT_OR_PRINT (_mongocrypt_random_pool_take (
+                          &pool, &crypto, &iv, MONGOCRYPT_IV_LEN, status),
+                       status);
+      for (j = 0; j < MONGOCRYPT_IV_LEN; j++) {
+         expected[j] = (uint8_t) (i * MONGOCRYPT_IV_LEN + j);
+      }
+      BSON_ASSERT (0 == memcmp (iv.data, expected, MONGOCRYPT_IV_LEN));
+   }
+   BSON_ASSERT (counter.calls == 1);
+   BSON_ASSERT (pool.avail == 0);
+
+   /* An empty pool is refilled. */
+   ASSERT_OR_PRINT (_mongocrypt_random_pool_take (
+                       &pool, &crypto, &iv, MONGOCRYPT_IV_LEN, status),
+                    status);
+   BSON_ASSERT (counter.calls == 2);
+
+   /* A pool filled by another process is discarded. */
+   pool.pid = -1;
+   ASSERT_OR_PRINT (_mongocrypt_random_pool_take (
+                       &pool, &crypto, &iv, MONGOCRYPT_IV_LEN, status),
+                    status);
+   BSON_ASSERT (counter.calls == 3);
+   BSON_ASSERT (pool.avail == MONGOCRYPT_RANDOM_POOL_LEN - MONGOCRYPT_IV_LEN);
+
+   /* Requests larger than the pool bypass it. */
+   _mongocrypt_buffer_init (&big);
+   _mongocrypt_buffer_resize (&big, MONGOCRYPT_RANDOM_POOL_LEN + 1);
+   ASSERT_OR_PRINT (
+      _mongocrypt_random_pool_take (
+         &pool, &crypto, &big, MONGOCRYPT_RANDOM_POOL_LEN + 1, status),
+      status);
+   BSON_ASSERT (counter.calls == 4);
+   BSON_ASSERT (pool.avail == MONGOCRYPT_RANDOM_POOL_LEN - MONGOCRYPT_IV_LEN);
+
+   ASSERT_FAILS_STATUS (
+      _mongocrypt_random_pool_take (&pool, &crypto, &iv, 1, status),
+      status,
+      "out should have length 1");
+
+   _mongocrypt_buffer_cleanup (&big);
+   _mongocrypt_buffer_cleanup (&iv);
+   _mongocrypt_random_pool_cleanup (&pool);
+   mongocrypt_status_destroy (status);
+}
+
+
 void
 _mongocrypt_tester_install_crypto (_mongocrypt_tester_t *tester)
 {
    INSTALL_TEST (_test_mcgrew);
    INSTALL_TEST (_test_roundtrip);
+   INSTALL_TEST (_test_roundtrip_lengths);
+   INSTALL_TEST (_test_encryption_multi_buffer);
+   INSTALL_TEST (_test_random_pool);
 }
\ No newline at end of file
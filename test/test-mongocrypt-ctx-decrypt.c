@@ -105,6 +105,93 @@ _test_decrypt_need_keys (_mongocrypt_tester_t *tester)
 }
 
 
+/* Wrap @key_doc in a find reply. */
+static mongocrypt_binary_t *
+_key_cursor_reply (mongocrypt_binary_t *key_doc, bson_t *reply)
+{
+   bson_t key_bson, cursor, batch;
+
+   BSON_ASSERT (_mongocrypt_binary_to_bson (key_doc, &key_bson));
+   bson_init (reply);
+   BSON_APPEND_INT32 (reply, "ok", 1);
+   BSON_APPEND_DOCUMENT_BEGIN (reply, "cursor", &cursor);
+   BSON_APPEND_INT64 (&cursor, "id", 0);
+   BSON_APPEND_UTF8 (&cursor, "ns", "keyvault.datakeys");
+   BSON_APPEND_ARRAY_BEGIN (&cursor, "firstBatch", &batch);
+   BSON_APPEND_DOCUMENT (&batch, "0", &key_bson);
+   bson_append_array_end (&cursor, &batch);
+   bson_append_document_end (reply, &cursor);
+   return mongocrypt_binary_new_from_data ((uint8_t *) bson_get_data (reply),
+                                           reply->len);
+}
+
+
+static void
+_test_decrypt_feed_cursor (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted, *reply_bin;
+   bson_t reply;
+
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+   reply_bin = _key_cursor_reply (
+      TEST_FILE ("./test/example/key-document.json"), &reply);
+
+   /* The key documents are fed out of the whole reply. */
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed_cursor (ctx, reply_bin), ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_KMS);
+   ASSERT_FAILS (mongocrypt_ctx_mongo_feed_cursor (ctx, reply_bin),
+                 ctx,
+                 "wrong state");
+   mongocrypt_ctx_destroy (ctx);
+
+   /* A getMore reply with an empty batch feeds nothing. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed_cursor (
+                 ctx,
+                 TEST_BSON ("{'ok': 1, 'cursor': {'id': 0, 'ns': 'a.b', "
+                            "'nextBatch': []}}")),
+              ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   ASSERT_FAILS (mongocrypt_ctx_mongo_feed_cursor (
+                    ctx, TEST_BSON ("{'ok': 0, 'errmsg': 'unauthorized'}")),
+                 ctx,
+                 "cursor reply is an error");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   ASSERT_FAILS (mongocrypt_ctx_mongo_feed_cursor (
+                    ctx, TEST_FILE ("./test/example/key-document.json")),
+                 ctx,
+                 "invalid cursor reply");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   ASSERT_FAILS (mongocrypt_ctx_mongo_feed_cursor (
+                    ctx, TEST_BSON ("{'cursor': {'firstBatch': [1]}}")),
+                 ctx,
+                 "expected documents in batch");
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_destroy (crypt);
+   mongocrypt_binary_destroy (reply_bin);
+   bson_destroy (&reply);
+   mongocrypt_binary_destroy (encrypted);
+}
+
+
 static void
 _test_decrypt_ready (_mongocrypt_tester_t *tester)
 {
@@ -201,13 +288,1293 @@ _test_decrypt_empty_binary (_mongocrypt_tester_t *tester)
    mongocrypt_destroy (crypt);
 }
 
+/* A reset context can run another operation. */
+static void
+_test_decrypt_reset (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+   ctx = mongocrypt_ctx_new (crypt);
+
+   /* Reset after an error. */
+   ASSERT_FAILS (mongocrypt_ctx_decrypt_init (ctx, NULL), ctx, "invalid doc");
+   BSON_ASSERT (mongocrypt_ctx_reset (ctx));
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_DONE);
+   BSON_ASSERT (mongocrypt_status_ok (ctx->status));
+
+   /* Reset in the middle of an operation. */
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   BSON_ASSERT (mongocrypt_ctx_reset (ctx));
+
+   /* Reset after completing an operation. */
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   BSON_ASSERT (mongocrypt_ctx_reset (ctx));
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_binary_destroy (encrypted);
+   mongocrypt_destroy (crypt);
+}
+
+
+static int64_t _allocations;
+
+
+static void *
+_counting_malloc (size_t num_bytes)
+{
+   _allocations++;
+   return malloc (num_bytes);
+}
+
+
+static void *
+_counting_calloc (size_t n_members, size_t num_bytes)
+{
+   _allocations++;
+   return calloc (n_members, num_bytes);
+}
+
+
+static void *
+_counting_realloc (void *mem, size_t num_bytes)
+{
+   _allocations++;
+   return realloc (mem, num_bytes);
+}
+
+
+static void
+_counting_free (void *mem)
+{
+   free (mem);
+}
+
+
+/* Decrypt @encrypted with @ctx and return the number of allocations made.
+ * Sets @data to the decrypted document's storage. */
+static int64_t
+_count_decrypt (_mongocrypt_tester_t *tester,
+                mongocrypt_ctx_t *ctx,
+                mongocrypt_binary_t *encrypted,
+                const uint8_t **data)
+{
+   mongocrypt_binary_t *out;
+   int64_t before;
+
+   before = _allocations;
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   out = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, out), ctx);
+   *data = mongocrypt_binary_data (out);
+   mongocrypt_binary_destroy (out);
+   return _allocations - before;
+}
+
+
+/* A reset context keeps the storage of its previous operation. */
+static void
+_test_decrypt_reset_allocations (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted;
+   bson_mem_vtable_t vtable;
+   const uint8_t *data, *prev_data;
+   int64_t fresh, reset, before;
+   int i;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+
+   /* Cache the key, so every counted decryption runs the same way. */
+   ctx = mongocrypt_ctx_new (crypt);
+   _count_decrypt (tester, ctx, encrypted, &data);
+   mongocrypt_ctx_destroy (ctx);
+
+   memset (&vtable, 0, sizeof (vtable));
+   vtable.malloc = _counting_malloc;
+   vtable.calloc = _counting_calloc;
+   vtable.realloc = _counting_realloc;
+   vtable.free = _counting_free;
+   bson_mem_set_vtable (&vtable);
+
+   fresh = 0;
+   for (i = 0; i < 3; i++) {
+      before = _allocations;
+      ctx = mongocrypt_ctx_new (crypt);
+      _count_decrypt (tester, ctx, encrypted, &data);
+      mongocrypt_ctx_destroy (ctx);
+      fresh = _allocations - before;
+   }
+
+   ctx = mongocrypt_ctx_new (crypt);
+   _count_decrypt (tester, ctx, encrypted, &prev_data);
+   reset = 0;
+   for (i = 0; i < 3; i++) {
+      BSON_ASSERT (mongocrypt_ctx_reset (ctx));
+      reset = _count_decrypt (tester, ctx, encrypted, &data);
+      /* The result is laid out in the storage of the previous one. */
+      BSON_ASSERT (data == prev_data);
+      prev_data = data;
+   }
+   mongocrypt_ctx_destroy (ctx);
+
+   bson_mem_restore_vtable ();
+
+   /* Besides the context and its status, a new context allocates the key
+    * broker's status, requests, keys and indexes, the input copy, the splice
+    * arrays and the result. A reset context reuses all of them. */
+   BSON_ASSERT (reset + 8 <= fresh);
+
+   mongocrypt_binary_destroy (encrypted);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_test_decrypt_batch (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted, *batch, *decrypted;
+   bson_t encrypted_bson, batch_bson, as_bson;
+   bson_iter_t iter;
+   const char *paths[] = {"0.filter.ssn", "1.filter.ssn"};
+   int i;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (encrypted, &encrypted_bson));
+   bson_init (&batch_bson);
+   BSON_APPEND_DOCUMENT (&batch_bson, "0", &encrypted_bson);
+   BSON_APPEND_DOCUMENT (&batch_bson, "1", &encrypted_bson);
+   batch = mongocrypt_binary_new_from_data (
+      (uint8_t *) bson_get_data (&batch_bson), batch_bson.len);
+
+   /* Both documents use the same key, which is only requested once. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_batch_init (ctx, batch), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/key-document.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, decrypted), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (decrypted, &as_bson));
+   for (i = 0; i < 2; i++) {
+      bson_iter_init (&iter, &as_bson);
+      BSON_ASSERT (bson_iter_find_descendant (&iter, paths[i], &iter));
+      BSON_ASSERT (BSON_ITER_HOLDS_UTF8 (&iter));
+      BSON_ASSERT (0 == strcmp (bson_iter_utf8 (&iter, NULL),
+                                _mongocrypt_tester_plaintext (tester)));
+   }
+   mongocrypt_binary_destroy (decrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Every element must be a document. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (mongocrypt_ctx_decrypt_batch_init (
+                    ctx, TEST_BSON ("{'0': {'a': 1}, '1': 2}")),
+                 ctx,
+                 "each element must be a document");
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (batch);
+   bson_destroy (&batch_bson);
+   mongocrypt_binary_destroy (encrypted);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_test_decrypt_chunked (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted, *decrypted;
+   bson_t as_bson;
+   bson_iter_t iter;
+   int i;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+
+   /* Both documents use the same key, which is only requested once. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_chunked_init (ctx), ctx);
+   ASSERT_OK (mongocrypt_ctx_decrypt_feed_chunk (ctx, encrypted), ctx);
+   ASSERT_OK (mongocrypt_ctx_decrypt_feed_chunk (ctx, TEST_BSON ("{'a': 1}")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_decrypt_feed_chunk (ctx, encrypted), ctx);
+   ASSERT_OK (mongocrypt_ctx_decrypt_chunks_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/key-document.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+
+   /* Each finalize returns the next document. */
+   decrypted = mongocrypt_binary_new ();
+   for (i = 0; i < 3; i++) {
+      BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+      ASSERT_OK (mongocrypt_ctx_finalize (ctx, decrypted), ctx);
+      BSON_ASSERT (_mongocrypt_binary_to_bson (decrypted, &as_bson));
+      if (i == 1) {
+         BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "a"));
+         continue;
+      }
+      bson_iter_init (&iter, &as_bson);
+      BSON_ASSERT (bson_iter_find_descendant (&iter, "filter.ssn", &iter));
+      BSON_ASSERT (BSON_ITER_HOLDS_UTF8 (&iter));
+      BSON_ASSERT (0 == strcmp (bson_iter_utf8 (&iter, NULL),
+                                _mongocrypt_tester_plaintext (tester)));
+   }
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_DONE);
+   mongocrypt_binary_destroy (decrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* With no documents, finalize returns an empty document. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_chunked_init (ctx), ctx);
+   ASSERT_OK (mongocrypt_ctx_decrypt_chunks_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, decrypted), ctx);
+   BSON_ASSERT (decrypted->len == 5);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_DONE);
+   mongocrypt_binary_destroy (decrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Chunks are only accepted before chunks_done. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_chunked_init (ctx), ctx);
+   ASSERT_OK (mongocrypt_ctx_decrypt_chunks_done (ctx), ctx);
+   ASSERT_FAILS (mongocrypt_ctx_decrypt_feed_chunk (ctx, encrypted),
+                 ctx,
+                 "chunks already done");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   ASSERT_FAILS (mongocrypt_ctx_decrypt_feed_chunk (ctx, encrypted),
+                 ctx,
+                 "not applicable to context");
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (encrypted);
+   mongocrypt_destroy (crypt);
+}
+
+typedef struct {
+   uint32_t calls;
+   bool fail;
+} _parallel_for_ctx_t;
+
+
+/* Runs the tasks in reverse, to check that results are placed in order. */
+static bool
+_parallel_for_reverse (void *ctx,
+                       uint32_t count,
+                       mongocrypt_task_fn task,
+                       void *task_ctx)
+{
+   _parallel_for_ctx_t *pctx;
+
+   pctx = (_parallel_for_ctx_t *) ctx;
+   pctx->calls++;
+   if (pctx->fail) {
+      return false;
+   }
+   while (count > 0) {
+      task (task_ctx, --count);
+   }
+   return true;
+}
+
+
+static void
+_test_decrypt_parallel (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted, *batch, *decrypted;
+   bson_t encrypted_bson, batch_bson, as_bson;
+   bson_iter_t iter;
+   _parallel_for_ctx_t pctx = {0};
+   const char *paths[] = {"0.filter.ssn", "1.filter.ssn"};
+   int i;
+
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (encrypted, &encrypted_bson));
+   bson_init (&batch_bson);
+   BSON_APPEND_DOCUMENT (&batch_bson, "0", &encrypted_bson);
+   BSON_APPEND_DOCUMENT (&batch_bson, "1", &encrypted_bson);
+   batch = mongocrypt_binary_new_from_data (
+      (uint8_t *) bson_get_data (&batch_bson), batch_bson.len);
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_parallel_for (
+                 crypt, _parallel_for_reverse, 2, &pctx),
+              crypt);
+   ASSERT_FAILS (mongocrypt_setopt_parallel_for (
+                    crypt, _parallel_for_reverse, 2, &pctx),
+                 crypt,
+                 "parallel_for already set");
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+
+   /* A single field is decrypted on the calling thread. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, decrypted), ctx);
+   BSON_ASSERT (pctx.calls == 0);
+   mongocrypt_binary_destroy (decrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_batch_init (ctx, batch), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, decrypted), ctx);
+   BSON_ASSERT (pctx.calls == 1);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (decrypted, &as_bson));
+   for (i = 0; i < 2; i++) {
+      bson_iter_init (&iter, &as_bson);
+      BSON_ASSERT (bson_iter_find_descendant (&iter, paths[i], &iter));
+      BSON_ASSERT (BSON_ITER_HOLDS_UTF8 (&iter));
+      BSON_ASSERT (0 == strcmp (bson_iter_utf8 (&iter, NULL),
+                                _mongocrypt_tester_plaintext (tester)));
+   }
+   mongocrypt_binary_destroy (decrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* A failing parallel_for fails the context. */
+   pctx.fail = true;
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_batch_init (ctx, batch), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_FAILS (
+      mongocrypt_ctx_finalize (ctx, decrypted), ctx, "parallel_for failed");
+   mongocrypt_binary_destroy (decrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_destroy (crypt);
+   mongocrypt_binary_destroy (batch);
+   bson_destroy (&batch_bson);
+   mongocrypt_binary_destroy (encrypted);
+}
+
+
+/* An executor that holds submitted tasks until they are run by the test. */
+typedef struct {
+   mongocrypt_task_fn tasks[64];
+   void *task_ctxs[64];
+   uint32_t indexes[64];
+   uint32_t n_tasks;
+   bool fail;
+} _executor_ctx_t;
+
+
+static bool
+_executor_submit (void *ctx,
+                  mongocrypt_task_fn task,
+                  void *task_ctx,
+                  uint32_t index)
+{
+   _executor_ctx_t *ectx;
+
+   ectx = (_executor_ctx_t *) ctx;
+   if (ectx->fail || ectx->n_tasks == 64) {
+      return false;
+   }
+   ectx->tasks[ectx->n_tasks] = task;
+   ectx->task_ctxs[ectx->n_tasks] = task_ctx;
+   ectx->indexes[ectx->n_tasks] = index;
+   ectx->n_tasks++;
+   return true;
+}
+
+
+static void
+_executor_run_all (_executor_ctx_t *ectx)
+{
+   uint32_t i;
+
+   for (i = 0; i < ectx->n_tasks; i++) {
+      ectx->tasks[i](ectx->task_ctxs[i], ectx->indexes[i]);
+   }
+   ectx->n_tasks = 0;
+}
+
+
+static void
+_test_decrypt_executor (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted, *batch, *decrypted;
+   bson_t encrypted_bson, batch_bson, as_bson;
+   bson_iter_t iter;
+   _executor_ctx_t ectx;
+   _parallel_for_ctx_t pctx = {0};
+   const char *keys[] = {"0", "1", "2", "3"};
+   const char *paths[] = {
+      "0.filter.ssn", "1.filter.ssn", "2.filter.ssn", "3.filter.ssn"};
+   int i, attempt;
+
+   memset (&ectx, 0, sizeof (ectx));
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (encrypted, &encrypted_bson));
+   bson_init (&batch_bson);
+   for (i = 0; i < 4; i++) {
+      BSON_APPEND_DOCUMENT (&batch_bson, keys[i], &encrypted_bson);
+   }
+   batch = mongocrypt_binary_new_from_data (
+      (uint8_t *) bson_get_data (&batch_bson), batch_bson.len);
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_executor (crypt, _executor_submit, &ectx),
+              crypt);
+   ASSERT_FAILS (mongocrypt_setopt_parallel_for (
+                    crypt, _parallel_for_reverse, 2, &pctx),
+                 crypt,
+                 "cannot set both an executor and parallel_for");
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+
+   /* The tasks run after the work is done, and find nothing to do. If the
+    * executor fails, the calling thread does all of it. */
+   for (attempt = 0; attempt < 2; attempt++) {
+      ectx.fail = attempt == 1;
+      ctx = mongocrypt_ctx_new (crypt);
+      ASSERT_OK (mongocrypt_ctx_decrypt_batch_init (ctx, batch), ctx);
+      _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+      decrypted = mongocrypt_binary_new ();
+      ASSERT_OK (mongocrypt_ctx_finalize (ctx, decrypted), ctx);
+      BSON_ASSERT (ectx.n_tasks == (ectx.fail ? 0u : 3u));
+      BSON_ASSERT (_mongocrypt_binary_to_bson (decrypted, &as_bson));
+      for (i = 0; i < 4; i++) {
+         bson_iter_init (&iter, &as_bson);
+         BSON_ASSERT (bson_iter_find_descendant (&iter, paths[i], &iter));
+         BSON_ASSERT (BSON_ITER_HOLDS_UTF8 (&iter));
+      }
+      mongocrypt_binary_destroy (decrypted);
+      mongocrypt_ctx_destroy (ctx);
+      _executor_run_all (&ectx);
+   }
+
+   mongocrypt_destroy (crypt);
+   mongocrypt_binary_destroy (batch);
+   bson_destroy (&batch_bson);
+   mongocrypt_binary_destroy (encrypted);
+}
+
+
+/* Only the ciphertexts under the decrypt paths are decrypted. */
+static void
+_test_decrypt_paths (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted, *batch, *decrypted;
+   bson_t encrypted_bson, batch_bson, as_bson;
+   bson_iter_t iter;
+   const char *paths[] = {"0.filter.ssn", "1.filter.ssn"};
+   int i;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (encrypted, &encrypted_bson));
+
+   /* No ciphertext is selected, so no key is requested. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_decrypt_paths (
+                 ctx, TEST_BSON ("{'paths': ['other', 'filter.ssn2']}")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, decrypted), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (decrypted, &as_bson));
+   BSON_ASSERT (bson_equal (&as_bson, &encrypted_bson));
+   mongocrypt_binary_destroy (decrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* A ciphertext under a selected path is decrypted. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_decrypt_paths (
+                 ctx, TEST_BSON ("{'paths': ['filter']}")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, decrypted), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (decrypted, &as_bson));
+   bson_iter_init (&iter, &as_bson);
+   BSON_ASSERT (bson_iter_find_descendant (&iter, "filter.ssn", &iter));
+   BSON_ASSERT (BSON_ITER_HOLDS_UTF8 (&iter));
+   mongocrypt_binary_destroy (decrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* The paths of a batch apply to each document. */
+   bson_init (&batch_bson);
+   BSON_APPEND_DOCUMENT (&batch_bson, "0", &encrypted_bson);
+   BSON_APPEND_DOCUMENT (&batch_bson, "1", &encrypted_bson);
+   batch = mongocrypt_binary_new_from_data (
+      (uint8_t *) bson_get_data (&batch_bson), batch_bson.len);
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_decrypt_paths (
+                 ctx, TEST_BSON ("{'paths': ['filter.ssn']}")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_decrypt_batch_init (ctx, batch), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, decrypted), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (decrypted, &as_bson));
+   for (i = 0; i < 2; i++) {
+      bson_iter_init (&iter, &as_bson);
+      BSON_ASSERT (bson_iter_find_descendant (&iter, paths[i], &iter));
+      BSON_ASSERT (BSON_ITER_HOLDS_UTF8 (&iter));
+      BSON_ASSERT (0 == strcmp (bson_iter_utf8 (&iter, NULL),
+                                _mongocrypt_tester_plaintext (tester)));
+   }
+   mongocrypt_binary_destroy (decrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Invalid paths. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (mongocrypt_ctx_setopt_decrypt_paths (
+                    ctx, TEST_BSON ("{'paths': 'filter'}")),
+                 ctx,
+                 "paths expected to be an array");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (mongocrypt_ctx_setopt_decrypt_paths (
+                    ctx, TEST_BSON ("{'paths': ['a..b']}")),
+                 ctx,
+                 "invalid path");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (mongocrypt_ctx_setopt_decrypt_paths (
+                    ctx, TEST_BSON ("{'paths': []}")),
+                 ctx,
+                 "paths must not be empty");
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Explicit decryption has no paths. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_decrypt_paths (
+                 ctx, TEST_BSON ("{'paths': ['v']}")),
+              ctx);
+   ASSERT_FAILS (mongocrypt_ctx_explicit_decrypt_init (
+                    ctx,
+                    TEST_BSON ("{ 'v': { '$binary': { 'subType': '06', "
+                               "'base64': "
+                               "'AWFhYWFhYWFhYWFhYWFhYWECRTOW9yZzNDn5dGwuqsrJ"
+                               "QNLtgMEKaujhs9aRWRp+7Yo3JK8N8jC8P0Xjll6C1CwLsE"
+                               "/iP5wjOMhVv1KMMyOCSCrHorXRsb2IKPtzl2lKTqQ=' } "
+                               "} }")),
+                 ctx,
+                 "decrypt paths prohibited");
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (batch);
+   bson_destroy (&batch_bson);
+   mongocrypt_binary_destroy (encrypted);
+   mongocrypt_destroy (crypt);
+}
+
+
+/* The ciphertexts found when requesting keys are decrypted by finalize,
+ * without looking for them again. */
+static void
+_test_decrypt_recorded (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   _mongocrypt_ctx_decrypt_t *dctx;
+   mongocrypt_binary_t *encrypted, *batch, *decrypted;
+   bson_t encrypted_bson, batch_bson, as_bson;
+   bson_iter_t iter;
+   const char *paths[] = {"0.filter.ssn", "1.filter.ssn"};
+   uint32_t i;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (encrypted, &encrypted_bson));
+   bson_init (&batch_bson);
+   BSON_APPEND_DOCUMENT (&batch_bson, "0", &encrypted_bson);
+   BSON_APPEND_DOCUMENT (&batch_bson, "1", &encrypted_bson);
+   batch = mongocrypt_binary_new_from_data (
+      (uint8_t *) bson_get_data (&batch_bson), batch_bson.len);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_batch_init (ctx, batch), ctx);
+   dctx = (_mongocrypt_ctx_decrypt_t *) ctx;
+   BSON_ASSERT (dctx->collected.n_items == 2);
+   for (i = 0; i < dctx->collected.n_items; i++) {
+      BSON_ASSERT (dctx->collected.items[i].header);
+   }
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, decrypted), ctx);
+   BSON_ASSERT (dctx->collected.n_items == 0);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (decrypted, &as_bson));
+   for (i = 0; i < 2; i++) {
+      bson_iter_init (&iter, &as_bson);
+      BSON_ASSERT (bson_iter_find_descendant (&iter, paths[i], &iter));
+      BSON_ASSERT (BSON_ITER_HOLDS_UTF8 (&iter));
+      BSON_ASSERT (0 == strcmp (bson_iter_utf8 (&iter, NULL),
+                                _mongocrypt_tester_plaintext (tester)));
+   }
+   mongocrypt_binary_destroy (decrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (batch);
+   bson_destroy (&batch_bson);
+   mongocrypt_binary_destroy (encrypted);
+   mongocrypt_destroy (crypt);
+}
+
+
+/* Fields of a view are decrypted when read. */
+static void
+_test_decrypt_view (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted, *field;
+   mongocrypt_doc_view_t *view;
+   mongocrypt_status_t *status;
+   bson_t as_bson;
+   bson_iter_t iter;
+   const uint8_t *data;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+   field = mongocrypt_binary_new ();
+   status = mongocrypt_status_new ();
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   view = mongocrypt_ctx_finalize_view (ctx);
+   BSON_ASSERT (view);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_DONE);
+
+   BSON_ASSERT (mongocrypt_doc_view_get (view, "filter.ssn", field));
+   BSON_ASSERT (_mongocrypt_binary_to_bson (field, &as_bson));
+   BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "v"));
+   BSON_ASSERT (BSON_ITER_HOLDS_UTF8 (&iter));
+   BSON_ASSERT (0 == strcmp (bson_iter_utf8 (&iter, NULL),
+                             _mongocrypt_tester_plaintext (tester)));
+
+   /* A field is decrypted once. */
+   data = mongocrypt_binary_data (field);
+   BSON_ASSERT (mongocrypt_doc_view_get (view, "filter.ssn", field));
+   BSON_ASSERT (mongocrypt_binary_data (field) == data);
+
+   /* A document is returned with its fields decrypted. */
+   BSON_ASSERT (mongocrypt_doc_view_get (view, "filter", field));
+   BSON_ASSERT (_mongocrypt_binary_to_bson (field, &as_bson));
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, "v.ssn", &iter));
+   BSON_ASSERT (BSON_ITER_HOLDS_UTF8 (&iter));
+
+   /* A missing field is an empty document. */
+   BSON_ASSERT (mongocrypt_doc_view_get (view, "missing", field));
+   BSON_ASSERT (_mongocrypt_binary_to_bson (field, &as_bson));
+   BSON_ASSERT (bson_empty (&as_bson));
+
+   BSON_ASSERT (mongocrypt_doc_view_status (view, status));
+   mongocrypt_doc_view_destroy (view);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Explicit decryption has no document. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_explicit_decrypt_init (
+                 ctx,
+                 TEST_BSON ("{ 'v': { '$binary': { 'subType': '06', "
+                            "'base64': "
+                            "'AWFhYWFhYWFhYWFhYWFhYWECRTOW9yZzNDn5dGwuqsrJ"
+                            "QNLtgMEKaujhs9aRWRp+7Yo3JK8N8jC8P0Xjll6C1CwLsE"
+                            "/iP5wjOMhVv1KMMyOCSCrHorXRsb2IKPtzl2lKTqQ=' } "
+                            "} }")),
+              ctx);
+   BSON_ASSERT (!mongocrypt_ctx_finalize_view (ctx));
+   ASSERT_FAILS_STATUS (
+      mongocrypt_ctx_status (ctx, status), status, "not applicable");
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_status_destroy (status);
+   mongocrypt_binary_destroy (field);
+   mongocrypt_binary_destroy (encrypted);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_test_decrypt_cached (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted, *expected, *out;
+   mongocrypt_status_t *status;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+   out = mongocrypt_binary_new ();
+   status = mongocrypt_status_new ();
+
+   /* The key is not cached yet. */
+   ASSERT_OK_STATUS (
+      mongocrypt_try_decrypt_cached (crypt, encrypted, out, status), status);
+   BSON_ASSERT (mongocrypt_binary_len (out) == 0);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   expected = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, expected), ctx);
+
+   /* Now it is, and the result matches the context's. */
+   ASSERT_OK_STATUS (
+      mongocrypt_try_decrypt_cached (crypt, encrypted, out, status), status);
+   BSON_ASSERT (mongocrypt_binary_len (out) ==
+                mongocrypt_binary_len (expected));
+   BSON_ASSERT (0 == memcmp (mongocrypt_binary_data (out),
+                             mongocrypt_binary_data (expected),
+                             mongocrypt_binary_len (out)));
+   mongocrypt_ctx_destroy (ctx);
+
+   ASSERT_FAILS_STATUS (
+      mongocrypt_try_decrypt_cached (crypt, NULL, out, status),
+      status,
+      "invalid doc");
+
+   mongocrypt_status_destroy (status);
+   mongocrypt_binary_destroy (expected);
+   mongocrypt_binary_destroy (out);
+   mongocrypt_binary_destroy (encrypted);
+   mongocrypt_destroy (crypt);
+}
+
+
+/* The stolen output outlives the context. */
+static void
+_test_decrypt_finalize_steal (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted, *decrypted;
+   bson_t as_bson;
+   bson_iter_t iter;
+
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+   crypt = _mongocrypt_tester_mongocrypt ();
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize_steal (ctx, decrypted), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+
+   BSON_ASSERT (_mongocrypt_binary_to_bson (decrypted, &as_bson));
+   bson_iter_init (&iter, &as_bson);
+   bson_iter_find_descendant (&iter, "filter.ssn", &iter);
+   BSON_ASSERT (BSON_ITER_HOLDS_UTF8 (&iter));
+   BSON_ASSERT (0 == strcmp (bson_iter_utf8 (&iter, NULL),
+                             _mongocrypt_tester_plaintext (tester)));
+   mongocrypt_binary_destroy (decrypted);
+
+   /* Nothing to decrypt. The output views the input, so it is copied. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, TEST_BSON ("{'a': 1}")), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize_steal (ctx, decrypted), ctx);
+   mongocrypt_ctx_destroy (ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (decrypted, &as_bson));
+   BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "a"));
+   BSON_ASSERT (bson_iter_int32 (&iter) == 1);
+   mongocrypt_binary_destroy (decrypted);
+
+   mongocrypt_destroy (crypt);
+   mongocrypt_binary_destroy (encrypted);
+}
+
+
+/* The result is laid out in memory owned by the caller. */
+static void
+_test_decrypt_finalize_into (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted, *expected, *out;
+   uint8_t *data;
+   uint32_t len;
+
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+   crypt = _mongocrypt_tester_mongocrypt ();
+
+   /* Decrypt once with mongocrypt_ctx_finalize for the expected result. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   expected = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize_steal (ctx, expected), ctx);
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   out = mongocrypt_binary_new ();
+   ASSERT_FAILS (mongocrypt_ctx_finalize_into (ctx, out), ctx, "invalid NULL");
+   mongocrypt_binary_destroy (out);
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   ASSERT_OK (mongocrypt_ctx_finalize_len (ctx, &len), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_DONE);
+   BSON_ASSERT (len == mongocrypt_binary_len (expected));
+   data = bson_malloc (len);
+   out = mongocrypt_binary_new_from_data (data, len);
+   ASSERT_OK (mongocrypt_ctx_finalize_into (ctx, out), ctx);
+   BSON_ASSERT (0 == memcmp (data, mongocrypt_binary_data (expected), len));
+   mongocrypt_binary_destroy (out);
+   mongocrypt_ctx_destroy (ctx);
+   bson_free (data);
+
+   /* Too small. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   ASSERT_OK (mongocrypt_ctx_finalize_len (ctx, &len), ctx);
+   data = bson_malloc (len);
+   out = mongocrypt_binary_new_from_data (data, len - 1);
+   ASSERT_FAILS (mongocrypt_ctx_finalize_into (ctx, out), ctx, "too small");
+   mongocrypt_binary_destroy (out);
+   mongocrypt_ctx_destroy (ctx);
+   bson_free (data);
+
+   /* Nothing to decrypt. The output views the input, so it is copied. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, TEST_BSON ("{'a': 1}")), ctx);
+   ASSERT_OK (mongocrypt_ctx_finalize_len (ctx, &len), ctx);
+   BSON_ASSERT (len == mongocrypt_binary_len (TEST_BSON ("{'a': 1}")));
+   data = bson_malloc (len);
+   out = mongocrypt_binary_new_from_data (data, len);
+   ASSERT_OK (mongocrypt_ctx_finalize_into (ctx, out), ctx);
+   BSON_ASSERT (0 ==
+                memcmp (data,
+                        mongocrypt_binary_data (TEST_BSON ("{'a': 1}")),
+                        len));
+   ASSERT_FAILS (
+      mongocrypt_ctx_finalize_into (ctx, out), ctx, "must be called first");
+   mongocrypt_binary_destroy (out);
+   mongocrypt_ctx_destroy (ctx);
+   bson_free (data);
+
+   mongocrypt_binary_destroy (expected);
+   mongocrypt_destroy (crypt);
+   mongocrypt_binary_destroy (encrypted);
+}
+
+
+static void
+_test_decrypt_in_place (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted, *batch, *reply, *expected, *out;
+   bson_t encrypted_bson, batch_bson;
+   uint8_t *data;
+   uint32_t len;
+
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (encrypted, &encrypted_bson));
+   crypt = _mongocrypt_tester_mongocrypt ();
+
+   /* Two encrypted documents nested in a reply, so the lengths of enclosing
+    * documents and arrays change. */
+   bson_init (&batch_bson);
+   BSON_APPEND_DOCUMENT (&batch_bson, "0", &encrypted_bson);
+   BSON_APPEND_DOCUMENT (&batch_bson, "1", &encrypted_bson);
+   batch = mongocrypt_binary_new_from_data (
+      (uint8_t *) bson_get_data (&batch_bson), batch_bson.len);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, batch), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   expected = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize_steal (ctx, expected), ctx);
+   mongocrypt_ctx_destroy (ctx);
+
+   len = mongocrypt_binary_len (batch);
+   data = bson_malloc (len);
+   memcpy (data, mongocrypt_binary_data (batch), len);
+   reply = mongocrypt_binary_new_from_data (data, len);
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_in_place_init (ctx, reply), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   out = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, out), ctx);
+   /* The output is the start of the input. */
+   BSON_ASSERT (mongocrypt_binary_data (out) == data);
+   BSON_ASSERT (mongocrypt_binary_len (out) ==
+                mongocrypt_binary_len (expected));
+   BSON_ASSERT (mongocrypt_binary_len (out) < len);
+   BSON_ASSERT (0 == memcmp (data,
+                             mongocrypt_binary_data (expected),
+                             mongocrypt_binary_len (expected)));
+   mongocrypt_binary_destroy (out);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_binary_destroy (reply);
+   bson_free (data);
+
+   /* Nothing to decrypt. The input is untouched. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (
+      mongocrypt_ctx_decrypt_in_place_init (ctx, TEST_BSON ("{'a': 1}")), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   out = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, out), ctx);
+   BSON_ASSERT (mongocrypt_binary_len (out) ==
+                mongocrypt_binary_len (TEST_BSON ("{'a': 1}")));
+   BSON_ASSERT (0 == memcmp (mongocrypt_binary_data (out),
+                             mongocrypt_binary_data (TEST_BSON ("{'a': 1}")),
+                             mongocrypt_binary_len (out)));
+   mongocrypt_binary_destroy (out);
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (expected);
+   mongocrypt_binary_destroy (batch);
+   bson_destroy (&batch_bson);
+   mongocrypt_destroy (crypt);
+   mongocrypt_binary_destroy (encrypted);
+}
+
+
+static int64_t
+_plaintext_cache_stat (mongocrypt_t *crypt, const char *name)
+{
+   mongocrypt_binary_t *bin;
+   bson_t as_bson;
+   bson_iter_t iter;
+   char *path;
+   int64_t value;
+
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_get_stats (crypt, bin), crypt);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   path = bson_strdup_printf ("cache.plaintext.%s", name);
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, path, &iter));
+   value = bson_iter_int64 (&iter);
+   bson_free (path);
+   mongocrypt_binary_destroy (bin);
+   return value;
+}
+
+
+static void
+_test_decrypt_plaintext_cache (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted, *first, *second;
+   int i;
+
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_FAILS (mongocrypt_setopt_use_plaintext_cache (crypt, 0),
+                 crypt,
+                 "must be positive");
+   ASSERT_OK (mongocrypt_setopt_use_plaintext_cache (crypt, 1), crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+
+   first = mongocrypt_binary_new ();
+   second = mongocrypt_binary_new ();
+   for (i = 0; i < 2; i++) {
+      ctx = mongocrypt_ctx_new (crypt);
+      ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+      _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+      ASSERT_OK (mongocrypt_ctx_finalize (ctx, i == 0 ? first : second), ctx);
+      mongocrypt_ctx_destroy (ctx);
+   }
+
+   /* The second deterministic decryption was copied from the cache. */
+   BSON_ASSERT (1 == _plaintext_cache_stat (crypt, "misses"));
+   BSON_ASSERT (1 == _plaintext_cache_stat (crypt, "hits"));
+   BSON_ASSERT (1 == _plaintext_cache_stat (crypt, "entries"));
+   BSON_ASSERT (mongocrypt_binary_len (first) ==
+                mongocrypt_binary_len (second));
+   BSON_ASSERT (0 == memcmp (mongocrypt_binary_data (first),
+                             mongocrypt_binary_data (second),
+                             mongocrypt_binary_len (first)));
+
+   /* The entry is kept while its key is cached. */
+   ASSERT_OK (mongocrypt_cache_maintain (crypt), crypt);
+   BSON_ASSERT (1 == _plaintext_cache_stat (crypt, "entries"));
+
+   mongocrypt_binary_destroy (second);
+   mongocrypt_binary_destroy (first);
+   mongocrypt_destroy (crypt);
+   mongocrypt_binary_destroy (encrypted);
+}
+
+
+/* Returns a crypt answering key requests from @a and @b (if set) laid end
+ * to end. @snapshot is set to the snapshot, which must outlive the crypt. */
+static mongocrypt_t *
+_crypt_with_snapshot (mongocrypt_binary_t *a,
+                      mongocrypt_binary_t *b,
+                      _mongocrypt_buffer_t *snapshot)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_binary_t *bin;
+   uint32_t b_len = b ? mongocrypt_binary_len (b) : 0;
+
+   _mongocrypt_buffer_init (snapshot);
+   _mongocrypt_buffer_resize (snapshot, mongocrypt_binary_len (a) + b_len);
+   memcpy (snapshot->data,
+           mongocrypt_binary_data (a),
+           mongocrypt_binary_len (a));
+   if (b) {
+      memcpy (snapshot->data + mongocrypt_binary_len (a),
+              mongocrypt_binary_data (b),
+              b_len);
+   }
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   bin = _mongocrypt_buffer_as_binary (snapshot);
+   ASSERT_OK (mongocrypt_setopt_key_vault_snapshot (crypt, bin), crypt);
+   return crypt;
+}
+
+
+static void
+_test_decrypt_key_vault_snapshot (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted, *decrypted, *bin;
+   _mongocrypt_buffer_t snapshot;
+   const _mongocrypt_key_vault_snapshot_t *snap;
+
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+
+   crypt = mongocrypt_new ();
+   ASSERT_FAILS (mongocrypt_setopt_key_vault_snapshot (crypt, NULL),
+                 crypt,
+                 "passed null key vault snapshot");
+   mongocrypt_destroy (crypt);
+
+   /* Keys are found by _id, so NEED_MONGO_KEYS is skipped. */
+   crypt = _crypt_with_snapshot (
+      TEST_FILE ("./test/data/key-document-full.json"),
+      TEST_FILE ("./test/data/key-document-with-alt-name.json"),
+      &snapshot);
+   bin = mongocrypt_binary_new_from_data (snapshot.data, snapshot.len);
+   ASSERT_FAILS (mongocrypt_setopt_key_vault_snapshot (crypt, bin),
+                 crypt,
+                 "already set key vault snapshot");
+   mongocrypt_binary_destroy (bin);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+
+   snap = &crypt->key_vault_snapshot;
+   BSON_ASSERT (2 == snap->num_keys);
+   BSON_ASSERT (_mongocrypt_key_vault_snapshot_find_name (snap, "altname2"));
+   BSON_ASSERT (_mongocrypt_key_vault_snapshot_find_name (snap, "Kasey"));
+   BSON_ASSERT (!_mongocrypt_key_vault_snapshot_find_name (snap, "kasey"));
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_KMS);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, decrypted), ctx);
+   mongocrypt_binary_destroy (decrypted);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+   _mongocrypt_buffer_cleanup (&snapshot);
+
+   /* A key missing from the snapshot fails the context. */
+   crypt = _crypt_with_snapshot (
+      TEST_FILE ("./test/data/key-document-full.json"), NULL, &snapshot);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (mongocrypt_ctx_decrypt_init (ctx, encrypted),
+                 ctx,
+                 "requested key not found in key vault snapshot");
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+   _mongocrypt_buffer_cleanup (&snapshot);
+
+   /* The snapshot is checked by mongocrypt_init. */
+   crypt = mongocrypt_new ();
+   bin = TEST_FILE ("./test/data/key-document-full.json");
+   bin = mongocrypt_binary_new_from_data (mongocrypt_binary_data (bin),
+                                          mongocrypt_binary_len (bin) - 1);
+   ASSERT_OK (mongocrypt_setopt_key_vault_snapshot (crypt, bin), crypt);
+   ASSERT_FAILS (
+      mongocrypt_init (crypt), crypt, "truncated key vault snapshot");
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_destroy (crypt);
+
+   mongocrypt_binary_destroy (encrypted);
+}
+
+
+static bool
+_remove_all (void *attr, void *value, void *ctx)
+{
+   return true;
+}
+
+
+static void
+_test_decrypt_session (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt, *other;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted, *decrypted;
+   mongocrypt_decrypt_session_t *session;
+
+   crypt = mongocrypt_new ();
+   BSON_ASSERT (!mongocrypt_decrypt_session_new (crypt));
+   ASSERT_STATUS_CONTAINS (crypt->status, "from uninitialized crypt");
+   mongocrypt_destroy (crypt);
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   other = _mongocrypt_tester_mongocrypt ();
+   encrypted = _mongocrypt_tester_encrypted_doc (tester);
+   session = mongocrypt_decrypt_session_new (crypt);
+   BSON_ASSERT (session);
+
+   ctx = mongocrypt_ctx_new (other);
+   ASSERT_FAILS (mongocrypt_ctx_setopt_decrypt_session (ctx, session),
+                 ctx,
+                 "decrypt session belongs to another crypt");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_decrypt_session (ctx, session), ctx);
+   ASSERT_FAILS (mongocrypt_ctx_explicit_decrypt_init (ctx, encrypted),
+                 ctx,
+                 "decrypt session prohibited");
+   mongocrypt_ctx_destroy (ctx);
+
+   /* The first batch resolves the key. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_decrypt_session (ctx, session), ctx);
+   ASSERT_FAILS (mongocrypt_ctx_setopt_decrypt_session (ctx, session),
+                 ctx,
+                 "already set decrypt session");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_decrypt_session (ctx, session), ctx);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, decrypted), ctx);
+   mongocrypt_binary_destroy (decrypted);
+   mongocrypt_ctx_destroy (ctx);
+   BSON_ASSERT (session->keys);
+   BSON_ASSERT (!session->keys->next);
+
+   /* The next batch finds it in the session, even with the key cache
+    * emptied. */
+   _mongocrypt_cache_remove_if (crypt->cache_key, _remove_all, NULL);
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_decrypt_session (ctx, session), ctx);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, decrypted), ctx);
+   mongocrypt_binary_destroy (decrypted);
+   /* The key is checked out of the session, and given back on destroy. */
+   mongocrypt_ctx_destroy (ctx);
+   BSON_ASSERT (session->keys);
+   BSON_ASSERT (!session->keys->next);
+
+   /* Invalidating keys drops them from the session. */
+   ASSERT_OK (mongocrypt_key_cache_invalidate_alt_name (
+                 crypt, TEST_BSON ("{'keyAltName': 'altname1'}")),
+              crypt);
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_decrypt_session (ctx, session), ctx);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   BSON_ASSERT (!session->keys);
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_decrypt_session_destroy (session);
+   mongocrypt_binary_destroy (encrypted);
+   mongocrypt_destroy (other);
+   mongocrypt_destroy (crypt);
+}
+
+
 void
 _mongocrypt_tester_install_ctx_decrypt (_mongocrypt_tester_t *tester)
 {
    INSTALL_TEST (_test_explicit_decrypt_init);
    INSTALL_TEST (_test_decrypt_init);
    INSTALL_TEST (_test_decrypt_need_keys);
+   INSTALL_TEST (_test_decrypt_feed_cursor);
    INSTALL_TEST (_test_decrypt_ready);
    INSTALL_TEST (_test_decrypt_empty_aws);
    INSTALL_TEST (_test_decrypt_empty_binary);
+   INSTALL_TEST (_test_decrypt_reset);
+   INSTALL_TEST (_test_decrypt_reset_allocations);
+   INSTALL_TEST (_test_decrypt_batch);
+   INSTALL_TEST (_test_decrypt_chunked);
+   INSTALL_TEST (_test_decrypt_parallel);
+   INSTALL_TEST (_test_decrypt_executor);
+   INSTALL_TEST (_test_decrypt_paths);
+   INSTALL_TEST (_test_decrypt_recorded);
+   INSTALL_TEST (_test_decrypt_view);
+   INSTALL_TEST (_test_decrypt_cached);
+   INSTALL_TEST (_test_decrypt_finalize_steal);
+   INSTALL_TEST (_test_decrypt_finalize_into);
+   INSTALL_TEST (_test_decrypt_in_place);
+   INSTALL_TEST (_test_decrypt_plaintext_cache);
+   INSTALL_TEST (_test_decrypt_key_vault_snapshot);
+   INSTALL_TEST (_test_decrypt_session);
 }
@@ -14,7 +14,9 @@
  * limitations under the License.
  */
 
+#include <mongocrypt-cache-collinfo-private.h>
 #include <mongocrypt-marking-private.h>
+#include <mongocrypt-schema-paths-private.h>
 
 #include "test-mongocrypt.h"
 
@@ -635,6 +637,371 @@ _test_encrypt_need_markings (_mongocrypt_tester_t *tester)
 }
 
 
+static void
+_test_encrypt_mongo_op_iov (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+   mongocrypt_binary_t *iov[MONGOCRYPT_MONGO_OP_IOV_MAX];
+   uint32_t iov_count;
+   uint32_t i;
+   _mongocrypt_buffer_t joined;
+   uint32_t offset;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   bin = mongocrypt_binary_new ();
+   for (i = 0; i < MONGOCRYPT_MONGO_OP_IOV_MAX; i++) {
+      iov[i] = mongocrypt_binary_new ();
+   }
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, bin), ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_op_iov (ctx, iov, &iov_count), ctx);
+   BSON_ASSERT (iov_count == MONGOCRYPT_MONGO_OP_IOV_MAX);
+
+   /* The pieces concatenate to the same bytes as mongocrypt_ctx_mongo_op. */
+   _mongocrypt_buffer_init (&joined);
+   _mongocrypt_buffer_resize (&joined, mongocrypt_binary_len (bin));
+   offset = 0;
+   for (i = 0; i < iov_count; i++) {
+      BSON_ASSERT (offset + mongocrypt_binary_len (iov[i]) <= joined.len);
+      memcpy (joined.data + offset,
+              mongocrypt_binary_data (iov[i]),
+              mongocrypt_binary_len (iov[i]));
+      offset += mongocrypt_binary_len (iov[i]);
+   }
+   BSON_ASSERT (offset == mongocrypt_binary_len (bin));
+   BSON_ASSERT (
+      0 == memcmp (joined.data, mongocrypt_binary_data (bin), offset));
+   _mongocrypt_buffer_cleanup (&joined);
+
+   /* The reply is borrowed, and outlives the context. */
+   ASSERT_OK (mongocrypt_ctx_mongo_feed_unowned (
+                 ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   _assert_bin_bson_equal (bin, TEST_FILE ("./test/data/encrypted-cmd.json"));
+
+   /* Outside of NEED_MONGO_MARKINGS, the command is returned whole. */
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt); /* recreate crypt because of caching. */
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   ASSERT_OK (mongocrypt_ctx_mongo_op_iov (ctx, iov, &iov_count), ctx);
+   BSON_ASSERT (iov_count == 1);
+   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, bin), ctx);
+   BSON_ASSERT (mongocrypt_binary_len (iov[0]) == mongocrypt_binary_len (bin));
+
+   for (i = 0; i < MONGOCRYPT_MONGO_OP_IOV_MAX; i++) {
+      mongocrypt_binary_destroy (iov[i]);
+   }
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_test_encrypt_prefetch_filter (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx, *prefetch_ctx;
+   mongocrypt_binary_t *filter;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   filter = mongocrypt_binary_new ();
+
+   /* Not available before the schema is known. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_COLLINFO);
+   ASSERT_FAILS (mongocrypt_ctx_encrypt_prefetch_filter (ctx, filter),
+                 ctx,
+                 "wrong state");
+   mongocrypt_ctx_destroy (ctx);
+
+   /* The key named by the schema is requested. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   ASSERT_OK (mongocrypt_ctx_encrypt_prefetch_filter (ctx, filter), ctx);
+   _assert_bin_bson_equal (
+      filter,
+      TEST_BSON ("{'_id': {'$in': [{'$binary': {'base64': "
+                 "'YWFhYWFhYWFhYWFhYWFhYQ==', 'subType': '04'}}]}}"));
+
+   /* Load it with a second context while mongocryptd marks the command. */
+   prefetch_ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_prefetch_keys_init (prefetch_ctx, filter),
+              prefetch_ctx);
+   _mongocrypt_tester_run_ctx_to (tester, prefetch_ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (prefetch_ctx);
+
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Cached keys are not requested again. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   ASSERT_OK (mongocrypt_ctx_encrypt_prefetch_filter (ctx, filter), ctx);
+   _assert_bin_bson_equal (filter, TEST_BSON ("{'_id': {'$in': []}}"));
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (filter);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_test_encrypt_pending_ops (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_ctx_t *ops[MONGOCRYPT_CTX_PENDING_OPS_MAX];
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+
+   /* The schema is not known yet. */
+   BSON_ASSERT (1 == mongocrypt_ctx_pending_ops (
+                        ctx, ops, MONGOCRYPT_CTX_PENDING_OPS_MAX));
+   BSON_ASSERT (ops[0] == ctx);
+   _mongocrypt_tester_run_ctx_to (
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+
+   /* Keys are loaded alongside markings. */
+   BSON_ASSERT (2 == mongocrypt_ctx_pending_ops (
+                        ctx, ops, MONGOCRYPT_CTX_PENDING_OPS_MAX));
+   BSON_ASSERT (ops[0] == ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ops[1]) ==
+                MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   BSON_ASSERT (1 == mongocrypt_ctx_pending_ops (ctx, ops, 1));
+   BSON_ASSERT (2 == mongocrypt_ctx_pending_ops (
+                        ctx, ops, MONGOCRYPT_CTX_PENDING_OPS_MAX));
+   _mongocrypt_tester_run_ctx_to (tester, ops[1], MONGOCRYPT_CTX_READY);
+   BSON_ASSERT (1 == mongocrypt_ctx_pending_ops (
+                        ctx, ops, MONGOCRYPT_CTX_PENDING_OPS_MAX));
+
+   /* The keys are taken from the cache. */
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   BSON_ASSERT (1 == mongocrypt_ctx_pending_ops (
+                        ctx, ops, MONGOCRYPT_CTX_PENDING_OPS_MAX));
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Nothing to prefetch once the keys are cached. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   BSON_ASSERT (1 == mongocrypt_ctx_pending_ops (
+                        ctx, ops, MONGOCRYPT_CTX_PENDING_OPS_MAX));
+   mongocrypt_ctx_destroy (ctx);
+
+   BSON_ASSERT (0 == mongocrypt_ctx_pending_ops (NULL, ops, 1));
+   mongocrypt_destroy (crypt);
+}
+
+
+/* Operations started by mongocrypt_ctx_run, completed later in reverse
+ * order. */
+typedef struct {
+   mongocrypt_ctx_t *ops[8];
+   mongocrypt_kms_ctx_t *kms[8];
+   mongocrypt_ctx_state_t states[8];
+   int n_queued;
+   int max_queued;
+   int n_done;
+   bool ok;
+} _run_queue_t;
+
+
+static void
+_run_mongo (void *ctx,
+            mongocrypt_ctx_t *op,
+            mongocrypt_ctx_state_t state,
+            mongocrypt_binary_t *op_bson)
+{
+   _run_queue_t *queue = (_run_queue_t *) ctx;
+
+   BSON_ASSERT (mongocrypt_binary_len (op_bson) > 0);
+   BSON_ASSERT (queue->n_queued < 8);
+   queue->ops[queue->n_queued] = op;
+   queue->kms[queue->n_queued] = NULL;
+   queue->states[queue->n_queued++] = state;
+   queue->max_queued = BSON_MAX (queue->max_queued, queue->n_queued);
+}
+
+
+static void
+_run_kms (void *ctx, mongocrypt_ctx_t *op, mongocrypt_kms_ctx_t *kms)
+{
+   _run_queue_t *queue = (_run_queue_t *) ctx;
+
+   BSON_ASSERT (queue->n_queued < 8);
+   queue->ops[queue->n_queued] = op;
+   queue->kms[queue->n_queued] = kms;
+   queue->states[queue->n_queued++] = MONGOCRYPT_CTX_NEED_KMS;
+   queue->max_queued = BSON_MAX (queue->max_queued, queue->n_queued);
+}
+
+
+static void
+_run_done (void *ctx, mongocrypt_ctx_t *run, bool ok)
+{
+   _run_queue_t *queue = (_run_queue_t *) ctx;
+
+   BSON_ASSERT (queue->n_queued == 0);
+   BSON_ASSERT (mongocrypt_ctx_state (run) ==
+                (ok ? MONGOCRYPT_CTX_READY : MONGOCRYPT_CTX_ERROR));
+   queue->n_done++;
+   queue->ok = ok;
+}
+
+
+static void
+_run_complete_last (_mongocrypt_tester_t *tester, _run_queue_t *queue)
+{
+   mongocrypt_ctx_t *op;
+   mongocrypt_binary_t *reply = NULL;
+   int i;
+
+   i = --queue->n_queued;
+   op = queue->ops[i];
+   switch (queue->states[i]) {
+   case MONGOCRYPT_CTX_NEED_MONGO_COLLINFO:
+      reply = TEST_FILE ("./test/example/collection-info.json");
+      break;
+   case MONGOCRYPT_CTX_NEED_MONGO_MARKINGS:
+      reply = TEST_FILE ("./test/example/mongocryptd-reply.json");
+      break;
+   case MONGOCRYPT_CTX_NEED_MONGO_KEYS:
+      reply = TEST_FILE ("./test/example/key-document.json");
+      break;
+   case MONGOCRYPT_CTX_NEED_KMS:
+      _mongocrypt_tester_satisfy_kms (tester, queue->kms[i]);
+      break;
+   default:
+      BSON_ASSERT (false);
+   }
+   if (reply) {
+      ASSERT_OK (mongocrypt_ctx_mongo_feed (op, reply), op);
+   }
+   BSON_ASSERT (mongocrypt_ctx_run_continue (op));
+}
+
+
+static void
+_test_encrypt_run (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *expected, *out;
+   mongocrypt_status_t *status;
+   _run_queue_t queue;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   expected = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, expected), ctx);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+
+   /* The key find is started alongside the mongocryptd command. */
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (
+      mongocrypt_ctx_run (ctx, _run_mongo, _run_kms, _run_done, NULL),
+      ctx,
+      "uninitialized");
+   mongocrypt_ctx_destroy (ctx);
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   memset (&queue, 0, sizeof (queue));
+   ASSERT_OK (mongocrypt_ctx_run (ctx, _run_mongo, _run_kms, _run_done, &queue),
+              ctx);
+   BSON_ASSERT (
+      !mongocrypt_ctx_run (ctx, _run_mongo, _run_kms, _run_done, NULL));
+   while (queue.n_queued > 0) {
+      BSON_ASSERT (queue.n_done == 0);
+      _run_complete_last (tester, &queue);
+   }
+   BSON_ASSERT (queue.n_done == 1);
+   BSON_ASSERT (queue.ok);
+   BSON_ASSERT (queue.max_queued == 2);
+   BSON_ASSERT (!mongocrypt_ctx_run_continue (ctx));
+   out = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, out), ctx);
+   _assert_bin_bson_equal (out, expected);
+   mongocrypt_binary_destroy (out);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+
+   /* A failed operation ends the run. */
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   memset (&queue, 0, sizeof (queue));
+   ASSERT_OK (mongocrypt_ctx_run (ctx, _run_mongo, _run_kms, _run_done, &queue),
+              ctx);
+   BSON_ASSERT (queue.n_queued == 1);
+   status = mongocrypt_status_new ();
+   mongocrypt_status_set (
+      status, MONGOCRYPT_STATUS_ERROR_CLIENT, 1, "connection refused", -1);
+   queue.n_queued--;
+   BSON_ASSERT (mongocrypt_ctx_run_fail (queue.ops[0], status));
+   BSON_ASSERT (queue.n_done == 1);
+   BSON_ASSERT (!queue.ok);
+   ASSERT_FAILS_STATUS (
+      mongocrypt_ctx_status (ctx, status), status, "connection refused");
+   mongocrypt_status_destroy (status);
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (expected);
+   mongocrypt_destroy (crypt);
+}
+
+
 static void
 _test_encrypt_need_keys (_mongocrypt_tester_t *tester)
 {
@@ -868,155 +1235,191 @@ _test_local_schema (_mongocrypt_tester_t *tester)
    mongocrypt_destroy (crypt);
 }
 
+
 static void
-_test_encrypt_caches_collinfo (_mongocrypt_tester_t *tester)
+_test_local_schema_map_compiled (_mongocrypt_tester_t *tester)
 {
    mongocrypt_t *crypt;
    mongocrypt_ctx_t *ctx;
-   bson_t *cached_collinfo;
-   mongocrypt_status_t *status;
+   mongocrypt_binary_t *mongocryptd_cmd;
+   bson_t as_bson;
+   bson_iter_t iter;
 
-   crypt = _mongocrypt_tester_mongocrypt ();
-   ctx = mongocrypt_ctx_new (crypt);
-   status = mongocrypt_status_new ();
-   ASSERT_OK (mongocrypt_ctx_encrypt_init (
-                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
-              ctx);
-   _mongocrypt_tester_run_ctx_to (
-      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_COLLINFO);
-   ASSERT_OK (mongocrypt_ctx_mongo_feed (
-                 ctx, TEST_FILE ("./test/example/collection-info.json")),
-              ctx);
-   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
-   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
-                MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
-   /* The next ctx has the schema cached. */
-   BSON_ASSERT (_mongocrypt_cache_get (
-      &crypt->cache_collinfo, "test.test", (void **) &cached_collinfo));
-   BSON_ASSERT (cached_collinfo != NULL);
-   bson_destroy (cached_collinfo);
-   mongocrypt_ctx_destroy (ctx);
+   /* Schemas are checked when the schema map is compiled. */
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (
+      mongocrypt_setopt_schema_map (crypt, TEST_BSON ("{'test.test': 1}")),
+      crypt);
+   ASSERT_FAILS (mongocrypt_init (crypt), crypt, "malformed schema map");
+   mongocrypt_destroy (crypt);
 
-   /* The next context enters the NEED_MONGO_MARKINGS state immediately. */
+   /* The first schema for a repeated namespace is used. */
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_schema_map (
+                 crypt,
+                 TEST_BSON ("{'test.other': {'title': 'other'}, 'test.test': "
+                            "{'title': 'first'}, 'test.test': {'title': "
+                            "'second'}}")),
+              crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
    ctx = mongocrypt_ctx_new (crypt);
    ASSERT_OK (mongocrypt_ctx_encrypt_init (
                  ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
               ctx);
    BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
                 MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   mongocryptd_cmd = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, mongocryptd_cmd), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (mongocryptd_cmd, &as_bson));
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, "jsonSchema.title", &iter));
+   ASSERT_STREQUAL (bson_iter_utf8 (&iter, NULL), "first");
+   mongocrypt_binary_destroy (mongocryptd_cmd);
    mongocrypt_ctx_destroy (ctx);
-
    mongocrypt_destroy (crypt);
-   mongocrypt_status_destroy (status);
 }
 
-
 static void
-_test_encrypt_caches_keys (_mongocrypt_tester_t *tester)
+_test_local_schema_map_image (_mongocrypt_tester_t *tester)
 {
    mongocrypt_t *crypt;
    mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *schema_map, *image, *truncated, *mongocryptd_cmd;
+
+   schema_map = TEST_FILE ("./test/data/schema-map.json");
+   crypt = mongocrypt_new ();
+   image = mongocrypt_binary_new ();
+   ASSERT_FAILS (mongocrypt_build_schema_map_image (
+                    crypt, TEST_BSON ("{'a.b': 1}"), image),
+                 crypt,
+                 "malformed schema map");
+   ASSERT_OK (mongocrypt_build_schema_map_image (crypt, schema_map, image),
+              crypt);
+   mongocrypt_destroy (crypt);
+
+   /* The image is checked by mongocrypt_init. */
+   crypt = mongocrypt_new ();
+   truncated = mongocrypt_binary_new_from_data (
+      mongocrypt_binary_data (image), mongocrypt_binary_len (image) - 1);
+   ASSERT_OK (mongocrypt_setopt_schema_map_image (crypt, truncated), crypt);
+   ASSERT_FAILS (mongocrypt_setopt_schema_map (crypt, schema_map),
+                 crypt,
+                 "already set schema map");
+   ASSERT_FAILS (mongocrypt_init (crypt), crypt, "truncated");
+   mongocrypt_binary_destroy (truncated);
+   mongocrypt_destroy (crypt);
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (mongocrypt_setopt_schema_map_image (crypt, schema_map), crypt);
+   ASSERT_FAILS (mongocrypt_init (crypt), crypt, "not a schema map image");
+   mongocrypt_destroy (crypt);
+
+   /* The image finds the same schemas as the schema map. */
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_schema_map_image (crypt, image), crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
 
-   crypt = _mongocrypt_tester_mongocrypt ();
    ctx = mongocrypt_ctx_new (crypt);
+   mongocryptd_cmd = mongocrypt_binary_new ();
    ASSERT_OK (mongocrypt_ctx_encrypt_init (
-                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+                 ctx, "test", -1, TEST_BSON ("{'find': 'test2'}")),
               ctx);
-   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
-   mongocrypt_ctx_destroy (ctx);
-   /* The next context skips needing keys after being supplied mark documents.
-    */
-   ctx = mongocrypt_ctx_new (crypt);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, mongocryptd_cmd), ctx);
+   _assert_schema_compares (schema_map, "test.test2", mongocryptd_cmd);
+   mongocrypt_binary_destroy (mongocryptd_cmd);
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
    ASSERT_OK (mongocrypt_ctx_encrypt_init (
                  ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
               ctx);
-   _mongocrypt_tester_run_ctx_to (
-      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
-   ASSERT_OK (mongocrypt_ctx_mongo_feed (
-                 ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
-              ctx);
-   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
-   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
 
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_BSON ("{'find': 'mismatch'}")),
+              ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_COLLINFO);
    mongocrypt_ctx_destroy (ctx);
+
    mongocrypt_destroy (crypt);
+   mongocrypt_binary_destroy (image);
 }
 
 
 static void
-_test_encrypt_caches_keys_by_alt_name (_mongocrypt_tester_t *tester)
+_test_encrypt_caches_collinfo (_mongocrypt_tester_t *tester)
 {
    mongocrypt_t *crypt;
    mongocrypt_ctx_t *ctx;
+   bson_t *cached_collinfo;
+   mongocrypt_status_t *status;
+   _mongocrypt_schema_paths_t paths;
 
    crypt = _mongocrypt_tester_mongocrypt ();
    ctx = mongocrypt_ctx_new (crypt);
+   status = mongocrypt_status_new ();
    ASSERT_OK (mongocrypt_ctx_encrypt_init (
                  ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
               ctx);
    _mongocrypt_tester_run_ctx_to (
-      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
-   ASSERT_OK (
-      mongocrypt_ctx_mongo_feed (
-         ctx, TEST_FILE ("./test/data/mongocryptd-reply-key-alt-name.json")),
-      ctx);
-   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
-   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
-   ASSERT_OK (
-      mongocrypt_ctx_mongo_feed (
-         ctx, TEST_FILE ("./test/data/key-document-with-alt-name.json")),
-      ctx);
-   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
-   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
-   mongocrypt_ctx_destroy (ctx);
-
-   /* The next context skips needing keys after being supplied mark documents.
-    */
-   ctx = mongocrypt_ctx_new (crypt);
-   ASSERT_OK (mongocrypt_ctx_encrypt_init (
-                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_COLLINFO);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/collection-info.json")),
               ctx);
-   _mongocrypt_tester_run_ctx_to (
-      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
-   ASSERT_OK (
-      mongocrypt_ctx_mongo_feed (
-         ctx, TEST_FILE ("./test/data/mongocryptd-reply-key-alt-name.json")),
-      ctx);
    ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
-   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   /* The next ctx has the schema cached. */
+   BSON_ASSERT (_mongocrypt_cache_get (
+      crypt->cache_collinfo, "test.test", (void **) &cached_collinfo));
+   BSON_ASSERT (cached_collinfo != NULL);
+   /* The encrypted paths of the schema are compiled with the entry. */
+   BSON_ASSERT (
+      _mongocrypt_cache_collinfo_value_paths (cached_collinfo, &paths));
+   BSON_ASSERT (paths.len == 1);
+   BSON_ASSERT (0 == strcmp (paths.paths[0], "ssn"));
+   _mongocrypt_schema_paths_cleanup (&paths);
+   bson_destroy (cached_collinfo);
    mongocrypt_ctx_destroy (ctx);
 
-   /* But a context requesting a different key alt name does not get it from the
-    * cache. */
+   /* The next context enters the NEED_MONGO_MARKINGS state immediately. */
    ctx = mongocrypt_ctx_new (crypt);
    ASSERT_OK (mongocrypt_ctx_encrypt_init (
                  ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
               ctx);
-   _mongocrypt_tester_run_ctx_to (
-      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
-   ASSERT_OK (
-      mongocrypt_ctx_mongo_feed (
-         ctx, TEST_FILE ("./test/data/mongocryptd-reply-key-alt-name2.json")),
-      ctx);
-   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
-   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
-   ASSERT_OK (
-      mongocrypt_ctx_mongo_feed (
-         ctx, TEST_FILE ("./test/data/key-document-with-alt-name2.json")),
-      ctx);
-   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
-   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
    mongocrypt_ctx_destroy (ctx);
 
    mongocrypt_destroy (crypt);
+   mongocrypt_status_destroy (status);
 }
 
 
 static void
-_test_encrypt_random (_mongocrypt_tester_t *tester)
+_test_encrypt_caches_missing_collinfo (_mongocrypt_tester_t *tester)
 {
    mongocrypt_t *crypt;
    mongocrypt_ctx_t *ctx;
+   bson_t *value = NULL;
+   bson_t collinfo;
+   uint32_t digest = 1;
 
    crypt = _mongocrypt_tester_mongocrypt ();
    ctx = mongocrypt_ctx_new (crypt);
@@ -1024,144 +1427,964 @@ _test_encrypt_random (_mongocrypt_tester_t *tester)
                  ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
               ctx);
    _mongocrypt_tester_run_ctx_to (
-      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
-   ASSERT_OK (mongocrypt_ctx_mongo_feed (
-                 ctx, TEST_FILE ("./test/data/mongocryptd-reply-random.json")),
-              ctx);
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_COLLINFO);
+   /* listCollections returned nothing. */
    ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
-   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   mongocrypt_ctx_destroy (ctx);
+
+   BSON_ASSERT (_mongocrypt_cache_get (
+      crypt->cache_collinfo, "test.test", (void **) &value));
+   BSON_ASSERT (value);
+   BSON_ASSERT (
+      _mongocrypt_cache_collinfo_value_parse (value, &collinfo, &digest));
+   BSON_ASSERT (bson_empty (&collinfo));
+   BSON_ASSERT (digest == 0);
+   bson_destroy (&collinfo);
+   bson_destroy (value);
+
+   /* The next context does not repeat listCollections. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
    mongocrypt_ctx_destroy (ctx);
+
    mongocrypt_destroy (crypt);
 }
 
 
 static void
-_test_encrypt_is_remote_schema (_mongocrypt_tester_t *tester)
+_test_encrypt_prefetch_collinfo (_mongocrypt_tester_t *tester)
 {
    mongocrypt_t *crypt;
    mongocrypt_ctx_t *ctx;
-   mongocrypt_binary_t *bin;
-   bson_t as_bson;
-   bson_iter_t iter;
-
-   bin = mongocrypt_binary_new ();
+   mongocrypt_binary_t *out;
+   bson_t *value = NULL;
+   bson_t collinfo;
+   uint32_t digest = 0;
 
-   /* isRemoteSchema = true for a remote schema. */
    crypt = _mongocrypt_tester_mongocrypt ();
+   out = mongocrypt_binary_new ();
+
    ctx = mongocrypt_ctx_new (crypt);
-   ASSERT_OK (mongocrypt_ctx_encrypt_init (
-                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+   ASSERT_OK (mongocrypt_ctx_prefetch_collinfo_init (
+                 ctx, "test", -1, TEST_BSON ("{'names': ['test', 'other']}")),
               ctx);
-   _mongocrypt_tester_run_ctx_to (
-      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
-   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, bin), ctx);
-   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
-   BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "isRemoteSchema"));
-   BSON_ASSERT (bson_iter_bool (&iter) == true);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_COLLINFO);
+   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, out), ctx);
+   _assert_bin_bson_equal (
+      out, TEST_BSON ("{'name': {'$in': ['test', 'other']}}"));
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/collection-info.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, out), ctx);
+   _assert_bin_bson_equal (out, TEST_BSON ("{}"));
    mongocrypt_ctx_destroy (ctx);
-   mongocrypt_destroy (crypt);
 
-   /* isRemoteSchema = false for a local schema. */
-   crypt = mongocrypt_new ();
-   ASSERT_OK (
-      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
-      crypt);
-   ASSERT_OK (mongocrypt_setopt_schema_map (
-                 crypt, TEST_FILE ("./test/data/schema-map.json")),
-              crypt);
-   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   /* Both collections are cached, the missing one as a negative entry. */
+   BSON_ASSERT (_mongocrypt_cache_get (
+      crypt->cache_collinfo, "test.test", (void **) &value));
+   BSON_ASSERT (value);
+   BSON_ASSERT (
+      _mongocrypt_cache_collinfo_value_parse (value, &collinfo, &digest));
+   BSON_ASSERT (!bson_empty (&collinfo));
+   BSON_ASSERT (digest != 0);
+   bson_destroy (&collinfo);
+   bson_destroy (value);
+   value = NULL;
+   BSON_ASSERT (_mongocrypt_cache_get (
+      crypt->cache_collinfo, "test.other", (void **) &value));
+   BSON_ASSERT (value);
+   BSON_ASSERT (
+      _mongocrypt_cache_collinfo_value_parse (value, &collinfo, &digest));
+   BSON_ASSERT (bson_empty (&collinfo));
+   BSON_ASSERT (digest == 0);
+   bson_destroy (&collinfo);
+   bson_destroy (value);
+
+   /* An encryption context skips listCollections. */
    ctx = mongocrypt_ctx_new (crypt);
    ASSERT_OK (mongocrypt_ctx_encrypt_init (
                  ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
               ctx);
-   _mongocrypt_tester_run_ctx_to (
-      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
-   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, bin), ctx);
-   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
-   BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "isRemoteSchema"));
-   BSON_ASSERT (bson_iter_bool (&iter) == false);
-
-   mongocrypt_binary_destroy (bin);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
    mongocrypt_ctx_destroy (ctx);
-   mongocrypt_destroy (crypt);
-}
 
-static void
-_init_fails (_mongocrypt_tester_t *tester, const char *json, const char *msg)
-{
-   mongocrypt_t *crypt;
-   mongocrypt_ctx_t *ctx;
+   /* Without names, the whole database is listed. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_prefetch_collinfo_init (ctx, "db", -1, NULL),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, out), ctx);
+   _assert_bin_bson_equal (out, TEST_BSON ("{}"));
+   ASSERT_FAILS (mongocrypt_ctx_mongo_feed (ctx, TEST_BSON ("{'x': 1}")),
+                 ctx,
+                 "collection info has no \"name\"");
+   mongocrypt_ctx_destroy (ctx);
 
-   crypt = _mongocrypt_tester_mongocrypt ();
    ctx = mongocrypt_ctx_new (crypt);
-   ASSERT_FAILS (
-      mongocrypt_ctx_encrypt_init (ctx, "test", -1, TEST_BSON (json)),
-      ctx,
-      msg);
+   ASSERT_FAILS (mongocrypt_ctx_prefetch_collinfo_init (
+                    ctx, "test", -1, TEST_BSON ("{'names': []}")),
+                 ctx,
+                 "\"names\" must not be empty");
    mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (out);
    mongocrypt_destroy (crypt);
 }
 
 
 static void
-_init_ok (_mongocrypt_tester_t *tester, const char *json)
+_test_encrypt_collinfo_export_import (_mongocrypt_tester_t *tester)
 {
-   mongocrypt_t *crypt;
+   mongocrypt_t *crypt, *restarted;
    mongocrypt_ctx_t *ctx;
-   mongocrypt_binary_t *filter;
+   mongocrypt_binary_t *exported, *out;
+   bson_t *value = NULL;
+   bson_t as_bson, collinfo;
+   bson_iter_t iter;
+   uint32_t digest = 0;
 
    crypt = _mongocrypt_tester_mongocrypt ();
+   out = mongocrypt_binary_new ();
    ctx = mongocrypt_ctx_new (crypt);
-
-   ASSERT_OK (mongocrypt_ctx_encrypt_init (ctx, "test", -1, TEST_BSON (json)),
+   ASSERT_OK (mongocrypt_ctx_prefetch_collinfo_init (
+                 ctx, "test", -1, TEST_BSON ("{'names': ['test', 'other']}")),
               ctx);
-   /* verify the collection in the filter is 'coll' */
-   BSON_ASSERT (MONGOCRYPT_CTX_NEED_MONGO_COLLINFO ==
-                mongocrypt_ctx_state (ctx));
+   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, out), ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/collection-info.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, out), ctx);
+   mongocrypt_ctx_destroy (ctx);
 
-   filter = mongocrypt_binary_new ();
-   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, filter), ctx);
-   _assert_bin_bson_equal (filter, TEST_BSON ("{'name': 'coll'}"));
+   exported = mongocrypt_binary_new ();
+   ASSERT_FAILS (mongocrypt_collinfo_cache_export (crypt, NULL),
+                 crypt,
+                 "invalid NULL output");
+   ASSERT_OK (mongocrypt_collinfo_cache_export (crypt, exported), crypt);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (exported, &as_bson));
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (
+      bson_iter_find_descendant (&iter, "collections.1.ttlMs", &iter));
+   BSON_ASSERT (bson_iter_int64 (&iter) > 0);
+   BSON_ASSERT (bson_iter_int64 (&iter) <= CACHE_EXPIRATION_MS);
+   mongocrypt_destroy (crypt);
 
-   mongocrypt_binary_destroy (filter);
+   restarted = _mongocrypt_tester_mongocrypt ();
+   ASSERT_FAILS (mongocrypt_collinfo_cache_import (
+                    restarted, TEST_BSON ("{'v': 2, 'collections': []}")),
+                 restarted,
+                 "unsupported collinfo cache export version");
+   ASSERT_FAILS (
+      mongocrypt_collinfo_cache_import (
+         restarted, TEST_BSON ("{'v': 1, 'collections': [{'ttlMs': 1}]}")),
+      restarted,
+      "expected string 'ns'");
+   ASSERT_OK (mongocrypt_collinfo_cache_import (restarted, exported),
+              restarted);
+
+   /* The missing collection stays a negative entry. */
+   BSON_ASSERT (_mongocrypt_cache_get (
+      restarted->cache_collinfo, "test.other", (void **) &value));
+   BSON_ASSERT (value);
+   BSON_ASSERT (
+      _mongocrypt_cache_collinfo_value_parse (value, &collinfo, &digest));
+   BSON_ASSERT (bson_empty (&collinfo));
+   bson_destroy (&collinfo);
+   bson_destroy (value);
+
+   /* An encryption context skips listCollections after the restart. */
+   ctx = mongocrypt_ctx_new (restarted);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
    mongocrypt_ctx_destroy (ctx);
-   mongocrypt_destroy (crypt);
+
+   mongocrypt_destroy (restarted);
+   mongocrypt_binary_destroy (exported);
+   mongocrypt_binary_destroy (out);
 }
 
 
+/* Test that a schema mongocryptd reports as requiring no encryption is
+ * remembered in the collinfo cache. */
 static void
-_init_bypass (_mongocrypt_tester_t *tester, const char *json)
+_test_encrypt_caches_no_encryption (_mongocrypt_tester_t *tester)
 {
    mongocrypt_t *crypt;
    mongocrypt_ctx_t *ctx;
    mongocrypt_binary_t *bin;
+   bson_t *value = NULL;
 
-   bin = mongocrypt_binary_new ();
    crypt = _mongocrypt_tester_mongocrypt ();
+   bin = mongocrypt_binary_new ();
    ctx = mongocrypt_ctx_new (crypt);
-   ASSERT_OK (mongocrypt_ctx_encrypt_init (ctx, "test", -1, TEST_BSON (json)),
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
               ctx);
-   BSON_ASSERT (MONGOCRYPT_CTX_READY == mongocrypt_ctx_state (ctx));
+   _mongocrypt_tester_run_ctx_to (
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   ASSERT_OK (
+      mongocrypt_ctx_mongo_feed (
+         ctx,
+         TEST_FILE ("./test/data/mongocryptd-reply-no-encryption-needed.json")),
+      ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   mongocrypt_ctx_destroy (ctx);
+
+   BSON_ASSERT (_mongocrypt_cache_get (
+      crypt->cache_collinfo, "test.test", (void **) &value));
+   BSON_ASSERT (value);
+   BSON_ASSERT (!_mongocrypt_cache_collinfo_value_requires_encryption (value));
+   bson_destroy (value);
+
+   /* The next context does not go to mongocryptd. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
    ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
-   _assert_bin_bson_equal (bin, TEST_BSON (json));
+   _assert_bin_bson_equal (bin, TEST_FILE ("./test/example/cmd.json"));
+   mongocrypt_ctx_destroy (ctx);
 
-   mongocrypt_binary_destroy (bin);
+   /* A schema that requires encryption is not marked. */
+   mongocrypt_destroy (crypt);
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_KEYS);
    mongocrypt_ctx_destroy (ctx);
+
+   BSON_ASSERT (_mongocrypt_cache_get (
+      crypt->cache_collinfo, "test.test", (void **) &value));
+   BSON_ASSERT (value);
+   BSON_ASSERT (_mongocrypt_cache_collinfo_value_requires_encryption (value));
+   bson_destroy (value);
+
+   mongocrypt_binary_destroy (bin);
    mongocrypt_destroy (crypt);
 }
 
-
 static void
-_test_encrypt_init_each_cmd (_mongocrypt_tester_t *tester)
+_test_encrypt_caches_keys (_mongocrypt_tester_t *tester)
 {
-   /* collection aggregate is ok */
-   _init_ok (tester, "{'aggregate': 'coll'}");
-   /* db agg is not ok */
-   _init_fails (
-      tester,
-      "{'aggregate': 1}",
-      "non-collection command not supported for auto encryption: aggregate");
-   _init_ok (tester, "{'count': 'coll'}");
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+   /* The next context skips needing keys after being supplied mark documents.
+    */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_test_encrypt_caches_keys_by_alt_name (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   ASSERT_OK (
+      mongocrypt_ctx_mongo_feed (
+         ctx, TEST_FILE ("./test/data/mongocryptd-reply-key-alt-name.json")),
+      ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   ASSERT_OK (
+      mongocrypt_ctx_mongo_feed (
+         ctx, TEST_FILE ("./test/data/key-document-with-alt-name.json")),
+      ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* The next context skips needing keys after being supplied mark documents.
+    */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   ASSERT_OK (
+      mongocrypt_ctx_mongo_feed (
+         ctx, TEST_FILE ("./test/data/mongocryptd-reply-key-alt-name.json")),
+      ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* But a context requesting a different key alt name does not get it from the
+    * cache. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   ASSERT_OK (
+      mongocrypt_ctx_mongo_feed (
+         ctx, TEST_FILE ("./test/data/mongocryptd-reply-key-alt-name2.json")),
+      ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   ASSERT_OK (
+      mongocrypt_ctx_mongo_feed (
+         ctx, TEST_FILE ("./test/data/key-document-with-alt-name2.json")),
+      ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_test_encrypt_markings_cache (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx, *dctx;
+   mongocrypt_binary_t *encrypted, *decrypted;
+   bson_t as_bson;
+   bson_iter_t iter;
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_use_markings_cache (crypt, 0), crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   ASSERT_FAILS (mongocrypt_setopt_use_markings_cache (crypt, 0),
+                 crypt,
+                 "options cannot be set after initialization");
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* A command of the same shape skips mongocryptd. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx,
+                 "test",
+                 -1,
+                 TEST_BSON ("{'find': 'test', 'filter': {'ssn': '123'}}")),
+              ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   encrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, encrypted), ctx);
+
+   /* The new literal was encrypted. */
+   dctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (dctx, encrypted), dctx);
+   BSON_ASSERT (mongocrypt_ctx_state (dctx) == MONGOCRYPT_CTX_READY);
+   decrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (dctx, decrypted), dctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (decrypted, &as_bson));
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, "filter.ssn", &iter));
+   ASSERT_STREQUAL (bson_iter_utf8 (&iter, NULL), "123");
+   mongocrypt_binary_destroy (decrypted);
+   mongocrypt_ctx_destroy (dctx);
+   mongocrypt_binary_destroy (encrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* A command of a different shape does not. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (
+      mongocrypt_ctx_encrypt_init (
+         ctx,
+         "test",
+         -1,
+         TEST_BSON ("{'find': 'test', 'filter': {'ssn': '123', 'a': 'b'}}")),
+      ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_destroy (crypt);
+}
+
+
+static int64_t
+_ciphertext_cache_stat (mongocrypt_t *crypt, const char *name)
+{
+   mongocrypt_binary_t *bin;
+   bson_t as_bson;
+   bson_iter_t iter;
+   char *path;
+   int64_t value;
+
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_get_stats (crypt, bin), crypt);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   path = bson_strdup_printf ("cache.ciphertext.%s", name);
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, path, &iter));
+   value = bson_iter_int64 (&iter);
+   bson_free (path);
+   mongocrypt_binary_destroy (bin);
+   return value;
+}
+
+
+static void
+_test_encrypt_ciphertext_cache (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *first, *second;
+   int i;
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_FAILS (mongocrypt_setopt_use_ciphertext_cache (crypt, 0),
+                 crypt,
+                 "must be positive");
+   ASSERT_OK (mongocrypt_setopt_use_ciphertext_cache (crypt, 1), crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   ASSERT_FAILS (mongocrypt_setopt_use_ciphertext_cache (crypt, 1),
+                 crypt,
+                 "options cannot be set after initialization");
+
+   first = mongocrypt_binary_new ();
+   second = mongocrypt_binary_new ();
+   for (i = 0; i < 2; i++) {
+      ctx = mongocrypt_ctx_new (crypt);
+      ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                    ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+                 ctx);
+      _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+      ASSERT_OK (mongocrypt_ctx_finalize (ctx, i == 0 ? first : second), ctx);
+      mongocrypt_ctx_destroy (ctx);
+   }
+
+   /* The second deterministic encryption was copied from the cache. */
+   BSON_ASSERT (1 == _ciphertext_cache_stat (crypt, "misses"));
+   BSON_ASSERT (1 == _ciphertext_cache_stat (crypt, "hits"));
+   BSON_ASSERT (1 == _ciphertext_cache_stat (crypt, "entries"));
+   _assert_bin_bson_equal (first, second);
+
+   mongocrypt_binary_destroy (second);
+   mongocrypt_binary_destroy (first);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_test_encrypt_local_marking (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *schema_map;
+
+   schema_map = TEST_BSON (
+      "{'test.test': {'bsonType': 'object', 'properties': {'ssn': {'encrypt': "
+      "{'keyId': [{'$binary': {'base64': 'YWFhYWFhYWFhYWFhYWFhYQ==', "
+      "'subType': '04'}}], 'bsonType': 'string', 'algorithm': "
+      "'AEAD_AES_256_CBC_HMAC_SHA_512-Deterministic'}}}}}");
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_schema_map (crypt, schema_map), crypt);
+   ASSERT_FAILS (mongocrypt_setopt_local_marking (crypt, "test", -1),
+                 crypt,
+                 "invalid namespace");
+   ASSERT_OK (mongocrypt_setopt_local_marking (crypt, "test.test", -1), crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   ASSERT_FAILS (mongocrypt_setopt_local_marking (crypt, "test.test", -1),
+                 crypt,
+                 "options cannot be set after initialization");
+
+   /* An equality find is marked without mongocryptd. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* A range query is still marked by mongocryptd. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (
+      mongocrypt_ctx_encrypt_init (
+         ctx,
+         "test",
+         -1,
+         TEST_BSON ("{'find': 'test', 'filter': {'ssn': {'$gt': '123'}}}")),
+      ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_destroy (crypt);
+}
+
+
+/* Only the encrypted paths of an insert are searched for markings. */
+static void
+_test_encrypt_plan (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *schema_map, *out;
+   bson_t as_bson;
+   bson_iter_t iter;
+   _mongocrypt_buffer_t buf;
+   const char *paths[] = {"documents.0.ssn", "documents.1.ssn"};
+   int i;
+
+   schema_map = TEST_BSON (
+      "{'test.test': {'bsonType': 'object', 'properties': {'ssn': {'encrypt': "
+      "{'keyId': [{'$binary': {'base64': 'YWFhYWFhYWFhYWFhYWFhYQ==', "
+      "'subType': '04'}}], 'bsonType': 'string', 'algorithm': "
+      "'AEAD_AES_256_CBC_HMAC_SHA_512-Deterministic'}}}}}");
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_schema_map (crypt, schema_map), crypt);
+   ASSERT_OK (mongocrypt_setopt_local_marking (crypt, "test.test", -1), crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx,
+                 "test",
+                 -1,
+                 TEST_BSON ("{'insert': 'test', 'documents': [{'ssn': '1', "
+                            "'a': {'b': [1, 2]}}, {'ssn': '2'}]}")),
+              ctx);
+   BSON_ASSERT (((_mongocrypt_ctx_encrypt_t *) ctx)->plan.len == 1);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   /* The markings were recorded with their keys requested. */
+   BSON_ASSERT (((_mongocrypt_ctx_encrypt_t *) ctx)->collected.n_items == 2);
+   out = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, out), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (out, &as_bson));
+   for (i = 0; i < 2; i++) {
+      BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+      BSON_ASSERT (bson_iter_find_descendant (&iter, paths[i], &iter));
+      BSON_ASSERT (_mongocrypt_buffer_from_binary_iter (&buf, &iter));
+      BSON_ASSERT (buf.subtype == 6);
+      BSON_ASSERT (buf.data[0] == 1); /* Deterministic ciphertext. */
+   }
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, "documents.0.a.b.1", &iter));
+   BSON_ASSERT (BSON_ITER_HOLDS_INT32 (&iter));
+   mongocrypt_binary_destroy (out);
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_destroy (crypt);
+}
+
+
+static bool
+_cmd_is_disjoint (_mongocrypt_tester_t *tester,
+                  const char *schema,
+                  const char *cmd)
+{
+   _mongocrypt_schema_paths_t paths;
+   bool ret;
+
+   BSON_ASSERT (_mongocrypt_schema_paths_init (&paths, TMP_BSON (schema)));
+   ret = _mongocrypt_schema_paths_cmd_is_disjoint (&paths, TMP_BSON (cmd));
+   _mongocrypt_schema_paths_cleanup (&paths);
+   return ret;
+}
+
+
+static void
+_test_encrypt_schema_paths (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_schema_paths_t paths;
+   const char *schema = "{'properties': {'a': {'properties': {'b': "
+                        "{'encrypt': {}}}}, 'c': {'encrypt': {}}}}";
+
+   BSON_ASSERT (_mongocrypt_schema_paths_init (&paths, TMP_BSON (schema)));
+   BSON_ASSERT (paths.len == 2);
+   BSON_ASSERT (0 == strcmp (paths.paths[0], "a.b"));
+   BSON_ASSERT (0 == strcmp (paths.paths[1], "c"));
+   _mongocrypt_schema_paths_cleanup (&paths);
+
+   /* Encrypted fields that cannot be listed. */
+   BSON_ASSERT (!_mongocrypt_schema_paths_init (
+      &paths, TMP_BSON ("{'items': {'encrypt': {}}}")));
+   BSON_ASSERT (!_mongocrypt_schema_paths_init (
+      &paths,
+      TMP_BSON ("{'patternProperties': {'^a': {'encrypt': {}}}}")));
+   BSON_ASSERT (!_mongocrypt_schema_paths_init (&paths,
+                                                TMP_BSON ("{'encrypt': {}}")));
+   BSON_ASSERT (_mongocrypt_schema_paths_init (
+      &paths, TMP_BSON ("{'items': {'bsonType': 'int'}}")));
+   BSON_ASSERT (paths.len == 0);
+   _mongocrypt_schema_paths_cleanup (&paths);
+
+   BSON_ASSERT (_cmd_is_disjoint (
+      tester, schema, "{'find': 'c', 'filter': {'a.d': 1, 'cc': 2}}"));
+   BSON_ASSERT (_cmd_is_disjoint (
+      tester,
+      schema,
+      "{'find': 'c', 'filter': {'$or': [{'d': 1}, {'e': {'$gt': 1}}]}, "
+      "'projection': {'d': 1}, 'sort': {'e': 1}, 'limit': 1, '$db': 'db'}"));
+   BSON_ASSERT (_cmd_is_disjoint (
+      tester, schema, "{'insert': 'c', 'documents': [{'d': 1}, {'e': 2}]}"));
+   BSON_ASSERT (_cmd_is_disjoint (
+      tester,
+      schema,
+      "{'delete': 'c', 'deletes': [{'q': {'d': 1}, 'limit': 1}]}"));
+   BSON_ASSERT (_cmd_is_disjoint (
+      tester, schema, "{'distinct': 'c', 'key': 'd', 'query': {'e': 1}}"));
+   BSON_ASSERT (
+      _cmd_is_disjoint (tester, "{}", "{'find': 'c', 'filter': {'c': 1}}"));
+
+   /* A prefix or an extension of an encrypted path. */
+   BSON_ASSERT (
+      !_cmd_is_disjoint (tester, schema, "{'find': 'c', 'filter': {'a': 1}}"));
+   BSON_ASSERT (!_cmd_is_disjoint (
+      tester, schema, "{'find': 'c', 'filter': {'c.d': 1}}"));
+   BSON_ASSERT (!_cmd_is_disjoint (
+      tester, schema, "{'find': 'c', 'filter': {'$and': [{'a.b': 1}]}}"));
+   BSON_ASSERT (!_cmd_is_disjoint (
+      tester, schema, "{'find': 'c', 'projection': {'c': 1}}"));
+   BSON_ASSERT (!_cmd_is_disjoint (
+      tester, schema, "{'insert': 'c', 'documents': [{'d': 1}, {'a': {}}]}"));
+   BSON_ASSERT (
+      !_cmd_is_disjoint (tester, schema, "{'distinct': 'c', 'key': 'c'}"));
+
+   /* Paths and commands that are not compared. */
+   BSON_ASSERT (!_cmd_is_disjoint (
+      tester, schema, "{'find': 'c', 'filter': {'d.0': 1}}"));
+   BSON_ASSERT (!_cmd_is_disjoint (
+      tester, schema, "{'find': 'c', 'filter': {'$expr': {'$eq': [1, 1]}}}"));
+   BSON_ASSERT (!_cmd_is_disjoint (
+      tester, schema, "{'find': 'c', 'filter': {}, 'collation': {}}"));
+   BSON_ASSERT (
+      !_cmd_is_disjoint (tester, schema, "{'aggregate': 'c', 'pipeline': []}"));
+}
+
+
+static void
+_test_encrypt_skip_unencrypted_cmds (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *cmd, *out;
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_skip_unencrypted_commands (crypt, true), crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   ASSERT_FAILS (mongocrypt_setopt_skip_unencrypted_commands (crypt, true),
+                 crypt,
+                 "options cannot be set after initialization");
+   out = mongocrypt_binary_new ();
+
+   /* A find on an unencrypted field is returned unchanged. */
+   cmd = TEST_BSON ("{'find': 'test', 'filter': {'name': 'Shannon'}}");
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (ctx, "test", -1, cmd), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, out), ctx);
+   _assert_bin_bson_equal (out, cmd);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* A find on an encrypted field still needs mongocryptd. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (out);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_test_encrypt_random (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/data/mongocryptd-reply-random.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+}
+
+
+#define DETERMINISTIC_MARKING                                             \
+   "{'$binary': {'subType': '06', 'base64': "                            \
+   "'ADgAAAAQYQABAAAABWtpABAAAAAEYWFhYWFhYWFhYWFhYWFhYQJ2AAwAAAA0NTctNTUt" \
+   "NTQ2MgAA'}}"
+#define RANDOM_MARKING                                                    \
+   "{'$binary': {'subType': '06', 'base64': "                            \
+   "'ADgAAAAQYQACAAAABWtpABAAAAAEYWFhYWFhYWFhYWFhYWFhYQJ2AAwAAAA0NTctNTUt" \
+   "NTQ2MgAA'}}"
+
+
+static void
+_in_element (bson_t *doc, const char *index, _mongocrypt_buffer_t *out)
+{
+   bson_iter_t iter;
+   char path[32];
+
+   bson_snprintf (path, sizeof (path), "filter.ssn.$in.%s", index);
+   BSON_ASSERT (bson_iter_init (&iter, doc));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, path, &iter));
+   BSON_ASSERT (_mongocrypt_buffer_from_binary_iter (out, &iter));
+}
+
+
+/* Repeated deterministic markings are encrypted once and share a
+ * ciphertext. Random markings are never shared. */
+static void
+_test_encrypt_dedupe (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *out;
+   _mongocrypt_buffer_t elems[5];
+   bson_t as_bson;
+   int i;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx,
+                 TEST_BSON ("{'ok': 1, 'schemaRequiresEncryption': true, "
+                            "'hasEncryptedPlaceholders': true, 'result': "
+                            "{'find': 'test', 'filter': {'ssn': {'$in': "
+                            "[%s, %s, %s, %s, %s]}}}}",
+                            DETERMINISTIC_MARKING,
+                            RANDOM_MARKING,
+                            DETERMINISTIC_MARKING,
+                            RANDOM_MARKING,
+                            DETERMINISTIC_MARKING)),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   out = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, out), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (out, &as_bson));
+
+   for (i = 0; i < 5; i++) {
+      char index[2] = {(char) ('0' + i), '\0'};
+
+      _in_element (&as_bson, index, &elems[i]);
+   }
+   BSON_ASSERT (0 == _mongocrypt_buffer_cmp (&elems[0], &elems[2]));
+   BSON_ASSERT (0 == _mongocrypt_buffer_cmp (&elems[0], &elems[4]));
+   BSON_ASSERT (0 != _mongocrypt_buffer_cmp (&elems[1], &elems[3]));
+   BSON_ASSERT (0 != _mongocrypt_buffer_cmp (&elems[0], &elems[1]));
+
+   mongocrypt_binary_destroy (out);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+}
+
+#undef DETERMINISTIC_MARKING
+#undef RANDOM_MARKING
+
+
+static void
+_test_encrypt_is_remote_schema (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+   bson_t as_bson;
+   bson_iter_t iter;
+
+   bin = mongocrypt_binary_new ();
+
+   /* isRemoteSchema = true for a remote schema. */
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, bin), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "isRemoteSchema"));
+   BSON_ASSERT (bson_iter_bool (&iter) == true);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+
+   /* isRemoteSchema = false for a local schema. */
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_schema_map (
+                 crypt, TEST_FILE ("./test/data/schema-map.json")),
+              crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, bin), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "isRemoteSchema"));
+   BSON_ASSERT (bson_iter_bool (&iter) == false);
+
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+}
+
+static void
+_init_fails (_mongocrypt_tester_t *tester, const char *json, const char *msg)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (
+      mongocrypt_ctx_encrypt_init (ctx, "test", -1, TEST_BSON (json)),
+      ctx,
+      msg);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_init_ok (_mongocrypt_tester_t *tester, const char *json)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *filter;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (ctx, "test", -1, TEST_BSON (json)),
+              ctx);
+   /* verify the collection in the filter is 'coll' */
+   BSON_ASSERT (MONGOCRYPT_CTX_NEED_MONGO_COLLINFO ==
+                mongocrypt_ctx_state (ctx));
+
+   filter = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, filter), ctx);
+   _assert_bin_bson_equal (filter, TEST_BSON ("{'name': 'coll'}"));
+
+   mongocrypt_binary_destroy (filter);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_init_bypass (_mongocrypt_tester_t *tester, const char *json)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+
+   bin = mongocrypt_binary_new ();
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (ctx, "test", -1, TEST_BSON (json)),
+              ctx);
+   BSON_ASSERT (MONGOCRYPT_CTX_READY == mongocrypt_ctx_state (ctx));
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   _assert_bin_bson_equal (bin, TEST_BSON (json));
+
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_test_encrypt_init_each_cmd (_mongocrypt_tester_t *tester)
+{
+   /* collection aggregate is ok */
+   _init_ok (tester, "{'aggregate': 'coll'}");
+   /* db agg is not ok */
+   _init_fails (
+      tester,
+      "{'aggregate': 1}",
+      "non-collection command not supported for auto encryption: aggregate");
+   _init_ok (tester, "{'count': 'coll'}");
    _init_ok (tester, "{'distinct': 'coll'}");
    _init_ok (tester, "{'delete': 'coll'}");
    _init_ok (tester, "{'find': 'coll'}");
@@ -1213,156 +2436,1067 @@ _test_encrypt_init_each_cmd (_mongocrypt_tester_t *tester)
 
 
 static void
-_test_encrypt_invalid_siblings (_mongocrypt_tester_t *tester)
+_test_encrypt_invalid_siblings (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+
+   BSON_ASSERT (MONGOCRYPT_CTX_NEED_MONGO_COLLINFO ==
+                mongocrypt_ctx_state (ctx));
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/data/collinfo-siblings.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+
+   BSON_ASSERT (MONGOCRYPT_CTX_NEED_MONGO_MARKINGS ==
+                mongocrypt_ctx_state (ctx));
+   ASSERT_FAILS (mongocrypt_ctx_mongo_feed (
+                    ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
+                 ctx,
+                 "JSON schema validator has siblings");
+
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_test_encrypt_dupe_jsonschema (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+
+   BSON_ASSERT (MONGOCRYPT_CTX_NEED_MONGO_COLLINFO ==
+                mongocrypt_ctx_state (ctx));
+   ASSERT_FAILS (mongocrypt_ctx_mongo_feed (
+                    ctx,
+                    TEST_BSON ("{'options': {'validator': { '$jsonSchema': {}, "
+                               "'$jsonSchema': {} } } }")),
+                 ctx,
+                 "duplicate $jsonSchema");
+
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_test_encrypting_with_explicit_encryption (_mongocrypt_tester_t *tester)
+{
+   /* Test that we do not strip existing ciphertexts when automatically
+    * encrypting a document. */
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+   bson_iter_t iter;
+   bson_t tmp;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+
+   _mongocrypt_tester_run_ctx_to (
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   ASSERT_OK (
+      mongocrypt_ctx_mongo_feed (
+         ctx,
+         TEST_FILE ("./test/data/mongocryptd-reply-existing-ciphertext.json")),
+      ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   mongocrypt_ctx_finalize (ctx, bin);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &tmp));
+   BSON_ASSERT (bson_iter_init (&iter, &tmp));
+   BSON_ASSERT (
+      bson_iter_find_descendant (&iter, "filter.existing_ciphertext", &iter));
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+}
+
+static void
+_test_explicit_encryption (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   _mongocrypt_buffer_t from_key_id, from_key_altname;
+   mongocrypt_binary_t *bin, *key_id;
+   char *deterministic = "AEAD_AES_256_CBC_HMAC_SHA_512-Deterministic";
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+
+   ctx = mongocrypt_ctx_new (crypt);
+   key_id = mongocrypt_binary_new_from_data (
+      MONGOCRYPT_DATA_AND_LEN ("aaaaaaaaaaaaaaaa"));
+
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, deterministic, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   ASSERT_OK (
+      mongocrypt_ctx_explicit_encrypt_init (ctx, TEST_BSON ("{'v': 123}")),
+      ctx);
+
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   _mongocrypt_buffer_copy_from_binary (&from_key_id, bin);
+   mongocrypt_binary_destroy (bin);
+
+   mongocrypt_binary_destroy (key_id);
+   mongocrypt_ctx_destroy (ctx);
+
+
+   ctx = mongocrypt_ctx_new (crypt);
+
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, deterministic, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_alt_name (
+                 ctx, TEST_BSON ("{'keyAltName': 'keyDocumentName'}")),
+              ctx);
+   ASSERT_OK (
+      mongocrypt_ctx_explicit_encrypt_init (ctx, TEST_BSON ("{'v': 123}")),
+      ctx);
+
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   _mongocrypt_buffer_copy_from_binary (&from_key_altname, bin);
+   mongocrypt_binary_destroy (bin);
+
+   mongocrypt_ctx_destroy (ctx);
+
+   BSON_ASSERT (0 == _mongocrypt_buffer_cmp (&from_key_id, &from_key_altname));
+
+   _mongocrypt_buffer_cleanup (&from_key_id);
+   _mongocrypt_buffer_cleanup (&from_key_altname);
+
+   mongocrypt_destroy (crypt);
+}
+
+/* Encrypt and decrypt a raw value, and compare with the { "v": ... }
+ * documents of explicit_encrypt_init. */
+static void
+_test_explicit_encryption_value (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *key_id, *plaintext, *ciphertext, *bin;
+   _mongocrypt_buffer_t wrapped;
+   const char *deterministic = "AEAD_AES_256_CBC_HMAC_SHA_512-Deterministic";
+   /* The string "hello". */
+   uint8_t raw[] = {0x02, 6, 0, 0, 0, 'h', 'e', 'l', 'l', 'o', 0};
+   uint8_t truncated[] = {0x02, 6, 0, 0, 0, 'h', 'e'};
+   /* An int32, followed by a second element. */
+   uint8_t trailing[] = {0x10, 1, 0, 0, 0, 0x10, 'a', 0, 1, 0, 0, 0};
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   key_id = mongocrypt_binary_new_from_data (
+      MONGOCRYPT_DATA_AND_LEN ("aaaaaaaaaaaaaaaa"));
+   plaintext = mongocrypt_binary_new_from_data (raw, sizeof (raw));
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, deterministic, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   ASSERT_OK (mongocrypt_ctx_explicit_encrypt_init (
+                 ctx, TEST_BSON ("{'v': 'hello'}")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   _mongocrypt_buffer_copy_from_binary (&wrapped, bin);
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* The raw ciphertext is the element of the document, without its key. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, deterministic, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   ASSERT_OK (mongocrypt_ctx_explicit_encrypt_value_init (ctx, plaintext),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   ciphertext = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize_steal (ctx, ciphertext), ctx);
+   mongocrypt_ctx_destroy (ctx);
+   BSON_ASSERT (mongocrypt_binary_len (ciphertext) == wrapped.len - 7);
+   BSON_ASSERT (mongocrypt_binary_data (ciphertext)[0] == wrapped.data[4]);
+   BSON_ASSERT (0 == memcmp (mongocrypt_binary_data (ciphertext) + 1,
+                             wrapped.data + 7,
+                             wrapped.len - 8));
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_explicit_decrypt_value_init (ctx, ciphertext),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   BSON_ASSERT (mongocrypt_binary_len (bin) == sizeof (raw));
+   BSON_ASSERT (0 == memcmp (mongocrypt_binary_data (bin), raw, sizeof (raw)));
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* A raw value must be exactly one value. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, deterministic, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   bin = mongocrypt_binary_new_from_data (truncated, sizeof (truncated));
+   ASSERT_FAILS (mongocrypt_ctx_explicit_encrypt_value_init (ctx, bin),
+                 ctx,
+                 "malformed raw value");
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   bin = mongocrypt_binary_new_from_data (trailing, sizeof (trailing));
+   ASSERT_FAILS (mongocrypt_ctx_explicit_decrypt_value_init (ctx, bin),
+                 ctx,
+                 "malformed raw value");
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+
+   _mongocrypt_buffer_cleanup (&wrapped);
+   mongocrypt_binary_destroy (ciphertext);
+   mongocrypt_binary_destroy (plaintext);
+   mongocrypt_binary_destroy (key_id);
+   mongocrypt_destroy (crypt);
+}
+
+static void
+_test_explicit_encryption_batch (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+   bson_t as_bson;
+   bson_iter_t iter;
+   const bson_value_t *value;
+   bson_value_t first;
+
+#define KEY_ID                                             \
+   "{'$binary': {'base64': 'YWFhYWFhYWFhYWFhYWFhYQ==', " \
+   "'subType': '04'}}"
+#define DETERMINISTIC "'AEAD_AES_256_CBC_HMAC_SHA_512-Deterministic'"
+#define RANDOM "'AEAD_AES_256_CBC_HMAC_SHA_512-Random'"
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+
+   /* The key id and key alt name identify the same key, which is only
+    * requested once. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_explicit_encrypt_batch_init (
+                 ctx,
+                 TEST_BSON ("{'0': {'v': 123, 'algorithm': " DETERMINISTIC
+                            ", 'keyId': " KEY_ID "},"
+                            " '1': {'v': 123, 'algorithm': " DETERMINISTIC
+                            ", 'keyAltName': 'keyDocumentName'},"
+                            " '2': {'v': 'abc', 'algorithm': " RANDOM
+                            ", 'keyId': " KEY_ID "}}")),
+              ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/key-document.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, "0.v", &iter));
+   BSON_ASSERT (BSON_ITER_HOLDS_BINARY (&iter));
+   bson_value_copy (bson_iter_value (&iter), &first);
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, "1.v", &iter));
+   value = bson_iter_value (&iter);
+   BSON_ASSERT (value->value_type == BSON_TYPE_BINARY);
+   BSON_ASSERT (value->value.v_binary.data_len ==
+                first.value.v_binary.data_len);
+   BSON_ASSERT (0 == memcmp (value->value.v_binary.data,
+                             first.value.v_binary.data,
+                             first.value.v_binary.data_len));
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, "2.v", &iter));
+   BSON_ASSERT (BSON_ITER_HOLDS_BINARY (&iter));
+   bson_value_destroy (&first);
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Each message names its own key and algorithm. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (
+                 ctx, "AEAD_AES_256_CBC_HMAC_SHA_512-Random", -1),
+              ctx);
+   ASSERT_FAILS (mongocrypt_ctx_explicit_encrypt_batch_init (
+                    ctx,
+                    TEST_BSON ("{'0': {'v': 123, 'algorithm': " RANDOM
+                               ", 'keyId': " KEY_ID "}}")),
+                 ctx,
+                 "algorithm prohibited");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (mongocrypt_ctx_explicit_encrypt_batch_init (
+                    ctx, TEST_BSON ("{'0': {'v': 123, 'keyId': " KEY_ID "}}")),
+                 ctx,
+                 "must contain 'algorithm'");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (mongocrypt_ctx_explicit_encrypt_batch_init (
+                    ctx,
+                    TEST_BSON ("{'0': {'v': 123, 'algorithm': " RANDOM
+                               ", 'keyId': " KEY_ID
+                               ", 'keyAltName': 'keyDocumentName'}}")),
+                 ctx,
+                 "must contain one of 'keyId' or 'keyAltName'");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (mongocrypt_ctx_explicit_encrypt_batch_init (
+                    ctx,
+                    TEST_BSON ("{'0': {'v': 1.5, 'algorithm': " DETERMINISTIC
+                               ", 'keyId': " KEY_ID "}}")),
+                 ctx,
+                 "BSON type invalid for deterministic encryption");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (mongocrypt_ctx_explicit_encrypt_batch_init (
+                    ctx, TEST_BSON ("{'0': 123}")),
+                 ctx,
+                 "each element must be a document");
+   mongocrypt_ctx_destroy (ctx);
+
+#undef RANDOM
+#undef DETERMINISTIC
+#undef KEY_ID
+
+   mongocrypt_destroy (crypt);
+}
+
+
+/* Finalize a column context, and copy its output and offsets. */
+static void
+_column_run (_mongocrypt_tester_t *tester,
+             mongocrypt_ctx_t *ctx,
+             _mongocrypt_buffer_t *out,
+             uint32_t *offsets,
+             uint32_t count)
+{
+   mongocrypt_binary_t *bin;
+   const uint32_t *out_offsets;
+
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   ASSERT_OK (mongocrypt_ctx_column_offsets (ctx, &out_offsets), ctx);
+   memcpy (offsets, out_offsets, sizeof (uint32_t) * (count + 1u));
+   BSON_ASSERT (offsets[count] == mongocrypt_binary_len (bin));
+   _mongocrypt_buffer_copy_from_binary (out, bin);
+   mongocrypt_binary_destroy (bin);
+}
+
+
+static void
+_test_explicit_encryption_column (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *key_id, *bin;
+   _mongocrypt_buffer_t encrypted, decrypted;
+   bson_t *msg, as_bson;
+   bson_iter_t iter;
+   const uint8_t *data;
+   uint32_t data_len;
+   int64_t ints[3] = {1, -2, 3};
+   uint8_t int_data[sizeof (ints)];
+   const char *strs = "abca string longer than one AES block";
+   uint32_t str_offsets[4] = {0, 0, 3, 37};
+   uint32_t offsets[4];
+   uint32_t i;
+   char *random = "AEAD_AES_256_CBC_HMAC_SHA_512-Random";
+   char *deterministic = "AEAD_AES_256_CBC_HMAC_SHA_512-Deterministic";
+
+   for (i = 0; i < 3; i++) {
+      uint64_t le = BSON_UINT64_TO_LE ((uint64_t) ints[i]);
+
+      memcpy (int_data + i * 8u, &le, 8);
+   }
+   crypt = _mongocrypt_tester_mongocrypt ();
+   key_id = mongocrypt_binary_new_from_data (
+      MONGOCRYPT_DATA_AND_LEN ("aaaaaaaaaaaaaaaa"));
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, deterministic, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   bin = mongocrypt_binary_new_from_data (int_data, sizeof (int_data));
+   ASSERT_OK (mongocrypt_ctx_explicit_encrypt_column_init (
+                 ctx, BSON_TYPE_INT64, bin, NULL, 3),
+              ctx);
+   mongocrypt_binary_destroy (bin);
+   _mongocrypt_buffer_init (&encrypted);
+   _column_run (tester, ctx, &encrypted, offsets, 3);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Each encrypted value is what explicit encryption outputs. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, deterministic, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   msg = BCON_NEW ("v", BCON_INT64 (-2));
+   bin = mongocrypt_binary_new_from_data ((uint8_t *) bson_get_data (msg),
+                                          msg->len);
+   ASSERT_OK (mongocrypt_ctx_explicit_encrypt_init (ctx, bin), ctx);
+   mongocrypt_binary_destroy (bin);
+   bson_destroy (msg);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "v"));
+   BSON_ASSERT (BSON_ITER_HOLDS_BINARY (&iter));
+   bson_iter_binary (&iter, NULL, &data_len, &data);
+   BSON_ASSERT (data_len == offsets[2] - offsets[1]);
+   BSON_ASSERT (0 == memcmp (data, encrypted.data + offsets[1], data_len));
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* The column decrypts back to the values. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_explicit_decrypt_column_init (
+                 ctx,
+                 BSON_TYPE_INT64,
+                 _mongocrypt_buffer_as_binary (&encrypted),
+                 offsets,
+                 3),
+              ctx);
+   _mongocrypt_buffer_init (&decrypted);
+   _column_run (tester, ctx, &decrypted, offsets, 3);
+   BSON_ASSERT (decrypted.len == sizeof (int_data));
+   BSON_ASSERT (0 == memcmp (decrypted.data, int_data, sizeof (int_data)));
+   BSON_ASSERT (offsets[1] == 8 && offsets[2] == 16);
+   _mongocrypt_buffer_cleanup (&decrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Only as the type they were encrypted from. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (mongocrypt_ctx_explicit_decrypt_column_init (
+                    ctx,
+                    BSON_TYPE_INT32,
+                    _mongocrypt_buffer_as_binary (&encrypted),
+                    offsets,
+                    3),
+                 ctx,
+                 "does not have the column type");
+   mongocrypt_ctx_destroy (ctx);
+   _mongocrypt_buffer_cleanup (&encrypted);
+
+   /* Strings, including an empty one. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, random, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   bin = mongocrypt_binary_new_from_data ((uint8_t *) strs,
+                                          (uint32_t) strlen (strs));
+   ASSERT_OK (mongocrypt_ctx_explicit_encrypt_column_init (
+                 ctx, BSON_TYPE_UTF8, bin, str_offsets, 3),
+              ctx);
+   mongocrypt_binary_destroy (bin);
+   _mongocrypt_buffer_init (&encrypted);
+   _column_run (tester, ctx, &encrypted, offsets, 3);
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_explicit_decrypt_column_init (
+                 ctx,
+                 BSON_TYPE_UTF8,
+                 _mongocrypt_buffer_as_binary (&encrypted),
+                 offsets,
+                 3),
+              ctx);
+   _mongocrypt_buffer_init (&decrypted);
+   _column_run (tester, ctx, &decrypted, offsets, 3);
+   BSON_ASSERT (0 == memcmp (offsets, str_offsets, sizeof (offsets)));
+   BSON_ASSERT (decrypted.len == strlen (strs));
+   BSON_ASSERT (0 == memcmp (decrypted.data, strs, decrypted.len));
+   _mongocrypt_buffer_cleanup (&decrypted);
+   _mongocrypt_buffer_cleanup (&encrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, deterministic, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   ASSERT_FAILS (mongocrypt_ctx_explicit_encrypt_column_init (
+                    ctx, BSON_TYPE_DOUBLE, TEST_BSON ("{}"), NULL, 1),
+                 ctx,
+                 "invalid for deterministic encryption");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, random, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   bin = mongocrypt_binary_new_from_data (int_data, sizeof (int_data));
+   ASSERT_FAILS (mongocrypt_ctx_explicit_encrypt_column_init (
+                    ctx, BSON_TYPE_INT64, bin, str_offsets, 3),
+                 ctx,
+                 "offsets must not be set");
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (key_id);
+   mongocrypt_destroy (crypt);
+}
+
+
+/* Appends @piece to @buf. */
+static void
+_stream_append (_mongocrypt_buffer_t *buf, mongocrypt_binary_t *piece)
+{
+   if (piece->len == 0) {
+      return;
+   }
+   buf->data = bson_realloc (buf->data, buf->len + piece->len);
+   memcpy (buf->data + buf->len, piece->data, piece->len);
+   buf->len += piece->len;
+   buf->owned = true;
+}
+
+
+/* Passes @len bytes of @in to a READY streaming context in chunks of
+ * @chunk_len, then finishes it, appending the output to @out. */
+static bool
+_stream_run (mongocrypt_ctx_t *ctx,
+             const uint8_t *in,
+             uint32_t len,
+             uint32_t chunk_len,
+             _mongocrypt_buffer_t *out)
+{
+   mongocrypt_binary_t *chunk, *piece;
+   uint32_t offset, n;
+   bool ret = false;
+
+   piece = mongocrypt_binary_new ();
+   for (offset = 0; offset < len; offset += n) {
+      n = BSON_MIN (chunk_len, len - offset);
+      chunk = mongocrypt_binary_new_from_data ((uint8_t *) in + offset, n);
+      if (!mongocrypt_ctx_stream_update (ctx, chunk, piece)) {
+         mongocrypt_binary_destroy (chunk);
+         goto done;
+      }
+      mongocrypt_binary_destroy (chunk);
+      _stream_append (out, piece);
+   }
+   if (!mongocrypt_ctx_stream_final (ctx, piece)) {
+      goto done;
+   }
+   _stream_append (out, piece);
+   ret = true;
+done:
+   mongocrypt_binary_destroy (piece);
+   return ret;
+}
+
+
+static void
+_test_explicit_encryption_stream (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *key_id, *bin, *header;
+   _mongocrypt_buffer_t encrypted, decrypted;
+   bson_t as_bson;
+   bson_iter_t iter;
+   bson_t *msg;
+   const uint8_t *data;
+   uint32_t data_len;
+   bson_subtype_t subtype;
+   uint8_t value[1000];
+   uint32_t i;
+   char *random = "AEAD_AES_256_CBC_HMAC_SHA_512-Random";
+   char *deterministic = "AEAD_AES_256_CBC_HMAC_SHA_512-Deterministic";
+   const char *str = "a string long enough to span several AES blocks";
+
+   for (i = 0; i < sizeof (value); i++) {
+      value[i] = (uint8_t) i;
+   }
+   crypt = _mongocrypt_tester_mongocrypt ();
+   key_id = mongocrypt_binary_new_from_data (
+      MONGOCRYPT_DATA_AND_LEN ("aaaaaaaaaaaaaaaa"));
+
+   /* A streamed binary decrypts with explicit decryption. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, random, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   ASSERT_OK (mongocrypt_ctx_explicit_encrypt_stream_init (
+                 ctx, BSON_TYPE_BINARY, BSON_SUBTYPE_USER, sizeof (value)),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   _mongocrypt_buffer_init (&encrypted);
+   ASSERT_OK (_stream_run (ctx, value, sizeof (value), 7, &encrypted), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_explicit_decrypt_init (
+                 ctx, _mongocrypt_buffer_as_binary (&encrypted)),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "v"));
+   BSON_ASSERT (BSON_ITER_HOLDS_BINARY (&iter));
+   bson_iter_binary (&iter, &subtype, &data_len, &data);
+   BSON_ASSERT (subtype == BSON_SUBTYPE_USER);
+   BSON_ASSERT (data_len == sizeof (value));
+   BSON_ASSERT (0 == memcmp (data, value, sizeof (value)));
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* And with streaming decryption. */
+   ctx = mongocrypt_ctx_new (crypt);
+   header = mongocrypt_binary_new_from_data (encrypted.data,
+                                             MONGOCRYPT_STREAM_HEADER_LEN);
+   ASSERT_OK (mongocrypt_ctx_explicit_decrypt_stream_init (ctx, header), ctx);
+   mongocrypt_binary_destroy (header);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   _mongocrypt_buffer_init (&decrypted);
+   ASSERT_OK (_stream_run (ctx,
+                           encrypted.data + MONGOCRYPT_STREAM_HEADER_LEN,
+                           encrypted.len - MONGOCRYPT_STREAM_HEADER_LEN,
+                           33,
+                           &decrypted),
+              ctx);
+   BSON_ASSERT (decrypted.len == sizeof (value));
+   BSON_ASSERT (0 == memcmp (decrypted.data, value, sizeof (value)));
+   _mongocrypt_buffer_cleanup (&decrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* A tampered ciphertext fails authentication in final. */
+   encrypted.data[encrypted.len - 40] ^= 1;
+   ctx = mongocrypt_ctx_new (crypt);
+   header = mongocrypt_binary_new_from_data (encrypted.data,
+                                             MONGOCRYPT_STREAM_HEADER_LEN);
+   ASSERT_OK (mongocrypt_ctx_explicit_decrypt_stream_init (ctx, header), ctx);
+   mongocrypt_binary_destroy (header);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   _mongocrypt_buffer_init (&decrypted);
+   ASSERT_FAILS (_stream_run (ctx,
+                              encrypted.data + MONGOCRYPT_STREAM_HEADER_LEN,
+                              encrypted.len - MONGOCRYPT_STREAM_HEADER_LEN,
+                              64,
+                              &decrypted),
+                 ctx,
+                 "HMAC validation failure");
+   _mongocrypt_buffer_cleanup (&decrypted);
+   _mongocrypt_buffer_cleanup (&encrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* A string from explicit encryption decrypts with streaming. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, random, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   msg = BCON_NEW ("v", BCON_UTF8 (str));
+   bin = mongocrypt_binary_new_from_data ((uint8_t *) bson_get_data (msg),
+                                          msg->len);
+   ASSERT_OK (mongocrypt_ctx_explicit_encrypt_init (ctx, bin), ctx);
+   mongocrypt_binary_destroy (bin);
+   bson_destroy (msg);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   _mongocrypt_buffer_copy_from_binary (&encrypted, bin);
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   header = mongocrypt_binary_new_from_data (encrypted.data,
+                                             MONGOCRYPT_STREAM_HEADER_LEN);
+   ASSERT_OK (mongocrypt_ctx_explicit_decrypt_stream_init (ctx, header), ctx);
+   mongocrypt_binary_destroy (header);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   _mongocrypt_buffer_init (&decrypted);
+   ASSERT_OK (_stream_run (ctx,
+                           encrypted.data + MONGOCRYPT_STREAM_HEADER_LEN,
+                           encrypted.len - MONGOCRYPT_STREAM_HEADER_LEN,
+                           1,
+                           &decrypted),
+              ctx);
+   BSON_ASSERT (decrypted.len == strlen (str));
+   BSON_ASSERT (0 == memcmp (decrypted.data, str, strlen (str)));
+   _mongocrypt_buffer_cleanup (&decrypted);
+   _mongocrypt_buffer_cleanup (&encrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* The input must match the declared length. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, random, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   ASSERT_OK (mongocrypt_ctx_explicit_encrypt_stream_init (
+                 ctx, BSON_TYPE_UTF8, 0, 4),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   _mongocrypt_buffer_init (&encrypted);
+   ASSERT_FAILS (_stream_run (ctx, value, 5, 5, &encrypted),
+                 ctx,
+                 "stream input exceeds the declared length");
+   _mongocrypt_buffer_cleanup (&encrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, random, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   ASSERT_OK (mongocrypt_ctx_explicit_encrypt_stream_init (
+                 ctx, BSON_TYPE_UTF8, 0, 4),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   _mongocrypt_buffer_init (&encrypted);
+   ASSERT_FAILS (_stream_run (ctx, value, 3, 3, &encrypted),
+                 ctx,
+                 "stream input is shorter than the declared length");
+   _mongocrypt_buffer_cleanup (&encrypted);
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, deterministic, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   ASSERT_FAILS (mongocrypt_ctx_explicit_encrypt_stream_init (
+                    ctx, BSON_TYPE_BINARY, 0, 4),
+                 ctx,
+                 "streaming requires the random algorithm");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, random, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   ASSERT_FAILS (mongocrypt_ctx_explicit_encrypt_stream_init (
+                    ctx, BSON_TYPE_INT32, 0, 4),
+                 ctx,
+                 "only supported for binary and string values");
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (key_id);
+   mongocrypt_destroy (crypt);
+}
+
+/* Encrypt the string @value with @algorithm and decrypt it back. Returns the
+ * blob subtype and the length of the ciphertext. */
+static void
+_explicit_roundtrip (_mongocrypt_tester_t *tester,
+                     const char *algorithm,
+                     const char *value,
+                     uint8_t *blob_subtype,
+                     uint32_t *ciphertext_len)
 {
    mongocrypt_t *crypt;
    mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin, *key_id, *msg;
+   _mongocrypt_buffer_t encrypted;
+   bson_t as_bson, doc;
+   bson_iter_t iter;
+   bson_subtype_t subtype;
+   const uint8_t *data;
 
    crypt = _mongocrypt_tester_mongocrypt ();
+   key_id = mongocrypt_binary_new_from_data (
+      MONGOCRYPT_DATA_AND_LEN ("aaaaaaaaaaaaaaaa"));
+   bson_init (&doc);
+   BSON_APPEND_UTF8 (&doc, "v", value);
+   msg = mongocrypt_binary_new_from_data ((uint8_t *) bson_get_data (&doc),
+                                          doc.len);
+
    ctx = mongocrypt_ctx_new (crypt);
-   ASSERT_OK (mongocrypt_ctx_encrypt_init (
-                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
-              ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, algorithm, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   ASSERT_OK (mongocrypt_ctx_explicit_encrypt_init (ctx, msg), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "v"));
+   BSON_ASSERT (BSON_ITER_HOLDS_BINARY (&iter));
+   bson_iter_binary (&iter, &subtype, ciphertext_len, &data);
+   *blob_subtype = data[0];
+   _mongocrypt_buffer_copy_from_binary (&encrypted, bin);
+   mongocrypt_ctx_destroy (ctx);
 
-   BSON_ASSERT (MONGOCRYPT_CTX_NEED_MONGO_COLLINFO ==
-                mongocrypt_ctx_state (ctx));
-   ASSERT_OK (mongocrypt_ctx_mongo_feed (
-                 ctx, TEST_FILE ("./test/data/collinfo-siblings.json")),
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_explicit_decrypt_init (
+                 ctx, _mongocrypt_buffer_as_binary (&encrypted)),
               ctx);
-   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
-
-   BSON_ASSERT (MONGOCRYPT_CTX_NEED_MONGO_MARKINGS ==
-                mongocrypt_ctx_state (ctx));
-   ASSERT_FAILS (mongocrypt_ctx_mongo_feed (
-                    ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
-                 ctx,
-                 "JSON schema validator has siblings");
-
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "v"));
+   BSON_ASSERT (BSON_ITER_HOLDS_UTF8 (&iter));
+   ASSERT_STREQUAL (bson_iter_utf8 (&iter, NULL), value);
    mongocrypt_ctx_destroy (ctx);
+
+   _mongocrypt_buffer_cleanup (&encrypted);
+   mongocrypt_binary_destroy (msg);
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_binary_destroy (key_id);
+   bson_destroy (&doc);
    mongocrypt_destroy (crypt);
 }
 
 
 static void
-_test_encrypt_dupe_jsonschema (_mongocrypt_tester_t *tester)
+_test_explicit_encryption_compressed (_mongocrypt_tester_t *tester)
+{
+   const char *random = "AEAD_AES_256_CBC_HMAC_SHA_512-Random";
+   const char *compressed = "AEAD_AES_256_CBC_HMAC_SHA_512-Random-Compressed";
+   char value[4096];
+   uint32_t i, random_len, compressed_len;
+   uint8_t blob_subtype;
+
+   for (i = 0; i < sizeof (value) - 1; i++) {
+      value[i] = "{\"name\": \"value\"}, "[i % 19];
+   }
+   value[i] = '\0';
+
+   _explicit_roundtrip (tester, random, value, &blob_subtype, &random_len);
+   BSON_ASSERT (blob_subtype == MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM);
+   _explicit_roundtrip (
+      tester, compressed, value, &blob_subtype, &compressed_len);
+   BSON_ASSERT (blob_subtype ==
+                MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM_COMPRESSED);
+   BSON_ASSERT (compressed_len < random_len / 4);
+
+   /* A value that does not get smaller is encrypted as random. */
+   _explicit_roundtrip (
+      tester, compressed, "abc", &blob_subtype, &compressed_len);
+   BSON_ASSERT (blob_subtype == MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM);
+}
+
+/* Explicitly encrypt @value with the key "aaaaaaaaaaaaaaaa" into @out. */
+static void
+_explicit_encrypt_value (_mongocrypt_tester_t *tester,
+                         mongocrypt_t *crypt,
+                         const char *algorithm,
+                         mongocrypt_binary_t *value,
+                         bson_value_t *out)
 {
-   mongocrypt_t *crypt;
    mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin, *key_id;
+   bson_t as_bson;
+   bson_iter_t iter;
 
-   crypt = _mongocrypt_tester_mongocrypt ();
+   key_id = mongocrypt_binary_new_from_data (
+      MONGOCRYPT_DATA_AND_LEN ("aaaaaaaaaaaaaaaa"));
    ctx = mongocrypt_ctx_new (crypt);
-   ASSERT_OK (mongocrypt_ctx_encrypt_init (
-                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
-              ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, algorithm, -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   ASSERT_OK (mongocrypt_ctx_explicit_encrypt_init (ctx, value), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "v"));
+   bson_value_copy (bson_iter_value (&iter), out);
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_binary_destroy (key_id);
+}
 
-   BSON_ASSERT (MONGOCRYPT_CTX_NEED_MONGO_COLLINFO ==
-                mongocrypt_ctx_state (ctx));
-   ASSERT_FAILS (mongocrypt_ctx_mongo_feed (
-                    ctx,
-                    TEST_BSON ("{'options': {'validator': { '$jsonSchema': {}, "
-                               "'$jsonSchema': {} } } }")),
-                 ctx,
-                 "duplicate $jsonSchema");
 
-   mongocrypt_ctx_destroy (ctx);
-   mongocrypt_destroy (crypt);
+/* Feed the key documents @key_files, then satisfy the KMS requests. */
+static void
+_feed_keys (_mongocrypt_tester_t *tester,
+            mongocrypt_ctx_t *ctx,
+            const char **key_files,
+            uint32_t n)
+{
+   mongocrypt_kms_ctx_t *kms;
+   uint32_t i;
+
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   for (i = 0; i < n; i++) {
+      ASSERT_OK (mongocrypt_ctx_mongo_feed (ctx, TEST_FILE (key_files[i])),
+                 ctx);
+   }
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_KMS);
+   while ((kms = mongocrypt_ctx_next_kms_ctx (ctx))) {
+      ASSERT_OK (mongocrypt_kms_ctx_feed (
+                    kms, TEST_FILE ("./test/example/kms-decrypt-reply.txt")),
+                 kms);
+   }
+   ASSERT_OK (mongocrypt_ctx_kms_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
 }
 
 
+/* Check that the ciphertext at @path is encrypted with the key of id
+ * 0x00...00, with @algorithm and @bson_type. */
 static void
-_test_encrypting_with_explicit_encryption (_mongocrypt_tester_t *tester)
+_assert_reencrypted (const bson_t *doc,
+                     const char *path,
+                     uint8_t algorithm,
+                     uint8_t bson_type)
 {
-   /* Test that we do not strip existing ciphertexts when automatically
-    * encrypting a document. */
+   static const uint8_t zero_id[16] = {0};
+   bson_iter_t iter;
+   bson_subtype_t subtype;
+   uint32_t len;
+   const uint8_t *data;
+
+   BSON_ASSERT (bson_iter_init (&iter, doc));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, path, &iter));
+   BSON_ASSERT (BSON_ITER_HOLDS_BINARY (&iter));
+   bson_iter_binary (&iter, &subtype, &len, &data);
+   BSON_ASSERT (subtype == 6);
+   BSON_ASSERT (len > 18);
+   BSON_ASSERT (data[0] == algorithm);
+   BSON_ASSERT (0 == memcmp (data + 1, zero_id, sizeof (zero_id)));
+   BSON_ASSERT (data[17] == bson_type);
+}
+
+
+static void
+_test_reencrypt (_mongocrypt_tester_t *tester)
+{
+   const char *deterministic = "AEAD_AES_256_CBC_HMAC_SHA_512-Deterministic";
+   const char *random = "AEAD_AES_256_CBC_HMAC_SHA_512-Random";
+   const char *keys[] = {"./test/example/key-document.json",
+                         "./test/data/key-document-full.json"};
    mongocrypt_t *crypt;
    mongocrypt_ctx_t *ctx;
    mongocrypt_binary_t *bin;
-   bson_iter_t iter;
-   bson_t tmp;
+   _mongocrypt_buffer_t reencrypted;
+   bson_value_t a, c;
+   bson_t doc, sub, as_bson;
 
    crypt = _mongocrypt_tester_mongocrypt ();
+   _explicit_encrypt_value (
+      tester, crypt, deterministic, TEST_BSON ("{'v': 123}"), &a);
+   _explicit_encrypt_value (
+      tester, crypt, random, TEST_BSON ("{'v': 'hello'}"), &c);
+   bson_init (&doc);
+   BSON_ASSERT (BSON_APPEND_VALUE (&doc, "a", &a));
+   BSON_APPEND_DOCUMENT_BEGIN (&doc, "b", &sub);
+   BSON_ASSERT (BSON_APPEND_VALUE (&sub, "c", &c));
+   bson_append_document_end (&doc, &sub);
+   BSON_ASSERT (BSON_APPEND_INT32 (&doc, "d", 1));
+
+   /* Move both ciphertexts to the key named "altname1". */
    ctx = mongocrypt_ctx_new (crypt);
-   ASSERT_OK (mongocrypt_ctx_encrypt_init (
-                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+   ASSERT_OK (mongocrypt_ctx_setopt_key_alt_name (
+                 ctx, TEST_BSON ("{'keyAltName': 'altname1'}")),
               ctx);
+   bin = mongocrypt_binary_new_from_data ((uint8_t *) bson_get_data (&doc),
+                                          doc.len);
+   ASSERT_OK (mongocrypt_ctx_reencrypt_init (ctx, bin), ctx);
+   mongocrypt_binary_destroy (bin);
+   _feed_keys (tester, ctx, keys, 2);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   _assert_reencrypted (&as_bson,
+                        "a",
+                        MONGOCRYPT_ENCRYPTION_ALGORITHM_DETERMINISTIC,
+                        BSON_TYPE_INT32);
+   _assert_reencrypted (&as_bson,
+                        "b.c",
+                        MONGOCRYPT_ENCRYPTION_ALGORITHM_RANDOM,
+                        BSON_TYPE_UTF8);
+   _mongocrypt_buffer_copy_from_binary (&reencrypted, bin);
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
 
-   _mongocrypt_tester_run_ctx_to (
-      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
-   ASSERT_OK (
-      mongocrypt_ctx_mongo_feed (
-         ctx,
-         TEST_FILE ("./test/data/mongocryptd-reply-existing-ciphertext.json")),
-      ctx);
-   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
-   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   /* Only the new key is needed to decrypt. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (
+                 ctx, _mongocrypt_buffer_as_binary (&reencrypted)),
+              ctx);
+   _feed_keys (tester, ctx, keys + 1, 1);
    bin = mongocrypt_binary_new ();
-   mongocrypt_ctx_finalize (ctx, bin);
-   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &tmp));
-   BSON_ASSERT (bson_iter_init (&iter, &tmp));
-   BSON_ASSERT (
-      bson_iter_find_descendant (&iter, "filter.existing_ciphertext", &iter));
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   _assert_bin_bson_equal (
+      bin, TEST_BSON ("{'a': 123, 'b': {'c': 'hello'}, 'd': 1}"));
    mongocrypt_binary_destroy (bin);
    mongocrypt_ctx_destroy (ctx);
+
+   /* A key is required. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (mongocrypt_ctx_reencrypt_init (
+                    ctx, _mongocrypt_buffer_as_binary (&reencrypted)),
+                 ctx,
+                 "either key id or key alt name required");
+   mongocrypt_ctx_destroy (ctx);
+
+   _mongocrypt_buffer_cleanup (&reencrypted);
+   bson_value_destroy (&a);
+   bson_value_destroy (&c);
+   bson_destroy (&doc);
    mongocrypt_destroy (crypt);
 }
 
 static void
-_test_explicit_encryption (_mongocrypt_tester_t *tester)
+_test_explicit_encrypt_cached (_mongocrypt_tester_t *tester)
 {
+   const char *deterministic = "AEAD_AES_256_CBC_HMAC_SHA_512-Deterministic";
    mongocrypt_t *crypt;
    mongocrypt_ctx_t *ctx;
-   _mongocrypt_buffer_t from_key_id, from_key_altname;
-   mongocrypt_binary_t *bin, *key_id;
-   char *deterministic = "AEAD_AES_256_CBC_HMAC_SHA_512-Deterministic";
+   mongocrypt_binary_t *key_id, *msg, *expected, *out;
+   mongocrypt_status_t *status;
 
    crypt = _mongocrypt_tester_mongocrypt ();
-
-   ctx = mongocrypt_ctx_new (crypt);
    key_id = mongocrypt_binary_new_from_data (
       MONGOCRYPT_DATA_AND_LEN ("aaaaaaaaaaaaaaaa"));
+   msg = TEST_BSON ("{'v': 'value'}");
+   out = mongocrypt_binary_new ();
+   status = mongocrypt_status_new ();
 
-   ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, deterministic, -1), ctx);
-   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
-   ASSERT_OK (
-      mongocrypt_ctx_explicit_encrypt_init (ctx, TEST_BSON ("{'v': 123}")),
-      ctx);
-
-   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
-   bin = mongocrypt_binary_new ();
-   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
-   _mongocrypt_buffer_copy_from_binary (&from_key_id, bin);
-   mongocrypt_binary_destroy (bin);
-
-   mongocrypt_binary_destroy (key_id);
-   mongocrypt_ctx_destroy (ctx);
-
+   /* The key is not cached yet. */
+   ASSERT_OK_STATUS (mongocrypt_explicit_encrypt_cached (
+                        crypt, key_id, deterministic, msg, out, status),
+                     status);
+   BSON_ASSERT (mongocrypt_binary_len (out) == 0);
 
    ctx = mongocrypt_ctx_new (crypt);
-
    ASSERT_OK (mongocrypt_ctx_setopt_algorithm (ctx, deterministic, -1), ctx);
-   ASSERT_OK (mongocrypt_ctx_setopt_key_alt_name (
-                 ctx, TEST_BSON ("{'keyAltName': 'keyDocumentName'}")),
-              ctx);
-   ASSERT_OK (
-      mongocrypt_ctx_explicit_encrypt_init (ctx, TEST_BSON ("{'v': 123}")),
-      ctx);
-
+   ASSERT_OK (mongocrypt_ctx_setopt_key_id (ctx, key_id), ctx);
+   ASSERT_OK (mongocrypt_ctx_explicit_encrypt_init (ctx, msg), ctx);
    _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
-   bin = mongocrypt_binary_new ();
-   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
-   _mongocrypt_buffer_copy_from_binary (&from_key_altname, bin);
-   mongocrypt_binary_destroy (bin);
+   expected = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, expected), ctx);
 
+   /* Now it is, and the result matches the context's. */
+   ASSERT_OK_STATUS (mongocrypt_explicit_encrypt_cached (
+                        crypt, key_id, deterministic, msg, out, status),
+                     status);
+   BSON_ASSERT (mongocrypt_binary_len (out) ==
+                mongocrypt_binary_len (expected));
+   BSON_ASSERT (0 == memcmp (mongocrypt_binary_data (out),
+                             mongocrypt_binary_data (expected),
+                             mongocrypt_binary_len (out)));
    mongocrypt_ctx_destroy (ctx);
 
-   BSON_ASSERT (0 == _mongocrypt_buffer_cmp (&from_key_id, &from_key_altname));
-
-   _mongocrypt_buffer_cleanup (&from_key_id);
-   _mongocrypt_buffer_cleanup (&from_key_altname);
+   ASSERT_FAILS_STATUS (mongocrypt_explicit_encrypt_cached (
+                           crypt, key_id, NULL, msg, out, status),
+                        status,
+                        "passed null algorithm");
 
+   mongocrypt_status_destroy (status);
+   mongocrypt_binary_destroy (expected);
+   mongocrypt_binary_destroy (out);
+   mongocrypt_binary_destroy (key_id);
    mongocrypt_destroy (crypt);
 }
 
+
 /* Test with empty AWS credentials. */
 void
 _test_encrypt_empty_aws (_mongocrypt_tester_t *tester)
@@ -1460,6 +3594,166 @@ _test_encrypt_with_aws_session_token (_mongocrypt_tester_t *tester)
    mongocrypt_destroy (crypt);
 }
 
+static int64_t
+_get_timing (mongocrypt_ctx_t *ctx, const char *name)
+{
+   mongocrypt_binary_t *bin;
+   bson_t bson;
+   bson_iter_t iter;
+   int64_t value;
+
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_timings (ctx, bin), ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &bson));
+   BSON_ASSERT (bson_iter_init_find (&iter, &bson, name));
+   BSON_ASSERT (BSON_ITER_HOLDS_INT64 (&iter));
+   value = bson_iter_int64 (&iter);
+   mongocrypt_binary_destroy (bin);
+   return value;
+}
+
+
+static void
+_test_encrypt_timings (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+   int64_t total;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (
+      mongocrypt_ctx_timings (ctx, NULL), ctx, "ctx NULL or uninitialized");
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   BSON_ASSERT (0 == _get_timing (ctx, "fields"));
+   BSON_ASSERT (0 == _get_timing (ctx, "finalize"));
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   mongocrypt_binary_destroy (bin);
+
+   BSON_ASSERT (_get_timing (ctx, "fields") > 0);
+   BSON_ASSERT (_get_timing (ctx, "needMongoCollinfo") >= 0);
+   BSON_ASSERT (_get_timing (ctx, "needMongoMarkings") >= 0);
+   BSON_ASSERT (_get_timing (ctx, "needMongoKeys") >= 0);
+   BSON_ASSERT (_get_timing (ctx, "needKms") >= 0);
+   BSON_ASSERT (_get_timing (ctx, "ready") >= 0);
+   BSON_ASSERT (_get_timing (ctx, "finalize") >= 0);
+   /* Nothing is counted once the context is done. */
+   total = _get_timing (ctx, "total");
+   BSON_ASSERT (total >= 0);
+   BSON_ASSERT (total == _get_timing (ctx, "total"));
+
+   ASSERT_FAILS (mongocrypt_ctx_timings (ctx, NULL), ctx, "invalid NULL");
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+}
+
+
+typedef struct {
+   int count;
+   char *message;
+} _slow_ctx_log_t;
+
+
+static void
+_slow_ctx_log_fn (mongocrypt_log_level_t level,
+                  const char *message,
+                  uint32_t message_len,
+                  void *ctx)
+{
+   _slow_ctx_log_t *log = ctx;
+
+   BSON_ASSERT (level == MONGOCRYPT_LOG_LEVEL_WARNING);
+   log->count++;
+   bson_free (log->message);
+   log->message = bson_strdup (message);
+}
+
+
+/* Run an encryption of cmd.json that started @age_us ago. */
+static void
+_run_slow_ctx (_mongocrypt_tester_t *tester,
+               mongocrypt_t *crypt,
+               int64_t age_us)
+{
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ctx->timings.created_us -= age_us;
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_DONE);
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+}
+
+
+static void
+_test_encrypt_slow_ctx_log (_mongocrypt_tester_t *tester)
+{
+   _slow_ctx_log_t log = {0};
+   mongocrypt_t *crypt;
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (mongocrypt_setopt_log_handler (crypt, _slow_ctx_log_fn, &log),
+              crypt);
+   ASSERT_OK (mongocrypt_setopt_log_level (crypt, MONGOCRYPT_LOG_LEVEL_WARNING),
+              crypt);
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_slow_ctx_threshold_ms (crypt, 1000), crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   ASSERT_FAILS (mongocrypt_setopt_slow_ctx_threshold_ms (crypt, 1),
+                 crypt,
+                 "options cannot be set after initialization");
+
+   /* The key is fetched and decrypted. */
+   _run_slow_ctx (tester, crypt, 5 * 1000 * 1000);
+   BSON_ASSERT (log.count == 1);
+   ASSERT_STRCONTAINS (log.message, "\"msg\" : \"slow context\"");
+   ASSERT_STRCONTAINS (log.message, "\"type\" : \"encrypt\"");
+   ASSERT_STRCONTAINS (log.message, "\"ns\" : \"test.test\"");
+   ASSERT_STRCONTAINS (log.message, "\"needKms\"");
+   ASSERT_STRCONTAINS (log.message, "\"keys\" : 1");
+   ASSERT_STRCONTAINS (log.message, "\"cacheHits\" : 0");
+   ASSERT_STRCONTAINS (log.message, "\"kmsRequests\" : 1");
+   ASSERT_STRCONTAINS (log.message, "\"suppressed\" : 0");
+
+   /* Not slow. */
+   _run_slow_ctx (tester, crypt, 0);
+   BSON_ASSERT (log.count == 1);
+
+   /* Rate limited. The next message counts this one. */
+   crypt->slow_ctx_next_us = bson_get_monotonic_time () + 60 * 1000 * 1000;
+   _run_slow_ctx (tester, crypt, 5 * 1000 * 1000);
+   BSON_ASSERT (log.count == 1);
+   BSON_ASSERT (crypt->slow_ctx_suppressed == 1);
+   crypt->slow_ctx_next_us = 0;
+   _run_slow_ctx (tester, crypt, 5 * 1000 * 1000);
+   BSON_ASSERT (log.count == 2);
+   ASSERT_STRCONTAINS (log.message, "\"cacheHits\" : 1");
+   ASSERT_STRCONTAINS (log.message, "\"kmsRequests\" : 0");
+   ASSERT_STRCONTAINS (log.message, "\"suppressed\" : 1");
+   BSON_ASSERT (crypt->slow_ctx_suppressed == 0);
+
+   bson_free (log.message);
+   mongocrypt_destroy (crypt);
+}
+
+
 void
 _mongocrypt_tester_install_ctx_encrypt (_mongocrypt_tester_t *tester)
 {
@@ -1467,22 +3761,48 @@ _mongocrypt_tester_install_ctx_encrypt (_mongocrypt_tester_t *tester)
    INSTALL_TEST (_test_encrypt_init);
    INSTALL_TEST (_test_encrypt_need_collinfo);
    INSTALL_TEST (_test_encrypt_need_markings);
+   INSTALL_TEST (_test_encrypt_mongo_op_iov);
+   INSTALL_TEST (_test_encrypt_prefetch_filter);
+   INSTALL_TEST (_test_encrypt_pending_ops);
+   INSTALL_TEST (_test_encrypt_run);
    INSTALL_TEST (_test_encrypt_need_keys);
    INSTALL_TEST (_test_encrypt_ready);
    INSTALL_TEST (_test_key_missing_region);
    INSTALL_TEST (_test_view);
    INSTALL_TEST (_test_local_schema);
+   INSTALL_TEST (_test_local_schema_map_compiled);
+   INSTALL_TEST (_test_local_schema_map_image);
    INSTALL_TEST (_test_encrypt_caches_collinfo);
+   INSTALL_TEST (_test_encrypt_caches_missing_collinfo);
+   INSTALL_TEST (_test_encrypt_prefetch_collinfo);
+   INSTALL_TEST (_test_encrypt_collinfo_export_import);
+   INSTALL_TEST (_test_encrypt_plan);
+   INSTALL_TEST (_test_encrypt_caches_no_encryption);
    INSTALL_TEST (_test_encrypt_caches_keys);
    INSTALL_TEST (_test_encrypt_caches_keys_by_alt_name);
+   INSTALL_TEST (_test_encrypt_markings_cache);
+   INSTALL_TEST (_test_encrypt_ciphertext_cache);
+   INSTALL_TEST (_test_encrypt_local_marking);
+   INSTALL_TEST (_test_encrypt_schema_paths);
+   INSTALL_TEST (_test_encrypt_skip_unencrypted_cmds);
    INSTALL_TEST (_test_encrypt_random);
+   INSTALL_TEST (_test_encrypt_dedupe);
    INSTALL_TEST (_test_encrypt_is_remote_schema);
    INSTALL_TEST (_test_encrypt_init_each_cmd);
    INSTALL_TEST (_test_encrypt_invalid_siblings);
    INSTALL_TEST (_test_encrypt_dupe_jsonschema);
    INSTALL_TEST (_test_encrypting_with_explicit_encryption);
    INSTALL_TEST (_test_explicit_encryption);
+   INSTALL_TEST (_test_explicit_encryption_value);
+   INSTALL_TEST (_test_explicit_encryption_batch);
+   INSTALL_TEST (_test_explicit_encryption_column);
+   INSTALL_TEST (_test_explicit_encryption_stream);
+   INSTALL_TEST (_test_explicit_encryption_compressed);
+   INSTALL_TEST (_test_explicit_encrypt_cached);
+   INSTALL_TEST (_test_reencrypt);
    INSTALL_TEST (_test_encrypt_empty_aws);
    INSTALL_TEST (_test_encrypt_custom_endpoint);
    INSTALL_TEST (_test_encrypt_with_aws_session_token);
+   INSTALL_TEST (_test_encrypt_timings);
+   INSTALL_TEST (_test_encrypt_slow_ctx_log);
 }
@@ -227,6 +227,343 @@ _test_datakey_custom_endpoint (_mongocrypt_tester_t *tester)
 }
 
 
+static uint32_t
+_num_aws_signing_keys (mongocrypt_t *crypt)
+{
+   _mongocrypt_aws_signing_key_t *key;
+   uint32_t count = 0;
+
+   for (key = crypt->aws_signing_keys.keys; NULL != key; key = key->next) {
+      count++;
+   }
+   return count;
+}
+
+static void
+_create_aws_data_key (mongocrypt_t *crypt, const char *region)
+{
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_kms_ctx_t *kms_ctx;
+   mongocrypt_binary_t *bin;
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_masterkey_aws (ctx, region, -1, "cmk", -1),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_datakey_init (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_KMS);
+   kms_ctx = mongocrypt_ctx_next_kms_ctx (ctx);
+   BSON_ASSERT (kms_ctx);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_kms_ctx_message (kms_ctx, bin), ctx);
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+}
+
+/* The SigV4 signing key is derived once per date and region. */
+static void
+_test_datakey_aws_signing_key_reused (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   BSON_ASSERT (0 == _num_aws_signing_keys (crypt));
+   _create_aws_data_key (crypt, "region");
+   BSON_ASSERT (1 == _num_aws_signing_keys (crypt));
+   BSON_ASSERT (0 == strcmp ("region", crypt->aws_signing_keys.keys->region));
+   _create_aws_data_key (crypt, "region");
+   BSON_ASSERT (1 == _num_aws_signing_keys (crypt));
+   _create_aws_data_key (crypt, "other-region");
+   BSON_ASSERT (2 == _num_aws_signing_keys (crypt));
+   mongocrypt_destroy (crypt);
+}
+
+
+static uint32_t
+_num_gcp_assertions (mongocrypt_t *crypt)
+{
+   _mongocrypt_gcp_assertion_t *assertion;
+   uint32_t count = 0;
+
+   for (assertion = crypt->gcp_assertions.assertions; NULL != assertion;
+        assertion = assertion->next) {
+      count++;
+   }
+   return count;
+}
+
+/* Returns the OAuth request of a new GCP data key. No token is cached, so the
+ * first request is authentication. */
+static char *
+_create_gcp_data_key_auth (_mongocrypt_tester_t *tester,
+                           mongocrypt_t *crypt,
+                           const char *endpoint)
+{
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_kms_ctx_t *kms_ctx;
+   mongocrypt_binary_t *bin;
+   char *msg;
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_encryption_key (
+                 ctx,
+                 TEST_BSON ("{'provider': 'gcp', 'projectId': 'p', "
+                            "'location': 'l', 'keyRing': 'r', 'keyName': "
+                            "'k', 'endpoint': '%s'}",
+                            endpoint)),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_datakey_init (ctx), ctx);
+   kms_ctx = mongocrypt_ctx_next_kms_ctx (ctx);
+   BSON_ASSERT (kms_ctx);
+   BSON_ASSERT (kms_ctx->req_type == MONGOCRYPT_KMS_GCP_OAUTH);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_kms_ctx_message (kms_ctx, bin), ctx);
+   msg = bson_strndup ((const char *) bin->data, bin->len);
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+   return msg;
+}
+
+/* The GCP OAuth JWT is signed once per scope and reused until it is about to
+ * expire. */
+static void
+_test_datakey_gcp_assertion_reused (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   const char *endpoint = "cloudkms.googleapis.com";
+   char *first;
+   char *second;
+   char *other;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   BSON_ASSERT (0 == _num_gcp_assertions (crypt));
+   first = _create_gcp_data_key_auth (tester, crypt, endpoint);
+   BSON_ASSERT (1 == _num_gcp_assertions (crypt));
+   second = _create_gcp_data_key_auth (tester, crypt, endpoint);
+   BSON_ASSERT (1 == _num_gcp_assertions (crypt));
+   ASSERT_STREQUAL (first, second);
+
+   /* A different KMS domain requests a different scope. */
+   other = _create_gcp_data_key_auth (tester, crypt, "cloudkms.example.com");
+   BSON_ASSERT (2 == _num_gcp_assertions (crypt));
+   BSON_ASSERT (0 != strcmp (first, other));
+
+   bson_free (first);
+   bson_free (second);
+   bson_free (other);
+   mongocrypt_destroy (crypt);
+}
+
+/* Returns the AWS KMS request of a new data key. */
+static char *
+_create_aws_data_key_msg (mongocrypt_t *crypt)
+{
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_kms_ctx_t *kms_ctx;
+   mongocrypt_binary_t *bin;
+   char *msg;
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (
+      mongocrypt_ctx_setopt_masterkey_aws (ctx, "region", -1, "cmk", -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_datakey_init (ctx), ctx);
+   kms_ctx = mongocrypt_ctx_next_kms_ctx (ctx);
+   BSON_ASSERT (kms_ctx);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_kms_ctx_message (kms_ctx, bin), ctx);
+   msg = bson_strndup ((const char *) bin->data, bin->len);
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+   return msg;
+}
+
+/* New KMS requests use updated credentials. Derived signing keys and
+ * assertions are not reused across credentials. */
+static void
+_test_datakey_update_kms_credentials (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_binary_t *bin;
+   bson_t gcp, child;
+   char *msg;
+
+   crypt = mongocrypt_new ();
+   ASSERT_FAILS (mongocrypt_update_kms_credentials (
+                    crypt,
+                    TEST_BSON ("{'aws': {'accessKeyId': 'a', "
+                               "'secretAccessKey': 's'}}")),
+                 crypt,
+                 "mongocrypt_init must be called first");
+   mongocrypt_destroy (crypt);
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   msg = _create_aws_data_key_msg (crypt);
+   BSON_ASSERT (NULL != strstr (msg, "Credential=example/"));
+   BSON_ASSERT (NULL == strstr (msg, "X-Amz-Security-Token"));
+   bson_free (msg);
+   BSON_ASSERT (1 == _num_aws_signing_keys (crypt));
+
+   ASSERT_OK (mongocrypt_update_kms_credentials (
+                 crypt,
+                 TEST_BSON ("{'aws': {'accessKeyId': 'rotated', "
+                            "'secretAccessKey': 'rotated', "
+                            "'sessionToken': 'token'}}")),
+              crypt);
+   msg = _create_aws_data_key_msg (crypt);
+   BSON_ASSERT (NULL != strstr (msg, "Credential=rotated/"));
+   BSON_ASSERT (NULL != strstr (msg, "X-Amz-Security-Token:token"));
+   bson_free (msg);
+   /* The key for the replaced access key was dropped. */
+   BSON_ASSERT (1 == _num_aws_signing_keys (crypt));
+   ASSERT_STREQUAL ("rotated", crypt->aws_signing_keys.keys->access_key_id);
+
+   bson_free (_create_gcp_data_key_auth (
+      tester, crypt, "cloudkms.googleapis.com"));
+   BSON_ASSERT (1 == _num_gcp_assertions (crypt));
+   /* Reuse the configured private key, passed as binary. */
+   bson_init (&gcp);
+   BSON_APPEND_DOCUMENT_BEGIN (&gcp, "gcp", &child);
+   BSON_APPEND_UTF8 (&child, "email", "other@example.com");
+   BSON_APPEND_BINARY (&child,
+                       "privateKey",
+                       BSON_SUBTYPE_BINARY,
+                       crypt->opts.kms_provider_gcp.private_key.data,
+                       crypt->opts.kms_provider_gcp.private_key.len);
+   bson_append_document_end (&gcp, &child);
+   bin = mongocrypt_binary_new_from_data ((uint8_t *) bson_get_data (&gcp),
+                                          gcp.len);
+   ASSERT_OK (mongocrypt_update_kms_credentials (crypt, bin), crypt);
+   mongocrypt_binary_destroy (bin);
+   bson_destroy (&gcp);
+   BSON_ASSERT (0 == _num_gcp_assertions (crypt));
+
+   ASSERT_FAILS (mongocrypt_update_kms_credentials (
+                    crypt, TEST_BSON ("{'local': {'key': 'AAAA'}}")),
+                 crypt,
+                 "local KMS provider cannot be updated");
+   ASSERT_FAILS (mongocrypt_update_kms_credentials (
+                    crypt,
+                    TEST_BSON ("{'azure': {'tenantId': '', 'clientId': '', "
+                               "'clientSecret': '', "
+                               "'identityPlatformEndpoint': 'example.com'}}")),
+                 crypt,
+                 "Unexpected field");
+
+   /* Nothing is replaced on error. */
+   ASSERT_FAILS (mongocrypt_update_kms_credentials (
+                    crypt,
+                    TEST_BSON ("{'aws': {'accessKeyId': 'partial', "
+                               "'secretAccessKey': 's'}, 'other': {}}")),
+                 crypt,
+                 "unsupported KMS provider");
+   msg = _create_aws_data_key_msg (crypt);
+   BSON_ASSERT (NULL != strstr (msg, "Credential=rotated/"));
+   bson_free (msg);
+
+   mongocrypt_destroy (crypt);
+}
+
+static void
+_test_datakey_kms_keep_alive (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_kms_ctx_t *kms_ctx;
+   mongocrypt_binary_t *bin;
+   int i;
+
+   /* By default the connection is closed after each message. */
+   for (i = 0; i < 2; i++) {
+      bool keep_alive = i == 1;
+
+      crypt = mongocrypt_new ();
+      ASSERT_OK (mongocrypt_setopt_kms_provider_aws (
+                    crypt, "example", -1, "example", -1),
+                 crypt);
+      if (keep_alive) {
+         ASSERT_OK (mongocrypt_setopt_kms_keep_alive (crypt, true), crypt);
+      }
+      ASSERT_OK (mongocrypt_init (crypt), crypt);
+      ASSERT_FAILS (mongocrypt_setopt_kms_keep_alive (crypt, true),
+                    crypt,
+                    "options cannot be set after initialization");
+
+      ctx = mongocrypt_ctx_new (crypt);
+      ASSERT_OK (
+         mongocrypt_ctx_setopt_masterkey_aws (ctx, "region", -1, "cmk", -1),
+         ctx);
+      ASSERT_OK (mongocrypt_ctx_datakey_init (ctx), ctx);
+      kms_ctx = mongocrypt_ctx_next_kms_ctx (ctx);
+      BSON_ASSERT (kms_ctx);
+      bin = mongocrypt_binary_new ();
+      ASSERT_OK (mongocrypt_kms_ctx_message (kms_ctx, bin), ctx);
+      BSON_ASSERT (keep_alive ==
+                   (NULL == strstr ((char *) bin->data, "Connection:close")));
+      mongocrypt_binary_destroy (bin);
+      mongocrypt_ctx_destroy (ctx);
+      mongocrypt_destroy (crypt);
+   }
+}
+
+
+/* Returns how long to wait before sending the request of a new AWS data
+ * key. */
+static int64_t
+_aws_data_key_usleep (mongocrypt_t *crypt, const char *region)
+{
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_kms_ctx_t *kms_ctx;
+   int64_t wait_us;
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_masterkey_aws (ctx, region, -1, "cmk", -1),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_datakey_init (ctx), ctx);
+   kms_ctx = mongocrypt_ctx_next_kms_ctx (ctx);
+   BSON_ASSERT (kms_ctx);
+   wait_us = mongocrypt_kms_ctx_usleep (kms_ctx);
+   mongocrypt_ctx_destroy (ctx);
+   return wait_us;
+}
+
+static void
+_test_datakey_kms_rate_limit (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   int64_t wait_us;
+
+   /* No limit by default. */
+   crypt = _mongocrypt_tester_mongocrypt ();
+   BSON_ASSERT (0 == _aws_data_key_usleep (crypt, "region"));
+   BSON_ASSERT (0 == _aws_data_key_usleep (crypt, "region"));
+   BSON_ASSERT (0 == _aws_data_key_usleep (crypt, "region"));
+   mongocrypt_destroy (crypt);
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_FAILS (mongocrypt_setopt_kms_rate_limit (crypt, 0, 1),
+                 crypt,
+                 "requests_per_sec must be between 1 and 1000000");
+   ASSERT_FAILS (mongocrypt_setopt_kms_rate_limit (crypt, 1, 0),
+                 crypt,
+                 "burst must be positive");
+   ASSERT_OK (mongocrypt_setopt_kms_rate_limit (crypt, 1, 2), crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+
+   /* A burst of two is sent at once. The third waits up to a second. */
+   BSON_ASSERT (0 == _aws_data_key_usleep (crypt, "region"));
+   BSON_ASSERT (0 == _aws_data_key_usleep (crypt, "region"));
+   wait_us = _aws_data_key_usleep (crypt, "region");
+   BSON_ASSERT (wait_us > 0 && wait_us <= 1000 * 1000);
+   /* The fourth waits for the token after. */
+   BSON_ASSERT (_aws_data_key_usleep (crypt, "region") > wait_us);
+   /* Another region has its own bucket. */
+   BSON_ASSERT (0 == _aws_data_key_usleep (crypt, "other-region"));
+   mongocrypt_destroy (crypt);
+}
+
+
 static void
 _test_create_data_key (_mongocrypt_tester_t *tester)
 {
@@ -241,10 +578,192 @@ _test_create_data_key (_mongocrypt_tester_t *tester)
 }
 
 
+/* Check that @bin is { v: [ key documents ] } with @count distinct _ids. */
+static void
+_assert_batch_result (mongocrypt_binary_t *bin, uint32_t count)
+{
+   bson_t as_bson;
+   bson_iter_t iter, keys, key;
+   _mongocrypt_buffer_t ids[3];
+   uint32_t n = 0, i;
+
+   BSON_ASSERT (count <= 3);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "v"));
+   BSON_ASSERT (BSON_ITER_HOLDS_ARRAY (&iter));
+   BSON_ASSERT (bson_iter_recurse (&iter, &keys));
+   while (bson_iter_next (&keys)) {
+      BSON_ASSERT (n < count);
+      BSON_ASSERT (bson_iter_recurse (&keys, &key));
+      BSON_ASSERT (bson_iter_find (&key, "_id"));
+      BSON_ASSERT (_mongocrypt_buffer_from_binary_iter (&ids[n], &key));
+      BSON_ASSERT (ids[n].subtype == BSON_SUBTYPE_UUID);
+      for (i = 0; i < n; i++) {
+         BSON_ASSERT (0 != _mongocrypt_buffer_cmp (&ids[i], &ids[n]));
+      }
+      BSON_ASSERT (bson_iter_recurse (&keys, &key));
+      BSON_ASSERT (bson_iter_find (&key, "keyMaterial"));
+      n++;
+   }
+   BSON_ASSERT (n == count);
+}
+
+
+static void
+_test_datakey_batch (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_kms_ctx_t *kms;
+   mongocrypt_binary_t *bin;
+   uint32_t n_kms = 0;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   bin = mongocrypt_binary_new ();
+
+   /* AWS issues one KMS request per key, all at once. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (
+      mongocrypt_ctx_setopt_masterkey_aws (ctx, "region", -1, "cmk", -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_datakey_batch_init (ctx, 3), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_KMS);
+   while ((kms = mongocrypt_ctx_next_kms_ctx (ctx))) {
+      ASSERT_OK (mongocrypt_kms_ctx_feed (
+                    kms, TEST_FILE ("./test/data/kms-encrypt-reply.txt")),
+                 kms);
+      BSON_ASSERT (0 == mongocrypt_kms_ctx_bytes_needed (kms));
+      n_kms++;
+   }
+   BSON_ASSERT (n_kms == 3);
+   ASSERT_OK (mongocrypt_ctx_kms_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   _assert_batch_result (bin, 3);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Local keys are encrypted immediately. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_masterkey_local (ctx), ctx);
+   ASSERT_OK (mongocrypt_ctx_datakey_batch_init (ctx, 2), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   _assert_batch_result (bin, 2);
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_masterkey_local (ctx), ctx);
+   ASSERT_FAILS (mongocrypt_ctx_datakey_batch_init (ctx, 0),
+                 ctx,
+                 "key count must be positive");
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Key alt names must be unique. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_masterkey_local (ctx), ctx);
+   ASSERT_OK (mongocrypt_ctx_setopt_key_alt_name (
+                 ctx, TEST_BSON ("{'keyAltName': 'a'}")),
+              ctx);
+   BSON_ASSERT (!mongocrypt_ctx_datakey_batch_init (ctx, 2));
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_test_rewrap_many_datakey (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_kms_ctx_t *kms;
+   mongocrypt_binary_t *bin;
+   bson_t as_bson;
+   bson_iter_t iter;
+   _mongocrypt_buffer_t id;
+   uint32_t n_kms = 0;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   bin = mongocrypt_binary_new ();
+
+   /* Rewrap an AWS key with the local master key. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_masterkey_local (ctx), ctx);
+   ASSERT_OK (mongocrypt_ctx_rewrap_many_datakey_init (
+                 ctx, TEST_BSON ("{'keyAltNames': 'a'}")),
+              ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, bin), ctx);
+   _assert_bin_bson_equal (bin, TEST_BSON ("{'keyAltNames': 'a'}"));
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/key-document.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_KMS);
+   while ((kms = mongocrypt_ctx_next_kms_ctx (ctx))) {
+      ASSERT_OK (mongocrypt_kms_ctx_feed (
+                    kms, TEST_FILE ("./test/example/kms-decrypt-reply.txt")),
+                 kms);
+      n_kms++;
+   }
+   BSON_ASSERT (n_kms == 1);
+   ASSERT_OK (mongocrypt_ctx_kms_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, "v.0.q._id", &iter));
+   BSON_ASSERT (_mongocrypt_buffer_from_binary_iter (&id, &iter));
+   BSON_ASSERT (id.len == 16);
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (
+      &iter, "v.0.u.$set.masterKey.provider", &iter));
+   BSON_ASSERT (0 == strcmp (bson_iter_utf8 (&iter, NULL), "local"));
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (
+      bson_iter_find_descendant (&iter, "v.0.u.$set.keyMaterial", &iter));
+   BSON_ASSERT (BSON_ITER_HOLDS_BINARY (&iter));
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (
+      &iter, "v.0.u.$currentDate.updateDate", &iter));
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (!bson_iter_find_descendant (&iter, "v.1", &iter));
+   mongocrypt_ctx_destroy (ctx);
+
+   /* No matching keys. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_masterkey_local (ctx), ctx);
+   ASSERT_OK (mongocrypt_ctx_rewrap_many_datakey_init (ctx, TEST_BSON ("{}")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   _assert_bin_bson_equal (bin, TEST_BSON ("{'v': []}"));
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (
+      mongocrypt_ctx_rewrap_many_datakey_init (ctx, TEST_BSON ("{}")),
+      ctx,
+      "master key required");
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_destroy (crypt);
+}
+
 void
 _mongocrypt_tester_install_data_key (_mongocrypt_tester_t *tester)
 {
    INSTALL_TEST (_test_random_generator);
    INSTALL_TEST (_test_create_data_key);
    INSTALL_TEST (_test_datakey_custom_endpoint);
+   INSTALL_TEST (_test_datakey_aws_signing_key_reused);
+   INSTALL_TEST (_test_datakey_gcp_assertion_reused);
+   INSTALL_TEST (_test_datakey_update_kms_credentials);
+   INSTALL_TEST (_test_datakey_kms_keep_alive);
+   INSTALL_TEST (_test_datakey_kms_rate_limit);
+   INSTALL_TEST (_test_datakey_batch);
+   INSTALL_TEST (_test_rewrap_many_datakey);
 }
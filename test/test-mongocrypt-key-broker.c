@@ -321,6 +321,57 @@ _test_key_broker_get_key_filter (_mongocrypt_tester_t *tester)
 }
 
 
+static void
+_test_key_broker_get_key_projection (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   _mongocrypt_buffer_t key_id1;
+   mongocrypt_binary_t *projection;
+   _mongocrypt_key_broker_t key_broker;
+   bson_t as_bson;
+   bson_iter_t iter;
+   /* Every field of a key document that is parsed. */
+   const char *fields[] = {"_id",
+                           "keyAltNames",
+                           "keyMaterial",
+                           "masterKey",
+                           "version",
+                           "status",
+                           "creationDate",
+                           "updateDate"};
+   const uint32_t n_fields = sizeof (fields) / sizeof (fields[0]);
+   uint32_t i;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   _gen_uuid (1, &key_id1);
+
+   _mongocrypt_key_broker_init (&key_broker, crypt);
+   projection = mongocrypt_binary_new ();
+   ASSERT_FAILS (_mongocrypt_key_broker_projection (&key_broker, projection),
+                 &key_broker,
+                 "in wrong state");
+   _mongocrypt_key_broker_cleanup (&key_broker);
+
+   _mongocrypt_key_broker_init (&key_broker, crypt);
+   ASSERT_OK (_mongocrypt_key_broker_request_id (&key_broker, &key_id1),
+              &key_broker);
+   ASSERT_OK (_mongocrypt_key_broker_requests_done (&key_broker), &key_broker);
+   ASSERT_OK (_mongocrypt_key_broker_projection (&key_broker, projection),
+              &key_broker);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (projection, &as_bson));
+   BSON_ASSERT (bson_count_keys (&as_bson) == n_fields);
+   for (i = 0; i < n_fields; i++) {
+      BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, fields[i]));
+      BSON_ASSERT (bson_iter_as_int64 (&iter) == 1);
+   }
+
+   _mongocrypt_key_broker_cleanup (&key_broker);
+   mongocrypt_binary_destroy (projection);
+   _mongocrypt_buffer_cleanup (&key_id1);
+   mongocrypt_destroy (crypt);
+}
+
+
 static void
 _test_key_broker_add_key (_mongocrypt_tester_t *tester)
 {
@@ -618,12 +669,146 @@ _test_key_broker_multi_match (_mongocrypt_tester_t *tester)
    mongocrypt_status_destroy (status);
 }
 
+
+/* Enough keys to grow the key broker indexes several times. */
+#define MANY_KEYS 200
+
+static void
+_test_key_broker_many_keys (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   _mongocrypt_key_broker_t key_broker;
+   _mongocrypt_buffer_t key_ids[MANY_KEYS], key_docs[MANY_KEYS];
+   _mongocrypt_buffer_t key_material;
+   key_request_t *req;
+   uint32_t num_requests;
+   char altname[16];
+   int i;
+
+   for (i = 0; i < MANY_KEYS; i++) {
+      bson_snprintf (altname, sizeof (altname), "alt%d", i);
+      _gen_uuid_and_key_and_altname (
+         tester, altname, (uint8_t) i, &key_ids[i], &key_docs[i]);
+   }
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   _mongocrypt_key_broker_init (&key_broker, crypt);
+
+   /* Request every key by id and by name, twice. Duplicates are ignored. */
+   for (i = 0; i < MANY_KEYS * 2; i++) {
+      ASSERT_OK (_mongocrypt_key_broker_request_id (&key_broker,
+                                                    &key_ids[i % MANY_KEYS]),
+                 &key_broker);
+      bson_snprintf (altname, sizeof (altname), "alt%d", i % MANY_KEYS);
+      _key_broker_add_name (&key_broker, altname);
+   }
+   num_requests = 0;
+   for (req = key_broker.key_requests; NULL != req; req = req->next) {
+      num_requests++;
+   }
+   BSON_ASSERT (num_requests == MANY_KEYS * 2);
+   ASSERT_OK (_mongocrypt_key_broker_requests_done (&key_broker), &key_broker);
+
+   /* Each doc satisfies its id request and its name request. */
+   for (i = MANY_KEYS - 1; i >= 0; i--) {
+      ASSERT_OK (_mongocrypt_key_broker_add_doc (&key_broker, &key_docs[i]),
+                 &key_broker);
+   }
+   BSON_ASSERT (MANY_KEYS * 2 == _key_broker_num_satisfied (&key_broker));
+   ASSERT_FAILS (_mongocrypt_key_broker_add_doc (&key_broker, &key_docs[7]),
+                 &key_broker,
+                 "duplicate");
+   _mongocrypt_key_broker_cleanup (&key_broker);
+
+   /* Decrypted keys are found by id. */
+   _mongocrypt_key_broker_init (&key_broker, crypt);
+   for (i = 0; i < MANY_KEYS; i++) {
+      _mongocrypt_key_broker_add_test_key (&key_broker, &key_ids[i]);
+   }
+   for (i = 0; i < MANY_KEYS; i++) {
+      ASSERT_OK (_mongocrypt_key_broker_decrypted_key_by_id (
+                    &key_broker, &key_ids[i], &key_material, NULL),
+                 &key_broker);
+      BSON_ASSERT (key_material.len == MONGOCRYPT_KEY_LEN);
+      _mongocrypt_buffer_cleanup (&key_material);
+   }
+   _mongocrypt_key_broker_cleanup (&key_broker);
+
+   for (i = 0; i < MANY_KEYS; i++) {
+      _mongocrypt_buffer_cleanup (&key_ids[i]);
+      _mongocrypt_buffer_cleanup (&key_docs[i]);
+   }
+   mongocrypt_destroy (crypt);
+}
+
+static void
+_test_key_broker_borrow_decrypted_key (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   _mongocrypt_key_broker_t key_broker;
+   _mongocrypt_buffer_t key_ids[KB_RECENT_KEYS + 1], missing_id;
+   const _mongocrypt_buffer_t *borrowed, *borrowed_again;
+   _mongocrypt_buffer_t copied;
+   int i;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   _mongocrypt_key_broker_init (&key_broker, crypt);
+   /* Key ids with the same last byte share a recent key slot. */
+   for (i = 0; i < KB_RECENT_KEYS + 1; i++) {
+      _gen_uuid ((uint8_t) i, &key_ids[i]);
+      key_ids[i].data[15] = 0;
+      _mongocrypt_key_broker_add_test_key (&key_broker, &key_ids[i]);
+   }
+
+   for (i = 0; i < (KB_RECENT_KEYS + 1) * 2; i++) {
+      ASSERT_OK (_mongocrypt_key_broker_borrow_decrypted_key (
+                    &key_broker,
+                    &key_ids[i % (KB_RECENT_KEYS + 1)],
+                    &borrowed,
+                    NULL),
+                 &key_broker);
+      ASSERT_OK (_mongocrypt_key_broker_borrow_decrypted_key (
+                    &key_broker,
+                    &key_ids[i % (KB_RECENT_KEYS + 1)],
+                    &borrowed_again,
+                    NULL),
+                 &key_broker);
+      BSON_ASSERT (borrowed == borrowed_again);
+      ASSERT_OK (_mongocrypt_key_broker_decrypted_key_by_id (
+                    &key_broker,
+                    &key_ids[i % (KB_RECENT_KEYS + 1)],
+                    &copied,
+                    NULL),
+                 &key_broker);
+      BSON_ASSERT (0 == _mongocrypt_buffer_cmp (borrowed, &copied));
+      BSON_ASSERT (borrowed->data != copied.data);
+      _mongocrypt_buffer_cleanup (&copied);
+   }
+
+   _gen_uuid (99, &missing_id);
+   ASSERT_FAILS (_mongocrypt_key_broker_borrow_decrypted_key (
+                    &key_broker, &missing_id, &borrowed, NULL),
+                 &key_broker,
+                 "could not find key");
+   BSON_ASSERT (!borrowed);
+
+   _mongocrypt_key_broker_cleanup (&key_broker);
+   for (i = 0; i < KB_RECENT_KEYS + 1; i++) {
+      _mongocrypt_buffer_cleanup (&key_ids[i]);
+   }
+   _mongocrypt_buffer_cleanup (&missing_id);
+   mongocrypt_destroy (crypt);
+}
+
 void
 _mongocrypt_tester_install_key_broker (_mongocrypt_tester_t *tester)
 {
    INSTALL_TEST (_test_key_broker_get_key_filter);
+   INSTALL_TEST (_test_key_broker_get_key_projection);
    INSTALL_TEST (_test_key_broker_add_key);
    INSTALL_TEST (_test_key_broker_add_decrypted_key);
    INSTALL_TEST (_test_key_broker_wrong_subtype);
    INSTALL_TEST (_test_key_broker_multi_match);
+   INSTALL_TEST (_test_key_broker_many_keys);
+   INSTALL_TEST (_test_key_broker_borrow_decrypted_key);
 }
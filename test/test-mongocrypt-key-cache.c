@@ -20,6 +20,11 @@
 #include "test-conveniences.h"
 #include "test-mongocrypt.h"
 
+#ifdef BSON_OS_UNIX
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 typedef struct {
    _mongocrypt_buffer_t bson;
    _mongocrypt_key_doc_t *parsed;
@@ -217,7 +222,7 @@ _add_to_cache (_mongocrypt_tester_t *tester,
 
    ASSERT_OK_STATUS (
       _mongocrypt_cache_add_copy (
-         &ctx->crypt->cache_key, cache_key_attr, cache_key_value, status),
+         ctx->crypt->cache_key, cache_key_attr, cache_key_value, status),
       status);
 
    _mongocrypt_key_destroy (key_doc);
@@ -292,7 +297,7 @@ _match_cache_entry (_mongocrypt_tester_t *tester,
    _mongocrypt_cache_pair_t *pair;
    bool matched = false;
 
-   pair = ctx->crypt->cache_key.pair;
+   pair = ctx->crypt->cache_key->pair;
 
    while (pair) {
       if (_match_one_cache_entry (pair, expected_entry)) {
@@ -429,7 +434,7 @@ _run_one_test (_mongocrypt_tester_t *tester,
             count++;
          }
          BSON_ASSERT (count ==
-                      _mongocrypt_cache_num_entries (&ctx->crypt->cache_key));
+                      _mongocrypt_cache_num_entries (ctx->crypt->cache_key));
       }
    }
 
@@ -466,8 +471,1243 @@ _test_key_cache (_mongocrypt_tester_t *tester)
    bson_destroy (&test_file);
 }
 
+static void
+_feed_key (_mongocrypt_tester_t *tester,
+           mongocrypt_ctx_t *ctx,
+           bson_t *key_description)
+{
+   _mongocrypt_buffer_t buf;
+   bson_t key;
+
+   gen_key (tester, key_description, &key, NULL);
+   _mongocrypt_buffer_from_bson (&buf, &key);
+   ASSERT_OK (
+      mongocrypt_ctx_mongo_feed (ctx, _mongocrypt_buffer_as_binary (&buf)),
+      ctx);
+   bson_destroy (&key);
+}
+
+
+static void
+_test_key_cache_refresh (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+   _mongocrypt_buffer_t key_id;
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_cache_key_value_t *value;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   /* Any lookup is within a window as long as the TTL. */
+   _mongocrypt_cache_set_refresh_window (crypt->cache_key,
+                                         crypt->cache_key->expiration);
+
+   /* With nothing to refresh, the context is immediately ready. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_refresh_keys_init (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   BSON_ASSERT (bin->len == 5);
+   mongocrypt_binary_destroy (bin);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_DONE);
+
+   _add_to_cache (tester, ctx, TMP_BSON ("{'_id': 0, 'local': true}"));
+   mongocrypt_ctx_destroy (ctx);
+   BSON_ASSERT (!mongocrypt_needs_key_refresh (crypt));
+
+   lookup_key_id (0, &key_id);
+   attr = _mongocrypt_cache_key_attr_new (&key_id, NULL);
+   BSON_ASSERT (
+      _mongocrypt_cache_get (crypt->cache_key, attr, (void **) &value));
+   BSON_ASSERT (value);
+   _mongocrypt_cache_key_value_destroy (value);
+   BSON_ASSERT (mongocrypt_needs_key_refresh (crypt));
+
+   /* The cached key is fetched again, though it is still in the cache. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_refresh_keys_init (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   BSON_ASSERT (!mongocrypt_needs_key_refresh (crypt));
+   _feed_key (tester, ctx, TMP_BSON ("{'_id': 0, 'local': true}"));
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* The refreshed key replaced the cached one. */
+   BSON_ASSERT (1 == _mongocrypt_cache_num_entries (crypt->cache_key));
+   BSON_ASSERT (crypt->cache_key->pair->refresh == CACHE_REFRESH_NONE);
+
+   _mongocrypt_cache_key_attr_destroy (attr);
+   _mongocrypt_buffer_cleanup (&key_id);
+   mongocrypt_destroy (crypt);
+}
+
+
+static void
+_test_key_cache_prefetch (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *filter, *bin;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   filter = TEST_BSON ("{'status': 1}");
+   ASSERT_OK (mongocrypt_ctx_prefetch_keys_init (ctx, filter), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+
+   /* The caller's filter is used as is. */
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_mongo_op (ctx, bin), ctx);
+   BSON_ASSERT (bin->len == filter->len);
+   BSON_ASSERT (0 == memcmp (bin->data, filter->data, bin->len));
+   mongocrypt_binary_destroy (bin);
+
+   /* Any key returned is accepted and cached. */
+   _feed_key (tester, ctx, TMP_BSON ("{'_id': 0, 'local': true}"));
+   _feed_key (tester,
+              ctx,
+              TMP_BSON ("{'_id': 1, 'keyAltNames': ['a'], 'local': true}"));
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   _match_cache_entry (tester, ctx, TMP_BSON ("{'_id': 0}"));
+   _match_cache_entry (
+      tester, ctx, TMP_BSON ("{'_id': 1, 'keyAltNames': ['a']}"));
+   BSON_ASSERT (2 == _mongocrypt_cache_num_entries (crypt->cache_key));
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Prefetching nothing is not an error. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_prefetch_keys_init (ctx, TEST_BSON ("{}")), ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_FAILS (mongocrypt_ctx_prefetch_keys_init (ctx, NULL),
+                 ctx,
+                 "invalid filter");
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_destroy (crypt);
+}
+
+
+#ifdef BSON_OS_UNIX
+typedef struct {
+   mongocrypt_t *crypt;
+   mongocrypt_binary_t *cmd;
+   mongocrypt_ctx_state_t state;
+} _key_fetch_waiter_t;
+
+
+static void *
+_key_fetch_waiter_run (void *arg)
+{
+   _key_fetch_waiter_t *waiter;
+   mongocrypt_ctx_t *ctx;
+
+   waiter = (_key_fetch_waiter_t *) arg;
+   ctx = mongocrypt_ctx_new (waiter->crypt);
+   BSON_ASSERT (mongocrypt_ctx_decrypt_init (ctx, waiter->cmd));
+   waiter->state = mongocrypt_ctx_state (ctx);
+   mongocrypt_ctx_destroy (ctx);
+   return NULL;
+}
+#endif
+
+
+static void
+_test_key_cache_fetch_wait (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx, *ctx2;
+   mongocrypt_binary_t *cmd;
+   int64_t start;
+
+   cmd = TEST_FILE ("./test/data/encrypted-cmd.json");
+
+   /* If the first fetch does not finish in time, the waiter fetches too. */
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_key_fetch_wait (crypt, 50), crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   ASSERT_FAILS (mongocrypt_setopt_key_fetch_wait (crypt, 50),
+                 crypt,
+                 "options cannot be set after initialization");
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, cmd), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   ctx2 = mongocrypt_ctx_new (crypt);
+   start = bson_get_monotonic_time ();
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx2, cmd), ctx2);
+   BSON_ASSERT (bson_get_monotonic_time () - start >= 40 * 1000);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx2) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   mongocrypt_ctx_destroy (ctx2);
+
+   /* A context that finishes wakes the waiters. */
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, cmd), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+
+#ifdef BSON_OS_UNIX
+   {
+      _key_fetch_waiter_t waiter;
+      pthread_t thread;
+
+      /* A waiter on another thread uses the key the first context fetched,
+       * whether it starts waiting before that context finishes or not. */
+      crypt = mongocrypt_new ();
+      ASSERT_OK (mongocrypt_setopt_kms_provider_aws (
+                    crypt, "example", -1, "example", -1),
+                 crypt);
+      ASSERT_OK (mongocrypt_setopt_key_fetch_wait (crypt, 60 * 1000), crypt);
+      ASSERT_OK (mongocrypt_init (crypt), crypt);
+      ctx = mongocrypt_ctx_new (crypt);
+      ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, cmd), ctx);
+      BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                   MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+
+      waiter.crypt = crypt;
+      waiter.cmd = cmd;
+      waiter.state = MONGOCRYPT_CTX_ERROR;
+      BSON_ASSERT (
+         0 == pthread_create (&thread, NULL, _key_fetch_waiter_run, &waiter));
+      _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+      mongocrypt_ctx_destroy (ctx);
+      BSON_ASSERT (0 == pthread_join (thread, NULL));
+      BSON_ASSERT (waiter.state == MONGOCRYPT_CTX_READY);
+      mongocrypt_destroy (crypt);
+   }
+#endif
+}
+
+#ifdef BSON_OS_UNIX
+typedef struct {
+   mongocrypt_t *crypt;
+   const char *key_id;
+   mongocrypt_binary_t *msg;
+   mongocrypt_ctx_t *ctx;
+} _key_fetch_batcher_t;
+
+
+static void *
+_key_fetch_batcher_run (void *arg)
+{
+   _key_fetch_batcher_t *batcher;
+   mongocrypt_binary_t *key_id;
+
+   batcher = (_key_fetch_batcher_t *) arg;
+   key_id = mongocrypt_binary_new_from_data (
+      (uint8_t *) batcher->key_id, (uint32_t) strlen (batcher->key_id));
+   batcher->ctx = mongocrypt_ctx_new (batcher->crypt);
+   BSON_ASSERT (mongocrypt_ctx_setopt_key_id (batcher->ctx, key_id));
+   BSON_ASSERT (mongocrypt_ctx_setopt_algorithm (
+      batcher->ctx, "AEAD_AES_256_CBC_HMAC_SHA_512-Random", -1));
+   BSON_ASSERT (
+      mongocrypt_ctx_explicit_encrypt_init (batcher->ctx, batcher->msg));
+   mongocrypt_binary_destroy (key_id);
+   return NULL;
+}
+
+
+static void
+_test_key_cache_fetch_batch (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   _key_fetch_batcher_t leader, follower;
+   pthread_t leader_thread, follower_thread;
+   mongocrypt_binary_t *bin;
+   bson_t filter;
+   bson_iter_t iter;
+
+   /* Batching relies on waiting for the batch leader. */
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_key_fetch_batch (crypt, 50), crypt);
+   ASSERT_FAILS (mongocrypt_init (crypt),
+                 crypt,
+                 "key fetch batching requires a key fetch wait");
+   mongocrypt_destroy (crypt);
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_key_fetch_wait (crypt, 60 * 1000), crypt);
+   ASSERT_OK (mongocrypt_setopt_key_fetch_batch (crypt, 500), crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+
+   /* A context missing a different key during the leader's window joins its
+    * batch, and waits for the leader instead of querying itself. */
+   memset (&leader, 0, sizeof (leader));
+   leader.crypt = crypt;
+   leader.key_id = "2395340598345034";
+   leader.msg = TEST_BSON ("{'v': 1}");
+   memset (&follower, 0, sizeof (follower));
+   follower.crypt = crypt;
+   follower.key_id = "2395340598345035";
+   follower.msg = leader.msg;
+   BSON_ASSERT (0 == pthread_create (
+                        &leader_thread, NULL, _key_fetch_batcher_run, &leader));
+   usleep (100 * 1000);
+   BSON_ASSERT (0 == pthread_create (&follower_thread,
+                                     NULL,
+                                     _key_fetch_batcher_run,
+                                     &follower));
+   BSON_ASSERT (0 == pthread_join (leader_thread, NULL));
+   BSON_ASSERT (mongocrypt_ctx_state (leader.ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+
+   /* The leader's filter has both keys. */
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_mongo_op (leader.ctx, bin), leader.ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &filter));
+   BSON_ASSERT (bson_iter_init (&iter, &filter));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, "$or.0._id.$in.1", &iter));
+   BSON_ASSERT (bson_iter_init (&iter, &filter));
+   BSON_ASSERT (!bson_iter_find_descendant (&iter, "$or.0._id.$in.2", &iter));
+   mongocrypt_binary_destroy (bin);
+
+   /* If the leader gives up, the follower queries for its key itself. */
+   mongocrypt_ctx_destroy (leader.ctx);
+   BSON_ASSERT (0 == pthread_join (follower_thread, NULL));
+   BSON_ASSERT (mongocrypt_ctx_state (follower.ctx) ==
+                MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_mongo_op (follower.ctx, bin), follower.ctx);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &filter));
+   BSON_ASSERT (bson_iter_init (&iter, &filter));
+   BSON_ASSERT (!bson_iter_find_descendant (&iter, "$or.0._id.$in.1", &iter));
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (follower.ctx);
+   mongocrypt_destroy (crypt);
+}
+#endif
+
+typedef struct {
+   int calls;
+   int64_t hits[2];
+   bool stop;
+} _key_cache_foreach_test_t;
+
+static bool
+_key_cache_foreach_visit (mongocrypt_binary_t *key_info, void *ctx)
+{
+   _key_cache_foreach_test_t *test = (_key_cache_foreach_test_t *) ctx;
+   _mongocrypt_buffer_t key_id, expected_id;
+   bson_t bson;
+   bson_iter_t iter;
+   int i;
+
+   BSON_ASSERT (_mongocrypt_binary_to_bson (key_info, &bson));
+   BSON_ASSERT (!bson_has_field (&bson, "keyMaterial"));
+   BSON_ASSERT (bson_iter_init_find (&iter, &bson, "_id"));
+   BSON_ASSERT (_mongocrypt_buffer_from_uuid_iter (&key_id, &iter));
+   for (i = 0; i < 2; i++) {
+      lookup_key_id (i, &expected_id);
+      if (0 == _mongocrypt_buffer_cmp (&key_id, &expected_id)) {
+         BSON_ASSERT (bson_iter_init_find (&iter, &bson, "hits"));
+         test->hits[i] = bson_iter_int64 (&iter);
+      }
+      _mongocrypt_buffer_cleanup (&expected_id);
+   }
+   BSON_ASSERT (bson_iter_init_find (&iter, &bson, "keyAltNames"));
+   BSON_ASSERT (BSON_ITER_HOLDS_ARRAY (&iter));
+   BSON_ASSERT (bson_iter_init_find (&iter, &bson, "ageMs"));
+   BSON_ASSERT (bson_iter_int64 (&iter) >= 0);
+   BSON_ASSERT (bson_iter_init_find (&iter, &bson, "idleMs"));
+   BSON_ASSERT (bson_iter_int64 (&iter) >= 0);
+   test->calls++;
+   return !test->stop;
+}
+
+
+static void
+_test_key_cache_foreach (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   _mongocrypt_buffer_t key_id;
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_cache_key_value_t *value;
+   _key_cache_foreach_test_t test = {0};
+   int i;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   BSON_ASSERT (!mongocrypt_key_cache_foreach (crypt, NULL, NULL));
+   ASSERT_OK (mongocrypt_key_cache_foreach (
+                 crypt, _key_cache_foreach_visit, &test),
+              crypt);
+   BSON_ASSERT (test.calls == 0);
+
+   _add_to_cache (tester, ctx, TMP_BSON ("{'_id': 0, 'keyAltNames': ['a']}"));
+   _add_to_cache (tester, ctx, TMP_BSON ("{'_id': 1}"));
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Look up the first key twice. */
+   lookup_key_id (0, &key_id);
+   attr = _mongocrypt_cache_key_attr_new (&key_id, NULL);
+   for (i = 0; i < 2; i++) {
+      BSON_ASSERT (
+         _mongocrypt_cache_get (crypt->cache_key, attr, (void **) &value));
+      BSON_ASSERT (value);
+      _mongocrypt_cache_key_value_destroy (value);
+   }
+
+   ASSERT_OK (mongocrypt_key_cache_foreach (
+                 crypt, _key_cache_foreach_visit, &test),
+              crypt);
+   BSON_ASSERT (test.calls == 2);
+   BSON_ASSERT (test.hits[0] == 2);
+   BSON_ASSERT (test.hits[1] == 0);
+
+   /* Returning false stops iterating. */
+   memset (&test, 0, sizeof (test));
+   test.stop = true;
+   ASSERT_OK (mongocrypt_key_cache_foreach (
+                 crypt, _key_cache_foreach_visit, &test),
+              crypt);
+   BSON_ASSERT (test.calls == 1);
+
+   _mongocrypt_cache_key_attr_destroy (attr);
+   _mongocrypt_buffer_cleanup (&key_id);
+   mongocrypt_destroy (crypt);
+}
+
+
+/* Copy a wrapped key @entry to @out, with @field changed: an int64 lifetime
+ * is raised, and "keyDocument" gets another keyAltName. */
+static void
+_tamper_key_entry (const bson_t *entry, const char *field, bson_t *out)
+{
+   bson_t key_doc, tampered_doc, child;
+   bson_iter_t iter;
+   const uint8_t *data;
+   uint32_t len;
+
+   bson_init (out);
+   bson_copy_to_excluding_noinit (entry, out, field, NULL);
+   BSON_ASSERT (bson_iter_init_find (&iter, entry, field));
+   if (BSON_ITER_HOLDS_INT64 (&iter)) {
+      BSON_APPEND_INT64 (out, field, bson_iter_int64 (&iter) + 1000);
+      return;
+   }
+
+   bson_iter_document (&iter, &len, &data);
+   BSON_ASSERT (bson_init_static (&key_doc, data, len));
+   bson_init (&tampered_doc);
+   bson_copy_to_excluding_noinit (&key_doc, &tampered_doc, "keyAltNames", NULL);
+   BSON_APPEND_ARRAY_BEGIN (&tampered_doc, "keyAltNames", &child);
+   BSON_APPEND_UTF8 (&child, "0", "tampered");
+   bson_append_array_end (&tampered_doc, &child);
+   BSON_APPEND_DOCUMENT (out, field, &tampered_doc);
+   bson_destroy (&tampered_doc);
+}
+
+
+/* Copy the first key of @exported to @out, with @field changed. */
+static void
+_tamper_exported_key (mongocrypt_binary_t *exported,
+                      const char *field,
+                      bson_t *out)
+{
+   bson_t as_bson, entry, tampered, keys;
+   bson_iter_t iter;
+   const uint8_t *data;
+   uint32_t len;
+
+   BSON_ASSERT (_mongocrypt_binary_to_bson (exported, &as_bson));
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, "keys.0", &iter));
+   bson_iter_document (&iter, &len, &data);
+   BSON_ASSERT (bson_init_static (&entry, data, len));
+   _tamper_key_entry (&entry, field, &tampered);
+
+   bson_init (out);
+   BSON_APPEND_INT32 (out, "v", 2);
+   BSON_APPEND_ARRAY_BEGIN (out, "keys", &keys);
+   BSON_APPEND_DOCUMENT (&keys, "0", &tampered);
+   bson_append_array_end (out, &keys);
+   bson_destroy (&tampered);
+}
+
+
+static void
+_test_key_cache_export_import (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt, *restarted;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *kek, *wrong_kek, *short_kek, *exported;
+   _mongocrypt_key_alt_name_t *alt_name;
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_cache_key_value_t *value;
+   _key_cache_foreach_test_t test = {0};
+   uint8_t kek_data[MONGOCRYPT_KEY_LEN];
+   uint8_t wrong_kek_data[MONGOCRYPT_KEY_LEN];
+   const char *tampered_fields[] = {"ttlMs", "keyDocument"};
+   mongocrypt_binary_t *tampered_bin;
+   bson_t as_bson, tampered;
+   bson_iter_t iter;
+   int i;
+
+   memset (kek_data, 1, sizeof (kek_data));
+   memset (wrong_kek_data, 2, sizeof (wrong_kek_data));
+   kek = mongocrypt_binary_new_from_data (kek_data, sizeof (kek_data));
+   wrong_kek = mongocrypt_binary_new_from_data (wrong_kek_data,
+                                                sizeof (wrong_kek_data));
+   short_kek = mongocrypt_binary_new_from_data (kek_data, 32);
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   _add_to_cache (tester, ctx, TMP_BSON ("{'_id': 0, 'keyAltNames': ['a']}"));
+   _add_to_cache (tester, ctx, TMP_BSON ("{'_id': 1}"));
+   mongocrypt_ctx_destroy (ctx);
+
+   exported = mongocrypt_binary_new ();
+   ASSERT_FAILS (mongocrypt_key_cache_export (crypt, NULL, exported),
+                 crypt,
+                 "invalid NULL kek");
+   ASSERT_FAILS (mongocrypt_key_cache_export (crypt, short_kek, exported),
+                 crypt,
+                 "kek must be 96 bytes");
+   ASSERT_OK (mongocrypt_key_cache_export (crypt, kek, exported), crypt);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (exported, &as_bson));
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, "keys.1.ttlMs", &iter));
+   BSON_ASSERT (bson_iter_int64 (&iter) > 0);
+   BSON_ASSERT (bson_iter_int64 (&iter) <= CACHE_EXPIRATION_MS);
+   mongocrypt_destroy (crypt);
+
+   /* The key material is authenticated, so a wrong kek is detected. */
+   restarted = _mongocrypt_tester_mongocrypt ();
+   ASSERT_FAILS (mongocrypt_key_cache_import (restarted, wrong_kek, exported),
+                 restarted,
+                 "HMAC validation failure");
+   /* So is a change to the key document or the TTL. */
+   for (i = 0; i < 2; i++) {
+      _tamper_exported_key (exported, tampered_fields[i], &tampered);
+      tampered_bin = mongocrypt_binary_new_from_data (
+         (uint8_t *) bson_get_data (&tampered), tampered.len);
+      ASSERT_FAILS (
+         mongocrypt_key_cache_import (restarted, kek, tampered_bin),
+         restarted,
+         "HMAC validation failure");
+      mongocrypt_binary_destroy (tampered_bin);
+      bson_destroy (&tampered);
+   }
+   /* Version 1 exports did not authenticate the key document or TTL. */
+   ASSERT_FAILS (mongocrypt_key_cache_import (
+                    restarted, kek, TEST_BSON ("{'v': 1, 'keys': []}")),
+                 restarted,
+                 "unsupported key cache export version");
+   ASSERT_OK (mongocrypt_key_cache_import (restarted, kek, exported),
+              restarted);
+   ASSERT_OK (mongocrypt_key_cache_foreach (
+                 restarted, _key_cache_foreach_visit, &test),
+              restarted);
+   BSON_ASSERT (test.calls == 2);
+
+   /* Keys are found by keyAltName, with their decrypted key material. */
+   alt_name = _MONGOCRYPT_KEY_ALT_NAME_CREATE ("a");
+   attr = _mongocrypt_cache_key_attr_new (NULL, alt_name);
+   BSON_ASSERT (
+      _mongocrypt_cache_get (restarted->cache_key, attr, (void **) &value));
+   BSON_ASSERT (value);
+   BSON_ASSERT (value->decrypted_key_material.len == MONGOCRYPT_KEY_LEN);
+   BSON_ASSERT (0 == value->decrypted_key_material.data[0]);
+   /* Entries only keep what decryption needs, and the BSON to export. */
+   BSON_ASSERT (_mongocrypt_buffer_empty (&value->key_doc->key_material));
+   BSON_ASSERT (value->key_doc->kek.kms_provider ==
+                MONGOCRYPT_KMS_PROVIDER_NONE);
+   BSON_ASSERT (!bson_empty (&value->key_doc->bson));
+   _mongocrypt_cache_key_value_destroy (value);
+   _mongocrypt_cache_key_attr_destroy (attr);
+   _mongocrypt_key_alt_name_destroy_all (alt_name);
+
+   mongocrypt_destroy (restarted);
+   mongocrypt_binary_destroy (exported);
+   mongocrypt_binary_destroy (short_kek);
+   mongocrypt_binary_destroy (wrong_kek);
+   mongocrypt_binary_destroy (kek);
+}
+
+
+#define BACKEND_MAX_ENTRIES 8
+
+/* A key cache backend shared by several mongocrypt_t, in place of shared
+ * memory. */
+typedef struct {
+   _mongocrypt_buffer_t names[BACKEND_MAX_ENTRIES];
+   _mongocrypt_buffer_t entries[BACKEND_MAX_ENTRIES];
+   uint32_t num_entries;
+   uint32_t gets;
+   uint32_t hits;
+   uint32_t puts;
+   uint32_t evictions;
+} _test_backend_t;
+
+
+static int
+_backend_find (_test_backend_t *backend, mongocrypt_binary_t *name)
+{
+   _mongocrypt_buffer_t name_buf;
+   uint32_t i;
+
+   _mongocrypt_buffer_from_binary (&name_buf, name);
+   for (i = 0; i < backend->num_entries; i++) {
+      if (0 == _mongocrypt_buffer_cmp (&backend->names[i], &name_buf)) {
+         return (int) i;
+      }
+   }
+   return -1;
+}
+
+
+static bool
+_backend_get (void *ctx,
+              mongocrypt_binary_t *name,
+              mongocrypt_binary_t *out,
+              uint32_t *bytes_written,
+              mongocrypt_status_t *status)
+{
+   _test_backend_t *backend = (_test_backend_t *) ctx;
+   int i;
+
+   backend->gets++;
+   *bytes_written = 0;
+   i = _backend_find (backend, name);
+   if (i >= 0) {
+      BSON_ASSERT (backend->entries[i].len <= mongocrypt_binary_len (out));
+      memcpy (mongocrypt_binary_data (out),
+              backend->entries[i].data,
+              backend->entries[i].len);
+      *bytes_written = backend->entries[i].len;
+      backend->hits++;
+   }
+   return true;
+}
+
+
+static bool
+_backend_put (void *ctx,
+              mongocrypt_binary_t *name,
+              mongocrypt_binary_t *entry,
+              mongocrypt_status_t *status)
+{
+   _test_backend_t *backend = (_test_backend_t *) ctx;
+   int i;
+
+   backend->puts++;
+   i = _backend_find (backend, name);
+   if (i < 0) {
+      BSON_ASSERT (backend->num_entries < BACKEND_MAX_ENTRIES);
+      i = (int) backend->num_entries++;
+      _mongocrypt_buffer_copy_from_binary (&backend->names[i], name);
+   } else {
+      _mongocrypt_buffer_cleanup (&backend->entries[i]);
+   }
+   _mongocrypt_buffer_copy_from_binary (&backend->entries[i], entry);
+   return true;
+}
+
+
+static bool
+_backend_evict (void *ctx,
+                mongocrypt_binary_t *name,
+                mongocrypt_status_t *status)
+{
+   _test_backend_t *backend = (_test_backend_t *) ctx;
+   int i;
+
+   backend->evictions++;
+   i = _backend_find (backend, name);
+   if (i >= 0) {
+      _mongocrypt_buffer_cleanup (&backend->names[i]);
+      _mongocrypt_buffer_cleanup (&backend->entries[i]);
+      backend->num_entries--;
+      backend->names[i] = backend->names[backend->num_entries];
+      backend->entries[i] = backend->entries[backend->num_entries];
+   }
+   return true;
+}
+
+
+static mongocrypt_t *
+_backend_mongocrypt (_test_backend_t *backend,
+                     uint8_t secret_byte,
+                     mongocrypt_key_cache_evict_fn evict)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_binary_t *secret;
+   uint8_t secret_data[MONGOCRYPT_KEY_LEN];
+
+   memset (secret_data, secret_byte, sizeof (secret_data));
+   secret = mongocrypt_binary_new_from_data (secret_data, sizeof (secret_data));
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_key_cache_backend (
+                 crypt, _backend_get, _backend_put, secret, backend),
+              crypt);
+   if (evict) {
+      ASSERT_OK (mongocrypt_setopt_key_cache_backend_evict (crypt, evict),
+                 crypt);
+   }
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   mongocrypt_binary_destroy (secret);
+   return crypt;
+}
+
+
+/* Run cmd.json until the markings are needed. Feeding them requests the
+ * key. */
+static mongocrypt_ctx_t *
+_backend_ctx (_mongocrypt_tester_t *tester, mongocrypt_t *crypt)
+{
+   mongocrypt_ctx_t *ctx;
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (
+      tester, ctx, MONGOCRYPT_CTX_NEED_MONGO_MARKINGS);
+   return ctx;
+}
+
+
+static void
+_test_key_cache_backend (_mongocrypt_tester_t *tester)
+{
+   _test_backend_t backend = {{{0}}};
+   mongocrypt_t *crypt, *worker;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *secret;
+   uint8_t secret_data[32] = {0};
+   uint32_t i;
+
+   crypt = mongocrypt_new ();
+   secret = mongocrypt_binary_new_from_data (secret_data, sizeof (secret_data));
+   ASSERT_FAILS (mongocrypt_setopt_key_cache_backend (
+                    crypt, NULL, _backend_put, secret, &backend),
+                 crypt,
+                 "invalid NULL key cache callback");
+   ASSERT_FAILS (mongocrypt_setopt_key_cache_backend (
+                    crypt, _backend_get, _backend_put, secret, &backend),
+                 crypt,
+                 "secret must be 96 bytes");
+   mongocrypt_binary_destroy (secret);
+   mongocrypt_destroy (crypt);
+
+   /* The first worker decrypts the key with KMS and shares it. */
+   crypt = _backend_mongocrypt (&backend, 1, NULL);
+   ctx = _backend_ctx (tester, crypt);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+   BSON_ASSERT (backend.gets == 1);
+   BSON_ASSERT (backend.hits == 0);
+   BSON_ASSERT (backend.puts >= 1);
+   mongocrypt_destroy (crypt);
+
+   /* Another worker with the same secret skips the key vault and KMS. */
+   worker = _backend_mongocrypt (&backend, 1, NULL);
+   ctx = _backend_ctx (tester, worker);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   mongocrypt_ctx_destroy (ctx);
+   BSON_ASSERT (backend.hits == 1);
+   BSON_ASSERT (1 == _mongocrypt_cache_num_entries (worker->cache_key));
+   mongocrypt_destroy (worker);
+
+   /* A worker with another secret cannot read the shared key, and fetches
+    * it instead. */
+   worker = _backend_mongocrypt (&backend, 2, NULL);
+   ctx = _backend_ctx (tester, worker);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   BSON_ASSERT (worker->stats.key_backend.hits == 0);
+   BSON_ASSERT (worker->stats.key_backend.misses == 1);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (worker);
+
+   for (i = 0; i < backend.num_entries; i++) {
+      _mongocrypt_buffer_cleanup (&backend.names[i]);
+      _mongocrypt_buffer_cleanup (&backend.entries[i]);
+   }
+}
+
+
+static void
+_test_key_cache_backend_evict (_mongocrypt_tester_t *tester)
+{
+   _test_backend_t backend = {{{0}}};
+   mongocrypt_t *crypt, *worker;
+   mongocrypt_ctx_t *ctx;
+   uint32_t i;
+   bson_t entry, expired;
+
+   crypt = mongocrypt_new ();
+   ASSERT_FAILS (mongocrypt_setopt_key_cache_backend_evict (crypt, NULL),
+                 crypt,
+                 "invalid NULL key cache callback");
+   ASSERT_FAILS (
+      mongocrypt_setopt_key_cache_backend_evict (crypt, _backend_evict),
+      crypt,
+      "mongocrypt_setopt_key_cache_backend must be called first");
+   mongocrypt_destroy (crypt);
+
+   crypt = _backend_mongocrypt (&backend, 1, NULL);
+   ctx = _backend_ctx (tester, crypt);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+   BSON_ASSERT (crypt->stats.key_backend.misses == 1);
+   BSON_ASSERT (crypt->stats.key_backend.puts == backend.puts);
+   mongocrypt_destroy (crypt);
+
+   /* Expire every shared entry. */
+   for (i = 0; i < backend.num_entries; i++) {
+      BSON_ASSERT (_mongocrypt_buffer_to_bson (&backend.entries[i], &entry));
+      bson_init (&expired);
+      bson_copy_to_excluding_noinit (&entry, &expired, "expiresMs", NULL);
+      BSON_APPEND_INT64 (&expired, "expiresMs", 0);
+      _mongocrypt_buffer_cleanup (&backend.entries[i]);
+      _mongocrypt_buffer_steal_from_bson (&backend.entries[i], &expired);
+   }
+
+   /* A worker that reads an expired entry evicts it and fetches the key. */
+   worker = _backend_mongocrypt (&backend, 1, _backend_evict);
+   i = backend.num_entries;
+   ctx = _backend_ctx (tester, worker);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   BSON_ASSERT (backend.evictions == 1);
+   BSON_ASSERT (backend.num_entries == i - 1);
+   BSON_ASSERT (worker->stats.key_backend.hits == 0);
+   BSON_ASSERT (worker->stats.key_backend.misses == 1);
+   BSON_ASSERT (worker->stats.key_backend.evictions == 1);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (worker);
+
+   for (i = 0; i < backend.num_entries; i++) {
+      _mongocrypt_buffer_cleanup (&backend.names[i]);
+      _mongocrypt_buffer_cleanup (&backend.entries[i]);
+   }
+}
+
+
+static void
+_test_key_cache_backend_tamper (_mongocrypt_tester_t *tester)
+{
+   const char *tampered_fields[] = {"keyDocument", "expiresMs"};
+   _test_backend_t backend;
+   mongocrypt_t *crypt, *worker;
+   mongocrypt_ctx_t *ctx;
+   uint32_t i, num_entries;
+   bson_t entry, tampered;
+   int f;
+
+   for (f = 0; f < 2; f++) {
+      memset (&backend, 0, sizeof (backend));
+      crypt = _backend_mongocrypt (&backend, 1, NULL);
+      ctx = _backend_ctx (tester, crypt);
+      ASSERT_OK (
+         mongocrypt_ctx_mongo_feed (
+            ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
+         ctx);
+      ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+      _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+      mongocrypt_ctx_destroy (ctx);
+      mongocrypt_destroy (crypt);
+
+      for (i = 0; i < backend.num_entries; i++) {
+         BSON_ASSERT (
+            _mongocrypt_buffer_to_bson (&backend.entries[i], &entry));
+         _tamper_key_entry (&entry, tampered_fields[f], &tampered);
+         _mongocrypt_buffer_cleanup (&backend.entries[i]);
+         _mongocrypt_buffer_steal_from_bson (&backend.entries[i], &tampered);
+      }
+
+      /* A worker that reads a changed entry evicts it and fetches the key,
+       * rather than trusting the changed field. */
+      worker = _backend_mongocrypt (&backend, 1, _backend_evict);
+      num_entries = backend.num_entries;
+      ctx = _backend_ctx (tester, worker);
+      ASSERT_OK (
+         mongocrypt_ctx_mongo_feed (
+            ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
+         ctx);
+      ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+      BSON_ASSERT (mongocrypt_ctx_state (ctx) ==
+                   MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+      BSON_ASSERT (backend.num_entries == num_entries - 1);
+      BSON_ASSERT (worker->stats.key_backend.hits == 0);
+      BSON_ASSERT (worker->stats.key_backend.misses == 1);
+      BSON_ASSERT (worker->stats.key_backend.evictions == 1);
+      BSON_ASSERT (0 == _mongocrypt_cache_num_entries (worker->cache_key));
+      mongocrypt_ctx_destroy (ctx);
+      mongocrypt_destroy (worker);
+
+      for (i = 0; i < backend.num_entries; i++) {
+         _mongocrypt_buffer_cleanup (&backend.names[i]);
+         _mongocrypt_buffer_cleanup (&backend.entries[i]);
+      }
+   }
+}
+
+
+static bool
+_key_cached (mongocrypt_t *crypt, uint32_t index)
+{
+   _mongocrypt_buffer_t key_id;
+   _mongocrypt_cache_key_attr_t *attr;
+   _mongocrypt_cache_key_value_t *value;
+
+   lookup_key_id (index, &key_id);
+   attr = _mongocrypt_cache_key_attr_new (&key_id, NULL);
+   BSON_ASSERT (
+      _mongocrypt_cache_get (crypt->cache_key, attr, (void **) &value));
+   _mongocrypt_cache_key_attr_destroy (attr);
+   _mongocrypt_buffer_cleanup (&key_id);
+   if (!value) {
+      return false;
+   }
+   _mongocrypt_cache_key_value_destroy (value);
+   return true;
+}
+
+
+static void
+_test_key_cache_invalidate (_mongocrypt_tester_t *tester)
+{
+   _test_backend_t backend = {{{0}}};
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *key_id_bin;
+   _mongocrypt_buffer_t key_id;
+   _mongocrypt_cache_key_value_t *value;
+   uint8_t short_id[3] = {0};
+
+   crypt = mongocrypt_new ();
+   lookup_key_id (0, &key_id);
+   key_id_bin = mongocrypt_binary_new_from_data (key_id.data, key_id.len);
+   ASSERT_FAILS (mongocrypt_key_cache_invalidate (crypt, key_id_bin),
+                 crypt,
+                 "mongocrypt_init must be called first");
+   mongocrypt_destroy (crypt);
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   _add_to_cache (tester, ctx, TMP_BSON ("{'_id': 0, 'keyAltNames': ['a']}"));
+   _add_to_cache (tester, ctx, TMP_BSON ("{'_id': 1}"));
+
+   /* Removing by _id leaves other keys. */
+   ASSERT_OK (mongocrypt_key_cache_invalidate (crypt, key_id_bin), crypt);
+   BSON_ASSERT (!_key_cached (crypt, 0));
+   BSON_ASSERT (_key_cached (crypt, 1));
+   /* Removing a key that is not cached is not an error. */
+   ASSERT_OK (mongocrypt_key_cache_invalidate (crypt, key_id_bin), crypt);
+
+   /* Remove by keyAltName. */
+   _add_to_cache (tester, ctx, TMP_BSON ("{'_id': 0, 'keyAltNames': ['a']}"));
+   BSON_ASSERT (_key_cached (crypt, 0));
+   ASSERT_OK (mongocrypt_key_cache_invalidate_alt_name (
+                 crypt, TEST_BSON ("{'keyAltName': 'a'}")),
+              crypt);
+   BSON_ASSERT (!_key_cached (crypt, 0));
+   BSON_ASSERT (_mongocrypt_cache_num_entries (crypt->cache_key) == 1);
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (key_id_bin);
+   key_id_bin = mongocrypt_binary_new_from_data (short_id, sizeof (short_id));
+   ASSERT_FAILS (mongocrypt_key_cache_invalidate (crypt, key_id_bin),
+                 crypt,
+                 "invalid key_id");
+   ASSERT_FAILS (mongocrypt_key_cache_invalidate_alt_name (
+                    crypt, TEST_BSON ("{'keyAltName': 1}")),
+                 crypt,
+                 "keyAltName must have UTF8 field");
+   mongocrypt_binary_destroy (key_id_bin);
+   _mongocrypt_buffer_cleanup (&key_id);
+   mongocrypt_destroy (crypt);
+
+   /* The entries of the key in the backend store are evicted. */
+   crypt = _backend_mongocrypt (&backend, 1, _backend_evict);
+   ctx = _backend_ctx (tester, crypt);
+   ASSERT_OK (mongocrypt_ctx_mongo_feed (
+                 ctx, TEST_FILE ("./test/example/mongocryptd-reply.json")),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_mongo_done (ctx), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+   BSON_ASSERT (backend.num_entries > 0);
+   BSON_ASSERT (_mongocrypt_cache_num_entries (crypt->cache_key) == 1);
+   value = (_mongocrypt_cache_key_value_t *) crypt->cache_key->pair->value;
+   key_id_bin = mongocrypt_binary_new_from_data (value->key_doc->id.data,
+                                                 value->key_doc->id.len);
+   ASSERT_OK (mongocrypt_key_cache_invalidate (crypt, key_id_bin), crypt);
+   BSON_ASSERT (_mongocrypt_cache_num_entries (crypt->cache_key) == 0);
+   BSON_ASSERT (backend.num_entries == 0);
+   mongocrypt_binary_destroy (key_id_bin);
+   mongocrypt_destroy (crypt);
+}
+
+
+static mongocrypt_ctx_state_t
+_decrypt_state (mongocrypt_t *crypt, mongocrypt_binary_t *cmd)
+{
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_ctx_state_t state;
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, cmd), ctx);
+   state = mongocrypt_ctx_state (ctx);
+   mongocrypt_ctx_destroy (ctx);
+   return state;
+}
+
+
+static void
+_test_key_cache_per_thread (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *cmd;
+   _mongocrypt_cache_key_attr_t *attr, *cached_attr;
+   _mongocrypt_cache_key_value_t *value;
+
+   cmd = TEST_FILE ("./test/data/encrypted-cmd.json");
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_key_cache_per_thread (crypt, true), crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   ASSERT_FAILS (mongocrypt_setopt_key_cache_per_thread (crypt, true),
+                 crypt,
+                 "options cannot be set after initialization");
+   BSON_ASSERT (crypt->key_l1);
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, cmd), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+   BSON_ASSERT (crypt->cache_key->hits == 0);
+
+   /* The first hit goes to the shared cache, later ones stay in the thread's
+    * cache. */
+   BSON_ASSERT (_decrypt_state (crypt, cmd) == MONGOCRYPT_CTX_READY);
+   BSON_ASSERT (crypt->cache_key->hits == 1);
+   BSON_ASSERT (_decrypt_state (crypt, cmd) == MONGOCRYPT_CTX_READY);
+   BSON_ASSERT (_decrypt_state (crypt, cmd) == MONGOCRYPT_CTX_READY);
+   BSON_ASSERT (crypt->cache_key->hits == 1);
+
+   /* Replacing the key in the shared cache invalidates the copy. */
+   cached_attr = (_mongocrypt_cache_key_attr_t *) crypt->cache_key->pair->attr;
+   attr = _mongocrypt_cache_key_attr_new (&cached_attr->id, NULL);
+   BSON_ASSERT (
+      _mongocrypt_cache_get (crypt->cache_key, attr, (void **) &value));
+   BSON_ASSERT (value);
+   ASSERT_OK_STATUS (_mongocrypt_cache_add_stolen (
+                        crypt->cache_key, attr, value, crypt->status),
+                     crypt->status);
+   BSON_ASSERT (crypt->cache_key->hits == 2);
+   BSON_ASSERT (_decrypt_state (crypt, cmd) == MONGOCRYPT_CTX_READY);
+   BSON_ASSERT (crypt->cache_key->hits == 3);
+   BSON_ASSERT (_decrypt_state (crypt, cmd) == MONGOCRYPT_CTX_READY);
+   BSON_ASSERT (crypt->cache_key->hits == 3);
+
+#ifdef BSON_OS_UNIX
+   {
+      _key_fetch_waiter_t waiter;
+      pthread_t thread;
+
+      /* Another thread has its own cache, so it starts with a shared hit. */
+      waiter.crypt = crypt;
+      waiter.cmd = cmd;
+      waiter.state = MONGOCRYPT_CTX_ERROR;
+      BSON_ASSERT (
+         0 == pthread_create (&thread, NULL, _key_fetch_waiter_run, &waiter));
+      BSON_ASSERT (0 == pthread_join (thread, NULL));
+      BSON_ASSERT (waiter.state == MONGOCRYPT_CTX_READY);
+      BSON_ASSERT (crypt->cache_key->hits == 4);
+   }
+#endif
+
+   _mongocrypt_cache_key_attr_destroy (attr);
+   mongocrypt_destroy (crypt);
+}
+
+
+static mongocrypt_t *
+_shared_cache_mongocrypt (mongocrypt_shared_cache_t *shared)
+{
+   mongocrypt_t *crypt;
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_shared_cache (crypt, shared), crypt);
+   return crypt;
+}
+
+
+static void
+_test_key_cache_shared (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_shared_cache_t *shared;
+   mongocrypt_t *crypt, *crypt2;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *cmd;
+
+   cmd = TEST_FILE ("./test/data/encrypted-cmd.json");
+   shared = mongocrypt_shared_cache_new ();
+   crypt = _shared_cache_mongocrypt (shared);
+   ASSERT_FAILS (mongocrypt_setopt_shared_cache (crypt, NULL),
+                 crypt,
+                 "invalid NULL shared cache");
+   mongocrypt_destroy (crypt);
+
+   crypt = _shared_cache_mongocrypt (shared);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   crypt2 = _shared_cache_mongocrypt (shared);
+   /* Cache options set on one handle apply to all of them. */
+   ASSERT_OK (mongocrypt_setopt_key_cache_ttl (crypt2, 1234), crypt2);
+   ASSERT_OK (mongocrypt_init (crypt2), crypt2);
+   ASSERT_FAILS (mongocrypt_setopt_shared_cache (crypt2, shared),
+                 crypt2,
+                 "options cannot be set after initialization");
+   BSON_ASSERT (crypt->cache_key == crypt2->cache_key);
+   BSON_ASSERT (crypt->cache_key->expiration == 1234);
+   BSON_ASSERT (crypt->cache_oauth_azure == crypt2->cache_oauth_azure);
+   /* The handles keep the caches alive. */
+   mongocrypt_shared_cache_destroy (shared);
+
+   /* A key decrypted by one handle is used by the other. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, cmd), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_NEED_MONGO_KEYS);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+   mongocrypt_destroy (crypt);
+
+   ctx = mongocrypt_ctx_new (crypt2);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, cmd), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+   BSON_ASSERT (1 == _mongocrypt_cache_num_entries (crypt2->cache_key));
+   mongocrypt_destroy (crypt2);
+}
+
+
+static void
+_test_key_cache_after_fork (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx, *in_flight;
+   mongocrypt_binary_t *cmd;
+
+   cmd = TEST_FILE ("./test/data/encrypted-cmd.json");
+   crypt = mongocrypt_new ();
+   ASSERT_FAILS (mongocrypt_after_fork_child (crypt),
+                 crypt,
+                 "mongocrypt_init must be called first");
+   mongocrypt_destroy (crypt);
+
+   /* Warm the key cache. */
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, cmd), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_DONE);
+   mongocrypt_ctx_destroy (ctx);
+   in_flight = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (in_flight, cmd), in_flight);
+
+#ifdef BSON_OS_UNIX
+   {
+      pid_t pid;
+      int wstatus;
+
+      pid = fork ();
+      BSON_ASSERT (pid >= 0);
+      if (pid == 0) {
+         /* The child starts warm. Exit without running atexit handlers of
+          * the test runner. */
+         _exit (mongocrypt_after_fork_child (crypt) &&
+                      _decrypt_state (crypt, cmd) == MONGOCRYPT_CTX_READY &&
+                      mongocrypt_ctx_state (in_flight) == MONGOCRYPT_CTX_ERROR
+                   ? 0
+                   : 1);
+      }
+      BSON_ASSERT (pid == waitpid (pid, &wstatus, 0));
+      BSON_ASSERT (WIFEXITED (wstatus) && WEXITSTATUS (wstatus) == 0);
+   }
+#endif
+
+   /* The parent is unaffected by the fork. */
+   BSON_ASSERT (mongocrypt_ctx_state (in_flight) == MONGOCRYPT_CTX_READY);
+
+   /* Contexts created before the call fail. The caches stay warm. */
+   ASSERT_OK (mongocrypt_after_fork_child (crypt), crypt);
+   BSON_ASSERT (mongocrypt_ctx_state (in_flight) == MONGOCRYPT_CTX_ERROR);
+   ASSERT_FAILS (mongocrypt_ctx_finalize (in_flight, NULL),
+                 in_flight,
+                 "created before the process forked");
+   mongocrypt_ctx_destroy (in_flight);
+   BSON_ASSERT (_decrypt_state (crypt, cmd) == MONGOCRYPT_CTX_READY);
+   mongocrypt_destroy (crypt);
+}
+
+
 void
 _mongocrypt_tester_install_key_cache (_mongocrypt_tester_t *tester)
 {
    INSTALL_TEST (_test_key_cache);
+   INSTALL_TEST (_test_key_cache_refresh);
+   INSTALL_TEST (_test_key_cache_prefetch);
+   INSTALL_TEST (_test_key_cache_fetch_wait);
+#ifdef BSON_OS_UNIX
+   INSTALL_TEST (_test_key_cache_fetch_batch);
+#endif
+   INSTALL_TEST (_test_key_cache_foreach);
+   INSTALL_TEST (_test_key_cache_export_import);
+   INSTALL_TEST (_test_key_cache_backend);
+   INSTALL_TEST (_test_key_cache_backend_evict);
+   INSTALL_TEST (_test_key_cache_backend_tamper);
+   INSTALL_TEST (_test_key_cache_invalidate);
+   INSTALL_TEST (_test_key_cache_per_thread);
+   INSTALL_TEST (_test_key_cache_shared);
+   INSTALL_TEST (_test_key_cache_after_fork);
 }
\ No newline at end of file
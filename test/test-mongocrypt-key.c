@@ -270,13 +270,51 @@ test_mongocrypt_key_alt_name_from_iter (_mongocrypt_tester_t *tester)
       status,
       "duplicate");
 
+   /* Duplicate alt names in a long list */
+   test = TMP_BSON ("{'test': ['a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', "
+                    "'j', 'c']}");
+   bson_iter_init_find (&iter, test, "test");
+   ASSERT_FAILS_STATUS (
+      _mongocrypt_key_alt_name_from_iter (&iter, &key_alt_names, status),
+      status,
+      "duplicate");
+
    mongocrypt_status_destroy (status);
 }
 
+/* Long lists are compared by sorting them. */
+static void
+test_mongocrypt_key_alt_name_long_lists (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_key_alt_name_t *a, *b, *c, *one;
+
+   a = _MONGOCRYPT_KEY_ALT_NAME_CREATE (
+      "a", "b", "c", "d", "e", "f", "g", "h", "i", "j");
+   b = _MONGOCRYPT_KEY_ALT_NAME_CREATE (
+      "j", "i", "h", "g", "f", "e", "d", "c", "b", "a");
+   c = _MONGOCRYPT_KEY_ALT_NAME_CREATE (
+      "k", "l", "m", "n", "o", "p", "q", "r", "s", "t");
+   one = _MONGOCRYPT_KEY_ALT_NAME_CREATE ("t");
+
+   BSON_ASSERT (_mongocrypt_key_alt_name_intersects (a, b));
+   BSON_ASSERT (!_mongocrypt_key_alt_name_intersects (a, c));
+   BSON_ASSERT (_mongocrypt_key_alt_name_intersects (c, one));
+   BSON_ASSERT (_mongocrypt_key_alt_name_intersects (one, c));
+   BSON_ASSERT (!_mongocrypt_key_alt_name_intersects (a, one));
+   BSON_ASSERT (_mongocrypt_key_alt_name_unique_list_equal (a, b));
+   BSON_ASSERT (!_mongocrypt_key_alt_name_unique_list_equal (a, c));
+
+   _mongocrypt_key_alt_name_destroy_all (a);
+   _mongocrypt_key_alt_name_destroy_all (b);
+   _mongocrypt_key_alt_name_destroy_all (c);
+   _mongocrypt_key_alt_name_destroy_all (one);
+}
+
 
 void
 _mongocrypt_tester_install_key (_mongocrypt_tester_t *tester)
 {
    INSTALL_TEST (test_mongocrypt_key_parsing);
    INSTALL_TEST (test_mongocrypt_key_alt_name_from_iter);
+   INSTALL_TEST (test_mongocrypt_key_alt_name_long_lists);
 }
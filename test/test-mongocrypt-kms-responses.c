@@ -16,6 +16,7 @@
 
 #include <mongocrypt.h>
 
+#include "mongocrypt-json-private.h"
 #include "mongocrypt-private.h"
 #include "test-mongocrypt.h"
 #include "test-conveniences.h"
@@ -153,8 +154,265 @@ _test_kms_responses (_mongocrypt_tester_t *tester)
    bson_destroy (&test_file);
 }
 
+static bool
+_find_string (const char *json, const char *field, const char *expect)
+{
+   const char *value;
+   size_t value_len;
+
+   if (!_mongocrypt_json_find_string (
+          json, strlen (json), field, &value, &value_len)) {
+      return false;
+   }
+   BSON_ASSERT (value_len == strlen (expect));
+   BSON_ASSERT (0 == memcmp (value, expect, value_len));
+   return true;
+}
+
+static bool
+_find_int64 (const char *json, int64_t *value)
+{
+   return _mongocrypt_json_find_int64 (json, strlen (json), "n", value);
+}
+
+static void
+_test_kms_json (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_buffer_t buf;
+   int64_t n;
+
+   BSON_ASSERT (_find_string ("{\"a\": \"b\"}", "a", "b"));
+   BSON_ASSERT (_find_string (
+      " { \"x\": [1, {\"a\": \"c\"}], \"a\" : \"b\", \"y\": null }\n",
+      "a",
+      "b"));
+   /* Nested fields are not top level. */
+   BSON_ASSERT (!_find_string ("{\"x\": {\"a\": \"b\"}}", "a", ""));
+   /* Escapes, non-strings, and malformed JSON are left to the full parser. */
+   BSON_ASSERT (!_find_string ("{\"a\": \"b\\/\"}", "a", ""));
+   BSON_ASSERT (!_find_string ("{\"a\": 1}", "a", ""));
+   BSON_ASSERT (!_find_string ("{\"a\": \"b\"", "a", ""));
+   BSON_ASSERT (!_find_string ("{\"a\": \"b\"} x", "a", ""));
+   BSON_ASSERT (!_find_string ("[\"a\"]", "a", ""));
+
+   BSON_ASSERT (_find_int64 ("{\"n\": 3599}", &n));
+   BSON_ASSERT (n == 3599);
+   BSON_ASSERT (!_find_int64 ("{\"n\": 1.5}", &n));
+   BSON_ASSERT (!_find_int64 ("{\"n\": \"1\"}", &n));
+
+   _mongocrypt_buffer_init (&buf);
+   BSON_ASSERT (_mongocrypt_json_b64_decode ("AQID", 4, false, &buf));
+   BSON_ASSERT (buf.len == 3);
+   BSON_ASSERT (0 == memcmp (buf.data, "\x01\x02\x03", 3));
+   BSON_ASSERT (_mongocrypt_json_b64_decode ("-_8=", 4, true, &buf));
+   BSON_ASSERT (buf.len == 2);
+   BSON_ASSERT (0 == memcmp (buf.data, "\xfb\xff", 2));
+   BSON_ASSERT (!_mongocrypt_json_b64_decode ("-_8=", 4, false, &buf));
+   BSON_ASSERT (!_mongocrypt_json_b64_decode ("AQIDB", 5, false, &buf));
+   _mongocrypt_buffer_cleanup (&buf);
+}
+
+/* Feed @reply to @kms. */
+static bool
+_feed_reply (mongocrypt_kms_ctx_t *kms, const char *reply)
+{
+   mongocrypt_binary_t *bin;
+   bool ret;
+
+   bin = mongocrypt_binary_new_from_data ((uint8_t *) reply,
+                                          (uint32_t) strlen (reply));
+   ret = mongocrypt_kms_ctx_feed (kms, bin);
+   mongocrypt_binary_destroy (bin);
+   return ret;
+}
+
+/* Create an AWS data key context in the NEED_KMS state. */
+static mongocrypt_ctx_t *
+_aws_datakey_ctx (mongocrypt_t *crypt, mongocrypt_kms_ctx_t **kms)
+{
+   mongocrypt_ctx_t *ctx;
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (
+      mongocrypt_ctx_setopt_masterkey_aws (ctx, "region", -1, "cmk", -1), ctx);
+   ASSERT_OK (mongocrypt_ctx_datakey_init (ctx), ctx);
+   *kms = mongocrypt_ctx_next_kms_ctx (ctx);
+   BSON_ASSERT (*kms);
+   return ctx;
+}
+
+static void
+_test_kms_retry (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_kms_ctx_t *kms;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+
+   /* A 5xx response may be retried without restarting the context. */
+   ctx = _aws_datakey_ctx (crypt, &kms);
+   BSON_ASSERT (mongocrypt_kms_ctx_failure (kms) ==
+                MONGOCRYPT_KMS_FAILURE_NONE);
+   BSON_ASSERT (!_feed_reply (
+      kms, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n"));
+   BSON_ASSERT (mongocrypt_kms_ctx_failure (kms) ==
+                MONGOCRYPT_KMS_FAILURE_SERVER);
+   BSON_ASSERT (mongocrypt_kms_ctx_retry (kms));
+   BSON_ASSERT (mongocrypt_kms_ctx_failure (kms) ==
+                MONGOCRYPT_KMS_FAILURE_NONE);
+   BSON_ASSERT (mongocrypt_kms_ctx_bytes_needed (kms) > 0);
+   ASSERT_OK (mongocrypt_kms_ctx_feed (
+                 kms, TEST_FILE ("./test/data/kms-encrypt-reply.txt")),
+              kms);
+   ASSERT_OK (mongocrypt_ctx_kms_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* AWS reports throttling as HTTP 400. */
+   ctx = _aws_datakey_ctx (crypt, &kms);
+   BSON_ASSERT (!_feed_reply (kms,
+                              "HTTP/1.1 400 Bad Request\r\n"
+                              "Content-Length: 58\r\n\r\n"
+                              "{\"__type\":\"ThrottlingException\","
+                              "\"message\":\"Rate exceeded\"}"));
+   BSON_ASSERT (mongocrypt_kms_ctx_failure (kms) ==
+                MONGOCRYPT_KMS_FAILURE_THROTTLED);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Other client errors are permanent. */
+   ctx = _aws_datakey_ctx (crypt, &kms);
+   BSON_ASSERT (!_feed_reply (kms,
+                              "HTTP/1.1 400 Bad Request\r\n"
+                              "Content-Length: 23\r\n\r\n"
+                              "{\"message\":\"bad input\"}"));
+   BSON_ASSERT (mongocrypt_kms_ctx_failure (kms) ==
+                MONGOCRYPT_KMS_FAILURE_PERMANENT);
+   BSON_ASSERT (!mongocrypt_kms_ctx_retry (kms));
+   mongocrypt_ctx_destroy (ctx);
+
+   /* A response that is not HTTP. */
+   ctx = _aws_datakey_ctx (crypt, &kms);
+   BSON_ASSERT (!_feed_reply (kms, "garbage\r\n"));
+   BSON_ASSERT (mongocrypt_kms_ctx_failure (kms) ==
+                MONGOCRYPT_KMS_FAILURE_NETWORK);
+   BSON_ASSERT (mongocrypt_kms_ctx_retry (kms));
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_destroy (crypt);
+}
+
+static void
+_test_kms_hedge (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_kms_ctx_t *kms, *hedge;
+   mongocrypt_binary_t *msg, *hedge_msg;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   msg = mongocrypt_binary_new ();
+   hedge_msg = mongocrypt_binary_new ();
+
+   /* The hedge sends the same message, and its response wins. */
+   ctx = _aws_datakey_ctx (crypt, &kms);
+   hedge = mongocrypt_kms_ctx_hedge (kms);
+   BSON_ASSERT (hedge);
+   BSON_ASSERT (hedge == mongocrypt_kms_ctx_hedge (kms));
+   BSON_ASSERT (!mongocrypt_kms_ctx_hedge (hedge));
+   ASSERT_OK (mongocrypt_kms_ctx_message (kms, msg), kms);
+   ASSERT_OK (mongocrypt_kms_ctx_message (hedge, hedge_msg), hedge);
+   BSON_ASSERT (msg->len == hedge_msg->len);
+   BSON_ASSERT (0 == memcmp (msg->data, hedge_msg->data, msg->len));
+   BSON_ASSERT (!_feed_reply (kms, "garbage\r\n"));
+   ASSERT_OK (mongocrypt_kms_ctx_feed (
+                 hedge, TEST_FILE ("./test/data/kms-encrypt-reply.txt")),
+              hedge);
+   BSON_ASSERT (0 == mongocrypt_kms_ctx_bytes_needed (kms));
+   ASSERT_OK (mongocrypt_ctx_kms_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* The original wins, and bytes fed to the hedge are discarded. */
+   ctx = _aws_datakey_ctx (crypt, &kms);
+   hedge = mongocrypt_kms_ctx_hedge (kms);
+   BSON_ASSERT (hedge);
+   ASSERT_OK (mongocrypt_kms_ctx_feed (
+                 kms, TEST_FILE ("./test/data/kms-encrypt-reply.txt")),
+              kms);
+   BSON_ASSERT (0 == mongocrypt_kms_ctx_bytes_needed (hedge));
+   ASSERT_OK (_feed_reply (hedge, "HTTP/1.1 500 Internal Server Error\r\n"),
+              hedge);
+   ASSERT_OK (mongocrypt_ctx_kms_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (hedge_msg);
+   mongocrypt_binary_destroy (msg);
+   mongocrypt_destroy (crypt);
+}
+
+/* Read the response into the space reserved by the KMS context. */
+static void
+_test_kms_reserve_read (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_kms_ctx_t *kms;
+   mongocrypt_binary_t *reply;
+   uint32_t offset = 0;
+   uint32_t len;
+   uint8_t *buf;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   reply = TEST_FILE ("./test/data/kms-encrypt-reply.txt");
+
+   ctx = _aws_datakey_ctx (crypt, &kms);
+   for (;;) {
+      ASSERT_OK (mongocrypt_kms_ctx_reserve_read (kms, &buf, &len), kms);
+      BSON_ASSERT (len == mongocrypt_kms_ctx_bytes_needed (kms));
+      if (len == 0) {
+         break;
+      }
+      BSON_ASSERT (buf);
+      if (len > reply->len - offset) {
+         len = reply->len - offset;
+      }
+      memcpy (buf, reply->data + offset, len);
+      offset += len;
+      ASSERT_OK (mongocrypt_kms_ctx_commit_read (kms, len), kms);
+   }
+   BSON_ASSERT (offset == reply->len);
+   ASSERT_OK (mongocrypt_ctx_kms_done (ctx), ctx);
+   BSON_ASSERT (mongocrypt_ctx_state (ctx) == MONGOCRYPT_CTX_READY);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Committing more than was reserved is an error. */
+   ctx = _aws_datakey_ctx (crypt, &kms);
+   ASSERT_OK (mongocrypt_kms_ctx_reserve_read (kms, &buf, &len), kms);
+   ASSERT_FAILS (mongocrypt_kms_ctx_commit_read (kms, len + 1),
+                 kms,
+                 "KMS response committed more than was reserved");
+   mongocrypt_ctx_destroy (ctx);
+
+   /* A feed drops the reserved space. */
+   ctx = _aws_datakey_ctx (crypt, &kms);
+   ASSERT_OK (mongocrypt_kms_ctx_reserve_read (kms, &buf, &len), kms);
+   ASSERT_OK (_feed_reply (kms, "HTTP/1.1 200 OK\r\n"), kms);
+   ASSERT_FAILS (mongocrypt_kms_ctx_commit_read (kms, 1),
+                 kms,
+                 "KMS response committed more than was reserved");
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_destroy (crypt);
+}
+
 void
 _mongocrypt_tester_install_kms_responses (_mongocrypt_tester_t *tester)
 {
    INSTALL_TEST (_test_kms_responses);
+   INSTALL_TEST (_test_kms_json);
+   INSTALL_TEST (_test_kms_retry);
+   INSTALL_TEST (_test_kms_hedge);
+   INSTALL_TEST (_test_kms_reserve_read);
 }
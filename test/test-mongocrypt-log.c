@@ -23,6 +23,7 @@
 typedef struct {
    char *message;
    mongocrypt_log_level_t expected_level;
+   int count;
 } log_test_ctx_t;
 
 static void
@@ -34,6 +35,7 @@ _test_log_fn (mongocrypt_log_level_t level,
    log_test_ctx_t *ctx = (log_test_ctx_t *) ctx_void;
    BSON_ASSERT (level == ctx->expected_level);
    BSON_ASSERT (0 == strcmp (message, ctx->message));
+   ctx->count++;
 }
 
 /* Test a custom log handler on all log levels except for trace. */
@@ -96,6 +98,107 @@ _test_trace_log (_mongocrypt_tester_t *tester)
    mongocrypt_destroy (crypt);
 }
 
+/* Messages more verbose than the log level are not passed to the handler. */
+static void
+_test_log_level (_mongocrypt_tester_t *tester)
+{
+   log_test_ctx_t log_ctx = {0};
+   mongocrypt_t *crypt;
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (mongocrypt_setopt_log_handler (crypt, _test_log_fn, &log_ctx),
+              crypt);
+   ASSERT_FAILS (
+      mongocrypt_setopt_log_level (crypt, (mongocrypt_log_level_t) 5),
+      crypt,
+      "invalid log level");
+   mongocrypt_destroy (crypt);
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (mongocrypt_setopt_log_handler (crypt, _test_log_fn, &log_ctx),
+              crypt);
+   ASSERT_OK (mongocrypt_setopt_log_level (crypt, MONGOCRYPT_LOG_LEVEL_WARNING),
+              crypt);
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   ASSERT_FAILS (mongocrypt_setopt_log_level (crypt, MONGOCRYPT_LOG_LEVEL_INFO),
+                 crypt,
+                 "options cannot be set after initialization");
+
+   BSON_ASSERT (
+      !MONGOCRYPT_LOG_ENABLED (&crypt->log, MONGOCRYPT_LOG_LEVEL_INFO));
+   BSON_ASSERT (!MONGOCRYPT_LOG_TRACE_ENABLED (&crypt->log));
+   log_ctx.message = "test";
+   log_ctx.expected_level = MONGOCRYPT_LOG_LEVEL_INFO;
+   _mongocrypt_log (&crypt->log, MONGOCRYPT_LOG_LEVEL_INFO, "test");
+   BSON_ASSERT (log_ctx.count == 0);
+
+   BSON_ASSERT (
+      MONGOCRYPT_LOG_ENABLED (&crypt->log, MONGOCRYPT_LOG_LEVEL_WARNING));
+   log_ctx.expected_level = MONGOCRYPT_LOG_LEVEL_WARNING;
+   _mongocrypt_log (&crypt->log, MONGOCRYPT_LOG_LEVEL_WARNING, "test");
+   BSON_ASSERT (log_ctx.count == 1);
+   mongocrypt_destroy (crypt);
+}
+
+/* Buffered messages reach the handler only when drained. */
+static void
+_test_log_buffer (_mongocrypt_tester_t *tester)
+{
+   log_test_ctx_t log_ctx = {0};
+   mongocrypt_t *crypt;
+   int i;
+
+   crypt = mongocrypt_new ();
+   ASSERT_FAILS (mongocrypt_setopt_log_buffer (crypt, 0),
+                 crypt,
+                 "invalid log buffer capacity");
+   ASSERT_FAILS (
+      mongocrypt_setopt_log_buffer (crypt, MONGOCRYPT_LOG_BUFFER_MAX + 1),
+      crypt,
+      "invalid log buffer capacity");
+   /* Rounded up to 4. */
+   ASSERT_OK (mongocrypt_setopt_log_buffer (crypt, 3), crypt);
+   ASSERT_OK (mongocrypt_setopt_log_handler (crypt, _test_log_fn, &log_ctx),
+              crypt);
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   ASSERT_FAILS (mongocrypt_setopt_log_buffer (crypt, 4),
+                 crypt,
+                 "options cannot be set after initialization");
+   BSON_ASSERT (0 == mongocrypt_log_drain (crypt, 10));
+
+   log_ctx.message = "test";
+   log_ctx.expected_level = MONGOCRYPT_LOG_LEVEL_WARNING;
+   for (i = 0; i < 5; i++) {
+      _mongocrypt_log (&crypt->log, MONGOCRYPT_LOG_LEVEL_WARNING, "test");
+   }
+   BSON_ASSERT (log_ctx.count == 0);
+   BSON_ASSERT (mongocrypt_log_dropped (crypt) == 1);
+   BSON_ASSERT (2 == mongocrypt_log_drain (crypt, 2));
+   BSON_ASSERT (log_ctx.count == 2);
+   BSON_ASSERT (2 == mongocrypt_log_drain (crypt, 10));
+   BSON_ASSERT (log_ctx.count == 4);
+   BSON_ASSERT (0 == mongocrypt_log_drain (crypt, 10));
+
+   /* Slots are reused once drained. */
+   for (i = 0; i < 4; i++) {
+      _mongocrypt_log (&crypt->log, MONGOCRYPT_LOG_LEVEL_WARNING, "test");
+   }
+   BSON_ASSERT (mongocrypt_log_dropped (crypt) == 1);
+   BSON_ASSERT (4 == mongocrypt_log_drain (crypt, 10));
+   BSON_ASSERT (log_ctx.count == 8);
+
+   /* Undrained messages are freed with crypt. */
+   _mongocrypt_log (&crypt->log, MONGOCRYPT_LOG_LEVEL_WARNING, "test");
+   mongocrypt_destroy (crypt);
+   BSON_ASSERT (log_ctx.count == 8);
+}
+
 #if defined(__GLIBC__) || defined(__APPLE__)
 static void
 _test_no_log (_mongocrypt_tester_t *tester)
@@ -131,6 +234,8 @@ _mongocrypt_tester_install_log (_mongocrypt_tester_t *tester)
 {
    INSTALL_TEST (_test_log);
    INSTALL_TEST (_test_trace_log);
+   INSTALL_TEST (_test_log_level);
+   INSTALL_TEST (_test_log_buffer);
 #if defined(__GLIBC__) || defined(__APPLE__)
    INSTALL_TEST (_test_no_log);
 #endif
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2021-present MongoDB, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "test-mongocrypt.h"
+#include "mongocrypt-mutex-private.h"
+
+
+static void
+_test_atomic_ptr (_mongocrypt_tester_t *tester)
+{
+   int a = 1;
+   int b = 2;
+   void *ptr = NULL;
+
+   BSON_ASSERT (!_mongocrypt_atomic_load_acquire_ptr (&ptr));
+   _mongocrypt_atomic_store_release_ptr (&ptr, &a);
+   BSON_ASSERT (_mongocrypt_atomic_load_acquire_ptr (&ptr) == &a);
+
+   /* A CAS with a stale expected value does not swap. */
+   BSON_ASSERT (!_mongocrypt_atomic_cas_ptr (&ptr, &b, NULL));
+   BSON_ASSERT (ptr == &a);
+   BSON_ASSERT (_mongocrypt_atomic_cas_ptr (&ptr, &a, &b));
+   BSON_ASSERT (ptr == &b);
+
+   BSON_ASSERT (_mongocrypt_atomic_exchange_ptr (&ptr, NULL) == &b);
+   BSON_ASSERT (!ptr);
+}
+
+
+static void
+_test_seqlock (_mongocrypt_tester_t *tester)
+{
+   _mongocrypt_seqlock_t seqlock;
+   int64_t seq;
+
+   _mongocrypt_seqlock_init (&seqlock);
+   seq = _mongocrypt_seqlock_read_begin (&seqlock);
+   BSON_ASSERT (!_mongocrypt_seqlock_read_retry (&seqlock, seq));
+
+   /* A read overlapping a write must retry. */
+   seq = _mongocrypt_seqlock_read_begin (&seqlock);
+   _mongocrypt_seqlock_write_begin (&seqlock);
+   _mongocrypt_seqlock_write_end (&seqlock);
+   BSON_ASSERT (_mongocrypt_seqlock_read_retry (&seqlock, seq));
+
+   seq = _mongocrypt_seqlock_read_begin (&seqlock);
+   BSON_ASSERT (!_mongocrypt_seqlock_read_retry (&seqlock, seq));
+}
+
+
+#ifdef BSON_OS_UNIX
+#define SEQLOCK_WRITES 100000
+
+typedef struct {
+   _mongocrypt_seqlock_t seqlock;
+   /* The writer keeps both halves equal. */
+   int64_t a;
+   int64_t b;
+   int64_t done;
+   int64_t torn;
+} _seqlock_shared_t;
+
+
+static void *
+_seqlock_reader_run (void *arg)
+{
+   _seqlock_shared_t *shared = arg;
+
+   while (!_mongocrypt_atomic_load_acquire_int64 (&shared->done)) {
+      int64_t seq;
+      int64_t a;
+      int64_t b;
+
+      do {
+         seq = _mongocrypt_seqlock_read_begin (&shared->seqlock);
+         a = _mongocrypt_atomic_load_int64 (&shared->a);
+         b = _mongocrypt_atomic_load_int64 (&shared->b);
+      } while (_mongocrypt_seqlock_read_retry (&shared->seqlock, seq));
+
+      if (a != b) {
+         _mongocrypt_atomic_add_int64 (&shared->torn, 1);
+      }
+   }
+   return NULL;
+}
+
+
+static void
+_test_seqlock_threads (_mongocrypt_tester_t *tester)
+{
+   _seqlock_shared_t shared;
+   pthread_t readers[4];
+   int64_t i;
+   int j;
+
+   memset (&shared, 0, sizeof (shared));
+   _mongocrypt_seqlock_init (&shared.seqlock);
+   for (j = 0; j < 4; j++) {
+      BSON_ASSERT (
+         0 == pthread_create (&readers[j], NULL, _seqlock_reader_run, &shared));
+   }
+
+   for (i = 1; i <= SEQLOCK_WRITES; i++) {
+      _mongocrypt_seqlock_write_begin (&shared.seqlock);
+      _mongocrypt_atomic_store_int64 (&shared.a, i);
+      _mongocrypt_atomic_store_int64 (&shared.b, i);
+      _mongocrypt_seqlock_write_end (&shared.seqlock);
+   }
+
+   _mongocrypt_atomic_store_release_int64 (&shared.done, 1);
+   for (j = 0; j < 4; j++) {
+      BSON_ASSERT (0 == pthread_join (readers[j], NULL));
+   }
+   BSON_ASSERT (shared.torn == 0);
+}
+#endif
+
+
+void
+_mongocrypt_tester_install_mutex (_mongocrypt_tester_t *tester)
+{
+   INSTALL_TEST (_test_atomic_ptr);
+   INSTALL_TEST (_test_seqlock);
+#ifdef BSON_OS_UNIX
+   INSTALL_TEST (_test_seqlock_threads);
+#endif
+}
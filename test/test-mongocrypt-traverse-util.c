@@ -306,6 +306,15 @@ test_traverse (int num_markings,
 
    /* Count matches */
    BSON_ASSERT (matched == num_matches);
+   if (num_matches > 0) {
+      BSON_ASSERT (_mongocrypt_traverse_may_match (bson, match));
+   }
+
+   /* Scanning the raw bytes finds the same matches. */
+   matched = 0;
+   BSON_ASSERT (_mongocrypt_scan_binary_in_bson (
+      test_traverse_cb, &matched, match, bson, NULL, status));
+   BSON_ASSERT (matched == num_matches);
 
    bson_destroy (bson);
    mongocrypt_status_destroy (status);
@@ -400,6 +409,98 @@ test_transform_cb (void *ctx,
    return true;
 }
 
+/* Replaces with a value of another type and length. */
+static bool
+test_transform_to_utf8_cb (void *ctx,
+                           _mongocrypt_buffer_t *in,
+                           bson_value_t *out,
+                           mongocrypt_status_t *status)
+{
+   int *matches = (int *) ctx;
+
+   *matches += 1;
+   out->value_type = BSON_TYPE_UTF8;
+   out->value.v_utf8.str = bson_strdup_printf ("replaced %d", (int) in->len);
+   out->value.v_utf8.len = (uint32_t) strlen (out->value.v_utf8.str);
+   return true;
+}
+
+/* Passes the in and out of a splice item to a transform callback. */
+typedef struct {
+   _mongocrypt_transform_callback_t cb;
+   void *ctx;
+} _splice_cb_ctx_t;
+
+static bool
+test_splice_cb (void *ctx,
+                _mongocrypt_splice_item_t *item,
+                mongocrypt_status_t *status)
+{
+   _splice_cb_ctx_t *cb_ctx = (_splice_cb_ctx_t *) ctx;
+
+   return cb_ctx->cb (cb_ctx->ctx, &item->in, &item->out, status);
+}
+
+static bool
+test_parallel_for_reverse (void *ctx,
+                           uint32_t count,
+                           mongocrypt_task_fn task,
+                           void *task_ctx)
+{
+   while (count > 0) {
+      task (task_ctx, --count);
+   }
+   return true;
+}
+
+/* Splicing must give the same document as rebuilding it. */
+static void
+test_splice (bson_t *bson,
+             traversal_match_t match,
+             _mongocrypt_transform_callback_t cb,
+             bool parallel,
+             int num_matches)
+{
+   mongocrypt_status_t *status;
+   _mongocrypt_splice_t splice;
+   _mongocrypt_buffer_t spliced;
+   bson_iter_t iter;
+   bson_t out = BSON_INITIALIZER;
+   int matches = 0;
+   _splice_cb_ctx_t cb_ctx = {cb, &matches};
+
+   status = mongocrypt_status_new ();
+   BSON_ASSERT (bson_iter_init (&iter, bson));
+   BSON_ASSERT (_mongocrypt_transform_binary_in_bson (
+      cb, &matches, match, &iter, &out, status));
+   BSON_ASSERT (matches == num_matches);
+
+   matches = 0;
+   _mongocrypt_splice_init (&splice, match);
+   BSON_ASSERT (_mongocrypt_splice_collect (&splice, bson, status));
+   BSON_ASSERT (splice.n_items == (uint32_t) num_matches);
+   if (parallel) {
+      BSON_ASSERT (_mongocrypt_splice_transform (&splice,
+                                                 test_splice_cb,
+                                                 &cb_ctx,
+                                                 test_parallel_for_reverse,
+                                                 NULL,
+                                                 status));
+   } else {
+      BSON_ASSERT (_mongocrypt_splice_transform (
+         &splice, test_splice_cb, &cb_ctx, NULL, NULL, status));
+   }
+   BSON_ASSERT (_mongocrypt_splice_finish (&splice, &spliced, status));
+   BSON_ASSERT (matches == num_matches);
+   BSON_ASSERT (spliced.len == out.len);
+   BSON_ASSERT (0 == memcmp (spliced.data, bson_get_data (&out), out.len));
+
+   _mongocrypt_buffer_cleanup (&spliced);
+   _mongocrypt_splice_cleanup (&splice);
+   bson_destroy (&out);
+   mongocrypt_status_destroy (status);
+}
+
 static void
 test_transform (int num_markings,
                 int num_deterministic,
@@ -453,6 +554,11 @@ test_transform (int num_markings,
 
    BSON_ASSERT (matches == num_matches);
 
+   test_splice (bson, match, test_transform_cb, false, num_matches);
+   test_splice (bson, match, test_transform_cb, true, num_matches);
+   test_splice (bson, match, test_transform_to_utf8_cb, false, num_matches);
+   test_splice (bson, match, test_transform_to_utf8_cb, true, num_matches);
+
    bson_destroy (bson);
    bson_destroy (&out);
    mongocrypt_status_destroy (status);
@@ -540,9 +646,232 @@ test_mongocrypt_traverse_util (_mongocrypt_tester_t *tester)
    test_mongocrypt_traverse_util_nesting (&ctx);
 }
 
+static void
+test_mongocrypt_traverse_may_match (_mongocrypt_tester_t *tester)
+{
+   bson_t *bson;
+
+   bson = bson_new ();
+   BSON_ASSERT (
+      !_mongocrypt_traverse_may_match (bson, TRAVERSE_MATCH_CIPHERTEXT));
+   BSON_APPEND_UTF8 (bson, "a", "b");
+   BSON_APPEND_INT32 (bson, "n", 6);
+   BSON_ASSERT (
+      !_mongocrypt_traverse_may_match (bson, TRAVERSE_MATCH_CIPHERTEXT));
+   /* Binary subtype 06 with the first byte of a marking. */
+   BSON_APPEND_BINARY (bson, "m", 6, (const uint8_t *) "\x00", 1);
+   BSON_ASSERT (
+      !_mongocrypt_traverse_may_match (bson, TRAVERSE_MATCH_CIPHERTEXT));
+   BSON_ASSERT (_mongocrypt_traverse_may_match (bson, TRAVERSE_MATCH_MARKING));
+   BSON_APPEND_BINARY (bson, "c", 6, (const uint8_t *) "\x02", 1);
+   BSON_ASSERT (
+      _mongocrypt_traverse_may_match (bson, TRAVERSE_MATCH_CIPHERTEXT));
+   bson_destroy (bson);
+}
+
+static void
+test_mongocrypt_scan_malformed (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_status_t *status;
+   bson_t *bson, child, view;
+   uint8_t *data;
+   uint32_t len;
+   int matched = 0;
+
+   status = mongocrypt_status_new ();
+   bson = bson_new ();
+   BSON_APPEND_DOCUMENT_BEGIN (bson, "a", &child);
+   BSON_APPEND_UTF8 (&child, "b", "c");
+   bson_append_document_end (bson, &child);
+   len = bson->len;
+   data = bson_destroy_with_steal (bson, true, &len);
+
+   /* The embedded document claims to extend past its parent. */
+   data[7] = 0x7f;
+   BSON_ASSERT (bson_init_static (&view, data, len));
+   BSON_ASSERT (!_mongocrypt_scan_binary_in_bson (test_traverse_cb,
+                                                  &matched,
+                                                  TRAVERSE_MATCH_CIPHERTEXT,
+                                                  &view,
+                                                  NULL,
+                                                  status));
+   ASSERT_STATUS_CONTAINS (status, "malformed BSON");
+   BSON_ASSERT (matched == 0);
+
+   bson_free (data);
+   mongocrypt_status_destroy (status);
+}
+
+static bool
+test_parallel_for_count (void *ctx,
+                         uint32_t count,
+                         mongocrypt_task_fn task,
+                         void *task_ctx)
+{
+   *(uint32_t *) ctx = count;
+   return test_parallel_for_reverse (NULL, count, task, task_ctx);
+}
+
+/* Each document of a bulk write is transformed by one task. */
+static void
+test_mongocrypt_splice_bulk_write (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_status_t *status;
+   _mongocrypt_splice_t splice;
+   _mongocrypt_buffer_t spliced;
+   bson_t *bson, documents, doc, out = BSON_INITIALIZER;
+   bson_iter_t iter;
+   const int n_fields[] = {2, 1, 3};
+   uint32_t count = 0;
+   int i, j, matches = 0;
+   _splice_cb_ctx_t cb_ctx = {test_transform_to_utf8_cb, &matches};
+
+   status = mongocrypt_status_new ();
+   bson = BCON_NEW ("insert", "coll");
+   BSON_APPEND_ARRAY_BEGIN (bson, "documents", &documents);
+   for (i = 0; i < 3; i++) {
+      char key[2] = {(char) ('0' + i), 0};
+
+      BSON_APPEND_DOCUMENT_BEGIN (&documents, key, &doc);
+      for (j = 0; j < n_fields[i]; j++) {
+         char field[2] = {(char) ('a' + j), 0};
+
+         _append_marking (&doc, field, 1);
+      }
+      bson_append_document_end (&documents, &doc);
+   }
+   bson_append_array_end (bson, &documents);
+
+   BSON_ASSERT (bson_iter_init (&iter, bson));
+   BSON_ASSERT (_mongocrypt_transform_binary_in_bson (test_transform_to_utf8_cb,
+                                                      &matches,
+                                                      TRAVERSE_MATCH_MARKING,
+                                                      &iter,
+                                                      &out,
+                                                      status));
+
+   matches = 0;
+   _mongocrypt_splice_init (&splice, TRAVERSE_MATCH_MARKING);
+   BSON_ASSERT (_mongocrypt_splice_collect (&splice, bson, status));
+   BSON_ASSERT (splice.n_items == 6);
+   BSON_ASSERT (_mongocrypt_splice_transform (&splice,
+                                              test_splice_cb,
+                                              &cb_ctx,
+                                              test_parallel_for_count,
+                                              &count,
+                                              status));
+   BSON_ASSERT (count == 3);
+   BSON_ASSERT (matches == 6);
+   BSON_ASSERT (_mongocrypt_splice_finish (&splice, &spliced, status));
+   BSON_ASSERT (spliced.len == out.len);
+   BSON_ASSERT (0 == memcmp (spliced.data, bson_get_data (&out), out.len));
+
+   _mongocrypt_buffer_cleanup (&spliced);
+   _mongocrypt_splice_cleanup (&splice);
+   bson_destroy (&out);
+   bson_destroy (bson);
+   mongocrypt_status_destroy (status);
+}
+
+/* Nesting is traversed and scanned without a C stack frame per level. */
+static void
+test_mongocrypt_traverse_deep (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_status_t *status;
+   bson_t *levels, out = BSON_INITIALIZER;
+   bson_iter_t iter;
+   _mongocrypt_splice_t splice;
+   _mongocrypt_buffer_t spliced;
+   const int depth = 200;
+   int i, matches = 0;
+   _splice_cb_ctx_t cb_ctx = {test_transform_cb, &matches};
+
+   status = mongocrypt_status_new ();
+   /* Alternate documents and arrays, with a marking at the top and bottom. */
+   levels = bson_malloc0 (sizeof (bson_t) * (depth + 1));
+   BSON_ASSERT (levels);
+   bson_init (&levels[0]);
+   _append_marking (&levels[0], "a", 1);
+   for (i = 1; i <= depth; i++) {
+      if (i % 2) {
+         BSON_APPEND_ARRAY_BEGIN (&levels[i - 1], "0", &levels[i]);
+      } else {
+         BSON_APPEND_DOCUMENT_BEGIN (&levels[i - 1], "0", &levels[i]);
+      }
+   }
+   _append_marking (&levels[depth], "0", 1);
+   BSON_APPEND_UTF8 (&levels[depth], "1", "x");
+   for (i = depth; i >= 1; i--) {
+      if (i % 2) {
+         bson_append_array_end (&levels[i - 1], &levels[i]);
+      } else {
+         bson_append_document_end (&levels[i - 1], &levels[i]);
+      }
+   }
+
+   BSON_ASSERT (bson_iter_init (&iter, &levels[0]));
+   BSON_ASSERT (_mongocrypt_traverse_binary_in_bson (
+      test_traverse_cb, &matches, TRAVERSE_MATCH_MARKING, &iter, status));
+   BSON_ASSERT (matches == 2);
+
+   matches = 0;
+   BSON_ASSERT (bson_iter_init (&iter, &levels[0]));
+   BSON_ASSERT (_mongocrypt_transform_binary_in_bson (test_transform_cb,
+                                                      &matches,
+                                                      TRAVERSE_MATCH_MARKING,
+                                                      &iter,
+                                                      &out,
+                                                      status));
+   BSON_ASSERT (matches == 2);
+
+   /* The copy has the same shape, with both markings replaced. */
+   matches = 0;
+   BSON_ASSERT (bson_iter_init (&iter, &out));
+   BSON_ASSERT (_mongocrypt_traverse_binary_in_bson (
+      test_traverse_cb, &matches, TRAVERSE_MATCH_MARKING, &iter, status));
+   BSON_ASSERT (matches == 2);
+   BSON_ASSERT (bson_iter_init (&iter, &out));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, "0.0.0.0", &iter));
+   BSON_ASSERT (BSON_ITER_HOLDS_DOCUMENT (&iter));
+
+   /* The raw scanner records every enclosing level and splices the same
+    * copy. */
+   matches = 0;
+   BSON_ASSERT (_mongocrypt_scan_binary_in_bson (test_traverse_cb,
+                                                 &matches,
+                                                 TRAVERSE_MATCH_MARKING,
+                                                 &levels[0],
+                                                 NULL,
+                                                 status));
+   BSON_ASSERT (matches == 2);
+
+   matches = 0;
+   _mongocrypt_splice_init (&splice, TRAVERSE_MATCH_MARKING);
+   BSON_ASSERT (_mongocrypt_splice_collect (&splice, &levels[0], status));
+   BSON_ASSERT (splice.n_items == 2);
+   BSON_ASSERT (splice.n_containers == (uint32_t) depth + 1u);
+   BSON_ASSERT (_mongocrypt_splice_transform (
+      &splice, test_splice_cb, &cb_ctx, NULL, NULL, status));
+   BSON_ASSERT (matches == 2);
+   BSON_ASSERT (_mongocrypt_splice_finish (&splice, &spliced, status));
+   BSON_ASSERT (spliced.len == out.len);
+   BSON_ASSERT (0 == memcmp (spliced.data, bson_get_data (&out), out.len));
+
+   _mongocrypt_buffer_cleanup (&spliced);
+   _mongocrypt_splice_cleanup (&splice);
+   bson_destroy (&out);
+   bson_destroy (&levels[0]);
+   bson_free (levels);
+   mongocrypt_status_destroy (status);
+}
+
 void
 _mongocrypt_tester_install_traverse_util (_mongocrypt_tester_t *tester)
 {
    INSTALL_TEST (test_mongocrypt_traverse_util);
+   INSTALL_TEST (test_mongocrypt_traverse_may_match);
+   INSTALL_TEST (test_mongocrypt_scan_malformed);
    INSTALL_TEST (test_mongocrypt_transform_util);
+   INSTALL_TEST (test_mongocrypt_splice_bulk_write);
+   INSTALL_TEST (test_mongocrypt_traverse_deep);
 }
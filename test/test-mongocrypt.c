@@ -640,6 +640,40 @@ _test_setopt_schema (_mongocrypt_tester_t *tester)
    mongocrypt_destroy (crypt);
 }
 
+static void
+_test_setopt_cache_limits (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (mongocrypt_setopt_key_cache_ttl (crypt, 5 * 60 * 1000), crypt);
+   ASSERT_OK (mongocrypt_setopt_key_cache_max_entries (crypt, 100), crypt);
+   ASSERT_OK (mongocrypt_setopt_collinfo_cache_ttl (crypt, 1000), crypt);
+   ASSERT_OK (mongocrypt_setopt_collinfo_cache_max_entries (crypt, 10), crypt);
+   ASSERT_OK (mongocrypt_setopt_key_cache_refresh_window (crypt, 30 * 1000),
+              crypt);
+   BSON_ASSERT (crypt->cache_key->expiration == 5 * 60 * 1000);
+   BSON_ASSERT (crypt->cache_key->max_entries == 100);
+   BSON_ASSERT (crypt->cache_collinfo->expiration == 1000);
+   BSON_ASSERT (crypt->cache_collinfo->max_entries == 10);
+   BSON_ASSERT (crypt->cache_key->refresh_window == 30 * 1000);
+
+   ASSERT_FAILS (mongocrypt_setopt_key_cache_ttl (crypt, 0),
+                 crypt,
+                 "cache TTL must be greater than zero");
+   mongocrypt_destroy (crypt);
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   ASSERT_FAILS (mongocrypt_setopt_key_cache_ttl (crypt, 1000),
+                 crypt,
+                 "options cannot be set after initialization");
+   ASSERT_FAILS (mongocrypt_setopt_collinfo_cache_max_entries (crypt, 1),
+                 crypt,
+                 "options cannot be set after initialization");
+   mongocrypt_destroy (crypt);
+}
+
+
 static void
 _test_setopt_invalid_kms_providers (_mongocrypt_tester_t *tester)
 {
@@ -746,6 +780,336 @@ _test_setopt_kms_providers (_mongocrypt_tester_t *tester)
 }
 
 
+static int64_t
+_get_stat (mongocrypt_t *crypt, const char *path)
+{
+   mongocrypt_binary_t *bin;
+   bson_t as_bson;
+   bson_iter_t iter;
+   int64_t value;
+
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_get_stats (crypt, bin), crypt);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   BSON_ASSERT (bson_iter_find_descendant (&iter, path, &iter));
+   BSON_ASSERT (BSON_ITER_HOLDS_INT64 (&iter));
+   value = bson_iter_int64 (&iter);
+   mongocrypt_binary_destroy (bin);
+   return value;
+}
+
+
+static void
+_test_get_stats (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+   int64_t encrypted;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   BSON_ASSERT (0 == _get_stat (crypt, "kms.aws.requests"));
+   BSON_ASSERT (0 == _get_stat (crypt, "cache.key.entries"));
+
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+
+   BSON_ASSERT (1 == _get_stat (crypt, "kms.aws.requests"));
+   BSON_ASSERT (_get_stat (crypt, "kms.aws.bytesSent") > 0);
+   BSON_ASSERT (_get_stat (crypt, "kms.aws.bytesReceived") > 0);
+   BSON_ASSERT (0 == _get_stat (crypt, "kms.aws.oauthRefreshes"));
+   BSON_ASSERT (0 == _get_stat (crypt, "kms.azure.requests"));
+   BSON_ASSERT (1 == _get_stat (crypt, "mongocryptdRoundTrips"));
+   BSON_ASSERT (_get_stat (crypt, "cache.collinfo.misses") > 0);
+   BSON_ASSERT (1 == _get_stat (crypt, "cache.collinfo.entries"));
+   BSON_ASSERT (1 == _get_stat (crypt, "cache.key.entries"));
+   encrypted = _get_stat (crypt, "fieldsEncrypted");
+   BSON_ASSERT (encrypted > 0);
+   BSON_ASSERT (0 == _get_stat (crypt, "fieldsDecrypted"));
+   /* No key cache backend is set. */
+   BSON_ASSERT (0 == _get_stat (crypt, "keyCacheBackend.misses"));
+
+   /* The second command hits both caches and makes no KMS request. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+
+   BSON_ASSERT (1 == _get_stat (crypt, "kms.aws.requests"));
+   BSON_ASSERT (2 == _get_stat (crypt, "mongocryptdRoundTrips"));
+   BSON_ASSERT (_get_stat (crypt, "cache.collinfo.hits") > 0);
+   BSON_ASSERT (_get_stat (crypt, "cache.key.hits") > 0);
+   BSON_ASSERT (2 * encrypted == _get_stat (crypt, "fieldsEncrypted"));
+
+   ASSERT_FAILS (mongocrypt_get_stats (crypt, NULL), crypt, "invalid NULL");
+   mongocrypt_destroy (crypt);
+}
+
+
+static bool
+_has_stat (mongocrypt_t *crypt, const char *path)
+{
+   mongocrypt_binary_t *bin;
+   bson_t as_bson;
+   bson_iter_t iter;
+   bool found;
+
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_get_stats (crypt, bin), crypt);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   BSON_ASSERT (bson_iter_init (&iter, &as_bson));
+   found = bson_iter_find_descendant (&iter, path, &iter);
+   mongocrypt_binary_destroy (bin);
+   return found;
+}
+
+
+static void
+_test_get_stats_namespaces (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *encrypted;
+   mongocrypt_binary_t *bin;
+   char ns[32];
+   int i;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   BSON_ASSERT (!_has_stat (crypt, "namespaces.0"));
+   BSON_ASSERT (0 == _get_stat (crypt, "otherNamespaces.encryptOps"));
+
+   /* Auto encryption is counted under the namespace of the command. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   encrypted = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, encrypted), ctx);
+   mongocrypt_ctx_destroy (ctx);
+   BSON_ASSERT (1 == _get_stat (crypt, "namespaces.0.encryptOps"));
+   BSON_ASSERT (_get_stat (crypt, "fieldsEncrypted") ==
+                _get_stat (crypt, "namespaces.0.fieldsEncrypted"));
+   BSON_ASSERT (encrypted->len ==
+                _get_stat (crypt, "namespaces.0.ciphertextBytes"));
+   BSON_ASSERT (1 == _get_stat (crypt, "namespaces.0.mongocryptdRoundTrips"));
+   BSON_ASSERT (1 == _get_stat (crypt, "namespaces.0.collinfoMisses"));
+   BSON_ASSERT (0 == _get_stat (crypt, "namespaces.0.decryptOps"));
+
+   /* Decryption is counted under the namespace it is given. */
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_stats_namespace (ctx, "test.test", -1),
+              ctx);
+   ASSERT_FAILS (mongocrypt_ctx_setopt_stats_namespace (ctx, "test.test", -1),
+                 ctx,
+                 "already set stats namespace");
+   mongocrypt_ctx_destroy (ctx);
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_stats_namespace (ctx, "test.test", -1),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   BSON_ASSERT (1 == _get_stat (crypt, "namespaces.0.decryptOps"));
+   BSON_ASSERT (_get_stat (crypt, "namespaces.0.fieldsDecrypted") > 0);
+   BSON_ASSERT (bin->len == _get_stat (crypt, "namespaces.0.plaintextBytes"));
+   BSON_ASSERT (!_has_stat (crypt, "namespaces.1"));
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Namespaces past the limit share the overflow counters. */
+   for (i = 1; i < MONGOCRYPT_STATS_MAX_NAMESPACES; i++) {
+      bson_snprintf (ns, sizeof (ns), "test.coll%d", i);
+      ctx = mongocrypt_ctx_new (crypt);
+      ASSERT_OK (mongocrypt_ctx_setopt_stats_namespace (ctx, ns, -1), ctx);
+      mongocrypt_ctx_destroy (ctx);
+   }
+   BSON_ASSERT (_has_stat (crypt, "namespaces.63"));
+   ctx = mongocrypt_ctx_new (crypt);
+   ASSERT_OK (mongocrypt_ctx_setopt_stats_namespace (ctx, "test.other", -1),
+              ctx);
+   ASSERT_OK (mongocrypt_ctx_decrypt_init (ctx, encrypted), ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   BSON_ASSERT (!_has_stat (crypt, "namespaces.64"));
+   BSON_ASSERT (1 == _get_stat (crypt, "otherNamespaces.decryptOps"));
+   BSON_ASSERT (1 == _get_stat (crypt, "namespaces.0.decryptOps"));
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+
+   mongocrypt_binary_destroy (encrypted);
+   mongocrypt_destroy (crypt);
+}
+
+
+static int64_t
+_get_memory (mongocrypt_t *crypt, const char *key)
+{
+   mongocrypt_binary_t *bin;
+   bson_t as_bson;
+   bson_iter_t iter;
+   int64_t value;
+
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_get_memory_usage (crypt, bin), crypt);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (bin, &as_bson));
+   BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, key));
+   BSON_ASSERT (BSON_ITER_HOLDS_INT64 (&iter));
+   value = bson_iter_int64 (&iter);
+   mongocrypt_binary_destroy (bin);
+   return value;
+}
+
+
+static void
+_test_get_memory_usage (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+   int64_t contexts;
+   int64_t key_cache;
+
+   crypt = _mongocrypt_tester_mongocrypt ();
+   contexts = _get_memory (crypt, "contexts");
+   key_cache = _get_memory (crypt, "keyCache");
+   BSON_ASSERT (0 == _get_memory (crypt, "kms"));
+
+   ctx = mongocrypt_ctx_new (crypt);
+   BSON_ASSERT (_get_memory (crypt, "contexts") > contexts);
+   ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                 ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+              ctx);
+   _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+   bin = mongocrypt_binary_new ();
+   ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_ctx_destroy (ctx);
+
+   /* Destroying the context releases its memory and its KMS request. */
+   BSON_ASSERT (contexts == _get_memory (crypt, "contexts"));
+   BSON_ASSERT (0 == _get_memory (crypt, "kms"));
+   BSON_ASSERT (_get_memory (crypt, "keyCache") > key_cache);
+   BSON_ASSERT (_get_memory (crypt, "collinfoCache") > 0);
+
+   ASSERT_FAILS (
+      mongocrypt_get_memory_usage (crypt, NULL), crypt, "invalid NULL");
+   mongocrypt_destroy (crypt);
+}
+
+
+typedef struct {
+   int begins[MONGOCRYPT_TRACE_SPAN_FINALIZE + 1];
+   int ends[MONGOCRYPT_TRACE_SPAN_FINALIZE + 1];
+   uint64_t last_id;
+   bool saw_kms_endpoint;
+   bool saw_cache_hit;
+} _trace_counts_t;
+
+
+static void
+_trace_fn (mongocrypt_trace_span_t span,
+           bool begin,
+           uint64_t span_id,
+           mongocrypt_binary_t *attrs,
+           void *ctx)
+{
+   _trace_counts_t *counts = (_trace_counts_t *) ctx;
+   bson_t as_bson;
+   bson_iter_t iter;
+
+   BSON_ASSERT (span_id != 0);
+   BSON_ASSERT (_mongocrypt_binary_to_bson (attrs, &as_bson));
+   if (begin) {
+      /* Ids are handed out in order. */
+      BSON_ASSERT (span_id > counts->last_id);
+      counts->last_id = span_id;
+      counts->begins[span]++;
+   } else {
+      counts->ends[span]++;
+   }
+
+   if (span == MONGOCRYPT_TRACE_SPAN_KMS_REQUEST && begin) {
+      BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "provider"));
+      ASSERT_STREQUAL (bson_iter_utf8 (&iter, NULL), "aws");
+      BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "endpoint"));
+      ASSERT_STREQUAL (bson_iter_utf8 (&iter, NULL),
+                       "kms.us-east-1.amazonaws.com");
+      counts->saw_kms_endpoint = true;
+   }
+   if (span == MONGOCRYPT_TRACE_SPAN_CACHE_LOOKUP && !begin) {
+      BSON_ASSERT (bson_iter_init_find (&iter, &as_bson, "hit"));
+      if (bson_iter_bool (&iter)) {
+         counts->saw_cache_hit = true;
+      }
+   }
+}
+
+
+static void
+_test_trace_handler (_mongocrypt_tester_t *tester)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   mongocrypt_binary_t *bin;
+   _trace_counts_t counts = {{0}};
+   int i;
+
+   crypt = mongocrypt_new ();
+   ASSERT_OK (
+      mongocrypt_setopt_kms_provider_aws (crypt, "example", -1, "example", -1),
+      crypt);
+   ASSERT_OK (mongocrypt_setopt_trace_handler (crypt, _trace_fn, &counts),
+              crypt);
+   ASSERT_OK (mongocrypt_init (crypt), crypt);
+   ASSERT_FAILS (mongocrypt_setopt_trace_handler (crypt, _trace_fn, &counts),
+                 crypt,
+                 "options cannot be set after initialization");
+
+   for (i = 0; i < 2; i++) {
+      ctx = mongocrypt_ctx_new (crypt);
+      ASSERT_OK (mongocrypt_ctx_encrypt_init (
+                    ctx, "test", -1, TEST_FILE ("./test/example/cmd.json")),
+                 ctx);
+      _mongocrypt_tester_run_ctx_to (tester, ctx, MONGOCRYPT_CTX_READY);
+      bin = mongocrypt_binary_new ();
+      ASSERT_OK (mongocrypt_ctx_finalize (ctx, bin), ctx);
+      mongocrypt_binary_destroy (bin);
+      mongocrypt_ctx_destroy (ctx);
+   }
+
+   /* Every span that began has ended. */
+   for (i = 0; i <= MONGOCRYPT_TRACE_SPAN_FINALIZE; i++) {
+      BSON_ASSERT (counts.begins[i] == counts.ends[i]);
+   }
+   /* Only the first command fetches and decrypts the key. */
+   BSON_ASSERT (counts.begins[MONGOCRYPT_TRACE_SPAN_KEY_VAULT] == 1);
+   BSON_ASSERT (counts.begins[MONGOCRYPT_TRACE_SPAN_KMS_DECRYPT] == 1);
+   BSON_ASSERT (counts.begins[MONGOCRYPT_TRACE_SPAN_KMS_REQUEST] == 1);
+   BSON_ASSERT (counts.begins[MONGOCRYPT_TRACE_SPAN_KMS_AUTH] == 0);
+   BSON_ASSERT (counts.begins[MONGOCRYPT_TRACE_SPAN_FINALIZE] == 2);
+   BSON_ASSERT (counts.begins[MONGOCRYPT_TRACE_SPAN_CACHE_LOOKUP] > 0);
+   BSON_ASSERT (counts.saw_kms_endpoint);
+   BSON_ASSERT (counts.saw_cache_hit);
+   mongocrypt_destroy (crypt);
+}
+
+
 int
 main (int argc, char **argv)
 {
@@ -770,12 +1134,17 @@ main (int argc, char **argv)
    _mongocrypt_tester_install_local_kms (&tester);
    _mongocrypt_tester_install_cache (&tester);
    _mongocrypt_tester_install_buffer (&tester);
+   _mongocrypt_tester_install_arena (&tester);
    _mongocrypt_tester_install_ctx_setopt (&tester);
    _mongocrypt_tester_install_key (&tester);
    _mongocrypt_tester_install_marking (&tester);
    _mongocrypt_tester_install_traverse_util (&tester);
    _mongocrypt_tester_install (
       &tester, "_test_setopt_schema", _test_setopt_schema, CRYPTO_REQUIRED);
+   _mongocrypt_tester_install (&tester,
+                               "_test_setopt_cache_limits",
+                               _test_setopt_cache_limits,
+                               CRYPTO_REQUIRED);
    _mongocrypt_tester_install (&tester,
                                "_test_setopt_invalid_kms_providers",
                                _test_setopt_invalid_kms_providers,
@@ -791,6 +1160,19 @@ main (int argc, char **argv)
                                CRYPTO_OPTIONAL);
    _mongocrypt_tester_install_kek (&tester);
    _mongocrypt_tester_install_cache_oauth (&tester);
+   _mongocrypt_tester_install_mutex (&tester);
+   _mongocrypt_tester_install (
+      &tester, "_test_get_stats", _test_get_stats, CRYPTO_REQUIRED);
+   _mongocrypt_tester_install (&tester,
+                               "_test_get_stats_namespaces",
+                               _test_get_stats_namespaces,
+                               CRYPTO_REQUIRED);
+   _mongocrypt_tester_install (&tester,
+                               "_test_get_memory_usage",
+                               _test_get_memory_usage,
+                               CRYPTO_REQUIRED);
+   _mongocrypt_tester_install (
+      &tester, "_test_trace_handler", _test_trace_handler, CRYPTO_REQUIRED);
 
 
    printf ("Running tests...\n");
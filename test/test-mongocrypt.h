@@ -244,6 +244,9 @@ _mongocrypt_tester_install_cache (_mongocrypt_tester_t *tester);
 void
 _mongocrypt_tester_install_buffer (_mongocrypt_tester_t *tester);
 
+void
+_mongocrypt_tester_install_arena (_mongocrypt_tester_t *tester);
+
 void
 _mongocrypt_tester_install_ctx_setopt (_mongocrypt_tester_t *tester);
 
@@ -277,6 +280,9 @@ _mongocrypt_tester_install_kek (_mongocrypt_tester_t *tester);
 void
 _mongocrypt_tester_install_cache_oauth (_mongocrypt_tester_t *tester);
 
+void
+_mongocrypt_tester_install_mutex (_mongocrypt_tester_t *tester);
+
 /* Conveniences for getting test data. */
 
 /* Get a temporary bson_t from a JSON string. Do not free it. */
@@ -21,6 +21,13 @@
 #include <kms_message/kms_b64.h>
 #include <fcntl.h>
 
+#ifdef BSON_OS_UNIX
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "util.h"
 
 const char *help_text = ""
@@ -55,12 +62,41 @@ set_kms_providers (mongocrypt_t *crypt, bson_t *args)
    bson_destroy (kms_providers);
 }
 
+/* Map a schema map image read-only. The mapping is shared with other
+ * processes mapping the same file, and is kept until the process exits. */
+static mongocrypt_binary_t *
+map_schema_map_image (const char *path)
+{
+#ifdef BSON_OS_UNIX
+   struct stat st;
+   void *data;
+   int fd;
+
+   fd = open (path, O_RDONLY);
+   if (fd < 0 || 0 != fstat (fd, &st) || st.st_size == 0 ||
+       (uint64_t) st.st_size > UINT32_MAX) {
+      ERREXIT ("Error opening %s", path);
+   }
+   data = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   if (data == MAP_FAILED) {
+      ERREXIT ("Error mapping %s", path);
+   }
+   close (fd);
+   return mongocrypt_binary_new_from_data (data, (uint32_t) st.st_size);
+#else
+   ERREXIT ("--schema_map_image_file requires mmap");
+   return NULL;
+#endif
+}
+
 static mongocrypt_t *
 crypt_new (bson_t *args)
 {
    mongocrypt_t *crypt;
    bson_t *schema_map;
    mongocrypt_binary_t *bin;
+   const char *image_path;
+   const char *ttl_ms;
 
    crypt = mongocrypt_new ();
    if (!mongocrypt_setopt_log_handler (crypt, _log_to_stdout, NULL)) {
@@ -69,6 +105,12 @@ crypt_new (bson_t *args)
 
    set_kms_providers (crypt, args);
 
+   ttl_ms = bson_get_utf8 (args, "key_cache_ttl_ms", NULL);
+   if (ttl_ms &&
+       !mongocrypt_setopt_key_cache_ttl (crypt, strtoull (ttl_ms, NULL, 10))) {
+      ERREXIT_MONGOCRYPT (crypt);
+   }
+
    schema_map = bson_get_json (args, "schema_map_file");
    if (schema_map) {
       bin = util_bson_to_bin (schema_map);
@@ -79,6 +121,15 @@ crypt_new (bson_t *args)
    }
    bson_destroy (schema_map);
 
+   image_path = bson_get_utf8 (args, "schema_map_image_file", NULL);
+   if (image_path) {
+      bin = map_schema_map_image (image_path);
+      if (!mongocrypt_setopt_schema_map_image (crypt, bin)) {
+         ERREXIT_MONGOCRYPT (crypt);
+      }
+      mongocrypt_binary_destroy (bin);
+   }
+
    if (!mongocrypt_init (crypt)) {
       ERREXIT_MONGOCRYPT (crypt);
    }
@@ -103,6 +154,7 @@ state_init (state_t *state, bson_t *args, mongocrypt_ctx_t *ctx)
    const char *keyvault_ns;
    char *pos;
 
+   memset (state, 0, sizeof (*state));
    state->keyvault_client = mongoc_client_new (
       bson_get_utf8 (args, "mongodb_uri", "mongodb://localhost:27017"));
    state->mongocryptd_client = mongoc_client_new (
@@ -138,21 +190,15 @@ state_cleanup (state_t *state)
    bson_free (state->keyvault_coll);
 }
 
+/* Initializes a context for one function from its options. */
+typedef void (*ctx_init_fn) (mongocrypt_ctx_t *ctx, bson_t *args);
+
 static void
-fn_createdatakey (bson_t *args)
+init_createdatakey (mongocrypt_ctx_t *ctx, bson_t *args)
 {
-   state_t state;
-   mongocrypt_t *crypt;
-   mongocrypt_ctx_t *ctx;
    const char *kms_provider;
-   bson_t result;
-   bson_error_t error;
-   char *result_utf8;
    mongocrypt_binary_t *bin;
 
-   crypt = crypt_new (args);
-   ctx = mongocrypt_ctx_new (crypt);
-
    kms_provider = bson_req_utf8 (args, "kms_provider");
 
    /* Set the key encryption key (KEK). */
@@ -242,51 +288,15 @@ fn_createdatakey (bson_t *args)
    if (!mongocrypt_ctx_datakey_init (ctx)) {
       ERREXIT_CTX (ctx);
    }
-
-   state_init (&state, args, ctx);
-
-   if (state.machine.trace) {
-      MONGOC_DEBUG ("Running state machine");
-   }
-
-   if (!_state_machine_run (&state.machine, &result, &error)) {
-      ERREXIT_BSON (&error);
-   }
-
-   if (state.machine.trace) {
-      MONGOC_DEBUG ("Finished running state machine");
-   }
-
-   if (!mongoc_collection_insert_one (
-          state.machine.keyvault_coll, &result, NULL, NULL, &error)) {
-      ERREXIT_BSON (&error);
-   }
-
-   result_utf8 = bson_as_canonical_extended_json (&result, NULL);
-   printf ("%s\n", result_utf8);
-   bson_free (result_utf8);
-
-   bson_destroy (&result);
-   mongocrypt_ctx_destroy (ctx);
-   mongocrypt_destroy (crypt);
-   state_cleanup (&state);
 }
 
 static void
-fn_autoencrypt (bson_t *args)
+init_autoencrypt (mongocrypt_ctx_t *ctx, bson_t *args)
 {
-   state_t state;
-   mongocrypt_t *crypt;
-   mongocrypt_ctx_t *ctx;
    const char *db;
    mongocrypt_binary_t *bin;
    bson_t *cmd;
-   bson_t result;
    bson_error_t error;
-   char *result_utf8;
-
-   crypt = crypt_new (args);
-   ctx = mongocrypt_ctx_new (crypt);
 
    cmd = bson_get_json (args, "command_file");
    if (!cmd) {
@@ -304,46 +314,16 @@ fn_autoencrypt (bson_t *args)
       ERREXIT_CTX (ctx);
    }
 
-   state_init (&state, args, ctx);
-
-   if (state.machine.trace) {
-      MONGOC_INFO ("Running state machine");
-   }
-
-   if (!_state_machine_run (&state.machine, &result, &error)) {
-      ERREXIT_BSON (&error);
-   }
-
-   if (state.machine.trace) {
-      MONGOC_INFO ("Finished running state machine");
-   }
-
-   result_utf8 = bson_as_canonical_extended_json (&result, NULL);
-   printf ("%s\n", result_utf8);
-   bson_free (result_utf8);
-
    bson_destroy (cmd);
    mongocrypt_binary_destroy (bin);
-   bson_destroy (&result);
-   mongocrypt_ctx_destroy (ctx);
-   mongocrypt_destroy (crypt);
-   state_cleanup (&state);
 }
 
 static void
-fn_autodecrypt (bson_t *args)
+init_autodecrypt (mongocrypt_ctx_t *ctx, bson_t *args)
 {
-   state_t state;
-   mongocrypt_t *crypt;
-   mongocrypt_ctx_t *ctx;
    mongocrypt_binary_t *bin;
    bson_t *doc;
-   bson_t result;
    bson_error_t error;
-   char *result_utf8;
-
-   crypt = crypt_new (args);
-   ctx = mongocrypt_ctx_new (crypt);
 
    doc = bson_get_json (args, "document_file");
    if (!doc) {
@@ -360,51 +340,22 @@ fn_autodecrypt (bson_t *args)
       ERREXIT_CTX (ctx);
    }
 
-   state_init (&state, args, ctx);
-
-   if (state.machine.trace) {
-      MONGOC_INFO ("Running state machine");
-   }
-
-   if (!_state_machine_run (&state.machine, &result, &error)) {
-      ERREXIT_BSON (&error);
-   }
-
-   if (state.machine.trace) {
-      MONGOC_INFO ("Finished running state machine");
-   }
-
-   result_utf8 = bson_as_canonical_extended_json (&result, NULL);
-   printf ("%s\n", result_utf8);
-   bson_free (result_utf8);
-
    bson_destroy (doc);
    mongocrypt_binary_destroy (bin);
-   bson_destroy (&result);
-   mongocrypt_ctx_destroy (ctx);
-   mongocrypt_destroy (crypt);
-   state_cleanup (&state);
 }
 
 static void
-fn_explicitencrypt (bson_t *args)
+init_explicitencrypt (mongocrypt_ctx_t *ctx, bson_t *args)
 {
-   state_t state;
-   mongocrypt_t *crypt;
-   mongocrypt_ctx_t *ctx;
    const char *value;
    bson_t *value_doc;
    const char *key_id_base64;
    const char *key_alt_name;
    const char *algorithm;
    mongocrypt_binary_t *bin;
-   bson_t result;
    bson_error_t error;
-   char *result_utf8;
    uint8_t key_id[97];
 
-   crypt = crypt_new (args);
-   ctx = mongocrypt_ctx_new (crypt);
    value = bson_req_utf8 (args, "value");
    value_doc =
       bson_new_from_json ((const uint8_t *) value, strlen (value), &error);
@@ -434,6 +385,7 @@ fn_explicitencrypt (bson_t *args)
          ERREXIT_CTX (ctx);
       }
       mongocrypt_binary_destroy (bin);
+      bson_destroy (wrapper);
    }
 
 
@@ -447,47 +399,18 @@ fn_explicitencrypt (bson_t *args)
       ERREXIT_CTX (ctx);
    }
 
-   state_init (&state, args, ctx);
-
-   if (state.machine.trace) {
-      MONGOC_INFO ("Running state machine");
-   }
-
-   if (!_state_machine_run (&state.machine, &result, &error)) {
-      ERREXIT_BSON (&error);
-   }
-
-   if (state.machine.trace) {
-      MONGOC_INFO ("Finished running state machine");
-   }
-
-   result_utf8 = bson_as_canonical_extended_json (&result, NULL);
-   printf ("%s\n", result_utf8);
-   bson_free (result_utf8);
-
    bson_destroy (value_doc);
    mongocrypt_binary_destroy (bin);
-   bson_destroy (&result);
-   mongocrypt_ctx_destroy (ctx);
-   mongocrypt_destroy (crypt);
-   state_cleanup (&state);
 }
 
 static void
-fn_explicitdecrypt (bson_t *args)
+init_explicitdecrypt (mongocrypt_ctx_t *ctx, bson_t *args)
 {
-   state_t state;
-   mongocrypt_t *crypt;
-   mongocrypt_ctx_t *ctx;
    const char *value;
    bson_t *value_doc;
    mongocrypt_binary_t *bin;
-   bson_t result;
    bson_error_t error;
-   char *result_utf8;
 
-   crypt = crypt_new (args);
-   ctx = mongocrypt_ctx_new (crypt);
    value = bson_req_utf8 (args, "value");
    value_doc =
       bson_new_from_json ((const uint8_t *) value, strlen (value), &error);
@@ -500,7 +423,56 @@ fn_explicitdecrypt (bson_t *args)
       ERREXIT_CTX (ctx);
    }
 
+   bson_destroy (value_doc);
+   mongocrypt_binary_destroy (bin);
+}
+
+static const struct {
+   const char *name;
+   ctx_init_fn init;
+} functions[] = {{"create_datakey", init_createdatakey},
+                 {"auto_encrypt", init_autoencrypt},
+                 {"auto_decrypt", init_autodecrypt},
+                 {"explicit_encrypt", init_explicitencrypt},
+                 {"explicit_decrypt", init_explicitdecrypt}};
+
+static ctx_init_fn
+lookup_function (const char *fn)
+{
+   size_t i;
+
+   for (i = 0; i < sizeof (functions) / sizeof (functions[0]); i++) {
+      if (0 == strcmp (fn, functions[i].name)) {
+         return functions[i].init;
+      }
+   }
+   ERREXIT ("Unknown function: %s", fn);
+   return NULL;
+}
+
+/* Run one function against the servers and print the result. If
+ * --record_file is set, the replies are appended to it for replay. */
+static void
+run_function (bson_t *args, const char *fn)
+{
+   state_t state;
+   mongocrypt_t *crypt;
+   mongocrypt_ctx_t *ctx;
+   const char *record_file;
+   bson_t steps = BSON_INITIALIZER;
+   bson_t result;
+   bson_error_t error;
+   char *result_utf8;
+
+   crypt = crypt_new (args);
+   ctx = mongocrypt_ctx_new (crypt);
+   lookup_function (fn) (ctx, args);
+
    state_init (&state, args, ctx);
+   record_file = bson_get_utf8 (args, "record_file", NULL);
+   if (record_file) {
+      state.machine.record = &steps;
+   }
 
    if (state.machine.trace) {
       MONGOC_INFO ("Running state machine");
@@ -514,18 +486,588 @@ fn_explicitdecrypt (bson_t *args)
       MONGOC_INFO ("Finished running state machine");
    }
 
+   if (0 == strcmp (fn, "create_datakey") &&
+       !mongoc_collection_insert_one (
+          state.machine.keyvault_coll, &result, NULL, NULL, &error)) {
+      ERREXIT_BSON (&error);
+   }
+
+   if (record_file) {
+      bson_t record = BSON_INITIALIZER;
+
+      BSON_APPEND_UTF8 (&record, "function", fn);
+      BSON_APPEND_DOCUMENT (&record, "args", args);
+      BSON_APPEND_ARRAY (&record, "steps", &steps);
+      util_append_json_file (record_file, &record);
+      bson_destroy (&record);
+   }
+
    result_utf8 = bson_as_canonical_extended_json (&result, NULL);
    printf ("%s\n", result_utf8);
    bson_free (result_utf8);
 
-   bson_destroy (value_doc);
-   mongocrypt_binary_destroy (bin);
+   bson_destroy (&steps);
    bson_destroy (&result);
    mongocrypt_ctx_destroy (ctx);
    mongocrypt_destroy (crypt);
    state_cleanup (&state);
 }
 
+/* A recorded operation read from a replay file. */
+typedef struct {
+   ctx_init_fn init;
+   bson_t args;
+   bson_t steps;
+} replay_op_t;
+
+typedef struct {
+   bson_t *args;
+   /* Shared by all threads. */
+   mongocrypt_t *crypt;
+   /* Set for bench. */
+   ctx_init_fn init;
+   /* Set for replay. */
+   replay_op_t *ops;
+   size_t num_ops;
+   int64_t iterations;
+} bench_t;
+
+typedef struct {
+   bench_t *bench;
+   int64_t *latencies_us;
+   size_t count;
+#ifdef BSON_OS_UNIX
+   pthread_t thread;
+#endif
+} bench_thread_t;
+
+static void
+bench_latency (bench_thread_t *thread, int64_t start_us)
+{
+   thread->latencies_us[thread->count++] =
+      bson_get_monotonic_time () - start_us;
+}
+
+static void *
+bench_thread_run (void *arg)
+{
+   bench_thread_t *thread = arg;
+   bench_t *bench = thread->bench;
+   state_t state;
+   int64_t i;
+   size_t j;
+
+   if (!bench->ops) {
+      /* Each thread needs its own clients. */
+      state_init (&state, bench->args, NULL);
+   }
+
+   for (i = 0; i < bench->iterations; i++) {
+      bson_t result;
+      bson_error_t error;
+      mongocrypt_ctx_t *ctx;
+      int64_t start_us;
+
+      if (!bench->ops) {
+         start_us = bson_get_monotonic_time ();
+         ctx = mongocrypt_ctx_new (bench->crypt);
+         bench->init (ctx, bench->args);
+         state.machine.ctx = ctx;
+         if (!_state_machine_run (&state.machine, &result, &error)) {
+            ERREXIT_BSON (&error);
+         }
+         bson_destroy (&result);
+         mongocrypt_ctx_destroy (ctx);
+         bench_latency (thread, start_us);
+         continue;
+      }
+
+      for (j = 0; j < bench->num_ops; j++) {
+         start_us = bson_get_monotonic_time ();
+         ctx = mongocrypt_ctx_new (bench->crypt);
+         bench->ops[j].init (ctx, &bench->ops[j].args);
+         if (!_replay_run (ctx, &bench->ops[j].steps, &result, &error)) {
+            ERREXIT_BSON (&error);
+         }
+         bson_destroy (&result);
+         mongocrypt_ctx_destroy (ctx);
+         bench_latency (thread, start_us);
+      }
+   }
+
+   if (!bench->ops) {
+      state_cleanup (&state);
+   }
+   return NULL;
+}
+
+static int
+cmp_int64 (const void *a, const void *b)
+{
+   int64_t x = *(const int64_t *) a;
+   int64_t y = *(const int64_t *) b;
+
+   return x < y ? -1 : x > y;
+}
+
+/* Run the operations of @bench on --concurrency threads, each doing
+ * --iterations rounds, and print the throughput and latency percentiles. */
+static void
+bench_run (bench_t *bench, const char *name)
+{
+   bench_thread_t *threads;
+   int64_t *latencies_us;
+   int64_t concurrency;
+   int64_t start_us, elapsed_us;
+   size_t ops_per_thread, total = 0;
+   int64_t i;
+
+   concurrency = atoll (bson_get_utf8 (bench->args, "concurrency", "1"));
+   /* A replay file is usually a whole workload, so replay it once. */
+   bench->iterations = atoll (
+      bson_get_utf8 (bench->args, "iterations", bench->ops ? "1" : "100"));
+   if (concurrency < 1 || bench->iterations < 1) {
+      ERREXIT ("--concurrency and --iterations must be positive");
+   }
+#ifndef BSON_OS_UNIX
+   if (concurrency > 1) {
+      ERREXIT ("--concurrency requires POSIX threads");
+   }
+#endif
+
+   bench->crypt = crypt_new (bench->args);
+   ops_per_thread =
+      (size_t) bench->iterations * (bench->ops ? bench->num_ops : 1);
+   threads = bson_malloc0 (sizeof (*threads) * concurrency);
+   start_us = bson_get_monotonic_time ();
+   for (i = 0; i < concurrency; i++) {
+      threads[i].bench = bench;
+      threads[i].latencies_us =
+         bson_malloc (sizeof (int64_t) * ops_per_thread);
+#ifdef BSON_OS_UNIX
+      if (0 != pthread_create (
+                  &threads[i].thread, NULL, bench_thread_run, &threads[i])) {
+         ERREXIT ("Could not create thread");
+      }
+#else
+      bench_thread_run (&threads[i]);
+#endif
+   }
+
+   latencies_us = bson_malloc (sizeof (int64_t) * ops_per_thread * concurrency);
+   for (i = 0; i < concurrency; i++) {
+#ifdef BSON_OS_UNIX
+      pthread_join (threads[i].thread, NULL);
+#endif
+      memcpy (latencies_us + total,
+              threads[i].latencies_us,
+              sizeof (int64_t) * threads[i].count);
+      total += threads[i].count;
+      bson_free (threads[i].latencies_us);
+   }
+   elapsed_us = bson_get_monotonic_time () - start_us;
+   qsort (latencies_us, total, sizeof (int64_t), cmp_int64);
+
+   printf ("{ \"name\": \"%s\", \"concurrency\": %" PRId64
+           ", \"operations\": %" PRIu64 ", \"opsPerSec\": %.1f, "
+           "\"p50Us\": %" PRId64 ", \"p90Us\": %" PRId64
+           ", \"p99Us\": %" PRId64 ", \"maxUs\": %" PRId64 " }\n",
+           name,
+           concurrency,
+           (uint64_t) total,
+           (double) total * 1e6 / (double) elapsed_us,
+           latencies_us[total / 2],
+           latencies_us[total * 90 / 100],
+           latencies_us[total * 99 / 100],
+           latencies_us[total - 1]);
+
+   bson_free (latencies_us);
+   bson_free (threads);
+   mongocrypt_destroy (bench->crypt);
+}
+
+static void
+fn_bench (bson_t *args)
+{
+   bench_t bench = {0};
+   const char *fn;
+
+   fn = bson_req_utf8 (args, "function");
+   bench.args = args;
+   bench.init = lookup_function (fn);
+   bench_run (&bench, fn);
+}
+
+static void
+fn_replay (bson_t *args)
+{
+   bench_t bench = {0};
+   const char *path;
+   bson_json_reader_t *reader;
+   bson_t **records = NULL;
+   bson_error_t error;
+   size_t i;
+   int r;
+
+   path = bson_req_utf8 (args, "replay_file");
+   reader = bson_json_reader_new_from_file (path, &error);
+   if (!reader) {
+      ERREXIT ("Error opening %s: %s", path, error.message);
+   }
+
+   for (;;) {
+      bson_t *record = bson_new ();
+      bson_iter_t iter;
+      replay_op_t *op;
+      const uint8_t *data;
+      uint32_t len;
+
+      r = bson_json_reader_read (reader, record, &error);
+      if (r < 0) {
+         ERREXIT ("Could not read BSON from %s: %s", path, error.message);
+      }
+      if (r == 0) {
+         bson_destroy (record);
+         break;
+      }
+
+      records =
+         bson_realloc (records, sizeof (*records) * (bench.num_ops + 1));
+      records[bench.num_ops] = record;
+      bench.ops =
+         bson_realloc (bench.ops, sizeof (*bench.ops) * (bench.num_ops + 1));
+      op = &bench.ops[bench.num_ops++];
+      op->init = lookup_function (bson_req_utf8 (record, "function"));
+
+      if (!bson_iter_init_find (&iter, record, "args") ||
+          !BSON_ITER_HOLDS_DOCUMENT (&iter)) {
+         ERREXIT ("Replay record is missing 'args'");
+      }
+      bson_iter_document (&iter, &len, &data);
+      bson_init_static (&op->args, data, len);
+
+      if (!bson_iter_init_find (&iter, record, "steps") ||
+          !BSON_ITER_HOLDS_ARRAY (&iter)) {
+         ERREXIT ("Replay record is missing 'steps'");
+      }
+      bson_iter_array (&iter, &len, &data);
+      bson_init_static (&op->steps, data, len);
+   }
+   bson_json_reader_destroy (reader);
+
+   if (bench.num_ops == 0) {
+      ERREXIT ("No records in %s", path);
+   }
+
+   bench.args = args;
+   bench_run (&bench, path);
+
+   for (i = 0; i < bench.num_ops; i++) {
+      bson_destroy (records[i]);
+   }
+   bson_free (records);
+   bson_free (bench.ops);
+}
+
+/* Shared by the threads of encrypt_file and decrypt_file. Threads take
+ * documents from reader in turn, and write them to out in the same order. */
+typedef struct {
+   bson_t *args;
+   mongocrypt_t *crypt;
+   bool encrypt;
+   /* Set for encrypt_file. */
+   const char *db;
+   const char *coll;
+   bson_t *key_docs;
+   size_t num_key_docs;
+   const char *in_path;
+   const char *out_path;
+   bson_reader_t *reader;
+   FILE *out;
+   /* Sequence numbers of the next document read and written. */
+   uint64_t next_read;
+   uint64_t next_write;
+#ifdef BSON_OS_UNIX
+   pthread_mutex_t lock;
+   pthread_cond_t written;
+#endif
+} file_job_t;
+
+static void
+file_lock (file_job_t *job)
+{
+#ifdef BSON_OS_UNIX
+   pthread_mutex_lock (&job->lock);
+#endif
+}
+
+static void
+file_unlock (file_job_t *job)
+{
+#ifdef BSON_OS_UNIX
+   pthread_mutex_unlock (&job->lock);
+#endif
+}
+
+/* Read the next document of the input file. Returns NULL at the end. */
+static bson_t *
+file_read (file_job_t *job, uint64_t *seq)
+{
+   const bson_t *doc;
+   bson_t *copy = NULL;
+   bool eof = false;
+
+   file_lock (job);
+   doc = bson_reader_read (job->reader, &eof);
+   if (doc) {
+      copy = bson_copy (doc);
+      *seq = job->next_read++;
+   } else if (!eof) {
+      ERREXIT ("Could not read BSON from %s", job->in_path);
+   }
+   file_unlock (job);
+   return copy;
+}
+
+/* Write @doc once the documents read before it are written. */
+static void
+file_write (file_job_t *job, uint64_t seq, const bson_t *doc)
+{
+   file_lock (job);
+#ifdef BSON_OS_UNIX
+   while (job->next_write != seq) {
+      pthread_cond_wait (&job->written, &job->lock);
+   }
+#endif
+   if (1 != fwrite (bson_get_data (doc), doc->len, 1, job->out)) {
+      ERREXIT ("Error writing %s", job->out_path);
+   }
+   job->next_write++;
+#ifdef BSON_OS_UNIX
+   pthread_cond_broadcast (&job->written);
+#endif
+   file_unlock (job);
+}
+
+/* Encrypt @doc as if inserted into --coll, or decrypt it. */
+static void
+file_ctx_init (file_job_t *job, mongocrypt_ctx_t *ctx, const bson_t *doc)
+{
+   mongocrypt_binary_t *bin;
+   bson_t *cmd;
+   bool ok;
+
+   if (!job->encrypt) {
+      bin = util_bson_to_bin ((bson_t *) doc);
+      ok = mongocrypt_ctx_decrypt_init (ctx, bin);
+      mongocrypt_binary_destroy (bin);
+      if (!ok) {
+         ERREXIT_CTX (ctx);
+      }
+      return;
+   }
+
+   cmd = BCON_NEW (
+      "insert", job->coll, "documents", "[", BCON_DOCUMENT (doc), "]");
+   bin = util_bson_to_bin (cmd);
+   ok = mongocrypt_ctx_encrypt_init (ctx, job->db, -1, bin);
+   mongocrypt_binary_destroy (bin);
+   bson_destroy (cmd);
+   if (!ok) {
+      ERREXIT_CTX (ctx);
+   }
+}
+
+static void *
+file_thread_run (void *arg)
+{
+   file_job_t *job = arg;
+   _state_machine_t machine = {0};
+   mongoc_client_t *mongocryptd_client = NULL;
+   bson_t *doc;
+   uint64_t seq;
+
+   if (job->encrypt) {
+      /* Markings still come from mongocryptd. Clients are per thread. */
+      mongocryptd_client = mongoc_client_new (bson_get_utf8 (
+         job->args, "mongocryptd_uri", "mongodb://localhost:27020"));
+   }
+   machine.mongocryptd_client = mongocryptd_client;
+   machine.db_name = job->db;
+   machine.key_docs = job->key_docs;
+   machine.num_key_docs = job->num_key_docs;
+   machine.trace = bson_get_bool (job->args, "trace", false);
+
+   while ((doc = file_read (job, &seq))) {
+      mongocrypt_ctx_t *ctx;
+      bson_t result;
+      bson_error_t error;
+
+      ctx = mongocrypt_ctx_new (job->crypt);
+      file_ctx_init (job, ctx, doc);
+      machine.ctx = ctx;
+      if (!_state_machine_run (&machine, &result, &error)) {
+         ERREXIT_BSON (&error);
+      }
+
+      if (job->encrypt) {
+         bson_iter_t iter;
+         bson_iter_t child;
+         const uint8_t *data;
+         uint32_t len;
+         bson_t encrypted;
+
+         if (!bson_iter_init (&iter, &result) ||
+             !bson_iter_find_descendant (&iter, "documents.0", &child) ||
+             !BSON_ITER_HOLDS_DOCUMENT (&child)) {
+            ERREXIT ("Encrypted command has no document");
+         }
+         bson_iter_document (&child, &len, &data);
+         bson_init_static (&encrypted, data, len);
+         file_write (job, seq, &encrypted);
+      } else {
+         file_write (job, seq, &result);
+      }
+
+      bson_destroy (&result);
+      mongocrypt_ctx_destroy (ctx);
+      bson_destroy (doc);
+   }
+
+   mongoc_client_destroy (mongocryptd_client);
+   return NULL;
+}
+
+/* Encrypt or decrypt every document of --in_file into --out_file on
+ * --concurrency threads sharing one mongocrypt_t. Keys come from
+ * --key_vault_file, and stay cached for the whole run by default, so each
+ * data key is decrypted by KMS once. */
+static void
+fn_process_file (bson_t *args, bool encrypt)
+{
+   file_job_t job = {0};
+#ifdef BSON_OS_UNIX
+   pthread_t *threads;
+   int64_t t;
+#endif
+   bson_error_t error;
+   int64_t concurrency;
+   int64_t start_us, elapsed_us;
+   size_t i;
+
+   concurrency = atoll (bson_get_utf8 (args, "concurrency", "1"));
+   if (concurrency < 1) {
+      ERREXIT ("--concurrency must be positive");
+   }
+#ifndef BSON_OS_UNIX
+   if (concurrency > 1) {
+      ERREXIT ("--concurrency requires POSIX threads");
+   }
+#endif
+
+   job.args = args;
+   job.encrypt = encrypt;
+   job.in_path = bson_req_utf8 (args, "in_file");
+   job.out_path = bson_req_utf8 (args, "out_file");
+   if (encrypt) {
+      job.db = bson_req_utf8 (args, "db");
+      job.coll = bson_req_utf8 (args, "coll");
+      /* There is no server to list collections from. */
+      if (!bson_has_field (args, "schema_map_file") &&
+          !bson_has_field (args, "schema_map_image_file")) {
+         ERREXIT ("encrypt_file requires --schema_map_file or "
+                  "--schema_map_image_file");
+      }
+   }
+   job.key_docs = util_read_bson_file (
+      bson_req_utf8 (args, "key_vault_file"), &job.num_key_docs);
+
+   if (!bson_has_field (args, "key_cache_ttl_ms")) {
+      /* One day. */
+      BSON_APPEND_UTF8 (args, "key_cache_ttl_ms", "86400000");
+   }
+   job.crypt = crypt_new (args);
+
+   job.reader = bson_reader_new_from_file (job.in_path, &error);
+   if (!job.reader) {
+      ERREXIT ("Error opening %s: %s", job.in_path, error.message);
+   }
+   job.out = fopen (job.out_path, "wb");
+   if (!job.out) {
+      ERREXIT ("Error opening %s", job.out_path);
+   }
+
+   start_us = bson_get_monotonic_time ();
+#ifdef BSON_OS_UNIX
+   pthread_mutex_init (&job.lock, NULL);
+   pthread_cond_init (&job.written, NULL);
+   threads = bson_malloc (sizeof (*threads) * concurrency);
+   for (t = 0; t < concurrency; t++) {
+      if (0 != pthread_create (&threads[t], NULL, file_thread_run, &job)) {
+         ERREXIT ("Could not create thread");
+      }
+   }
+   for (t = 0; t < concurrency; t++) {
+      pthread_join (threads[t], NULL);
+   }
+   bson_free (threads);
+   pthread_cond_destroy (&job.written);
+   pthread_mutex_destroy (&job.lock);
+#else
+   file_thread_run (&job);
+#endif
+   elapsed_us = bson_get_monotonic_time () - start_us;
+
+   if (0 != fclose (job.out)) {
+      ERREXIT ("Error writing %s", job.out_path);
+   }
+   printf ("{ \"documents\": %" PRIu64 ", \"docsPerSec\": %.1f }\n",
+           job.next_write,
+           (double) job.next_write * 1e6 / (double) (elapsed_us + 1));
+
+   bson_reader_destroy (job.reader);
+   mongocrypt_destroy (job.crypt);
+   for (i = 0; i < job.num_key_docs; i++) {
+      bson_destroy (&job.key_docs[i]);
+   }
+   bson_free (job.key_docs);
+}
+
+static void
+fn_build_schema_map_image (bson_t *args)
+{
+   mongocrypt_t *crypt;
+   mongocrypt_binary_t *bin, *image;
+   bson_t *schema_map;
+   const char *path;
+   FILE *file;
+
+   schema_map = bson_req_json (args, "schema_map_file");
+   path = bson_req_utf8 (args, "out_file");
+   crypt = mongocrypt_new ();
+   bin = util_bson_to_bin (schema_map);
+   image = mongocrypt_binary_new ();
+   if (!mongocrypt_build_schema_map_image (crypt, bin, image)) {
+      ERREXIT_MONGOCRYPT (crypt);
+   }
+
+   file = fopen (path, "wb");
+   if (!file || 1 != fwrite (mongocrypt_binary_data (image),
+                             mongocrypt_binary_len (image),
+                             1,
+                             file)) {
+      ERREXIT ("Error writing %s", path);
+   }
+   fclose (file);
+   printf (
+      "Wrote %" PRIu32 " bytes to %s\n", mongocrypt_binary_len (image), path);
+
+   mongocrypt_binary_destroy (image);
+   mongocrypt_binary_destroy (bin);
+   mongocrypt_destroy (crypt);
+   bson_destroy (schema_map);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -547,22 +1089,22 @@ main (int argc, char **argv)
       bson_concat (&args, options_file_bson);
    }
 
-   if (0 == strcmp (fn, "create_datakey")) {
-      fn_createdatakey (&args);
-   } else if (0 == strcmp (fn, "auto_encrypt")) {
-      fn_autoencrypt (&args);
-   } else if (0 == strcmp (fn, "auto_decrypt")) {
-      fn_autodecrypt (&args);
-   } else if (0 == strcmp (fn, "explicit_encrypt")) {
-      fn_explicitencrypt (&args);
-   } else if (0 == strcmp (fn, "explicit_decrypt")) {
-      fn_explicitdecrypt (&args);
+   if (0 == strcmp (fn, "bench")) {
+      fn_bench (&args);
+   } else if (0 == strcmp (fn, "replay")) {
+      fn_replay (&args);
+   } else if (0 == strcmp (fn, "encrypt_file")) {
+      fn_process_file (&args, true);
+   } else if (0 == strcmp (fn, "decrypt_file")) {
+      fn_process_file (&args, false);
+   } else if (0 == strcmp (fn, "build_schema_map_image")) {
+      fn_build_schema_map_image (&args);
    } else {
-      ERREXIT ("Unknown function: %s", fn);
+      run_function (&args, fn);
    }
 
    bson_destroy (&args);
    bson_destroy (options_file_bson);
 
    mongoc_cleanup ();
-}
\ No newline at end of file
+}
@@ -238,6 +238,72 @@ _bin_to_static_bson (mongocrypt_binary_t *bin, bson_t *out, bson_error_t *error)
    return true;
 }
 
+/* Start recording the replies for one state. */
+static void
+_record_begin (_state_machine_t *state_machine)
+{
+   if (!state_machine->record) {
+      return;
+   }
+   bson_init (&state_machine->record_replies);
+   state_machine->record_num_replies = 0;
+}
+
+static void
+_record_reply (_state_machine_t *state_machine, const bson_t *reply)
+{
+   char buf[16];
+   const char *key;
+
+   if (!state_machine->record) {
+      return;
+   }
+   bson_uint32_to_string (
+      state_machine->record_num_replies++, &key, buf, sizeof (buf));
+   bson_append_document (&state_machine->record_replies, key, -1, reply);
+}
+
+static void
+_record_kms_reply (_state_machine_t *state_machine,
+                   const uint8_t *data,
+                   uint32_t len)
+{
+   char buf[16];
+   const char *key;
+
+   if (!state_machine->record) {
+      return;
+   }
+   bson_uint32_to_string (
+      state_machine->record_num_replies++, &key, buf, sizeof (buf));
+   bson_append_binary (&state_machine->record_replies,
+                       key,
+                       -1,
+                       BSON_SUBTYPE_BINARY,
+                       data,
+                       len);
+}
+
+/* Append the replies recorded since _record_begin as a step for @state. */
+static void
+_record_end (_state_machine_t *state_machine, mongocrypt_ctx_state_t state)
+{
+   char buf[16];
+   const char *key;
+   bson_t step;
+
+   if (!state_machine->record) {
+      return;
+   }
+   bson_uint32_to_string (
+      state_machine->record_num_steps++, &key, buf, sizeof (buf));
+   bson_append_document_begin (state_machine->record, key, -1, &step);
+   BSON_APPEND_UTF8 (&step, "state", _state_string (state));
+   BSON_APPEND_ARRAY (&step, "replies", &state_machine->record_replies);
+   bson_append_document_end (state_machine->record, &step);
+   bson_destroy (&state_machine->record_replies);
+}
+
 /* State handler MONGOCRYPT_CTX_NEED_MONGO_COLLINFO */
 static bool
 _state_need_mongo_collinfo (_state_machine_t *state_machine,
@@ -293,6 +359,7 @@ _state_need_mongo_collinfo (_state_machine_t *state_machine,
          MONGOC_DEBUG ("<-- got result: %s", result_str);
          bson_free (result_str);
       }
+      _record_reply (state_machine, collinfo_bson);
       collinfo_bin = mongocrypt_binary_new_from_data (
          (uint8_t *) bson_get_data (collinfo_bson), collinfo_bson->len);
       if (!mongocrypt_ctx_mongo_feed (state_machine->ctx, collinfo_bin)) {
@@ -377,6 +444,8 @@ _state_need_mongo_markings (_state_machine_t *state_machine,
       bson_free (reply_str);
    }
 
+   _record_reply (state_machine, &reply);
+
    /* 2. Feed the reply back with mongocrypt_ctx_mongo_feed. */
    mongocryptd_reply_bin = mongocrypt_binary_new_from_data (
       (uint8_t *) bson_get_data (&reply), reply.len);
@@ -399,6 +468,129 @@ fail:
    return ret;
 }
 
+/* Returns true if @a and @b hold the same binary or string. */
+static bool
+_iter_value_equal (bson_iter_t *a, bson_iter_t *b)
+{
+   const bson_value_t *va = bson_iter_value (a);
+   const bson_value_t *vb = bson_iter_value (b);
+
+   if (va->value_type != vb->value_type) {
+      return false;
+   }
+   switch (va->value_type) {
+   case BSON_TYPE_BINARY:
+      return va->value.v_binary.subtype == vb->value.v_binary.subtype &&
+             va->value.v_binary.data_len == vb->value.v_binary.data_len &&
+             0 == memcmp (va->value.v_binary.data,
+                          vb->value.v_binary.data,
+                          va->value.v_binary.data_len);
+   case BSON_TYPE_UTF8:
+      return va->value.v_utf8.len == vb->value.v_utf8.len &&
+             0 == memcmp (va->value.v_utf8.str,
+                          vb->value.v_utf8.str,
+                          va->value.v_utf8.len);
+   default:
+      return false;
+   }
+}
+
+/* Returns true if @field of @key_doc is, or is an array containing, the value
+ * at @value. */
+static bool
+_key_field_has (const bson_t *key_doc, const char *field, bson_iter_t *value)
+{
+   bson_iter_t iter;
+   bson_iter_t child;
+
+   if (!bson_iter_init_find (&iter, key_doc, field)) {
+      return false;
+   }
+   if (!BSON_ITER_HOLDS_ARRAY (&iter)) {
+      return _iter_value_equal (&iter, value);
+   }
+   if (!bson_iter_recurse (&iter, &child)) {
+      return false;
+   }
+   while (bson_iter_next (&child)) {
+      if (_iter_value_equal (&child, value)) {
+         return true;
+      }
+   }
+   return false;
+}
+
+/* Returns true if @key_doc matches the filter the key broker requests:
+ * { $or: [ { _id: { $in : [ids] }}, { keyAltNames : { $in : [names] }} ] } */
+static bool
+_key_doc_matches (const bson_t *filter, const bson_t *key_doc)
+{
+   bson_iter_t or_iter;
+   bson_iter_t clause_iter;
+
+   if (!bson_iter_init_find (&or_iter, filter, "$or") ||
+       !BSON_ITER_HOLDS_ARRAY (&or_iter) ||
+       !bson_iter_recurse (&or_iter, &clause_iter)) {
+      return false;
+   }
+
+   while (bson_iter_next (&clause_iter)) {
+      bson_iter_t field_iter;
+      bson_iter_t in_iter;
+      bson_iter_t value_iter;
+      const char *field;
+
+      if (!BSON_ITER_HOLDS_DOCUMENT (&clause_iter) ||
+          !bson_iter_recurse (&clause_iter, &field_iter) ||
+          !bson_iter_next (&field_iter)) {
+         continue;
+      }
+      field = bson_iter_key (&field_iter);
+      if (!BSON_ITER_HOLDS_DOCUMENT (&field_iter) ||
+          !bson_iter_recurse (&field_iter, &in_iter) ||
+          !bson_iter_find (&in_iter, "$in") ||
+          !BSON_ITER_HOLDS_ARRAY (&in_iter) ||
+          !bson_iter_recurse (&in_iter, &value_iter)) {
+         continue;
+      }
+      while (bson_iter_next (&value_iter)) {
+         if (_key_field_has (key_doc, field, &value_iter)) {
+            return true;
+         }
+      }
+   }
+   return false;
+}
+
+/* Feed the documents of state_machine->key_docs that match @filter. */
+static bool
+_feed_key_docs (_state_machine_t *state_machine,
+                const bson_t *filter,
+                bson_error_t *error)
+{
+   size_t i;
+
+   for (i = 0; i < state_machine->num_key_docs; i++) {
+      const bson_t *key_bson = &state_machine->key_docs[i];
+      mongocrypt_binary_t *key_bin;
+      bool ok;
+
+      if (!_key_doc_matches (filter, key_bson)) {
+         continue;
+      }
+      _record_reply (state_machine, key_bson);
+      key_bin = mongocrypt_binary_new_from_data (
+         (uint8_t *) bson_get_data (key_bson), key_bson->len);
+      ok = mongocrypt_ctx_mongo_feed (state_machine->ctx, key_bin);
+      mongocrypt_binary_destroy (key_bin);
+      if (!ok) {
+         _ctx_check_error (state_machine->ctx, error, true);
+         return false;
+      }
+   }
+   return true;
+}
+
 static bool
 _state_need_mongo_keys (_state_machine_t *state_machine, bson_error_t *error)
 {
@@ -425,6 +617,13 @@ _state_need_mongo_keys (_state_machine_t *state_machine, bson_error_t *error)
       goto fail;
    }
 
+   if (state_machine->key_docs) {
+      if (!_feed_key_docs (state_machine, &filter_bson, error)) {
+         goto fail;
+      }
+      goto keys_fed;
+   }
+
    rc = mongoc_read_concern_new ();
    mongoc_read_concern_set_level (rc, MONGOC_READ_CONCERN_LEVEL_MAJORITY);
    if (!mongoc_read_concern_append (rc, &opts)) {
@@ -461,6 +660,7 @@ _state_need_mongo_keys (_state_machine_t *state_machine, bson_error_t *error)
          MONGOC_DEBUG ("<-- got result key document: %s", key_str);
          bson_free (key_str);
       }
+      _record_reply (state_machine, key_bson);
       mongocrypt_binary_destroy (key_bin);
       key_bin = mongocrypt_binary_new_from_data (
          (uint8_t *) bson_get_data (key_bson), key_bson->len);
@@ -474,6 +674,7 @@ _state_need_mongo_keys (_state_machine_t *state_machine, bson_error_t *error)
       goto fail;
    }
 
+keys_fed:
    /* 3. Call mongocrypt_ctx_mongo_done. */
    if (!mongocrypt_ctx_mongo_done (state_machine->ctx)) {
       _ctx_check_error (state_machine->ctx, error, true);
@@ -643,6 +844,8 @@ _state_need_kms (_state_machine_t *state_machine, bson_error_t *error)
    mongocrypt_binary_t *http_reply = NULL;
    const char *endpoint;
    uint32_t sockettimeout;
+   uint8_t *recorded = NULL;
+   uint32_t recorded_len = 0;
 
    sockettimeout = MONGOC_DEFAULT_SOCKETTIMEOUTMS;
    kms_ctx = mongocrypt_ctx_next_kms_ctx (state_machine->ctx);
@@ -686,6 +889,7 @@ _state_need_kms (_state_machine_t *state_machine, bson_error_t *error)
       }
 
       /* Read and feed reply. */
+      recorded_len = 0;
       while (mongocrypt_kms_ctx_bytes_needed (kms_ctx) > 0) {
 #define BUFFER_SIZE 1024
          uint8_t buf[BUFFER_SIZE];
@@ -721,6 +925,12 @@ _state_need_kms (_state_machine_t *state_machine, bson_error_t *error)
                "<-- read KMS reply: %.*s", (int) read_ret, (char *) buf);
          }
 
+         if (state_machine->record) {
+            recorded = bson_realloc (recorded, recorded_len + read_ret);
+            memcpy (recorded + recorded_len, buf, read_ret);
+            recorded_len += (uint32_t) read_ret;
+         }
+
          mongocrypt_binary_destroy (http_reply);
          http_reply = mongocrypt_binary_new_from_data (buf, read_ret);
          if (!mongocrypt_kms_ctx_feed (kms_ctx, http_reply)) {
@@ -728,6 +938,7 @@ _state_need_kms (_state_machine_t *state_machine, bson_error_t *error)
             goto fail;
          }
       }
+      _record_kms_reply (state_machine, recorded, recorded_len);
       kms_ctx = mongocrypt_ctx_next_kms_ctx (state_machine->ctx);
    }
    /* When NULL is returned by mongocrypt_ctx_next_kms_ctx, this can either be
@@ -746,6 +957,7 @@ fail:
    mongoc_stream_destroy (tls_stream);
    mongocrypt_binary_destroy (http_req);
    mongocrypt_binary_destroy (http_reply);
+   bson_free (recorded);
    return ret;
 #undef BUFFER_SIZE
 }
@@ -821,15 +1033,22 @@ _state_machine_run (_state_machine_t *state_machine,
 {
    bool ret = false;
    mongocrypt_binary_t *bin = NULL;
+   mongocrypt_ctx_state_t state;
+   bool recording = false;
 
    bson_init (result);
    while (true) {
+      state = mongocrypt_ctx_state (state_machine->ctx);
       if (state_machine->trace) {
-         MONGOC_DEBUG (
-            "Current state = %s",
-            _state_string (mongocrypt_ctx_state (state_machine->ctx)));
+         MONGOC_DEBUG ("Current state = %s", _state_string (state));
       }
-      switch (mongocrypt_ctx_state (state_machine->ctx)) {
+      if (state_machine->record &&
+          state >= MONGOCRYPT_CTX_NEED_MONGO_COLLINFO &&
+          state <= MONGOCRYPT_CTX_NEED_KMS) {
+         _record_begin (state_machine);
+         recording = true;
+      }
+      switch (state) {
       default:
       case MONGOCRYPT_CTX_ERROR:
          _ctx_check_error (state_machine->ctx, error, true);
@@ -864,6 +1083,10 @@ _state_machine_run (_state_machine_t *state_machine,
          goto success;
          break;
       }
+      if (recording) {
+         _record_end (state_machine, state);
+         recording = false;
+      }
    }
 
 success:
@@ -872,10 +1095,152 @@ fail:
    if (!ret && state_machine->trace) {
       MONGOC_DEBUG ("Error: %s", error->message);
    }
+   if (recording) {
+      bson_destroy (&state_machine->record_replies);
+   }
    mongocrypt_binary_destroy (bin);
    return ret;
 }
 
+static bool
+_replay_feed_kms (mongocrypt_ctx_t *ctx,
+                  bson_iter_t *replies,
+                  bson_error_t *error)
+{
+   mongocrypt_kms_ctx_t *kms_ctx;
+
+   while ((kms_ctx = mongocrypt_ctx_next_kms_ctx (ctx))) {
+      const uint8_t *data;
+      uint32_t len, offset = 0;
+      bson_subtype_t subtype;
+
+      if (!bson_iter_next (replies) || !BSON_ITER_HOLDS_BINARY (replies)) {
+         bson_set_error (
+            error, MONGOC_ERROR_CLIENT, 0, "replay is missing a KMS reply");
+         return false;
+      }
+      bson_iter_binary (replies, &subtype, &len, &data);
+      while (offset < len && mongocrypt_kms_ctx_bytes_needed (kms_ctx) > 0) {
+         uint32_t chunk = mongocrypt_kms_ctx_bytes_needed (kms_ctx);
+         mongocrypt_binary_t *bin;
+         bool ok;
+
+         if (chunk > len - offset) {
+            chunk = len - offset;
+         }
+         bin = mongocrypt_binary_new_from_data ((uint8_t *) data + offset,
+                                                chunk);
+         ok = mongocrypt_kms_ctx_feed (kms_ctx, bin);
+         mongocrypt_binary_destroy (bin);
+         if (!ok) {
+            return _kms_ctx_check_error (kms_ctx, error, true);
+         }
+         offset += chunk;
+      }
+   }
+   if (!_ctx_check_error (ctx, error, false)) {
+      return false;
+   }
+   if (!mongocrypt_ctx_kms_done (ctx)) {
+      return _ctx_check_error (ctx, error, true);
+   }
+   return true;
+}
+
+static bool
+_replay_feed_mongo (mongocrypt_ctx_t *ctx,
+                    bson_iter_t *replies,
+                    bson_error_t *error)
+{
+   while (bson_iter_next (replies)) {
+      const uint8_t *data;
+      uint32_t len;
+      mongocrypt_binary_t *bin;
+      bool ok;
+
+      if (!BSON_ITER_HOLDS_DOCUMENT (replies)) {
+         bson_set_error (
+            error, MONGOC_ERROR_CLIENT, 0, "replay reply is not a document");
+         return false;
+      }
+      bson_iter_document (replies, &len, &data);
+      bin = mongocrypt_binary_new_from_data ((uint8_t *) data, len);
+      ok = mongocrypt_ctx_mongo_feed (ctx, bin);
+      mongocrypt_binary_destroy (bin);
+      if (!ok) {
+         return _ctx_check_error (ctx, error, true);
+      }
+   }
+   if (!mongocrypt_ctx_mongo_done (ctx)) {
+      return _ctx_check_error (ctx, error, true);
+   }
+   return true;
+}
+
+bool
+_replay_run (mongocrypt_ctx_t *ctx,
+             const bson_t *steps,
+             bson_t *result,
+             bson_error_t *error)
+{
+   _state_machine_t state_machine = {0};
+   bson_iter_t iter, step, replies;
+   mongocrypt_ctx_state_t state;
+
+   state_machine.ctx = ctx;
+   bson_init (result);
+   bson_iter_init (&iter, steps);
+   while (true) {
+      state = mongocrypt_ctx_state (ctx);
+      switch (state) {
+      default:
+      case MONGOCRYPT_CTX_ERROR:
+         return _ctx_check_error (ctx, error, true);
+      case MONGOCRYPT_CTX_READY:
+         bson_destroy (result);
+         if (!_state_ready (&state_machine, result, error)) {
+            return false;
+         }
+         continue;
+      case MONGOCRYPT_CTX_DONE:
+         return true;
+      case MONGOCRYPT_CTX_NEED_MONGO_COLLINFO:
+      case MONGOCRYPT_CTX_NEED_MONGO_MARKINGS:
+      case MONGOCRYPT_CTX_NEED_MONGO_KEYS:
+      case MONGOCRYPT_CTX_NEED_KMS:
+         break;
+      }
+
+      if (!bson_iter_next (&iter) || !BSON_ITER_HOLDS_DOCUMENT (&iter) ||
+          !bson_iter_recurse (&iter, &step) ||
+          !bson_iter_find (&step, "state") || !BSON_ITER_HOLDS_UTF8 (&step) ||
+          0 != strcmp (bson_iter_utf8 (&step, NULL), _state_string (state))) {
+         bson_set_error (error,
+                         MONGOC_ERROR_CLIENT,
+                         0,
+                         "replay does not match state %s",
+                         _state_string (state));
+         return false;
+      }
+      bson_iter_recurse (&iter, &step);
+      if (!bson_iter_find (&step, "replies") ||
+          !BSON_ITER_HOLDS_ARRAY (&step) ||
+          !bson_iter_recurse (&step, &replies)) {
+         bson_set_error (
+            error, MONGOC_ERROR_CLIENT, 0, "replay step has no replies");
+         return false;
+      }
+
+      if (state == MONGOCRYPT_CTX_NEED_KMS) {
+         if (!_replay_feed_kms (ctx, &replies, error)) {
+            return false;
+         }
+      } else if (!_replay_feed_mongo (ctx, &replies, error)) {
+         return false;
+      }
+   }
+}
+
 bson_t *
 util_read_json_file (const char *path)
 {
@@ -896,6 +1261,48 @@ util_read_json_file (const char *path)
    return doc;
 }
 
+bson_t *
+util_read_bson_file (const char *path, size_t *num_docs)
+{
+   bson_reader_t *reader;
+   bson_error_t error;
+   const bson_t *doc;
+   bson_t *docs = NULL;
+   bool eof = false;
+
+   reader = bson_reader_new_from_file (path, &error);
+   if (!reader) {
+      ERREXIT ("Error opening %s: %s", path, error.message);
+   }
+
+   *num_docs = 0;
+   while ((doc = bson_reader_read (reader, &eof))) {
+      docs = bson_realloc (docs, sizeof (*docs) * (*num_docs + 1));
+      bson_copy_to (doc, &docs[(*num_docs)++]);
+   }
+   if (!eof) {
+      ERREXIT ("Could not read BSON from %s", path);
+   }
+   bson_reader_destroy (reader);
+   return docs;
+}
+
+void
+util_append_json_file (const char *path, const bson_t *doc)
+{
+   FILE *file;
+   char *json;
+
+   file = fopen (path, "a");
+   if (!file) {
+      ERREXIT ("Error opening %s", path);
+   }
+   json = bson_as_canonical_extended_json (doc, NULL);
+   fprintf (file, "%s\n", json);
+   bson_free (json);
+   fclose (file);
+}
+
 void
 args_parse (bson_t *args, int argc, char **argv)
 {
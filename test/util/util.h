@@ -49,6 +49,9 @@ util_getenv (const char *key);
 mongocrypt_binary_t *
 util_bson_to_bin (bson_t *bson);
 
+const char *
+_state_string (mongocrypt_ctx_state_t state);
+
 typedef struct {
    mongocrypt_ctx_t *ctx;
    mongoc_collection_t *keyvault_coll;
@@ -56,6 +59,17 @@ typedef struct {
    mongoc_client_t *collinfo_client;
    const char *db_name;
    bool trace;
+   /* Optional. If set, every reply fed to ctx is appended to this array as a
+    * step that _replay_run can feed again. */
+   bson_t *record;
+   /* Optional. If set, key requests are answered from these key documents,
+    * e.g. read from a mongodump of the key vault, instead of keyvault_coll. */
+   const bson_t *key_docs;
+   size_t num_key_docs;
+   /* Used while recording. */
+   bson_t record_replies;
+   uint32_t record_num_replies;
+   uint32_t record_num_steps;
 } _state_machine_t;
 
 bool
@@ -63,12 +77,30 @@ _state_machine_run (_state_machine_t *state_machine,
                     bson_t *result,
                     bson_error_t *error);
 
+/* Run the state machine of @ctx by feeding the steps recorded by
+ * _state_machine_t.record. No servers are contacted. Fails if @ctx does not
+ * request the same states in the same order. */
+bool
+_replay_run (mongocrypt_ctx_t *ctx,
+             const bson_t *steps,
+             bson_t *result,
+             bson_error_t *error);
+
 bson_t *
 util_bin_to_bson (mongocrypt_binary_t *bin);
 
 bson_t *
 util_read_json_file (const char *path);
 
+/* Read every document of a .bson file, such as one written by mongodump.
+ * Free each with bson_destroy and the array with bson_free. */
+bson_t *
+util_read_bson_file (const char *path, size_t *num_docs);
+
+/* Append @doc to @path as one line of canonical extended JSON. */
+void
+util_append_json_file (const char *path, const bson_t *doc);
+
 void
 args_parse (bson_t *args, int argc, char **argv);
 